@@ -28,6 +28,8 @@ dependencies = [
 	'ext/common/agents/Watchdog/HelperAgentWatcher.cpp',
 	'ext/common/agents/Watchdog/LoggingAgentWatcher.cpp',
 	'ext/common/agents/Watchdog/ServerInstanceDirToucher.cpp',
+	'ext/common/agents/Watchdog/ProcessKeeper.cpp',
+	'ext/common/agents/TreeToucher.h',
 	'ext/common/Constants.h',
 	'ext/common/ServerInstanceDir.h',
 	'ext/common/ResourceLocator.h',
@@ -58,30 +60,66 @@ helper_agent_libs = COMMON_LIBRARY.
 dependencies = [
 	'ext/common/agents/HelperAgent/Main.cpp',
 	'ext/common/agents/HelperAgent/RequestHandler.h',
+	'ext/common/Utils/HeapTrim.h',
 	'ext/common/agents/HelperAgent/RequestHandler.cpp',
 	'ext/common/agents/HelperAgent/ScgiRequestParser.h',
+	'ext/common/agents/HelperAgent/HttpRequestParser.h',
+	'ext/common/agents/HelperAgent/RequestLatencyStats.h',
+	'ext/common/agents/HelperAgent/LoopPriorities.h',
+	'ext/common/agents/HelperAgent/RateLimiter.h',
+	'ext/common/agents/HelperAgent/ResponseCache.h',
+	'ext/common/agents/HelperAgent/ResponseCompressor.h',
+	'ext/common/agents/HelperAgent/ResponseDrainer.h',
+	'ext/common/agents/HelperAgent/StaticFileCache.h',
+	'ext/common/agents/HelperAgent/Tunnel.h',
 	'ext/common/Constants.h',
 	'ext/common/StaticString.h',
 	'ext/common/Account.h',
 	'ext/common/AccountsDatabase.h',
 	'ext/common/MessageServer.h',
+	'ext/common/PooledMessageServer.h',
+	'ext/common/EventedMessageServer.h',
 	'ext/common/FileDescriptor.h',
 	'ext/common/Logging.h',
+	'ext/common/Hooks.h',
+	'ext/common/HookScriptExecutor.h',
+	'ext/common/DTraceSupport.h',
 	'ext/common/ResourceLocator.h',
+	'ext/common/UnionStation.h',
+	'ext/common/UnionStationLogBatch.h',
+	'ext/common/agents/LoggingAgent/FilterSupport.h',
 	'ext/common/Utils/ProcessMetricsCollector.h',
+	'ext/common/Utils/TimerWheel.h',
+	'ext/common/Utils/MemoryArena.h',
 	'ext/common/Utils/VariantMap.h',
+	'ext/common/Utils/MetricsRegistry.h',
+	'ext/common/Utils/SamplingProfiler.h',
+	'ext/common/Utils/FileChangeWatcher.h',
 	'ext/common/ApplicationPool2/Pool.h',
 	'ext/common/ApplicationPool2/Common.h',
 	'ext/common/ApplicationPool2/SuperGroup.h',
 	'ext/common/ApplicationPool2/Group.h',
+	'ext/common/ApplicationPool2/DemandTracker.h',
+	'ext/common/ApplicationPool2/QueueWaitTracker.h',
+	'ext/common/ApplicationPool2/SpawnScheduler.h',
+	'ext/common/ApplicationPool2/PoolSnapshot.h',
+	'ext/common/Utils/JsonWriter.h',
+	'ext/common/Utils/InlineFunction.h',
+	'ext/common/ApplicationPool2/ProcessJournal.h',
 	'ext/common/ApplicationPool2/Process.h',
+	'ext/common/ApplicationPool2/ConcurrencyTuner.h',
 	'ext/common/ApplicationPool2/Session.h',
 	'ext/common/ApplicationPool2/Options.h',
+	'ext/common/ApplicationPool2/CpuAffinity.h',
+	'ext/common/ApplicationPool2/CgroupManager.h',
 	'ext/common/ApplicationPool2/PipeWatcher.h',
+	'ext/common/ApplicationPool2/ForkExec.h',
+	'ext/common/ApplicationPool2/UserDatabaseCache.h',
 	'ext/common/ApplicationPool2/Spawner.h',
 	'ext/common/ApplicationPool2/SpawnerFactory.h',
 	'ext/common/ApplicationPool2/SmartSpawner.h',
 	'ext/common/ApplicationPool2/DirectSpawner.h',
+	'ext/common/ApplicationPool2/RemoteSpawner.h',
 	LIBBOOST_OXT,
 	helper_agent_libs.link_objects,
 	LIBEV_TARGET,
@@ -94,6 +132,7 @@ file AGENT_OUTPUT_DIR + 'PassengerHelperAgent' => dependencies do
 		"#{EXTRA_PRE_CXXFLAGS} " <<
 		"-Iext -Iext/common " <<
 		"#{AGENT_CFLAGS} #{LIBEV_CFLAGS} #{LIBEIO_CFLAGS} " <<
+		"#{PlatformInfo.zlib_flags} " <<
 		"#{EXTRA_CXXFLAGS}")
 	create_executable("#{AGENT_OUTPUT_DIR}PassengerHelperAgent",
 		"#{AGENT_OUTPUT_DIR}PassengerHelperAgent.o",
@@ -102,6 +141,7 @@ file AGENT_OUTPUT_DIR + 'PassengerHelperAgent' => dependencies do
 		"#{EXTRA_PRE_CXX_LDFLAGS} " <<
 		"#{LIBEV_LIBS} " <<
 		"#{LIBEIO_LIBS} " <<
+		"#{PlatformInfo.zlib_libs} " <<
 		"#{PlatformInfo.portability_cxx_ldflags} " <<
 		"#{AGENT_LDFLAGS} " <<
 		"#{EXTRA_CXX_LDFLAGS}")
@@ -114,8 +154,16 @@ dependencies = [
 	'ext/common/agents/LoggingAgent/AdminController.h',
 	'ext/common/agents/LoggingAgent/LoggingServer.h',
 	'ext/common/agents/LoggingAgent/RemoteSender.h',
+	'ext/common/agents/LoggingAgent/PacketSpool.h',
+	'ext/common/agents/LoggingAgent/MetricsAggregator.h',
+	'ext/common/agents/LoggingAgent/RequestStore.h',
 	'ext/common/agents/LoggingAgent/DataStoreId.h',
 	'ext/common/agents/LoggingAgent/FilterSupport.h',
+	'ext/common/UnionStationLogBatch.h',
+	'ext/common/DTraceSupport.h',
+	'ext/common/Utils/FlatStringMap.h',
+	'ext/common/Utils/HeapTrim.h',
+	'ext/common/Utils/MetricsRegistry.h',
 	'ext/common/Constants.h',
 	'ext/common/ServerInstanceDir.h',
 	'ext/common/Logging.h',
@@ -150,6 +198,48 @@ file AGENT_OUTPUT_DIR + 'PassengerLoggingAgent' => dependencies do
 		"#{EXTRA_CXX_LDFLAGS}")
 end
 
+remote_agent_libs = COMMON_LIBRARY.
+	only(:base, :other).
+	exclude('AgentsStarter.o')
+dependencies = [
+	'ext/common/agents/RemoteAgent/Main.cpp',
+	'ext/common/agents/RemoteAgent/RemoteAgentServer.h',
+	'ext/common/ApplicationPool2/Process.h',
+	'ext/common/ApplicationPool2/Options.h',
+	'ext/common/ApplicationPool2/Spawner.h',
+	'ext/common/ApplicationPool2/DirectSpawner.h',
+	'ext/common/ApplicationPool2/RemoteSpawner.h',
+	'ext/common/Constants.h',
+	'ext/common/ServerInstanceDir.h',
+	'ext/common/ResourceLocator.h',
+	'ext/common/Utils/VariantMap.h',
+	LIBBOOST_OXT,
+	remote_agent_libs.link_objects,
+	LIBEV_TARGET,
+	LIBEIO_TARGET
+].flatten.compact
+file AGENT_OUTPUT_DIR + 'PassengerRemoteAgent' => dependencies do
+	sh "mkdir -p #{AGENT_OUTPUT_DIR}" if !File.directory?(AGENT_OUTPUT_DIR)
+	compile_cxx("ext/common/agents/RemoteAgent/Main.cpp",
+		"-o #{AGENT_OUTPUT_DIR}PassengerRemoteAgent.o " <<
+		"#{EXTRA_PRE_CXXFLAGS} " <<
+		"-Iext -Iext/common " <<
+		"#{AGENT_CFLAGS} #{LIBEV_CFLAGS} #{LIBEIO_CFLAGS} " <<
+		"#{PlatformInfo.zlib_flags} " <<
+		"#{EXTRA_CXXFLAGS}")
+	create_executable("#{AGENT_OUTPUT_DIR}PassengerRemoteAgent",
+		"#{AGENT_OUTPUT_DIR}PassengerRemoteAgent.o",
+		"#{remote_agent_libs.link_objects_as_string} " <<
+		"#{LIBBOOST_OXT} " <<
+		"#{EXTRA_PRE_CXX_LDFLAGS} " <<
+		"#{LIBEV_LIBS} " <<
+		"#{LIBEIO_LIBS} " <<
+		"#{PlatformInfo.zlib_libs} " <<
+		"#{PlatformInfo.portability_cxx_ldflags} " <<
+		"#{AGENT_LDFLAGS} " <<
+		"#{EXTRA_CXX_LDFLAGS}")
+end
+
 spawn_preparer_libs = COMMON_LIBRARY.only('Utils/Base64.o')
 dependencies = [
 	'ext/common/agents/SpawnPreparer.cpp',
@@ -175,7 +265,10 @@ file AGENT_OUTPUT_DIR + 'EnvPrinter' => 'ext/common/agents/EnvPrinter.c' do
 		'ext/common/agents/EnvPrinter.c')
 end
 
-file AGENT_OUTPUT_DIR + 'TempDirToucher' => 'ext/common/agents/TempDirToucher.c' do
+file AGENT_OUTPUT_DIR + 'TempDirToucher' => [
+	'ext/common/agents/TempDirToucher.c',
+	'ext/common/agents/TreeToucher.h'
+] do
 	sh "mkdir -p #{AGENT_OUTPUT_DIR}" if !File.directory?(AGENT_OUTPUT_DIR)
 	create_c_executable(AGENT_OUTPUT_DIR + 'TempDirToucher',
 		'ext/common/agents/TempDirToucher.c')
@@ -70,7 +70,8 @@ APACHE2_MODULE_BOOST_OXT_LIBRARY = define_libboost_oxt_task("apache2",
 	APACHE2_OUTPUT_DIR + "module_libboost_oxt",
 	PlatformInfo.apache2_module_cflags)
 APACHE2_MODULE_COMMON_LIBRARIES  = COMMON_LIBRARY.
-	only(:base, 'ApplicationPool2/AppTypes.o', 'Utils/Base64.o',
+	only(:base, 'ApplicationPool2/AppTypes.o', 'ApplicationPool2/PoolStatusTable.o',
+		'Utils/Base64.o',
 		'Utils/MD5.o', 'Utils/LargeFiles.o').
 	set_namespace("apache2").
 	set_output_dir(APACHE2_OUTPUT_DIR + "module_libpassenger_common").
@@ -93,6 +94,7 @@ task :apache2 => [
 	AGENT_OUTPUT_DIR + 'PassengerHelperAgent',
 	AGENT_OUTPUT_DIR + 'PassengerWatchdog',
 	AGENT_OUTPUT_DIR + 'PassengerLoggingAgent',
+	AGENT_OUTPUT_DIR + 'PassengerRemoteAgent',
 	AGENT_OUTPUT_DIR + 'SpawnPreparer',
 	AGENT_OUTPUT_DIR + 'TempDirToucher',
 	NATIVE_SUPPORT_TARGET
@@ -171,6 +171,8 @@ EXTRA_CXXFLAGS << " " << compiler_flag_option('EXTRA_CXXFLAGS') if !compiler_fla
 [EXTRA_CFLAGS, EXTRA_CXXFLAGS].each do |flags|
 	flags << " -fno-omit-frame-pointers" if USE_ASAN
 	flags << " -DPASSENGER_DISABLE_THREAD_LOCAL_STORAGE" if !boolean_option('PASSENGER_THREAD_LOCAL_STORAGE', true)
+	flags << " -DOXT_SAMPLED_BACKTRACES" if boolean_option("SAMPLED_BACKTRACES")
+	flags << " -DPASSENGER_USE_DTRACE" if boolean_option("USE_DTRACE")
 end
 
 # Extra linker flags that should always be passed to the linker.
@@ -55,36 +55,88 @@ TEST_CXX_OBJECTS = {
 		test/cxx/ApplicationPool2/DirectSpawnerTest.cpp
 		test/cxx/ApplicationPool2/SpawnerTestCases.cpp
 		ext/common/ApplicationPool2/Options.h
+		ext/common/ApplicationPool2/CpuAffinity.h
+		ext/common/ApplicationPool2/CgroupManager.h
 		ext/common/ApplicationPool2/Process.h
 		ext/common/ApplicationPool2/Socket.h
+		ext/common/ApplicationPool2/ForkExec.h
 		ext/common/ApplicationPool2/Spawner.h
 		ext/common/ApplicationPool2/DirectSpawner.h),
 	'test/cxx/ApplicationPool2/SmartSpawnerTest.o' => %w(
 		test/cxx/ApplicationPool2/SmartSpawnerTest.cpp
 		test/cxx/ApplicationPool2/SpawnerTestCases.cpp
 		ext/common/ApplicationPool2/Options.h
+		ext/common/ApplicationPool2/CpuAffinity.h
+		ext/common/ApplicationPool2/CgroupManager.h
 		ext/common/ApplicationPool2/Process.h
 		ext/common/ApplicationPool2/Socket.h
+		ext/common/ApplicationPool2/ForkExec.h
 		ext/common/ApplicationPool2/Spawner.h
 		ext/common/ApplicationPool2/SmartSpawner.h),
+	'test/cxx/ApplicationPool2/RemoteSpawnerTest.o' => %w(
+		test/cxx/ApplicationPool2/RemoteSpawnerTest.cpp
+		ext/common/ApplicationPool2/Options.h
+		ext/common/ApplicationPool2/Process.h
+		ext/common/ApplicationPool2/Socket.h
+		ext/common/ApplicationPool2/Spawner.h
+		ext/common/ApplicationPool2/DirectSpawner.h
+		ext/common/ApplicationPool2/RemoteSpawner.h
+		ext/common/agents/RemoteAgent/RemoteAgentServer.h),
 	'test/cxx/ApplicationPool2/ProcessTest.o' => %w(
 		test/cxx/ApplicationPool2/ProcessTest.cpp
 		ext/common/ApplicationPool2/Process.h
+		ext/common/ApplicationPool2/ConcurrencyTuner.h
 		ext/common/ApplicationPool2/Socket.h
 		ext/common/ApplicationPool2/Session.h),
+	'test/cxx/ApplicationPool2/DemandTrackerTest.o' => %w(
+		test/cxx/ApplicationPool2/DemandTrackerTest.cpp
+		ext/common/ApplicationPool2/DemandTracker.h),
+	'test/cxx/ApplicationPool2/QueueWaitTrackerTest.o' => %w(
+		test/cxx/ApplicationPool2/QueueWaitTrackerTest.cpp
+		ext/common/ApplicationPool2/QueueWaitTracker.h),
+	'test/cxx/ApplicationPool2/SpawnSchedulerTest.o' => %w(
+		test/cxx/ApplicationPool2/SpawnSchedulerTest.cpp
+		ext/common/ApplicationPool2/SpawnScheduler.h),
+	'test/cxx/ApplicationPool2/ForkExecTest.o' => %w(
+		test/cxx/ApplicationPool2/ForkExecTest.cpp
+		ext/common/ApplicationPool2/ForkExec.h),
+	'test/cxx/ApplicationPool2/UserDatabaseCacheTest.o' => %w(
+		test/cxx/ApplicationPool2/UserDatabaseCacheTest.cpp
+		ext/common/ApplicationPool2/UserDatabaseCache.h),
+	'test/cxx/ApplicationPool2/CpuAffinityTest.o' => %w(
+		test/cxx/ApplicationPool2/CpuAffinityTest.cpp
+		ext/common/ApplicationPool2/CpuAffinity.h),
+	'test/cxx/ApplicationPool2/CgroupManagerTest.o' => %w(
+		test/cxx/ApplicationPool2/CgroupManagerTest.cpp
+		ext/common/ApplicationPool2/CgroupManager.h),
+	'test/cxx/ApplicationPool2/ConcurrencyTunerTest.o' => %w(
+		test/cxx/ApplicationPool2/ConcurrencyTunerTest.cpp
+		ext/common/ApplicationPool2/ConcurrencyTuner.h),
 	'test/cxx/ApplicationPool2/PoolTest.o' => %w(
 		test/cxx/ApplicationPool2/PoolTest.cpp
 		ext/common/ApplicationPool2/SuperGroup.h
 		ext/common/ApplicationPool2/Group.h
+		ext/common/ApplicationPool2/DemandTracker.h
+		ext/common/ApplicationPool2/QueueWaitTracker.h
+		ext/common/ApplicationPool2/SpawnScheduler.h
+		ext/common/ApplicationPool2/PoolSnapshot.h
+		ext/common/Utils/JsonWriter.h
+		ext/common/Utils/InlineFunction.h
+		ext/common/ApplicationPool2/ProcessJournal.h
 		ext/common/ApplicationPool2/Pool.h
 		ext/common/ApplicationPool2/Process.h
+		ext/common/ApplicationPool2/ConcurrencyTuner.h
 		ext/common/ApplicationPool2/Socket.h
 		ext/common/ApplicationPool2/Options.h
+		ext/common/ApplicationPool2/CpuAffinity.h
+		ext/common/ApplicationPool2/CgroupManager.h
 		ext/common/ApplicationPool2/Spawner.h
 		ext/common/ApplicationPool2/SpawnerFactory.h
 		ext/common/ApplicationPool2/SmartSpawner.h
 		ext/common/ApplicationPool2/DirectSpawner.h
-		ext/common/ApplicationPool2/DummySpawner.h),
+		ext/common/ApplicationPool2/DummySpawner.h
+		ext/common/Utils/FileChangeWatcher.h
+		ext/common/HookScriptExecutor.h),
 	'test/cxx/MessageReadersWritersTest.o' => %w(
 		test/cxx/MessageReadersWritersTest.cpp
 		ext/common/MessageReadersWriters.h
@@ -102,20 +154,31 @@ TEST_CXX_OBJECTS = {
 		test/cxx/ScgiRequestParserTest.cpp
 		ext/common/agents/HelperAgent/ScgiRequestParser.h
 		ext/common/StaticString.h),
+	'test/cxx/HttpRequestParserTest.o' => %w(
+		test/cxx/HttpRequestParserTest.cpp
+		ext/common/agents/HelperAgent/HttpRequestParser.h
+		ext/common/agents/HelperAgent/ScgiRequestParser.h
+		ext/common/StaticString.h),
 	'test/cxx/DechunkerTest.o' => %w(
 		test/cxx/DechunkerTest.cpp
 		ext/common/Utils/Dechunker.h),
 	'test/cxx/HttpHeaderBuffererTest.o' => %w(
 		test/cxx/HttpHeaderBuffererTest.cpp
 		ext/common/Utils/HttpHeaderBufferer.h
-		ext/common/Utils/StreamBoyerMooreHorspool.h),
+		ext/common/Utils/CharScanner.h),
 	'test/cxx/UnionStationTest.o' => %w(
 		test/cxx/UnionStationTest.cpp
 		ext/common/agents/LoggingAgent/LoggingServer.h
+		ext/common/Utils/HeapTrim.h
 		ext/common/agents/LoggingAgent/RemoteSender.h
+		ext/common/agents/LoggingAgent/PacketSpool.h
+		ext/common/agents/LoggingAgent/MetricsAggregator.h
+		ext/common/agents/LoggingAgent/RequestStore.h
 		ext/common/agents/LoggingAgent/DataStoreId.h
 		ext/common/agents/LoggingAgent/FilterSupport.h
 		ext/common/UnionStation.h
+		ext/common/UnionStationLogBatch.h
+		ext/common/Utils/FlatStringMap.h
 		ext/common/Utils.h
 		ext/common/EventedServer.h
 		ext/common/EventedClient.h
@@ -134,6 +197,13 @@ TEST_CXX_OBJECTS = {
 		ext/common/Account.h
 		ext/common/AccountsDatabase.h
 		ext/common/MessageServer.h),
+	'test/cxx/PooledMessageServerTest.o' => %w(
+		test/cxx/PooledMessageServerTest.cpp
+		ext/common/PooledMessageServer.h
+		ext/common/MessageServer.h
+		ext/common/EventedMessageServer.h
+		ext/common/EventedServer.h
+		ext/common/SafeLibev.h),
 	'test/cxx/ServerInstanceDir.o' => %w(
 		test/cxx/ServerInstanceDirTest.cpp
 		ext/common/ServerInstanceDir.h
@@ -142,14 +212,38 @@ TEST_CXX_OBJECTS = {
 		test/cxx/RequestHandlerTest.cpp
 		ext/common/agents/HelperAgent/RequestHandler.h
 		ext/common/agents/HelperAgent/FileBackedPipe.h
+		ext/common/agents/HelperAgent/RequestLatencyStats.h
+		ext/common/agents/HelperAgent/LoopPriorities.h
+		ext/common/agents/HelperAgent/RateLimiter.h
+		ext/common/agents/HelperAgent/ResponseCache.h
+		ext/common/agents/HelperAgent/ResponseCompressor.h
+		ext/common/agents/HelperAgent/ResponseDrainer.h
 		ext/common/agents/HelperAgent/ScgiRequestParser.h
+		ext/common/agents/HelperAgent/HttpRequestParser.h
+		ext/common/agents/HelperAgent/StaticFileCache.h
+		ext/common/agents/HelperAgent/Tunnel.h
 		ext/common/agents/HelperAgent/AgentOptions.h
+		ext/common/Utils/TimerWheel.h
+		ext/common/Utils/HeapTrim.h
+		ext/common/Utils/MemoryArena.h
 		ext/common/UnionStation.h
+		ext/common/UnionStationLogBatch.h
+		ext/common/agents/LoggingAgent/FilterSupport.h
 		ext/common/ApplicationPool2/Pool.h
 		ext/common/ApplicationPool2/SuperGroup.h
 		ext/common/ApplicationPool2/Group.h
+		ext/common/ApplicationPool2/DemandTracker.h
+		ext/common/ApplicationPool2/QueueWaitTracker.h
+		ext/common/ApplicationPool2/SpawnScheduler.h
+		ext/common/ApplicationPool2/PoolSnapshot.h
+		ext/common/Utils/JsonWriter.h
+		ext/common/Utils/InlineFunction.h
+		ext/common/ApplicationPool2/ProcessJournal.h
 		ext/common/ApplicationPool2/Process.h
+		ext/common/ApplicationPool2/ConcurrencyTuner.h
 		ext/common/ApplicationPool2/Options.h
+		ext/common/ApplicationPool2/CpuAffinity.h
+		ext/common/ApplicationPool2/CgroupManager.h
 		ext/common/ApplicationPool2/Spawner.h
 		ext/common/ApplicationPool2/SpawnerFactory.h
 		ext/common/ApplicationPool2/SmartSpawner.h
@@ -158,10 +252,73 @@ TEST_CXX_OBJECTS = {
 	'test/cxx/FileBackedPipeTest.o' => %w(
 		test/cxx/FileBackedPipeTest.cpp
 		ext/common/agents/HelperAgent/FileBackedPipe.h),
+	'test/cxx/MultiLibeioTest.o' => %w(
+		test/cxx/MultiLibeioTest.cpp
+		ext/common/MultiLibeio.h
+		ext/common/MultiLibeio.cpp
+		ext/common/BackgroundEventLoop.h),
+	'test/cxx/PoolStatusTableTest.o' => %w(
+		test/cxx/PoolStatusTableTest.cpp
+		ext/common/ApplicationPool2/PoolStatusTable.h),
+	'test/cxx/PriorityQueueTest.o' => %w(
+		test/cxx/PriorityQueueTest.cpp
+		ext/common/Utils/PriorityQueue.h),
+	'test/cxx/RequestLatencyStatsTest.o' => %w(
+		test/cxx/RequestLatencyStatsTest.cpp
+		ext/common/agents/HelperAgent/RequestLatencyStats.h),
+	'test/cxx/MetricsRegistryTest.o' => %w(
+		test/cxx/MetricsRegistryTest.cpp
+		ext/common/Utils/MetricsRegistry.h),
+	'test/cxx/SamplingProfilerTest.o' => %w(
+		test/cxx/SamplingProfilerTest.cpp
+		ext/common/Utils/SamplingProfiler.h),
+	'test/cxx/SafeLibevTest.o' => %w(
+		test/cxx/SafeLibevTest.cpp
+		ext/common/SafeLibev.h
+		ext/common/BackgroundEventLoop.h),
+	'test/cxx/TimerWheelTest.o' => %w(
+		test/cxx/TimerWheelTest.cpp
+		ext/common/Utils/TimerWheel.h),
+	'test/cxx/RateLimiterTest.o' => %w(
+		test/cxx/RateLimiterTest.cpp
+		ext/common/agents/HelperAgent/RateLimiter.h),
+	'test/cxx/MemoryArenaTest.o' => %w(
+		test/cxx/MemoryArenaTest.cpp
+		ext/common/Utils/MemoryArena.h),
+	'test/cxx/JsonWriterTest.o' => %w(
+		test/cxx/JsonWriterTest.cpp
+		ext/common/Utils/JsonWriter.h),
+	'test/cxx/HeapTrimTest.o' => %w(
+		test/cxx/HeapTrimTest.cpp
+		ext/common/Utils/HeapTrim.h),
+	'test/cxx/InlineFunctionTest.o' => %w(
+		test/cxx/InlineFunctionTest.cpp
+		ext/common/Utils/InlineFunction.h),
+	'test/cxx/ResponseCompressorTest.o' => %w(
+		test/cxx/ResponseCompressorTest.cpp
+		ext/common/agents/HelperAgent/ResponseCompressor.h),
+	'test/cxx/CharScannerTest.o' => %w(
+		test/cxx/CharScannerTest.cpp
+		ext/common/Utils/CharScanner.h),
+	'test/cxx/ResponseCacheTest.o' => %w(
+		test/cxx/ResponseCacheTest.cpp
+		ext/common/agents/HelperAgent/ResponseCache.h
+		ext/common/Utils/StringMap.h),
+	'test/cxx/StaticFileCacheTest.o' => %w(
+		test/cxx/StaticFileCacheTest.cpp
+		ext/common/agents/HelperAgent/StaticFileCache.h
+		ext/common/Utils/StringMap.h),
 	'test/cxx/FileChangeCheckerTest.o' => %w(
 		test/cxx/FileChangeCheckerTest.cpp
 		ext/common/Utils/FileChangeChecker.h
 		ext/common/Utils/CachedFileStat.hpp),
+	'test/cxx/FileChangeWatcherTest.o' => %w(
+		test/cxx/FileChangeWatcherTest.cpp
+		ext/common/Utils/FileChangeWatcher.h),
+	'test/cxx/HookScriptExecutorTest.o' => %w(
+		test/cxx/HookScriptExecutorTest.cpp
+		ext/common/HookScriptExecutor.h
+		ext/common/Hooks.h),
 	'test/cxx/FileDescriptorTest.o' => %w(
 		test/cxx/FileDescriptorTest.cpp
 		ext/common/FileDescriptor.h),
@@ -172,9 +329,25 @@ TEST_CXX_OBJECTS = {
 	'test/cxx/FilterSupportTest.o' => %w(
 		test/cxx/FilterSupportTest.cpp
 		ext/common/agents/LoggingAgent/FilterSupport.h),
+	'test/cxx/LoggingTest.o' => %w(
+		test/cxx/LoggingTest.cpp
+		ext/common/Logging.h),
+	'test/cxx/PacketSpoolTest.o' => %w(
+		test/cxx/PacketSpoolTest.cpp
+		ext/common/agents/LoggingAgent/PacketSpool.h),
+	'test/cxx/MetricsAggregatorTest.o' => %w(
+		test/cxx/MetricsAggregatorTest.cpp
+		ext/common/agents/LoggingAgent/MetricsAggregator.h),
+	'test/cxx/RequestStoreTest.o' => %w(
+		test/cxx/RequestStoreTest.cpp
+		ext/common/agents/LoggingAgent/RequestStore.h
+		ext/common/agents/LoggingAgent/FilterSupport.h
+		ext/common/agents/LoggingAgent/MetricsAggregator.h),
 	'test/cxx/CachedFileStatTest.o' => %w(
 		test/cxx/CachedFileStatTest.cpp
 		ext/common/Utils/CachedFileStat.hpp
+		ext/common/Utils/ShardedCachedFileStat.hpp
+		ext/common/Utils/FlatStringMap.h
 		ext/common/Utils/CachedFileStat.cpp),
 	'test/cxx/BufferedIOTest.o' => %w(
 		test/cxx/BufferedIOTest.cpp
@@ -183,13 +356,17 @@ TEST_CXX_OBJECTS = {
 	'test/cxx/MessageIOTest.o' => %w(
 		test/cxx/MessageIOTest.cpp
 		ext/common/Utils/MessageIO.h
-		ext/common/Utils/IOUtils.h),
+		ext/common/Utils/IOUtils.h
+		ext/common/Utils/SmallVector.h),
 	'test/cxx/MessagePassingTest.o' => %w(
 		test/cxx/MessagePassingTest.cpp
 		ext/common/Utils/MessagePassing.h),
 	'test/cxx/VariantMapTest.o' => %w(
 		test/cxx/VariantMapTest.cpp
 		ext/common/Utils/VariantMap.h),
+	'test/cxx/FlatStringMapTest.o' => %w(
+		test/cxx/FlatStringMapTest.cpp
+		ext/common/Utils/FlatStringMap.h),
 	'test/cxx/StringMapTest.o' => %w(
 		test/cxx/StringMapTest.cpp
 		ext/common/Utils/StringMap.h
@@ -203,6 +380,13 @@ TEST_CXX_OBJECTS = {
 	'test/cxx/IOUtilsTest.o' => %w(
 		test/cxx/IOUtilsTest.cpp
 		ext/common/Utils/IOUtils.h),
+	'test/cxx/ShmRingTest.o' => %w(
+		test/cxx/ShmRingTest.cpp
+		ext/common/ShmRing.h
+		ext/common/Utils/IOUtils.h),
+	'test/cxx/RandomGeneratorTest.o' => %w(
+		test/cxx/RandomGeneratorTest.cpp
+		ext/common/RandomGenerator.h),
 	'test/cxx/TemplateTest.o' => %w(
 		test/cxx/TemplateTest.cpp
 		ext/common/Utils/Template.h)
@@ -252,6 +436,207 @@ file 'test/cxx/CxxTestMain' => dependencies.flatten do
 	create_executable("test/cxx/CxxTestMain", objects, TEST_CXX_LDFLAGS)
 end
 
+dependencies = [
+	'test/cxx/LoadTest.cpp',
+	'ext/common/AgentsStarter.h',
+	'ext/common/Utils/ProcessMetricsCollector.h',
+	'ext/common/Utils/IOUtils.h',
+	TEST_BOOST_OXT_LIBRARY,
+	TEST_COMMON_LIBRARY.link_objects
+].flatten.compact
+file 'test/cxx/LoadTest' => dependencies do
+	compile_cxx 'test/cxx/LoadTest.cpp',
+		"-o test/cxx/LoadTest.o -O2 #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/LoadTest',
+		'test/cxx/LoadTest.o', TEST_CXX_LDFLAGS
+end
+
+dependencies = [
+	'test/cxx/LoadTest',
+	NATIVE_SUPPORT_TARGET,
+	AGENT_OUTPUT_DIR + 'PassengerWatchdog',
+	AGENT_OUTPUT_DIR + 'PassengerHelperAgent',
+	AGENT_OUTPUT_DIR + 'PassengerLoggingAgent',
+	AGENT_OUTPUT_DIR + 'SpawnPreparer'
+].compact
+desc "Run an end-to-end load test against the agents and a stub app. Pass options with ARGS=\"--name value ...\", e.g. ARGS=\"--scenario large_uploads --rate 50\""
+task 'test:load' => dependencies do
+	sh "cd test && ./cxx/LoadTest #{ENV['ARGS']}".strip
+end
+
+dependencies = [
+	'test/cxx/LoggingAgentBenchmark.cpp',
+	'ext/common/agents/LoggingAgent/LoggingServer.h',
+	'ext/common/Utils/HeapTrim.h',
+	'ext/common/agents/LoggingAgent/RemoteSender.h',
+	'ext/common/agents/LoggingAgent/PacketSpool.h',
+	'ext/common/agents/LoggingAgent/MetricsAggregator.h',
+	'ext/common/agents/LoggingAgent/RequestStore.h',
+	'ext/common/agents/LoggingAgent/DataStoreId.h',
+	'ext/common/agents/LoggingAgent/FilterSupport.h',
+	'ext/common/UnionStation.h',
+	'ext/common/UnionStationLogBatch.h',
+	LIBEV_TARGET,
+	LIBEIO_TARGET,
+	TEST_BOOST_OXT_LIBRARY,
+	TEST_COMMON_LIBRARY.link_objects
+].flatten.compact
+file 'test/cxx/LoggingAgentBenchmark' => dependencies do
+	compile_cxx 'test/cxx/LoggingAgentBenchmark.cpp',
+		"-o test/cxx/LoggingAgentBenchmark.o #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/LoggingAgentBenchmark',
+		'test/cxx/LoggingAgentBenchmark.o', TEST_CXX_LDFLAGS
+end
+
+desc "Benchmark the logging agent's throughput. Pass options with ARGS=\"--name value ...\""
+task 'benchmark:logging_agent' => 'test/cxx/LoggingAgentBenchmark' do
+	sh "test/cxx/LoggingAgentBenchmark #{ENV['ARGS']}".strip
+end
+
+dependencies = [
+	'test/cxx/StaticStringHashBenchmark.cpp',
+	'ext/common/StaticString.h',
+	'ext/common/Utils/HashMap.h'
+]
+file 'test/cxx/StaticStringHashBenchmark' => dependencies do
+	create_executable 'test/cxx/StaticStringHashBenchmark',
+		'test/cxx/StaticStringHashBenchmark.cpp',
+		"-O2 #{TEST_CXX_CFLAGS} #{EXTRA_CXX_LDFLAGS}"
+end
+
+dependencies = [
+	'test/cxx/StringMapBenchmark.cpp',
+	'ext/common/StaticString.h',
+	'ext/common/Utils/StringMap.h',
+	'ext/common/Utils/FlatStringMap.h',
+	'ext/common/Utils/HashMap.h'
+]
+file 'test/cxx/StringMapBenchmark' => dependencies do
+	create_executable 'test/cxx/StringMapBenchmark',
+		'test/cxx/StringMapBenchmark.cpp',
+		"-O2 #{TEST_CXX_CFLAGS} #{EXTRA_CXX_LDFLAGS}"
+end
+
+dependencies = [
+	'test/cxx/CachedFileStatBenchmark.cpp',
+	'ext/common/Utils/CachedFileStat.hpp',
+	'ext/common/Utils/ShardedCachedFileStat.hpp',
+	'ext/common/Utils/FlatStringMap.h',
+	TEST_BOOST_OXT_LIBRARY,
+	TEST_COMMON_LIBRARY.link_objects
+].flatten.compact
+file 'test/cxx/CachedFileStatBenchmark' => dependencies do
+	compile_cxx 'test/cxx/CachedFileStatBenchmark.cpp',
+		"-o test/cxx/CachedFileStatBenchmark.o -O2 #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/CachedFileStatBenchmark',
+		'test/cxx/CachedFileStatBenchmark.o', TEST_CXX_LDFLAGS
+end
+
+dependencies = [
+	'test/cxx/SyscallBenchmark.cpp',
+	'ext/oxt/system_calls.hpp',
+	TEST_BOOST_OXT_LIBRARY
+].flatten.compact
+file 'test/cxx/SyscallBenchmark' => dependencies do
+	compile_cxx 'test/cxx/SyscallBenchmark.cpp',
+		"-o test/cxx/SyscallBenchmark.o -O2 #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/SyscallBenchmark',
+		'test/cxx/SyscallBenchmark.o', TEST_CXX_LDFLAGS
+end
+
+dependencies = [
+	'test/cxx/HotPathBenchmark.cpp',
+	'ext/common/BackgroundEventLoop.cpp',
+	'ext/common/MultiLibeio.cpp',
+	'ext/common/agents/HelperAgent/ScgiRequestParser.h',
+	'ext/common/agents/HelperAgent/FileBackedPipe.h',
+	'ext/common/Utils/CachedFileStat.hpp',
+	'ext/common/Utils/Dechunker.h',
+	'ext/common/Utils/HttpHeaderBufferer.h',
+	'ext/common/Utils/MessageIO.h',
+	'ext/common/Utils/StringMap.h',
+	'ext/common/ApplicationPool2/Pool.h',
+	'ext/common/ApplicationPool2/DummySpawner.h',
+	LIBEV_TARGET,
+	LIBEIO_TARGET,
+	TEST_BOOST_OXT_LIBRARY,
+	TEST_COMMON_LIBRARY.link_objects
+].flatten.compact
+file 'test/cxx/HotPathBenchmark' => dependencies do
+	compile_cxx 'test/cxx/HotPathBenchmark.cpp',
+		"-o test/cxx/HotPathBenchmark.o -O2 #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/HotPathBenchmark',
+		'test/cxx/HotPathBenchmark.o', TEST_CXX_LDFLAGS
+end
+
+dependencies = [
+	'test/cxx/PoolSimulator.cpp',
+	'ext/common/BackgroundEventLoop.cpp',
+	'ext/common/ApplicationPool2/Pool.h',
+	'ext/common/ApplicationPool2/Group.h',
+	'ext/common/ApplicationPool2/DummySpawner.h',
+	'ext/common/agents/LoggingAgent/MetricsAggregator.h',
+	'ext/common/Utils/SystemTime.h',
+	LIBEV_TARGET,
+	LIBEIO_TARGET,
+	TEST_BOOST_OXT_LIBRARY,
+	TEST_COMMON_LIBRARY.link_objects
+].flatten.compact
+file 'test/cxx/PoolSimulator' => dependencies do
+	compile_cxx 'test/cxx/PoolSimulator.cpp',
+		"-o test/cxx/PoolSimulator.o -O2 #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/PoolSimulator',
+		'test/cxx/PoolSimulator.o', TEST_CXX_LDFLAGS
+end
+
+desc "Replay a request trace against the application pool with simulated processes and a virtual clock. Pass options with ARGS=\"--name value ...\", e.g. ARGS=\"--trace requests.txt --max 20\""
+task 'test:pool_simulator' => 'test/cxx/PoolSimulator' do
+	sh "test/cxx/PoolSimulator #{ENV['ARGS']}".strip
+end
+
+dependencies = [
+	'test/cxx/PriorityQueueBenchmark.cpp',
+	'ext/common/Utils/PriorityQueue.h',
+	'ext/common/Utils/fib.h',
+	TEST_COMMON_LIBRARY.link_objects
+].flatten.compact
+file 'test/cxx/PriorityQueueBenchmark' => dependencies do
+	compile_cxx 'test/cxx/PriorityQueueBenchmark.cpp',
+		"-o test/cxx/PriorityQueueBenchmark.o -O2 #{TEST_CXX_CFLAGS}"
+	create_executable 'test/cxx/PriorityQueueBenchmark',
+		'test/cxx/PriorityQueueBenchmark.o', TEST_CXX_LDFLAGS
+end
+
+desc "Benchmark PriorityQueue against a Fibonacci heap on the session open/close path"
+task 'benchmark:priority_queue' => 'test/cxx/PriorityQueueBenchmark' do
+	sh "test/cxx/PriorityQueueBenchmark"
+end
+
+desc "Benchmark FlatStringMap against StringMap"
+task 'benchmark:string_map' => 'test/cxx/StringMapBenchmark' do
+	sh "test/cxx/StringMapBenchmark"
+end
+
+desc "Benchmark StaticString::Hash"
+task 'benchmark:static_string_hash' => 'test/cxx/StaticStringHashBenchmark' do
+	sh "test/cxx/StaticStringHashBenchmark"
+end
+
+desc "Benchmark CachedFileStat and ShardedCachedFileStat with many threads. Pass the number of threads with ARGS"
+task 'benchmark:cached_file_stat' => 'test/cxx/CachedFileStatBenchmark' do
+	sh "test/cxx/CachedFileStatBenchmark #{ENV['ARGS']}".strip
+end
+
+desc "Benchmark the overhead of the oxt::syscalls wrappers. Pass the number of iterations with ARGS"
+task 'benchmark:syscalls' => 'test/cxx/SyscallBenchmark' do
+	sh "test/cxx/SyscallBenchmark #{ENV['ARGS']}".strip
+end
+
+desc "Run the micro-benchmarks for the request hot path. Pass options with ARGS=\"--name value ...\", e.g. ARGS=\"--json results.json\""
+task 'benchmark:hot_path' => 'test/cxx/HotPathBenchmark' do
+	sh "cd test && ./cxx/HotPathBenchmark #{ENV['ARGS']}".strip
+end
+
 deps = [
 	'test/cxx/TestSupport.h',
 	'test/tut/tut.h',
@@ -40,6 +40,7 @@ task :nginx_without_native_support => [
 	AGENT_OUTPUT_DIR + 'PassengerHelperAgent',
 	AGENT_OUTPUT_DIR + 'PassengerWatchdog',
 	AGENT_OUTPUT_DIR + 'PassengerLoggingAgent',
+	AGENT_OUTPUT_DIR + 'PassengerRemoteAgent',
 	AGENT_OUTPUT_DIR + 'SpawnPreparer',
 	AGENT_OUTPUT_DIR + 'TempDirToucher',
 	COMMON_LIBRARY.only(*NGINX_LIBS_SELECTOR).link_objects
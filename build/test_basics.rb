@@ -31,7 +31,7 @@ task :test => ['test:oxt', 'test:cxx', 'test:ruby', 'test:node', 'test:integrati
 
 desc "Clean all compiled test files"
 task 'test:clean' do
-	sh("rm -rf test/oxt/oxt_test_main test/oxt/*.o test/cxx/*.dSYM test/cxx/CxxTestMain")
+	sh("rm -rf test/oxt/oxt_test_main test/oxt/*.o test/cxx/*.dSYM test/cxx/CxxTestMain test/cxx/LoggingAgentBenchmark test/cxx/StaticStringHashBenchmark test/cxx/StringMapBenchmark test/cxx/CachedFileStatBenchmark")
 	sh("rm -f test/cxx/*.o test/cxx/*/*.o test/cxx/*.gch")
 	sh("rm -f test/support/allocate_memory")
 end
@@ -24,10 +24,17 @@
  */
 
 #include <boost/make_shared.hpp>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
 #include "Bucket.h"
 
 namespace Passenger {
 
+/** Upper bound for PassengerBucketState::readSize. */
+static const apr_size_t MAX_READ_SIZE = 128 * 1024;
+
 static void bucket_destroy(void *data);
 static apr_status_t bucket_read(apr_bucket *a, const char **str, apr_size_t *len, apr_read_type_e block);
 
@@ -56,9 +63,186 @@ bucket_destroy(void *data) {
 	}
 }
 
+/**
+ * Looks for the end of the response header in the given data. Returns the
+ * number of bytes that belong to the header.
+ */
+static apr_size_t
+scan_header_end(PassengerBucketState *state, const char *data, apr_size_t size) {
+	static const char terminator[] = "\r\n\r\n";
+	apr_size_t i;
+	
+	for (i = 0; i < size; i++) {
+		if (data[i] == terminator[state->headerEndMatched]) {
+			state->headerEndMatched++;
+		} else if (data[i] == '\r') {
+			state->headerEndMatched = 1;
+		} else {
+			state->headerEndMatched = 0;
+		}
+		if (state->headerEndMatched == sizeof(terminator) - 1) {
+			state->headerComplete = true;
+			return i + 1;
+		}
+	}
+	return size;
+}
+
+static int
+hex_digit_value(char ch) {
+	if (ch >= '0' && ch <= '9') {
+		return ch - '0';
+	} else if (ch >= 'a' && ch <= 'f') {
+		return ch - 'a' + 10;
+	} else if (ch >= 'A' && ch <= 'F') {
+		return ch - 'A' + 10;
+	} else {
+		return -1;
+	}
+}
+
+/**
+ * Removes the chunked framing from the given data, in place. Returns the
+ * number of body bytes that are now at the beginning of the buffer, or -1
+ * if the framing is malformed. `consumed` is set to the number of input
+ * bytes that were processed, which is less than `size` if the terminating
+ * chunk was found before the end of the data.
+ */
+static ssize_t
+dechunk(PassengerBucketState *state, char *data, apr_size_t size, apr_size_t *consumed) {
+	apr_size_t i = 0, out = 0;
+	
+	while (i < size && state->chunkState != PassengerBucketState::CHUNK_DONE) {
+		char ch = data[i];
+		int digit;
+		
+		switch (state->chunkState) {
+		case PassengerBucketState::CHUNK_SIZE:
+			digit = hex_digit_value(ch);
+			if (digit >= 0) {
+				if (state->chunkRemaining > (~0ul >> 4)) {
+					return -1;
+				}
+				state->chunkRemaining = state->chunkRemaining * 16 + digit;
+				i++;
+			} else {
+				state->chunkState = PassengerBucketState::CHUNK_EXTENSION;
+			}
+			break;
+		case PassengerBucketState::CHUNK_EXTENSION:
+			if (ch == '\n') {
+				if (state->chunkRemaining == 0) {
+					state->chunkState = PassengerBucketState::CHUNK_TRAILER;
+				} else {
+					state->chunkState = PassengerBucketState::CHUNK_DATA;
+				}
+			}
+			i++;
+			break;
+		case PassengerBucketState::CHUNK_DATA: {
+			apr_size_t n = std::min<apr_size_t>(state->chunkRemaining, size - i);
+			memmove(data + out, data + i, n);
+			out += n;
+			i += n;
+			state->chunkRemaining -= n;
+			if (state->chunkRemaining == 0) {
+				state->chunkState = PassengerBucketState::CHUNK_DATA_CR;
+			}
+			break;
+		}
+		case PassengerBucketState::CHUNK_DATA_CR:
+			if (ch != '\r') {
+				return -1;
+			}
+			state->chunkState = PassengerBucketState::CHUNK_DATA_LF;
+			i++;
+			break;
+		case PassengerBucketState::CHUNK_DATA_LF:
+			if (ch != '\n') {
+				return -1;
+			}
+			state->chunkState = PassengerBucketState::CHUNK_SIZE;
+			i++;
+			break;
+		case PassengerBucketState::CHUNK_TRAILER:
+			if (ch == '\n') {
+				state->chunkState = PassengerBucketState::CHUNK_DONE;
+			} else if (ch != '\r') {
+				state->chunkState = PassengerBucketState::CHUNK_TRAILER_LINE;
+			}
+			i++;
+			break;
+		case PassengerBucketState::CHUNK_TRAILER_LINE:
+			if (ch == '\n') {
+				state->chunkState = PassengerBucketState::CHUNK_TRAILER;
+			}
+			i++;
+			break;
+		default:
+			return -1;
+		}
+	}
+	
+	*consumed = i;
+	return out;
+}
+
+/**
+ * Reads the next piece of the response from the pending data or from the
+ * connection. Returns the number of body bytes that were placed in `buf`,
+ * 0 on end-of-stream or -1 on error (with errno set).
+ */
+static ssize_t
+read_response(PassengerBucketState *state, char *buf, apr_size_t bufsize) {
+	ssize_t ret;
+	
+	while (true) {
+		if (!state->pending.empty()) {
+			ret = std::min<apr_size_t>(state->pending.size(), bufsize);
+			memcpy(buf, state->pending.data(), ret);
+			state->pending.erase(0, ret);
+		} else {
+			do {
+				ret = read(state->connection, buf, bufsize);
+			} while (ret == -1 && errno == EINTR);
+			if (ret > 0) {
+				state->bytesRead += ret;
+			}
+		}
+		
+		if (ret <= 0) {
+			return ret;
+		} else if (!state->headerComplete) {
+			/* Hand out no more than the header so that the body is
+			 * interpreted according to what the header says.
+			 */
+			apr_size_t headerSize = scan_header_end(state, buf, ret);
+			state->pending.insert(0, buf + headerSize, ret - headerSize);
+			return headerSize;
+		} else if (state->chunked) {
+			apr_size_t consumed;
+			ssize_t size = dechunk(state, buf, ret, &consumed);
+			if (size == -1) {
+				errno = EPROTO;
+				return -1;
+			} else if (state->chunkState == PassengerBucketState::CHUNK_DONE) {
+				state->completed = true;
+				state->reusable = consumed == (apr_size_t) ret && state->pending.empty();
+				return size;
+			} else if (size > 0) {
+				return size;
+			}
+			// Only framing was read; read more.
+		} else {
+			return ret;
+		}
+	}
+}
+
 static apr_status_t
 bucket_read(apr_bucket *bucket, const char **str, apr_size_t *len, apr_read_type_e block) {
 	char *buf;
+	apr_size_t size;
 	ssize_t ret;
 	BucketData *data;
 	
@@ -86,19 +270,34 @@ bucket_read(apr_bucket *bucket, const char **str, apr_size_t *len, apr_read_type
 		return APR_EAGAIN;
 	}
 	
-	buf = (char *) apr_bucket_alloc(APR_BUCKET_BUFF_SIZE, bucket->list);
+	if (data->state->completed) {
+		/* The terminating chunk of a chunked response has been read
+		 * by the previous PassengerBucket.
+		 */
+		delete data;
+		bucket->data = NULL;
+		bucket = apr_bucket_immortal_make(bucket, "", 0);
+		*str = (const char *) bucket->data;
+		*len = 0;
+		return APR_SUCCESS;
+	}
+	
+	size = data->state->readSize;
+	buf = (char *) apr_bucket_alloc(size, bucket->list);
 	if (buf == NULL) {
 		return APR_ENOMEM;
 	}
 	
-	do {
-		ret = read(data->state->connection, buf, APR_BUCKET_BUFF_SIZE);
-	} while (ret == -1 && errno == EINTR);
+	ret = read_response(data->state.get(), buf, size);
 	
 	if (ret > 0) {
 		apr_bucket_heap *h;
 		
-		data->state->bytesRead += ret;
+		if ((apr_size_t) ret == size && size < MAX_READ_SIZE) {
+			data->state->readSize = size * 2;
+		} else if ((apr_size_t) ret < size / 4 && size > APR_BUCKET_BUFF_SIZE) {
+			data->state->readSize = std::max<apr_size_t>(size / 2, APR_BUCKET_BUFF_SIZE);
+		}
 		
 		*str = buf;
 		*len = ret;
@@ -110,7 +309,7 @@ bucket_read(apr_bucket *bucket, const char **str, apr_size_t *len, apr_read_type
 		 */
 		bucket = apr_bucket_heap_make(bucket, buf, *len, apr_bucket_free);
 		h = (apr_bucket_heap *) bucket->data;
-		h->alloc_len = APR_BUCKET_BUFF_SIZE; /* note the real buffer size */
+		h->alloc_len = size; /* note the real buffer size */
 		
 		/* And after this newly created bucket we insert a new Passenger Bucket
 		 * which can read the next chunk from the stream.
@@ -140,6 +339,7 @@ bucket_read(apr_bucket *bucket, const char **str, apr_size_t *len, apr_read_type
 	} else /* ret == -1 */ {
 		int e = errno;
 		data->state->completed = true;
+		data->state->reusable = false;
 		data->state->errorCode = e;
 		delete data;
 		bucket->data = NULL;
@@ -26,11 +26,13 @@
 #define _PASSENGER_BUCKET_H_
 
 #include <boost/shared_ptr.hpp>
+#include <string>
 #include <apr_buckets.h>
 #include <FileDescriptor.h>
 
 namespace Passenger {
 
+using namespace std;
 using namespace boost;
 
 struct PassengerBucketState {
@@ -54,11 +56,69 @@ struct PassengerBucketState {
 	/** Connection to the helper agent. */
 	FileDescriptor connection;
 	
-	PassengerBucketState(const FileDescriptor &conn) {
+	/** Whether the helper agent was asked to keep the connection open, in
+	 * which case the response body may be chunked. The PassengerBucket then
+	 * stops at the end of the response header so that Hooks can look at it
+	 * and set `chunked` before the body is read.
+	 */
+	bool keepAliveRequested;
+	
+	/** Whether the end of the response header has been read. */
+	bool headerComplete;
+	
+	/** The number of bytes of the "\r\n\r\n" header terminator that have
+	 * been matched so far.
+	 */
+	unsigned int headerEndMatched;
+	
+	/** Whether the response body is chunked. The PassengerBucket removes the
+	 * chunked framing and completes at the terminating chunk instead of at EOF.
+	 */
+	bool chunked;
+	
+	/** State of the chunked framing parser. */
+	enum {
+		CHUNK_SIZE,
+		CHUNK_EXTENSION,
+		CHUNK_SIZE_LF,
+		CHUNK_DATA,
+		CHUNK_DATA_CR,
+		CHUNK_DATA_LF,
+		CHUNK_TRAILER,
+		CHUNK_TRAILER_LINE,
+		CHUNK_DONE
+	} chunkState;
+	
+	/** The number of data bytes left in the current chunk. */
+	unsigned long chunkRemaining;
+	
+	/** Data read from the connection that hasn't been handed out yet. */
+	string pending;
+	
+	/** Whether the response has been fully read and nothing else has been
+	 * received, so that the connection may be used for another request.
+	 */
+	bool reusable;
+	
+	/** The number of bytes that the next read() asks for. Grows while reads
+	 * fill the entire buffer, so that large responses are forwarded with
+	 * fewer system calls and buckets, and shrinks again when they don't.
+	 */
+	apr_size_t readSize;
+	
+	PassengerBucketState(const FileDescriptor &conn, bool keepAliveRequested = false) {
 		bytesRead  = 0;
 		completed  = false;
 		errorCode  = 0;
 		connection = conn;
+		this->keepAliveRequested = keepAliveRequested;
+		headerComplete   = !keepAliveRequested;
+		headerEndMatched = 0;
+		chunked    = false;
+		chunkState = CHUNK_SIZE;
+		chunkRemaining = 0;
+		reusable   = false;
+		readSize   = APR_BUCKET_BUFF_SIZE;
 	}
 };
 
@@ -81,6 +141,8 @@ typedef boost::shared_ptr<PassengerBucketState> PassengerBucketStatePtr;
  * - It ignores the APR_NONBLOCK_READ flag because that's known to cause
  *   strange I/O problems.
  * - It can store its current state in a PassengerBucketState data structure.
+ * - It can decode a chunked response body, so that the response ends at the
+ *   terminating chunk and the connection can be reused.
  */
 apr_bucket *passenger_bucket_create(const PassengerBucketStatePtr &state,
                                     apr_bucket_alloc_t *list,
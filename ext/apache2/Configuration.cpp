@@ -179,6 +179,7 @@ extern "C" {
 static DirConfig *
 create_dir_config_struct(apr_pool_t *pool) {
 	DirConfig *config = new DirConfig();
+	config->staticHeaders.store(NULL, boost::memory_order_relaxed);
 	apr_pool_cleanup_register(pool, config, destroy_config_struct<DirConfig>, apr_pool_cleanup_null);
 	return config;
 }
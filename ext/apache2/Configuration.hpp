@@ -36,6 +36,7 @@
  */
 #include "Configuration.h"
 
+#include <boost/atomic.hpp>
 #include <set>
 #include <string>
 
@@ -144,9 +145,21 @@ struct DirConfig {
 	 */
 	Threeway bufferResponse;
 	
+	/**
+	 * The request headers that only depend on this configuration, in the
+	 * format that they're sent to the helper agent in. Built by Hooks on
+	 * first use, so that requests don't have to rebuild them. NULL until
+	 * then; once set, it doesn't change anymore.
+	 */
+	boost::atomic<const string *> staticHeaders;
+	
 	/*************************************/
 	/*************************************/
 	
+	~DirConfig() {
+		delete staticHeaders.load(boost::memory_order_acquire);
+	}
+	
 	bool isEnabled() const {
 		return enabled != DISABLED;
 	}
@@ -213,6 +226,18 @@ struct DirConfig {
 	bool getBufferResponse() const {
 		return bufferResponse == ENABLED;
 	}
+
+	bool getStreamUpload() const {
+		return streamUpload == ENABLED;
+	}
+
+	bool getHelperAgentKeepalive() const {
+		return helperAgentKeepalive == ENABLED;
+	}
+
+	bool getAsyncResponse() const {
+		return asyncResponse == ENABLED;
+	}
 	
 	string getUnionStationFilterString() const {
 		if (unionStationFilters.empty()) {
@@ -159,6 +159,13 @@
 		"Whether to load environment variables from the shell before running the application."),
 
 	
+	AP_INIT_FLAG("PassengerTimingHeader",
+		(FlagFunc) cmd_passenger_timing_header,
+		NULL,
+		OR_OPTIONS | ACCESS_CONF | RSRC_CONF,
+		"Whether to add an X-Passenger-Timing header to responses."),
+
+	
 	AP_INIT_FLAG("PassengerBufferUpload",
 		(FlagFunc) cmd_passenger_buffer_upload,
 		NULL,
@@ -166,6 +173,27 @@
 		"Whether to buffer file uploads."),
 
 	
+	AP_INIT_FLAG("PassengerStreamUpload",
+		(FlagFunc) cmd_passenger_stream_upload,
+		NULL,
+		OR_ALL,
+		"Whether to stream file uploads to the helper agent and let it buffer them."),
+
+	
+	AP_INIT_FLAG("PassengerHelperAgentKeepalive",
+		(FlagFunc) cmd_passenger_helper_agent_keepalive,
+		NULL,
+		OR_ALL,
+		"Whether to reuse helper agent connections across requests."),
+
+	
+	AP_INIT_FLAG("PassengerAsyncResponse",
+		(FlagFunc) cmd_passenger_async_response,
+		NULL,
+		OR_ALL,
+		"Whether to free the Apache worker thread while waiting for the application to respond."),
+
+	
 	AP_INIT_TAKE1("PassengerAppType",
 		(Take1Func) cmd_passenger_app_type,
 		NULL,
@@ -38,16 +38,24 @@
 
 
 
+	/** Whether to free the Apache worker thread while waiting for the application to respond. */
+	Threeway asyncResponse;
 	/** Whether to buffer file uploads. */
 	Threeway bufferUpload;
 	/** Enable or disable Phusion Passenger. */
 	Threeway enabled;
 	/** Allow Apache to handle error response. */
 	Threeway errorOverride;
+	/** Whether to reuse helper agent connections across requests. */
+	Threeway helperAgentKeepalive;
 	/** Enable or disable Passenger's high performance mode. */
 	Threeway highPerformance;
 	/** Whether to load environment variables from the shell before running the application. */
 	Threeway loadShellEnvvars;
+	/** Whether to stream file uploads to the helper agent and let it buffer them. */
+	Threeway streamUpload;
+	/** Whether to add an X-Passenger-Timing header to responses. */
+	Threeway timingHeader;
 	/** The maximum number of simultaneously alive application instances a single application may occupy. */
 	int maxInstancesPerApp;
 	/** The maximum number of queued requests. */
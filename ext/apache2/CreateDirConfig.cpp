@@ -53,7 +53,11 @@
 				config->enabled = DirConfig::UNSET;
 				config->maxRequestQueueSize = UNSET_INT_VALUE;
 				config->loadShellEnvvars = DirConfig::UNSET;
+				config->timingHeader = DirConfig::UNSET;
 				config->bufferUpload = DirConfig::UNSET;
+				config->streamUpload = DirConfig::UNSET;
+				config->helperAgentKeepalive = DirConfig::UNSET;
+				config->asyncResponse = DirConfig::UNSET;
 				config->appType = NULL;
 				config->startupFile = NULL;
 	
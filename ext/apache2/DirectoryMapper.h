@@ -27,14 +27,17 @@
 
 #include <string>
 #include <set>
+#include <map>
 #include <cstring>
 
+#include <boost/thread.hpp>
 #include <oxt/backtrace.hpp>
 
 #include "Configuration.hpp"
 #include <ApplicationPool2/AppTypes.h>
 #include <Utils.h>
 #include <Utils/CachedFileStat.hpp>
+#include <Utils/SystemTime.h>
 
 // The Apache/APR headers *must* come after the Boost headers, otherwise
 // compilation will fail on OpenBSD.
@@ -58,6 +61,93 @@ public:
 };
 
 
+/**
+ * Caches the results of application type detection, so that requests
+ * for the same application don't have to examine the filesystem every
+ * time. A result is reused for at most <tt>throttleRate</tt> seconds, just
+ * like CachedFileStat does with stat() results.
+ *
+ * Per-directory configurations are merged per request, so results are
+ * keyed on the relevant configuration values instead of on the DirConfig
+ * object.
+ *
+ * This class is fully thread-safe.
+ */
+class DirectoryMappingCache {
+private:
+	struct Entry {
+		time_t lastCheck;
+		PassengerAppType appType;
+		string appRoot;
+	};
+
+	typedef map<string, Entry> EntryMap;
+
+	mutable boost::mutex lock;
+	EntryMap entries;
+	unsigned int maxSize;
+
+	void removeExpiredEntries(time_t now, unsigned int throttleRate) {
+		EntryMap::iterator it = entries.begin();
+		while (it != entries.end()) {
+			if (now - it->second.lastCheck >= (time_t) throttleRate) {
+				entries.erase(it++);
+			} else {
+				it++;
+			}
+		}
+	}
+
+public:
+	DirectoryMappingCache(unsigned int maxSize = 1024) {
+		this->maxSize = maxSize;
+	}
+
+	/**
+	 * Looks up a result that was stored at most <tt>throttleRate</tt> seconds
+	 * ago. Returns whether one was found.
+	 *
+	 * @throws TimeRetrievalException
+	 * @throws boost::thread_interrupted
+	 */
+	bool lookup(const string &key, unsigned int throttleRate,
+		PassengerAppType &appType, string &appRoot) const
+	{
+		time_t now = SystemTime::get();
+		boost::lock_guard<boost::mutex> l(lock);
+		EntryMap::const_iterator it = entries.find(key);
+		if (it != entries.end() && now - it->second.lastCheck < (time_t) throttleRate) {
+			appType = it->second.appType;
+			appRoot = it->second.appRoot;
+			return true;
+		} else {
+			return false;
+		}
+	}
+
+	/**
+	 * @throws TimeRetrievalException
+	 * @throws boost::thread_interrupted
+	 */
+	void store(const string &key, unsigned int throttleRate,
+		PassengerAppType appType, const string &appRoot)
+	{
+		time_t now = SystemTime::get();
+		boost::lock_guard<boost::mutex> l(lock);
+		if (entries.size() >= maxSize && entries.find(key) == entries.end()) {
+			removeExpiredEntries(now, throttleRate);
+			if (entries.size() >= maxSize) {
+				entries.clear();
+			}
+		}
+		Entry &entry = entries[key];
+		entry.lastCheck = now;
+		entry.appType = appType;
+		entry.appRoot = appRoot;
+	}
+};
+
+
 /**
  * Utility class for determining URI-to-application directory mappings.
  * Given a URI, it will determine whether that URI belongs to a Phusion
@@ -72,6 +162,7 @@ private:
 	DirConfig *config;
 	request_rec *r;
 	CachedFileStat *cstat;
+	DirectoryMappingCache *cache;
 	const char *baseURI;
 	string publicDir;
 	string appRoot;
@@ -142,18 +233,42 @@ private:
 		}
 
 		UPDATE_TRACE_POINT();
-		AppTypeDetector detector(cstat, throttleRate);
 		PassengerAppType appType;
 		string appRoot;
 		if (config->appType == NULL) {
+			bool resolveFirstSymlink = baseURI != NULL
+				|| config->resolveSymlinksInDocRoot == DirConfig::ENABLED;
+			string cacheKey;
+			if (cache != NULL && throttleRate > 0) {
+				cacheKey.reserve(publicDir.size() + 2 +
+					(config->appRoot == NULL ? 0 : strlen(config->appRoot)));
+				cacheKey.append(publicDir);
+				cacheKey.append(1, '\0');
+				cacheKey.append(1, resolveFirstSymlink ? '1' : '0');
+				if (config->appRoot != NULL) {
+					cacheKey.append(config->appRoot);
+				}
+				if (cache->lookup(cacheKey, throttleRate, appType, appRoot)) {
+					this->appRoot = appRoot;
+					this->baseURI = baseURI;
+					this->appType = appType;
+					autoDetectionDone = true;
+					return;
+				}
+			}
+
+			AppTypeDetector detector(cstat, throttleRate);
 			if (config->appRoot == NULL) {
 				appType = detector.checkDocumentRoot(publicDir,
-					baseURI != NULL || config->resolveSymlinksInDocRoot == DirConfig::ENABLED,
-					&appRoot);
+					resolveFirstSymlink, &appRoot);
 			} else {
 				appRoot = config->appRoot;
 				appType = detector.checkAppRoot(appRoot);
 			}
+
+			if (!cacheKey.empty()) {
+				cache->store(cacheKey, throttleRate, appType, appRoot);
+			}
 		} else {
 			if (config->appRoot == NULL) {
 				appType = PAT_NONE;
@@ -174,15 +289,18 @@ public:
 	 * Create a new DirectoryMapper object.
 	 *
 	 * @param cstat A CachedFileStat object used for statting files.
-	 * @param throttleRate A throttling rate for cstat.
+	 * @param throttleRate A throttling rate for cstat and cache.
+	 * @param cache A cache for application type detection results, or NULL.
 	 * @warning Do not use this object after the destruction of <tt>r</tt>,
-	 *          <tt>config</tt> or <tt>cstat</tt>.
+	 *          <tt>config</tt>, <tt>cstat</tt> or <tt>cache</tt>.
 	 */
 	DirectoryMapper(request_rec *r, DirConfig *config,
-	                CachedFileStat *cstat, unsigned int throttleRate) {
+	                CachedFileStat *cstat, unsigned int throttleRate,
+	                DirectoryMappingCache *cache = NULL) {
 		this->r = r;
 		this->config = config;
 		this->cstat = cstat;
+		this->cache = cache;
 		this->throttleRate = throttleRate;
 		appType = PAT_NONE;
 		baseURI = NULL;
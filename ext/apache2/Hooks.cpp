@@ -41,6 +41,7 @@
 
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <poll.h>
 #include <exception>
 #include <cstdio>
 #include <unistd.h>
@@ -59,6 +60,7 @@
 #include "AgentsStarter.h"
 #include "DirectoryMapper.h"
 #include "Constants.h"
+#include "ApplicationPool2/PoolStatusTable.h"
 
 /* The Apache/APR headers *must* come after the Boost headers, otherwise
  * compilation will fail on OpenBSD.
@@ -109,6 +111,16 @@ extern "C" module AP_MODULE_DECLARE_DATA passenger_module;
 #if HTTP_VERSION(AP_SERVER_MAJORVERSION_NUMBER, AP_SERVER_MINORVERSION_NUMBER) >= 2004
 	// Apache >= 2.4
 	#define unixd_config ap_unixd_config
+	// Handlers may return SUSPENDED and be resumed by an async MPM.
+	#define PASSENGER_ASYNC_RESPONSE
+	#include <ap_mpm.h>
+	
+	/**
+	 * The bounds of the interval, in microseconds, at which a suspended
+	 * request checks whether the helper agent has started responding.
+	 */
+	#define ASYNC_RESPONSE_MIN_INTERVAL 1000
+	#define ASYNC_RESPONSE_MAX_INTERVAL 20000
 #endif
 
 
@@ -208,7 +220,20 @@ private:
 
 	Threeway m_hasModRewrite, m_hasModDir, m_hasModAutoIndex, m_hasModXsendfile;
 	CachedFileStat cstat;
+	DirectoryMappingCache mappingCache;
 	AgentsStarter agentsStarter;
+	/**
+	 * Tells which application groups' request queues are full, so that
+	 * requests for them can be rejected before the upload data is read.
+	 * May be NULL.
+	 */
+	ApplicationPool2::PoolStatusTablePtr poolStatusTable;
+	
+	/**
+	 * The idle helper agent connection of each worker thread, kept open
+	 * across requests if PassengerHelperAgentKeepalive is enabled.
+	 */
+	boost::thread_specific_ptr<FileDescriptor> idleHelperAgentConnection;
 	
 	inline DirConfig *getDirConfig(request_rec *r) {
 		return (DirConfig *) ap_get_module_config(r->per_dir_config, &passenger_module);
@@ -291,6 +316,54 @@ private:
 		return conn;
 	}
 	
+	/**
+	 * Returns this worker thread's idle helper agent connection, or a new
+	 * connection if there is none or if the helper agent has closed it in
+	 * the meantime. `reused` is set to whether an idle connection was returned.
+	 */
+	FileDescriptor checkoutHelperAgentConnection(bool &reused) {
+		TRACE_POINT();
+		FileDescriptor *idle = idleHelperAgentConnection.get();
+		
+		if (idle != NULL && *idle != -1) {
+			FileDescriptor conn = *idle;
+			struct pollfd pfd;
+			int ret;
+			
+			*idle = FileDescriptor();
+			
+			/* An idle connection must not be readable: that means that the
+			 * helper agent closed it, e.g. because it has been restarted.
+			 */
+			pfd.fd = conn;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			do {
+				ret = poll(&pfd, 1, 0);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == 0) {
+				reused = true;
+				return conn;
+			}
+		}
+		
+		reused = false;
+		return connectToHelperAgent();
+	}
+	
+	/**
+	 * Keeps the given connection around for the next request that this worker
+	 * thread handles. The helper agent must have sent the complete response.
+	 */
+	void checkinHelperAgentConnection(const FileDescriptor &conn) {
+		FileDescriptor *idle = idleHelperAgentConnection.get();
+		if (idle == NULL) {
+			idle = new FileDescriptor();
+			idleHelperAgentConnection.reset(idle);
+		}
+		*idle = conn;
+	}
+	
 	bool hasModRewrite() {
 		if (m_hasModRewrite == UNKNOWN) {
 			if (ap_find_linked_module("mod_rewrite.c")) {
@@ -365,7 +438,8 @@ private:
 	bool prepareRequest(request_rec *r, DirConfig *config, const char *filename, bool coreModuleWillBeRun = false) {
 		TRACE_POINT();
 		
-		DirectoryMapper mapper(r, config, &cstat, config->getStatThrottleRate());
+		DirectoryMapper mapper(r, config, &cstat, config->getStatThrottleRate(),
+			&mappingCache);
 		try {
 			if (mapper.getApplicationType() == PAT_NONE) {
 				// (B) is not true.
@@ -476,14 +550,8 @@ private:
 		}
 	}
 	
-	/**
-	 * Most of the high-level logic for forwarding a request to a backend application
-	 * is contained in this method.
-	 */
-	int handleRequest(request_rec *r) {
-		/********** Step 1: preparation work **********/
-		
-		/* Initialize OXT backtrace support if not already done for this thread */
+	/** Initializes OXT backtrace support if not already done for this thread. */
+	void initThreadLocalContext() {
 		if (oxt::get_thread_local_context() == NULL) {
 			/* There is no need to cleanup the context. Apache uses a static
 			 * number of threads per process.
@@ -493,6 +561,16 @@ private:
 			context->thread_name = "Worker " + integerToHex(tid);
 			oxt::set_thread_local_context(context);
 		}
+	}
+	
+	/**
+	 * Most of the high-level logic for forwarding a request to a backend application
+	 * is contained in this method.
+	 */
+	int handleRequest(request_rec *r) {
+		/********** Step 1: preparation work **********/
+		
+		initThreadLocalContext();
 
 		/* Check whether an error occured in prepareRequest() that should be reported
 		 * to the browser.
@@ -529,6 +607,16 @@ private:
 		}
 		
 		
+		if (poolStatusTable != NULL
+		 && poolStatusTable->isQueueFull(config->getAppGroupName(mapper.getAppRoot()),
+			time(NULL)))
+		{
+			P_WARN("The request queue of the application that serves " << r->uri <<
+				" is full; rejecting the request");
+			return reportBusyException(r);
+		}
+		
+		
 		UPDATE_TRACE_POINT();
 		try {
 			/********** Step 2: handle HTTP upload data, if any **********/
@@ -542,6 +630,8 @@ private:
 			this_thread::disable_syscall_interruption dsi;
 			bool expectingUploadData;
 			bool shouldBufferUploads;
+			bool streamUploads;
+			bool keepAlive;
 			string uploadDataMemory;
 			boost::shared_ptr<BufferedUpload> uploadDataFile;
 			const char *contentLength;
@@ -549,6 +639,7 @@ private:
 			expectingUploadData = ap_should_client_block(r);
 			contentLength = lookupHeader(r, "Content-Length");
 			shouldBufferUploads = config->bufferUpload != DirConfig::DISABLED;
+			streamUploads = shouldBufferUploads && config->getStreamUpload();
 			
 			/* If the HTTP upload data is larger than a threshold, or if the HTTP
 			 * client sent HTTP upload data using the "chunked" transfer encoding
@@ -558,8 +649,13 @@ private:
 			 * We never forward the data directly to the backend process because
 			 * the HTTP client might block indefinitely until it's done uploading.
 			 * This would quickly exhaust the application pool.
+			 *
+			 * If PassengerStreamUpload is enabled then we forward the data to the
+			 * helper agent as it arrives and let the helper agent buffer it
+			 * before checking out a session, so that Apache doesn't have to
+			 * make a copy.
 			 */
-			if (expectingUploadData && shouldBufferUploads) {
+			if (expectingUploadData && shouldBufferUploads && !streamUploads) {
 				if (contentLength == NULL || atol(contentLength) > LARGE_UPLOAD_THRESHOLD) {
 					uploadDataFile = receiveRequestBody(r);
 				} else {
@@ -586,6 +682,12 @@ private:
 				}
 			}
 			
+			/* The helper agent can only keep the connection open if it can tell
+			 * where the request body ends.
+			 */
+			keepAlive = config->getHelperAgentKeepalive()
+				&& (!expectingUploadData || lookupHeader(r, "Content-Length") != NULL);
+			
 			
 			/********** Step 3: forwarding the request and request body
 			                    to the HelperAgent **********/
@@ -596,116 +698,75 @@ private:
 			char sizeString[16];
 			int ret;
 			
-			requestData.reserve(3);
+			requestData.reserve(5);
 			headerData.reserve(1024 * 2);
 			requestData.push_back(StaticString());
-			size = constructHeaders(r, config, requestData, mapper, headerData);
+			size = constructHeaders(r, config, requestData, mapper, headerData,
+				expectingUploadData && streamUploads, keepAlive);
 			requestData.push_back(",");
 			
 			ret = snprintf(sizeString, sizeof(sizeString) - 1, "%u:", size);
 			sizeString[ret] = '\0';
 			requestData[0] = StaticString(sizeString, ret);
 			
-			if (expectingUploadData && shouldBufferUploads && uploadDataFile == NULL) {
+			if (expectingUploadData && shouldBufferUploads && !streamUploads
+			 && uploadDataFile == NULL)
+			{
 				requestData.push_back(uploadDataMemory);
 			}
 			
-			FileDescriptor conn = connectToHelperAgent();
-			gatheredWrite(conn, &requestData[0], requestData.size());
+			FileDescriptor conn;
+			bool reused = false;
+			if (keepAlive) {
+				conn = checkoutHelperAgentConnection(reused);
+			} else {
+				conn = connectToHelperAgent();
+			}
+			try {
+				gatheredWrite(conn, &requestData[0], requestData.size());
+			} catch (const SystemException &e) {
+				if (reused && (e.code() == EPIPE || e.code() == ECONNRESET)) {
+					// The helper agent closed the idle connection just now.
+					UPDATE_TRACE_POINT();
+					conn = connectToHelperAgent();
+					gatheredWrite(conn, &requestData[0], requestData.size());
+				} else {
+					throw;
+				}
+			}
 			
 			if (expectingUploadData) {
-				if (shouldBufferUploads && uploadDataFile != NULL) {
+				if (uploadDataFile != NULL) {
 					sendRequestBody(conn, uploadDataFile);
 					uploadDataFile.reset();
-				} else if (!shouldBufferUploads) {
+				} else if (!shouldBufferUploads || streamUploads) {
 					sendRequestBody(conn, r);
 				}
 			}
 			
-			do {
-				ret = shutdown(conn, SHUT_WR);
-			} while (ret == -1 && errno == EINTR);
-			if (ret == -1 && errno != ENOTCONN) {
-				// FreeBSD has a kernel bug which causes shutdown()
-				// to harmlessly return ENOTCONN sometimes. See comment
-				// in safelyClose().
-				int e = errno;
-				throw SystemException("Cannot shutdown(SHUT_WR) HelperAgent connection", e);
+			if (!keepAlive) {
+				do {
+					ret = shutdown(conn, SHUT_WR);
+				} while (ret == -1 && errno == EINTR);
+				if (ret == -1 && errno != ENOTCONN) {
+					// FreeBSD has a kernel bug which causes shutdown()
+					// to harmlessly return ENOTCONN sometimes. See comment
+					// in safelyClose().
+					int e = errno;
+					throw SystemException("Cannot shutdown(SHUT_WR) HelperAgent connection", e);
+				}
 			}
 			
 
 			/********** Step 4: forwarding the response from the backend
 			                    process back to the HTTP client **********/
 			
-			UPDATE_TRACE_POINT();
-			apr_bucket_brigade *bb;
-			apr_bucket *b;
-			PassengerBucketStatePtr bucketState;
-			
-			/* Setup the bucket brigade. */
-			bb = apr_brigade_create(r->connection->pool, r->connection->bucket_alloc);
-			
-			bucketState = boost::make_shared<PassengerBucketState>(conn);
-			b = passenger_bucket_create(bucketState, r->connection->bucket_alloc, config->getBufferResponse());
-			APR_BRIGADE_INSERT_TAIL(bb, b);
-			
-			b = apr_bucket_eos_create(r->connection->bucket_alloc);
-			APR_BRIGADE_INSERT_TAIL(bb, b);
-
-			/* Now read the HTTP response header, parse it and fill relevant
-			 * information in our request_rec structure.
-			 */
-			
-			/* I know the required size for backendData because I read
-			 * util_script.c's source. :-(
-			 */
-			char backendData[MAX_STRING_LEN];
-			Timer timer;
-			int result = ap_scan_script_header_err_brigade(r, bb, backendData);
-			
-			if (result == OK) {
-				// The API documentation for ap_scan_script_err_brigade() says it
-				// returns HTTP_OK on success, but it actually returns OK.
-				
-				/* We were able to parse the HTTP response header sent by the
-				 * backend process! Proceed with passing the bucket brigade,
-				 * for forwarding the response body to the HTTP client.
-				 */
-				
-				/* Manually set the Status header because
-				 * ap_scan_script_header_err_brigade() filters it
-				 * out. Some broken HTTP clients depend on the
-				 * Status header for retrieving the HTTP status.
-				 */
-				if (!r->status_line || *r->status_line == '\0') {
-					r->status_line = apr_psprintf(r->pool,
-						"%d Unknown Status",
-						r->status);
+			#ifdef PASSENGER_ASYNC_RESPONSE
+				if (config->getAsyncResponse() && suspendUntilResponse(r, config, conn, keepAlive)) {
+					return SUSPENDED;
 				}
-				apr_table_setn(r->headers_out, "Status", r->status_line);
-				
-				UPDATE_TRACE_POINT();
-				if (config->errorOverride == DirConfig::ENABLED
-				 && ap_is_HTTP_ERROR(r->status))
-				{
-					/* Send ErrorDocument.
-					 * Clear r->status for override error, otherwise ErrorDocument
-					 * thinks that this is a recursive error, and doesn't find the
-					 * custom error page.
-					 */
-					int originalStatus = r->status;
-					r->status = HTTP_OK;
-					return originalStatus;
-				} else if (ap_pass_brigade(r->output_filters, bb) == APR_SUCCESS) {
-					apr_brigade_cleanup(bb);
-				}
-				return OK;
-			} else {
-				// HelperAgent sent an empty response, or an invalid response.
-				apr_brigade_cleanup(bb);
-				apr_table_setn(r->err_headers_out, "Status", "500 Internal Server Error");
-				return HTTP_INTERNAL_SERVER_ERROR;
-			}
+			#endif
+			return forwardResponse(r, config, conn, keepAlive);
 			
 		} catch (const thread_interrupted &e) {
 			P_TRACE(3, "A system call was interrupted during an HTTP request. Apache "
@@ -725,6 +786,213 @@ private:
 		}
 	}
 	
+	/**
+	 * Reads the response from the helper agent and passes it, through the
+	 * output filters, to the HTTP client. Returns the status that the handler
+	 * should return.
+	 */
+	int forwardResponse(request_rec *r, DirConfig *config, FileDescriptor conn,
+		bool keepAlive)
+	{
+		TRACE_POINT();
+		apr_bucket_brigade *bb;
+		apr_bucket *b;
+		PassengerBucketStatePtr bucketState;
+		
+		/* Setup the bucket brigade. */
+		bb = apr_brigade_create(r->connection->pool, r->connection->bucket_alloc);
+		
+		bucketState = boost::make_shared<PassengerBucketState>(conn, keepAlive);
+		b = passenger_bucket_create(bucketState, r->connection->bucket_alloc, config->getBufferResponse());
+		APR_BRIGADE_INSERT_TAIL(bb, b);
+		
+		b = apr_bucket_eos_create(r->connection->bucket_alloc);
+		APR_BRIGADE_INSERT_TAIL(bb, b);
+
+		/* Now read the HTTP response header, parse it and fill relevant
+		 * information in our request_rec structure.
+		 */
+		
+		/* I know the required size for backendData because I read
+		 * util_script.c's source. :-(
+		 */
+		char backendData[MAX_STRING_LEN];
+		Timer timer;
+		int result = ap_scan_script_header_err_brigade(r, bb, backendData);
+		
+		if (result == OK) {
+			// The API documentation for ap_scan_script_err_brigade() says it
+			// returns HTTP_OK on success, but it actually returns OK.
+			
+			/* We were able to parse the HTTP response header sent by the
+			 * backend process! Proceed with passing the bucket brigade,
+			 * for forwarding the response body to the HTTP client.
+			 */
+			
+			/* Manually set the Status header because
+			 * ap_scan_script_header_err_brigade() filters it
+			 * out. Some broken HTTP clients depend on the
+			 * Status header for retrieving the HTTP status.
+			 */
+			if (!r->status_line || *r->status_line == '\0') {
+				r->status_line = apr_psprintf(r->pool,
+					"%d Unknown Status",
+					r->status);
+			}
+			apr_table_setn(r->headers_out, "Status", r->status_line);
+			
+			/* On a kept-alive connection the helper agent delimits the
+			 * response body with chunked framing, which the bucket removes.
+			 * Apache applies its own framing towards the HTTP client.
+			 */
+			if (keepAlive) {
+				const char *transferEncoding = apr_table_get(r->headers_out, "Transfer-Encoding");
+				if (transferEncoding == NULL) {
+					transferEncoding = apr_table_get(r->err_headers_out, "Transfer-Encoding");
+				}
+				if (transferEncoding != NULL && strcasecmp(transferEncoding, "chunked") == 0) {
+					bucketState->chunked = true;
+					apr_table_unset(r->headers_out, "Transfer-Encoding");
+					apr_table_unset(r->err_headers_out, "Transfer-Encoding");
+				}
+			}
+			
+			UPDATE_TRACE_POINT();
+			if (config->errorOverride == DirConfig::ENABLED
+			 && ap_is_HTTP_ERROR(r->status))
+			{
+				/* Send ErrorDocument.
+				 * Clear r->status for override error, otherwise ErrorDocument
+				 * thinks that this is a recursive error, and doesn't find the
+				 * custom error page.
+				 */
+				int originalStatus = r->status;
+				r->status = HTTP_OK;
+				return originalStatus;
+			} else if (ap_pass_brigade(r->output_filters, bb) == APR_SUCCESS) {
+				apr_brigade_cleanup(bb);
+			}
+			if (bucketState->reusable) {
+				checkinHelperAgentConnection(conn);
+			}
+			return OK;
+		} else {
+			// HelperAgent sent an empty response, or an invalid response.
+			apr_brigade_cleanup(bb);
+			apr_table_setn(r->err_headers_out, "Status", "500 Internal Server Error");
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+	}
+	
+	#ifdef PASSENGER_ASYNC_RESPONSE
+		/**
+		 * A request whose handler has returned SUSPENDED, while it waits for
+		 * the helper agent to respond.
+		 */
+		struct SuspendedRequest {
+			Hooks *self;
+			request_rec *r;
+			DirConfig *config;
+			FileDescriptor conn;
+			bool keepAlive;
+			apr_interval_time_t interval;
+		};
+		
+		/**
+		 * Releases the worker thread until the helper agent has started sending
+		 * the response, after which the MPM resumes the request in
+		 * resumeSuspendedRequest(). There is no way to have the MPM watch the
+		 * helper agent connection that works on all Apache 2.4 versions, so
+		 * the connection is polled with timed callbacks that back off from
+		 * ASYNC_RESPONSE_MIN_INTERVAL to ASYNC_RESPONSE_MAX_INTERVAL.
+		 *
+		 * Returns false if the MPM can't suspend requests, in which case the
+		 * caller should forward the response the usual way.
+		 */
+		bool suspendUntilResponse(request_rec *r, DirConfig *config,
+			const FileDescriptor &conn, bool keepAlive)
+		{
+			int async = 0;
+			if (ap_mpm_query(AP_MPMQ_IS_ASYNC, &async) != APR_SUCCESS || !async) {
+				return false;
+			}
+			
+			SuspendedRequest *sr = new SuspendedRequest();
+			sr->self = this;
+			sr->r = r;
+			sr->config = config;
+			sr->conn = conn;
+			sr->keepAlive = keepAlive;
+			sr->interval = ASYNC_RESPONSE_MIN_INTERVAL;
+			if (ap_mpm_register_timed_callback(apr_time_now() + sr->interval,
+				suspendedRequestCallback, sr) == APR_SUCCESS)
+			{
+				return true;
+			} else {
+				delete sr;
+				return false;
+			}
+		}
+		
+		static void suspendedRequestCallback(void *baton) {
+			SuspendedRequest *sr = (SuspendedRequest *) baton;
+			sr->self->resumeSuspendedRequest(sr);
+		}
+		
+		void resumeSuspendedRequest(SuspendedRequest *sr) {
+			initThreadLocalContext();
+			TRACE_POINT();
+			request_rec *r = sr->r;
+			struct pollfd pfd;
+			int ret;
+			
+			pfd.fd = sr->conn;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			do {
+				ret = poll(&pfd, 1, 0);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == 0) {
+				sr->interval = std::min<apr_interval_time_t>(sr->interval * 2,
+					ASYNC_RESPONSE_MAX_INTERVAL);
+				if (ap_mpm_register_timed_callback(apr_time_now() + sr->interval,
+					suspendedRequestCallback, sr) == APR_SUCCESS)
+				{
+					return;
+				}
+				// Fall through and wait for the response in this thread.
+			}
+			
+			UPDATE_TRACE_POINT();
+			int status;
+			try {
+				this_thread::disable_interruption di;
+				this_thread::disable_syscall_interruption dsi;
+				status = forwardResponse(r, sr->config, sr->conn, sr->keepAlive);
+			} catch (const thread_interrupted &e) {
+				P_TRACE(3, "A system call was interrupted during an HTTP request. Apache "
+					"is probably restarting or shutting down. Backtrace:\n" <<
+					e.backtrace());
+				status = HTTP_INTERNAL_SERVER_ERROR;
+			} catch (const std::exception &e) {
+				P_ERROR("Unexpected error in mod_passenger: " << e.what());
+				status = HTTP_INTERNAL_SERVER_ERROR;
+			}
+			delete sr;
+			
+			/* Finish the request the way Apache does it after a handler
+			 * that didn't suspend.
+			 */
+			if (status == OK || status == DONE) {
+				ap_finalize_request_protocol(r);
+			} else {
+				r->status = HTTP_OK;
+				ap_die(status, r);
+			}
+			ap_process_request_after_handler(r);
+		}
+	#endif
+	
 	unsigned int
 	escapeUri(unsigned char *dst, const unsigned char *src, size_t size) {
 		static const char hex[] = "0123456789abcdef";
@@ -840,6 +1108,15 @@ private:
 		}
 	}
 
+	void addIntegerHeader(string &headers, const char *name, long value) {
+		char buf[sizeof(long) * 3 + 2];
+		int size = snprintf(buf, sizeof(buf), "%ld", value);
+		headers.append(name);
+		headers.append(1, '\0');
+		headers.append(buf, size);
+		headers.append(1, '\0');
+	}
+
 	void addHeader(request_rec *r, string &headers, const char *name, DirConfig::Threeway value) {
 		if (value != DirConfig::UNSET) {
 			headers.append(name);
@@ -853,7 +1130,7 @@ private:
 	
 	unsigned int constructHeaders(request_rec *r, DirConfig *config,
 		vector<StaticString> &requestData, DirectoryMapper &mapper,
-		string &output)
+		string &output, bool bufferInHelperAgent, bool keepAlive)
 	{
 		const char *baseURI = mapper.getBaseURI();
 		
@@ -879,13 +1156,13 @@ private:
 		addHeader(output, "SERVER_NAME",     ap_get_server_name(r));
 		addHeader(output, "SERVER_ADMIN",    r->server->server_admin);
 		addHeader(output, "SERVER_ADDR",     r->connection->local_ip);
-		addHeader(output, "SERVER_PORT",     apr_psprintf(r->pool, "%u", ap_get_server_port(r)));
+		addIntegerHeader(output, "SERVER_PORT", ap_get_server_port(r));
 		#if HTTP_VERSION(AP_SERVER_MAJORVERSION_NUMBER, AP_SERVER_MINORVERSION_NUMBER) >= 2004
 			addHeader(output, "REMOTE_ADDR", r->connection->client_ip);
-			addHeader(output, "REMOTE_PORT", apr_psprintf(r->pool, "%d", r->connection->client_addr->port));
+			addIntegerHeader(output, "REMOTE_PORT", r->connection->client_addr->port);
 		#else
 			addHeader(output, "REMOTE_ADDR", r->connection->remote_ip);
-			addHeader(output, "REMOTE_PORT", apr_psprintf(r->pool, "%d", r->connection->remote_addr->port));
+			addIntegerHeader(output, "REMOTE_PORT", r->connection->remote_addr->port);
 		#endif
 		addHeader(output, "REMOTE_USER",     r->user);
 		addHeader(output, "REQUEST_METHOD",  r->method);
@@ -946,20 +1223,50 @@ private:
 			addHeader(output, env[i].key, env[i].val);
 		}
 		
-		// Phusion Passenger options.
-		addHeader(output, "PASSENGER_STATUS_LINE", "false");
+		// Phusion Passenger options that differ per request.
 		addHeader(output, "PASSENGER_APP_ROOT", mapper.getAppRoot());
 		addHeader(output, "PASSENGER_APP_GROUP_NAME", config->getAppGroupName(mapper.getAppRoot()));
+		addHeader(output, "PASSENGER_APP_TYPE", mapper.getApplicationTypeName());
+		if (bufferInHelperAgent) {
+			addHeader(output, "PASSENGER_BUFFERING", "true");
+		}
+		if (keepAlive) {
+			addHeader(output, "PASSENGER_FRONTEND_KEEPALIVE", "true");
+		}
+		
+		/*********************/
+		/*********************/
+		
+		// The other options only depend on the configuration. They're sent
+		// as a separate buffer, so they don't have to be copied.
+		const string &staticHeaders = getStaticHeaders(r, config);
+		requestData.push_back(output);
+		requestData.push_back(staticHeaders);
+		return output.size() + staticHeaders.size();
+	}
+	
+	/**
+	 * Returns the part of the request headers that only depends on the
+	 * given DirConfig. It's built on first use and stored in the DirConfig.
+	 * Apache may use the same DirConfig from multiple threads at the same
+	 * time; if they all build it, the first one to finish wins.
+	 */
+	const string &getStaticHeaders(request_rec *r, DirConfig *config) {
+		const string *result = config->staticHeaders.load(boost::memory_order_acquire);
+		if (result != NULL) {
+			return *result;
+		}
+		
+		string output;
+		output.reserve(1024);
+		addHeader(output, "PASSENGER_STATUS_LINE", "false");
 		#include "SetHeaders.cpp"
 		addHeader(output, "PASSENGER_SPAWN_METHOD", config->getSpawnMethodString());
 		addHeader(r, output, "PASSENGER_MAX_REQUEST_QUEUE_SIZE", config->maxRequestQueueSize);
-		addHeader(output, "PASSENGER_APP_TYPE", mapper.getApplicationTypeName());
-		addHeader(output, "PASSENGER_MAX_PRELOADER_IDLE_TIME",
-			apr_psprintf(r->pool, "%ld", config->maxPreloaderIdleTime));
+		addIntegerHeader(output, "PASSENGER_MAX_PRELOADER_IDLE_TIME", config->maxPreloaderIdleTime);
 		addHeader(output, "PASSENGER_DEBUGGER", "false");
 		addHeader(output, "PASSENGER_SHOW_VERSION_IN_HEADER", "true");
-		addHeader(output, "PASSENGER_STAT_THROTTLE_RATE",
-			apr_psprintf(r->pool, "%ld", config->getStatThrottleRate()));
+		addIntegerHeader(output, "PASSENGER_STAT_THROTTLE_RATE", config->getStatThrottleRate());
 		addHeader(output, "PASSENGER_RESTART_DIR", config->getRestartDir());
 		addHeader(output, "PASSENGER_FRIENDLY_ERROR_PAGES",
 			config->showFriendlyErrorPages() ? "true" : "false");
@@ -972,11 +1279,16 @@ private:
 			}
 		}
 		
-		/*********************/
-		/*********************/
-		
-		requestData.push_back(output);
-		return output.size();
+		const string *built = new string(output);
+		const string *expected = NULL;
+		if (config->staticHeaders.compare_exchange_strong(expected, built,
+			boost::memory_order_acq_rel, boost::memory_order_acquire))
+		{
+			return *built;
+		} else {
+			delete built;
+			return *expected;
+		}
 	}
 	
 	void throwUploadBufferingException(request_rec *r, int code) {
@@ -1255,6 +1567,7 @@ private:
 public:
 	Hooks(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
 	    : cstat(1024),
+	      mappingCache(1024),
 	      agentsStarter(AS_APACHE)
 	{
 		serverConfig.finalize();
@@ -1323,6 +1636,15 @@ public:
 			}
 		}
 		createFile(generationPath + "/config_files.txt", configFiles);
+		
+		// The child processes inherit this mapping. Requests are simply
+		// not fast-failed if it cannot be opened.
+		try {
+			poolStatusTable = boost::make_shared<ApplicationPool2::PoolStatusTable>(
+				ApplicationPool2::PoolStatusTable::getFilename(generationPath), false);
+		} catch (const std::exception &e) {
+			P_WARN("Cannot open the pool status table: " << e.what());
+		}
 	}
 	
 	void childInit(apr_pool_t *pchild, server_rec *s) {
@@ -145,6 +145,13 @@
 	
 
 	
+		config->timingHeader =
+			(add->timingHeader == DirConfig::UNSET) ?
+			base->timingHeader :
+			add->timingHeader;
+	
+
+	
 		config->bufferUpload =
 			(add->bufferUpload == DirConfig::UNSET) ?
 			base->bufferUpload :
@@ -152,6 +159,27 @@
 	
 
 	
+		config->streamUpload =
+			(add->streamUpload == DirConfig::UNSET) ?
+			base->streamUpload :
+			add->streamUpload;
+	
+
+	
+		config->helperAgentKeepalive =
+			(add->helperAgentKeepalive == DirConfig::UNSET) ?
+			base->helperAgentKeepalive :
+			add->helperAgentKeepalive;
+	
+
+	
+		config->asyncResponse =
+			(add->asyncResponse == DirConfig::UNSET) ?
+			base->asyncResponse :
+			add->asyncResponse;
+	
+
+	
 		config->appType =
 			(add->appType == NULL) ?
 			base->appType :
@@ -88,6 +88,10 @@
 	
 
 	
+		addHeader(r, output, "PASSENGER_TIMING_HEADER", config->timingHeader);
+	
+
+	
 		addHeader(output, "PASSENGER_STARTUP_FILE", config->startupFile);
 	
 
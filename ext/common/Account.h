@@ -73,6 +73,10 @@ public:
 		// HelperAgent admin rights.
 		INSPECT_REQUESTS          = 1 << 8,
 		INSPECT_BACKTRACES        = 1 << 9,
+		HANDOFF                   = 1 << 10,
+		
+		// Watchdog rights.
+		KEEP_PROCESSES            = 1 << 16,
 		
 		// Other rights.
 		EXIT                      = 1 << 31
@@ -234,17 +234,22 @@ private:
 	 */
 	static int timedWaitPid(pid_t pid, int *status, unsigned long long timeout) {
 		Timer timer;
+		unsigned long long elapsed;
 		int ret;
 		
-		do {
+		while (true) {
 			ret = syscalls::waitpid(pid, status, WNOHANG);
 			if (ret > 0 || ret == -1) {
 				return ret;
-			} else {
+			}
+			elapsed = timer.elapsed();
+			if (elapsed >= timeout) {
+				return 0; // timed out
+			} else if (waitForProcessExit(pid, (int) (timeout - elapsed)) == -1) {
+				// Can't wait for the exit event on this platform, so poll.
 				syscalls::usleep(10000);
 			}
-		} while (timer.elapsed() < timeout);
-		return 0; // timed out
+		}
 	}
 	
 	/**
@@ -510,12 +515,25 @@ public:
 				this->feedbackFd = feedbackFd;
 				requestSocketFilename   = info.get("request_socket_filename");
 				requestSocketPassword   = info.get("request_socket_password");
+				if (requestSocketPassword == "-") {
+					// The helper agent authenticates us by our peer credentials.
+					requestSocketPassword.clear();
+				}
 				helperAgentAdminSocketAddress = info.get("helper_agent_admin_socket_address");
 				helperAgentExitPassword       = info.get("helper_agent_exit_password");
 				serverInstanceDir = boost::make_shared<ServerInstanceDir>(info.get("server_instance_dir"), false);
 				generation        = serverInstanceDir->getGeneration(info.getInt("generation"));
 				loggingSocketAddress  = info.get("logging_socket_address");
 				loggingSocketPassword = info.get("logging_socket_password");
+				P_DEBUG("Phusion Passenger agents started in " <<
+					info.getULL("agents_startup_time", false) << " msec (helper agent: " <<
+					info.getULL("helper_agent_startup_fork_time", false) << " msec fork, " <<
+					info.getULL("helper_agent_startup_arguments_time", false) << " msec arguments, " <<
+					info.getULL("helper_agent_startup_initialization_time", false) << " msec initialization; " <<
+					"logging agent: " <<
+					info.getULL("logging_agent_startup_fork_time", false) << " msec fork, " <<
+					info.getULL("logging_agent_startup_arguments_time", false) << " msec arguments, " <<
+					info.getULL("logging_agent_startup_initialization_time", false) << " msec initialization)");
 				guard.clear();
 			} else if (args[0] == "Watchdog startup error") {
 				killProcessGroupAndWait(&pid, 5000);
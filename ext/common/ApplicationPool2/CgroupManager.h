@@ -0,0 +1,305 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_CGROUP_MANAGER_H_
+#define _PASSENGER_APPLICATION_POOL2_CGROUP_MANAGER_H_
+
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <StaticString.h>
+#include <Logging.h>
+#include <ApplicationPool2/Options.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/SystemTime.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+
+
+/**
+ * Places the processes of each SuperGroup in their own cgroup (version 2)
+ * below a root cgroup, so that the kernel divides the CPU between
+ * applications according to their priority instead of according to their
+ * number of runnable threads:
+ *
+ *  - cpu.weight is 100 (the kernel's default) times Options::capacityWeight,
+ *    so the weights that decide how the pool's capacity is shared also
+ *    decide how the CPU is shared when it's contended.
+ *  - memory.high is Options::memoryLimit times Options::maxProcesses, if
+ *    both are set. Above it the kernel reclaims the SuperGroup's memory
+ *    aggressively, before the pool's memory limit checking kicks in.
+ *
+ * The root must be in a cgroup2 file system and writable by the HelperAgent,
+ * e.g. a subtree delegated by systemd, and its parent must have the cpu and
+ * memory controllers enabled. It must not be the HelperAgent's own cgroup,
+ * because a cgroup that distributes resources to children can't contain
+ * processes itself. The cgroups are created when a SuperGroup
+ * spawns its first process and updated on every spawn. Problems are logged
+ * once per SuperGroup; its processes then stay in the HelperAgent's cgroup.
+ *
+ * The CPU pressure (PSI) of a cgroup tells how much of the time its
+ * processes were runnable but waiting for a CPU. Group doesn't spawn more
+ * processes when it's high: they would all share the same cpu.weight, so
+ * they'd only add to the queue. Thread-safe.
+ */
+class CgroupManager {
+private:
+	struct Cgroup {
+		bool failed;
+		double cpuPressure;
+		unsigned long long cpuPressureCheckedAt;
+
+		Cgroup()
+			: failed(false),
+			  cpuPressure(-1),
+			  cpuPressureCheckedAt(0)
+			{ }
+	};
+
+	/** How long a cpu.pressure reading is reused, in microseconds. */
+	static const unsigned int CPU_PRESSURE_CACHE_TIME = 1000000;
+
+	const string root;
+	boost::mutex syncher;
+	bool rootPrepared;
+	map<string, Cgroup> cgroups;
+
+	static bool writeControlFile(const string &path, const StaticString &value, int &e) {
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			e = errno;
+			return false;
+		}
+		ssize_t ret = write(fd, value.data(), value.size());
+		e = errno;
+		close(fd);
+		return ret == (ssize_t) value.size();
+	}
+
+	bool prepareRoot() {
+		int e;
+		if (rootPrepared) {
+			return true;
+		}
+		if (mkdir(root.c_str(), 0755) == -1 && errno != EEXIST) {
+			e = errno;
+			P_WARN("Cannot create cgroup " << root << ": " <<
+				strerror(e) << " (errno=" << e << ")");
+			return false;
+		}
+		if (!writeControlFile(root + "/cgroup.subtree_control", "+cpu +memory", e)) {
+			P_WARN("Cannot enable the cpu and memory controllers in cgroup " <<
+				root << ": " << strerror(e) << " (errno=" << e << ")");
+			return false;
+		}
+		rootPrepared = true;
+		return true;
+	}
+
+	bool prepareCgroup(const string &path, const Options &options) {
+		int e;
+		if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+			e = errno;
+			P_WARN("Cannot create cgroup " << path << ": " <<
+				strerror(e) << " (errno=" << e << ")");
+			return false;
+		}
+		if (!writeControlFile(path + "/cpu.weight",
+			toString(cpuWeightFor(options)), e))
+		{
+			P_WARN("Cannot set the CPU weight of cgroup " << path << ": " <<
+				strerror(e) << " (errno=" << e << ")");
+			return false;
+		}
+		unsigned long long memoryHigh = memoryHighFor(options);
+		if (!writeControlFile(path + "/memory.high",
+			(memoryHigh == 0) ? string("max") : toString(memoryHigh), e))
+		{
+			P_WARN("Cannot set the memory.high of cgroup " << path << ": " <<
+				strerror(e) << " (errno=" << e << ")");
+			return false;
+		}
+		return true;
+	}
+
+public:
+	/** Disables cgroup placement if `root` is empty. */
+	CgroupManager(const string &_root)
+		: root(_root),
+		  rootPrepared(false)
+		{ }
+
+	bool enabled() const {
+		return !root.empty();
+	}
+
+	const string &getRoot() const {
+		return root;
+	}
+
+	/**
+	 * Turns an app group name, which may contain slashes and other
+	 * characters that aren't allowed or are awkward in a file name, into
+	 * the name of its cgroup. A hash of the name keeps names that only
+	 * differ in those characters apart.
+	 */
+	static string cgroupNameFor(const StaticString &appGroupName) {
+		string result = "app-";
+		unsigned int hash = 2166136261u;
+		for (string::size_type i = 0; i < appGroupName.size(); i++) {
+			char c = appGroupName[i];
+			hash = (hash ^ (unsigned char) c) * 16777619u;
+			if (i < 64) {
+				if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				 || (c >= '0' && c <= '9') || c == '.' || c == '-')
+				{
+					result.append(1, c);
+				} else {
+					result.append(1, '_');
+				}
+			}
+		}
+		result.append("-");
+		result.append(integerToHex(hash));
+		return result;
+	}
+
+	static unsigned int cpuWeightFor(const Options &options) {
+		unsigned long long weight = 100ull * std::max(1u, options.capacityWeight);
+		return (unsigned int) std::min(weight, 10000ull);
+	}
+
+	/** In bytes; 0 means no limit. */
+	static unsigned long long memoryHighFor(const Options &options) {
+		return (unsigned long long) options.memoryLimit * options.maxProcesses
+			* 1024 * 1024;
+	}
+
+	/**
+	 * Parses the "some avg10" value of a cpu.pressure file, i.e. the
+	 * percentage of the last 10 seconds during which at least one task
+	 * was waiting for a CPU. Returns -1 if there is none.
+	 */
+	static double parseCpuPressure(const StaticString &contents) {
+		string str = contents.toString();
+		string::size_type pos = str.find("some ");
+		if (pos == string::npos || (pos > 0 && str[pos - 1] != '\n')) {
+			return -1;
+		}
+		string::size_type end = str.find('\n', pos);
+		pos = str.find("avg10=", pos);
+		if (pos == string::npos || (end != string::npos && pos > end)) {
+			return -1;
+		}
+		return atof(str.c_str() + pos + sizeof("avg10=") - 1);
+	}
+
+	/**
+	 * Creates or updates the cgroup of the SuperGroup that `options` belong
+	 * to. Returns the path of its cgroup.procs file, to which the pids of
+	 * processes are to be written, or the empty string if the process
+	 * should not be placed in a cgroup.
+	 */
+	string prepare(const Options &options) {
+		if (!enabled()) {
+			return string();
+		}
+
+		string name = cgroupNameFor(options.getAppGroupName());
+		string path = root + "/" + name;
+		boost::lock_guard<boost::mutex> l(syncher);
+		Cgroup &cgroup = cgroups[name];
+		if (cgroup.failed) {
+			return string();
+		} else if (!prepareRoot() || !prepareCgroup(path, options)) {
+			cgroup.failed = true;
+			return string();
+		} else {
+			return path + "/cgroup.procs";
+		}
+	}
+
+	/** Moves the given process into the cgroup whose cgroup.procs file
+	 * prepare() returned. */
+	static bool addProcess(const string &procsPath, pid_t pid) {
+		int e;
+		return writeControlFile(procsPath, toString(pid), e);
+	}
+
+	/**
+	 * Returns the CPU pressure of the given app group's cgroup, see
+	 * parseCpuPressure(), or -1 if it's not known. Readings are reused
+	 * for CPU_PRESSURE_CACHE_TIME, so that this can be called whenever
+	 * the pool considers spawning.
+	 */
+	double getCpuPressure(const StaticString &appGroupName) {
+		if (!enabled()) {
+			return -1;
+		}
+
+		string name = cgroupNameFor(appGroupName);
+		unsigned long long now = SystemTime::getCoarseUsec();
+		boost::lock_guard<boost::mutex> l(syncher);
+		map<string, Cgroup>::iterator it = cgroups.find(name);
+		if (it == cgroups.end() || it->second.failed) {
+			return -1;
+		}
+
+		Cgroup &cgroup = it->second;
+		if (cgroup.cpuPressureCheckedAt == 0
+		 || now >= cgroup.cpuPressureCheckedAt + CPU_PRESSURE_CACHE_TIME)
+		{
+			cgroup.cpuPressureCheckedAt = now;
+			try {
+				cgroup.cpuPressure = parseCpuPressure(
+					readAll(root + "/" + name + "/cpu.pressure"));
+			} catch (const SystemException &) {
+				// The kernel doesn't support PSI.
+				cgroup.cpuPressure = -1;
+			}
+		}
+		return cgroup.cpuPressure;
+	}
+};
+
+typedef boost::shared_ptr<CgroupManager> CgroupManagerPtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_CGROUP_MANAGER_H_ */
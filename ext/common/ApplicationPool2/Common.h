@@ -26,11 +26,18 @@
 #define _PASSENGER_APPLICATION_POOL2_COMMON_H_
 
 #include <boost/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
 #include <oxt/tracable_exception.hpp>
+#include <Exceptions.h>
 #include <ApplicationPool2/Options.h>
+#include <ApplicationPool2/CpuAffinity.h>
+#include <ApplicationPool2/CgroupManager.h>
+#include <ApplicationPool2/UserDatabaseCache.h>
 #include <Utils/StringMap.h>
+#include <Utils/InlineFunction.h>
+#include <Utils/SystemTime.h>
 
 namespace tut {
 	struct ApplicationPool2_PoolTest;
@@ -75,7 +82,15 @@ enum SpawnResult {
 	// Unable to spawn a new process: the pool is at full capacity. Pool capacity is
 	// checked after checking the group upper bound limits, so if you get this result
 	// then it is guaranteed that the group upper bound limits have not been reached.
-	SR_ERR_POOL_AT_FULL_CAPACITY
+	SR_ERR_POOL_AT_FULL_CAPACITY,
+
+	// The last few spawns failed, so the group doesn't spawn until its backoff
+	// period is over. See Group::spawnCircuitOpen().
+	SR_ERR_SPAWN_BACKOFF,
+
+	// The group's cgroup is short on CPU, so another process wouldn't be able
+	// to do any work either. See Group::cpuPressureTooHigh().
+	SR_ERR_CPU_PRESSURE
 };
 
 /**
@@ -158,22 +173,92 @@ typedef boost::shared_ptr<Process> ProcessPtr;
 typedef boost::shared_ptr<Session> SessionPtr;
 typedef boost::shared_ptr<tracable_exception> ExceptionPtr;
 typedef StringMap<SuperGroupPtr> SuperGroupMap;
-typedef boost::function<void (const SessionPtr &session, const ExceptionPtr &e)> GetCallback;
+/** Stored in an InlineFunction because this callback is created for every
+ * request, and is typically a boost::bind() that doesn't fit in a
+ * boost::function without a heap allocation. */
+typedef InlineFunction<void (const SessionPtr &session, const ExceptionPtr &e)> GetCallback;
 typedef boost::function<void (const ProcessPtr &process, DisableResult result)> DisableCallback;
 typedef boost::function<void ()> Callback;
 
+/**
+ * The type of Pool::syncher. Locking it exclusively protects all pool
+ * state. Locking it in shared mode only allows reading pool-wide state,
+ * such as the SuperGroup map and capacity; a Group's session bookkeeping
+ * may then only be modified while also holding that Group's
+ * sessionSyncher. See Pool::asyncGet() and Group::onSessionClose().
+ */
+typedef boost::shared_mutex PoolSyncher;
+typedef boost::lock_guard<PoolSyncher> PoolLockGuard;
+typedef boost::unique_lock<PoolSyncher> PoolLock;
+typedef boost::shared_lock<PoolSyncher> PoolSharedLock;
+
+/** Like DynamicScopedLock, but for the pool lock. */
+class PoolDynamicLock: public PoolLock {
+public:
+	PoolDynamicLock(PoolSyncher &m, bool lockNow = true)
+		: PoolLock(m, boost::defer_lock)
+	{
+		if (lockNow) {
+			lock();
+		}
+	}
+};
+
 struct GetWaiter {
+	/**
+	 * How many times a waiter may be overtaken by waiters with a higher
+	 * Options::requestPriority before it can no longer be overtaken.
+	 * This prevents low priority requests from starving.
+	 */
+	static const unsigned int MAX_OVERTAKES = 64;
+
 	Options options;
 	GetCallback callback;
+	unsigned int overtakes;
+	/** When this waiter was queued, in microseconds. */
+	unsigned long long enqueueTime;
 	
 	GetWaiter(const Options &o, const GetCallback &cb)
 		: options(o),
-		  callback(cb)
+		  callback(cb),
+		  overtakes(0),
+		  enqueueTime(SystemTime::getCoarseUsec())
 	{
 		options.persist(o);
 	}
+
+	/** Whether the caller gave up on this request; see Options::cancellation. */
+	bool cancelled() const {
+		return options.cancellation != NULL && options.cancellation->isCancelled();
+	}
+
+	static ExceptionPtr cancelledException() {
+		return boost::make_shared<GetAbortedException>("The request was cancelled");
+	}
 };
 
+/**
+ * Queues a waiter on a get wait list (a deque or vector of GetWaiter). The
+ * list is ordered by Options::requestPriority, from high to low, and is FIFO
+ * within the same priority. A waiter is not queued before other waiters
+ * that have already been overtaken GetWaiter::MAX_OVERTAKES times.
+ */
+template<typename Collection>
+inline void
+pushGetWaiterByPriority(Collection &waitlist, const GetWaiter &waiter) {
+	typename Collection::size_type i = waitlist.size();
+	while (i > 0
+		&& waitlist[i - 1].options.requestPriority < waiter.options.requestPriority
+		&& waitlist[i - 1].overtakes < GetWaiter::MAX_OVERTAKES)
+	{
+		i--;
+	}
+	for (typename Collection::size_type j = i; j < waitlist.size(); j++) {
+		waitlist[j].overtakes++;
+	}
+	waitlist.insert(waitlist.begin() + i, waiter);
+}
+
 struct Ticket {
 	boost::mutex syncher;
 	boost::condition_variable cond;
@@ -185,6 +270,19 @@ struct SpawnerConfig {
 	// Used by SmartSpawner and DirectSpawner.
 	/** A random generator to use. */
 	RandomGeneratorPtr randomGenerator;
+	/** Chooses the CPUs to pin new processes to, see Options::cpuAffinity. */
+	CpuAffinityAllocatorPtr cpuAffinityAllocator;
+	/** Places new processes in per-SuperGroup cgroups. Disabled unless
+	 * given a root cgroup. */
+	CgroupManagerPtr cgroupManager;
+	/** Resolves the users and groups to run processes as. Shared by all
+	 * spawners so that lookups are done once per application, not once
+	 * per spawn. */
+	UserDatabaseCachePtr userDatabaseCache;
+
+	// Used by RemoteSpawner.
+	/** The password with which to authenticate with RemoteAgents. */
+	string remoteAgentPassword;
 
 	// Used by DummySpawner and SpawnerFactory.
 	unsigned int concurrency;
@@ -201,6 +299,9 @@ struct SpawnerConfig {
 		} else {
 			this->randomGenerator = boost::make_shared<RandomGenerator>();
 		}
+		cpuAffinityAllocator = boost::make_shared<CpuAffinityAllocator>();
+		cgroupManager = boost::make_shared<CgroupManager>(string());
+		userDatabaseCache = boost::make_shared<UserDatabaseCache>();
 	}
 };
 
@@ -0,0 +1,149 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_CONCURRENCY_TUNER_H_
+#define _PASSENGER_APPLICATION_POOL2_CONCURRENCY_TUNER_H_
+
+#include <algorithm>
+#include <cmath>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+
+/**
+ * Tunes the concurrency of a multithreaded process at runtime, based on how
+ * its response times change with the number of concurrent sessions. The
+ * best average response time that was observed, adjusted by the ones observed
+ * while the process was lightly loaded, is taken as the response time
+ * without load. As long as the response times stay close to it, the
+ * limit grows; when they rise because the process is saturated (e.g. its
+ * threads are waiting for the GVL or the CPU instead of for I/O), the limit
+ * shrinks proportionally. This is the gradient algorithm of adaptive
+ * concurrency limiters.
+ *
+ * Response times are evaluated per window of WINDOW_SIZE sessions. The limit
+ * is only raised after windows in which the process actually used at least
+ * half of its current limit, so that an idle process doesn't grow it to the
+ * maximum.
+ *
+ * Durations are in microseconds. Not thread-safe; Process protects it in the
+ * same way as its session bookkeeping.
+ */
+class ConcurrencyTuner {
+public:
+	static const unsigned int WINDOW_SIZE = 20;
+
+private:
+	unsigned int maxLimit;
+	double limit;
+	double noLoadTime;
+	unsigned long long windowTotalTime;
+	unsigned int windowSessions;
+	unsigned int windowPeakSessions;
+
+public:
+	ConcurrencyTuner() {
+		maxLimit = 0;
+		limit = 0;
+		reset(0);
+	}
+
+	bool isEnabled() const {
+		return maxLimit > 0;
+	}
+
+	/**
+	 * Starts tuning between 1 and `max`, from the given limit.
+	 * A `max` of 0 disables tuning.
+	 */
+	void enable(unsigned int initial, unsigned int max) {
+		maxLimit = max;
+		reset(initial);
+	}
+
+	/** Continues tuning from the given limit, e.g. after it has been changed by hand. */
+	void reset(unsigned int initial) {
+		limit = std::min(std::max(initial, 1u), std::max(maxLimit, 1u));
+		noLoadTime = 0;
+		windowTotalTime = 0;
+		windowSessions = 0;
+		windowPeakSessions = 0;
+	}
+
+	unsigned int getLimit() const {
+		return (unsigned int) limit;
+	}
+
+	/**
+	 * Records a finished session that took `duration` and that was one of
+	 * `concurrentSessions` open sessions. Returns whether getLimit() changed.
+	 */
+	bool recordSession(unsigned long long duration, unsigned int concurrentSessions) {
+		if (!isEnabled()) {
+			return false;
+		}
+
+		windowTotalTime += duration;
+		windowSessions++;
+		windowPeakSessions = std::max(windowPeakSessions, concurrentSessions);
+		if (windowSessions < WINDOW_SIZE) {
+			return false;
+		}
+
+		double averageTime = std::max<double>(
+			(double) windowTotalTime / windowSessions, 1);
+		bool limitUsed = windowPeakSessions * 2 >= getLimit();
+		windowTotalTime = 0;
+		windowSessions = 0;
+		windowPeakSessions = 0;
+
+		if (noLoadTime == 0 || averageTime < noLoadTime) {
+			noLoadTime = averageTime;
+		} else if (!limitUsed) {
+			// The process was lightly loaded, so let the estimate follow
+			// when its response times change for reasons other than load.
+			noLoadTime += (averageTime - noLoadTime) / 16;
+		}
+
+		double gradient = std::max(0.5, std::min(1.0, noLoadTime / averageTime));
+		double newLimit = limit * gradient + std::sqrt(limit);
+		if (!limitUsed) {
+			newLimit = std::min(newLimit, limit);
+		}
+		// Smooth the change so that a noisy window doesn't move it too much.
+		newLimit = limit * 0.8 + newLimit * 0.2;
+		newLimit = std::min<double>(std::max(newLimit, 1.0), maxLimit);
+
+		unsigned int oldLimit = getLimit();
+		limit = newLimit;
+		return getLimit() != oldLimit;
+	}
+};
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_CONCURRENCY_TUNER_H_ */
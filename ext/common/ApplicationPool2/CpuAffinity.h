@@ -0,0 +1,262 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_CPU_AFFINITY_H_
+#define _PASSENGER_APPLICATION_POOL2_CPU_AFFINITY_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+	#include <sched.h>
+#endif
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <StaticString.h>
+#include <Utils.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+
+
+/**
+ * Parses a CPU list in the format of the Linux kernel, e.g. "0-3,8,10-11",
+ * as used by the cpulist files in /sys/devices/system/node.
+ */
+inline vector<unsigned int>
+parseCpuList(const StaticString &str) {
+	vector<unsigned int> result;
+	vector<string> ranges;
+	vector<string>::const_iterator it;
+
+	split(strip(str), ',', ranges);
+	for (it = ranges.begin(); it != ranges.end(); it++) {
+		string::size_type pos = it->find('-');
+		if (it->empty()) {
+			continue;
+		} else if (pos == string::npos) {
+			result.push_back(atoi(*it));
+		} else {
+			unsigned int begin = atoi(it->substr(0, pos));
+			unsigned int end = atoi(it->substr(pos + 1));
+			for (unsigned int cpu = begin; cpu <= end; cpu++) {
+				result.push_back(cpu);
+			}
+		}
+	}
+	return result;
+}
+
+/** The inverse of parseCpuList(). */
+inline string
+cpuListToString(const vector<unsigned int> &cpus) {
+	string result;
+	unsigned int i = 0;
+
+	while (i < cpus.size()) {
+		unsigned int j = i;
+		while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+			j++;
+		}
+		if (!result.empty()) {
+			result.append(1, ',');
+		}
+		result.append(toString(cpus[i]));
+		if (j > i) {
+			result.append("-" + toString(cpus[j]));
+		}
+		i = j + 1;
+	}
+	return result;
+}
+
+/**
+ * Sets the CPU affinity of the given process (0 is the calling process) to
+ * the given CPUs. Does nothing if `cpus` is empty. Returns whether it
+ * succeeded; always fails on platforms other than Linux.
+ *
+ * Does not allocate memory, so it may be called between fork() and exec().
+ */
+inline bool
+applyCpuAffinity(pid_t pid, const vector<unsigned int> &cpus) {
+	if (cpus.empty()) {
+		return true;
+	}
+	#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int i = 0; i < cpus.size(); i++) {
+			if (cpus[i] < CPU_SETSIZE) {
+				CPU_SET(cpus[i], &set);
+			}
+		}
+		return sched_setaffinity(pid, sizeof(set), &set) == 0;
+	#else
+		return false;
+	#endif
+}
+
+
+/**
+ * The CPUs of the machine, grouped by NUMA node. On machines or platforms
+ * without NUMA information, all CPUs are in a single node.
+ */
+struct CpuTopology {
+	vector< vector<unsigned int> > nodes;
+
+	vector<unsigned int> allCpus() const {
+		vector<unsigned int> result;
+		for (unsigned int i = 0; i < nodes.size(); i++) {
+			result.insert(result.end(), nodes[i].begin(), nodes[i].end());
+		}
+		return result;
+	}
+
+	/** Returns the index of the node that contains the given CPU, or 0. */
+	unsigned int nodeOf(unsigned int cpu) const {
+		for (unsigned int i = 0; i < nodes.size(); i++) {
+			if (find(nodes[i].begin(), nodes[i].end(), cpu) != nodes[i].end()) {
+				return i;
+			}
+		}
+		return 0;
+	}
+
+	static CpuTopology detect() {
+		CpuTopology topology;
+		for (unsigned int i = 0; ; i++) {
+			string path = "/sys/devices/system/node/node" + toString(i) + "/cpulist";
+			if (!fileExists(path)) {
+				break;
+			}
+			vector<unsigned int> cpus = parseCpuList(readAll(path));
+			if (!cpus.empty()) {
+				topology.nodes.push_back(cpus);
+			}
+		}
+		if (topology.nodes.empty()) {
+			long count = sysconf(_SC_NPROCESSORS_ONLN);
+			topology.nodes.push_back(vector<unsigned int>());
+			for (long cpu = 0; cpu < std::max(count, 1l); cpu++) {
+				topology.nodes[0].push_back(cpu);
+			}
+		}
+		return topology;
+	}
+};
+
+
+/**
+ * Chooses the CPUs that a newly spawned process is pinned to, according to
+ * Options::cpuAffinity:
+ *
+ *  - "round-robin": one CPU per process, going round all CPUs.
+ *  - "numa-node": all CPUs of one NUMA node per group. The groups are
+ *    spread over the nodes round-robin.
+ *  - "agent": all CPUs of the NUMA node on which the HelperAgent thread
+ *    that spawns the process runs, so that the process's memory is close
+ *    to the agent that serves it.
+ *
+ * Anything else, or an empty value, means no pinning. Thread-safe.
+ */
+class CpuAffinityAllocator {
+private:
+	boost::mutex syncher;
+	bool detected;
+	CpuTopology topology;
+	unsigned int nextCpu;
+	unsigned int nextNode;
+	map<string, unsigned int> groupNodes;
+
+	void detectTopology() {
+		if (!detected) {
+			topology = CpuTopology::detect();
+			detected = true;
+		}
+	}
+
+public:
+	CpuAffinityAllocator() {
+		detected = false;
+		nextCpu = 0;
+		nextNode = 0;
+	}
+
+	/** Uses the given topology instead of the machine's. For unit tests. */
+	CpuAffinityAllocator(const CpuTopology &_topology)
+		: detected(true),
+		  topology(_topology),
+		  nextCpu(0),
+		  nextNode(0)
+		{ }
+
+	/** Returns the CPUs to pin the process to; empty means no pinning. */
+	vector<unsigned int> allocate(const StaticString &policy, const StaticString &groupName) {
+		#ifndef __linux__
+			return vector<unsigned int>();
+		#endif
+		if (policy != "round-robin" && policy != "numa-node" && policy != "agent") {
+			return vector<unsigned int>();
+		}
+
+		boost::lock_guard<boost::mutex> l(syncher);
+		detectTopology();
+		if (policy == "round-robin") {
+			vector<unsigned int> cpus = topology.allCpus();
+			return vector<unsigned int>(1, cpus[nextCpu++ % cpus.size()]);
+		} else if (policy == "numa-node") {
+			map<string, unsigned int>::iterator it = groupNodes.find(groupName.toString());
+			if (it == groupNodes.end()) {
+				it = groupNodes.insert(make_pair(groupName.toString(),
+					nextNode++ % topology.nodes.size())).first;
+			}
+			return topology.nodes[it->second];
+		} else {
+			#ifdef __linux__
+				int cpu = sched_getcpu();
+				if (cpu >= 0) {
+					return topology.nodes[topology.nodeOf(cpu)];
+				}
+			#endif
+			return topology.nodes[0];
+		}
+	}
+};
+
+typedef boost::shared_ptr<CpuAffinityAllocator> CpuAffinityAllocatorPtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_CPU_AFFINITY_H_ */
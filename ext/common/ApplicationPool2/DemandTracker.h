@@ -0,0 +1,202 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_DEMAND_TRACKER_H_
+#define _PASSENGER_APPLICATION_POOL2_DEMAND_TRACKER_H_
+
+#include <algorithm>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+
+/**
+ * Tracks the demand for the processes of a Group over a sliding window of
+ * one-second buckets: how many requests arrived, and the peak number of
+ * sessions that were open at the same time. Group uses this to spawn
+ * processes ahead of demand, instead of only when all of them are busy.
+ * The peak concurrency is also tracked over much longer windows, which
+ * the garbage collector scales the Group down toward.
+ *
+ * Timestamps are in microseconds. Not thread-safe; Group protects it in the
+ * same way as its session bookkeeping.
+ */
+class DemandTracker {
+public:
+	static const unsigned int BUCKETS = 10;
+	static const unsigned long long BUCKET_USEC = 1000000;
+
+private:
+	struct Bucket {
+		unsigned long long index;
+		unsigned int arrivals;
+		unsigned int peakSessions;
+	};
+
+	Bucket buckets[BUCKETS];
+	unsigned int activeSessions;
+	/** The peak concurrency in the current and in the previous long
+	 * window. See getSustainedPeakSessions(). */
+	unsigned int windowPeaks[2];
+	unsigned long long windowStart;
+
+	Bucket &currentBucket(unsigned long long now) {
+		unsigned long long index = now / BUCKET_USEC;
+		Bucket &bucket = buckets[index % BUCKETS];
+		if (bucket.index != index) {
+			bucket.index = index;
+			bucket.arrivals = 0;
+			bucket.peakSessions = activeSessions;
+		}
+		return bucket;
+	}
+
+	/** Returns the bucket `age` seconds before `now`, or NULL if nothing
+	 * was recorded during that second. */
+	const Bucket *bucketAt(unsigned long long now, unsigned int age) const {
+		unsigned long long index = now / BUCKET_USEC;
+		if (index < age) {
+			return NULL;
+		}
+		index -= age;
+		const Bucket &bucket = buckets[index % BUCKETS];
+		if (bucket.index == index) {
+			return &bucket;
+		} else {
+			return NULL;
+		}
+	}
+
+public:
+	DemandTracker() {
+		for (unsigned int i = 0; i < BUCKETS; i++) {
+			buckets[i].index = 0;
+			buckets[i].arrivals = 0;
+			buckets[i].peakSessions = 0;
+		}
+		activeSessions = 0;
+		windowPeaks[0] = 0;
+		windowPeaks[1] = 0;
+		windowStart = 0;
+	}
+
+	void recordArrival(unsigned long long now, unsigned int count = 1) {
+		currentBucket(now).arrivals += count;
+	}
+
+	void sessionOpened(unsigned long long now) {
+		activeSessions++;
+		Bucket &bucket = currentBucket(now);
+		bucket.peakSessions = std::max(bucket.peakSessions, activeSessions);
+		windowPeaks[0] = std::max(windowPeaks[0], activeSessions);
+	}
+
+	void sessionClosed() {
+		if (activeSessions > 0) {
+			activeSessions--;
+		}
+	}
+
+	unsigned int getActiveSessions() const {
+		return activeSessions;
+	}
+
+	/** The number of arrivals in the `count` seconds before the
+	 * `skip` most recent ones, including the current second. */
+	unsigned int getArrivals(unsigned long long now, unsigned int skip, unsigned int count) const {
+		unsigned int result = 0;
+		for (unsigned int i = skip; i < skip + count && i < BUCKETS; i++) {
+			const Bucket *bucket = bucketAt(now, i);
+			if (bucket != NULL) {
+				result += bucket->arrivals;
+			}
+		}
+		return result;
+	}
+
+	/** The peak number of concurrently open sessions in the `count`
+	 * most recent seconds, including the current one. */
+	unsigned int getPeakSessions(unsigned long long now, unsigned int count) const {
+		unsigned int result = activeSessions;
+		for (unsigned int i = 0; i < count && i < BUCKETS; i++) {
+			const Bucket *bucket = bucketAt(now, i);
+			if (bucket != NULL) {
+				result = std::max(result, bucket->peakSessions);
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * The peak number of concurrently open sessions in the current and the
+	 * previous window of `windowUsec`, i.e. over the past one to two windows.
+	 * A new window is started if the current one has ended, so the peak
+	 * only drops after demand has stayed lower for a full window. Windows
+	 * aren't advanced by anything else; if this isn't called for a while,
+	 * the current window simply lasts longer.
+	 */
+	unsigned int getSustainedPeakSessions(unsigned long long now, unsigned long long windowUsec) {
+		if (now >= windowStart + windowUsec) {
+			windowPeaks[1] = windowPeaks[0];
+			windowPeaks[0] = activeSessions;
+			windowStart = now;
+		}
+		return std::max(windowPeaks[0], windowPeaks[1]);
+	}
+
+	/** When the current long window ends. */
+	unsigned long long getSustainedPeakWindowEnd(unsigned long long windowUsec) const {
+		return windowStart + windowUsec;
+	}
+
+	/**
+	 * Projects how many sessions will be open at the same time in the near
+	 * future, given the average session duration. The demand over the most
+	 * recent half of the window is the larger of the observed peak concurrency
+	 * and the concurrency that the arrival rate implies (Little's law). It is
+	 * then extrapolated by how much the arrival rate grew compared to the
+	 * older half of the window, by at most a factor 2.
+	 */
+	double projectDemand(unsigned long long now, unsigned long long averageSessionUsec) const {
+		const unsigned int half = BUCKETS / 2;
+		unsigned int recent = getArrivals(now, 0, half);
+		unsigned int previous = getArrivals(now, half, half);
+		double demand = std::max<double>(getPeakSessions(now, half),
+			(double) recent * averageSessionUsec / (half * BUCKET_USEC));
+		double growth;
+
+		if (previous == 0) {
+			growth = (recent > 0) ? 2 : 1;
+		} else {
+			growth = std::min(2.0, std::max(1.0, (double) recent / previous));
+		}
+		return demand * growth;
+	}
+};
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_DEMAND_TRACKER_H_ */
@@ -109,9 +109,7 @@ private:
 		startBackgroundThread(detachProcessMain, (void *) (long) pid);
 	}
 	
-	vector<string> createCommand(const Options &options, const SpawnPreparationInfo &preparation,
-		shared_array<const char *> &args) const
-	{
+	vector<string> createCommand(const Options &options, const SpawnPreparationInfo &preparation) const {
 		vector<string> startCommandArgs;
 		string agentsDir = resourceLocator.getAgentsDir();
 		vector<string> command;
@@ -141,7 +139,6 @@ private:
 			command.push_back(startCommandArgs[i]);
 		}
 		
-		createCommandArgs(command, args);
 		return command;
 	}
 	
@@ -168,83 +165,64 @@ public:
 		P_DEBUG("Spawning new process: appRoot=" << options.appRoot);
 		possiblyRaiseInternalError(options);
 
-		shared_array<const char *> args;
 		SpawnPreparationInfo preparation = prepareSpawn(options);
-		vector<string> command = createCommand(options, preparation, args);
+		vector<string> command = createCommand(options, preparation);
 		SocketPair adminSocket = createUnixSocketPair();
 		Pipe errorPipe = createPipe();
 		DebugDirPtr debugDir = boost::make_shared<DebugDir>(preparation.uid, preparation.gid);
-		pid_t pid;
+		vector<unsigned int> cpus = config->cpuAffinityAllocator->allocate(
+			options.cpuAffinity, options.getAppGroupName());
 		
-		pid = syscalls::fork();
-		if (pid == 0) {
-			setenv("PASSENGER_DEBUG_DIR", debugDir->getPath().c_str(), 1);
-			purgeStdio(stdout);
-			purgeStdio(stderr);
-			resetSignalHandlersAndMask();
-			disableMallocDebugging();
-			int adminSocketCopy = dup2(adminSocket.first, 3);
-			int errorPipeCopy = dup2(errorPipe.second, 4);
-			dup2(adminSocketCopy, 0);
-			dup2(adminSocketCopy, 1);
-			dup2(errorPipeCopy, 2);
-			closeAllFileDescriptors(2);
-			setChroot(preparation);
-			switchUser(preparation);
-			setWorkingDirectory(preparation);
-			execvp(args[0], (char * const *) args.get());
-			
-			int e = errno;
-			printf("!> Error\n");
-			printf("!> \n");
-			printf("Cannot execute \"%s\": %s (errno=%d)\n", command[0].c_str(),
-				strerror(e), e);
-			fprintf(stderr, "Cannot execute \"%s\": %s (errno=%d)\n",
-				command[0].c_str(), strerror(e), e);
-			fflush(stdout);
-			fflush(stderr);
-			_exit(1);
-			
-		} else if (pid == -1) {
-			int e = errno;
-			throw SystemException("Cannot fork a new process", e);
-			
-		} else {
-			UPDATE_TRACE_POINT();
-			ScopeGuard guard(boost::bind(nonInterruptableKillAndWaitpid, pid));
-			P_DEBUG("Process forked for appRoot=" << options.appRoot << ": PID " << pid);
-			adminSocket.first.close();
-			errorPipe.second.close();
-			
-			NegotiationDetails details;
-			details.preparation = &preparation;
-			details.libev = libev;
-			details.stderrCapturer =
-				make_shared<BackgroundIOCapturer>(
-					errorPipe.first,
-					pid,
-					// The cast works around a compilation problem in Clang.
-					(const char *) "stderr");
-			details.stderrCapturer->start();
-			details.pid = pid;
-			details.adminSocket = adminSocket.second;
-			details.io = BufferedIO(adminSocket.second);
-			details.errorPipe = errorPipe.first;
-			details.options = &options;
-			details.debugDir = debugDir;
-			
-			ProcessPtr process;
-			{
-				this_thread::restore_interruption ri(di);
-				this_thread::restore_syscall_interruption rsi(dsi);
-				process = negotiateSpawn(details);
-			}
-			detachProcess(process->pid);
-			guard.clear();
-			P_DEBUG("Process spawning done: appRoot=" << options.appRoot <<
-				", pid=" << process->pid);
-			return process;
+		ExecPlan plan;
+		createExecCommand(plan, command);
+		plan.setenv("PASSENGER_DEBUG_DIR", debugDir->getPath());
+		plan.disableMallocDebugging();
+		plan.stdinFd = adminSocket.first;
+		plan.stdoutFd = adminSocket.first;
+		plan.stderrFd = errorPipe.second;
+		plan.cpus = cpus;
+		plan.cgroupProcsPath = config->cgroupManager->prepare(options);
+		applyPreparation(plan, preparation);
+
+		unsigned long long forkStartTime = SystemTime::getUsec();
+		pid_t pid = forkAndExec(plan);
+		
+		UPDATE_TRACE_POINT();
+		ScopeGuard guard(boost::bind(nonInterruptableKillAndWaitpid, pid));
+		P_DEBUG("Process forked for appRoot=" << options.appRoot << ": PID " << pid);
+		adminSocket.first.close();
+		errorPipe.second.close();
+		
+		NegotiationDetails details;
+		details.preparation = &preparation;
+		details.libev = libev;
+		details.stderrCapturer =
+			make_shared<BackgroundIOCapturer>(
+				errorPipe.first,
+				pid,
+				// The cast works around a compilation problem in Clang.
+				(const char *) "stderr");
+		details.stderrCapturer->start();
+		details.pid = pid;
+		details.adminSocket = adminSocket.second;
+		details.io = BufferedIO(adminSocket.second);
+		details.errorPipe = errorPipe.first;
+		details.options = &options;
+		details.debugDir = debugDir;
+		details.forkStartTime = forkStartTime;
+		
+		ProcessPtr process;
+		{
+			this_thread::restore_interruption ri(di);
+			this_thread::restore_syscall_interruption rsi(dsi);
+			process = negotiateSpawn(details);
 		}
+		process->cpuAffinity = cpuListToString(cpus);
+		detachProcess(process->pid);
+		guard.clear();
+		P_DEBUG("Process spawning done: appRoot=" << options.appRoot <<
+			", pid=" << process->pid);
+		return process;
 	}
 };
 
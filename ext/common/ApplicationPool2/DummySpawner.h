@@ -43,6 +43,7 @@ private:
 	
 public:
 	unsigned int cleanCount;
+	unsigned int prepareCount;
 	
 	DummySpawner(const ResourceLocator &resourceLocator, const SpawnerConfigPtr &_config)
 		: Spawner(resourceLocator),
@@ -50,6 +51,7 @@ public:
 	{
 		count = 0;
 		cleanCount = 0;
+		prepareCount = 0;
 	}
 	
 	virtual ProcessPtr spawn(const Options &options) {
@@ -72,6 +74,10 @@ public:
 		return process;
 	}
 
+	virtual void prepare() {
+		prepareCount++;
+	}
+
 	virtual bool cleanable() const {
 		return true;
 	}
@@ -0,0 +1,606 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_FORK_EXEC_H_
+#define _PASSENGER_APPLICATION_POOL2_FORK_EXEC_H_
+
+/*
+ * Starting a process with fork() copies the page tables of the parent, which
+ * takes time proportional to the parent's memory usage, and all other threads
+ * of the parent stall while that happens. The HelperAgent is large and heavily
+ * multithreaded, so forkAndExec() avoids that: on Linux the child is created
+ * with clone(CLONE_VM | CLONE_VFORK), i.e. it borrows the parent's address
+ * space until it calls exec(), just like posix_spawn() does.
+ *
+ * posix_spawn() itself can't be used because the child must chroot, switch
+ * user and change directory before exec()ing. Such a child may not touch any
+ * memory that the parent cares about, so everything it needs is computed in
+ * advance in an ExecPlan, and it only makes async-signal-safe system calls.
+ * On other platforms, or when the plan needs initgroups() (which isn't
+ * async-signal-safe), the same child code runs after a regular fork().
+ */
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <boost/shared_array.hpp>
+#include <oxt/system_calls.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#ifdef __linux__
+	#include <sched.h>
+	#include <sys/syscall.h>
+#endif
+#include <ApplicationPool2/CpuAffinity.h>
+#include <Exceptions.h>
+#include <Utils.h>
+#include <Utils/StrIntUtils.h>
+
+extern "C" {
+	extern char **environ;
+}
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+using namespace oxt;
+
+
+/**
+ * Describes everything that the child process created by forkAndExec() does
+ * before it calls exec().
+ */
+struct ExecPlan {
+	/** The executable. It's searched for in $PATH, like execvp() does,
+	 * if it doesn't contain a slash. */
+	string program;
+	/** The argument vector, including argv[0]. */
+	vector<string> args;
+	/** The complete environment of the new process, as "NAME=value" strings.
+	 * Initialized with a copy of the current environment. */
+	vector<string> env;
+	/** The file descriptors that become the child's stdin, stdout and stderr.
+	 * All other file descriptors are closed. Errors that happen before exec()
+	 * are reported on stdout in the "!> Error" spawn protocol format. */
+	int stdinFd, stdoutFd, stderrFd;
+	vector<unsigned int> cpus;
+	/** The cgroup.procs file of the cgroup that the child joins, see
+	 * CgroupManager. Empty = stay in the parent's cgroup. */
+	string cgroupProcsPath;
+
+	/** Absolute chroot path, or "/" for none. */
+	string chrootDir;
+
+	bool switchUser;
+	string username;
+	string groupname;
+	uid_t uid;
+	gid_t gid;
+	/** The supplementary groups. If not set, initgroups() is used. */
+	int ngroups;
+	boost::shared_array<gid_t> gidset;
+
+	/** Directories that must be accessible after the chroot, the last of which
+	 * becomes the working directory. If empty, the working directory isn't changed. */
+	vector<string> workingDirectoryPaths;
+	/** Same as workingDirectoryPaths, but outside the chroot; used in error messages. */
+	vector<string> workingDirectoryPathsOutsideChroot;
+
+	ExecPlan()
+		: stdinFd(0),
+		  stdoutFd(1),
+		  stderrFd(2),
+		  chrootDir("/"),
+		  switchUser(false),
+		  uid(0),
+		  gid(0),
+		  ngroups(-1)
+	{
+		for (char **var = environ; *var != NULL; var++) {
+			env.push_back(*var);
+		}
+	}
+
+	void setenv(const StaticString &name, const StaticString &value) {
+		unsetenv(name);
+		env.push_back(name + "=" + value);
+	}
+
+	void unsetenv(const StaticString &name) {
+		vector<string>::iterator it = env.begin();
+		while (it != env.end()) {
+			if (it->size() > name.size()
+			 && (*it)[name.size()] == '='
+			 && memcmp(it->data(), name.data(), name.size()) == 0)
+			{
+				it = env.erase(it);
+			} else {
+				it++;
+			}
+		}
+	}
+
+	const char *getenv(const StaticString &name) const {
+		vector<string>::const_iterator it;
+		for (it = env.begin(); it != env.end(); it++) {
+			if (it->size() > name.size()
+			 && (*it)[name.size()] == '='
+			 && memcmp(it->data(), name.data(), name.size()) == 0)
+			{
+				return it->c_str() + name.size() + 1;
+			}
+		}
+		return NULL;
+	}
+
+	/** Removes the malloc debugging variables, like disableMallocDebugging() does. */
+	void disableMallocDebugging() {
+		static const char * const names[] = {
+			"MALLOC_FILL_SPACE", "MALLOC_PROTECT_BEFORE", "MallocGuardEdges",
+			"MallocScribble", "MallocPreScribble", "MallocCheckHeapStart",
+			"MallocCheckHeapEach", "MallocCheckHeapAbort", "MallocBadFreeAbort",
+			"MALLOC_CHECK_", NULL
+		};
+		for (unsigned int i = 0; names[i] != NULL; i++) {
+			unsetenv(names[i]);
+		}
+
+		const char *libs = getenv("DYLD_INSERT_LIBRARIES");
+		if (libs != NULL) {
+			vector<string> components;
+			string newLibs;
+			split(libs, ':', components);
+			for (unsigned int i = 0; i < components.size(); i++) {
+				if (!components[i].empty() && components[i] != "/usr/lib/libgmalloc.dylib") {
+					if (!newLibs.empty()) {
+						newLibs.append(1, ':');
+					}
+					newLibs.append(components[i]);
+				}
+			}
+			if (newLibs.empty()) {
+				unsetenv("DYLD_INSERT_LIBRARIES");
+			} else if (newLibs != libs) {
+				setenv("DYLD_INSERT_LIBRARIES", newLibs);
+			}
+		}
+	}
+};
+
+
+namespace ForkExecInternal {
+	/** The ExecPlan in the form of C data structures that the child can use as-is. */
+	struct ChildContext {
+		const ExecPlan *plan;
+		vector<const char *> argv;
+		vector<const char *> envp;
+		/** Paths to try exec()ing, in order. */
+		vector<string> candidates;
+		bool forked;
+		int maxFd;
+		/** Signals that had a handler in the parent. */
+		vector<int> caughtSignals;
+	};
+
+	/** Async-signal-safe message formatting. */
+	class ErrorMessage {
+	private:
+		char buf[4096];
+		size_t size;
+
+	public:
+		ErrorMessage() {
+			size = 0;
+		}
+
+		ErrorMessage &operator<<(const char *str) {
+			size_t len = strlen(str);
+			if (len > sizeof(buf) - size) {
+				len = sizeof(buf) - size;
+			}
+			memcpy(buf + size, str, len);
+			size += len;
+			return *this;
+		}
+
+		ErrorMessage &operator<<(const string &str) {
+			return *this << str.c_str();
+		}
+
+		ErrorMessage &operator<<(int value) {
+			char tmp[16];
+			char *pos = tmp + sizeof(tmp);
+			unsigned int u = (value < 0) ? -value : value;
+			*--pos = '\0';
+			do {
+				*--pos = '0' + u % 10;
+				u /= 10;
+			} while (u > 0);
+			if (value < 0) {
+				*--pos = '-';
+			}
+			return *this << (const char *) pos;
+		}
+
+		void writeTo(int fd) const {
+			size_t written = 0;
+			while (written < size) {
+				ssize_t ret = write(fd, buf + written, size - written);
+				if (ret == -1 && errno == EINTR) {
+					continue;
+				} else if (ret <= 0) {
+					break;
+				}
+				written += ret;
+			}
+		}
+	};
+
+	inline void
+	reportError(const ErrorMessage &message) {
+		ErrorMessage header;
+		header << "!> Error\n" << "!> \n";
+		header.writeTo(1);
+		message.writeTo(1);
+	}
+
+	inline void
+	resetSignals(const ChildContext *ctx) {
+		// The handlers must be reset before the signals are unblocked: in
+		// vfork mode the parent's handlers would run on the parent's memory.
+		static const int defaultSignals[] = {
+			SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGTRAP, SIGABRT, SIGFPE, SIGBUS,
+			SIGSEGV, SIGSYS, SIGPIPE, SIGALRM, SIGTERM, SIGURG, SIGTSTP,
+			SIGCONT, SIGCHLD, SIGUSR1, SIGUSR2
+		};
+		struct sigaction action;
+		sigset_t signalSet;
+
+		action.sa_handler = SIG_DFL;
+		action.sa_flags   = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		for (unsigned int i = 0; i < sizeof(defaultSignals) / sizeof(int); i++) {
+			sigaction(defaultSignals[i], &action, NULL);
+		}
+		#ifdef SIGEMT
+			sigaction(SIGEMT, &action, NULL);
+		#endif
+		#ifdef SIGINFO
+			sigaction(SIGINFO, &action, NULL);
+		#endif
+		for (unsigned int i = 0; i < ctx->caughtSignals.size(); i++) {
+			sigaction(ctx->caughtSignals[i], &action, NULL);
+		}
+
+		sigemptyset(&signalSet);
+		sigprocmask(SIG_SETMASK, &signalSet, NULL);
+	}
+
+	inline bool
+	setupFileDescriptors(const ChildContext *ctx) {
+		const ExecPlan *plan = ctx->plan;
+		int fds[3];
+
+		// Move them out of the way first, in case one of them is 0, 1 or 2.
+		fds[0] = fcntl(plan->stdinFd, F_DUPFD, 3);
+		fds[1] = fcntl(plan->stdoutFd, F_DUPFD, 3);
+		fds[2] = fcntl(plan->stderrFd, F_DUPFD, 3);
+		if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1) {
+			return false;
+		}
+		for (int i = 0; i < 3; i++) {
+			if (dup2(fds[i], i) == -1) {
+				return false;
+			}
+		}
+
+		#if defined(__linux__) && defined(SYS_close_range)
+			if (syscall(SYS_close_range, 3, ~0U, 0) == 0) {
+				return true;
+			}
+		#endif
+		if (ctx->forked) {
+			closeAllFileDescriptors(2);
+		} else {
+			for (int fd = 3; fd < ctx->maxFd; fd++) {
+				close(fd);
+			}
+		}
+		return true;
+	}
+
+	inline void
+	switchUser(const ChildContext *ctx) {
+		const ExecPlan *plan = ctx->plan;
+		int e;
+
+		if (plan->ngroups >= 0) {
+			if (setgroups(plan->ngroups, plan->gidset.get()) == -1) {
+				e = errno;
+				reportError(ErrorMessage() << "setgroups(" << plan->ngroups <<
+					", ...) failed: " << strerror(e) << " (errno=" << e << ")\n");
+				_exit(1);
+			}
+		} else if (initgroups(plan->username.c_str(), plan->gid) == -1) {
+			e = errno;
+			reportError(ErrorMessage() << "initgroups() failed: " <<
+				strerror(e) << " (errno=" << e << ")\n");
+			_exit(1);
+		}
+		if (setgid(plan->gid) == -1) {
+			e = errno;
+			reportError(ErrorMessage() << "setgid() failed: " <<
+				strerror(e) << " (errno=" << e << ")\n");
+			_exit(1);
+		}
+		if (setuid(plan->uid) == -1) {
+			e = errno;
+			reportError(ErrorMessage() << "setuid() failed: " <<
+				strerror(e) << " (errno=" << e << ")\n");
+			_exit(1);
+		}
+	}
+
+	inline void
+	setWorkingDirectory(const ChildContext *ctx) {
+		const ExecPlan *plan = ctx->plan;
+		const vector<string> &paths = plan->workingDirectoryPaths;
+		const string &appRoot = plan->workingDirectoryPathsOutsideChroot.back();
+		int ret, e;
+
+		for (unsigned int i = 0; i < paths.size(); i++) {
+			struct stat buf;
+			ret = stat(paths[i].c_str(), &buf);
+			if (ret == -1 && errno == EACCES) {
+				char parent[PATH_MAX];
+				const char *end = strrchr(paths[i].c_str(), '/');
+				size_t len = end - paths[i].c_str();
+				if (len >= sizeof(parent)) {
+					len = sizeof(parent) - 1;
+				}
+				memcpy(parent, paths[i].c_str(), len);
+				parent[len] = '\0';
+
+				reportError(ErrorMessage() <<
+					"This web application process is being run as user '" << plan->username <<
+					"' and group '" << plan->groupname << "' "
+					"and must be able to access its application root directory '" << appRoot << "'. "
+					"However, the parent directory '" << parent << "' has wrong permissions, thereby "
+					"preventing this process from accessing its application root directory. "
+					"Please fix the permissions of the directory '" << parent << "' first.\n");
+				_exit(1);
+			} else if (ret == -1) {
+				e = errno;
+				reportError(ErrorMessage() << "Unable to stat() directory '" << paths[i] <<
+					"': " << strerror(e) << " (errno=" << e << ")\n");
+				_exit(1);
+			}
+		}
+
+		ret = chdir(paths.back().c_str());
+		if (ret == -1 && errno == EACCES) {
+			reportError(ErrorMessage() <<
+				"This web application process is being run as user '" << plan->username <<
+				"' and group '" << plan->groupname << "' "
+				"and must be able to access its application root directory '" << appRoot << "'. "
+				"However this directory is not accessible because it has wrong permissions. "
+				"Please fix these permissions first.\n");
+			_exit(1);
+		} else if (ret == -1) {
+			e = errno;
+			reportError(ErrorMessage() << "Unable to change working directory to '" <<
+				paths.back() << "': " << strerror(e) << " (errno=" << e << ")\n");
+			_exit(1);
+		}
+	}
+
+	/** Runs in the child. May only call async-signal-safe functions. */
+	inline int
+	childMain(void *arg) {
+		const ChildContext *ctx = (const ChildContext *) arg;
+		const ExecPlan *plan = ctx->plan;
+		int e;
+
+		resetSignals(ctx);
+		if (!setupFileDescriptors(ctx)) {
+			_exit(1);
+		}
+		applyCpuAffinity(0, plan->cpus);
+		if (!plan->cgroupProcsPath.empty()) {
+			// Failure is ignored, like a failure to set the CPU affinity.
+			int fd = open(plan->cgroupProcsPath.c_str(), O_WRONLY);
+			if (fd != -1) {
+				write(fd, "0", 1);
+				close(fd);
+			}
+		}
+		if (plan->chrootDir != "/" && chroot(plan->chrootDir.c_str()) == -1) {
+			e = errno;
+			(ErrorMessage() << "Cannot chroot() to '" << plan->chrootDir << "': " <<
+				strerror(e) << " (errno=" << e << ")\n").writeTo(2);
+			_exit(1);
+		}
+		if (plan->switchUser) {
+			switchUser(ctx);
+		}
+		if (!plan->workingDirectoryPaths.empty()) {
+			setWorkingDirectory(ctx);
+		}
+
+		e = ENOENT;
+		for (unsigned int i = 0; i < ctx->candidates.size(); i++) {
+			execve(ctx->candidates[i].c_str(), (char * const *) &ctx->argv[0],
+				(char * const *) &ctx->envp[0]);
+			// Like execvp(), keep looking after EACCES but report it
+			// if nothing else is found.
+			if (errno == EACCES) {
+				e = EACCES;
+			} else if (errno != ENOENT && errno != ENOTDIR) {
+				e = errno;
+				break;
+			}
+		}
+
+		ErrorMessage message;
+		message << "Cannot execute \"" << plan->program << "\": " <<
+			strerror(e) << " (errno=" << e << ")\n";
+		reportError(message);
+		message.writeTo(2);
+		_exit(1);
+		return 1;
+	}
+
+	inline void
+	prepareChildContext(ChildContext &ctx, const ExecPlan &plan) {
+		const string &command = plan.program;
+
+		ctx.plan = &plan;
+		for (unsigned int i = 0; i < plan.args.size(); i++) {
+			ctx.argv.push_back(plan.args[i].c_str());
+		}
+		ctx.argv.push_back(NULL);
+		for (unsigned int i = 0; i < plan.env.size(); i++) {
+			ctx.envp.push_back(plan.env[i].c_str());
+		}
+		ctx.envp.push_back(NULL);
+
+		if (command.find('/') != string::npos) {
+			ctx.candidates.push_back(command);
+		} else {
+			// The directories are resolved after the chroot, by the child.
+			const char *path = plan.getenv("PATH");
+			vector<string> dirs;
+			split((path == NULL) ? "/bin:/usr/bin" : path, ':', dirs);
+			for (unsigned int i = 0; i < dirs.size(); i++) {
+				if (dirs[i].empty()) {
+					ctx.candidates.push_back(command);
+				} else {
+					ctx.candidates.push_back(dirs[i] + "/" + command);
+				}
+			}
+		}
+
+		for (int sig = 1; sig < NSIG; sig++) {
+			struct sigaction action;
+			if (sigaction(sig, NULL, &action) == 0
+			 && action.sa_handler != SIG_DFL
+			 && action.sa_handler != SIG_IGN)
+			{
+				ctx.caughtSignals.push_back(sig);
+			}
+		}
+
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+		 && limit.rlim_cur <= 65536)
+		{
+			ctx.maxFd = limit.rlim_cur;
+		} else {
+			ctx.maxFd = -1;
+		}
+	}
+
+	#ifdef __linux__
+		inline bool
+		canUseVfork(const ChildContext &ctx) {
+			if (ctx.plan->switchUser && ctx.plan->ngroups < 0) {
+				// initgroups() reads /etc/group.
+				return false;
+			}
+			#ifdef SYS_close_range
+				return true;
+			#else
+				return ctx.maxFd != -1;
+			#endif
+		}
+	#endif
+}
+
+
+/**
+ * Starts a child process according to the given plan and returns its PID.
+ * Failures that happen in the child are reported to the child's stdout and
+ * stderr, not thrown.
+ *
+ * @throws SystemException The child process could not be created.
+ */
+inline pid_t
+forkAndExec(const ExecPlan &plan) {
+	using namespace ForkExecInternal;
+	ChildContext ctx;
+	pid_t pid;
+
+	prepareChildContext(ctx, plan);
+
+	#ifdef __linux__
+		if (canUseVfork(ctx)) {
+			const size_t stackSize = 128 * 1024;
+			boost::shared_array<char> stack(new char[stackSize]);
+			sigset_t allSignals, oldSignals;
+			int e;
+
+			ctx.forked = false;
+			// Until the child has reset its signal handlers, no handler
+			// may run in it.
+			sigfillset(&allSignals);
+			pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+			pid = clone(childMain,
+				// The stack grows downwards.
+				(void *) (((unsigned long) (stack.get() + stackSize)) & ~15UL),
+				CLONE_VM | CLONE_VFORK | SIGCHLD,
+				&ctx);
+			e = errno;
+			pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+			if (pid == -1) {
+				throw SystemException("Cannot create a new process", e);
+			}
+			return pid;
+		}
+	#endif
+
+	ctx.forked = true;
+	pid = syscalls::fork();
+	if (pid == 0) {
+		childMain(&ctx);
+		_exit(1);
+	} else if (pid == -1) {
+		int e = errno;
+		throw SystemException("Cannot fork a new process", e);
+	}
+	return pid;
+}
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_FORK_EXEC_H_ */
@@ -34,6 +34,7 @@
 #include <boost/foreach.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/atomic.hpp>
 #include <oxt/macros.hpp>
 #include <oxt/thread.hpp>
 #include <oxt/dynamic_thread_group.hpp>
@@ -41,14 +42,20 @@
 #include <cassert>
 #include <ApplicationPool2/Common.h>
 #include <ApplicationPool2/ComponentInfo.h>
+#include <ApplicationPool2/DemandTracker.h>
+#include <ApplicationPool2/QueueWaitTracker.h>
 #include <ApplicationPool2/SpawnerFactory.h>
 #include <ApplicationPool2/Process.h>
 #include <ApplicationPool2/Options.h>
 #include <Hooks.h>
+#include <DTraceSupport.h>
 #include <Utils.h>
 #include <Utils/CachedFileStat.hpp>
 #include <Utils/FileChangeChecker.h>
+#include <Utils/FileChangeWatcher.h>
 #include <Utils/SmallVector.h>
+#include <Utils/HashMap.h>
+#include <Utils/MetricsRegistry.h>
 
 namespace Passenger {
 namespace ApplicationPool2 {
@@ -70,6 +77,7 @@ private:
 	struct GetAction {
 		GetCallback callback;
 		SessionPtr session;
+		ExceptionPtr exception;
 	};
 	
 	struct DisableWaiter {
@@ -136,6 +144,13 @@ private:
 	FileChangeChecker fileChangeChecker;
 	string restartFile;
 	string alwaysRestartFile;
+	/** Notifies us about changes in the directory of the restart files.
+	 * While it's active and stat throttling is enabled, needsRestart() only
+	 * stat()s them after a notification. May be NULL, e.g. if the directory
+	 * doesn't exist. */
+	FileChangeWatcher::WatchPtr restartFileWatch;
+	/** Whether alwaysRestartFile existed when it was last stat()ed. */
+	bool alwaysRestartFileExists;
 
 	/** Number of times a restart has been initiated so far. This is incremented immediately
 	 * in Group::restart(), and is used to abort the restarter thread that was active at the
@@ -150,7 +165,16 @@ private:
 	 */
 	short processesBeingSpawned;
 	/**
-	 * Whether the spawner thread is currently working. Note that even
+	 * The number of spawner threads that are currently working. There are
+	 * at most `options.maxConcurrentSpawns` of them, each spawning one
+	 * process at a time.
+	 *
+	 * Invariant:
+	 *     m_spawning == (spawnThreadCount > 0)
+	 */
+	unsigned int spawnThreadCount;
+	/**
+	 * Whether a spawner thread is currently working. Note that even
 	 * if it's working, it doesn't necessarily mean that processes are
 	 * being spawned (i.e. that processesBeingSpawned > 0). After the
 	 * thread is done spawning a process, it will attempt to attach
@@ -158,6 +182,9 @@ private:
 	 * technically spawning anything.
 	 */
 	bool m_spawning;
+	/** Whether the standby spawner thread is currently working on a process
+	 * for `standbyProcesses`. Reset by restart(). */
+	bool standbySpawning;
 	/** Whether a non-rolling restart is in progress (i.e. whether spawnThreadRealMain()
 	 * is at work). While it is in progress, it is not possible to signal the desire to
 	 * spawn new process. If spawning was already in progress when the restart was initiated,
@@ -169,15 +196,60 @@ private:
 	 *    if m_restarting: processesBeingSpawned == 0
 	 */
 	bool m_restarting;
+	/** Set by tryGetFast() when it notices that the group must be restarted,
+	 * which it can't do by itself. The next get() performs the restart. */
+	bool restartPending;
+	/**
+	 * The processes that the current rolling restart still has to replace,
+	 * i.e. that were around when it started. They keep serving requests until
+	 * a new process has been attached in their place. Some of them may have
+	 * been detached for other reasons in the mean time; those are skipped.
+	 * Empty unless a rolling restart is in progress.
+	 */
+	ProcessList outdatedProcesses;
+	/** Whether a rolling restart is waiting for its new spawner to be created.
+	 * Nothing may be spawned in the mean time, because it'd be spawned with
+	 * the old spawner. */
+	bool rollingRestartPreparing;
+	/** How many replacements the current rolling restart may spawn at the
+	 * same time, on top of the process limits. See `options.maxSurge`. */
+	unsigned int rollingRestartSurge;
+	/** The number of outdated processes that the current rolling restart
+	 * retired before their replacements were ready, and that still have to be
+	 * replaced. See `options.maxUnavailable`. */
+	unsigned int rollingRestartUnavailable;
+	/**
+	 * The number of spawns that failed in a row. Once it reaches
+	 * SPAWN_FAILURE_THRESHOLD, the group stops spawning until
+	 * `spawnBackoffUntil` (monotonic microseconds), and get() fails requests
+	 * that have no process to go to right away with `lastSpawnException`.
+	 * After that, one spawn at a time is attempted; the counter is reset
+	 * when one succeeds, or by restart().
+	 */
+	unsigned int consecutiveSpawnFailures;
+	unsigned long long spawnBackoffUntil;
+	ExceptionPtr lastSpawnException;
+	/**
+	 * Protects the session bookkeeping of this group, i.e. `pqueue` and the
+	 * session counters of its processes, while the pool lock is only held in
+	 * shared mode. Not needed when holding the pool lock exclusively, since
+	 * that excludes all shared holders.
+	 */
+	boost::mutex sessionSyncher;
 
 	/** Contains the spawn loop thread and the restarter thread. */
 	dynamic_thread_group interruptableThreads;
 
-	/** This timer scans `detachedProcesses` periodically to see
-	 * whether any of the Processes can be shut down.
+	/**
+	 * `detachedProcesses` are checked on the pool's event loop, whenever
+	 * something happens that may let them proceed with shutting down: a
+	 * process is detached, its last session is closed, it exits (see
+	 * ProcessExitWatcher) or its shutdown timeout expires. These tell
+	 * whether a check has been scheduled with runLater(), and when the next
+	 * timed check is due (monotonic microseconds, 0 if none).
 	 */
-	bool detachedProcessesCheckerActive;
-	boost::condition_variable detachedProcessesCheckerCond;
+	bool detachedProcessesCheckScheduled;
+	unsigned long long detachedProcessesCheckTime;
 	Callback shutdownCallback;
 	GroupPtr selfPointer;
 	
@@ -188,18 +260,24 @@ private:
 		process->getGroup()->onSessionInitiateFailure(process, session);
 	}
 
-	static void _onSessionClose(Session *session) {
-		ProcessPtr process = session->getProcess();
-		assert(process != NULL);
-		process->getGroup()->onSessionClose(process, session);
-	}
+	static void _onSessionClose(Session *session);
 	
 	static string generateSecret(const SuperGroupPtr &superGroup);
 	void onSessionInitiateFailure(const ProcessPtr &process, Session *session);
-	void onSessionClose(const ProcessPtr &process, Session *session);
+	void onSessionClose(const ProcessPtr &process, Socket *socket,
+		unsigned long long startTime);
+	bool processSessionClose(const ProcessPtr &process, Socket *socket,
+		unsigned long long startTime, bool used, vector<Callback> &postLockActions);
+	void recallSessionLeases();
+	bool canCloseSessionQuickly(const ProcessPtr &process, const PoolPtr &pool) const;
 
 	/** Returns whether it is allowed to perform a new OOBW in this group. */
 	bool oobwAllowed() const;
+	/** Returns whether OOBW may be started now, as opposed to continued after
+	 * the process has been disabled. See initiateOobw(). */
+	bool oobwMayStartNow() const;
+	/** Returns whether any enabled process requests OOBW that hasn't started yet. */
+	bool oobwRequested() const;
 	/** Returns whether a new OOBW should be initiated for this process. */
 	bool shouldInitiateOobw(const ProcessPtr &process) const;
 	void maybeInitiateOobw(const ProcessPtr &process);
@@ -207,26 +285,47 @@ private:
 	void initiateOobw(const ProcessPtr &process);
 	void spawnThreadOOBWRequest(GroupPtr self, ProcessPtr process);
 	void initiateNextOobwRequest();
+	/** Sends the warmup requests in options.warmupUrls to a newly spawned process,
+	 * before it is attached. */
+	void warmUpProcess(const ProcessPtr &process, const Options &options);
 
 	void spawnThreadMain(GroupPtr self, SpawnerPtr spawner, Options options,
 		unsigned int restartsInitiated);
 	void spawnThreadRealMain(const SpawnerPtr &spawner, const Options &options,
 		unsigned int restartsInitiated);
+	void standbySpawnThreadMain(GroupPtr self, SpawnerPtr spawner, Options options,
+		unsigned int restartsInitiated);
+	void beginRollingRestart(vector<Callback> &postLockActions);
+	void startReplacingOutdatedProcesses(vector<Callback> &postLockActions);
+	unsigned int determineRollingRestartSurge() const;
 	void finalizeRestart(GroupPtr self, Options options, RestartMethod method,
-		SpawnerFactoryPtr spawnerFactory, unsigned int restartsInitiated,
-		vector<Callback> postLockActions);
-	void startCheckingDetachedProcesses(bool immediately);
-	void detachedProcessesCheckerMain(GroupPtr self);
+		bool prepareSpawner, SpawnerFactoryPtr spawnerFactory,
+		unsigned int restartsInitiated, vector<Callback> postLockActions);
+	void startCheckingDetachedProcesses();
+	void scheduleDetachedProcessesCheck(unsigned int timeout);
+	void onDetachedProcessesCheckTimeout(GroupPtr self, unsigned long long time);
+	static void onDetachedProcessExited(boost::weak_ptr<Group> weakSelf);
+	void checkDetachedProcesses(GroupPtr self);
 	void wakeUpGarbageCollector();
 	bool poolAtFullCapacity() const;
+	bool cpuPressureTooHigh() const;
+	bool poolSpawnConcurrencyLimitReached() const;
+	void indexProcess(const ProcessPtr &process);
+	void unindexProcess(const ProcessPtr &process);
+	void indexIdleProcess(Process *process);
+	void unindexIdleProcess(Process *process);
 	bool anotherGroupIsWaitingForCapacity() const;
 	boost::shared_ptr<Group> findOtherGroupWaitingForCapacity() const;
 	ProcessPtr poolForceFreeCapacity(const Group *exclude, vector<Callback> &postLockActions);
+	bool capacityShareReached() const;
+	bool belowGuaranteedCapacity() const;
 	bool testOverflowRequestQueue() const;
 	const ResourceLocator &getResourceLocator() const;
 	void runAttachHooks(const ProcessPtr process) const;
 	void runDetachHooks(const ProcessPtr process) const;
 	void setupAttachOrDetachHook(const ProcessPtr process, HookScriptOptions &options) const;
+	void journalAttachedProcess(const ProcessPtr &process) const;
+	void journalDetachedProcess(const ProcessPtr &process) const;
 
 	void verifyInvariants() const {
 		// !a || b: logical equivalent of a IMPLIES b.
@@ -250,6 +349,8 @@ private:
 
 		// Verify processesBeingSpawned, m_spawning and m_restarting.
 		assert(!( processesBeingSpawned > 0 ) || ( m_spawning ));
+		assert(m_spawning == (spawnThreadCount > 0));
+		assert((unsigned int) processesBeingSpawned <= spawnThreadCount);
 		assert(!( m_restarting ) || ( processesBeingSpawned == 0 ));
 
 		// Verify lifeStatus.
@@ -337,6 +438,20 @@ private:
 		options.minProcesses     = other.minProcesses;
 		options.statThrottleRate = other.statThrottleRate;
 		options.maxPreloaderIdleTime = other.maxPreloaderIdleTime;
+		options.spawnAheadUtilization = other.spawnAheadUtilization;
+		options.maxTunedConcurrency = other.maxTunedConcurrency;
+		options.maxOutOfBandWorkPercentage = other.maxOutOfBandWorkPercentage;
+		options.outOfBandWorkInterval = other.outOfBandWorkInterval;
+		options.maxConcurrentSpawns = other.maxConcurrentSpawns;
+		options.standbyProcesses = other.standbyProcesses;
+		options.rollingRestart   = other.rollingRestart;
+		options.maxSurge         = other.maxSurge;
+		options.maxUnavailable   = other.maxUnavailable;
+		options.memoryLimit = other.memoryLimit;
+		options.memoryLimitOobw = other.memoryLimitOobw;
+		options.capacityWeight = other.capacityWeight;
+		options.guaranteedCapacity = other.guaranteedCapacity;
+		options.maxCapacityShare = other.maxCapacityShare;
 	}
 	
 	static void runAllActions(const vector<Callback> &actions) {
@@ -404,44 +519,214 @@ private:
 		}
 	}
 
+	/**
+	 * The priority by which `pqueue` orders the given process: its busyness,
+	 * or in latency-aware routing mode its expected latency.
+	 */
+	int routingPriority(const Process *process) const {
+		if (options.latencyAwareRouting) {
+			return process->expectedLatency();
+		} else {
+			return process->busyness();
+		}
+	}
+
+	/**
+	 * Repositions an enabled process in `pqueue` after a session has been
+	 * closed. In latency-aware routing mode the priority may go up as well
+	 * as down, because the response time average changes too.
+	 */
+	void updateRoutingPriority(Process *process) {
+		process->pqHandle = pqueue.update(process->pqHandle, routingPriority(process));
+	}
+
+	/**
+	 * Changes the concurrency of the given process at runtime, and assigns
+	 * sessions to get waiters if that has made new capacity available.
+	 * Automatic tuning, if enabled, continues from the new value.
+	 *
+	 * @pre The pool lock is held exclusively.
+	 */
+	void setProcessConcurrency(const ProcessPtr &process, int concurrency,
+		vector<Callback> &postLockActions)
+	{
+		P_DEBUG("Changing concurrency of process " << process->inspect() <<
+			" to " << concurrency);
+		process->setConcurrency(concurrency);
+		if (process->concurrencyTuner.isEnabled()) {
+			process->concurrencyTuner.reset(process->concurrency);
+		}
+		if (process->enabled == Process::ENABLED) {
+			updateRoutingPriority(process.get());
+			if (!getWaitlist.empty()) {
+				assignSessionsToGetWaiters(postLockActions);
+			}
+		}
+	}
+
 	SessionPtr newSession(Process *process) {
 		SessionPtr session = process->newSession();
 		session->onInitiateFailure = _onSessionInitiateFailure;
 		session->onClose   = _onSessionClose;
+		if (process->sessions == 1) {
+			unindexIdleProcess(process);
+		}
+		demand.sessionOpened(process->lastUsed);
+		sessionsMetric->increment();
+		sessionsTotalMetric->increment();
 		if (process->enabled == Process::ENABLED) {
 			if (process == pqueue.top()) {
 				pqueue.pop();
 			} else {
 				pqueue.erase(process->pqHandle);
 			}
-			process->pqHandle = pqueue.push(process, process->busyness());
+			process->pqHandle = pqueue.push(process, routingPriority(process));
 		}
 		return session;
 	}
 
+	/**
+	 * Returns the index of the waiter that is rejected first when the
+	 * request queue overflows: the most recently queued one among those
+	 * with the lowest priority.
+	 */
+	unsigned int findGetWaiterToShed() const {
+		unsigned int result = getWaitlist.size() - 1;
+		for (unsigned int i = getWaitlist.size() - 1; i > 0; i--) {
+			if (getWaitlist[i - 1].options.requestPriority
+				< getWaitlist[result].options.requestPriority)
+			{
+				result = i - 1;
+			}
+		}
+		return result;
+	}
+
+	/** @pre !getWaitlist.empty() */
+	unsigned long long oldestGetWaiterEnqueueTime() const {
+		unsigned long long result = getWaitlist.front().enqueueTime;
+		for (unsigned int i = 1; i < getWaitlist.size(); i++) {
+			result = std::min(result, getWaitlist[i].enqueueTime);
+		}
+		return result;
+	}
+
+	/** Call after adding waiters to, or removing them from, `getWaitlist`. */
+	void getWaitlistChanged() {
+		queueDepthMetric->set(getWaitlist.size());
+		hasGetWaiters.store(!getWaitlist.empty(), boost::memory_order_relaxed);
+	}
+
+	/** Called when a waiter is about to be taken off `getWaitlist`. */
+	void recordGetWaiterDequeued(const GetWaiter &waiter) {
+		unsigned long long now = SystemTime::getCoarseUsec();
+		queueWaits.recordWait(now, now - std::min(now, waiter.enqueueTime),
+			waiter.options.maxRequestQueueTime * 1000ull);
+	}
+
+	/**
+	 * Takes the waiters whose request has been cancelled (see
+	 * Options::cancellation) off `getWaitlist`, so that they don't count
+	 * towards its size and wait time limits.
+	 */
+	void removeCancelledGetWaiters() {
+		SmallVector<GetCallback, 8> callbacks;
+		deque<GetWaiter>::iterator it, dest = getWaitlist.begin(), end = getWaitlist.end();
+
+		for (it = getWaitlist.begin(); it != end; it++) {
+			if (it->cancelled()) {
+				callbacks.push_back(it->callback);
+			} else {
+				if (dest != it) {
+					*dest = *it;
+				}
+				dest++;
+			}
+		}
+		if (callbacks.empty()) {
+			return;
+		}
+
+		getWaitlist.erase(dest, end);
+		if (getWaitlist.empty()) {
+			queueWaits.queueEmptied();
+		}
+		getWaitlistChanged();
+		P_DEBUG(callbacks.size() << " cancelled requests removed from the queue");
+		SmallVector<GetCallback, 8>::const_iterator c_it, c_end = callbacks.end();
+		for (c_it = callbacks.begin(); c_it != c_end; c_it++) {
+			(*c_it)(SessionPtr(), GetWaiter::cancelledException());
+		}
+	}
+
+	/**
+	 * Queues a get() request. If the request queue is full, then the request
+	 * is rejected, unless a queued request has a lower priority. That one is
+	 * rejected instead. So lower priority requests are shed first. The
+	 * request is also rejected if the queue wait has been above
+	 * Options::maxRequestQueueTime for too long.
+	 */
 	bool pushGetWaiter(const Options &newOptions, const GetCallback &callback) {
-		if (OXT_LIKELY(!testOverflowRequestQueue()
-			&& (newOptions.maxRequestQueueSize == 0
-			    || getWaitlist.size() < newOptions.maxRequestQueueSize)))
-		{
-			getWaitlist.push_back(GetWaiter(newOptions.copyAndPersist().clearLogger(), callback));
-			return true;
-		} else {
+		if (OXT_UNLIKELY(testOverflowRequestQueue())) {
 			P_WARN("Request queue is full. Returning an error");
 			callback(SessionPtr(), boost::make_shared<RequestQueueFullException>());
 			return false;
 		}
+
+		if (!getWaitlist.empty()
+		 && (newOptions.maxRequestQueueTime > 0
+		  || (newOptions.maxRequestQueueSize > 0
+		   && getWaitlist.size() >= newOptions.maxRequestQueueSize)))
+		{
+			removeCancelledGetWaiters();
+		}
+
+		if (newOptions.maxRequestQueueTime > 0 && !getWaitlist.empty()) {
+			unsigned long long now = SystemTime::getCoarseUsec();
+			if (queueWaits.overloaded(now, newOptions.maxRequestQueueTime * 1000ull,
+				now - std::min(now, oldestGetWaiterEnqueueTime())))
+			{
+				P_WARN("Requests have been waiting in the queue for longer than " <<
+					newOptions.maxRequestQueueTime << " msec. Returning an error");
+				callback(SessionPtr(), boost::make_shared<RequestQueueFullException>());
+				return false;
+			}
+		}
+
+		if (newOptions.maxRequestQueueSize > 0
+		 && getWaitlist.size() >= newOptions.maxRequestQueueSize)
+		{
+			unsigned int shed = getWaitlist.empty() ? 0 : findGetWaiterToShed();
+			if (getWaitlist.empty()
+			 || getWaitlist[shed].options.requestPriority >= newOptions.requestPriority)
+			{
+				P_WARN("Request queue is full. Returning an error");
+				callback(SessionPtr(), boost::make_shared<RequestQueueFullException>());
+				return false;
+			}
+
+			P_WARN("Request queue is full. Returning an error to a queued "
+				"request with a lower priority");
+			GetCallback shedCallback = getWaitlist[shed].callback;
+			getWaitlist.erase(getWaitlist.begin() + shed);
+			shedCallback(SessionPtr(), boost::make_shared<RequestQueueFullException>());
+		}
+
+		pushGetWaiterByPriority(getWaitlist,
+			GetWaiter(newOptions.copyAndPersist().clearLogger(), callback));
+		getWaitlistChanged();
+		recallSessionLeases();
+		return true;
 	}
 
 	Process *findProcessWithStickySessionId(unsigned int id) const {
-		ProcessList::const_iterator it, end = enabledProcesses.end();
-		for (it = enabledProcesses.begin(); it != end; it++) {
-			Process *process = it->get();
-			if (process->stickySessionId == id) {
-				return process;
-			}
+		HashMap<unsigned int, Process *>::const_iterator it =
+			enabledProcessesByStickySessionId.find(id);
+		if (it != enabledProcessesByStickySessionId.end()) {
+			return it->second;
+		} else {
+			return NULL;
 		}
-		return NULL;
 	}
 
 	Process *findProcessWithLowestBusyness(const ProcessList &processes) const {
@@ -449,7 +734,7 @@ private:
 		ProcessList::const_iterator it, end = processes.end();
 		for (it = processes.begin(); it != end; it++) {
 			Process *process = it->get();
-			if (result == NULL || process->busyness() < result->busyness()) {
+			if (result == NULL || routingPriority(process) < routingPriority(result)) {
 				result = process;
 			}
 		}
@@ -469,6 +754,9 @@ private:
 			enabledCount--;
 			pqueue.erase(process->pqHandle);
 			process->pqHandle = NULL;
+			enabledProcessesByStickySessionId.erase(process->stickySessionId);
+			unindexIdleProcess(process.get());
+			recallSessionLeases();
 			break;
 		case Process::DISABLING:
 			assert(&source == &disablingProcesses);
@@ -497,8 +785,12 @@ private:
 		process->it = destination.last_iterator();
 		if (&destination == &enabledProcesses) {
 			process->enabled = Process::ENABLED;
-			process->pqHandle = pqueue.push(process.get(), process->busyness());
+			process->pqHandle = pqueue.push(process.get(), routingPriority(process.get()));
+			enabledProcessesByStickySessionId[process->stickySessionId] = process.get();
 			enabledCount++;
+			if (process->sessions == 0) {
+				indexIdleProcess(process.get());
+			}
 		} else if (&destination == &disablingProcesses) {
 			process->enabled = Process::DISABLING;
 			disablingCount++;
@@ -509,6 +801,7 @@ private:
 		} else if (&destination == &detachedProcesses) {
 			assert(process->isAlive());
 			process->enabled = Process::DETACHED;
+			journalDetachedProcess(process);
 		} else {
 			P_BUG("Unknown destination list");
 		}
@@ -530,8 +823,17 @@ private:
 
 		while (!done && i < getWaitlist.size()) {
 			const GetWaiter &waiter = getWaitlist[i];
+			if (waiter.cancelled()) {
+				GetAction action;
+				action.callback  = waiter.callback;
+				action.exception = GetWaiter::cancelledException();
+				getWaitlist.erase(getWaitlist.begin() + i);
+				actions.push_back(action);
+				continue;
+			}
 			RouteResult result = route(waiter.options);
 			if (result.process != NULL) {
+				recordGetWaiterDequeued(waiter);
 				GetAction action;
 				action.callback = waiter.callback;
 				action.session  = newSession(result.process);
@@ -544,12 +846,16 @@ private:
 				}
 			}
 		}
+		if (getWaitlist.empty()) {
+			queueWaits.queueEmptied();
+		}
+		getWaitlistChanged();
 
 		verifyInvariants();
 		lock.unlock();
 		SmallVector<GetAction, 50>::const_iterator it, end = actions.end();
 		for (it = actions.begin(); it != end; it++) {
-			it->callback(it->session, ExceptionPtr());
+			it->callback(it->session, it->exception);
 		}
 	}
 	
@@ -559,8 +865,16 @@ private:
 
 		while (!done && i < getWaitlist.size()) {
 			const GetWaiter &waiter = getWaitlist[i];
+			if (waiter.cancelled()) {
+				postLockActions.push_back(boost::bind(
+					waiter.callback, SessionPtr(),
+					GetWaiter::cancelledException()));
+				getWaitlist.erase(getWaitlist.begin() + i);
+				continue;
+			}
 			RouteResult result = route(waiter.options);
 			if (result.process != NULL) {
+				recordGetWaiterDequeued(waiter);
 				postLockActions.push_back(boost::bind(
 					waiter.callback,
 					newSession(result.process),
@@ -573,6 +887,10 @@ private:
 				}
 			}
 		}
+		if (getWaitlist.empty()) {
+			queueWaits.queueEmptied();
+		}
+		getWaitlistChanged();
 	}
 
 	void enableAllDisablingProcesses(vector<Callback> &postLockActions) {
@@ -655,6 +973,20 @@ private:
 	}
 	
 public:
+	/** The number of spawns that must fail in a row before the group backs off. */
+	static const unsigned int SPAWN_FAILURE_THRESHOLD = 3;
+	/** The backoff period after SPAWN_FAILURE_THRESHOLD failures, in
+	 * microseconds. It doubles with every further failure, up to
+	 * MAX_SPAWN_BACKOFF. */
+	static const unsigned int MIN_SPAWN_BACKOFF = 1000000;
+	static const unsigned int MAX_SPAWN_BACKOFF = 60000000;
+	/** The CPU pressure of the group's cgroup, in percent, above which it
+	 * doesn't spawn more processes. See CgroupManager. */
+	static const unsigned int CPU_PRESSURE_SPAWN_THRESHOLD = 40;
+	/** How many percent more processes than its recent peak concurrency
+	 * requires a group keeps when scaling down. See scaleDownTarget(). */
+	static const unsigned int SCALE_DOWN_HEADROOM = 20;
+
 	Options options;
 	/** This name uniquely identifies this Group within its Pool. It can also be used as the display name. */
 	const string name;
@@ -683,8 +1015,8 @@ public:
 	 * their numbers.
 	 * These lists do not intersect. A process is in exactly 1 list.
 	 *
-	 * 'pqueue' orders all enabled processes according to busyness() values,
-	 * from small to large.
+	 * 'pqueue' orders all enabled processes according to routingPriority()
+	 * values, from small to large.
 	 *
 	 * Invariants:
 	 *    enabledCount >= 0
@@ -730,6 +1062,13 @@ public:
 	ProcessList disablingProcesses;
 	ProcessList disabledProcesses;
 
+	/**
+	 * Maps the sticky session IDs of all processes in `enabledProcesses` to
+	 * those processes. Maintained by addProcessToList(), removeProcessFromList()
+	 * and detachAll().
+	 */
+	HashMap<unsigned int, Process *> enabledProcessesByStickySessionId;
+
 	/**
 	 * When a process is detached, it is stored here until we've confirmed
 	 * that the OS process has exited.
@@ -739,6 +1078,52 @@ public:
 	 *    process.pqHandle == NULL
 	 */
 	ProcessList detachedProcesses;
+
+	/**
+	 * Recent request arrivals and session concurrency, for spawning processes
+	 * ahead of demand. Protected like `pqueue`.
+	 */
+	DemandTracker demand;
+
+	/**
+	 * How long requests waited in `getWaitlist`. Used for load shedding
+	 * (see Options::maxRequestQueueTime). Protected like `pqueue`.
+	 */
+	QueueWaitTracker queueWaits;
+
+	/**
+	 * Whether `getWaitlist` is non-empty. Read by the pool's SpawnScheduler
+	 * without the pool lock, to give our spawns priority over those of groups
+	 * that are only prestarting processes.
+	 */
+	boost::atomic<bool> hasGetWaiters;
+
+	/**
+	 * This group's metrics, labeled with its name. They're registered in the
+	 * pool's MetricsRegistry by the constructor and removed by the destructor.
+	 */
+	MetricsRegistryPtr metricsRegistry;
+	Metric *sessionsMetric;
+	Metric *sessionsTotalMetric;
+	Metric *queueDepthMetric;
+	Metric *spawnsMetric;
+	Metric *spawnErrorsMetric;
+	Metric *cpuTimeMetric;
+	Metric *allocationsMetric;
+
+	/** The last time that OOBW was initiated for one of this group's processes. */
+	unsigned long long lastOobwStartTime;
+	/** The last time that the garbage collector detached one of this group's
+	 * idle processes in order to scale it down. */
+	unsigned long long lastScaleDownTime;
+
+	/**
+	 * Fully spawned processes that don't take any traffic yet, so that capacity
+	 * can be added instantly when needed. See `options.standbyProcesses`.
+	 * They're in none of the process lists above, but they do count towards
+	 * capacityUsed().
+	 */
+	vector<ProcessPtr> standbyProcesses;
 	
 	/**
 	 * get() requests for this group that cannot be immediately satisfied are
@@ -793,7 +1178,12 @@ public:
 	 * Constructors and destructors
 	 ********************************************/
 
-	Group(const SuperGroupPtr &superGroup, const Options &options, const ComponentInfo &info);
+	/**
+	 * `spawner` may be given if the caller already created one outside the
+	 * pool lock; otherwise a new one is created from `options`.
+	 */
+	Group(const SuperGroupPtr &superGroup, const Options &options, const ComponentInfo &info,
+		const SpawnerPtr &spawner = SpawnerPtr());
 	~Group();
 
 	/**
@@ -811,7 +1201,7 @@ public:
 		P_DEBUG("Begin shutting down group " << name);
 		shutdownCallback = callback;
 		detachAll(postLockActions);
-		startCheckingDetachedProcesses(true);
+		startCheckingDetachedProcesses();
 		interruptableThreads.interrupt_all();
 		postLockActions.push_back(boost::bind(doCleanupSpawner, spawner));
 		spawner.reset();
@@ -823,6 +1213,25 @@ public:
 		}
 	}
 
+	/**
+	 * Kills the detached processes that are still running with SIGKILL,
+	 * e.g. because a shutdown deadline has passed. They are cleaned up as
+	 * usual once they have exited.
+	 */
+	void killDetachedProcesses() {
+		if (detachedProcesses.empty()) {
+			return;
+		}
+		foreach (const ProcessPtr &process, detachedProcesses) {
+			if (process->getLifeStatus() != Process::DEAD) {
+				P_WARN("Forcefully killing detached process " << process->inspect() <<
+					" with SIGKILL because it didn't shut down in time");
+				process->kill(SIGKILL);
+			}
+		}
+		startCheckingDetachedProcesses();
+	}
+
 
 	/********************************************
 	 * Life time and back-reference methods
@@ -866,22 +1275,104 @@ public:
 	 * Core methods
 	 ********************************************/
 
+	/**
+	 * Checks out a session by only updating this group's session bookkeeping,
+	 * if that suffices: that is, if a process is available and nothing needs
+	 * to be spawned, restarted or queued. Returns NULL otherwise, in which
+	 * case the caller must fall back to get() with the pool lock held
+	 * exclusively.
+	 *
+	 * If `leases` is given, also checks out up to `maxLeases` sessions ahead
+	 * of time into it, see Pool::SessionLeases. `leasedArrivals` is the number
+	 * of previously leased sessions that have been handed out since, which
+	 * are recorded as arrivals now.
+	 *
+	 * @pre The pool lock is held in shared mode.
+	 */
+	SessionPtr tryGetFast(const Options &newOptions, vector<SessionPtr> *leases = NULL,
+		unsigned int maxLeases = 0, unsigned int leasedArrivals = 0)
+	{
+		boost::lock_guard<boost::mutex> l(sessionSyncher);
+		if (OXT_UNLIKELY(!isAlive()
+			|| restarting()
+			|| restartPending
+			|| newOptions.noop
+			|| enabledCount == 0
+			|| !getWaitlist.empty()))
+		{
+			return SessionPtr();
+		}
+		if (OXT_UNLIKELY(needsRestart(newOptions))) {
+			restartPending = true;
+			return SessionPtr();
+		}
+		if (shouldSpawnForGetAction()) {
+			return SessionPtr();
+		}
+
+		RouteResult result = route(newOptions);
+		if (result.process == NULL) {
+			return SessionPtr();
+		}
+		mergeOptions(newOptions);
+		demand.recordArrival(SystemTime::getCoarseUsec(), 1 + leasedArrivals);
+		P_DEBUG("Session checked out from process " << result.process->inspect());
+		SessionPtr session = newSession(result.process);
+		if (leases != NULL) {
+			leaseSessions(newOptions, maxLeases, *leases);
+		}
+		return session;
+	}
+
+	/**
+	 * Checks out up to `count` sessions ahead of time. They are only taken
+	 * from processes that routing picks anyway and that don't become totally
+	 * busy, so that leasing never makes this group spawn or queue requests.
+	 *
+	 * @pre The pool lock is held in shared mode, and sessionSyncher is held.
+	 */
+	void leaseSessions(const Options &newOptions, unsigned int count,
+		vector<SessionPtr> &leases)
+	{
+		while (count > 0) {
+			Process *process = route(newOptions).process;
+			if (process == NULL
+			 || process->enabled != Process::ENABLED
+			 || process->oobwStatus != Process::OOBW_NOT_ACTIVE
+			 || (process->concurrency != 0 && process->sessions + 1 >= process->concurrency))
+			{
+				break;
+			}
+			leases.push_back(newSession(process));
+			count--;
+		}
+	}
+
 	SessionPtr get(const Options &newOptions, const GetCallback &callback,
 		vector<Callback> &postLockActions)
 	{
 		assert(isAlive());
+		if (OXT_LIKELY(!newOptions.noop)) {
+			demand.recordArrival(SystemTime::getCoarseUsec());
+		}
 
 		if (OXT_LIKELY(!restarting())) {
-			if (OXT_UNLIKELY(needsRestart(newOptions))) {
+			if (OXT_UNLIKELY(restartPending || needsRestart(newOptions))) {
 				restart(newOptions);
 			} else {
 				mergeOptions(newOptions);
 			}
-			if (OXT_UNLIKELY(!newOptions.noop && shouldSpawnForGetAction())) {
+			if (OXT_UNLIKELY(!newOptions.noop && shouldSpawnForGetAction())
+			 && !attachStandbyProcess(postLockActions))
+			{
 				// If we're trying to spawn the first process for this group, and
 				// spawning failed because the pool is at full capacity, then we
 				// try to kill some random idle process in the pool and try again.
-				if (spawn() == SR_ERR_POOL_AT_FULL_CAPACITY && enabledCount == 0) {
+				// The same goes for SuperGroups that have fewer processes
+				// than they are guaranteed.
+				if (spawn() == SR_ERR_POOL_AT_FULL_CAPACITY
+				 && (enabledCount == 0 || belowGuaranteedCapacity()))
+				{
 					P_INFO("Unable to spawn the the sole process for group " << name <<
 						" because the max pool size has been reached. Trying " <<
 						"to shutdown another idle process to free capacity...");
@@ -921,7 +1412,8 @@ public:
 			 * after a process has been spawned or has failed to spawn, or
 			 * when a disabling process becomes available.
 			 */
-			assert(m_spawning || restarting() || poolAtFullCapacity());
+			assert(m_spawning || restarting() || poolAtFullCapacity()
+				|| consecutiveSpawnFailures >= SPAWN_FAILURE_THRESHOLD);
 
 			if (disablingCount > 0 && !restarting()) {
 				Process *process = findProcessWithLowestBusyness(
@@ -932,6 +1424,19 @@ public:
 				}
 			}
 
+			if (OXT_UNLIKELY(!m_spawning && !restarting() && !poolAtFullCapacity()
+			 && consecutiveSpawnFailures >= SPAWN_FAILURE_THRESHOLD))
+			{
+				// The spawn circuit breaker is open. Queueing the request
+				// would only make it wait for the backoff period and then
+				// for a spawn that will likely fail again.
+				P_DEBUG("No session checked out: spawning failed repeatedly; " <<
+					"failing fast until the backoff period is over");
+				postLockActions.push_back(boost::bind(callback, SessionPtr(),
+					lastSpawnException));
+				return SessionPtr();
+			}
+
 			if (pushGetWaiter(newOptions, callback)) {
 				P_DEBUG("No session checked out yet: group is spawning or restarting");
 			}
@@ -961,6 +1466,9 @@ public:
 
 	// Thread-safe, but only call outside the pool lock!
 	void requestOOBW(const ProcessPtr &process);
+	// Thread-safe, but only call outside the pool lock!
+	void recordResourceUsage(const ProcessPtr &process, unsigned long long cpuTime,
+		unsigned long long allocations);
 
 	/**
 	 * Attaches the given process to this Group and mark it as enabled. This
@@ -976,14 +1484,24 @@ public:
 			return AR_GROUP_UPPER_LIMITS_REACHED;
 		} else if (poolAtFullCapacity()) {
 			return AR_POOL_AT_FULL_CAPACITY;
-		} else if (!isWaitingForCapacity() && anotherGroupIsWaitingForCapacity()) {
+		} else if (!isWaitingForCapacity() && surgeAllowance() == 0
+			&& anotherGroupIsWaitingForCapacity())
+		{
+			// A replacement spawned by a rolling restart doesn't take
+			// capacity away from others, because it retires an old process.
 			return AR_ANOTHER_GROUP_IS_WAITING_FOR_CAPACITY;
 		}
 
 		process->setGroup(shared_from_this());
 		process->stickySessionId = generateStickySessionId();
+		if (options.maxTunedConcurrency > 0 && process->concurrency > 1) {
+			process->concurrencyTuner.enable(process->concurrency,
+				options.maxTunedConcurrency);
+		}
 		P_DEBUG("Attaching process " << process->inspect());
 		addProcessToList(process, enabledProcesses);
+		indexProcess(process);
+		journalAttachedProcess(process);
 
 		/* Now that there are enough resources, relevant processes in
 		 * 'disableWaitlist' can be disabled.
@@ -1017,6 +1535,8 @@ public:
 		wakeUpGarbageCollector();
 
 		postLockActions.push_back(boost::bind(&Group::runAttachHooks, this, process));
+		PASSENGER_PROBE4(process_attached, name.data(), name.size(),
+			(int) process->pid, process->gupid.c_str());
 
 		return AR_OK;
 	}
@@ -1049,9 +1569,12 @@ public:
 		}
 
 		addProcessToList(process, detachedProcesses);
-		startCheckingDetachedProcesses(false);
+		unindexProcess(process);
+		startCheckingDetachedProcesses();
 
 		postLockActions.push_back(boost::bind(&Group::runDetachHooks, this, process));
+		PASSENGER_PROBE4(process_detached, name.data(), name.size(),
+			(int) process->pid, process->gupid.c_str());
 	}
 	
 	/**
@@ -1061,27 +1584,45 @@ public:
 	void detachAll(vector<Callback> &postLockActions) {
 		assert(isAlive());
 		P_DEBUG("Detaching all processes in group " << name);
+		recallSessionLeases();
 
 		foreach (ProcessPtr process, enabledProcesses) {
 			addProcessToList(process, detachedProcesses);
+			unindexProcess(process);
+			unindexIdleProcess(process.get());
 			process->pqHandle = NULL;
+			PASSENGER_PROBE4(process_detached, name.data(), name.size(),
+				(int) process->pid, process->gupid.c_str());
 		}
 		foreach (ProcessPtr process, disablingProcesses) {
 			addProcessToList(process, detachedProcesses);
+			unindexProcess(process);
+			PASSENGER_PROBE4(process_detached, name.data(), name.size(),
+				(int) process->pid, process->gupid.c_str());
 		}
 		foreach (ProcessPtr process, disabledProcesses) {
 			addProcessToList(process, detachedProcesses);
+			unindexProcess(process);
+			PASSENGER_PROBE4(process_detached, name.data(), name.size(),
+				(int) process->pid, process->gupid.c_str());
+		}
+		// Standby processes may run an outdated version of the app.
+		foreach (ProcessPtr process, standbyProcesses) {
+			addProcessToList(process, detachedProcesses);
 		}
 		
 		enabledProcesses.clear();
 		disablingProcesses.clear();
 		disabledProcesses.clear();
+		standbyProcesses.clear();
 		pqueue.clear();
+		enabledProcessesByStickySessionId.clear();
 		enabledCount = 0;
 		disablingCount = 0;
 		disabledCount = 0;
+		abortRollingRestart();
 		clearDisableWaitlist(DR_NOOP, postLockActions);
-		startCheckingDetachedProcesses(false);
+		startCheckingDetachedProcesses();
 	}
 	
 	/**
@@ -1170,26 +1711,136 @@ public:
 	 */
 	SpawnResult spawn() {
 		assert(isAlive());
-		if (m_spawning) {
+		if (m_spawning && !shouldStartAnotherSpawnThread()) {
 			return SR_IN_PROGRESS;
-		} else if (restarting()) {
+		} else if (restarting() || rollingRestartPreparing) {
 			return SR_ERR_RESTARTING;
+		} else if (spawnCircuitOpen() && (enabledCount > 0 || getWaitlist.empty())) {
+			// If requests are waiting and there's no process to serve them,
+			// we spawn anyway so that they don't wait forever. They get the
+			// outcome of that spawn.
+			return SR_ERR_SPAWN_BACKOFF;
+		} else if (enabledCount > 0 && cpuPressureTooHigh()) {
+			return SR_ERR_CPU_PRESSURE;
 		} else if (processUpperLimitsReached()) {
 			return SR_ERR_GROUP_UPPER_LIMITS_REACHED;
 		} else if (poolAtFullCapacity()) {
 			return SR_ERR_POOL_AT_FULL_CAPACITY;
 		} else {
-			P_DEBUG("Requested spawning of new process for group " << name);
+			do {
+				startSpawnThread();
+			} while (shouldStartAnotherSpawnThread());
+			return SR_OK;
+		}
+	}
+
+	void startSpawnThread() {
+		P_DEBUG("Requested spawning of new process for group " << name);
+		interruptableThreads.create_thread(
+			boost::bind(&Group::spawnThreadMain,
+				this, shared_from_this(), spawner,
+				options.copyAndPersist().clearPerRequestFields(),
+				restartsInitiated),
+			"Group process spawner: " + name,
+			POOL_HELPER_THREAD_STACK_SIZE);
+		spawnThreadCount++;
+		m_spawning = true;
+		processesBeingSpawned++;
+	}
+
+	/**
+	 * Whether another spawner thread should be started next to the ones that
+	 * are already working: when more processes are needed than are being
+	 * spawned right now, and neither `options.maxConcurrentSpawns` (or the
+	 * surge of a rolling restart) nor the pool-wide spawn concurrency limit
+	 * have been reached.
+	 */
+	bool shouldStartAnotherSpawnThread() const {
+		return spawnThreadCount > 0
+			// After repeated failures, a single spawn probes whether the
+			// application works again.
+			&& consecutiveSpawnFailures < SPAWN_FAILURE_THRESHOLD
+			&& spawnThreadCount < std::max(std::max(1u, options.maxConcurrentSpawns),
+				surgeAllowance() + rollingRestartUnavailable)
+			&& (!processLowerLimitsSatisfied()
+				|| getWaitlist.size() > (unsigned int) processesBeingSpawned
+				|| replacementsNeeded() > 0)
+			&& !processUpperLimitsReached()
+			&& !poolAtFullCapacity()
+			&& !poolSpawnConcurrencyLimitReached();
+	}
+
+	/**
+	 * Whether the standby spawner thread should spawn another standby process:
+	 * while there are fewer than `options.standbyProcesses` of them, as long as
+	 * the group serves traffic and the process limits allow it.
+	 */
+	bool shouldSpawnStandbyProcess() const {
+		return standbyProcesses.size() < options.standbyProcesses
+			&& enabledCount > 0
+			&& !restarting()
+			&& !rollingRestarting()
+			&& !processUpperLimitsReached()
+			&& !poolAtFullCapacity();
+	}
+
+	/** Starts the standby spawner thread if more standby processes are needed. */
+	void maintainStandbyProcesses() {
+		if (!standbySpawning && shouldSpawnStandbyProcess()) {
+			P_DEBUG("Spawning standby process for group " << name);
 			interruptableThreads.create_thread(
-				boost::bind(&Group::spawnThreadMain,
+				boost::bind(&Group::standbySpawnThreadMain,
 					this, shared_from_this(), spawner,
 					options.copyAndPersist().clearPerRequestFields(),
 					restartsInitiated),
-				"Group process spawner: " + name,
+				"Group standby process spawner: " + name,
 				POOL_HELPER_THREAD_STACK_SIZE);
-			m_spawning = true;
-			processesBeingSpawned++;
-			return SR_OK;
+			standbySpawning = true;
+		}
+	}
+
+	/**
+	 * Attaches one of the standby processes, so that the group gains capacity
+	 * without waiting for a spawn. Returns whether that succeeded.
+	 */
+	bool attachStandbyProcess(vector<Callback> &postLockActions) {
+		while (!standbyProcesses.empty()) {
+			ProcessPtr process = standbyProcesses.back();
+			standbyProcesses.pop_back();
+			if (!process->dummy && !process->osProcessExists()) {
+				P_DEBUG("Standby process " << process->inspect() << " has exited");
+				addProcessToList(process, detachedProcesses);
+				startCheckingDetachedProcesses();
+				continue;
+			}
+
+			process->lastUsed = SystemTime::getUsec();
+			if (attach(process, postLockActions) == AR_OK) {
+				P_DEBUG("Attached standby process " << process->inspect());
+				maintainStandbyProcesses();
+				return true;
+			} else {
+				standbyProcesses.push_back(process);
+				return false;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Gives up one of the standby processes, in order to free capacity in the
+	 * pool. Returns the process, or NULL if there are none.
+	 */
+	ProcessPtr detachStandbyProcess() {
+		if (standbyProcesses.empty()) {
+			return ProcessPtr();
+		} else {
+			ProcessPtr process = standbyProcesses.back();
+			standbyProcesses.pop_back();
+			P_DEBUG("Detaching standby process " << process->inspect());
+			addProcessToList(process, detachedProcesses);
+			startCheckingDetachedProcesses();
+			return process;
 		}
 	}
 
@@ -1209,12 +1860,24 @@ public:
 		return enabledCount + disablingCount + disabledCount;
 	}
 
+	/** The number of threads in `interruptableThreads`, i.e. the spawner,
+	 * restarter and OOBW request threads that are still running. */
+	unsigned int getThreadCount() const {
+		return interruptableThreads.num_threads();
+	}
+
 	/**
 	 * Returns the number of processes in this group that should be part of the
 	 * ApplicationPool process limits calculations.
 	 */
 	unsigned int capacityUsed() const {
-		return enabledCount + disablingCount + disabledCount + processesBeingSpawned;
+		return enabledCount + disablingCount + disabledCount + processesBeingSpawned
+			+ standbyCapacityUsed();
+	}
+
+	/** The part of capacityUsed() that is taken by standby processes. */
+	unsigned int standbyCapacityUsed() const {
+		return standbyProcesses.size() + (standbySpawning ? 1 : 0);
 	}
 
 	/**
@@ -1223,16 +1886,121 @@ public:
 	 * may not allow spawning, so you should check `pool->atFullCapacity()` too.
 	 */
 	bool processLowerLimitsSatisfied() const {
-		return capacityUsed() >= options.minProcesses;
+		return capacityUsed() - standbyCapacityUsed() >= options.minProcesses;
 	}
 
 	/**
 	 * Returns whether the upper bound of the group-specific process limits have
-	 * been reached, or surpassed. Does not check whether pool limits have been
+	 * been reached, or surpassed. This includes the SuperGroup's
+	 * maxCapacityShare. Does not check whether pool limits have been
 	 * reached. Use `pool->atFullCapacity()` to check for that.
 	 */
+	/** Whether spawning is suspended because spawns have failed repeatedly.
+	 * See `consecutiveSpawnFailures`. */
+	bool spawnCircuitOpen() const {
+		return consecutiveSpawnFailures >= SPAWN_FAILURE_THRESHOLD
+			&& SystemTime::getCoarseUsec() < spawnBackoffUntil;
+	}
+
+	/**
+	 * Records a failed spawn, and starts a backoff period if too many spawns
+	 * failed in a row. The period is randomized by up to half, so that groups
+	 * that started failing at the same time, e.g. because a shared dependency
+	 * went down, don't keep retrying at the same time.
+	 */
+	void recordSpawnFailure(const ExceptionPtr &exception) {
+		consecutiveSpawnFailures++;
+		lastSpawnException = exception;
+		if (consecutiveSpawnFailures >= SPAWN_FAILURE_THRESHOLD) {
+			unsigned int doublings = std::min(
+				consecutiveSpawnFailures - SPAWN_FAILURE_THRESHOLD, 10u);
+			unsigned long long backoff = (unsigned long long) MIN_SPAWN_BACKOFF << doublings;
+			if (backoff > MAX_SPAWN_BACKOFF) {
+				backoff = MAX_SPAWN_BACKOFF;
+			}
+			backoff = backoff / 2 + (unsigned long long) rand() % (backoff / 2 + 1);
+			spawnBackoffUntil = SystemTime::getCoarseUsec() + backoff;
+			P_WARN("Spawning a process for group " << name << " failed " <<
+				consecutiveSpawnFailures << " times in a row; not trying again for " <<
+				(backoff / 1000) << " msec. Requests that need a new process fail " <<
+				"immediately in the mean time.");
+		}
+	}
+
 	bool processUpperLimitsReached() const {
-		return options.maxProcesses != 0 && capacityUsed() >= options.maxProcesses;
+		return (options.maxProcesses != 0
+				&& capacityUsed() >= options.maxProcesses + surgeAllowance())
+			|| capacityShareReached();
+	}
+
+	/** The number of outdated processes that a rolling restart still has to
+	 * replace. */
+	unsigned int outdatedCount() const {
+		unsigned int result = 0;
+		foreach (const ProcessPtr &process, outdatedProcesses) {
+			if (process->enabled != Process::DETACHED) {
+				result++;
+			}
+		}
+		return result;
+	}
+
+	/** The number of replacements for outdated processes that still have to
+	 * be spawned, on top of the ones being spawned right now. */
+	unsigned int replacementsNeeded() const {
+		if (rollingRestartPreparing) {
+			return 0;
+		}
+		unsigned int outdated = outdatedCount() + rollingRestartUnavailable;
+		if (outdated > (unsigned int) processesBeingSpawned) {
+			return outdated - processesBeingSpawned;
+		} else {
+			return 0;
+		}
+	}
+
+	/**
+	 * How many processes the group may temporarily have on top of the group
+	 * and pool limits while a rolling restart spawns replacements next to the
+	 * processes that they replace.
+	 */
+	unsigned int surgeAllowance() const {
+		if (rollingRestartPreparing) {
+			return 0;
+		} else {
+			return std::min(rollingRestartSurge, outdatedCount());
+		}
+	}
+
+	/** Retires the next outdated process. Returns false if there are none left. */
+	bool retireOutdatedProcess(vector<Callback> &postLockActions) {
+		while (!outdatedProcesses.empty()) {
+			ProcessPtr process = outdatedProcesses.front();
+			outdatedProcesses.pop_front();
+			if (process->enabled != Process::DETACHED && process->isAlive()) {
+				P_DEBUG("Rolling restart: retiring outdated process " << process->inspect());
+				detach(process, postLockActions);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/** Called when a replacement spawned by a rolling restart has been
+	 * attached: retires another outdated process in its place. */
+	void replacementAttached(vector<Callback> &postLockActions) {
+		if (!retireOutdatedProcess(postLockActions) && rollingRestartUnavailable > 0) {
+			rollingRestartUnavailable--;
+		}
+		if (!rollingRestarting()) {
+			P_INFO("Rolling restart of group " << name << " done");
+		}
+	}
+
+	void abortRollingRestart() {
+		outdatedProcesses.clear();
+		rollingRestartPreparing = false;
+		rollingRestartUnavailable = 0;
 	}
 
 	/**
@@ -1244,6 +2012,61 @@ public:
 		return enabledCount > 0 && pqueue.top()->isTotallyBusy();
 	}
 
+	/**
+	 * Whether the projected demand (see DemandTracker::projectDemand()) would
+	 * use at least `options.spawnAheadUtilization` percent of the capacity of
+	 * the enabled processes, in which case a process should be spawned ahead
+	 * of demand. Always false for processes with unlimited concurrency.
+	 */
+	bool demandExceedsSpawnAheadUtilization() const {
+		if (options.spawnAheadUtilization == 0 || enabledCount == 0 || m_spawning) {
+			return false;
+		}
+
+		ProcessList::const_iterator it, end = enabledProcesses.end();
+		unsigned long long totalResponseTime = 0;
+		unsigned int measured = 0;
+		int capacity = 0;
+		for (it = enabledProcesses.begin(); it != end; it++) {
+			const Process *process = it->get();
+			if (process->concurrency <= 0) {
+				return false;
+			}
+			capacity += process->concurrency;
+			if (process->responseTimeEwma > 0) {
+				totalResponseTime += process->responseTimeEwma;
+				measured++;
+			}
+		}
+
+		double projected = demand.projectDemand(SystemTime::getCoarseUsec(),
+			(measured > 0) ? totalResponseTime / measured : 0);
+		return projected * 100 >= (double) capacity * options.spawnAheadUtilization;
+	}
+
+	/**
+	 * The number of processes that the garbage collector may scale this
+	 * group down to: enough to serve the peak concurrency of the past one
+	 * to two windows of `windowUsec` (see
+	 * DemandTracker::getSustainedPeakSessions()) plus SCALE_DOWN_HEADROOM
+	 * percent, but no fewer than `options.minProcesses`.
+	 *
+	 * @pre The pool lock is held exclusively.
+	 */
+	unsigned int scaleDownTarget(unsigned long long now, unsigned long long windowUsec) {
+		unsigned int peak = demand.getSustainedPeakSessions(now, windowUsec);
+		unsigned int needed;
+		int concurrency = enabledProcesses.empty() ? 1 : enabledProcesses.front()->concurrency;
+
+		if (concurrency <= 0) {
+			needed = (peak > 0) ? 1 : 0;
+		} else {
+			needed = (peak + concurrency - 1) / concurrency;
+		}
+		needed += needed * SCALE_DOWN_HEADROOM / 100;
+		return std::max<unsigned int>(needed, options.minProcesses);
+	}
+
 	/**
 	 * Checks whether this group is waiting for capacity on the pool to
 	 * become available before it can continue processing requests.
@@ -1285,13 +2108,35 @@ public:
 			&& !poolAtFullCapacity();
 	}
 	
+	bool checkRestartFiles(unsigned int throttleRate) {
+		struct stat buf;
+		alwaysRestartFileExists = cstat.stat(alwaysRestartFile, &buf, throttleRate) == 0;
+		return alwaysRestartFileExists ||
+		       fileChangeChecker.changed(restartFile, throttleRate);
+	}
+
 	bool needsRestart(const Options &options) {
 		if (m_restarting) {
 			return false;
+		} else if (options.statThrottleRate > 0
+			&& restartFileWatch != NULL
+			&& restartFileWatch->isActive())
+		{
+			/* Throttling means that the admin accepts restart files not being
+			 * checked on every request. In that case we rely on the watcher,
+			 * which notices changes sooner and without stat()ing anything.
+			 * Without throttling, keep stat()ing so that a change is seen by
+			 * the very next request, even if the watcher thread hasn't
+			 * processed the event yet.
+			 */
+			if (OXT_LIKELY(!restartFileWatch->consumeChange())) {
+				return alwaysRestartFileExists;
+			} else {
+				// Don't let throttling hide the change we were notified of.
+				return checkRestartFiles(0);
+			}
 		} else {
-			struct stat buf;
-			return cstat.stat(alwaysRestartFile, &buf, options.statThrottleRate) == 0 ||
-			       fileChangeChecker.changed(restartFile, options.statThrottleRate);
+			return checkRestartFiles(options.statThrottleRate);
 		}
 	}
 
@@ -1303,6 +2148,13 @@ public:
 		return m_restarting;
 	}
 
+	/** Whether a rolling restart is in progress. restarting() is false in that
+	 * case, because the outdated processes keep serving requests. */
+	bool rollingRestarting() const {
+		return rollingRestartPreparing || outdatedCount() > 0
+			|| rollingRestartUnavailable > 0;
+	}
+
 	template<typename Stream>
 	void inspectXml(Stream &stream, bool includeSecrets = true) const {
 		ProcessList::const_iterator it;
@@ -1318,6 +2170,14 @@ public:
 		stream << "<capacity_used>" << capacityUsed() << "</capacity_used>";
 		stream << "<get_wait_list_size>" << getWaitlist.size() << "</get_wait_list_size>";
 		stream << "<disable_wait_list_size>" << disableWaitlist.size() << "</disable_wait_list_size>";
+		if (queueWaits.getSampleCount() > 0) {
+			stream << "<queue_wait>";
+			stream << "<sample_count>" << queueWaits.getSampleCount() << "</sample_count>";
+			stream << "<p50_usec>" << queueWaits.getPercentile(50) << "</p50_usec>";
+			stream << "<p90_usec>" << queueWaits.getPercentile(90) << "</p90_usec>";
+			stream << "<p99_usec>" << queueWaits.getPercentile(99) << "</p99_usec>";
+			stream << "</queue_wait>";
+		}
 		stream << "<processes_being_spawned>" << processesBeingSpawned << "</processes_being_spawned>";
 		if (m_spawning) {
 			stream << "<spawning/>";
@@ -35,6 +35,7 @@
 #include <Exceptions.h>
 #include <MessageReadersWriters.h>
 #include <Utils/ScopeGuard.h>
+#include <Utils/ProcessExitWatcher.h>
 
 namespace Passenger {
 namespace ApplicationPool2 {
@@ -141,8 +142,223 @@ Pool::getSuperGroup(const char *name) {
 	return superGroups.get(name);
 }
 
+static void
+doNotDeleteSessionCloseBatch(Pool::SessionCloseBatch *batch) {
+	// The batch is owned by whoever activated it.
+}
+
+static boost::thread_specific_ptr<Pool::SessionCloseBatch>
+	currentSessionCloseBatch(doNotDeleteSessionCloseBatch);
+
+Pool::SessionCloseBatch *
+Pool::SessionCloseBatch::current() {
+	return currentSessionCloseBatch.get();
+}
+
+void
+Pool::SessionCloseBatch::activate() {
+	if (currentSessionCloseBatch.get() != this) {
+		currentSessionCloseBatch.reset(this);
+	}
+}
+
+void
+Pool::SessionCloseBatch::deactivate() {
+	if (currentSessionCloseBatch.get() == this) {
+		currentSessionCloseBatch.reset();
+	}
+}
+
+void
+Pool::SessionCloseBatch::flush() {
+	while (!entries.empty()) {
+		TRACE_POINT();
+		vector<Entry> closes;
+		vector<GroupPtr> groupsWithWaiters;
+		vector<Callback> actions;
+		closes.swap(entries);
+
+		PoolLock lock(pool->syncher);
+		vector<Entry>::const_iterator it, end = closes.end();
+		for (it = closes.begin(); it != end; it++) {
+			// The pool may have been destroyed in the mean time.
+			if (!it->process->isAlive()) {
+				continue;
+			}
+			GroupPtr group = it->process->getGroup();
+			if (group->processSessionClose(it->process, it->socket, it->startTime,
+				it->used, actions)
+			 && std::find(groupsWithWaiters.begin(), groupsWithWaiters.end(), group)
+				== groupsWithWaiters.end())
+			{
+				groupsWithWaiters.push_back(group);
+			}
+		}
+
+		UPDATE_TRACE_POINT();
+		vector<GroupPtr>::const_iterator g_it, g_end = groupsWithWaiters.end();
+		for (g_it = groupsWithWaiters.begin(); g_it != g_end; g_it++) {
+			const GroupPtr &group = *g_it;
+			if (group->isAlive() && !group->getWaitlist.empty()) {
+				group->assignSessionsToGetWaiters(actions);
+			}
+		}
+		pool->fullVerifyInvariants();
+		lock.unlock();
+		runAllActions(actions);
+	}
+}
+
+
+void
+Pool::recallSessionLeases() {
+	sessionLeaseGeneration.fetch_add(1, boost::memory_order_release);
+	if (sessionLeaseCount.load(boost::memory_order_relaxed) == 0) {
+		return;
+	}
+
+	boost::lock_guard<boost::mutex> l(sessionLeaseHoldersSyncher);
+	vector< boost::weak_ptr<SessionLeases> >::iterator it = sessionLeaseHolders.begin();
+	while (it != sessionLeaseHolders.end()) {
+		SessionLeasesPtr holder = it->lock();
+		if (holder == NULL) {
+			it = sessionLeaseHolders.erase(it);
+		} else {
+			holder->libev->runLater(boost::bind(&SessionLeases::onRecalled,
+				boost::weak_ptr<SessionLeases>(holder)));
+			it++;
+		}
+	}
+}
+
+void
+Pool::SessionLeases::onRecalled(boost::weak_ptr<SessionLeases> weakSelf) {
+	SessionLeasesPtr self = weakSelf.lock();
+	if (self != NULL) {
+		self->returnLeases(true);
+	}
+}
+
+SessionPtr
+Pool::SessionLeases::checkout(const Options &options) {
+	if (count == 0 || options.noop || options.stickySessionId != 0) {
+		return SessionPtr();
+	}
+	StringMap<Bucket>::iterator it = buckets.find(options.getAppGroupName());
+	if (it == buckets.end() || it->second.sessions.empty()) {
+		return SessionPtr();
+	}
+
+	Bucket &bucket = it->second;
+	if (bucket.generation != pool->sessionLeaseGeneration.load(boost::memory_order_acquire)) {
+		returnLeases(true);
+		return SessionPtr();
+	}
+	SessionPtr session = bucket.sessions.back();
+	bucket.sessions.pop_back();
+	bucket.arrivals++;
+	count--;
+	pool->sessionLeaseCount.fetch_sub(1, boost::memory_order_relaxed);
+	session->setStartTime(SystemTime::getUsec());
+	return session;
+}
 
-boost::mutex &
+SessionPtr
+Pool::SessionLeases::refill(const Options &options, unsigned int maxPerGroup) {
+	if (!registered) {
+		boost::lock_guard<boost::mutex> l(pool->sessionLeaseHoldersSyncher);
+		pool->sessionLeaseHolders.push_back(shared_from_this());
+		registered = true;
+	}
+
+	// Closes that are still pending may free the capacity that we'd lease.
+	SessionCloseBatch *batch = SessionCloseBatch::current();
+	if (batch != NULL && !batch->empty()) {
+		batch->flush();
+	}
+
+	StringMap<Bucket>::iterator it = buckets.find(options.getAppGroupName());
+	if (it == buckets.end()) {
+		buckets.set(options.getAppGroupName(), Bucket());
+		it = buckets.find(options.getAppGroupName());
+	}
+	Bucket &bucket = it->second;
+	unsigned int oldSize = bucket.sessions.size();
+	unsigned int generation = 0;
+	SessionPtr session = pool->tryGetFastAndLease(options,
+		maxPerGroup - std::min(oldSize, maxPerGroup), bucket.arrivals,
+		bucket.sessions, generation);
+	if (session != NULL) {
+		bucket.arrivals = 0;
+		if (bucket.sessions.size() > oldSize) {
+			bucket.generation = generation;
+			count += bucket.sessions.size() - oldSize;
+			if (!expiryTimer.is_active()) {
+				expiryTimer.start(ttl / 1000.0, 0);
+			}
+		}
+	}
+	return session;
+}
+
+void
+Pool::SessionLeases::asyncGet(const Options &options, const GetCallback &callback,
+	unsigned int maxPerGroup)
+{
+	SessionPtr session = checkout(options);
+	if (session == NULL && maxPerGroup > 0 && !options.noop
+	 && options.stickySessionId == 0)
+	{
+		session = refill(options, maxPerGroup);
+	}
+	if (session != NULL) {
+		P_TRACE(2, "asyncGet(appGroupName=" << options.getAppGroupName() <<
+			") finished with a leased session");
+		callback(session, ExceptionPtr());
+	} else {
+		pool->asyncGet(options, callback);
+	}
+}
+
+/**
+ * Returns unused leases to the pool. If `onlyRecalled` is true, only leases
+ * that were taken before the last recallSessionLeases() call are returned.
+ */
+void
+Pool::SessionLeases::returnLeases(bool onlyRecalled) {
+	if (count == 0) {
+		return;
+	}
+
+	TRACE_POINT();
+	unsigned int generation = pool->sessionLeaseGeneration.load(boost::memory_order_acquire);
+	SessionCloseBatch closes(pool);
+	StringMap<Bucket>::iterator it, end = buckets.end();
+	for (it = buckets.begin(); it != end; it++) {
+		Bucket &bucket = it->second;
+		if (onlyRecalled && bucket.generation == generation) {
+			continue;
+		}
+		vector<SessionPtr>::iterator s_it, s_end = bucket.sessions.end();
+		for (s_it = bucket.sessions.begin(); s_it != s_end; s_it++) {
+			Session *session = s_it->get();
+			closes.add(session->getProcess(), session->getSocket(), 0, false);
+			session->onClose = NULL;
+			session->close(false);
+		}
+		count -= bucket.sessions.size();
+		pool->sessionLeaseCount.fetch_sub(bucket.sessions.size(),
+			boost::memory_order_relaxed);
+		bucket.sessions.clear();
+	}
+	if (count == 0) {
+		expiryTimer.stop();
+	}
+	closes.flush();
+}
+
+
+PoolSyncher &
 SuperGroup::getPoolSyncher(const PoolPtr &pool) {
 	return pool->syncher;
 }
@@ -159,7 +375,7 @@ SuperGroup::generateSecret() const {
 
 void
 SuperGroup::runInitializationHooks() const {
-	getPool()->runHookScripts("after_initialize_supergroup",
+	getPool()->scheduleHookScripts("after_initialize_supergroup",
 		boost::bind(&SuperGroup::setupInitializationOrDestructionHook, this, _1));
 }
 
@@ -182,16 +398,31 @@ SuperGroup::createInterruptableThread(const boost::function<void ()> &func, cons
 }
 
 void
-SuperGroup::realDoInitialize(const Options &options, unsigned int generation) {
+SuperGroup::realDoInitialize(const Options &_options, unsigned int generation) {
+	Options options = _options;
 	vector<ComponentInfo> componentInfos;
 	vector<ComponentInfo>::const_iterator it;
+	vector<SpawnerPtr> spawners;
 	ExceptionPtr exception;
+	PoolPtr pool = getPool();
+	Pool::DebugSupportPtr debug = pool->debugSupport;
 	
 	P_TRACE(2, "Initializing SuperGroup " << inspect() << " in the background...");
+	/* App type detection, component loading and spawner creation may all
+	 * block on the filesystem, so they're done here before grabbing the lock.
+	 * Until then the SuperGroup sits in the pool as a placeholder in the
+	 * INITIALIZING state and other SuperGroups are unaffected.
+	 */
 	try {
+		detectAppType(options);
 		componentInfos = loadComponentInfos(options);
+		for (it = componentInfos.begin(); it != componentInfos.end(); it++) {
+			spawners.push_back(pool->spawnerFactory->create(options));
+		}
 	} catch (const tracable_exception &e) {
 		exception = copyException(e);
+		componentInfos.clear();
+		spawners.clear();
 	}
 	if (componentInfos.empty() && exception == NULL) {
 		string message = "The directory " +
@@ -201,9 +432,6 @@ SuperGroup::realDoInitialize(const Options &options, unsigned int generation) {
 			message, message, false);
 	}
 	
-	PoolPtr pool = getPool();
-	Pool::DebugSupportPtr debug = pool->debugSupport;
-	
 	vector<Callback> actions;
 	{
 		if (debug != NULL && debug->superGroup) {
@@ -211,7 +439,7 @@ SuperGroup::realDoInitialize(const Options &options, unsigned int generation) {
 			debug->messages->recv("Proceed with initializing SuperGroup");
 		}
 
-		boost::unique_lock<boost::mutex> lock(getPoolSyncher(pool));
+		PoolLock lock(getPoolSyncher(pool));
 		this_thread::disable_interruption di;
 		this_thread::disable_syscall_interruption dsi;
 		NOT_EXPECTING_EXCEPTIONS();
@@ -237,14 +465,19 @@ SuperGroup::realDoInitialize(const Options &options, unsigned int generation) {
 				getWaitlist.pop_front();
 			}
 		} else {
+			if (this->options.appType.empty()) {
+				// Either still empty or points to a static app type name.
+				this->options.appType = options.appType;
+			}
 			for (it = componentInfos.begin(); it != componentInfos.end(); it++) {
 				const ComponentInfo &info = *it;
 				GroupPtr group = boost::make_shared<Group>(shared_from_this(),
-					options, info);
+					options, info, spawners[it - componentInfos.begin()]);
 				groups.push_back(group);
 				if (info.isDefault) {
 					defaultGroup = group.get();
 				}
+				pool->attachHandedOffProcesses(group, actions);
 			}
 
 			setState(READY);
@@ -274,7 +507,7 @@ SuperGroup::realDoRestart(const Options &options, unsigned int generation) {
 		debug->messages->recv("Proceed with restarting SuperGroup");
 	}
 	
-	boost::unique_lock<boost::mutex> lock(getPoolSyncher(pool));
+	PoolLock lock(getPoolSyncher(pool));
 	if (OXT_UNLIKELY(this->generation != generation)) {
 		return;
 	}
@@ -334,7 +567,8 @@ SuperGroup::realDoRestart(const Options &options, unsigned int generation) {
 }
 
 
-Group::Group(const SuperGroupPtr &_superGroup, const Options &options, const ComponentInfo &info)
+Group::Group(const SuperGroupPtr &_superGroup, const Options &options, const ComponentInfo &info,
+	const SpawnerPtr &_spawner)
 	: superGroup(_superGroup),
 	  name(_superGroup->name + "#" + info.name),
 	  secret(generateSecret(_superGroup)),
@@ -343,11 +577,26 @@ Group::Group(const SuperGroupPtr &_superGroup, const Options &options, const Com
 	enabledCount   = 0;
 	disablingCount = 0;
 	disabledCount  = 0;
-	spawner        = getPool()->spawnerFactory->create(options);
+	if (_spawner != NULL) {
+		spawner    = _spawner;
+	} else {
+		spawner    = getPool()->spawnerFactory->create(options);
+	}
 	restartsInitiated = 0;
 	processesBeingSpawned = 0;
+	spawnThreadCount = 0;
 	m_spawning     = false;
+	standbySpawning = false;
 	m_restarting   = false;
+	restartPending = false;
+	rollingRestartPreparing = false;
+	rollingRestartSurge = 0;
+	rollingRestartUnavailable = 0;
+	consecutiveSpawnFailures = 0;
+	spawnBackoffUntil = 0;
+	lastOobwStartTime = 0;
+	lastScaleDownTime = 0;
+	hasGetWaiters.store(false, boost::memory_order_relaxed);
 	lifeStatus     = ALIVE;
 	if (options.restartDir.empty()) {
 		restartFile = options.appRoot + "/tmp/restart.txt";
@@ -359,9 +608,36 @@ Group::Group(const SuperGroupPtr &_superGroup, const Options &options, const Com
 		restartFile = options.appRoot + "/" + options.restartDir + "/restart.txt";
 		alwaysRestartFile = options.appRoot + "/" + options.restartDir + "/always_restart.txt";
 	}
+	alwaysRestartFileExists = false;
+
+	string labels = MetricsRegistry::label("app", name);
+	metricsRegistry = getPool()->metrics;
+	sessionsMetric = metricsRegistry->add(this, "passenger_group_sessions",
+		Metric::GAUGE, "Open sessions with the group's processes.", labels);
+	sessionsTotalMetric = metricsRegistry->add(this, "passenger_group_sessions_total",
+		Metric::COUNTER, "Sessions checked out from the group.", labels);
+	queueDepthMetric = metricsRegistry->add(this, "passenger_group_queue_depth",
+		Metric::GAUGE, "Requests waiting for a process of the group.", labels);
+	spawnsMetric = metricsRegistry->add(this, "passenger_group_spawns_total",
+		Metric::COUNTER, "Processes spawned for the group.", labels);
+	spawnErrorsMetric = metricsRegistry->add(this, "passenger_group_spawn_errors_total",
+		Metric::COUNTER, "Failed attempts to spawn a process for the group.", labels);
+	cpuTimeMetric = metricsRegistry->add(this, "passenger_group_cpu_usec_total",
+		Metric::COUNTER, "CPU time that the group's processes reported for their requests.", labels);
+	allocationsMetric = metricsRegistry->add(this, "passenger_group_allocations_total",
+		Metric::COUNTER, "Objects that the group's processes reported to have allocated for their requests.", labels);
+
+	if (getPool()->restartFileWatcher != NULL) {
+		vector<string> names;
+		names.push_back(extractBaseName(restartFile));
+		names.push_back(extractBaseName(alwaysRestartFile));
+		restartFileWatch = getPool()->restartFileWatcher->watch(
+			extractDirName(restartFile), names);
+	}
 	resetOptions(options);
 
-	detachedProcessesCheckerActive = false;
+	detachedProcessesCheckScheduled = false;
+	detachedProcessesCheckTime = 0;
 }
 
 Group::~Group() {
@@ -370,7 +646,7 @@ Group::~Group() {
 		P_BUG("You must call Group::shutdown() before destroying a Group.");
 	}
 	assert(lifeStatus == SHUT_DOWN);
-	assert(!detachedProcessesCheckerActive);
+	metricsRegistry->removeAll(this);
 }
 
 PoolPtr
@@ -378,6 +654,41 @@ Group::getPool() const {
 	return getSuperGroup()->getPool();
 }
 
+void
+Group::indexProcess(const ProcessPtr &process) {
+	PoolPtr pool = getPool();
+	// The PID of a remote process may be that of an unrelated local process.
+	if (!process->isRemote()) {
+		pool->processesByPid[process->pid] = process;
+	}
+	pool->processesByGupid.set(process->gupid, process);
+	pool->statsChanged();
+}
+
+void
+Group::unindexProcess(const ProcessPtr &process) {
+	PoolPtr pool = getPool();
+	HashMap<pid_t, ProcessPtr>::iterator it = pool->processesByPid.find(process->pid);
+	// Dummy processes in different groups may have the same PID.
+	if (it != pool->processesByPid.end() && it->second == process) {
+		pool->processesByPid.erase(it);
+	}
+	if (pool->processesByGupid.get(process->gupid) == process) {
+		pool->processesByGupid.remove(process->gupid);
+	}
+	pool->statsChanged();
+}
+
+void
+Group::indexIdleProcess(Process *process) {
+	getPool()->indexIdleProcess(process);
+}
+
+void
+Group::unindexIdleProcess(Process *process) {
+	getPool()->unindexIdleProcess(process);
+}
+
 void
 Group::onSessionInitiateFailure(const ProcessPtr &process, Session *session) {
 	vector<Callback> actions;
@@ -385,7 +696,7 @@ Group::onSessionInitiateFailure(const ProcessPtr &process, Session *session) {
 	TRACE_POINT();
 	// Standard resource management boilerplate stuff...
 	PoolPtr pool = getPool();
-	boost::unique_lock<boost::mutex> lock(pool->syncher);
+	PoolLock lock(pool->syncher);
 	assert(process->isAlive());
 	assert(isAlive() || getLifeStatus() == SHUTTING_DOWN);
 
@@ -400,12 +711,120 @@ Group::onSessionInitiateFailure(const ProcessPtr &process, Session *session) {
 	runAllActions(actions);
 }
 
+/**
+ * Whether closing a session on the given process only involves updating the
+ * session bookkeeping. These are exactly the cases in which onSessionClose()
+ * neither detaches nor disables the process, doesn't initiate an OOBW and
+ * doesn't have to assign sessions to get waiters.
+ *
+ * @pre The pool lock is held, at least in shared mode.
+ */
+bool
+Group::canCloseSessionQuickly(const ProcessPtr &process, const PoolPtr &pool) const {
+	return process->enabled == Process::ENABLED
+		&& process->oobwStatus != Process::OOBW_REQUESTED
+		&& getWaitlist.empty()
+		&& !(options.maxRequests > 0 && process->processed + 1 >= options.maxRequests)
+		&& (process->sessions > 1
+			|| (pool->getWaitlist.empty() && !anotherGroupIsWaitingForCapacity()));
+}
+
+void
+Group::_onSessionClose(Session *session) {
+	ProcessPtr process = session->getProcess();
+	assert(process != NULL);
+	Pool::SessionCloseBatch *batch = Pool::SessionCloseBatch::current();
+	if (batch != NULL) {
+		batch->add(process, session->getSocket(), session->getStartTime());
+	} else {
+		process->getGroup()->onSessionClose(process, session->getSocket(),
+			session->getStartTime());
+	}
+}
+
 void
-Group::onSessionClose(const ProcessPtr &process, Session *session) {
+Group::recallSessionLeases() {
+	PoolPtr pool = getPool();
+	if (pool != NULL) {
+		pool->recallSessionLeases();
+	}
+}
+
+/**
+ * Adds the CPU time and the allocated objects that the application reported
+ * for one of its requests to the totals of the process and of this group.
+ * Protected like the session bookkeeping, so that it doesn't need the pool
+ * lock in exclusive mode.
+ */
+void
+Group::recordResourceUsage(const ProcessPtr &process, unsigned long long cpuTime,
+	unsigned long long allocations)
+{
+	PoolPtr pool = getPool();
+	PoolSharedLock sharedLock(pool->syncher);
+	boost::lock_guard<boost::mutex> l(sessionSyncher);
+	process->cpuTime += cpuTime;
+	process->allocations += allocations;
+	process->resourceUsageReports++;
+	cpuTimeMetric->add(cpuTime);
+	allocationsMetric->add(allocations);
+}
+
+void
+Group::onSessionClose(const ProcessPtr &process, Socket *socket,
+	unsigned long long startTime)
+{
 	TRACE_POINT();
+	PoolPtr pool = getPool();
+
+	// Fast path: only the session bookkeeping of this group needs to be
+	// updated, so sessions of different groups can be closed concurrently.
+	{
+		PoolSharedLock sharedLock(pool->syncher);
+		boost::lock_guard<boost::mutex> l(sessionSyncher);
+		assert(process->isAlive());
+		if (canCloseSessionQuickly(process, pool)) {
+			P_TRACE(2, "Session closed for process " << process->inspect());
+			process->sessionClosed(socket, startTime);
+			demand.sessionClosed();
+			sessionsMetric->decrement();
+			updateRoutingPriority(process.get());
+			if (process->sessions == 0) {
+				pool->indexIdleProcess(process.get());
+			}
+			return;
+		}
+	}
+
 	// Standard resource management boilerplate stuff...
+	PoolLock lock(pool->syncher);
+	vector<Callback> actions;
+	if (processSessionClose(process, socket, startTime, true, actions)) {
+		/* If there are clients on this group waiting for a process to
+		 * become available then call them now.
+		 */
+		UPDATE_TRACE_POINT();
+		// Already calls verifyInvariants().
+		assignSessionsToGetWaitersQuickly(lock);
+	} else {
+		lock.unlock();
+		runAllActions(actions);
+	}
+}
+
+/**
+ * Updates the pool after closing a session, possibly detaching or disabling
+ * the process. Returns whether the process can now serve this group's get
+ * waiters, in which case the caller must assign sessions to them.
+ *
+ * @pre The pool lock is held exclusively.
+ */
+bool
+Group::processSessionClose(const ProcessPtr &process, Socket *socket,
+	unsigned long long startTime, bool used, vector<Callback> &postLockActions)
+{
+	TRACE_POINT();
 	PoolPtr pool = getPool();
-	boost::unique_lock<boost::mutex> lock(pool->syncher);
 	assert(process->isAlive());
 	assert(isAlive() || getLifeStatus() == SHUTTING_DOWN);
 
@@ -414,19 +833,25 @@ Group::onSessionClose(const ProcessPtr &process, Session *session) {
 	UPDATE_TRACE_POINT();
 	
 	/* Update statistics. */
-	process->sessionClosed(session);
+	process->sessionClosed(socket, startTime, used);
+	demand.sessionClosed();
+	sessionsMetric->decrement();
 	assert(process->getLifeStatus() == Process::ALIVE);
 	assert(process->enabled == Process::ENABLED
 		|| process->enabled == Process::DISABLING
 		|| process->enabled == Process::DETACHED);
 	if (process->enabled == Process::ENABLED) {
-		pqueue.decrease(process->pqHandle, process->busyness());
+		updateRoutingPriority(process.get());
+		if (process->sessions == 0) {
+			pool->indexIdleProcess(process.get());
+		}
+	} else if (process->enabled == Process::DETACHED && process->sessions == 0) {
+		startCheckingDetachedProcesses();
 	}
 
-	/* This group now has a process that's guaranteed to be not
-	 * totally busy.
+	/* This group now has a process that's not totally busy, unless its
+	 * concurrency has been lowered while the session was open.
 	 */
-	assert(!process->isTotallyBusy());
 
 	bool detachingBecauseOfMaxRequests = false;
 	bool detachingBecauseCapacityNeeded = false;
@@ -450,8 +875,6 @@ Group::onSessionClose(const ProcessPtr &process, Session *session) {
 		&& enabledCount > 0;
 
 	if (shouldDetach || shouldDisable) {
-		vector<Callback> actions;
-
 		if (shouldDetach) {
 			if (detachingBecauseCapacityNeeded) {
 				/* Someone might be trying to get() a session for a different
@@ -470,30 +893,21 @@ Group::onSessionClose(const ProcessPtr &process, Session *session) {
 					" has reached its maximum number of requests (" <<
 					options.maxRequests << "); detaching it");
 			}
-			pool->detachProcessUnlocked(process, actions);
+			pool->detachProcessUnlocked(process, postLockActions);
 		} else {
 			removeProcessFromList(process, disablingProcesses);
 			addProcessToList(process, disabledProcesses);
-			removeFromDisableWaitlist(process, DR_SUCCESS, actions);
+			removeFromDisableWaitlist(process, DR_SUCCESS, postLockActions);
 			maybeInitiateOobw(process);
 		}
 		
 		pool->fullVerifyInvariants();
-		lock.unlock();
-		runAllActions(actions);
+		return false;
 
 	} else {
 		// This could change process->enabled.
 		maybeInitiateOobw(process);
-
-		if (!getWaitlist.empty() && process->enabled == Process::ENABLED) {
-			/* If there are clients on this group waiting for a process to
-			 * become available then call them now.
-			 */
-			UPDATE_TRACE_POINT();
-			// Already calls verifyInvariants().
-			assignSessionsToGetWaitersQuickly(lock);
-		}
+		return !getWaitlist.empty() && process->enabled == Process::ENABLED;
 	}
 }
 
@@ -501,9 +915,15 @@ void
 Group::requestOOBW(const ProcessPtr &process) {
 	// Standard resource management boilerplate stuff...
 	PoolPtr pool = getPool();
-	boost::unique_lock<boost::mutex> lock(pool->syncher);
+	PoolLock lock(pool->syncher);
 	if (isAlive() && process->isAlive() && process->oobwStatus == Process::OOBW_NOT_ACTIVE) {
 		process->oobwStatus = Process::OOBW_REQUESTED;
+		recallSessionLeases();
+		if (options.outOfBandWorkInterval != 0) {
+			// Lets the garbage collector schedule itself for when
+			// this request may start, see Pool::maybeInitiateDeferredOobw().
+			pool->garbageCollectionCond.notify_all();
+		}
 	}
 }
 
@@ -520,7 +940,29 @@ Group::oobwAllowed() const {
 			oobwInstances += 1;
 		}
 	}
-	return oobwInstances < options.maxOutOfBandWorkInstances;
+	if (oobwInstances >= options.maxOutOfBandWorkInstances) {
+		return false;
+	} else if (options.maxOutOfBandWorkPercentage == 0 || oobwInstances == 0) {
+		return true;
+	} else {
+		unsigned int total = enabledCount + disablingCount + disabledCount;
+		return (oobwInstances + 1) * 100 <= total * options.maxOutOfBandWorkPercentage;
+	}
+}
+
+/**
+ * OOBW is deferred while requests are queued, because the processes are
+ * needed to serve them, and until `options.outOfBandWorkInterval` has
+ * passed since the last one was started. A deferred OOBW request is
+ * reconsidered when the process closes a session, when another OOBW
+ * finishes, and during garbage collection.
+ */
+bool
+Group::oobwMayStartNow() const {
+	return getWaitlist.empty()
+		&& (options.outOfBandWorkInterval == 0
+			|| SystemTime::getUsec() >= lastOobwStartTime
+				+ options.outOfBandWorkInterval * 1000ull);
 }
 
 bool
@@ -531,9 +973,19 @@ Group::shouldInitiateOobw(const ProcessPtr &process) const {
 		&& oobwAllowed();
 }
 
+bool
+Group::oobwRequested() const {
+	foreach (const ProcessPtr &process, enabledProcesses) {
+		if (process->oobwStatus == Process::OOBW_REQUESTED) {
+			return true;
+		}
+	}
+	return false;
+}
+
 void
 Group::maybeInitiateOobw(const ProcessPtr &process) {
-	if (shouldInitiateOobw(process)) {
+	if (shouldInitiateOobw(process) && oobwMayStartNow()) {
 		initiateOobw(process);
 	}
 }
@@ -545,7 +997,7 @@ Group::lockAndMaybeInitiateOobw(const ProcessPtr &process, DisableResult result,
 	
 	// Standard resource management boilerplate stuff...
 	PoolPtr pool = getPool();
-	boost::unique_lock<boost::mutex> lock(pool->syncher);
+	PoolLock lock(pool->syncher);
 	if (OXT_UNLIKELY(!process->isAlive() || !isAlive())) {
 		return;
 	}
@@ -585,6 +1037,7 @@ Group::initiateOobw(const ProcessPtr &process) {
 	assert(process->oobwStatus == Process::OOBW_REQUESTED);
 
 	process->oobwStatus = Process::OOBW_IN_PROGRESS;
+	lastOobwStartTime = SystemTime::getUsec();
 
 	if (process->enabled == Process::ENABLED
 	 || process->enabled == Process::DISABLING)
@@ -646,7 +1099,7 @@ Group::spawnThreadOOBWRequest(GroupPtr self, ProcessPtr process) {
 	UPDATE_TRACE_POINT();
 	{
 		// Standard resource management boilerplate stuff...
-		boost::unique_lock<boost::mutex> lock(pool->syncher);
+		PoolLock lock(pool->syncher);
 		if (OXT_UNLIKELY(!process->isAlive()
 			|| process->enabled == Process::DETACHED
 			|| !isAlive()))
@@ -671,6 +1124,8 @@ Group::spawnThreadOOBWRequest(GroupPtr self, ProcessPtr process) {
 	}
 	
 	UPDATE_TRACE_POINT();
+	PASSENGER_PROBE4(oobw_begin, name.data(), name.size(),
+		(int) process->pid, process->gupid.c_str());
 	unsigned long long timeout = 1000 * 1000 * 60; // 1 min
 	try {
 		this_thread::restore_interruption ri(di);
@@ -711,13 +1166,15 @@ Group::spawnThreadOOBWRequest(GroupPtr self, ProcessPtr process) {
 	} catch (const TimeoutException &e) {
 		P_ERROR("*** ERROR: " << e.what() << "\n" << e.backtrace());
 	}
+	PASSENGER_PROBE4(oobw_end, name.data(), name.size(),
+		(int) process->pid, process->gupid.c_str());
 	
 	UPDATE_TRACE_POINT();
 	vector<Callback> actions;
 	{
 		// Standard resource management boilerplate stuff...
 		PoolPtr pool = getPool();
-		boost::unique_lock<boost::mutex> lock(pool->syncher);
+		PoolLock lock(pool->syncher);
 		if (OXT_UNLIKELY(!process->isAlive() || !isAlive())) {
 			return;
 		}
@@ -743,8 +1200,104 @@ Group::spawnThreadOOBWRequest(GroupPtr self, ProcessPtr process) {
 	}
 }
 
+void
+Group::warmUpProcess(const ProcessPtr &process, const Options &options) {
+	TRACE_POINT();
+	vector<string> uris;
+	vector<string>::const_iterator it;
+
+	// The process is not attached yet, so nobody else uses its sockets.
+	Socket *socket = process->sessionSockets.top();
+	if (options.warmupUrls.empty() || process->dummy || socket == NULL) {
+		return;
+	}
+	split(options.warmupUrls, ' ', uris);
+
+	for (it = uris.begin(); it != uris.end(); it++) {
+		const string &uri = *it;
+		if (uri.empty()) {
+			continue;
+		}
+
+		UPDATE_TRACE_POINT();
+		P_DEBUG("Sending warmup request " << uri << " to process " << process->inspect());
+		unsigned long long timeout = 1000 * 1000 * 60; // 1 min
+		try {
+			// The connection is closed after the response, like the ones
+			// used for OOBW requests.
+			Connection connection = socket->checkoutConnection();
+			connection.fail = true;
+			ScopeGuard guard(boost::bind(&Socket::checkinConnection, socket, connection));
+
+			string::size_type pos = uri.find('?');
+			string pathInfo = uri.substr(0, pos);
+			string queryString = (pos == string::npos) ? string() : uri.substr(pos + 1);
+			string data;
+
+			if (socket->protocol == "session") {
+				char sizeField[sizeof(uint32_t)];
+				const char *headers[] = {
+					"REQUEST_METHOD", "GET",
+					"REQUEST_URI", uri.c_str(),
+					"PATH_INFO", pathInfo.c_str(),
+					"QUERY_STRING", queryString.c_str(),
+					"SCRIPT_NAME", "",
+					"SERVER_NAME", "localhost",
+					"SERVER_PORT", "80",
+					"SERVER_PROTOCOL", "HTTP/1.1",
+					"REMOTE_ADDR", "127.0.0.1",
+					"CONTENT_LENGTH", "0",
+					"HTTP_HOST", "localhost",
+					"HTTP_USER_AGENT", "Phusion Passenger warmup",
+					"PASSENGER_CONNECT_PASSWORD", process->connectPassword.c_str()
+				};
+
+				for (unsigned int i = 0; i < sizeof(headers) / sizeof(const char *); i++) {
+					data.append(headers[i]);
+					data.append(1, '\0');
+				}
+				Uint32Message::generate(sizeField, data.size());
+				data.insert(0, sizeField, sizeof(sizeField));
+			} else {
+				data = "GET " + uri + " HTTP/1.1\r\n"
+					"Connection: close\r\n"
+					"Host: localhost\r\n"
+					"User-Agent: Phusion Passenger warmup\r\n"
+					"X-Passenger-Connect-Password: " + process->connectPassword + "\r\n"
+					"\r\n";
+			}
+			writeExact(connection.fd, data, &timeout);
+
+			// We do not care what the actual response is, as long as the
+			// application is done with it.
+			UPDATE_TRACE_POINT();
+			char buf[1024 * 16];
+			ssize_t ret;
+			do {
+				if (!waitUntilReadable(connection.fd, &timeout)) {
+					throw TimeoutException("Timeout reading the warmup response");
+				}
+				ret = syscalls::read(connection.fd, buf, sizeof(buf));
+				if (ret == -1) {
+					int e = errno;
+					throw SystemException("Cannot read the warmup response", e);
+				}
+			} while (ret > 0);
+		} catch (const SystemException &e) {
+			P_WARN("Warmup request " << uri << " to process " << process->inspect() <<
+				" failed: " << e.what());
+		} catch (const TimeoutException &) {
+			P_WARN("Warmup request " << uri << " to process " << process->inspect() <<
+				" timed out");
+		}
+	}
+}
+
 void
 Group::initiateNextOobwRequest() {
+	if (!oobwMayStartNow()) {
+		return;
+	}
 	ProcessList::const_iterator it, end = enabledProcesses.end();
 	for (it = enabledProcesses.begin(); it != end; it++) {
 		const ProcessPtr &process = *it;
@@ -806,20 +1359,32 @@ Group::spawnThreadRealMain(const SpawnerPtr &spawner, const Options &options, un
 			if (shouldFail) {
 				throw SpawnException("Simulated failure");
 			} else {
+				SpawnScheduler::Ticket ticket(pool->spawnScheduler, name, hasGetWaiters);
+				PASSENGER_PROBE2(spawn_begin, name.data(), name.size());
 				process = spawner->spawn(options);
 				process->setGroup(shared_from_this());
+				warmUpProcess(process, options);
 			}
 		} catch (const thread_interrupted &) {
+			Process::forceTriggerShutdownAndCleanup(process);
 			break;
 		} catch (const tracable_exception &e) {
 			exception = copyException(e);
 			// Let other (unexpected) exceptions crash the program so
 			// gdb can generate a backtrace.
 		}
+		if (process != NULL) {
+			spawnsMetric->increment();
+			PASSENGER_PROBE4(spawn_end, name.data(), name.size(),
+				(int) process->pid, process->gupid.c_str());
+		} else {
+			spawnErrorsMetric->increment();
+			PASSENGER_PROBE4(spawn_end, name.data(), name.size(), 0, "");
+		}
 
 		UPDATE_TRACE_POINT();
 		ScopeGuard guard(boost::bind(Process::forceTriggerShutdownAndCleanup, process));
-		boost::unique_lock<boost::mutex> lock(pool->syncher);
+		PoolLock lock(pool->syncher);
 
 		if (!isAlive()) {
 			if (process != NULL) {
@@ -852,7 +1417,7 @@ Group::spawnThreadRealMain(const SpawnerPtr &spawner, const Options &options, un
 		assert(processesBeingSpawned > 0);
 
 		processesBeingSpawned--;
-		assert(processesBeingSpawned == 0);
+		assert(processesBeingSpawned >= 0);
 
 		UPDATE_TRACE_POINT();
 		vector<Callback> actions;
@@ -860,6 +1425,11 @@ Group::spawnThreadRealMain(const SpawnerPtr &spawner, const Options &options, un
 			AttachResult result = attach(process, actions);
 			if (result == AR_OK) {
 				guard.clear();
+				consecutiveSpawnFailures = 0;
+				lastSpawnException.reset();
+				if (rollingRestarting()) {
+					replacementAttached(actions);
+				}
 				if (getWaitlist.empty()) {
 					pool->assignSessionsToGetWaiters(actions);
 				} else {
@@ -880,24 +1450,37 @@ Group::spawnThreadRealMain(const SpawnerPtr &spawner, const Options &options, un
 			P_ERROR("Could not spawn process for group " << name <<
 				": " << exception->what() << "\n" <<
 				exception->backtrace());
+			if (rollingRestarting()) {
+				P_ERROR("Aborting the rolling restart of group " << name <<
+					"; its remaining old processes keep serving requests");
+				abortRollingRestart();
+			}
+			recordSpawnFailure(exception);
 			if (enabledCount == 0) {
 				enableAllDisablingProcesses(actions);
 			}
 			Pool::assignExceptionToGetWaiters(getWaitlist, exception, actions);
+			getWaitlistChanged();
 			pool->assignSessionsToGetWaiters(actions);
 			done = true;
 		}
 
 		done = done
-			|| (processLowerLimitsSatisfied() && getWaitlist.empty())
+			|| (processLowerLimitsSatisfied() && getWaitlist.empty()
+				&& replacementsNeeded() == 0)
 			|| processUpperLimitsReached()
-			|| pool->atFullCapacity(false);
-		m_spawning = !done;
+			|| poolAtFullCapacity();
 		if (done) {
+			spawnThreadCount--;
+			m_spawning = spawnThreadCount > 0;
 			P_DEBUG("Spawn loop done");
+			maintainStandbyProcesses();
 		} else {
 			processesBeingSpawned++;
 			P_DEBUG("Continue spawning");
+			while (shouldStartAnotherSpawnThread()) {
+				startSpawnThread();
+			}
 		}
 
 		UPDATE_TRACE_POINT();
@@ -913,12 +1496,84 @@ Group::spawnThreadRealMain(const SpawnerPtr &spawner, const Options &options, un
 	}
 }
 
+// The 'self' parameter is for keeping the current Group object alive while this thread is running.
+void
+Group::standbySpawnThreadMain(GroupPtr self, SpawnerPtr spawner, Options options,
+	unsigned int restartsInitiated)
+{
+	TRACE_POINT();
+	this_thread::disable_interruption di;
+	this_thread::disable_syscall_interruption dsi;
+	PoolPtr pool = getPool();
+
+	while (true) {
+		ProcessPtr process;
+		try {
+			UPDATE_TRACE_POINT();
+			this_thread::restore_interruption ri(di);
+			this_thread::restore_syscall_interruption rsi(dsi);
+			SpawnScheduler::Ticket ticket(pool->spawnScheduler, name, hasGetWaiters);
+			process = spawner->spawn(options);
+			process->setGroup(shared_from_this());
+			warmUpProcess(process, options);
+		} catch (const thread_interrupted &) {
+			Process::forceTriggerShutdownAndCleanup(process);
+			break;
+		} catch (const tracable_exception &e) {
+			P_WARN("Could not spawn standby process for group " << name <<
+				": " << e.what());
+		}
+
+		UPDATE_TRACE_POINT();
+		ScopeGuard guard(boost::bind(Process::forceTriggerShutdownAndCleanup, process));
+		PoolLock lock(pool->syncher);
+		if (!isAlive() || restartsInitiated != this->restartsInitiated) {
+			P_DEBUG("Group " << name << " is shutting down or restarting, " <<
+				"so dropping standby process");
+			break;
+		}
+
+		assert(standbySpawning);
+		standbySpawning = false;
+		if (process == NULL) {
+			break;
+		}
+		guard.clear();
+		vector<Callback> actions;
+		bool more;
+		standbyProcesses.push_back(process);
+		if (enabledCount == 0 || !getWaitlist.empty()) {
+			/* Requests came in while we were spawning, so put the
+			 * process to work right away. If that succeeds,
+			 * attachStandbyProcess() starts a new standby spawner
+			 * thread if necessary.
+			 */
+			if (attachStandbyProcess(actions)) {
+				assignSessionsToGetWaiters(actions);
+			}
+			more = false;
+		} else {
+			P_DEBUG("Standby process " << process->inspect() << " ready");
+			more = shouldSpawnStandbyProcess();
+			standbySpawning = more;
+		}
+		pool->fullVerifyInvariants();
+		lock.unlock();
+		runAllActions(actions);
+		if (!more) {
+			break;
+		}
+	}
+}
+
 bool
 Group::shouldSpawn() const {
 	return allowSpawn()
 		&& (
 			!processLowerLimitsSatisfied()
 			|| allEnabledProcessesAreTotallyBusy()
+			|| demandExceedsSpawnAheadUtilization()
+			|| replacementsNeeded() > 0
 			// TODO: test this
 			//|| !getWaitlist.empty()
 		);
@@ -933,31 +1588,59 @@ void
 Group::restart(const Options &options, RestartMethod method) {
 	vector<Callback> actions;
 
+	bool rolling = method == RM_ROLLING
+		|| (method == RM_DEFAULT && options.rollingRestart);
+
 	assert(isAlive());
-	P_DEBUG("Restarting group " << name);
+	P_DEBUG((rolling ? "Rolling restarting group " : "Restarting group ") << name);
 
 	// If there is currently a restarter thread or a spawner thread active,
 	// the following tells them to abort their current work as soon as possible.
 	restartsInitiated++;
 
 	processesBeingSpawned = 0;
+	spawnThreadCount = 0;
 	m_spawning   = false;
-	m_restarting = true;
-	detachAll(actions);
+	standbySpawning = false;
+	restartPending = false;
+	// The restart may well be because the application has been fixed.
+	consecutiveSpawnFailures = 0;
+	spawnBackoffUntil = 0;
+	lastSpawnException.reset();
+	rolling = rolling && enabledCount > 0;
+	if (rolling) {
+		beginRollingRestart(actions);
+	} else {
+		m_restarting = true;
+		detachAll(actions);
+	}
 	getPool()->interruptableThreads.create_thread(
 		boost::bind(&Group::finalizeRestart, this, shared_from_this(),
 			options.copyAndPersist().clearPerRequestFields(),
-			method, getPool()->spawnerFactory, restartsInitiated, actions),
+			method, rolling, getPool()->spawnerFactory, restartsInitiated,
+			actions),
 		"Group restarter: " + name,
 		POOL_HELPER_THREAD_STACK_SIZE
 	);
 }
 
-// The 'self' parameter is for keeping the current Group object alive while this thread is running.
+/**
+ * Creates the new spawner of a restart and swaps it with the old one.
+ *
+ * If `prepareSpawner` is set, which is the case for rolling restarts, then
+ * the new spawner is prepared first, e.g. its preloader is started. The
+ * outdated processes keep serving requests in the meantime, and the
+ * replacements can then be spawned right away, so that the application's
+ * boot time isn't spent while processes are being retired. If preparing
+ * fails, then the first spawn tries again and reports the error as usual.
+ *
+ * The 'self' parameter is for keeping the current Group object alive while
+ * this thread is running.
+ */
 void
 Group::finalizeRestart(GroupPtr self, Options options, RestartMethod method,
-	SpawnerFactoryPtr spawnerFactory, unsigned int restartsInitiated,
-	vector<Callback> postLockActions)
+	bool prepareSpawner, SpawnerFactoryPtr spawnerFactory,
+	unsigned int restartsInitiated, vector<Callback> postLockActions)
 {
 	TRACE_POINT();
 
@@ -971,6 +1654,20 @@ Group::finalizeRestart(GroupPtr self, Options options, RestartMethod method,
 	SpawnerPtr newSpawner = spawnerFactory->create(options);
 	SpawnerPtr oldSpawner;
 
+	if (prepareSpawner) {
+		UPDATE_TRACE_POINT();
+		try {
+			this_thread::restore_interruption ri(di);
+			this_thread::restore_syscall_interruption rsi(dsi);
+			newSpawner->prepare();
+		} catch (const thread_interrupted &) {
+			return;
+		} catch (const std::exception &e) {
+			P_WARN("Cannot prepare the new spawner for group " << name <<
+				" ahead of the rolling restart: " << e.what());
+		}
+	}
+
 	UPDATE_TRACE_POINT();
 	PoolPtr pool = getPool();
 
@@ -983,7 +1680,7 @@ Group::finalizeRestart(GroupPtr self, Options options, RestartMethod method,
 		debug->messages->recv("Finish restarting");
 	}
 
-	ScopedLock l(pool->syncher);
+	PoolLock l(pool->syncher);
 	if (!isAlive()) {
 		P_DEBUG("Group " << name << " is shutting down, so aborting restart");
 		return;
@@ -1000,7 +1697,7 @@ Group::finalizeRestart(GroupPtr self, Options options, RestartMethod method,
 
 	// Run some sanity checks.
 	pool->fullVerifyInvariants();
-	assert(m_restarting);
+	assert(m_restarting || rollingRestartPreparing);
 	UPDATE_TRACE_POINT();
 	
 	// Atomically swap the new spawner with the old one.
@@ -1009,7 +1706,9 @@ Group::finalizeRestart(GroupPtr self, Options options, RestartMethod method,
 	spawner    = newSpawner;
 
 	m_restarting = false;
-	if (shouldSpawn()) {
+	if (rollingRestartPreparing) {
+		startReplacingOutdatedProcesses(postLockActions);
+	} else if (shouldSpawn()) {
 		spawn();
 	} else if (isWaitingForCapacity()) {
 		P_INFO("Group " << name << " is waiting for capacity to become available. "
@@ -1033,117 +1732,240 @@ Group::finalizeRestart(GroupPtr self, Options options, RestartMethod method,
 }
 
 /**
- * The `immediately` parameter only has effect if the detached processes checker
- * thread is active. It means that, if the thread is currently sleeping, it should
- * wake up immediately and perform work.
+ * Starts a rolling restart: all current processes become outdated, but keep
+ * serving requests until restart() has created the new spawner and
+ * replacements are attached. Standby processes run the old version and
+ * don't serve anything, so they're detached right away.
  */
 void
-Group::startCheckingDetachedProcesses(bool immediately) {
-	if (!detachedProcessesCheckerActive) {
-		P_DEBUG("Starting detached processes checker");
-		getPool()->nonInterruptableThreads.create_thread(
-			boost::bind(&Group::detachedProcessesCheckerMain, this, shared_from_this()),
-			"Detached processes checker: " + name,
-			POOL_HELPER_THREAD_STACK_SIZE
-		);
-		detachedProcessesCheckerActive = true;
-	} else if (detachedProcessesCheckerActive && immediately) {
-		detachedProcessesCheckerCond.notify_all();
+Group::beginRollingRestart(vector<Callback> &postLockActions) {
+	abortRollingRestart();
+	// Retire the processes that don't serve requests first.
+	outdatedProcesses.insert(outdatedProcesses.end(),
+		disabledProcesses.begin(), disabledProcesses.end());
+	outdatedProcesses.insert(outdatedProcesses.end(),
+		disablingProcesses.begin(), disablingProcesses.end());
+	outdatedProcesses.insert(outdatedProcesses.end(),
+		enabledProcesses.begin(), enabledProcesses.end());
+	foreach (ProcessPtr process, standbyProcesses) {
+		addProcessToList(process, detachedProcesses);
+	}
+	if (!standbyProcesses.empty()) {
+		standbyProcesses.clear();
+		startCheckingDetachedProcesses();
 	}
+	rollingRestartPreparing = true;
 }
 
+/**
+ * Called once the new spawner of a rolling restart is ready. Retires up to
+ * `options.maxUnavailable` outdated processes to make room, and starts
+ * spawning replacements. Every replacement that gets attached retires
+ * another outdated process, until none are left.
+ */
 void
-Group::detachedProcessesCheckerMain(GroupPtr self) {
-	TRACE_POINT();
-	PoolPtr pool = getPool();
+Group::startReplacingOutdatedProcesses(vector<Callback> &postLockActions) {
+	unsigned int outdated = outdatedCount();
+	unsigned int unavailable = std::min(options.maxUnavailable,
+		(outdated > 0) ? outdated - 1 : 0);
+
+	rollingRestartPreparing = false;
+	rollingRestartSurge = determineRollingRestartSurge();
+	P_INFO("Rolling restarting group " << name << ": replacing " << outdated <<
+		" " << Pool::maybePluralize(outdated, "process", "processes") <<
+		", " << rollingRestartSurge << " surge, " << unavailable << " unavailable");
+
+	for (unsigned int i = 0; i < unavailable; i++) {
+		if (retireOutdatedProcess(postLockActions)) {
+			rollingRestartUnavailable++;
+		}
+	}
+	if (rollingRestarting()) {
+		spawn();
+	}
+}
 
-	Pool::DebugSupportPtr debug = pool->debugSupport;
-	if (debug != NULL && debug->detachedProcessesChecker) {
-		debug->debugger->send("About to start detached processes checker");
-		debug->messages->recv("Proceed with starting detached processes checker");
+/**
+ * The number of replacements that a rolling restart may spawn at the same
+ * time: `options.maxSurge`, but no more than the available memory can hold,
+ * assuming that a replacement uses as much memory as the old processes do
+ * on average. At least one replacement is always allowed.
+ */
+unsigned int
+Group::determineRollingRestartSurge() const {
+	unsigned int surge = std::max(1u, options.maxSurge);
+	unsigned long long totalMemory = 0;
+	unsigned int measured = 0;
+
+	foreach (const ProcessPtr &process, outdatedProcesses) {
+		if (process->enabled != Process::DETACHED && process->metrics.realMemory() > 0) {
+			totalMemory += process->metrics.realMemory();
+			measured++;
+		}
 	}
+	if (measured > 0 && surge > 1) {
+		ssize_t available = ProcessMetricsCollector::getAvailableSystemMemory();
+		if (available >= 0) {
+			unsigned long long headroom = available / (totalMemory / measured);
+			if (headroom < surge) {
+				P_INFO("Limiting the rolling restart surge of group " << name <<
+					" to " << std::max(1ull, headroom) << " because of available memory");
+				surge = (unsigned int) std::max(1ull, headroom);
+			}
+		}
+	}
+	return surge;
+}
 
-	boost::unique_lock<boost::mutex> lock(pool->syncher);
-	while (true) {
-		assert(detachedProcessesCheckerActive);
+/**
+ * Schedules a check of `detachedProcesses` on the pool's event loop. Called
+ * whenever one of them may be able to proceed with shutting down.
+ */
+void
+Group::startCheckingDetachedProcesses() {
+	if (!detachedProcessesCheckScheduled) {
+		detachedProcessesCheckScheduled = true;
+		getPool()->detachedProcessesLoop.safe->runLater(boost::bind(
+			&Group::checkDetachedProcesses, this, shared_from_this()));
+	}
+}
 
-		if (getLifeStatus() == SHUT_DOWN || this_thread::interruption_requested()) {
-			UPDATE_TRACE_POINT();
-			P_DEBUG("Stopping detached processes checker");
-			detachedProcessesCheckerActive = false;
-			break;
-		}
+/**
+ * Schedules a check of `detachedProcesses` in `timeout` milliseconds, unless
+ * one is already due before then.
+ *
+ * @pre Called from the pool's event loop thread.
+ */
+void
+Group::scheduleDetachedProcessesCheck(unsigned int timeout) {
+	unsigned long long time = SystemTime::getMonotonicUsec() + timeout * 1000ull;
+	if (detachedProcessesCheckTime == 0 || time < detachedProcessesCheckTime) {
+		detachedProcessesCheckTime = time;
+		getPool()->detachedProcessesLoop.safe->runAfter(timeout, boost::bind(
+			&Group::onDetachedProcessesCheckTimeout, this, shared_from_this(), time));
+	}
+}
 
-		UPDATE_TRACE_POINT();
-		if (!detachedProcesses.empty()) {
-			P_TRACE(2, "Checking whether any of the " << detachedProcesses.size() <<
-				" detached processes have exited...");
-			ProcessList::iterator it = detachedProcesses.begin();
-			ProcessList::iterator end = detachedProcesses.end();
-			while (it != end) {
-				const ProcessPtr process = *it;
-				switch (process->getLifeStatus()) {
-				case Process::ALIVE:
-					if (process->canTriggerShutdown()) {
-						P_DEBUG("Detached process " << process->inspect() <<
-							" has 0 active sessions now. Triggering shutdown.");
-						process->triggerShutdown();
-						assert(process->getLifeStatus() == Process::SHUTDOWN_TRIGGERED);
-					}
-					it++;
-					break;
-				case Process::SHUTDOWN_TRIGGERED:
-					if (process->canCleanup()) {
-						P_DEBUG("Detached process " << process->inspect() << " has shut down. Cleaning up associated resources.");
-						process->cleanup();
-						assert(process->getLifeStatus() == Process::DEAD);
-						it++;
-						removeProcessFromList(process, detachedProcesses);
-					} else if (process->shutdownTimeoutExpired()) {
-						P_WARN("Detached process " << process->inspect() <<
-							" didn't shut down within " PROCESS_SHUTDOWN_TIMEOUT_DISPLAY
-							". Forcefully killing it with SIGKILL.");
-						kill(process->pid, SIGKILL);
-						it++;
-					} else {
-						it++;
-					}
-					break;
-				default:
-					P_BUG("Unknown 'lifeStatus' state " << (int) process->getLifeStatus());
-				}
-			}
+void
+Group::onDetachedProcessesCheckTimeout(GroupPtr self, unsigned long long time) {
+	// Only the most recently scheduled timeout is tracked; earlier ones
+	// are superseded but still perform a (harmless) check.
+	if (detachedProcessesCheckTime == time) {
+		detachedProcessesCheckTime = 0;
+	}
+	checkDetachedProcesses(self);
+}
+
+void
+Group::onDetachedProcessExited(boost::weak_ptr<Group> weakSelf) {
+	GroupPtr self = weakSelf.lock();
+	if (self != NULL) {
+		self->checkDetachedProcesses(self);
+	}
+}
+
+/**
+ * Tells the detached processes without sessions to shut down, cleans up the
+ * ones that have exited and kills the ones that don't shut down in time.
+ * Processes that are told to shut down are watched with a ProcessExitWatcher,
+ * so that they are cleaned up as soon as they exit. They are only polled on
+ * systems that don't support that. Finishes the group's shutdown once all
+ * detached processes are gone.
+ *
+ * Runs on the pool's event loop.
+ */
+void
+Group::checkDetachedProcesses(GroupPtr self) {
+	TRACE_POINT();
+	SuperGroupPtr superGroup = getSuperGroup();
+	if (superGroup == NULL || getLifeStatus() == SHUT_DOWN) {
+		return;
+	}
+	PoolPtr pool = superGroup->getPool();
+	if (pool == NULL) {
+		return;
+	}
+
+	PoolLock lock(pool->syncher);
+	detachedProcessesCheckScheduled = false;
+	if (getLifeStatus() == SHUT_DOWN) {
+		return;
+	}
+
+	UPDATE_TRACE_POINT();
+	SafeLibev *libev = pool->detachedProcessesLoop.safe.get();
+	unsigned int timeout = 0;
+	ProcessList::iterator it = detachedProcesses.begin();
+	ProcessList::iterator end = detachedProcesses.end();
+	while (it != end) {
+		const ProcessPtr process = *it;
+		it++;
+
+		if (process->canTriggerShutdown()) {
+			P_DEBUG("Detached process " << process->inspect() <<
+				" has 0 active sessions now. Triggering shutdown.");
+			process->triggerShutdown();
+			assert(process->getLifeStatus() == Process::SHUTDOWN_TRIGGERED);
+		}
+		if (process->getLifeStatus() != Process::SHUTDOWN_TRIGGERED) {
+			// Waiting for its sessions to be closed.
+			continue;
 		}
 
-		UPDATE_TRACE_POINT();
-		if (detachedProcesses.empty()) {
-			UPDATE_TRACE_POINT();
-			P_DEBUG("Stopping detached processes checker");
-			detachedProcessesCheckerActive = false;
+		if (process->canCleanup()) {
+			P_DEBUG("Detached process " << process->inspect() << " has shut down. Cleaning up associated resources.");
+			process->cleanup();
+			assert(process->getLifeStatus() == Process::DEAD);
+			removeProcessFromList(process, detachedProcesses);
+			continue;
+		}
 
-			vector<Callback> actions;
-			if (shutdownCanFinish()) {
-				UPDATE_TRACE_POINT();
-				finishShutdown(actions);
-			}
+		if (!process->exitWatched && !process->isRemote()) {
+			process->exitWatched = ProcessExitWatcher::watch(libev, process->pid,
+				boost::bind(onDetachedProcessExited, boost::weak_ptr<Group>(self)));
+		}
 
-			verifyInvariants();
-			verifyExpensiveInvariants();
-			lock.unlock();
-			UPDATE_TRACE_POINT();
-			runAllActions(actions);
-			break;
+		unsigned int processTimeout;
+		if (process->shutdownTimeoutExpired()) {
+			P_WARN("Detached process " << process->inspect() <<
+				" didn't shut down within " PROCESS_SHUTDOWN_TIMEOUT_DISPLAY
+				". Forcefully killing it with SIGKILL.");
+			process->kill(SIGKILL);
+			processTimeout = 1000;
 		} else {
+			processTimeout = process->shutdownTimeoutRemaining();
+		}
+		if (!process->exitWatched) {
+			processTimeout = std::min(processTimeout, 100u);
+		}
+		if (timeout == 0 || processTimeout < timeout) {
+			timeout = std::max(processTimeout, 1u);
+		}
+	}
+
+	UPDATE_TRACE_POINT();
+	vector<Callback> actions;
+	if (detachedProcesses.empty()) {
+		P_DEBUG("All detached processes of group " << name << " have shut down");
+		if (shutdownCanFinish()) {
 			UPDATE_TRACE_POINT();
-			verifyInvariants();
-			verifyExpensiveInvariants();
+			finishShutdown(actions);
 		}
+	} else if (timeout > 0) {
+		scheduleDetachedProcessesCheck(timeout);
+	}
 
-		// Not all processes can be shut down yet. Sleep for a while unless
-		// someone wakes us up.
+	verifyInvariants();
+	verifyExpensiveInvariants();
+	lock.unlock();
+	if (!actions.empty()) {
+		// finishShutdown() joins the group's threads, which must not
+		// block the event loop.
 		UPDATE_TRACE_POINT();
-		detachedProcessesCheckerCond.timed_wait(lock,
-			posix_time::milliseconds(100));
+		pool->nonInterruptableThreads.create_thread(
+			boost::bind(runAllActions, actions),
+			"Group shutdown finisher: " + name,
+			POOL_HELPER_THREAD_STACK_SIZE);
 	}
 }
 
@@ -1152,9 +1974,41 @@ Group::wakeUpGarbageCollector() {
 	getPool()->garbageCollectionCond.notify_all();
 }
 
+/**
+ * Whether the processes in the group's cgroup already spend so much time
+ * waiting for a CPU that another process would only add to the wait: they
+ * all share the cgroup's cpu.weight. Always false if cgroups are disabled or
+ * the kernel doesn't report CPU pressure.
+ */
+bool
+Group::cpuPressureTooHigh() const {
+	CgroupManagerPtr cgroupManager =
+		getPool()->spawnerFactory->getConfig()->cgroupManager;
+	return cgroupManager->enabled()
+		&& cgroupManager->getCpuPressure(options.getAppGroupName())
+			> CPU_PRESSURE_SPAWN_THRESHOLD;
+}
+
 bool
 Group::poolAtFullCapacity() const {
-	return getPool()->atFullCapacity(false);
+	unsigned int allowance = surgeAllowance();
+	if (allowance == 0) {
+		return getPool()->atFullCapacity(false);
+	} else {
+		PoolPtr pool = getPool();
+		return pool->capacityUsed(false) >= pool->max + allowance;
+	}
+}
+
+/* The first spawner thread of a group is always allowed, so that a group
+ * never has to wait for other groups to finish spawning. The limit only
+ * applies to the additional spawner threads.
+ */
+bool
+Group::poolSpawnConcurrencyLimitReached() const {
+	PoolPtr pool = getPool();
+	return pool->maxConcurrentSpawns > 0
+		&& pool->getProcessesBeingSpawned(false) >= pool->maxConcurrentSpawns;
 }
 
 bool
@@ -1183,6 +2037,30 @@ Group::poolForceFreeCapacity(const Group *exclude, vector<Callback> &postLockAct
 	return getPool()->forceFreeCapacity(exclude, postLockActions);
 }
 
+/* A group may always have one process, even if that exceeds the share,
+ * so that requests to it never wait forever.
+ */
+bool
+Group::capacityShareReached() const {
+	if (options.maxCapacityShare == 0 || options.maxCapacityShare >= 100
+	 || capacityUsed() == 0)
+	{
+		return false;
+	}
+	PoolPtr pool = getPool();
+	SuperGroupPtr superGroup = getSuperGroup();
+	unsigned int limit = std::max(1u, pool->max * options.maxCapacityShare / 100);
+	return superGroup != NULL
+		&& superGroup->capacityUsed() >= limit + surgeAllowance();
+}
+
+bool
+Group::belowGuaranteedCapacity() const {
+	SuperGroupPtr superGroup = getSuperGroup();
+	return superGroup != NULL
+		&& superGroup->capacityUsed() < options.guaranteedCapacity;
+}
+
 bool
 Group::testOverflowRequestQueue() const {
 	// This has a performance penalty, although I'm not sure whether the penalty is
@@ -1204,14 +2082,16 @@ Group::getResourceLocator() const {
 // pointer reference to increment.
 void
 Group::runAttachHooks(const ProcessPtr process) const {
-	getPool()->runHookScripts("attached_process",
-		boost::bind(&Group::setupAttachOrDetachHook, this, process, _1));
+	getPool()->scheduleHookScripts("attached_process",
+		boost::bind(&Group::setupAttachOrDetachHook, this, process, _1),
+		"attached_process:" + name);
 }
 
 void
 Group::runDetachHooks(const ProcessPtr process) const {
-	getPool()->runHookScripts("detached_process",
-		boost::bind(&Group::setupAttachOrDetachHook, this, process, _1));
+	getPool()->scheduleHookScripts("detached_process",
+		boost::bind(&Group::setupAttachOrDetachHook, this, process, _1),
+		"detached_process:" + name);
 }
 
 void
@@ -1220,6 +2100,25 @@ Group::setupAttachOrDetachHook(const ProcessPtr process, HookScriptOptions &opti
 	options.environment.push_back(make_pair("PASSENGER_APP_ROOT", this->options.appRoot));
 }
 
+void
+Group::journalAttachedProcess(const ProcessPtr &process) const {
+	const ProcessJournalPtr &journal = getPool()->journal;
+	if (journal != NULL && !process->dummy && !process->isRemote()) {
+		journal->attached(name, process);
+	}
+}
+
+void
+Group::journalDetachedProcess(const ProcessPtr &process) const {
+	const ProcessJournalPtr &journal = getPool()->journal;
+	// A handed off process belongs to the new helper agent's journal now.
+	if (journal != NULL && !process->dummy && !process->handedOff
+	 && !process->isRemote())
+	{
+		journal->detached(process);
+	}
+}
+
 string
 Group::generateSecret(const SuperGroupPtr &superGroup) {
 	return superGroup->getPool()->randomGenerator->generateAsciiString(43);
@@ -1237,6 +2136,9 @@ Process::inspect() const {
 	assert(getLifeStatus() != DEAD);
 	stringstream result;
 	result << "(pid=" << pid;
+	if (isRemote()) {
+		result << ", host=" << remoteAgent;
+	}
 	GroupPtr group = getGroup();
 	if (group != NULL) {
 		// This Process hasn't been attached to a Group yet.
@@ -1279,6 +2181,15 @@ Session::requestOOBW() {
 	process->getGroup()->requestOOBW(process);
 }
 
+void
+Session::reportResourceUsage(unsigned long long cpuTime, unsigned long long allocations) {
+	ProcessPtr process = getProcess();
+	GroupPtr group = process->getGroup();
+	if (group != NULL) {
+		group->recordResourceUsage(process, cpuTime, allocations);
+	}
+}
+
 int
 Session::kill(int signo) {
 	return getProcess()->kill(signo);
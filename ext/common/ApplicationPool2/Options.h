@@ -28,7 +28,15 @@
 #include <string>
 #include <vector>
 #include <utility>
+#include <map>
+#include <cstring>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <ApplicationPool2/AppTypes.h>
 #include <Account.h>
 #include <UnionStation.h>
@@ -43,6 +51,154 @@ namespace ApplicationPool2 {
 using namespace std;
 using namespace boost;
 
+/**
+ * The string data of a persisted Options object, except for the per-request
+ * fields. Persisted Options objects with the same values share one instance,
+ * so that persisting an Options object, e.g. for every queued get() request,
+ * usually costs no allocation or copy of the per-application values.
+ */
+struct InternedOptionsStrings {
+	/** All strings, NULL-terminated, back to back. */
+	shared_array<char> data;
+	/** The string fields, followed by the environment variable names and values. */
+	vector<StaticString> strings;
+};
+
+typedef boost::shared_ptr<const InternedOptionsStrings> InternedOptionsStringsPtr;
+
+/**
+ * The interning table for InternedOptionsStrings. It does not keep entries
+ * alive: entries are freed when the last Options object that uses them
+ * is destroyed, and the table occasionally sweeps away the dead ones.
+ * Thread-safe.
+ */
+class OptionsStringTable {
+private:
+	typedef multimap< size_t, boost::weak_ptr<const InternedOptionsStrings> > Map;
+
+	boost::mutex syncher;
+	Map entries;
+	/** The table is swept when it reaches this size. */
+	size_t sweepSize;
+
+	static size_t hashStrings(const vector<StaticString> &strings) {
+		StaticString::Hash hasher;
+		size_t result = strings.size();
+		vector<StaticString>::const_iterator it, end = strings.end();
+		for (it = strings.begin(); it != end; it++) {
+			result = result * 31 + hasher(*it) + it->size();
+		}
+		return result;
+	}
+
+	static InternedOptionsStringsPtr copyStrings(const vector<StaticString> &strings) {
+		boost::shared_ptr<InternedOptionsStrings> result =
+			boost::make_shared<InternedOptionsStrings>();
+		vector<StaticString>::const_iterator it, end = strings.end();
+		size_t len = 0;
+		char *pos;
+
+		for (it = strings.begin(); it != end; it++) {
+			len += it->size() + 1;
+		}
+		result->data.reset(new char[len]);
+		result->strings.reserve(strings.size());
+		pos = result->data.get();
+		for (it = strings.begin(); it != end; it++) {
+			memcpy(pos, it->data(), it->size());
+			pos[it->size()] = '\0';
+			result->strings.push_back(StaticString(pos, it->size()));
+			pos += it->size() + 1;
+		}
+		return result;
+	}
+
+	void sweep() {
+		Map::iterator it = entries.begin();
+		while (it != entries.end()) {
+			if (it->second.expired()) {
+				entries.erase(it++);
+			} else {
+				it++;
+			}
+		}
+		sweepSize = std::max<size_t>(64, entries.size() * 2);
+	}
+
+public:
+	OptionsStringTable()
+		: sweepSize(64)
+		{ }
+
+	/** Returns the entry with the given strings, creating it if necessary. */
+	InternedOptionsStringsPtr intern(const vector<StaticString> &strings) {
+		size_t hash = hashStrings(strings);
+		boost::lock_guard<boost::mutex> l(syncher);
+		pair<Map::iterator, Map::iterator> range = entries.equal_range(hash);
+		Map::iterator it;
+
+		for (it = range.first; it != range.second; it++) {
+			InternedOptionsStringsPtr entry = it->second.lock();
+			if (entry != NULL && entry->strings == strings) {
+				return entry;
+			}
+		}
+
+		InternedOptionsStringsPtr entry = copyStrings(strings);
+		if (entries.size() >= sweepSize) {
+			sweep();
+		}
+		entries.insert(make_pair(hash, boost::weak_ptr<const InternedOptionsStrings>(entry)));
+		return entry;
+	}
+
+	/** The number of entries, including dead ones that haven't been swept yet. */
+	size_t size() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return entries.size();
+	}
+
+	static OptionsStringTable &getInstance() {
+		static OptionsStringTable table;
+		return table;
+	}
+};
+
+/**
+ * Lets the caller of Pool::asyncGet() give up on a request while it waits
+ * in a get wait list, e.g. because the client disconnected. See
+ * Options::cancellation. Cancelled requests are taken off the wait list the
+ * next time the pool looks at it, and their callback is called with a
+ * GetAbortedException instead of a session, so that no process is occupied
+ * by a request whose response nobody will read.
+ */
+class GetCancellation {
+private:
+	boost::atomic<bool> cancelled;
+
+public:
+	GetCancellation()
+		: cancelled(false)
+		{ }
+
+	/** May be called from any thread. */
+	void cancel() {
+		cancelled.store(true, boost::memory_order_relaxed);
+	}
+
+	bool isCancelled() const {
+		return cancelled.load(boost::memory_order_relaxed);
+	}
+
+	/** Makes this object reusable for another request. Only call this
+	 * when no wait list refers to it anymore. */
+	void reset() {
+		cancelled.store(false, boost::memory_order_relaxed);
+	}
+};
+
+typedef boost::shared_ptr<GetCancellation> GetCancellationPtr;
+
 /**
  * This struct encapsulates information for ApplicationPool::get() and for
  * SpawnManager::spawn(), such as which application is to be spawned.
@@ -73,7 +229,12 @@ using namespace boost;
  */
 class Options {
 private:
+	/** The string data of the per-request fields. */
 	shared_array<char> storage;
+	/** The string data of the other string fields and the environment variables. */
+	InternedOptionsStringsPtr internedStrings;
+	
+	/** The string fields, except for the per-request ones. */
 	
 	vector<const StaticString *> getStringFields() const {
 		vector<const StaticString *> result;
@@ -106,12 +267,55 @@ private:
 		result.push_back(&loggingAgentUsername);
 		result.push_back(&loggingAgentPassword);
 		result.push_back(&groupSecret);
-		result.push_back(&hostName);
-		result.push_back(&uri);
 		result.push_back(&unionStationKey);
+		result.push_back(&warmupUrls);
+		result.push_back(&cpuAffinity);
+		result.push_back(&remoteAgents);
 		
 		return result;
 	}
+
+	vector<const StaticString *> getPerRequestStringFields() const {
+		vector<const StaticString *> result;
+		result.reserve(2);
+		result.push_back(&hostName);
+		result.push_back(&uri);
+		return result;
+	}
+
+	/**
+	 * Whether the given string fields and the environment variables still
+	 * refer to `internedStrings`, i.e. haven't been assigned since persist().
+	 */
+	bool usesInternedStrings(const vector<const StaticString *> &strings) const {
+		if (internedStrings == NULL
+		 || internedStrings->strings.size() != strings.size() + 2 * environmentVariables.size())
+		{
+			return false;
+		}
+
+		const vector<StaticString> &interned = internedStrings->strings;
+		unsigned int i;
+		for (i = 0; i < strings.size(); i++) {
+			if (strings[i]->data() != interned[i].data()
+			 || strings[i]->size() != interned[i].size())
+			{
+				return false;
+			}
+		}
+		for (i = 0; i < environmentVariables.size(); i++) {
+			const StaticString &name = interned[strings.size() + 2 * i];
+			const StaticString &value = interned[strings.size() + 2 * i + 1];
+			if (environmentVariables[i].first.data() != name.data()
+			 || environmentVariables[i].first.size() != name.size()
+			 || environmentVariables[i].second.data() != value.data()
+			 || environmentVariables[i].second.size() != value.size())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
 	
 	static inline void
 	appendKeyValue(vector<string> &vec, const char *key, const StaticString &value) {
@@ -277,6 +481,13 @@ public:
 	 */
 	bool loadShellEnvvars;
 	
+	/**
+	 * Whether the Ruby loaders should cache the contents of gem directories
+	 * in the load path, to speed up `require` during startup. The cache is
+	 * stored in the generation directory. See LoadPathCache in the Ruby code.
+	 */
+	bool loadPathCache;
+	
 	/** Whether Union Station logging should be enabled. This option only affects
 	 * whether the application enables Union Station support; whether a request
 	 * actually results in data being logged to Union Station depends on whether
@@ -326,12 +537,184 @@ public:
 	 */
 	unsigned int maxOutOfBandWorkInstances;
 
+	/**
+	 * The maximum percentage of a group's processes that may be performing
+	 * out-of-band work at the same time, on top of maxOutOfBandWorkInstances.
+	 * Keeps processes that all request out-of-band work at once from taking
+	 * too much of the group's capacity away. One process may always perform
+	 * out-of-band work. 0 (the default) means no limit besides
+	 * maxOutOfBandWorkInstances.
+	 */
+	unsigned int maxOutOfBandWorkPercentage;
+
+	/**
+	 * The minimum time in milliseconds between the starts of out-of-band
+	 * work in the same group, so that the processes that request it at the
+	 * same moment take turns. 0 (the default) means no minimum.
+	 */
+	unsigned int outOfBandWorkInterval;
+
 	/**
 	 * The maximum number of requests that may live in the Group.getWaitlist queue.
 	 * A value of 0 means unlimited.
 	 */
 	unsigned int maxRequestQueueSize;
 
+	/**
+	 * The queue wait deadline in milliseconds. When requests that are taken
+	 * off the Group.getWaitlist queue have waited longer than this for a while
+	 * (see QueueWaitTracker::overloaded()), new requests are rejected instead
+	 * of queued, until the queue drains. A value of 0 means unlimited.
+	 */
+	unsigned int maxRequestQueueTime;
+
+	/**
+	 * The maximum time in seconds that a process may take to respond to a
+	 * request. A process that exceeds it is considered stuck: the request
+	 * is aborted and the process is detached. See
+	 * RequestHandler::onMaxRequestTimeExceeded(). A value of 0 (the default)
+	 * means unlimited.
+	 */
+	unsigned int maxRequestTime;
+
+	/**
+	 * Whether requests are routed to the process with the lowest expected
+	 * latency (see Process::expectedLatency()) instead of the least busy one.
+	 * Helps when some processes respond slower than others, e.g. because of
+	 * garbage collection pauses. Only takes effect when the group is created
+	 * or restarted. False by default.
+	 */
+	bool latencyAwareRouting;
+
+	/**
+	 * When non-zero, a process is spawned ahead of demand as soon as the
+	 * projected number of concurrent requests reaches this percentage of the
+	 * capacity of the group's processes, based on the request arrival rate
+	 * and concurrency over the past few seconds. The usual process limits
+	 * still apply. 0 (the default) only spawns when all processes are busy.
+	 */
+	unsigned int spawnAheadUtilization;
+
+	/**
+	 * When non-zero, the concurrency of processes that announce support for
+	 * more than one concurrent session is tuned at runtime, between 1 and
+	 * this value, based on how their response times change with load (see
+	 * ConcurrencyTuner). Useful for multithreaded applications, whose ideal
+	 * concurrency depends on how much time they spend waiting for I/O.
+	 * Only affects processes attached after it is set. 0 (the default)
+	 * keeps the concurrency that the application announced.
+	 */
+	unsigned int maxTunedConcurrency;
+
+	/**
+	 * The maximum number of processes that may be spawned for the group at
+	 * the same time. Values below 1 are treated as 1.
+	 */
+	unsigned int maxConcurrentSpawns;
+
+	/**
+	 * The number of fully spawned standby processes to keep around for the
+	 * group. They take no traffic until the group needs more capacity, at which
+	 * point one is attached instantly instead of spawning a new process. They
+	 * count towards maxProcesses and the pool size. 0 (the default) disables
+	 * standby processes.
+	 */
+	unsigned int standbyProcesses;
+
+	/**
+	 * Whether restarting the group (e.g. because restart.txt was touched)
+	 * replaces its processes gradually while the old ones keep serving
+	 * requests, instead of shutting them all down first.
+	 */
+	bool rollingRestart;
+
+	/**
+	 * The number of replacement processes that a rolling restart may spawn
+	 * at the same time, temporarily exceeding maxProcesses and the pool size
+	 * by that many. It is further limited by available memory. Values below
+	 * 1 are treated as 1.
+	 */
+	unsigned int maxSurge;
+
+	/**
+	 * The number of old processes that a rolling restart may shut down before
+	 * their replacements are ready, to make room for them. At least one old
+	 * process always keeps serving until a new one is ready.
+	 */
+	unsigned int maxUnavailable;
+
+	/**
+	 * The maximum amount of memory, in MB, that a process of the group may
+	 * use, as measured by Pool's periodic process metrics collection
+	 * (private dirty RSS plus swap where available). A process that exceeds
+	 * it is detached, meaning that it finishes its current requests, receives
+	 * no new ones and is then shut down. 0 (the default) means unlimited.
+	 */
+	unsigned int memoryLimit;
+
+	/**
+	 * Whether a process that exceeds memoryLimit is first sent an out-of-band
+	 * work request, so that it can garbage collect. It is only detached if
+	 * it still exceeds the limit after that. False by default.
+	 */
+	bool memoryLimitOobw;
+
+	/**
+	 * The relative weight of the group's SuperGroup when the pool's capacity
+	 * is shared between SuperGroups. A SuperGroup's fair share of the pool is
+	 * `max * capacityWeight / (sum of the weights of all SuperGroups)`. When
+	 * the pool is full, capacity is reclaimed from the SuperGroup that is
+	 * furthest above its fair share, and freed capacity goes to those furthest
+	 * below it first. Values below 1 are treated as 1. 1 by default.
+	 */
+	unsigned int capacityWeight;
+
+	/**
+	 * The number of processes of the group's SuperGroup that are never shut
+	 * down to make room for other SuperGroups. While it has fewer processes
+	 * than this, the SuperGroup may itself shut down idle processes of other
+	 * SuperGroups to make room. Idle processes are still shut down after
+	 * maxIdleTime. 0 (the default) guarantees nothing.
+	 */
+	unsigned int guaranteedCapacity;
+
+	/**
+	 * The maximum percentage of the pool's capacity that the group's
+	 * SuperGroup may use. At least one process is always allowed. 0 (the
+	 * default) means no limit other than the pool size.
+	 */
+	unsigned int maxCapacityShare;
+
+	/**
+	 * A space-separated list of URIs (paths, optionally with a query string)
+	 * that are requested from every newly spawned process of the group, one
+	 * after the other, before it is enabled and receives real traffic. Until
+	 * then the process counts as still being spawned. Failed warmup requests
+	 * are logged and otherwise ignored. Empty by default.
+	 */
+	StaticString warmupUrls;
+
+	/**
+	 * The policy by which newly spawned processes are pinned to CPUs:
+	 * "round-robin", "numa-node" or "agent". See CpuAffinityAllocator.
+	 * Only supported on Linux. Empty (the default) means no pinning.
+	 */
+	StaticString cpuAffinity;
+
+	/**
+	 * A space-separated list of addresses ("tcp://host:port") of
+	 * RemoteAgents on which the group may run processes, see RemoteSpawner.
+	 * Empty (the default) means that all processes run locally.
+	 */
+	StaticString remoteAgents;
+
+	/**
+	 * If remoteAgents is set, the number of the group's processes that are
+	 * spawned locally before new processes spill over to the RemoteAgents.
+	 * 0 (the default) means that all processes run remotely.
+	 */
+	unsigned int maxLocalProcesses;
+
 	/**
 	 * The Union Station key to use in case analytics logging is enabled.
 	 * It is used by Pool::collectAnalytics() and other administrative
@@ -362,10 +745,24 @@ public:
 	 */
 	UnionStation::LoggerPtr logger;
 
+	/**
+	 * If set, the request is dropped from the get wait list that it's
+	 * queued in once this is cancelled. May be the null pointer.
+	 */
+	GetCancellationPtr cancellation;
+
 	/**
 	 * A sticky session ID for routing to a specific process.
 	 */
 	unsigned int stickySessionId;
+
+	/**
+	 * The priority class of this request. When requests have to wait for a
+	 * process, those with a higher priority are served first, and when the
+	 * request queue is full, those with the lowest priority are rejected
+	 * first. 0 by default.
+	 */
+	unsigned int requestPriority;
 	
 	/**
 	 * A throttling rate for file stats. When set to a non-zero value N,
@@ -423,6 +820,7 @@ public:
 		rights                  = DEFAULT_BACKEND_ACCOUNT_RIGHTS;
 		debugger                = false;
 		loadShellEnvvars        = true;
+		loadPathCache           = false;
 		analytics               = false;
 		raiseInternalError      = false;
 		
@@ -430,9 +828,28 @@ public:
 		maxProcesses            = 0;
 		maxPreloaderIdleTime    = -1;
 		maxOutOfBandWorkInstances = 1;
+		maxOutOfBandWorkPercentage = 0;
+		outOfBandWorkInterval   = 0;
 		maxRequestQueueSize     = 100;
+		maxRequestQueueTime     = 0;
+		maxRequestTime          = 0;
+		latencyAwareRouting     = false;
+		spawnAheadUtilization   = 0;
+		maxTunedConcurrency     = 0;
+		maxConcurrentSpawns     = 1;
+		standbyProcesses        = 0;
+		rollingRestart          = false;
+		maxSurge                = 1;
+		maxUnavailable          = 0;
+		memoryLimit             = 0;
+		memoryLimitOobw         = false;
+		capacityWeight          = 1;
+		guaranteedCapacity      = 0;
+		maxCapacityShare        = 0;
+		maxLocalProcesses       = 0;
 		
 		stickySessionId         = 0;
+		requestPriority         = 0;
 		statThrottleRate        = 0;
 		maxRequests             = 0;
 		noop                    = false;
@@ -453,68 +870,72 @@ public:
 	/**
 	 * Assign <em>other</em>'s string fields' values into this Option
 	 * object, and store the data in this Option object's internal storage
-	 * area.
+	 * area. The values of the fields that are not per-request are interned
+	 * (see OptionsStringTable), so persisting Options with the same values
+	 * shares their data. And if <em>other</em> has been persisted and its
+	 * values haven't been changed since, they are shared without even
+	 * looking them up.
 	 */
 	Options &persist(const Options &other) {
 		const vector<const StaticString *> strings = getStringFields();
 		const vector<const StaticString *> otherStrings = other.getStringFields();
+		const vector<const StaticString *> perRequestStrings = getPerRequestStringFields();
+		const vector<const StaticString *> otherPerRequestStrings = other.getPerRequestStringFields();
+		InternedOptionsStringsPtr interned;
 		unsigned int i;
-		size_t otherLen = 0;
-		char *end;
+		size_t perRequestLen = 0;
 		
 		assert(strings.size() == otherStrings.size());
 		
-		// Calculate the desired length of the internal storage area.
-		// All strings are NULL-terminated.
-		for (i = 0; i < otherStrings.size(); i++) {
-			otherLen += otherStrings[i]->size() + 1;
-		}
-		for (i = 0; i < other.environmentVariables.size(); i++) {
-			otherLen += environmentVariables[i].first.size() + 1;
-			otherLen += environmentVariables[i].second.size() + 1;
+		if (other.usesInternedStrings(otherStrings)) {
+			interned = other.internedStrings;
+		} else {
+			vector<StaticString> values;
+			values.reserve(otherStrings.size() + 2 * other.environmentVariables.size());
+			for (i = 0; i < otherStrings.size(); i++) {
+				values.push_back(*otherStrings[i]);
+			}
+			for (i = 0; i < other.environmentVariables.size(); i++) {
+				values.push_back(other.environmentVariables[i].first);
+				values.push_back(other.environmentVariables[i].second);
+			}
+			interned = OptionsStringTable::getInstance().intern(values);
 		}
 		
-		shared_array<char> data(new char[otherLen]);
-		end = data.get();
-		
-		// Copy string fields into the internal storage area.
-		for (i = 0; i < otherStrings.size(); i++) {
-			const StaticString *str = strings[i];
-			const StaticString *otherStr = otherStrings[i];
-			
-			// Point current object's field to the data in the
-			// internal storage area.
-			*const_cast<StaticString *>(str) = StaticString(end, otherStr->size());
-			
-			// Copy over the string data.
-			memcpy(end, otherStr->c_str(), otherStr->size());
-			end += otherStr->size();
-			*end = '\0';
-			end++;
+		// Point the current object's fields to the interned data.
+		for (i = 0; i < strings.size(); i++) {
+			*const_cast<StaticString *>(strings[i]) = interned->strings[i];
 		}
-		
-		// Copy environmentVariables names and values into the internal storage area.
-		for (i = 0; i < other.environmentVariables.size(); i++) {
-			const pair<StaticString, StaticString> &p = other.environmentVariables[i];
-			
+		environmentVariables.resize(other.environmentVariables.size());
+		for (i = 0; i < environmentVariables.size(); i++) {
 			environmentVariables[i] = make_pair(
-				StaticString(end, p.first.size()),
-				StaticString(end + p.first.size() + 1, p.second.size())
-			);
-			
-			// Copy over string data.
-			memcpy(end, p.first.data(), p.first.size());
-			end += p.first.size();
-			*end = '\0';
-			end++;
-			
-			// Copy over value data.
-			memcpy(end, p.second.data(), p.second.size());
-			end += p.second.size();
-			*end = '\0';
-			end++;
+				interned->strings[strings.size() + 2 * i],
+				interned->strings[strings.size() + 2 * i + 1]);
 		}
+		internedStrings = interned;
 		
+		// Copy the per-request fields into the internal storage area.
+		// All strings are NULL-terminated.
+		for (i = 0; i < otherPerRequestStrings.size(); i++) {
+			perRequestLen += otherPerRequestStrings[i]->size();
+		}
+		if (perRequestLen == 0) {
+			for (i = 0; i < perRequestStrings.size(); i++) {
+				*const_cast<StaticString *>(perRequestStrings[i]) = StaticString();
+			}
+			storage.reset();
+			return *this;
+		}
+		perRequestLen += otherPerRequestStrings.size();
+		shared_array<char> data(new char[perRequestLen]);
+		char *end = data.get();
+		for (i = 0; i < otherPerRequestStrings.size(); i++) {
+			const StaticString *otherStr = otherPerRequestStrings[i];
+			memcpy(end, otherStr->data(), otherStr->size());
+			end[otherStr->size()] = '\0';
+			*const_cast<StaticString *>(perRequestStrings[i]) = StaticString(end, otherStr->size());
+			end += otherStr->size() + 1;
+		}
 		storage = data;
 		
 		return *this;
@@ -524,7 +945,9 @@ public:
 		hostName = StaticString();
 		uri      = StaticString();
 		stickySessionId = 0;
+		requestPriority = 0;
 		noop     = false;
+		cancellation.reset();
 		return clearLogger();
 	}
 
@@ -574,6 +997,7 @@ public:
 			appendKeyValue (vec, "logging_agent_password", loggingAgentPassword);
 			appendKeyValue4(vec, "debugger",           debugger);
 			appendKeyValue4(vec, "analytics",          analytics);
+			appendKeyValue4(vec, "load_path_cache",    loadPathCache);
 
 			appendKeyValue (vec, "group_secret",       groupSecret);
 		}
@@ -582,6 +1006,26 @@ public:
 			appendKeyValue3(vec, "max_processes",       maxProcesses);
 			appendKeyValue2(vec, "max_preloader_idle_time", maxPreloaderIdleTime);
 			appendKeyValue3(vec, "max_out_of_band_work_instances", maxOutOfBandWorkInstances);
+			appendKeyValue3(vec, "max_out_of_band_work_percentage", maxOutOfBandWorkPercentage);
+			appendKeyValue3(vec, "out_of_band_work_interval", outOfBandWorkInterval);
+			appendKeyValue4(vec, "latency_aware_routing", latencyAwareRouting);
+			appendKeyValue3(vec, "spawn_ahead_utilization", spawnAheadUtilization);
+			appendKeyValue3(vec, "max_tuned_concurrency", maxTunedConcurrency);
+			appendKeyValue3(vec, "max_concurrent_spawns", maxConcurrentSpawns);
+			appendKeyValue3(vec, "standby_processes", standbyProcesses);
+			appendKeyValue4(vec, "rolling_restart",     rollingRestart);
+			appendKeyValue3(vec, "max_surge",           maxSurge);
+			appendKeyValue3(vec, "max_unavailable",     maxUnavailable);
+			appendKeyValue3(vec, "memory_limit",        memoryLimit);
+			appendKeyValue4(vec, "memory_limit_oobw",   memoryLimitOobw);
+			appendKeyValue3(vec, "capacity_weight",     capacityWeight);
+			appendKeyValue3(vec, "max_request_time",    maxRequestTime);
+			appendKeyValue3(vec, "guaranteed_capacity", guaranteedCapacity);
+			appendKeyValue3(vec, "max_capacity_share",  maxCapacityShare);
+			appendKeyValue (vec, "warmup_urls",         warmupUrls);
+			appendKeyValue (vec, "cpu_affinity",        cpuAffinity);
+			appendKeyValue (vec, "remote_agents",       remoteAgents);
+			appendKeyValue3(vec, "max_local_processes", maxLocalProcesses);
 			appendKeyValue (vec, "union_station_key",   unionStationKey);
 		}
 		
@@ -27,6 +27,7 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <algorithm>
 #include <utility>
 #include <sstream>
@@ -37,27 +38,36 @@
 #include <boost/make_shared.hpp>
 #include <boost/function.hpp>
 #include <boost/foreach.hpp>
+#include <boost/atomic.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <oxt/dynamic_thread_group.hpp>
 #include <oxt/backtrace.hpp>
 #include <ApplicationPool2/Common.h>
 #include <ApplicationPool2/Process.h>
+#include <ApplicationPool2/ProcessJournal.h>
 #include <ApplicationPool2/Group.h>
 #include <ApplicationPool2/SuperGroup.h>
 #include <ApplicationPool2/Session.h>
 #include <ApplicationPool2/SpawnerFactory.h>
 #include <ApplicationPool2/Options.h>
+#include <ApplicationPool2/PoolSnapshot.h>
+#include <ApplicationPool2/SpawnScheduler.h>
+#include <BackgroundEventLoop.h>
+#include <SafeLibev.h>
 #include <UnionStation.h>
 #include <Logging.h>
 #include <Exceptions.h>
 #include <RandomGenerator.h>
 #include <Hooks.h>
+#include <HookScriptExecutor.h>
 #include <Utils/Lock.h>
 #include <Utils/AnsiColorConstants.h>
 #include <Utils/SystemTime.h>
 #include <Utils/MessagePassing.h>
 #include <Utils/VariantMap.h>
 #include <Utils/ProcessMetricsCollector.h>
+#include <Utils/FileChangeWatcher.h>
+#include <Utils/MetricsRegistry.h>
 
 namespace Passenger {
 namespace ApplicationPool2 {
@@ -84,6 +94,168 @@ public:
 			{ }
 	};
 
+	/**
+	 * Defers the pool bookkeeping of sessions that are closed on a single
+	 * thread, so that it can be done for many sessions at once. While a
+	 * batch is active on a thread (see activate()), closing a session on
+	 * that thread only queues the close. flush() then applies all queued
+	 * closes while holding the pool lock once, and assigns sessions to the
+	 * get waiters that they unblocked in the same pass.
+	 *
+	 * Until a close is flushed, its process still counts the session as
+	 * open. asyncGet() therefore flushes the calling thread's batch first,
+	 * so that it doesn't spawn a process just because of that.
+	 */
+	class SessionCloseBatch {
+	private:
+		struct Entry {
+			ProcessPtr process;
+			Socket *socket;
+			unsigned long long startTime;
+			bool used;
+		};
+
+		PoolPtr pool;
+		vector<Entry> entries;
+
+	public:
+		SessionCloseBatch(const PoolPtr &_pool)
+			: pool(_pool)
+			{ }
+
+		~SessionCloseBatch() {
+			deactivate();
+			flush();
+		}
+
+		/** Returns the batch that is active on the calling thread, or NULL. */
+		static SessionCloseBatch *current();
+
+		/**
+		 * Makes this the active batch of the calling thread. Unless this
+		 * object is destroyed on that thread, the thread must call
+		 * deactivate() or exit first.
+		 */
+		void activate();
+		void deactivate();
+
+		/** `used` is false for sessions that were never handed out, see
+		 * Process::sessionClosed(). */
+		void add(const ProcessPtr &process, Socket *socket,
+			unsigned long long startTime, bool used = true)
+		{
+			entries.push_back(Entry());
+			Entry &entry = entries.back();
+			entry.process = process;
+			entry.socket = socket;
+			entry.startTime = startTime;
+			entry.used = used;
+		}
+
+		bool empty() const {
+			return entries.empty();
+		}
+
+		/**
+		 * Applies the queued closes. Closes that are queued by the callbacks
+		 * that this calls are applied too, before returning.
+		 */
+		void flush();
+	};
+
+	class SessionLeases;
+	typedef boost::shared_ptr<SessionLeases> SessionLeasesPtr;
+
+	/**
+	 * Sessions that an event loop has checked out from the pool ahead of
+	 * time, so that it can hand them out for busy apps without locking the
+	 * pool. Leased sessions still count as open sessions, so the pool stays
+	 * authoritative about process capacity. See Group::leaseSessions() for
+	 * which sessions are leased.
+	 *
+	 * Whenever the pool needs the leased capacity back, e.g. because a
+	 * request is queued or a process is detached, disabled or about to do
+	 * out-of-band work, it calls recallSessionLeases(). Leases that were taken
+	 * before that are not handed out anymore, and are returned on their
+	 * holder's event loop. Unused leases are also returned `ttl` milliseconds
+	 * after they were taken, so that they don't keep processes from becoming
+	 * idle.
+	 *
+	 * Except for the destructor, this class may only be used from the event
+	 * loop thread.
+	 */
+	class SessionLeases: public boost::enable_shared_from_this<SessionLeases> {
+	private:
+		struct Bucket {
+			vector<SessionPtr> sessions;
+			/** The value of Pool::sessionLeaseGeneration when the
+			 * sessions were leased. */
+			unsigned int generation;
+			/** The number of leased sessions handed out since the last
+			 * refill, which haven't been recorded as arrivals yet. */
+			unsigned int arrivals;
+
+			Bucket()
+				: generation(0),
+				  arrivals(0)
+				{ }
+		};
+
+		PoolPtr pool;
+		SafeLibevPtr libev;
+		StringMap<Bucket> buckets;
+		unsigned int count;
+		bool registered;
+		ev::timer expiryTimer;
+
+		SessionPtr refill(const Options &options, unsigned int maxPerGroup);
+		void returnLeases(bool onlyRecalled);
+
+		void onExpired(ev::timer &timer, int revents) {
+			returnLeases(false);
+		}
+
+		static void onRecalled(boost::weak_ptr<SessionLeases> weakSelf);
+
+		friend class Pool;
+
+	public:
+		/** In milliseconds. */
+		unsigned int ttl;
+
+		SessionLeases(const PoolPtr &_pool, const SafeLibevPtr &_libev)
+			: pool(_pool),
+			  libev(_libev),
+			  count(0),
+			  registered(false),
+			  ttl(1000)
+		{
+			expiryTimer.set(_libev->getLoop());
+			expiryTimer.set<SessionLeases, &SessionLeases::onExpired>(this);
+		}
+
+		~SessionLeases() {
+			returnLeases(false);
+		}
+
+		/**
+		 * Hands out a leased session for the given options if there is one.
+		 * Otherwise leases up to `maxPerGroup` sessions along with checking
+		 * out one on the pool's fast path, or falls back to Pool::asyncGet().
+		 * 0 disables leasing.
+		 */
+		void asyncGet(const Options &options, const GetCallback &callback,
+			unsigned int maxPerGroup);
+
+		/** Returns a leased session for the given options, or NULL. */
+		SessionPtr checkout(const Options &options);
+
+		/** The number of leased sessions that haven't been handed out. */
+		unsigned int size() const {
+			return count;
+		}
+	};
+
 // Actually private, but marked public so that unit tests can access the fields.
 public:
 	friend class SuperGroup;
@@ -92,6 +264,16 @@ public:
 	typedef UnionStation::LoggerFactoryPtr LoggerFactoryPtr;
 	typedef UnionStation::LoggerPtr LoggerPtr;
 
+	/** Restart files are stat()ed at least this often (in seconds), even
+	 * if the file change watcher reports nothing. It can't see changes made
+	 * by other hosts on network file systems, and this keeps it from being
+	 * slower than the smallest sensible stat throttle rate for those. */
+	static const unsigned int RESTART_FILE_RECHECK_INTERVAL = 1;
+	/** The default number of hook scripts that may run in the background
+	 * at the same time. Can be changed with the `hook_concurrency` agent
+	 * option. */
+	static const unsigned int DEFAULT_HOOK_CONCURRENCY = 2;
+
 	struct DebugSupport {
 		/** Mailbox for the unit tests to receive messages on. */
 		MessageBoxPtr debugger;
@@ -104,7 +286,6 @@ public:
 		bool superGroup;
 		bool oobw;
 		bool testOverflowRequestQueue;
-		bool detachedProcessesChecker;
 
 		// The following fields may only be accessed by Pool.
 		boost::mutex syncher;
@@ -117,7 +298,6 @@ public:
 			spawning   = true;
 			superGroup = false;
 			oobw       = false;
-			detachedProcessesChecker = false;
 			testOverflowRequestQueue = false;
 			spawnLoopIteration = 0;
 		}
@@ -129,11 +309,71 @@ public:
 	LoggerFactoryPtr loggerFactory;
 	RandomGeneratorPtr randomGenerator;
 
-	mutable boost::mutex syncher;
+	/**
+	 * Notifies Groups about changes to their restart files, so that they
+	 * don't have to stat() them on every get(). Created by initialize();
+	 * NULL before that, in which case Groups always stat().
+	 */
+	FileChangeWatcherPtr restartFileWatcher;
+	/**
+	 * Runs the hook scripts that don't have to finish before the pool can
+	 * carry on, like the `attached_process` hook. Created by initialize();
+	 * NULL before that, in which case those hook scripts are run
+	 * synchronously.
+	 */
+	HookScriptExecutorPtr hookScriptExecutor;
+	/**
+	 * Where Groups register their metrics. Created by the constructor; the
+	 * HelperAgent shares it with its RequestHandlers.
+	 */
+	MetricsRegistryPtr metrics;
+	/**
+	 * Journals the attached processes so that they can be recovered after a
+	 * helper agent crash. Set by the HelperAgent; NULL if it doesn't
+	 * journal processes.
+	 */
+	ProcessJournalPtr journal;
+
+	/**
+	 * Held exclusively by everything that changes pool, SuperGroup or Group
+	 * state, except for the fast paths of asyncGet() and
+	 * Group::onSessionClose(), which hold it in shared mode together with
+	 * the Group's sessionSyncher. As before, callbacks and other post lock
+	 * actions must be run after releasing it.
+	 */
+	mutable PoolSyncher syncher;
 	unsigned int max;
 	unsigned long long maxIdleTime;
+	/**
+	 * Groups are scaled down gradually: the garbage collector detaches at
+	 * most one of a group's processes that have been idle for more than
+	 * maxIdleTime per this many microseconds, and only while the group has
+	 * more processes than its recent peak concurrency requires (see
+	 * Group::scaleDownTarget()). This
+	 * keeps processes that were spawned together for a traffic peak from
+	 * all being shut down at once, only to be spawned again when traffic
+	 * picks up.
+	 */
+	unsigned long long scaleDownInterval;
+	/**
+	 * SuperGroups that have had no processes, and no requests, for this many
+	 * microseconds are detached by the garbage collector, freeing their
+	 * options, spawners, file watchers and so on. Only their names are
+	 * remembered, in `dormantSuperGroups`. The next request for one of them
+	 * creates it anew, just like the first request after the Pool started.
+	 * 0 means that SuperGroups are never made dormant.
+	 */
+	unsigned long long maxDormancyIdleTime;
+	/** The names of the dormant SuperGroups, mapped to when they became dormant. */
+	map<string, unsigned long long> dormantSuperGroups;
+	/** The maximum number of processes that may be spawned at the same time
+	 * in the entire pool, on top of one per group. 0 means unlimited. */
+	unsigned int maxConcurrentSpawns;
+	/** Limits how many of the processes that are being spawned are actually
+	 * being started at the same time, see SpawnScheduler. */
+	SpawnScheduler spawnScheduler;
 	
-	boost::condition_variable garbageCollectionCond;
+	boost::condition_variable_any garbageCollectionCond;
 	
 	/**
 	 * Code can register background threads in one of these dynamic thread groups
@@ -146,6 +386,20 @@ public:
 	 */
 	dynamic_thread_group interruptableThreads;
 	dynamic_thread_group nonInterruptableThreads;
+	/** Incremented by recallSessionLeases(); leases that were taken before
+	 * that may not be handed out anymore. */
+	boost::atomic<unsigned int> sessionLeaseGeneration;
+	/** The number of leased sessions that haven't been handed out. */
+	boost::atomic<unsigned int> sessionLeaseCount;
+	boost::mutex sessionLeaseHoldersSyncher;
+	vector< boost::weak_ptr<SessionLeases> > sessionLeaseHolders;
+	/**
+	 * The event loop on which Groups wait for their detached processes to
+	 * exit, see Group::checkDetachedProcesses(). It's separate from the
+	 * spawners' event loop so that destroy() may be called from that loop.
+	 * Started by initialize() and stopped by destroy().
+	 */
+	BackgroundEventLoop detachedProcessesLoop;
 
 	enum LifeStatus {
 		ALIVE,
@@ -154,6 +408,16 @@ public:
 	} lifeStatus;
 	
 	SuperGroupMap superGroups;
+
+	/**
+	 * Indexes for the find*() methods. The process indexes contain the
+	 * enabled, disabling and disabled processes of all groups, and are
+	 * maintained by Group::attach(), Group::detach() and Group::detachAll().
+	 * `superGroupsBySecret` contains the same SuperGroups as `superGroups`.
+	 */
+	HashMap<pid_t, ProcessPtr> processesByPid;
+	StringMap<ProcessPtr> processesByGupid;
+	SuperGroupMap superGroupsBySecret;
 	
 	/**
 	 * get() requests that...
@@ -193,6 +457,41 @@ public:
 	 */
 	vector<GetWaiter> getWaitlist;
 
+	/**
+	 * Processes that the previous HelperAgent has handed off to us, keyed by
+	 * group name, which haven't been attached to their Group yet. See
+	 * addHandedOffProcess(). `handedOffProcessesTime` is the time at which
+	 * the last one was added.
+	 */
+	map< string, vector<ProcessPtr> > handedOffProcesses;
+	unsigned long long handedOffProcessesTime;
+
+	/**
+	 * The enabled processes without sessions of all groups, least recently
+	 * used first. Processes are appended when they become idle, and removed
+	 * as soon as they are given a session or are no longer enabled. The list
+	 * is thus ordered by idle deadline (Process::idleSince + maxIdleTime), so
+	 * that the garbage collector only has to look at the processes whose
+	 * deadline has passed, and forceFreeCapacity() finds the processes to
+	 * shut down without scanning every group. Protected by
+	 * `idleProcessesSyncher`, because sessions may be opened and closed while
+	 * holding the pool lock in shared mode only.
+	 */
+	IdleProcessList idleProcesses;
+	boost::mutex idleProcessesSyncher;
+
+	/**
+	 * Incremented when SuperGroups or processes are added or removed, and when
+	 * process metrics have been updated. Tells getStatsSnapshot() whether
+	 * `statsSnapshot` is outdated. Only changed while holding the pool lock.
+	 */
+	boost::atomic<unsigned int> statsGeneration;
+	/**
+	 * The snapshot that getStatsSnapshot() created last. Only accessed with
+	 * boost::atomic_load() and boost::atomic_store(), without the pool lock.
+	 */
+	mutable PoolSnapshotPtr statsSnapshot;
+
 	const VariantMap *agentsOptions;
 	DebugSupportPtr debugSupport;
 	
@@ -248,27 +547,58 @@ public:
 		}
 	}
 	
-	bool runHookScripts(const char *name,
-		const boost::function<void (HookScriptOptions &)> &setup) const
+	bool prepareHookScripts(const char *name,
+		const boost::function<void (HookScriptOptions &)> &setup,
+		HookScriptOptions &options) const
 	{
 		if (agentsOptions != NULL) {
 			string hookName = string("hook_") + name;
 			string spec = agentsOptions->get(hookName, false);
 			if (!spec.empty()) {
-				HookScriptOptions options;
 				options.agentsOptions = agentsOptions;
 				options.name = name;
 				options.spec = spec;
+				options.timeout = agentsOptions->getInt("hook_timeout", false, 0);
 				setup(options);
-				return Passenger::runHookScripts(options);
-			} else {
 				return true;
+			} else {
+				return false;
 			}
+		} else {
+			return false;
+		}
+	}
+
+	bool runHookScripts(const char *name,
+		const boost::function<void (HookScriptOptions &)> &setup) const
+	{
+		HookScriptOptions options;
+		if (prepareHookScripts(name, setup, options)) {
+			return Passenger::runHookScripts(options);
 		} else {
 			return true;
 		}
 	}
 
+	/**
+	 * Like runHookScripts(), but runs the hook scripts in the background
+	 * and ignores their result. Hook scripts with the same `batchKey` may
+	 * be merged into a single invocation; see HookScriptExecutor.
+	 */
+	void scheduleHookScripts(const char *name,
+		const boost::function<void (HookScriptOptions &)> &setup,
+		const string &batchKey = string()) const
+	{
+		HookScriptOptions options;
+		if (prepareHookScripts(name, setup, options)) {
+			if (hookScriptExecutor != NULL) {
+				hookScriptExecutor->schedule(options, batchKey);
+			} else {
+				Passenger::runHookScripts(options);
+			}
+		}
+	}
+
 	static const char *maybePluralize(unsigned int count, const char *singular, const char *plural) {
 		if (count == 1) {
 			return singular;
@@ -277,38 +607,69 @@ public:
 		}
 	}
 
-	ProcessPtr findOldestIdleProcess(const Group *exclude = NULL) const {
-		ProcessPtr oldestIdleProcess;
-		
+	/**
+	 * The capacity that a SuperGroup uses per unit of capacityWeight. Fair
+	 * shares are proportional to the weights, so this orders SuperGroups by
+	 * how far they are above or below their fair share of the pool.
+	 */
+	static double capacityUsedPerWeight(const SuperGroup *superGroup) {
+		return (double) superGroup->capacityUsed() / superGroup->capacityWeight();
+	}
+
+	/**
+	 * Finds the idle process to shut down in order to make room for another
+	 * SuperGroup: the least recently used idle process of the SuperGroup that
+	 * is furthest above its fair share. SuperGroups that don't use more than
+	 * their guaranteedCapacity are left alone.
+	 *
+	 * `idleProcesses` is walked from the least recently used process onwards,
+	 * so the first process encountered of a SuperGroup is its oldest one, and
+	 * the walk ends as soon as one of the SuperGroup that is furthest above
+	 * its share is found. That is usually the first one.
+	 */
+	ProcessPtr findIdleProcessToReclaim(const Group *exclude) const {
+		map<const SuperGroup *, double> usages;
+		double maxUsage = -1;
+
 		SuperGroupMap::const_iterator it, end = superGroups.end();
 		for (it = superGroups.begin(); it != end; it++) {
-			const SuperGroupPtr &superGroup = it->second;
-			const vector<GroupPtr> &groups = superGroup->groups;
-			vector<GroupPtr>::const_iterator g_it, g_end = groups.end();
-			for (g_it = groups.begin(); g_it != g_end; g_it++) {
-				const GroupPtr &group = *g_it;
-				if (group.get() == exclude) {
-					continue;
-				}
-				const ProcessList &processes = group->enabledProcesses;
-				ProcessList::const_iterator p_it, p_end = processes.end();
-				for (p_it = processes.begin(); p_it != p_end; p_it++) {
-					const ProcessPtr process = *p_it;
-					if (process->busyness() == 0
-					     && (oldestIdleProcess == NULL
-					         || process->lastUsed < oldestIdleProcess->lastUsed)
-					) {
-						oldestIdleProcess = process;
-					}
+			const SuperGroup *superGroup = it->second.get();
+			if (superGroup->capacityUsed() > superGroup->capacityOptions().guaranteedCapacity) {
+				double usage = capacityUsedPerWeight(superGroup);
+				usages.insert(make_pair(superGroup, usage));
+				maxUsage = std::max(maxUsage, usage);
+			}
+		}
+
+		Process *result = NULL;
+		double resultUsage = -1;
+		Process *process = idleProcesses.front();
+		while (process != NULL && resultUsage < maxUsage) {
+			const GroupPtr group = process->getGroup();
+			if (group.get() != exclude) {
+				map<const SuperGroup *, double>::const_iterator u_it =
+					usages.find(group->getSuperGroup().get());
+				if (u_it != usages.end() && u_it->second > resultUsage) {
+					result = process;
+					resultUsage = u_it->second;
 				}
 			}
+			process = IdleProcessList::next(process);
+		}
+
+		if (result != NULL) {
+			return result->shared_from_this();
+		} else {
+			return ProcessPtr();
 		}
-		
-		return oldestIdleProcess;
 	}
 	
 	ProcessPtr findBestProcessToTrash() const {
 		ProcessPtr oldestProcess;
+
+		if (!idleProcesses.empty()) {
+			return idleProcesses.front()->shared_from_this();
+		}
 		
 		SuperGroupMap::const_iterator it, end = superGroups.end();
 		for (it = superGroups.begin(); it != end; it++) {
@@ -332,18 +693,83 @@ public:
 		return oldestProcess;
 	}
 	
+	struct WeightedGetWaiter {
+		double virtualTime;
+		unsigned int index;
+
+		bool operator<(const WeightedGetWaiter &other) const {
+			return virtualTime < other.virtualTime;
+		}
+	};
+
+	/**
+	 * Reorders the waiters on `getWaitlist` that have the same request priority
+	 * by weighted fair queueing on their capacityWeight: the n-th waiter for an
+	 * app group gets its turn at virtual time n / weight. App groups are thus
+	 * served in proportion to their weights instead of in arrival order, and
+	 * no app group has to wait for all waiters of a busier one.
+	 */
+	void sortGetWaitlistByWeight() {
+		vector<GetWaiter>::size_type begin = 0, end;
+		vector<WeightedGetWaiter> order;
+		vector<GetWaiter> sorted;
+		StringMap<unsigned int> counts;
+
+		if (getWaitlist.size() < 2) {
+			return;
+		}
+		sorted.reserve(getWaitlist.size());
+
+		while (begin < getWaitlist.size()) {
+			unsigned int priority = getWaitlist[begin].options.requestPriority;
+			end = begin;
+			order.clear();
+			counts.clear();
+			while (end < getWaitlist.size()
+				&& getWaitlist[end].options.requestPriority == priority)
+			{
+				const Options &options = getWaitlist[end].options;
+				unsigned int count = counts.get(options.getAppGroupName(), 0) + 1;
+				counts.set(options.getAppGroupName(), count);
+
+				WeightedGetWaiter waiter;
+				waiter.virtualTime = (double) count / std::max(1u, options.capacityWeight);
+				waiter.index = end;
+				order.push_back(waiter);
+				end++;
+			}
+			std::stable_sort(order.begin(), order.end());
+			foreach (const WeightedGetWaiter &waiter, order) {
+				sorted.push_back(getWaitlist[waiter.index]);
+			}
+			begin = end;
+		}
+
+		std::swap(getWaitlist, sorted);
+	}
+
 	/** Process all waiters on the getWaitlist. Call when capacity has become free.
 	 * This function assigns sessions to them by calling get() on the corresponding
 	 * SuperGroups, or by creating more SuperGroups, in so far the new capacity allows.
 	 */
 	void assignSessionsToGetWaiters(vector<Callback> &postLockActions) {
 		bool done = false;
-		vector<GetWaiter>::iterator it, end = getWaitlist.end();
+		vector<GetWaiter>::iterator it, end;
 		vector<GetWaiter> newWaitlist;
 
+		sortGetWaitlistByWeight();
+		end = getWaitlist.end();
+
 		for (it = getWaitlist.begin(); it != end && !done; it++) {
 			GetWaiter &waiter = *it;
 
+			if (waiter.cancelled()) {
+				postLockActions.push_back(boost::bind(
+					waiter.callback, SessionPtr(),
+					GetWaiter::cancelledException()));
+				continue;
+			}
+
 			SuperGroup *superGroup = findMatchingSuperGroup(waiter.options);
 			if (superGroup != NULL) {
 				SessionPtr session = superGroup->get(waiter.options, waiter.callback,
@@ -382,14 +808,30 @@ public:
 		}
 	}
 	
+	static bool superGroupHasLessCapacityPerWeight(const SuperGroupPtr &a,
+		const SuperGroupPtr &b)
+	{
+		return capacityUsedPerWeight(a.get()) < capacityUsedPerWeight(b.get());
+	}
+
 	void possiblySpawnMoreProcessesForExistingGroups() {
 		StringMap<SuperGroupPtr>::const_iterator sg_it, sg_end = superGroups.end();
+		vector<SuperGroupPtr> sorted;
+
+		/* Free capacity goes to the SuperGroups that are furthest below
+		 * their fair share first.
+		 */
+		sorted.reserve(superGroups.size());
+		for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
+			sorted.push_back(sg_it->second);
+		}
+		std::stable_sort(sorted.begin(), sorted.end(), superGroupHasLessCapacityPerWeight);
+
 		/* Looks for Groups that are waiting for capacity to become available,
 		 * and spawn processes in those groups.
 		 */
-		for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
-			pair<StaticString, SuperGroupPtr> p = *sg_it;
-			foreach (GroupPtr group, p.second->groups) {
+		foreach (const SuperGroupPtr &superGroup, sorted) {
+			foreach (GroupPtr group, superGroup->groups) {
 				if (group->isWaitingForCapacity()) {
 					P_DEBUG("Group " << group->name << " is waiting for capacity");
 					group->spawn();
@@ -402,9 +844,8 @@ public:
 		/* Now look for Groups that haven't maximized their allowed capacity
 		 * yet, and spawn processes in those groups.
 		 */
-		for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
-			pair<StaticString, SuperGroupPtr> p = *sg_it;
-			foreach (GroupPtr group, p.second->groups) {
+		foreach (const SuperGroupPtr &superGroup, sorted) {
+			foreach (GroupPtr group, superGroup->groups) {
 				if (group->shouldSpawn()) {
 					P_DEBUG("Group " << group->name << " requests more processes to be spawned");
 					group->spawn();
@@ -419,7 +860,7 @@ public:
 	void migrateSuperGroupGetWaitlistToPool(const SuperGroupPtr &superGroup) {
 		getWaitlist.reserve(getWaitlist.size() + superGroup->getWaitlist.size());
 		while (!superGroup->getWaitlist.empty()) {
-			getWaitlist.push_back(superGroup->getWaitlist.front());
+			pushGetWaiterByPriority(getWaitlist, superGroup->getWaitlist.front());
 			superGroup->getWaitlist.pop_front();
 		}
 	}
@@ -431,7 +872,21 @@ public:
 	ProcessPtr forceFreeCapacity(const Group *exclude,
 		vector<Callback> &postLockActions)
 	{
-		ProcessPtr process = findOldestIdleProcess(exclude);
+		/* Standby processes are the cheapest to give up. */
+		StringMap<SuperGroupPtr>::const_iterator sg_it, sg_end = superGroups.end();
+		for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
+			pair<StaticString, SuperGroupPtr> p = *sg_it;
+			foreach (GroupPtr group, p.second->groups) {
+				if (group.get() != exclude) {
+					ProcessPtr process = group->detachStandbyProcess();
+					if (process != NULL) {
+						return process;
+					}
+				}
+			}
+		}
+
+		ProcessPtr process = findIdleProcessToReclaim(exclude);
 		if (process != NULL) {
 			P_DEBUG("Forcefully detaching process " << process->inspect() <<
 				" in order to free capacity in the pool");
@@ -463,6 +918,8 @@ public:
 		const SuperGroupPtr sp = superGroup; // Prevent premature destruction.
 		bool removed = superGroups.remove(superGroup->name);
 		assert(removed);
+		superGroupsBySecret.remove(superGroup->secret);
+		statsChanged();
 		(void) removed; // Shut up compiler warning.
 		superGroup->destroy(false, postLockActions, callback);
 	}
@@ -492,6 +949,32 @@ public:
 		}
 	}
 	
+	/**
+	 * Reports how long the least recently used idle processes, which are
+	 * the first to be shut down when capacity is needed, have been idle.
+	 * The exclusive pool lock must be held, so that `idleProcesses`
+	 * doesn't change.
+	 */
+	void inspectIdleProcesses(const InspectOptions &options, stringstream &result) const {
+		result << "Idle processes     : " << idleProcesses.size();
+		if (!idleProcesses.empty()) {
+			result << " (longest idle for " <<
+				distanceOfTimeInWords(idleProcesses.front()->idleSince / 1000000) << ")";
+		}
+		result << endl;
+		if (options.verbose) {
+			const Process *process = idleProcesses.front();
+			unsigned int i = 0;
+			while (process != NULL) {
+				result << "  " << i << ": PID " << process->pid << " (" <<
+					process->getGroup()->name << "), idle for " <<
+					distanceOfTimeInWords(process->idleSince / 1000000) << endl;
+				process = IdleProcessList::next(process);
+				i++;
+			}
+		}
+	}
+
 	void inspectProcessList(const InspectOptions &options, stringstream &result,
 		const Group *group, const ProcessList &processes) const
 	{
@@ -516,6 +999,11 @@ public:
 					membuf,
 					distanceOfTimeInWords(process->lastUsed / 1000000).c_str());
 			result << buf << endl;
+			if (options.verbose && process->metrics.sharedMemory() != -1) {
+				result << "    Shared  : " << process->metrics.sharedMemory() / 1024 <<
+					"M   Private dirty: " << process->metrics.privateDirty / 1024 <<
+					"M" << endl;
+			}
 
 			if (process->enabled == Process::DISABLING) {
 				result << "    Disabling..." << endl;
@@ -533,13 +1021,41 @@ public:
 		}
 	}
 
+	void inspectSpawnQueue(const InspectOptions &options, stringstream &result) const {
+		unsigned int limit = spawnScheduler.getLimit();
+		vector<SpawnScheduler::QueuedSpawn> queue = spawnScheduler.getQueue();
+
+		result << "Spawns in progress : " << spawnScheduler.getActive();
+		if (limit > 0) {
+			result << " (max " << limit << ")";
+		}
+		result << endl;
+		result << "Spawns in queue    : " << queue.size() << endl;
+		if (options.verbose) {
+			unsigned long long now = SystemTime::getMonotonicUsec();
+			vector<SpawnScheduler::QueuedSpawn>::const_iterator it, end = queue.end();
+			for (it = queue.begin(); it != end; it++) {
+				result << "  " << (it - queue.begin()) << ": " << it->groupName <<
+					", waiting for " << (now - std::min(now, it->enqueueTime)) / 1000 << "ms";
+				if (it->urgent) {
+					result << ", requests are queued";
+				}
+				result << endl;
+			}
+		}
+	}
+
 	struct DetachSuperGroupWaitTicket {
 		boost::mutex syncher;
 		boost::condition_variable cond;
 		SuperGroup::ShutdownResult result;
+		/** The number of SuperGroups that are still shutting down. */
+		unsigned int pending;
 		bool done;
 
 		DetachSuperGroupWaitTicket() {
+			result = SuperGroup::SUCCESS;
+			pending = 1;
 			done = false;
 		}
 	};
@@ -559,9 +1075,13 @@ public:
 		boost::shared_ptr<DetachSuperGroupWaitTicket> ticket)
 	{
 		LockGuard l(ticket->syncher);
-		ticket->done = true;
-		ticket->result = result;
-		ticket->cond.notify_one();
+		if (result != SuperGroup::SUCCESS) {
+			ticket->result = result;
+		}
+		if (--ticket->pending == 0) {
+			ticket->done = true;
+			ticket->cond.notify_one();
+		}
 	}
 
 	static void waitDetachSuperGroupCallback(boost::shared_ptr<DetachSuperGroupWaitTicket> ticket) {
@@ -603,7 +1123,7 @@ public:
 	static void garbageCollect(PoolPtr self) {
 		TRACE_POINT();
 		{
-			ScopedLock lock(self->syncher);
+			PoolLock lock(self->syncher);
 			self->garbageCollectionCond.timed_wait(lock,
 				posix_time::seconds(5));
 		}
@@ -611,7 +1131,7 @@ public:
 			try {
 				UPDATE_TRACE_POINT();
 				unsigned long long sleepTime = self->realGarbageCollect();
-				ScopedLock lock(self->syncher);
+				PoolLock lock(self->syncher);
 				self->garbageCollectionCond.timed_wait(lock,
 					posix_time::microseconds(sleepTime));
 			} catch (const thread_interrupted &) {
@@ -628,25 +1148,90 @@ public:
 		}
 	}
 
-	void maybeDetachIdleProcess(GarbageCollectorState &state, const GroupPtr &group,
-		const ProcessPtr &process, ProcessList::iterator &p_it)
-	{
-		assert(maxIdleTime > 0);
-		unsigned long long processGcTime =
-			process->lastUsed + maxIdleTime;
-		if (process->sessions == 0
-		 && state.now >= processGcTime
-		 && (unsigned long) group->getProcessCount() > group->options.minProcesses)
-		{
-			ProcessList::iterator prev = p_it;
-			prev--;
+	/**
+	 * Detaches the given process, which has been idle for more than
+	 * maxIdleTime, if its group is due for scaling down by one process.
+	 * Processes that aren't detached stay in `idleProcesses`, and are
+	 * looked at again on the next run.
+	 */
+	void maybeDetachIdleProcess(GarbageCollectorState &state, const ProcessPtr &process) {
+		if (process->sessions != 0 || process->enabled != Process::ENABLED) {
+			return;
+		}
+
+		GroupPtr group = process->getGroup();
+		unsigned long long deadline = group->lastScaleDownTime + scaleDownInterval;
+		if (group->lastScaleDownTime != 0 && state.now < deadline) {
+			maybeUpdateNextGcRuntime(state, deadline);
+			return;
+		}
+
+		unsigned int target = group->scaleDownTarget(state.now, maxIdleTime);
+		if (group->getProcessCount() > target) {
 			P_DEBUG("Garbage collect idle process: " << process->inspect() <<
-				", group=" << group->name);
+				", group=" << group->name << ", scaling down to " << target <<
+				" processes");
 			group->detach(process, state.actions);
-			p_it = prev;
-		} else {
-			maybeUpdateNextGcRuntime(state, processGcTime);
+			group->lastScaleDownTime = state.now;
+		} else if (group->getProcessCount() > group->options.minProcesses) {
+			// The target drops once the peak falls out of the window.
+			maybeUpdateNextGcRuntime(state,
+				group->demand.getSustainedPeakWindowEnd(maxIdleTime));
+		}
+	}
+
+	/**
+	 * Scales groups down by detaching processes that have been idle for more
+	 * than maxIdleTime. Only looks at the processes in `idleProcesses` whose
+	 * deadline has passed. See `scaleDownInterval`.
+	 */
+	void detachIdleProcesses(GarbageCollectorState &state) {
+		assert(maxIdleTime > 0);
+		vector<ProcessPtr> expired;
+
+		{
+			boost::lock_guard<boost::mutex> l(idleProcessesSyncher);
+			Process *process = idleProcesses.front();
+			while (process != NULL) {
+				unsigned long long processGcTime = process->idleSince + maxIdleTime;
+				if (state.now < processGcTime) {
+					maybeUpdateNextGcRuntime(state, processGcTime);
+					break;
+				}
+				expired.push_back(process->shared_from_this());
+				process = IdleProcessList::next(process);
+			}
+		}
+
+		foreach (const ProcessPtr &process, expired) {
+			maybeDetachIdleProcess(state, process);
+		}
+	}
+
+	/**
+	 * Shuts down the handed off processes that no request has asked for
+	 * within maxIdleTime, just like idle processes.
+	 */
+	void shutdownUnclaimedHandedOffProcesses(GarbageCollectorState &state) {
+		unsigned long long deadline = handedOffProcessesTime + maxIdleTime;
+		if (state.now < deadline) {
+			maybeUpdateNextGcRuntime(state, deadline);
+			return;
+		}
+
+		map< string, vector<ProcessPtr> >::const_iterator it;
+		for (it = handedOffProcesses.begin(); it != handedOffProcesses.end(); it++) {
+			foreach (const ProcessPtr &process, it->second) {
+				P_DEBUG("Shutting down unclaimed handed off process " <<
+					process->inspect() << ", group=" << it->first);
+				if (journal != NULL) {
+					journal->detached(process);
+				}
+				state.actions.push_back(boost::bind(
+					Process::forceTriggerShutdownAndCleanup, process));
+			}
 		}
+		handedOffProcesses.clear();
 	}
 
 	void maybeCleanPreloader(GarbageCollectorState &state, const GroupPtr &group) {
@@ -663,9 +1248,66 @@ public:
 		}
 	}
 
+	/**
+	 * OOBW that Group::oobwMayStartNow() deferred because of
+	 * outOfBandWorkInterval may not be reconsidered otherwise if the process
+	 * receives no more requests, so the garbage collector is scheduled for
+	 * when the interval has passed.
+	 */
+	void maybeInitiateDeferredOobw(GarbageCollectorState &state, const GroupPtr &group) {
+		group->initiateNextOobwRequest();
+		if (group->options.outOfBandWorkInterval != 0 && group->oobwRequested()) {
+			maybeUpdateNextGcRuntime(state, group->lastOobwStartTime +
+				group->options.outOfBandWorkInterval * 1000ull);
+		}
+	}
+
+	/**
+	 * Whether the given SuperGroup has no processes, nothing going on, and
+	 * nothing to remember except for its name, so that it can become dormant.
+	 * See `maxDormancyIdleTime`.
+	 */
+	static bool mayBecomeDormant(const SuperGroup *superGroup) {
+		if (superGroup->state != SuperGroup::READY
+		 || !superGroup->getWaitlist.empty()
+		 || !superGroup->detachedGroups.empty())
+		{
+			return false;
+		}
+		foreach (const GroupPtr &group, superGroup->groups) {
+			// A group that is backing off from spawning must keep
+			// remembering its spawn failures.
+			if (group->getProcessCount() > 0
+			 || !group->detachedProcesses.empty()
+			 || !group->getWaitlist.empty()
+			 || group->spawning()
+			 || group->restarting()
+			 || group->getThreadCount() > 0
+			 || group->consecutiveSpawnFailures > 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void maybeMakeDormant(GarbageCollectorState &state, const SuperGroupPtr &superGroup,
+		vector<SuperGroupPtr> &dormant)
+	{
+		if (!mayBecomeDormant(superGroup.get())) {
+			return;
+		}
+		unsigned long long deadline = superGroup->lastUsed + maxDormancyIdleTime;
+		if (state.now >= deadline) {
+			dormant.push_back(superGroup);
+		} else {
+			maybeUpdateNextGcRuntime(state, deadline);
+		}
+	}
+
 	unsigned long long realGarbageCollect() {
 		TRACE_POINT();
-		ScopedLock lock(syncher);
+		PoolLock lock(syncher);
 		SuperGroupMap::iterator it, end = superGroups.end();
 		GarbageCollectorState state;
 		state.now = SystemTime::getUsec();
@@ -674,7 +1316,17 @@ public:
 		P_DEBUG("Garbage collection time...");
 		verifyInvariants();
 		
+		if (maxIdleTime > 0) {
+			// Scale groups down by detaching processes that have been
+			// idle for more than maxIdleTime.
+			detachIdleProcesses(state);
+			if (!handedOffProcesses.empty()) {
+				shutdownUnclaimedHandedOffProcesses(state);
+			}
+		}
+
 		// For all supergroups and groups...
+		vector<SuperGroupPtr> dormant;
 		for (it = superGroups.begin(); it != end; it++) {
 			SuperGroupPtr superGroup = it->second;
 			vector<GroupPtr> &groups = superGroup->groups;
@@ -685,24 +1337,28 @@ public:
 			for (g_it = groups.begin(); g_it != g_end; g_it++) {
 				GroupPtr group = *g_it;
 
-				if (maxIdleTime > 0) {
-					ProcessList &processes = group->enabledProcesses;
-					ProcessList::iterator p_it, p_end = processes.end();
-
-					for (p_it = processes.begin(); p_it != p_end; p_it++) {
-						ProcessPtr process = *p_it;
-						// ...detach processes that have been idle for more than maxIdleTime.
-						maybeDetachIdleProcess(state, group, process, p_it);
-					}
-				}
-				
 				group->verifyInvariants();
 			
 				// ...cleanup the spawner if it's been idle for more than preloaderIdleTime.
 				maybeCleanPreloader(state, group);
+
+				// ...and start OOBW that has been deferred.
+				maybeInitiateDeferredOobw(state, group);
 			}
 			
 			superGroup->verifyInvariants();
+
+			// ...and see whether it has been unused for long enough to become dormant.
+			if (maxDormancyIdleTime > 0) {
+				maybeMakeDormant(state, superGroup, dormant);
+			}
+		}
+
+		foreach (const SuperGroupPtr &superGroup, dormant) {
+			P_DEBUG("Making idle SuperGroup dormant: " << superGroup->name);
+			dormantSuperGroups[superGroup->name] = state.now;
+			forceDetachSuperGroup(superGroup, state.actions,
+				SuperGroup::ShutdownCallback());
 		}
 		
 		verifyInvariants();
@@ -755,7 +1411,10 @@ public:
 
 	static void collectPids(const ProcessList &processes, vector<pid_t> &pids) {
 		foreach (const ProcessPtr &process, processes) {
-			pids.push_back(process->pid);
+			// We can't measure processes on other hosts.
+			if (!process->isRemote()) {
+				pids.push_back(process->pid);
+			}
 		}
 	}
 
@@ -764,8 +1423,9 @@ public:
 		vector<ProcessPtr> &processesToDetach)
 	{
 		foreach (const ProcessPtr &process, processes) {
-			ProcessMetricMap::const_iterator metrics_it =
-				allMetrics.find(process->pid);
+			ProcessMetricMap::const_iterator metrics_it = process->isRemote()
+				? allMetrics.end()
+				: allMetrics.find(process->pid);
 			if (metrics_it != allMetrics.end()) {
 				process->metrics = metrics_it->second;
 			// If the process is missing from 'allMetrics' then either 'ps'
@@ -779,6 +1439,52 @@ public:
 		}
 	}
 
+	/**
+	 * Enforces Options::memoryLimit on the enabled processes of the given group,
+	 * based on their freshly collected metrics. Processes that are over the
+	 * limit are either sent to out-of-band work first, or added to
+	 * `processesToDetach`.
+	 */
+	static void enforceMemoryLimit(const GroupPtr &group, vector<ProcessPtr> &processesToDetach) {
+		if (group->options.memoryLimit == 0) {
+			return;
+		}
+
+		size_t limit = (size_t) group->options.memoryLimit * 1024;
+		vector<ProcessPtr> processesToOobw;
+		foreach (const ProcessPtr &process, group->enabledProcesses) {
+			if (process->metrics.realMemory() <= limit
+			 || process->oobwStatus != Process::OOBW_NOT_ACTIVE
+			 || std::find(processesToDetach.begin(), processesToDetach.end(), process)
+				!= processesToDetach.end())
+			{
+				continue;
+			}
+
+			if (group->options.memoryLimitOobw && !process->memoryLimitOobwPerformed) {
+				P_INFO("Process " << process->inspect() << " uses " <<
+					process->metrics.realMemory() / 1024 << " MB of memory, which "
+					"exceeds the limit of " << group->options.memoryLimit << " MB. "
+					"Performing out-of-band work before deciding to shut it down.");
+				processesToOobw.push_back(process);
+			} else {
+				P_INFO("Process " << process->inspect() << " uses " <<
+					process->metrics.realMemory() / 1024 << " MB of memory, which "
+					"exceeds the limit of " << group->options.memoryLimit << " MB. "
+					"Shutting it down after it has finished its current requests.");
+				processesToDetach.push_back(process);
+			}
+		}
+
+		// Initiating out-of-band work modifies the process lists,
+		// so we do it outside the loop above.
+		foreach (const ProcessPtr &process, processesToOobw) {
+			process->memoryLimitOobwPerformed = true;
+			process->oobwStatus = Process::OOBW_REQUESTED;
+			group->maybeInitiateOobw(process);
+		}
+	}
+
 	unsigned long long realCollectAnalytics() {
 		TRACE_POINT();
 		this_thread::disable_interruption di;
@@ -790,13 +1496,13 @@ public:
 		// Collect all the PIDs.
 		{
 			UPDATE_TRACE_POINT();
-			LockGuard l(syncher);
+			PoolLockGuard l(syncher);
 			max = this->max;
 		}
 		pids.reserve(max);
 		{
 			UPDATE_TRACE_POINT();
-			LockGuard l(syncher);
+			PoolLockGuard l(syncher);
 			SuperGroupMap::const_iterator sg_it, sg_end = superGroups.end();
 			
 			for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
@@ -819,7 +1525,7 @@ public:
 			UPDATE_TRACE_POINT();
 			allMetrics = ProcessMetricsCollector().collect(pids);
 		} catch (const ProcessMetricsCollector::ParseException &) {
-			P_WARN("Unable to collect process metrics: cannot parse 'ps' output.");
+			P_WARN("Unable to collect process metrics: cannot parse the process information.");
 			goto end;
 		}
 
@@ -828,7 +1534,7 @@ public:
 			vector<ProcessAnalyticsLogEntryPtr> logEntries;
 			vector<ProcessPtr> processesToDetach;
 			vector<Callback> actions;
-			ScopedLock l(syncher);
+			PoolLock l(syncher);
 			SuperGroupMap::iterator sg_it, sg_end = superGroups.end();
 			
 			UPDATE_TRACE_POINT();
@@ -842,6 +1548,7 @@ public:
 					updateProcessMetrics(group->enabledProcesses, allMetrics, processesToDetach);
 					updateProcessMetrics(group->disablingProcesses, allMetrics, processesToDetach);
 					updateProcessMetrics(group->disabledProcesses, allMetrics, processesToDetach);
+					enforceMemoryLimit(group, processesToDetach);
 
 					// Log to Union Station.
 					if (group->options.analytics && loggerFactory != NULL) {
@@ -858,6 +1565,7 @@ public:
 				}
 			}
 
+			statsChanged();
 			UPDATE_TRACE_POINT();
 			foreach (const ProcessPtr process, processesToDetach) {
 				detachProcessUnlocked(process, actions);
@@ -894,11 +1602,49 @@ public:
 		return deadline - currentTime;
 	}
 	
+	/**
+	 * Called when a Group has just been created. Attaches the processes that
+	 * have been handed off to us for that Group, so that they serve its
+	 * requests instead of newly spawned ones.
+	 */
+	void attachHandedOffProcesses(const GroupPtr &group, vector<Callback> &postLockActions) {
+		map< string, vector<ProcessPtr> >::iterator it = handedOffProcesses.find(group->name);
+		if (it == handedOffProcesses.end()) {
+			return;
+		}
+
+		vector<ProcessPtr> processes;
+		processes.swap(it->second);
+		handedOffProcesses.erase(it);
+		foreach (const ProcessPtr &process, processes) {
+			if (group->attach(process, postLockActions) == AR_OK) {
+				P_INFO("Adopted process " << process->inspect() <<
+					" from the previous helper agent");
+			} else {
+				P_WARN("Cannot adopt process " << process->inspect() <<
+					" from the previous helper agent because of resource limits; "
+					"shutting it down");
+				if (journal != NULL) {
+					journal->detached(process);
+				}
+				postLockActions.push_back(boost::bind(
+					Process::forceTriggerShutdownAndCleanup, process));
+			}
+		}
+	}
+
 	SuperGroupPtr createSuperGroup(const Options &options) {
+		if (!dormantSuperGroups.empty()
+		 && dormantSuperGroups.erase(options.getAppGroupName()) > 0)
+		{
+			P_DEBUG("Waking up dormant SuperGroup " << options.getAppGroupName());
+		}
 		SuperGroupPtr superGroup = boost::make_shared<SuperGroup>(shared_from_this(),
 			options);
 		superGroup->initialize();
 		superGroups.set(options.getAppGroupName(), superGroup);
+		superGroupsBySecret.set(superGroup->secret, superGroup);
+		statsChanged();
 		garbageCollectionCond.notify_all();
 		return superGroup;
 	}
@@ -920,6 +1666,103 @@ public:
 	// Debugging helper function, implemented in .cpp file so that GDB can access it.
 	const SuperGroupPtr getSuperGroup(const char *name);
 	
+	static void snapshotProcesses(const ProcessList &processes,
+		vector<ProcessSnapshot> &result)
+	{
+		foreach (const ProcessPtr &process, processes) {
+			ProcessSnapshot snapshot;
+			snapshot.pid = process->pid;
+			snapshot.stickySessionId = process->stickySessionId;
+			snapshot.gupid = process->gupid;
+			snapshot.concurrency = process->concurrency;
+			snapshot.sessions = process->sessions;
+			snapshot.busyness = process->busyness();
+			snapshot.processed = process->processed;
+			snapshot.spawnEndTime = process->spawnEndTime;
+			snapshot.spawnUsec = process->spawnTimings.total();
+			snapshot.lastUsed = process->lastUsed;
+			snapshot.lifeStatus = process->getLifeStatusName();
+			snapshot.enabled = process->getEnabledName();
+			snapshot.hasMetrics = process->metrics.isValid();
+			if (snapshot.hasMetrics) {
+				snapshot.cpu = (int) process->metrics.cpu;
+				snapshot.realMemory = process->metrics.realMemory();
+				snapshot.rss = process->metrics.rss;
+				snapshot.privateDirty = process->metrics.privateDirty;
+				snapshot.vmsize = (ssize_t) process->metrics.vmsize;
+				snapshot.ppid = process->metrics.ppid;
+				snapshot.command = process->metrics.command;
+			} else {
+				snapshot.cpu = 0;
+				snapshot.realMemory = 0;
+				snapshot.rss = -1;
+				snapshot.privateDirty = -1;
+				snapshot.vmsize = -1;
+				snapshot.ppid = (pid_t) -1;
+			}
+			result.push_back(snapshot);
+		}
+	}
+
+	static void snapshotGroup(const Group *group, GroupSnapshot &snapshot) {
+		snapshot.name = group->name;
+		snapshot.componentName = group->componentInfo.name;
+		snapshot.appRoot = group->options.appRoot;
+		snapshot.appType = group->options.appType;
+		snapshot.environment = group->options.environment;
+		snapshot.secret = group->secret;
+		snapshot.isDefault = group->componentInfo.isDefault;
+		snapshot.spawning = group->spawning();
+		snapshot.restarting = group->restarting();
+		snapshot.enabledProcessCount = group->enabledCount;
+		snapshot.disablingProcessCount = group->disablingCount;
+		snapshot.disabledProcessCount = group->disabledCount;
+		snapshot.capacityUsed = group->capacityUsed();
+		snapshot.getWaitlistSize = group->getWaitlist.size();
+		snapshot.maxRequestQueueSize = group->options.maxRequestQueueSize;
+		snapshot.processesBeingSpawned = group->processesBeingSpawned;
+		snapshot.queueWaitSampleCount = group->queueWaits.getSampleCount();
+		snapshot.queueWaitP50 = group->queueWaits.getPercentile(50);
+		snapshot.queueWaitP90 = group->queueWaits.getPercentile(90);
+		snapshot.queueWaitP99 = group->queueWaits.getPercentile(99);
+		snapshotProcesses(group->enabledProcesses, snapshot.processes);
+		snapshotProcesses(group->disablingProcesses, snapshot.processes);
+		snapshotProcesses(group->disabledProcesses, snapshot.processes);
+		snapshotProcesses(group->detachedProcesses, snapshot.processes);
+	}
+
+	/** @pre The pool lock is held. */
+	PoolSnapshotPtr createStatsSnapshot() const {
+		boost::shared_ptr<PoolSnapshot> snapshot = boost::make_shared<PoolSnapshot>();
+		SuperGroupMap::const_iterator sg_it;
+		vector<GroupPtr>::const_iterator g_it;
+
+		snapshot->generation = statsGeneration.load();
+		snapshot->createdAt = SystemTime::getUsec();
+		snapshot->processCount = getProcessCount(false);
+		snapshot->max = max;
+		snapshot->capacityUsed = capacityUsed(false);
+		snapshot->getWaitlistSize = getWaitlist.size();
+		snapshot->superGroups.reserve(superGroups.size());
+
+		for (sg_it = superGroups.begin(); sg_it != superGroups.end(); sg_it++) {
+			const SuperGroupPtr &superGroup = sg_it->second;
+			snapshot->superGroups.push_back(SuperGroupSnapshot());
+			SuperGroupSnapshot &superGroupSnapshot = snapshot->superGroups.back();
+
+			superGroupSnapshot.name = superGroup->name;
+			superGroupSnapshot.secret = superGroup->secret;
+			superGroupSnapshot.state = superGroup->getStateName();
+			superGroupSnapshot.getWaitlistSize = superGroup->getWaitlist.size();
+			superGroupSnapshot.capacityUsed = superGroup->capacityUsed();
+			superGroupSnapshot.groups.resize(superGroup->groups.size());
+			for (unsigned int i = 0; i < superGroup->groups.size(); i++) {
+				snapshotGroup(superGroup->groups[i].get(), superGroupSnapshot.groups[i]);
+			}
+		}
+		return snapshot;
+	}
+
 public:
 	Pool(const SpawnerFactoryPtr &spawnerFactory,
 		const LoggerFactoryPtr &loggerFactory = LoggerFactoryPtr(),
@@ -934,10 +1777,18 @@ public:
 			this->randomGenerator = boost::make_shared<RandomGenerator>();
 		}
 		this->agentsOptions = agentsOptions;
+		metrics = boost::make_shared<MetricsRegistry>();
 		
 		lifeStatus  = ALIVE;
 		max         = 6;
 		maxIdleTime = 60 * 1000000;
+		scaleDownInterval = 10 * 1000000;
+		maxDormancyIdleTime = 0;
+		maxConcurrentSpawns = 0;
+		handedOffProcessesTime = 0;
+		statsGeneration = 0;
+		sessionLeaseGeneration = 0;
+		sessionLeaseCount = 0;
 		
 		// The following code only serve to instantiate certain inline methods
 		// so that they can be invoked from gdb.
@@ -954,7 +1805,7 @@ public:
 	}
 
 	void initialize() {
-		LockGuard l(syncher);
+		PoolLockGuard l(syncher);
 		interruptableThreads.create_thread(
 			boost::bind(collectAnalytics, shared_from_this()),
 			"Pool analytics collector",
@@ -965,31 +1816,94 @@ public:
 			"Pool garbage collector",
 			POOL_HELPER_THREAD_STACK_SIZE
 		);
+
+		restartFileWatcher = boost::make_shared<FileChangeWatcher>(
+			(unsigned int) RESTART_FILE_RECHECK_INTERVAL);
+		if (restartFileWatcher->isSupported()) {
+			interruptableThreads.create_thread(
+				boost::bind(&FileChangeWatcher::run, restartFileWatcher.get()),
+				"Pool restart file watcher",
+				POOL_HELPER_THREAD_STACK_SIZE
+			);
+		} else {
+			restartFileWatcher.reset();
+		}
+
+		detachedProcessesLoop.start("Pool detached processes watcher",
+			POOL_HELPER_THREAD_STACK_SIZE);
+
+		unsigned int hookConcurrency = DEFAULT_HOOK_CONCURRENCY;
+		unsigned int hookBatchTime = 0;
+		if (agentsOptions != NULL) {
+			hookConcurrency = std::max(1, agentsOptions->getInt("hook_concurrency",
+				false, DEFAULT_HOOK_CONCURRENCY));
+			hookBatchTime = std::max(0, agentsOptions->getInt("hook_batch_time",
+				false, 0));
+		}
+		hookScriptExecutor = boost::make_shared<HookScriptExecutor>(hookBatchTime);
+		for (unsigned int i = 0; i < hookConcurrency; i++) {
+			interruptableThreads.create_thread(
+				boost::bind(&HookScriptExecutor::run, hookScriptExecutor.get()),
+				"Pool hook script executor " + toString(i + 1),
+				POOL_HELPER_THREAD_STACK_SIZE
+			);
+		}
 	}
 
 	void initDebugging() {
-		LockGuard l(syncher);
+		PoolLockGuard l(syncher);
 		debugSupport = boost::make_shared<DebugSupport>();
 	}
 
-	void destroy() {
+	/**
+	 * Shuts down all processes and detaches all SuperGroups, at once. If
+	 * `timeout` (in microseconds) is not 0, then the processes that are
+	 * still running after that time are killed with SIGKILL.
+	 */
+	void destroy(unsigned long long timeout = 0) {
 		TRACE_POINT();
-		ScopedLock lock(syncher);
+		PoolLock lock(syncher);
 		assert(lifeStatus == ALIVE);
 
 		lifeStatus = SHUTTING_DOWN;
 
+		vector<ProcessPtr> unclaimedProcesses;
+		map< string, vector<ProcessPtr> >::const_iterator h_it;
+		for (h_it = handedOffProcesses.begin(); h_it != handedOffProcesses.end(); h_it++) {
+			unclaimedProcesses.insert(unclaimedProcesses.end(),
+				h_it->second.begin(), h_it->second.end());
+		}
+		handedOffProcesses.clear();
+		lock.unlock();
+		foreach (const ProcessPtr &process, unclaimedProcesses) {
+			if (journal != NULL) {
+				journal->detached(process);
+			}
+			Process::forceTriggerShutdownAndCleanup(process);
+		}
+		lock.lock();
+
 		while (!superGroups.empty()) {
-			string name = superGroups.begin()->second->name;
+			vector<string> names;
+			StringMap<SuperGroupPtr>::const_iterator sg_it, sg_end = superGroups.end();
+			for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
+				names.push_back(sg_it->second->name);
+			}
 			lock.unlock();
-			detachSuperGroupByName(name);
+			detachSuperGroupsByName(names, timeout);
 			lock.lock();
 		}
 
 		UPDATE_TRACE_POINT();
 		lock.unlock();
+		if (hookScriptExecutor != NULL) {
+			// Let the detached_process hooks of the processes
+			// that we just shut down finish.
+			hookScriptExecutor->drain();
+		}
 		interruptableThreads.interrupt_and_join_all();
 		nonInterruptableThreads.join_all();
+		detachedProcessesLoop.stop();
 		lock.lock();
 
 		lifeStatus = SHUT_DOWN;
@@ -999,10 +1913,80 @@ public:
 		verifyExpensiveInvariants();
 	}
 
+	/**
+	 * The fast path of asyncGet(). Checks out a session from an existing group
+	 * while holding the pool lock in shared mode only, so that gets for
+	 * different groups don't serialize. Returns NULL if anything else is
+	 * needed, such as creating a SuperGroup, spawning or queueing.
+	 */
+	SessionPtr tryGetFast(const Options &options) {
+		PoolSharedLock lock(syncher);
+		if (OXT_UNLIKELY(lifeStatus != ALIVE)) {
+			return SessionPtr();
+		}
+		SuperGroup *superGroup = findMatchingSuperGroup(options);
+		if (superGroup != NULL) {
+			return superGroup->tryGetFast(options);
+		} else {
+			return SessionPtr();
+		}
+	}
+
+	/**
+	 * Like tryGetFast(), but also leases up to `maxLeases` more sessions from
+	 * the same group into `leases`. `leasedArrivals` is the number of leased
+	 * sessions that have been handed out since the last call, so that the
+	 * group's demand tracking still sees them. `generation` is set to the
+	 * lease generation that the leases belong to.
+	 */
+	SessionPtr tryGetFastAndLease(const Options &options, unsigned int maxLeases,
+		unsigned int leasedArrivals, vector<SessionPtr> &leases,
+		unsigned int &generation)
+	{
+		PoolSharedLock lock(syncher);
+		if (OXT_UNLIKELY(lifeStatus != ALIVE)) {
+			return SessionPtr();
+		}
+		SuperGroup *superGroup = findMatchingSuperGroup(options);
+		if (superGroup != NULL) {
+			unsigned int oldSize = leases.size();
+			generation = sessionLeaseGeneration.load(boost::memory_order_acquire);
+			SessionPtr session = superGroup->tryGetFast(options, &leases,
+				maxLeases, leasedArrivals);
+			sessionLeaseCount.fetch_add(leases.size() - oldSize,
+				boost::memory_order_relaxed);
+			return session;
+		} else {
+			return SessionPtr();
+		}
+	}
+
+	/**
+	 * Invalidates all session leases that have been taken so far, and asks
+	 * their holders to return them. Thread-safe; may be called with or
+	 * without the pool lock.
+	 */
+	void recallSessionLeases();
+
 	// 'lockNow == false' may only be used during unit tests. Normally we
 	// should never call the callback while holding the lock.
 	void asyncGet(const Options &options, const GetCallback &callback, bool lockNow = true) {
-		DynamicScopedLock lock(syncher, lockNow);
+		if (OXT_LIKELY(lockNow)) {
+			SessionCloseBatch *batch = SessionCloseBatch::current();
+			if (batch != NULL && !batch->empty()) {
+				batch->flush();
+			}
+
+			SessionPtr session = tryGetFast(options);
+			if (session != NULL) {
+				P_TRACE(2, "asyncGet(appGroupName=" << options.getAppGroupName() <<
+					") finished on the fast path");
+				callback(session, ExceptionPtr());
+				return;
+			}
+		}
+
+		PoolDynamicLock lock(syncher, lockNow);
 
 		assert(lifeStatus == ALIVE);
 		verifyInvariants();
@@ -1014,6 +1998,7 @@ public:
 			/* Best case: the app super group is already in the pool. Let's use it. */
 			P_TRACE(2, "Found existing SuperGroup");
 			existingSuperGroup->verifyInvariants();
+			existingSuperGroup->lastUsed = SystemTime::getUsec();
 			SessionPtr session = existingSuperGroup->get(options, callback, actions);
 			existingSuperGroup->verifyInvariants();
 			verifyInvariants();
@@ -1051,19 +2036,16 @@ public:
 				 * become available.
 				 */
 				P_DEBUG("Could not free a process; putting request to top-level getWaitlist");
-				getWaitlist.push_back(GetWaiter(
+				pushGetWaiterByPriority(getWaitlist, GetWaiter(
 					options.copyAndPersist().clearLogger(),
 					callback));
+				recallSessionLeases();
 			} else {
 				/* Now that a process has been trashed we can create
 				 * the missing SuperGroup.
 				 */
 				P_DEBUG("Creating new SuperGroup");
-				SuperGroupPtr superGroup;
-				superGroup = boost::make_shared<SuperGroup>(shared_from_this(), options);
-				superGroup->initialize();
-				superGroups.set(options.getAppGroupName(), superGroup);
-				garbageCollectionCond.notify_all();
+				SuperGroupPtr superGroup = createSuperGroup(options);
 				SessionPtr session = superGroup->get(options, callback,
 					actions);
 				/* The SuperGroup is still initializing so the callback
@@ -1126,7 +2108,7 @@ public:
 		
 		Ticket ticket;
 		{
-			LockGuard l(syncher);
+			PoolLockGuard l(syncher);
 			if (superGroups.get(options.getAppGroupName()) == NULL) {
 				// Forcefully create SuperGroup, don't care whether resource limits
 				// actually allow it.
@@ -1137,7 +2119,7 @@ public:
 	}
 	
 	void setMax(unsigned int max) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		assert(max > 0);
 		fullVerifyInvariants();
 		bool bigger = max > this->max;
@@ -1165,13 +2147,52 @@ public:
 	}
 
 	void setMaxIdleTime(unsigned long long value) {
-		LockGuard l(syncher);
+		PoolLockGuard l(syncher);
 		maxIdleTime = value;
 		garbageCollectionCond.notify_all();
 	}
+
+	/** See `scaleDownInterval`. */
+	void setScaleDownInterval(unsigned long long value) {
+		PoolLockGuard l(syncher);
+		scaleDownInterval = value;
+		garbageCollectionCond.notify_all();
+	}
+
+	/** See `maxDormancyIdleTime`. */
+	void setMaxDormancyIdleTime(unsigned long long value) {
+		PoolLockGuard l(syncher);
+		maxDormancyIdleTime = value;
+		garbageCollectionCond.notify_all();
+	}
+	
+	void setMaxConcurrentSpawns(unsigned int value) {
+		PoolLockGuard l(syncher);
+		maxConcurrentSpawns = value;
+	}
+
+	/** Sets how many processes may be started at the same time in the
+	 * entire pool. 0 means unlimited. */
+	void setSpawnConcurrency(unsigned int value) {
+		spawnScheduler.setLimit(value);
+	}
+
+	/** The number of processes that are being spawned right now, in all groups. */
+	unsigned int getProcessesBeingSpawned(bool lock = true) const {
+		PoolDynamicLock l(syncher, lock);
+		SuperGroupMap::const_iterator it, end = superGroups.end();
+		unsigned int result = 0;
+		for (it = superGroups.begin(); it != end; it++) {
+			const SuperGroupPtr &superGroup = it->second;
+			foreach (const GroupPtr &group, superGroup->groups) {
+				result += group->processesBeingSpawned;
+			}
+		}
+		return result;
+	}
 	
 	unsigned int capacityUsed(bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		SuperGroupMap::const_iterator it, end = superGroups.end();
 		int result = 0;
 		for (it = superGroups.begin(); it != end; it++) {
@@ -1182,12 +2203,12 @@ public:
 	}
 	
 	bool atFullCapacity(bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		return capacityUsed(false) >= max;
 	}
 
 	vector<ProcessPtr> getProcesses(bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		vector<ProcessPtr> result;
 		SuperGroupMap::const_iterator it, end = superGroups.end();
 		for (it = superGroups.begin(); OXT_LIKELY(it != end); it++) {
@@ -1212,13 +2233,40 @@ public:
 		return result;
 	}
 	
+	/**
+	 * Adds a process that the previous HelperAgent has handed off to us, see
+	 * HandoffHandler in the HelperAgent, or that we've recovered after it
+	 * crashed, see ProcessJournal::recover(). It isn't used until the group called
+	 * `groupName` is created upon the first request for it, at which point
+	 * it's attached to that group instead of a new process being spawned.
+	 * Processes that are not claimed within maxIdleTime are shut down.
+	 */
+	void addHandedOffProcess(const string &groupName, const ProcessPtr &process) {
+		PoolLockGuard l(syncher);
+		handedOffProcesses[groupName].push_back(process);
+		handedOffProcessesTime = SystemTime::getUsec();
+		garbageCollectionCond.notify_all();
+	}
+
+	/**
+	 * Marks the given processes, which have been handed off to another
+	 * HelperAgent, as no longer ours: they keep serving the sessions that
+	 * are open on them, but detaching them won't shut them down anymore.
+	 */
+	void markHandedOff(const vector<ProcessPtr> &processes) {
+		PoolLockGuard l(syncher);
+		foreach (const ProcessPtr &process, processes) {
+			process->handedOff = true;
+		}
+	}
+
 	/**
 	 * Returns the total number of processes in the pool, including all disabling and
 	 * disabled processes, but excluding processes that are shutting down and excluding
 	 * processes that are being spawned.
 	 */
 	unsigned int getProcessCount(bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		unsigned int result = 0;
 		SuperGroupMap::const_iterator it, end = superGroups.end();
 		for (it = superGroups.begin(); OXT_LIKELY(it != end); it++) {
@@ -1229,104 +2277,134 @@ public:
 	}
 
 	unsigned int getSuperGroupCount() const {
-		LockGuard l(syncher);
+		PoolLockGuard l(syncher);
 		return superGroups.size();
 	}
 	
 	SuperGroupPtr findSuperGroupBySecret(const string &secret, bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
-		SuperGroupMap::const_iterator it, end = superGroups.end();
-		for (it = superGroups.begin(); OXT_LIKELY(it != end); it++) {
-			const SuperGroupPtr &superGroup = it->second;
-			if (superGroup->secret == secret) {
-				return superGroup;
-			}
-		}
-		return SuperGroupPtr();
+		PoolDynamicLock l(syncher, lock);
+		return superGroupsBySecret.get(secret);
 	}
 	
 	ProcessPtr findProcessByGupid(const string &gupid, bool lock = true) const {
-		vector<ProcessPtr> processes = getProcesses(lock);
-		vector<ProcessPtr>::const_iterator it, end = processes.end();
-		for (it = processes.begin(); it != end; it++) {
-			const ProcessPtr &process = *it;
-			if (process->gupid == gupid) {
-				return process;
-			}
-		}
-		return ProcessPtr();
+		PoolDynamicLock l(syncher, lock);
+		return processesByGupid.get(gupid);
 	}
 
 	ProcessPtr findProcessByPid(pid_t pid, bool lock = true) const {
-		vector<ProcessPtr> processes = getProcesses(lock);
-		vector<ProcessPtr>::const_iterator it, end = processes.end();
-		for (it = processes.begin(); it != end; it++) {
-			const ProcessPtr &process = *it;
-			if (process->pid == pid) {
-				return process;
-			}
+		PoolDynamicLock l(syncher, lock);
+		HashMap<pid_t, ProcessPtr>::const_iterator it = processesByPid.find(pid);
+		if (it != processesByPid.end()) {
+			return it->second;
+		} else {
+			return ProcessPtr();
 		}
-		return ProcessPtr();
 	}
 
 	bool detachSuperGroupByName(const string &name) {
+		vector<string> names;
+		bool succeeded;
+		names.push_back(name);
+		return detachSuperGroupsByName(names, 0, &succeeded) > 0 && succeeded;
+	}
+
+	/**
+	 * Detaches the SuperGroups with the given names and waits until their
+	 * processes have shut down. All processes are told to shut down at the
+	 * same time, and are cleaned up by the detached processes loop as they
+	 * exit, so detaching many SuperGroups takes about as long as detaching
+	 * the slowest one. If `timeout` (in microseconds) is not 0, then the
+	 * processes that are still running after that time are killed with
+	 * SIGKILL.
+	 *
+	 * Returns the number of SuperGroups that were found and detached.
+	 * `succeeded`, if given, is set to whether all of them were shut down
+	 * successfully.
+	 */
+	unsigned int detachSuperGroupsByName(const vector<string> &names,
+		unsigned long long timeout = 0, bool *succeeded = NULL)
+	{
 		TRACE_POINT();
-		ScopedLock l(syncher);
-		
-		SuperGroupPtr superGroup = superGroups.get(name);
-		if (OXT_LIKELY(superGroup != NULL)) {
-			if (OXT_LIKELY(superGroups.get(superGroup->name) != NULL)) {
-				UPDATE_TRACE_POINT();
-				verifyInvariants();
-				verifyExpensiveInvariants();
-				
-				vector<Callback> actions;
-				boost::shared_ptr<DetachSuperGroupWaitTicket> ticket =
-					boost::make_shared<DetachSuperGroupWaitTicket>();
-				ExceptionPtr exception = copyException(
-					GetAbortedException("The containg SuperGroup was detached."));
-
-				forceDetachSuperGroup(superGroup, actions,
-					boost::bind(syncDetachSuperGroupCallback, _1, ticket));
-				assignExceptionToGetWaiters(superGroup->getWaitlist,
-					exception, actions);
-				#if 0
-				/* If this SuperGroup had get waiters, either
-				 * on itself or in one of its groups, then we must
-				 * reprocess them immediately. Detaching such a
-				 * SuperGroup is essentially the same as restarting it.
-				 */
-				migrateSuperGroupGetWaitlistToPool(superGroup);
-				
-				UPDATE_TRACE_POINT();
-				assignSessionsToGetWaiters(actions);
-				#endif
-				possiblySpawnMoreProcessesForExistingGroups();
-				
-				verifyInvariants();
-				verifyExpensiveInvariants();
-				
-				l.unlock();
-				UPDATE_TRACE_POINT();
-				runAllActions(actions);
-				actions.clear();
+		PoolLock l(syncher);
+		vector<SuperGroupPtr> detached;
+		vector<Callback> actions;
+		boost::shared_ptr<DetachSuperGroupWaitTicket> ticket =
+			boost::make_shared<DetachSuperGroupWaitTicket>();
+		ExceptionPtr exception = copyException(
+			GetAbortedException("The containg SuperGroup was detached."));
 
-				UPDATE_TRACE_POINT();
-				ScopedLock l2(ticket->syncher);
-				while (!ticket->done) {
-					ticket->cond.wait(l2);
-				}
-				return ticket->result == SuperGroup::SUCCESS;
-			} else {
-				return false;
+		verifyInvariants();
+		verifyExpensiveInvariants();
+		foreach (const string &name, names) {
+			SuperGroupPtr superGroup = superGroups.get(name);
+			if (superGroup == NULL) {
+				continue;
+			}
+			detached.push_back(superGroup);
+			{
+				LockGuard l2(ticket->syncher);
+				ticket->pending++;
+			}
+			forceDetachSuperGroup(superGroup, actions,
+				boost::bind(syncDetachSuperGroupCallback, _1, ticket));
+			assignExceptionToGetWaiters(superGroup->getWaitlist,
+				exception, actions);
+		}
+		if (detached.empty()) {
+			if (succeeded != NULL) {
+				*succeeded = false;
+			}
+			return 0;
+		}
+		possiblySpawnMoreProcessesForExistingGroups();
+
+		verifyInvariants();
+		verifyExpensiveInvariants();
+
+		l.unlock();
+		UPDATE_TRACE_POINT();
+		runAllActions(actions);
+		actions.clear();
+		// The ticket started out with one pending shutdown on our behalf, so
+		// that it couldn't be completed before all SuperGroups were detached.
+		syncDetachSuperGroupCallback(SuperGroup::SUCCESS, ticket);
+
+		UPDATE_TRACE_POINT();
+		ScopedLock l2(ticket->syncher);
+		if (timeout > 0) {
+			boost::system_time deadline = boost::get_system_time() +
+				boost::posix_time::microseconds(timeout);
+			while (!ticket->done && ticket->cond.timed_wait(l2, deadline)) {
+				// Continue waiting.
+			}
+			if (!ticket->done) {
+				l2.unlock();
+				P_WARN("Not all application processes have shut down within " <<
+					timeout / 1000000 << " seconds. Killing the remaining ones.");
+				killDetachedProcesses(detached);
+				l2.lock();
+			}
+		}
+		while (!ticket->done) {
+			ticket->cond.wait(l2);
+		}
+		if (succeeded != NULL) {
+			*succeeded = ticket->result == SuperGroup::SUCCESS;
+		}
+		return detached.size();
+	}
+
+	void killDetachedProcesses(const vector<SuperGroupPtr> &detached) {
+		PoolLockGuard l(syncher);
+		foreach (const SuperGroupPtr &superGroup, detached) {
+			foreach (const GroupPtr &group, superGroup->detachedGroups) {
+				group->killDetachedProcesses();
 			}
-		} else {
-			return false;
 		}
 	}
 	
 	bool detachSuperGroupBySecret(const string &superGroupSecret) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		SuperGroupPtr superGroup = findSuperGroupBySecret(superGroupSecret, false);
 		if (superGroup != NULL) {
 			string name = superGroup->name;
@@ -1339,7 +2417,7 @@ public:
 	}
 	
 	bool detachProcess(const ProcessPtr &process) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		vector<Callback> actions;
 		bool result = detachProcessUnlocked(process, actions);
 		fullVerifyInvariants();
@@ -1349,7 +2427,7 @@ public:
 	}
 
 	bool detachProcess(pid_t pid) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		ProcessPtr process = findProcessByPid(pid, false);
 		if (process != NULL) {
 			vector<Callback> actions;
@@ -1363,8 +2441,28 @@ public:
 		}
 	}
 
+	/**
+	 * Changes the concurrency of the process with the given PID at runtime,
+	 * e.g. because a multithreaded application has been reconfigured. See
+	 * Process::setConcurrency(). Returns whether the process was found.
+	 */
+	bool setProcessConcurrency(pid_t pid, int concurrency) {
+		PoolLock l(syncher);
+		ProcessPtr process = findProcessByPid(pid, false);
+		if (process != NULL && process->getGroup() != NULL) {
+			vector<Callback> actions;
+			process->getGroup()->setProcessConcurrency(process, concurrency, actions);
+			fullVerifyInvariants();
+			l.unlock();
+			runAllActions(actions);
+			return true;
+		} else {
+			return false;
+		}
+	}
+
 	bool detachProcess(const string &gupid) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		ProcessPtr process = findProcessByGupid(gupid, false);
 		if (process != NULL) {
 			vector<Callback> actions;
@@ -1379,7 +2477,7 @@ public:
 	}
 
 	DisableResult disableProcess(const string &gupid) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		ProcessPtr process = findProcessByGupid(gupid, false);
 		if (process != NULL) {
 			GroupPtr group = process->getGroup();
@@ -1405,7 +2503,7 @@ public:
 	}
 
 	bool restartGroupByName(const StaticString &name, RestartMethod method = RM_DEFAULT) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		SuperGroupMap::iterator sg_it, sg_end = superGroups.end();
 
 		for (sg_it = superGroups.begin(); sg_it != sg_end; sg_it++) {
@@ -1424,7 +2522,7 @@ public:
 	}
 
 	unsigned int restartSuperGroupsByAppRoot(const StaticString &appRoot) {
-		ScopedLock l(syncher);
+		PoolLock l(syncher);
 		SuperGroupMap::iterator sg_it, sg_end = superGroups.end();
 		unsigned int result = 0;
 
@@ -1443,7 +2541,7 @@ public:
 	 * Checks whether at least one process is being spawned.
 	 */
 	bool isSpawning(bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		SuperGroupMap::const_iterator it, end = superGroups.end();
 		for (it = superGroups.begin(); it != end; it++) {
 			foreach (GroupPtr group, it->second->groups) {
@@ -1456,7 +2554,7 @@ public:
 	}
 
 	string inspect(const InspectOptions &options = InspectOptions(), bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		stringstream result;
 		const char *headerColor = maybeColorize(options, ANSI_COLOR_YELLOW ANSI_COLOR_BLUE_BG ANSI_COLOR_BOLD);
 		const char *resetColor  = maybeColorize(options, ANSI_COLOR_RESET);
@@ -1472,6 +2570,15 @@ public:
 				i++;
 			}
 		}
+		inspectSpawnQueue(options, result);
+		inspectIdleProcesses(options, result);
+		if (maxDormancyIdleTime > 0) {
+			result << "Dormant apps       : " << dormantSuperGroups.size() << endl;
+		}
+		if (options.verbose && loggerFactory != NULL && !loggerFactory->isNull()) {
+			result << "Union Station connections : " <<
+				loggerFactory->inspectConnectionPool() << endl;
+		}
 		result << endl;
 		
 		result << headerColor << "----------- Application groups -----------" << resetColor << endl;
@@ -1496,7 +2603,16 @@ public:
 							"...)" << endl;
 					}
 				}
+				if (!group->standbyProcesses.empty()) {
+					result << "  Standby processes: " << group->standbyProcesses.size() << endl;
+				}
 				result << "  Requests in queue: " << group->getWaitlist.size() << endl;
+				if (group->queueWaits.getSampleCount() > 0) {
+					result << "  Queue wait: p50=" <<
+						group->queueWaits.getPercentile(50) / 1000 << "ms p90=" <<
+						group->queueWaits.getPercentile(90) / 1000 << "ms p99=" <<
+						group->queueWaits.getPercentile(99) / 1000 << "ms" << endl;
+				}
 				inspectProcessList(options, result, group, group->enabledProcesses);
 				inspectProcessList(options, result, group, group->disablingProcesses);
 				inspectProcessList(options, result, group, group->disabledProcesses);
@@ -1507,8 +2623,55 @@ public:
 		return result.str();
 	}
 
+	/**
+	 * Returns a snapshot of the pool statistics, which can be serialized
+	 * without holding the pool lock. The last created snapshot is reused,
+	 * also by other threads, as long as no SuperGroups or processes have been
+	 * added or removed since, and it is at most `maxAge` microseconds old.
+	 * So session counters and such may be up to `maxAge` behind. Otherwise
+	 * a new snapshot is created under the pool lock.
+	 */
+	PoolSnapshotPtr getStatsSnapshot(unsigned long long maxAge = 1000000) const {
+		PoolSnapshotPtr snapshot = boost::atomic_load(&statsSnapshot);
+		if (snapshot != NULL
+		 && snapshot->generation == statsGeneration.load()
+		 && SystemTime::getUsec() <= snapshot->createdAt + maxAge)
+		{
+			return snapshot;
+		}
+
+		{
+			PoolLockGuard l(syncher);
+			snapshot = createStatsSnapshot();
+		}
+		boost::atomic_store(&statsSnapshot, snapshot);
+		return snapshot;
+	}
+
+	/** Moves `process` to the back of `idleProcesses`, as idle since now. */
+	void indexIdleProcess(Process *process) {
+		boost::lock_guard<boost::mutex> l(idleProcessesSyncher);
+		if (process->idleIndexed) {
+			idleProcesses.erase(process);
+		}
+		process->idleSince = SystemTime::getUsec();
+		idleProcesses.push_back(process);
+	}
+
+	void unindexIdleProcess(Process *process) {
+		boost::lock_guard<boost::mutex> l(idleProcessesSyncher);
+		if (process->idleIndexed) {
+			idleProcesses.erase(process);
+		}
+	}
+
+	/** Called, while holding the pool lock, to invalidate the stats snapshot. */
+	void statsChanged() {
+		statsGeneration.fetch_add(1, boost::memory_order_relaxed);
+	}
+
 	string toXml(bool includeSecrets = true, bool lock = true) const {
-		DynamicScopedLock l(syncher, lock);
+		PoolDynamicLock l(syncher, lock);
 		stringstream result;
 		SuperGroupMap::const_iterator sg_it;
 		vector<GroupPtr>::const_iterator g_it;
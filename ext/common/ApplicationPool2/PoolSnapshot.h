@@ -0,0 +1,381 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_POOL_SNAPSHOT_H_
+#define _PASSENGER_APPLICATION_POOL2_POOL_SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <sys/types.h>
+#include <boost/shared_ptr.hpp>
+#include <Utils.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/JsonWriter.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+
+
+/** The part of a PoolSnapshot that describes a Process. */
+struct ProcessSnapshot {
+	pid_t pid;
+	unsigned int stickySessionId;
+	string gupid;
+	int concurrency;
+	int sessions;
+	int busyness;
+	unsigned int processed;
+	unsigned long long spawnEndTime;
+	/** How long spawning took in total, see SpawnTimings. */
+	unsigned long long spawnUsec;
+	unsigned long long lastUsed;
+	const char *lifeStatus;
+	const char *enabled;
+	bool hasMetrics;
+	int cpu;
+	/** In KB. */
+	ssize_t realMemory;
+	/** The following sizes are in KB, and are -1 if unknown.
+	 * See ProcessMetrics. */
+	ssize_t rss;
+	ssize_t privateDirty;
+	ssize_t vmsize;
+	pid_t ppid;
+	string command;
+};
+
+/** The part of a PoolSnapshot that describes a Group. */
+struct GroupSnapshot {
+	string name;
+	string componentName;
+	string appRoot;
+	string appType;
+	string environment;
+	string secret;
+	bool isDefault;
+	bool spawning;
+	bool restarting;
+	unsigned int enabledProcessCount;
+	unsigned int disablingProcessCount;
+	unsigned int disabledProcessCount;
+	unsigned int capacityUsed;
+	unsigned int getWaitlistSize;
+	/** 0 means that the request queue size is unlimited. */
+	unsigned int maxRequestQueueSize;
+	unsigned int processesBeingSpawned;
+	/** The number of queue wait samples, followed by the percentiles in usec. */
+	unsigned int queueWaitSampleCount;
+	unsigned long long queueWaitP50, queueWaitP90, queueWaitP99;
+	vector<ProcessSnapshot> processes;
+};
+
+/** The part of a PoolSnapshot that describes a SuperGroup. */
+struct SuperGroupSnapshot {
+	string name;
+	string secret;
+	const char *state;
+	unsigned int getWaitlistSize;
+	unsigned int capacityUsed;
+	vector<GroupSnapshot> groups;
+};
+
+/**
+ * An immutable copy of the pool statistics that passenger-status and other
+ * monitoring tools need. Pool::getStatsSnapshot() creates it while holding
+ * the pool lock, which is much cheaper than generating XML, and publishes it
+ * so that it can be shared between readers. Serializing it into XML or JSON
+ * happens without holding the pool lock.
+ */
+struct PoolSnapshot {
+	/** The value of Pool::statsGeneration when this snapshot was created. */
+	unsigned int generation;
+	/** When this snapshot was created, in microseconds. */
+	unsigned long long createdAt;
+	unsigned int processCount;
+	unsigned int max;
+	unsigned int capacityUsed;
+	unsigned int getWaitlistSize;
+	vector<SuperGroupSnapshot> superGroups;
+
+	/** Serializes this snapshot in the same format as Pool::toXml(),
+	 * minus the fields that it doesn't contain. */
+	string toXml(bool includeSecrets = true) const {
+		stringstream result;
+		vector<SuperGroupSnapshot>::const_iterator sg_it;
+		vector<GroupSnapshot>::const_iterator g_it;
+		vector<ProcessSnapshot>::const_iterator p_it;
+
+		result << "<?xml version=\"1.0\" encoding=\"iso8859-1\" ?>\n";
+		result << "<info version=\"2\">";
+		result << "<process_count>" << processCount << "</process_count>";
+		result << "<max>" << max << "</max>";
+		result << "<capacity_used>" << capacityUsed << "</capacity_used>";
+		result << "<get_wait_list_size>" << getWaitlistSize << "</get_wait_list_size>";
+
+		result << "<supergroups>";
+		for (sg_it = superGroups.begin(); sg_it != superGroups.end(); sg_it++) {
+			result << "<supergroup>";
+			result << "<name>" << escapeForXml(sg_it->name) << "</name>";
+			result << "<state>" << sg_it->state << "</state>";
+			result << "<get_wait_list_size>" << sg_it->getWaitlistSize << "</get_wait_list_size>";
+			result << "<capacity_used>" << sg_it->capacityUsed << "</capacity_used>";
+			if (includeSecrets) {
+				result << "<secret>" << escapeForXml(sg_it->secret) << "</secret>";
+			}
+
+			for (g_it = sg_it->groups.begin(); g_it != sg_it->groups.end(); g_it++) {
+				const GroupSnapshot &group = *g_it;
+
+				if (group.isDefault) {
+					result << "<group default=\"true\">";
+				} else {
+					result << "<group>";
+				}
+				result << "<name>" << escapeForXml(group.name) << "</name>";
+				result << "<component_name>" << escapeForXml(group.componentName) << "</component_name>";
+				result << "<app_root>" << escapeForXml(group.appRoot) << "</app_root>";
+				result << "<app_type>" << escapeForXml(group.appType) << "</app_type>";
+				result << "<environment>" << escapeForXml(group.environment) << "</environment>";
+				result << "<enabled_process_count>" << group.enabledProcessCount << "</enabled_process_count>";
+				result << "<disabling_process_count>" << group.disablingProcessCount << "</disabling_process_count>";
+				result << "<disabled_process_count>" << group.disabledProcessCount << "</disabled_process_count>";
+				result << "<capacity_used>" << group.capacityUsed << "</capacity_used>";
+				result << "<get_wait_list_size>" << group.getWaitlistSize << "</get_wait_list_size>";
+				result << "<processes_being_spawned>" << group.processesBeingSpawned << "</processes_being_spawned>";
+				if (group.queueWaitSampleCount > 0) {
+					result << "<queue_wait>";
+					result << "<sample_count>" << group.queueWaitSampleCount << "</sample_count>";
+					result << "<p50_usec>" << group.queueWaitP50 << "</p50_usec>";
+					result << "<p90_usec>" << group.queueWaitP90 << "</p90_usec>";
+					result << "<p99_usec>" << group.queueWaitP99 << "</p99_usec>";
+					result << "</queue_wait>";
+				}
+				if (group.spawning) {
+					result << "<spawning/>";
+				}
+				if (group.restarting) {
+					result << "<restarting/>";
+				}
+				if (includeSecrets) {
+					result << "<secret>" << escapeForXml(group.secret) << "</secret>";
+				}
+
+				result << "<processes>";
+				for (p_it = group.processes.begin(); p_it != group.processes.end(); p_it++) {
+					const ProcessSnapshot &process = *p_it;
+					result << "<process>";
+					result << "<pid>" << process.pid << "</pid>";
+					result << "<sticky_session_id>" << process.stickySessionId << "</sticky_session_id>";
+					result << "<gupid>" << process.gupid << "</gupid>";
+					result << "<concurrency>" << process.concurrency << "</concurrency>";
+					result << "<sessions>" << process.sessions << "</sessions>";
+					result << "<busyness>" << process.busyness << "</busyness>";
+					result << "<processed>" << process.processed << "</processed>";
+					result << "<spawn_end_time>" << process.spawnEndTime << "</spawn_end_time>";
+					result << "<spawn_usec>" << process.spawnUsec << "</spawn_usec>";
+					result << "<last_used>" << process.lastUsed << "</last_used>";
+					result << "<uptime>" << distanceOfTimeInWords(process.spawnEndTime / 1000000) << "</uptime>";
+					result << "<life_status>" << process.lifeStatus << "</life_status>";
+					result << "<enabled>" << process.enabled << "</enabled>";
+					if (process.hasMetrics) {
+						result << "<has_metrics>true</has_metrics>";
+						result << "<cpu>" << process.cpu << "</cpu>";
+						result << "<real_memory>" << process.realMemory << "</real_memory>";
+						result << "<command>" << escapeForXml(process.command) << "</command>";
+					}
+					result << "</process>";
+				}
+				result << "</processes>";
+				result << "</group>";
+			}
+			result << "</supergroup>";
+		}
+		result << "</supergroups>";
+
+		result << "</info>";
+		return result.str();
+	}
+
+	/** Serializes this snapshot into compact JSON, with the same
+	 * field names as toXml(). */
+	string toJson(bool includeSecrets = true) const {
+		string result;
+		toJson(result, includeSecrets);
+		return result;
+	}
+
+	/**
+	 * Like toJson(bool), but appends to the given buffer. The JSON is
+	 * written directly into it, without building a document first, so
+	 * reusing one buffer between calls doesn't allocate once it's large
+	 * enough.
+	 */
+	void toJson(string &buffer, bool includeSecrets = true) const {
+		vector<SuperGroupSnapshot>::const_iterator sg_it;
+		vector<GroupSnapshot>::const_iterator g_it;
+		vector<ProcessSnapshot>::const_iterator p_it;
+		JsonWriter writer(buffer);
+
+		writer.beginObject();
+		writer.field("process_count", processCount);
+		writer.field("max", max);
+		writer.field("capacity_used", capacityUsed);
+		writer.field("get_wait_list_size", getWaitlistSize);
+		writer.key("supergroups");
+		writer.beginArray();
+
+		for (sg_it = superGroups.begin(); sg_it != superGroups.end(); sg_it++) {
+			writer.beginObject();
+			writer.field("name", sg_it->name);
+			writer.field("state", sg_it->state);
+			writer.field("get_wait_list_size", sg_it->getWaitlistSize);
+			writer.field("capacity_used", sg_it->capacityUsed);
+			if (includeSecrets) {
+				writer.field("secret", sg_it->secret);
+			}
+			writer.key("groups");
+			writer.beginArray();
+
+			for (g_it = sg_it->groups.begin(); g_it != sg_it->groups.end(); g_it++) {
+				const GroupSnapshot &group = *g_it;
+
+				writer.beginObject();
+				writer.field("name", group.name);
+				writer.field("component_name", group.componentName);
+				writer.field("default", group.isDefault);
+				writer.field("app_root", group.appRoot);
+				writer.field("app_type", group.appType);
+				writer.field("environment", group.environment);
+				writer.field("enabled_process_count", group.enabledProcessCount);
+				writer.field("disabling_process_count", group.disablingProcessCount);
+				writer.field("disabled_process_count", group.disabledProcessCount);
+				writer.field("capacity_used", group.capacityUsed);
+				writer.field("get_wait_list_size", group.getWaitlistSize);
+				writer.field("processes_being_spawned", group.processesBeingSpawned);
+				writer.field("spawning", group.spawning);
+				writer.field("restarting", group.restarting);
+				if (group.queueWaitSampleCount > 0) {
+					writer.key("queue_wait");
+					writer.beginObject();
+					writer.field("sample_count", group.queueWaitSampleCount);
+					writer.field("p50_usec", group.queueWaitP50);
+					writer.field("p90_usec", group.queueWaitP90);
+					writer.field("p99_usec", group.queueWaitP99);
+					writer.endObject();
+				}
+				if (includeSecrets) {
+					writer.field("secret", group.secret);
+				}
+				writer.key("processes");
+				writer.beginArray();
+
+				for (p_it = group.processes.begin(); p_it != group.processes.end(); p_it++) {
+					const ProcessSnapshot &process = *p_it;
+
+					writer.beginObject();
+					writer.field("pid", (int) process.pid);
+					writer.field("sticky_session_id", process.stickySessionId);
+					writer.field("gupid", process.gupid);
+					writer.field("concurrency", process.concurrency);
+					writer.field("sessions", process.sessions);
+					writer.field("busyness", process.busyness);
+					writer.field("processed", process.processed);
+					writer.field("spawn_end_time", process.spawnEndTime);
+					writer.field("spawn_usec", process.spawnUsec);
+					writer.field("last_used", process.lastUsed);
+					writer.field("uptime", distanceOfTimeInWords(process.spawnEndTime / 1000000));
+					writer.field("life_status", process.lifeStatus);
+					writer.field("enabled", process.enabled);
+					if (process.hasMetrics) {
+						writer.field("cpu", process.cpu);
+						writer.field("real_memory", (long long) process.realMemory);
+						writer.field("command", process.command);
+					}
+					writer.endObject();
+				}
+				writer.endArray();
+				writer.endObject();
+			}
+			writer.endArray();
+			writer.endObject();
+		}
+
+		writer.endArray();
+		writer.endObject();
+		buffer.append(1, '\n');
+	}
+
+	/**
+	 * Lists the memory usage of all processes for which metrics have been
+	 * collected, so that passenger-memory-stats doesn't have to measure
+	 * them again. One line per process, with tab-separated fields:
+	 *
+	 *   pid, ppid, VM size, private dirty RSS, RSS, CPU, command
+	 *
+	 * Sizes are in KB, -1 if unknown. The command is last and has any
+	 * tabs and newlines replaced by spaces.
+	 */
+	string toMemoryStats() const {
+		vector<SuperGroupSnapshot>::const_iterator sg_it;
+		vector<GroupSnapshot>::const_iterator g_it;
+		vector<ProcessSnapshot>::const_iterator p_it;
+		stringstream result;
+
+		for (sg_it = superGroups.begin(); sg_it != superGroups.end(); sg_it++) {
+			for (g_it = sg_it->groups.begin(); g_it != sg_it->groups.end(); g_it++) {
+				for (p_it = g_it->processes.begin(); p_it != g_it->processes.end(); p_it++) {
+					const ProcessSnapshot &process = *p_it;
+					if (!process.hasMetrics) {
+						continue;
+					}
+					string command = process.command;
+					for (string::size_type i = 0; i < command.size(); i++) {
+						if (command[i] == '\t' || command[i] == '\n') {
+							command[i] = ' ';
+						}
+					}
+					result << process.pid << "\t" <<
+						process.ppid << "\t" <<
+						process.vmsize << "\t" <<
+						process.privateDirty << "\t" <<
+						process.rss << "\t" <<
+						process.cpu << "\t" <<
+						command << "\n";
+				}
+			}
+		}
+		return result.str();
+	}
+};
+
+typedef boost::shared_ptr<const PoolSnapshot> PoolSnapshotPtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_POOL_SNAPSHOT_H_ */
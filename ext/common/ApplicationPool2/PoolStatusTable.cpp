@@ -0,0 +1,53 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+#include <ApplicationPool2/PoolStatusTable.h>
+#include <exception>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+
+PP_PoolStatusTable *
+pp_pool_status_table_open(const char *generation_dir, PP_Error *error) {
+	try {
+		return new PoolStatusTable(PoolStatusTable::getFilename(generation_dir), false);
+	} catch (const std::exception &e) {
+		pp_error_set(e, error);
+		return 0;
+	}
+}
+
+void
+pp_pool_status_table_close(PP_PoolStatusTable *table) {
+	delete (PoolStatusTable *) table;
+}
+
+int
+pp_pool_status_table_queue_full(PP_PoolStatusTable *_table,
+	const char *app_group_name, unsigned int len)
+{
+	PoolStatusTable *table = (PoolStatusTable *) _table;
+	return table->isQueueFull(StaticString(app_group_name, len), time(NULL));
+}
@@ -0,0 +1,347 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_POOL_STATUS_TABLE_H_
+#define _PASSENGER_APPLICATION_POOL2_POOL_STATUS_TABLE_H_
+
+/**
+ * Pool status table
+ *
+ * The HelperAgent periodically publishes the request queue state of every
+ * application group in a small file in the generation directory, which the
+ * web server modules map into memory. This allows them to reject requests
+ * for an application whose request queue is full before connecting to the
+ * HelperAgent and before forwarding the request body.
+ *
+ * The table is advisory. Readers treat a missing, stale or concurrently
+ * updated entry as "not full", so that requests are never rejected because
+ * of a problem with the table itself.
+ */
+
+#include "../Exceptions.h"
+
+#define PP_POOL_STATUS_TABLE_FILENAME "pool_status"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+typedef void PP_PoolStatusTable;
+
+/** Maps the table in the given generation directory, read-only. Returns NULL on error. */
+PP_PoolStatusTable *pp_pool_status_table_open(const char *generation_dir, PP_Error *error);
+void pp_pool_status_table_close(PP_PoolStatusTable *table);
+/** Returns whether the request queue of the given application group is known to be full. */
+int pp_pool_status_table_queue_full(PP_PoolStatusTable *table,
+	const char *app_group_name, unsigned int len);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+
+#ifdef __cplusplus
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <oxt/system_calls.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctime>
+#include <cerrno>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <FileDescriptor.h>
+#include <StaticString.h>
+#include <Exceptions.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+using namespace oxt;
+
+
+class PoolStatusTable: public boost::noncopyable {
+public:
+	struct GroupState {
+		string name;
+		unsigned int queueSize;
+		/** 0 means that the queue size is unlimited. */
+		unsigned int maxQueueSize;
+
+		GroupState(const string &_name, unsigned int _queueSize, unsigned int _maxQueueSize)
+			: name(_name),
+			  queueSize(_queueSize),
+			  maxQueueSize(_maxQueueSize)
+			{ }
+	};
+
+private:
+	static const boost::uint32_t MAGIC = 0x50505354; // "PPST"
+	static const boost::uint32_t VERSION = 1;
+	static const unsigned int SLOT_COUNT = 1024;
+	static const unsigned int MAX_NAME_SIZE = 240;
+	static const unsigned int MAX_PROBES = 8;
+	/** Readers ignore the table if it hasn't been updated for this many seconds. */
+	static const time_t MAX_AGE = 5;
+
+	struct Header {
+		boost::uint32_t magic;
+		boost::uint32_t version;
+		boost::uint32_t slotCount;
+		boost::uint32_t reserved;
+		volatile boost::uint64_t updatedAt;
+	};
+
+	/**
+	 * Each slot is protected by a sequence lock: the writer makes the
+	 * sequence number odd while it's changing the slot, and readers retry
+	 * or give up if the sequence number was odd or has changed.
+	 */
+	struct Slot {
+		volatile boost::uint32_t sequence;
+		boost::uint32_t queueSize;
+		boost::uint32_t maxQueueSize;
+		/** 0 means that the slot is free. */
+		boost::uint32_t nameSize;
+		char name[MAX_NAME_SIZE];
+	};
+
+	struct Table {
+		Header header;
+		Slot slots[SLOT_COUNT];
+	};
+
+	Table *table;
+	bool writable;
+	/** Only used by the writer: what the slots should contain. */
+	vector<Slot> shadow;
+
+	static boost::uint32_t hash(const StaticString &name) {
+		// FNV-1a
+		boost::uint32_t result = 2166136261u;
+		for (string::size_type i = 0; i < name.size(); i++) {
+			result = (result ^ (unsigned char) name[i]) * 16777619u;
+		}
+		return result;
+	}
+
+	static bool slotContentEquals(const Slot &a, const volatile Slot &b) {
+		return a.queueSize == b.queueSize
+			&& a.maxQueueSize == b.maxQueueSize
+			&& a.nameSize == b.nameSize
+			&& memcmp(a.name, (const char *) b.name, a.nameSize) == 0;
+	}
+
+	void place(const GroupState &state) {
+		if (state.name.empty() || state.name.size() > MAX_NAME_SIZE) {
+			return;
+		}
+		boost::uint32_t h = hash(state.name);
+		for (unsigned int i = 0; i < MAX_PROBES; i++) {
+			Slot &slot = shadow[(h + i) % SLOT_COUNT];
+			if (slot.nameSize == 0) {
+				slot.queueSize = state.queueSize;
+				slot.maxQueueSize = state.maxQueueSize;
+				slot.nameSize = state.name.size();
+				memcpy(slot.name, state.name.data(), state.name.size());
+				return;
+			}
+		}
+		// Too many collisions; readers won't find this group.
+	}
+
+	void writeSlot(unsigned int index) {
+		Slot &slot = table->slots[index];
+		const Slot &source = shadow[index];
+		slot.sequence++;
+		boost::atomic_thread_fence(boost::memory_order_seq_cst);
+		slot.queueSize = source.queueSize;
+		slot.maxQueueSize = source.maxQueueSize;
+		slot.nameSize = source.nameSize;
+		memcpy(slot.name, source.name, source.nameSize);
+		boost::atomic_thread_fence(boost::memory_order_seq_cst);
+		slot.sequence++;
+	}
+
+	void initializeTable() {
+		memset(table, 0, sizeof(Table));
+		table->header.version = VERSION;
+		table->header.slotCount = SLOT_COUNT;
+		boost::atomic_thread_fence(boost::memory_order_seq_cst);
+		table->header.magic = MAGIC;
+	}
+
+public:
+	static string getFilename(const string &generationDir) {
+		return generationDir + "/" PP_POOL_STATUS_TABLE_FILENAME;
+	}
+
+	/**
+	 * Maps the table in the given file. The writer creates the file if it
+	 * doesn't exist. An existing file is reused instead of replaced, so
+	 * that readers' mappings stay valid when the HelperAgent is restarted.
+	 *
+	 * @throws SystemException
+	 * @throws FileSystemException
+	 */
+	PoolStatusTable(const string &filename, bool writable) {
+		FileDescriptor fd;
+		struct stat buf;
+		int ret;
+
+		this->writable = writable;
+		if (writable) {
+			fd = FileDescriptor(syscalls::open(filename.c_str(), O_RDWR | O_CREAT, 0644));
+		} else {
+			fd = FileDescriptor(syscalls::open(filename.c_str(), O_RDONLY));
+		}
+		if (fd == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot open " + filename, e, filename);
+		}
+
+		do {
+			ret = fstat(fd, &buf);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot stat " + filename, e, filename);
+		}
+		if (buf.st_size != (off_t) sizeof(Table)) {
+			if (!writable) {
+				throw FileSystemException(filename + " has an unexpected size",
+					EINVAL, filename);
+			}
+			do {
+				ret = ftruncate(fd, sizeof(Table));
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				int e = errno;
+				throw FileSystemException("Cannot resize " + filename, e, filename);
+			}
+		}
+
+		void *addr = mmap(NULL, sizeof(Table),
+			writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+			MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			int e = errno;
+			throw SystemException("Cannot map " + filename, e);
+		}
+		table = (Table *) addr;
+
+		if (writable) {
+			if (table->header.magic != MAGIC
+			 || table->header.version != VERSION
+			 || table->header.slotCount != SLOT_COUNT)
+			{
+				initializeTable();
+			}
+			shadow.resize(SLOT_COUNT);
+			for (unsigned int i = 0; i < SLOT_COUNT; i++) {
+				memcpy(&shadow[i], (const void *) &table->slots[i], sizeof(Slot));
+			}
+		}
+	}
+
+	~PoolStatusTable() {
+		munmap(table, sizeof(Table));
+	}
+
+	/**
+	 * Replaces the contents of the table with the given states. Only the
+	 * slots that have changed are written to.
+	 */
+	void update(const vector<GroupState> &states, time_t now) {
+		vector<Slot> previous;
+		vector<GroupState>::const_iterator it, end = states.end();
+
+		assert(writable);
+		previous.swap(shadow);
+		shadow.resize(SLOT_COUNT);
+		memset(&shadow[0], 0, sizeof(Slot) * SLOT_COUNT);
+		for (it = states.begin(); it != end; it++) {
+			place(*it);
+		}
+		for (unsigned int i = 0; i < SLOT_COUNT; i++) {
+			if (!slotContentEquals(shadow[i], previous[i])) {
+				writeSlot(i);
+			}
+		}
+		table->header.updatedAt = now;
+	}
+
+	bool isQueueFull(const StaticString &appGroupName, time_t now) const {
+		if (table->header.magic != MAGIC
+		 || table->header.version != VERSION
+		 || table->header.slotCount != SLOT_COUNT
+		 || (time_t) table->header.updatedAt + MAX_AGE < now
+		 || appGroupName.empty()
+		 || appGroupName.size() > MAX_NAME_SIZE)
+		{
+			return false;
+		}
+
+		boost::uint32_t h = hash(appGroupName);
+		for (unsigned int i = 0; i < MAX_PROBES; i++) {
+			const volatile Slot &slot = table->slots[(h + i) % SLOT_COUNT];
+			boost::uint32_t sequence = slot.sequence;
+			if (sequence % 2 != 0) {
+				return false;
+			}
+			boost::atomic_thread_fence(boost::memory_order_seq_cst);
+			boost::uint32_t nameSize = slot.nameSize;
+			boost::uint32_t queueSize = slot.queueSize;
+			boost::uint32_t maxQueueSize = slot.maxQueueSize;
+			bool matches = nameSize == appGroupName.size()
+				&& memcmp((const char *) slot.name, appGroupName.data(), nameSize) == 0;
+			boost::atomic_thread_fence(boost::memory_order_seq_cst);
+			if (slot.sequence != sequence || nameSize == 0) {
+				return false;
+			} else if (matches) {
+				return maxQueueSize > 0 && queueSize >= maxQueueSize;
+			}
+		}
+		return false;
+	}
+};
+
+typedef boost::shared_ptr<PoolStatusTable> PoolStatusTablePtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* __cplusplus */
+
+#endif /* _PASSENGER_APPLICATION_POOL2_POOL_STATUS_TABLE_H_ */
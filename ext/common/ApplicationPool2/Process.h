@@ -27,18 +27,23 @@
 
 #include <string>
 #include <list>
+#include <map>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <oxt/system_calls.hpp>
 #include <oxt/macros.hpp>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <cstdio>
 #include <climits>
+#include <algorithm>
 #include <cassert>
 #include <ApplicationPool2/Common.h>
 #include <ApplicationPool2/Socket.h>
 #include <ApplicationPool2/Session.h>
 #include <ApplicationPool2/PipeWatcher.h>
+#include <ApplicationPool2/ConcurrencyTuner.h>
 #include <Constants.h>
 #include <FileDescriptor.h>
 #include <SafeLibev.h>
@@ -47,6 +52,7 @@
 #include <Utils/SystemTime.h>
 #include <Utils/StrIntUtils.h>
 #include <Utils/ProcessMetricsCollector.h>
+#include <Utils/MessageIO.h>
 
 namespace Passenger {
 namespace ApplicationPool2 {
@@ -86,6 +92,75 @@ public:
 	}
 };
 
+/**
+ * The enabled processes without sessions of a Pool, from the one that has
+ * been idle the longest to the one that became idle last. The list is
+ * intrusive: its links are stored in the Process objects themselves, so that
+ * adding and removing processes doesn't allocate, and the least recently
+ * used process is found in O(1). See Pool::idleProcesses.
+ */
+class IdleProcessList {
+private:
+	Process *head;
+	Process *tail;
+	unsigned int count;
+
+public:
+	IdleProcessList()
+		: head(NULL),
+		  tail(NULL),
+		  count(0)
+		{ }
+
+	bool empty() const {
+		return head == NULL;
+	}
+
+	unsigned int size() const {
+		return count;
+	}
+
+	/** The process that has been idle the longest, or NULL. */
+	Process *front() const {
+		return head;
+	}
+
+	/** The process that became idle after the given one, or NULL. */
+	static Process *next(const Process *process);
+
+	void push_back(Process *process);
+	void erase(Process *process);
+};
+
+/**
+ * How long the phases of spawning a Process took, as measured by the Spawner.
+ * Microseconds resolution; a phase is 0 if it wasn't measured.
+ */
+struct SpawnTimings {
+	/** From the start of the spawn until the process was forked. For
+	 * SmartSpawner this includes asking the preloader to fork. */
+	unsigned long long forkUsec;
+	/** From the fork until the process sent its handshake. This covers exec,
+	 * SpawnPreparer and starting the loader. */
+	unsigned long long preparationUsec;
+	/** From sending the spawn request until the process reported that
+	 * it is ready, i.e. the time it took to load the application. */
+	unsigned long long appLoadUsec;
+	/** From the ready message until its sockets were received and validated. */
+	unsigned long long socketReadyUsec;
+
+	SpawnTimings()
+		: forkUsec(0),
+		  preparationUsec(0),
+		  appLoadUsec(0),
+		  socketReadyUsec(0)
+		{ }
+
+	unsigned long long total() const {
+		return forkUsec + preparationUsec + appLoadUsec + socketReadyUsec;
+	}
+};
+
 /**
  * Represents an application process, as spawned by a Spawner. Every Process has
  * a PID, an admin socket and a list of sockets on which it listens for
@@ -128,6 +203,9 @@ public:
 class Process: public boost::enable_shared_from_this<Process> {
 private:
 	friend class Group;
+	friend class Pool;
+	friend class PriorityQueue<Process>;
+	friend class IdleProcessList;
 	
 	/** A mutex to protect access to `lifeStatus`. */
 	mutable boost::mutex lifetimeSyncher;
@@ -146,6 +224,14 @@ private:
 	ProcessList::iterator it;
 	/** The handle inside the associated Group's process priority queue. */
 	PriorityQueue<Process>::Handle pqHandle;
+	/** This process's position in the Group's process priority queue. Maintained by the queue. */
+	unsigned int pqIndex;
+	/** Whether this process is in Pool::idleProcesses, and if so, its links there. */
+	bool idleIndexed;
+	Process *idlePrev;
+	Process *idleNext;
+	/** When this process was last added to Pool::idleProcesses. */
+	unsigned long long idleSince;
 
 	static bool
 	isZombie(pid_t pid) {
@@ -218,6 +304,11 @@ public:
 	string connectPassword;
 	/** Admin socket, see class description. */
 	FileDescriptor adminSocket;
+	/** The pipe that this process's STDERR is connected to, if known. For
+	 * SmartSpawner-spawned processes this is the preloader's error pipe.
+	 * Only kept so that it can be handed off to a new HelperAgent along
+	 * with the admin socket; see Pool::prepareHandoff(). */
+	FileDescriptor errorPipe;
 	/** The sockets that this Process listens on for connections. */
 	SocketListPtr sockets;
 	/** Time at which the Spawner that created this process was created.
@@ -225,6 +316,11 @@ public:
 	unsigned long long spawnerCreationTime;
 	/** Time at which we started spawning this process. Microseconds resolution. */
 	unsigned long long spawnStartTime;
+	/** Breakdown of the time it took to spawn this process. */
+	SpawnTimings spawnTimings;
+	/** The CPUs that this process has been pinned to, as a CPU list (see
+	 * parseCpuList()). Empty if it wasn't pinned. */
+	string cpuAffinity;
 	/** The maximum amount of concurrent sessions this process can handle.
 	 * 0 means unlimited. */
 	int concurrency;
@@ -233,6 +329,12 @@ public:
 	 * the admin socket need not be closed, etc.
 	 */
 	bool dummy;
+	/** The address of the RemoteAgent that runs this process, if it runs on
+	 * another host. Empty for local processes. The `pid` of a remote process
+	 * is its PID on that host, and `adminSocket` is its control connection
+	 * with the RemoteAgent; see RemoteSpawner.
+	 */
+	string remoteAgent;
 	/** Whether it is required that triggerShutdown() and cleanup() must be called
 	 * before destroying this Process. Normally true, except for dummy Process
 	 * objects created by Pool::asyncGet() with options.noop == true, because those
@@ -250,6 +352,9 @@ public:
 	 * process was finished initializing. Microseconds resolution.
 	 */
 	unsigned long long spawnEndTime;
+	/** Whether a ProcessExitWatcher has been set up for this process after
+	 * it has been told to shut down. If not, its Group polls it. */
+	bool exitWatched;
 	/** Last time when a session was opened for this Process. */
 	unsigned long long lastUsed;
 	/** Number of sessions currently open.
@@ -258,6 +363,18 @@ public:
 	int sessions;
 	/** Number of sessions opened so far. */
 	unsigned int processed;
+	/** Exponentially weighted moving average of the durations of the sessions
+	 * closed so far, in microseconds. 0 if no session has been closed yet. */
+	unsigned long long responseTimeEwma;
+	/** The CPU time, in microseconds, and the number of objects that the
+	 * application reported to have used for its requests so far, and the
+	 * number of requests that it reported them for. See
+	 * Group::recordResourceUsage(). */
+	unsigned long long cpuTime;
+	unsigned long long allocations;
+	unsigned int resourceUsageReports;
+	/** Tunes `concurrency` at runtime if enabled, see Options::maxTunedConcurrency. */
+	ConcurrencyTuner concurrencyTuner;
 	/** Do not access directly, always use `isAlive()`/`isDead()`/`getLifeStatus()` or
 	 * through `lifetimeSyncher`. */
 	enum LifeStatus {
@@ -312,6 +429,12 @@ public:
 	time_t shutdownStartTime;
 	/** Collected by Pool::collectAnalytics(). */
 	ProcessMetrics metrics;
+	/** Whether an out-of-band work request has been sent to this process because
+	 * it exceeded Options::memoryLimit. */
+	bool memoryLimitOobwPerformed;
+	/** Whether this process has been handed off to another HelperAgent, which
+	 * owns it now. If so, shutting it down leaves the OS process alone. */
+	bool handedOff;
 	
 	Process(const SafeLibevPtr _libev,
 		pid_t _pid,
@@ -328,25 +451,38 @@ public:
 		unsigned long long _spawnStartTime,
 		const SpawnerConfigPtr &_config = SpawnerConfigPtr())
 		: pqHandle(NULL),
+		  pqIndex(0),
+		  idleIndexed(false),
+		  idlePrev(NULL),
+		  idleNext(NULL),
+		  idleSince(0),
 		  libev(_libev.get()),
 		  pid(_pid),
 		  stickySessionId(0),
 		  gupid(_gupid),
 		  connectPassword(_connectPassword),
 		  adminSocket(_adminSocket),
+		  errorPipe(_errorPipe),
 		  sockets(_sockets),
 		  spawnerCreationTime(_spawnerCreationTime),
 		  spawnStartTime(_spawnStartTime),
 		  concurrency(0),
 		  dummy(false),
 		  requiresShutdown(true),
+		  exitWatched(false),
 		  sessions(0),
 		  processed(0),
+		  responseTimeEwma(0),
+		  cpuTime(0),
+		  allocations(0),
+		  resourceUsageReports(0),
 		  lifeStatus(ALIVE),
 		  enabled(ENABLED),
 		  oobwStatus(OOBW_NOT_ACTIVE),
 		  m_osProcessExists(true),
-		  shutdownStartTime(0)
+		  shutdownStartTime(0),
+		  memoryLimitOobwPerformed(false),
+		  handedOff(false)
 	{
 		SpawnerConfigPtr config;
 		if (_config == NULL) {
@@ -443,6 +579,42 @@ public:
 		return getLifeStatus() == ALIVE && sessions == 0;
 	}
 
+	/** Sends a command to the RemoteAgent over the control connection.
+	 * Returns whether that succeeded. */
+	bool sendRemoteCommand(const char *command, const string &arg = string()) {
+		assert(isRemote());
+		try {
+			writeArrayMessage(adminSocket, command, arg.c_str(), (const char *) 0);
+			return true;
+		} catch (const SystemException &e) {
+			P_WARN("Cannot send '" << command << "' to the RemoteAgent of process " <<
+				pid << " at " << remoteAgent << ": " << e.what());
+			return false;
+		}
+	}
+
+	/** Whether the RemoteAgent still keeps the control connection open, which
+	 * it does for as long as the process runs. Doesn't block. */
+	bool remoteControlConnectionOpen() const {
+		struct pollfd pfd;
+		pfd.fd = adminSocket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0) {
+			return true;
+		} else if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+			return false;
+		} else {
+			char c;
+			ssize_t ret = recv(adminSocket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+			return ret > 0 || (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+		}
+	}
+
+	bool isRemote() const {
+		return !remoteAgent.empty();
+	}
+
 	void triggerShutdown() {
 		assert(canTriggerShutdown());
 		{
@@ -452,7 +624,17 @@ public:
 			shutdownStartTime = SystemTime::get();
 		}
 		if (!dummy) {
-			syscalls::shutdown(adminSocket, SHUT_WR);
+			if (OXT_LIKELY(sockets != NULL)) {
+				SocketList::iterator it, end = sockets->end();
+				for (it = sockets->begin(); it != end; it++) {
+					it->closeIdleConnections();
+				}
+			}
+			if (isRemote()) {
+				sendRemoteCommand("shutdown");
+			} else if (!handedOff) {
+				syscalls::shutdown(adminSocket, SHUT_WR);
+			}
 		}
 	}
 
@@ -460,6 +642,17 @@ public:
 		return SystemTime::get() >= shutdownStartTime + PROCESS_SHUTDOWN_TIMEOUT;
 	}
 
+	/** The number of milliseconds until shutdownTimeoutExpired() becomes true. */
+	unsigned int shutdownTimeoutRemaining() const {
+		time_t now = SystemTime::get();
+		time_t deadline = shutdownStartTime + PROCESS_SHUTDOWN_TIMEOUT;
+		if (now >= deadline) {
+			return 0;
+		} else {
+			return (unsigned int) (deadline - now) * 1000;
+		}
+	}
+
 	bool canCleanup() const {
 		return getLifeStatus() == SHUTDOWN_TRIGGERED && !osProcessExists();
 	}
@@ -468,7 +661,7 @@ public:
 		assert(canCleanup());
 
 		P_TRACE(2, "Cleaning up process " << inspect());
-		if (!dummy) {
+		if (!dummy && !handedOff) {
 			if (OXT_LIKELY(sockets != NULL)) {
 				SocketList::const_iterator it, end = sockets->end();
 				for (it = sockets->begin(); it != end; it++) {
@@ -487,11 +680,15 @@ public:
 	/** Checks whether the OS process exists.
 	 * Once it has been detected that it doesn't, that event is remembered
 	 * so that we don't accidentally ping any new processes that have the
-	 * same PID.
+	 * same PID. A process that has been handed off is treated as gone,
+	 * because it's no longer ours to wait for or to kill. A remote process
+	 * exists for as long as its RemoteAgent keeps the control connection open.
 	 */
 	bool osProcessExists() const {
-		if (!dummy && m_osProcessExists) {
-			if (syscalls::kill(pid, 0) == 0) {
+		if (!dummy && !handedOff && m_osProcessExists) {
+			if (isRemote()) {
+				m_osProcessExists = remoteControlConnectionOpen();
+			} else if (syscalls::kill(pid, 0) == 0) {
 				/* On some environments, e.g. Heroku, the init process does
 				 * not properly reap adopted zombie processes, which can interfere
 				 * with our process existance check. To work around this, we
@@ -507,12 +704,20 @@ public:
 		}
 	}
 
-	/** Kill the OS process with the given signal. */
+	/** Kill the OS process with the given signal. Remote processes are
+	 * killed by their RemoteAgent. */
 	int kill(int signo) {
-		if (osProcessExists()) {
-			return syscalls::kill(pid, signo);
-		} else {
+		if (!osProcessExists()) {
 			return 0;
+		} else if (isRemote()) {
+			if (sendRemoteCommand("kill", toString(signo))) {
+				return 0;
+			} else {
+				errno = EPIPE;
+				return -1;
+			}
+		} else {
+			return syscalls::kill(pid, signo);
 		}
 	}
 	
@@ -532,11 +737,33 @@ public:
 			} else {
 				return 1;
 			}
+		} else if (sessions >= concurrency) {
+			// There may be more sessions than the concurrency if it
+			// has been lowered at runtime.
+			return INT_MAX;
 		} else {
 			return (int) (((long long) sessions * INT_MAX) / (double) concurrency);
 		}
 	}
 	
+	/**
+	 * The number of microseconds that a new session with this process can
+	 * expect to take: the recent average session duration, multiplied by the
+	 * number of sessions that it would share the process with. Processes that
+	 * haven't closed a session yet are assumed to be fast, so that they get
+	 * tried early. Like with busyness(), a totally busy process sorts last.
+	 * Used by Group.pqueue in latency-aware routing mode.
+	 */
+	int expectedLatency() const {
+		if (isTotallyBusy()) {
+			return INT_MAX;
+		} else {
+			unsigned long long result = (unsigned long long) (sessions + 1)
+				* std::max<unsigned long long>(responseTimeEwma, 1);
+			return (int) std::min<unsigned long long>(result, INT_MAX - 1);
+		}
+	}
+	
 	/**
 	 * Whether we've reached the maximum number of concurrent sessions for this
 	 * process.
@@ -564,29 +791,98 @@ public:
 	 * not result in any harmful behavior.
 	 */
 	SessionPtr newSession() {
-		Socket *socket = sessionSockets.pop();
+		Socket *socket = sessionSockets.top();
 		if (socket->isTotallyBusy()) {
 			return SessionPtr();
 		} else {
+			sessionSockets.pop();
 			socket->sessions++;
 			this->sessions++;
 			socket->pqHandle = sessionSockets.push(socket, socket->busyness());
 			lastUsed = SystemTime::getUsec();
-			return boost::make_shared<Session>(shared_from_this(), socket);
+			return boost::make_shared<Session>(shared_from_this(), socket, lastUsed);
 		}
 	}
 	
 	void sessionClosed(Session *session) {
-		Socket *socket = session->getSocket();
-		
+		sessionClosed(session->getSocket(), session->getStartTime());
+	}
+
+	/**
+	 * Like sessionClosed(Session *), for when the Session object is already
+	 * gone. `startTime` is the session's start time, see Session::getStartTime().
+	 * `used` is false for sessions that were closed without having been
+	 * handed out, which don't count as processed requests.
+	 */
+	void sessionClosed(Socket *socket, unsigned long long startTime, bool used = true) {
 		assert(socket->sessions > 0);
 		assert(sessions > 0);
 		
 		socket->sessions--;
 		this->sessions--;
-		processed++;
+		if (used) {
+			processed++;
+		}
 		sessionSockets.decrease(socket->pqHandle, socket->busyness());
-		assert(!isTotallyBusy());
+		if (startTime != 0) {
+			unsigned long long now = SystemTime::getUsec();
+			unsigned long long duration = (now > startTime)
+				? now - startTime
+				: 0;
+			// Same 1/8 gain as TCP's smoothed round-trip time.
+			if (responseTimeEwma == 0) {
+				responseTimeEwma = duration;
+			} else {
+				responseTimeEwma = (responseTimeEwma * 7 + duration) / 8;
+			}
+			if (concurrencyTuner.recordSession(duration, sessions + 1)) {
+				P_DEBUG("Tuned concurrency of process " << inspect() << " to " <<
+					concurrencyTuner.getLimit());
+				setConcurrency(concurrencyTuner.getLimit());
+			}
+		}
+		// Not asserting !isTotallyBusy() here: if the concurrency has been
+		// lowered while sessions were open, the process may still be over
+		// its new limit.
+	}
+
+	/**
+	 * Changes the concurrency of this process at runtime, by distributing
+	 * it over the session sockets, and reorders them accordingly. Every
+	 * session socket keeps a concurrency of at least 1, so the result may
+	 * be higher than requested. 0 means unlimited. Open sessions are not
+	 * affected; if there are more than the new concurrency, then no new
+	 * sessions can be opened until enough of them are closed.
+	 *
+	 * The caller must reposition this process in its Group afterwards,
+	 * because busyness() changes.
+	 */
+	void setConcurrency(int value) {
+		SocketList::iterator it;
+		unsigned int count = 0;
+		for (it = sockets->begin(); it != sockets->end(); it++) {
+			if (it->protocol == "session" || it->protocol == "http_session") {
+				count++;
+			}
+		}
+		if (count == 0) {
+			return;
+		}
+
+		unsigned int i = 0;
+		for (it = sockets->begin(); it != sockets->end(); it++) {
+			if (it->protocol == "session" || it->protocol == "http_session") {
+				if (value <= 0) {
+					it->concurrency = 0;
+				} else {
+					it->concurrency = std::max<int>(1,
+						value / count + ((unsigned int) value % count > i ? 1 : 0));
+				}
+				i++;
+			}
+		}
+		sessionSockets.clear();
+		indexSessionSockets();
 	}
 
 	/**
@@ -598,56 +894,73 @@ public:
 
 	string inspect() const;
 
-	template<typename Stream>
-	void inspectXml(Stream &stream, bool includeSockets = true) const {
-		stream << "<pid>" << pid << "</pid>";
-		stream << "<sticky_session_id>" << stickySessionId << "</sticky_session_id>";
-		stream << "<gupid>" << gupid << "</gupid>";
-		stream << "<connect_password>" << connectPassword << "</connect_password>";
-		stream << "<concurrency>" << concurrency << "</concurrency>";
-		stream << "<sessions>" << sessions << "</sessions>";
-		stream << "<busyness>" << busyness() << "</busyness>";
-		stream << "<processed>" << processed << "</processed>";
-		stream << "<spawner_creation_time>" << spawnerCreationTime << "</spawner_creation_time>";
-		stream << "<spawn_start_time>" << spawnStartTime << "</spawn_start_time>";
-		stream << "<spawn_end_time>" << spawnEndTime << "</spawn_end_time>";
-		stream << "<last_used>" << lastUsed << "</last_used>";
-		stream << "<uptime>" << uptime() << "</uptime>";
+	const char *getLifeStatusName() const {
 		switch (lifeStatus) {
 		case ALIVE:
-			stream << "<life_status>ALIVE</life_status>";
-			break;
+			return "ALIVE";
 		case SHUTDOWN_TRIGGERED:
-			stream << "<life_status>SHUTDOWN_TRIGGERED</life_status>";
-			break;
+			return "SHUTDOWN_TRIGGERED";
 		case DEAD:
-			stream << "<life_status>DEAD</life_status>";
-			break;
+			return "DEAD";
 		default:
 			P_BUG("Unknown 'lifeStatus' state " << (int) lifeStatus);
+			return NULL; // Shut up compiler warning.
 		}
+	}
+
+	const char *getEnabledName() const {
 		switch (enabled) {
 		case ENABLED:
-			stream << "<enabled>ENABLED</enabled>";
-			break;
+			return "ENABLED";
 		case DISABLING:
-			stream << "<enabled>DISABLING</enabled>";
-			break;
+			return "DISABLING";
 		case DISABLED:
-			stream << "<enabled>DISABLED</enabled>";
-			break;
+			return "DISABLED";
 		case DETACHED:
-			stream << "<enabled>DETACHED</enabled>";
-			break;
+			return "DETACHED";
 		default:
 			P_BUG("Unknown 'enabled' state " << (int) enabled);
+			return NULL; // Shut up compiler warning.
 		}
+	}
+
+	template<typename Stream>
+	void inspectXml(Stream &stream, bool includeSockets = true) const {
+		stream << "<pid>" << pid << "</pid>";
+		stream << "<sticky_session_id>" << stickySessionId << "</sticky_session_id>";
+		stream << "<gupid>" << gupid << "</gupid>";
+		stream << "<connect_password>" << connectPassword << "</connect_password>";
+		stream << "<concurrency>" << concurrency << "</concurrency>";
+		stream << "<sessions>" << sessions << "</sessions>";
+		stream << "<busyness>" << busyness() << "</busyness>";
+		stream << "<processed>" << processed << "</processed>";
+		stream << "<response_time_ewma>" << responseTimeEwma << "</response_time_ewma>";
+		stream << "<cpu_time>" << cpuTime << "</cpu_time>";
+		stream << "<allocations>" << allocations << "</allocations>";
+		stream << "<resource_usage_reports>" << resourceUsageReports << "</resource_usage_reports>";
+		stream << "<spawner_creation_time>" << spawnerCreationTime << "</spawner_creation_time>";
+		stream << "<spawn_start_time>" << spawnStartTime << "</spawn_start_time>";
+		stream << "<spawn_end_time>" << spawnEndTime << "</spawn_end_time>";
+		stream << "<spawn_timings>";
+		stream << "<fork_usec>" << spawnTimings.forkUsec << "</fork_usec>";
+		stream << "<preparation_usec>" << spawnTimings.preparationUsec << "</preparation_usec>";
+		stream << "<app_load_usec>" << spawnTimings.appLoadUsec << "</app_load_usec>";
+		stream << "<socket_ready_usec>" << spawnTimings.socketReadyUsec << "</socket_ready_usec>";
+		stream << "</spawn_timings>";
+		if (!cpuAffinity.empty()) {
+			stream << "<cpu_affinity>" << cpuAffinity << "</cpu_affinity>";
+		}
+		stream << "<last_used>" << lastUsed << "</last_used>";
+		stream << "<uptime>" << uptime() << "</uptime>";
+		stream << "<life_status>" << getLifeStatusName() << "</life_status>";
+		stream << "<enabled>" << getEnabledName() << "</enabled>";
 		if (metrics.isValid()) {
 			stream << "<has_metrics>true</has_metrics>";
 			stream << "<cpu>" << (int) metrics.cpu << "</cpu>";
 			stream << "<rss>" << metrics.rss << "</rss>";
 			stream << "<pss>" << metrics.pss << "</pss>";
 			stream << "<private_dirty>" << metrics.privateDirty << "</private_dirty>";
+			stream << "<shared_memory>" << metrics.sharedMemory() << "</shared_memory>";
 			stream << "<swap>" << metrics.swap << "</swap>";
 			stream << "<real_memory>" << metrics.realMemory() << "</real_memory>";
 			stream << "<vmsize>" << metrics.vmsize << "</vmsize>";
@@ -665,6 +978,9 @@ public:
 				stream << "<address>" << escapeForXml(socket.address) << "</address>";
 				stream << "<protocol>" << escapeForXml(socket.protocol) << "</protocol>";
 				stream << "<concurrency>" << socket.concurrency << "</concurrency>";
+				if (socket.keepAlive) {
+					stream << "<keepalive>true</keepalive>";
+				}
 				stream << "<sessions>" << socket.sessions << "</sessions>";
 				stream << "</socket>";
 			}
@@ -674,6 +990,46 @@ public:
 };
 
 
+inline Process *
+IdleProcessList::next(const Process *process) {
+	return process->idleNext;
+}
+
+inline void
+IdleProcessList::push_back(Process *process) {
+	assert(!process->idleIndexed);
+	process->idlePrev = tail;
+	process->idleNext = NULL;
+	if (tail != NULL) {
+		tail->idleNext = process;
+	} else {
+		head = process;
+	}
+	tail = process;
+	process->idleIndexed = true;
+	count++;
+}
+
+inline void
+IdleProcessList::erase(Process *process) {
+	assert(process->idleIndexed);
+	if (process->idlePrev != NULL) {
+		process->idlePrev->idleNext = process->idleNext;
+	} else {
+		head = process->idleNext;
+	}
+	if (process->idleNext != NULL) {
+		process->idleNext->idlePrev = process->idlePrev;
+	} else {
+		tail = process->idlePrev;
+	}
+	process->idlePrev = NULL;
+	process->idleNext = NULL;
+	process->idleIndexed = false;
+	count--;
+}
+
+
 } // namespace ApplicationPool2
 } // namespace Passenger
 
@@ -0,0 +1,500 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_PROCESS_JOURNAL_H_
+#define _PASSENGER_APPLICATION_POOL2_PROCESS_JOURNAL_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ApplicationPool2/Process.h>
+#include <ApplicationPool2/Socket.h>
+#include <MessageClient.h>
+#include <FileDescriptor.h>
+#include <Exceptions.h>
+#include <Logging.h>
+#include <Utils.h>
+#include <Utils/BlockingQueue.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/json.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+
+/**
+ * An append-only journal of the processes in the pool, kept in the
+ * generation directory, so that a helper agent that is started after the
+ * previous one crashed can reattach the application processes that are
+ * still running, instead of spawning new ones.
+ *
+ * Every process that is attached to a Group gets an 'attach' record, with
+ * everything that is needed to recreate its Process object, and a 'detach'
+ * record once it leaves its Group. One JSON document per line. Once there
+ * are more dead records than live ones, the journal is rewritten with only
+ * the live ones.
+ *
+ * An application process exits as soon as the other end of its admin socket
+ * is closed, which happens when the helper agent dies. So the journal also
+ * passes every process's admin socket and error pipe to the process keeper
+ * in the watchdog, which holds on to them until the process is detached.
+ * recover() takes them back.
+ *
+ * Pool calls attached() and detached() with the pool lock held, so they
+ * only queue the record; a background thread does the I/O.
+ */
+class ProcessJournal {
+public:
+	/** Everything needed to recreate the Process object of a journaled process. */
+	struct Entry {
+		string groupName;
+		pid_t pid;
+		string gupid;
+		string connectPassword;
+		unsigned long long spawnerCreationTime;
+		unsigned long long spawnStartTime;
+		string cpuAffinity;
+		SocketListPtr sockets;
+		/** Not journaled. Set by recover(). */
+		FileDescriptor adminSocket;
+		FileDescriptor errorPipe;
+
+		Entry()
+			: pid(0),
+			  spawnerCreationTime(0),
+			  spawnStartTime(0)
+			{ }
+	};
+
+private:
+	/** The journal is never compacted while it has fewer dead records than this. */
+	static const unsigned int MIN_DEAD_RECORDS_FOR_COMPACTION = 64;
+
+	struct Record {
+		enum Type {
+			ATTACH,
+			DETACH,
+			STOP
+		} type;
+		string gupid;
+		string line;
+		FileDescriptor adminSocket;
+		FileDescriptor errorPipe;
+	};
+
+	const string filename;
+	const string keeperAddress;
+	const string keeperPassword;
+	FileDescriptor fd;
+	BlockingQueue<Record> queue;
+	oxt::thread *thr;
+
+	// Only accessed by the journal thread after construction.
+	/** gupid => 'attach' record. */
+	map<string, string> liveRecords;
+	unsigned int deadRecords;
+	MessageClient keeper;
+
+	static string serialize(const Entry &entry) {
+		Json::Value doc;
+		SocketList::const_iterator it, end = entry.sockets->end();
+
+		doc["type"] = "attach";
+		doc["group"] = entry.groupName;
+		doc["pid"] = (Json::Int) entry.pid;
+		doc["gupid"] = entry.gupid;
+		doc["connect_password"] = entry.connectPassword;
+		doc["spawner_creation_time"] = (Json::UInt64) entry.spawnerCreationTime;
+		doc["spawn_start_time"] = (Json::UInt64) entry.spawnStartTime;
+		doc["cpu_affinity"] = entry.cpuAffinity;
+		doc["sockets"] = Json::Value(Json::arrayValue);
+		for (it = entry.sockets->begin(); it != end; it++) {
+			Json::Value socket;
+			socket["name"] = it->name;
+			socket["address"] = it->address;
+			socket["protocol"] = it->protocol;
+			socket["concurrency"] = it->concurrency;
+			socket["keep_alive"] = it->keepAlive;
+			doc["sockets"].append(socket);
+		}
+		// FastWriter puts everything on one line, followed by a newline.
+		return Json::FastWriter().write(doc);
+	}
+
+	static string serializeDetach(const string &gupid) {
+		Json::Value doc;
+		doc["type"] = "detach";
+		doc["gupid"] = gupid;
+		return Json::FastWriter().write(doc);
+	}
+
+	static Entry deserialize(const Json::Value &doc) {
+		const Json::Value &sockets = doc["sockets"];
+		Entry entry;
+
+		entry.groupName = doc["group"].asString();
+		entry.pid = (pid_t) doc["pid"].asInt();
+		entry.gupid = doc["gupid"].asString();
+		entry.connectPassword = doc["connect_password"].asString();
+		entry.spawnerCreationTime = doc["spawner_creation_time"].asUInt64();
+		entry.spawnStartTime = doc["spawn_start_time"].asUInt64();
+		entry.cpuAffinity = doc["cpu_affinity"].asString();
+		entry.sockets = boost::make_shared<SocketList>();
+		for (Json::Value::ArrayIndex i = 0; i < sockets.size(); i++) {
+			const Json::Value &socket = sockets[i];
+			entry.sockets->add(socket["name"].asString(),
+				socket["address"].asString(),
+				socket["protocol"].asString(),
+				socket["concurrency"].asInt(),
+				socket["keep_alive"].asBool());
+		}
+		return entry;
+	}
+
+	/** Whether the process still exists, and hasn't closed its admin socket. */
+	static bool isAlive(const Entry &entry) {
+		if (syscalls::kill(entry.pid, 0) == -1 && errno != EPERM) {
+			return false;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = entry.adminSocket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		return syscalls::poll(&pfd, 1, 0) != -1 && !(pfd.revents & (POLLHUP | POLLERR));
+	}
+
+	void threadMain() {
+		TRACE_POINT();
+		try {
+			while (true) {
+				UPDATE_TRACE_POINT();
+				Record record = queue.get();
+				if (record.type == Record::STOP) {
+					break;
+				}
+
+				try {
+					writeRecord(record);
+				} catch (const tracable_exception &e) {
+					P_WARN("Cannot write to the process journal " << filename <<
+						": " << e.what());
+				}
+				if (!keeperAddress.empty()) {
+					try {
+						tellKeeper(record);
+					} catch (const tracable_exception &e) {
+						if (record.type == Record::ATTACH) {
+							P_WARN("Cannot pass process " << record.gupid <<
+								" to the process keeper: " << e.what());
+						} else {
+							// The process keeper stops before the helper agent
+							// does when the Watchdog shuts down.
+							P_DEBUG("Cannot tell the process keeper to release process " <<
+								record.gupid << ": " << e.what());
+						}
+						keeper.disconnect();
+					}
+				}
+			}
+		} catch (const boost::thread_interrupted &) {
+			P_DEBUG("Process journal thread interrupted");
+		}
+	}
+
+	void writeRecord(const Record &record) {
+		string line;
+
+		if (record.type == Record::ATTACH) {
+			if (liveRecords.find(record.gupid) != liveRecords.end()) {
+				deadRecords++;
+			}
+			liveRecords[record.gupid] = record.line;
+			line = record.line;
+		} else if (liveRecords.erase(record.gupid) == 0) {
+			// Was never attached, e.g. a standby process.
+			return;
+		} else {
+			deadRecords += 2;
+			line = serializeDetach(record.gupid);
+		}
+
+		if (deadRecords >= MIN_DEAD_RECORDS_FOR_COMPACTION
+		 && deadRecords > liveRecords.size())
+		{
+			compact();
+		} else {
+			writeExact(fd, line);
+		}
+	}
+
+	void compact() {
+		map<string, string>::const_iterator it, end = liveRecords.end();
+		string contents;
+
+		for (it = liveRecords.begin(); it != end; it++) {
+			contents.append(it->second);
+		}
+		// The file is in append mode, so this rewrites it from the start.
+		int ret;
+		do {
+			ret = ftruncate(fd, 0);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot truncate the process journal", e, filename);
+		}
+		writeExact(fd, contents);
+		deadRecords = 0;
+	}
+
+	void tellKeeper(const Record &record) {
+		if (!keeper.connected()) {
+			keeper.connect(keeperAddress, "_helper_agent", keeperPassword);
+		}
+		if (record.type == Record::ATTACH) {
+			keeper.write("keep",
+				record.gupid.c_str(),
+				(record.errorPipe != -1) ? "true" : "false",
+				NULL);
+			keeper.checkSecurityResponse();
+			keeper.writeFileDescriptor(record.adminSocket);
+			if (record.errorPipe != -1) {
+				keeper.writeFileDescriptor(record.errorPipe);
+			}
+		} else {
+			keeper.write("release", record.gupid.c_str(), NULL);
+			keeper.checkSecurityResponse();
+		}
+	}
+
+public:
+	/**
+	 * Opens the journal and rewrites it with just the given entries, which
+	 * are usually the processes that have been recovered. If `keeperAddress`
+	 * is empty then processes are only journaled, not kept.
+	 *
+	 * @throws FileSystemException
+	 */
+	ProcessJournal(const string &_filename, const string &_keeperAddress,
+		const string &_keeperPassword, const vector<Entry> &entries = vector<Entry>())
+		: filename(_filename),
+		  keeperAddress(_keeperAddress),
+		  keeperPassword(_keeperPassword),
+		  thr(NULL),
+		  deadRecords(0)
+	{
+		fd = FileDescriptor(syscalls::open(filename.c_str(),
+			O_WRONLY | O_CREAT | O_APPEND, 0600));
+		if (fd == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot open the process journal", e, filename);
+		}
+		foreach (const Entry &entry, entries) {
+			liveRecords[entry.gupid] = serialize(entry);
+		}
+		compact();
+		thr = new oxt::thread(boost::bind(&ProcessJournal::threadMain, this),
+			"Process journal", 128 * 1024);
+	}
+
+	~ProcessJournal() {
+		stop();
+	}
+
+	/**
+	 * Writes out all queued records and stops the journal thread. Records
+	 * that are queued after this are ignored. Called by the destructor.
+	 */
+	void stop() {
+		if (thr != NULL) {
+			this_thread::disable_interruption di;
+			this_thread::disable_syscall_interruption dsi;
+			Record record;
+			record.type = Record::STOP;
+			queue.add(record);
+			thr->join();
+			delete thr;
+			thr = NULL;
+		}
+	}
+
+	/** Journals that `process` has been attached to the given Group. Thread-safe. */
+	void attached(const string &groupName, const ProcessPtr &process) {
+		Entry entry;
+		entry.groupName = groupName;
+		entry.pid = process->pid;
+		entry.gupid = process->gupid;
+		entry.connectPassword = process->connectPassword;
+		entry.spawnerCreationTime = process->spawnerCreationTime;
+		entry.spawnStartTime = process->spawnStartTime;
+		entry.cpuAffinity = process->cpuAffinity;
+		entry.sockets = process->sockets;
+
+		Record record;
+		record.type = Record::ATTACH;
+		record.gupid = process->gupid;
+		record.line = serialize(entry);
+		record.adminSocket = process->adminSocket;
+		record.errorPipe = process->errorPipe;
+		queue.add(record);
+	}
+
+	/** Journals that `process` has left its Group. Thread-safe. */
+	void detached(const ProcessPtr &process) {
+		Record record;
+		record.type = Record::DETACH;
+		record.gupid = process->gupid;
+		queue.add(record);
+	}
+
+	/**
+	 * Reads the processes that are attached according to the given journal.
+	 * Ignores records that can't be parsed, e.g. one that was only partially
+	 * written when the helper agent crashed.
+	 *
+	 * @throws SystemException
+	 */
+	static map<string, Entry> load(const string &filename) {
+		map<string, Entry> entries;
+		string contents;
+		vector<string> lines;
+
+		try {
+			contents = readAll(filename);
+		} catch (const SystemException &e) {
+			if (e.code() == ENOENT) {
+				return entries;
+			} else {
+				throw;
+			}
+		}
+
+		split(contents, '\n', lines);
+		foreach (const string &line, lines) {
+			Json::Reader reader;
+			Json::Value doc;
+			if (line.empty() || !reader.parse(line, doc, false) || !doc.isObject()) {
+				continue;
+			}
+			try {
+				if (doc["type"].asString() == "attach") {
+					Entry entry = deserialize(doc);
+					entries[entry.gupid] = entry;
+				} else if (doc["type"].asString() == "detach") {
+					entries.erase(doc["gupid"].asString());
+				}
+			} catch (const std::runtime_error &) {
+				// Field with the wrong type.
+				continue;
+			}
+		}
+		return entries;
+	}
+
+	/**
+	 * Takes back the admin sockets and error pipes that the process keeper
+	 * holds, and returns the processes that are both journaled and still
+	 * alive. Tells the process keeper to release all other processes, so
+	 * that they exit.
+	 *
+	 * @throws SystemException
+	 * @throws IOException
+	 * @throws SecurityException
+	 */
+	static vector<Entry> recover(const string &filename, const string &keeperAddress,
+		const string &keeperPassword)
+	{
+		TRACE_POINT();
+		map<string, Entry> journaled = load(filename);
+		MessageClient client;
+		vector<string> args;
+		vector<string> released;
+		vector<Entry> result;
+
+		client.connect(keeperAddress, "_helper_agent", keeperPassword);
+		client.write("recover", NULL);
+		client.checkSecurityResponse();
+		while (true) {
+			if (!client.read(args)) {
+				throw IOException("The process keeper closed the connection unexpectedly");
+			} else if (args.size() == 1 && args[0] == "end") {
+				break;
+			} else if (args.size() != 3 || args[0] != "process") {
+				throw IOException("Unexpected message from the process keeper");
+			}
+
+			FileDescriptor adminSocket(client.readFileDescriptor());
+			FileDescriptor errorPipe;
+			if (args[2] == "true") {
+				errorPipe = FileDescriptor(client.readFileDescriptor());
+			}
+
+			map<string, Entry>::iterator it = journaled.find(args[1]);
+			if (it != journaled.end()) {
+				it->second.adminSocket = adminSocket;
+				it->second.errorPipe = errorPipe;
+				if (isAlive(it->second)) {
+					result.push_back(it->second);
+					continue;
+				}
+			}
+			released.push_back(args[1]);
+		}
+
+		UPDATE_TRACE_POINT();
+		foreach (const string &gupid, released) {
+			client.write("release", gupid.c_str(), NULL);
+			client.checkSecurityResponse();
+		}
+		return result;
+	}
+};
+
+typedef boost::shared_ptr<ProcessJournal> ProcessJournalPtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_PROCESS_JOURNAL_H_ */
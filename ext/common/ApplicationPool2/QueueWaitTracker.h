@@ -0,0 +1,120 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_QUEUE_WAIT_TRACKER_H_
+#define _PASSENGER_APPLICATION_POOL2_QUEUE_WAIT_TRACKER_H_
+
+#include <algorithm>
+#include <vector>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+
+
+/**
+ * Tracks how long get() requests waited in a Group's request queue: the
+ * distribution of the most recent wait times, and whether the wait has been
+ * above a target for a while. The latter is the CoDel criterion for a
+ * standing queue, which Group uses to shed load.
+ *
+ * Times are in microseconds. Not thread-safe; Group protects it with
+ * the pool lock.
+ */
+class QueueWaitTracker {
+public:
+	static const unsigned int SAMPLES = 256;
+	/** How long the wait must stay above the target before the queue is
+	 * considered to be overloaded. The CoDel default. */
+	static const unsigned long long INTERVAL_USEC = 100000;
+
+private:
+	unsigned long long samples[SAMPLES];
+	unsigned int count;
+	unsigned int next;
+	/** When the wait first went above the target, or 0 if it is below it. */
+	unsigned long long aboveTargetSince;
+
+public:
+	QueueWaitTracker()
+		: count(0),
+		  next(0),
+		  aboveTargetSince(0)
+		{ }
+
+	/** Records that a request was taken off the queue after waiting `wait`. */
+	void recordWait(unsigned long long now, unsigned long long wait, unsigned long long target) {
+		samples[next] = wait;
+		next = (next + 1) % SAMPLES;
+		if (count < SAMPLES) {
+			count++;
+		}
+		if (target == 0 || wait < target) {
+			aboveTargetSince = 0;
+		} else if (aboveTargetSince == 0) {
+			aboveTargetSince = now;
+		}
+	}
+
+	/** Called when the queue has become empty, which ends any standing queue. */
+	void queueEmptied() {
+		aboveTargetSince = 0;
+	}
+
+	/**
+	 * Whether new requests should be rejected because the queue wait exceeds
+	 * `target`: either the requests that were taken off the queue have waited
+	 * longer than that for at least INTERVAL_USEC, or the oldest queued
+	 * request has already waited longer than `target + INTERVAL_USEC`.
+	 */
+	bool overloaded(unsigned long long now, unsigned long long target,
+		unsigned long long oldestWait) const
+	{
+		return target > 0
+			&& ((aboveTargetSince != 0 && now - aboveTargetSince >= INTERVAL_USEC)
+			    || oldestWait >= target + INTERVAL_USEC);
+	}
+
+	unsigned int getSampleCount() const {
+		return count;
+	}
+
+	/** Returns the given percentile (0-100) of the recent wait times. */
+	unsigned long long getPercentile(unsigned int percentile) const {
+		if (count == 0) {
+			return 0;
+		}
+		vector<unsigned long long> sorted(samples, samples + count);
+		unsigned int index = std::min(count - 1, count * percentile / 100);
+		std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+		return sorted[index];
+	}
+};
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_QUEUE_WAIT_TRACKER_H_ */
@@ -0,0 +1,324 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2011-2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_REMOTE_SPAWNER_H_
+#define _PASSENGER_APPLICATION_POOL2_REMOTE_SPAWNER_H_
+
+#include <ApplicationPool2/Spawner.h>
+#include <Utils/VariantMap.h>
+#include <Utils/MessageIO.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+
+/**
+ * Spawns processes on other hosts, through the RemoteAgents listed in
+ * Options::remoteAgents, once the group has Options::maxLocalProcesses
+ * processes that were spawned locally by `localSpawner`. New remote
+ * processes are spread over the RemoteAgents in a round-robin manner.
+ *
+ * The RemoteAgent spawns the process like DirectSpawner does, and makes
+ * each of its sockets available on a TCP port, so that Pool can route
+ * requests to it like to any other process. The connection over which the
+ * process was spawned is kept open as its control connection, and serves
+ * as the Process's admin socket: the process is shut down or killed by
+ * sending commands over it, and the RemoteAgent closes it when the process
+ * has exited. If the control connection is closed on our side, e.g. because
+ * the HelperAgent exited, then the RemoteAgent shuts the process down.
+ *
+ * The protocol consists of MessageIO array messages. The spawn request is
+ * a "spawn" message with key-value pairs, see serializeOptions(). The
+ * response is either
+ *
+ *     "ok", PID, GUPID, CONNECT_PASSWORD, then for each socket:
+ *         NAME, ADDRESS, PROTOCOL, CONCURRENCY
+ *
+ * or "error", MESSAGE, ERROR_KIND, ERROR_PAGE, IS_HTML. After that, the
+ * control connection accepts "shutdown" and "kill", SIGNO messages.
+ */
+class RemoteSpawner: public Spawner {
+private:
+	SpawnerPtr localSpawner;
+	vector<string> agents;
+	unsigned int maxLocalProcesses;
+	boost::mutex syncher;
+	unsigned int nextAgent;
+	vector< boost::weak_ptr<Process> > localProcesses;
+
+	bool shouldSpawnLocally() {
+		if (localSpawner == NULL) {
+			return false;
+		}
+
+		boost::lock_guard<boost::mutex> l(syncher);
+		vector< boost::weak_ptr<Process> >::iterator it = localProcesses.begin();
+		while (it != localProcesses.end()) {
+			ProcessPtr process = it->lock();
+			if (process == NULL || process->isDead()) {
+				it = localProcesses.erase(it);
+			} else {
+				it++;
+			}
+		}
+		return localProcesses.size() < maxLocalProcesses;
+	}
+
+	ProcessPtr spawnOnAgent(const string &agent, const Options &options) {
+		TRACE_POINT();
+		unsigned long long spawnStartTime = SystemTime::getUsec();
+		unsigned long long timeout = options.startTimeout * 1000ull;
+		FileDescriptor fd(connectToServer(agent));
+		vector<string> args;
+
+		args.push_back("spawn");
+		args.push_back("password");
+		args.push_back(config->remoteAgentPassword);
+		serializeOptions(options, args);
+		writeArrayMessage(fd, args, &timeout);
+
+		UPDATE_TRACE_POINT();
+		if (!readArrayMessage(fd, args, &timeout)) {
+			throw IOException("The RemoteAgent closed the connection");
+		} else if (args.size() == 5 && args[0] == "error") {
+			throw SpawnException("Cannot spawn a process on " + agent + ": " + args[1],
+				args[3], args[4] == "true",
+				(SpawnException::ErrorKind) atoi(args[2]));
+		} else if (args.size() < 4 || (args.size() - 4) % 4 != 0 || args[0] != "ok") {
+			throw IOException("Invalid response from the RemoteAgent");
+		}
+
+		SocketListPtr sockets = boost::make_shared<SocketList>();
+		for (unsigned int i = 4; i < args.size(); i += 4) {
+			sockets->add(args[i], args[i + 1], args[i + 2], atoi(args[i + 3]));
+		}
+		ProcessPtr process = boost::make_shared<Process>(SafeLibevPtr(),
+			(pid_t) atoi(args[1]), args[2], args[3],
+			FileDescriptor(), FileDescriptor(), sockets,
+			creationTime, spawnStartTime, config);
+		process->adminSocket = fd;
+		process->remoteAgent = agent;
+		return process;
+	}
+
+public:
+	RemoteSpawner(const ResourceLocator &resourceLocator,
+		const SpawnerPtr &_localSpawner,
+		const Options &options,
+		const SpawnerConfigPtr &_config = SpawnerConfigPtr())
+		: Spawner(resourceLocator),
+		  localSpawner(_localSpawner),
+		  maxLocalProcesses(options.maxLocalProcesses),
+		  nextAgent(0)
+	{
+		split(options.remoteAgents, ' ', agents);
+		agents.erase(std::remove(agents.begin(), agents.end(), string()), agents.end());
+		if (_config == NULL) {
+			config = boost::make_shared<SpawnerConfig>();
+		} else {
+			config = _config;
+		}
+	}
+
+	virtual ProcessPtr spawn(const Options &options) {
+		TRACE_POINT();
+		if (shouldSpawnLocally() || agents.empty()) {
+			ProcessPtr process = localSpawner->spawn(options);
+			boost::lock_guard<boost::mutex> l(syncher);
+			localProcesses.push_back(process);
+			return process;
+		}
+
+		unsigned int first;
+		{
+			boost::lock_guard<boost::mutex> l(syncher);
+			first = nextAgent;
+			nextAgent = (nextAgent + 1) % agents.size();
+		}
+
+		// Try the other RemoteAgents if one is unreachable, but don't
+		// hide errors that the application itself caused.
+		string errors;
+		for (unsigned int i = 0; i < agents.size(); i++) {
+			const string &agent = agents[(first + i) % agents.size()];
+			try {
+				P_DEBUG("Spawning new process on " << agent << ": appRoot=" << options.appRoot);
+				return spawnOnAgent(agent, options);
+			} catch (const SystemException &e) {
+				P_WARN("Cannot spawn a process on " << agent << ": " << e.what());
+				errors.append("\n" + agent + ": " + e.what());
+			} catch (const IOException &e) {
+				P_WARN("Cannot spawn a process on " << agent << ": " << e.what());
+				errors.append("\n" + agent + ": " + e.what());
+			} catch (const TimeoutException &e) {
+				P_WARN("Cannot spawn a process on " << agent << ": " << e.what());
+				errors.append("\n" + agent + ": " + e.what());
+			}
+		}
+		throw SpawnException("None of the RemoteAgents could spawn a process:" + errors);
+	}
+
+	/** RemoteAgents prepare their own spawners. */
+	virtual void prepare() {
+		if (localSpawner != NULL) {
+			localSpawner->prepare();
+		}
+	}
+
+	virtual bool cleanable() const {
+		return localSpawner != NULL && localSpawner->cleanable();
+	}
+
+	virtual void cleanup() {
+		if (localSpawner != NULL) {
+			localSpawner->cleanup();
+		}
+	}
+
+	virtual unsigned long long lastUsed() const {
+		if (localSpawner != NULL) {
+			return localSpawner->lastUsed();
+		} else {
+			return 0;
+		}
+	}
+
+	/**
+	 * Appends the options that a RemoteAgent needs to spawn a process to
+	 * `args`, as key-value pairs. Things that only make sense on this host,
+	 * such as the logging agent address, are left out.
+	 */
+	static void serializeOptions(const Options &options, vector<string> &args) {
+		string envvars;
+		vector< pair<StaticString, StaticString> >::const_iterator it, end;
+
+		end = options.environmentVariables.end();
+		for (it = options.environmentVariables.begin(); it != end; it++) {
+			envvars.append(it->first.data(), it->first.size());
+			envvars.append(1, '\0');
+			envvars.append(it->second.data(), it->second.size());
+			envvars.append(1, '\0');
+		}
+
+		#define PUSH(key, value) \
+			do { \
+				args.push_back(key); \
+				args.push_back(value); \
+			} while (false)
+		PUSH("app_root", options.appRoot);
+		PUSH("app_group_name", options.getAppGroupName());
+		PUSH("app_type", options.appType);
+		PUSH("start_command", options.startCommand);
+		PUSH("startup_file", options.startupFile);
+		PUSH("process_title", options.processTitle);
+		PUSH("log_level", toString(options.logLevel));
+		PUSH("start_timeout", toString(options.startTimeout));
+		PUSH("environment", options.environment);
+		PUSH("base_uri", options.baseURI);
+		PUSH("user", options.user);
+		PUSH("group", options.group);
+		PUSH("default_user", options.defaultUser);
+		PUSH("default_group", options.defaultGroup);
+		PUSH("preexec_chroot", options.preexecChroot);
+		PUSH("postexec_chroot", options.postexecChroot);
+		PUSH("ruby", options.ruby);
+		PUSH("python", options.python);
+		PUSH("nodejs", options.nodejs);
+		PUSH("environment_variables", Base64::encode(envvars));
+		PUSH("debugger", options.debugger ? "true" : "false");
+		PUSH("load_shell_envvars", options.loadShellEnvvars ? "true" : "false");
+		PUSH("raise_internal_error", options.raiseInternalError ? "true" : "false");
+		PUSH("cpu_affinity", options.cpuAffinity);
+		PUSH("group_secret", options.groupSecret);
+		#undef PUSH
+	}
+
+	/**
+	 * The inverse of serializeOptions(). The string fields of `options` point
+	 * into `args` and `storage`, so those must outlive it.
+	 */
+	static void parseOptions(const VariantMap &args, Options &options, string &storage) {
+		options.appRoot        = args.get("app_root");
+		options.appGroupName   = args.get("app_group_name", false);
+		options.appType        = args.get("app_type", false);
+		options.startCommand   = args.get("start_command", false);
+		options.startupFile    = args.get("startup_file", false);
+		options.processTitle   = args.get("process_title", false);
+		options.logLevel       = args.getInt("log_level", false, options.logLevel);
+		options.startTimeout   = args.getInt("start_timeout", false, options.startTimeout);
+		options.user           = args.get("user", false);
+		options.group          = args.get("group", false);
+		options.defaultGroup   = args.get("default_group", false);
+		options.preexecChroot  = args.get("preexec_chroot", false);
+		options.postexecChroot = args.get("postexec_chroot", false);
+		options.debugger       = args.getBool("debugger", false, false);
+		options.loadShellEnvvars = args.getBool("load_shell_envvars", false, true);
+		options.raiseInternalError = args.getBool("raise_internal_error", false, false);
+		options.cpuAffinity    = args.get("cpu_affinity", false);
+		options.groupSecret    = args.get("group_secret", false);
+		options.spawnMethod    = "direct";
+
+		// Only override the defaults of these if the HelperAgent sent a value,
+		// because the fallback values would not outlive this function.
+		#define GET_OPTIONAL(field, key) \
+			do { \
+				if (!args.get(key, false).empty()) { \
+					options.field = args.get(key); \
+				} \
+			} while (false)
+		GET_OPTIONAL(environment, "environment");
+		GET_OPTIONAL(baseURI, "base_uri");
+		GET_OPTIONAL(defaultUser, "default_user");
+		GET_OPTIONAL(ruby, "ruby");
+		GET_OPTIONAL(python, "python");
+		GET_OPTIONAL(nodejs, "nodejs");
+		#undef GET_OPTIONAL
+
+		storage = Base64::decode(args.get("environment_variables", false));
+		const char *pos = storage.c_str();
+		const char *end = storage.c_str() + storage.size();
+		while (pos < end) {
+			StaticString name(pos);
+			pos += name.size() + 1;
+			if (pos >= end) {
+				break;
+			}
+			StaticString value(pos);
+			pos += value.size() + 1;
+			options.environmentVariables.push_back(make_pair(name, value));
+		}
+	}
+};
+
+typedef boost::shared_ptr<RemoteSpawner> RemoteSpawnerPtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_REMOTE_SPAWNER_H_ */
@@ -60,6 +60,8 @@ private:
 	
 	Connection connection;
 	FileDescriptor theFd;
+	/** When this session was opened, in microseconds. 0 if unknown. */
+	unsigned long long startTime;
 	bool closed;
 	
 	void deinitiate(bool success) {
@@ -86,9 +88,10 @@ public:
 	Callback onInitiateFailure;
 	Callback onClose;
 	
-	Session(const ProcessPtr &_process, Socket *_socket)
+	Session(const ProcessPtr &_process, Socket *_socket, unsigned long long _startTime = 0)
 		: process(_process),
 		  socket(_socket),
+		  startTime(_startTime),
 		  closed(false),
 		  onInitiateFailure(NULL),
 		  onClose(NULL)
@@ -111,6 +114,7 @@ public:
 	int getStickySessionId() const;
 	const GroupPtr getGroup() const;
 	void requestOOBW();
+	void reportResourceUsage(unsigned long long cpuTime, unsigned long long allocations);
 	int kill(int signo);
 	
 	bool isClosed() const {
@@ -126,6 +130,16 @@ public:
 		return process;
 	}
 	
+	unsigned long long getStartTime() const {
+		return startTime;
+	}
+
+	/** Used when a session that was checked out ahead of time is handed
+	 * out, see Pool::SessionLeases. */
+	void setStartTime(unsigned long long time) {
+		startTime = time;
+	}
+
 	Socket *getSocket() const {
 		return socket;
 	}
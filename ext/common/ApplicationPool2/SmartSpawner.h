@@ -81,6 +81,9 @@ private:
 	// Preloader information.
 	pid_t pid;
 	FileDescriptor adminSocket;
+	/** Read end of the pipe that the preloader's and its children's STDERR
+	 * is connected to. */
+	FileDescriptor errorPipe;
 	string socketAddress;
 	unsigned long long m_lastUsed;
 	// Upon starting the preloader, its preparation info is stored here
@@ -100,9 +103,7 @@ private:
 		return result;
 	}
 	
-	vector<string> createRealPreloaderCommand(const Options &options,
-		shared_array<const char *> &args)
-	{
+	vector<string> createRealPreloaderCommand(const Options &options) {
 		string agentsDir = resourceLocator.getAgentsDir();
 		vector<string> command;
 		
@@ -126,7 +127,6 @@ private:
 			command.push_back(preloaderCommand[i]);
 		}
 		
-		createCommandArgs(command, args);
 		return command;
 	}
 	
@@ -210,97 +210,71 @@ private:
 		P_DEBUG("Spawning new preloader: appRoot=" << options.appRoot);
 		checkChrootDirectories(options);
 		
-		shared_array<const char *> args;
 		preparation = prepareSpawn(options);
-		vector<string> command = createRealPreloaderCommand(options, args);
+		vector<string> command = createRealPreloaderCommand(options);
 		SocketPair adminSocket = createUnixSocketPair();
 		Pipe errorPipe = createPipe();
 		DebugDirPtr debugDir = boost::make_shared<DebugDir>(preparation.uid, preparation.gid);
-		pid_t pid;
 		
-		pid = syscalls::fork();
-		if (pid == 0) {
-			setenv("PASSENGER_DEBUG_DIR", debugDir->getPath().c_str(), 1);
-			purgeStdio(stdout);
-			purgeStdio(stderr);
-			resetSignalHandlersAndMask();
-			disableMallocDebugging();
-			int adminSocketCopy = dup2(adminSocket.first, 3);
-			int errorPipeCopy = dup2(errorPipe.second, 4);
-			dup2(adminSocketCopy, 0);
-			dup2(adminSocketCopy, 1);
-			dup2(errorPipeCopy, 2);
-			closeAllFileDescriptors(2);
-			setChroot(preparation);
-			switchUser(preparation);
-			setWorkingDirectory(preparation);
-			execvp(command[0].c_str(), (char * const *) args.get());
-			
-			int e = errno;
-			printf("!> Error\n");
-			printf("!> \n");
-			printf("Cannot execute \"%s\": %s (errno=%d)\n", command[0].c_str(),
-				strerror(e), e);
-			fprintf(stderr, "Cannot execute \"%s\": %s (errno=%d)\n",
-				command[0].c_str(), strerror(e), e);
-			fflush(stdout);
-			fflush(stderr);
-			_exit(1);
-			
-		} else if (pid == -1) {
-			int e = errno;
-			throw SystemException("Cannot fork a new process", e);
-			
-		} else {
-			ScopeGuard guard(boost::bind(nonInterruptableKillAndWaitpid, pid));
-			P_DEBUG("Preloader process forked for appRoot=" << options.appRoot << ": PID " << pid);
-			adminSocket.first.close();
-			errorPipe.second.close();
-			
-			StartupDetails details;
-			details.pid = pid;
-			details.adminSocket = adminSocket.second;
-			details.io = BufferedIO(adminSocket.second);
-			details.stderrCapturer =
-				make_shared<BackgroundIOCapturer>(
-					errorPipe.first,
-					pid,
-					// The cast works around a compilation problem in Clang.
-					(const char *) "stderr");
-			details.stderrCapturer->start();
-			details.debugDir = debugDir;
-			details.options = &options;
-			details.timeout = options.startTimeout * 1000;
-			
-			{
-				this_thread::restore_interruption ri(di);
-				this_thread::restore_syscall_interruption rsi(dsi);
-				socketAddress = negotiatePreloaderStartup(details);
-			}
-			this->adminSocket = adminSocket.second;
-			{
-				boost::lock_guard<boost::mutex> l(simpleFieldSyncher);
-				this->pid = pid;
-			}
-			
-			PipeWatcherPtr watcher;
+		ExecPlan plan;
+		createExecCommand(plan, command);
+		plan.setenv("PASSENGER_DEBUG_DIR", debugDir->getPath());
+		plan.disableMallocDebugging();
+		plan.stdinFd = adminSocket.first;
+		plan.stdoutFd = adminSocket.first;
+		plan.stderrFd = errorPipe.second;
+		applyPreparation(plan, preparation);
+		pid_t pid = forkAndExec(plan);
+		
+		ScopeGuard guard(boost::bind(nonInterruptableKillAndWaitpid, pid));
+		P_DEBUG("Preloader process forked for appRoot=" << options.appRoot << ": PID " << pid);
+		adminSocket.first.close();
+		errorPipe.second.close();
+		
+		StartupDetails details;
+		details.pid = pid;
+		details.adminSocket = adminSocket.second;
+		details.io = BufferedIO(adminSocket.second);
+		details.stderrCapturer =
+			make_shared<BackgroundIOCapturer>(
+				errorPipe.first,
+				pid,
+				// The cast works around a compilation problem in Clang.
+				(const char *) "stderr");
+		details.stderrCapturer->start();
+		details.debugDir = debugDir;
+		details.options = &options;
+		details.timeout = options.startTimeout * 1000;
+		
+		{
+			this_thread::restore_interruption ri(di);
+			this_thread::restore_syscall_interruption rsi(dsi);
+			socketAddress = negotiatePreloaderStartup(details);
+		}
+		this->adminSocket = adminSocket.second;
+		this->errorPipe = errorPipe.first;
+		{
+			boost::lock_guard<boost::mutex> l(simpleFieldSyncher);
+			this->pid = pid;
+		}
+		
+		PipeWatcherPtr watcher;
 
-			watcher = boost::make_shared<PipeWatcher>(adminSocket.second,
-				"stdout", pid);
-			watcher->initialize();
-			watcher->start();
+		watcher = boost::make_shared<PipeWatcher>(adminSocket.second,
+			"stdout", pid);
+		watcher->initialize();
+		watcher->start();
 
-			watcher = boost::make_shared<PipeWatcher>(errorPipe.first,
-				"stderr", pid);
-			watcher->initialize();
-			watcher->start();
-			
-			preloaderAnnotations = debugDir->readAll();
-			P_INFO("Preloader for " << options.appRoot <<
-				" started on PID " << pid <<
-				", listening on " << socketAddress);
-			guard.clear();
-		}
+		watcher = boost::make_shared<PipeWatcher>(errorPipe.first,
+			"stderr", pid);
+		watcher->initialize();
+		watcher->start();
+		
+		preloaderAnnotations = debugDir->readAll();
+		P_INFO("Preloader for " << options.appRoot <<
+			" started on PID " << pid <<
+			", listening on " << socketAddress);
+		guard.clear();
 	}
 	
 	void stopPreloader() {
@@ -328,6 +302,7 @@ private:
 			pid = -1;
 		}
 		socketAddress.clear();
+		errorPipe = FileDescriptor();
 		preparation = SpawnPreparationInfo();
 	}
 	
@@ -351,7 +326,7 @@ private:
 			}
 
 			vector<StaticString> lines;
-			split(data, '\n', lines);
+			splitLines(data, lines);
 			foreach (const StaticString line, lines) {
 				P_DEBUG("[App " << details.pid << " stdin >>] " << line);
 			}
@@ -746,39 +721,82 @@ public:
 			boost::lock_guard<boost::mutex> l(simpleFieldSyncher);
 			m_lastUsed = SystemTime::getUsec();
 		}
+		/* Only talking to the preloader needs to be serialized. The negotiation
+		 * with the forked process happens without the lock, so that multiple
+		 * processes can be spawned in parallel.
+		 */
 		UPDATE_TRACE_POINT();
-		boost::lock_guard<boost::mutex> l(syncher);
-		if (!preloaderStarted()) {
+		SpawnResult result;
+		SpawnPreparationInfo preparationCopy;
+		FileDescriptor errorPipeCopy;
+		unsigned long long forkStartTime;
+		{
+			boost::lock_guard<boost::mutex> l(syncher);
+			if (!preloaderStarted()) {
+				UPDATE_TRACE_POINT();
+				startPreloader();
+			}
+			
 			UPDATE_TRACE_POINT();
-			startPreloader();
+			forkStartTime = SystemTime::getUsec();
+			try {
+				result = sendSpawnCommand(options);
+			} catch (const SystemException &e) {
+				result = sendSpawnCommandAgain(e, options);
+			} catch (const IOException &e) {
+				result = sendSpawnCommandAgain(e, options);
+			} catch (const SpawnException &e) {
+				result = sendSpawnCommandAgain(e, options);
+			}
+			preparationCopy = preparation;
+			errorPipeCopy = errorPipe;
 		}
 		
 		UPDATE_TRACE_POINT();
-		SpawnResult result;
-		try {
-			result = sendSpawnCommand(options);
-		} catch (const SystemException &e) {
-			result = sendSpawnCommandAgain(e, options);
-		} catch (const IOException &e) {
-			result = sendSpawnCommandAgain(e, options);
-		} catch (const SpawnException &e) {
-			result = sendSpawnCommandAgain(e, options);
+		/* The process has been forked by the preloader, so it can only be
+		 * pinned and moved to its cgroup from here. Threads that it has already started are not
+		 * affected, but the preloader normally doesn't start any.
+		 */
+		vector<unsigned int> cpus = config->cpuAffinityAllocator->allocate(
+			options.cpuAffinity, options.getAppGroupName());
+		if (!applyCpuAffinity(result.pid, cpus)) {
+			P_WARN("Cannot set the CPU affinity of process " << result.pid <<
+				" to " << cpuListToString(cpus));
+			cpus.clear();
 		}
-		
-		UPDATE_TRACE_POINT();
+		string cgroupProcsPath = config->cgroupManager->prepare(options);
+		if (!cgroupProcsPath.empty()
+		 && !CgroupManager::addProcess(cgroupProcsPath, result.pid))
+		{
+			P_WARN("Cannot move process " << result.pid << " to cgroup " <<
+				extractDirName(cgroupProcsPath));
+		}
+
 		NegotiationDetails details;
-		details.preparation = &preparation;
+		details.preparation = &preparationCopy;
 		details.libev = libev;
 		details.pid = result.pid;
 		details.adminSocket = result.adminSocket;
 		details.io = result.io;
 		details.options = &options;
+		details.forkStartTime = forkStartTime;
 		ProcessPtr process = negotiateSpawn(details);
+		process->cpuAffinity = cpuListToString(cpus);
+		// The process shares the preloader's STDERR.
+		process->errorPipe = errorPipeCopy;
 		P_DEBUG("Process spawning done: appRoot=" << options.appRoot <<
 			", pid=" << process->pid);
 		return process;
 	}
 
+	virtual void prepare() {
+		TRACE_POINT();
+		boost::lock_guard<boost::mutex> l(syncher);
+		if (!preloaderStarted()) {
+			startPreloader();
+		}
+	}
+
 	virtual bool cleanable() const {
 		return true;
 	}
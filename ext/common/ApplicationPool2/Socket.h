@@ -93,25 +93,40 @@ public:
 	string address;
 	string protocol;
 	int concurrency;
+	/** Whether the application supports keeping session connections alive
+	 * after a response. If so, connections are pooled and reused (up to
+	 * the concurrency limit) instead of being closed after every session.
+	 * See RequestHandler for the keep-alive session protocol.
+	 */
+	bool keepAlive;
 	
 	/** The handle inside the associated Process's 'sessionSockets' priority queue.
 	 * Guaranteed to be valid as long as the Process is alive.
 	 */
 	PriorityQueue<Socket>::Handle pqHandle;
+	/** This socket's position in the 'sessionSockets' priority queue. Maintained by the queue. */
+	unsigned int pqIndex;
 	
 	/** Invariant: sessions >= 0 */
 	int sessions;
 	
 	Socket()
-		: concurrency(0)
+		: concurrency(0),
+		  keepAlive(false),
+		  pqHandle(NULL),
+		  pqIndex(0)
 		{ }
 	
-	Socket(const string &_name, const string &_address, const string &_protocol, int _concurrency)
+	Socket(const string &_name, const string &_address, const string &_protocol, int _concurrency,
+		bool _keepAlive = false)
 		: totalConnections(0),
 		  name(_name),
 		  address(_address),
 		  protocol(_protocol),
 		  concurrency(_concurrency),
+		  keepAlive(_keepAlive),
+		  pqHandle(NULL),
+		  pqIndex(0),
 		  sessions(0)
 		{ }
 	
@@ -122,7 +137,9 @@ public:
 		  address(other.address),
 		  protocol(other.protocol),
 		  concurrency(other.concurrency),
+		  keepAlive(other.keepAlive),
 		  pqHandle(other.pqHandle),
+		  pqIndex(other.pqIndex),
 		  sessions(other.sessions)
 		{ }
 	
@@ -133,7 +150,9 @@ public:
 		address = other.address;
 		protocol = other.protocol;
 		concurrency = other.concurrency;
+		keepAlive = other.keepAlive;
 		pqHandle = other.pqHandle;
+		pqIndex = other.pqIndex;
 		sessions = other.sessions;
 		return *this;
 	}
@@ -151,7 +170,7 @@ public:
 			Connection connection = idleConnections.back();
 			idleConnections.pop_back();
 			return connection;
-		} else if (totalConnections < connectionPoolLimit()) {
+		} else if (keepAlive && totalConnections < connectionPoolLimit()) {
 			Connection connection = connect();
 			connection.persistent = true;
 			totalConnections++;
@@ -177,6 +196,29 @@ public:
 			connection.close();
 		}
 	}
+
+	/**
+	 * Closes all idle pooled connections. Applications that support
+	 * keep-alive wait for the next request on these connections, so
+	 * this must be called before asking them to shut down.
+	 */
+	void closeIdleConnections() {
+		vector<Connection> connections;
+		{
+			boost::lock_guard<boost::mutex> l(connectionPoolLock);
+			connections.swap(idleConnections);
+			totalConnections -= connections.size();
+		}
+		vector<Connection>::iterator it, end = connections.end();
+		for (it = connections.begin(); it != end; it++) {
+			it->close();
+		}
+	}
+
+	unsigned int idleConnectionCount() {
+		boost::lock_guard<boost::mutex> l(connectionPoolLock);
+		return idleConnections.size();
+	}
 	
 	
 	bool isIdle() const {
@@ -200,6 +242,9 @@ public:
 			} else {
 				return 1;
 			}
+		} else if (sessions >= concurrency) {
+			// See Process::setConcurrency().
+			return INT_MAX;
 		} else {
 			return (int) (((long long) sessions * INT_MAX) / (double) concurrency);
 		}
@@ -212,8 +257,10 @@ public:
 
 class SocketList: public vector<Socket> {
 public:
-	void add(const string &name, const string &address, const string &protocol, int concurrency) {
-		push_back(Socket(name, address, protocol, concurrency));
+	void add(const string &name, const string &address, const string &protocol, int concurrency,
+		bool keepAlive = false)
+	{
+		push_back(Socket(name, address, protocol, concurrency, keepAlive));
 	}
 
 	const Socket *findSocketWithName(const StaticString &name) const {
@@ -0,0 +1,209 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_SPAWN_SCHEDULER_H_
+#define _PASSENGER_APPLICATION_POOL2_SPAWN_SCHEDULER_H_
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+#include <list>
+#include <Utils/SystemTime.h>
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+
+
+/**
+ * Limits how many processes are spawned at the same time in the entire pool.
+ * After a restart every Group starts spawning at once, and all of those app
+ * boots slow each other down: the pool reaches full capacity sooner if they
+ * take turns. A spawner thread therefore holds a Ticket while it spawns and
+ * warms up a process. Creating one blocks until a spawn slot is available.
+ *
+ * Slots are handed out in FIFO order, except that spawns for Groups with
+ * queued requests go before spawns that only prestart processes. A Group
+ * tells us whether it has queued requests through a flag that it keeps up
+ * to date itself, so that we never need the pool lock.
+ *
+ * This class is fully thread-safe. Its lock may be grabbed while holding
+ * the pool lock, but not the other way around.
+ */
+class SpawnScheduler: public boost::noncopyable {
+public:
+	struct QueuedSpawn {
+		string groupName;
+		bool urgent;
+		unsigned long long enqueueTime;
+	};
+
+private:
+	struct Waiter {
+		const string *groupName;
+		const boost::atomic<bool> *urgent;
+		unsigned long long enqueueTime;
+		bool granted;
+	};
+
+	mutable boost::mutex syncher;
+	boost::condition_variable cond;
+	/** 0 means unlimited. */
+	unsigned int limit;
+	unsigned int active;
+	list<Waiter *> waiters;
+
+	bool slotAvailable() const {
+		return limit == 0 || active < limit;
+	}
+
+	void grantSlots() {
+		bool granted = false;
+		while (!waiters.empty() && slotAvailable()) {
+			list<Waiter *>::iterator it, end = waiters.end();
+			list<Waiter *>::iterator chosen = waiters.begin();
+			for (it = waiters.begin(); it != end; it++) {
+				if ((*it)->urgent->load(boost::memory_order_relaxed)) {
+					chosen = it;
+					break;
+				}
+			}
+			(*chosen)->granted = true;
+			waiters.erase(chosen);
+			active++;
+			granted = true;
+		}
+		if (granted) {
+			cond.notify_all();
+		}
+	}
+
+	void acquire(Waiter *waiter) {
+		boost::unique_lock<boost::mutex> l(syncher);
+		if (waiters.empty() && slotAvailable()) {
+			waiter->granted = true;
+			active++;
+			return;
+		}
+
+		waiters.push_back(waiter);
+		try {
+			while (!waiter->granted) {
+				cond.wait(l);
+			}
+		} catch (const boost::thread_interrupted &) {
+			if (waiter->granted) {
+				active--;
+				grantSlots();
+			} else {
+				waiters.remove(waiter);
+			}
+			throw;
+		}
+	}
+
+	void release() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		active--;
+		grantSlots();
+	}
+
+public:
+	/**
+	 * Holds a spawn slot for as long as it exists. The constructor blocks
+	 * until a slot is available; it is an interruption point. `groupName`
+	 * and `urgent` must stay valid until the Ticket is destroyed.
+	 */
+	class Ticket: public boost::noncopyable {
+	private:
+		SpawnScheduler &scheduler;
+		Waiter waiter;
+
+	public:
+		Ticket(SpawnScheduler &_scheduler, const string &groupName,
+			const boost::atomic<bool> &urgent)
+			: scheduler(_scheduler)
+		{
+			waiter.groupName = &groupName;
+			waiter.urgent = &urgent;
+			waiter.enqueueTime = SystemTime::getMonotonicUsec();
+			waiter.granted = false;
+			scheduler.acquire(&waiter);
+		}
+
+		~Ticket() {
+			scheduler.release();
+		}
+	};
+
+	SpawnScheduler()
+		: limit(0),
+		  active(0)
+		{ }
+
+	/** Sets the maximum number of concurrent spawns. 0 means unlimited. */
+	void setLimit(unsigned int value) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		limit = value;
+		grantSlots();
+	}
+
+	unsigned int getLimit() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return limit;
+	}
+
+	/** The number of spawns that are holding a slot right now. */
+	unsigned int getActive() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return active;
+	}
+
+	/** The spawns that are waiting for a slot, in the order in which
+	 * they asked for one. */
+	vector<QueuedSpawn> getQueue() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		vector<QueuedSpawn> result;
+		list<Waiter *>::const_iterator it, end = waiters.end();
+
+		result.reserve(waiters.size());
+		for (it = waiters.begin(); it != end; it++) {
+			QueuedSpawn spawn;
+			spawn.groupName = *(*it)->groupName;
+			spawn.urgent = (*it)->urgent->load(boost::memory_order_relaxed);
+			spawn.enqueueTime = (*it)->enqueueTime;
+			result.push_back(spawn);
+		}
+		return result;
+	}
+};
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_SPAWN_SCHEDULER_H_ */
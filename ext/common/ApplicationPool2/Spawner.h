@@ -56,6 +56,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <utility>
 #include <boost/make_shared.hpp>
 #include <boost/shared_array.hpp>
@@ -75,6 +76,7 @@
 #include <dirent.h>
 #include <ApplicationPool2/Process.h>
 #include <ApplicationPool2/Options.h>
+#include <ApplicationPool2/ForkExec.h>
 #include <ApplicationPool2/PipeWatcher.h>
 #include <FileDescriptor.h>
 #include <SafeLibev.h>
@@ -126,6 +128,7 @@ protected:
 		
 		void capture() {
 			TRACE_POINT();
+			vector<StaticString> lines;
 			while (!this_thread::interruption_requested()) {
 				char buf[1024 * 8];
 				ssize_t ret;
@@ -148,17 +151,9 @@ protected:
 						data.append(buf, ret);
 					}
 					UPDATE_TRACE_POINT();
-					if (ret == 1 && buf[0] == '\n') {
-						printAppOutput(pid, channelName, "", 0);
-					} else {
-						vector<StaticString> lines;
-						if (ret > 0 && buf[ret - 1] == '\n') {
-							ret--;
-						}
-						split(StaticString(buf, ret), '\n', lines);
-						foreach (const StaticString line, lines) {
-							printAppOutput(pid, channelName, line.data(), line.size());
-						}
+					splitLines(StaticString(buf, ret), lines);
+					foreach (const StaticString line, lines) {
+						printAppOutput(pid, channelName, line.data(), line.size());
 					}
 				}
 			}
@@ -345,6 +340,9 @@ protected:
 		FileDescriptor errorPipe;
 		const Options *options;
 		DebugDirPtr debugDir;
+		/** Time at which the spawner started forking the process. If 0,
+		 * the start of the negotiation is used instead. */
+		unsigned long long forkStartTime;
 		
 		/****** Working state ******/
 		BufferedIO io;
@@ -352,12 +350,18 @@ protected:
 		string connectPassword;
 		unsigned long long spawnStartTime;
 		unsigned long long timeout;
+		SpawnTimings timings;
+		unsigned long long requestSentTime;
+		unsigned long long readyTime;
 		
 		NegotiationDetails() {
 			preparation = NULL;
 			pid = 0;
 			options = NULL;
+			forkStartTime = 0;
 			spawnStartTime = 0;
+			requestSentTime = 0;
+			readyTime = 0;
 			timeout = 0;
 		}
 	};
@@ -402,12 +406,14 @@ private:
 			}
 
 			vector<StaticString> lines;
-			split(data, '\n', lines);
+			splitLines(data, lines);
 			foreach (const StaticString line, lines) {
 				P_DEBUG("[App " << details.pid << " stdin >>] " << line);
 			}
+			// Send the terminating empty line along with the rest, so that
+			// the whole request is transferred with a single write.
+			data.append(1, '\n');
 			writeExact(details.adminSocket, data, &details.timeout);
-			writeExact(details.adminSocket, "\n", &details.timeout);
 		} catch (const SystemException &e) {
 			if (e.code() == EPIPE) {
 				/* Ignore this. Process might have written an
@@ -469,13 +475,15 @@ private:
 			string key = line.substr(0, pos);
 			string value = line.substr(pos + 2, line.size() - pos - 3);
 			if (key == "socket") {
-				// socket: <name>;<address>;<protocol>;<concurrency>
+				// socket: <name>;<address>;<protocol>;<concurrency>[;<flags>]
+				// <flags> is a comma-separated list. Supported flags:
+				// - keepalive: the socket supports keep-alive sessions.
 				// TODO: in case of TCP sockets, check whether it points to localhost
 				// TODO: in case of unix sockets, check whether filename is absolute
 				// and whether owner is correct
 				vector<string> args;
 				split(value, ';', args);
-				if (args.size() == 4) {
+				if (args.size() == 4 || args.size() == 5) {
 					string error = validateSocketAddress(details, args[1]);
 					if (!error.empty()) {
 						throwAppSpawnException(
@@ -483,10 +491,17 @@ private:
 							SpawnException::APP_STARTUP_PROTOCOL_ERROR,
 							details);
 					}
+					bool keepAlive = false;
+					if (args.size() == 5) {
+						vector<string> flags;
+						split(args[4], ',', flags);
+						keepAlive = find(flags.begin(), flags.end(), "keepalive") != flags.end();
+					}
 					sockets->add(args[0],
 						fixupSocketAddress(*details.options, args[1]),
 						args[2],
-						atoi(args[3]));
+						atoi(args[3]),
+						keepAlive);
 				} else {
 					throwAppSpawnException("An error occurred while starting the "
 						"web application. It reported a wrongly formatted 'socket'"
@@ -526,11 +541,19 @@ private:
 				details);
 		}
 		
-		return boost::make_shared<Process>(details.libev, details.pid,
+		ProcessPtr process = boost::make_shared<Process>(details.libev, details.pid,
 			details.gupid, details.connectPassword,
 			details.adminSocket, details.errorPipe,
 			sockets, creationTime, details.spawnStartTime,
 			config);
+		details.timings.socketReadyUsec = process->spawnEndTime - details.readyTime;
+		process->spawnTimings = details.timings;
+		P_DEBUG("Spawn timings for PID " << process->pid << ": " <<
+			"fork=" << details.timings.forkUsec << "us, " <<
+			"preparation=" << details.timings.preparationUsec << "us, " <<
+			"app load=" << details.timings.appLoadUsec << "us, " <<
+			"socket ready=" << details.timings.socketReadyUsec << "us");
+		return process;
 	}
 	
 protected:
@@ -550,17 +573,22 @@ protected:
 	 */
 	static int timedWaitpid(pid_t pid, int *status, unsigned long long timeout) {
 		Timer timer;
+		unsigned long long elapsed;
 		int ret;
 		
-		do {
+		while (true) {
 			ret = syscalls::waitpid(pid, status, WNOHANG);
 			if (ret > 0 || ret == -1) {
 				return ret;
-			} else {
+			}
+			elapsed = timer.elapsed();
+			if (elapsed >= timeout) {
+				return 0; // timed out
+			} else if (waitForProcessExit(pid, (int) (timeout - elapsed)) == -1) {
+				// Can't wait for the exit event on this platform, so poll.
 				syscalls::usleep(10000);
 			}
-		} while (timer.elapsed() < timeout);
-		return 0; // timed out
+		}
 	}
 	
 	static string fixupSocketAddress(const Options &options, const string &address) {
@@ -662,14 +690,13 @@ protected:
 		}
 	}
 	
-	static void createCommandArgs(const vector<string> &command,
-		shared_array<const char *> &args)
-	{
-		args.reset(new const char *[command.size()]);
-		for (unsigned int i = 1; i < command.size(); i++) {
-			args[i - 1] = command[i].c_str();
-		}
-		args[command.size() - 1] = NULL;
+	/**
+	 * Sets the program and arguments of `plan` from a command, which
+	 * consists of the program followed by the argument vector.
+	 */
+	static void createExecCommand(ExecPlan &plan, const vector<string> &command) {
+		plan.program = command[0];
+		plan.args.assign(command.begin() + 1, command.end());
 	}
 
 	void possiblyRaiseInternalError(const Options &options) {
@@ -771,19 +798,21 @@ protected:
 	string readMessageLine(Details &details) {
 		TRACE_POINT();
 		while (true) {
-			string result = details.io.readLine(1024 * 4, &details.timeout);
-			string line = result;
+			// Lines are read without copying them, so that an app that writes
+			// a lot of output during startup doesn't cause an allocation per line.
+			StaticString result;
+			details.io.readLine(result, 1024 * 4, &details.timeout);
+			StaticString line = result;
 			if (!line.empty() && line[line.size() - 1] == '\n') {
-				line.erase(line.size() - 1, 1);
+				line = line.substr(0, line.size() - 1);
 			}
 			
 			if (result.empty()) {
 				// EOF
-				return result;
+				return string();
 			} else if (startsWith(result, "!> ")) {
 				P_DEBUG("[App " << details.pid << " stdout] " << line);
-				result.erase(0, sizeof("!> ") - 1);
-				return result;
+				return result.substr(sizeof("!> ") - 1);
 			} else {
 				if (details.stderrCapturer != NULL) {
 					details.stderrCapturer->appendToBuffer(result);
@@ -827,19 +856,21 @@ protected:
 
 	void prepareUserSwitching(SpawnPreparationInfo &info, const Options &options) const {
 		TRACE_POINT();
+		UserDatabaseCache &userDatabase = *config->userDatabaseCache;
+
 		if (geteuid() != 0) {
-			struct passwd *userInfo = getpwuid(geteuid());
-			if (userInfo == NULL) {
+			UserDatabaseCache::User userInfo = userDatabase.lookupUser(geteuid());
+			if (!userInfo.found) {
 				throw RuntimeException("Cannot get user database entry for user " +
 					getProcessUsername() + "; it looks like your system's " +
 					"user database is broken, please fix it.");
 			}
 			
 			info.switchUser = false;
-			info.username = userInfo->pw_name;
-			info.groupname = getGroupName(userInfo->pw_gid);
-			info.home = userInfo->pw_dir;
-			info.shell = userInfo->pw_shell;
+			info.username = userInfo.name;
+			info.groupname = userDatabase.getGroupName(userInfo.gid);
+			info.home = userInfo.home;
+			info.shell = userInfo.shell;
 			info.uid = geteuid();
 			info.gid = getegid();
 			info.ngroups = 0;
@@ -849,29 +880,29 @@ protected:
 		UPDATE_TRACE_POINT();
 		string defaultGroup;
 		string startupFile = absolutizePath(options.getStartupFile(), info.appRoot);
-		struct passwd *userInfo = NULL;
+		UserDatabaseCache::User userInfo;
 		gid_t  groupId = (gid_t) -1;
 		
 		if (options.defaultGroup.empty()) {
-			struct passwd *info = getpwnam(options.defaultUser.c_str());
-			if (info == NULL) {
+			UserDatabaseCache::User info = userDatabase.lookupUser(options.defaultUser);
+			if (!info.found) {
 				throw RuntimeException("Cannot get user database entry for username '" +
 					options.defaultUser + "'");
 			}
-			struct group *group = getgrgid(info->pw_gid);
-			if (group == NULL) {
+			UserDatabaseCache::Group group = userDatabase.lookupGroup(info.gid);
+			if (!group.found) {
 				throw RuntimeException(string("Cannot get group database entry for ") +
 					"the default group belonging to username '" +
 					options.defaultUser + "'");
 			}
-			defaultGroup = group->gr_name;
+			defaultGroup = group.name;
 		} else {
 			defaultGroup = options.defaultGroup;
 		}
 		
 		UPDATE_TRACE_POINT();
 		if (!options.user.empty()) {
-			userInfo = getpwnam(options.user.c_str());
+			userInfo = userDatabase.lookupUser(options.user);
 		} else {
 			struct stat buf;
 			if (syscalls::lstat(startupFile.c_str(), &buf) == -1) {
@@ -879,10 +910,10 @@ protected:
 				throw SystemException("Cannot lstat(\"" + startupFile +
 					"\")", e);
 			}
-			userInfo = getpwuid(buf.st_uid);
+			userInfo = userDatabase.lookupUser(buf.st_uid);
 		}
-		if (userInfo == NULL || userInfo->pw_uid == 0) {
-			userInfo = getpwnam(options.defaultUser.c_str());
+		if (!userInfo.found || userInfo.uid == 0) {
+			userInfo = userDatabase.lookupUser(options.defaultUser);
 		}
 		
 		UPDATE_TRACE_POINT();
@@ -894,28 +925,35 @@ protected:
 					throw SystemException("Cannot lstat(\"" +
 						startupFile + "\")", e);
 				}
-				if (getgrgid(buf.st_gid) != NULL) {
+				if (userDatabase.lookupGroup(buf.st_gid).found) {
 					groupId = buf.st_gid;
 				} else {
 					groupId = (gid_t) -1;
 				}
 			} else {
-				struct group *groupInfo = getgrnam(options.group.c_str());
-				if (groupInfo != NULL) {
-					groupId = groupInfo->gr_gid;
+				UserDatabaseCache::Group groupInfo = userDatabase.lookupGroup(options.group);
+				if (groupInfo.found) {
+					groupId = groupInfo.gid;
 				} else {
 					groupId = (gid_t) -1;
 				}
 			}
-		} else if (userInfo != NULL) {
-			groupId = userInfo->pw_gid;
+		} else if (userInfo.found) {
+			groupId = userInfo.gid;
 		}
 		if (groupId == 0 || groupId == (gid_t) -1) {
-			groupId = lookupGid(defaultGroup);
+			UserDatabaseCache::Group groupInfo = userDatabase.lookupGroup(defaultGroup);
+			if (groupInfo.found) {
+				groupId = groupInfo.gid;
+			} else if (looksLikePositiveNumber(defaultGroup)) {
+				groupId = atoi(defaultGroup);
+			} else {
+				groupId = (gid_t) -1;
+			}
 		}
 
 		UPDATE_TRACE_POINT();
-		if (userInfo == NULL) {
+		if (!userInfo.found) {
 			throw RuntimeException("Cannot determine a user to lower privilege to");
 		}
 		if (groupId == (gid_t) -1) {
@@ -923,34 +961,24 @@ protected:
 		}
 		
 		UPDATE_TRACE_POINT();
-		#ifdef __APPLE__
-			int groups[1024];
-			info.ngroups = sizeof(groups) / sizeof(int);
-		#else
-			gid_t groups[1024];
-			info.ngroups = sizeof(groups) / sizeof(gid_t);
-		#endif
 		info.switchUser = true;
-		info.username = userInfo->pw_name;
-		info.groupname = getGroupName(groupId);
-		info.home = userInfo->pw_dir;
-		info.shell = userInfo->pw_shell;
-		info.uid = userInfo->pw_uid;
+		info.username = userInfo.name;
+		info.groupname = userDatabase.getGroupName(groupId);
+		info.home = userInfo.home;
+		info.shell = userInfo.shell;
+		info.uid = userInfo.uid;
 		info.gid = groupId;
-		#if !defined(HAVE_GETGROUPLIST) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
-			#define HAVE_GETGROUPLIST
-		#endif
 		#ifdef HAVE_GETGROUPLIST
-			int ret = getgrouplist(userInfo->pw_name, groupId,
-				groups, &info.ngroups);
-			if (ret == -1) {
-				int e = errno;
-				throw SystemException("getgrouplist() failed", e);
-			}
+			// The child passes these to setgroups() directly, instead of
+			// querying the group database with initgroups().
+			vector<gid_t> groups = userDatabase.getGroupList(userInfo.name, groupId);
+			info.ngroups = groups.size();
 			info.gidset = shared_array<gid_t>(new gid_t[info.ngroups]);
 			for (int i = 0; i < info.ngroups; i++) {
 				info.gidset[i] = groups[i];
 			}
+		#else
+			info.ngroups = 0;
 		#endif
 	}
 
@@ -1023,139 +1051,37 @@ protected:
 		return Base64::encode(result);
 	}
 
-	void switchUser(const SpawnPreparationInfo &info) {
+	/**
+	 * Fills in the parts of `plan` that follow from the preparation info:
+	 * the chroot, user switching and the working directory.
+	 */
+	void applyPreparation(ExecPlan &plan, const SpawnPreparationInfo &info) const {
+		plan.chrootDir = info.chrootDir;
+		plan.username = info.username;
+		plan.groupname = info.groupname;
 		if (info.switchUser) {
-			bool setgroupsCalled = false;
+			plan.switchUser = true;
+			plan.uid = info.uid;
+			plan.gid = info.gid;
 			#ifdef HAVE_GETGROUPLIST
 				if (info.ngroups <= NGROUPS_MAX) {
-					setgroupsCalled = true;
-					if (setgroups(info.ngroups, info.gidset.get()) == -1) {
-						int e = errno;
-						printf("!> Error\n");
-						printf("!> \n");
-						printf("setgroups(%d, ...) failed: %s (errno=%d)\n",
-							info.ngroups, strerror(e), e);
-						fflush(stdout);
-						_exit(1);
-					}
+					plan.ngroups = info.ngroups;
+					plan.gidset = info.gidset;
 				}
 			#endif
-			if (!setgroupsCalled && initgroups(info.username.c_str(), info.gid) == -1) {
-				int e = errno;
-				printf("!> Error\n");
-				printf("!> \n");
-				printf("initgroups() failed: %s (errno=%d)\n",
-					strerror(e), e);
-				fflush(stdout);
-				_exit(1);
-			}
-			if (setgid(info.gid) == -1) {
-				int e = errno;
-				printf("!> Error\n");
-				printf("!> \n");
-				printf("setgid() failed: %s (errno=%d)\n",
-					strerror(e), e);
-				fflush(stdout);
-				_exit(1);
-			}
-			if (setuid(info.uid) == -1) {
-				int e = errno;
-				printf("!> Error\n");
-				printf("!> \n");
-				printf("setuid() failed: %s (errno=%d)\n",
-					strerror(e), e);
-				fflush(stdout);
-				_exit(1);
-			}
-			
+
 			// We set these environment variables here instead of
 			// in the SpawnPreparer because SpawnPreparer might
 			// be executed by bash, but these environment variables
 			// must be set before bash.
-			setenv("USER", info.username.c_str(), 1);
-			setenv("LOGNAME", info.username.c_str(), 1);
-			setenv("SHELL", info.shell.c_str(), 1);
-			setenv("HOME", info.home.c_str(), 1);
-		}
-	}
-	
-	void setChroot(const SpawnPreparationInfo &info) {
-		if (info.chrootDir != "/") {
-			int ret = chroot(info.chrootDir.c_str());
-			if (ret == -1) {
-				int e = errno;
-				fprintf(stderr, "Cannot chroot() to '%s': %s (errno=%d)\n",
-					info.chrootDir.c_str(),
-					strerror(e),
-					e);
-				fflush(stderr);
-				_exit(1);
-			}
-		}
-	}
-	
-	void setWorkingDirectory(const SpawnPreparationInfo &info) {
-		vector<string>::const_iterator it, end = info.appRootPathsInsideChroot.end();
-		int ret;
-
-		for (it = info.appRootPathsInsideChroot.begin(); it != end; it++) {
-			struct stat buf;
-			ret = stat(it->c_str(), &buf);
-			if (ret == -1 && errno == EACCES) {
-				char parent[PATH_MAX];
-				const char *end = strrchr(it->c_str(), '/');
-				memcpy(parent, it->c_str(), end - it->c_str());
-				parent[end - it->c_str()] = '\0';
-
-				printf("!> Error\n");
-				printf("!> \n");
-				printf("This web application process is being run as user '%s' and group '%s' "
-					"and must be able to access its application root directory '%s'. "
-					"However, the parent directory '%s' has wrong permissions, thereby "
-					"preventing this process from accessing its application root directory. "
-					"Please fix the permissions of the directory '%s' first.\n",
-					info.username.c_str(),
-					info.groupname.c_str(),
-					info.appRootPaths.back().c_str(),
-					parent,
-					parent);
-				fflush(stdout);
-				_exit(1);
-			} else if (ret == -1) {
-				int e = errno;
-				printf("!> Error\n");
-				printf("!> \n");
-				printf("Unable to stat() directory '%s': %s (errno=%d)\n",
-					it->c_str(), strerror(e), e);
-				fflush(stdout);
-				_exit(1);
-			}
-		}
-
-		ret = chdir(info.appRootPathsInsideChroot.back().c_str());
-		if (ret == 0) {
-			setenv("PWD", info.appRootPathsInsideChroot.back().c_str(), 1);
-		} else if (ret == -1 && errno == EACCES) {
-			printf("!> Error\n");
-			printf("!> \n");
-			printf("This web application process is being run as user '%s' and group '%s' "
-				"and must be able to access its application root directory '%s'. "
-				"However this directory is not accessible because it has wrong permissions. "
-				"Please fix these permissions first.\n",
-				info.username.c_str(),
-				info.groupname.c_str(),
-				info.appRootPaths.back().c_str());
-			fflush(stdout);
-			_exit(1);
-		} else {
-			int e = errno;
-			printf("!> Error\n");
-			printf("!> \n");
-			printf("Unable to change working directory to '%s': %s (errno=%d)\n",
-				info.appRootPathsInsideChroot.back().c_str(), strerror(e), e);
-			fflush(stdout);
-			_exit(1);
+			plan.setenv("USER", info.username);
+			plan.setenv("LOGNAME", info.username);
+			plan.setenv("SHELL", info.shell);
+			plan.setenv("HOME", info.home);
 		}
+		plan.workingDirectoryPaths = info.appRootPathsInsideChroot;
+		plan.workingDirectoryPathsOutsideChroot = info.appRootPaths;
+		plan.setenv("PWD", info.appRootPathsInsideChroot.back());
 	}
 	
 	/**
@@ -1164,6 +1090,9 @@ protected:
 	ProcessPtr negotiateSpawn(NegotiationDetails &details) {
 		TRACE_POINT();
 		details.spawnStartTime = SystemTime::getUsec();
+		if (details.forkStartTime != 0 && details.forkStartTime < details.spawnStartTime) {
+			details.timings.forkUsec = details.spawnStartTime - details.forkStartTime;
+		}
 		details.gupid = integerToHex(SystemTime::get() / 60) + "-" +
 			config->randomGenerator->generateAsciiString(11);
 		details.connectPassword = config->randomGenerator->generateAsciiString(43);
@@ -1188,7 +1117,11 @@ protected:
 		protocol_begin:
 		if (result == "I have control 1.0\n") {
 			UPDATE_TRACE_POINT();
+			if (details.requestSentTime == 0) {
+				details.timings.preparationUsec = SystemTime::getUsec() - details.spawnStartTime;
+			}
 			sendSpawnRequest(details);
+			details.requestSentTime = SystemTime::getUsec();
 			try {
 				result = readMessageLine(details);
 			} catch (const SystemException &e) {
@@ -1204,6 +1137,8 @@ protected:
 					details);
 			}
 			if (result == "Ready\n") {
+				details.readyTime = SystemTime::getUsec();
+				details.timings.appLoadUsec = details.readyTime - details.requestSentTime;
 				return handleSpawnResponse(details);
 			} else if (result == "Error\n") {
 				handleSpawnErrorResponse(details);
@@ -1312,6 +1247,14 @@ public:
 	
 	virtual ~Spawner() { }
 	virtual ProcessPtr spawn(const Options &options) = 0;
+
+	/**
+	 * Does the work that the first spawn() would otherwise have to do
+	 * before it can spawn anything, e.g. starting a preloader, so that
+	 * spawning can start right away. Errors are reported by throwing,
+	 * just like spawn() would.
+	 */
+	virtual void prepare() { }
 	
 	/** Does not depend on the event loop. */
 	virtual bool cleanable() const {
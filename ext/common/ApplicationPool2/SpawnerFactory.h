@@ -29,6 +29,7 @@
 #include <ApplicationPool2/SmartSpawner.h>
 #include <ApplicationPool2/DirectSpawner.h>
 #include <ApplicationPool2/DummySpawner.h>
+#include <ApplicationPool2/RemoteSpawner.h>
 
 namespace Passenger {
 namespace ApplicationPool2 {
@@ -57,6 +58,9 @@ private:
 		} else if (options.appType == "rack") {
 			preloaderCommand.push_back(options.ruby);
 			preloaderCommand.push_back(dir + "/rack-preloader.rb");
+		} else if (options.appType == "wsgi") {
+			preloaderCommand.push_back(options.python);
+			preloaderCommand.push_back(dir + "/wsgi-preloader.py");
 		} else {
 			return SpawnerPtr();
 		}
@@ -83,6 +87,15 @@ public:
 	virtual ~SpawnerFactory() { }
 	
 	virtual SpawnerPtr create(const Options &options) {
+		SpawnerPtr spawner = createLocalSpawner(options);
+		if (!options.remoteAgents.empty() && options.spawnMethod != "dummy") {
+			spawner = boost::make_shared<RemoteSpawner>(resourceLocator,
+				spawner, options, config);
+		}
+		return spawner;
+	}
+
+	SpawnerPtr createLocalSpawner(const Options &options) {
 		if (options.spawnMethod == "smart" || options.spawnMethod == "smart-lv2") {
 			SpawnerPtr spawner = tryCreateSmartSpawner(options);
 			if (spawner == NULL) {
@@ -34,6 +34,7 @@
 #include <utility>
 #include <Logging.h>
 #include <ApplicationPool2/Common.h>
+#include <ApplicationPool2/AppTypes.h>
 #include <ApplicationPool2/ComponentInfo.h>
 #include <ApplicationPool2/Group.h>
 #include <ApplicationPool2/Options.h>
@@ -189,7 +190,7 @@ private:
 	
 	
 	// Thread-safe.
-	static boost::mutex &getPoolSyncher(const PoolPtr &pool);
+	static PoolSyncher &getPoolSyncher(const PoolPtr &pool);
 	static void runAllActions(const vector<Callback> &actions);
 	string generateSecret() const;
 	void runInitializationHooks() const;
@@ -216,6 +217,26 @@ private:
 		generation++;
 	}
 
+	/**
+	 * If neither the application type nor a start command is given, detects
+	 * the application type by looking at the files in the application root.
+	 * This touches the filesystem, so like `loadComponentInfos()` it must
+	 * only be called from the background initializer, outside the pool lock.
+	 */
+	void detectAppType(Options &options) const {
+		if (!options.appType.empty() || !options.startCommand.empty()) {
+			return;
+		}
+
+		AppTypeDetector detector;
+		PassengerAppType type = detector.checkAppRoot(options.appRoot);
+		if (type != PAT_NONE) {
+			options.appType = getAppTypeName(type);
+			P_DEBUG("Detected application type of " << options.appRoot <<
+				": " << options.appType);
+		}
+	}
+
 	vector<ComponentInfo> loadComponentInfos(const Options &options) const {
 		vector<ComponentInfo> infos;
 		ComponentInfo info;
@@ -254,7 +275,7 @@ private:
 		// This function is either called from the pool event loop or directly from
 		// the detachAllGroups post lock actions. In both cases getPool() is never NULL.
 		PoolPtr pool = self->getPool();
-		boost::lock_guard<boost::mutex> lock(self->getPoolSyncher(pool));
+		PoolLockGuard lock(self->getPoolSyncher(pool));
 
 		vector<GroupPtr>::iterator it, end = self->detachedGroups.end();
 		for (it = self->detachedGroups.begin(); it != end; it++) {
@@ -276,9 +297,10 @@ private:
 			}
 			
 			while (!group->getWaitlist.empty()) {
-				getWaitlist.push_back(group->getWaitlist.front());
+				pushGetWaiterByPriority(getWaitlist, group->getWaitlist.front());
 				group->getWaitlist.pop_front();
 			}
+			group->getWaitlistChanged();
 			detachedGroups.push_back(group);
 			group->shutdown(
 				boost::bind(oneGroupHasBeenShutDown,
@@ -294,6 +316,13 @@ private:
 	void assignGetWaitlistToGroups(vector<Callback> &postLockActions) {
 		while (!getWaitlist.empty()) {
 			GetWaiter &waiter = getWaitlist.front();
+			if (waiter.cancelled()) {
+				postLockActions.push_back(boost::bind(
+					waiter.callback, SessionPtr(),
+					GetWaiter::cancelledException()));
+				getWaitlist.pop_front();
+				continue;
+			}
 			Group *group = route(waiter.options);
 			Options adjustedOptions = waiter.options;
 			adjustOptions(adjustedOptions, group);
@@ -330,7 +359,7 @@ private:
 		// Wait until 'detachedGroups' is empty.
 		UPDATE_TRACE_POINT();
 		PoolPtr pool = getPool();
-		boost::unique_lock<boost::mutex> lock(getPoolSyncher(pool));
+		PoolLock lock(getPoolSyncher(pool));
 		verifyInvariants();
 		while (true) {
 			if (OXT_UNLIKELY(this->generation != generation)) {
@@ -413,6 +442,11 @@ public:
 	 *       detachedGroups.empty()
 	 */
 	vector<GroupPtr> detachedGroups;
+
+	/** When a request last had to go through Pool::asyncGet() for this
+	 * SuperGroup, or when it was created. Used to decide whether it may
+	 * become dormant; see Pool::maxDormancyIdleTime. */
+	unsigned long long lastUsed;
 	
 	/** One MUST call initialize() after construction because shared_from_this()
 	 * is not available in the constructor.
@@ -426,6 +460,7 @@ public:
 		state = INITIALIZING;
 		defaultGroup = NULL;
 		generation = 0;
+		lastUsed = SystemTime::getUsec();
 	}
 
 	~SuperGroup() {
@@ -574,12 +609,27 @@ public:
 		return false;
 	}
 	
+	/**
+	 * See Group::tryGetFast().
+	 *
+	 * @pre The pool lock is held in shared mode.
+	 */
+	SessionPtr tryGetFast(const Options &newOptions, vector<SessionPtr> *leases = NULL,
+		unsigned int maxLeases = 0, unsigned int leasedArrivals = 0)
+	{
+		if (state == READY && groups.size() == 1) {
+			return defaultGroup->tryGetFast(newOptions, leases, maxLeases, leasedArrivals);
+		} else {
+			return SessionPtr();
+		}
+	}
+
 	SessionPtr get(const Options &newOptions, const GetCallback &callback,
 		vector<Callback> &postLockActions)
 	{
 		switch (state) {
 		case INITIALIZING:
-			getWaitlist.push_back(GetWaiter(newOptions, callback));
+			pushGetWaiterByPriority(getWaitlist, GetWaiter(newOptions, callback));
 			verifyInvariants();
 			return SessionPtr();
 		case READY:
@@ -599,7 +649,7 @@ public:
 			}
 		case DESTROYING:
 		case DESTROYED:
-			getWaitlist.push_back(GetWaiter(newOptions, callback));
+			pushGetWaiterByPriority(getWaitlist, GetWaiter(newOptions, callback));
 			setState(INITIALIZING);
 			createInterruptableThread(
 				boost::bind(
@@ -634,6 +684,23 @@ public:
 		return result;
 	}
 
+	/**
+	 * The options that the fair-share capacity settings (capacityWeight,
+	 * guaranteedCapacity, maxCapacityShare) are taken from: those of the
+	 * default Group, which are kept up to date by get() requests.
+	 */
+	const Options &capacityOptions() const {
+		if (defaultGroup != NULL) {
+			return defaultGroup->options;
+		} else {
+			return options;
+		}
+	}
+
+	unsigned int capacityWeight() const {
+		return std::max(1u, capacityOptions().capacityWeight);
+	}
+
 	unsigned int getProcessCount() const {
 		unsigned int result = 0;
 		vector<GroupPtr>::const_iterator g_it, g_end = groups.end();
@@ -0,0 +1,298 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_APPLICATION_POOL2_USER_DATABASE_CACHE_H_
+#define _PASSENGER_APPLICATION_POOL2_USER_DATABASE_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <cerrno>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <Exceptions.h>
+#include <Utils/SystemTime.h>
+#include <Utils/StrIntUtils.h>
+
+#if !defined(HAVE_GETGROUPLIST) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+	#define HAVE_GETGROUPLIST
+#endif
+
+namespace Passenger {
+namespace ApplicationPool2 {
+
+using namespace std;
+
+
+/**
+ * Caches user and group database lookups, as well as supplementary group
+ * lists, for a limited time. Spawning resolves the same users and groups over
+ * and over again, and with a network-backed NSS (LDAP, SSSD) every lookup can
+ * take tens of milliseconds. Negative results are cached too.
+ *
+ * Uses the reentrant getpw*_r() and getgr*_r() functions, so it doesn't
+ * interfere with other users of the non-reentrant ones. This class is
+ * thread-safe; concurrent lookups of an uncached entry wait for each other,
+ * so that a spawn burst only queries the database once.
+ */
+class UserDatabaseCache {
+public:
+	struct User {
+		bool found;
+		string name;
+		string home;
+		string shell;
+		uid_t uid;
+		gid_t gid;
+
+		User()
+			: found(false),
+			  uid((uid_t) -1),
+			  gid((gid_t) -1)
+			{ }
+	};
+
+	struct Group {
+		bool found;
+		string name;
+		gid_t gid;
+
+		Group()
+			: found(false),
+			  gid((gid_t) -1)
+			{ }
+	};
+
+private:
+	template<typename T>
+	struct Entry {
+		T value;
+		unsigned long long resolvedAt;
+	};
+
+	typedef Entry<User> UserEntry;
+	typedef Entry<Group> GroupEntry;
+	typedef Entry< vector<gid_t> > GroupListEntry;
+
+	mutable boost::mutex syncher;
+	unsigned long long ttl;
+	map<string, UserEntry> usersByName;
+	map<uid_t, UserEntry> usersByUid;
+	map<string, GroupEntry> groupsByName;
+	map<gid_t, GroupEntry> groupsByGid;
+	map<pair<string, gid_t>, GroupListEntry> groupLists;
+
+	template<typename Map>
+	bool lookupCache(Map &map, const typename Map::key_type &key,
+		unsigned long long now, typename Map::mapped_type **result)
+	{
+		typename Map::iterator it = map.find(key);
+		if (it != map.end() && now - it->second.resolvedAt < ttl) {
+			*result = &it->second;
+			return true;
+		} else {
+			*result = &map[key];
+			(*result)->resolvedAt = now;
+			return false;
+		}
+	}
+
+	static User toUser(struct passwd *pwd) {
+		User user;
+		if (pwd != NULL) {
+			user.found = true;
+			user.name  = pwd->pw_name;
+			user.home  = pwd->pw_dir;
+			user.shell = pwd->pw_shell;
+			user.uid   = pwd->pw_uid;
+			user.gid   = pwd->pw_gid;
+		}
+		return user;
+	}
+
+	static Group toGroup(struct group *grp) {
+		Group group;
+		if (grp != NULL) {
+			group.found = true;
+			group.name = grp->gr_name;
+			group.gid  = grp->gr_gid;
+		}
+		return group;
+	}
+
+	/*
+	 * The *_r() functions return ERANGE if the buffer is too small. Entries of
+	 * groups with many members can be large, so grow the buffer until it fits.
+	 */
+
+	static User queryUser(const string *name, uid_t uid) {
+		vector<char> buf(16 * 1024);
+		struct passwd pwd, *result;
+		int ret;
+
+		while (true) {
+			result = NULL;
+			if (name != NULL) {
+				ret = getpwnam_r(name->c_str(), &pwd, &buf[0], buf.size(), &result);
+			} else {
+				ret = getpwuid_r(uid, &pwd, &buf[0], buf.size(), &result);
+			}
+			if (ret == ERANGE && buf.size() < 16 * 1024 * 1024) {
+				buf.resize(buf.size() * 2);
+			} else if (ret == EINTR) {
+				continue;
+			} else {
+				return toUser(ret == 0 ? result : NULL);
+			}
+		}
+	}
+
+	static Group queryGroup(const string *name, gid_t gid) {
+		vector<char> buf(16 * 1024);
+		struct group grp, *result;
+		int ret;
+
+		while (true) {
+			result = NULL;
+			if (name != NULL) {
+				ret = getgrnam_r(name->c_str(), &grp, &buf[0], buf.size(), &result);
+			} else {
+				ret = getgrgid_r(gid, &grp, &buf[0], buf.size(), &result);
+			}
+			if (ret == ERANGE && buf.size() < 16 * 1024 * 1024) {
+				buf.resize(buf.size() * 2);
+			} else if (ret == EINTR) {
+				continue;
+			} else {
+				return toGroup(ret == 0 ? result : NULL);
+			}
+		}
+	}
+
+public:
+	/** The TTL is in seconds. 0 disables caching. */
+	UserDatabaseCache(unsigned int ttl = 60)
+		: ttl((unsigned long long) ttl * 1000000)
+		{ }
+
+	User lookupUser(const string &name) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		UserEntry *entry;
+		if (!lookupCache(usersByName, name, SystemTime::getMonotonicUsec(), &entry)) {
+			entry->value = queryUser(&name, 0);
+		}
+		return entry->value;
+	}
+
+	User lookupUser(uid_t uid) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		UserEntry *entry;
+		if (!lookupCache(usersByUid, uid, SystemTime::getMonotonicUsec(), &entry)) {
+			entry->value = queryUser(NULL, uid);
+		}
+		return entry->value;
+	}
+
+	Group lookupGroup(const string &name) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		GroupEntry *entry;
+		if (!lookupCache(groupsByName, name, SystemTime::getMonotonicUsec(), &entry)) {
+			entry->value = queryGroup(&name, 0);
+		}
+		return entry->value;
+	}
+
+	Group lookupGroup(gid_t gid) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		GroupEntry *entry;
+		if (!lookupCache(groupsByGid, gid, SystemTime::getMonotonicUsec(), &entry)) {
+			entry->value = queryGroup(NULL, gid);
+		}
+		return entry->value;
+	}
+
+	/** Returns the group's name, or its ID as a string if it doesn't exist. */
+	string getGroupName(gid_t gid) {
+		Group group = lookupGroup(gid);
+		if (group.found) {
+			return group.name;
+		} else {
+			return toString(gid);
+		}
+	}
+
+	#ifdef HAVE_GETGROUPLIST
+		/**
+		 * Returns the supplementary groups of the given user, including `gid`,
+		 * like getgrouplist() does.
+		 *
+		 * @throws SystemException
+		 */
+		vector<gid_t> getGroupList(const string &username, gid_t gid) {
+			boost::lock_guard<boost::mutex> l(syncher);
+			GroupListEntry *entry;
+			if (lookupCache(groupLists, make_pair(username, gid),
+				SystemTime::getMonotonicUsec(), &entry))
+			{
+				return entry->value;
+			}
+
+			#ifdef __APPLE__
+				int groups[1024];
+			#else
+				gid_t groups[1024];
+			#endif
+			int ngroups = sizeof(groups) / sizeof(groups[0]);
+			if (getgrouplist(username.c_str(), gid, groups, &ngroups) == -1) {
+				int e = errno;
+				groupLists.erase(make_pair(username, gid));
+				throw SystemException("getgrouplist() failed", e);
+			}
+			entry->value.assign(groups, groups + ngroups);
+			return entry->value;
+		}
+	#endif
+
+	void clear() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		usersByName.clear();
+		usersByUid.clear();
+		groupsByName.clear();
+		groupsByGid.clear();
+		groupLists.clear();
+	}
+};
+
+typedef boost::shared_ptr<UserDatabaseCache> UserDatabaseCachePtr;
+
+
+} // namespace ApplicationPool2
+} // namespace Passenger
+
+#endif /* _PASSENGER_APPLICATION_POOL2_USER_DATABASE_CACHE_H_ */
@@ -26,6 +26,7 @@
 #include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
 #include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
 #include <ev++.h>
 #include <BackgroundEventLoop.h>
 #include <Exceptions.h>
@@ -53,6 +54,10 @@ signalBackgroundEventLoopExit(struct ev_loop *loop, ev_async *async, int revents
 
 static void
 startBackgroundLoop(BackgroundEventLoop *bg) {
+	// The loop is stopped through an ev_async, never by interrupting this
+	// thread, so let the syscalls made by event handlers skip the
+	// interruption checks.
+	this_thread::disable_syscall_interruption dsi;
 	boost::unique_lock<boost::mutex> l(bg->priv->lock);
 	bg->safe->setCurrentThread();
 	bg->priv->started = true;
@@ -52,6 +52,8 @@
 
 	#define DEFAULT_CONCURRENCY_MODEL "process"
 
+	#define DEFAULT_HELPER_AGENT_KEEPALIVE 32
+
 	#define DEFAULT_LOG_LEVEL 0
 
 	#define DEFAULT_MAX_POOL_SIZE 6
@@ -66,6 +68,8 @@
 
 	#define DEFAULT_START_TIMEOUT 90000
 
+	#define DEFAULT_STAT_CACHE_TTL 1
+
 	#define DEFAULT_THREAD_COUNT 1
 
 	#define DEFAULT_UNION_STATION_GATEWAY_ADDRESS "gateway.unionstationapp.com"
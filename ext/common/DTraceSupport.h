@@ -0,0 +1,70 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_DTRACE_SUPPORT_H_
+#define _PASSENGER_DTRACE_SUPPORT_H_
+
+/**
+ * Static tracepoints in the "passenger" provider, for DTrace, SystemTap and
+ * bpftrace. They're compiled in when the agents are built with USE_DTRACE=yes,
+ * which defines PASSENGER_USE_DTRACE and requires <sys/sdt.h> (on Linux, from
+ * the SystemTap SDT development package). A tracepoint that nobody traces is
+ * a single nop instruction; its arguments are only evaluated into registers
+ * or stack slots that the nop refers to. Without USE_DTRACE, the macros
+ * expand to nothing and their arguments aren't evaluated at all.
+ *
+ * Conventions for the arguments, so that scripts can be written once:
+ *
+ * - Application group names are passed as two arguments, a `const char *`
+ *   and a length, because they are often StaticStrings that aren't
+ *   NUL-terminated. In bpftrace: str(arg0, arg1).
+ * - Processes are identified by their PID followed by their GUPID as a
+ *   NUL-terminated string. The PID is 0 if there is no process, e.g.
+ *   because a spawn failed.
+ *
+ * See doc/DebuggingAndStressTesting.md for the list of tracepoints.
+ */
+
+#ifdef PASSENGER_USE_DTRACE
+	#include <sys/sdt.h>
+
+	#define PASSENGER_PROBE1(name, arg1) \
+		DTRACE_PROBE1(passenger, name, arg1)
+	#define PASSENGER_PROBE2(name, arg1, arg2) \
+		DTRACE_PROBE2(passenger, name, arg1, arg2)
+	#define PASSENGER_PROBE3(name, arg1, arg2, arg3) \
+		DTRACE_PROBE3(passenger, name, arg1, arg2, arg3)
+	#define PASSENGER_PROBE4(name, arg1, arg2, arg3, arg4) \
+		DTRACE_PROBE4(passenger, name, arg1, arg2, arg3, arg4)
+	#define PASSENGER_PROBE5(name, arg1, arg2, arg3, arg4, arg5) \
+		DTRACE_PROBE5(passenger, name, arg1, arg2, arg3, arg4, arg5)
+#else
+	#define PASSENGER_PROBE1(name, arg1) do { } while (false)
+	#define PASSENGER_PROBE2(name, arg1, arg2) do { } while (false)
+	#define PASSENGER_PROBE3(name, arg1, arg2, arg3) do { } while (false)
+	#define PASSENGER_PROBE4(name, arg1, arg2, arg3, arg4) do { } while (false)
+	#define PASSENGER_PROBE5(name, arg1, arg2, arg3, arg4, arg5) do { } while (false)
+#endif
+
+#endif /* _PASSENGER_DTRACE_SUPPORT_H_ */
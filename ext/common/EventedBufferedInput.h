@@ -31,6 +31,7 @@
 
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <boost/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
@@ -52,6 +53,117 @@ using namespace oxt;
 
 #define EBI_TRACE(expr) P_TRACE(3, "[EventedBufferedInput " << this << " " << inspect() << "] " << expr)
 
+/**
+ * A free list of read buffers that EventedBufferedInputs can borrow from
+ * while they hold unconsumed data, so that idle connections don't pin a
+ * buffer each. Buffers come in a few size classes, each 4 times as large
+ * as the previous one, so that inputs that receive a lot of data can read
+ * it in bigger chunks. A pool is meant to be shared by all inputs on the
+ * same event loop and is *not* thread-safe.
+ *
+ * Freed buffers are kept around as long as the free buffers take up at
+ * most 'maxFreeBytes' bytes in total; buffers released beyond that limit
+ * are freed.
+ */
+class EventedBufferedInputBufferPool {
+public:
+	static const unsigned int SIZE_CLASSES = 3;
+
+private:
+	const size_t minBufferSize;
+	const size_t maxFreeBytes;
+	size_t freeBytes;
+	vector<char *> freeLists[SIZE_CLASSES];
+	unsigned long long hits;
+	unsigned long long misses;
+
+public:
+	EventedBufferedInputBufferPool(size_t _minBufferSize = 1024 * 8,
+		size_t _maxFreeBytes = 1024 * 1024 * 4)
+		: minBufferSize(_minBufferSize),
+		  maxFreeBytes(_maxFreeBytes),
+		  freeBytes(0),
+		  hits(0),
+		  misses(0)
+		{ }
+
+	~EventedBufferedInputBufferPool() {
+		clear();
+	}
+
+	size_t getBufferSize(unsigned int sizeClass) const {
+		assert(sizeClass < SIZE_CLASSES);
+		return minBufferSize << (2 * sizeClass);
+	}
+
+	char *acquire(unsigned int sizeClass) {
+		assert(sizeClass < SIZE_CLASSES);
+		vector<char *> &freeList = freeLists[sizeClass];
+		if (freeList.empty()) {
+			misses++;
+			return new char[getBufferSize(sizeClass)];
+		} else {
+			char *result = freeList.back();
+			freeList.pop_back();
+			freeBytes -= getBufferSize(sizeClass);
+			hits++;
+			return result;
+		}
+	}
+
+	void release(char *buffer, unsigned int sizeClass) {
+		assert(sizeClass < SIZE_CLASSES);
+		size_t size = getBufferSize(sizeClass);
+		if (freeBytes + size <= maxFreeBytes) {
+			freeLists[sizeClass].push_back(buffer);
+			freeBytes += size;
+		} else {
+			delete[] buffer;
+		}
+	}
+
+	/** Frees all free buffers, e.g. when the server has become idle. */
+	void clear() {
+		for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+			vector<char *>::iterator it, end = freeLists[i].end();
+			for (it = freeLists[i].begin(); it != end; it++) {
+				delete[] *it;
+			}
+			vector<char *>().swap(freeLists[i]);
+		}
+		freeBytes = 0;
+	}
+
+	unsigned int freeCount() const {
+		unsigned int result = 0;
+		for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+			result += freeLists[i].size();
+		}
+		return result;
+	}
+
+	unsigned long long hitCount() const {
+		return hits;
+	}
+
+	unsigned long long missCount() const {
+		return misses;
+	}
+
+	template<typename Stream>
+	void inspect(Stream &stream) const {
+		stream << "Input buffer pool: free =";
+		for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+			stream << " " << freeLists[i].size() << "x" <<
+				getBufferSize(i) / 1024 << "K";
+		}
+		stream << ", hits = " << hits <<
+			", misses = " << misses << "\n";
+	}
+};
+
+typedef boost::shared_ptr<EventedBufferedInputBufferPool> EventedBufferedInputBufferPoolPtr;
+
 /**
  * Provides input buffering services for non-blocking sockets in evented I/O systems.
  *
@@ -60,6 +172,14 @@ using namespace oxt;
  * the number of bytes that it has actually consumed. If not everything has been
  * consumed, then the handler will be called with the remaining data in the next
  * tick.
+ *
+ * By default data is read into a buffer of <tt>bufferSize</tt> bytes that is
+ * part of the object. If a buffer pool is set with setBufferPool(), then a
+ * buffer is instead borrowed from the pool when the socket becomes readable,
+ * and returned once all data in it has been consumed. The size of the
+ * borrowed buffer adapts to the amount of data that the socket delivers.
+ * With <tt>bufferSize</tt> 0 there is no built-in buffer, and a buffer pool
+ * must be set before the input is started.
  */
 template<size_t bufferSize = 1024 * 8>
 class EventedBufferedInput: public boost::enable_shared_from_this< EventedBufferedInput<bufferSize> > {
@@ -119,7 +239,17 @@ private:
 	unsigned int generation;
 	int error;
 
-	char bufferData[bufferSize];
+	EventedBufferedInputBufferPoolPtr bufferPool;
+	/** The buffer borrowed from bufferPool, if any. */
+	char *pooledBuffer;
+	/** The size class of pooledBuffer. */
+	unsigned int pooledBufferSizeClass: 2;
+	/** The size class of the buffer to borrow on the next read. */
+	unsigned int sizeClass: 2;
+	/** Holds the data passed to unread(). */
+	string unreadData;
+
+	char bufferData[bufferSize > 0 ? bufferSize : 1];
 
 	void verifyInvariants() {
 		// !a || b: logical equivalent of a IMPLIES b.
@@ -139,6 +269,38 @@ private:
 		userData = NULL;
 	}
 
+	void releasePooledBuffer() {
+		if (pooledBuffer != NULL) {
+			bufferPool->release(pooledBuffer, pooledBufferSizeClass);
+			pooledBuffer = NULL;
+		}
+	}
+
+	/**
+	 * Reads into a borrowed buffer. Data that fills the entire buffer makes
+	 * the next read use a larger one, and data that would have fit in a
+	 * smaller one makes it use a smaller one.
+	 */
+	ssize_t readIntoPooledBuffer() {
+		assert(pooledBuffer == NULL);
+		size_t size = bufferPool->getBufferSize(sizeClass);
+		pooledBuffer = bufferPool->acquire(sizeClass);
+		pooledBufferSizeClass = sizeClass;
+		ssize_t ret = readSocket(pooledBuffer, size);
+		if (ret <= 0) {
+			int e = errno;
+			releasePooledBuffer();
+			errno = e;
+		} else if ((size_t) ret == size) {
+			if (sizeClass + 1 < EventedBufferedInputBufferPool::SIZE_CLASSES) {
+				sizeClass++;
+			}
+		} else if (sizeClass > 0 && (size_t) ret <= bufferPool->getBufferSize(sizeClass - 1)) {
+			sizeClass--;
+		}
+		return ret;
+	}
+
 	void onReadable(ev::io &watcher, int revents) {
 		// Keep 'this' alive until function exit.
 		boost::shared_ptr< EventedBufferedInput<bufferSize> > self = EventedBufferedInput<bufferSize>::shared_from_this();
@@ -147,7 +309,13 @@ private:
 		verifyInvariants();
 		assert(!nextTickInstalled);
 
-		ssize_t ret = readSocket(bufferData, bufferSize);
+		ssize_t ret;
+		if (bufferPool != NULL) {
+			ret = readIntoPooledBuffer();
+		} else {
+			assert(bufferSize > 0);
+			ret = readSocket(bufferData, bufferSize);
+		}
 		if (ret == -1) {
 			if (errno != EAGAIN) {
 				error = errno;
@@ -190,7 +358,11 @@ private:
 			assert(buffer.empty());
 			assert(!paused);
 
-			buffer = StaticString(bufferData, ret);
+			if (pooledBuffer != NULL) {
+				buffer = StaticString(pooledBuffer, ret);
+			} else {
+				buffer = StaticString(bufferData, ret);
+			}
 			processBuffer();
 			verifyInvariants();
 		}
@@ -228,6 +400,13 @@ private:
 
 		~SetProcessingBufferToFalse() {
 			self->processingBuffer = false;
+			// The data callback may still have been using the data
+			// when it reset this input, so don't return the buffer
+			// to the pool before now.
+			if (self->buffer.empty()) {
+				self->releasePooledBuffer();
+				string().swap(self->unreadData);
+			}
 		}
 	};
 
@@ -293,6 +472,13 @@ private:
 		this->libev = libev;
 		this->fd = fd;
 		buffer = StaticString();
+		if (firstTime) {
+			pooledBuffer = NULL;
+		} else if (!processingBuffer) {
+			releasePooledBuffer();
+			string().swap(unreadData);
+		}
+		sizeClass = 0;
 		state = LIVE;
 		paused = true;
 		socketPaused = true;
@@ -350,6 +536,7 @@ public:
 	virtual ~EventedBufferedInput() {
 		cancelScheduledProcessBufferCall();
 		watcher.stop();
+		releasePooledBuffer();
 		EBI_TRACE("destroyed");
 	}
 
@@ -362,6 +549,32 @@ public:
 		_reset(libev, fd);
 	}
 
+	/**
+	 * Sets the pool from which read buffers are borrowed. Pass NULL to use
+	 * the built-in buffer. Should be called while the input is reset, i.e.
+	 * not holding any buffered data.
+	 */
+	void setBufferPool(const EventedBufferedInputBufferPoolPtr &pool) {
+		assert(buffer.empty());
+		releasePooledBuffer();
+		bufferPool = pool;
+		sizeClass = 0;
+	}
+
+	const EventedBufferedInputBufferPoolPtr &getBufferPool() const {
+		return bufferPool;
+	}
+
+	/**
+	 * Sets the libev priority of the socket watcher. It's kept across
+	 * reset() calls. Must be called while the watcher isn't active, e.g.
+	 * while the input is reset.
+	 */
+	void setPriority(int priority) {
+		assert(!watcher.is_active());
+		ev_set_priority(static_cast<ev_io *>(&watcher), priority);
+	}
+
 	void stop() {
 		if (state == LIVE && !paused) {
 			EBI_TRACE("stop()");
@@ -406,11 +619,41 @@ public:
 		return state == END_OF_STREAM;
 	}
 
+	/** The amount of data that has been read from the socket but not
+	 * consumed yet. */
+	size_t getBufferSize() const {
+		return buffer.size();
+	}
+
 	void readNow() {
 		assert(!nextTickInstalled);
 		onReadable(watcher, 0);
 	}
 
+	/**
+	 * Makes this input emit a copy of the given data before anything else
+	 * that it reads from the socket, as if it had been read from the socket.
+	 * Used to take over a connection from another EventedBufferedInput,
+	 * e.g. in another event loop, along with the data that that one had
+	 * already read. May only be called while no data is buffered.
+	 */
+	void unread(const StaticString &data) {
+		assert(buffer.empty());
+		assert(state == LIVE);
+		if (data.empty()) {
+			return;
+		}
+		unreadData.assign(data.data(), data.size());
+		buffer = unreadData;
+		if (!socketPaused) {
+			socketPaused = true;
+			watcher.stop();
+		}
+		if (!paused) {
+			processBufferInNextTick();
+		}
+	}
+
 	const FileDescriptor &getFd() const {
 		return fd;
 	}
@@ -452,6 +695,7 @@ public:
 };
 
 typedef boost::shared_ptr< EventedBufferedInput<> > EventedBufferedInputPtr;
+typedef boost::shared_ptr< EventedBufferedInput<0> > PooledEventedBufferedInputPtr;
 
 } // namespace Passenger
 
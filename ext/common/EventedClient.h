@@ -27,16 +27,21 @@
 
 #include <ev++.h>
 #include <string>
+#include <deque>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <cstdlib>
 #include <cerrno>
 #include <cassert>
 
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <oxt/system_calls.hpp>
 #include <oxt/thread.hpp>
 
 #include "FileDescriptor.h"
+#include "StaticString.h"
 #include "Utils/IOUtils.h"
 
 namespace Passenger {
@@ -177,10 +182,36 @@ protected:
 	
 	/** A libev watcher on for watching read events on <tt>fd</tt>. */
 	ev::io readWatcher;
+	/** A part of the outbox. */
+	struct OutboxSegment {
+		/** Keeps the data alive. Shared with the caller of
+		 * write(const boost::shared_ptr<const string> &). */
+		boost::shared_ptr<const string> buffer;
+		/** Position of the first byte in buffer that hasn't been sent yet. */
+		string::size_type begin;
+	};
+	
+	/** Data copied into the outbox is coalesced into segments of at most this size. */
+	static const unsigned int OUTBOX_SEGMENT_SIZE = 1024 * 16;
+	/** Maximum number of buffers passed to a single writev() call. */
+	static const unsigned int MAX_IOVECS = 32;
+	
 	/** A libev watcher on for watching write events on <tt>fd</tt>. */
 	ev::io writeWatcher;
-	/** Storage for data that could not be sent out immediately. */
-	string outbox;
+	/**
+	 * Storage for data that could not be sent out immediately. It's a chain
+	 * of buffers that is sent with writev(), so that data that has been
+	 * partially sent never has to be moved, and so that data passed to
+	 * write() as a shared buffer never has to be copied.
+	 */
+	deque<OutboxSegment> outbox;
+	/** Total number of unsent bytes in the outbox. */
+	size_t outboxSize;
+	/**
+	 * The buffer of the last outbox segment, if it contains data that was
+	 * copied into the outbox, so that more data may be appended to it.
+	 */
+	boost::shared_ptr<string> outboxTail;
 	int refcount;
 	unsigned int outboxLimit;
 	bool m_notifyReads;
@@ -196,32 +227,181 @@ protected:
 		
 		this_thread::disable_interruption di;
 		this_thread::disable_syscall_interruption dsi;
-		size_t sent = 0;
 		bool done = outbox.empty();
 		
 		while (!done) {
-			ssize_t ret = syscalls::write(fd,
-				outbox.data() + sent,
-				outbox.size() - sent);
+			struct iovec iov[MAX_IOVECS];
+			size_t total;
+			unsigned int iovCount = outboxToIoVec(iov, MAX_IOVECS, total);
+			ssize_t ret = syscalls::writev(fd, iov, iovCount);
 			if (ret == -1) {
 				if (errno != EAGAIN) {
-					int e = errno;
-					if (writeErrorAction == DISCONNECT_FULL) {
-						disconnect(true);
-					} else {
-						closeWrite();
-					}
-					emitSystemErrorEvent("Cannot write data to client", e);
+					handleWriteError(errno);
 					return;
 				}
 				done = true;
 			} else {
-				sent += ret;
-				done = sent == outbox.size();
+				consumeOutbox(ret);
+				done = outbox.empty() || (size_t) ret < total;
 			}
 		}
-		if (sent > 0) {
-			outbox.erase(0, sent);
+		
+		updateWatcherStates();
+		if (outbox.empty()) {
+			emitEvent(onPendingDataFlushed);
+		}
+	}
+	
+	void handleWriteError(int e) {
+		if (writeErrorAction == DISCONNECT_FULL) {
+			disconnect(true);
+		} else {
+			closeWrite();
+		}
+		emitSystemErrorEvent("Cannot write data to client", e);
+	}
+	
+	/**
+	 * Fills <tt>iov</tt> with the outbox's first segments, at most
+	 * <tt>max</tt> of them. Returns the number of segments filled in, and
+	 * sets <tt>total</tt> to the number of bytes in them.
+	 */
+	unsigned int outboxToIoVec(struct iovec *iov, unsigned int max, size_t &total) const {
+		deque<OutboxSegment>::const_iterator it, end = outbox.end();
+		unsigned int count = 0;
+		
+		total = 0;
+		for (it = outbox.begin(); it != end && count < max; it++, count++) {
+			iov[count].iov_base = (char *) it->buffer->data() + it->begin;
+			iov[count].iov_len  = it->buffer->size() - it->begin;
+			total += iov[count].iov_len;
+		}
+		return count;
+	}
+	
+	/** Removes the first <tt>size</tt> bytes, which have been sent, from the outbox. */
+	void consumeOutbox(size_t size) {
+		assert(size <= outboxSize);
+		outboxSize -= size;
+		while (size > 0) {
+			OutboxSegment &segment = outbox.front();
+			size_t segmentSize = segment.buffer->size() - segment.begin;
+			if (size >= segmentSize) {
+				size -= segmentSize;
+				outbox.pop_front();
+			} else {
+				segment.begin += size;
+				size = 0;
+			}
+		}
+		if (outbox.empty()) {
+			outboxTail.reset();
+		}
+	}
+	
+	/** Copies the given data to the end of the outbox. */
+	void appendToOutbox(const char *data, size_t size) {
+		if (outboxTail != NULL && outboxTail->size() + size <= OUTBOX_SEGMENT_SIZE) {
+			outboxTail->append(data, size);
+		} else {
+			OutboxSegment segment;
+			outboxTail = boost::make_shared<string>(data, size);
+			segment.buffer = outboxTail;
+			segment.begin  = 0;
+			outbox.push_back(segment);
+		}
+		outboxSize += size;
+	}
+	
+	/** Adds the given buffer, starting at <tt>begin</tt>, to the end of the outbox without copying it. */
+	void appendToOutbox(const boost::shared_ptr<const string> &buffer, string::size_type begin) {
+		OutboxSegment segment;
+		segment.buffer = buffer;
+		segment.begin  = begin;
+		outbox.push_back(segment);
+		outboxSize += buffer->size() - begin;
+		outboxTail.reset();
+	}
+	
+	/**
+	 * Adds the given data to the outbox, except for the first <tt>skip</tt>
+	 * bytes, which have already been sent. If <tt>sharedData</tt> is given
+	 * then <tt>data</tt> lies within it, and it's referenced instead of copied.
+	 */
+	void appendUnsentData(const StaticString data[], unsigned int count, size_t skip,
+		const boost::shared_ptr<const string> *sharedData)
+	{
+		for (unsigned int i = 0; i < count; i++) {
+			size_t size = data[i].size();
+			if (skip >= size) {
+				skip -= size;
+			} else {
+				if (sharedData != NULL) {
+					appendToOutbox(*sharedData,
+						data[i].data() - (*sharedData)->data() + skip);
+				} else {
+					appendToOutbox(data[i].data() + skip, size - skip);
+				}
+				skip = 0;
+			}
+		}
+	}
+	
+	void realWrite(const StaticString data[], unsigned int count,
+		const boost::shared_ptr<const string> *sharedData)
+	{
+		if (!writeAllowed()) {
+			return;
+		}
+		
+		this_thread::disable_interruption di;
+		this_thread::disable_syscall_interruption dsi;
+		struct iovec iov[MAX_IOVECS];
+		size_t outboxBytes, total;
+		unsigned int iovCount, i;
+		bool dataIncluded;
+		
+		// Send the outbox and the new data with a single writev() call
+		// if they fit, otherwise send only (part of) the outbox and
+		// queue the new data.
+		iovCount = outboxToIoVec(iov, MAX_IOVECS, outboxBytes);
+		total = outboxBytes;
+		dataIncluded = outboxBytes == outboxSize;
+		for (i = 0; i < count && dataIncluded; i++) {
+			if (data[i].empty()) {
+				continue;
+			} else if (iovCount == MAX_IOVECS) {
+				dataIncluded = false;
+			} else {
+				iov[iovCount].iov_base = (char *) data[i].data();
+				iov[iovCount].iov_len  = data[i].size();
+				total += data[i].size();
+				iovCount++;
+			}
+		}
+		if (!dataIncluded) {
+			iovCount = outboxToIoVec(iov, MAX_IOVECS, total);
+		}
+		
+		size_t sent = 0;
+		if (total > 0) {
+			ssize_t ret = syscalls::writev(fd, iov, iovCount);
+			if (ret == -1) {
+				if (errno != EAGAIN) {
+					handleWriteError(errno);
+					return;
+				}
+			} else {
+				sent = ret;
+			}
+		}
+		
+		if (sent <= outboxBytes) {
+			consumeOutbox(sent);
+			appendUnsentData(data, count, 0, sharedData);
+		} else {
+			consumeOutbox(outboxBytes);
+			appendUnsentData(data, count, sent - outboxBytes, sharedData);
 		}
 		
 		updateWatcherStates();
@@ -231,7 +411,7 @@ protected:
 	}
 	
 	bool outboxTooLarge() {
-		return outbox.size() > 0 && outbox.size() >= outboxLimit;
+		return outboxSize > 0 && outboxSize >= outboxLimit;
 	}
 	
 	void updateWatcherStates() {
@@ -395,6 +575,7 @@ public:
 		  fd(_fd)
 	{
 		state              = EC_CONNECTED;
+		outboxSize         = 0;
 		refcount           = 1;
 		m_notifyReads      = false;
 		outboxLimit        = 1024 * 32;
@@ -467,7 +648,7 @@ public:
 			|| state == EC_RO_CONNECTED_WITH_WRITES_PENDING;
 	}
 	
-	/** Used by unit tests. */
+	/** Returns whether the input readiness watcher is currently active. */
 	bool readWatcherActive() const {
 		return readWatcher.is_active();
 	}
@@ -479,7 +660,7 @@ public:
 	 * @see write()
 	 */
 	size_t pendingWrites() const {
-		return outbox.size();
+		return outboxSize;
 	}
 	
 	/**
@@ -555,29 +736,18 @@ public:
 	 * of time.
 	 */
 	void write(const StaticString data[], unsigned int count) {
-		if (!writeAllowed()) {
-			return;
-		}
-		
-		ssize_t ret;
-		this_thread::disable_interruption di;
-		this_thread::disable_syscall_interruption dsi;
-		
-		ret = gatheredWrite(fd, data, count, outbox);
-		if (ret == -1) {
-			int e = errno;
-			if (writeErrorAction == DISCONNECT_FULL) {
-				disconnect(true);
-			} else {
-				closeWrite();
-			}
-			emitSystemErrorEvent("Cannot write data to client", e);
-		} else {
-			updateWatcherStates();
-			if (outbox.empty()) {
-				emitEvent(onPendingDataFlushed);
-			}
-		}
+		realWrite(data, count, NULL);
+	}
+	
+	/**
+	 * Like <tt>write(const StaticString[], unsigned int)</tt>, but if the
+	 * data cannot be sent immediately then the outbox keeps a reference
+	 * to <tt>data</tt> instead of copying it. <tt>data</tt> must not be
+	 * modified afterwards.
+	 */
+	void write(const boost::shared_ptr<const string> &data) {
+		StaticString str(*data);
+		realWrite(&str, 1, &data);
 	}
 	
 	/**
@@ -179,7 +179,9 @@ protected:
 				onDataReceived(client, buf, ret);
 			}
 			i++;
-			done = done || !client->ioAllowed();
+			// Stop if a hook has stopped reads, e.g. to process a message
+			// in another thread.
+			done = done || !client->ioAllowed() || !client->readWatcherActive();
 		}
 	}
 	
@@ -212,14 +214,12 @@ protected:
 		readDataDiscarded = true;
 	}
 
-private:
-	bool readDataDiscarded;
-	
-	static void onAuthenticationTimeout(ev::timer &t, int revents) {
-		EventedMessageClient *client = (EventedMessageClient *) t.data;
-		client->disconnect();
-	}
-	
+	/**
+	 * Feeds data that has been read from the client to the protocol parser.
+	 * Subclasses that stop processing a client's data in the middle of a
+	 * read, e.g. to process a message asynchronously, may call this later
+	 * with the remaining data.
+	 */
 	void onDataReceived(EventedMessageClient *client, char *data, size_t size) {
 		EventedMessageClientContext *context = &client->messageServer;
 		size_t consumed = 0;
@@ -316,6 +316,14 @@ private:
 		}
 	}
 
+private:
+	bool readDataDiscarded;
+	
+	static void onAuthenticationTimeout(ev::timer &t, int revents) {
+		EventedMessageClient *client = (EventedMessageClient *) t.data;
+		client->disconnect();
+	}
+
 public:
 	EventedMessageServer(struct ev_loop *loop, FileDescriptor fd,
 		const AccountsDatabasePtr &accountsDatabase)
@@ -27,6 +27,7 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
 #include <oxt/system_calls.hpp>
 
 #include <utility>
@@ -217,6 +218,89 @@ public:
 		errno = e;
 		return *this;
 	}
+
+	/** Exchanges the underlying file descriptors without touching their
+	 * reference counts, so that ownership can be moved cheaply. */
+	void swap(FileDescriptor &other) {
+		data.swap(other.data);
+	}
+};
+
+/**
+ * Owns a file descriptor exclusively, and closes it when destroyed, ignoring
+ * any errors. Unlike FileDescriptor, it doesn't allocate anything and has no
+ * reference count, so it's meant for file descriptors that are often closed
+ * again without ever being shared, e.g. connections that are rejected right
+ * after accept(). It can't be copied: ownership is passed on with release()
+ * or share(), the latter once the file descriptor does need to be shared.
+ *
+ * Like FileDescriptor, it doesn't change errno except in close(), so that
+ * it can be checked after constructing one with the result of a system call.
+ */
+class UniqueFileDescriptor: public boost::noncopyable {
+private:
+	int fd;
+
+public:
+	explicit UniqueFileDescriptor(int fd = -1)
+		: fd(fd)
+		{ }
+
+	~UniqueFileDescriptor() {
+		reset();
+	}
+
+	/** Closes the current file descriptor, if any, ignoring errors, and
+	 * takes ownership of `newFd`. */
+	void reset(int newFd = -1) {
+		if (fd >= 0) {
+			this_thread::disable_syscall_interruption dsi;
+			int e = errno;
+			syscalls::close(fd);
+			errno = e;
+		}
+		fd = newFd;
+	}
+
+	/**
+	 * Closes the file descriptor, if any.
+	 *
+	 * @throws SystemException Only thrown if checkErrors is true.
+	 * @post *this == -1
+	 */
+	void close(bool checkErrors = true) {
+		if (fd >= 0) {
+			this_thread::disable_syscall_interruption dsi;
+			int theFd = fd;
+			fd = -1;
+			safelyClose(theFd, !checkErrors);
+		}
+	}
+
+	/**
+	 * Gives up ownership of the file descriptor without closing it.
+	 *
+	 * @return The file descriptor, or -1 if there is none.
+	 * @post *this == -1
+	 */
+	int release() {
+		int result = fd;
+		fd = -1;
+		return result;
+	}
+
+	/**
+	 * Moves ownership of the file descriptor into a new FileDescriptor.
+	 *
+	 * @post *this == -1
+	 */
+	FileDescriptor share() {
+		return FileDescriptor(release());
+	}
+
+	operator int () const {
+		return fd;
+	}
 };
 
 /**
@@ -0,0 +1,214 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_HOOK_SCRIPT_EXECUTOR_H_
+#define _PASSENGER_HOOK_SCRIPT_EXECUTOR_H_
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <oxt/backtrace.hpp>
+#include <string>
+#include <vector>
+#include <list>
+#include <utility>
+
+#include <Hooks.h>
+#include <Logging.h>
+#include <Utils/SystemTime.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace oxt;
+
+
+/**
+ * Runs hook scripts in the background so that the caller doesn't have to
+ * wait for them. The hook scripts are run by the threads that call run();
+ * the number of such threads bounds the number of hook scripts that run at
+ * the same time.
+ *
+ * Hook scripts that are scheduled with a batch key are not run right away,
+ * but after `batchTime` milliseconds. All hook scripts with the same batch
+ * key that are scheduled in the mean time are merged into a single
+ * invocation: environment variables are joined with commas if their values
+ * differ. For example, three `detached_process` hooks in the same group
+ * result in a single invocation with `PASSENGER_PROCESS_PID=123,456,789`.
+ * Batching is disabled if `batchTime` is 0.
+ */
+class HookScriptExecutor {
+private:
+	struct Job {
+		HookScriptOptions options;
+		string batchKey;
+		unsigned long long readyTime;
+	};
+
+	boost::mutex syncher;
+	boost::condition_variable cond;
+	boost::condition_variable idleCond;
+	list<Job> queue;
+	const unsigned int batchTime;
+	unsigned int running;
+	bool draining;
+
+	static void mergeEnvironment(vector< pair<string, string> > &target,
+		const vector< pair<string, string> > &source)
+	{
+		vector< pair<string, string> >::const_iterator it, end = source.end();
+		for (it = source.begin(); it != end; it++) {
+			vector< pair<string, string> >::iterator t_it, t_end = target.end();
+			for (t_it = target.begin(); t_it != t_end; t_it++) {
+				if (t_it->first == it->first) {
+					break;
+				}
+			}
+			if (t_it == t_end) {
+				target.push_back(*it);
+			} else if (t_it->second != it->second) {
+				t_it->second.append(1, ',');
+				t_it->second.append(it->second);
+			}
+		}
+	}
+
+	bool isReady(const Job &job, unsigned long long now) const {
+		return draining || job.readyTime <= now;
+	}
+
+	Job takeNextJob(boost::unique_lock<boost::mutex> &l) {
+		while (true) {
+			unsigned long long now = SystemTime::getMsec(true);
+			unsigned long long earliest = 0;
+			list<Job>::iterator it, end = queue.end();
+
+			for (it = queue.begin(); it != end; it++) {
+				if (isReady(*it, now)) {
+					Job job = *it;
+					queue.erase(it);
+					return job;
+				} else if (earliest == 0 || it->readyTime < earliest) {
+					earliest = it->readyTime;
+				}
+			}
+
+			if (queue.empty()) {
+				cond.wait(l);
+			} else {
+				cond.timed_wait(l, boost::posix_time::milliseconds(earliest - now));
+			}
+		}
+	}
+
+public:
+	HookScriptExecutor(unsigned int batchTime = 0)
+		: batchTime(batchTime),
+		  running(0),
+		  draining(false)
+		{ }
+
+	/**
+	 * Schedules the given hook scripts to be run in the background.
+	 * Hook scripts with the same non-empty `batchKey` may be merged
+	 * into a single invocation, as described in the class description.
+	 */
+	void schedule(const HookScriptOptions &options, const string &batchKey = string()) {
+		boost::lock_guard<boost::mutex> l(syncher);
+
+		if (batchTime > 0 && !batchKey.empty()) {
+			list<Job>::iterator it, end = queue.end();
+			for (it = queue.begin(); it != end; it++) {
+				if (it->batchKey == batchKey) {
+					mergeEnvironment(it->options.environment, options.environment);
+					return;
+				}
+			}
+		}
+
+		Job job;
+		job.options = options;
+		job.readyTime = SystemTime::getMsec(true);
+		if (batchTime > 0 && !batchKey.empty()) {
+			job.batchKey = batchKey;
+			job.readyTime += batchTime;
+		}
+		queue.push_back(job);
+		cond.notify_one();
+	}
+
+	/**
+	 * Runs scheduled hook scripts until the calling thread is interrupted.
+	 * Hook scripts that haven't been started by then are not run.
+	 */
+	void run() {
+		TRACE_POINT();
+		boost::unique_lock<boost::mutex> l(syncher);
+		while (true) {
+			UPDATE_TRACE_POINT();
+			Job job = takeNextJob(l);
+			running++;
+			l.unlock();
+
+			try {
+				runHookScripts(job.options);
+			} catch (...) {
+				l.lock();
+				running--;
+				idleCond.notify_all();
+				throw;
+			}
+
+			l.lock();
+			running--;
+			idleCond.notify_all();
+		}
+	}
+
+	/**
+	 * Runs all scheduled hook scripts without waiting for their batch time,
+	 * and waits until they're done. There must be at least one thread in
+	 * run().
+	 */
+	void drain() {
+		boost::unique_lock<boost::mutex> l(syncher);
+		draining = true;
+		cond.notify_all();
+		while (!queue.empty() || running > 0) {
+			idleCond.wait(l);
+		}
+		draining = false;
+	}
+
+	unsigned int getPendingCount() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return queue.size() + running;
+	}
+};
+
+typedef boost::shared_ptr<HookScriptExecutor> HookScriptExecutorPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_HOOK_SCRIPT_EXECUTOR_H_ */
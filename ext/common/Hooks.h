@@ -29,10 +29,12 @@
 #include <vector>
 #include <utility>
 
+#include <boost/foreach.hpp>
 #include <oxt/backtrace.hpp>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <cstdio>
 #include <cerrno>
 #include <cstring>
@@ -43,6 +45,7 @@
 #include <Logging.h>
 #include <Utils.h>
 #include <Utils/StrIntUtils.h>
+#include <Utils/SystemTime.h>
 #include <Utils/VariantMap.h>
 
 namespace Passenger {
@@ -59,9 +62,13 @@ struct HookScriptOptions {
 	// Optional.
 	const VariantMap *agentsOptions;
 	vector< pair<string, string> > environment;
+	/** The number of milliseconds that a hook script may run. Hook scripts
+	 * that take longer are killed and count as failed. 0 means no limit. */
+	unsigned int timeout;
 
 	HookScriptOptions()
-		: agentsOptions(NULL)
+		: agentsOptions(NULL),
+		  timeout(0)
 		{ }
 };
 
@@ -118,6 +125,41 @@ namespace {
 	}
 }
 
+namespace {
+	inline bool
+	waitForHookScript(const HookScriptOptions &options, const string &command,
+		pid_t pid, int &status)
+	{
+		unsigned long long deadline = SystemTime::getMsec(true) + options.timeout;
+		int ret, e;
+
+		do {
+			ret = waitpid(pid, &status, (options.timeout == 0) ? 0 : WNOHANG);
+			if (ret == 0) {
+				if (SystemTime::getMsec(true) >= deadline) {
+					kill(pid, SIGKILL);
+					waitpid(pid, &status, 0);
+					P_ERROR("Hook script " << command << " (PID " << pid <<
+						") did not finish within " << options.timeout <<
+						" msec, so it has been killed");
+					return false;
+				}
+				usleep(10000);
+			}
+		} while (ret == 0 || (ret == -1 && errno == EINTR));
+
+		if (ret == -1) {
+			e = errno;
+			P_ERROR("Unable to wait for hook script " << command <<
+				" (PID " << pid << "): " << strerror(e) << " (errno=" <<
+				e << ")");
+			return false;
+		} else {
+			return true;
+		}
+	}
+}
+
 inline bool
 runSingleHookScript(HookScriptOptions &options, const string &command,
 	const vector< pair<string, string> > &envvars)
@@ -149,11 +191,7 @@ runSingleHookScript(HookScriptOptions &options, const string &command,
 			": " << strerror(e) << " (errno=" << e << ")");
 		return false;
 
-	} else if (waitpid(pid, &status, 0) == -1) {
-		e = errno;
-		P_ERROR("Unable to wait for hook script " << command <<
-			" (PID " << pid << "): " << strerror(e) << " (errno=" <<
-			e << ")");
+	} else if (!waitForHookScript(options, command, pid, status)) {
 		return false;
 
 	} else {
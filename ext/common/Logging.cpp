@@ -22,8 +22,15 @@
  *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  *  THE SOFTWARE.
  */
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/bind.hpp>
 #include <iomanip>
+#include <algorithm>
+#include <vector>
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
 #include <Logging.h>
@@ -108,6 +115,216 @@ _writeLogEntry(const std::string &str) {
 	_writeLogEntry(StaticString(str));
 }
 
+
+/********** Asynchronous logging **********/
+
+/**
+ * A ring buffer of formatted log entries with a single producer, the thread
+ * that owns it, and a single consumer, the async logging thread. `head` and
+ * `tail` are the total number of bytes ever written and read. Entries are
+ * only published by advancing `head` after they've been copied in
+ * completely, so the consumer never sees a partial entry.
+ */
+struct LogRingBuffer {
+	char *data;
+	size_t capacity;
+	boost::atomic<size_t> head;
+	boost::atomic<size_t> tail;
+	/** Set when the owning thread has exited. */
+	boost::atomic<bool> orphaned;
+
+	LogRingBuffer(size_t _capacity)
+		: data(new char[_capacity]),
+		  capacity(_capacity)
+	{
+		head = 0;
+		tail = 0;
+		orphaned = false;
+	}
+
+	~LogRingBuffer() {
+		delete[] data;
+	}
+
+	bool push(const StaticString &str) {
+		size_t h = head.load(boost::memory_order_relaxed);
+		size_t t = tail.load(boost::memory_order_acquire);
+		if (str.size() > capacity - (h - t)) {
+			return false;
+		}
+
+		size_t offset = h % capacity;
+		size_t first = std::min(str.size(), capacity - offset);
+		memcpy(data + offset, str.data(), first);
+		memcpy(data, str.data() + first, str.size() - first);
+		head.store(h + str.size(), boost::memory_order_release);
+		return true;
+	}
+
+	void drain(string &output) {
+		size_t h = head.load(boost::memory_order_acquire);
+		size_t t = tail.load(boost::memory_order_relaxed);
+		size_t offset = t % capacity;
+		size_t first = std::min(h - t, capacity - offset);
+		output.append(data + offset, first);
+		output.append(data, h - t - first);
+		tail.store(h, boost::memory_order_release);
+	}
+};
+
+static boost::atomic<bool> asyncLogging(false);
+static boost::atomic<unsigned long long> droppedLogEntries(0);
+static unsigned int asyncBufferSize;
+static oxt::thread *asyncLoggingThread = NULL;
+
+/** Protects the fields that follow. */
+static boost::mutex asyncLoggingSyncher;
+static boost::condition_variable asyncLoggingCond;
+static vector<LogRingBuffer *> ringBuffers;
+static bool asyncLoggingQuit;
+/** Whether a thread logged something after the logging thread last woke up. */
+static boost::atomic<bool> asyncLogsPending(false);
+
+static void
+releaseRingBuffer(LogRingBuffer *buffer) {
+	boost::lock_guard<boost::mutex> l(asyncLoggingSyncher);
+	if (asyncLoggingThread != NULL) {
+		// Let the logging thread write the remaining entries first.
+		buffer->orphaned = true;
+	} else {
+		string remaining;
+		buffer->drain(remaining);
+		_writeLogEntry(StaticString(remaining));
+		ringBuffers.erase(std::find(ringBuffers.begin(), ringBuffers.end(), buffer));
+		delete buffer;
+	}
+}
+
+static boost::thread_specific_ptr<LogRingBuffer> threadRingBuffer(releaseRingBuffer);
+
+static LogRingBuffer *
+getThreadRingBuffer() {
+	LogRingBuffer *buffer = threadRingBuffer.get();
+	if (OXT_UNLIKELY(buffer == NULL)) {
+		buffer = new LogRingBuffer(asyncBufferSize);
+		boost::lock_guard<boost::mutex> l(asyncLoggingSyncher);
+		ringBuffers.push_back(buffer);
+		threadRingBuffer.reset(buffer);
+	}
+	return buffer;
+}
+
+/**
+ * Moves the contents of all ring buffers into `batch`, and frees the
+ * buffers of threads that have exited. Must be called while holding
+ * `asyncLoggingSyncher`.
+ */
+static void
+drainRingBuffers(string &batch, unsigned long long &lastDropped) {
+	vector<LogRingBuffer *>::iterator it = ringBuffers.begin();
+	while (it != ringBuffers.end()) {
+		LogRingBuffer *buffer = *it;
+		buffer->drain(batch);
+		if (buffer->orphaned) {
+			it = ringBuffers.erase(it);
+			delete buffer;
+		} else {
+			it++;
+		}
+	}
+
+	unsigned long long dropped = droppedLogEntries.load();
+	if (dropped != lastDropped) {
+		std::stringstream sstream;
+		_prepareLogEntry(sstream, __FILE__, __LINE__);
+		sstream << (dropped - lastDropped) << " log entries were dropped " <<
+			"because they were logged faster than they could be written\n";
+		batch.append(sstream.str());
+		lastDropped = dropped;
+	}
+}
+
+static void
+asyncLoggingMain(unsigned long long lastDropped) {
+	this_thread::disable_interruption di;
+	this_thread::disable_syscall_interruption dsi;
+	boost::unique_lock<boost::mutex> l(asyncLoggingSyncher);
+	string batch;
+
+	while (!asyncLoggingQuit) {
+		asyncLogsPending = false;
+		drainRingBuffers(batch, lastDropped);
+		if (!batch.empty()) {
+			// Don't block threads that create their ring buffer while
+			// we're writing.
+			l.unlock();
+			_writeLogEntry(StaticString(batch));
+			batch.clear();
+			l.lock();
+		}
+		if (!asyncLogsPending && !asyncLoggingQuit) {
+			// Threads only notify us after the first entry that they log
+			// since we last woke up, so we also wake up periodically for
+			// entries that were logged in the meantime.
+			asyncLoggingCond.timed_wait(l, boost::posix_time::milliseconds(100));
+		}
+	}
+	drainRingBuffers(batch, lastDropped);
+	_writeLogEntry(StaticString(batch));
+}
+
+void
+startAsyncLogging(unsigned int bufferSize) {
+	boost::lock_guard<boost::mutex> l(asyncLoggingSyncher);
+	if (asyncLoggingThread == NULL) {
+		asyncBufferSize = bufferSize;
+		asyncLoggingQuit = false;
+		asyncLoggingThread = new oxt::thread(
+			boost::bind(asyncLoggingMain, droppedLogEntries.load()),
+			"Async logging", 64 * 1024);
+		asyncLogging = true;
+	}
+}
+
+void
+stopAsyncLogging() {
+	boost::unique_lock<boost::mutex> l(asyncLoggingSyncher);
+	if (asyncLoggingThread != NULL) {
+		asyncLogging = false;
+		asyncLoggingQuit = true;
+		asyncLoggingCond.notify_one();
+		l.unlock();
+		asyncLoggingThread->join();
+		l.lock();
+		delete asyncLoggingThread;
+		asyncLoggingThread = NULL;
+	}
+}
+
+unsigned long long
+getDroppedLogEntries() {
+	return droppedLogEntries.load();
+}
+
+void
+_writeLogEntry(const std::string &str, int level) {
+	if (!asyncLogging.load(boost::memory_order_relaxed) || level < LVL_INFO) {
+		_writeLogEntry(StaticString(str));
+		return;
+	}
+
+	LogRingBuffer *buffer = getThreadRingBuffer();
+	if (OXT_UNLIKELY(str.size() > buffer->capacity)) {
+		_writeLogEntry(StaticString(str));
+	} else if (OXT_UNLIKELY(!buffer->push(str))) {
+		droppedLogEntries++;
+	} else if (!asyncLogsPending.exchange(true)) {
+		// Notifying without holding the lock may occasionally wake up
+		// the logging thread too late, but it also wakes up periodically.
+		asyncLoggingCond.notify_one();
+	}
+}
+
 static void
 realPrintAppOutput(char *buf, unsigned int bufSize,
 	const char *pidStr, unsigned int pidStrLen,
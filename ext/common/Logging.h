@@ -64,6 +64,29 @@ void setLogLevel(int value);
 bool setDebugFile(const char *logFile = NULL);
 void _prepareLogEntry(std::stringstream &sstream, const char *file, unsigned int line);
 void _writeLogEntry(const std::string &str);
+void _writeLogEntry(const std::string &str, int level);
+
+/**
+ * Makes log entries be written by a background thread instead of by the
+ * thread that logs them. Every thread appends its formatted entries to its
+ * own lock-free ring buffer of `bufferSize` bytes, and the background thread
+ * writes the contents of all buffers in batches. When a thread's buffer is
+ * full its entries are dropped and counted; the background thread logs how
+ * many were dropped. Errors and critical errors are always written
+ * synchronously, so that they're not lost when the process crashes.
+ *
+ * Entries from different threads may be written slightly out of order.
+ * The log level checks are not affected, so disabled log levels still
+ * cost nothing.
+ */
+void startAsyncLogging(unsigned int bufferSize = 64 * 1024);
+/**
+ * Writes all buffered log entries and stops the background thread.
+ * Entries are written synchronously again afterwards.
+ */
+void stopAsyncLogging();
+/** The number of log entries that were dropped because a buffer was full. */
+unsigned long long getDroppedLogEntries();
 
 
 enum PassengerLogLevel {
@@ -84,7 +107,7 @@ enum PassengerLogLevel {
 			std::stringstream sstream; \
 			Passenger::_prepareLogEntry(sstream, __FILE__, __LINE__); \
 			sstream << expr << "\n"; \
-			Passenger::_writeLogEntry(sstream.str()); \
+			Passenger::_writeLogEntry(sstream.str(), (level)); \
 		} \
 	} while (false)
 
@@ -194,6 +194,26 @@ public:
 		return result;
 	}
 	
+	/**
+	 * Reads the server's answer to whether we may execute the command that
+	 * we've just sent, which the server sends before anything else.
+	 *
+	 * @throws SystemException
+	 * @throws IOException The server closed the connection.
+	 * @throws SecurityException We may not execute the command.
+	 * @throws TimeoutException
+	 * @throws boost::thread_interrupted
+	 */
+	void checkSecurityResponse(unsigned long long *timeout = NULL) {
+		vector<string> args;
+		if (!readArray(args, timeout)) {
+			throw IOException("The message server closed the connection unexpectedly");
+		} else if (args.empty() || args[0] != "Passed security") {
+			autoDisconnect();
+			throw SecurityException(args.empty() ? "Unknown security error" : args[0]);
+		}
+	}
+	
 	/**
 	 * @throws SystemException
 	 * @throws SecurityException
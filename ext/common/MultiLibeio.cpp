@@ -27,6 +27,30 @@
 #include <oxt/system_calls.hpp>
 #include <cassert>
 
+#if !defined(PASSENGER_IO_URING_SUPPORTED) && defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#include <linux/io_uring.h>
+		#ifdef IORING_FEAT_FAST_POLL
+			#define PASSENGER_IO_URING_SUPPORTED 1
+		#endif
+	#endif
+#endif
+#ifndef PASSENGER_IO_URING_SUPPORTED
+	#define PASSENGER_IO_URING_SUPPORTED 0
+#endif
+
+#if PASSENGER_IO_URING_SUPPORTED
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <cstring>
+	#include <map>
+	#include <boost/weak_ptr.hpp>
+	#include <boost/enable_shared_from_this.hpp>
+#endif
+
 #ifndef PREAD_AND_PWRITE_ARE_NOT_THREADSAFE
 	#ifdef __APPLE__
 		#define PREAD_AND_PWRITE_ARE_NOT_THREADSAFE 1
@@ -45,6 +69,7 @@ static boost::condition_variable cond;
 static bool shouldPoll = false;
 static oxt::thread *thr = NULL;
 static bool quit = false;
+static bool ioUringEnabled = false;
 
 
 struct Data {
@@ -108,6 +133,315 @@ executeWrapper(eio_req *req) {
 	data->execute(req);
 }
 
+#if PASSENGER_IO_URING_SUPPORTED
+	/**
+	 * An io_uring whose completions are reaped by a libev event loop. It must
+	 * only be used from that event loop's thread. The io_uring_* system calls
+	 * are used directly, so that no dependency on liburing is needed.
+	 */
+	class IoUringContext: public boost::enable_shared_from_this<IoUringContext> {
+	private:
+		static const unsigned int ENTRIES = 64;
+
+		struct Operation {
+			MultiLibeio::Callback callback;
+			eio_req req;
+			string path;
+
+			Operation(int type, const MultiLibeio::Callback &_callback)
+				: callback(_callback)
+			{
+				memset(&req, 0, sizeof(req));
+				req.type = type;
+			}
+		};
+
+		static boost::mutex registrySyncher;
+		static map< SafeLibev *, boost::weak_ptr<IoUringContext> > registry;
+
+		SafeLibevPtr libev;
+		int ringFd;
+		int eventFd;
+		ev_io watcher;
+
+		void *sqRing, *cqRing;
+		size_t sqRingSize, cqRingSize;
+		struct io_uring_sqe *sqes;
+		size_t sqesSize;
+		unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+		unsigned int *cqHead, *cqTail, *cqMask;
+		struct io_uring_cqe *cqes;
+		unsigned int cqEntries;
+
+		/** Number of submitted operations that haven't completed yet. */
+		unsigned int inFlight;
+		/** Keeps this object alive while operations are in flight. */
+		boost::shared_ptr<IoUringContext> selfWhileBusy;
+
+		IoUringContext(const SafeLibevPtr &_libev)
+			: libev(_libev),
+			  ringFd(-1),
+			  eventFd(-1),
+			  sqRing(MAP_FAILED),
+			  cqRing(MAP_FAILED),
+			  sqes((struct io_uring_sqe *) MAP_FAILED),
+			  inFlight(0)
+		{
+			ev_io_init(&watcher, onEventFdReadable, -1, EV_READ);
+			watcher.data = this;
+		}
+
+		static int ioUringSetup(unsigned int entries, struct io_uring_params *params) {
+			return (int) syscall(__NR_io_uring_setup, entries, params);
+		}
+
+		static int ioUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete,
+			unsigned int flags)
+		{
+			return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+				flags, NULL, 0);
+		}
+
+		static int ioUringRegister(int fd, unsigned int opcode, void *arg, unsigned int nargs) {
+			return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+		}
+
+		/** IORING_FEAT_FAST_POLL implies support for all opcodes that we use. */
+		static bool featuresSupported(const struct io_uring_params &params) {
+			return params.features & IORING_FEAT_FAST_POLL;
+		}
+
+		static void *mapRing(int fd, size_t size, off_t offset) {
+			return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				fd, offset);
+		}
+
+		bool initialize() {
+			struct io_uring_params params;
+
+			memset(&params, 0, sizeof(params));
+			ringFd = ioUringSetup(ENTRIES, &params);
+			if (ringFd == -1 || !featuresSupported(params)) {
+				return false;
+			}
+
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			sqesSize   = params.sq_entries * sizeof(struct io_uring_sqe);
+			sqRing = mapRing(ringFd, sqRingSize, IORING_OFF_SQ_RING);
+			cqRing = mapRing(ringFd, cqRingSize, IORING_OFF_CQ_RING);
+			sqes   = (struct io_uring_sqe *) mapRing(ringFd, sqesSize, IORING_OFF_SQES);
+			if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+				return false;
+			}
+
+			sqHead  = (unsigned int *) ((char *) sqRing + params.sq_off.head);
+			sqTail  = (unsigned int *) ((char *) sqRing + params.sq_off.tail);
+			sqMask  = (unsigned int *) ((char *) sqRing + params.sq_off.ring_mask);
+			sqArray = (unsigned int *) ((char *) sqRing + params.sq_off.array);
+			cqHead  = (unsigned int *) ((char *) cqRing + params.cq_off.head);
+			cqTail  = (unsigned int *) ((char *) cqRing + params.cq_off.tail);
+			cqMask  = (unsigned int *) ((char *) cqRing + params.cq_off.ring_mask);
+			cqes    = (struct io_uring_cqe *) ((char *) cqRing + params.cq_off.cqes);
+			cqEntries = params.cq_entries;
+
+			// <sys/eventfd.h> doesn't compile when an ambiguous uint64_t is
+			// in scope, which is the case wherever this file is included.
+			eventFd = (int) syscall(__NR_eventfd2, 0, O_NONBLOCK | O_CLOEXEC);
+			if (eventFd == -1
+			 || ioUringRegister(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) == -1)
+			{
+				return false;
+			}
+			fcntl(ringFd, F_SETFD, FD_CLOEXEC);
+			ev_io_set(&watcher, eventFd, EV_READ);
+			return true;
+		}
+
+		/**
+		 * Submits an operation that has been prepared with prepare().
+		 * Returns NULL if the kernel didn't accept it, in which case the
+		 * caller should fall back to libeio.
+		 */
+		eio_req *submit(Operation *op, const struct io_uring_sqe &sqe) {
+			auto_ptr<Operation> guard(op);
+			unsigned int head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			unsigned int tail = *sqTail;
+			unsigned int index = tail & *sqMask;
+
+			// We submit every entry right away, so the submission
+			// queue is only full if the kernel refused entries earlier.
+			// Completions that don't fit in the completion queue are only
+			// delivered after another io_uring_enter() call, so don't let
+			// that happen.
+			if (tail - head > *sqMask || inFlight >= cqEntries) {
+				return NULL;
+			}
+			sqes[index] = sqe;
+			sqes[index].user_data = (unsigned long long) (size_t) op;
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+			int ret;
+			do {
+				ret = ioUringEnter(ringFd, 1, 0, 0);
+			} while (ret == -1 && errno == EINTR);
+			if (ret != 1) {
+				// The kernel hasn't consumed the entry, so take it back.
+				__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+				return NULL;
+			}
+
+			if (inFlight == 0) {
+				selfWhileBusy = shared_from_this();
+				ev_io_start(libev->getLoop(), &watcher);
+			}
+			inFlight++;
+			return &guard.release()->req;
+		}
+
+		static void onEventFdReadable(struct ev_loop *loop, ev_io *w, int revents) {
+			IoUringContext *self = (IoUringContext *) w->data;
+			self->reapCompletions();
+		}
+
+		void reapCompletions() {
+			char counter[8];
+			ssize_t ret = ::read(eventFd, counter, sizeof(counter));
+			(void) ret;
+
+			unsigned int head = *cqHead;
+			while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+				auto_ptr<Operation> op((Operation *) (size_t) cqe->user_data);
+				int result = cqe->res;
+
+				head++;
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+				inFlight--;
+
+				if (result < 0) {
+					op->req.result  = -1;
+					op->req.errorno = -result;
+				} else {
+					op->req.result  = result;
+				}
+				op->callback(op->req);
+			}
+
+			if (inFlight == 0) {
+				ev_io_stop(libev->getLoop(), &watcher);
+				// This may destroy this object, so it must come last.
+				boost::shared_ptr<IoUringContext> self;
+				self.swap(selfWhileBusy);
+			}
+		}
+
+		static struct io_uring_sqe prepare(int opcode, int fd, const void *addr,
+			unsigned int len, off_t offset)
+		{
+			struct io_uring_sqe sqe;
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = opcode;
+			sqe.fd     = fd;
+			sqe.addr   = (unsigned long long) (size_t) addr;
+			sqe.len    = len;
+			sqe.off    = offset;
+			return sqe;
+		}
+
+	public:
+		/** Checks whether the kernel supports everything that we need. */
+		static bool probe() {
+			struct io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			int fd = ioUringSetup(1, &params);
+			if (fd == -1) {
+				return false;
+			} else {
+				close(fd);
+				return featuresSupported(params);
+			}
+		}
+
+		/**
+		 * Returns the io_uring of the given event loop, creating it if necessary.
+		 * Returns NULL if it cannot be created.
+		 */
+		static boost::shared_ptr<IoUringContext> get(const SafeLibevPtr &libev) {
+			boost::unique_lock<boost::mutex> l(registrySyncher);
+			boost::shared_ptr<IoUringContext> result = registry[libev.get()].lock();
+			if (result == NULL) {
+				result.reset(new IoUringContext(libev));
+				if (result->initialize()) {
+					registry[libev.get()] = result;
+				} else {
+					registry.erase(libev.get());
+					// The destructor locks the registry.
+					l.unlock();
+					result.reset();
+				}
+			}
+			return result;
+		}
+
+		~IoUringContext() {
+			assert(inFlight == 0);
+			{
+				boost::lock_guard<boost::mutex> l(registrySyncher);
+				map< SafeLibev *, boost::weak_ptr<IoUringContext> >::iterator it =
+					registry.find(libev.get());
+				if (it != registry.end() && it->second.expired()) {
+					registry.erase(it);
+				}
+			}
+			if (sqes != MAP_FAILED) {
+				munmap(sqes, sqesSize);
+			}
+			if (cqRing != MAP_FAILED) {
+				munmap(cqRing, cqRingSize);
+			}
+			if (sqRing != MAP_FAILED) {
+				munmap(sqRing, sqRingSize);
+			}
+			if (eventFd != -1) {
+				close(eventFd);
+			}
+			if (ringFd != -1) {
+				close(ringFd);
+			}
+		}
+
+		eio_req *open(const char *path, int flags, mode_t mode, const MultiLibeio::Callback &callback) {
+			Operation *op = new Operation(EIO_OPEN, callback);
+			op->path = path;
+			struct io_uring_sqe sqe = prepare(IORING_OP_OPENAT, AT_FDCWD,
+				op->path.c_str(), mode, 0);
+			sqe.open_flags = flags | O_CLOEXEC;
+			return submit(op, sqe);
+		}
+
+		eio_req *read(int fd, void *buf, size_t length, off_t offset,
+			const MultiLibeio::Callback &callback)
+		{
+			return submit(new Operation(EIO_READ, callback),
+				prepare(IORING_OP_READ, fd, buf, length, offset));
+		}
+
+		eio_req *write(int fd, void *buf, size_t length, off_t offset,
+			const MultiLibeio::Callback &callback)
+		{
+			return submit(new Operation(EIO_WRITE, callback),
+				prepare(IORING_OP_WRITE, fd, buf, length, offset));
+		}
+	};
+
+	boost::mutex IoUringContext::registrySyncher;
+	map< SafeLibev *, boost::weak_ptr<IoUringContext> > IoUringContext::registry;
+#else
+	class IoUringContext { };
+#endif
+
 #if PREAD_AND_PWRITE_ARE_NOT_THREADSAFE
 	static boost::mutex preadWriteLock;
 
@@ -128,6 +462,9 @@ void
 MultiLibeio::init() {
 	eio_init(wantPoll, NULL);
 	thr = new oxt::thread(threadMain, "MultiLibeio dispatcher", 1024 * 64);
+	#if PASSENGER_IO_URING_SUPPORTED
+		ioUringEnabled = IoUringContext::probe();
+	#endif
 }
 
 void
@@ -142,6 +479,45 @@ MultiLibeio::shutdown() {
 	quit = false;
 }
 
+bool
+MultiLibeio::usingIoUring() {
+	return ioUringEnabled;
+}
+
+void
+MultiLibeio::setIoUringEnabled(bool enabled) {
+	#if PASSENGER_IO_URING_SUPPORTED
+		ioUringEnabled = enabled && IoUringContext::probe();
+	#endif
+}
+
+IoUringContext *
+MultiLibeio::getRing() {
+	#if PASSENGER_IO_URING_SUPPORTED
+		if (!ioUringEnabled) {
+			return NULL;
+		} else if (ring == NULL) {
+			ring = IoUringContext::get(libev);
+		}
+		return ring.get();
+	#else
+		return NULL;
+	#endif
+}
+
+#if PASSENGER_IO_URING_SUPPORTED
+	#define TRY_IO_URING(code) \
+		do { \
+			IoUringContext *ring = getRing(); \
+			eio_req *result; \
+			if (ring != NULL && (result = ring->code) != NULL) { \
+				return result; \
+			} \
+		} while (false)
+#else
+	#define TRY_IO_URING(code) do { } while (false)
+#endif
+
 #define MAKE_REQUEST(code) \
 	eio_req *result; \
 	Data *data = new Data(libev, callback); \
@@ -155,6 +531,7 @@ MultiLibeio::shutdown() {
 
 eio_req *
 MultiLibeio::open(const char *path, int flags, mode_t mode, int pri, const Callback &callback) {
+	TRY_IO_URING(open(path, flags, mode, callback));
 	MAKE_REQUEST(
 		result = eio_open(path, flags, mode, pri, dispatch, data);
 	);
@@ -162,6 +539,7 @@ MultiLibeio::open(const char *path, int flags, mode_t mode, int pri, const Callb
 
 eio_req *
 MultiLibeio::read(int fd, void *buf, size_t length, off_t offset, int pri, const Callback &callback) {
+	TRY_IO_URING(read(fd, buf, length, offset, callback));
 	#if PREAD_AND_PWRITE_ARE_NOT_THREADSAFE
 		return custom(boost::bind(lockedPread, fd, buf, length, offset, _1),
 			pri, callback);
@@ -174,6 +552,7 @@ MultiLibeio::read(int fd, void *buf, size_t length, off_t offset, int pri, const
 
 eio_req *
 MultiLibeio::write(int fd, void *buf, size_t length, off_t offset, int pri, const Callback &callback) {
+	TRY_IO_URING(write(fd, buf, length, offset, callback));
 	#if PREAD_AND_PWRITE_ARE_NOT_THREADSAFE
 		return custom(boost::bind(lockedPwrite, fd, buf, length, offset, _1),
 			pri, callback);
@@ -26,6 +26,7 @@
 #define _PASSENGER_MULTI_LIBEIO_H_
 
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <eio.h>
 #include <SafeLibev.h>
 
@@ -34,9 +35,24 @@ namespace Passenger {
 using namespace boost;
 
 
+class IoUringContext;
+
+/**
+ * Performs asynchronous file I/O on behalf of a libev event loop. Callbacks
+ * are called in the event loop's thread.
+ *
+ * On Linux kernels that support it, open(), read() and write() are
+ * submitted to an io_uring that is shared by all MultiLibeio objects of the
+ * same event loop, and whose completions are reaped by that event loop
+ * through an eventfd. Otherwise, and for custom(), the operations are
+ * performed by libeio's thread pool.
+ */
 class MultiLibeio {
 private:
 	SafeLibevPtr libev;
+	boost::shared_ptr<IoUringContext> ring;
+
+	IoUringContext *getRing();
 
 public:
 	typedef boost::function<void (eio_req *req)> ExecuteCallback;
@@ -45,6 +61,15 @@ public:
 	static void init();
 	static void shutdown();
 
+	/** Whether open(), read() and write() are performed with io_uring. */
+	static bool usingIoUring();
+
+	/**
+	 * Allows disabling io_uring so that libeio is used instead, even if
+	 * the kernel supports io_uring. Useful for unit tests.
+	 */
+	static void setIoUringEnabled(bool enabled);
+
 	MultiLibeio() { }
 
 	MultiLibeio(const SafeLibevPtr &_libev)
@@ -55,6 +80,7 @@ public:
 		return libev;
 	}
 
+	/* With io_uring, <tt>pri</tt> is ignored. */
 	eio_req *open(const char *path, int flags, mode_t mode, int pri, const Callback &callback);
 	eio_req *read(int fd, void *buf, size_t length, off_t offset, int pri, const Callback &callback);
 	eio_req *write(int fd, void *buf, size_t length, off_t offset, int pri, const Callback &callback);
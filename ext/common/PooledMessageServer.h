@@ -0,0 +1,372 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_POOLED_MESSAGE_SERVER_H_
+#define _PASSENGER_POOLED_MESSAGE_SERVER_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <oxt/backtrace.hpp>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
+
+#include <EventedMessageServer.h>
+#include <MessageServer.h>
+#include <SafeLibev.h>
+#include <Logging.h>
+#include <Utils/BlockingQueue.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+
+/* This source file follows the security guidelines written in Account.h. */
+
+class PooledMessageClient: public EventedMessageClient {
+public:
+	boost::shared_ptr<MessageServer::CommonClientContext> commonContext;
+	vector<MessageServer::ClientContextPtr> handlerSpecificContexts;
+	/** Data that the client sent while a message was being processed. */
+	string backlog;
+	/** Whether a worker thread is processing a message from this client. */
+	bool processing;
+
+	PooledMessageClient(struct ev_loop *loop, const FileDescriptor &fd)
+		: EventedMessageClient(loop, fd),
+		  processing(false)
+		{ }
+};
+
+/**
+ * Serves MessageServer::Handlers the way MessageServer does, but without
+ * one thread per client. Connections are accepted, authenticated and
+ * parsed on an event loop. When a client has sent a message, the server
+ * stops reading from it and passes the message to one of a small number
+ * of worker threads, which call the handlers' processMessage() methods.
+ * Handlers may thus block, e.g. on the pool lock, and they write their
+ * replies to CommonClientContext::fd just like they do with MessageServer:
+ * the socket is in blocking mode while a worker is processing a message.
+ * Once the handlers are done, the event loop resumes reading.
+ *
+ * Messages from a single client are processed one at a time, in order, so
+ * the same thread-safety rules apply to handlers as with MessageServer.
+ * newClient() and clientDisconnected() are called on the event loop
+ * thread and must not block. Handlers must not read from the client
+ * socket themselves.
+ *
+ * The event loop must be stopped before the server is destroyed.
+ */
+class PooledMessageServer: public EventedMessageServer {
+public:
+	static const unsigned int WORKER_THREAD_STACK_SIZE = 1024 * 128;
+
+private:
+	typedef boost::function<void ()> Job;
+
+	SafeLibevPtr libev;
+	string socketFilename;
+	vector<MessageServer::HandlerPtr> handlers;
+	/** An empty job tells a worker thread to exit. */
+	BlockingQueue<Job> queue;
+	vector<oxt::thread *> threads;
+
+	static FileDescriptor createSocket(const string &socketFilename) {
+		FileDescriptor fd(createUnixServer(socketFilename.c_str()));
+		int ret;
+		do {
+			ret = chmod(socketFilename.c_str(),
+				S_ISVTX |
+				S_IRUSR | S_IWUSR | S_IXUSR |
+				S_IRGRP | S_IWGRP | S_IXGRP |
+				S_IROTH | S_IWOTH | S_IXOTH);
+		} while (ret == -1 && errno == EINTR);
+		return fd;
+	}
+
+	static void setBlocking(int fd, bool blocking) {
+		int flags, ret;
+
+		do {
+			flags = fcntl(fd, F_GETFL);
+		} while (flags == -1 && errno == EINTR);
+		if (flags == -1) {
+			int e = errno;
+			throw SystemException("Cannot get file descriptor flags", e);
+		}
+		if (blocking) {
+			flags &= ~O_NONBLOCK;
+		} else {
+			flags |= O_NONBLOCK;
+		}
+		do {
+			ret = fcntl(fd, F_SETFL, flags);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			throw SystemException("Cannot set file descriptor flags", e);
+		}
+	}
+
+	void threadMain() {
+		TRACE_POINT();
+		try {
+			while (true) {
+				UPDATE_TRACE_POINT();
+				Job job = queue.get();
+				if (job.empty()) {
+					break;
+				}
+				job();
+			}
+		} catch (const boost::thread_interrupted &) {
+			P_TRACE(2, "PooledMessageServer worker thread interrupted.");
+		}
+	}
+
+	bool dispatchMessage(PooledMessageClient *client, const vector<string> &args) {
+		vector<MessageServer::HandlerPtr>::iterator handler_iter;
+		vector<MessageServer::ClientContextPtr>::iterator context_iter;
+
+		for (handler_iter = handlers.begin(), context_iter = client->handlerSpecificContexts.begin();
+		     handler_iter != handlers.end();
+		     handler_iter++, context_iter++) {
+			if ((*handler_iter)->processMessage(*client->commonContext, *context_iter, args)) {
+				return true;
+			}
+		}
+		P_TRACE(2, "A MessageServer client sent an invalid command: "
+			<< args[0] << " (" << args.size() << " elements)");
+		return false;
+	}
+
+	/** Runs in a worker thread. */
+	void processMessage(PooledMessageClient *client, const vector<string> &args) {
+		TRACE_POINT();
+		bool keepConnection = false;
+
+		P_TRACE(4, "MessageServer client " << client->commonContext->name() <<
+			": received message: " << toString(args));
+		try {
+			setBlocking(client->fd, true);
+			keepConnection = dispatchMessage(client, args);
+		} catch (const tracable_exception &e) {
+			P_TRACE(2, "An error occurred in a MessageServer worker thread:\n"
+				<< "   message: " << toString(args) << "\n"
+				<< "   exception: " << e.what() << "\n"
+				<< "   backtrace:\n" << e.backtrace());
+			keepConnection = false;
+		}
+		try {
+			setBlocking(client->fd, false);
+		} catch (const SystemException &) {
+			keepConnection = false;
+		}
+		libev->runLater(boost::bind(&PooledMessageServer::onMessageProcessed, this,
+			client, keepConnection));
+	}
+
+	void onMessageProcessed(PooledMessageClient *client, bool keepConnection) {
+		ScopeGuard guard(boost::bind(&EventedClient::unref, client));
+		client->processing = false;
+		if (!client->ioAllowed()) {
+			// Disconnected while the message was being processed.
+			broadcastDisconnectEvent(client);
+		} else if (!keepConnection) {
+			client->disconnect();
+		} else {
+			client->messageServer.state = EventedMessageClientContext::MS_READING_MESSAGE;
+			client->notifyReads(true);
+			if (!client->backlog.empty()) {
+				string data;
+				data.swap(client->backlog);
+				onDataReceived(client, &data[0], data.size());
+			}
+		}
+	}
+
+	void broadcastDisconnectEvent(PooledMessageClient *client) {
+		if (client->commonContext == NULL) {
+			return;
+		}
+
+		vector<MessageServer::HandlerPtr>::iterator handler_iter;
+		vector<MessageServer::ClientContextPtr>::iterator context_iter;
+
+		for (handler_iter = handlers.begin(), context_iter = client->handlerSpecificContexts.begin();
+		     handler_iter != handlers.end();
+		     handler_iter++, context_iter++) {
+			try {
+				(*handler_iter)->clientDisconnected(*client->commonContext, *context_iter);
+			} catch (const tracable_exception &e) {
+				P_WARN("Error in a MessageServer disconnect handler: " << e.what());
+			}
+		}
+		client->commonContext.reset();
+		client->handlerSpecificContexts.clear();
+	}
+
+protected:
+	virtual EventedClient *createClient(const FileDescriptor &fd) {
+		return new PooledMessageClient(getLoop(), fd);
+	}
+
+	virtual void onClientAuthenticated(EventedMessageClient *_client) {
+		PooledMessageClient *client = (PooledMessageClient *) _client;
+		FileDescriptor fd = client->fd;
+		AccountPtr account = client->messageServer.account;
+		vector<MessageServer::HandlerPtr>::iterator it;
+
+		client->commonContext.reset(new MessageServer::CommonClientContext(
+			fd, account));
+		for (it = handlers.begin(); it != handlers.end(); it++) {
+			client->handlerSpecificContexts.push_back(
+				(*it)->newClient(*client->commonContext));
+		}
+	}
+
+	virtual bool onMessageReceived(EventedMessageClient *_client, const vector<StaticString> &args) {
+		PooledMessageClient *client = (PooledMessageClient *) _client;
+
+		if (client->pendingWrites() > 0) {
+			// A worker can't write the reply in blocking mode while the
+			// event loop is still writing to the same socket.
+			logError(client, "Client sent a message without reading the previous reply.");
+			client->disconnect();
+			return true;
+		}
+
+		vector<string> stringArgs;
+		stringArgs.reserve(args.size());
+		for (unsigned int i = 0; i < args.size(); i++) {
+			stringArgs.push_back(args[i]);
+		}
+
+		client->notifyReads(false);
+		client->processing = true;
+		client->ref();
+		queue.add(boost::bind(&PooledMessageServer::processMessage, this,
+			client, stringArgs));
+		return false;
+	}
+
+	virtual pair<size_t, bool> onOtherDataReceived(EventedMessageClient *_client,
+		const char *data, size_t size)
+	{
+		PooledMessageClient *client = (PooledMessageClient *) _client;
+		client->backlog.append(data, size);
+		return make_pair(size, false);
+	}
+
+	virtual void onClientDisconnected(EventedClient *_client) {
+		PooledMessageClient *client = (PooledMessageClient *) _client;
+		EventedMessageServer::onClientDisconnected(client);
+		if (!client->processing) {
+			broadcastDisconnectEvent(client);
+		}
+	}
+
+public:
+	/**
+	 * Creates a PooledMessageServer that listens on a world-writable Unix
+	 * socket, like MessageServer does.
+	 *
+	 * @throws RuntimeException Something went wrong while setting up the server socket.
+	 * @throws SystemException Something went wrong while setting up the server socket.
+	 * @throws boost::thread_interrupted
+	 */
+	PooledMessageServer(const SafeLibevPtr &_libev, const string &socketFilename,
+		const AccountsDatabasePtr &accountsDatabase, unsigned int threadCount = 2)
+		: EventedMessageServer(_libev->getLoop(), createSocket(socketFilename),
+			accountsDatabase),
+		  libev(_libev)
+	{
+		this->socketFilename = socketFilename;
+		if (threadCount == 0) {
+			threadCount = 1;
+		}
+		for (unsigned int i = 0; i < threadCount; i++) {
+			threads.push_back(new oxt::thread(
+				boost::bind(&PooledMessageServer::threadMain, this),
+				"MessageServer worker " + toString(i + 1),
+				WORKER_THREAD_STACK_SIZE
+			));
+		}
+	}
+
+	~PooledMessageServer() {
+		this_thread::disable_syscall_interruption dsi;
+		this_thread::disable_interruption di;
+
+		// Workers may be blocked on a client that doesn't read its reply.
+		for (unsigned int i = 0; i < threads.size(); i++) {
+			threads[i]->interrupt_and_join();
+			delete threads[i];
+		}
+
+		ClientSet::const_iterator it, end = getClients().end();
+		for (it = getClients().begin(); it != end; it++) {
+			broadcastDisconnectEvent((PooledMessageClient *) *it);
+		}
+		syscalls::unlink(socketFilename.c_str());
+	}
+
+	string getSocketFilename() const {
+		return socketFilename;
+	}
+
+	/**
+	 * Registers a new handler.
+	 *
+	 * @pre The event loop isn't running.
+	 */
+	void addHandler(const MessageServer::HandlerPtr &handler) {
+		handlers.push_back(handler);
+	}
+
+	unsigned int getThreadCount() const {
+		return threads.size();
+	}
+};
+
+typedef boost::shared_ptr<PooledMessageServer> PooledMessageServerPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_POOLED_MESSAGE_SERVER_H_ */
@@ -26,75 +26,327 @@
 #define _PASSENGER_RANDOM_GENERATOR_H_
 
 #include <string>
+#include <cstring>
+#include <cerrno>
 
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/tss.hpp>
 #include <oxt/system_calls.hpp>
+#include <oxt/macros.hpp>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(__linux__)
+	#include <sys/syscall.h>
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+	#include <stdlib.h>
+	#define PASSENGER_HAVE_ARC4RANDOM_BUF
+#endif
 
 #include "StaticString.h"
 #include "Exceptions.h"
 #include "Utils/StrIntUtils.h"
 
 
-/**
- * A random 
- */
 namespace Passenger {
 
 using namespace std;
 using namespace boost;
 using namespace oxt;
 
+
+/**
+ * A ChaCha20 keystream generator (RFC 7539), used as a CSPRNG by
+ * RandomGenerator. After every refill of the output buffer, the first
+ * 32 bytes of fresh keystream become the new key and are erased, so that
+ * a compromise of the state doesn't reveal output that was handed out
+ * earlier ("fast key erasure").
+ *
+ * Not thread-safe. RandomGenerator keeps one per thread.
+ */
+class ChaCha20Rng: public boost::noncopyable {
+public:
+	static const unsigned int KEY_SIZE = 32;
+	static const unsigned int BLOCK_SIZE = 64;
+	/** Number of bytes of output after which the key is refreshed from the kernel. */
+	static const unsigned int RESEED_INTERVAL = 1024 * 1024;
+
+private:
+	static const unsigned int BUFFER_BLOCKS = 16;
+	static const unsigned int BUFFER_SIZE = BUFFER_BLOCKS * BLOCK_SIZE;
+
+	boost::uint32_t key[8];
+	unsigned char buffer[BUFFER_SIZE];
+	/** Number of unused bytes at the end of `buffer`. */
+	unsigned int available;
+	unsigned int outputSinceReseed;
+	unsigned int forkGeneration;
+
+	static boost::uint32_t rotl(boost::uint32_t x, int n) {
+		return (x << n) | (x >> (32 - n));
+	}
+
+	static boost::uint32_t load32(const unsigned char *p) {
+		return (boost::uint32_t) p[0]
+			| ((boost::uint32_t) p[1] << 8)
+			| ((boost::uint32_t) p[2] << 16)
+			| ((boost::uint32_t) p[3] << 24);
+	}
+
+	static void store32(unsigned char *p, boost::uint32_t x) {
+		p[0] = (unsigned char) x;
+		p[1] = (unsigned char) (x >> 8);
+		p[2] = (unsigned char) (x >> 16);
+		p[3] = (unsigned char) (x >> 24);
+	}
+
+	static void quarterRound(boost::uint32_t *x, int a, int b, int c, int d) {
+		x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+		x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+		x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+		x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+	}
+
+	/** Volatile so that the compiler doesn't optimize the erasure away. */
+	static void wipe(void *buf, size_t size) {
+		volatile unsigned char *p = (volatile unsigned char *) buf;
+		while (size > 0) {
+			*p++ = 0;
+			size--;
+		}
+	}
+
+	/** Reads kernel entropy. Never returns short; throws on failure. */
+	static void readEntropy(unsigned char *buf, size_t size) {
+		#if defined(PASSENGER_HAVE_ARC4RANDOM_BUF)
+			arc4random_buf(buf, size);
+			return;
+		#else
+			#if defined(__linux__) && defined(SYS_getrandom)
+				size_t done = 0;
+				while (done < size) {
+					long ret = syscall(SYS_getrandom, buf + done, size - done, 0);
+					if (ret > 0) {
+						done += ret;
+					} else if (ret == -1 && errno == EINTR) {
+						continue;
+					} else {
+						// ENOSYS on kernels older than 3.17.
+						break;
+					}
+				}
+				if (done == size) {
+					return;
+				}
+			#endif
+
+			int fd = syscalls::open("/dev/urandom", O_RDONLY);
+			if (fd == -1) {
+				int e = errno;
+				throw FileSystemException("Cannot open /dev/urandom",
+					e, "/dev/urandom");
+			}
+			size_t pos = 0;
+			while (pos < size) {
+				ssize_t ret = syscalls::read(fd, buf + pos, size - pos);
+				if (ret <= 0) {
+					syscalls::close(fd);
+					throw IOException("Cannot read sufficient data from /dev/urandom");
+				}
+				pos += ret;
+			}
+			syscalls::close(fd);
+		#endif
+	}
+
+	void refill() {
+		boost::uint32_t input[16];
+		unsigned int i;
+
+		input[0] = 0x61707865;
+		input[1] = 0x3320646e;
+		input[2] = 0x79622d32;
+		input[3] = 0x6b206574;
+		memcpy(input + 4, key, sizeof(key));
+		input[13] = input[14] = input[15] = 0;
+		for (i = 0; i < BUFFER_BLOCKS; i++) {
+			input[12] = i;
+			block(input, buffer + i * BLOCK_SIZE);
+		}
+		for (i = 0; i < 8; i++) {
+			key[i] = load32(buffer + 4 * i);
+		}
+		wipe(buffer, KEY_SIZE);
+		wipe(input, sizeof(input));
+		available = BUFFER_SIZE - KEY_SIZE;
+	}
+
+public:
+	/**
+	 * Incremented in the child process after fork(), so that a child
+	 * never repeats its parent's output.
+	 */
+	static volatile unsigned int &forkCounter() {
+		static volatile unsigned int counter = 0;
+		return counter;
+	}
+
+	/**
+	 * The ChaCha20 block function: computes one 64-byte keystream block
+	 * from the 16-word input (constants, key, counter, nonce).
+	 */
+	static void block(const boost::uint32_t input[16], unsigned char output[BLOCK_SIZE]) {
+		boost::uint32_t x[16];
+		int i;
+
+		memcpy(x, input, sizeof(x));
+		for (i = 0; i < 10; i++) {
+			quarterRound(x, 0, 4,  8, 12);
+			quarterRound(x, 1, 5,  9, 13);
+			quarterRound(x, 2, 6, 10, 14);
+			quarterRound(x, 3, 7, 11, 15);
+			quarterRound(x, 0, 5, 10, 15);
+			quarterRound(x, 1, 6, 11, 12);
+			quarterRound(x, 2, 7,  8, 13);
+			quarterRound(x, 3, 4,  9, 14);
+		}
+		for (i = 0; i < 16; i++) {
+			store32(output + 4 * i, x[i] + input[i]);
+		}
+		wipe(x, sizeof(x));
+	}
+
+	ChaCha20Rng() {
+		available = 0;
+		outputSinceReseed = 0;
+		forkGeneration = 0;
+		memset(key, 0, sizeof(key));
+		reseed();
+	}
+
+	~ChaCha20Rng() {
+		wipe(key, sizeof(key));
+		wipe(buffer, sizeof(buffer));
+	}
+
+	/** Mixes fresh kernel entropy into the key and discards buffered output. */
+	void reseed() {
+		unsigned char seed[KEY_SIZE];
+		readEntropy(seed, sizeof(seed));
+		for (unsigned int i = 0; i < 8; i++) {
+			key[i] ^= load32(seed + 4 * i);
+		}
+		wipe(seed, sizeof(seed));
+		wipe(buffer, sizeof(buffer));
+		available = 0;
+		outputSinceReseed = 0;
+		forkGeneration = forkCounter();
+	}
+
+	void generate(void *_buf, size_t size) {
+		unsigned char *buf = (unsigned char *) _buf;
+
+		if (OXT_UNLIKELY(forkGeneration != forkCounter()
+		 || outputSinceReseed >= RESEED_INTERVAL))
+		{
+			reseed();
+		}
+		if (size < RESEED_INTERVAL) {
+			outputSinceReseed += size;
+		} else {
+			outputSinceReseed = RESEED_INTERVAL;
+		}
+
+		while (size > 0) {
+			if (available == 0) {
+				refill();
+			}
+			size_t n = (size < available) ? size : available;
+			unsigned char *src = buffer + BUFFER_SIZE - available;
+			memcpy(buf, src, n);
+			// Handed-out output must not linger in memory.
+			wipe(src, n);
+			buf += n;
+			size -= n;
+			available -= n;
+		}
+	}
+};
+
+
 /**
- * A random data generator. Data is generated using /dev/urandom, and
- * is cryptographically secure. Unlike rand() and friends,
+ * A random data generator. Data is generated by a per-thread ChaCha20
+ * CSPRNG that is seeded from the kernel (getrandom(), arc4random_buf() or
+ * /dev/urandom), and reseeded every ChaCha20Rng::RESEED_INTERVAL bytes and
+ * after fork(). The output is cryptographically secure, and generating it
+ * doesn't involve any system calls. Unlike rand() and friends,
  * RandomGenerator does not require seeding.
  *
- * The reason why RandomGenerator isn't a singleton is because opening
- * /dev/urandom is *very* slow on Mac OS X and OpenBSD. Each object of
- * this class caches the /dev/urandom file handle.
+ * All RandomGenerator objects on the same thread share the same state.
+ * Objects are still passed around instead of being a singleton for
+ * historical reasons.
  *
- * This class is thread-safe as long as there are no concurrent
- * calls to reopen() or close().
+ * This class is thread-safe.
  */
 class RandomGenerator: public boost::noncopyable {
 private:
-	FILE *handle;
-	
+	static void onForkInChild() {
+		ChaCha20Rng::forkCounter()++;
+	}
+
+	static boost::thread_specific_ptr<ChaCha20Rng> &threadRng() {
+		static boost::thread_specific_ptr<ChaCha20Rng> rng;
+		return rng;
+	}
+
+	static ChaCha20Rng *getThreadRng() {
+		ChaCha20Rng *rng = threadRng().get();
+		if (OXT_UNLIKELY(rng == NULL)) {
+			static pthread_once_t once = PTHREAD_ONCE_INIT;
+			pthread_once(&once, registerForkHandler);
+			rng = new ChaCha20Rng();
+			threadRng().reset(rng);
+		}
+		return rng;
+	}
+
+	static void registerForkHandler() {
+		pthread_atfork(NULL, NULL, onForkInChild);
+	}
+
 public:
+	/**
+	 * If `open` is true, the calling thread's generator is seeded right
+	 * away, so that a missing entropy source is reported here instead of
+	 * at the first generate call.
+	 */
 	RandomGenerator(bool open = true) {
-		handle = NULL;
 		if (open) {
 			reopen();
 		}
 	}
-	
-	~RandomGenerator() {
-		this_thread::disable_syscall_interruption dsi;
-		close();
-	}
-	
+
+	/** Reseeds the calling thread's generator. */
 	void reopen() {
-		close();
-		handle = syscalls::fopen("/dev/urandom", "r");
-		if (handle == NULL) {
-			throw FileSystemException("Cannot open /dev/urandom",
-				errno, "/dev/urandom");
+		ChaCha20Rng *rng = threadRng().get();
+		if (rng == NULL) {
+			getThreadRng();
+		} else {
+			rng->reseed();
 		}
 	}
-	
+
+	/** Kept for API compatibility. There is no file handle to close anymore. */
 	void close() {
-		if (handle != NULL) {
-			syscalls::fclose(handle);
-			handle = NULL;
-		}
+		// Nothing to do.
 	}
-	
+
 	StaticString generateBytes(void *buf, unsigned int size) {
-		size_t ret = syscalls::fread(buf, 1, size, handle);
-		if (ret != size) {
-			throw IOException("Cannot read sufficient data from /dev/urandom");
-		}
+		getThreadRng()->generate(buf, size);
 		return StaticString((const char *) buf, size);
 	}
 	
@@ -31,9 +31,11 @@
 #include <memory>
 #include <climits>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
+#include <Utils/SystemTime.h>
 
 namespace Passenger {
 
@@ -43,19 +45,44 @@ using namespace boost;
 
 /**
  * Class for thread-safely using libev.
+ *
+ * Commands that other threads schedule for the event loop thread are put
+ * on an intrusive, lock-free, multi-producer single-consumer queue: a
+ * stack that producers push onto with a compare-and-swap, and that the
+ * event loop thread takes over in its entirety, restoring the order in
+ * which the commands were pushed. Only the producer that finds the queue
+ * empty calls ev_async_send(), so a burst of commands results in a single
+ * wakeup. A command and its callback are stored in a single allocation.
  */
 class SafeLibev {
 private:
 	typedef boost::function<void ()> Callback;
 
 	struct Command {
+		Command *next;
 		int id;
-		Callback callback;
 
-		Command(unsigned int _id, const Callback &_callback)
-			: id(_id),
+		Command(int _id)
+			: next(NULL),
+			  id(_id)
+			{ }
+
+		virtual ~Command() { }
+		virtual void run() = 0;
+	};
+
+	template<typename Function>
+	struct TypedCommand: public Command {
+		Function callback;
+
+		TypedCommand(int id, const Function &_callback)
+			: Command(id),
 			  callback(_callback)
 			{ }
+
+		virtual void run() {
+			callback();
+		}
 	};
 
 	struct ev_loop *loop;
@@ -64,8 +91,14 @@ private:
 	
 	boost::mutex syncher;
 	boost::condition_variable cond;
-	vector<Command> commands;
-	unsigned int nextCommandId;
+	/** The most recently pushed command. Commands point to the one pushed before them. */
+	boost::atomic<Command *> queueHead;
+	boost::atomic<unsigned int> nextCommandId;
+	/**
+	 * Commands that the event loop thread has taken from the queue, in the
+	 * order in which they must be run. Only accessed by the event loop thread.
+	 */
+	Command *pendingHead, *pendingTail;
 	
 	static void asyncHandler(EV_P_ ev_async *w, int revents) {
 		SafeLibev *self = (SafeLibev *) w->data;
@@ -77,17 +110,95 @@ private:
 		(*callback)();
 	}
 
+	template<typename Function>
+	int push(const Function &callback) {
+		// Command IDs are non-negative ints, so that cancelCommand()
+		// can accept the value that runLater() returned.
+		int id = (int) (nextCommandId.fetch_add(1, boost::memory_order_relaxed) & INT_MAX);
+		Command *command = new TypedCommand<Function>(id, callback);
+		Command *head = queueHead.load(boost::memory_order_relaxed);
+		do {
+			command->next = head;
+		} while (!queueHead.compare_exchange_weak(head, command,
+			boost::memory_order_release, boost::memory_order_relaxed));
+		if (head == NULL) {
+			// If the queue wasn't empty then whoever made it non-empty
+			// has already woken up the event loop, and the event loop
+			// hasn't taken the commands yet.
+			ev_async_send(loop, &async);
+		}
+		return id;
+	}
+
+	/** Moves all queued commands to the end of the pending list. */
+	void takeQueuedCommands() {
+		Command *command = queueHead.exchange(NULL, boost::memory_order_acquire);
+		Command *first = NULL, *last = command;
+		while (command != NULL) {
+			Command *next = command->next;
+			command->next = first;
+			first = command;
+			command = next;
+		}
+		if (first != NULL) {
+			if (pendingTail == NULL) {
+				pendingHead = first;
+			} else {
+				pendingTail->next = first;
+			}
+			pendingTail = last;
+		}
+	}
+
+	Command *popPendingCommand() {
+		Command *command = pendingHead;
+		if (command != NULL) {
+			pendingHead = command->next;
+			if (pendingHead == NULL) {
+				pendingTail = NULL;
+			}
+		}
+		return command;
+	}
+
 	void runCommands() {
-		boost::unique_lock<boost::mutex> l(syncher);
-		vector<Command> commands = this->commands;
-		this->commands.clear();
-		l.unlock();
-		
-		vector<Command>::const_iterator it, end = commands.end();
-		for (it = commands.begin(); it != end; it++) {
-			it->callback();
+		Command *command;
+		takeQueuedCommands();
+		while ((command = popPendingCommand()) != NULL) {
+			auto_ptr<Command> guard(command);
+			command->run();
+		}
+	}
+
+	void deleteCommands() {
+		Command *command;
+		takeQueuedCommands();
+		while ((command = popPendingCommand()) != NULL) {
+			delete command;
 		}
 	}
+
+	void cancelCommandInLoop(int id, bool *result) {
+		Command *prev = NULL, *command;
+
+		takeQueuedCommands();
+		for (command = pendingHead; command != NULL; prev = command, command = command->next) {
+			if (command->id == id) {
+				if (prev == NULL) {
+					pendingHead = command->next;
+				} else {
+					prev->next = command->next;
+				}
+				if (pendingTail == command) {
+					pendingTail = prev;
+				}
+				delete command;
+				*result = true;
+				return;
+			}
+		}
+		*result = false;
+	}
 	
 	template<typename Watcher>
 	void startWatcherAndNotify(Watcher *watcher, bool *done) {
@@ -113,20 +224,14 @@ private:
 		cond.notify_all();
 	}
 
-	void incNextCommandId() {
-		if (nextCommandId == INT_MAX) {
-			nextCommandId = 0;
-		} else {
-			nextCommandId++;
-		}
-	}
-	
 public:
 	/** SafeLibev takes over ownership of the loop object. */
 	SafeLibev(struct ev_loop *loop) {
 		this->loop = loop;
 		loopThread = pthread_self();
-		nextCommandId = 0;
+		queueHead.store(NULL, boost::memory_order_relaxed);
+		nextCommandId.store(0, boost::memory_order_relaxed);
+		pendingHead = pendingTail = NULL;
 		
 		ev_async_init(&async, asyncHandler);
 		ev_set_priority(&async, EV_MAXPRI);
@@ -136,6 +241,7 @@ public:
 	
 	~SafeLibev() {
 		destroy();
+		deleteCommands();
 		ev_loop_destroy(loop);
 	}
 
@@ -147,6 +253,33 @@ public:
 		return loop;
 	}
 	
+	/**
+	 * Returns the time at which the current event loop iteration began, in
+	 * microseconds since the Epoch. libev caches this time once per
+	 * iteration, so this is much cheaper than SystemTime::getUsec(), but it
+	 * lags behind by however long the iteration has taken so far. Call
+	 * updateNow() after blocking for a significant amount of time. Or, if a
+	 * time was forced with SystemTime::forceUsec(), then the forced time is
+	 * returned instead.
+	 *
+	 * Must be called from the event loop thread.
+	 */
+	unsigned long long getNowUsec() const {
+		if (SystemTimeData::hasForcedUsecValue) {
+			return SystemTimeData::forcedUsecValue;
+		} else {
+			return (unsigned long long) (ev_now(loop) * 1000000);
+		}
+	}
+
+	/**
+	 * Refreshes the time returned by getNowUsec() and ev_now().
+	 * Must be called from the event loop thread.
+	 */
+	void updateNow() {
+		ev_now_update(loop);
+	}
+	
 	void setCurrentThread() {
 		loopThread = pthread_self();
 	}
@@ -163,11 +296,8 @@ public:
 		} else {
 			boost::unique_lock<boost::mutex> l(syncher);
 			bool done = false;
-			commands.push_back(Command(nextCommandId,
-				boost::bind(&SafeLibev::startWatcherAndNotify<Watcher>,
-					this, &watcher, &done)));
-			incNextCommandId();
-			ev_async_send(loop, &async);
+			push(boost::bind(&SafeLibev::startWatcherAndNotify<Watcher>,
+				this, &watcher, &done));
 			while (!done) {
 				cond.wait(l);
 			}
@@ -181,11 +311,8 @@ public:
 		} else {
 			boost::unique_lock<boost::mutex> l(syncher);
 			bool done = false;
-			commands.push_back(Command(nextCommandId,
-				boost::bind(&SafeLibev::stopWatcherAndNotify<Watcher>,
-					this, &watcher, &done)));
-			incNextCommandId();
-			ev_async_send(loop, &async);
+			push(boost::bind(&SafeLibev::stopWatcherAndNotify<Watcher>,
+				this, &watcher, &done));
 			while (!done) {
 				cond.wait(l);
 			}
@@ -205,11 +332,8 @@ public:
 		assert(callback != NULL);
 		boost::unique_lock<boost::mutex> l(syncher);
 		bool done = false;
-		commands.push_back(Command(nextCommandId,
-			boost::bind(&SafeLibev::runAndNotify, this,
-				&callback, &done)));
-		incNextCommandId();
-		ev_async_send(loop, &async);
+		push(boost::bind(&SafeLibev::runAndNotify, this,
+			&callback, &done));
 		while (!done) {
 			cond.wait(l);
 		}
@@ -231,17 +355,24 @@ public:
 		}
 	}
 
+	/**
+	 * Schedules a callback to be run by the event loop thread, after the
+	 * callbacks that have already been scheduled. Returns an ID that can
+	 * be passed to cancelCommand().
+	 */
 	unsigned int runLater(const Callback &callback) {
 		assert(callback != NULL);
-		unsigned int result;
-		{
-			boost::unique_lock<boost::mutex> l(syncher);
-			commands.push_back(Command(nextCommandId, callback));
-			result = nextCommandId;
-			incNextCommandId();
-		}
-		ev_async_send(loop, &async);
-		return result;
+		return push(callback);
+	}
+
+	/**
+	 * Like runLater(const Callback &), but stores the function object
+	 * directly instead of wrapping it in a boost::function, so that
+	 * scheduling e.g. the result of boost::bind() allocates only once.
+	 */
+	template<typename Function>
+	unsigned int runLater(const Function &callback) {
+		return push(callback);
 	}
 
 	/**
@@ -250,19 +381,15 @@ public:
 	 * That is, a return value of true guarantees that the callback will not be called
 	 * in the future, while a return value of false means that the callback has already
 	 * been called or is currently being called.
+	 *
+	 * Only the event loop thread looks at the scheduled commands, so when
+	 * called from another thread, this method waits for the event loop
+	 * thread to run the commands that were scheduled before it.
 	 */
 	bool cancelCommand(int id) {
-		boost::unique_lock<boost::mutex> l(syncher);
-		// TODO: we can do a binary search because the command ID
-		// is monotically increasing except on overflow.
-		vector<Command>::iterator it, end = commands.end();
-		for (it = commands.begin(); it != end; it++) {
-			if (it->id == id) {
-				commands.erase(it);
-				return true;
-			}
-		}
-		return false;
+		bool result;
+		run(boost::bind(&SafeLibev::cancelCommandInLoop, this, id, &result));
+		return result;
 	}
 };
 
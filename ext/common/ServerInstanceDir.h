@@ -154,6 +154,20 @@ public:
 				makeDirTree(path + "/backends", "u=rwx,g=,o=");
 			}
 			
+			/* The Ruby loaders store their load path caches here, so it must
+			 * be writable by applications in the same way as the backends
+			 * subdirectory.
+			 */
+			if (runningAsRoot) {
+				if (userSwitching) {
+					makeDirTree(path + "/load_path_caches", "u=rwx,g=wx,o=wx,+t");
+				} else {
+					makeDirTree(path + "/load_path_caches", "u=rwx,g=x,o=x", defaultUid, defaultGid);
+				}
+			} else {
+				makeDirTree(path + "/load_path_caches", "u=rwx,g=,o=");
+			}
+			
 			owner = true;
 		}
 	
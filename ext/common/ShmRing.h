@@ -0,0 +1,253 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_SHM_RING_H_
+#define _PASSENGER_SHM_RING_H_
+
+/*
+ * A single-producer, single-consumer byte ring that lives in memory shared
+ * between two processes, e.g. the helper agent and an application process.
+ * The producer and the consumer only ever write their own position, so no
+ * locks are needed: copying data in or out is a memcpy() plus a memory
+ * barrier.
+ *
+ * The ring does not block. A side that finds the ring empty (or full) calls
+ * pp_shm_ring_prepare_wait_readable() (or _writable()) and, if that returns
+ * false, sleeps on a doorbell of the caller's choice, e.g. an eventfd that an
+ * event loop watches. The other side only needs to ring the doorbell when
+ * pp_shm_ring_write() (or _read()) says so, so that a busy pair of processes
+ * exchanges data without any system calls.
+ *
+ * This is a C header so that the Ruby native extension can use it too.
+ */
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __cplusplus
+	extern "C" {
+#endif
+
+#define PP_SHM_RING_MAGIC 0x50535231 /* "PSR1" */
+#define PP_SHM_RING_CACHE_LINE 64
+
+typedef unsigned long long PP_ShmRingPosition;
+
+typedef struct {
+	unsigned int magic;
+	/* Size of the data area, a power of 2. */
+	unsigned int capacity;
+	char pad0[PP_SHM_RING_CACHE_LINE - 2 * sizeof(unsigned int)];
+
+	/* Total number of bytes ever written. Only written by the producer. */
+	volatile PP_ShmRingPosition head;
+	/* Whether the producer is about to sleep until there's space. */
+	volatile unsigned int producerWaiting;
+	char pad1[PP_SHM_RING_CACHE_LINE - sizeof(PP_ShmRingPosition) - sizeof(unsigned int)];
+
+	/* Total number of bytes ever read. Only written by the consumer. */
+	volatile PP_ShmRingPosition tail;
+	/* Whether the consumer is about to sleep until there's data. */
+	volatile unsigned int consumerWaiting;
+	char pad2[PP_SHM_RING_CACHE_LINE - sizeof(PP_ShmRingPosition) - sizeof(unsigned int)];
+} PP_ShmRing;
+
+/** Returns the number of bytes to map for a ring of the given capacity. */
+static inline size_t
+pp_shm_ring_size(unsigned int capacity) {
+	return sizeof(PP_ShmRing) + capacity;
+}
+
+static inline char *
+pp_shm_ring_data(PP_ShmRing *ring) {
+	return (char *) (ring + 1);
+}
+
+/**
+ * Initializes a ring in the given memory, which must be at least
+ * pp_shm_ring_size(capacity) bytes. Returns NULL if the capacity
+ * is not a power of 2.
+ */
+static inline PP_ShmRing *
+pp_shm_ring_init(void *memory, unsigned int capacity) {
+	PP_ShmRing *ring = (PP_ShmRing *) memory;
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+		return NULL;
+	}
+	memset(ring, 0, sizeof(PP_ShmRing));
+	ring->capacity = capacity;
+	__sync_synchronize();
+	ring->magic = PP_SHM_RING_MAGIC;
+	return ring;
+}
+
+/**
+ * Attaches to a ring that the other process has initialized in the given
+ * memory of the given size. Returns NULL if the memory doesn't contain
+ * a valid ring.
+ */
+static inline PP_ShmRing *
+pp_shm_ring_attach(void *memory, size_t size) {
+	PP_ShmRing *ring = (PP_ShmRing *) memory;
+	if (size < sizeof(PP_ShmRing) || ring->magic != PP_SHM_RING_MAGIC) {
+		return NULL;
+	}
+	__sync_synchronize();
+	if (ring->capacity == 0
+	 || (ring->capacity & (ring->capacity - 1)) != 0
+	 || size < pp_shm_ring_size(ring->capacity))
+	{
+		return NULL;
+	}
+	return ring;
+}
+
+/** The number of bytes that can be read right now. */
+static inline size_t
+pp_shm_ring_readable(const PP_ShmRing *ring) {
+	return (size_t) (ring->head - ring->tail);
+}
+
+/** The number of bytes that can be written right now. */
+static inline size_t
+pp_shm_ring_writable(const PP_ShmRing *ring) {
+	return ring->capacity - pp_shm_ring_readable(ring);
+}
+
+/**
+ * Writes as much of the given data as fits, and returns the number of bytes
+ * written. Only the producer may call this. *wakeConsumer is set to whether
+ * the consumer is waiting for data, and must have its doorbell rung.
+ */
+static inline size_t
+pp_shm_ring_write(PP_ShmRing *ring, const void *data, size_t size, int *wakeConsumer) {
+	PP_ShmRingPosition head = ring->head;
+	size_t space, offset, first;
+
+	__sync_synchronize();
+	space = ring->capacity - (size_t) (head - ring->tail);
+	if (size > space) {
+		size = space;
+	}
+	offset = (size_t) (head & (ring->capacity - 1));
+	first = ring->capacity - offset;
+	if (first > size) {
+		first = size;
+	}
+	memcpy(pp_shm_ring_data(ring) + offset, data, first);
+	memcpy(pp_shm_ring_data(ring), (const char *) data + first, size - first);
+
+	/* The data must be visible before the new head. */
+	__sync_synchronize();
+	ring->head = head + size;
+	/* And the new head before we look at consumerWaiting. See
+	 * pp_shm_ring_prepare_wait_readable(). */
+	__sync_synchronize();
+	*wakeConsumer = size > 0 && ring->consumerWaiting;
+	return size;
+}
+
+/**
+ * Reads at most the given number of bytes, and returns the number of bytes
+ * read. Only the consumer may call this. *wakeProducer is set to whether
+ * the producer is waiting for space, and must have its doorbell rung.
+ */
+static inline size_t
+pp_shm_ring_read(PP_ShmRing *ring, void *buf, size_t size, int *wakeProducer) {
+	PP_ShmRingPosition tail = ring->tail;
+	size_t available, offset, first;
+
+	available = (size_t) (ring->head - tail);
+	/* The data must be read after the head that says it's there. */
+	__sync_synchronize();
+	if (size > available) {
+		size = available;
+	}
+	offset = (size_t) (tail & (ring->capacity - 1));
+	first = ring->capacity - offset;
+	if (first > size) {
+		first = size;
+	}
+	memcpy(buf, pp_shm_ring_data(ring) + offset, first);
+	memcpy((char *) buf + first, pp_shm_ring_data(ring), size - first);
+
+	/* The data must have been copied before the producer may overwrite it. */
+	__sync_synchronize();
+	ring->tail = tail + size;
+	__sync_synchronize();
+	*wakeProducer = size > 0 && ring->producerWaiting;
+	return size;
+}
+
+/**
+ * Called by the consumer before it sleeps on its doorbell. Returns true if
+ * it must not sleep because data has arrived in the meantime. Otherwise the
+ * producer will ring the doorbell after its next write.
+ */
+static inline int
+pp_shm_ring_prepare_wait_readable(PP_ShmRing *ring) {
+	ring->consumerWaiting = 1;
+	__sync_synchronize();
+	if (pp_shm_ring_readable(ring) > 0) {
+		ring->consumerWaiting = 0;
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/** Called by the consumer once it's awake again. */
+static inline void
+pp_shm_ring_end_wait_readable(PP_ShmRing *ring) {
+	ring->consumerWaiting = 0;
+}
+
+/**
+ * Called by the producer before it sleeps on its doorbell. Returns true if
+ * it must not sleep because space has become available in the meantime.
+ */
+static inline int
+pp_shm_ring_prepare_wait_writable(PP_ShmRing *ring) {
+	ring->producerWaiting = 1;
+	__sync_synchronize();
+	if (pp_shm_ring_writable(ring) > 0) {
+		ring->producerWaiting = 0;
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/** Called by the producer once it's awake again. */
+static inline void
+pp_shm_ring_end_wait_writable(PP_ShmRing *ring) {
+	ring->producerWaiting = 0;
+}
+
+#ifdef __cplusplus
+	}
+#endif
+
+#endif /* _PASSENGER_SHM_RING_H_ */
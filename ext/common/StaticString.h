@@ -25,6 +25,7 @@
 #ifndef _PASSENGER_STATIC_STRING_H_
 #define _PASSENGER_STATIC_STRING_H_
 
+#include <boost/cstdint.hpp>
 #include <sys/types.h>
 #include <string>
 #include <cstring>
@@ -78,38 +79,91 @@ private:
 		} while (true);
 	}
 	
+	static boost::uint64_t read64(const char *data) {
+		boost::uint64_t result;
+		memcpy(&result, data, sizeof(result));
+		return result;
+	}
+	
+	static boost::uint64_t read32(const char *data) {
+		boost::uint32_t result;
+		memcpy(&result, data, sizeof(result));
+		return result;
+	}
+	
+	/**
+	 * Multiplies two 64-bit numbers into a 128-bit product and folds it
+	 * back into 64 bits, mixing every input bit into every output bit.
+	 */
+	static boost::uint64_t mix(boost::uint64_t a, boost::uint64_t b) {
+		#ifdef __SIZEOF_INT128__
+			__uint128_t product = (__uint128_t) a * b;
+			return (boost::uint64_t) product ^ (boost::uint64_t) (product >> 64);
+		#else
+			boost::uint64_t ha = a >> 32, la = (boost::uint32_t) a;
+			boost::uint64_t hb = b >> 32, lb = (boost::uint32_t) b;
+			boost::uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+			boost::uint64_t mid = (ll >> 32) + (boost::uint32_t) hl + (boost::uint32_t) lh;
+			boost::uint64_t low = (mid << 32) | (boost::uint32_t) ll;
+			boost::uint64_t high = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+			return low ^ high;
+		#endif
+	}
+	
 public:
-	/** A hash function object for StaticString. */
+	/**
+	 * A hash function object for StaticString. This is a variant of
+	 * wyhash: it reads the data 8 or 32 bytes at a time (keys of up to
+	 * 16 bytes, like most header names, take at most four overlapping
+	 * reads) and mixes them with 64-bit multiplications. Hash values
+	 * depend on the platform's endianness, so they must not be stored.
+	 */
 	struct Hash {
 		size_t operator()(const StaticString &str) const {
+			static const boost::uint64_t P0 = 0xa0761d6478bd642fULL;
+			static const boost::uint64_t P1 = 0xe7037ed1a0b428dbULL;
+			static const boost::uint64_t P2 = 0x8ebc6af09c88c6e3ULL;
 			const char *data = str.content;
-			const char *end  = str.content + str.len;
-			size_t result    = 0;
+			string::size_type len = str.len;
+			boost::uint64_t seed = P0;
+			boost::uint64_t a, b;
 			
-			#if defined(__i386__) || defined(__x86_64__)
-				/* When on x86 or x86_64, process 4 or 8 bytes
-				 * per iteration by treating the data as an
-				 * array of longs. Luckily for us these
-				 * architectures can read longs even on unaligned
-				 * addresses.
-				 */
-				const char *last_long = str.content +
-					str.len / sizeof(unsigned long) *
-					sizeof(unsigned long);
-				
-				while (data < last_long) {
-					result = result * 33 + *((unsigned long *) data);
-					data += sizeof(unsigned long);
+			if (len <= 16) {
+				if (len >= 4) {
+					// Covers all bytes with two pairs of possibly
+					// overlapping 4-byte reads.
+					string::size_type offset = (len >> 3) << 2;
+					a = (read32(data) << 32) | read32(data + offset);
+					b = (read32(data + len - 4) << 32) | read32(data + len - 4 - offset);
+				} else if (len > 0) {
+					a = ((boost::uint64_t) (unsigned char) data[0] << 16)
+						| ((boost::uint64_t) (unsigned char) data[len >> 1] << 8)
+						| (unsigned char) data[len - 1];
+					b = 0;
+				} else {
+					a = b = 0;
 				}
-				
-				/* Process leftover data byte-by-byte. */
-			#endif
-			
-			while (data < end) {
-				result = result * 33 + *data;
-				data++;
+			} else {
+				const char *end = data + len;
+				boost::uint64_t seed2 = seed;
+				// Two independent streams, so that the CPU can
+				// overlap their multiplications.
+				while (end - data > 32) {
+					seed = mix(read64(data) ^ P1, read64(data + 8) ^ seed);
+					seed2 = mix(read64(data + 16) ^ P2, read64(data + 24) ^ seed2);
+					data += 32;
+				}
+				seed ^= seed2;
+				if (end - data > 16) {
+					seed = mix(read64(data) ^ P1, read64(data + 8) ^ seed);
+				}
+				// The last 16 bytes, which may overlap with the
+				// ones that were already processed.
+				a = read64(end - 16);
+				b = read64(end - 8);
 			}
-			return result;
+			
+			return (size_t) mix(P1 ^ len, mix(a ^ P1, b ^ seed ^ P2));
 		}
 	};
 	
@@ -28,6 +28,7 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
 #include <oxt/thread.hpp>
 #include <oxt/system_calls.hpp>
 #include <oxt/backtrace.hpp>
@@ -35,10 +36,14 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <string>
+#include <sstream>
 #include <map>
 #include <stdexcept>
 #include <cstdio>
@@ -53,8 +58,11 @@
 #include <Exceptions.h>
 #include <Utils.h>
 #include <Utils/MessageIO.h>
+#include <Utils/SmallVector.h>
 #include <Utils/StrIntUtils.h>
 #include <Utils/MD5.h>
+#include <UnionStationLogBatch.h>
+#include <agents/LoggingAgent/FilterSupport.h>
 #include <Utils/SystemTime.h>
 
 
@@ -70,10 +78,45 @@ using namespace oxt;
 struct Connection {
 	mutable boost::mutex syncher;
 	int fd;
+	/** Whether the logging agent accepts log entries in the binary format. */
+	bool binaryLogs;
+	/** Reused for reading replies from the logging agent. */
+	string readBuffer;
+
+	// The following fields are only accessed by LoggerFactory's connection
+	// pool, while the connection is checked in.
+	/** The thread that checked this connection in last. */
+	boost::thread::id lastThread;
+	/** When this connection was checked in last, in microseconds. */
+	unsigned long long lastCheckinTime;
 	
-	Connection(int _fd)
-		: fd(_fd)
+	Connection(int _fd, bool _binaryLogs = false)
+		: fd(_fd),
+		  binaryLogs(_binaryLogs),
+		  lastCheckinTime(0)
 		{ }
+
+	/**
+	 * Checks whether an idle connection can still be used. The logging agent
+	 * never sends anything unsolicited, so if the socket is readable then it
+	 * has been closed or is in an unknown state.
+	 */
+	bool isHealthy() const {
+		if (!connected()) {
+			return false;
+		}
+
+		struct pollfd pfd;
+		int ret;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		do {
+			ret = poll(&pfd, 1, 0);
+		} while (ret == -1 && errno == EINTR);
+		return ret == 0;
+	}
 	
 	~Connection() {
 		disconnect();
@@ -209,6 +252,85 @@ public:
 };
 
 
+/**
+ * An unconnected Unix datagram socket for sending whole transactions to the
+ * logging agent's datagram socket, as TransactionDatagrams. Sending never
+ * blocks: if the logging agent isn't running or can't keep up, the
+ * transaction is dropped. Thread-safe.
+ */
+class DatagramSocket: public boost::noncopyable {
+private:
+	FileDescriptor fd;
+	struct sockaddr_un addr;
+	boost::atomic<unsigned int> sent;
+	boost::atomic<unsigned int> dropped;
+
+public:
+	const string username;
+	const string password;
+	const string nodeName;
+
+	/**
+	 * @throws RuntimeException The filename is too long.
+	 * @throws SystemException The socket cannot be created.
+	 */
+	DatagramSocket(const string &filename, const string &_username,
+		const string &_password, const string &_nodeName)
+		: sent(0),
+		  dropped(0),
+		  username(_username),
+		  password(_password),
+		  nodeName(_nodeName)
+	{
+		if (filename.size() > sizeof(addr.sun_path) - 1) {
+			throw RuntimeException("Cannot use Unix socket '" + filename +
+				"': filename is too long.");
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_LOCAL;
+		memcpy(addr.sun_path, filename.data(), filename.size());
+
+		int ret = syscalls::socket(PF_LOCAL, SOCK_DGRAM, 0);
+		if (ret == -1) {
+			int e = errno;
+			throw SystemException("Cannot create a Unix datagram socket", e);
+		}
+		fd = ret;
+	}
+
+	/**
+	 * Sends the given datagram with a single non-blocking system call.
+	 * Returns whether it was sent.
+	 */
+	bool send(const string &data) {
+		ssize_t ret;
+		do {
+			ret = sendto(fd, data.data(), data.size(), MSG_DONTWAIT,
+				(const struct sockaddr *) &addr, sizeof(addr));
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			P_TRACE(3, "Dropped a Union Station transaction datagram: " <<
+				strerror(errno) << " (errno=" << errno << ")");
+			dropped++;
+			return false;
+		} else {
+			sent++;
+			return true;
+		}
+	}
+
+	unsigned int getSent() const {
+		return sent.load(boost::memory_order_relaxed);
+	}
+
+	unsigned int getDropped() const {
+		return dropped.load(boost::memory_order_relaxed);
+	}
+};
+
+typedef boost::shared_ptr<DatagramSocket> DatagramSocketPtr;
+
+
 enum ExceptionHandlingMode {
 	PRINT,
 	THROW,
@@ -220,21 +342,213 @@ class LoggerFactory;
 typedef boost::shared_ptr<LoggerFactory> LoggerFactoryPtr;
 
 inline void _checkinConnection(const LoggerFactoryPtr &loggerFactory, const ConnectionPtr &connection);
+inline bool _passesFilters(const LoggerFactoryPtr &loggerFactory, const string &filters,
+	const StaticString &logData);
 
 
 class Logger: public boost::noncopyable {
 private:
 	static const int INT64_STR_BUFSIZE = 22; // Long enough for a 64-bit number.
 	static const unsigned long long IO_TIMEOUT = 5000000; // In microseconds.
+	/** message() tries to send the buffered messages once there are this
+	 * many bytes of them, as long as the connection isn't busy. */
+	static const unsigned int FLUSH_THRESHOLD = 8 * 1024;
+	/** message() drops messages once this many bytes have been buffered. */
+	static const unsigned int MAX_BUFFER_SIZE = 128 * 1024;
 	
 	const LoggerFactoryPtr loggerFactory;
 	const ConnectionPtr connection;
+	/**
+	 * Set instead of `connection` if the whole transaction is sent to the
+	 * logging agent as one datagram when this Logger is destroyed.
+	 */
+	const DatagramSocketPtr datagramSocket;
 	const string txnId;
 	const string groupName;
 	const string category;
 	const string unionStationKey;
+	/** Only used with `datagramSocket`. */
+	const string filters;
+	const unsigned long long openedAt;
 	const ExceptionHandlingMode exceptionHandlingMode;
 	bool shouldFlushToDiskAfterClose;
+
+	/**
+	 * Whether message() buffers messages instead of sending them right away.
+	 * Buffered messages are all sent in one write, at the latest when this
+	 * Logger is destroyed, so that logging doesn't wait for the connection
+	 * on every message. The logging agent numbers messages in the order
+	 * in which they arrive, so this changes the order of messages from
+	 * different Loggers for the same transaction if they have the same
+	 * timestamp.
+	 */
+	const bool buffered;
+	/** Whether ScopeLogs on this Logger use the lightweight timing mode. See ScopeLog. */
+	const bool lightweightScopeLogs;
+	/** Messages that haven't been sent to the logging agent yet, in wire format. */
+	string buffer;
+	/**
+	 * Buffered log entries in the binary format, if the logging agent
+	 * supports it. They're moved to `buffer` by finishBatch(), or sent in
+	 * a datagram by sendDatagram().
+	 */
+	LogBatchWriter batch;
+	boost::mutex bufferSyncher;
+	unsigned int droppedMessages;
+
+	static void appendArrayMessage(string &output, const StaticString args[],
+		unsigned int nargs)
+	{
+		uint16_t bodySize = 0;
+		for (unsigned int i = 0; i < nargs; i++) {
+			bodySize += args[i].size() + 1;
+		}
+
+		uint16_t header = htons(bodySize);
+		output.append((const char *) &header, sizeof(uint16_t));
+		for (unsigned int i = 0; i < nargs; i++) {
+			output.append(args[i].data(), args[i].size());
+			output.append(1, '\0');
+		}
+	}
+
+	static void appendScalarMessage(string &output, const StaticString &data) {
+		uint32_t header = htonl(data.size());
+		output.append((const char *) &header, sizeof(uint32_t));
+		output.append(data.data(), data.size());
+	}
+
+	/** Appends a "log" message for the text protocol. */
+	void appendLogMessage(string &output, unsigned long long timestamp,
+		const StaticString &text) const
+	{
+		char timestampStr[2 * sizeof(unsigned long long) + 1];
+		integerToHexatri<unsigned long long>(timestamp, timestampStr);
+		StaticString args[] = { "log", txnId, timestampStr };
+		appendArrayMessage(output, args, 3);
+		appendScalarMessage(output, text);
+	}
+
+	static void finishBatch(string &output, LogBatchWriter &batch) {
+		if (!batch.empty()) {
+			StaticString args[] = { "logBatch" };
+			appendArrayMessage(output, args, 1);
+			appendScalarMessage(output, batch.getData());
+			batch.clear();
+		}
+	}
+
+	/**
+	 * Sends the buffered messages to the logging agent. Must be called while
+	 * holding the connection lock. Returns false if the connection has been
+	 * closed because of an error.
+	 */
+	bool sendBuffer(const string &data) {
+		TRACE_POINT();
+		if (!connection->connected()) {
+			return false;
+		}
+
+		ConnectionGuard guard(connection);
+		try {
+			unsigned long long timeout = IO_TIMEOUT;
+			writeExact(connection->fd, data.data(), data.size(), &timeout);
+			guard.clear();
+			return true;
+		} catch (const std::exception &e) {
+			string errorResponse;
+
+			UPDATE_TRACE_POINT();
+			guard.clear();
+			if (connection->disconnect(errorResponse)) {
+				handleException(IOException(
+					"Logging agent disconnected with error: " +
+					errorResponse));
+			} else {
+				handleException(e);
+			}
+			return false;
+		}
+	}
+
+	void appendLogLine(string &output, unsigned long long timestamp,
+		const StaticString &text) const
+	{
+		char timestampStr[2 * sizeof(unsigned long long) + 1];
+		integerToHexatri<unsigned long long>(timestamp, timestampStr);
+		output.append(txnId);
+		output.append(1, ' ');
+		output.append(timestampStr);
+		output.append(" 0 ", 3);
+		output.append(text.data(), text.size());
+		output.append(1, '\n');
+	}
+
+	/**
+	 * Whether the transaction passes `filters`. They're evaluated on the
+	 * same log lines as the logging agent evaluates them on when it
+	 * receives the datagram, so the result is the same, but transactions
+	 * that would be discarded aren't serialized and sent at all.
+	 */
+	bool passesFilters(unsigned long long closedAt) const {
+		if (filters.empty()) {
+			return true;
+		}
+
+		LogBatchReader reader(batch.getData());
+		unsigned long long timestamp;
+		StaticString entry;
+		string logData;
+
+		logData.reserve(batch.size() * 2);
+		appendLogLine(logData, openedAt, "ATTACH");
+		while (reader.next(timestamp, entry)) {
+			appendLogLine(logData, timestamp, entry);
+		}
+		appendLogLine(logData, closedAt, "DETACH");
+		return _passesFilters(loggerFactory, filters, logData);
+	}
+
+	/** Sends the whole transaction to the logging agent's datagram socket. */
+	void sendDatagram() {
+		unsigned long long closedAt = SystemTime::getUsec();
+		TransactionDatagram datagram;
+		string data;
+
+		batch.start(txnId);
+		if (!passesFilters(closedAt)) {
+			P_TRACE(3, "Union Station transaction " << txnId <<
+				" did not pass the filters; not sending it");
+			return;
+		}
+		datagram.username  = datagramSocket->username;
+		datagram.password  = datagramSocket->password;
+		datagram.groupName = groupName;
+		datagram.nodeName  = datagramSocket->nodeName;
+		datagram.category  = category;
+		datagram.unionStationKey = unionStationKey;
+		datagram.filters   = filters;
+		datagram.openedAt  = openedAt;
+		datagram.closedAt  = closedAt;
+		datagram.batch     = batch.getData();
+		data.reserve(batch.size() + groupName.size() + filters.size() + 128);
+		datagram.appendTo(data);
+		datagramSocket->send(data);
+	}
+
+	/**
+	 * Sends the buffered messages if nobody else is using the connection
+	 * right now. Must be called while holding `bufferSyncher`.
+	 */
+	void trySendBuffer() {
+		if (!connection->syncher.try_lock()) {
+			return;
+		}
+		boost::lock_guard<boost::mutex> l(connection->syncher, boost::adopt_lock);
+		string data;
+		data.swap(buffer);
+		sendBuffer(data);
+	}
 	
 	/**
 	 * Buffer must be at least txnId.size() + 1 + INT64_STR_BUFSIZE + 1 bytes.
@@ -286,7 +600,10 @@ private:
 	
 public:
 	Logger()
-		: exceptionHandlingMode(PRINT)
+		: openedAt(0),
+		  exceptionHandlingMode(PRINT),
+		  buffered(false),
+		  lightweightScopeLogs(false)
 		{ }
 	
 	Logger(const LoggerFactoryPtr &_loggerFactory,
@@ -295,47 +612,96 @@ public:
 		const string &_groupName,
 		const string &_category,
 		const string &_unionStationKey,
-		ExceptionHandlingMode _exceptionHandlingMode = PRINT)
+		ExceptionHandlingMode _exceptionHandlingMode = PRINT,
+		bool _buffered = false,
+		bool _lightweightScopeLogs = false)
 		: loggerFactory(_loggerFactory),
 		  connection(_connection),
 		  txnId(_txnId),
 		  groupName(_groupName),
 		  category(_category),
 		  unionStationKey(_unionStationKey),
+		  openedAt(0),
 		  exceptionHandlingMode(_exceptionHandlingMode),
-		  shouldFlushToDiskAfterClose(false)
+		  shouldFlushToDiskAfterClose(false),
+		  buffered(_buffered),
+		  lightweightScopeLogs(_lightweightScopeLogs),
+		  droppedMessages(0)
+		{ }
+
+	/**
+	 * Creates a Logger that buffers all messages and sends the whole
+	 * transaction as one datagram when it's destroyed.
+	 */
+	Logger(const LoggerFactoryPtr &_loggerFactory,
+		const DatagramSocketPtr &_datagramSocket,
+		const string &_txnId,
+		const string &_groupName,
+		const string &_category,
+		const string &_unionStationKey,
+		const string &_filters,
+		bool _lightweightScopeLogs = false)
+		: loggerFactory(_loggerFactory),
+		  datagramSocket(_datagramSocket),
+		  txnId(_txnId),
+		  groupName(_groupName),
+		  category(_category),
+		  unionStationKey(_unionStationKey),
+		  filters(_filters),
+		  openedAt(SystemTime::getUsec()),
+		  exceptionHandlingMode(PRINT),
+		  shouldFlushToDiskAfterClose(false),
+		  buffered(true),
+		  lightweightScopeLogs(_lightweightScopeLogs),
+		  droppedMessages(0)
 		{ }
 	
 	~Logger() {
 		TRACE_POINT();
-		if (connection == NULL) {
+		if (datagramSocket != NULL) {
+			if (droppedMessages > 0) {
+				P_WARN("Dropped " << droppedMessages << " Union Station log " <<
+					"messages for transaction " << txnId << " because it " <<
+					"was too large");
+			}
+			sendDatagram();
 			return;
 		}
-		ConnectionLock l(connection);
-		if (!connection->connected()) {
+		if (connection == NULL) {
 			return;
 		}
 		
 		char timestamp[2 * sizeof(unsigned long long) + 1];
 		integerToHexatri<unsigned long long>(SystemTime::getUsec(),
 			timestamp);
+		StaticString args[] = { "closeTransaction", txnId, timestamp };
+		finishBatch(buffer, batch);
+		appendArrayMessage(buffer, args, 3);
+		if (shouldFlushToDiskAfterClose) {
+			StaticString flushArgs[] = { "flush" };
+			appendArrayMessage(buffer, flushArgs, 1);
+		}
+		if (droppedMessages > 0) {
+			P_WARN("Dropped " << droppedMessages << " Union Station log " <<
+				"messages for transaction " << txnId << " because the " <<
+				"logging agent could not keep up");
+		}
+		
+		ConnectionLock l(connection);
+		if (!sendBuffer(buffer)) {
+			return;
+		}
 		
 		UPDATE_TRACE_POINT();
 		ConnectionGuard guard(connection);
 		try {
-			unsigned long long timeout = IO_TIMEOUT;
-			writeArrayMessage(connection->fd, &timeout,
-				"closeTransaction",
-				txnId.c_str(),
-				timestamp,
-				NULL);
-			
 			if (shouldFlushToDiskAfterClose) {
 				UPDATE_TRACE_POINT();
-				timeout = IO_TIMEOUT;
-				writeArrayMessage(connection->fd, &timeout,
-					"flush", NULL);
-				readArrayMessage(connection->fd, &timeout);
+				unsigned long long timeout = IO_TIMEOUT;
+				SmallVector<StaticString, 2> args;
+				if (!readArrayMessage(connection->fd, args, connection->readBuffer, &timeout)) {
+					throw EOFException("EOF encountered before the full array message could be read");
+				}
 			}
 
 			_checkinConnection(loggerFactory, connection);
@@ -355,45 +721,60 @@ public:
 		}
 	}
 	
+	/**
+	 * Logs the given message. If this Logger is buffered then the message
+	 * is sent to the logging agent later, and this never waits for other
+	 * users of the connection; if the buffer grows too large because the
+	 * connection is busy all the time, then the message is dropped.
+	 */
 	void message(const StaticString &text) {
 		TRACE_POINT();
-		if (connection == NULL) {
-			P_TRACE(3, "[Union Station log to null] " << text);
-			return;
-		}
-		ConnectionLock l(connection);
-		if (!connection->connected()) {
+		if (isNull()) {
 			P_TRACE(3, "[Union Station log to null] " << text);
 			return;
 		}
 		
-		char timestamp[2 * sizeof(unsigned long long) + 1];
-		integerToHexatri<unsigned long long>(SystemTime::getUsec(), timestamp);
+		unsigned long long now = SystemTime::getUsec();
 		
 		UPDATE_TRACE_POINT();
-		ConnectionGuard guard(connection);
-		try {
-			unsigned long long timeout = IO_TIMEOUT;
-			P_TRACE(3, "[Union Station log] " << txnId << " " << timestamp << " " << text);
-			writeArrayMessage(connection->fd, &timeout,
-				"log",
-				txnId.c_str(),
-				timestamp,
-				NULL);
-			writeScalarMessage(connection->fd, text, &timeout);
-			guard.clear();
-		} catch (const std::exception &e) {
-			string errorResponse;
+		if (buffered) {
+			boost::lock_guard<boost::mutex> l(bufferSyncher);
+			if (buffer.size() + batch.size() + text.size() > MAX_BUFFER_SIZE) {
+				P_TRACE(3, "[Union Station log dropped] " << txnId << " " << now << " " << text);
+				droppedMessages++;
+				return;
+			}
 			
-			UPDATE_TRACE_POINT();
-			guard.clear();
-			if (connection->disconnect(errorResponse)) {
-				handleException(IOException(
-					"Logging agent disconnected with error: " +
-					errorResponse));
+			P_TRACE(3, "[Union Station log] " << txnId << " " << now << " " << text);
+			if (datagramSocket != NULL) {
+				batch.append(txnId, now, text);
+				return;
+			} else if (connection->binaryLogs) {
+				batch.append(txnId, now, text);
 			} else {
-				handleException(e);
+				appendLogMessage(buffer, now, text);
 			}
+			if (buffer.size() + batch.size() >= FLUSH_THRESHOLD) {
+				finishBatch(buffer, batch);
+				trySendBuffer();
+			}
+		} else {
+			ConnectionLock l(connection);
+			if (!connection->connected()) {
+				P_TRACE(3, "[Union Station log to null] " << text);
+				return;
+			}
+			
+			P_TRACE(3, "[Union Station log] " << txnId << " " << now << " " << text);
+			string data;
+			if (connection->binaryLogs) {
+				LogBatchWriter entry;
+				entry.append(txnId, now, text);
+				finishBatch(data, entry);
+			} else {
+				appendLogMessage(data, now, text);
+			}
+			sendBuffer(data);
 		}
 	}
 	
@@ -406,7 +787,7 @@ public:
 	}
 	
 	bool isNull() const {
-		return connection == NULL;
+		return connection == NULL && datagramSocket == NULL;
 	}
 	
 	const string &getTxnId() const {
@@ -424,6 +805,10 @@ public:
 	const string &getUnionStationKey() const {
 		return unionStationKey;
 	}
+	
+	bool usesLightweightScopeLogs() const {
+		return lightweightScopeLogs;
+	}
 };
 
 typedef boost::shared_ptr<Logger> LoggerPtr;
@@ -445,9 +830,21 @@ private:
 	} data;
 	bool ok;
 	
-	static string timevalToString(struct timeval &tv) {
-		unsigned long long i = (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
-		return usecToString(i);
+	/**
+	 * In the lightweight timing mode, the CPU times of the calling thread
+	 * are only sampled once every this many microseconds, instead of
+	 * calling getrusage() at the beginning and at the end of every scope.
+	 */
+	static const unsigned long long CPU_SAMPLE_INTERVAL = 10000;
+
+	struct CpuSample {
+		unsigned long long time;
+		unsigned long long utime;
+		unsigned long long stime;
+	};
+
+	static unsigned long long timevalToUsec(const struct timeval &tv) {
+		return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
 	}
 	
 	static string usecToString(unsigned long long usec) {
@@ -455,41 +852,105 @@ private:
 		integerToHexatri<unsigned long long>(usec, timestamp);
 		return timestamp;
 	}
+
+	static char *appendHexatri(char *pos, const char *end, unsigned long long value) {
+		char buf[2 * sizeof(unsigned long long) + 1];
+		unsigned int size = integerToHexatri<unsigned long long>(value, buf);
+		return appendData(pos, end, buf, size);
+	}
+
+	static void getCpuTimes(int who, unsigned long long &utime, unsigned long long &stime) {
+		struct rusage usage;
+		if (getrusage(who, &usage) == -1) {
+			int e = errno;
+			throw SystemException("getrusage() failed", e);
+		}
+		utime = timevalToUsec(usage.ru_utime);
+		stime = timevalToUsec(usage.ru_stime);
+	}
+
+	/**
+	 * Returns the calling thread's CPU times as of at most CPU_SAMPLE_INTERVAL
+	 * ago. Falls back to the CPU times of the whole process if the platform
+	 * can't tell per-thread times, or doesn't support thread-local storage.
+	 */
+	static void sampleCpuTimes(unsigned long long now, unsigned long long &utime,
+		unsigned long long &stime)
+	{
+		#ifdef RUSAGE_THREAD
+			const int who = RUSAGE_THREAD;
+		#else
+			const int who = RUSAGE_SELF;
+		#endif
+		#ifdef OXT_THREAD_LOCAL_KEYWORD_SUPPORTED
+			static __thread CpuSample sample;
+			if (sample.time == 0 || now < sample.time
+			 || now - sample.time >= CPU_SAMPLE_INTERVAL)
+			{
+				getCpuTimes(who, sample.utime, sample.stime);
+				sample.time = now;
+			}
+			utime = sample.utime;
+			stime = sample.stime;
+		#else
+			getCpuTimes(who, utime, stime);
+		#endif
+	}
+
+	/** Appends " (<time>,<utime>,<stime>)" for a BEGIN, END or FAIL message. */
+	static char *appendTimes(char *pos, const char *end, bool lightweight) {
+		unsigned long long now, utime, stime;
+
+		if (lightweight) {
+			now = SystemTime::getMonotonicUsec();
+			sampleCpuTimes(now, utime, stime);
+		} else {
+			now = SystemTime::getUsec();
+			getCpuTimes(RUSAGE_SELF, utime, stime);
+		}
+		pos = appendData(pos, end, " (");
+		pos = appendHexatri(pos, end, now);
+		pos = appendData(pos, end, ",");
+		pos = appendHexatri(pos, end, utime);
+		pos = appendData(pos, end, ",");
+		pos = appendHexatri(pos, end, stime);
+		return appendData(pos, end, ")");
+	}
 	
 public:
 	ScopeLog()
 		: log(NULL)
 		{ }
 
+	/**
+	 * Logs a BEGIN message now, and an END or FAIL message when this
+	 * object is destroyed, each with the current time and CPU times.
+	 *
+	 * If the Logger uses lightweight scope logs, the time is read from the
+	 * monotonic clock, and the CPU times are those of the calling thread,
+	 * sampled at most once every CPU_SAMPLE_INTERVAL. This avoids two
+	 * getrusage() system calls per scope, at the cost of CPU times that
+	 * are only accurate for scopes that take longer than that interval.
+	 */
 	ScopeLog(const LoggerPtr &_log, const char *name)
 		: log(_log.get())
 	{
 		type = NAME;
 		data.name = name;
 		ok = false;
+		if (log == NULL) {
+			return;
+		}
 
 		char message[150];
 		char *pos = message;
 		const char *end = message + sizeof(message);
-		struct rusage usage;
 
 		pos = appendData(pos, end, "BEGIN: ");
 		pos = appendData(pos, end, name);
-		pos = appendData(pos, end, " (");
-		pos = appendData(pos, end, usecToString(SystemTime::getUsec()));
-		pos = appendData(pos, end, ",");
-		if (getrusage(RUSAGE_SELF, &usage) == -1) {
-			int e = errno;
-			throw SystemException("getrusage() failed", e);
-		}
-		pos = appendData(pos, end, timevalToString(usage.ru_utime));
-		pos = appendData(pos, end, ",");
-		pos = appendData(pos, end, timevalToString(usage.ru_stime));
-		pos = appendData(pos, end, ") ");
-
-		if (log != NULL) {
-			log->message(StaticString(message, pos - message));
-		}
+		pos = appendTimes(pos, end, log->usesLightweightScopeLogs());
+		pos = appendData(pos, end, " ");
+		log->message(StaticString(message, pos - message));
 	}
 	
 	ScopeLog(const LoggerPtr &_log,
@@ -515,7 +976,6 @@ public:
 			char message[150];
 			char *pos = message;
 			const char *end = message + sizeof(message);
-			struct rusage usage;
 			
 			if (ok) {
 				pos = appendData(pos, end, "END: ");
@@ -523,17 +983,7 @@ public:
 				pos = appendData(pos, end, "FAIL: ");
 			}
 			pos = appendData(pos, end, data.name);
-			pos = appendData(pos, end, " (");
-			pos = appendData(pos, end, usecToString(SystemTime::getUsec()));
-			pos = appendData(pos, end, ",");
-			if (getrusage(RUSAGE_SELF, &usage) == -1) {
-				int e = errno;
-				throw SystemException("getrusage() failed", e);
-			}
-			pos = appendData(pos, end, timevalToString(usage.ru_utime));
-			pos = appendData(pos, end, ",");
-			pos = appendData(pos, end, timevalToString(usage.ru_stime));
-			pos = appendData(pos, end, ")");
+			pos = appendTimes(pos, end, log->usesLightweightScopeLogs());
 
 			log->message(StaticString(message, pos - message));
 		} else {
@@ -548,12 +998,46 @@ public:
 	void success() {
 		ok = true;
 	}
+
+	/**
+	 * Logs the BEGIN message of a scope with the given timestamp, for
+	 * transactions that are only created once a request is known to be
+	 * worth logging. The CPU usage at that time isn't known anymore, so
+	 * it's logged as 0. Finish with logEndAt().
+	 */
+	static void logBeginAt(const LoggerPtr &log, const char *name, unsigned long long usec) {
+		string message = "BEGIN: ";
+		message.append(name);
+		message.append(" (");
+		message.append(usecToString(usec));
+		message.append(",0,0) ");
+		log->message(message);
+	}
+
+	static void logEndAt(const LoggerPtr &log, const char *name, unsigned long long usec,
+		bool success)
+	{
+		string message = success ? "END: " : "FAIL: ";
+		message.append(name);
+		message.append(" (");
+		message.append(usecToString(usec));
+		message.append(",0,0)");
+		log->message(message);
+	}
 };
 
 
 class LoggerFactory: public boost::enable_shared_from_this<LoggerFactory> {
 private:
-	static const unsigned int CONNECTION_POOL_MAX_SIZE = 10;
+	static const unsigned int DEFAULT_CONNECTION_POOL_MAX_SIZE = 10;
+	/** Idle connections that haven't been used for this long (in
+	 * microseconds) are closed instead of being reused, because
+	 * firewalls tend to silently drop such TCP connections. */
+	static const unsigned long long CONNECTION_MAX_IDLE_TIME = 5 * 60 * 1000000ull;
+	/** Filter sources are set per application, so there are only a few. */
+	static const unsigned int MAX_FILTER_CACHE_SIZE = 64;
+
+	typedef boost::shared_ptr<FilterSupport::Filter> FilterPtr;
 
 	const string serverAddress;
 	const string username;
@@ -562,16 +1046,91 @@ private:
 	RandomGenerator randomGenerator;
 
 	LoggerPtr nullLogger;
+	/** Whether newly created Loggers buffer their messages. See Logger::buffered. */
+	bool bufferMessages;
+	/** Whether newly created Loggers use lightweight scope logs. See ScopeLog. */
+	bool lightweightScopeLogs;
+	/** If set, transactions are sent through this instead of connections. */
+	DatagramSocketPtr datagramSocket;
+	/** The number of datagram transactions that weren't sent because they
+	 * didn't pass their filters. */
+	boost::atomic<unsigned int> filteredTransactions;
 	
 	/** Lock protecting the fields that follow, but not the
 	 * contents of the connection object.
 	 */
 	mutable boost::mutex syncher;
 	vector<ConnectionPtr> connectionPool;
+	unsigned int connectionPoolMaxSize;
 	unsigned int maxConnectTries;
 	unsigned long long reconnectTimeout;
 	unsigned long long nextReconnectTime;
+
+	// Connection pool statistics.
+	unsigned int connectionsCreated;
+	unsigned int connectionsReused;
+	unsigned int connectionsReusedBySameThread;
+	unsigned int unhealthyConnectionsClosed;
+
+	/**
+	 * Compiled filters for passesFilters(), by source. NULL if the source
+	 * doesn't compile.
+	 */
+	map<string, FilterPtr> filterCache;
 	
+	void initConnectionPool() {
+		connectionPoolMaxSize = DEFAULT_CONNECTION_POOL_MAX_SIZE;
+		connectionsCreated = 0;
+		connectionsReused = 0;
+		connectionsReusedBySameThread = 0;
+		unhealthyConnectionsClosed = 0;
+		filteredTransactions = 0;
+	}
+
+	FilterPtr compileFilter(const StaticString &source) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		string key = source;
+		map<string, FilterPtr>::iterator it = filterCache.find(key);
+		if (it != filterCache.end()) {
+			return it->second;
+		}
+
+		FilterPtr filter;
+		try {
+			filter = boost::make_shared<FilterSupport::Filter>(source);
+		} catch (const SyntaxError &e) {
+			P_DEBUG("Cannot compile Union Station filter: " << e.what());
+		}
+		if (filterCache.size() >= MAX_FILTER_CACHE_SIZE) {
+			filterCache.clear();
+		}
+		filterCache.insert(make_pair(key, filter));
+		return filter;
+	}
+
+	/** Must be called while holding the lock. */
+	ConnectionPtr takeConnectionFromPool() {
+		if (connectionPool.empty()) {
+			return ConnectionPtr();
+		}
+
+		vector<ConnectionPtr>::iterator it = connectionPool.end();
+		boost::thread::id self = boost::this_thread::get_id();
+		do {
+			it--;
+			if ((*it)->lastThread == self) {
+				break;
+			}
+		} while (it != connectionPool.begin());
+		if ((*it)->lastThread != self) {
+			it = connectionPool.end() - 1;
+		}
+
+		ConnectionPtr connection = *it;
+		connectionPool.erase(it);
+		return connection;
+	}
+
 	static string determineNodeName(const string &givenNodeName) {
 		if (givenNodeName.empty()) {
 			return getHostName();
@@ -591,7 +1150,13 @@ private:
 		return dynamic_cast<const T *>(&e) != NULL;
 	}
 	
-	ConnectionPtr createNewConnection() {
+	/**
+	 * @param binaryLogs Whether to ask the logging agent to accept log
+	 *                   entries in the binary format. If it doesn't
+	 *                   support that, then a new connection is made that
+	 *                   uses the text format.
+	 */
+	ConnectionPtr createNewConnection(bool binaryLogs = true) {
 		TRACE_POINT();
 		int fd;
 		vector<string> args;
@@ -625,9 +1190,19 @@ private:
 		}
 		
 		UPDATE_TRACE_POINT();
-		writeArrayMessage(fd, &timeout, "init", nodeName.c_str(), NULL);
+		if (binaryLogs) {
+			writeArrayMessage(fd, &timeout, "init", nodeName.c_str(),
+				"binary-logs", NULL);
+		} else {
+			writeArrayMessage(fd, &timeout, "init", nodeName.c_str(), NULL);
+		}
 		if (!readArrayMessage(fd, args, &timeout)) {
 			throw SystemException("Cannot connect to logging server", ECONNREFUSED);
+		} else if (binaryLogs && args.size() == 2 && args[0] == "error") {
+			// Logging agents that predate the binary format don't accept
+			// the extra argument.
+			P_DEBUG("The logging agent doesn't support binary logs: " << args[1]);
+			return createNewConnection(false);
 		} else if (args.size() != 1) {
 			throw IOException("Logging server returned an invalid reply for the 'init' command");
 		} else if (args[0] == "server shutting down") {
@@ -637,12 +1212,15 @@ private:
 		}
 		
 		guard.clear();
-		return boost::make_shared<Connection>(fd);
+		return boost::make_shared<Connection>(fd, binaryLogs);
 	}
 	
 public:
 	LoggerFactory() {
 		nullLogger = boost::make_shared<Logger>();
+		bufferMessages = false;
+		lightweightScopeLogs = false;
+		initConnectionPool();
 	}
 	
 	LoggerFactory(const string &_serverAddress, const string &_username,
@@ -660,54 +1238,84 @@ public:
 		}
 		reconnectTimeout  = 1000000;
 		nextReconnectTime = 0;
+		bufferMessages    = false;
+		lightweightScopeLogs = false;
+		initConnectionPool();
 	}
 
+	/**
+	 * Checks out a connection from the pool, or creates a new one if the pool
+	 * is empty. Prefers the connection that the calling thread checked in
+	 * last. Connections that are no longer usable are closed.
+	 */
 	ConnectionPtr checkoutConnection() {
 		TRACE_POINT();
 		boost::unique_lock<boost::mutex> l(syncher);
-		if (!connectionPool.empty()) {
-			P_TRACE(3, "Checked out existing connection");
-			ConnectionPtr connection = connectionPool.back();
-			connectionPool.pop_back();
-			return connection;
-
-		} else {
-			if (SystemTime::getUsec() < nextReconnectTime) {
-				P_TRACE(3, "Not yet time to reconnect; returning NULL connection");
-				return ConnectionPtr();
-			}
-
+		ConnectionPtr connection;
+		while ((connection = takeConnectionFromPool()) != NULL) {
+			/* Don't poll the socket while holding the lock. Nobody
+			 * else has a reference to this connection anyway.
+			 */
 			l.unlock();
-			P_TRACE(3, "Creating new connection with logging agent");
-			ConnectionPtr connection;
-			try {
-				connection = createNewConnection();
-			} catch (const TimeoutException &) {
-				l.lock();
-				P_WARN("Timeout trying to connect to the logging agent at " << serverAddress << "; " <<
-					"will reconnect in " << reconnectTimeout / 1000000 << " second(s).");
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
-				return ConnectionPtr();
-			} catch (const tracable_exception &e) {
-				l.lock();
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
-				if (instanceof<IOException>(e) || instanceof<SystemException>(e)) {
-					P_WARN("Cannot connect to the logging agent at " << serverAddress <<
-						" (" << e.what() << "); will reconnect in " <<
-						reconnectTimeout / 1000000 << " second(s).");
-					return ConnectionPtr();
-				} else {
-					throw;
+			unsigned long long now = SystemTime::getCoarseUsec();
+			bool healthy = connection->isHealthy()
+				&& (now < connection->lastCheckinTime
+					|| now - connection->lastCheckinTime < CONNECTION_MAX_IDLE_TIME);
+			if (!healthy) {
+				P_DEBUG("Closing unusable connection with the logging agent");
+				connection->disconnect();
+			}
+			l.lock();
+			if (healthy) {
+				P_TRACE(3, "Checked out existing connection");
+				connectionsReused++;
+				if (connection->lastThread == boost::this_thread::get_id()) {
+					connectionsReusedBySameThread++;
 				}
+				return connection;
+			} else {
+				unhealthyConnectionsClosed++;
 			}
+		}
+
+		if (SystemTime::getCoarseUsec() < nextReconnectTime) {
+			P_TRACE(3, "Not yet time to reconnect; returning NULL connection");
+			return ConnectionPtr();
+		}
 
-			return connection;
+		l.unlock();
+		P_TRACE(3, "Creating new connection with logging agent");
+		try {
+			connection = createNewConnection();
+		} catch (const TimeoutException &) {
+			l.lock();
+			P_WARN("Timeout trying to connect to the logging agent at " << serverAddress << "; " <<
+				"will reconnect in " << reconnectTimeout / 1000000 << " second(s).");
+			nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
+			return ConnectionPtr();
+		} catch (const tracable_exception &e) {
+			l.lock();
+			nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
+			if (instanceof<IOException>(e) || instanceof<SystemException>(e)) {
+				P_WARN("Cannot connect to the logging agent at " << serverAddress <<
+					" (" << e.what() << "); will reconnect in " <<
+					reconnectTimeout / 1000000 << " second(s).");
+				return ConnectionPtr();
+			} else {
+				throw;
+			}
 		}
+
+		l.lock();
+		connectionsCreated++;
+		return connection;
 	}
 
 	void checkinConnection(const ConnectionPtr &connection) {
 		boost::lock_guard<boost::mutex> l(syncher);
-		if (connectionPool.size() < CONNECTION_POOL_MAX_SIZE) {
+		if (connectionPool.size() < connectionPoolMaxSize) {
+			connection->lastThread = boost::this_thread::get_id();
+			connection->lastCheckinTime = SystemTime::getCoarseUsec();
 			connectionPool.push_back(connection);
 		} else {
 			connection->disconnect();
@@ -755,6 +1363,16 @@ public:
 		*end = '\0';
 		
 		integerToHexatri<unsigned long long>(timestamp, timestampStr);
+
+		if (datagramSocket != NULL) {
+			return boost::make_shared<Logger>(shared_from_this(),
+				datagramSocket,
+				string(txnId, end - txnId),
+				groupName, category,
+				unionStationKey,
+				filters,
+				lightweightScopeLogs);
+		}
 		
 		ConnectionPtr connection = checkoutConnection();
 		if (connection == NULL) {
@@ -780,14 +1398,14 @@ public:
 				filters.c_str(),
 				NULL);
 			
-			vector<string> args;
-			if (!readArrayMessage(connection->fd, args, &timeout)) {
+			SmallVector<StaticString, 2> args;
+			if (!readArrayMessage(connection->fd, args, connection->readBuffer, &timeout)) {
 				boost::lock_guard<boost::mutex> l(syncher);
 				P_WARN("The logging agent at " << serverAddress <<
 					" closed the connection (no error message given);" <<
 					" will reconnect in " << reconnectTimeout / 1000000 <<
 					" second(s).");
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+				nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 				return createNullLogger();
 			} else if (args.size() == 2 && args[0] == "error") {
 				boost::lock_guard<boost::mutex> l(syncher);
@@ -795,7 +1413,7 @@ public:
 					" closed the connection (error message: " << args[1] <<
 					"); will reconnect in " << reconnectTimeout / 1000000 <<
 					" second(s).");
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+				nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 				return createNullLogger();
 			} else if (args.empty() || args[0] != "ok") {
 				boost::lock_guard<boost::mutex> l(syncher);
@@ -803,7 +1421,7 @@ public:
 					" sent an unexpected reply;" <<
 					" will reconnect in " << reconnectTimeout / 1000000 <<
 					" second(s).");
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+				nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 				return createNullLogger();
 			}
 			
@@ -812,13 +1430,16 @@ public:
 				connection,
 				string(txnId, end - txnId),
 				groupName, category,
-				unionStationKey);
+				unionStationKey,
+				PRINT,
+				bufferMessages,
+				lightweightScopeLogs);
 			
 		} catch (const TimeoutException &) {
 			boost::lock_guard<boost::mutex> l(syncher);
 			P_WARN("Timeout trying to communicate with the logging agent at " << serverAddress << "; " <<
 				"will reconnect in " << reconnectTimeout / 1000000 << " second(s).");
-			nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+			nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 			return createNullLogger();
 			
 		} catch (const SystemException &e) {
@@ -840,7 +1461,7 @@ public:
 						" will reconnect in " << reconnectTimeout / 1000000 <<
 						" second(s).");
 				}
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+				nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 				return createNullLogger();
 			} else {
 				throw;
@@ -856,6 +1477,17 @@ public:
 		if (serverAddress.empty() || txnId.empty()) {
 			return createNullLogger();
 		}
+		if (datagramSocket != NULL) {
+			// The logging agent writes this part of the transaction
+			// separately from the part that was logged by whoever
+			// created the transaction.
+			return boost::make_shared<Logger>(shared_from_this(),
+				datagramSocket,
+				txnId, groupName, category,
+				unionStationKey,
+				string(),
+				lightweightScopeLogs);
+		}
 		
 		char timestampStr[2 * sizeof(unsigned long long) + 1];
 		integerToHexatri<unsigned long long>(SystemTime::getUsec(), timestampStr);
@@ -884,13 +1516,16 @@ public:
 			return boost::make_shared<Logger>(shared_from_this(),
 				connection,
 				txnId, groupName, category,
-				unionStationKey);
+				unionStationKey,
+				PRINT,
+				bufferMessages,
+				lightweightScopeLogs);
 			
 		} catch (const TimeoutException &) {
 			boost::lock_guard<boost::mutex> l(syncher);
 			P_WARN("Timeout trying to communicate with the logging agent at " << serverAddress << "; " <<
 				"will reconnect in " << reconnectTimeout / 1000000 << " second(s).");
-			nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+			nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 			return createNullLogger();
 			
 		} catch (const SystemException &e) {
@@ -912,7 +1547,7 @@ public:
 						" will reconnect in " << reconnectTimeout / 1000000 <<
 						" second(s).");
 				}
-				nextReconnectTime = SystemTime::getUsec() + reconnectTimeout;
+				nextReconnectTime = SystemTime::getCoarseUsec() + reconnectTimeout;
 				return createNullLogger();
 			} else {
 				throw;
@@ -929,6 +1564,96 @@ public:
 		boost::lock_guard<boost::mutex> l(syncher);
 		reconnectTimeout = usec;
 	}
+
+	/** The maximum number of idle connections to keep around. */
+	void setConnectionPoolMaxSize(unsigned int value) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		connectionPoolMaxSize = value;
+		while (connectionPool.size() > connectionPoolMaxSize) {
+			connectionPool.front()->disconnect();
+			connectionPool.erase(connectionPool.begin());
+		}
+	}
+
+	/** Returns a one-line summary of the connection pool's statistics. */
+	string inspectConnectionPool() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		stringstream result;
+		result << connectionPool.size() << "/" << connectionPoolMaxSize << " idle, " <<
+			connectionsCreated << " created, " <<
+			connectionsReused << " reused (" <<
+			connectionsReusedBySameThread << " by the same thread), " <<
+			unhealthyConnectionsClosed << " unusable ones closed";
+		if (datagramSocket != NULL) {
+			result << "; datagrams: " << datagramSocket->getSent() << " sent, " <<
+				datagramSocket->getDropped() << " dropped, " <<
+				filteredTransactions.load(boost::memory_order_relaxed) << " filtered";
+		}
+		return result.str();
+	}
+
+	/** Must be called before any Loggers are created. */
+	void setBufferMessages(bool value) {
+		bufferMessages = value;
+	}
+
+	/** Must be called before any Loggers are created. */
+	void setLightweightScopeLogs(bool value) {
+		lightweightScopeLogs = value;
+	}
+
+	/**
+	 * Makes newly created Loggers send their whole transaction as a single
+	 * datagram to the logging agent's datagram socket at the given Unix
+	 * socket address, when they're destroyed, instead of using connections.
+	 * Logging then never waits for the logging agent, but transactions are
+	 * dropped if it isn't running or can't keep up. Must be called before
+	 * any Loggers are created.
+	 */
+	void setDatagramAddress(const string &address) {
+		datagramSocket = boost::make_shared<DatagramSocket>(
+			parseUnixSocketAddress(address), username, password, nodeName);
+	}
+	
+	/**
+	 * Returns whether the given transaction log data passes all the given
+	 * filters, which are separated by '\1' characters, just like the logging
+	 * agent's Transaction::passesFilter(). Filters that can't be compiled
+	 * are left to the logging agent. Transactions that don't pass are
+	 * counted as filtered.
+	 */
+	bool passesFilters(const StaticString &filters, const StaticString &logData) {
+		const char *current = filters.data();
+		const char *end     = filters.data() + filters.size();
+		vector<FilterPtr> compiledFilters;
+		unsigned int fields = 0;
+
+		while (current < end) {
+			StaticString tmp(current, end - current);
+			size_t pos = tmp.find('\1');
+			if (pos == string::npos) {
+				pos = tmp.size();
+			}
+
+			FilterPtr filter = compileFilter(StaticString(current, pos));
+			if (filter != NULL) {
+				fields |= filter->getReferencedFields();
+				compiledFilters.push_back(filter);
+			}
+
+			current = tmp.data() + pos + 1;
+		}
+
+		FilterSupport::ContextFromLog ctx(logData, fields);
+		vector<FilterPtr>::const_iterator it;
+		for (it = compiledFilters.begin(); it != compiledFilters.end(); it++) {
+			if (!(*it)->run(ctx)) {
+				filteredTransactions++;
+				return false;
+			}
+		}
+		return true;
+	}
 	
 	bool isNull() const {
 		return serverAddress.empty();
@@ -960,6 +1685,13 @@ _checkinConnection(const LoggerFactoryPtr &loggerFactory, const ConnectionPtr &c
 	loggerFactory->checkinConnection(connection);
 }
 
+inline bool
+_passesFilters(const LoggerFactoryPtr &loggerFactory, const string &filters,
+	const StaticString &logData)
+{
+	return loggerFactory->passesFilters(filters, logData);
+}
+
 
 } // namespace UnionStation
 } // namespace Passenger
@@ -0,0 +1,295 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_UNION_STATION_LOG_BATCH_H_
+#define _PASSENGER_UNION_STATION_LOG_BATCH_H_
+
+#include <string>
+#include <StaticString.h>
+
+namespace Passenger {
+namespace UnionStation {
+
+using namespace std;
+
+
+/*
+ * A batch of log entries for a single transaction, in a compact binary
+ * format. Loggers send it to the logging agent as the scalar message that
+ * follows a "logBatch" array message, instead of sending a "log" array
+ * message plus a scalar message for every entry. The transaction ID is
+ * only sent once per batch, and timestamps don't have to be formatted and
+ * parsed as text.
+ *
+ * Format:
+ *
+ *   1 byte   LOG_BATCH_FORMAT_VERSION
+ *   varint   size of the transaction ID, followed by the transaction ID
+ *   For each entry:
+ *     varint   difference between this entry's timestamp and the previous
+ *              one's, in microseconds, zigzag encoded. The first entry's
+ *              timestamp is relative to 0.
+ *     varint   size of the data, followed by the data
+ *
+ * Varints are unsigned LEB128: 7 bits per byte, least significant group
+ * first, with the high bit set on all bytes except the last one.
+ */
+static const char LOG_BATCH_FORMAT_VERSION = 1;
+
+
+inline void
+appendVarint(string &output, unsigned long long value) {
+	char buf[10];
+	unsigned int size = 0;
+	while (value >= 0x80) {
+		buf[size] = (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+		size++;
+	}
+	buf[size] = (char) value;
+	output.append(buf, size + 1);
+}
+
+/**
+ * Reads a varint and advances `current` past it. Returns false if the data
+ * ends in the middle of the varint, or if it doesn't fit in 64 bits.
+ */
+inline bool
+readVarint(const char *&current, const char *end, unsigned long long &value) {
+	const char *pos = current;
+	unsigned int shift = 0;
+	value = 0;
+	while (pos < end && shift < 64) {
+		unsigned char byte = (unsigned char) *pos;
+		pos++;
+		value |= (unsigned long long) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			current = pos;
+			return true;
+		}
+		shift += 7;
+	}
+	return false;
+}
+
+
+class LogBatchWriter {
+private:
+	string data;
+	unsigned long long lastTimestamp;
+
+public:
+	LogBatchWriter() {
+		lastTimestamp = 0;
+	}
+
+	/** Writes the batch header, if it hasn't been written yet. */
+	void start(const StaticString &txnId) {
+		if (data.empty()) {
+			data.append(1, LOG_BATCH_FORMAT_VERSION);
+			appendVarint(data, txnId.size());
+			data.append(txnId.data(), txnId.size());
+			lastTimestamp = 0;
+		}
+	}
+
+	void append(const StaticString &txnId, unsigned long long timestamp,
+		const StaticString &entry)
+	{
+		start(txnId);
+
+		long long delta = (long long) (timestamp - lastTimestamp);
+		appendVarint(data, ((unsigned long long) delta << 1) ^ (unsigned long long) (delta >> 63));
+		appendVarint(data, entry.size());
+		data.append(entry.data(), entry.size());
+		lastTimestamp = timestamp;
+	}
+
+	bool empty() const {
+		return data.empty();
+	}
+
+	size_t size() const {
+		return data.size();
+	}
+
+	const string &getData() const {
+		return data;
+	}
+
+	void clear() {
+		data.clear();
+	}
+};
+
+
+class LogBatchReader {
+private:
+	const char *current;
+	const char *end;
+	StaticString txnId;
+	unsigned long long timestamp;
+	bool valid;
+
+public:
+	LogBatchReader(const StaticString &batch) {
+		unsigned long long size;
+
+		current = batch.data();
+		end = batch.data() + batch.size();
+		timestamp = 0;
+		valid = current < end
+			&& *current == LOG_BATCH_FORMAT_VERSION
+			&& readVarint(++current, end, size)
+			&& size <= (unsigned long long) (end - current);
+		if (valid) {
+			txnId = StaticString(current, size);
+			current += size;
+		}
+	}
+
+	/** Whether the batch has been well-formed so far. */
+	bool isValid() const {
+		return valid;
+	}
+
+	const StaticString &getTxnId() const {
+		return txnId;
+	}
+
+	/**
+	 * Reads the next entry. Returns false at the end of the batch, or if
+	 * the batch turns out to be malformed, in which case isValid() returns
+	 * false.
+	 */
+	bool next(unsigned long long &entryTimestamp, StaticString &entry) {
+		unsigned long long zigzag, size;
+
+		if (!valid || current == end) {
+			return false;
+		}
+		if (!readVarint(current, end, zigzag)
+		 || !readVarint(current, end, size)
+		 || size > (unsigned long long) (end - current))
+		{
+			valid = false;
+			return false;
+		}
+		timestamp += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+		entryTimestamp = timestamp;
+		entry = StaticString(current, size);
+		current += size;
+		return true;
+	}
+};
+
+
+/*
+ * A whole transaction in a single datagram, for the logging agent's datagram
+ * socket. Unlike the stream protocol there is no connection, so each
+ * datagram carries the credentials and everything that "openTransaction"
+ * and "closeTransaction" would have sent.
+ *
+ * Format:
+ *
+ *   1 byte   TRANSACTION_DATAGRAM_FORMAT_VERSION
+ *   For each of the username, password, group name, node name, category,
+ *   Union Station key and filters:
+ *     varint   size, followed by the data
+ *   varint   time at which the transaction was opened, in microseconds
+ *   varint   time at which the transaction was closed, in microseconds
+ *   The rest: a log batch with the transaction's entries (see above).
+ */
+static const char TRANSACTION_DATAGRAM_FORMAT_VERSION = 1;
+
+struct TransactionDatagram {
+	StaticString username;
+	StaticString password;
+	StaticString groupName;
+	StaticString nodeName;
+	StaticString category;
+	StaticString unionStationKey;
+	StaticString filters;
+	unsigned long long openedAt;
+	unsigned long long closedAt;
+	/** Must contain at least the batch header. See LogBatchWriter::start(). */
+	StaticString batch;
+
+	TransactionDatagram()
+		: openedAt(0),
+		  closedAt(0)
+		{ }
+
+	void appendTo(string &output) const {
+		const StaticString *fields[] = { &username, &password, &groupName,
+			&nodeName, &category, &unionStationKey, &filters };
+		output.append(1, TRANSACTION_DATAGRAM_FORMAT_VERSION);
+		for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+			appendVarint(output, fields[i]->size());
+			output.append(fields[i]->data(), fields[i]->size());
+		}
+		appendVarint(output, openedAt);
+		appendVarint(output, closedAt);
+		output.append(batch.data(), batch.size());
+	}
+
+	/**
+	 * Parses the given datagram. The fields refer to `data`. Returns false
+	 * if it's malformed; the batch itself is only checked when it's read.
+	 */
+	bool parse(const StaticString &data) {
+		StaticString *fields[] = { &username, &password, &groupName,
+			&nodeName, &category, &unionStationKey, &filters };
+		const char *current = data.data();
+		const char *end = data.data() + data.size();
+		unsigned long long size;
+
+		if (current == end || *current != TRANSACTION_DATAGRAM_FORMAT_VERSION) {
+			return false;
+		}
+		current++;
+		for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+			if (!readVarint(current, end, size)
+			 || size > (unsigned long long) (end - current))
+			{
+				return false;
+			}
+			*fields[i] = StaticString(current, size);
+			current += size;
+		}
+		if (!readVarint(current, end, openedAt)
+		 || !readVarint(current, end, closedAt))
+		{
+			return false;
+		}
+		batch = StaticString(current, end - current);
+		return true;
+	}
+};
+
+
+} // namespace UnionStation
+} // namespace Passenger
+
+#endif /* _PASSENGER_UNION_STATION_LOG_BATCH_H_ */
@@ -46,6 +46,10 @@
 	#include <sys/syscall.h>
 	#include <features.h>
 #endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+	#include <sys/event.h>
+	#define PASSENGER_HAS_KQUEUE_PROC
+#endif
 #include <vector>
 #include <FileDescriptor.h>
 #include <MessageServer.h>
@@ -55,7 +59,6 @@
 #include <Utils/Base64.h>
 #include <Utils/CachedFileStat.hpp>
 #include <Utils/StrIntUtils.h>
-#include <Utils/HttpHeaderBufferer.h>
 
 #ifndef HOST_NAME_MAX
 	#if defined(_POSIX_HOST_NAME_MAX)
@@ -75,7 +78,6 @@
 namespace Passenger {
 
 static string passengerTempDir;
-HttpHeaderBufferer::StaticData HttpHeaderBufferer::staticData;
 
 namespace {
 	/**
@@ -1010,6 +1012,65 @@ asyncFork() {
 	#endif
 }
 
+int
+waitForProcessExit(pid_t pid, int timeout) {
+	#if defined(__linux__) && defined(SYS_pidfd_open)
+		int fd = (int) syscall(SYS_pidfd_open, pid, 0);
+		if (fd == -1) {
+			return (errno == ESRCH) ? 1 : -1;
+		}
+		FileDescriptor guard(fd);
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		// A pidfd becomes readable when the process exits.
+		int ret = syscalls::poll(&pfd, 1, timeout);
+		if (ret == -1) {
+			return -1;
+		} else {
+			return ret > 0;
+		}
+	#elif defined(PASSENGER_HAS_KQUEUE_PROC)
+		int kq = kqueue();
+		if (kq == -1) {
+			return -1;
+		}
+		FileDescriptor guard(kq);
+		struct kevent change, event;
+		struct timespec ts, *tsp = NULL;
+		int ret;
+
+		EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			tsp = &ts;
+		}
+		do {
+			ret = kevent(kq, &change, 1, &event, 1, tsp);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			return (errno == ESRCH) ? 1 : -1;
+		} else if (ret == 0) {
+			return 0;
+		} else if (event.flags & EV_ERROR) {
+			if (event.data == ESRCH) {
+				// Already exited and reaped.
+				return 1;
+			} else {
+				errno = (int) event.data;
+				return -1;
+			}
+		} else {
+			return 1;
+		}
+	#else
+		errno = ENOSYS;
+		return -1;
+	#endif
+}
+
 // Async-signal safe way to get the current process's hard file descriptor limit.
 static int
 getFileDescriptorLimit() {
@@ -398,6 +398,21 @@ int runShellCommand(const StaticString &command);
  */
 pid_t asyncFork();
 
+/**
+ * Waits until the process with the given PID has exited, for at most
+ * <em>timeout</em> miliseconds (-1 means forever), without polling in a
+ * sleep loop: a pidfd is used on Linux, and kqueue's EVFILT_PROC on OS X
+ * and the BSDs. The process is not reaped; it may still be a zombie.
+ *
+ * Returns 1 if the process has exited and 0 if the timeout expired.
+ * Returns -1 with errno set if the process can't be waited for this way,
+ * e.g. because the platform or the kernel doesn't support it (ENOSYS);
+ * callers should then fall back to polling.
+ *
+ * @throws boost::thread_interrupted
+ */
+int waitForProcessExit(pid_t pid, int timeout);
+
 /**
  * Close all file descriptors that are higher than <em>lastToKeepOpen</em>.
  * This function is async-signal safe. But make sure there are no other
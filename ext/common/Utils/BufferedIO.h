@@ -24,7 +24,9 @@ using namespace oxt;
  * found in C++'s iostream or libc's stdio:
  * - All functions have timeout support.
  * - The readLine() method returns a C++ string, so no need to worry about
- *   buffer management. A size limit can be imposed.
+ *   buffer management. A size limit can be imposed. There's also a variant
+ *   that returns a StaticString pointing into the read buffer, for reading
+ *   many lines without allocating memory for each of them.
  * - Read buffer is infinite in size.
  * - Unreading (pushing back) arbitrary amount of data.
  */
@@ -32,6 +34,16 @@ class BufferedIO {
 private:
 	FileDescriptor fd;
 	string buffer;
+	/** Data before this position in <tt>buffer</tt> has already been consumed. */
+	string::size_type bufferStart;
+	
+	/** Removes already consumed data from the buffer. */
+	void compactBuffer() {
+		if (bufferStart > 0) {
+			buffer.erase(0, bufferStart);
+			bufferStart = 0;
+		}
+	}
 	
 	static pair<unsigned int, bool> nReadOrEofReached(const char *data,
 		unsigned int size, void *output, unsigned int goalSize, unsigned int *alreadyRead)
@@ -74,18 +86,21 @@ private:
 public:
 	typedef boost::function< pair<unsigned int, bool>(const char *data, unsigned int size) > AcceptFunction;
 	
-	BufferedIO() { }
+	BufferedIO()
+		: bufferStart(0)
+		{ }
 	
 	BufferedIO(const FileDescriptor &_fd)
-		: fd(_fd)
+		: fd(_fd),
+		  bufferStart(0)
 		{ }
 	
 	FileDescriptor getFd() const {
 		return fd;
 	}
 	
-	const string &getBuffer() const {
-		return buffer;
+	StaticString getBuffer() const {
+		return StaticString(buffer).substr(bufferStart);
 	}
 	
 	/**
@@ -114,6 +129,7 @@ public:
 		pair<unsigned int, bool> acceptResult;
 		unsigned int totalRead = 0;
 		
+		compactBuffer();
 		if (!buffer.empty()) {
 			acceptResult = acceptor(buffer.c_str(), buffer.size());
 			if (OXT_UNLIKELY(!acceptResult.second && acceptResult.first < buffer.size())) {
@@ -177,12 +193,62 @@ public:
 		return output;
 	}
 	
+	/**
+	 * Like <tt>readLine(unsigned int, unsigned long long *)</tt>, but
+	 * instead of copying the line into a new string, sets <tt>output</tt>
+	 * to the line's location in the read buffer. <tt>output</tt> is only
+	 * valid until the next method call on this BufferedIO object.
+	 * Lines that have already been read from the file descriptor are
+	 * returned without any further copying.
+	 */
+	void readLine(StaticString &output, unsigned int max = 1024, unsigned long long *timeout = NULL) {
+		while (true) {
+			const char *data = buffer.data() + bufferStart;
+			unsigned int size = buffer.size() - bufferStart;
+			const char *newline = (const char *) memchr(data, '\n', size);
+			
+			if (newline != NULL) {
+				unsigned int lineSize = newline - data + 1;
+				if (lineSize > max) {
+					throw SecurityException("Line too long");
+				}
+				output = StaticString(data, lineSize);
+				bufferStart += lineSize;
+				return;
+			} else if (size > max) {
+				throw SecurityException("Line too long");
+			}
+			
+			if (OXT_UNLIKELY(timeout != NULL && !waitUntilReadable(fd, timeout))) {
+				throw TimeoutException("Read timeout");
+			}
+			
+			char tmp[1024 * 8];
+			ssize_t ret = syscalls::read(fd, tmp, sizeof(tmp));
+			if (ret == 0) {
+				// EOF: return the incomplete last line, if any.
+				output = StaticString(data, size);
+				bufferStart = buffer.size();
+				return;
+			} else if (OXT_UNLIKELY(ret == -1)) {
+				if (errno != EAGAIN) {
+					int e = errno;
+					throw SystemException("read() failed", e);
+				}
+			} else {
+				compactBuffer();
+				buffer.append(tmp, ret);
+			}
+		}
+	}
+	
 	void unread(const void *buf, unsigned int size) {
 		string newBuffer;
-		newBuffer.reserve(size + buffer.size());
+		newBuffer.reserve(size + buffer.size() - bufferStart);
 		newBuffer.append((const char *) buf, (string::size_type) size);
-		newBuffer.append(buffer);
+		newBuffer.append(buffer, bufferStart, string::npos);
 		buffer = newBuffer;
+		bufferStart = 0;
 	}
 	
 	void unread(const StaticString &str) {
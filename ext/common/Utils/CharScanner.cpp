@@ -0,0 +1,197 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#include <Utils/CharScanner.h>
+#include <cstddef>
+#include <stdint.h>
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+	#include <emmintrin.h>
+	#define CS_SSE2_AVAILABLE
+	// The AVX2 kernel is compiled with a function-level target attribute, so
+	// that the rest of the code doesn't require an AVX2 capable CPU.
+	#if (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) \
+	  || defined(__clang__)
+		#include <immintrin.h>
+		#define CS_AVX2_AVAILABLE
+	#endif
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	#include <arm_neon.h>
+	#define CS_NEON_AVAILABLE
+#endif
+
+namespace Passenger {
+
+
+static const char *
+findCrOrLfScalar(const char *begin, const char *end) {
+	const char *pos = begin;
+	while (pos < end && *pos != '\r' && *pos != '\n') {
+		pos++;
+	}
+	return pos;
+}
+
+#ifdef CS_SSE2_AVAILABLE
+	static const char *
+	findCrOrLfSse2(const char *begin, const char *end) {
+		const __m128i cr = _mm_set1_epi8('\r');
+		const __m128i lf = _mm_set1_epi8('\n');
+		const char *pos = begin;
+
+		while (end - pos >= 16) {
+			__m128i data = _mm_loadu_si128((const __m128i *) pos);
+			int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(data, cr),
+				_mm_cmpeq_epi8(data, lf)));
+			if (mask != 0) {
+				return pos + __builtin_ctz(mask);
+			}
+			pos += 16;
+		}
+		return findCrOrLfScalar(pos, end);
+	}
+#endif
+
+#ifdef CS_AVX2_AVAILABLE
+	__attribute__((target("avx2")))
+	static const char *
+	findCrOrLfAvx2(const char *begin, const char *end) {
+		const __m256i cr = _mm256_set1_epi8('\r');
+		const __m256i lf = _mm256_set1_epi8('\n');
+		const char *pos = begin;
+
+		while (end - pos >= 32) {
+			__m256i data = _mm256_loadu_si256((const __m256i *) pos);
+			unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpeq_epi8(data, cr),
+				_mm256_cmpeq_epi8(data, lf)));
+			if (mask != 0) {
+				return pos + __builtin_ctz(mask);
+			}
+			pos += 32;
+		}
+		return findCrOrLfSse2(pos, end);
+	}
+#endif
+
+#ifdef CS_NEON_AVAILABLE
+	static const char *
+	findCrOrLfNeon(const char *begin, const char *end) {
+		const uint8x16_t cr = vdupq_n_u8('\r');
+		const uint8x16_t lf = vdupq_n_u8('\n');
+		const char *pos = begin;
+
+		while (end - pos >= 16) {
+			uint8x16_t data = vld1q_u8((const uint8_t *) pos);
+			uint8x16_t matches = vorrq_u8(vceqq_u8(data, cr), vceqq_u8(data, lf));
+			// Narrow every byte of the comparison result to 4 bits, so
+			// that the result fits in a 64-bit integer.
+			uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+			if (mask != 0) {
+				return pos + (__builtin_ctzll(mask) >> 2);
+			}
+			pos += 16;
+		}
+		return findCrOrLfScalar(pos, end);
+	}
+#endif
+
+
+static CharScannerFunction
+getKernelFunction(CharScannerKernel kernel) {
+	switch (kernel) {
+	case CSK_SCALAR:
+		return findCrOrLfScalar;
+	#ifdef CS_SSE2_AVAILABLE
+		case CSK_SSE2:
+			return findCrOrLfSse2;
+	#endif
+	#ifdef CS_AVX2_AVAILABLE
+		case CSK_AVX2:
+			return findCrOrLfAvx2;
+	#endif
+	#ifdef CS_NEON_AVAILABLE
+		case CSK_NEON:
+			return findCrOrLfNeon;
+	#endif
+	default:
+		return NULL;
+	}
+}
+
+bool
+charScannerKernelSupported(CharScannerKernel kernel) {
+	if (getKernelFunction(kernel) == NULL) {
+		return false;
+	}
+	#ifdef CS_AVX2_AVAILABLE
+		if (kernel == CSK_AVX2) {
+			return __builtin_cpu_supports("avx2");
+		}
+	#endif
+	return true;
+}
+
+CharScannerKernel
+getCharScannerKernel() {
+	if (charScannerKernelSupported(CSK_AVX2)) {
+		return CSK_AVX2;
+	} else if (charScannerKernelSupported(CSK_SSE2)) {
+		return CSK_SSE2;
+	} else if (charScannerKernelSupported(CSK_NEON)) {
+		return CSK_NEON;
+	} else {
+		return CSK_SCALAR;
+	}
+}
+
+const char *
+getCharScannerKernelName(CharScannerKernel kernel) {
+	static const char *names[] = { "scalar", "SSE2", "AVX2", "NEON" };
+	return names[kernel];
+}
+
+const char *
+findCrOrLfWithKernel(CharScannerKernel kernel, const char *begin, const char *end) {
+	return getKernelFunction(kernel)(begin, end);
+}
+
+/**
+ * The initial value of _findCrOrLfFunction. Selects the kernel on first use,
+ * so that it works regardless of static initialization order. Concurrent
+ * first calls are harmless because they all select the same kernel.
+ */
+static const char *
+selectKernelAndFindCrOrLf(const char *begin, const char *end) {
+	_findCrOrLfFunction = getKernelFunction(getCharScannerKernel());
+	return _findCrOrLfFunction(begin, end);
+}
+
+CharScannerFunction _findCrOrLfFunction = selectKernelAndFindCrOrLf;
+
+
+} // namespace Passenger
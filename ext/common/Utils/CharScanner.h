@@ -0,0 +1,78 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_CHAR_SCANNER_H_
+#define _PASSENGER_CHAR_SCANNER_H_
+
+namespace Passenger {
+
+
+/**
+ * Vectorized scanning for the line terminator characters of HTTP. The
+ * scanning kernel is selected at runtime, on first use, based on what the
+ * CPU supports: AVX2 (32 bytes at a time) or SSE2 (16 bytes at a time) on
+ * x86, NEON (16 bytes at a time) on ARM64, or a scalar loop otherwise.
+ */
+enum CharScannerKernel {
+	CSK_SCALAR,
+	CSK_SSE2,
+	CSK_AVX2,
+	CSK_NEON,
+
+	CSK_KERNEL_COUNT
+};
+
+typedef const char *(*CharScannerFunction)(const char *begin, const char *end);
+
+/** The selected kernel, through which findCrOrLf() calls. */
+extern CharScannerFunction _findCrOrLfFunction;
+
+/**
+ * Returns a pointer to the first CR or LF in [begin, end), or `end` if
+ * there is none.
+ */
+inline const char *
+findCrOrLf(const char *begin, const char *end) {
+	return _findCrOrLfFunction(begin, end);
+}
+
+/** The kernel that findCrOrLf() uses on this machine. */
+CharScannerKernel getCharScannerKernel();
+
+/** Whether the given kernel is compiled in and supported by this CPU. */
+bool charScannerKernelSupported(CharScannerKernel kernel);
+
+const char *getCharScannerKernelName(CharScannerKernel kernel);
+
+/**
+ * Like findCrOrLf(), but with the given kernel. For testing and benchmarking.
+ *
+ * @pre charScannerKernelSupported(kernel)
+ */
+const char *findCrOrLfWithKernel(CharScannerKernel kernel, const char *begin, const char *end);
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_CHAR_SCANNER_H_ */
@@ -79,39 +79,7 @@ private:
 		}
 	}
 	
-public:
-	DataCallback onData;
-	Callback onEnd;
-	void *userData;
-	
-	Dechunker() {
-		onData = NULL;
-		onEnd = NULL;
-		userData = NULL;
-		reset();
-	}
-	
-	/**
-	 * Resets the internal state so that this Dechunker can be reused
-	 * for parsing new data.
-	 *
-	 * @post acceptingInput()
-	 * @post !hasError()
-	 */
-	void reset() {
-		state = EXPECTING_SIZE;
-		sizeBufferLen = 0;
-		remainingDataSize = 0;
-		errorMessage = NULL;
-	}
-	
-	/**
-	 * Feeds data into this parser. Any data chunks it has parsed will be emitted
-	 * through the onData callback. Returns the number of bytes that have been
-	 * accepted. Any data not recognized as part of the chunked transfer encoding
-	 * stream will be rejected.
-	 */
-	size_t feed(const char *data, size_t size) {
+	size_t parse(const char *data, size_t size, bool emitEvents) {
 		const char *current = data;
 		const char *end     = data + size;
 		const char *needle;
@@ -124,7 +92,9 @@ public:
 				if (dataSize == 0) {
 					state = EXPECTING_FINAL_CR;
 				} else {
-					emitDataEvent(current, dataSize);
+					if (emitEvents) {
+						emitDataEvent(current, dataSize);
+					}
 					current += dataSize;
 					remainingDataSize -= (unsigned int) dataSize;
 					if (remainingDataSize == 0) {
@@ -207,7 +177,9 @@ public:
 			
 			case EXPECTING_FINAL_LF:
 				if (*current == LF) {
-					emitEndEvent();
+					if (emitEvents) {
+						emitEndEvent();
+					}
 					state = DONE;
 					current++;
 				} else {
@@ -223,6 +195,53 @@ public:
 		return current - data;
 	}
 	
+public:
+	DataCallback onData;
+	Callback onEnd;
+	void *userData;
+	
+	Dechunker() {
+		onData = NULL;
+		onEnd = NULL;
+		userData = NULL;
+		reset();
+	}
+	
+	/**
+	 * Resets the internal state so that this Dechunker can be reused
+	 * for parsing new data.
+	 *
+	 * @post acceptingInput()
+	 * @post !hasError()
+	 */
+	void reset() {
+		state = EXPECTING_SIZE;
+		sizeBufferLen = 0;
+		remainingDataSize = 0;
+		errorMessage = NULL;
+	}
+	
+	/**
+	 * Feeds data into this parser. Any data chunks it has parsed will be emitted
+	 * through the onData callback. Returns the number of bytes that have been
+	 * accepted. Any data not recognized as part of the chunked transfer encoding
+	 * stream will be rejected.
+	 */
+	size_t feed(const char *data, size_t size) {
+		return parse(data, size, true);
+	}
+	
+	/**
+	 * Like feed(), but doesn't emit any events: only the chunk boundaries
+	 * are tracked, and the chunk data is skipped over in bulk. For callers
+	 * that pass the still chunked data on as-is, and only need to know
+	 * where it ends. Use isDone() to find out whether the terminating chunk
+	 * has been seen.
+	 */
+	size_t skip(const char *data, size_t size) {
+		return parse(data, size, false);
+	}
+	
 	bool acceptingInput() const {
 		return state != DONE && state != ERROR;
 	}
@@ -231,6 +250,10 @@ public:
 		return state == ERROR;
 	}
 	
+	bool isDone() const {
+		return state == DONE;
+	}
+	
 	const char *getErrorMessage() const {
 		return errorMessage;
 	}
@@ -0,0 +1,523 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_FILE_CHANGE_WATCHER_H_
+#define _PASSENGER_FILE_CHANGE_WATCHER_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <oxt/backtrace.hpp>
+#include <oxt/macros.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#if defined(__linux__)
+	#include <sys/inotify.h>
+	#define PASSENGER_FILE_CHANGE_WATCHER_INOTIFY
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+	defined(__NetBSD__) || defined(__DragonFly__)
+	#include <sys/types.h>
+	#include <sys/event.h>
+	#include <sys/time.h>
+	#define PASSENGER_FILE_CHANGE_WATCHER_KQUEUE
+#endif
+
+#include <Logging.h>
+#include <Exceptions.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace oxt;
+
+
+/**
+ * Watches directories for changes to specific files in them, so that callers
+ * can find out about file changes without stat()ing the files all the time.
+ * Uses inotify on Linux and kqueue on BSD and OS X. Example:
+ *
+ * @code
+ * FileChangeWatcher watcher;
+ * vector<string> names;
+ * names.push_back("restart.txt");
+ * FileChangeWatcher::WatchPtr watch = watcher.watch("app/tmp", names);
+ *
+ * // In a background thread:
+ * watcher.run();
+ *
+ * // Later:
+ * if (watch == NULL || !watch->isActive()) {
+ *     // Not watched; stat() the file as usual.
+ * } else if (watch->consumeChange()) {
+ *     // The file may have changed; stat() it to find out.
+ * }
+ * @endcode
+ *
+ * A change notification only means that one of the files *may* have changed.
+ * Checking for it is a single atomic load, so it's cheap enough for hot paths.
+ * A watch becomes inactive when the watched directory is removed or renamed,
+ * or when run() stops.
+ *
+ * File system watchers don't see changes made by other hosts on network file
+ * systems. If `recheckInterval` is non-zero, every watch is therefore also
+ * notified once per that many seconds, whether something happened or not.
+ *
+ * This class is fully thread-safe.
+ */
+class FileChangeWatcher: public boost::noncopyable {
+public:
+	class Watch: public boost::noncopyable {
+	private:
+		friend class FileChangeWatcher;
+
+		boost::atomic<bool> changed;
+		boost::atomic<bool> active;
+		string dir;
+		vector<string> names;
+
+		Watch(const string &_dir, const vector<string> &_names)
+			: changed(true),
+			  active(true),
+			  dir(_dir),
+			  names(_names)
+			{ }
+
+		bool matches(const char *name) const {
+			vector<string>::const_iterator it;
+			for (it = names.begin(); it != names.end(); it++) {
+				if (*it == name) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void notify() {
+			changed.store(true, boost::memory_order_release);
+		}
+
+		void deactivate() {
+			active.store(false, boost::memory_order_release);
+			notify();
+		}
+
+	public:
+		bool isActive() const {
+			return active.load(boost::memory_order_acquire);
+		}
+
+		/**
+		 * Returns whether a change notification has been received since the
+		 * last call. The first call always returns true, so that the caller
+		 * can record the files' initial state.
+		 */
+		bool consumeChange() {
+			if (OXT_LIKELY(!changed.load(boost::memory_order_acquire))) {
+				return false;
+			} else {
+				return changed.exchange(false, boost::memory_order_acq_rel);
+			}
+		}
+	};
+
+	typedef boost::shared_ptr<Watch> WatchPtr;
+
+private:
+	typedef boost::weak_ptr<Watch> WeakWatchPtr;
+
+	int fd;
+	unsigned int recheckInterval;
+	mutable boost::mutex syncher;
+	bool stopped;
+
+	#if defined(PASSENGER_FILE_CHANGE_WATCHER_INOTIFY)
+		/** inotify returns the same watch descriptor every time the same
+		 * directory is watched, so several Watches may share one. */
+		typedef map< int, vector<WeakWatchPtr> > WatchMap;
+		WatchMap watches;
+
+		static const unsigned int DIR_EVENTS = IN_CREATE | IN_DELETE | IN_MODIFY |
+			IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+	#elif defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+		/** kqueue watches open file descriptors: one for the directory, so that
+		 * we notice files being created, and one for each file that exists. */
+		struct Entry {
+			WeakWatchPtr watch;
+			bool isDir;
+		};
+		typedef map<int, Entry> EntryMap;
+		EntryMap entries;
+
+		static const unsigned int DIR_EVENTS = NOTE_WRITE | NOTE_DELETE |
+			NOTE_RENAME | NOTE_REVOKE;
+		static const unsigned int FILE_EVENTS = NOTE_WRITE | NOTE_EXTEND |
+			NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE;
+
+		static int openForEvents(const string &path) {
+			#ifdef O_EVTONLY
+				return open(path.c_str(), O_EVTONLY);
+			#else
+				return open(path.c_str(), O_RDONLY);
+			#endif
+		}
+
+		bool addEntry(int entryFd, const WatchPtr &watch, bool isDir) {
+			struct kevent ev;
+			EV_SET(&ev, entryFd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+				isDir ? (unsigned int) DIR_EVENTS : (unsigned int) FILE_EVENTS, 0, 0);
+			if (kevent(fd, &ev, 1, NULL, 0, NULL) == -1) {
+				return false;
+			}
+			Entry entry;
+			entry.watch = watch;
+			entry.isDir = isDir;
+			entries[entryFd] = entry;
+			return true;
+		}
+
+		void closeEntries(const Watch *watch, bool filesOnly) {
+			EntryMap::iterator it = entries.begin();
+			while (it != entries.end()) {
+				WatchPtr owner = it->second.watch.lock();
+				if ((owner == NULL || owner.get() == watch)
+				 && !(filesOnly && it->second.isDir))
+				{
+					close(it->first);
+					entries.erase(it++);
+				} else {
+					it++;
+				}
+			}
+		}
+
+		/** (Re)opens the watched files that currently exist. Called after
+		 * something happened in the directory, e.g. a file was created. */
+		void openFiles(const WatchPtr &watch) {
+			vector<string>::const_iterator it;
+
+			closeEntries(watch.get(), true);
+			for (it = watch->names.begin(); it != watch->names.end(); it++) {
+				int fileFd = openForEvents(watch->dir + "/" + *it);
+				if (fileFd != -1 && !addEntry(fileFd, watch, false)) {
+					close(fileFd);
+				}
+			}
+		}
+	#endif
+
+	void removeExpiredWatches() {
+		#if defined(PASSENGER_FILE_CHANGE_WATCHER_INOTIFY)
+			WatchMap::iterator it = watches.begin();
+			while (it != watches.end()) {
+				vector<WeakWatchPtr> &list = it->second;
+				vector<WeakWatchPtr>::iterator w_it = list.begin();
+				while (w_it != list.end()) {
+					if (w_it->expired()) {
+						w_it = list.erase(w_it);
+					} else {
+						w_it++;
+					}
+				}
+				if (list.empty()) {
+					inotify_rm_watch(fd, it->first);
+					watches.erase(it++);
+				} else {
+					it++;
+				}
+			}
+		#elif defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+			closeEntries(NULL, false);
+		#endif
+	}
+
+	template<typename Func>
+	void forEachWatch(const Func &func) {
+		#if defined(PASSENGER_FILE_CHANGE_WATCHER_INOTIFY)
+			WatchMap::iterator it;
+			for (it = watches.begin(); it != watches.end(); it++) {
+				vector<WeakWatchPtr>::iterator w_it;
+				for (w_it = it->second.begin(); w_it != it->second.end(); w_it++) {
+					WatchPtr watch = w_it->lock();
+					if (watch != NULL) {
+						func(watch.get());
+					}
+				}
+			}
+		#elif defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+			EntryMap::iterator it;
+			for (it = entries.begin(); it != entries.end(); it++) {
+				WatchPtr watch = it->second.watch.lock();
+				if (watch != NULL && it->second.isDir) {
+					func(watch.get());
+				}
+			}
+		#endif
+	}
+
+	static void notifyWatch(Watch *watch) {
+		watch->notify();
+	}
+
+	static void deactivateWatch(Watch *watch) {
+		watch->deactivate();
+	}
+
+	void stop() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		stopped = true;
+		forEachWatch(deactivateWatch);
+	}
+
+	/**
+	 * Blocks until there are events or until the recheck interval has passed,
+	 * and processes the events. Returns false in the latter case.
+	 */
+	bool processEvents() {
+		#if defined(PASSENGER_FILE_CHANGE_WATCHER_INOTIFY)
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			int ret = syscalls::poll(&pfd, 1,
+				(recheckInterval == 0) ? -1 : (int) recheckInterval * 1000);
+			if (ret == -1) {
+				int e = errno;
+				throw SystemException("Cannot poll inotify", e);
+			} else if (ret == 0) {
+				return false;
+			}
+
+			// Aligned so that the inotify_event structs in it are too.
+			long buf[1024];
+			ssize_t size = syscalls::read(fd, buf, sizeof(buf));
+			if (size == -1) {
+				int e = errno;
+				if (e == EAGAIN) {
+					return true;
+				}
+				throw SystemException("Cannot read from inotify", e);
+			}
+
+			boost::lock_guard<boost::mutex> l(syncher);
+			const char *pos = (const char *) buf;
+			const char *end = pos + size;
+			while (pos < end) {
+				const struct inotify_event *event = (const struct inotify_event *) pos;
+				pos += sizeof(struct inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW) {
+					forEachWatch(notifyWatch);
+					continue;
+				}
+
+				WatchMap::iterator it = watches.find(event->wd);
+				if (it == watches.end()) {
+					continue;
+				}
+				vector<WeakWatchPtr>::iterator w_it;
+				for (w_it = it->second.begin(); w_it != it->second.end(); w_it++) {
+					WatchPtr watch = w_it->lock();
+					if (watch == NULL) {
+						continue;
+					} else if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+						watch->deactivate();
+					} else if (event->len > 0 && watch->matches(event->name)) {
+						watch->notify();
+					}
+				}
+				if (event->mask & IN_IGNORED) {
+					watches.erase(it);
+				}
+			}
+			return true;
+
+		#elif defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+			struct kevent events[32];
+			struct timespec timeout;
+			timeout.tv_sec = recheckInterval;
+			timeout.tv_nsec = 0;
+			int count = kevent(fd, NULL, 0, events, 32,
+				(recheckInterval == 0) ? NULL : &timeout);
+			if (count == -1) {
+				int e = errno;
+				if (e == EINTR) {
+					// We may have been interrupted by oxt.
+					boost::this_thread::interruption_point();
+					return true;
+				}
+				throw SystemException("Cannot read from kqueue", e);
+			} else if (count == 0) {
+				return false;
+			}
+
+			boost::lock_guard<boost::mutex> l(syncher);
+			for (int i = 0; i < count; i++) {
+				EntryMap::iterator it = entries.find((int) events[i].ident);
+				if (it == entries.end()) {
+					continue;
+				}
+				WatchPtr watch = it->second.watch.lock();
+				bool gone = events[i].fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE);
+				if (watch == NULL) {
+					continue;
+				} else if (it->second.isDir && gone) {
+					watch->deactivate();
+					closeEntries(watch.get(), false);
+				} else if (it->second.isDir) {
+					watch->notify();
+					openFiles(watch);
+				} else {
+					watch->notify();
+					if (gone) {
+						close(it->first);
+						entries.erase(it);
+					}
+				}
+			}
+			return true;
+
+		#else
+			return false;
+		#endif
+	}
+
+public:
+	FileChangeWatcher(unsigned int _recheckInterval = 0)
+		: recheckInterval(_recheckInterval),
+		  stopped(false)
+	{
+		#if defined(PASSENGER_FILE_CHANGE_WATCHER_INOTIFY)
+			fd = inotify_init();
+		#elif defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+			fd = kqueue();
+		#else
+			fd = -1;
+		#endif
+		if (fd == -1) {
+			int e = errno;
+			P_DEBUG("File change watching is not available: " << strerror(e));
+		} else {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+
+	~FileChangeWatcher() {
+		#if defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+			EntryMap::iterator it;
+			for (it = entries.begin(); it != entries.end(); it++) {
+				close(it->first);
+			}
+		#endif
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+
+	bool isSupported() const {
+		return fd != -1;
+	}
+
+	/**
+	 * Starts watching the files called `names` in the directory `dir`.
+	 * Returns NULL if the directory can't be watched, e.g. because it
+	 * doesn't exist or because this platform isn't supported. The watch
+	 * ends when the last reference to the returned object is gone.
+	 */
+	WatchPtr watch(const string &dir, const vector<string> &names) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		if (fd == -1 || stopped) {
+			return WatchPtr();
+		}
+		removeExpiredWatches();
+
+		WatchPtr watch(new Watch(dir, names));
+		#if defined(PASSENGER_FILE_CHANGE_WATCHER_INOTIFY)
+			int wd = inotify_add_watch(fd, dir.c_str(), DIR_EVENTS);
+			if (wd == -1) {
+				int e = errno;
+				P_DEBUG("Cannot watch directory " << dir << ": " << strerror(e));
+				return WatchPtr();
+			}
+			watches[wd].push_back(watch);
+		#elif defined(PASSENGER_FILE_CHANGE_WATCHER_KQUEUE)
+			int dirFd = openForEvents(dir);
+			if (dirFd == -1) {
+				int e = errno;
+				P_DEBUG("Cannot watch directory " << dir << ": " << strerror(e));
+				return WatchPtr();
+			} else if (!addEntry(dirFd, watch, true)) {
+				int e = errno;
+				close(dirFd);
+				P_DEBUG("Cannot watch directory " << dir << ": " << strerror(e));
+				return WatchPtr();
+			}
+			openFiles(watch);
+		#endif
+		return watch;
+	}
+
+	/**
+	 * Processes file system events until the calling thread is interrupted,
+	 * or until an error occurs. All watches become inactive afterwards, so
+	 * that their owners fall back to stat().
+	 */
+	void run() {
+		TRACE_POINT();
+		if (fd == -1) {
+			return;
+		}
+		try {
+			while (true) {
+				if (!processEvents()) {
+					boost::lock_guard<boost::mutex> l(syncher);
+					forEachWatch(notifyWatch);
+				}
+			}
+		} catch (const SystemException &e) {
+			P_WARN("File change watcher stopped: " << e.what());
+			stop();
+		} catch (...) {
+			stop();
+			throw;
+		}
+	}
+};
+
+typedef boost::shared_ptr<FileChangeWatcher> FileChangeWatcherPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_FILE_CHANGE_WATCHER_H_ */
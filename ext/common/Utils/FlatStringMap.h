@@ -0,0 +1,447 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_FLAT_STRING_MAP_H_
+#define _PASSENGER_FLAT_STRING_MAP_H_
+
+#include <string>
+#include <utility>
+#include <cstring>
+
+#include <StaticString.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * A map with string keys that has the same interface as StringMap, but
+ * that stores its entries in a single array using open addressing with
+ * linear probing, instead of allocating a node per entry. A separate
+ * array of control bytes, one per slot, says whether a slot is empty,
+ * deleted, or full; for full slots it contains 7 bits of the key's hash,
+ * so that most probes of non-matching slots don't have to look at the key
+ * itself. Keys of up to INLINE_KEY_SIZE bytes are stored inside the slot,
+ * so that inserting them doesn't allocate.
+ *
+ * Unlike StringMap, set() may move entries around: it invalidates all
+ * iterators, and keys and values obtained through them. remove() doesn't
+ * move other entries, so entries may be removed while iterating over the
+ * map, as long as the iterator is advanced past them first.
+ *
+ * FlatStringMap requires the same properties on T as StringMap.
+ */
+template<typename T>
+class FlatStringMap {
+public:
+	static const unsigned int INLINE_KEY_SIZE = 23;
+
+private:
+	static const unsigned char EMPTY   = 0x80;
+	static const unsigned char DELETED = 0xFE;
+	static const unsigned int MIN_CAPACITY = 16;
+
+	struct Slot {
+		pair<StaticString, T> thePair;
+		char *heapKey;
+		char inlineKey[INLINE_KEY_SIZE];
+
+		Slot() {
+			heapKey = NULL;
+		}
+
+		~Slot() {
+			delete[] heapKey;
+		}
+
+		void setKey(const StaticString &key) {
+			char *data;
+			if (key.size() <= INLINE_KEY_SIZE) {
+				data = inlineKey;
+			} else {
+				heapKey = new char[key.size()];
+				data = heapKey;
+			}
+			memcpy(data, key.data(), key.size());
+			thePair.first = StaticString(data, key.size());
+		}
+
+		/** Takes over the key and the value of `other`, leaving it empty. */
+		void takeOver(Slot &other) {
+			using std::swap;
+			if (other.heapKey != NULL) {
+				heapKey = other.heapKey;
+				other.heapKey = NULL;
+				thePair.first = other.thePair.first;
+			} else {
+				setKey(other.thePair.first);
+			}
+			swap(thePair.second, other.thePair.second);
+			other.clear();
+		}
+
+		void clear() {
+			delete[] heapKey;
+			heapKey = NULL;
+			thePair.first = StaticString();
+			thePair.second = T();
+		}
+	};
+
+	Slot *slots;
+	unsigned char *ctrl;
+	/** Always a power of 2, or 0 if nothing has been allocated yet. */
+	unsigned int capacity;
+	unsigned int count;
+	unsigned int deletedCount;
+
+	static bool isFull(unsigned char c) {
+		return (c & 0x80) == 0;
+	}
+
+	static unsigned char fragmentOf(size_t hash) {
+		return (hash >> (sizeof(size_t) * 8 - 7)) & 0x7F;
+	}
+
+	/** Returns the index of the slot with the given key, or `capacity`. */
+	unsigned int findIndex(const StaticString &key, size_t hash) const {
+		if (capacity == 0) {
+			return 0;
+		}
+
+		unsigned char fragment = fragmentOf(hash);
+		unsigned int mask = capacity - 1;
+		unsigned int i = hash & mask;
+		while (true) {
+			unsigned char c = ctrl[i];
+			if (c == EMPTY) {
+				return capacity;
+			} else if (c == fragment && slots[i].thePair.first == key) {
+				return i;
+			}
+			i = (i + 1) & mask;
+		}
+	}
+
+	/** Returns the first non-full slot in the probe sequence of `hash`. */
+	unsigned int findFreeIndex(size_t hash) const {
+		unsigned int mask = capacity - 1;
+		unsigned int i = hash & mask;
+		while (isFull(ctrl[i])) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void rehash(unsigned int newCapacity) {
+		Slot *oldSlots = slots;
+		unsigned char *oldCtrl = ctrl;
+		unsigned int oldCapacity = capacity;
+		StaticString::Hash hasher;
+
+		slots = new Slot[newCapacity];
+		ctrl = new unsigned char[newCapacity];
+		memset(ctrl, EMPTY, newCapacity);
+		capacity = newCapacity;
+		deletedCount = 0;
+
+		for (unsigned int i = 0; i < oldCapacity; i++) {
+			if (isFull(oldCtrl[i])) {
+				size_t hash = hasher(oldSlots[i].thePair.first);
+				unsigned int j = findFreeIndex(hash);
+				slots[j].takeOver(oldSlots[i]);
+				ctrl[j] = fragmentOf(hash);
+			}
+		}
+		delete[] oldSlots;
+		delete[] oldCtrl;
+	}
+
+	void copyFrom(const FlatStringMap &other) {
+		const_iterator it, end = other.end();
+		for (it = other.begin(); it != end; it++) {
+			set(it->first, it->second);
+		}
+	}
+
+	void freeStorage() {
+		delete[] slots;
+		delete[] ctrl;
+		slots = NULL;
+		ctrl = NULL;
+		capacity = 0;
+		count = 0;
+		deletedCount = 0;
+	}
+
+public:
+	class const_iterator {
+	private:
+		const FlatStringMap *map;
+		unsigned int index;
+
+	public:
+		const_iterator()
+			: map(NULL),
+			  index(0)
+			{ }
+
+		const_iterator(const FlatStringMap *_map, unsigned int _index)
+			: map(_map),
+			  index(_index)
+		{
+			while (index < map->capacity && !isFull(map->ctrl[index])) {
+				index++;
+			}
+		}
+
+		const_iterator &operator++() {
+			do {
+				index++;
+			} while (index < map->capacity && !isFull(map->ctrl[index]));
+			return *this;
+		}
+
+		const_iterator operator++(int) {
+			const_iterator copy(*this);
+			operator++();
+			return copy;
+		}
+
+		bool operator==(const const_iterator &other) {
+			return index == other.index;
+		}
+
+		bool operator!=(const const_iterator &other) {
+			return index != other.index;
+		}
+
+		const pair<const StaticString, const T> &operator*() {
+			return (pair<const StaticString, const T> &) map->slots[index].thePair;
+		}
+
+		const pair<const StaticString, const T> *operator->() {
+			return &(**this);
+		}
+	};
+
+	class iterator {
+	private:
+		FlatStringMap *map;
+		unsigned int index;
+
+	public:
+		iterator()
+			: map(NULL),
+			  index(0)
+			{ }
+
+		iterator(FlatStringMap *_map, unsigned int _index)
+			: map(_map),
+			  index(_index)
+		{
+			while (index < map->capacity && !isFull(map->ctrl[index])) {
+				index++;
+			}
+		}
+
+		iterator &operator++() {
+			do {
+				index++;
+			} while (index < map->capacity && !isFull(map->ctrl[index]));
+			return *this;
+		}
+
+		iterator operator++(int) {
+			iterator copy(*this);
+			operator++();
+			return copy;
+		}
+
+		bool operator==(const iterator &other) {
+			return index == other.index;
+		}
+
+		bool operator!=(const iterator &other) {
+			return index != other.index;
+		}
+
+		pair<StaticString, T> &operator*() {
+			return map->slots[index].thePair;
+		}
+
+		pair<StaticString, T> *operator->() {
+			return &(**this);
+		}
+
+		operator const_iterator() const {
+			return const_iterator(map, index);
+		}
+	};
+
+	FlatStringMap()
+		: slots(NULL),
+		  ctrl(NULL),
+		  capacity(0),
+		  count(0),
+		  deletedCount(0)
+		{ }
+
+	FlatStringMap(const FlatStringMap &other)
+		: slots(NULL),
+		  ctrl(NULL),
+		  capacity(0),
+		  count(0),
+		  deletedCount(0)
+	{
+		copyFrom(other);
+	}
+
+	~FlatStringMap() {
+		freeStorage();
+	}
+
+	FlatStringMap &operator=(const FlatStringMap &other) {
+		if (this != &other) {
+			freeStorage();
+			copyFrom(other);
+		}
+		return *this;
+	}
+
+	T get(const StaticString &key) const {
+		unsigned int i = findIndex(key, StaticString::Hash()(key));
+		if (i == capacity) {
+			return T();
+		} else {
+			return slots[i].thePair.second;
+		}
+	}
+
+	T get(const StaticString &key, const T &defaultValue) const {
+		unsigned int i = findIndex(key, StaticString::Hash()(key));
+		if (i == capacity) {
+			return defaultValue;
+		} else {
+			return slots[i].thePair.second;
+		}
+	}
+
+	bool has(const StaticString &key) const {
+		return findIndex(key, StaticString::Hash()(key)) != capacity;
+	}
+
+	bool set(const StaticString &key, const T &value) {
+		size_t hash = StaticString::Hash()(key);
+		unsigned int i = findIndex(key, hash);
+		if (i != capacity) {
+			// Key already exists. Update value.
+			slots[i].thePair.second = value;
+			return false;
+		}
+
+		// Keep at least 1/4 of the slots empty so that probe sequences
+		// stay short. Deleted slots are reclaimed by rehashing at the
+		// same capacity if there are many of them.
+		if ((count + deletedCount + 1) * 4 > capacity * 3) {
+			unsigned int newCapacity = (capacity < MIN_CAPACITY) ? MIN_CAPACITY : capacity;
+			while ((count + 1) * 2 > newCapacity) {
+				newCapacity *= 2;
+			}
+			rehash(newCapacity);
+		}
+
+		i = findFreeIndex(hash);
+		if (ctrl[i] == DELETED) {
+			deletedCount--;
+		}
+		ctrl[i] = fragmentOf(hash);
+		slots[i].setKey(key);
+		slots[i].thePair.second = value;
+		count++;
+		return true;
+	}
+
+	bool remove(const StaticString &key) {
+		unsigned int i = findIndex(key, StaticString::Hash()(key));
+		if (i == capacity) {
+			return false;
+		}
+
+		slots[i].clear();
+		// A slot can only become empty again if that doesn't break
+		// the probe sequence of another key, i.e. if the next slot is
+		// already empty.
+		if (ctrl[(i + 1) & (capacity - 1)] == EMPTY) {
+			ctrl[i] = EMPTY;
+		} else {
+			ctrl[i] = DELETED;
+			deletedCount++;
+		}
+		count--;
+		return true;
+	}
+
+	void clear() {
+		freeStorage();
+	}
+
+	iterator find(const StaticString &key) {
+		return iterator(this, findIndex(key, StaticString::Hash()(key)));
+	}
+
+	const_iterator find(const StaticString &key) const {
+		return const_iterator(this, findIndex(key, StaticString::Hash()(key)));
+	}
+
+	unsigned int size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	iterator begin() {
+		return iterator(this, 0);
+	}
+
+	const_iterator begin() const {
+		return const_iterator(this, 0);
+	}
+
+	iterator end() {
+		return iterator(this, capacity);
+	}
+
+	const_iterator end() const {
+		return const_iterator(this, capacity);
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_FLAT_STRING_MAP_H_ */
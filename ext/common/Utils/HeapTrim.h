@@ -0,0 +1,95 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_HEAP_TRIM_H_
+#define _PASSENGER_HEAP_TRIM_H_
+
+#include <cstddef>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+	#include <malloc.h>
+#elif defined(__APPLE__)
+	#include <malloc/malloc.h>
+#endif
+
+namespace Passenger {
+
+
+/**
+ * Returns the resident set size of the current process in bytes, or 0 if
+ * it can't be determined. Only supported on Linux.
+ */
+inline size_t
+getCurrentRss() {
+	#ifdef __linux__
+		char buf[128];
+		unsigned long pages;
+		int fd = open("/proc/self/statm", O_RDONLY);
+		if (fd == -1) {
+			return 0;
+		}
+		ssize_t size = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (size <= 0) {
+			return 0;
+		}
+		buf[size] = '\0';
+		if (sscanf(buf, "%*lu %lu", &pages) != 1) {
+			return 0;
+		}
+		return pages * sysconf(_SC_PAGESIZE);
+	#else
+		return 0;
+	#endif
+}
+
+/**
+ * Asks the memory allocator to return the free memory in its heap to the
+ * OS. glibc only does that by itself for free memory at the top of the
+ * heap, so after a peak most of it stays in glibc's free lists, counting
+ * towards our RSS, until it's reused. Returns whether the allocator
+ * supports this.
+ *
+ * This takes a while with a large heap, so it should only be called when
+ * the process is idle.
+ */
+inline bool
+releaseFreeHeapMemory() {
+	#if defined(__GLIBC__)
+		malloc_trim(0);
+		return true;
+	#elif defined(__APPLE__)
+		malloc_zone_pressure_relief(NULL, 0);
+		return true;
+	#else
+		return false;
+	#endif
+}
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_HEAP_TRIM_H_ */
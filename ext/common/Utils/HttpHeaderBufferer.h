@@ -30,7 +30,7 @@
 #include <cstddef>
 #include <cassert>
 #include <StaticString.h>
-#include <Utils/StreamBoyerMooreHorspool.h>
+#include <Utils/CharScanner.h>
 
 namespace Passenger {
 
@@ -54,16 +54,6 @@ using namespace std;
  */
 class HttpHeaderBufferer {
 private:
-	struct StaticData {
-		StreamBMH_Occ occ;
-		
-		StaticData() {
-			sbmh_init(NULL, &occ, (const unsigned char *) "\r\n\r\n", 4);
-		}
-	};
-	
-	static StaticData staticData;
-	
 	string buffer;
 	StaticString data;
 	unsigned int max;
@@ -72,17 +62,48 @@ private:
 		DONE,
 		ERROR
 	} state;
-	union {
-		struct StreamBMH terminatorFinder;
-		char padding[SBMH_SIZE(4)];
-	} u;
+	/** How many characters of "\r\n\r\n" have been matched so far. */
+	unsigned int matched;
+	
+	/**
+	 * Looks for the terminating "\r\n\r\n", continuing the match from
+	 * previous feeds. Returns the number of bytes up to and including the
+	 * terminator, or `size` if it hasn't been found yet.
+	 *
+	 * Header lines are mostly plain characters, so as long as we're not
+	 * in the middle of a potential match, we skip to the next CR or LF with
+	 * a vectorized scan instead of looking at every byte.
+	 */
+	size_t findTerminator(const char *data, size_t size) {
+		const char *pos = data;
+		const char *end = data + size;
+		
+		while (pos < end) {
+			if (matched == 0) {
+				pos = findCrOrLf(pos, end);
+				if (pos == end) {
+					break;
+				}
+			}
+			
+			char ch = *pos;
+			pos++;
+			if (ch == "\r\n\r\n"[matched]) {
+				matched++;
+				if (matched == 4) {
+					return pos - data;
+				}
+			} else if (ch == '\r') {
+				matched = 1;
+			} else {
+				matched = 0;
+			}
+		}
+		return size;
+	}
 	
 public:
 	HttpHeaderBufferer() {
-		sbmh_init(&u.terminatorFinder,
-			NULL,
-			(const unsigned char *) "\r\n\r\n",
-			4);
 		max = 1024 * 128;
 		reset();
 	}
@@ -94,7 +115,7 @@ public:
 	void reset() {
 		buffer.clear();
 		data = StaticString("", 0);
-		sbmh_reset(&u.terminatorFinder);
+		matched = 0;
 		state = WORKING;
 	}
 	
@@ -107,13 +128,8 @@ public:
 		
 		if (buffer.empty()) {
 			feedSize = std::min<size_t>(size, max);
-			accepted = sbmh_feed(&u.terminatorFinder,
-				&staticData.occ,
-				(const unsigned char *) "\r\n\r\n",
-				4,
-				(const unsigned char *) data,
-				feedSize);
-			if (u.terminatorFinder.found) {
+			accepted = findTerminator(data, feedSize);
+			if (matched == 4) {
 				state = DONE;
 				this->data = StaticString(data, accepted);
 			} else if (feedSize == max) {
@@ -126,15 +142,10 @@ public:
 			}
 		} else {
 			feedSize = std::min<size_t>(size, max - buffer.size());
-			accepted = sbmh_feed(&u.terminatorFinder,
-				&staticData.occ,
-				(const unsigned char *) "\r\n\r\n",
-				4,
-				(const unsigned char *) data,
-				feedSize);
+			accepted = findTerminator(data, feedSize);
 			buffer.append(data, accepted);
 			this->data = buffer;
-			if (u.terminatorFinder.found) {
+			if (matched == 4) {
 				state = DONE;
 			} else if (buffer.size() == (size_t) max) {
 				state = ERROR;
@@ -54,6 +54,13 @@
 	// For accept4 macros
 	#include <sys/syscall.h>
 	#include <linux/net.h>
+	// For getUnixServerQueueInfo() and createExclusiveAcceptEpoll()
+	#include <sys/stat.h>
+	#include <sys/epoll.h>
+	#include <linux/netlink.h>
+	#include <linux/rtnetlink.h>
+	#include <linux/sock_diag.h>
+	#include <linux/unix_diag.h>
 #endif
 
 #if defined(__APPLE__)
@@ -306,6 +313,179 @@ createUnixServer(const StaticString &filename, unsigned int backlogSize, bool au
 	return fd;
 }
 
+int
+createUnixDatagramServer(const StaticString &filename, bool autoDelete) {
+	struct sockaddr_un addr;
+	int fd, ret;
+	
+	if (filename.size() > sizeof(addr.sun_path) - 1) {
+		string message = "Cannot create Unix socket '";
+		message.append(filename.toString());
+		message.append("': filename is too long.");
+		throw RuntimeException(message);
+	}
+	
+	fd = syscalls::socket(PF_LOCAL, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		int e = errno;
+		throw SystemException("Cannot create a Unix socket file descriptor", e);
+	}
+	
+	FdGuard guard(fd, true);
+	addr.sun_family = AF_LOCAL;
+	strncpy(addr.sun_path, filename.c_str(), filename.size());
+	addr.sun_path[filename.size()] = '\0';
+	
+	if (autoDelete) {
+		do {
+			ret = unlink(filename.c_str());
+		} while (ret == -1 && errno == EINTR);
+	}
+	
+	ret = syscalls::bind(fd, (const struct sockaddr *) &addr, sizeof(addr));
+	if (ret == -1) {
+		int e = errno;
+		string message = "Cannot bind Unix socket '";
+		message.append(filename.toString());
+		message.append("'");
+		throw SystemException(message, e);
+	}
+	
+	guard.clear();
+	return fd;
+}
+
+bool
+getUnixServerQueueInfo(int fd, unsigned int &queued, unsigned int &backlog) {
+	#ifdef __linux__
+		struct stat buf;
+		int sock, ret;
+		
+		if (fstat(fd, &buf) == -1) {
+			return false;
+		}
+		
+		sock = syscalls::socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG);
+		if (sock == -1) {
+			return false;
+		}
+		FdGuard guard(sock, true);
+		
+		struct {
+			struct nlmsghdr header;
+			struct unix_diag_req body;
+		} request;
+		struct sockaddr_nl addr;
+		
+		memset(&request, 0, sizeof(request));
+		request.header.nlmsg_len = sizeof(request);
+		request.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+		request.header.nlmsg_flags = NLM_F_REQUEST;
+		request.body.sdiag_family = AF_UNIX;
+		request.body.udiag_states = ~0u;
+		request.body.udiag_ino = buf.st_ino;
+		request.body.udiag_show = UDIAG_SHOW_RQLEN;
+		request.body.udiag_cookie[0] = ~0u;
+		request.body.udiag_cookie[1] = ~0u;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		
+		do {
+			ret = sendto(sock, &request, sizeof(request), 0,
+				(struct sockaddr *) &addr, sizeof(addr));
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			return false;
+		}
+		
+		union {
+			struct nlmsghdr header;
+			char data[1024];
+		} response;
+		int len;
+		do {
+			len = recv(sock, &response, sizeof(response), 0);
+		} while (len == -1 && errno == EINTR);
+		
+		struct nlmsghdr *header = &response.header;
+		for (; NLMSG_OK(header, (unsigned int) len); header = NLMSG_NEXT(header, len)) {
+			if (header->nlmsg_type != SOCK_DIAG_BY_FAMILY) {
+				// NLMSG_ERROR or NLMSG_DONE.
+				return false;
+			}
+			
+			struct unix_diag_msg *msg = (struct unix_diag_msg *) NLMSG_DATA(header);
+			struct rtattr *attr = (struct rtattr *) (msg + 1);
+			int attrLen = header->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+			
+			if (msg->udiag_ino != buf.st_ino) {
+				continue;
+			}
+			for (; RTA_OK(attr, attrLen); attr = RTA_NEXT(attr, attrLen)) {
+				if (attr->rta_type == UNIX_DIAG_RQLEN) {
+					struct unix_diag_rqlen *rqlen = (struct unix_diag_rqlen *) RTA_DATA(attr);
+					queued  = rqlen->udiag_rqueue;
+					backlog = rqlen->udiag_wqueue;
+					return true;
+				}
+			}
+		}
+		return false;
+	#else
+		return false;
+	#endif
+}
+
+int
+createExclusiveAcceptEpoll(int fd) {
+	#if defined(__linux__) && defined(EPOLLEXCLUSIVE)
+		int epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			return -1;
+		}
+		
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			// Some kernels reject EPOLLEXCLUSIVE. Linux versions before 4.5
+			// accept but ignore it, in which case this still works.
+			int e = errno;
+			safelyClose(epfd, true);
+			errno = e;
+			return -1;
+		}
+		return epfd;
+	#else
+		return -1;
+	#endif
+}
+
+bool
+getPeerUid(int fd, uid_t &uid) {
+	#if defined(__linux__) && defined(SO_PEERCRED)
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+			return false;
+		}
+		if (cred.uid == (uid_t) -1) {
+			// Not a Unix domain socket.
+			errno = EINVAL;
+			return false;
+		}
+		uid = cred.uid;
+		return true;
+	#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+	   || defined(__NetBSD__) || defined(__DragonFly__)
+		gid_t gid;
+		return getpeereid(fd, &uid, &gid) == 0;
+	#else
+		errno = ENOSYS;
+		return false;
+	#endif
+}
+
 int
 createTcpServer(const char *address, unsigned short port, unsigned int backlogSize) {
 	struct sockaddr_in addr;
@@ -163,6 +163,52 @@ int createUnixServer(const StaticString &filename,
 	unsigned int backlogSize = 0,
 	bool autoDelete = true);
 
+/**
+ * Create a new Unix datagram socket which is bounded to <tt>filename</tt>.
+ *
+ * @param filename The filename to bind the socket to.
+ * @param autoDelete Whether <tt>filename</tt> should be deleted, if it already exists.
+ * @return The file descriptor of the newly created Unix datagram socket.
+ * @throws RuntimeException Something went wrong.
+ * @throws SystemException Something went wrong while creating the Unix datagram socket.
+ * @throws boost::thread_interrupted A system call has been interrupted.
+ * @ingroup Support
+ */
+int createUnixDatagramServer(const StaticString &filename, bool autoDelete = true);
+
+/**
+ * Looks up how many connections are waiting to be accepted on the given
+ * listening Unix socket, and its backlog size. This is the information that
+ * `ss -xl` shows. Only supported on Linux.
+ *
+ * @return Whether the information could be obtained.
+ * @ingroup Support
+ */
+bool getUnixServerQueueInfo(int fd, unsigned int &queued, unsigned int &backlog);
+
+/**
+ * Creates an epoll instance that watches the given listening socket for
+ * readability with EPOLLEXCLUSIVE. If multiple event loops each watch the
+ * socket through their own instance, then the kernel wakes up only one of
+ * them per new connection instead of all of them. The returned file
+ * descriptor can be watched for readability in place of the socket.
+ *
+ * @return The epoll file descriptor, or -1 if the platform doesn't
+ *         support this.
+ * @ingroup Support
+ */
+int createExclusiveAcceptEpoll(int fd);
+
+/**
+ * Looks up the effective user ID of the process on the other end of the
+ * given connected Unix domain socket, as it was when the connection was
+ * made. Uses SO_PEERCRED on Linux and getpeereid() on macOS and the BSDs.
+ *
+ * @return Whether the user ID could be obtained. If not, errno is set.
+ * @ingroup Support
+ */
+bool getPeerUid(int fd, uid_t &uid);
+
 /**
  * Create a new TCP server socket which is bounded to the given address and port.
  * SO_REUSEADDR will be set on the socket.
@@ -0,0 +1,329 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_INLINE_FUNCTION_H_
+#define _PASSENGER_INLINE_FUNCTION_H_
+
+#include <boost/function.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/type_traits/decay.hpp>
+#include <cstddef>
+#include <new>
+
+namespace Passenger {
+
+
+/**
+ * Like boost::function, but with a configurable buffer in which function
+ * objects of up to `BufferSize` bytes are stored without allocating memory.
+ * boost::function only has room for a pointer and a member function pointer,
+ * so e.g. a boost::bind() of a member function, an object pointer and a
+ * shared_ptr already requires a heap allocation, and so does every copy of
+ * it. Larger function objects are still supported and are stored on the heap.
+ *
+ *   InlineFunction<void (int), 48> f = boost::bind(&Foo::bar, this, client, _1);
+ *   f(1);
+ *
+ * Copying an InlineFunction copies the function object. Assigning an empty
+ * boost::function or a NULL function pointer results in an empty
+ * InlineFunction. Calling an empty InlineFunction is not allowed.
+ *
+ * Only signatures with up to 2 arguments are supported.
+ */
+template<typename Signature, size_t BufferSize = 48>
+class InlineFunction;
+
+
+template<size_t BufferSize>
+class InlineFunctionBase {
+protected:
+	union Buffer {
+		char data[BufferSize];
+		void *pointer;
+		long long integer;
+		double floating;
+	};
+
+	typedef void (*GenericInvoker)();
+
+	struct Operations {
+		void (*copy)(const Buffer &source, Buffer &target);
+		void (*destroy)(Buffer &buffer);
+	};
+
+	template<typename F>
+	struct Manager {
+		static const bool INPLACE = sizeof(F) <= BufferSize
+			&& boost::alignment_of<F>::value <= boost::alignment_of<Buffer>::value;
+
+		static F *get(Buffer &buffer) {
+			if (INPLACE) {
+				return (F *) buffer.data;
+			} else {
+				return (F *) buffer.pointer;
+			}
+		}
+
+		static void create(Buffer &buffer, const F &func) {
+			if (INPLACE) {
+				new (buffer.data) F(func);
+			} else {
+				buffer.pointer = new F(func);
+			}
+		}
+
+		static void copy(const Buffer &source, Buffer &target) {
+			create(target, *get(const_cast<Buffer &>(source)));
+		}
+
+		static void destroy(Buffer &buffer) {
+			if (INPLACE) {
+				get(buffer)->~F();
+			} else {
+				delete get(buffer);
+			}
+		}
+
+		static const Operations *operations() {
+			static const Operations result = { copy, destroy };
+			return &result;
+		}
+	};
+
+	mutable Buffer buffer;
+	const Operations *ops;
+	GenericInvoker invoker;
+
+	template<typename F>
+	static bool isNull(const F &func) {
+		return false;
+	}
+
+	template<typename S>
+	static bool isNull(const boost::function<S> &func) {
+		return func.empty();
+	}
+
+	template<typename T>
+	static bool isNull(T *func) {
+		return func == NULL;
+	}
+
+	InlineFunctionBase()
+		: ops(NULL),
+		  invoker(NULL)
+		{ }
+
+	InlineFunctionBase(const InlineFunctionBase &other)
+		: ops(NULL),
+		  invoker(NULL)
+	{
+		copyFrom(other);
+	}
+
+	~InlineFunctionBase() {
+		clear();
+	}
+
+	template<typename F>
+	void assign(const F &func, GenericInvoker invoker) {
+		clear();
+		if (!isNull(func)) {
+			Manager<F>::create(buffer, func);
+			ops = Manager<F>::operations();
+			this->invoker = invoker;
+		}
+	}
+
+	/** @pre empty() */
+	void copyFrom(const InlineFunctionBase &other) {
+		if (other.ops != NULL) {
+			other.ops->copy(other.buffer, buffer);
+			ops = other.ops;
+			invoker = other.invoker;
+		}
+	}
+
+	void assignFrom(const InlineFunctionBase &other) {
+		if (this != &other) {
+			// `other` may be owned by our own function object.
+			InlineFunctionBase temp(other);
+			clear();
+			copyFrom(temp);
+		}
+	}
+
+	typedef void (InlineFunctionBase::*SafeBool)() const;
+	void safeBoolTrue() const { }
+
+public:
+	bool empty() const {
+		return ops == NULL;
+	}
+
+	void clear() {
+		if (ops != NULL) {
+			const Operations *oldOps = ops;
+			ops = NULL;
+			invoker = NULL;
+			oldOps->destroy(buffer);
+		}
+	}
+
+	operator SafeBool() const {
+		return (ops != NULL) ? &InlineFunctionBase::safeBoolTrue : 0;
+	}
+};
+
+
+template<typename R, size_t BufferSize>
+class InlineFunction<R (), BufferSize>: public InlineFunctionBase<BufferSize> {
+private:
+	typedef InlineFunctionBase<BufferSize> Base;
+	typedef typename Base::Buffer Buffer;
+	typedef R (*Invoker)(Buffer &buffer);
+
+	template<typename F>
+	static R invoke(Buffer &buffer) {
+		return (*Base::template Manager<F>::get(buffer))();
+	}
+
+	template<typename F>
+	void assignFunction(const F &func) {
+		this->assign(func, (typename Base::GenericInvoker) &invoke<F>);
+	}
+
+public:
+	typedef R result_type;
+
+	InlineFunction() { }
+
+	template<typename F>
+	InlineFunction(const F &func) {
+		assignFunction<typename boost::decay<F>::type>(func);
+	}
+
+	InlineFunction &operator=(const InlineFunction &other) {
+		this->assignFrom(other);
+		return *this;
+	}
+
+	template<typename F>
+	InlineFunction &operator=(const F &func) {
+		return operator=(InlineFunction(func));
+	}
+
+	R operator()() const {
+		return ((Invoker) this->invoker)(this->buffer);
+	}
+};
+
+template<typename R, typename A1, size_t BufferSize>
+class InlineFunction<R (A1), BufferSize>: public InlineFunctionBase<BufferSize> {
+private:
+	typedef InlineFunctionBase<BufferSize> Base;
+	typedef typename Base::Buffer Buffer;
+	typedef R (*Invoker)(Buffer &buffer, A1 a1);
+
+	template<typename F>
+	static R invoke(Buffer &buffer, A1 a1) {
+		return (*Base::template Manager<F>::get(buffer))(a1);
+	}
+
+	template<typename F>
+	void assignFunction(const F &func) {
+		this->assign(func, (typename Base::GenericInvoker) &invoke<F>);
+	}
+
+public:
+	typedef R result_type;
+
+	InlineFunction() { }
+
+	template<typename F>
+	InlineFunction(const F &func) {
+		assignFunction<typename boost::decay<F>::type>(func);
+	}
+
+	InlineFunction &operator=(const InlineFunction &other) {
+		this->assignFrom(other);
+		return *this;
+	}
+
+	template<typename F>
+	InlineFunction &operator=(const F &func) {
+		return operator=(InlineFunction(func));
+	}
+
+	R operator()(A1 a1) const {
+		return ((Invoker) this->invoker)(this->buffer, a1);
+	}
+};
+
+template<typename R, typename A1, typename A2, size_t BufferSize>
+class InlineFunction<R (A1, A2), BufferSize>: public InlineFunctionBase<BufferSize> {
+private:
+	typedef InlineFunctionBase<BufferSize> Base;
+	typedef typename Base::Buffer Buffer;
+	typedef R (*Invoker)(Buffer &buffer, A1 a1, A2 a2);
+
+	template<typename F>
+	static R invoke(Buffer &buffer, A1 a1, A2 a2) {
+		return (*Base::template Manager<F>::get(buffer))(a1, a2);
+	}
+
+	template<typename F>
+	void assignFunction(const F &func) {
+		this->assign(func, (typename Base::GenericInvoker) &invoke<F>);
+	}
+
+public:
+	typedef R result_type;
+
+	InlineFunction() { }
+
+	template<typename F>
+	InlineFunction(const F &func) {
+		assignFunction<typename boost::decay<F>::type>(func);
+	}
+
+	InlineFunction &operator=(const InlineFunction &other) {
+		this->assignFrom(other);
+		return *this;
+	}
+
+	template<typename F>
+	InlineFunction &operator=(const F &func) {
+		return operator=(InlineFunction(func));
+	}
+
+	R operator()(A1 a1, A2 a2) const {
+		return ((Invoker) this->invoker)(this->buffer, a1, a2);
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_INLINE_FUNCTION_H_ */
@@ -0,0 +1,270 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_JSON_WRITER_H_
+#define _PASSENGER_JSON_WRITER_H_
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <cassert>
+#include <cstdio>
+#include <cmath>
+#include <StaticString.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * Writes compact JSON directly into a string, as opposed to building a
+ * Json::Value document first and serializing that. Values are appended in
+ * the order in which they're given; the writer only keeps track of where
+ * commas are needed. Numbers are formatted on the stack, so the only
+ * allocations are those of the string itself. Pass a string that is
+ * reused between documents to avoid even those.
+ *
+ *   string buffer;
+ *   JsonWriter writer(buffer);
+ *   writer.beginObject();
+ *   writer.field("pid", 1234);
+ *   writer.key("groups");
+ *   writer.beginArray();
+ *   writer.value("foo");
+ *   writer.endArray();
+ *   writer.endObject();
+ *   // buffer == "{\"pid\":1234,\"groups\":[\"foo\"]}"
+ *
+ * Strings are written as they are, except for the characters that must be
+ * escaped, so they should be UTF-8. The caller is responsible for producing
+ * a well-formed document, e.g. for not writing two values in a row in an
+ * object; this is only checked with assertions.
+ */
+class JsonWriter: public boost::noncopyable {
+public:
+	static const unsigned int MAX_DEPTH = 32;
+
+private:
+	string &buffer;
+	/** Whether the container at each nesting level has any values yet. */
+	bool hasValues[MAX_DEPTH + 1];
+	/** Whether a key has just been written, so that the next value
+	 * belongs to it and doesn't need a comma. */
+	bool afterKey;
+	unsigned int depth;
+
+	void beginValue() {
+		if (afterKey) {
+			afterKey = false;
+		} else {
+			if (hasValues[depth]) {
+				buffer.append(1, ',');
+			}
+			hasValues[depth] = true;
+		}
+	}
+
+	void begin(char c) {
+		assert(depth < MAX_DEPTH);
+		beginValue();
+		buffer.append(1, c);
+		depth++;
+		hasValues[depth] = false;
+	}
+
+	void end(char c) {
+		assert(depth > 0);
+		assert(!afterKey);
+		buffer.append(1, c);
+		depth--;
+	}
+
+	void appendString(const StaticString &str) {
+		static const char hex[] = "0123456789abcdef";
+		const char *data = str.data();
+		const char *end = data + str.size();
+		const char *start = data;
+
+		buffer.append(1, '"');
+		while (data < end) {
+			unsigned char c = (unsigned char) *data;
+			if (c >= 0x20 && c != '"' && c != '\\') {
+				data++;
+				continue;
+			}
+
+			buffer.append(start, data - start);
+			switch (c) {
+			case '"':
+				buffer.append("\\\"", 2);
+				break;
+			case '\\':
+				buffer.append("\\\\", 2);
+				break;
+			case '\n':
+				buffer.append("\\n", 2);
+				break;
+			case '\r':
+				buffer.append("\\r", 2);
+				break;
+			case '\t':
+				buffer.append("\\t", 2);
+				break;
+			default: {
+				char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+				buffer.append(escaped, sizeof(escaped));
+				break;
+			}
+			}
+			data++;
+			start = data;
+		}
+		buffer.append(start, data - start);
+		buffer.append(1, '"');
+	}
+
+public:
+	/** Appends to `buffer`, which is not cleared first. */
+	JsonWriter(string &buffer)
+		: buffer(buffer),
+		  afterKey(false),
+		  depth(0)
+	{
+		hasValues[0] = false;
+	}
+
+	void beginObject() {
+		begin('{');
+	}
+
+	void endObject() {
+		end('}');
+	}
+
+	void beginArray() {
+		begin('[');
+	}
+
+	void endArray() {
+		end(']');
+	}
+
+	/** Writes the key of the next value in the current object. */
+	void key(const StaticString &name) {
+		assert(depth > 0);
+		assert(!afterKey);
+		beginValue();
+		appendString(name);
+		buffer.append(1, ':');
+		afterKey = true;
+	}
+
+	void value(const StaticString &str) {
+		beginValue();
+		appendString(str);
+	}
+
+	void value(const string &str) {
+		value(StaticString(str));
+	}
+
+	// Without this, string literals would be converted to bool rather than
+	// to StaticString.
+	void value(const char *str) {
+		value(StaticString(str));
+	}
+
+	void value(bool b) {
+		beginValue();
+		if (b) {
+			buffer.append("true", 4);
+		} else {
+			buffer.append("false", 5);
+		}
+	}
+
+	void value(int i) {
+		value((long long) i);
+	}
+
+	void value(unsigned int i) {
+		value((unsigned long long) i);
+	}
+
+	void value(long i) {
+		value((long long) i);
+	}
+
+	void value(unsigned long i) {
+		value((unsigned long long) i);
+	}
+
+	void value(long long i) {
+		char temp[32];
+		beginValue();
+		int size = snprintf(temp, sizeof(temp), "%lld", i);
+		buffer.append(temp, size);
+	}
+
+	void value(unsigned long long i) {
+		char temp[32];
+		beginValue();
+		int size = snprintf(temp, sizeof(temp), "%llu", i);
+		buffer.append(temp, size);
+	}
+
+	/** NaN and infinity can't be represented in JSON and are written as null. */
+	void value(double d) {
+		if (std::isnan(d) || std::isinf(d)) {
+			null();
+		} else {
+			char temp[32];
+			beginValue();
+			int size = snprintf(temp, sizeof(temp), "%.17g", d);
+			buffer.append(temp, size);
+		}
+	}
+
+	void null() {
+		beginValue();
+		buffer.append("null", 4);
+	}
+
+	/** Writes a key and its value. */
+	template<typename T>
+	void field(const StaticString &name, const T &val) {
+		key(name);
+		value(val);
+	}
+
+	/** Whether all objects and arrays have been closed. */
+	bool isComplete() const {
+		return depth == 0 && hasValues[0];
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_JSON_WRITER_H_ */
@@ -0,0 +1,253 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_MEMORY_ARENA_H_
+#define _PASSENGER_MEMORY_ARENA_H_
+
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <new>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <StaticString.h>
+
+namespace Passenger {
+
+
+/**
+ * A bump allocator for data that is freed all at once, such as the data that
+ * belongs to a single request. allocate() hands out memory by moving a
+ * pointer through a block; reset() frees everything that has been allocated.
+ *
+ * The arena is sized by its own history. When the current block runs out,
+ * extra blocks are allocated on the side, and the next reset() replaces them
+ * all with a single block that would have fit everything. So after a few
+ * rounds, a round normally doesn't call malloc() at all. If the block turns
+ * out to be much larger than needed for SHRINK_INTERVAL rounds in a row, it's
+ * shrunk again. The block never grows beyond `maxBlockSize`; allocations that
+ * don't fit in it always get a block of their own.
+ *
+ * The arena doesn't know what it contains. Objects that are constructed in
+ * it with placement new must be destroyed by hand before reset().
+ *
+ * Not thread-safe.
+ */
+class MemoryArena: public boost::noncopyable {
+public:
+	static const unsigned int SHRINK_INTERVAL = 64;
+
+private:
+	struct Overflow {
+		Overflow *next;
+		size_t size;
+	};
+
+	char *block;
+	size_t blockSize;
+	size_t pos;
+	/** Extra blocks allocated since the last reset(), newest first. The
+	 * memory that is handed out follows the Overflow header. */
+	Overflow *overflow;
+	/** The overflow block that allocations are bumped from, if any. */
+	size_t overflowPos;
+	/** The total number of bytes allocated since the last reset(). */
+	size_t used;
+
+	size_t initialBlockSize;
+	size_t maxBlockSize;
+	/** The most that was used in a round since the last shrink check. */
+	size_t peakUsed;
+	unsigned int rounds;
+
+	static size_t alignUp(size_t value, size_t alignment) {
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+
+	static size_t overflowHeaderSize() {
+		return alignUp(sizeof(Overflow), sizeof(double) * 2);
+	}
+
+	void *allocateOverflow(size_t size, size_t alignment) {
+		if (overflow != NULL) {
+			size_t start = alignUp(overflowHeaderSize() + overflowPos, alignment);
+			if (start + size <= overflowHeaderSize() + overflow->size) {
+				overflowPos = start + size - overflowHeaderSize();
+				return (char *) overflow + start;
+			}
+		}
+
+		size_t dataSize = std::max(size + alignment, std::max(blockSize, initialBlockSize));
+		Overflow *o = (Overflow *) malloc(overflowHeaderSize() + dataSize);
+		if (o == NULL) {
+			throw std::bad_alloc();
+		}
+		o->next = overflow;
+		o->size = dataSize;
+		overflow = o;
+
+		size_t start = alignUp(overflowHeaderSize(), alignment);
+		overflowPos = start + size - overflowHeaderSize();
+		return (char *) o + start;
+	}
+
+	void freeOverflow() {
+		while (overflow != NULL) {
+			Overflow *next = overflow->next;
+			free(overflow);
+			overflow = next;
+		}
+		overflowPos = 0;
+	}
+
+	void resizeBlock(size_t size) {
+		free(block);
+		block = NULL;
+		blockSize = 0;
+		block = (char *) malloc(size);
+		if (block == NULL) {
+			throw std::bad_alloc();
+		}
+		blockSize = size;
+	}
+
+public:
+	/**
+	 * @param initialBlockSize The size of the first block, which is only
+	 *    allocated when something is allocated from the arena.
+	 * @param maxBlockSize The size that the block may grow to.
+	 */
+	MemoryArena(size_t initialBlockSize = 1024, size_t maxBlockSize = 16 * 1024) {
+		block = NULL;
+		blockSize = 0;
+		pos = 0;
+		overflow = NULL;
+		overflowPos = 0;
+		used = 0;
+		this->initialBlockSize = initialBlockSize;
+		this->maxBlockSize = std::max(initialBlockSize, maxBlockSize);
+		peakUsed = 0;
+		rounds = 0;
+	}
+
+	~MemoryArena() {
+		freeOverflow();
+		free(block);
+	}
+
+	/**
+	 * Returns `size` bytes of memory, aligned to `alignment`, which must be
+	 * a power of two. The memory stays valid until the next reset().
+	 */
+	void *allocate(size_t size, size_t alignment = sizeof(void *)) {
+		assert((alignment & (alignment - 1)) == 0);
+		if (block == NULL) {
+			resizeBlock(initialBlockSize);
+		}
+		used += size;
+
+		size_t start = alignUp((size_t) block + pos, alignment) - (size_t) block;
+		if (start + size <= blockSize) {
+			pos = start + size;
+			return block + start;
+		} else {
+			return allocateOverflow(size, alignment);
+		}
+	}
+
+	/** Allocates memory for an object of type T, to be constructed with
+	 * placement new. */
+	template<typename T>
+	void *allocateFor() {
+		return allocate(sizeof(T), std::max<size_t>(sizeof(void *), sizeof(double)));
+	}
+
+	/** Copies the given string into the arena, NULL-terminated. */
+	StaticString copy(const StaticString &str) {
+		char *data = (char *) allocate(str.size() + 1, 1);
+		memcpy(data, str.data(), str.size());
+		data[str.size()] = '\0';
+		return StaticString(data, str.size());
+	}
+
+	/** Copies the concatenation of the given strings into the arena,
+	 * NULL-terminated. */
+	StaticString concat(const StaticString &str1, const StaticString &str2) {
+		char *data = (char *) allocate(str1.size() + str2.size() + 1, 1);
+		memcpy(data, str1.data(), str1.size());
+		memcpy(data + str1.size(), str2.data(), str2.size());
+		data[str1.size() + str2.size()] = '\0';
+		return StaticString(data, str1.size() + str2.size());
+	}
+
+	/**
+	 * Frees everything that has been allocated, and adjusts the block size
+	 * to what the past rounds needed.
+	 */
+	void reset() {
+		size_t needed = std::min(alignUp(used + used / 4, 1024), maxBlockSize);
+
+		peakUsed = std::max(peakUsed, used);
+		rounds++;
+		if (overflow != NULL) {
+			freeOverflow();
+			if (needed > blockSize) {
+				resizeBlock(needed);
+			}
+		} else if (rounds >= SHRINK_INTERVAL) {
+			size_t wanted = std::max(initialBlockSize,
+				std::min(alignUp(peakUsed + peakUsed / 4, 1024), maxBlockSize));
+			if (block != NULL && wanted < blockSize / 2) {
+				resizeBlock(wanted);
+			}
+		}
+		if (rounds >= SHRINK_INTERVAL) {
+			rounds = 0;
+			peakUsed = 0;
+		}
+		pos = 0;
+		used = 0;
+	}
+
+	/** The number of bytes allocated since the last reset(). */
+	size_t getUsed() const {
+		return used;
+	}
+
+	/** The size of the block that allocations are normally bumped from. */
+	size_t getBlockSize() const {
+		return blockSize;
+	}
+
+	/** Whether allocations since the last reset() didn't fit in the block. */
+	bool overflowed() const {
+		return overflow != NULL;
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_MEMORY_ARENA_H_ */
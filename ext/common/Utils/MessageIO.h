@@ -258,6 +258,58 @@ readArrayMessage(int fd, Collection &output, unsigned long long *timeout = NULL)
 	return true;
 }
 
+/**
+ * Reads an array message from the given file descriptor without allocating
+ * a string for every element. The raw message is read into <tt>buffer</tt>,
+ * which may be reused between calls so that its memory is reused too, and
+ * <tt>output</tt> is filled with StaticStrings that point into <tt>buffer</tt>.
+ * These StaticStrings are therefore only valid until <tt>buffer</tt> is
+ * modified or destroyed. <tt>output</tt> is typically a
+ * <tt>SmallVector&lt;StaticString, N&gt;</tt>.
+ *
+ * Unlike the other readArrayMessage() versions, this one does not zero
+ * the message data after use, so don't use it for reading secrets.
+ *
+ * @param timeout A pointer to an integer, which specifies the maximum number of
+ *                microseconds that may be spent on reading the necessary data.
+ *                If the timeout expired then TimeoutException will be thrown.
+ *                If this function returns without throwing an exception, then the
+ *                total number of microseconds spent on reading will be deducted
+ *                from <tt>timeout</tt>.
+ *                Pass NULL if you do not want to enforce a timeout.
+ * @return True if an array message was read, false if end-of-file was reached
+ *         before a full array message could be read.
+ * @throws SystemException Something went wrong.
+ * @throws TimeoutException Unable to read the necessary data within
+ *                          <tt>timeout</tt> microseconds.
+ * @throws boost::thread_interrupted
+ */
+template<typename Collection>
+inline bool
+readArrayMessage(int fd, Collection &output, string &buffer, unsigned long long *timeout = NULL) {
+	uint16_t size;
+	if (!readUint16(fd, size, timeout)) {
+		return false;
+	}
+	
+	buffer.resize(size);
+	if (size != 0 && readExact(fd, &buffer[0], size, timeout) != size) {
+		return false;
+	}
+	
+	output.clear();
+	if (size != 0) {
+		const char *data = buffer.data();
+		const char *end = data + size;
+		const char *pos;
+		while ((pos = (const char *) memchr(data, '\0', end - data)) != NULL) {
+			output.push_back(StaticString(data, pos - data));
+			data = pos + 1;
+		}
+	}
+	return true;
+}
+
 /**
  * Reads an array message from the given file descriptor. This version returns
  * the result immediately as a string vector.
@@ -340,6 +392,54 @@ readScalarMessage(int fd, string &output, unsigned int maxSize = 0, unsigned lon
 	return true;
 }
 
+/**
+ * Reads a scalar message from the given file descriptor into <tt>buffer</tt>,
+ * which may be reused between calls, and sets <tt>output</tt> to the message
+ * body. <tt>output</tt> points into <tt>buffer</tt> and is only valid until
+ * <tt>buffer</tt> is modified or destroyed. The body is read directly into
+ * <tt>buffer</tt> instead of through an intermediate buffer on the stack.
+ *
+ * Unlike the other readScalarMessage() versions, this one does not zero
+ * intermediate data, so don't use it for reading secrets.
+ *
+ * @param maxSize The maximum number of bytes that may be read. If the
+ *                scalar to read is larger than this, then a SecurityException
+ *                will be thrown. Set to 0 for no size limit.
+ * @param timeout A pointer to an integer, which specifies the maximum number of
+ *                microseconds that may be spent on reading the necessary data.
+ *                If the timeout expired then TimeoutException will be thrown.
+ *                If this function returns without throwing an exception, then the
+ *                total number of microseconds spent on reading will be deducted
+ *                from <tt>timeout</tt>.
+ *                Pass NULL if you do not want to enforce a timeout.
+ * @return True if a scalar message was read, false if EOF was encountered.
+ * @throws SystemException Something went wrong.
+ * @throws SecurityException The message body is larger than allowed by maxSize.
+ * @throws TimeoutException Unable to read the necessary data within
+ *                          <tt>timeout</tt> microseconds.
+ * @throws boost::thread_interrupted
+ */
+inline bool
+readScalarMessage(int fd, StaticString &output, string &buffer, unsigned int maxSize = 0,
+	unsigned long long *timeout = NULL)
+{
+	uint32_t size;
+	if (!readUint32(fd, size, timeout)) {
+		return false;
+	}
+	
+	if (maxSize != 0 && size > (uint32_t) maxSize) {
+		throw SecurityException("The scalar message body is larger than the size limit");
+	}
+	
+	buffer.resize(size);
+	if (size != 0 && readExact(fd, &buffer[0], size, timeout) != size) {
+		return false;
+	}
+	output = StaticString(buffer.data(), size);
+	return true;
+}
+
 /**
  * Reads a scalar message from the given file descriptor.
  *
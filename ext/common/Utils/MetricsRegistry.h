@@ -0,0 +1,303 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_METRICS_REGISTRY_H_
+#define _PASSENGER_METRICS_REGISTRY_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <StaticString.h>
+#include <Exceptions.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * A counter or gauge that lives on a cache line of its own, so that metrics
+ * that are updated by different threads don't slow each other down.
+ * Metrics are created by MetricsRegistry::add(). Updating one is a single
+ * relaxed atomic operation; no locks are involved.
+ */
+class Metric: public boost::noncopyable {
+public:
+	enum Type {
+		/** A value that only ever goes up, like the number of requests. */
+		COUNTER,
+		/** A value that goes up and down, like the number of open sessions. */
+		GAUGE
+	};
+
+	static const unsigned int CACHE_LINE_SIZE = 64;
+
+private:
+	boost::atomic<long long> value;
+	char padding[CACHE_LINE_SIZE - sizeof(boost::atomic<long long>)];
+
+public:
+	Metric() {
+		value.store(0, boost::memory_order_relaxed);
+	}
+
+	void add(long long n) {
+		value.fetch_add(n, boost::memory_order_relaxed);
+	}
+
+	void increment() {
+		add(1);
+	}
+
+	void decrement() {
+		add(-1);
+	}
+
+	void set(long long n) {
+		value.store(n, boost::memory_order_relaxed);
+	}
+
+	long long get() const {
+		return value.load(boost::memory_order_relaxed);
+	}
+};
+
+
+/**
+ * Keeps track of the Metrics of the components in an agent, and renders them
+ * in the Prometheus text exposition format.
+ *
+ * Each component registers its own Metrics instead of sharing them with
+ * other components. For example, every RequestHandler, each of which runs
+ * on its own event loop thread, registers its own 'passenger_requests_total'
+ * counter. Metrics with the same name and labels are summed when rendering.
+ * So updating a metric never contends with other threads, and rendering only
+ * reads the values without stopping anybody: the registry lock is only held
+ * while registering and while copying the values.
+ *
+ * This class is fully thread-safe.
+ */
+class MetricsRegistry: public boost::noncopyable {
+private:
+	struct Family {
+		string help;
+		Metric::Type type;
+	};
+
+	struct Entry {
+		const void *owner;
+		string name;
+		string labels;
+		Metric *metric;
+	};
+
+	struct Sample {
+		const string *name;
+		const string *labels;
+		long long value;
+
+		bool operator<(const Sample &other) const {
+			int c = name->compare(*other.name);
+			return c < 0 || (c == 0 && *labels < *other.labels);
+		}
+	};
+
+	mutable boost::mutex syncher;
+	map<string, Family> families;
+	vector<Entry> entries;
+
+	static Metric *allocateMetric() {
+		void *memory;
+		if (posix_memalign(&memory, Metric::CACHE_LINE_SIZE, sizeof(Metric)) != 0) {
+			throw std::bad_alloc();
+		}
+		return new (memory) Metric();
+	}
+
+	static void freeMetric(Metric *metric) {
+		metric->~Metric();
+		free(metric);
+	}
+
+	static const char *typeName(Metric::Type type) {
+		if (type == Metric::COUNTER) {
+			return "counter";
+		} else {
+			return "gauge";
+		}
+	}
+
+public:
+	~MetricsRegistry() {
+		vector<Entry>::iterator it, end = entries.end();
+		for (it = entries.begin(); it != end; it++) {
+			freeMetric(it->metric);
+		}
+	}
+
+	/**
+	 * Creates a new Metric, owned by this registry, and returns it. The
+	 * Metric stays valid until `owner` calls `removeAll(owner)`, or until
+	 * the registry is destroyed.
+	 *
+	 * `labels` is either empty or a comma-separated list of labels as
+	 * created by `label()`, e.g. 'app="/foo#default"'.
+	 *
+	 * @throws ArgumentException A metric with the same name but a different
+	 *                           type has already been registered.
+	 */
+	Metric *add(const void *owner, const StaticString &name, Metric::Type type,
+		const StaticString &help, const StaticString &labels = StaticString())
+	{
+		boost::lock_guard<boost::mutex> l(syncher);
+		map<string, Family>::iterator it = families.find(name);
+		if (it == families.end()) {
+			Family family;
+			family.help = help;
+			family.type = type;
+			families.insert(make_pair(string(name), family));
+		} else if (it->second.type != type) {
+			throw ArgumentException("Metric " + name + " has already been "
+				"registered as a " + typeName(it->second.type));
+		}
+
+		Entry entry;
+		entry.owner  = owner;
+		entry.name   = name;
+		entry.labels = labels;
+		entry.metric = allocateMetric();
+		entries.push_back(entry);
+		return entry.metric;
+	}
+
+	/** Removes and frees all Metrics that `owner` has registered. */
+	void removeAll(const void *owner) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		unsigned int i = 0;
+		while (i < entries.size()) {
+			if (entries[i].owner == owner) {
+				freeMetric(entries[i].metric);
+				entries[i] = entries.back();
+				entries.pop_back();
+			} else {
+				i++;
+			}
+		}
+	}
+
+	/** Formats a label for `add()`, escaping the value as Prometheus requires. */
+	static string label(const StaticString &name, const StaticString &value) {
+		string result;
+		result.reserve(name.size() + value.size() + 3);
+		result.append(name.data(), name.size());
+		result.append("=\"", 2);
+		for (string::size_type i = 0; i < value.size(); i++) {
+			char ch = value[i];
+			if (ch == '\\' || ch == '"') {
+				result.append(1, '\\');
+				result.append(1, ch);
+			} else if (ch == '\n') {
+				result.append("\\n", 2);
+			} else {
+				result.append(1, ch);
+			}
+		}
+		result.append(1, '"');
+		return result;
+	}
+
+	/**
+	 * Renders the sum of all Metrics with the same name and labels, in the
+	 * Prometheus text exposition format (version 0.0.4).
+	 */
+	string toPrometheusText() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		vector<Sample> samples;
+		vector<Entry>::const_iterator it, end = entries.end();
+
+		samples.reserve(entries.size());
+		for (it = entries.begin(); it != end; it++) {
+			Sample sample;
+			sample.name   = &it->name;
+			sample.labels = &it->labels;
+			sample.value  = it->metric->get();
+			samples.push_back(sample);
+		}
+		std::sort(samples.begin(), samples.end());
+
+		string result;
+		const string *lastName = NULL;
+		unsigned int i = 0;
+		while (i < samples.size()) {
+			const Sample &sample = samples[i];
+			long long sum = sample.value;
+			for (i++; i < samples.size()
+				&& *samples[i].name == *sample.name
+				&& *samples[i].labels == *sample.labels;
+				i++)
+			{
+				sum += samples[i].value;
+			}
+
+			if (lastName == NULL || *lastName != *sample.name) {
+				const Family &family = families.find(*sample.name)->second;
+				result.append("# HELP ");
+				result.append(*sample.name);
+				result.append(" ");
+				result.append(family.help);
+				result.append("\n# TYPE ");
+				result.append(*sample.name);
+				result.append(" ");
+				result.append(typeName(family.type));
+				result.append("\n");
+				lastName = sample.name;
+			}
+			result.append(*sample.name);
+			if (!sample.labels->empty()) {
+				result.append("{");
+				result.append(*sample.labels);
+				result.append("}");
+			}
+			result.append(" ");
+			result.append(toString(sum));
+			result.append("\n");
+		}
+		return result;
+	}
+};
+
+typedef boost::shared_ptr<MetricsRegistry> MetricsRegistryPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_METRICS_REGISTRY_H_ */
@@ -1,51 +1,167 @@
 #ifndef _PASSENGER_PRIORITY_QUEUE_H_
 #define _PASSENGER_PRIORITY_QUEUE_H_
 
-#include "fib.h"
+#include <vector>
+#include <cassert>
+#include <cstddef>
+#include <algorithm>
 
 namespace Passenger {
 
+using namespace std;
+
+
+/**
+ * A min-priority queue of pointers to T, implemented as an indexed 4-ary
+ * heap in a single array. Unlike a Fibonacci heap, it doesn't allocate a
+ * node per item, and its entries are compared without chasing pointers.
+ * push(), pop(), decrease(), update() and erase() are O(log n).
+ *
+ * The queue is intrusive: T must have an <tt>unsigned int pqIndex</tt>
+ * member, in which the queue stores the item's current position in the
+ * heap. An item can therefore only be in one PriorityQueue at a time.
+ *
+ * A Handle is the item itself. It stays valid until the item is popped or
+ * erased, no matter how other items are moved around.
+ */
 template<typename T>
 class PriorityQueue {
+public:
+	typedef T *Handle;
+	
 private:
-	struct fibheap heap;
+	static const unsigned int ARITY = 4;
 	
-public:
-	typedef struct fibheap_el * Handle;
+	struct Entry {
+		int priority;
+		T *item;
+	};
+	
+	vector<Entry> heap;
+	
+	void place(unsigned int pos, const Entry &entry) {
+		heap[pos] = entry;
+		entry.item->pqIndex = pos;
+	}
+	
+	void siftUp(unsigned int pos) {
+		Entry entry = heap[pos];
+		while (pos > 0) {
+			unsigned int parent = (pos - 1) / ARITY;
+			if (heap[parent].priority <= entry.priority) {
+				break;
+			}
+			place(pos, heap[parent]);
+			pos = parent;
+		}
+		place(pos, entry);
+	}
 	
-	PriorityQueue() {
-		fh_initheap(&heap);
-		heap.fh_keys = 1;
+	void siftDown(unsigned int pos) {
+		Entry entry = heap[pos];
+		unsigned int size = heap.size();
+		while (true) {
+			unsigned int first = pos * ARITY + 1;
+			if (first >= size) {
+				break;
+			}
+			unsigned int last = std::min(first + ARITY, size);
+			unsigned int smallest = first;
+			for (unsigned int i = first + 1; i < last; i++) {
+				if (heap[i].priority < heap[smallest].priority) {
+					smallest = i;
+				}
+			}
+			if (heap[smallest].priority >= entry.priority) {
+				break;
+			}
+			place(pos, heap[smallest]);
+			pos = smallest;
+		}
+		place(pos, entry);
 	}
 	
-	~PriorityQueue() {
-		fh_destroyheap(&heap);
+	void reposition(unsigned int pos) {
+		if (pos > 0 && heap[pos].priority < heap[(pos - 1) / ARITY].priority) {
+			siftUp(pos);
+		} else {
+			siftDown(pos);
+		}
 	}
 	
+	void eraseAt(unsigned int pos) {
+		Entry last = heap.back();
+		heap.pop_back();
+		if (pos < heap.size()) {
+			place(pos, last);
+			reposition(pos);
+		}
+	}
+	
+public:
 	Handle push(T *item, int priority) {
-		return fh_insertkey(&heap, priority, item);
+		Entry entry;
+		entry.priority = priority;
+		entry.item = item;
+		heap.push_back(entry);
+		siftUp(heap.size() - 1);
+		return item;
 	}
 	
 	T *pop() {
-		return (T *) fh_extractmin(&heap);
+		if (heap.empty()) {
+			return NULL;
+		} else {
+			T *item = heap[0].item;
+			eraseAt(0);
+			return item;
+		}
 	}
 	
 	T *top() const {
-		return (T *) fh_min(const_cast<struct fibheap *>(&heap));
+		if (heap.empty()) {
+			return NULL;
+		} else {
+			return heap[0].item;
+		}
 	}
 	
 	void decrease(Handle handle, int priority) {
-		fh_replacekeydata(&heap, handle, priority, handle->fhe_data);
+		unsigned int pos = handle->pqIndex;
+		assert(pos < heap.size() && heap[pos].item == handle);
+		assert(priority <= heap[pos].priority);
+		heap[pos].priority = priority;
+		siftUp(pos);
+	}
+	
+	/**
+	 * Like decrease(), but the new priority may also be higher. Returns
+	 * the handle of the item, which is the same as the given one.
+	 */
+	Handle update(Handle handle, int priority) {
+		unsigned int pos = handle->pqIndex;
+		assert(pos < heap.size() && heap[pos].item == handle);
+		heap[pos].priority = priority;
+		reposition(pos);
+		return handle;
 	}
 	
 	void erase(Handle handle) {
-		fh_delete(&heap, handle);
+		unsigned int pos = handle->pqIndex;
+		assert(pos < heap.size() && heap[pos].item == handle);
+		eraseAt(pos);
 	}
 	
 	void clear() {
-		fh_destroyheap(&heap);
-		fh_initheap(&heap);
-		heap.fh_keys = 1;
+		heap.clear();
+	}
+	
+	unsigned int size() const {
+		return heap.size();
+	}
+	
+	bool empty() const {
+		return heap.empty();
 	}
 };
 
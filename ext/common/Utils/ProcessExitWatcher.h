@@ -0,0 +1,142 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_PROCESS_EXIT_WATCHER_H_
+#define _PASSENGER_PROCESS_EXIT_WATCHER_H_
+
+#include <boost/function.hpp>
+#include <oxt/system_calls.hpp>
+#include <ev++.h>
+#include <cerrno>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+	#include <sys/syscall.h>
+	#if defined(SYS_pidfd_open)
+		#define PASSENGER_PROCESS_EXIT_WATCHER_PIDFD
+	#endif
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+	defined(__NetBSD__) || defined(__DragonFly__)
+	#include <sys/event.h>
+	#include <sys/time.h>
+	#define PASSENGER_PROCESS_EXIT_WATCHER_KQUEUE
+#endif
+
+#include <FileDescriptor.h>
+#include <SafeLibev.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * Calls a callback on an event loop as soon as a process exits. Unlike
+ * SIGCHLD and waitpid(), this works for any process that we may signal, not
+ * just our own children, e.g. for application processes that were forked
+ * by a preloader. It uses a pidfd on Linux, and a kqueue with an EVFILT_PROC
+ * filter on OS X and the BSDs; both are file descriptors that become readable
+ * when the process exits, so they are watched like any other I/O.
+ *
+ * The watcher frees itself after calling the callback exactly once, and
+ * cannot be cancelled: the callback must be prepared for the process to
+ * have been dealt with already.
+ */
+class ProcessExitWatcher {
+private:
+	typedef boost::function<void ()> Callback;
+
+	ev::io watcher;
+	FileDescriptor fd;
+	Callback callback;
+
+	ProcessExitWatcher(int _fd, const Callback &_callback)
+		: fd(_fd),
+		  callback(_callback)
+		{ }
+
+	void onReadable(ev::io &io, int revents) {
+		Callback callback = this->callback;
+		watcher.stop();
+		delete this;
+		callback();
+	}
+
+	static int openFd(pid_t pid) {
+		#if defined(PASSENGER_PROCESS_EXIT_WATCHER_PIDFD)
+			return (int) syscall(SYS_pidfd_open, pid, 0);
+		#elif defined(PASSENGER_PROCESS_EXIT_WATCHER_KQUEUE)
+			int kq = kqueue();
+			if (kq == -1) {
+				return -1;
+			}
+			struct kevent change;
+			EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+			if (kevent(kq, &change, 1, NULL, 0, NULL) == -1) {
+				int e = errno;
+				close(kq);
+				errno = e;
+				return -1;
+			}
+			return kq;
+		#else
+			errno = ENOSYS;
+			return -1;
+		#endif
+	}
+
+public:
+	/**
+	 * Starts watching the process with the given PID, and calls `callback`
+	 * in the event loop thread once it has exited. If the process no longer
+	 * exists, the callback is called in the next event loop iteration.
+	 * Returns false if process exits can't be watched on this system, in
+	 * which case the caller has to poll.
+	 *
+	 * @pre Called from the event loop thread.
+	 */
+	static bool watch(SafeLibev *libev, pid_t pid, const Callback &callback) {
+		int fd = openFd(pid);
+		if (fd == -1) {
+			if (errno == ESRCH) {
+				libev->runLater(callback);
+				return true;
+			} else {
+				return false;
+			}
+		}
+
+		ProcessExitWatcher *self = new ProcessExitWatcher(fd, callback);
+		self->watcher.set<ProcessExitWatcher, &ProcessExitWatcher::onReadable>(self);
+		self->watcher.set(fd, ev::READ);
+		libev->start(self->watcher);
+		return true;
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_PROCESS_EXIT_WATCHER_H_ */
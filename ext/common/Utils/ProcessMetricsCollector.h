@@ -29,6 +29,7 @@
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <oxt/system_calls.hpp>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <map>
@@ -48,11 +49,13 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <cstdlib>
 #include <cerrno>
 #include <cstring>
@@ -130,6 +133,19 @@ struct ProcessMetrics {
 			return 0;
 		}
 	}
+
+	/**
+	 * Returns the amount of resident memory in KB that this process shares
+	 * with other processes, e.g. with the preloader that it was forked from,
+	 * or -1 if unknown.
+	 */
+	ssize_t sharedMemory() const {
+		if (rss != -1 && privateDirty != -1 && rss >= privateDirty) {
+			return rss - privateDirty;
+		} else {
+			return -1;
+		}
+	}
 };
 
 class ProcessMetricMap: public map<pid_t, ProcessMetrics> {
@@ -408,6 +424,121 @@ private:
 		return result;
 	}
 	
+	#ifdef __linux__
+		/**
+		 * Reads the entire contents of a file in /proc. Returns false if
+		 * the file cannot be read, e.g. because the process no longer exists.
+		 */
+		static bool readProcFile(const string &filename, string &output) {
+			int fd = syscalls::open(filename.c_str(), O_RDONLY);
+			if (fd == -1) {
+				return false;
+			}
+			FdGuard guard(fd);
+			output.clear();
+			while (true) {
+				char buf[1024 * 4];
+				ssize_t ret = syscalls::read(fd, buf, sizeof(buf));
+				if (ret == -1) {
+					return false;
+				} else if (ret == 0) {
+					return true;
+				} else {
+					output.append(buf, ret);
+				}
+			}
+		}
+
+		/**
+		 * Collects the metrics of a single process from /proc/<pid>/stat and
+		 * /proc/<pid>/cmdline, computing the same values as 'ps' does.
+		 * Returns false if the process no longer exists.
+		 *
+		 * @throws ProcessMetricsCollector::ParseException
+		 */
+		static bool collectFromProc(pid_t pid, double uptime, long clockTicks, long pageSize,
+			ProcessMetrics &metrics)
+		{
+			string dir = "/proc/" + toString(pid);
+			string stat, cmdline;
+			struct stat buf;
+
+			if (!readProcFile(dir + "/stat", stat)
+			 || !readProcFile(dir + "/cmdline", cmdline)
+			 || syscalls::stat(dir.c_str(), &buf) == -1)
+			{
+				return false;
+			}
+
+			// The command name is between parentheses and may itself
+			// contain spaces and parentheses.
+			string::size_type commStart = stat.find('(');
+			string::size_type commEnd = stat.rfind(')');
+			if (commStart == string::npos || commEnd == string::npos
+			 || commEnd < commStart || commEnd + 1 >= stat.size())
+			{
+				throw ParseException();
+			}
+
+			const char *data = stat.c_str() + commEnd + 1;
+			long long fields[22];
+			readNextWord(&data); // state
+			fields[0] = 0;
+			for (unsigned int i = 1; i < sizeof(fields) / sizeof(long long); i++) {
+				fields[i] = readNextWordAsLongLong(&data);
+			}
+
+			metrics.pid = pid;
+			metrics.ppid = (pid_t) fields[1];
+			metrics.processGroupId = (pid_t) fields[2];
+			metrics.uid = buf.st_uid;
+			metrics.vmsize = (size_t) (fields[20] / 1024);
+			metrics.rss = (size_t) (fields[21] * (pageSize / 1024));
+
+			// Like 'ps', the CPU usage is the CPU time divided by how long
+			// the process has existed.
+			double cpuTime = (double) (fields[11] + fields[12]) / clockTicks;
+			double elapsed = uptime - (double) fields[19] / clockTicks;
+			if (elapsed > 0) {
+				metrics.cpu = (int) (cpuTime * 100 / elapsed);
+			} else {
+				metrics.cpu = 0;
+			}
+
+			string::size_type end = cmdline.find_last_not_of('\0');
+			if (end == string::npos) {
+				// Kernel threads and zombies have no command line.
+				metrics.command = "[" + stat.substr(commStart + 1, commEnd - commStart - 1) + "]";
+			} else {
+				cmdline.resize(end + 1);
+				std::replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+				metrics.command = cmdline;
+			}
+			return true;
+		}
+
+		template<typename Collection, typename ConstIterator>
+		ProcessMetricMap collectFromProc(const Collection &pids) const {
+			ProcessMetricMap result;
+			string uptimeData;
+			if (!readProcFile("/proc/uptime", uptimeData)) {
+				throw RuntimeException("Cannot read /proc/uptime");
+			}
+			double uptime = atof(uptimeData.c_str());
+			long clockTicks = sysconf(_SC_CLK_TCK);
+			long pageSize = sysconf(_SC_PAGESIZE);
+
+			ConstIterator it;
+			for (it = pids.begin(); it != pids.end(); it++) {
+				ProcessMetrics metrics;
+				if (collectFromProc(*it, uptime, clockTicks, pageSize, metrics)) {
+					result[metrics.pid] = metrics;
+				}
+			}
+			return result;
+		}
+	#endif
+	
 public:
 	ProcessMetricsCollector() {
 		#ifdef __APPLE__
@@ -424,7 +555,8 @@ public:
 	
 	/**
 	 * Collect metrics for the given process IDs. Nonexistant PIDs are not
-	 * included in the result.
+	 * included in the result. On Linux the metrics are read from /proc
+	 * directly, on other platforms they are obtained by running 'ps'.
 	 *
 	 * Returns a map which maps a given PID to its collected metrics.
 	 *
@@ -438,6 +570,33 @@ public:
 			return ProcessMetricMap();
 		}
 		
+		ProcessMetricMap result;
+		#ifdef __linux__
+			if (psOutput.empty()) {
+				result = collectFromProc<Collection, ConstIterator>(pids);
+			} else {
+				result = parsePsOutput<Collection, ConstIterator>(psOutput, pids);
+			}
+		#else
+			result = collectFromPs<Collection, ConstIterator>(pids);
+		#endif
+		if (canMeasureRealMemory) {
+			ProcessMetricMap::iterator it;
+			for (it = result.begin(); it != result.end(); it++) {
+				ProcessMetrics &metric = it->second;
+				measureRealMemory(metric.pid, metric.pss,
+					metric.privateDirty, metric.swap);
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Like collect(), but always uses 'ps' instead of reading /proc
+	 * directly on Linux.
+	 */
+	template<typename Collection, typename ConstIterator>
+	ProcessMetricMap collectFromPs(const Collection &pids) const {
 		ConstIterator it;
 		// The list of PIDs must follow -p without a space.
 		// https://groups.google.com/forum/#!topic/phusion-passenger/WKXy61nJBMA
@@ -469,17 +628,7 @@ public:
 			psOutput = runCommandAndCaptureOutput(command);
 		}
 		pidsArg.resize(0);
-		ProcessMetricMap result = parsePsOutput<Collection, ConstIterator>(psOutput, pids);
-		psOutput.resize(0);
-		if (canMeasureRealMemory) {
-			ProcessMetricMap::iterator it;
-			for (it = result.begin(); it != result.end(); it++) {
-				ProcessMetrics &metric = it->second;
-				measureRealMemory(metric.pid, metric.pss,
-					metric.privateDirty, metric.swap);
-			}
-		}
-		return result;
+		return parsePsOutput<Collection, ConstIterator>(psOutput, pids);
 	}
 	
 	ProcessMetricMap collect(const vector<pid_t> &pids) const {
@@ -559,11 +708,17 @@ public:
 			pss /= 1024;
 			privateDirty /= 1024;
 		#else
+			// smaps_rollup (Linux >= 4.14) contains the same totals as
+			// smaps, but is much cheaper for the kernel to generate and
+			// for us to parse.
 			string smapsFilename = "/proc/";
 			smapsFilename.append(toString(pid));
 			smapsFilename.append("/smaps");
 			
-			FILE *f = syscalls::fopen(smapsFilename.c_str(), "r");
+			FILE *f = syscalls::fopen((smapsFilename + "_rollup").c_str(), "r");
+			if (f == NULL) {
+				f = syscalls::fopen(smapsFilename.c_str(), "r");
+			}
 			if (f == NULL) {
 				error:
 				pss = -1;
@@ -636,6 +791,32 @@ public:
 			}
 		#endif
 	}
+
+	/**
+	 * Returns the amount of memory, in KB, that is available for starting new
+	 * processes without swapping, or -1 if it cannot be determined. On Linux
+	 * this is MemAvailable from /proc/meminfo, which includes reclaimable
+	 * caches. Elsewhere only the free memory is counted.
+	 */
+	static ssize_t getAvailableSystemMemory() {
+		#ifdef __linux__
+			string meminfo;
+			if (readProcFile("/proc/meminfo", meminfo)) {
+				string::size_type pos = meminfo.find("MemAvailable:");
+				if (pos != string::npos) {
+					return (ssize_t) atoll(meminfo.c_str() + pos + sizeof("MemAvailable:") - 1);
+				}
+			}
+		#endif
+		#ifdef _SC_AVPHYS_PAGES
+			long pages = sysconf(_SC_AVPHYS_PAGES);
+			long pageSize = sysconf(_SC_PAGESIZE);
+			if (pages != -1 && pageSize != -1) {
+				return (ssize_t) ((long long) pages * pageSize / 1024);
+			}
+		#endif
+		return -1;
+	}
 };
 
 } // namespace Passenger
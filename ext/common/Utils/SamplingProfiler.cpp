@@ -0,0 +1,306 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <cxxabi.h>
+
+#if defined(__APPLE__) || defined(__linux__)
+	#define LIBC_HAS_BACKTRACE_FUNC
+#endif
+#ifdef LIBC_HAS_BACKTRACE_FUNC
+	#include <execinfo.h>
+#endif
+
+#include <Exceptions.h>
+#include <Utils/SamplingProfiler.h>
+#include <Utils/ScopeGuard.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace oxt;
+
+
+#define MAX_NATIVE_FRAMES 64
+#define MAX_TRACE_POINTS  32
+#define THREAD_NAME_SIZE  48
+/** Limits the sample buffer to about 20 MB. */
+#define MAX_SAMPLES       25000
+/** The frames of handleSigprof() and of the signal trampoline. */
+#define SIGNAL_HANDLER_FRAMES 2
+
+struct Sample {
+	unsigned int nativeDepth;
+	unsigned int traceDepth;
+	void *native[MAX_NATIVE_FRAMES];
+	const char *tracePoints[MAX_TRACE_POINTS];
+	char threadName[THREAD_NAME_SIZE];
+};
+
+/** Held during a profile, so that only one runs at a time. */
+static boost::mutex profilerMutex;
+static bool handlerInstalled = false;
+
+/* State shared with the signal handler. The handler only touches the
+ * buffer while it's published in 'sampleBuffer', and stopSampling()
+ * waits until no handler is running anymore after unpublishing it.
+ */
+static boost::atomic<Sample *> sampleBuffer(NULL);
+static boost::atomic<unsigned int> sampleCount(0);
+static boost::atomic<unsigned int> activeHandlers(0);
+static unsigned int sampleCapacity = 0;
+
+
+static void
+handleSigprof(int signo) {
+	int e = errno;
+	activeHandlers.fetch_add(1);
+	Sample *buffer = sampleBuffer.load();
+	if (buffer != NULL) {
+		unsigned int i = sampleCount.fetch_add(1, boost::memory_order_relaxed);
+		if (i < sampleCapacity) {
+			Sample *sample = &buffer[i];
+			#ifdef LIBC_HAS_BACKTRACE_FUNC
+				sample->nativeDepth = backtrace(sample->native, MAX_NATIVE_FRAMES);
+			#else
+				sample->nativeDepth = 0;
+			#endif
+			sample->traceDepth = oxt::thread::sample_current_thread(
+				sample->threadName, THREAD_NAME_SIZE,
+				sample->tracePoints, MAX_TRACE_POINTS);
+		}
+	}
+	activeHandlers.fetch_sub(1);
+	errno = e;
+}
+
+static void
+installSignalHandler() {
+	if (handlerInstalled) {
+		return;
+	}
+
+	#ifdef LIBC_HAS_BACKTRACE_FUNC
+		// The first call to backtrace() may load libgcc, which isn't
+		// something to do in a signal handler.
+		void *frames[1];
+		backtrace(frames, 1);
+	#endif
+
+	// The handler stays installed after the profile is done: a SIGPROF
+	// may still be pending, and its default action is to terminate us.
+	struct sigaction action;
+	action.sa_handler = handleSigprof;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, NULL) == -1) {
+		int e = errno;
+		throw SystemException("Cannot install a SIGPROF handler", e);
+	}
+	handlerInstalled = true;
+}
+
+static void
+stopSampling() {
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sampleBuffer.store(NULL);
+	while (activeHandlers.load() != 0) {
+		sched_yield();
+	}
+}
+
+static string
+frameName(const char *symbol) {
+	// glibc formats symbols as "/path/to/binary(mangled+0x1f) [0x4005d4]".
+	const char *open = strchr(symbol, '(');
+	const char *plus = (open == NULL) ? NULL : strchr(open, '+');
+	string result;
+
+	if (open == NULL) {
+		result = symbol;
+	} else if (plus == NULL || plus == open + 1) {
+		// No symbol name; only the binary is known.
+		const char *base = symbol;
+		for (const char *p = symbol; p < open; p++) {
+			if (*p == '/') {
+				base = p + 1;
+			}
+		}
+		result = "[" + string(base, open - base) + "]";
+	} else {
+		string mangled(open + 1, plus - open - 1);
+		int status;
+		char *demangled = abi::__cxa_demangle(mangled.c_str(), NULL, NULL, &status);
+		if (demangled != NULL) {
+			result = demangled;
+			free(demangled);
+		} else {
+			result = mangled;
+		}
+	}
+
+	// Semicolons separate the frames in the folded format.
+	replace(result.begin(), result.end(), ';', ':');
+	replace(result.begin(), result.end(), '\n', ' ');
+	return result;
+}
+
+static void
+symbolizeNativeFrames(const Sample *samples, unsigned int count, map<void *, string> &names) {
+	#ifdef LIBC_HAS_BACKTRACE_FUNC
+		for (unsigned int i = 0; i < count; i++) {
+			for (unsigned int j = SIGNAL_HANDLER_FRAMES; j < samples[i].nativeDepth; j++) {
+				names[samples[i].native[j]];
+			}
+		}
+
+		vector<void *> addresses;
+		map<void *, string>::iterator it, end = names.end();
+		addresses.reserve(names.size());
+		for (it = names.begin(); it != end; it++) {
+			addresses.push_back(it->first);
+		}
+		if (addresses.empty()) {
+			return;
+		}
+
+		char **symbols = backtrace_symbols(&addresses[0], addresses.size());
+		if (symbols == NULL) {
+			throw RuntimeException("Cannot resolve symbols: out of memory");
+		}
+		unsigned int i = 0;
+		for (it = names.begin(); it != end; it++, i++) {
+			it->second = frameName(symbols[i]);
+		}
+		free(symbols);
+	#endif
+}
+
+static string
+foldStacks(const Sample *samples, unsigned int count, unsigned int dropped,
+	SamplingProfilerStacks stacks)
+{
+	map<void *, string> names;
+	map<string, unsigned int> counts;
+	map<string, unsigned int>::const_iterator it;
+	string result;
+
+	if (stacks == NATIVE_STACKS) {
+		symbolizeNativeFrames(samples, count, names);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		const Sample &sample = samples[i];
+		string stack = (sample.threadName[0] == '\0')
+			? string("(unknown thread)")
+			: string(sample.threadName);
+		replace(stack.begin(), stack.end(), ';', ':');
+
+		if (stacks == NATIVE_STACKS) {
+			for (unsigned int j = sample.nativeDepth; j > SIGNAL_HANDLER_FRAMES; j--) {
+				stack.append(1, ';');
+				stack.append(names[sample.native[j - 1]]);
+			}
+		} else {
+			for (unsigned int j = 0; j < sample.traceDepth; j++) {
+				stack.append(1, ';');
+				stack.append(sample.tracePoints[j]);
+			}
+		}
+		counts[stack]++;
+	}
+
+	for (it = counts.begin(); it != counts.end(); it++) {
+		result.append(it->first);
+		result.append(1, ' ');
+		result.append(toString(it->second));
+		result.append(1, '\n');
+	}
+	if (dropped > 0) {
+		result.append("(dropped samples) ");
+		result.append(toString(dropped));
+		result.append(1, '\n');
+	}
+	return result;
+}
+
+string
+runSamplingProfiler(unsigned int durationMsec, unsigned int frequency,
+	SamplingProfilerStacks stacks)
+{
+	boost::unique_lock<boost::mutex> l(profilerMutex, boost::try_to_lock);
+	if (!l.owns_lock()) {
+		throw RuntimeException("Another profile is already running");
+	}
+
+	frequency = std::max(1u, std::min(frequency, 1000u));
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long long capacity = (unsigned long long) durationMsec * frequency
+		* std::max(1L, cpus) / 1000 + 1;
+	capacity = std::min<unsigned long long>(capacity, MAX_SAMPLES);
+
+	installSignalHandler();
+	vector<Sample> samples(capacity);
+	sampleCapacity = capacity;
+	sampleCount.store(0);
+	sampleBuffer.store(&samples[0]);
+	ScopeGuard guard(stopSampling);
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / frequency;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+		int e = errno;
+		throw SystemException("Cannot start the profiling timer", e);
+	}
+	syscalls::usleep((useconds_t) durationMsec * 1000);
+	guard.runNow();
+
+	unsigned int taken = sampleCount.load();
+	unsigned int count = std::min<unsigned int>(taken, capacity);
+	return foldStacks(&samples[0], count, taken - count, stacks);
+}
+
+
+} // namespace Passenger
@@ -0,0 +1,72 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_UTILS_SAMPLING_PROFILER_H_
+#define _PASSENGER_UTILS_SAMPLING_PROFILER_H_
+
+#include <string>
+
+namespace Passenger {
+
+using namespace std;
+
+
+enum SamplingProfilerStacks {
+	/** Native call stacks, as unwound by backtrace(). */
+	NATIVE_STACKS,
+	/** The functions of the oxt trace points, as in oxt::thread::all_backtraces(). */
+	TRACE_POINT_STACKS
+};
+
+/**
+ * Profiles the CPU usage of all threads in this process for `durationMsec`
+ * milliseconds, without stopping them, and returns the result in the
+ * "folded stacks" format that flame graph tools read: one line per distinct
+ * stack, consisting of the thread name and the stack frames from outermost
+ * to innermost, separated by semicolons, followed by a space and the number
+ * of samples:
+ *
+ *   Request handler 1;main;ev_run;...;RequestHandler::onClientData 42
+ *
+ * It uses setitimer(ITIMER_PROF), so the kernel sends SIGPROF to whichever
+ * thread is running, about `frequency` times per second of CPU time used by
+ * the process. The signal handler records the stack of the interrupted thread
+ * in a preallocated buffer; symbols are resolved afterwards. Idle threads are
+ * therefore not sampled at all. Native stacks only contain useful function
+ * names if the executable was linked with -rdynamic.
+ *
+ * The calling thread blocks until the profile is done. This function may be
+ * interrupted with oxt::thread::interrupt(), in which case profiling stops.
+ *
+ * @throws RuntimeException Another profile is already running.
+ * @throws SystemException
+ * @throws boost::thread_interrupted
+ */
+string runSamplingProfiler(unsigned int durationMsec, unsigned int frequency,
+	SamplingProfilerStacks stacks = NATIVE_STACKS);
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_UTILS_SAMPLING_PROFILER_H_ */
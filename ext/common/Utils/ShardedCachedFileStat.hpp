@@ -0,0 +1,249 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_SHARDED_CACHED_FILE_STAT_HPP_
+#define _PASSENGER_SHARDED_CACHED_FILE_STAT_HPP_
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+#include <StaticString.h>
+#include <Utils/CachedFileStat.hpp>
+#include <Utils/FlatStringMap.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * A CachedFileStat for caches that are used by many threads at the same
+ * time, such as the one that all Apache worker threads share. It has the
+ * same interface as CachedFileStat, but instead of one lock around one
+ * LRU list, it divides the filenames over a number of shards, each with
+ * its own lock. Within a shard the entries are stored in a flat array that
+ * a FlatStringMap indexes, and a full shard evicts entries with the CLOCK
+ * algorithm: every cache hit sets the entry's reference bit, and the clock
+ * hand evicts the first entry whose bit is not set, clearing the bits that
+ * it passes over. Cache hits therefore never allocate or move entries
+ * around.
+ *
+ * The maximum size is divided evenly over the shards and enforced per
+ * shard, so unlike CachedFileStat, eviction is only approximately least
+ * recently used, and the cache may hold up to `shardCount - 1` entries
+ * more than the maximum size.
+ *
+ * This class is fully thread-safe.
+ */
+class ShardedCachedFileStat {
+public:
+	typedef CachedFileStat::Entry Entry;
+
+	static const unsigned int DEFAULT_SHARD_COUNT = 16;
+
+private:
+	struct Slot {
+		Entry entry;
+		bool referenced;
+
+		Slot(const string &filename)
+			: entry(filename),
+			  referenced(false)
+			{ }
+	};
+
+	struct Shard {
+		boost::mutex lock;
+		vector<Slot> slots;
+		FlatStringMap<unsigned int> index;
+		unsigned int hand;
+		unsigned int maxSize;
+		/** Keeps shards that are next to each other out of each other's cache lines. */
+		char padding[64];
+
+		Shard() {
+			hand = 0;
+			maxSize = 0;
+		}
+
+		/** Evicts the entry that the clock hand points to and returns its index. */
+		unsigned int evictionCandidate() {
+			while (true) {
+				if (hand >= slots.size()) {
+					hand = 0;
+				}
+				Slot &slot = slots[hand];
+				if (slot.referenced) {
+					slot.referenced = false;
+					hand++;
+				} else {
+					return hand++;
+				}
+			}
+		}
+
+		void removeAt(unsigned int i) {
+			index.remove(slots[i].entry.filename);
+			if (i != slots.size() - 1) {
+				slots[i] = slots.back();
+				index.set(slots[i].entry.filename, i);
+			}
+			slots.pop_back();
+		}
+
+		void shrinkTo(unsigned int size) {
+			while (slots.size() > size) {
+				removeAt(evictionCandidate());
+			}
+		}
+	};
+
+	Shard *shards;
+	unsigned int shardCount;
+	unsigned int maxSize;
+
+	Shard &shardFor(const StaticString &filename) const {
+		// FlatStringMap uses the lowest and the highest bits of the hash,
+		// so pick the shard using the bits in between.
+		size_t hash = StaticString::Hash()(filename);
+		return shards[(hash >> (sizeof(size_t) * 4)) % shardCount];
+	}
+
+	unsigned int maxShardSize(unsigned int maxSize) const {
+		return (maxSize + shardCount - 1) / shardCount;
+	}
+
+	/* Shards contain mutexes, so this object can't be copied. */
+	ShardedCachedFileStat(const ShardedCachedFileStat &);
+	ShardedCachedFileStat &operator=(const ShardedCachedFileStat &);
+
+public:
+	/**
+	 * Creates a new ShardedCachedFileStat object.
+	 *
+	 * @param maxSize The maximum cache size. A size of 0 means unlimited.
+	 * @param shardCount The number of shards, i.e. the number of threads
+	 *                   that can use the cache without waiting for each other.
+	 */
+	ShardedCachedFileStat(unsigned int maxSize = 0,
+		unsigned int shardCount = DEFAULT_SHARD_COUNT)
+	{
+		this->shardCount = (shardCount == 0) ? 1 : shardCount;
+		this->maxSize = maxSize;
+		shards = new Shard[this->shardCount];
+		for (unsigned int i = 0; i < this->shardCount; i++) {
+			shards[i].maxSize = maxShardSize(maxSize);
+		}
+	}
+
+	~ShardedCachedFileStat() {
+		delete[] shards;
+	}
+
+	/**
+	 * Stats the given file, just like CachedFileStat::stat() does.
+	 *
+	 * @throws SystemException Something went wrong while retrieving the
+	 *         system time. stat() errors will <em>not</em> result in
+	 *         SystemException being thrown.
+	 * @throws boost::thread_interrupted
+	 */
+	int stat(const StaticString &filename, struct stat *buf, unsigned int throttleRate = 0) {
+		Shard &shard = shardFor(filename);
+		boost::unique_lock<boost::mutex> l(shard.lock);
+		unsigned int i = shard.index.get(filename, (unsigned int) -1);
+		int ret;
+
+		if (i == (unsigned int) -1) {
+			// Filename not in cache. If the shard is full, replace the
+			// entry that the clock hand selects.
+			if (shard.maxSize != 0 && shard.slots.size() >= shard.maxSize) {
+				i = shard.evictionCandidate();
+				shard.index.remove(shard.slots[i].entry.filename);
+				shard.slots[i] = Slot(filename);
+			} else {
+				i = shard.slots.size();
+				shard.slots.push_back(Slot(filename));
+			}
+			shard.index.set(filename, i);
+		} else {
+			shard.slots[i].referenced = true;
+		}
+
+		Entry &entry = shard.slots[i].entry;
+		ret = entry.refresh(throttleRate);
+		*buf = entry.info;
+		return ret;
+	}
+
+	/**
+	 * Change the maximum size of the cache. If the new size is smaller
+	 * than the old size, then entries are evicted until every shard
+	 * fits in its share of the new size.
+	 *
+	 * A size of 0 means unlimited.
+	 */
+	void setMaxSize(unsigned int maxSize) {
+		for (unsigned int i = 0; i < shardCount; i++) {
+			Shard &shard = shards[i];
+			boost::unique_lock<boost::mutex> l(shard.lock);
+			shard.maxSize = maxShardSize(maxSize);
+			if (shard.maxSize != 0) {
+				shard.shrinkTo(shard.maxSize);
+			}
+		}
+		this->maxSize = maxSize;
+	}
+
+	/**
+	 * Returns whether `filename` is in the cache.
+	 */
+	bool knows(const StaticString &filename) const {
+		Shard &shard = shardFor(filename);
+		boost::unique_lock<boost::mutex> l(shard.lock);
+		return shard.index.has(filename);
+	}
+
+	/**
+	 * Returns the number of cached entries.
+	 */
+	unsigned int size() const {
+		unsigned int result = 0;
+		for (unsigned int i = 0; i < shardCount; i++) {
+			boost::unique_lock<boost::mutex> l(shards[i].lock);
+			result += shards[i].slots.size();
+		}
+		return result;
+	}
+
+	unsigned int getShardCount() const {
+		return shardCount;
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_SHARDED_CACHED_FILE_STAT_HPP_ */
@@ -110,6 +110,23 @@ splitIncludeSep(const StaticString &str, char sep, vector<StaticString> &output)
 	_splitIncludeSep(str, sep, output);
 }
 
+void
+splitLines(const StaticString &str, vector<StaticString> &output) {
+	const char *current = str.data();
+	const char *end = str.data() + str.size();
+
+	output.clear();
+	while (current < end) {
+		const char *newline = (const char *) memchr(current, '\n', end - current);
+		if (newline == NULL) {
+			output.push_back(StaticString(current, end - current));
+			return;
+		}
+		output.push_back(StaticString(current, newline - current));
+		current = newline + 1;
+	}
+}
+
 string
 replaceString(const string &str, const string &toFind, const string &replaceWith) {
 	string::size_type pos = str.find(toFind);
@@ -128,6 +128,17 @@ void splitIncludeSep(const StaticString & restrict_ref str,
 	char sep,
 	vector<StaticString> & restrict_ref output);
 
+/**
+ * Split the given data into lines. The output items point into <tt>str</tt>
+ * and exclude the newline characters. Unlike <tt>split(str, '\n', output)</tt>,
+ * a trailing newline does not result in an extra, empty line. Lines are
+ * found with memchr(), which libc implements with vector instructions.
+ *
+ * Reusing the same <tt>output</tt> vector avoids memory allocations.
+ */
+void splitLines(const StaticString & restrict_ref str,
+	vector<StaticString> & restrict_ref output);
+
 /**
  * Look for 'toFind' inside 'str', replace it with 'replaceWith' and return the result.
  * Only the first occurence of 'toFind' is replaced.
@@ -200,6 +200,18 @@ public:
 		return store.erase(key) > 0;
 	}
 	
+	void clear() {
+		store.clear();
+	}
+	
+	iterator find(const StaticString &key) {
+		return iterator(store.find(key));
+	}
+	
+	const_iterator find(const StaticString &key) const {
+		return const_iterator(store.find(key));
+	}
+	
 	unsigned int size() const {
 		return store.size();
 	}
@@ -23,15 +23,30 @@
  *  THE SOFTWARE.
  */
 
+#include <sys/time.h>
 #include <time.h>
 
 namespace Passenger {
 	namespace SystemTimeData {
+		static long long
+		getMonotonicUsecOffset() {
+			#ifdef CLOCK_MONOTONIC
+				struct timespec ts;
+				struct timeval tv;
+				if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0 && gettimeofday(&tv, NULL) == 0) {
+					return ((long long) tv.tv_sec * 1000000 + tv.tv_usec)
+						- ((long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+				}
+			#endif
+			return 0;
+		}
+
 		bool hasForcedValue = false;
 		time_t forcedValue = 0;
 		bool hasForcedMsecValue = false;
 		unsigned long long forcedMsecValue = 0;
 		bool hasForcedUsecValue = false;
 		unsigned long long forcedUsecValue = 0;
+		long long monotonicUsecOffset = getMonotonicUsecOffset();
 	}
 }
@@ -27,6 +27,8 @@
 
 #include <boost/thread.hpp>
 #include <oxt/system_calls.hpp>
+#include <sys/time.h>
+#include <time.h>
 #include "../Exceptions.h"
 
 namespace Passenger {
@@ -40,6 +42,8 @@ namespace SystemTimeData {
 	extern unsigned long long forcedMsecValue;
 	extern bool hasForcedUsecValue;
 	extern unsigned long long forcedUsecValue;
+	/** CLOCK_REALTIME minus CLOCK_MONOTONIC at startup, in microseconds. */
+	extern long long monotonicUsecOffset;
 }
 
 /**
@@ -131,6 +135,65 @@ public:
 		}
 	}
 
+	/**
+	 * Like getUsec(), but reads CLOCK_MONOTONIC, which is cheaper than
+	 * gettimeofday() on most systems and never jumps. The result is offset
+	 * by the difference between the two clocks at startup, so it can be
+	 * used where a time since the Epoch is expected, but it drifts away
+	 * from getUsec() when the system time is adjusted. Or, if a time was
+	 * forced with forceUsec(), then the forced time is returned instead.
+	 *
+	 * @throws TimeRetrievalException Something went wrong while retrieving the time.
+	 */
+	static unsigned long long getMonotonicUsec() {
+		if (SystemTimeData::hasForcedUsecValue) {
+			return SystemTimeData::forcedUsecValue;
+		}
+		#ifdef CLOCK_MONOTONIC
+			struct timespec ts;
+			if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+				int e = errno;
+				throw TimeRetrievalException(
+					"Unable to retrieve the monotonic time",
+					e);
+			}
+			return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+				+ SystemTimeData::monotonicUsecOffset;
+		#else
+			return getUsec();
+		#endif
+	}
+
+	/**
+	 * Like getMonotonicUsec(), but reads CLOCK_MONOTONIC_COARSE where
+	 * available. That clock only advances once per kernel tick (typically
+	 * 1-4 msec), but reading it is a plain memory read that never enters
+	 * the kernel. Use it for timeouts and bookkeeping that don't need more
+	 * than millisecond accuracy. It may be called from any thread. Or, if
+	 * a time was forced with forceUsec(), then the forced time is returned
+	 * instead.
+	 *
+	 * @throws TimeRetrievalException Something went wrong while retrieving the time.
+	 */
+	static unsigned long long getCoarseUsec() {
+		#ifdef CLOCK_MONOTONIC_COARSE
+			if (SystemTimeData::hasForcedUsecValue) {
+				return SystemTimeData::forcedUsecValue;
+			}
+			struct timespec ts;
+			if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == -1) {
+				int e = errno;
+				throw TimeRetrievalException(
+					"Unable to retrieve the monotonic time",
+					e);
+			}
+			return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+				+ SystemTimeData::monotonicUsecOffset;
+		#else
+			return getMonotonicUsec();
+		#endif
+	}
+
 	/**
 	 * Force get() to return the given value.
 	 */
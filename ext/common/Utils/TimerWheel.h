@@ -0,0 +1,255 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_TIMER_WHEEL_H_
+#define _PASSENGER_TIMER_WHEEL_H_
+
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+namespace Passenger {
+
+
+/**
+ * A hashed timing wheel for large numbers of coarse timeouts, such as
+ * per-connection timeouts. Scheduling and cancelling are O(1) and expiring
+ * is O(1) amortized per tick, independent of the number of scheduled
+ * timeouts. In return, timeouts fire up to one resolution interval late.
+ *
+ * The wheel doesn't keep time by itself. The owner calls expire() with the
+ * current time, typically from a single repeating timer that runs at the
+ * wheel's resolution while the wheel is non-empty.
+ *
+ * Entries are embedded in the objects that own the timeouts so that
+ * scheduling doesn't allocate memory. An Entry must be cancelled or must have
+ * expired before it's destroyed. All times are in milliseconds.
+ *
+ * Not thread-safe.
+ */
+class TimerWheel: public boost::noncopyable {
+public:
+	class Entry: public boost::noncopyable {
+	private:
+		friend class TimerWheel;
+
+		Entry *prev;
+		Entry *next;
+		TimerWheel *wheel;
+		unsigned long long expiresAt;
+
+		void unlink() {
+			prev->next = next;
+			next->prev = prev;
+			prev = next = NULL;
+			wheel->count--;
+			wheel = NULL;
+		}
+
+	public:
+		/** Passed back to the owner when this entry expires. */
+		void *userData;
+
+		Entry() {
+			prev = next = NULL;
+			wheel = NULL;
+			expiresAt = 0;
+			userData = NULL;
+		}
+
+		~Entry() {
+			cancel();
+		}
+
+		bool scheduled() const {
+			return wheel != NULL;
+		}
+
+		/** Does nothing if this entry isn't scheduled. */
+		void cancel() {
+			if (wheel != NULL) {
+				unlink();
+			}
+		}
+	};
+
+private:
+	/** Circular lists of entries, headed by sentinels. Slot i contains the
+	 * entries that expire in a tick t with t % slotCount == i. */
+	Entry *slots;
+	/** Entries that have expired but for which the callback hasn't been
+	 * called yet. */
+	Entry expired;
+	unsigned int slotCount;
+	unsigned int resolution;
+	/** The last tick for which expired entries have been collected. */
+	unsigned long long currentTick;
+	unsigned int count;
+
+	static void initSentinel(Entry *sentinel) {
+		sentinel->prev = sentinel->next = sentinel;
+	}
+
+	static void insertBefore(Entry *sentinel, Entry *entry) {
+		entry->prev = sentinel->prev;
+		entry->next = sentinel;
+		sentinel->prev->next = entry;
+		sentinel->prev = entry;
+	}
+
+	void collectExpired(unsigned int slot, unsigned long long now) {
+		Entry *sentinel = &slots[slot];
+		Entry *entry = sentinel->next;
+		while (entry != sentinel) {
+			Entry *next = entry->next;
+			if (entry->expiresAt <= now) {
+				entry->prev->next = next;
+				next->prev = entry->prev;
+				insertBefore(&expired, entry);
+			}
+			entry = next;
+		}
+	}
+
+public:
+	/**
+	 * @param resolution The tick length in milliseconds.
+	 * @param slotCount The number of slots. Timeouts longer than
+	 *                  resolution * slotCount are fine but are looked at
+	 *                  once per wheel rotation until they expire.
+	 */
+	TimerWheel(unsigned int resolution = 1000, unsigned int slotCount = 512) {
+		assert(resolution > 0);
+		assert(slotCount > 0);
+		this->resolution = resolution;
+		this->slotCount = slotCount;
+		slots = new Entry[slotCount];
+		for (unsigned int i = 0; i < slotCount; i++) {
+			initSentinel(&slots[i]);
+		}
+		initSentinel(&expired);
+		currentTick = 0;
+		count = 0;
+	}
+
+	~TimerWheel() {
+		clear();
+		delete[] slots;
+	}
+
+	unsigned int getResolution() const {
+		return resolution;
+	}
+
+	/**
+	 * Changes the tick length.
+	 *
+	 * @pre empty()
+	 */
+	void setResolution(unsigned int value) {
+		assert(empty());
+		assert(value > 0);
+		resolution = value;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	unsigned int size() const {
+		return count;
+	}
+
+	/**
+	 * Schedules the given entry to expire `timeout` milliseconds after `now`.
+	 * If the entry was already scheduled then it's rescheduled.
+	 */
+	void schedule(Entry *entry, unsigned long long now, unsigned long long timeout) {
+		entry->cancel();
+		if (count == 0) {
+			// Nothing is pending, so it's safe to catch up with the clock.
+			currentTick = now / resolution;
+		}
+
+		unsigned long long expiresAt = now + timeout;
+		// Round up so that the entry never expires early.
+		unsigned long long tick = (expiresAt + resolution - 1) / resolution;
+		if (tick <= currentTick) {
+			tick = currentTick + 1;
+		}
+
+		entry->expiresAt = expiresAt;
+		entry->wheel = this;
+		insertBefore(&slots[tick % slotCount], entry);
+		count++;
+	}
+
+	/**
+	 * Expires all entries that are due at `now`, calling `callback(entry)` for
+	 * each of them after it has been unscheduled. The callback may schedule
+	 * and cancel any entries, including the one passed to it.
+	 *
+	 * @return The number of expired entries.
+	 */
+	template<typename Callback>
+	unsigned int expire(unsigned long long now, Callback callback) {
+		unsigned long long targetTick = now / resolution;
+		unsigned int result = 0;
+
+		if (targetTick > currentTick) {
+			unsigned long long ticks = std::min<unsigned long long>(
+				targetTick - currentTick, slotCount);
+			for (unsigned long long i = 1; i <= ticks; i++) {
+				collectExpired((currentTick + i) % slotCount, now);
+			}
+			currentTick = targetTick;
+		}
+
+		while (expired.next != &expired) {
+			Entry *entry = expired.next;
+			entry->unlink();
+			result++;
+			callback(entry);
+		}
+		return result;
+	}
+
+	/** Unschedules all entries without calling any callbacks. */
+	void clear() {
+		for (unsigned int i = 0; i < slotCount; i++) {
+			while (slots[i].next != &slots[i]) {
+				slots[i].next->unlink();
+			}
+		}
+		while (expired.next != &expired) {
+			expired.next->unlink();
+		}
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_TIMER_WHEEL_H_ */
@@ -26,7 +26,9 @@
 #define _PASSENGER_HELPER_AGENT_OPTIONS_H_
 
 #include <sys/types.h>
+#include <unistd.h>
 #include <string>
+#include <algorithm>
 #include <boost/shared_ptr.hpp>
 #include <Utils/VariantMap.h>
 
@@ -48,22 +50,140 @@ struct AgentOptions: public VariantMap {
 	unsigned int generationNumber;
 	unsigned int maxPoolSize;
 	unsigned int poolIdleTime;
+	/** Apps that have had no processes and no requests for this many seconds
+	 * are forgotten, except for their names, until their next request. This
+	 * keeps the memory usage proportional to the number of active apps on
+	 * servers with many rarely used apps. 0 = never. */
+	unsigned int poolDormancyIdleTime;
+	/** Idle processes of an app are shut down one at a time, at most once
+	 * per this many seconds, until what remains matches the app's recent
+	 * peak concurrency. */
+	unsigned int poolScaleDownInterval;
+	/** How many seconds the helper agent waits for all application processes
+	 * to shut down when it exits, before killing the remaining ones with
+	 * SIGKILL. 0 = only the per-process shutdown timeout applies. */
+	unsigned int poolShutdownTimeout;
+	unsigned int requestHandlerThreads;
+	/** Whether web server connections are handed over to the request handler
+	 * thread that owns the requested app group, so that each app group is
+	 * served by one thread. Only has effect with multiple request handler
+	 * threads. */
+	bool requestLoopAffinity;
+	/** Memory budget in bytes for the response cache, divided evenly between the
+	 * request handlers. 0 disables response caching. */
+	unsigned long long responseCacheSize;
+	/** Maximum number of public directory files, per request handler, whose
+	 * file descriptors are kept open for static file serving. 0 disables
+	 * static file serving. */
+	unsigned int staticFileCacheSize;
+	/** Number of threads that compress responses. 0 disables response
+	 * compression. */
+	unsigned int responseCompressionThreads;
+	/** Number of threads that process admin socket commands, such as the
+	 * ones sent by passenger-status. */
+	unsigned int adminServerThreads;
+	/** Only 1 in this many Union Station requests is logged, plus the ones
+	 * that fail or that take at least unionStationSlowRequestThreshold msec
+	 * (0 = never). A rate of 1 logs every request. */
+	unsigned int unionStationSampleRate;
+	unsigned int unionStationSlowRequestThreshold;
+	/** Memory budget in bytes for the request and response buffers of all
+	 * clients together. Beyond it, buffered data goes to disk. 0 = unlimited. */
+	unsigned long long bufferMemoryLimit;
+	/** Whether to hand fully generated responses for slow clients over to a
+	 * separate drainer thread. */
+	bool drainSlowClients;
+	/** Whether request and response buffer files are compressed, for
+	 * bodies with a text-like content type. */
+	bool compressBufferFiles;
+	/** The maximum number of processes that may be spawned at the same time,
+	 * on top of one per group. 0 = unlimited. */
+	unsigned int maxConcurrentSpawns;
+	/** The maximum number of processes that are actually being started at
+	 * the same time, in all groups together. The other spawns wait for
+	 * their turn. Defaults to the number of CPUs. 0 = unlimited. */
+	unsigned int spawnConcurrency;
+	/** Directories from which applications may have files sent on their
+	 * behalf, through an X-Sendfile response header. Empty = disabled. */
+	vector<string> sendfileRoots;
+	/** Secret with which a frontend may sign requests to get an
+	 * X-Passenger-Timing response header. Empty = disabled. */
+	string timingHeaderSecret;
 	string requestSocketFilename;
 	string requestSocketPassword;
+	/** Whether request socket clients are authenticated by the user ID of
+	 * the connecting process, instead of by requestSocketPassword. Only
+	 * root, this agent's own user and webServerWorkerUid may connect. */
+	bool requestSocketPeerAuth;
+	uid_t webServerWorkerUid;
 	string adminSocketAddress;
 	string exitPassword;
 	string loggingAgentAddress;
 	string loggingAgentPassword;
+	/** If set, Union Station transactions are sent to the logging agent
+	 * as datagrams. See UnionStation::LoggerFactory::setDatagramAddress(). */
+	string loggingAgentDatagramAddress;
 	string adminToolStatusPassword;
 	vector<string> prestartUrls;
+	/** Whether to take over the request socket and the application processes
+	 * of the currently running helper agent, instead of starting afresh.
+	 * Set by the Watchdog when it replaces the helper agent. */
+	bool handoff;
+	/** Address and password of the Watchdog's process keeper, which holds on
+	 * to the application processes' admin sockets so that they survive a
+	 * helper agent crash. Empty = don't journal processes for recovery. */
+	string processKeeperAddress;
+	string processKeeperPassword;
+	/** Address on which to accept HTTP/1.1 clients directly, without a web
+	 * server in front. Empty = disabled. */
+	string httpAddress;
+	/** NAME=VALUE request variables that HTTP clients' requests get, in
+	 * place of the ones a web server would have set, such as
+	 * PASSENGER_APP_ROOT. */
+	vector<string> httpEnvironment;
+	/** The password with which to authenticate with the RemoteAgents that
+	 * applications may run processes on, see Options::remoteAgents. */
+	string remoteAgentPassword;
+	/** The cgroup (version 2) directory below which each application's
+	 * processes get their own cgroup, see CgroupManager. Empty = disabled. */
+	string cgroupRoot;
 
 	bool testBinary;
 	string requestSocketLink;
 
-	AgentOptions() { }
+	AgentOptions()
+		: poolDormancyIdleTime(0),
+		  poolScaleDownInterval(10),
+		  poolShutdownTimeout(0),
+		  requestLoopAffinity(false),
+		  unionStationSampleRate(1),
+		  unionStationSlowRequestThreshold(0),
+		  bufferMemoryLimit(0),
+		  drainSlowClients(false),
+		  compressBufferFiles(false),
+		  maxConcurrentSpawns(0),
+		  spawnConcurrency(0),
+		  requestSocketPeerAuth(false),
+		  webServerWorkerUid(getuid()),
+		  handoff(false)
+		{ }
 
 	AgentOptions(const VariantMap &options)
-		: VariantMap(options)
+		: VariantMap(options),
+		  poolDormancyIdleTime(0),
+		  poolScaleDownInterval(10),
+		  poolShutdownTimeout(0),
+		  requestLoopAffinity(false),
+		  unionStationSampleRate(1),
+		  unionStationSlowRequestThreshold(0),
+		  bufferMemoryLimit(0),
+		  drainSlowClients(false),
+		  compressBufferFiles(false),
+		  maxConcurrentSpawns(0),
+		  spawnConcurrency(0),
+		  requestSocketPeerAuth(false),
+		  webServerWorkerUid(getuid()),
+		  handoff(false)
 	{
 		testBinary = options.get("test_binary", false) == "1";
 		if (testBinary) {
@@ -93,11 +213,40 @@ struct AgentOptions: public VariantMap {
 		exitPassword          = options.get("helper_agent_exit_password");
 		loggingAgentAddress   = options.get("logging_agent_address");
 		loggingAgentPassword  = options.get("logging_agent_password");
+		loggingAgentDatagramAddress = options.get("logging_agent_datagram_address", false);
 		adminToolStatusPassword = options.get("admin_tool_status_password");
 		
 		// Optional options.
 		prestartUrls          = options.getStrSet("prestart_urls", false);
 		requestSocketLink     = options.get("request_socket_link", false);
+		requestHandlerThreads = std::max(1, options.getInt("request_handler_threads", false, 1));
+		requestLoopAffinity   = options.getBool("request_loop_affinity", false, false);
+		poolDormancyIdleTime  = options.getInt("pool_dormancy_idle_time", false, 0);
+		poolScaleDownInterval = std::max(0, options.getInt("pool_scale_down_interval", false, 10));
+		poolShutdownTimeout   = options.getInt("pool_shutdown_timeout", false, 0);
+		responseCacheSize     = options.getULL("response_cache_size", false, 0);
+		staticFileCacheSize   = std::max(0, options.getInt("static_file_cache_size", false, 256));
+		responseCompressionThreads = std::max(0, options.getInt("response_compression_threads", false, 0));
+		adminServerThreads    = std::max(1, options.getInt("admin_server_threads", false, 2));
+		unionStationSampleRate = std::max(1, options.getInt("union_station_sample_rate", false, 1));
+		unionStationSlowRequestThreshold = std::max(0, options.getInt("union_station_slow_request_threshold", false, 0));
+		drainSlowClients      = options.getBool("drain_slow_clients", false, false);
+		bufferMemoryLimit     = options.getULL("buffer_memory_limit", false, 0);
+		compressBufferFiles   = options.getBool("compress_buffer_files", false, false);
+		maxConcurrentSpawns   = std::max(0, options.getInt("max_concurrent_spawns", false, 0));
+		spawnConcurrency      = std::max(0, options.getInt("spawn_concurrency", false,
+			(int) std::max(1L, sysconf(_SC_NPROCESSORS_ONLN))));
+		sendfileRoots         = options.getStrSet("sendfile_roots", false);
+		timingHeaderSecret    = options.get("timing_header_secret", false);
+		handoff               = options.getBool("handoff", false, false);
+		processKeeperAddress  = options.get("process_keeper_address", false);
+		processKeeperPassword = options.get("process_keeper_password", false);
+		httpAddress           = options.get("http_address", false);
+		httpEnvironment       = options.getStrSet("http_environment", false);
+		requestSocketPeerAuth = options.getBool("request_socket_peer_auth", false, false);
+		webServerWorkerUid    = options.getUid("web_server_worker_uid", false, getuid());
+		remoteAgentPassword   = options.get("remote_agent_password", false);
+		cgroupRoot            = options.get("cgroup_root", false);
 	}
 };
 
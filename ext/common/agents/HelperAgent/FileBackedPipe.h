@@ -31,22 +31,32 @@
 #include <boost/shared_array.hpp>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <deque>
 #include <memory>
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
 
+#include <boost/atomic.hpp>
 #include <oxt/macros.hpp>
 #include <SafeLibev.h>
 #include <MultiLibeio.h>
 #include <StaticString.h>
 #include <Exceptions.h>
 #include <FileDescriptor.h>
+#include <DTraceSupport.h>
 #include <Utils/StrIntUtils.h>
+#include <Utils/MetricsRegistry.h>
 
 namespace Passenger {
 
@@ -77,6 +87,8 @@ using namespace boost;
  * All FileBackedPipe methods may only be called from the event loop on which it
  * is installed.
  *
+ * Data in the buffer file can optionally be compressed, see setCompression().
+ *
  * FileBackedPipe *must* be dynamically allocated and assigned to a boost::shared_ptr.
  */
 class FileBackedPipe: public boost::enable_shared_from_this<FileBackedPipe> {
@@ -112,6 +124,269 @@ public:
 		}
 	};
 
+	/**
+	 * A free list of fixed-size memory buffers that FileBackedPipes can borrow
+	 * their in-memory buffer from, instead of allocating and freeing a fresh
+	 * buffer for every pipe. A pool is meant to be shared by all pipes on the
+	 * same event loop and is, just like FileBackedPipe, *not* thread-safe.
+	 *
+	 * A pipe only uses the pool if its threshold equals the pool's block size.
+	 * At most 'maxFree' buffers are kept around; buffers returned beyond that
+	 * limit are freed.
+	 */
+	class BufferPool {
+	private:
+		const size_t blockSize;
+		const unsigned int maxFree;
+		vector<char *> freeList;
+		unsigned long long hits;
+		unsigned long long misses;
+
+	public:
+		BufferPool(size_t _blockSize = 1024 * 8, unsigned int _maxFree = 1024)
+			: blockSize(_blockSize),
+			  maxFree(_maxFree),
+			  hits(0),
+			  misses(0)
+			{ }
+
+		~BufferPool() {
+			clear();
+		}
+
+		size_t getBlockSize() const {
+			return blockSize;
+		}
+
+		char *acquire() {
+			if (freeList.empty()) {
+				misses++;
+				return new char[blockSize];
+			} else {
+				char *result = freeList.back();
+				freeList.pop_back();
+				hits++;
+				return result;
+			}
+		}
+
+		void release(char *buffer) {
+			if (freeList.size() < maxFree) {
+				freeList.push_back(buffer);
+			} else {
+				delete[] buffer;
+			}
+		}
+
+		/** Frees all free blocks, e.g. when the server has become idle. */
+		void clear() {
+			vector<char *>::iterator it, end = freeList.end();
+			for (it = freeList.begin(); it != end; it++) {
+				delete[] *it;
+			}
+			vector<char *>().swap(freeList);
+		}
+
+		unsigned int freeCount() const {
+			return freeList.size();
+		}
+
+		unsigned long long hitCount() const {
+			return hits;
+		}
+
+		unsigned long long missCount() const {
+			return misses;
+		}
+
+		template<typename Stream>
+		void inspect(Stream &stream) const {
+			stream << "Buffer pool: block size = " << blockSize <<
+				", free = " << freeList.size() <<
+				", hits = " << hits <<
+				", misses = " << misses << "\n";
+		}
+	};
+
+	typedef boost::shared_ptr<BufferPool> BufferPoolPtr;
+
+	/**
+	 * A byte budget for the in-memory buffers of many FileBackedPipes,
+	 * possibly on different event loops, so that the total amount of memory
+	 * that they hold stays bounded. Thread-safe.
+	 *
+	 * Buffers are granted in full as long as less than half of the budget is
+	 * in use. Beyond that, the granted size shrinks linearly with the
+	 * remaining budget, so that pipes spill to disk earlier the closer the
+	 * budget is to being exhausted. Once it's exhausted, nothing is granted
+	 * and pipes go to disk straight away. A limit of 0 means unlimited; the
+	 * usage is then only tracked.
+	 */
+	class MemoryBudget {
+	private:
+		const size_t limit;
+		boost::atomic<size_t> used;
+		boost::atomic<size_t> highWatermark;
+		boost::atomic<unsigned long long> shrunk;
+		boost::atomic<unsigned long long> refused;
+
+		size_t grantFor(size_t wanted, size_t current) const {
+			if (limit == 0) {
+				return wanted;
+			} else if (current >= limit) {
+				return 0;
+			}
+
+			size_t remaining = limit - current;
+			size_t softLimit = limit / 2;
+			if (current <= softLimit) {
+				return std::min(wanted, remaining);
+			} else {
+				// remaining < limit - softLimit here.
+				return std::min(remaining, (size_t) ((unsigned long long) wanted
+					* remaining / (limit - softLimit)));
+			}
+		}
+
+	public:
+		MemoryBudget(size_t _limit = 0)
+			: limit(_limit),
+			  used(0),
+			  highWatermark(0),
+			  shrunk(0),
+			  refused(0)
+			{ }
+
+		/**
+		 * Reserves up to 'wanted' bytes and returns the number of bytes
+		 * that were actually reserved, which may be 0.
+		 */
+		size_t reserve(size_t wanted) {
+			size_t current = used.load(boost::memory_order_relaxed);
+			size_t granted;
+			do {
+				granted = grantFor(wanted, current);
+				if (granted == 0) {
+					refused.fetch_add(1, boost::memory_order_relaxed);
+					return 0;
+				}
+			} while (!used.compare_exchange_weak(current, current + granted,
+				boost::memory_order_relaxed));
+
+			size_t newUsed = current + granted;
+			size_t high = highWatermark.load(boost::memory_order_relaxed);
+			while (newUsed > high && !highWatermark.compare_exchange_weak(high,
+				newUsed, boost::memory_order_relaxed))
+			{ }
+			if (granted < wanted) {
+				shrunk.fetch_add(1, boost::memory_order_relaxed);
+			}
+			return granted;
+		}
+
+		void release(size_t size) {
+			used.fetch_sub(size, boost::memory_order_relaxed);
+		}
+
+		size_t getLimit() const {
+			return limit;
+		}
+
+		size_t getUsage() const {
+			return used.load(boost::memory_order_relaxed);
+		}
+
+		size_t getHighWatermark() const {
+			return highWatermark.load(boost::memory_order_relaxed);
+		}
+
+		template<typename Stream>
+		void inspect(Stream &stream) const {
+			stream << "Buffer memory: " << getUsage() << " bytes in use, " <<
+				"high watermark = " << getHighWatermark() << ", " <<
+				"limit = ";
+			if (limit == 0) {
+				stream << "unlimited";
+			} else {
+				stream << limit;
+			}
+			stream << ", shrunk = " << shrunk.load(boost::memory_order_relaxed) <<
+				", refused = " << refused.load(boost::memory_order_relaxed) << "\n";
+		}
+	};
+
+	typedef boost::shared_ptr<MemoryBudget> MemoryBudgetPtr;
+
+	/**
+	 * A free list of open, empty buffer files that FileBackedPipes can take
+	 * over when they spill to disk, so that spilling doesn't have to create
+	 * a file. A pipe gives its buffer file back when it's reset. Just like
+	 * BufferPool, a pool is meant to be shared by all pipes on the same event
+	 * loop, which must all use the same buffer directory, and is *not*
+	 * thread-safe.
+	 */
+	class SpillFilePool {
+	private:
+		const unsigned int maxFree;
+		vector<FileDescriptor> freeList;
+		unsigned long long hits;
+		unsigned long long misses;
+
+	public:
+		SpillFilePool(unsigned int _maxFree = 16)
+			: maxFree(_maxFree),
+			  hits(0),
+			  misses(0)
+			{ }
+
+		/** Returns an empty buffer file, or an invalid FileDescriptor if
+		 * there are none. */
+		FileDescriptor acquire() {
+			if (freeList.empty()) {
+				misses++;
+				return FileDescriptor();
+			} else {
+				FileDescriptor result = freeList.back();
+				freeList.pop_back();
+				hits++;
+				return result;
+			}
+		}
+
+		/** Takes a buffer file that has been truncated to 0 bytes. */
+		void release(const FileDescriptor &fd) {
+			if (freeList.size() < maxFree) {
+				freeList.push_back(fd);
+			}
+		}
+
+		/** Closes all free buffer files. */
+		void clear() {
+			vector<FileDescriptor>().swap(freeList);
+		}
+
+		unsigned int freeCount() const {
+			return freeList.size();
+		}
+
+		unsigned long long hitCount() const {
+			return hits;
+		}
+
+		unsigned long long missCount() const {
+			return misses;
+		}
+
+		template<typename Stream>
+		void inspect(Stream &stream) const {
+			stream << "Buffer file pool: free = " << freeList.size() <<
+				", hits = " << hits <<
+				", misses = " << misses << "\n";
+		}
+	};
+
+	typedef boost::shared_ptr<SpillFilePool> SpillFilePoolPtr;
+
 	typedef void (*DataCallback)(const boost::shared_ptr<FileBackedPipe> &source, const char *data,
 		size_t size, const ConsumeCallback &consumed);
 	typedef void (*ErrorCallback)(const boost::shared_ptr<FileBackedPipe> &source, int errorCode);
@@ -126,9 +401,74 @@ public:
 private:
 	typedef boost::function<void (int err, const char *data, size_t size)> EioReadCallback;
 
+	/** Reads from the buffer file start at this size... */
+	static const size_t MIN_READ_SIZE = 1024 * 16;
+	/** ...and grow up to this size when the consumer keeps waiting for the disk. */
+	static const size_t MAX_READ_SIZE = 1024 * 256;
+	/** Maximum number of buffer file reads that may be in flight or completed
+	 * but not yet consumed. */
+	static const unsigned int MAX_READ_AHEAD_BLOCKS = 4;
+	/** The size hint is trusted up to this size when preallocating the
+	 * buffer file, because it usually comes from the client. */
+	static const off_t MAX_PREALLOCATE_SIZE = 1024 * 1024 * 64;
+	/** Compressed buffer files consist of blocks that each hold up to this
+	 * much data, so that they can be read back one by one. */
+	static const size_t COMPRESSION_BLOCK_SIZE = 1024 * 64;
+	/** Every block in a compressed buffer file starts with its uncompressed
+	 * and its stored size, as 32-bit integers in native byte order. A block
+	 * whose stored size equals its uncompressed size didn't compress and is
+	 * stored as is. */
+	static const size_t COMPRESSION_BLOCK_HEADER_SIZE = 8;
+
+	struct ReadAheadBlock {
+		off_t offset;
+		size_t size;
+		shared_array<char> buffer;
+		bool completed;
+		int errorCode;
+
+		ReadAheadBlock(off_t _offset, size_t _size)
+			: offset(_offset),
+			  size(_size),
+			  buffer(new char[_size]),
+			  completed(false),
+			  errorCode(0)
+			{ }
+
+		bool contains(off_t pos) const {
+			return pos >= offset && pos < offset + (off_t) size;
+		}
+	};
+
+	/** The location of a block in a compressed buffer file. */
+	struct CompressedBlock {
+		/** Offset of the block's data in the uncompressed stream. */
+		off_t offset;
+		/** Offset of the block's header in the buffer file. */
+		off_t fileOffset;
+		size_t rawSize;
+		size_t storedSize;
+
+		CompressedBlock(off_t _offset, off_t _fileOffset, size_t _rawSize, size_t _storedSize)
+			: offset(_offset),
+			  fileOffset(_fileOffset),
+			  rawSize(_rawSize),
+			  storedSize(_storedSize)
+			{ }
+	};
+
+	typedef boost::shared_ptr< vector<CompressedBlock> > CompressedBlockListPtr;
+
 	// We already have a boost::shared_ptr reference to libev through MultiLibeio.
 	const string dir;
 	size_t threshold;
+	BufferPoolPtr bufferPool;
+	MemoryBudgetPtr memoryBudget;
+	SpillFilePoolPtr spillFilePool;
+	Metric *spillMetric;
+	/** The total amount of data that is expected to be written, or 0 if unknown. */
+	unsigned long long sizeHint;
+	bool compression;
 
 	const char *currentData;
 	size_t currentDataSize;
@@ -160,6 +500,9 @@ private:
 	struct {
 		char *data;
 		size_t size;
+		/* The size with which 'data' was allocated. 'threshold' may have
+		 * been changed since then. */
+		size_t capacity;
 	} memory;
 	struct {
 		FileDescriptor fd;
@@ -167,8 +510,17 @@ private:
 		 * of the buffer to the file. */
 		bool writingToFile;
 		/* Number of bytes written to the file so far. This number is incremented
-		 * *after* the file write operation has finished, not before. */
+		 * *after* the file write operation has finished, not before. If the file
+		 * is compressed, this and the other offsets below refer to the
+		 * uncompressed data.
+		 */
 		off_t writtenSize;
+		/* Whether the data in the file is compressed. */
+		bool compressed;
+		/* If the file is compressed: the blocks that haven't been fully
+		 * consumed yet, in file order, and the size of the file. */
+		deque<CompressedBlock> blocks;
+		off_t compressedSize;
 		/* Offset in the file at which data should be read. This can be
 		 * temporarily larger than 'writtenSize'. If this is the case then
 		 * the data with offset past 'writtenSize' should be obtained from
@@ -180,6 +532,16 @@ private:
 		 * finished, not before.
 		 */
 		string writeBuffer;
+		/* Blocks of the file that are being read or that have been read but
+		 * not yet fully consumed, in file order. The first block, if any,
+		 * always contains 'readOffset'. */
+		deque<ReadAheadBlock> readAhead;
+		/* Offset in the file at which the next read-ahead block starts. */
+		off_t readAheadOffset;
+		/* Size of the next read-ahead block. */
+		size_t readSize;
+		/* Callback waiting for the first read-ahead block to complete. */
+		EioReadCallback pendingReadCallback;
 	} file;
 
 	bool callOnData(const char *data, size_t size, bool passDataToConsumedCallback) {
@@ -237,40 +599,88 @@ private:
 		return libeio.getLibev().get();
 	}
 
-	void addToBuffer(const char *data, size_t size) {
-		size_t bytesToCopy;
+	/**
+	 * Allocates an in-memory buffer that can hold at least 'minSize' bytes.
+	 * Under memory budget pressure the buffer may be smaller than the
+	 * threshold, or not be allocated at all, in which case false is returned.
+	 */
+	bool allocateMemoryBuffer(size_t minSize) {
+		size_t capacity = threshold;
+		if (memoryBudget != NULL) {
+			capacity = memoryBudget->reserve(threshold);
+			if (capacity < minSize || capacity == 0) {
+				memoryBudget->release(capacity);
+				return false;
+			}
+		}
+		if (bufferPool != NULL && bufferPool->getBlockSize() == capacity) {
+			memory.data = bufferPool->acquire();
+		} else {
+			memory.data = new char[capacity];
+		}
+		memory.capacity = capacity;
+		return true;
+	}
+
+	void freeMemoryBuffer() {
+		if (memory.data != NULL) {
+			if (bufferPool != NULL && bufferPool->getBlockSize() == memory.capacity) {
+				bufferPool->release(memory.data);
+			} else {
+				delete[] memory.data;
+			}
+			if (memoryBudget != NULL) {
+				memoryBudget->release(memory.capacity);
+			}
+			memory.data = NULL;
+		}
+		memory.size = 0;
+	}
 
+	void addToBuffer(const char *data, size_t size) {
 		switch (dataState) {
 		case IN_MEMORY:
-			bytesToCopy = std::min(size, threshold - memory.size);
-			if (bytesToCopy == size) {
-				if (memory.data == NULL) {
-					assert(memory.size == 0);
-					memory.data = new char[threshold];
-				}
-				memcpy(memory.data + memory.size, data, bytesToCopy);
+			if (memory.data == NULL && size <= threshold) {
+				assert(memory.size == 0);
+				allocateMemoryBuffer(size);
+			}
+			if (memory.data != NULL && size <= memory.capacity - memory.size) {
+				memcpy(memory.data + memory.size, data, size);
 				memory.size += size;
 			} else {
 				dataState = OPENING_FILE;
+				file.compressed = compression;
+				if (spillMetric != NULL) {
+					spillMetric->increment();
+				}
+				PASSENGER_PROBE3(buffer_spilled, (void *) this,
+					(unsigned long long) (memory.size + size), (int) compression);
 				assert(file.fd == -1);
 				assert(file.writtenSize == 0);
 				assert(file.readOffset == 0);
 				file.writeBuffer.reserve(memory.size + size);
 				file.writeBuffer.append(memory.data, memory.size);
 				file.writeBuffer.append(data, size);
-				delete[] memory.data;
-				memory.data = NULL;
-				memory.size = 0;
+				freeMemoryBuffer();
 
+				FileDescriptor reused;
+				if (spillFilePool != NULL) {
+					reused = spillFilePool->acquire();
+				}
 				stringstream filename;
 				filename << dir;
 				filename << "/buffer.";
 				filename << getpid();
 				filename << ".";
 				filename << pointerToIntString(this);
-				libeio.open(filename.str().c_str(), O_CREAT | O_RDWR | O_TRUNC, 0, 0,
+				off_t preallocate = (off_t) std::min<unsigned long long>(sizeHint,
+					MAX_PREALLOCATE_SIZE);
+				libeio.custom(
+					boost::bind(openFile, dir, filename.str(), (int) reused,
+						preallocate, _1),
+					0,
 					boost::bind(&FileBackedPipe::openCallback, this,
-						_1, filename.str(), generation,
+						_1, reused, generation,
 						boost::weak_ptr<FileBackedPipe>(shared_from_this())
 					)
 				);
@@ -297,19 +707,102 @@ private:
 			shared_array<char> buffer(new char[file.writeBuffer.size()]);
 			memcpy(buffer.get(), file.writeBuffer.data(), file.writeBuffer.size());
 			file.writingToFile = true;
-			libeio.write(file.fd, buffer.get(), file.writeBuffer.size(),
-				file.writtenSize, 0, boost::bind(
-					&FileBackedPipe::writeBufferToFileCallback, this,
-					_1, file.fd, buffer, file.writeBuffer.size(),
-					generation,
-					boost::weak_ptr<FileBackedPipe>(shared_from_this())
-				)
-			);
+			if (file.compressed) {
+				// Compression happens in the libeio thread pool too.
+				CompressedBlockListPtr blocks = boost::make_shared< vector<CompressedBlock> >();
+				libeio.custom(
+					boost::bind(compressAndWrite, (int) file.fd, buffer.get(),
+						file.writeBuffer.size(), file.writtenSize,
+						file.compressedSize, blocks.get(), _1),
+					0,
+					boost::bind(
+						&FileBackedPipe::writeBufferToFileCallback, this,
+						_1, file.fd, buffer, file.writeBuffer.size(),
+						blocks, generation,
+						boost::weak_ptr<FileBackedPipe>(shared_from_this())
+					)
+				);
+			} else {
+				libeio.write(file.fd, buffer.get(), file.writeBuffer.size(),
+					file.writtenSize, 0, boost::bind(
+						&FileBackedPipe::writeBufferToFileCallback, this,
+						_1, file.fd, buffer, file.writeBuffer.size(),
+						CompressedBlockListPtr(), generation,
+						boost::weak_ptr<FileBackedPipe>(shared_from_this())
+					)
+				);
+			}
+		}
+	}
+
+	/**
+	 * Runs in the libeio thread pool. Compresses 'data', which starts at
+	 * 'offset' in the uncompressed stream, into blocks, writes them to the
+	 * file at 'fileOffset' and describes them in 'blocks'. The result is the
+	 * number of bytes written to the file.
+	 */
+	static void compressAndWrite(int fd, const char *data, size_t size,
+		off_t offset, off_t fileOffset, vector<CompressedBlock> *blocks,
+		eio_req *req)
+	{
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		bool deflating = deflateInit(&stream, Z_BEST_SPEED) == Z_OK;
+		string output;
+		size_t pos = 0;
+
+		while (pos < size) {
+			size_t rawSize = std::min((size_t) COMPRESSION_BLOCK_SIZE, size - pos);
+			size_t headerPos = output.size();
+			size_t bound = deflating ? deflateBound(&stream, rawSize) : rawSize;
+			output.resize(headerPos + COMPRESSION_BLOCK_HEADER_SIZE + bound);
+			char *dest = &output[headerPos + COMPRESSION_BLOCK_HEADER_SIZE];
+			size_t storedSize = rawSize;
+
+			if (deflating) {
+				stream.next_in = (Bytef *) data + pos;
+				stream.avail_in = rawSize;
+				stream.next_out = (Bytef *) dest;
+				stream.avail_out = bound;
+				if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+					storedSize = bound - stream.avail_out;
+				}
+				deflateReset(&stream);
+			}
+			if (storedSize >= rawSize) {
+				memcpy(dest, data + pos, rawSize);
+				storedSize = rawSize;
+			}
+
+			uint32_t header[2] = { (uint32_t) rawSize, (uint32_t) storedSize };
+			memcpy(&output[headerPos], header, COMPRESSION_BLOCK_HEADER_SIZE);
+			output.resize(headerPos + COMPRESSION_BLOCK_HEADER_SIZE + storedSize);
+			blocks->push_back(CompressedBlock(offset + pos, fileOffset + headerPos,
+				rawSize, storedSize));
+			pos += rawSize;
 		}
+		if (deflating) {
+			deflateEnd(&stream);
+		}
+
+		size_t written = 0;
+		while (written < output.size()) {
+			ssize_t ret = pwrite(fd, output.data() + written, output.size() - written,
+				fileOffset + written);
+			if (ret == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				req->result = -1;
+				return;
+			}
+			written += ret;
+		}
+		req->result = written;
 	}
 
 	void writeBufferToFileCallback(eio_req req, FileDescriptor fd,
-		shared_array<char> buffer, size_t size,
+		shared_array<char> buffer, size_t size, CompressedBlockListPtr blocks,
 		unsigned int generation, boost::weak_ptr<FileBackedPipe> wself)
 	{
 		boost::shared_ptr<FileBackedPipe> self = wself.lock();
@@ -321,6 +814,10 @@ private:
 			setError(req.errorno);
 		} else {
 			assert(dataState == IN_FILE);
+			if (blocks != NULL) {
+				file.blocks.insert(file.blocks.end(), blocks->begin(), blocks->end());
+				file.compressedSize += req.result;
+			}
 			file.writeBuffer.erase(0, size);
 			file.writtenSize += size;
 			file.writingToFile = false;
@@ -332,14 +829,67 @@ private:
 		}
 	}
 
-	void openCallback(eio_req req, string filename, unsigned int generation,
+	/**
+	 * Creates a buffer file that has no name, so that it disappears once it's
+	 * closed. Uses O_TMPFILE if the OS and the file system support it, and
+	 * otherwise creates the file under `fallbackFilename` and unlinks it.
+	 */
+	static int createAnonymousFile(const string &dir, const string &fallbackFilename) {
+		int flags = O_RDWR;
+		#ifdef O_CLOEXEC
+			flags |= O_CLOEXEC;
+		#endif
+		int fd;
+
+		#ifdef O_TMPFILE
+			do {
+				fd = ::open(dir.c_str(), flags | O_TMPFILE, 0600);
+			} while (fd == -1 && errno == EINTR);
+			if (fd != -1) {
+				return fd;
+			}
+		#endif
+
+		do {
+			fd = ::open(fallbackFilename.c_str(), flags | O_CREAT | O_TRUNC, 0600);
+		} while (fd == -1 && errno == EINTR);
+		if (fd != -1) {
+			unlink(fallbackFilename.c_str());
+		}
+		return fd;
+	}
+
+	/**
+	 * Runs in the libeio thread pool. Creates a buffer file unless a reused
+	 * one is given, and preallocates space for the data that is expected.
+	 */
+	static void openFile(const string &dir, const string &fallbackFilename,
+		int reusedFd, off_t preallocate, eio_req *req)
+	{
+		int fd = reusedFd;
+		if (fd == -1) {
+			fd = createAnonymousFile(dir, fallbackFilename);
+			if (fd == -1) {
+				req->result = -1;
+				return;
+			}
+		}
+		#ifdef FALLOC_FL_KEEP_SIZE
+			if (preallocate > 0) {
+				// Best effort: the file grows as it's written to anyway.
+				fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocate);
+			}
+		#endif
+		req->result = fd;
+	}
+
+	void openCallback(eio_req req, FileDescriptor reused, unsigned int generation,
 		boost::weak_ptr<FileBackedPipe> &wself)
 	{
 		boost::shared_ptr<FileBackedPipe> self = wself.lock();
 		if (self == NULL || EIO_CANCELLED(&req) || generation != self->generation) {
-			if (req.result != -1 || EIO_CANCELLED(&req)) {
+			if (reused == -1 && req.result != -1 && !EIO_CANCELLED(&req)) {
 				eio_close(req.result, 0, successCallback, NULL);
-				eio_unlink(filename.c_str(), 0, successCallback, NULL);
 			}
 			return;
 		}
@@ -348,21 +898,54 @@ private:
 		if (req.result < 0) {
 			setError(req.errorno);
 		} else {
-			eio_unlink(filename.c_str(), 0, successCallback, NULL);
+			FileDescriptor fd = (reused == -1) ? FileDescriptor(req.result) : reused;
 			if (openTimeout == 0) {
-				finalizeOpenFile(FileDescriptor(req.result));
+				finalizeOpenFile(fd);
 			} else {
 				getLibev()->runAfter(openTimeout,
 					boost::bind(&FileBackedPipe::finalizeOpenFileAfterTimeout, this,
 						boost::weak_ptr<FileBackedPipe>(shared_from_this()),
-						generation, FileDescriptor(req.result)));
+						generation, fd));
 			}
 		}
 	}
 
+	/**
+	 * Gives the buffer file back to the spill file pool, after truncating it
+	 * in the libeio thread pool. A file that is still being written to is
+	 * closed instead, because the write could land after another pipe has
+	 * taken over the file.
+	 */
+	void releaseFile() {
+		if (file.fd != -1 && spillFilePool != NULL && !file.writingToFile
+		 && libeio.getLibev() != NULL)
+		{
+			libeio.custom(boost::bind(truncateFile, (int) file.fd, _1), 0,
+				boost::bind(truncateFileCallback, _1, file.fd,
+					boost::weak_ptr<SpillFilePool>(spillFilePool)));
+		}
+		file.fd = FileDescriptor();
+	}
+
+	static void truncateFile(int fd, eio_req *req) {
+		req->result = ftruncate(fd, 0);
+	}
+
+	static void truncateFileCallback(eio_req req, FileDescriptor fd,
+		boost::weak_ptr<SpillFilePool> wpool)
+	{
+		SpillFilePoolPtr pool = wpool.lock();
+		if (pool != NULL && !EIO_CANCELLED(&req) && req.result == 0) {
+			pool->release(fd);
+		}
+	}
+
 	void finalizeOpenFile(const FileDescriptor &fd) {
 		dataState = IN_FILE;
 		file.fd = fd;
+		#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		#endif
 		writeBufferToFile();
 	}
 
@@ -381,37 +964,199 @@ private:
 
 	void readBlockFromFileOrWriteBuffer(const EioReadCallback &callback) {
 		if (file.readOffset >= file.writtenSize) {
+			discardReadAhead();
 			StaticString data = StaticString(file.writeBuffer).substr(
-				file.readOffset - file.writtenSize, 1024 * 16);
+				file.readOffset - file.writtenSize, MIN_READ_SIZE);
 			callback(0, data.data(), data.size());
 		} else {
-			shared_array<char> buffer(new char[1024 * 16]);
-			eio_req *req = libeio.read(file.fd, buffer.get(), 1024 * 16, file.readOffset, 0,
+			// Drop the blocks that have been fully consumed.
+			while (!file.readAhead.empty()
+			    && file.readAhead.front().completed
+			    && file.readAhead.front().offset + (off_t) file.readAhead.front().size
+			       <= file.readOffset)
+			{
+				file.readAhead.pop_front();
+			}
+			if (!file.readAhead.empty() && !file.readAhead.front().contains(file.readOffset)) {
+				// Short read earlier on; start over from the read offset.
+				discardReadAhead();
+			}
+			if (file.readAhead.empty()) {
+				file.readAheadOffset = file.readOffset;
+			}
+			while (!file.blocks.empty()
+			    && file.blocks.front().offset + (off_t) file.blocks.front().rawSize
+			       <= file.readOffset)
+			{
+				file.blocks.pop_front();
+			}
+
+			assert(!file.pendingReadCallback);
+			file.pendingReadCallback = callback;
+			issueReadAhead();
+			deliverReadAhead();
+		}
+	}
+
+	void issueReadAhead() {
+		while (file.readAhead.size() < MAX_READ_AHEAD_BLOCKS
+		    && file.readAheadOffset < file.writtenSize)
+		{
+			if (file.compressed) {
+				issueCompressedReadAhead();
+				continue;
+			}
+
+			size_t size = (size_t) std::min<off_t>(file.readSize,
+				file.writtenSize - file.readAheadOffset);
+			file.readAhead.push_back(ReadAheadBlock(file.readAheadOffset, size));
+			const ReadAheadBlock &block = file.readAhead.back();
+			eio_req *req = libeio.read(file.fd, block.buffer.get(), size,
+				block.offset, 0,
 				boost::bind(
-					&FileBackedPipe::readCallback, this,
-					_1, file.fd, buffer, callback, generation,
+					&FileBackedPipe::readAheadCallback, this,
+					_1, file.fd, block.buffer, generation,
 					boost::weak_ptr<FileBackedPipe>(shared_from_this())
 				)
 			);
 			if (req == NULL) {
 				throw RuntimeException("eio_read() failed!");
 			}
+			file.readAheadOffset += size;
+		}
+	}
+
+	/** Reads the compressed block that contains 'readAheadOffset' ahead. */
+	void issueCompressedReadAhead() {
+		deque<CompressedBlock>::const_iterator it = file.blocks.begin();
+		while (it->offset + (off_t) it->rawSize <= file.readAheadOffset) {
+			it++;
+		}
+		assert(it != file.blocks.end());
+
+		file.readAhead.push_back(ReadAheadBlock(it->offset, it->rawSize));
+		const ReadAheadBlock &block = file.readAhead.back();
+		eio_req *req = libeio.custom(
+			boost::bind(readAndDecompress, (int) file.fd, block.buffer.get(), *it, _1),
+			0,
+			boost::bind(
+				&FileBackedPipe::readAheadCallback, this,
+				_1, file.fd, block.buffer, generation,
+				boost::weak_ptr<FileBackedPipe>(shared_from_this())
+			)
+		);
+		if (req == NULL) {
+			throw RuntimeException("eio_custom() failed!");
+		}
+		file.readAheadOffset = it->offset + it->rawSize;
+	}
+
+	/**
+	 * Runs in the libeio thread pool. Reads a compressed block and
+	 * decompresses it into 'buffer'. The result is the block's uncompressed
+	 * size.
+	 */
+	static void readAndDecompress(int fd, char *buffer, CompressedBlock block, eio_req *req) {
+		string input(COMPRESSION_BLOCK_HEADER_SIZE + block.storedSize, '\0');
+		size_t done = 0;
+		while (done < input.size()) {
+			ssize_t ret = pread(fd, &input[done], input.size() - done,
+				block.fileOffset + done);
+			if (ret == -1 && errno == EINTR) {
+				continue;
+			} else if (ret <= 0) {
+				if (ret == 0) {
+					errno = EIO;
+				}
+				req->result = -1;
+				return;
+			}
+			done += ret;
+		}
+
+		uint32_t header[2];
+		memcpy(header, input.data(), COMPRESSION_BLOCK_HEADER_SIZE);
+		const char *stored = input.data() + COMPRESSION_BLOCK_HEADER_SIZE;
+		uLongf rawSize = block.rawSize;
+		if (header[0] != block.rawSize || header[1] != block.storedSize) {
+			errno = EIO;
+			req->result = -1;
+		} else if (block.storedSize == block.rawSize) {
+			memcpy(buffer, stored, block.rawSize);
+			req->result = block.rawSize;
+		} else if (uncompress((Bytef *) buffer, &rawSize, (const Bytef *) stored,
+			block.storedSize) != Z_OK || rawSize != block.rawSize)
+		{
+			errno = EIO;
+			req->result = -1;
+		} else {
+			req->result = block.rawSize;
 		}
 	}
 
-	void readCallback(eio_req req, FileDescriptor fd, shared_array<char> buffer,
-		EioReadCallback callback, unsigned int generation, boost::weak_ptr<FileBackedPipe> wself)
+	void deliverReadAhead() {
+		if (!file.pendingReadCallback
+		 || file.readAhead.empty()
+		 || !file.readAhead.front().completed)
+		{
+			return;
+		}
+
+		// Don't touch the block after calling the callback: the
+		// callback may consume the data and pop the block.
+		const ReadAheadBlock &block = file.readAhead.front();
+		EioReadCallback callback = file.pendingReadCallback;
+		file.pendingReadCallback = EioReadCallback();
+		if (block.errorCode != 0) {
+			callback(block.errorCode, NULL, 0);
+		} else {
+			size_t skip = file.readOffset - block.offset;
+			callback(0, block.buffer.get() + skip, block.size - skip);
+		}
+	}
+
+	void discardReadAhead() {
+		// Reads still in flight will not find their block and are ignored.
+		file.readAhead.clear();
+		file.readAheadOffset = file.readOffset;
+	}
+
+	void readAheadCallback(eio_req req, FileDescriptor fd, shared_array<char> buffer,
+		unsigned int generation, boost::weak_ptr<FileBackedPipe> wself)
 	{
 		boost::shared_ptr<FileBackedPipe> self = wself.lock();
 		if (self == NULL || EIO_CANCELLED(&req) || generation != self->generation) {
 			return;
 		}
 
+		deque<ReadAheadBlock>::iterator it, end = file.readAhead.end();
+		for (it = file.readAhead.begin(); it != end && it->buffer != buffer; it++) {
+			// Do nothing.
+		}
+		if (it == end) {
+			return;
+		}
+
+		it->completed = true;
 		if (req.result < 0) {
-			callback(req.errorno, NULL, 0);
+			it->errorCode = req.errorno;
+		} else if (req.result == 0) {
+			// The file is never truncated, so this shouldn't happen.
+			it->errorCode = EIO;
 		} else {
-			callback(0, buffer.get(), req.result);
+			it->size = req.result;
+		}
+
+		if (file.pendingReadCallback && it == file.readAhead.begin()) {
+			/* The consumer had to wait for the disk, so read bigger blocks
+			 * from now on.
+			 */
+			file.readSize *= 2;
+			if (file.readSize > MAX_READ_SIZE) {
+				file.readSize = MAX_READ_SIZE;
+			}
 		}
+		deliverReadAhead();
 	}
 
 	void dataConsumed(size_t consumed, bool done, unsigned int oldGeneration) {
@@ -487,6 +1232,11 @@ private:
 		case IN_MEMORY:
 			memmove(memory.data, memory.data + consumed, memory.size - consumed);
 			memory.size -= consumed;
+			if (memory.size == 0 && (bufferPool != NULL || memoryBudget != NULL)) {
+				// Give the buffer back so that idle pipes don't hold on to it
+				// or to their share of the memory budget.
+				freeMemoryBuffer();
+			}
 			if (started) {
 				if (memory.size == 0) {
 					//callOnConsumed();
@@ -551,6 +1301,9 @@ public:
 		onError = NULL;
 		onCommit = NULL;
 
+		spillMetric = NULL;
+		sizeHint = 0;
+		compression = false;
 		consumedCallCount = 0;
 		generation = 0;
 		currentData = NULL;
@@ -563,13 +1316,18 @@ public:
 		dataState = IN_MEMORY;
 		memory.data = NULL;
 		memory.size = 0;
+		memory.capacity = 0;
 		file.writingToFile = false;
 		file.readOffset = 0;
 		file.writtenSize = 0;
+		file.compressed = false;
+		file.compressedSize = 0;
+		file.readAheadOffset = 0;
+		file.readSize = MIN_READ_SIZE;
 	}
 
 	~FileBackedPipe() {
-		delete[] memory.data;
+		freeMemoryBuffer();
 	}
 	
 	bool resetable() const {
@@ -579,6 +1337,7 @@ public:
 
 	void reset(const SafeLibevPtr &libev = SafeLibevPtr()) {
 		generation++;
+		releaseFile();
 		libeio = MultiLibeio(libev);
 		currentData = NULL;
 		currentDataSize = 0;
@@ -588,19 +1347,102 @@ public:
 		hasError = false;
 		dataEventState = NOT_CALLING_EVENT;
 		dataState = IN_MEMORY;
-		delete[] memory.data;
-		memory.data = NULL;
-		memory.size = 0;
-		file.fd = FileDescriptor();
+		freeMemoryBuffer();
+		sizeHint = 0;
+		compression = false;
 		file.writingToFile = false;
 		file.readOffset = 0;
 		file.writtenSize = 0;
+		file.compressed = false;
+		file.blocks.clear();
+		file.compressedSize = 0;
+		file.readAhead.clear();
+		file.readAheadOffset = 0;
+		file.readSize = MIN_READ_SIZE;
+		file.pendingReadCallback = EioReadCallback();
 	}
 
 	void setThreshold(size_t value) {
 		threshold = value;
 	}
 
+	/**
+	 * Sets the pool from which the in-memory buffer is borrowed. Should be
+	 * called while the pipe is reset, i.e. not holding any buffered data.
+	 */
+	void setBufferPool(const BufferPoolPtr &pool) {
+		freeMemoryBuffer();
+		bufferPool = pool;
+	}
+
+	const BufferPoolPtr &getBufferPool() const {
+		return bufferPool;
+	}
+
+	/**
+	 * Sets the budget that the in-memory buffer is accounted against. Should
+	 * be called while the pipe is reset, i.e. not holding any buffered data.
+	 */
+	void setMemoryBudget(const MemoryBudgetPtr &budget) {
+		freeMemoryBuffer();
+		memoryBudget = budget;
+	}
+
+	const MemoryBudgetPtr &getMemoryBudget() const {
+		return memoryBudget;
+	}
+
+	/**
+	 * Sets the pool from which the buffer file is taken, and to which it's
+	 * given back when the pipe is reset. May be NULL, in which case a new
+	 * buffer file is created every time the pipe spills to disk.
+	 */
+	void setSpillFilePool(const SpillFilePoolPtr &pool) {
+		spillFilePool = pool;
+	}
+
+	const SpillFilePoolPtr &getSpillFilePool() const {
+		return spillFilePool;
+	}
+
+	/**
+	 * Sets the total amount of data that is expected to be written to the
+	 * pipe, e.g. a request body's Content-Length, or 0 if unknown. When the
+	 * pipe spills to disk, space for that much data is preallocated in the
+	 * buffer file, so that it doesn't have to grow write by write. reset()
+	 * clears the hint.
+	 */
+	void setSizeHint(unsigned long long size) {
+		sizeHint = size;
+	}
+
+	/**
+	 * Sets whether data that spills to disk is compressed, in blocks of
+	 * COMPRESSION_BLOCK_SIZE. This trades CPU time in the libeio thread pool
+	 * for less disk I/O, so it's only worth it for data that is likely
+	 * compressible, such as text. Takes effect the next time the pipe spills
+	 * to disk. reset() turns it off again.
+	 */
+	void setCompression(bool value) {
+		compression = value;
+	}
+
+	/**
+	 * Returns the number of bytes that have been written to the buffer file,
+	 * which is less than the amount of data if it's compressed.
+	 */
+	off_t getBufferFileSize() const {
+		return file.compressed ? file.compressedSize : file.writtenSize;
+	}
+
+	/**
+	 * Sets a counter that is incremented every time this pipe switches from
+	 * buffering in memory to buffering on disk. May be NULL.
+	 */
+	void setSpillMetric(Metric *metric) {
+		spillMetric = metric;
+	}
+
 	/**
 	 * Returns the amount of data that has been buffered, both in memory and on disk.
 	 */
@@ -695,6 +1537,48 @@ public:
 		return endReached;
 	}
 
+	/**
+	 * Takes all buffered data out of the pipe, so that it can be consumed
+	 * somewhere else, e.g. in another thread, and then resets the pipe.
+	 * In-memory data is copied into 'memoryData'. If the data is in the
+	 * buffer file, then 'fd' is set to that file and the data is at
+	 * [fileOffset, fileEnd).
+	 *
+	 * This is only possible if end() has been called and the pipe is idle:
+	 * it's stopped, no data event is in progress and nothing is being
+	 * written to the buffer file, and if the buffer file isn't compressed.
+	 * Otherwise false is returned and nothing is changed.
+	 */
+	bool detachBufferedData(string &memoryData, FileDescriptor &fd,
+		off_t &fileOffset, off_t &fileEnd)
+	{
+		if (!ended || started || hasError
+		 || dataEventState != NOT_CALLING_EVENT
+		 || dataState == OPENING_FILE
+		 || file.compressed
+		 || file.writingToFile
+		 || !file.writeBuffer.empty())
+		{
+			return false;
+		}
+
+		if (dataState == IN_MEMORY) {
+			memoryData.assign(memory.data == NULL ? "" : memory.data, memory.size);
+			fd = FileDescriptor();
+			fileOffset = 0;
+			fileEnd = 0;
+		} else {
+			memoryData.clear();
+			fd = file.fd;
+			// The caller owns the file now; don't give it back to the pool.
+			file.fd = FileDescriptor();
+			fileOffset = file.readOffset;
+			fileEnd = file.writtenSize;
+		}
+		reset(libeio.getLibev());
+		return true;
+	}
+
 	bool isCommittingToDisk() const {
 		return (dataState == OPENING_FILE || dataState == IN_FILE) && !file.writeBuffer.empty();
 	}
@@ -0,0 +1,688 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_HTTP_REQUEST_PARSER_H_
+#define _PASSENGER_HTTP_REQUEST_PARSER_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cctype>
+
+#include <StaticString.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+
+/**
+ * Parses the header of an HTTP/1.0 or HTTP/1.1 request and converts it into
+ * CGI variables, in the same format as the SCGI header data that web servers
+ * send to the RequestHandler ("NAME\0VALUE\0" pairs). This allows the
+ * RequestHandler to accept HTTP clients directly, without a web server in
+ * front of it. The request body is not parsed.
+ *
+ * <h2>Usage</h2>
+ * Feed data to the parser until it no longer accepts input. feed() only
+ * consumes the request header, so anything after it (the body, or the next
+ * pipelined request) is left to the caller.
+ *
+ * @code
+ *    HttpRequestParser parser;
+ *    size_t consumed = parser.feed(buf, size);
+ *    if (parser.getState() == HttpRequestParser::ERROR) {
+ *        respond(parser.getErrorStatusCode(), parser.getErrorMessage());
+ *    } else if (parser.getState() == HttpRequestParser::DONE) {
+ *        processCgiHeaders(parser.getHeaderData());
+ *        processBody(buf + consumed, size - consumed);
+ *    }
+ * @endcode
+ *
+ * <h2>CGI mapping</h2>
+ * - REQUEST_METHOD, REQUEST_URI, PATH_INFO (not unescaped), QUERY_STRING,
+ *   SCRIPT_NAME (empty) and SERVER_PROTOCOL come from the request line.
+ *   Absolute request URIs are reduced to their path and query string; their
+ *   host replaces the Host header.
+ * - Every header becomes HTTP_NAME, with dashes replaced by underscores.
+ *   Headers whose names contain underscores are dropped, so that they can't
+ *   pose as other headers. Repeated headers are joined with ", ", or with
+ *   "; " for Cookie.
+ * - Content-Length and Content-Type become CONTENT_LENGTH and CONTENT_TYPE.
+ * - SERVER_NAME is the Host header without the port, or defaultServerName
+ *   if there is no Host header.
+ * - Transfer-Encoding and "Expect: 100-continue" are handled by the caller,
+ *   see isChunked() and expectsContinue(), and are not passed on.
+ *
+ * Only the "chunked" transfer encoding is supported. Requests that carry
+ * both a Transfer-Encoding and a Content-Length header are rejected, as are
+ * HTTP/1.1 requests without a Host header.
+ */
+class HttpRequestParser {
+public:
+	enum State {
+		READING_HEADER,
+		DONE,
+		ERROR
+	};
+
+	enum ErrorReason {
+		NONE,
+
+		/** The header is larger than the maxSize value provided to the constructor. */
+		LIMIT_REACHED,
+
+		/** The request line is malformed. */
+		INVALID_REQUEST_LINE,
+
+		/** The request is not an HTTP/1.x request. */
+		UNSUPPORTED_HTTP_VERSION,
+
+		/** A header line is malformed. */
+		INVALID_HEADER,
+
+		/** An HTTP/1.1 request without a Host header. */
+		MISSING_HOST_HEADER,
+
+		/** The Content-Length header is malformed or contradicts another
+		 * Content-Length or Transfer-Encoding header. */
+		INVALID_CONTENT_LENGTH,
+
+		/** A transfer encoding other than "chunked" was used. */
+		UNSUPPORTED_TRANSFER_ENCODING
+	};
+
+private:
+	typedef pair<string, string> Header;
+
+	State state;
+	ErrorReason errorReason;
+	size_t maxSize;
+	/** The request header as received so far. */
+	string buffer;
+	/** The result, as "NAME\0VALUE\0" pairs. */
+	string headerData;
+	/** The request headers, converted to CGI names. */
+	vector<Header> headers;
+	string requestUri;
+	string host;
+	string transferEncoding;
+	int httpMinorVersion;
+	bool connectionClose;
+	bool chunked;
+	bool expectContinue;
+	bool contentLengthSeen;
+
+	static bool isTokenChar(char ch) {
+		if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) {
+			return true;
+		}
+		switch (ch) {
+		case '!': case '#': case '$': case '%': case '&': case '\'': case '*':
+		case '+': case '-': case '.': case '^': case '_': case '`': case '|':
+		case '~':
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	static bool isToken(const StaticString &str) {
+		if (str.empty()) {
+			return false;
+		}
+		for (string::size_type i = 0; i < str.size(); i++) {
+			if (!isTokenChar(str[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Whether the string is free of control characters other than tabs. */
+	static bool isPrintable(const StaticString &str) {
+		for (string::size_type i = 0; i < str.size(); i++) {
+			unsigned char ch = (unsigned char) str[i];
+			if ((ch < 0x20 && ch != '\t') || ch == 0x7f) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Whether the string is a number that fits in a long long. */
+	static bool isDigits(const StaticString &str) {
+		if (str.empty() || str.size() > 18) {
+			return false;
+		}
+		for (string::size_type i = 0; i < str.size(); i++) {
+			if (str[i] < '0' || str[i] > '9') {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static bool isWhitespace(char ch) {
+		return ch == ' ' || ch == '\t';
+	}
+
+	static StaticString trim(const StaticString &str) {
+		const char *begin = str.data();
+		const char *end = str.data() + str.size();
+		while (begin < end && isWhitespace(*begin)) {
+			begin++;
+		}
+		while (end > begin && isWhitespace(end[-1])) {
+			end--;
+		}
+		return StaticString(begin, end - begin);
+	}
+
+	static bool equalsIgnoreCase(const StaticString &a, const StaticString &b) {
+		if (a.size() != b.size()) {
+			return false;
+		}
+		for (string::size_type i = 0; i < a.size(); i++) {
+			if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static bool startsWithIgnoreCase(const StaticString &str, const StaticString &prefix) {
+		return str.size() >= prefix.size()
+			&& equalsIgnoreCase(str.substr(0, prefix.size()), prefix);
+	}
+
+	void setError(ErrorReason reason) {
+		state = ERROR;
+		errorReason = reason;
+	}
+
+	/**
+	 * Returns the position right after the empty line that terminates the
+	 * header, or string::npos if it hasn't been received yet.
+	 */
+	string::size_type findHeaderEnd(string::size_type start) const {
+		const char *data = buffer.data();
+		string::size_type size = buffer.size();
+		string::size_type pos = start;
+
+		while (pos < size) {
+			const char *lf = (const char *) memchr(data + pos, '\n', size - pos);
+			if (lf == NULL) {
+				return string::npos;
+			}
+			pos = lf - data + 1;
+			if (pos < size && data[pos] == '\n') {
+				return pos + 1;
+			} else if (pos + 1 < size && data[pos] == '\r' && data[pos + 1] == '\n') {
+				return pos + 2;
+			}
+		}
+		return string::npos;
+	}
+
+	void addCgiHeader(const StaticString &name, const StaticString &value) {
+		headerData.append(name.data(), name.size());
+		headerData.append(1, '\0');
+		headerData.append(value.data(), value.size());
+		headerData.append(1, '\0');
+	}
+
+	bool parseRequestLine(const StaticString &line) {
+		string::size_type sp1 = line.find(' ');
+		if (sp1 == string::npos) {
+			setError(INVALID_REQUEST_LINE);
+			return false;
+		}
+		string::size_type sp2 = line.find(' ', sp1 + 1);
+		if (sp2 == string::npos) {
+			setError(INVALID_REQUEST_LINE);
+			return false;
+		}
+
+		StaticString method = line.substr(0, sp1);
+		StaticString uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+		StaticString version = line.substr(sp2 + 1);
+		if (!isToken(method) || uri.empty() || !isPrintable(uri)
+		 || uri.find(' ') != string::npos || uri.find('\t') != string::npos)
+		{
+			setError(INVALID_REQUEST_LINE);
+			return false;
+		}
+
+		if (version.size() != sizeof("HTTP/1.1") - 1
+		 || !startsWith(version, "HTTP/")
+		 || version[6] != '.'
+		 || version[5] < '0' || version[5] > '9'
+		 || version[7] < '0' || version[7] > '9')
+		{
+			setError(INVALID_REQUEST_LINE);
+			return false;
+		} else if (version[5] != '1') {
+			setError(UNSUPPORTED_HTTP_VERSION);
+			return false;
+		}
+		httpMinorVersion = version[7] - '0';
+
+		if (startsWithIgnoreCase(uri, "http://") || startsWithIgnoreCase(uri, "https://")) {
+			// An absolute URI. Its host takes precedence over the Host header.
+			string::size_type hostBegin = uri.find("//") + 2;
+			string::size_type hostEnd = hostBegin;
+			while (hostEnd < uri.size() && uri[hostEnd] != '/' && uri[hostEnd] != '?') {
+				hostEnd++;
+			}
+			if (hostEnd == hostBegin) {
+				setError(INVALID_REQUEST_LINE);
+				return false;
+			}
+			host = uri.substr(hostBegin, hostEnd - hostBegin);
+			if (hostEnd == uri.size() || uri[hostEnd] == '?') {
+				requestUri = "/";
+				requestUri.append(uri.data() + hostEnd, uri.size() - hostEnd);
+			} else {
+				requestUri.assign(uri.data() + hostEnd, uri.size() - hostEnd);
+			}
+		} else if (uri[0] == '/') {
+			requestUri.assign(uri.data(), uri.size());
+		} else {
+			setError(INVALID_REQUEST_LINE);
+			return false;
+		}
+
+		string::size_type question = requestUri.find('?');
+		StaticString path, query;
+		if (question == string::npos) {
+			path = requestUri;
+		} else {
+			path = StaticString(requestUri.data(), question);
+			query = StaticString(requestUri.data() + question + 1,
+				requestUri.size() - question - 1);
+		}
+
+		addCgiHeader("REQUEST_METHOD", method);
+		addCgiHeader("REQUEST_URI", requestUri);
+		addCgiHeader("PATH_INFO", path);
+		addCgiHeader("QUERY_STRING", query);
+		addCgiHeader("SCRIPT_NAME", "");
+		addCgiHeader("SERVER_PROTOCOL", version);
+		return true;
+	}
+
+	/** Converts a header name like "X-Forwarded-For" to "HTTP_X_FORWARDED_FOR". */
+	static void makeCgiName(const StaticString &name, string &result) {
+		result.reserve(sizeof("HTTP_") - 1 + name.size());
+		result.assign("HTTP_");
+		for (string::size_type i = 0; i < name.size(); i++) {
+			char ch = name[i];
+			if (ch == '-') {
+				result.append(1, '_');
+			} else {
+				result.append(1, (char) toupper((unsigned char) ch));
+			}
+		}
+	}
+
+	bool processHeader(const StaticString &name, const StaticString &value) {
+		if (equalsIgnoreCase(name, "Content-Length")) {
+			if (!isDigits(value)) {
+				setError(INVALID_CONTENT_LENGTH);
+				return false;
+			}
+			if (contentLengthSeen) {
+				// Identical duplicates are harmless; others are ambiguous.
+				for (unsigned int i = 0; i < headers.size(); i++) {
+					if (headers[i].first == "CONTENT_LENGTH" && StaticString(headers[i].second) != value) {
+						setError(INVALID_CONTENT_LENGTH);
+						return false;
+					}
+				}
+				return true;
+			}
+			contentLengthSeen = true;
+			headers.push_back(Header("CONTENT_LENGTH", value));
+		} else if (equalsIgnoreCase(name, "Content-Type")) {
+			addHeader("CONTENT_TYPE", value, ", ");
+		} else if (equalsIgnoreCase(name, "Transfer-Encoding")) {
+			if (!transferEncoding.empty()) {
+				transferEncoding.append(", ");
+			}
+			transferEncoding.append(value.data(), value.size());
+		} else if (equalsIgnoreCase(name, "Expect") && equalsIgnoreCase(value, "100-continue")) {
+			expectContinue = httpMinorVersion >= 1;
+		} else if (name.find('_') != string::npos) {
+			// Dropped, like nginx does by default: "X_Forwarded-For" would
+			// otherwise be indistinguishable from "X-Forwarded-For".
+		} else {
+			string cgiName;
+			makeCgiName(name, cgiName);
+			if (cgiName == "HTTP_HOST") {
+				if (host.empty()) {
+					host.assign(value.data(), value.size());
+				}
+				return true;
+			} else if (cgiName == "HTTP_CONNECTION" && listContains(value, "close")) {
+				connectionClose = true;
+			}
+			addHeader(cgiName, value, (cgiName == "HTTP_COOKIE") ? "; " : ", ");
+		}
+		return true;
+	}
+
+	void addHeader(const string &cgiName, const StaticString &value, const char *separator) {
+		for (unsigned int i = 0; i < headers.size(); i++) {
+			if (headers[i].first == cgiName) {
+				headers[i].second.append(separator);
+				headers[i].second.append(value.data(), value.size());
+				return;
+			}
+		}
+		headers.push_back(Header(cgiName, value));
+	}
+
+	bool parseHeaderLines(StaticString data) {
+		string name, value;
+		bool haveHeader = false;
+
+		while (!data.empty()) {
+			string::size_type lf = data.find('\n');
+			StaticString line;
+			if (lf == string::npos) {
+				line = data;
+				data = StaticString();
+			} else {
+				line = data.substr(0, lf);
+				data = data.substr(lf + 1);
+			}
+			if (!line.empty() && line[line.size() - 1] == '\r') {
+				line = line.substr(0, line.size() - 1);
+			}
+			if (line.empty()) {
+				break;
+			}
+
+			if (isWhitespace(line[0])) {
+				// Obsolete line folding: a continuation of the previous value.
+				if (!haveHeader) {
+					setError(INVALID_HEADER);
+					return false;
+				}
+				StaticString continuation = trim(line);
+				if (!isPrintable(continuation)) {
+					setError(INVALID_HEADER);
+					return false;
+				}
+				value.append(" ");
+				value.append(continuation.data(), continuation.size());
+				continue;
+			}
+
+			if (haveHeader && !processHeader(name, value)) {
+				return false;
+			}
+			string::size_type colon = line.find(':');
+			if (colon == string::npos || !isToken(line.substr(0, colon))) {
+				setError(INVALID_HEADER);
+				return false;
+			}
+			StaticString lineValue = trim(line.substr(colon + 1));
+			if (!isPrintable(lineValue)) {
+				setError(INVALID_HEADER);
+				return false;
+			}
+			name.assign(line.data(), colon);
+			value.assign(lineValue.data(), lineValue.size());
+			haveHeader = true;
+		}
+		return !haveHeader || processHeader(name, value);
+	}
+
+	void parse() {
+		StaticString data = buffer;
+		string::size_type lf = data.find('\n');
+		StaticString requestLine = data.substr(0, lf);
+		if (!requestLine.empty() && requestLine[requestLine.size() - 1] == '\r') {
+			requestLine = requestLine.substr(0, requestLine.size() - 1);
+		}
+
+		if (!parseRequestLine(requestLine) || !parseHeaderLines(data.substr(lf + 1))) {
+			return;
+		}
+
+		if (!transferEncoding.empty()) {
+			if (!equalsIgnoreCase(trim(transferEncoding), "chunked")) {
+				setError(UNSUPPORTED_TRANSFER_ENCODING);
+				return;
+			} else if (contentLengthSeen) {
+				setError(INVALID_CONTENT_LENGTH);
+				return;
+			}
+			chunked = true;
+		}
+		if (host.empty() && httpMinorVersion >= 1) {
+			setError(MISSING_HOST_HEADER);
+			return;
+		}
+
+		if (host.empty()) {
+			addCgiHeader("SERVER_NAME", defaultServerName);
+		} else {
+			// Strip the port, but not the colons in an IPv6 address.
+			string::size_type colon = host.rfind(':');
+			string::size_type bracket = host.rfind(']');
+			if (colon != string::npos && (bracket == string::npos || bracket < colon)) {
+				addCgiHeader("SERVER_NAME", StaticString(host.data(), colon));
+			} else {
+				addCgiHeader("SERVER_NAME", host);
+			}
+			addCgiHeader("HTTP_HOST", host);
+		}
+		for (unsigned int i = 0; i < headers.size(); i++) {
+			addCgiHeader(headers[i].first, headers[i].second);
+		}
+		state = DONE;
+	}
+
+public:
+	/** The SERVER_NAME of requests without a Host header. Not cleared by reset(). */
+	string defaultServerName;
+
+	/**
+	 * @param maxSize The maximum size of the request header, or 0 if no
+	 *                limit is desired.
+	 */
+	HttpRequestParser(size_t maxSize = 0)
+		: defaultServerName("localhost")
+	{
+		this->maxSize = maxSize;
+		reset();
+	}
+
+	void reset() {
+		state = READING_HEADER;
+		errorReason = NONE;
+		buffer.clear();
+		headerData.clear();
+		headers.clear();
+		host.clear();
+		transferEncoding.clear();
+		requestUri.clear();
+		httpMinorVersion = 0;
+		connectionClose = false;
+		chunked = false;
+		expectContinue = false;
+		contentLengthSeen = false;
+	}
+
+	/**
+	 * Feeds request data to the parser. Returns the number of bytes that
+	 * belong to the request header; the rest, if any, is body data or the
+	 * next request.
+	 *
+	 * @post if result < size: !acceptingInput()
+	 */
+	size_t feed(const char *data, size_t size) {
+		size_t consumed = 0;
+
+		if (!acceptingInput()) {
+			return 0;
+		}
+		if (buffer.empty()) {
+			// Clients may send empty lines before the request line,
+			// e.g. after the body of the previous request.
+			while (consumed < size && (data[consumed] == '\r' || data[consumed] == '\n')) {
+				consumed++;
+			}
+			if (consumed == size) {
+				return consumed;
+			}
+		}
+
+		string::size_type searchStart = (buffer.size() > 3) ? buffer.size() - 3 : 0;
+		size_t appended = size - consumed;
+		if (maxSize > 0) {
+			appended = std::min(appended, maxSize - buffer.size());
+		}
+		buffer.append(data + consumed, appended);
+
+		string::size_type end = findHeaderEnd(searchStart);
+		if (end == string::npos) {
+			if (maxSize > 0 && buffer.size() >= maxSize) {
+				setError(LIMIT_REACHED);
+			}
+			return consumed + appended;
+		}
+
+		// Give back whatever follows the header.
+		consumed += appended - (buffer.size() - end);
+		buffer.resize(end);
+		parse();
+		return consumed;
+	}
+
+	/**
+	 * The CGI variables, as "NAME\0VALUE\0" pairs.
+	 *
+	 * @pre getState() == DONE
+	 */
+	StaticString getHeaderData() const {
+		return headerData;
+	}
+
+	State getState() const {
+		return state;
+	}
+
+	ErrorReason getErrorReason() const {
+		return errorReason;
+	}
+
+	bool acceptingInput() const {
+		return state == READING_HEADER;
+	}
+
+	/** The HTTP status code with which to respond to a request that failed to parse. */
+	int getErrorStatusCode() const {
+		switch (errorReason) {
+		case LIMIT_REACHED:
+			return 431;
+		case UNSUPPORTED_HTTP_VERSION:
+			return 505;
+		case UNSUPPORTED_TRANSFER_ENCODING:
+			return 501;
+		default:
+			return 400;
+		}
+	}
+
+	const char *getErrorMessage() const {
+		switch (errorReason) {
+		case NONE:
+			return "no error";
+		case LIMIT_REACHED:
+			return "request header too large";
+		case INVALID_REQUEST_LINE:
+			return "invalid request line";
+		case UNSUPPORTED_HTTP_VERSION:
+			return "unsupported HTTP version";
+		case INVALID_HEADER:
+			return "invalid request header";
+		case MISSING_HOST_HEADER:
+			return "missing Host header";
+		case INVALID_CONTENT_LENGTH:
+			return "invalid Content-Length header";
+		case UNSUPPORTED_TRANSFER_ENCODING:
+			return "unsupported transfer encoding";
+		default:
+			return "unknown error";
+		}
+	}
+
+	/**
+	 * Whether the comma-separated header value contains the given token,
+	 * ignoring case. E.g. listContains("TE, close", "close") is true.
+	 */
+	static bool listContains(const StaticString &list, const StaticString &token) {
+		string::size_type pos = 0;
+		while (pos <= list.size()) {
+			string::size_type comma = list.find(',', pos);
+			if (comma == string::npos) {
+				comma = list.size();
+			}
+			if (equalsIgnoreCase(trim(list.substr(pos, comma - pos)), token)) {
+				return true;
+			}
+			pos = comma + 1;
+		}
+		return false;
+	}
+
+	/** Whether the request body uses chunked transfer encoding. */
+	bool isChunked() const {
+		return chunked;
+	}
+
+	/** Whether the client wants a "100 Continue" response before it sends the body. */
+	bool expectsContinue() const {
+		return expectContinue;
+	}
+
+	/**
+	 * Whether the client may send another request on this connection
+	 * after the response. Only HTTP/1.1 connections are kept alive.
+	 */
+	bool keepAlive() const {
+		return httpMinorVersion >= 1 && !connectionClose;
+	}
+};
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_HTTP_REQUEST_PARSER_H_ */
@@ -0,0 +1,194 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_LOOP_PRIORITIES_H_
+#define _PASSENGER_LOOP_PRIORITIES_H_
+
+#include <boost/noncopyable.hpp>
+#include <ev++.h>
+#include <algorithm>
+#include <string>
+#include <cassert>
+#include <Utils/MetricsRegistry.h>
+#include <agents/HelperAgent/RequestLatencyStats.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * The priority classes of the request loop's watchers, highest first. Under
+ * overload, the work that frees application capacity should not wait behind
+ * bulk output to slow clients. So session checkouts and closes come first,
+ * then I/O with application processes, then accepting and reading client
+ * requests, and then writing responses to clients. Housekeeping timers come
+ * last.
+ *
+ * libev invokes all pending watchers in every loop iteration, highest priority
+ * first. A priority therefore only decides the order within an iteration.
+ * A lower class is never postponed by more than the callbacks that the higher
+ * classes run in the same iteration, so it cannot starve.
+ */
+enum LoopPriorityClass {
+	/** SafeLibev commands, which include the Pool's session checkout
+	 * callbacks, and flushing session closes to the Pool. */
+	LPC_SESSIONS,
+	/** Reading responses from and writing requests to application processes. */
+	LPC_APP_IO,
+	/** Accepting clients and reading their requests. */
+	LPC_CLIENT_INPUT,
+	/** Writing responses to clients, and tunneled traffic. */
+	LPC_CLIENT_OUTPUT,
+	/** Client timeouts and other periodic work. */
+	LPC_HOUSEKEEPING,
+	LPC_COUNT
+};
+
+inline int
+getLoopPriority(LoopPriorityClass priorityClass) {
+	return std::max(EV_MINPRI, EV_MAXPRI - (int) priorityClass);
+}
+
+inline const char *
+getLoopPriorityClassName(LoopPriorityClass priorityClass) {
+	switch (priorityClass) {
+	case LPC_SESSIONS:
+		return "sessions";
+	case LPC_APP_IO:
+		return "app_io";
+	case LPC_CLIENT_INPUT:
+		return "client_input";
+	case LPC_CLIENT_OUTPUT:
+		return "client_output";
+	case LPC_HOUSEKEEPING:
+		return "housekeeping";
+	default:
+		return "unknown";
+	}
+}
+
+/** Sets the libev priority of a watcher, which must not be active. */
+template<typename Watcher>
+inline void
+setLoopPriority(Watcher &watcher, LoopPriorityClass priorityClass) {
+	assert(!watcher.is_active());
+	ev_set_priority(&watcher, getLoopPriority(priorityClass));
+}
+
+
+/**
+ * Keeps track of how much time an event loop spends in the callbacks of each
+ * priority class, as Metrics. Only the event loop thread may use it.
+ */
+class LoopTimeStats: public boost::noncopyable {
+private:
+	MetricsRegistryPtr metricsRegistry;
+	Metric *timeMetrics[LPC_COUNT];
+	Metric *callbackMetrics[LPC_COUNT];
+	/** Whether a ScopedLoopTimer is active. Callbacks that are invoked by
+	 * other callbacks are accounted to the outermost one. */
+	bool timing;
+
+	friend class ScopedLoopTimer;
+
+public:
+	LoopTimeStats(const MetricsRegistryPtr &registry)
+		: metricsRegistry(registry),
+		  timing(false)
+	{
+		for (int i = 0; i < LPC_COUNT; i++) {
+			string labels = MetricsRegistry::label("class",
+				getLoopPriorityClassName((LoopPriorityClass) i));
+			timeMetrics[i] = metricsRegistry->add(this,
+				"passenger_request_loop_time_usec_total", Metric::COUNTER,
+				"Time that the request loops spent in callbacks, by priority class.",
+				labels);
+			callbackMetrics[i] = metricsRegistry->add(this,
+				"passenger_request_loop_callbacks_total", Metric::COUNTER,
+				"Callbacks that the request loops invoked, by priority class.",
+				labels);
+		}
+	}
+
+	~LoopTimeStats() {
+		metricsRegistry->removeAll(this);
+	}
+
+	unsigned long long getTime(LoopPriorityClass priorityClass) const {
+		return timeMetrics[priorityClass]->get();
+	}
+
+	unsigned long long getCallbacks(LoopPriorityClass priorityClass) const {
+		return callbackMetrics[priorityClass]->get();
+	}
+
+	template<typename Stream>
+	void inspect(Stream &stream) const {
+		stream << "Loop time:";
+		for (int i = 0; i < LPC_COUNT; i++) {
+			LoopPriorityClass priorityClass = (LoopPriorityClass) i;
+			stream << " " << getLoopPriorityClassName(priorityClass) << "=" <<
+				getTime(priorityClass) / 1000 << "ms/" <<
+				getCallbacks(priorityClass);
+		}
+		stream << "\n";
+	}
+};
+
+/**
+ * Accounts the time until it goes out of scope to a priority class. Does
+ * nothing if `stats` is NULL.
+ */
+class ScopedLoopTimer: public boost::noncopyable {
+private:
+	LoopTimeStats *stats;
+	LoopPriorityClass priorityClass;
+	unsigned long long startTime;
+
+public:
+	ScopedLoopTimer(LoopTimeStats *_stats, LoopPriorityClass _priorityClass) {
+		if (_stats == NULL || _stats->timing) {
+			stats = NULL;
+		} else {
+			stats = _stats;
+			stats->timing = true;
+			priorityClass = _priorityClass;
+			startTime = monotonicTimeUsec();
+		}
+	}
+
+	~ScopedLoopTimer() {
+		if (stats != NULL) {
+			stats->timeMetrics[priorityClass]->add(monotonicTimeUsec() - startTime);
+			stats->callbackMetrics[priorityClass]->increment();
+			stats->timing = false;
+		}
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_LOOP_PRIORITIES_H_ */
@@ -56,7 +56,10 @@
 #include <agents/Base.h>
 #include <Constants.h>
 #include <ApplicationPool2/Pool.h>
+#include <ApplicationPool2/PoolStatusTable.h>
 #include <MessageServer.h>
+#include <MessageClient.h>
+#include <PooledMessageServer.h>
 #include <MessageReadersWriters.h>
 #include <FileDescriptor.h>
 #include <ResourceLocator.h>
@@ -70,6 +73,7 @@
 #include <Utils/IOUtils.h>
 #include <Utils/MessageIO.h>
 #include <Utils/VariantMap.h>
+#include <Utils/SamplingProfiler.h>
 
 using namespace boost;
 using namespace oxt;
@@ -77,14 +81,37 @@ using namespace Passenger;
 using namespace Passenger::ApplicationPool2;
 
 
+typedef boost::shared_ptr<BackgroundEventLoop> BackgroundEventLoopPtr;
+
+/** How long a helper agent handoff may take before it's aborted. */
+static const unsigned int HANDOFF_TIMEOUT_MSEC = 30000;
+
+template<typename Stream>
+static void
+inspectRequestHandlers(Stream &stream, const vector<RequestHandlerPtr> &requestHandlers) {
+	if (requestHandlers.size() == 1) {
+		requestHandlers[0]->inspect(stream);
+	} else {
+		for (unsigned int i = 0; i < requestHandlers.size(); i++) {
+			stream << "Request handler " << i << ": ";
+			requestHandlers[i]->inspect(stream);
+		}
+	}
+}
+
+
 class RemoteController: public MessageServer::Handler {
 private:
 	struct SpecificContext: public MessageServer::ClientContext {
+		/** Reused between stats_snapshot requests on the same connection,
+		 * so that serializing a snapshot into JSON doesn't allocate. */
+		string jsonBuffer;
 	};
 	
 	typedef MessageServer::CommonClientContext CommonClientContext;
 	
-	boost::shared_ptr<RequestHandler> requestHandler;
+	vector<RequestHandlerPtr> requestHandlers;
+	RequestLatencyStatsPtr latencyStats;
 	PoolPtr pool;
 	
 	
@@ -104,6 +131,18 @@ private:
 		}
 	}
 
+	void processSetProcessConcurrency(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.requireRights(Account::RESTART);
+		if (pool->setProcessConcurrency((pid_t) atoi(args[1]), atoi(args[2]))) {
+			writeArrayMessage(commonContext.fd, "true", NULL);
+		} else {
+			writeArrayMessage(commonContext.fd, "false", NULL);
+		}
+	}
+
 	void processDetachProcessByKey(CommonClientContext &commonContext, SpecificContext *specificContext,
 		const vector<string> &args)
 	{
@@ -138,6 +177,36 @@ private:
 		writeScalarMessage(commonContext.fd, pool->toXml(includeSensitiveInfo));
 	}
 
+	/**
+	 * Like processToXml(), but serializes Pool::getStatsSnapshot(), which
+	 * doesn't hold the pool lock for long. The format is "xml" or "json".
+	 */
+	bool processStatsSnapshot(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.requireRights(Account::INSPECT_BASIC_INFO);
+		bool includeSensitiveInfo =
+			commonContext.account->hasRights(Account::INSPECT_SENSITIVE_INFO) &&
+			args[2] == "true";
+		PoolSnapshotPtr snapshot;
+		if (args[1] == "xml") {
+			snapshot = pool->getStatsSnapshot();
+			writeScalarMessage(commonContext.fd, snapshot->toXml(includeSensitiveInfo));
+		} else if (args[1] == "json") {
+			snapshot = pool->getStatsSnapshot();
+			specificContext->jsonBuffer.clear();
+			snapshot->toJson(specificContext->jsonBuffer, includeSensitiveInfo);
+			writeScalarMessage(commonContext.fd, specificContext->jsonBuffer);
+		} else if (args[1] == "memory") {
+			snapshot = pool->getStatsSnapshot();
+			writeScalarMessage(commonContext.fd, snapshot->toMemoryStats());
+		} else {
+			return false;
+		}
+		return true;
+	}
+
 	void processBacktraces(CommonClientContext &commonContext, SpecificContext *specificContext,
 		const vector<string> &args)
 	{
@@ -146,6 +215,41 @@ private:
 		writeScalarMessage(commonContext.fd, oxt::thread::all_backtraces());
 	}
 
+	/**
+	 * Runs the sampling profiler for the given number of seconds and replies
+	 * with the profile in the folded stacks format, for creating flame graphs.
+	 * Blocks this admin server thread while profiling.
+	 */
+	void processProfile(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.requireRights(Account::INSPECT_BACKTRACES);
+		VariantMap options = argsToOptions(args, 1);
+		int duration  = options.getInt("duration", false, 10);
+		int frequency = options.getInt("frequency", false, 99);
+		SamplingProfilerStacks stacks = (options.get("stacks", false) == "trace_points")
+			? TRACE_POINT_STACKS
+			: NATIVE_STACKS;
+
+		if (duration < 1 || duration > 600 || frequency < 1 || frequency > 1000) {
+			writeArrayMessage(commonContext.fd, "error",
+				"The duration must be between 1 and 600 seconds, and the "
+				"frequency between 1 and 1000 Hz", NULL);
+			return;
+		}
+
+		string profile;
+		try {
+			profile = runSamplingProfiler(duration * 1000, frequency, stacks);
+		} catch (const RuntimeException &e) {
+			writeArrayMessage(commonContext.fd, "error", e.what(), NULL);
+			return;
+		}
+		writeArrayMessage(commonContext.fd, "ok", NULL);
+		writeScalarMessage(commonContext.fd, profile);
+	}
+
 	void processRestartAppGroup(CommonClientContext &commonContext, SpecificContext *specificContext,
 		const vector<string> &args)
 	{
@@ -168,13 +272,37 @@ private:
 		TRACE_POINT();
 		stringstream stream;
 		commonContext.requireRights(Account::INSPECT_REQUESTS);
-		requestHandler->inspect(stream);
+		inspectRequestHandlers(stream, requestHandlers);
 		writeScalarMessage(commonContext.fd, stream.str());
 	}
+
+	void processLatencies(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.requireRights(Account::INSPECT_BASIC_INFO);
+		writeScalarMessage(commonContext.fd, latencyStats->inspect());
+	}
+
+	/**
+	 * Renders the metrics of the RequestHandlers and the pool in the
+	 * Prometheus text format. Unlike inspect and toXml, this doesn't take
+	 * the pool lock, so it's cheap enough to be scraped every second.
+	 */
+	void processMetrics(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.requireRights(Account::INSPECT_BASIC_INFO);
+		writeScalarMessage(commonContext.fd, pool->metrics->toPrometheusText());
+	}
 	
 public:
-	RemoteController(const boost::shared_ptr<RequestHandler> &requestHandler, const PoolPtr &pool) {
-		this->requestHandler = requestHandler;
+	RemoteController(const vector<RequestHandlerPtr> &requestHandlers,
+		const RequestLatencyStatsPtr &latencyStats, const PoolPtr &pool)
+	{
+		this->requestHandlers = requestHandlers;
+		this->latencyStats = latencyStats;
 		this->pool = pool;
 	}
 	
@@ -192,16 +320,26 @@ public:
 				processDetachProcess(commonContext, specificContext, args);
 			} else if (isCommand(args, "detach_process_by_key", 1)) {
 				processDetachProcessByKey(commonContext, specificContext, args);
+			} else if (isCommand(args, "set_process_concurrency", 2)) {
+				processSetProcessConcurrency(commonContext, specificContext, args);
 			} else if (args[0] == "inspect") {
 				return processInspect(commonContext, specificContext, args);
 			} else if (isCommand(args, "toXml", 1)) {
 				processToXml(commonContext, specificContext, args);
+			} else if (isCommand(args, "stats_snapshot", 2)) {
+				return processStatsSnapshot(commonContext, specificContext, args);
 			} else if (isCommand(args, "backtraces", 0)) {
 				processBacktraces(commonContext, specificContext, args);
+			} else if (isCommand(args, "profile", 0, 6)) {
+				processProfile(commonContext, specificContext, args);
 			} else if (isCommand(args, "restart_app_group", 1, 99)) {
 				processRestartAppGroup(commonContext, specificContext, args);
 			} else if (isCommand(args, "requests", 0)) {
 				processRequests(commonContext, specificContext, args);
+			} else if (isCommand(args, "latencies", 0)) {
+				processLatencies(commonContext, specificContext, args);
+			} else if (isCommand(args, "metrics", 0)) {
+				processMetrics(commonContext, specificContext, args);
 			} else {
 				return false;
 			}
@@ -241,6 +379,139 @@ public:
 	}
 };
 
+/**
+ * The processes that HandoffHandler has handed off to a new helper agent.
+ * The handoff only takes effect once the watchdog has accepted the new
+ * helper agent, see Server::mainLoop().
+ */
+struct PendingHandoff {
+	boost::mutex syncher;
+	bool pending;
+	vector<ProcessPtr> processes;
+
+	PendingHandoff()
+		: pending(false)
+		{ }
+};
+
+/**
+ * Hands the request socket and the application processes over to a new
+ * helper agent, which the watchdog starts with the 'handoff' option when it
+ * replaces this one. Their file descriptors are passed over the admin
+ * connection:
+ *
+ *   new agent:  ["handoff"]
+ *   this agent: ["request socket"], followed by the request socket
+ *   this agent: ["http socket"], followed by the HTTP socket, if any
+ *   this agent: for every process:
+ *                 ["process", group name, pid, gupid, connect password,
+ *                  spawner creation time, spawn start time, CPU affinity,
+ *                  number of sockets, whether it has an error pipe],
+ *                 ["socket", name, address, protocol, concurrency, keep-alive]
+ *                 for every socket, followed by the admin socket and the
+ *                 error pipe, if any
+ *   this agent: ["end"]
+ *   new agent:  ["done"]
+ *
+ * Until this helper agent exits, both use the same sockets and processes.
+ */
+class HandoffHandler: public MessageServer::Handler {
+private:
+	FileDescriptor requestSocket;
+	FileDescriptor httpSocket;
+	PoolPtr pool;
+	PendingHandoff &pendingHandoff;
+
+	static void writeProcess(int fd, const ProcessPtr &process, unsigned long long *timeout) {
+		GroupPtr group = process->getGroup();
+		SocketList::const_iterator it, end = process->sockets->end();
+
+		writeArrayMessage(fd, timeout,
+			"process",
+			group->name.c_str(),
+			toString(process->pid).c_str(),
+			process->gupid.c_str(),
+			process->connectPassword.c_str(),
+			toString(process->spawnerCreationTime).c_str(),
+			toString(process->spawnStartTime).c_str(),
+			process->cpuAffinity.c_str(),
+			toString(process->sockets->size()).c_str(),
+			(process->errorPipe != -1) ? "true" : "false",
+			NULL);
+		for (it = process->sockets->begin(); it != end; it++) {
+			writeArrayMessage(fd, timeout,
+				"socket",
+				it->name.c_str(),
+				it->address.c_str(),
+				it->protocol.c_str(),
+				toString(it->concurrency).c_str(),
+				it->keepAlive ? "true" : "false",
+				NULL);
+		}
+		writeFileDescriptorWithNegotiation(fd, process->adminSocket, timeout);
+		if (process->errorPipe != -1) {
+			writeFileDescriptorWithNegotiation(fd, process->errorPipe, timeout);
+		}
+	}
+
+public:
+	HandoffHandler(const FileDescriptor &_requestSocket, const FileDescriptor &_httpSocket,
+		const PoolPtr &_pool, PendingHandoff &_pendingHandoff)
+		: requestSocket(_requestSocket),
+		  httpSocket(_httpSocket),
+		  pool(_pool),
+		  pendingHandoff(_pendingHandoff)
+		{ }
+
+	virtual bool processMessage(MessageServer::CommonClientContext &commonContext,
+	                            MessageServer::ClientContextPtr &handlerSpecificContext,
+	                            const vector<string> &args)
+	{
+		if (args[0] == "handoff") {
+			TRACE_POINT();
+			commonContext.requireRights(Account::HANDOFF);
+			unsigned long long timeout = HANDOFF_TIMEOUT_MSEC * 1000ull;
+			vector<ProcessPtr> processes;
+			vector<string> reply;
+
+			// Processes that are already shutting down stay with us.
+			foreach (const ProcessPtr &process, pool->getProcesses()) {
+				// Remote processes are shut down by their RemoteAgents
+				// once we exit.
+				if (process->isAlive() && !process->isRemote()) {
+					processes.push_back(process);
+				}
+			}
+
+			P_WARN("Handing off the request socket and " << processes.size() <<
+				" application processes to a new helper agent...");
+			writeArrayMessage(commonContext.fd, &timeout, "request socket", NULL);
+			writeFileDescriptorWithNegotiation(commonContext.fd, requestSocket, &timeout);
+			if (httpSocket != -1) {
+				writeArrayMessage(commonContext.fd, &timeout, "http socket", NULL);
+				writeFileDescriptorWithNegotiation(commonContext.fd, httpSocket, &timeout);
+			}
+			foreach (const ProcessPtr &process, processes) {
+				writeProcess(commonContext.fd, process, &timeout);
+			}
+			writeArrayMessage(commonContext.fd, &timeout, "end", NULL);
+
+			UPDATE_TRACE_POINT();
+			if (!readArrayMessage(commonContext.fd, reply, &timeout)
+			 || reply.size() != 1 || reply[0] != "done")
+			{
+				throw IOException("The new helper agent did not finish the handoff");
+			}
+			boost::lock_guard<boost::mutex> l(pendingHandoff.syncher);
+			pendingHandoff.pending = true;
+			pendingHandoff.processes = processes;
+			return true;
+		} else {
+			return false;
+		}
+	}
+};
+
 /**
  * A representation of the Server responsible for handling Client instances.
  *
@@ -248,31 +519,52 @@ public:
  */
 class Server {
 private:
-	static const int MESSAGE_SERVER_THREAD_STACK_SIZE = 128 * 1024;
 	static const int EVENT_LOOP_THREAD_STACK_SIZE = 256 * 1024;
 	
 	FileDescriptor feedbackFd;
 	const AgentOptions &options;
 	
 	BackgroundEventLoop poolLoop;
-	BackgroundEventLoop requestLoop;
+	/** Runs the admin MessageServer, whose handlers run in its own worker threads. */
+	BackgroundEventLoop adminLoop;
+	/**
+	 * Each request loop runs its own RequestHandler. All handlers accept
+	 * from the same non-blocking request socket and share the same pool.
+	 */
+	vector<BackgroundEventLoopPtr> requestLoops;
 
 	FileDescriptor requestSocket;
+	/** Accepts HTTP clients directly, see AgentOptions::httpAddress. -1 if disabled. */
+	FileDescriptor httpSocket;
 	ServerInstanceDir serverInstanceDir;
 	ServerInstanceDir::GenerationPtr generation;
 	UnionStation::LoggerFactoryPtr loggerFactory;
 	RandomGeneratorPtr randomGenerator;
 	SpawnerFactoryPtr spawnerFactory;
 	PoolPtr pool;
+	/** Tells the web server modules which application groups' request queues are full. */
+	PoolStatusTablePtr poolStatusTable;
+	ev::timer poolStatusTimer;
 	ev::sig sigquitWatcher;
 	AccountsDatabasePtr accountsDatabase;
-	MessageServerPtr messageServer;
+	PooledMessageServerPtr messageServer;
 	ResourceLocator resourceLocator;
-	boost::shared_ptr<RequestHandler> requestHandler;
+	vector<RequestHandlerPtr> requestHandlers;
+	RequestLatencyStatsPtr latencyStats;
+	CompressionPoolPtr compressionPool;
+	ResponseDrainerPtr responseDrainer;
+	FileBackedPipe::MemoryBudgetPtr bufferMemoryBudget;
 	boost::shared_ptr<oxt::thread> prestarterThread;
-	boost::shared_ptr<oxt::thread> messageServerThread;
 	boost::shared_ptr<oxt::thread> eventLoopThread;
 	EventFd exitEvent;
+	PendingHandoff pendingHandoff;
+
+	ProcessJournalPtr processJournal;
+
+	/** A process that the previous helper agent has handed off to us, or
+	 * that we've recovered after it crashed, before the pool exists. */
+	typedef ProcessJournal::Entry HandedOffProcess;
+	vector<HandedOffProcess> handedOffProcesses;
 	
 	/**
 	 * Starts listening for client connections on this server's request socket.
@@ -280,6 +572,180 @@ private:
 	 * @throws SystemException Something went wrong while trying to create and bind to the Unix socket.
 	 * @throws RuntimeException Something went wrong.
 	 */
+	void onPoolStatusTimeout(ev::timer &timer, int revents) {
+		TRACE_POINT();
+		PoolSnapshotPtr snapshot = pool->getStatsSnapshot(250000);
+		vector<PoolStatusTable::GroupState> states;
+		vector<SuperGroupSnapshot>::const_iterator sg_it, sg_end = snapshot->superGroups.end();
+
+		states.reserve(snapshot->superGroups.size());
+		for (sg_it = snapshot->superGroups.begin(); sg_it != sg_end; sg_it++) {
+			// Requests are queued on the default group, unless the
+			// SuperGroup is still initializing.
+			vector<GroupSnapshot>::const_iterator g_it, g_end = sg_it->groups.end();
+			for (g_it = sg_it->groups.begin(); g_it != g_end; g_it++) {
+				if (g_it->isDefault) {
+					states.push_back(PoolStatusTable::GroupState(sg_it->name,
+						g_it->getWaitlistSize, g_it->maxRequestQueueSize));
+					break;
+				}
+			}
+		}
+		poolStatusTable->update(states, time(NULL));
+	}
+
+	static void readHandoffMessage(MessageClient &client, vector<string> &args,
+		const char *name, unsigned int size, unsigned long long *timeout)
+	{
+		if (!client.read(args, timeout)) {
+			throw IOException("The previous helper agent closed the connection during the handoff");
+		} else if (args.size() != size || args[0] != name) {
+			throw IOException(string("Expected a '") + name + "' message from the "
+				"previous helper agent");
+		}
+	}
+
+	/**
+	 * Takes over the request socket and the application processes from the
+	 * helper agent that we're replacing. See HandoffHandler.
+	 */
+	void receiveHandoff() {
+		TRACE_POINT();
+		unsigned long long timeout = HANDOFF_TIMEOUT_MSEC * 1000ull;
+		MessageClient client;
+		vector<string> args;
+
+		client.connect(options.adminSocketAddress, "_handoff", options.exitPassword);
+		client.write("handoff", NULL);
+		client.checkSecurityResponse(&timeout);
+		readHandoffMessage(client, args, "request socket", 1, &timeout);
+		requestSocket = FileDescriptor(readFileDescriptorWithNegotiation(
+			client.getConnection(), &timeout));
+
+		UPDATE_TRACE_POINT();
+		while (true) {
+			if (!client.read(args, &timeout)) {
+				throw IOException("The previous helper agent closed the connection during the handoff");
+			} else if (args.size() == 1 && args[0] == "end") {
+				break;
+			} else if (args.size() == 1 && args[0] == "http socket") {
+				httpSocket = FileDescriptor(readFileDescriptorWithNegotiation(
+					client.getConnection(), &timeout));
+				continue;
+			} else if (args.size() != 10 || args[0] != "process") {
+				throw IOException("Expected a 'process' message from the previous helper agent");
+			}
+
+			HandedOffProcess process;
+			unsigned int socketCount = atoi(args[8]);
+			bool hasErrorPipe = args[9] == "true";
+			process.groupName = args[1];
+			process.pid = (pid_t) atoi(args[2]);
+			process.gupid = args[3];
+			process.connectPassword = args[4];
+			process.spawnerCreationTime = stringToULL(args[5]);
+			process.spawnStartTime = stringToULL(args[6]);
+			process.cpuAffinity = args[7];
+			process.sockets = boost::make_shared<SocketList>();
+			for (unsigned int i = 0; i < socketCount; i++) {
+				readHandoffMessage(client, args, "socket", 6, &timeout);
+				process.sockets->add(args[1], args[2], args[3], atoi(args[4]),
+					args[5] == "true");
+			}
+			process.adminSocket = FileDescriptor(readFileDescriptorWithNegotiation(
+				client.getConnection(), &timeout));
+			if (hasErrorPipe) {
+				process.errorPipe = FileDescriptor(readFileDescriptorWithNegotiation(
+					client.getConnection(), &timeout));
+			}
+			handedOffProcesses.push_back(process);
+		}
+
+		client.write("done", NULL);
+		setNonBlocking(requestSocket);
+		if (httpSocket != -1) {
+			setNonBlocking(httpSocket);
+		}
+		P_WARN("Took over the request socket and " << handedOffProcesses.size() <<
+			" application processes from the previous helper agent");
+	}
+
+	string getProcessJournalFilename() const {
+		return generation->getPath() + "/process_journal";
+	}
+
+	/**
+	 * Takes back the application processes that the previous helper agent
+	 * left behind when it crashed, see ProcessJournal.
+	 */
+	void recoverProcesses() {
+		TRACE_POINT();
+		try {
+			handedOffProcesses = ProcessJournal::recover(getProcessJournalFilename(),
+				options.processKeeperAddress, options.processKeeperPassword);
+		} catch (const tracable_exception &e) {
+			P_WARN("Cannot recover the application processes of the previous "
+				"helper agent: " << e.what());
+			handedOffProcesses.clear();
+		}
+		if (!handedOffProcesses.empty()) {
+			P_WARN("Recovered " << handedOffProcesses.size() <<
+				" application processes from the previous helper agent");
+		}
+	}
+
+	void adoptHandedOffProcesses() {
+		foreach (const HandedOffProcess &info, handedOffProcesses) {
+			ProcessPtr process = boost::make_shared<Process>(poolLoop.safe,
+				info.pid, info.gupid, info.connectPassword,
+				info.adminSocket, info.errorPipe, info.sockets,
+				info.spawnerCreationTime, info.spawnStartTime);
+			process->cpuAffinity = info.cpuAffinity;
+			pool->addHandedOffProcess(info.groupName, process);
+		}
+		handedOffProcesses.clear();
+	}
+
+	/**
+	 * Called once the watchdog has accepted the helper agent that we've
+	 * handed off to. Stops accepting clients, lets the clients that are
+	 * still connected finish, and exits without shutting down the
+	 * application processes, which belong to the new helper agent now.
+	 */
+	void finishHandoff() {
+		TRACE_POINT();
+		P_WARN("Handoff complete; exiting once all clients have disconnected...");
+		{
+			boost::lock_guard<boost::mutex> l(pendingHandoff.syncher);
+			pool->markHandedOff(pendingHandoff.processes);
+		}
+		if (processJournal != NULL) {
+			// The processes that we haven't handed off must exit with us.
+			foreach (const ProcessPtr &process, pool->getProcesses()) {
+				if (!process->handedOff) {
+					processJournal->detached(process);
+				}
+			}
+			processJournal->stop();
+		}
+		poolLoop.safe->stop(poolStatusTimer);
+		foreach (const RequestHandlerPtr &requestHandler, requestHandlers) {
+			requestHandler->stopAccepting();
+		}
+		UPDATE_TRACE_POINT();
+		while (!allRequestHandlersInactive(1)) {
+			syscalls::usleep(100000);
+		}
+		P_DEBUG("All clients have disconnected. Exiting.");
+		stopAsyncLogging();
+		_exit(0);
+	}
+
+	bool handoffPending() {
+		boost::lock_guard<boost::mutex> l(pendingHandoff.syncher);
+		return pendingHandoff.pending;
+	}
+
 	void startListening() {
 		this_thread::disable_syscall_interruption dsi;
 		requestSocket = createUnixServer(getRequestSocketFilename().c_str());
@@ -375,7 +841,7 @@ private:
 	}
 	
 	void onSigquit(ev::sig &signal, int revents) {
-		requestHandler->inspect(cerr);
+		inspectRequestHandlers(cerr, requestHandlers);
 		cerr.flush();
 		cerr << "\n" << pool->inspect();
 		cerr.flush();
@@ -395,7 +861,7 @@ private:
 		Server *self = (Server *) userData;
 
 		cerr << "### Request handler state\n";
-		self->requestHandler->inspect(cerr);
+		inspectRequestHandlers(cerr, self->requestHandlers);
 		cerr << "\n";
 		cerr.flush();
 		
@@ -420,7 +886,6 @@ private:
 public:
 	Server(FileDescriptor feedbackFd, const AgentOptions &_options)
 		: options(_options),
-		  requestLoop(true),
 		  serverInstanceDir(_options.serverInstanceDir, false),
 		  resourceLocator(options.passengerRoot)
 	{
@@ -429,18 +894,46 @@ public:
 		
 		UPDATE_TRACE_POINT();
 		generation = serverInstanceDir.getGeneration(options.generationNumber);
-		startListening();
+		if (options.handoff) {
+			try {
+				receiveHandoff();
+			} catch (const tracable_exception &e) {
+				P_WARN("Cannot take over from the previous helper agent, "
+					"starting afresh instead: " << e.what());
+				requestSocket = FileDescriptor();
+				httpSocket = FileDescriptor();
+				handedOffProcesses.clear();
+			}
+		} else if (!options.processKeeperAddress.empty()) {
+			recoverProcesses();
+		}
+		if (requestSocket == -1) {
+			startListening();
+		}
+		if (httpSocket == -1 && !options.httpAddress.empty()) {
+			httpSocket = createServer(options.httpAddress);
+			setNonBlocking(httpSocket);
+		}
 		accountsDatabase = boost::make_shared<AccountsDatabase>();
 		accountsDatabase->add("_passenger-status", options.adminToolStatusPassword, false,
 			Account::INSPECT_BASIC_INFO | Account::INSPECT_SENSITIVE_INFO |
 			Account::INSPECT_BACKTRACES | Account::INSPECT_REQUESTS |
 			Account::RESTART);
 		accountsDatabase->add("_web_server", options.exitPassword, false, Account::EXIT);
-		messageServer = boost::make_shared<MessageServer>(
-			parseUnixSocketAddress(options.adminSocketAddress), accountsDatabase);
+		accountsDatabase->add("_handoff", options.exitPassword, false, Account::HANDOFF);
+		messageServer = boost::make_shared<PooledMessageServer>(adminLoop.safe,
+			parseUnixSocketAddress(options.adminSocketAddress), accountsDatabase,
+			options.adminServerThreads);
 		
 		createFile(generation->getPath() + "/helper_agent.pid",
 			toString(getpid()), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (!options.processKeeperAddress.empty()) {
+			processJournal = boost::make_shared<ProcessJournal>(
+				getProcessJournalFilename(), options.processKeeperAddress,
+				options.processKeeperPassword, handedOffProcesses);
+		}
+		poolStatusTable = boost::make_shared<PoolStatusTable>(
+			PoolStatusTable::getFilename(generation->getPath()), true);
 		
 		if (geteuid() == 0 && !options.userSwitching) {
 			lowerPrivilege(options.defaultUser, options.defaultGroup);
@@ -458,21 +951,82 @@ public:
 		UPDATE_TRACE_POINT();
 		loggerFactory = boost::make_shared<UnionStation::LoggerFactory>(options.loggingAgentAddress,
 			"logging", options.loggingAgentPassword);
+		// Don't let analytics logging wait for the logging agent on the request path.
+		loggerFactory->setBufferMessages(true);
+		// RequestHandler opens several ScopeLogs per request; don't make
+		// two getrusage() calls for each of them.
+		loggerFactory->setLightweightScopeLogs(true);
+		if (!options.loggingAgentDatagramAddress.empty()) {
+			loggerFactory->setDatagramAddress(options.loggingAgentDatagramAddress);
+		}
+		SpawnerConfigPtr spawnerConfig = boost::make_shared<SpawnerConfig>(randomGenerator);
+		spawnerConfig->remoteAgentPassword = options.remoteAgentPassword;
+		spawnerConfig->cgroupManager = boost::make_shared<CgroupManager>(options.cgroupRoot);
 		spawnerFactory = boost::make_shared<SpawnerFactory>(poolLoop.safe,
-			resourceLocator, generation, boost::make_shared<SpawnerConfig>(randomGenerator));
+			resourceLocator, generation, spawnerConfig);
 		pool = boost::make_shared<Pool>(spawnerFactory, loggerFactory,
 			randomGenerator, &options);
 		pool->initialize();
 		pool->setMax(options.maxPoolSize);
 		pool->setMaxIdleTime(options.poolIdleTime * 1000000);
+		pool->setMaxDormancyIdleTime(options.poolDormancyIdleTime * 1000000ull);
+		pool->setScaleDownInterval(options.poolScaleDownInterval * 1000000ull);
+		pool->setMaxConcurrentSpawns(options.maxConcurrentSpawns);
+		pool->setSpawnConcurrency(options.spawnConcurrency);
+		pool->journal = processJournal;
+		adoptHandedOffProcesses();
+		poolStatusTimer.set<Server, &Server::onPoolStatusTimeout>(this);
+		poolStatusTimer.set(0, 0.25);
 		
-		requestHandler = boost::make_shared<RequestHandler>(requestLoop.safe,
-			requestSocket, pool, options);
+		latencyStats = boost::make_shared<RequestLatencyStats>();
+		if (options.responseCompressionThreads > 0) {
+			compressionPool = boost::make_shared<CompressionPool>(
+				options.responseCompressionThreads);
+		}
+		if (options.drainSlowClients) {
+			responseDrainer = boost::make_shared<ResponseDrainer>(60, pool->metrics);
+		}
+		bufferMemoryBudget = boost::make_shared<FileBackedPipe::MemoryBudget>(
+			options.bufferMemoryLimit);
+		for (unsigned int i = 0; i < options.requestHandlerThreads; i++) {
+			BackgroundEventLoopPtr requestLoop = boost::make_shared<BackgroundEventLoop>(true);
+			RequestHandlerPtr requestHandler = boost::make_shared<RequestHandler>(requestLoop->safe,
+				requestSocket, pool, options);
+			if (httpSocket != -1) {
+				requestHandler->listenForHttp(httpSocket);
+			}
+			requestHandler->latencyStats = latencyStats;
+			requestHandler->compressionPool = compressionPool;
+			requestHandler->responseDrainer = responseDrainer;
+			requestHandler->bufferMemoryBudget = bufferMemoryBudget;
+			if (options.responseCacheSize > 0) {
+				requestHandler->responseCache = boost::make_shared<ResponseCache>(
+					options.responseCacheSize / options.requestHandlerThreads);
+			}
+			if (options.staticFileCacheSize > 0) {
+				requestHandler->staticFileCache = boost::make_shared<StaticFileCache>(
+					options.staticFileCacheSize);
+			}
+			requestLoops.push_back(requestLoop);
+			requestHandlers.push_back(requestHandler);
+		}
+		if (options.requestLoopAffinity && requestHandlers.size() > 1) {
+			vector<RequestHandler *> handlers;
+			foreach (const RequestHandlerPtr &requestHandler, requestHandlers) {
+				handlers.push_back(requestHandler.get());
+			}
+			foreach (const RequestHandlerPtr &requestHandler, requestHandlers) {
+				requestHandler->requestLoopHandlers = handlers;
+			}
+		}
 
-		messageServer->addHandler(boost::make_shared<RemoteController>(requestHandler, pool));
+		messageServer->addHandler(boost::make_shared<RemoteController>(requestHandlers,
+			latencyStats, pool));
 		messageServer->addHandler(ptr(new ExitHandler(exitEvent)));
+		messageServer->addHandler(boost::make_shared<HandoffHandler>(requestSocket,
+			httpSocket, pool, boost::ref(pendingHandoff)));
 
-		sigquitWatcher.set(requestLoop.loop);
+		sigquitWatcher.set(requestLoops[0]->loop);
 		sigquitWatcher.set(SIGQUIT);
 		sigquitWatcher.set<Server, &Server::onSigquit>(this);
 		sigquitWatcher.start();
@@ -501,18 +1055,24 @@ public:
 		
 		P_DEBUG("Shutting down helper agent...");
 		prestarterThread->interrupt_and_join();
-		if (messageServerThread != NULL) {
-			messageServerThread->interrupt_and_join();
-		}
-		
+		adminLoop.stop();
 		messageServer.reset();
+		if (poolLoop.isStarted()) {
+			poolLoop.safe->stop(poolStatusTimer);
+		}
 		P_DEBUG("Destroying application pool...");
-		pool->destroy();
+		pool->destroy(options.poolShutdownTimeout * 1000000ull);
 		uninstallDiagnosticsDumper();
 		pool.reset();
+		processJournal.reset();
 		poolLoop.stop();
-		requestLoop.stop();
-		requestHandler.reset();
+		foreach (const BackgroundEventLoopPtr &requestLoop, requestLoops) {
+			requestLoop->stop();
+		}
+		requestHandlers.clear();
+		compressionPool.reset();
+		responseDrainer.reset();
+		bufferMemoryBudget.reset();
 
 		if (!options.requestSocketLink.empty()) {
 			char path[PATH_MAX + 1];
@@ -540,16 +1100,16 @@ public:
 	
 	void mainLoop() {
 		TRACE_POINT();
-		boost::function<void ()> func;
-
-		func = boost::bind(&MessageServer::mainLoop, messageServer.get());
-		messageServerThread = ptr(new oxt::thread(
-			boost::bind(runAndPrintExceptions, func, true),
-			"MessageServer thread", MESSAGE_SERVER_THREAD_STACK_SIZE
-		));
-		
+		adminLoop.start("Admin event loop", 0);
 		poolLoop.start("Pool event loop", 0);
-		requestLoop.start("Request event loop", 0);
+		poolLoop.safe->start(poolStatusTimer);
+		if (requestLoops.size() == 1) {
+			requestLoops[0]->start("Request event loop", 0);
+		} else {
+			for (unsigned int i = 0; i < requestLoops.size(); i++) {
+				requestLoops[i]->start("Request event loop " + toString(i + 1), 0);
+			}
+		}
 
 		
 		/* Wait until the watchdog closes the feedback fd (meaning it
@@ -571,7 +1131,12 @@ public:
 			throw SystemException("select() failed", e);
 		}
 		
-		if (FD_ISSET(feedbackFd, &fds)) {
+		if (FD_ISSET(feedbackFd, &fds) && handoffPending()) {
+			/* The watchdog closes the feedback fd when it has replaced
+			 * us with the helper agent that we've handed off to.
+			 */
+			finishHandoff();
+		} else if (FD_ISSET(feedbackFd, &fds)) {
 			/* If the watchdog has been killed then we'll kill all descendant
 			 * processes and exit. There's no point in keeping this helper
 			 * server running because we can't detect when the web server exits,
@@ -581,6 +1146,7 @@ public:
 			 * inaccessible.
 			 */
 			P_DEBUG("Watchdog seems to be killed; forcing shutdown of all subprocesses");
+			stopAsyncLogging();
 			syscalls::killpg(getpgrp(), SIGKILL);
 			_exit(2); // In case killpg() fails.
 		} else {
@@ -589,8 +1155,10 @@ public:
 			 */
 			P_DEBUG("Received command to exit gracefully. "
 				"Waiting until 5 seconds after all clients have disconnected...");
-			requestHandler->resetInactivityTime();
-			while (requestHandler->inactivityTime() < 5000) {
+			foreach (const RequestHandlerPtr &requestHandler, requestHandlers) {
+				requestHandler->resetInactivityTime();
+			}
+			while (!allRequestHandlersInactive(5000)) {
 				syscalls::usleep(250000);
 			}
 			P_DEBUG("It's now 5 seconds after all clients have disconnected. "
@@ -598,6 +1166,15 @@ public:
 		}
 	}
 
+	bool allRequestHandlersInactive(unsigned long long msec) const {
+		foreach (const RequestHandlerPtr &requestHandler, requestHandlers) {
+			if (requestHandler->inactivityTime() < msec) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 	string getRequestSocketFilename() const {
 		return options.requestSocketFilename;
 	}
@@ -628,6 +1205,9 @@ main(int argc, char *argv[]) {
 
 	P_DEBUG("Starting PassengerHelperAgent...");
 	MultiLibeio::init();
+	// Request handling threads shouldn't wait for the log output,
+	// especially at the debug log levels.
+	startAsyncLogging();
 	
 	try {
 		UPDATE_TRACE_POINT();
@@ -638,11 +1218,13 @@ main(int argc, char *argv[]) {
 		UPDATE_TRACE_POINT();
 		server.mainLoop();
 	} catch (const tracable_exception &e) {
+		stopAsyncLogging();
 		P_ERROR("*** ERROR: " << e.what() << "\n" << e.backtrace());
 		return 1;
 	}
 	
 	MultiLibeio::shutdown();
 	P_TRACE(2, "Helper agent exiting with code 0.");
+	stopAsyncLogging();
 	return 0;
 }
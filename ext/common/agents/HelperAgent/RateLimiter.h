@@ -0,0 +1,213 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_RATE_LIMITER_H_
+#define _PASSENGER_RATE_LIMITER_H_
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <algorithm>
+#include <vector>
+#include <StaticString.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * Limits the request rate and the number of concurrent requests per key,
+ * e.g. per client IP address, in a fixed amount of memory regardless of how
+ * many distinct keys there are.
+ *
+ * The state is kept in a count-min sketch: DEPTH rows of `width` cells, where
+ * each key maps to one cell per row. Each cell holds a token bucket and a
+ * concurrency counter. Other keys that share a cell can only have consumed
+ * more tokens from it and added more concurrency to it, so a key's estimate
+ * is the most tokens and the least concurrency over its cells. A key is only
+ * limited because of another key if it shares all DEPTH cells with keys that
+ * are over the limit, so well-behaved clients are very rarely limited
+ * because of abusive ones. Hashes are seeded per RateLimiter so that
+ * collisions can't be precomputed.
+ *
+ * Not thread-safe. Each RequestHandler has its own RateLimiter, which is only
+ * used from its event loop, so no locking is needed.
+ */
+class RateLimiter: public boost::noncopyable {
+public:
+	static const unsigned int DEPTH = 4;
+
+	enum Result {
+		ALLOWED,
+		RATE_LIMITED,
+		CONCURRENCY_LIMITED
+	};
+
+private:
+	struct Cell {
+		float tokens;
+		unsigned int concurrency;
+		unsigned long long lastRefill;
+	};
+
+	vector<Cell> cells;
+	unsigned int width;
+	boost::uint64_t seed;
+
+	Cell &cellFor(boost::uint64_t hash, unsigned int row) {
+		// Derives the DEPTH indices from two halves of one hash
+		// (Kirsch-Mitzenmacher).
+		boost::uint32_t h1 = (boost::uint32_t) hash;
+		boost::uint32_t h2 = (boost::uint32_t) (hash >> 32) | 1;
+		return cells[row * width + (h1 + row * h2) % width];
+	}
+
+	static void refill(Cell &cell, double rate, double burst, unsigned long long now) {
+		if (cell.lastRefill == 0) {
+			cell.tokens = (float) burst;
+		} else if (now > cell.lastRefill) {
+			double tokens = cell.tokens + (now - cell.lastRefill) * rate / 1000000.0;
+			cell.tokens = (float) std::min(tokens, burst);
+		}
+		cell.lastRefill = now;
+	}
+
+public:
+	RateLimiter(unsigned int width = 4096, boost::uint64_t seed = 0)
+		: cells(DEPTH * width),
+		  width(width),
+		  seed(seed)
+	{
+		for (unsigned int i = 0; i < cells.size(); i++) {
+			cells[i].tokens = 0;
+			cells[i].concurrency = 0;
+			cells[i].lastRefill = 0;
+		}
+	}
+
+	/**
+	 * Hashes the given key with this RateLimiter's seed. `part1` and `part2`
+	 * are hashed as if separated by a NUL byte.
+	 */
+	boost::uint64_t hash(const StaticString &part1, const StaticString &part2 = StaticString()) const {
+		// FNV-1a, followed by a 64-bit finalizer for better bit dispersion.
+		boost::uint64_t result = 14695981039346656037ull ^ seed;
+		for (string::size_type i = 0; i < part1.size(); i++) {
+			result = (result ^ (unsigned char) part1[i]) * 1099511628211ull;
+		}
+		result *= 1099511628211ull;
+		for (string::size_type i = 0; i < part2.size(); i++) {
+			result = (result ^ (unsigned char) part2[i]) * 1099511628211ull;
+		}
+		result ^= result >> 33;
+		result *= 0xff51afd7ed558ccdull;
+		result ^= result >> 33;
+		result *= 0xc4ceb9fe1a85ec53ull;
+		result ^= result >> 33;
+		return result;
+	}
+
+	/**
+	 * Decides whether a request with the given key hash may proceed.
+	 *
+	 * @param rate The number of requests per second that each key may make
+	 *    on average, or 0 for no rate limit.
+	 * @param burst The number of requests that a key may make at once after
+	 *    having been idle. At least 1.
+	 * @param maxConcurrency The maximum number of requests that a key may
+	 *    have in progress, or 0 for no limit.
+	 * @param now The current monotonic time in microseconds.
+	 *
+	 * If the result is ALLOWED and maxConcurrency is not 0, then the request
+	 * is counted as in progress until release() is called with the same hash.
+	 */
+	Result admit(boost::uint64_t keyHash, double rate, double burst,
+		unsigned int maxConcurrency, unsigned long long now)
+	{
+		float maxTokens = 0;
+		unsigned int minConcurrency = 0;
+
+		burst = std::max(burst, 1.0);
+		for (unsigned int row = 0; row < DEPTH; row++) {
+			Cell &cell = cellFor(keyHash, row);
+			if (rate > 0) {
+				refill(cell, rate, burst, now);
+			}
+			if (row == 0 || cell.tokens > maxTokens) {
+				maxTokens = cell.tokens;
+			}
+			if (row == 0 || cell.concurrency < minConcurrency) {
+				minConcurrency = cell.concurrency;
+			}
+		}
+
+		if (rate > 0 && maxTokens < 1) {
+			return RATE_LIMITED;
+		}
+		if (maxConcurrency > 0 && minConcurrency >= maxConcurrency) {
+			return CONCURRENCY_LIMITED;
+		}
+		for (unsigned int row = 0; row < DEPTH; row++) {
+			Cell &cell = cellFor(keyHash, row);
+			if (rate > 0) {
+				cell.tokens = std::max(cell.tokens - 1, 0.0f);
+			}
+			if (maxConcurrency > 0) {
+				cell.concurrency++;
+			}
+		}
+		return ALLOWED;
+	}
+
+	/** Marks a request that was admitted with a concurrency limit as done. */
+	void release(boost::uint64_t keyHash) {
+		for (unsigned int row = 0; row < DEPTH; row++) {
+			Cell &cell = cellFor(keyHash, row);
+			if (cell.concurrency > 0) {
+				cell.concurrency--;
+			}
+		}
+	}
+
+	/** The estimated number of requests in progress for the given key. */
+	unsigned int getConcurrency(boost::uint64_t keyHash) {
+		unsigned int result = cellFor(keyHash, 0).concurrency;
+		for (unsigned int row = 1; row < DEPTH; row++) {
+			result = std::min(result, cellFor(keyHash, row).concurrency);
+		}
+		return result;
+	}
+
+	size_t getMemoryUsage() const {
+		return cells.size() * sizeof(Cell);
+	}
+};
+
+typedef boost::shared_ptr<RateLimiter> RateLimiterPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_RATE_LIMITER_H_ */
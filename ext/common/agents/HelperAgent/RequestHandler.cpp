@@ -38,23 +38,60 @@ Client::getSafeLibev() const {
 	return requestHandler->libev;
 }
 
-unsigned int
-Client::getConnectPasswordTimeout(const RequestHandler *handler) const {
-	return handler->connectPasswordTimeout;
+void
+Client::startConnectPasswordTimeout(RequestHandler *handler) {
+	handler->scheduleClientTimeout(this, handler->connectPasswordTimeout);
+}
+
+const FileBackedPipe::BufferPoolPtr &
+Client::getPipeBufferPool() const {
+	return requestHandler->pipeBufferPool;
+}
+
+const FileBackedPipe::MemoryBudgetPtr &
+Client::getPipeMemoryBudget() const {
+	return requestHandler->bufferMemoryBudget;
+}
+
+const FileBackedPipe::SpillFilePoolPtr &
+Client::getSpillFilePool() const {
+	return requestHandler->spillFilePool;
+}
+
+Metric *
+Client::getBufferSpillMetric() const {
+	return requestHandler->bufferSpillsMetric;
+}
+
+const EventedBufferedInputBufferPoolPtr &
+Client::getInputBufferPool() const {
+	return requestHandler->inputBufferPool;
 }
 
 size_t
-Client::onClientInputData(const EventedBufferedInputPtr &source, const StaticString &data) {
+Client::onClientInputData(const PooledEventedBufferedInputPtr &source, const StaticString &data) {
 	Client *client = (Client *) source->userData;
 	if (client != NULL) {
-		return client->requestHandler->onClientInputData(client->shared_from_this(), data);
+		// The client may be disassociated from its RequestHandler by the time this returns.
+		RequestHandler *handler = client->requestHandler;
+		ScopedLoopTimer timer(handler->loopTimeStats.get(), LPC_CLIENT_INPUT);
+		size_t consumed = handler->onClientInputData(client->shared_from_this(), data);
+		handler->bytesReceivedMetric->add(consumed);
+		return consumed;
 	} else {
 		return 0;
 	}
 }
 
 void
-Client::onClientInputError(const EventedBufferedInputPtr &source, const char *message, int errnoCode) {
+Client::onClientBodyChunk(const char *data, size_t size, void *userData) {
+	Client *client = (Client *) userData;
+	client->requestHandler->onClientBodyChunk(client->shared_from_this(),
+		StaticString(data, size));
+}
+
+void
+Client::onClientInputError(const PooledEventedBufferedInputPtr &source, const char *message, int errnoCode) {
 	Client *client = (Client *) source->userData;
 	if (client != NULL) {
 		client->requestHandler->onClientInputError(client->shared_from_this(), message, errnoCode);
@@ -106,6 +143,7 @@ Client::onClientOutputPipeData(const FileBackedPipePtr &source,
 {
 	Client *client = (Client *) source->userData;
 	if (client != NULL) {
+		ScopedLoopTimer timer(client->requestHandler->loopTimeStats.get(), LPC_CLIENT_OUTPUT);
 		client->requestHandler->onClientOutputPipeData(client->shared_from_this(),
 			data, size, callback);
 	}
@@ -139,14 +177,16 @@ Client::onClientOutputPipeCommit(const FileBackedPipePtr &source) {
 void
 Client::onClientOutputWritable(ev::io &io, int revents) {
 	assert(requestHandler != NULL);
+	ScopedLoopTimer timer(requestHandler->loopTimeStats.get(), LPC_CLIENT_OUTPUT);
 	requestHandler->onClientOutputWritable(shared_from_this());
 }
 
 
 size_t
-Client::onAppInputData(const EventedBufferedInputPtr &source, const StaticString &data) {
+Client::onAppInputData(const PooledEventedBufferedInputPtr &source, const StaticString &data) {
 	Client *client = (Client *) source->userData;
 	if (client != NULL) {
+		ScopedLoopTimer timer(client->requestHandler->loopTimeStats.get(), LPC_APP_IO);
 		return client->requestHandler->onAppInputData(client->shared_from_this(), data);
 	} else {
 		return 0;
@@ -170,7 +210,7 @@ Client::onAppInputChunkEnd(void *userData) {
 }
 
 void
-Client::onAppInputError(const EventedBufferedInputPtr &source, const char *message, int errnoCode) {
+Client::onAppInputError(const PooledEventedBufferedInputPtr &source, const char *message, int errnoCode) {
 	Client *client = (Client *) source->userData;
 	if (client != NULL) {
 		client->requestHandler->onAppInputError(client->shared_from_this(), message, errnoCode);
@@ -181,14 +221,22 @@ Client::onAppInputError(const EventedBufferedInputPtr &source, const char *messa
 void
 Client::onAppOutputWritable(ev::io &io, int revents) {
 	assert(requestHandler != NULL);
+	ScopedLoopTimer timer(requestHandler->loopTimeStats.get(), LPC_APP_IO);
 	requestHandler->onAppOutputWritable(shared_from_this());
 }
 
+void
+Client::onAppSpliceReadable(ev::io &io, int revents) {
+	assert(requestHandler != NULL);
+	ScopedLoopTimer timer(requestHandler->loopTimeStats.get(), LPC_APP_IO);
+	requestHandler->onAppSpliceReadable(shared_from_this());
+}
 
 void
-Client::onTimeout(ev::timer &timer, int revents) {
+Client::onClientSpliceReadable(ev::io &io, int revents) {
 	assert(requestHandler != NULL);
-	requestHandler->onTimeout(shared_from_this());
+	ScopedLoopTimer timer(requestHandler->loopTimeStats.get(), LPC_CLIENT_INPUT);
+	requestHandler->onClientSpliceReadable(shared_from_this());
 }
 
 
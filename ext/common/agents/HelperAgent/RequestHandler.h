@@ -54,6 +54,11 @@
       \|/
   Send request
    body to app
+       |
+       | (if the app switches protocols)
+      \|/
+   Hand over
+   to Tunnel
 
 
 
@@ -88,8 +93,16 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
+#include <algorithm>
+#include <map>
 #include <utility>
 #include <typeinfo>
 #include <cassert>
@@ -100,6 +113,7 @@
 #include <MessageReadersWriters.h>
 #include <Constants.h>
 #include <UnionStation.h>
+#include <DTraceSupport.h>
 #include <ApplicationPool2/Pool.h>
 #include <Utils/StrIntUtils.h>
 #include <Utils/IOUtils.h>
@@ -108,9 +122,23 @@
 #include <Utils/Template.h>
 #include <Utils/Timer.h>
 #include <Utils/Dechunker.h>
+#include <Utils/TimerWheel.h>
+#include <Utils/HeapTrim.h>
+#include <Utils/MemoryArena.h>
+#include <Utils/MD5.h>
+#include <Utils/MetricsRegistry.h>
 #include <agents/HelperAgent/AgentOptions.h>
 #include <agents/HelperAgent/FileBackedPipe.h>
+#include <agents/HelperAgent/HttpRequestParser.h>
+#include <agents/HelperAgent/RequestLatencyStats.h>
+#include <agents/HelperAgent/LoopPriorities.h>
+#include <agents/HelperAgent/RateLimiter.h>
+#include <agents/HelperAgent/ResponseCache.h>
+#include <agents/HelperAgent/ResponseCompressor.h>
+#include <agents/HelperAgent/ResponseDrainer.h>
 #include <agents/HelperAgent/ScgiRequestParser.h>
+#include <agents/HelperAgent/StaticFileCache.h>
+#include <agents/HelperAgent/Tunnel.h>
 
 namespace Passenger {
 
@@ -122,6 +150,15 @@ using namespace ApplicationPool2;
 class RequestHandler;
 
 #define MAX_STATUS_HEADER_SIZE 64
+#define MAX_HTTP_REQUEST_HEADER_SIZE (1024 * 32)
+#define TIMING_SIGNATURE_MAX_AGE 300
+
+#if defined(__linux__) && defined(SPLICE_F_MOVE) && defined(SPLICE_F_NONBLOCK)
+	#define RH_SPLICE_AVAILABLE
+#endif
+#ifdef __linux__
+	#define RH_SENDFILE_AVAILABLE
+#endif
 
 #define RH_ERROR(client, x) P_ERROR("[Client " << client->name() << "] " << x)
 #define RH_WARN(client, x) P_WARN("[Client " << client->name() << "] " << x)
@@ -139,10 +176,15 @@ class Client: public boost::enable_shared_from_this<Client> {
 private:
 	struct ev_loop *getLoop() const;
 	const SafeLibevPtr &getSafeLibev() const;
-	unsigned int getConnectPasswordTimeout(const RequestHandler *handler) const;
+	void startConnectPasswordTimeout(RequestHandler *handler);
+	const FileBackedPipe::BufferPoolPtr &getPipeBufferPool() const;
+	const FileBackedPipe::MemoryBudgetPtr &getPipeMemoryBudget() const;
+	const FileBackedPipe::SpillFilePoolPtr &getSpillFilePool() const;
+	Metric *getBufferSpillMetric() const;
+	const EventedBufferedInputBufferPoolPtr &getInputBufferPool() const;
 
-	static size_t onClientInputData(const EventedBufferedInputPtr &source, const StaticString &data);
-	static void onClientInputError(const EventedBufferedInputPtr &source, const char *message, int errnoCode);
+	static size_t onClientInputData(const PooledEventedBufferedInputPtr &source, const StaticString &data);
+	static void onClientInputError(const PooledEventedBufferedInputPtr &source, const char *message, int errnoCode);
 
 	static void onClientBodyBufferData(const FileBackedPipePtr &source,
 		const char *data, size_t size,
@@ -150,6 +192,7 @@ private:
 	static void onClientBodyBufferEnd(const FileBackedPipePtr &source);
 	static void onClientBodyBufferError(const FileBackedPipePtr &source, int errorCode);
 	static void onClientBodyBufferCommit(const FileBackedPipePtr &source);
+	static void onClientBodyChunk(const char *data, size_t size, void *userData);
 	
 	static void onClientOutputPipeData(const FileBackedPipePtr &source,
 		const char *data, size_t size,
@@ -160,14 +203,14 @@ private:
 	
 	void onClientOutputWritable(ev::io &io, int revents);
 
-	static size_t onAppInputData(const EventedBufferedInputPtr &source, const StaticString &data);
+	static size_t onAppInputData(const PooledEventedBufferedInputPtr &source, const StaticString &data);
 	static void onAppInputChunk(const char *data, size_t size, void *userData);
 	static void onAppInputChunkEnd(void *userData);
-	static void onAppInputError(const EventedBufferedInputPtr &source, const char *message, int errnoCode);
+	static void onAppInputError(const PooledEventedBufferedInputPtr &source, const char *message, int errnoCode);
 	
 	void onAppOutputWritable(ev::io &io, int revents);
-
-	void onTimeout(ev::timer &timer, int revents);
+	void onAppSpliceReadable(ev::io &io, int revents);
+	void onClientSpliceReadable(ev::io &io, int revents);
 
 
 	static const char *boolStr(bool val) {
@@ -179,9 +222,18 @@ private:
 		requestHandler = NULL;
 		state = DISCONNECTED;
 		backgroundOperations = 0;
-		requestBodyIsBuffered = false;
 		freeBufferedConnectPassword();
 		connectedAt = 0;
+		httpFrontend = false;
+		resetRequestFields();
+	}
+
+	/** Resets the fields that only describe the current request, as
+	 * opposed to the connection. */
+	void resetRequestFields() {
+		requestBodyIsBuffered = false;
+		requestBodyIsChunked = false;
+		memset(&phaseTimes, 0, sizeof(phaseTimes));
 		contentLength = 0;
 		clientBodyAlreadyRead = 0;
 		checkoutSessionAfterCommit = false;
@@ -190,7 +242,33 @@ private:
 		sessionCheckoutTry = 0;
 		responseHeaderSeen = false;
 		chunkedResponse = false;
-		appRoot.clear();
+		passThroughChunks = false;
+		keepAliveSession = false;
+		requestBodySent = false;
+		splicingResponse = false;
+		frontendKeepAlive = false;
+		responseBodyless = false;
+		upgraded = false;
+		sendfileFile = FileDescriptor();
+		sendfileOffset = 0;
+		sendfileEnd = 0;
+		sendingFile = false;
+		cachePrimaryKey.clear();
+		stopCachingResponse();
+		collapsingLeader = false;
+		compressor.reset();
+		compressionInput.clear();
+		compressionInFlight = false;
+		compressionEnding = false;
+		compressionThrottled = false;
+		responseStatusCode = 0;
+		unionStationDeferred = false;
+		unionStationSlowThreshold = 0;
+		unionStationError.clear();
+		timingHeader = false;
+		checkoutStartedAt = 0;
+		rateLimitHeld = false;
+		rateLimitKey = 0;
 	}
 
 	void freeScopeLogs() {
@@ -213,27 +291,35 @@ public:
 	 * Do not use this value for anything else as it may not refer to a valid
 	 * file descriptor. */
 	int fdnum;
+	/** Position of this Client in RequestHandler::clientList, while connected. */
+	unsigned int clientListIndex;
 
 
 	/***** Client <-> RequestHandler I/O channels, pipes and watchers *****/
 
 	/** Client input channel. */
-	EventedBufferedInputPtr clientInput;
+	PooledEventedBufferedInputPtr clientInput;
 	/** If request body buffering is turned on, it will be buffered into this FileBackedPipe. */
 	FileBackedPipePtr clientBodyBuffer;
 	/** Client output pipe. */
 	FileBackedPipePtr clientOutputPipe;
 	/** Client output channel watcher. */
 	ev::io clientOutputWatcher;
+	/** Watches the client socket while the request body is being spliced
+	 * directly to the application socket. See RequestHandler::maybeStartSplicingRequestBody(). */
+	ev::io clientSpliceWatcher;
 
 
 	/***** RequestHandler <-> Application I/O channels, pipes and watchers *****/
 
 	/** Application input channel. */
-	EventedBufferedInputPtr appInput;
+	PooledEventedBufferedInputPtr appInput;
 	string appOutputBuffer;
 	/** Application output channel watcher. */
 	ev::io appOutputWatcher;
+	/** Watches the application socket while the response body is being
+	 * spliced directly to the client socket. See RequestHandler::startSplicingResponse(). */
+	ev::io appSpliceWatcher;
 
 
 	/***** State variables *****/
@@ -243,6 +329,7 @@ public:
 		STILL_READING_CONNECT_PASSWORD,
 		READING_HEADER,
 		BUFFERING_REQUEST_BODY,
+		WAITING_FOR_COLLAPSED_RESPONSE,
 		CHECKING_OUT_SESSION,
 		SENDING_HEADER_TO_APP,
 		FORWARDING_BODY_TO_APP,
@@ -264,16 +351,45 @@ public:
 		unsigned int alreadyRead;
 	} bufferedConnectPassword;
 
-	// Used for enforcing the connection timeout.
-	ev::timer timeoutTimer;
+	// Used for enforcing the connection timeout, in RequestHandler::clientTimeouts.
+	TimerWheel::Entry timeoutEntry;
 
 	ev_tstamp connectedAt;
+	/** Monotonic timestamps, in microseconds, at which this request entered
+	 * each phase. Zero if the phase hasn't been reached. */
+	struct PhaseTimes {
+		unsigned long long accepted;
+		unsigned long long headerRead;
+		unsigned long long bodyBuffered;
+		unsigned long long sessionCheckedOut;
+		unsigned long long headerSent;
+		unsigned long long firstResponseByte;
+	} phaseTimes;
 	long long contentLength;
 	unsigned long long clientBodyAlreadyRead;
 	Options options;
 	ScgiRequestParser scgiParser;
+	/** Whether this client speaks HTTP directly instead of being a web server
+	 * that sends SCGI requests. See RequestHandler::listenForHttp(). */
+	bool httpFrontend;
+	/** Parses the request headers of HTTP clients, whose result is then fed
+	 * to scgiParser. */
+	HttpRequestParser httpParser;
+	/** CGI variables that describe an HTTP client's connection, such as
+	 * REMOTE_ADDR, as "NAME\0VALUE\0" pairs. */
+	string httpConnectionEnv;
+	/** Whether an HTTP client sends the request body with chunked transfer
+	 * encoding. requestDechunker decodes it while it's being buffered. */
+	bool requestBodyIsChunked;
+	Dechunker requestDechunker;
 	SessionPtr session;
-	string appRoot;
+	/**
+	 * Per-request data that doesn't outlive the request, like the Union
+	 * Station scope logs and Options::appRoot when it isn't taken from a
+	 * header as-is. Reset when the next request begins, so that the arena
+	 * is sized for the requests that this connection usually serves.
+	 */
+	MemoryArena arena;
 	struct {
 		UnionStation::ScopeLog
 			*requestProcessing,
@@ -282,6 +398,10 @@ public:
 			*requestProxying;
 	} scopeLogs;
 	unsigned int sessionCheckoutTry;
+	/** Set in `options` while checking out a session, so that the queued
+	 * request can be cancelled if the client goes away. Reused for the
+	 * next checkout if the pool no longer refers to it. */
+	GetCancellationPtr checkoutCancellation;
 	bool requestBodyIsBuffered;
 	bool sessionCheckedOut;
 	bool checkoutSessionAfterCommit;
@@ -289,17 +409,113 @@ public:
 
 	bool responseHeaderSeen;
 	bool chunkedResponse;
+	/** Whether the chunked response body is forwarded to the frontend as-is,
+	 * with responseDechunker only tracking where it ends. */
+	bool passThroughChunks;
+	/** Whether the application was asked to keep the session connection open
+	 * after the response, so that it can be checked back into the pool. */
+	bool keepAliveSession;
+	/** Whether the entire request body has been sent to the application. */
+	bool requestBodySent;
+	/** Whether the response body is being forwarded with splice() instead of
+	 * through appInput and clientOutputPipe. */
+	bool splicingResponse;
+	/** Whether the web server asked to keep this connection open after
+	 * the response, so that it can send another request over it. See
+	 * RequestHandler::canKeepAliveFrontend(). */
+	bool frontendKeepAlive;
+	/** Whether the response must not have a body, e.g. because it answers a
+	 * HEAD request. Only determined for HTTP clients. */
+	bool responseBodyless;
+	/** Whether the application switched protocols in response to an Upgrade
+	 * request. The connection is then handed over to a Tunnel as soon as
+	 * nothing is buffered. See RequestHandler::maybeStartTunnel(). */
+	bool upgraded;
+	/** The file that the application asked us to send through an X-Sendfile
+	 * response header, if any. See RequestHandler::prepareSendfileResponse(). */
+	FileDescriptor sendfileFile;
+	/** The part of sendfileFile that hasn't been sent to the client yet. */
+	off_t sendfileOffset;
+	off_t sendfileEnd;
+	/** Whether clientOutputPipe has ended and sendfileFile is now being
+	 * written to the client socket. */
+	bool sendingFile;
 	HttpHeaderBufferer responseHeaderBufferer;
 	Dechunker responseDechunker;
-
-
-	Client() {
+	/** The response header as it is sent to the client, built by
+	 * RequestHandler::processResponseHeader(). Kept between requests so
+	 * that its memory is reused. */
+	string outputHeader;
+
+	/** The RequestHandler::responseCache primary key for this request, or
+	 * empty if the response to this request can't be cached. */
+	string cachePrimaryKey;
+	/** Whether the response is being recorded for the response cache. */
+	bool cachingResponse;
+	/** Request header names that the recorded response varies on. */
+	vector<string> cacheVaryHeaders;
+	/** The recorded response header, without the Date header and without
+	 * the framing that RequestHandler adds. */
+	string cachedHeader;
+	/** The recorded response body, after dechunking. */
+	string cachedBody;
+	/** The response's Content-Length, or -1 if it didn't send one. */
+	long long cachedContentLength;
+	unsigned long long cacheExpiresAt;
+	/** Whether identical requests that arrive while this one is in flight
+	 * wait for its response. See RequestHandler::maybeCollapseRequest(). */
+	bool collapsingLeader;
+
+	/** Compresses the response body, if RequestHandler::compressionPool is
+	 * set and the response is compressible. */
+	ResponseCompressorPtr compressor;
+	/** Response body data that will be passed to the next compression step. */
+	string compressionInput;
+	/** Whether a compression step is running in the compression pool. */
+	bool compressionInFlight;
+	/** Whether the application has sent the entire response, so the next
+	 * compression step must be the last one. */
+	bool compressionEnding;
+	/** Whether appInput was stopped because compression is falling behind. */
+	bool compressionThrottled;
+
+	/** The response's status code, or 0 if it's not known (yet). Only
+	 * recorded if Union Station is enabled for this request. */
+	int responseStatusCode;
+	/** Whether Union Station is enabled for this request but the request
+	 * wasn't sampled. Nothing is logged for it unless it turns out to be
+	 * slow or to fail; see RequestHandler::finishUnionStationRequest(). */
+	bool unionStationDeferred;
+	/** Requests of a deferred Union Station transaction that take at least
+	 * this many microseconds are logged. 0 means never. */
+	unsigned long long unionStationSlowThreshold;
+	/** The first error that a deferred Union Station request was
+	 * disconnected with. */
+	string unionStationError;
+	/** Whether to add an X-Passenger-Timing header to the response. See
+	 * RequestHandler::wantsTimingHeader(). */
+	bool timingHeader;
+	/** SystemTime::getUsec() at which session checkout began. Only recorded
+	 * if timingHeader is set. Compared with the spawn times of the process
+	 * to tell how much of the checkout was spent waiting for a spawn. */
+	unsigned long long checkoutStartedAt;
+	/** Whether this request counts towards its rate limiting key's concurrency
+	 * limit. See RequestHandler::checkRateLimit(). */
+	bool rateLimitHeld;
+	/** The hash of the request's rate limiting key, if rateLimitHeld. */
+	boost::uint64_t rateLimitKey;
+
+
+	Client()
+		: httpParser(MAX_HTTP_REQUEST_HEADER_SIZE)
+	{
 		fdnum = -1;
 
-		clientInput = boost::make_shared< EventedBufferedInput<> >();
+		clientInput = boost::make_shared< EventedBufferedInput<0> >();
 		clientInput->onData   = onClientInputData;
 		clientInput->onError  = onClientInputError;
 		clientInput->userData = this;
+		clientInput->setPriority(getLoopPriority(LPC_CLIENT_INPUT));
 		
 		clientBodyBuffer = boost::make_shared<FileBackedPipe>("/tmp");
 		clientBodyBuffer->userData  = this;
@@ -316,22 +532,32 @@ public:
 		clientOutputPipe->onCommit  = onClientOutputPipeCommit;
 
 		clientOutputWatcher.set<Client, &Client::onClientOutputWritable>(this);
+		setLoopPriority(clientOutputWatcher, LPC_CLIENT_OUTPUT);
 
 		
-		appInput = boost::make_shared< EventedBufferedInput<> >();
+		appInput = boost::make_shared< EventedBufferedInput<0> >();
 		appInput->onData   = onAppInputData;
 		appInput->onError  = onAppInputError;
 		appInput->userData = this;
+		appInput->setPriority(getLoopPriority(LPC_APP_IO));
 		
 		appOutputWatcher.set<Client, &Client::onAppOutputWritable>(this);
+		appSpliceWatcher.set<Client, &Client::onAppSpliceReadable>(this);
+		clientSpliceWatcher.set<Client, &Client::onClientSpliceReadable>(this);
+		setLoopPriority(appOutputWatcher, LPC_APP_IO);
+		setLoopPriority(appSpliceWatcher, LPC_APP_IO);
+		setLoopPriority(clientSpliceWatcher, LPC_CLIENT_INPUT);
 
 
-		timeoutTimer.set<Client, &Client::onTimeout>(this);
+		timeoutEntry.userData = this;
 
 
 		responseDechunker.onData = onAppInputChunk;
 		responseDechunker.onEnd = onAppInputChunkEnd;
 		responseDechunker.userData = this;
+
+		requestDechunker.onData = onClientBodyChunk;
+		requestDechunker.userData = this;
 		
 
 		bufferedConnectPassword.data = NULL;
@@ -352,26 +578,51 @@ public:
 		freeScopeLogs();
 	}
 
-	void associate(RequestHandler *handler, const FileDescriptor &_fd) {
+	/**
+	 * @param http Whether this is an HTTP client rather than a web server.
+	 * @param authenticated Whether the client has already been authenticated
+	 *    by its peer credentials, in which case it doesn't send a connect
+	 *    password.
+	 */
+	void associate(RequestHandler *handler, const FileDescriptor &_fd, bool http = false,
+		bool authenticated = false)
+	{
 		assert(requestHandler == NULL);
 		requestHandler = handler;
 		fd = _fd;
 		fdnum = _fd;
-		state = BEGIN_READING_CONNECT_PASSWORD;
-		connectedAt = ev_time();
+		httpFrontend = http;
+		// HTTP clients don't send a connect password.
+		state = (http || authenticated) ? READING_HEADER : BEGIN_READING_CONNECT_PASSWORD;
+		connectedAt = ev_now(getSafeLibev()->getLoop());
+		phaseTimes.accepted = monotonicTimeUsec();
+		arena.reset();
 
 		clientInput->reset(getSafeLibev().get(), _fd);
+		clientInput->setBufferPool(getInputBufferPool());
 		clientInput->start();
 		clientBodyBuffer->reset(getSafeLibev());
+		clientBodyBuffer->setBufferPool(getPipeBufferPool());
+		clientBodyBuffer->setMemoryBudget(getPipeMemoryBudget());
+		clientBodyBuffer->setSpillFilePool(getSpillFilePool());
+		clientBodyBuffer->setSpillMetric(getBufferSpillMetric());
 		clientOutputPipe->reset(getSafeLibev());
+		clientOutputPipe->setBufferPool(getPipeBufferPool());
+		clientOutputPipe->setMemoryBudget(getPipeMemoryBudget());
+		clientOutputPipe->setSpillFilePool(getSpillFilePool());
+		clientOutputPipe->setSpillMetric(getBufferSpillMetric());
 		clientOutputPipe->start();
 		clientOutputWatcher.set(getLoop());
 		clientOutputWatcher.set(_fd, ev::WRITE);
 
+		appInput->setBufferPool(getInputBufferPool());
 		// appOutputWatcher is initialized in initiateSession.
 
-		timeoutTimer.set(getLoop());
-		timeoutTimer.start(getConnectPasswordTimeout(handler) / 1000.0, 0.0);
+		// For HTTP clients this limits the time until the request header
+		// has been received instead.
+		if (!authenticated) {
+			startConnectPasswordTimeout(handler);
+		}
 	}
 
 	void disassociate() {
@@ -387,9 +638,13 @@ public:
 		appInput->reset(NULL, FileDescriptor());
 		appOutputBuffer.resize(0);
 		appOutputWatcher.stop();
+		appSpliceWatcher.stop();
+		clientSpliceWatcher.stop();
 		
-		timeoutTimer.stop();
+		timeoutEntry.cancel();
 		scgiParser.reset();
+		httpParser.reset();
+		requestDechunker.reset();
 		session.reset();
 		responseHeaderBufferer.reset();
 		responseDechunker.reset();
@@ -408,14 +663,88 @@ public:
 
 		appInput->stop();
 		appOutputWatcher.stop();
+		appSpliceWatcher.stop();
+		clientSpliceWatcher.stop();
 
-		timeoutTimer.stop();
+		timeoutEntry.cancel();
 
 		freeScopeLogs();
 
 		requestHandler = NULL;
 	}
 
+	/**
+	 * Releases everything that a discarded Client still holds on to, such as
+	 * the session and the parsed request header, so that the object can be
+	 * associated with a new connection.
+	 */
+	void prepareForReuse() {
+		assert(reassociateable());
+		clientInput->reset(NULL, FileDescriptor());
+		appInput->reset(NULL, FileDescriptor());
+		appOutputBuffer.resize(0);
+		scgiParser.reset();
+		httpParser.reset();
+		requestDechunker.reset();
+		session.reset();
+		responseHeaderBufferer.reset();
+		responseDechunker.reset();
+	}
+
+	/** Abandons recording the response for the response cache. */
+	void stopCachingResponse() {
+		cachingResponse = false;
+		cacheVaryHeaders.clear();
+		cachedHeader.clear();
+		// Don't hold on to the memory of a large response.
+		string().swap(cachedBody);
+		cachedContentLength = -1;
+		cacheExpiresAt = 0;
+	}
+
+	/**
+	 * Called when a response has been completely sent on a persistent
+	 * frontend connection. Resets all per-request state so that the next
+	 * request on this connection can be read. The connect password is not
+	 * checked again.
+	 */
+	void prepareForNextRequest() {
+		assert(requestHandler != NULL);
+		assert(backgroundOperations == 0);
+		assert(session == NULL);
+		resetRequestFields();
+		state = READING_HEADER;
+		phaseTimes.accepted = monotonicTimeUsec();
+
+		clientBodyBuffer->reset(getSafeLibev());
+		clientOutputPipe->reset(getSafeLibev());
+		clientOutputPipe->start();
+		clientOutputWatcher.stop();
+
+		// appInput is reset in initiateSession.
+		appOutputBuffer.resize(0);
+		appOutputWatcher.stop();
+		appSpliceWatcher.stop();
+		clientSpliceWatcher.stop();
+
+		scgiParser.reset();
+		httpParser.reset();
+		requestDechunker.reset();
+		options = Options();
+		responseHeaderBufferer.reset();
+		responseDechunker.reset();
+		freeScopeLogs();
+		arena.reset();
+		timeoutEntry.cancel();
+		if (httpFrontend) {
+			// Don't keep idle HTTP connections open forever.
+			startConnectPasswordTimeout(requestHandler);
+		}
+
+		// Process any data that the web server has already sent.
+		clientInput->start();
+	}
+
 	bool reassociateable() const {
 		return requestHandler == NULL
 			&& backgroundOperations == 0
@@ -447,6 +776,8 @@ public:
 			return "READING_HEADER";
 		case BUFFERING_REQUEST_BODY:
 			return "BUFFERING_REQUEST_BODY";
+		case WAITING_FOR_COLLAPSED_RESPONSE:
+			return "WAITING_FOR_COLLAPSED_RESPONSE";
 		case CHECKING_OUT_SESSION:
 			return "CHECKING_OUT_SESSION";
 		case SENDING_HEADER_TO_APP:
@@ -472,8 +803,9 @@ public:
 
 	bool shouldHalfCloseWrite() const {
 		// Many broken HTTP servers consider a half close to be a full close, so don't
-		// half close HTTP sessions.
-		return session->getProtocol() == "session";
+		// half close HTTP sessions. Keep-alive sessions must not be half closed
+		// either because the connection is to be reused.
+		return session->getProtocol() == "session" && !keepAliveSession;
 	}
 
 	bool useUnionStation() const {
@@ -486,16 +818,20 @@ public:
 
 	void beginScopeLog(UnionStation::ScopeLog **scopeLog, const char *name) {
 		if (options.logger != NULL) {
-			*scopeLog = new UnionStation::ScopeLog(options.logger, name);
+			*scopeLog = new (arena.allocateFor<UnionStation::ScopeLog>())
+				UnionStation::ScopeLog(options.logger, name);
 		}
 	}
 
 	void endScopeLog(UnionStation::ScopeLog **scopeLog, bool success = true) {
-		if (success && *scopeLog != NULL) {
-			(*scopeLog)->success();
+		if (*scopeLog != NULL) {
+			if (success) {
+				(*scopeLog)->success();
+			}
+			// Allocated from the arena; see beginScopeLog().
+			(*scopeLog)->~ScopeLog();
+			*scopeLog = NULL;
 		}
-		delete *scopeLog;
-		*scopeLog = NULL;
 	}
 
 	void logMessage(const StaticString &message) {
@@ -531,7 +867,9 @@ public:
 			stream << indent << "session initiated           = " << boolStr(session->initiated()) << "\n";
 		}
 		stream
+			<< indent << "httpFrontend                = " << boolStr(httpFrontend) << "\n"
 			<< indent << "requestBodyIsBuffered       = " << boolStr(requestBodyIsBuffered) << "\n"
+			<< indent << "requestBodyIsChunked        = " << boolStr(requestBodyIsChunked) << "\n"
 			<< indent << "contentLength               = " << contentLength << "\n"
 			<< indent << "clientBodyAlreadyRead       = " << clientBodyAlreadyRead << "\n"
 			<< indent << "clientInput                 = " << clientInput.get() <<  " " << clientInput->inspect() << "\n"
@@ -545,12 +883,21 @@ public:
 			<< indent << "appInput started            = " << boolStr(appInput->isStarted()) << "\n"
 			<< indent << "appInput reachedEnd         = " << boolStr(appInput->endReached()) << "\n"
 			<< indent << "responseHeaderSeen          = " << boolStr(responseHeaderSeen) << "\n"
+			<< indent << "keepAliveSession            = " << boolStr(keepAliveSession) << "\n"
+			<< indent << "splicingResponse            = " << boolStr(splicingResponse) << "\n"
+			<< indent << "splicingRequestBody         = " << boolStr(clientSpliceWatcher.is_active()) << "\n"
+			<< indent << "frontendKeepAlive           = " << boolStr(frontendKeepAlive) << "\n"
+			<< indent << "upgraded                    = " << boolStr(upgraded) << "\n"
+			<< indent << "passThroughChunks           = " << boolStr(passThroughChunks) << "\n"
+			<< indent << "collapsingLeader            = " << boolStr(collapsingLeader) << "\n"
+			<< indent << "sendingFile                 = " << boolStr(sendingFile) << "\n"
 			<< indent << "useUnionStation             = " << boolStr(useUnionStation()) << "\n"
 			;
 	}
 };
 
 typedef boost::shared_ptr<Client> ClientPtr;
+typedef boost::weak_ptr<Client> ClientWeakPtr;
 
 
 class RequestHandler {
@@ -574,25 +921,243 @@ private:
 	PoolPtr pool;
 	const AgentOptions &options;
 	const ResourceLocator resourceLocator;
+	/** The error page templates, read once by loadErrorTemplates() so that
+	 * rendering an error page doesn't touch the disk. The CSS is already
+	 * inlined into errorLayout. Empty if they couldn't be read. */
+	string errorLayout;
+	string generalErrorTemplate;
+	string generalErrorWithHtmlTemplate;
+	/** Complete responses, indexed by [PASSENGER_STATUS_LINE][HTTP frontend],
+	 * for the errors that come in storms: a full request queue and, with
+	 * PASSENGER_FRIENDLY_ERROR_PAGES off, any error. Prepared up front so
+	 * that being overloaded doesn't make each rejection more expensive. */
+	string overloadResponses[2][2];
+	string undisclosedErrorResponses[2][2];
+	string rateLimitedResponses[2][2];
 	LoggerFactoryPtr loggerFactory;
 	ev::io requestSocketWatcher;
 	ev::timer resumeSocketWatcherTimer;
-	HashMap<int, ClientPtr> clients;
+	/** An epoll instance that watches requestSocket with EPOLLEXCLUSIVE, so
+	 * that a new connection only wakes up one of the event loops that share
+	 * requestSocket. requestSocketWatcher watches this instead of requestSocket
+	 * if the kernel supports it. */
+	FileDescriptor acceptEpoll;
+	/** Listening socket for HTTP clients, or -1. See listenForHttp(). */
+	FileDescriptor httpSocket;
+	ev::io httpSocketWatcher;
+	/** Like acceptEpoll, but for httpSocket. */
+	FileDescriptor httpAcceptEpoll;
+	/** The CGI variables from AgentOptions::httpEnvironment, as
+	 * "NAME\0VALUE\0" pairs. They're added to every request of an HTTP
+	 * client, and take the place of the ones that a web server would set,
+	 * such as PASSENGER_APP_ROOT. */
+	string httpEnvironment;
+	/** Scratch buffer for the SCGI header built from an HTTP request. */
+	string httpScgiHeader;
+	/** The maximum number of connections that onAcceptable() accepts per
+	 * wakeup. Grows while more connections are waiting than that, and
+	 * shrinks again when the backlog is short. */
+	unsigned int acceptBatchSize;
+	/** The number of times that onAcceptable() found more connections waiting
+	 * than it was allowed to accept. */
+	unsigned long long acceptBatchesFilled;
+	vector<ClientPtr> acceptedClients;
+	/** Drives clientTimeouts. Only active while any timeouts are scheduled. */
+	ev::timer clientTimeoutsTimer;
+	/** Connected clients, indexed by file descriptor number. File descriptors
+	 * are small, dense integers so this is cheaper than a hash table. */
+	vector<ClientPtr> clients;
+	/** The same clients, packed together for iteration. */
+	vector<Client *> clientList;
+	/** Disconnected clients that may be reused once the current event loop
+	 * iteration is done with them. See recycleClients(). */
+	vector<ClientPtr> disconnectedClients;
+	/** Clients ready to be associated with a new connection. */
+	vector<ClientPtr> freeClients;
+	ev::prepare recycleWatcher;
+	/** Session closes of this event loop iteration that haven't been
+	 * applied to the pool yet. See flushSessionCloses(). */
+	Pool::SessionCloseBatch sessionCloses;
+	ev::prepare sessionClosesWatcher;
+	/** Sessions checked out ahead of time, see sessionLeasesPerGroup. */
+	Pool::SessionLeasesPtr sessionLeases;
 	Timer inactivityTimer;
+	/** Fires when we've been idle for idleMemoryReleaseDelay seconds, see
+	 * releaseIdleMemory(). */
+	ev::timer idleMemoryTimer;
+	unsigned int idleMemoryReleases;
+	size_t rssBeforeIdleMemoryRelease;
+	size_t rssAfterIdleMemoryRelease;
 	bool accept4Available;
+	bool spliceAvailable;
+	/** Kernel pipe through which response bodies and tunnels are spliced.
+	 * It is shared by all clients because it's always drained before control
+	 * returns to the event loop. */
+	Pipe splicePipe;
+	/** Connections that have been handed over to a Tunnel, keyed on the
+	 * client fd. */
+	map<int, TunnelPtr> tunnels;
+	/** Pool options derived from the PASSENGER_* headers, keyed on the hash of
+	 * those headers. See fillPoolOptions(). */
+	struct OptionsCacheEntry {
+		string key;
+		Options options;
+	};
+	typedef HashMap<size_t, OptionsCacheEntry> OptionsCache;
+	static const unsigned int OPTIONS_CACHE_SIZE = 64;
+	static const unsigned int MIN_ACCEPT_BATCH_SIZE = 10;
+	static const unsigned int MAX_ACCEPT_BATCH_SIZE = 1024;
+	OptionsCache optionsCache;
+	/** Responses whose Content-Length is smaller than this aren't compressed. */
+	static const unsigned long long MIN_COMPRESSIBLE_SIZE = 256;
+	/** How much response body data may wait for a compression step before
+	 * reading from the application is paused. */
+	static const size_t MAX_COMPRESSION_BACKLOG = 1024 * 128;
+	/** Client::outputHeader gives up its memory after a response header
+	 * that needed more than this. */
+	static const size_t MAX_KEPT_OUTPUT_HEADER_SIZE = 1024 * 16;
+	/** How often (in milliseconds) the socket of a client that waits for a
+	 * session is checked for a hangup. */
+	static const unsigned int CHECKOUT_HANGUP_CHECK_INTERVAL = 1000;
+
+	/** Defaults for the Union Station sampling options, which requests can
+	 * override with the UNION_STATION_SAMPLE_RATE and
+	 * UNION_STATION_SLOW_REQUEST_THRESHOLD (in msec) headers. */
+	unsigned int unionStationSampleRate;
+	unsigned long long unionStationSlowRequestThreshold;
+	unsigned int unionStationSampleSeed;
+
+	/** Scratch buffer for building response cache keys. */
+	string responseCacheKey;
+	/** The Date header that appendDateHeader() last formatted, and the
+	 * second for which it was formatted. */
+	char dateHeader[64];
+	unsigned int dateHeaderSize;
+	time_t dateHeaderTime;
+	/** The requests that wait for the response to an identical request,
+	 * by the response cache primary key of the request they wait for. */
+	map< string, vector<ClientPtr> > collapsedRequests;
+	string optionsCacheKey;
+	/** Local cache of latencyStats->get() results, so that recording
+	 * latencies doesn't need to grab the registry lock. */
+	StringMap<RequestLatencyStats::GroupLatenciesPtr> groupLatencies;
+	/** Per-key request rate and concurrency limits. Only touched from our
+	 * event loop. */
+	RateLimiterPtr rateLimiter;
+	/** Free list of memory buffers for the clients' FileBackedPipes. There's
+	 * one per RequestHandler so that it's only ever touched from our event loop. */
+	FileBackedPipe::BufferPoolPtr pipeBufferPool;
+	/** Likewise for their buffer files. */
+	FileBackedPipe::SpillFilePoolPtr spillFilePool;
+	/** Likewise for the read buffers of the clients' EventedBufferedInputs,
+	 * so that idle keep-alive connections don't hold on to a buffer. */
+	EventedBufferedInputBufferPoolPtr inputBufferPool;
+
+	/** This RequestHandler's own metrics, registered in the pool's
+	 * MetricsRegistry. Only our event loop thread updates them. */
+	MetricsRegistryPtr metricsRegistry;
+	Metric *acceptsMetric;
+	Metric *clientsMetric;
+	Metric *requestsMetric;
+	Metric *bytesReceivedMetric;
+	Metric *bytesSentMetric;
+	Metric *bufferSpillsMetric;
+	Metric *tunnelsMetric;
+	Metric *collapsedRequestsMetric;
+	Metric *staticFilesMetric;
+	Metric *rateLimitedMetric;
+	Metric *handoversMetric;
+	Metric *stuckRequestsMetric;
+	/** Time spent in the callbacks of each LoopPriorityClass. */
+	boost::shared_ptr<LoopTimeStats> loopTimeStats;
+
+
+	void addClient(const ClientPtr &client) {
+		int fd = client->fd;
+		if ((size_t) fd >= clients.size()) {
+			clients.resize(std::max<size_t>(fd + 1, clients.size() * 2));
+		}
+		assert(clients[fd] == NULL);
+		clients[fd] = client;
+		client->clientListIndex = clientList.size();
+		clientList.push_back(client.get());
+		clientsMetric->increment();
+	}
+
+	void removeClient(const ClientPtr &client) {
+		int fd = client->fd;
+		assert(fd >= 0 && (size_t) fd < clients.size());
+		assert(clients[fd] == client);
+		Client *last = clientList.back();
+		clientList[client->clientListIndex] = last;
+		last->clientListIndex = client->clientListIndex;
+		clientList.pop_back();
+		clients[fd].reset();
+		clientsMetric->decrement();
+	}
+
+	static void recordPhase(RequestLatencyStats::GroupLatencies &latencies,
+		RequestLatencyStats::Phase phase, unsigned long long begin, unsigned long long end)
+	{
+		if (begin != 0 && end != 0) {
+			latencies.phases[phase].record(end - begin);
+		}
+	}
+
+	void recordLatencies(const ClientPtr &client) {
+		const Client::PhaseTimes &times = client->phaseTimes;
+		if (latencyStats == NULL || times.firstResponseByte == 0) {
+			// Only requests that made it to the application are interesting.
+			return;
+		}
+
+		StaticString groupName = client->options.getAppGroupName();
+		RequestLatencyStats::GroupLatenciesPtr latencies = groupLatencies.get(groupName);
+		if (latencies == NULL) {
+			latencies = latencyStats->get(groupName);
+			groupLatencies.set(groupName, latencies);
+		}
 
+		unsigned long long now = monotonicTimeUsec();
+		unsigned long long bodyDone = times.bodyBuffered != 0
+			? times.bodyBuffered
+			: times.headerRead;
+		recordPhase(*latencies, RequestLatencyStats::READING_HEADER, times.accepted, times.headerRead);
+		recordPhase(*latencies, RequestLatencyStats::BUFFERING_BODY, times.headerRead, times.bodyBuffered);
+		recordPhase(*latencies, RequestLatencyStats::CHECKING_OUT_SESSION, bodyDone, times.sessionCheckedOut);
+		recordPhase(*latencies, RequestLatencyStats::SENDING_HEADER, times.sessionCheckedOut, times.headerSent);
+		recordPhase(*latencies, RequestLatencyStats::WAITING_FOR_APP, times.headerSent, times.firstResponseByte);
+		recordPhase(*latencies, RequestLatencyStats::SENDING_RESPONSE, times.firstResponseByte, now);
+		recordPhase(*latencies, RequestLatencyStats::TOTAL, times.accepted, now);
+	}
 
 	void disconnect(const ClientPtr &client) {
 		// Prevent Client object from being destroyed until we're done.
 		ClientPtr reference = client;
 
-		clients.erase(client->fd);
+		if (client->state == Client::WAITING_FOR_COLLAPSED_RESPONSE) {
+			removeCollapsedRequest(client);
+		} else if (client->state == Client::CHECKING_OUT_SESSION
+			&& !client->sessionCheckedOut && client->options.cancellation != NULL)
+		{
+			client->options.cancellation->cancel();
+		}
+		releaseRateLimit(client);
+		recordLatencies(client);
+		finishUnionStationRequest(client);
+		removeClient(client);
+		releaseCollapsedRequests(client);
 		client->discard();
 		client->verifyInvariants();
-		RH_DEBUG(client, "Disconnected; new client count = " << clients.size());
+		RH_DEBUG(client, "Disconnected; new client count = " << clientList.size());
+
+		if (freeClients.size() + disconnectedClients.size() < clientFreelistLimit) {
+			disconnectedClients.push_back(reference);
+			recycleWatcher.start();
+		}
 
-		if (clients.empty()) {
-			inactivityTimer.start();
+		if (clientList.empty() && tunnels.empty()) {
+			becomeIdle();
 		}
 	}
 
@@ -600,6 +1165,8 @@ private:
 		RH_WARN(client, "Disconnecting with error: " << message);
 		if (client->useUnionStation()) {
 			client->logMessage("Disconnecting with error: " + message);
+		} else if (client->unionStationDeferred && client->unionStationError.empty()) {
+			client->unionStationError = message;
 		}
 		disconnect(client);
 	}
@@ -639,10 +1206,100 @@ private:
 	// GDB helper function, implemented in .cpp file to prevent inlining.
 	Client *getClientPointer(const ClientPtr &client);
 
+	/**
+	 * Called before the event loop blocks, i.e. when nothing up the call
+	 * stack refers to the clients that were disconnected during this
+	 * iteration anymore. Clients that are not referenced by anything else,
+	 * e.g. a pending asyncGet() callback, are moved to the freelist.
+	 * The others are simply dropped.
+	 */
+	void recycleClients(ev::prepare &watcher, int revents) {
+		ScopedLoopTimer timer(loopTimeStats.get(), LPC_HOUSEKEEPING);
+		vector<ClientPtr>::iterator it, end = disconnectedClients.end();
+		for (it = disconnectedClients.begin(); it != end; it++) {
+			const ClientPtr &client = *it;
+			if (client.unique() && client->reassociateable()) {
+				client->prepareForReuse();
+				freeClients.push_back(client);
+			}
+		}
+		disconnectedClients.clear();
+		recycleWatcher.stop();
+	}
+
+	/**
+	 * Called before the event loop blocks. Applies the sessions that were
+	 * closed during this iteration to the pool in one go, so that closing a
+	 * session doesn't take the pool lock each time.
+	 */
+	void flushSessionCloses(ev::prepare &watcher, int revents) {
+		ScopedLoopTimer timer(loopTimeStats.get(), LPC_SESSIONS);
+		if (batchSessionCloses) {
+			sessionCloses.activate();
+		} else {
+			sessionCloses.deactivate();
+			watcher.stop();
+		}
+		sessionCloses.flush();
+	}
+
+	ClientPtr checkoutClient() {
+		if (freeClients.empty()) {
+			return boost::make_shared<Client>();
+		} else {
+			ClientPtr client = freeClients.back();
+			freeClients.pop_back();
+			return client;
+		}
+	}
+
 	void doResetInactivityTime() {
 		inactivityTimer.reset();
 	}
 
+	void becomeIdle() {
+		inactivityTimer.start();
+		if (idleMemoryReleaseDelay > 0) {
+			idleMemoryTimer.start(idleMemoryReleaseDelay, 0);
+		}
+	}
+
+	void becomeActive() {
+		inactivityTimer.stop();
+		idleMemoryTimer.stop();
+	}
+
+	/**
+	 * Called when we've had no clients for idleMemoryReleaseDelay seconds.
+	 * After a traffic peak, the freelists and buffer pools hold on to memory
+	 * for the peak's number of clients, and the memory that was freed is
+	 * kept by the allocator. Neither is returned to the OS otherwise, so our
+	 * RSS would stay at the peak's level forever. Drops the freelists and
+	 * pools, which refill quickly once traffic resumes, and asks the
+	 * allocator to return its free memory.
+	 */
+	void releaseIdleMemory(ev::timer &timer, int revents) {
+		TRACE_POINT();
+		ScopedLoopTimer loopTimer(loopTimeStats.get(), LPC_HOUSEKEEPING);
+		rssBeforeIdleMemoryRelease = getCurrentRss();
+		vector<ClientPtr>().swap(freeClients);
+		pipeBufferPool->clear();
+		spillFilePool->clear();
+		inputBufferPool->clear();
+		releaseFreeHeapMemory();
+		rssAfterIdleMemoryRelease = getCurrentRss();
+		idleMemoryReleases++;
+		P_DEBUG("Idle for " << idleMemoryReleaseDelay << " seconds; released memory. RSS: " <<
+			rssBeforeIdleMemoryRelease / 1024 << " KB -> " <<
+			rssAfterIdleMemoryRelease / 1024 << " KB");
+	}
+
+	void doStopAccepting() {
+		requestSocketWatcher.stop();
+		httpSocketWatcher.stop();
+		resumeSocketWatcherTimer.stop();
+	}
+
 	void getInactivityTime(unsigned long long *result) const {
 		*result = inactivityTimer.elapsed();
 	}
@@ -656,6 +1313,15 @@ private:
 		}
 	}
 
+	static double getDoubleOption(const ClientPtr &client, const StaticString &name, double defaultValue) {
+		ScgiRequestParser::const_iterator it = client->scgiParser.getHeaderIterator(name);
+		if (it != client->scgiParser.end()) {
+			return atof(string(it->second.data(), it->second.size()).c_str());
+		} else {
+			return defaultValue;
+		}
+	}
+
 	static long long getULongLongOption(const ClientPtr &client, const StaticString &name, long long defaultValue = -1) {
 		ScgiRequestParser::const_iterator it = client->scgiParser.getHeaderIterator(name);
 		if (it != client->scgiParser.end()) {
@@ -671,10 +1337,16 @@ private:
 		}
 	}
 
-	void writeSimpleResponse(const ClientPtr &client, const StaticString &data, int code = 200) {
-		char header[256], statusBuffer[50];
+	/**
+	 * Formats the header of a simple response, which is delimited by EOF,
+	 * into `header`. Returns its size.
+	 */
+	static size_t formatSimpleResponseHeader(char *header, size_t size, int code,
+		size_t bodySize, bool statusLine, bool httpFrontend)
+	{
+		char statusBuffer[50];
 		char *pos = header;
-		const char *end = header + sizeof(header) - 1;
+		const char *end = header + size - 1;
 		const char *status;
 
 		status = getStatusCodeAndReasonPhrase(code);
@@ -683,7 +1355,7 @@ private:
 			status = statusBuffer;
 		}
 
-		if (getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
+		if (statusLine) {
 			pos += snprintf(pos, end - pos, "HTTP/1.1 %s\r\n",
 				status);
 		}
@@ -692,99 +1364,159 @@ private:
 			"Content-Length: %lu\r\n"
 			"Content-Type: text/html; charset=UTF-8\r\n"
 			"Cache-Control: no-cache, no-store, must-revalidate\r\n"
+			"%s"
 			"\r\n",
-			status, (unsigned long) data.size());
+			status, (unsigned long) bodySize,
+			httpFrontend ? "Connection: close\r\n" : "");
+		return pos - header;
+	}
+
+	static void prepareSimpleResponses(string responses[2][2], const StaticString &data, int code) {
+		char header[256];
+		for (int statusLine = 0; statusLine < 2; statusLine++) {
+			for (int httpFrontend = 0; httpFrontend < 2; httpFrontend++) {
+				string &response = responses[statusLine][httpFrontend];
+				response.assign(header, formatSimpleResponseHeader(header, sizeof(header),
+					code, data.size(), statusLine, httpFrontend));
+				response.append(data.data(), data.size());
+			}
+		}
+	}
 
-		client->clientOutputPipe->write(header, pos - header);
+	void writeSimpleResponse(const ClientPtr &client, const StaticString &data, int code = 200) {
+		char header[256];
+		size_t size = formatSimpleResponseHeader(header, sizeof(header), code, data.size(),
+			getBoolOption(client, "PASSENGER_STATUS_LINE", true), client->httpFrontend);
+
+		// Simple responses are delimited by EOF, not by chunked framing.
+		client->frontendKeepAlive = false;
+		client->clientOutputPipe->write(header, size);
 		client->clientOutputPipe->write(data.data(), data.size());
 		client->clientOutputPipe->end();
+		logSimpleResponseStatus(client, code);
+	}
+
+	/** Writes one of the responses prepared by prepareSimpleResponses(). */
+	void writePreparedResponse(const ClientPtr &client, const string responses[2][2], int code) {
+		const string &response = responses
+			[getBoolOption(client, "PASSENGER_STATUS_LINE", true)]
+			[client->httpFrontend];
+		client->frontendKeepAlive = false;
+		client->clientOutputPipe->write(response.data(), response.size());
+		client->clientOutputPipe->end();
+		logSimpleResponseStatus(client, code);
+	}
 
+	void logSimpleResponseStatus(const ClientPtr &client, int code) {
+		client->responseStatusCode = code;
 		if (client->useUnionStation()) {
-			snprintf(header, end - header, "Status: %d %s",
-				code, status);
-			client->logMessage(header);
+			const char *status = getStatusCodeAndReasonPhrase(code);
+			if (status != NULL) {
+				client->logMessage(string("Status: ") + status);
+			} else {
+				client->logMessage("Status: " + toString(code) + " Unknown Reason-Phrase");
+			}
+		}
+	}
+
+	static StaticString overloadPage() {
+		return "<h1>This website is under heavy load</h1>"
+			"<p>We're sorry, too many people are accessing this website at the same "
+			"time. We're working on this problem. Please try again later.</p>";
+	}
+
+	static StaticString gatewayTimeoutPage() {
+		return "<h1>Gateway timeout</h1>"
+			"<p>The web application took too long to respond to this request. "
+			"Please try again later.</p>";
+	}
+
+	static StaticString rateLimitedPage() {
+		return "<h1>Too many requests</h1>"
+			"<p>You have sent too many requests to this website in a short time. "
+			"Please try again later.</p>";
+	}
+
+	/**
+	 * Reads the error page templates and prepares the responses that don't
+	 * depend on the request. Called once, when the RequestHandler is created.
+	 */
+	void loadErrorTemplates() {
+		string templatesDir = resourceLocator.getResourcesDir() + "/templates";
+
+		try {
+			errorLayout = readAll(templatesDir + "/error_layout.html.template");
+			string::size_type pos = errorLayout.find("{{CSS|raw}}");
+			if (pos != string::npos) {
+				errorLayout.replace(pos, sizeof("{{CSS|raw}}") - 1,
+					readAll(templatesDir + "/error_layout.css"));
+			}
+			generalErrorTemplate = readAll(templatesDir + "/general_error.html.template");
+			generalErrorWithHtmlTemplate = readAll(templatesDir + "/general_error_with_html.html.template");
+		} catch (const SystemException &e) {
+			P_ERROR("Cannot load the error page templates: " << e.what());
+			errorLayout.clear();
+		}
+
+		string undisclosedError;
+		try {
+			undisclosedError = readAll(templatesDir + "/undisclosed_error.html.template");
+		} catch (const SystemException &e) {
+			P_ERROR("Cannot load the error page templates: " << e.what());
+			undisclosedError = "Internal Server Error";
 		}
+		prepareSimpleResponses(undisclosedErrorResponses, undisclosedError, 500);
+
+		prepareSimpleResponses(overloadResponses, overloadPage(), 503);
+		prepareSimpleResponses(rateLimitedResponses, rateLimitedPage(), 429);
 	}
 
 	void writeErrorResponse(const ClientPtr &client, const StaticString &message, const SpawnException *e = NULL) {
 		assert(client->state < Client::FORWARDING_BODY_TO_APP);
 		client->state = Client::WRITING_SIMPLE_RESPONSE;
 
-		string templatesDir = resourceLocator.getResourcesDir() + "/templates";
-		string data;
+		if (!getBoolOption(client, "PASSENGER_FRIENDLY_ERROR_PAGES", true)) {
+			writePreparedResponse(client, undisclosedErrorResponses, 500);
+			return;
+		}
 
-		if (getBoolOption(client, "PASSENGER_FRIENDLY_ERROR_PAGES", true)) {
-			try {
-				string cssFile = templatesDir + "/error_layout.css";
-				string errorLayoutFile = templatesDir + "/error_layout.html.template";
-				string generalErrorFile =
-					(e != NULL && e->isHTML())
-					? templatesDir + "/general_error_with_html.html.template"
-					: templatesDir + "/general_error.html.template";
-				string css = readAll(cssFile);
-				StringMap<StaticString> params;
-
-				params.set("CSS", css);
-				params.set("APP_ROOT", client->options.appRoot);
-				params.set("RUBY", client->options.ruby);
-				params.set("ENVIRONMENT", client->options.environment);
-				params.set("MESSAGE", message);
-				params.set("IS_RUBY_APP",
-					(client->options.appType == "classic-rails" || client->options.appType == "rack")
-					? "true" : "false");
-				if (e != NULL) {
-					params.set("TITLE", "Web application could not be started");
-					// Store all SpawnException annotations into 'params',
-					// but convert its name to uppercase.
-					const map<string, string> &annotations = e->getAnnotations();
-					map<string, string>::const_iterator it, end = annotations.end();
-					for (it = annotations.begin(); it != end; it++) {
-						string name = it->first;
-						for (string::size_type i = 0; i < name.size(); i++) {
-							name[i] = toupper(name[i]);
-						}
-						params.set(name, it->second);
+		string data;
+		if (!errorLayout.empty()) {
+			StringMap<StaticString> params;
+
+			params.set("APP_ROOT", client->options.appRoot);
+			params.set("RUBY", client->options.ruby);
+			params.set("ENVIRONMENT", client->options.environment);
+			params.set("MESSAGE", message);
+			params.set("IS_RUBY_APP",
+				(client->options.appType == "classic-rails" || client->options.appType == "rack")
+				? "true" : "false");
+			if (e != NULL) {
+				params.set("TITLE", "Web application could not be started");
+				// Store all SpawnException annotations into 'params',
+				// but convert its name to uppercase.
+				const map<string, string> &annotations = e->getAnnotations();
+				map<string, string>::const_iterator it, end = annotations.end();
+				for (it = annotations.begin(); it != end; it++) {
+					string name = it->first;
+					for (string::size_type i = 0; i < name.size(); i++) {
+						name[i] = toupper(name[i]);
 					}
-				} else {
-					params.set("TITLE", "Internal server error");
+					params.set(name, it->second);
 				}
-				string content = Template::apply(readAll(generalErrorFile), params);
-				params.set("CONTENT", content);
-				data = Template::apply(readAll(errorLayoutFile), params);
-			} catch (const SystemException &e2) {
-				P_ERROR("Cannot render an error page: " << e2.what() << "\n" <<
-					e2.backtrace());
-				data = message;
+			} else {
+				params.set("TITLE", "Internal server error");
 			}
+			string content = Template::apply(
+				(e != NULL && e->isHTML()) ? generalErrorWithHtmlTemplate : generalErrorTemplate,
+				params);
+			params.set("CONTENT", content);
+			data = Template::apply(errorLayout, params);
 		} else {
-			try {
-				data = readAll(templatesDir + "/undisclosed_error.html.template");
-			} catch (const SystemException &e2) {
-				P_ERROR("Cannot render an error page: " << e2.what() << "\n" <<
-					e2.backtrace());
-				data = "Internal Server Error";
-			}
-		}
-
-		stringstream str;
-		if (getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
-			str << "HTTP/1.1 500 Internal Server Error\r\n";
+			data = message;
 		}
-		str << "Status: 500 Internal Server Error\r\n";
-		str << "Content-Length: " << data.size() << "\r\n";
-		str << "Content-Type: text/html; charset=UTF-8\r\n";
-		str << "Cache-Control: no-cache, no-store, must-revalidate\r\n";
-		str << "\r\n";
-
-		const string header = str.str();
-		client->clientOutputPipe->write(header.data(), header.size());
-		client->clientOutputPipe->write(data.data(), data.size());
-		client->clientOutputPipe->end();
 
-		if (client->useUnionStation()) {
-			client->logMessage("Status: 500 Internal Server Error");
-			// TODO: record error message
-		}
+		writeSimpleResponse(client, data, 500);
 	}
 
 	static BenchmarkPoint getDefaultBenchmarkPoint() {
@@ -899,26 +1631,27 @@ private:
 		return header;
 	}
 
-	bool addStatusHeaderFromStatusLine(const ClientPtr &client, string &headerData) {
+	/**
+	 * Appends a Status header with the status from the HTTP status line at
+	 * the start of `origHeader` to `headerData`.
+	 */
+	bool addStatusHeaderFromStatusLine(const ClientPtr &client, const StaticString &origHeader,
+		string &headerData)
+	{
 		string::size_type begin, end;
 
-		begin = headerData.find(' ');
+		begin = origHeader.find(' ');
 		if (begin != string::npos) {
-			end = headerData.find("\r\n", begin + 1);
+			end = origHeader.find("\r\n", begin + 1);
 		} else {
 			end = string::npos;
 		}
 		if (begin != string::npos && end != string::npos) {
-			StaticString statusValue(headerData.data() + begin + 1, end - begin);
+			StaticString statusValue(origHeader.data() + begin + 1, end - begin - 1);
 			if (statusValue.size() <= MAX_STATUS_HEADER_SIZE) {
-				char header[MAX_STATUS_HEADER_SIZE + sizeof("Status: \r\n")];
-				char *pos = header;
-				const char *end = header + sizeof(header);
-
-				pos = appendData(pos, end, "Status: ");
-				pos = appendData(pos, end, statusValue);
-				pos = appendData(pos, end, "\r\n");
-				headerData.append(StaticString(header, pos - header));
+				headerData.append("Status: ");
+				headerData.append(statusValue.data(), statusValue.size());
+				headerData.append("\r\n");
 				return true;
 			} else {
 				disconnectWithError(client, "application sent malformed response: the Status header's (" +
@@ -932,167 +1665,707 @@ private:
 		}
 	}
 
-	static bool addReasonPhrase(string &headerData, const Header &status) {
+	/**
+	 * If the Status header lacks a reason phrase, formats the status with
+	 * the standard reason phrase into `buf` and returns that. Otherwise
+	 * returns the status as-is.
+	 */
+	static StaticString statusWithReasonPhrase(const Header &status, char *buf, size_t bufsize) {
 		if (status.value.find(' ') == string::npos) {
 			int statusCode = stringToInt(status.value);
 			const char *statusCodeAndReasonPhrase = getStatusCodeAndReasonPhrase(statusCode);
-			char newStatus[100];
-			char *pos = newStatus;
-			const char *end = newStatus + sizeof(newStatus);
+			char *pos = buf;
+			const char *end = buf + bufsize;
 
-			pos = appendData(pos, end, "Status: ");
 			if (statusCodeAndReasonPhrase == NULL) {
 				pos = appendData(pos, end, toString(statusCode));
-				pos = appendData(pos, end, " Unknown Reason-Phrase\r\n");
+				pos = appendData(pos, end, " Unknown Reason-Phrase");
 			} else {
 				pos = appendData(pos, end, statusCodeAndReasonPhrase);
-				pos = appendData(pos, end, "\r\n");
 			}
-
-			headerData.replace(status.begin() - headerData.data(), status.size(),
-				newStatus, pos - newStatus);
-			return true;
+			return StaticString(buf, pos - buf);
 		} else {
-			return false;
+			return status.value;
 		}
 	}
 
-	bool removeStatusLine(const ClientPtr &client, string &headerData) {
-		string::size_type end = headerData.find("\r\n");
-		if (end != string::npos) {
-			headerData.erase(0, end + 2);
-			return true;
+	/**
+	 * Appends `origHeader` to `headerData`, with the value of its Status
+	 * header replaced by `statusValue` if that differs.
+	 */
+	static void appendWithStatus(string &headerData, const StaticString &origHeader,
+		const Header &status, const StaticString &statusValue)
+	{
+		if (statusValue.data() == status.value.data()) {
+			headerData.append(origHeader.data(), origHeader.size());
 		} else {
-			disconnectWithError(client, "application sent malformed response: the HTTP status line is invalid.");
-			return false;
+			const char *end = origHeader.data() + origHeader.size();
+			headerData.append(origHeader.data(), status.begin() - origHeader.data());
+			headerData.append("Status: ");
+			headerData.append(statusValue.data(), statusValue.size());
+			headerData.append("\r\n");
+			headerData.append(status.end(), end - status.end());
 		}
 	}
 
-	static void addStatusLineFromStatusHeader(string &headerData, const Header &status) {
-		char statusLine[100];
-		char *pos = statusLine;
-		const char *end = statusLine + sizeof(statusLine);
-
-		pos = appendData(pos, end, "HTTP/1.1 ");
-		pos = appendData(pos, end, status.value);
-		pos = appendData(pos, end, "\r\n");
-
-		headerData.insert(0, statusLine, pos - statusLine);
-	}
-
 	static void removeHeader(string &headerData, const Header &header) {
 		headerData.erase(header.begin() - headerData.data(), header.size());
 	}
 
-	/*
-	 * Given a full header, possibly modify the header and send it to the clientOutputPipe.
+	/**
+	 * Parses a response's Cache-Control header. Returns whether it allows
+	 * shared caches to store the response, and if so sets `maxAge` to its
+	 * freshness lifetime in seconds.
 	 */
-	bool processResponseHeader(const ClientPtr &client,
-		const StaticString &origHeaderData)
-	{
-		string headerData;
-		headerData.reserve(origHeaderData.size() + 150);
-		// Strip trailing CRLF.
-		headerData.append(origHeaderData.data(), origHeaderData.size() - 2);
-		
-		if (startsWith(headerData, "HTTP/1.")) {
-			Header status = lookupHeader(headerData, "Status", "status");
-			if (status.empty()) {
-				// Add status header if necessary.
-				if (!addStatusHeaderFromStatusLine(client, headerData)) {
-					return false;
-				}
-			} else {
-				// Add reason phrase to existing status header if necessary.
-				addReasonPhrase(headerData, status);
-			}
-			// Remove status line if necesary.
-			if (!getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
-				if (!removeStatusLine(client, headerData)) {
-					return false;
-				}
+	static bool parseCacheControl(const StaticString &value, unsigned long long &maxAge) {
+		vector<string> directives;
+		bool isPublic = false;
+		bool hasMaxAge = false;
+		bool hasSharedMaxAge = false;
+		unsigned long long sharedMaxAge = 0;
+
+		maxAge = 0;
+		split(value, ',', directives);
+		foreach (string directive, directives) {
+			directive = strip(directive);
+			for (string::size_type i = 0; i < directive.size(); i++) {
+				directive[i] = tolower(directive[i]);
 			}
-		} else {
-			Header status = lookupHeader(headerData, "Status", "status");
-			if (!status.empty()) {
-				// Add reason phrase to status header if necessary.
-				if (addReasonPhrase(headerData, status)) {
-					status = lookupHeader(headerData, "Status", "status");
-				}
-				// Add status line if necessary.
-				if (getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
-					addStatusLineFromStatusHeader(headerData, status);
-				}
-			} else {
-				disconnectWithError(client, "application sent malformed response: it didn't send an HTTP status line or a Status header.");
+
+			if (directive == "public") {
+				isPublic = true;
+			} else if (directive == "private"
+			        || directive == "no-store"
+			        || directive == "no-cache"
+			        || startsWith(directive, "no-cache="))
+			{
 				return false;
+			} else if (startsWith(directive, "max-age=")) {
+				hasMaxAge = true;
+				maxAge = stringToULL(directive.substr(sizeof("max-age=") - 1));
+			} else if (startsWith(directive, "s-maxage=")) {
+				hasSharedMaxAge = true;
+				sharedMaxAge = stringToULL(directive.substr(sizeof("s-maxage=") - 1));
 			}
 		}
 
-		if (client->useUnionStation()) {
-			Header status = lookupHeader(headerData, "Status", "status");
-			string message = "Status: ";
-			message.append(status.value);
-			client->logMessage(message);
+		if (hasSharedMaxAge) {
+			maxAge = sharedMaxAge;
 		}
+		return isPublic && (hasMaxAge || hasSharedMaxAge) && maxAge > 0;
+	}
 
-		// Process chunked transfer encoding.
-		Header transferEncoding = lookupHeader(headerData, "Transfer-Encoding", "transfer-encoding");
-		if (!transferEncoding.empty() && transferEncoding.value == "chunked") {
-			P_TRACE(3, "Response with chunked transfer encoding detected.");
-			client->chunkedResponse = true;
-			removeHeader(headerData, transferEncoding);
+	/**
+	 * Called with the response header, before the framing for the web server
+	 * is added to it. Starts recording the response for the response cache
+	 * if the request and the response are cacheable.
+	 */
+	void maybeStartCachingResponse(const ClientPtr &client, const string &headerData) {
+		if (client->cachePrimaryKey.empty()) {
+			return;
 		}
 
-		// Add X-Powered-By.
-		if (getBoolOption(client, "PASSENGER_SHOW_VERSION_IN_HEADER", true)) {
-			headerData.append("X-Powered-By: Phusion Passenger " PASSENGER_VERSION "\r\n");
-		} else {
-			headerData.append("X-Powered-By: Phusion Passenger\r\n");
+		Header status = lookupHeader(headerData, "Status", "status");
+		if (!startsWith(status.value, "200")
+		 || !lookupHeader(headerData, "Set-Cookie", "set-cookie").empty()
+		 || !lookupHeader(headerData, "X-Passenger-Request-OOB-Work", "x-passenger-request-oob-work").empty())
+		{
+			return;
 		}
 
-		// Add sticky session ID.
-		if (client->stickySession && client->session != NULL) {
-			StaticString cookieName = getStickySessionCookieName(client);
-			headerData.append("Set-Cookie: ");
-			headerData.append(cookieName.data(), cookieName.size());
-			headerData.append("=");
-			headerData.append(toString(client->session->getStickySessionId()));
-			headerData.append("; HttpOnly\r\n");
+		unsigned long long maxAge;
+		Header cacheControl = lookupHeader(headerData, "Cache-Control", "cache-control");
+		if (cacheControl.empty() || !parseCacheControl(cacheControl.value, maxAge)) {
+			return;
 		}
 
-		// Add Date header. https://code.google.com/p/phusion-passenger/issues/detail?id=485
-		if (lookupHeader(headerData, "Date", "date").empty()) {
-			char dateStr[60];
-			char *pos = dateStr;
-			const char *end = dateStr + sizeof(dateStr) - 1;
-			time_t the_time = time(NULL);
-			struct tm the_tm;
+		vector<string> varyHeaders;
+		Header vary = lookupHeader(headerData, "Vary", "vary");
+		if (!vary.empty()) {
+			split(vary.value, ',', varyHeaders);
+			foreach (string &name, varyHeaders) {
+				name = strip(name);
+				if (name == "*") {
+					return;
+				}
+				for (string::size_type i = 0; i < name.size(); i++) {
+					name[i] = (name[i] == '-') ? '_' : toupper(name[i]);
+				}
+				name.insert(0, "HTTP_");
+			}
+		}
 
-			pos = appendData(pos, end, "Date: ");
-			gmtime_r(&the_time, &the_tm);
-			pos += strftime(pos, end - pos, "%a, %d %b %Y %H:%M:%S %Z", &the_tm);
-			pos = appendData(pos, end, "\r\n");
-			headerData.append(dateStr, pos - dateStr);
+		Header contentLength = lookupHeader(headerData, "Content-Length", "content-length");
+		RH_TRACE(client, 3, "Response is cacheable for " << maxAge << " seconds; recording it");
+		client->cachingResponse = true;
+		client->cacheVaryHeaders.swap(varyHeaders);
+		client->cachedHeader = headerData;
+		Header date = lookupHeader(client->cachedHeader, "Date", "date");
+		if (!date.empty()) {
+			// A fresh one is added to every response served from the cache.
+			removeHeader(client->cachedHeader, date);
 		}
+		client->cachedContentLength = contentLength.empty()
+			? -1
+			: (long long) stringToULL(contentLength.value);
+		client->cacheExpiresAt = monotonicTimeUsec() + maxAge * 1000000;
+	}
 
-		// Detect out of band work request
-		Header oobw = lookupHeader(headerData, "X-Passenger-Request-OOB-Work", "x-passenger-request-oob-work");
-		if (!oobw.empty()) {
-			P_TRACE(3, "Response with oobw detected.");
-			if (client->session != NULL) {
-				client->session->requestOOBW();
-			}
-			removeHeader(headerData, oobw);
+	static bool isCompressibleContentType(const StaticString &value) {
+		string type = value;
+		string::size_type pos = type.find(';');
+		if (pos != string::npos) {
+			type.erase(pos);
+		}
+		type = strip(type);
+		for (string::size_type i = 0; i < type.size(); i++) {
+			type[i] = tolower(type[i]);
 		}
 
-		headerData.append("\r\n");
-		writeToClientOutputPipe(client, headerData);
-		return true;
+		return startsWith(type, "text/")
+			|| type == "application/json"
+			|| type == "application/javascript"
+			|| type == "application/x-javascript"
+			|| type == "application/xml"
+			|| type == "image/svg+xml"
+			|| (type.size() > 5 && type.compare(type.size() - 5, 5, "+json") == 0)
+			|| (type.size() > 4 && type.compare(type.size() - 4, 4, "+xml") == 0);
 	}
 
-	void writeToClientOutputPipe(const ClientPtr &client, const StaticString &data) {
-		bool wasCommittingToDisk = client->clientOutputPipe->isCommittingToDisk();
+	/**
+	 * Picks a content coding that the client accepts, based on its
+	 * Accept-Encoding header. Returns false if it accepts neither gzip
+	 * nor deflate.
+	 */
+	static bool selectContentEncoding(const StaticString &acceptEncoding,
+		ResponseCompressor::Encoding &encoding)
+	{
+		vector<string> codings;
+		bool deflateAccepted = false;
+
+		split(acceptEncoding, ',', codings);
+		foreach (string coding, codings) {
+			string::size_type pos = coding.find(';');
+			bool rejected = false;
+			if (pos != string::npos) {
+				string params = coding.substr(pos + 1);
+				coding.erase(pos);
+				params = strip(params);
+				if (startsWith(params, "q=")) {
+					rejected = atof(params.c_str() + 2) <= 0;
+				}
+			}
+			coding = strip(coding);
+			for (string::size_type i = 0; i < coding.size(); i++) {
+				coding[i] = tolower(coding[i]);
+			}
+
+			if (rejected) {
+				continue;
+			} else if (coding == "gzip" || coding == "x-gzip") {
+				encoding = ResponseCompressor::GZIP;
+				return true;
+			} else if (coding == "deflate") {
+				deflateAccepted = true;
+			}
+		}
+		if (deflateAccepted) {
+			encoding = ResponseCompressor::DEFLATE;
+		}
+		return deflateAccepted;
+	}
+
+	/**
+	 * Called with the response header, before the framing for the web server
+	 * is added to it. If the client accepts compressed responses and the
+	 * response is worth compressing, then sets up client->compressor and
+	 * updates the header accordingly.
+	 */
+	void maybeStartCompressingResponse(const ClientPtr &client, string &headerData) {
+		if (compressionPool == NULL
+		 || client->scgiParser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD) == "HEAD")
+		{
+			return;
+		}
+
+		ResponseCompressor::Encoding encoding;
+		if (!selectContentEncoding(client->scgiParser.getHeader(ScgiRequestParser::KH_HTTP_ACCEPT_ENCODING), encoding)) {
+			return;
+		}
+
+		Header status = lookupHeader(headerData, "Status", "status");
+		if (startsWith(status.value, "1")
+		 || startsWith(status.value, "204")
+		 || startsWith(status.value, "206")
+		 || startsWith(status.value, "304"))
+		{
+			return;
+		}
+
+		Header contentType = lookupHeader(headerData, "Content-Type", "content-type");
+		Header cacheControl = lookupHeader(headerData, "Cache-Control", "cache-control");
+		if (contentType.empty()
+		 || !isCompressibleContentType(contentType.value)
+		 || !lookupHeader(headerData, "Content-Encoding", "content-encoding").empty()
+		 || cacheControl.value.find("no-transform") != string::npos)
+		{
+			return;
+		}
+
+		Header contentLength = lookupHeader(headerData, "Content-Length", "content-length");
+		if (!contentLength.empty()) {
+			if (stringToULL(contentLength.value) < MIN_COMPRESSIBLE_SIZE) {
+				return;
+			}
+			// The compressed size isn't known in advance.
+			removeHeader(headerData, contentLength);
+		}
+
+		RH_TRACE(client, 3, "Compressing response with " << ResponseCompressor::encodingName(encoding));
+		client->compressor = boost::make_shared<ResponseCompressor>(encoding);
+		headerData.append("Content-Encoding: ");
+		headerData.append(ResponseCompressor::encodingName(encoding));
+		headerData.append("\r\nVary: Accept-Encoding\r\n");
+	}
+
+	void storeCachedResponse(const ClientPtr &client) {
+		if (client->cachedContentLength != -1
+		 && client->cachedBody.size() != (unsigned long long) client->cachedContentLength)
+		{
+			RH_TRACE(client, 3, "Response is incomplete; not caching it");
+			client->stopCachingResponse();
+			releaseCollapsedRequests(client);
+			return;
+		}
+
+		vector<StaticString> varyValues;
+		foreach (const string &name, client->cacheVaryHeaders) {
+			varyValues.push_back(client->scgiParser.getHeader(name));
+		}
+		ResponseCache::buildKey(responseCacheKey, client->cachePrimaryKey, varyValues);
+		if (responseCache->store(client->cachePrimaryKey, client->cacheVaryHeaders,
+			responseCacheKey, client->cachedHeader, client->cachedBody,
+			monotonicTimeUsec(), client->cacheExpiresAt))
+		{
+			RH_DEBUG(client, "Response stored in the response cache");
+		}
+		client->stopCachingResponse();
+		releaseCollapsedRequests(client);
+	}
+
+	void appendPoweredByHeader(const ClientPtr &client, string &headerData) {
+		if (getBoolOption(client, "PASSENGER_SHOW_VERSION_IN_HEADER", true)) {
+			headerData.append("X-Powered-By: Phusion Passenger " PASSENGER_VERSION "\r\n");
+		} else {
+			headerData.append("X-Powered-By: Phusion Passenger\r\n");
+		}
+	}
+
+	static unsigned long long phaseDuration(unsigned long long begin, unsigned long long end) {
+		if (begin != 0 && end > begin) {
+			return end - begin;
+		} else {
+			return 0;
+		}
+	}
+
+	static void appendMsec(string &headerData, unsigned long long usec) {
+		headerData.append(toString(usec / 1000));
+		headerData.append(1, '.');
+		headerData.append(1, (char) ('0' + usec % 1000 / 100));
+		headerData.append("ms");
+	}
+
+	/**
+	 * Appends a header like
+	 * "X-Passenger-Timing: queue=3.1ms;spawn=0.0ms;app=45.2ms;buffer=0.4ms",
+	 * telling where the time before the first response byte was spent:
+	 * waiting in the pool for a process (queue), waiting for a process to be
+	 * spawned (spawn), waiting for the application (app) and buffering the
+	 * request body (buffer).
+	 */
+	void appendTimingHeader(const ClientPtr &client, string &headerData) {
+		const Client::PhaseTimes &times = client->phaseTimes;
+		unsigned long long bodyDone = times.bodyBuffered != 0
+			? times.bodyBuffered
+			: times.headerRead;
+		unsigned long long checkout = phaseDuration(bodyDone, times.sessionCheckedOut);
+		unsigned long long spawn = 0;
+
+		if (client->session != NULL) {
+			const ProcessPtr &process = client->session->getProcess();
+			if (process->spawnEndTime >= client->checkoutStartedAt) {
+				spawn = process->spawnEndTime - std::max(process->spawnStartTime,
+					client->checkoutStartedAt);
+				spawn = std::min(spawn, checkout);
+			}
+		}
+
+		headerData.append("X-Passenger-Timing: queue=");
+		appendMsec(headerData, checkout - spawn);
+		headerData.append(";spawn=");
+		appendMsec(headerData, spawn);
+		headerData.append(";app=");
+		appendMsec(headerData, phaseDuration(times.headerSent, times.firstResponseByte));
+		headerData.append(";buffer=");
+		appendMsec(headerData, phaseDuration(times.headerRead, times.bodyBuffered));
+		headerData.append("\r\n");
+	}
+
+	/**
+	 * Appends a Date header. It's formatted at most once per second, because
+	 * strftime() is too expensive to do for every response.
+	 */
+	void appendDateHeader(string &headerData) {
+		time_t now = (time_t) ev_now(libev->getLoop());
+		if (now != dateHeaderTime) {
+			char *pos = dateHeader;
+			const char *end = dateHeader + sizeof(dateHeader) - 1;
+			struct tm the_tm;
+
+			pos = appendData(pos, end, "Date: ");
+			gmtime_r(&now, &the_tm);
+			pos += strftime(pos, end - pos, "%a, %d %b %Y %H:%M:%S %Z", &the_tm);
+			pos = appendData(pos, end, "\r\n");
+			dateHeaderSize = pos - dateHeader;
+			dateHeaderTime = now;
+		}
+		headerData.append(dateHeader, dateHeaderSize);
+	}
+
+	/**
+	 * Handles the X-Passenger-Resource-Usage response header, with which the
+	 * application reports the CPU time, in microseconds, and the number of
+	 * objects that it used for generating the response, e.g.
+	 * "cpu=1534;allocations=2981". They're added to the totals of the
+	 * process and its group, and logged to Union Station.
+	 */
+	void recordResourceUsage(const ClientPtr &client, const StaticString &value) {
+		unsigned long long cpuTime = 0, allocations = 0;
+		vector<StaticString> fields;
+
+		split(value, ';', fields);
+		foreach (const StaticString &field, fields) {
+			if (startsWith(field, "cpu=")) {
+				cpuTime = stringToULL(field.substr(sizeof("cpu=") - 1));
+			} else if (startsWith(field, "allocations=")) {
+				allocations = stringToULL(field.substr(sizeof("allocations=") - 1));
+			}
+		}
+
+		if (client->session != NULL) {
+			client->session->reportResourceUsage(cpuTime, allocations);
+		}
+		if (client->useUnionStation()) {
+			client->logMessage("Resource usage: cpu=" + toString(cpuTime) +
+				" allocations=" + toString(allocations));
+		}
+	}
+
+	/*
+	 * Given a full header, possibly modify the header and send it to the clientOutputPipe.
+	 */
+	bool processResponseHeader(const ClientPtr &client,
+		const StaticString &origHeaderData)
+	{
+		// Strip trailing CRLF.
+		StaticString origHeader(origHeaderData.data(), origHeaderData.size() - 2);
+		string &headerData = client->outputHeader;
+		headerData.clear();
+		headerData.reserve(origHeaderData.size() + 150);
+		char statusBuf[100];
+
+		/* The status line and the Status header are sorted out while copying
+		 * the header, so that nothing has to be inserted or erased in the
+		 * middle of it afterwards.
+		 */
+		if (startsWith(origHeader, "HTTP/1.")) {
+			Header status = lookupHeader(origHeader, "Status", "status");
+			StaticString body = origHeader;
+			// Remove status line if necesary.
+			if (!getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
+				string::size_type end = origHeader.find("\r\n");
+				if (end == string::npos) {
+					disconnectWithError(client, "application sent malformed response: the HTTP status line is invalid.");
+					return false;
+				}
+				body = origHeader.substr(end + 2);
+			}
+			if (status.empty()) {
+				headerData.append(body.data(), body.size());
+				// Add status header if necessary.
+				if (!addStatusHeaderFromStatusLine(client, origHeader, headerData)) {
+					return false;
+				}
+			} else {
+				// Add reason phrase to existing status header if necessary.
+				appendWithStatus(headerData, body, status,
+					statusWithReasonPhrase(status, statusBuf, sizeof(statusBuf)));
+			}
+		} else {
+			Header status = lookupHeader(origHeader, "Status", "status");
+			if (!status.empty()) {
+				// Add reason phrase to status header if necessary.
+				StaticString statusValue = statusWithReasonPhrase(status,
+					statusBuf, sizeof(statusBuf));
+				// Add status line if necessary.
+				if (getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
+					headerData.append("HTTP/1.1 ");
+					headerData.append(statusValue.data(), statusValue.size());
+					headerData.append("\r\n");
+				}
+				appendWithStatus(headerData, origHeader, status, statusValue);
+			} else {
+				disconnectWithError(client, "application sent malformed response: it didn't send an HTTP status line or a Status header.");
+				return false;
+			}
+		}
+
+		if (client->useUnionStation() || client->unionStationDeferred) {
+			Header status = lookupHeader(headerData, "Status", "status");
+			client->responseStatusCode = stringToInt(status.value);
+			if (client->useUnionStation()) {
+				client->logMessage(client->arena.concat("Status: ", status.value));
+			}
+		}
+
+		Header resourceUsage = lookupHeader(headerData, "X-Passenger-Resource-Usage",
+			"x-passenger-resource-usage");
+		if (!resourceUsage.empty()) {
+			recordResourceUsage(client, resourceUsage.value);
+			removeHeader(headerData, resourceUsage);
+		}
+
+		if (client->httpFrontend) {
+			client->responseBodyless = responseHasNoBody(client, headerData);
+		}
+		if (client->scgiParser.hasHeader(ScgiRequestParser::KH_HTTP_UPGRADE)) {
+			Header status = lookupHeader(headerData, "Status", "status");
+			client->upgraded = startsWith(status.value, "101");
+		}
+
+		// Send the file named in the X-Sendfile header ourselves, if allowed.
+		Header sendfile = lookupHeader(headerData, "X-Sendfile", "x-sendfile");
+		if (!sendfile.empty() && !sendfileRoots.empty()) {
+			if (!prepareSendfileResponse(client, headerData, sendfile)) {
+				return false;
+			}
+		}
+
+		// Process chunked transfer encoding.
+		Header transferEncoding = lookupHeader(headerData, "Transfer-Encoding", "transfer-encoding");
+		if (!transferEncoding.empty() && transferEncoding.value == "chunked") {
+			P_TRACE(3, "Response with chunked transfer encoding detected.");
+			client->chunkedResponse = true;
+			removeHeader(headerData, transferEncoding);
+		} else if (client->keepAliveSession) {
+			// Without chunked framing we can only detect the end of the
+			// response through EOF, so the connection can't be reused.
+			RH_TRACE(client, 3, "Keep-alive session response is not chunked; connection will not be reused");
+			client->keepAliveSession = false;
+		}
+		if (client->sendfileFile == -1) {
+			maybeStartCachingResponse(client, headerData);
+			maybeStartCompressingResponse(client, headerData);
+		}
+		if (options.compressBufferFiles && client->compressor == NULL) {
+			// Responses that are compressed already don't get any smaller.
+			Header contentType = lookupHeader(headerData, "Content-Type", "content-type");
+			client->clientOutputPipe->setCompression(!contentType.empty()
+				&& isCompressibleContentType(contentType.value)
+				&& lookupHeader(headerData, "Content-Encoding", "content-encoding").empty());
+		}
+		if (!client->cachingResponse) {
+			// There won't be a response for the collapsed requests to share.
+			releaseCollapsedRequests(client);
+		}
+		if (client->httpFrontend) {
+			prepareHttpResponseHeader(client, headerData);
+		}
+		// The frontend wants the same chunked framing that the application
+		// used, so unless the body must be looked at, pass it on unmodified.
+		client->passThroughChunks = client->chunkedResponse
+			&& client->frontendKeepAlive
+			&& !client->responseBodyless
+			&& !client->cachingResponse
+			&& client->compressor == NULL;
+		if (client->frontendKeepAlive && !client->responseBodyless) {
+			// On a persistent frontend connection the web server finds the
+			// end of the response through chunked framing, which is applied
+			// in onAppInputChunk() and endClientOutput().
+			headerData.append("Transfer-Encoding: chunked\r\n");
+		}
+
+		appendPoweredByHeader(client, headerData);
+		if (client->timingHeader) {
+			appendTimingHeader(client, headerData);
+		}
+
+		// Add sticky session ID.
+		if (client->stickySession && client->session != NULL) {
+			StaticString cookieName = getStickySessionCookieName(client);
+			headerData.append("Set-Cookie: ");
+			headerData.append(cookieName.data(), cookieName.size());
+			headerData.append("=");
+			headerData.append(toString(client->session->getStickySessionId()));
+			headerData.append("; HttpOnly\r\n");
+		}
+
+		// Add Date header. https://code.google.com/p/phusion-passenger/issues/detail?id=485
+		if (lookupHeader(headerData, "Date", "date").empty()) {
+			appendDateHeader(headerData);
+		}
+
+		// Detect out of band work request
+		Header oobw = lookupHeader(headerData, "X-Passenger-Request-OOB-Work", "x-passenger-request-oob-work");
+		if (!oobw.empty()) {
+			P_TRACE(3, "Response with oobw detected.");
+			if (client->session != NULL) {
+				client->session->requestOOBW();
+			}
+			removeHeader(headerData, oobw);
+		}
+
+		headerData.append("\r\n");
+		writeToClientOutputPipe(client, headerData);
+		if (headerData.capacity() > MAX_KEPT_OUTPUT_HEADER_SIZE) {
+			// Don't hold on to the memory of an unusually large header.
+			string().swap(headerData);
+		}
+		if (client->sendfileFile != -1) {
+			abandonAppResponse(client);
+		}
+		return true;
+	}
+
+	/**
+	 * Whether the response to an HTTP client must not have a body: responses
+	 * to HEAD requests, and 204 and 304 responses.
+	 */
+	static bool responseHasNoBody(const ClientPtr &client, const StaticString &headerData) {
+		if (client->scgiParser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD) == "HEAD") {
+			return true;
+		} else {
+			Header status = lookupHeader(headerData, "Status", "status");
+			return startsWith(status.value, "204") || startsWith(status.value, "304");
+		}
+	}
+
+	/**
+	 * HTTP clients talk to us directly, so the response header must tell them
+	 * whether the connection stays open. An application that wants it closed
+	 * gets its way. Chunked responses lose their Content-Length, because the
+	 * two must not be combined.
+	 */
+	void prepareHttpResponseHeader(const ClientPtr &client, string &headerData) {
+		Header connection = lookupHeader(headerData, "Connection", "connection");
+		if (!connection.empty() && HttpRequestParser::listContains(connection.value, "close")) {
+			client->frontendKeepAlive = false;
+		}
+		if (client->frontendKeepAlive) {
+			Header contentLength = lookupHeader(headerData, "Content-Length", "content-length");
+			if (!contentLength.empty() && !client->responseBodyless) {
+				removeHeader(headerData, contentLength);
+			}
+		} else if (connection.empty()) {
+			headerData.append("Connection: close\r\n");
+		}
+	}
+
+	/**
+	 * Called when the response header contains an X-Sendfile header. Opens
+	 * the named file, provided that it's located in one of the sendfileRoots,
+	 * and replaces the X-Sendfile header with a Content-Length header. The
+	 * file is sent to the client after the header; see sendFileToClient().
+	 * Returns false if the client has been disconnected.
+	 */
+	bool prepareSendfileResponse(const ClientPtr &client, string &headerData,
+		const Header &header)
+	{
+		string path = header.value;
+		string realPath;
+		removeHeader(headerData, header);
+
+		try {
+			realPath = canonicalizePath(path);
+		} catch (const FileSystemException &e) {
+			disconnectWithError(client, "cannot send the file in the X-Sendfile header: " +
+				string(e.what()));
+			return false;
+		}
+		if (!isInSendfileRoot(realPath)) {
+			disconnectWithError(client, "application sent an X-Sendfile header for a file "
+				"that is not in an allowed directory: " + path);
+			return false;
+		}
+
+		UniqueFileDescriptor file(syscalls::open(realPath.c_str(), O_RDONLY));
+		struct stat buf;
+		if (file == -1 || fstat(file, &buf) == -1) {
+			int e = errno;
+			disconnectWithError(client, "cannot open the file in the X-Sendfile header (" +
+				path + "): " + strerror(e) + " (errno=" + toString(e) + ")");
+			return false;
+		} else if (!S_ISREG(buf.st_mode)) {
+			disconnectWithError(client, "application sent an X-Sendfile header for something "
+				"that is not a regular file: " + path);
+			return false;
+		}
+
+		Header contentLength = lookupHeader(headerData, "Content-Length", "content-length");
+		if (!contentLength.empty()) {
+			removeHeader(headerData, contentLength);
+		}
+		headerData.append("Content-Length: ");
+		headerData.append(toString(buf.st_size));
+		headerData.append("\r\n");
+
+		RH_DEBUG(client, "Sending " << realPath << " on behalf of the application");
+		client->sendfileFile = file.share();
+		client->sendfileOffset = 0;
+		if (client->scgiParser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD) == "HEAD") {
+			client->sendfileEnd = 0;
+		} else {
+			client->sendfileEnd = buf.st_size;
+		}
+		// The response body is delimited by its Content-Length and EOF
+		// instead of by chunked framing.
+		client->frontendKeepAlive = false;
+		return true;
+	}
+
+	bool isInSendfileRoot(const string &path) const {
+		vector<string>::const_iterator it, end = sendfileRoots.end();
+		for (it = sendfileRoots.begin(); it != end; it++) {
+			const string &root = *it;
+			if (path.size() > root.size()
+			 && path.compare(0, root.size(), root) == 0
+			 && (path[root.size()] == '/' || root == "/"))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Called after the header of a response with an X-Sendfile header has
+	 * been written. Whatever body the application sends is irrelevant, so
+	 * the session is closed right away, freeing the application process
+	 * while the file is being sent.
+	 */
+	void abandonAppResponse(const ClientPtr &client) {
+		RH_TRACE(client, 3, "Not reading the rest of the application response");
+		client->appInput->stop();
+		client->chunkedResponse = false;
+		client->keepAliveSession = false;
+		client->session.reset();
+		client->endScopeLog(&client->scopeLogs.requestProxying);
+		endClientOutput(client);
+	}
+
+	void writeToClientOutputPipe(const ClientPtr &client, const StaticString &data) {
+		bool wasCommittingToDisk = client->clientOutputPipe->isCommittingToDisk();
 		bool nowCommittingToDisk = !client->clientOutputPipe->write(data.data(), data.size());
 		if (!wasCommittingToDisk && nowCommittingToDisk) {
 			RH_TRACE(client, 3, "Buffering response data to disk; temporarily stopping application socket.");
@@ -1104,182 +2377,1222 @@ private:
 		}
 	}
 
-	size_t onAppInputData(const ClientPtr &client, const StaticString &data) {
-		RH_LOG_EVENT(client, "onAppInputData");
+	size_t onAppInputData(const ClientPtr &client, const StaticString &data) {
+		RH_LOG_EVENT(client, "onAppInputData");
+		if (!client->connected()) {
+			return 0;
+		}
+
+		if (!data.empty()) {
+			RH_TRACE(client, 3, "Application sent data: \"" << cEscapeString(data) << "\"");
+
+			// Buffer the application response until we've encountered the end of the header.
+			if (!client->responseHeaderSeen) {
+				if (client->phaseTimes.firstResponseByte == 0) {
+					client->phaseTimes.firstResponseByte = monotonicTimeUsec();
+				}
+				size_t consumed = client->responseHeaderBufferer.feed(data.data(), data.size());
+				if (!client->responseHeaderBufferer.acceptingInput()) {
+					if (client->responseHeaderBufferer.hasError()) {
+						disconnectWithError(client, "application response format error (invalid header)");
+					} else {
+						// Now that we have a full header, do something with it.
+						client->responseHeaderSeen = true;
+						StaticString header = client->responseHeaderBufferer.getData();
+						if (processResponseHeader(client, header)) {
+							if (client->upgraded) {
+								maybeStartTunnel(client);
+							} else if (consumed == data.size()) {
+								maybeStartSplicingResponse(client);
+							}
+							return consumed;
+						} else {
+							assert(!client->connected());
+						}
+					}
+				}
+			// The header has already been processed so forward it
+			// directly to clientOutputPipe, possibly through a
+			// dechunker first.
+			} else if (client->passThroughChunks) {
+				passThroughResponseChunks(client, data);
+			} else if (client->chunkedResponse) {
+				client->responseDechunker.feed(data.data(), data.size());
+			} else {
+				onAppInputChunk(client, data);
+				if (client->upgraded) {
+					maybeStartTunnel(client);
+				} else {
+					maybeStartSplicingResponse(client);
+				}
+			}
+			return data.size();
+
+		} else {
+			onAppInputEof(client);
+			return 0;
+		}
+	}
+
+	/**
+	 * Forwards chunked response data as-is, up to and including the
+	 * terminating chunk. responseDechunker skips over the chunk data instead
+	 * of emitting it, so that the response costs one write per read instead
+	 * of several per chunk.
+	 */
+	void passThroughResponseChunks(const ClientPtr &client, const StaticString &data) {
+		Dechunker &dechunker = client->responseDechunker;
+		size_t accepted = dechunker.skip(data.data(), data.size());
+		writeToClientOutputPipe(client, data.substr(0, accepted));
+		if (dechunker.isDone()) {
+			onAppInputChunkEnd(client);
+		}
+	}
+
+	void onAppInputChunk(const ClientPtr &client, const StaticString &data) {
+		RH_LOG_EVENT(client, "onAppInputChunk");
+		if (client->cachingResponse) {
+			if (client->cachedBody.size() + data.size() > responseCache->getMaxEntrySize()) {
+				RH_TRACE(client, 3, "Response is too large for the response cache");
+				client->stopCachingResponse();
+				releaseCollapsedRequests(client);
+			} else {
+				client->cachedBody.append(data.data(), data.size());
+			}
+		}
+		if (client->compressor != NULL) {
+			compressResponseData(client, data);
+		} else {
+			writeResponseBodyData(client, data);
+		}
+	}
+
+	/**
+	 * Writes (unframed) response body data to clientOutputPipe, applying
+	 * chunked framing if the frontend connection is persistent.
+	 */
+	void writeResponseBodyData(const ClientPtr &client, const StaticString &data) {
+		if (client->responseBodyless) {
+			return;
+		} else if (client->frontendKeepAlive) {
+			if (data.empty()) {
+				// An empty chunk would terminate the response.
+				return;
+			}
+			char sizeLine[sizeof(unsigned long) * 2 + 3];
+			int len = snprintf(sizeLine, sizeof(sizeLine), "%lx\r\n", (unsigned long) data.size());
+			writeToClientOutputPipe(client, StaticString(sizeLine, len));
+			writeToClientOutputPipe(client, data);
+			writeToClientOutputPipe(client, StaticString("\r\n", 2));
+		} else {
+			writeToClientOutputPipe(client, data);
+		}
+	}
+
+	void compressResponseData(const ClientPtr &client, const StaticString &data) {
+		client->compressionInput.append(data.data(), data.size());
+		submitCompressionStep(client);
+		if (client->compressionInput.size() >= MAX_COMPRESSION_BACKLOG
+		 && !client->compressionThrottled
+		 && client->session != NULL
+		 && client->session->initiated())
+		{
+			RH_TRACE(client, 3, "Response compression is falling behind; temporarily stopping application socket.");
+			client->compressionThrottled = true;
+			client->appInput->stop();
+		}
+	}
+
+	/**
+	 * Hands the collected response body data to the compression pool, unless
+	 * a compression step for this client is already running. The response is
+	 * only compressed by one thread at a time, in order.
+	 */
+	void submitCompressionStep(const ClientPtr &client) {
+		ResponseCompressorPtr compressor = client->compressor;
+		if (client->compressionInFlight
+		 || (client->compressionInput.empty() && !client->compressionEnding))
+		{
+			return;
+		}
+
+		compressor->input.swap(client->compressionInput);
+		compressor->finishing = client->compressionEnding;
+		client->compressionInFlight = true;
+		compressionPool->submit(boost::bind(runCompressionStep, libev, compressor,
+			CompressionPool::Job(boost::bind(&RequestHandler::onCompressionStepDone,
+				this, ClientWeakPtr(client), compressor))));
+	}
+
+	/** Runs in a compression pool thread. */
+	static void runCompressionStep(const SafeLibevPtr &libev, const ResponseCompressorPtr &compressor,
+		const CompressionPool::Job &done)
+	{
+		compressor->step();
+		libev->runLater(done);
+	}
+
+	void onCompressionStepDone(const ClientWeakPtr &weakClient, const ResponseCompressorPtr &compressor) {
+		ClientPtr client = weakClient.lock();
+		// The client may have been disconnected or may have moved on to the
+		// next request in the meantime.
+		if (client == NULL || !client->connected() || client->compressor != compressor) {
+			return;
+		}
+
+		client->compressionInFlight = false;
+		if (!compressor->errorMessage.empty()) {
+			disconnectWithError(client, "cannot compress response: " + compressor->errorMessage);
+			return;
+		}
+		if (!compressor->output.empty()) {
+			writeResponseBodyData(client, compressor->output);
+			compressor->output.clear();
+		}
+		if (compressor->isFinished()) {
+			client->compressor.reset();
+			finishClientOutput(client);
+			return;
+		}
+
+		submitCompressionStep(client);
+		if (client->compressionThrottled
+		 && client->compressionInput.size() < MAX_COMPRESSION_BACKLOG)
+		{
+			RH_TRACE(client, 3, "Response compression caught up; resuming application socket.");
+			client->compressionThrottled = false;
+			if (client->session != NULL
+			 && client->session->initiated()
+			 && !client->clientOutputPipe->isCommittingToDisk())
+			{
+				client->appInput->start();
+			}
+		}
+	}
+
+	/**
+	 * Called when the application has sent the entire response.
+	 */
+	void endClientOutput(const ClientPtr &client) {
+		if (client->cachingResponse) {
+			if (client->chunkedResponse) {
+				// onAppInputChunkEnd() would have stored it.
+				RH_TRACE(client, 3, "Response ended before its last chunk; not caching it");
+				client->stopCachingResponse();
+				releaseCollapsedRequests(client);
+			} else {
+				storeCachedResponse(client);
+			}
+		}
+		if (client->compressor != NULL) {
+			// finishClientOutput() is called when the last compression
+			// step is done.
+			client->compressionEnding = true;
+			submitCompressionStep(client);
+		} else {
+			finishClientOutput(client);
+		}
+	}
+
+	/**
+	 * Called when the entire response has been written to clientOutputPipe.
+	 */
+	void finishClientOutput(const ClientPtr &client) {
+		if (client->frontendKeepAlive) {
+			if (!client->responseHeaderSeen) {
+				// Nothing was sent, so let the web server see an EOF.
+				client->frontendKeepAlive = false;
+			} else if (client->passThroughChunks) {
+				if (!client->responseDechunker.isDone()) {
+					// The application's response was cut short in the
+					// middle of its chunked body; EOF tells the web server.
+					client->frontendKeepAlive = false;
+				}
+			} else if (!client->responseBodyless) {
+				writeToClientOutputPipe(client, StaticString("0\r\n\r\n", 5));
+			}
+		}
+		client->clientOutputPipe->end();
+		maybeOffloadSlowClient(client);
+	}
+
+	void onAppInputChunkEnd(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onAppInputChunkEnd");
+		if (client->cachingResponse && client->connected()) {
+			storeCachedResponse(client);
+		}
+		if (client->keepAliveSession && client->connected() && client->session != NULL) {
+			checkinKeepAliveSession(client);
+		}
+		onAppInputEof(client);
+	}
+
+	/**
+	 * Called when the application has finished sending a response on a
+	 * keep-alive session. Closes the session, allowing its connection to
+	 * be reused for another request if the exchange completed cleanly.
+	 */
+	void checkinKeepAliveSession(const ClientPtr &client) {
+		bool reusable = client->requestBodySent
+			&& client->appOutputBuffer.empty()
+			&& !client->appOutputWatcher.is_active();
+		RH_DEBUG(client, "Keep-alive session finished; connection " <<
+			(reusable ? "will be reused" : "will not be reused"));
+		client->appInput->stop();
+		client->appOutputWatcher.stop();
+		client->session->close(reusable);
+		client->session.reset();
+		client->endScopeLog(&client->scopeLogs.requestProxying);
+		endClientOutput(client);
+	}
+
+	void onAppInputEof(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onAppInputEof");
+		// Check for session == NULL in order to avoid executing the code twice on
+		// responses with chunked encoding.
+		if (!client->connected() || client->session == NULL) {
+			return;
+		}
+
+		RH_DEBUG(client, "Application sent EOF");
+		client->keepAliveSession = false;
+		client->session.reset();
+		client->endScopeLog(&client->scopeLogs.requestProxying);
+		endClientOutput(client);
+	}
+
+	void onAppInputError(const ClientPtr &client, const char *message, int errorCode) {
+		RH_LOG_EVENT(client, "onAppInputError");
+		if (!client->connected()) {
+			return;
+		}
+
+		if (errorCode == ECONNRESET) {
+			// We might as well treat ECONNRESET like an EOF.
+			// http://stackoverflow.com/questions/2974021/what-does-econnreset-mean-in-the-context-of-an-af-local-socket
+			onAppInputEof(client);
+		} else {
+			stringstream message;
+			message << "application socket read error: ";
+			message << strerror(errorCode);
+			message << " (fd=" << client->appInput->getFd();
+			message << ", errno=" << errorCode << ")";
+			disconnectWithError(client, message.str());
+		}
+	}
+
+	void onClientOutputPipeCommit(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onClientOutputPipeCommit");
+		if (!client->connected()) {
+			return;
+		}
+
+		RH_TRACE(client, 3, "Done buffering response data to disk; resuming application socket.");
+		client->backgroundOperations--;
+		// If the data comes from writeErrorResponse(), then appInput is not available.
+		if (client->session != NULL
+		 && client->session->initiated()
+		 && !client->compressionThrottled)
+		{
+			client->appInput->start();
+		}
+		maybeOffloadSlowClient(client);
+	}
+
+
+	/*****************************************************
+	 * COMPONENT: clientOutputPipe -> client fd plumbing
+	 *
+	 * The following code handles forwarding data from
+	 * clientOutputPipe to the client socket.
+	 *****************************************************/
+
+	void onClientOutputPipeData(const ClientPtr &client, const char *data,
+		size_t size, const FileBackedPipe::ConsumeCallback &consumed)
+	{
+		RH_LOG_EVENT(client, "onClientOutputPipeData");
+		if (!client->connected()) {
+			return;
+		}
+
+		RH_TRACE(client, 3, "Forwarding " << size << " bytes of application data to client.");
+		ssize_t ret = syscalls::write(client->fd, data, size);
+		if (ret == -1) {
+			int e = errno;
+			RH_TRACE(client, 3, "Could not write to client socket: " << strerror(e) << " (errno=" << e << ")");
+			if (e == EAGAIN) {
+				RH_TRACE(client, 3, "Waiting until the client socket is writable again.");
+				client->clientOutputWatcher.start();
+				consumed(0, true);
+				maybeOffloadSlowClient(client);
+			} else if (e == EPIPE || e == ECONNRESET) {
+				// If the client closed the connection then disconnect quietly.
+				RH_TRACE(client, 3, "Client stopped reading prematurely");
+				if (client->useUnionStation()) {
+					client->logMessage("Disconnecting: client stopped reading prematurely");
+				}
+				disconnect(client);
+			} else {
+				disconnectWithClientSocketWriteError(client, e);
+			}
+		} else {
+			RH_TRACE(client, 3, "Managed to forward " << ret << " bytes.");
+			bytesSentMetric->add(ret);
+			consumed(ret, false);
+			if (client->upgraded) {
+				maybeStartTunnel(client);
+			}
+		}
+	}
+
+	void onClientOutputPipeEnd(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onClientOutputPipeEnd");
+		if (!client->connected()) {
+			return;
+		}
+
+		if (client->sendfileFile != -1) {
+			client->sendingFile = true;
+			sendFileToClient(client);
+		} else {
+			onClientOutputEnd(client);
+		}
+	}
+
+	/** Called when the entire response has been written to the client socket. */
+	void onClientOutputEnd(const ClientPtr &client) {
+		client->endScopeLog(&client->scopeLogs.requestProcessing);
+		if (client->frontendKeepAlive
+		 && client->requestBodySent
+		 && !client->appOutputWatcher.is_active())
+		{
+			RH_TRACE(client, 2, "Client output pipe ended; waiting for next request on this connection");
+			// We're inside a clientOutputPipe callback, so don't reset it here.
+			libev->runLater(boost::bind(&RequestHandler::beginNextFrontendRequest,
+				this, client));
+		} else {
+			RH_TRACE(client, 2, "Client output pipe ended; disconnecting client");
+			disconnect(client);
+		}
+	}
+
+	void beginNextFrontendRequest(ClientPtr client) {
+		if (!client->connected()) {
+			return;
+		}
+		releaseRateLimit(client);
+		recordLatencies(client);
+		finishUnionStationRequest(client);
+		releaseCollapsedRequests(client);
+		client->prepareForNextRequest();
+		client->verifyInvariants();
+		RH_DEBUG(client, "Reading next request on persistent connection");
+	}
+
+	void onClientOutputPipeError(const ClientPtr &client, int errorCode) {
+		RH_LOG_EVENT(client, "onClientOutputPipeError");
+		if (!client->connected()) {
+			return;
+		}
+
+		stringstream message;
+		message << "client output pipe error: ";
+		message << strerror(errorCode);
+		message << " (errno=" << errorCode << ")";
+		disconnectWithError(client, message.str());
+	}
+
+	bool canOffloadSlowClient(const ClientPtr &client) const {
+		return responseDrainer != NULL
+			&& client->connected()
+			&& client->session == NULL
+			&& client->compressor == NULL
+			&& !client->frontendKeepAlive
+			&& !client->splicingResponse
+			&& client->sendfileFile == -1
+			&& client->clientOutputWatcher.is_active();
+	}
+
+	/**
+	 * Called whenever the client may have become a slow client whose
+	 * response is complete. The rest of the response is then handed over to
+	 * responseDrainer, freeing this event loop from the client. We may be
+	 * inside a clientOutputPipe callback, so the hand-over happens later.
+	 */
+	void maybeOffloadSlowClient(const ClientPtr &client) {
+		if (canOffloadSlowClient(client)) {
+			libev->runLater(boost::bind(&RequestHandler::offloadSlowClient,
+				this, client));
+		}
+	}
+
+	void offloadSlowClient(ClientPtr client) {
+		string memoryData;
+		FileDescriptor file;
+		off_t fileOffset, fileEnd;
+
+		if (!canOffloadSlowClient(client)
+		 || !client->clientOutputPipe->detachBufferedData(memoryData, file,
+		     fileOffset, fileEnd))
+		{
+			return;
+		}
+
+		RH_DEBUG(client, "Client is reading slowly; handing the rest of the response (" <<
+			(memoryData.size() + (fileEnd - fileOffset)) << " bytes) to the slow client drainer");
+		client->clientOutputWatcher.stop();
+		responseDrainer->drain(client->fd, memoryData, file, fileOffset, fileEnd);
+		client->endScopeLog(&client->scopeLogs.requestProcessing);
+		disconnect(client);
+	}
+
+	void onClientOutputWritable(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onClientOutputWritable");
+		if (!client->connected()) {
+			return;
+		}
+
+		// Continue forwarding output data to the client.
+		RH_TRACE(client, 3, "Client socket became writable again.");
+		client->clientOutputWatcher.stop();
+		if (client->sendingFile) {
+			sendFileToClient(client);
+		} else {
+			assert(!client->clientOutputPipe->isStarted());
+			client->clientOutputPipe->start();
+		}
+	}
+
+
+	/*****************************************************
+	 * COMPONENT: X-Sendfile file -> client fd
+	 *
+	 * After the header of a response with an X-Sendfile
+	 * header (or of a static file) has been written through
+	 * clientOutputPipe, the file is written to the client
+	 * socket directly, with sendfile() where available.
+	 *****************************************************/
+
+	static const size_t SENDFILE_BLOCK_SIZE = 64 * 1024;
+
+	/**
+	 * Writes up to SENDFILE_BLOCK_SIZE bytes of the file to the client
+	 * socket. Returns the number of bytes written, or -1 with errno set.
+	 */
+	ssize_t sendFileBlock(const ClientPtr &client) {
+		size_t size = (size_t) std::min<off_t>(SENDFILE_BLOCK_SIZE,
+			client->sendfileEnd - client->sendfileOffset);
+		ssize_t ret;
+
+		#ifdef RH_SENDFILE_AVAILABLE
+			off_t offset = client->sendfileOffset;
+			do {
+				ret = sendfile(client->fd, client->sendfileFile, &offset, size);
+			} while (ret == -1 && errno == EINTR);
+		#else
+			char buf[1024 * 16];
+			ret = ::pread(client->sendfileFile, buf,
+				std::min(size, sizeof(buf)), client->sendfileOffset);
+			if (ret > 0) {
+				ret = syscalls::write(client->fd, buf, ret);
+			}
+		#endif
+		if (ret > 0) {
+			client->sendfileOffset += ret;
+			bytesSentMetric->add(ret);
+		}
+		return ret;
+	}
+
+	void sendFileToClient(const ClientPtr &client) {
+		while (client->sendfileOffset < client->sendfileEnd) {
+			ssize_t ret = sendFileBlock(client);
+			if (ret == 0) {
+				disconnectWithError(client, "the file being sent was truncated "
+					"while sending it");
+				return;
+			} else if (ret == -1) {
+				int e = errno;
+				if (e == EAGAIN) {
+					if (responseDrainer != NULL && !client->frontendKeepAlive) {
+						offloadSendfileClient(client);
+					} else {
+						RH_TRACE(client, 3, "Waiting until the client socket is writable again.");
+						client->clientOutputWatcher.start();
+					}
+				} else if (e == EPIPE || e == ECONNRESET) {
+					RH_TRACE(client, 3, "Client stopped reading prematurely");
+					if (client->useUnionStation()) {
+						client->logMessage("Disconnecting: client stopped reading prematurely");
+					}
+					disconnect(client);
+				} else {
+					disconnectWithClientSocketWriteError(client, e);
+				}
+				return;
+			}
+		}
+
+		RH_TRACE(client, 3, "Done sending the file");
+		client->sendingFile = false;
+		client->sendfileFile = FileDescriptor();
+		onClientOutputEnd(client);
+	}
+
+	/** Hands the rest of the file over to responseDrainer. */
+	void offloadSendfileClient(const ClientPtr &client) {
+		string memoryData;
+		RH_DEBUG(client, "Client is reading slowly; handing the rest of the file (" <<
+			(client->sendfileEnd - client->sendfileOffset) << " bytes) to the slow client drainer");
+		responseDrainer->drain(client->fd, memoryData, client->sendfileFile,
+			client->sendfileOffset, client->sendfileEnd);
+		client->endScopeLog(&client->scopeLogs.requestProcessing);
+		disconnect(client);
+	}
+
+
+	/*****************************************************
+	 * COMPONENT: static files
+	 *
+	 * GET and HEAD requests for files in the application's
+	 * public directory, and for page cache files (foo.html
+	 * for /foo, index.html for /), are answered from the
+	 * file system without checking out a session. This is
+	 * what the Nginx module does in front of us; here it's
+	 * for HTTP clients that talk to us directly. Files are
+	 * sent like X-Sendfile files, through staticFileCache.
+	 *****************************************************/
+
+	/**
+	 * Unescapes PATH_INFO into `path`. Returns false for paths that must
+	 * not be mapped to files: malformed ones and ones that contain NUL
+	 * bytes or ".." segments.
+	 */
+	static bool decodeStaticFilePath(const StaticString &pathInfo, string &path) {
+		if (pathInfo.empty() || pathInfo[0] != '/') {
+			return false;
+		}
+
+		path.clear();
+		path.reserve(pathInfo.size());
+		for (string::size_type i = 0; i < pathInfo.size(); i++) {
+			char ch = pathInfo[i];
+			if (ch == '%') {
+				if (i + 2 >= pathInfo.size()
+				 || !isxdigit(pathInfo[i + 1])
+				 || !isxdigit(pathInfo[i + 2]))
+				{
+					return false;
+				}
+				ch = (char) hexToUint(pathInfo.substr(i + 1, 2));
+				i += 2;
+			}
+			if (ch == '\0') {
+				return false;
+			}
+			path.append(1, ch);
+		}
+
+		string::size_type pos = 0;
+		while ((pos = path.find("/..", pos)) != string::npos) {
+			if (pos + 3 == path.size() || path[pos + 3] == '/') {
+				return false;
+			}
+			pos += 3;
+		}
+		return true;
+	}
+
+	/**
+	 * Looks up the file that the request maps to, if any: the file itself,
+	 * or else its page cache file. If the client accepts gzip and there's
+	 * a precompressed .gz variant, that one is returned instead, with
+	 * `gzipped` set to true. Returns NULL if there's nothing to serve.
+	 */
+	StaticFileCache::EntryPtr lookupStaticFile(const ClientPtr &client, string &filename,
+		bool &gzipped)
+	{
+		string path;
+		if (client->options.appRoot.empty()
+		 || !decodeStaticFilePath(client->scgiParser.getHeader("PATH_INFO"), path))
+		{
+			return StaticFileCache::EntryPtr();
+		}
+
+		unsigned long long now = monotonicTimeUsec();
+		string publicDir = client->options.appRoot + "/public";
+		StaticFileCache::EntryPtr entry;
+		if (path[path.size() - 1] != '/') {
+			filename = publicDir + path;
+			entry = staticFileCache->lookup(filename, now);
+		}
+		if (entry == NULL || !entry->exists()) {
+			if (path == "/") {
+				filename = publicDir + "/index.html";
+			} else if (path[path.size() - 1] != '/') {
+				filename = publicDir + path + ".html";
+			} else {
+				return StaticFileCache::EntryPtr();
+			}
+			entry = staticFileCache->lookup(filename, now);
+			if (!entry->exists()) {
+				return StaticFileCache::EntryPtr();
+			}
+		}
+
+		ResponseCompressor::Encoding encoding;
+		gzipped = false;
+		if (selectContentEncoding(client->scgiParser.getHeader(
+				ScgiRequestParser::KH_HTTP_ACCEPT_ENCODING), encoding)
+		 && encoding == ResponseCompressor::GZIP)
+		{
+			StaticFileCache::EntryPtr gzEntry = staticFileCache->lookup(filename + ".gz", now);
+			if (gzEntry->exists()) {
+				entry = gzEntry;
+				gzipped = true;
+			}
+		}
+		return entry;
+	}
+
+	/** Whether the client already has the given version of the file. */
+	static bool staticFileNotModified(const ClientPtr &client, const StaticFileCache::Entry &entry) {
+		StaticString ifNoneMatch = client->scgiParser.getHeader("HTTP_IF_NONE_MATCH");
+		if (!ifNoneMatch.empty()) {
+			return ifNoneMatch == "*"
+				|| ifNoneMatch.find(entry.etag) != string::npos;
+		} else {
+			return client->scgiParser.getHeader("HTTP_IF_MODIFIED_SINCE") == entry.lastModified;
+		}
+	}
+
+	/**
+	 * Answers the request with a static file if it maps to one. Returns
+	 * whether it did; if so then the request is done.
+	 */
+	bool maybeServeStaticFile(const ClientPtr &client) {
+		StaticString method = client->scgiParser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD);
+		if ((method != "GET" && method != "HEAD")
+		 || client->contentLength > 0
+		 || !getBoolOption(client, "PASSENGER_SERVE_STATIC_FILES", client->httpFrontend))
+		{
+			return false;
+		}
+
+		string filename;
+		bool gzipped;
+		StaticFileCache::EntryPtr entry = lookupStaticFile(client, filename, gzipped);
+		if (entry == NULL) {
+			return false;
+		}
+
+		RH_DEBUG(client, "Serving static file " << entry->path);
+		client->state = Client::WRITING_SIMPLE_RESPONSE;
+		client->clientInput->stop();
+		client->requestBodySent = true;
+		client->responseHeaderSeen = true;
+		if (!client->httpFrontend) {
+			// The web server expects chunked framing on a persistent
+			// connection, but the file is delimited by its Content-Length.
+			client->frontendKeepAlive = false;
+		}
+
+		bool notModified = staticFileNotModified(client, *entry);
+		client->responseStatusCode = notModified ? 304 : 200;
+		const char *status = getStatusCodeAndReasonPhrase(client->responseStatusCode);
+		string header;
+		header.reserve(400);
+		if (getBoolOption(client, "PASSENGER_STATUS_LINE", true)) {
+			header.append("HTTP/1.1 ");
+			header.append(status);
+			header.append("\r\n");
+		}
+		header.append("Status: ");
+		header.append(status);
+		header.append("\r\n");
+		if (!notModified) {
+			header.append("Content-Length: ");
+			header.append(toString(entry->info.st_size));
+			header.append("\r\nContent-Type: ");
+			StaticString contentType = StaticFileCache::getContentType(filename);
+			header.append(contentType.data(), contentType.size());
+			header.append("\r\n");
+		}
+		if (gzipped) {
+			header.append("Content-Encoding: gzip\r\n");
+		}
+		header.append("Vary: Accept-Encoding\r\nETag: ");
+		header.append(entry->etag);
+		header.append("\r\nLast-Modified: ");
+		header.append(entry->lastModified);
+		header.append("\r\n");
+		if (client->httpFrontend && !client->frontendKeepAlive) {
+			header.append("Connection: close\r\n");
+		}
+		appendDateHeader(header);
+		header.append("\r\n");
+
+		if (client->useUnionStation()) {
+			client->logMessage(string("Status: ") + status);
+			client->logMessage("Served static file " + entry->path);
+		}
+
+		writeToClientOutputPipe(client, header);
+		if (!notModified && method != "HEAD") {
+			client->sendfileFile = entry->fd;
+			client->sendfileOffset = 0;
+			client->sendfileEnd = entry->info.st_size;
+		}
+		staticFilesMetric->increment();
+		// Not endClientOutput(): the response is delimited by its
+		// Content-Length, so no chunked framing must be added.
+		client->clientOutputPipe->end();
+		return true;
+	}
+
+
+	/*****************************************************
+	 * COMPONENT: app fd -> client fd splicing
+	 *
+	 * On Linux, response bodies that need no transformation
+	 * are moved from the application socket to the client
+	 * socket with splice() through a kernel pipe, bypassing
+	 * appInput and clientOutputPipe. As soon as the client
+	 * can't keep up we fall back to clientOutputPipe, which
+	 * buffers the rest of the response.
+	 *****************************************************/
+
+	static const size_t SPLICE_BLOCK_SIZE = 64 * 1024;
+
+	/**
+	 * Called after some response data has been fully consumed from appInput.
+	 * Switches to splicing if the client is keeping up; that is, if nothing
+	 * is buffered in clientOutputPipe.
+	 */
+	void maybeStartSplicingResponse(const ClientPtr &client) {
+		#ifdef RH_SPLICE_AVAILABLE
+			if (!spliceAvailable
+			 || !spliceResponses
+			 || !client->connected()
+			 || client->chunkedResponse
+			 || client->frontendKeepAlive
+			 || client->responseBodyless
+			 || client->cachingResponse
+			 || client->compressor != NULL
+			 || client->session == NULL
+			 || !client->session->initiated()
+			 || !client->clientOutputPipe->isStarted()
+			 || client->clientOutputPipe->getBufferSize() > 0
+			 || client->clientOutputWatcher.is_active())
+			{
+				return;
+			}
+
+			if (!createSplicePipe()) {
+				return;
+			}
+
+			RH_TRACE(client, 3, "Client is keeping up; splicing rest of the response body");
+			client->splicingResponse = true;
+			client->appInput->stop();
+			client->appSpliceWatcher.set(libev->getLoop());
+			client->appSpliceWatcher.set(client->session->fd(), ev::READ);
+			client->appSpliceWatcher.start();
+		#endif
+	}
+
+	/**
+	 * Creates splicePipe if it doesn't exist yet. Disables splicing and
+	 * returns false if that fails.
+	 */
+	bool createSplicePipe() {
+		if (splicePipe.first == -1 && spliceAvailable) {
+			try {
+				splicePipe = createPipe();
+				setNonBlocking(splicePipe.first);
+				setNonBlocking(splicePipe.second);
+			} catch (const SystemException &e) {
+				P_WARN("Cannot create a pipe for splicing, disabling splicing: " <<
+					e.what());
+				spliceAvailable = false;
+				splicePipe = Pipe();
+			}
+		}
+		return spliceAvailable;
+	}
+
+	/**
+	 * Switches back to forwarding the response through appInput and
+	 * clientOutputPipe.
+	 */
+	void stopSplicingResponse(const ClientPtr &client) {
+		client->splicingResponse = false;
+		client->appSpliceWatcher.stop();
+	}
+
+	/**
+	 * Discards any data left in the splice pipe, e.g. because the client
+	 * has been disconnected in the middle of a splice.
+	 */
+	void discardSplicePipeData(size_t size) {
+		char buf[1024 * 4];
+		while (size > 0) {
+			ssize_t ret = syscalls::read(splicePipe.first, buf,
+				std::min(size, sizeof(buf)));
+			if (ret <= 0) {
+				break;
+			}
+			size -= ret;
+		}
+	}
+
+	void onAppSpliceReadable(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onAppSpliceReadable");
 		if (!client->connected()) {
-			return 0;
+			return;
 		}
+		assert(client->splicingResponse);
+
+		#ifdef RH_SPLICE_AVAILABLE
+			ssize_t ret;
+			do {
+				ret = splice(client->session->fd(), NULL, splicePipe.second, NULL,
+					SPLICE_BLOCK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			} while (ret == -1 && errno == EINTR);
+
+			if (ret == 0) {
+				stopSplicingResponse(client);
+				onAppInputEof(client);
+				return;
+			} else if (ret == -1) {
+				int e = errno;
+				if (e == EAGAIN) {
+					return;
+				}
+				stopSplicingResponse(client);
+				if (e == EINVAL || e == ENOSYS) {
+					P_INFO("splice() is not supported for application sockets; disabling splicing");
+					spliceAvailable = false;
+					client->appInput->start();
+				} else {
+					onAppInputError(client, "Cannot splice from socket", e);
+				}
+				return;
+			}
 
-		if (!data.empty()) {
-			RH_TRACE(client, 3, "Application sent data: \"" << cEscapeString(data) << "\"");
+			RH_TRACE(client, 3, "Spliced " << ret << " bytes from the application");
+			size_t pending = ret;
+			while (pending > 0) {
+				do {
+					ret = splice(splicePipe.first, NULL, client->fd, NULL,
+						pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				} while (ret == -1 && errno == EINTR);
 
-			// Buffer the application response until we've encountered the end of the header.
-			if (!client->responseHeaderSeen) {
-				size_t consumed = client->responseHeaderBufferer.feed(data.data(), data.size());
-				if (!client->responseHeaderBufferer.acceptingInput()) {
-					if (client->responseHeaderBufferer.hasError()) {
-						disconnectWithError(client, "application response format error (invalid header)");
-					} else {
-						// Now that we have a full header, do something with it.
-						client->responseHeaderSeen = true;
-						StaticString header = client->responseHeaderBufferer.getData();
-						if (processResponseHeader(client, header)) {
-							return consumed;
-						} else {
-							assert(!client->connected());
+				if (ret == -1) {
+					int e = errno;
+					if (e == EAGAIN) {
+						onSplicingClientBlocked(client, pending);
+					} else if (e == EPIPE || e == ECONNRESET) {
+						discardSplicePipeData(pending);
+						RH_TRACE(client, 3, "Client stopped reading prematurely");
+						if (client->useUnionStation()) {
+							client->logMessage("Disconnecting: client stopped reading prematurely");
 						}
+						disconnect(client);
+					} else {
+						discardSplicePipeData(pending);
+						disconnectWithClientSocketWriteError(client, e);
 					}
+					return;
+				} else {
+					pending -= ret;
+					bytesSentMetric->add(ret);
 				}
-			// The header has already been processed so forward it
-			// directly to clientOutputPipe, possibly through a
-			// dechunker first.
-			} else if (client->chunkedResponse) {
-				client->responseDechunker.feed(data.data(), data.size());
-			} else {
-				onAppInputChunk(client, data);
 			}
-			return data.size();
+		#endif
+	}
 
-		} else {
-			onAppInputEof(client);
-			return 0;
+	/**
+	 * The client socket isn't writable right now. Move the data that's left in
+	 * the splice pipe into clientOutputPipe so that it gets buffered, and resume
+	 * normal response forwarding.
+	 */
+	void onSplicingClientBlocked(const ClientPtr &client, size_t pending) {
+		RH_TRACE(client, 3, "Client is not keeping up; buffering rest of the response body");
+		char buf[SPLICE_BLOCK_SIZE];
+		ssize_t ret = syscalls::read(splicePipe.first, buf, std::min(pending, sizeof(buf)));
+		stopSplicingResponse(client);
+		client->appInput->start();
+		if (ret > 0) {
+			writeToClientOutputPipe(client, StaticString(buf, ret));
 		}
 	}
 
-	void onAppInputChunk(const ClientPtr &client, const StaticString &data) {
-		RH_LOG_EVENT(client, "onAppInputChunk");
-		writeToClientOutputPipe(client, data);
-	}
 
-	void onAppInputChunkEnd(const ClientPtr &client) {
-		RH_LOG_EVENT(client, "onAppInputChunkEnd");
-		onAppInputEof(client);
-	}
+	/*****************************************************
+	 * COMPONENT: client fd -> app fd splicing
+	 *
+	 * On Linux, request bodies that aren't buffered are
+	 * moved from the client socket to the application
+	 * socket with splice() through splicePipe, bypassing
+	 * clientInput. As soon as the application can't keep
+	 * up, whatever is left in the pipe is put in
+	 * appOutputBuffer and we fall back to clientInput
+	 * until the application has caught up again.
+	 *****************************************************/
 
-	void onAppInputEof(const ClientPtr &client) {
-		RH_LOG_EVENT(client, "onAppInputEof");
-		// Check for session == NULL in order to avoid executing the code twice on
-		// responses with chunked encoding.
-		if (!client->connected() || client->session == NULL) {
-			return;
-		}
+	/**
+	 * Called whenever the client body data read so far may have been
+	 * forwarded to the application. Switches to splicing if nothing is
+	 * buffered in clientInput. Pass <tt>clientInputDrained</tt> from inside
+	 * a clientInput callback that has consumed all the data it was given,
+	 * because clientInput only discards that data after the callback returns.
+	 */
+	void maybeStartSplicingRequestBody(const ClientPtr &client, bool clientInputDrained = false) {
+		#ifdef RH_SPLICE_AVAILABLE
+			if (!spliceAvailable
+			 || !spliceRequestBodies
+			 || !client->connected()
+			 || client->state != Client::FORWARDING_BODY_TO_APP
+			 || client->requestBodyIsBuffered
+			 || client->requestBodySent
+			 || client->scgiParser.hasHeader(ScgiRequestParser::KH_HTTP_UPGRADE)
+			 || client->session == NULL
+			 || !client->appOutputBuffer.empty()
+			 || client->appOutputWatcher.is_active()
+			 || client->clientSpliceWatcher.is_active()
+			 || (!clientInputDrained && client->clientInput->getBufferSize() > 0))
+			{
+				return;
+			}
 
-		RH_DEBUG(client, "Application sent EOF");
-		client->session.reset();
-		client->endScopeLog(&client->scopeLogs.requestProxying);
-		client->clientOutputPipe->end();
+			if (!createSplicePipe()) {
+				return;
+			}
+
+			RH_TRACE(client, 3, "Application is keeping up; splicing rest of the request body");
+			client->clientInput->stop();
+			client->clientSpliceWatcher.set(libev->getLoop());
+			client->clientSpliceWatcher.set(client->fd, ev::READ);
+			client->clientSpliceWatcher.start();
+		#endif
 	}
 
-	void onAppInputError(const ClientPtr &client, const char *message, int errorCode) {
-		RH_LOG_EVENT(client, "onAppInputError");
+	/**
+	 * Switches back to forwarding the request body through clientInput.
+	 */
+	void stopSplicingRequestBody(const ClientPtr &client) {
+		client->clientSpliceWatcher.stop();
+	}
+
+	void onClientSpliceReadable(const ClientPtr &client) {
+		RH_LOG_EVENT(client, "onClientSpliceReadable");
 		if (!client->connected()) {
 			return;
 		}
+		assert(client->state == Client::FORWARDING_BODY_TO_APP);
 
-		if (errorCode == ECONNRESET) {
-			// We might as well treat ECONNRESET like an EOF.
-			// http://stackoverflow.com/questions/2974021/what-does-econnreset-mean-in-the-context-of-an-af-local-socket
-			onAppInputEof(client);
-		} else {
-			stringstream message;
-			message << "application socket read error: ";
-			message << strerror(errorCode);
-			message << " (fd=" << client->appInput->getFd();
-			message << ", errno=" << errorCode << ")";
-			disconnectWithError(client, message.str());
-		}
-	}
-
-	void onClientOutputPipeCommit(const ClientPtr &client) {
-		RH_LOG_EVENT(client, "onClientOutputPipeCommit");
-		if (!client->connected()) {
+		if (client->session == NULL) {
+			RH_TRACE(client, 2, "Application had already sent EOF. Stop reading client input.");
+			stopSplicingRequestBody(client);
+			syscalls::shutdown(client->fd, SHUT_RD);
 			return;
 		}
 
-		RH_TRACE(client, 3, "Done buffering response data to disk; resuming application socket.");
-		client->backgroundOperations--;
-		// If the data comes from writeErrorResponse(), then appInput is not available.
-		if (client->session != NULL && client->session->initiated()) {
-			client->appInput->start();
+		#ifdef RH_SPLICE_AVAILABLE
+			size_t size = SPLICE_BLOCK_SIZE;
+			if (client->contentLength >= 0) {
+				size = std::min<unsigned long long>(size,
+					(unsigned long long) client->contentLength - client->clientBodyAlreadyRead);
+			}
+
+			ssize_t ret;
+			do {
+				ret = splice(client->fd, NULL, splicePipe.second, NULL,
+					size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			} while (ret == -1 && errno == EINTR);
+
+			if (ret == 0) {
+				stopSplicingRequestBody(client);
+				onClientEof(client);
+				return;
+			} else if (ret == -1) {
+				int e = errno;
+				if (e == EAGAIN) {
+					return;
+				}
+				stopSplicingRequestBody(client);
+				if (e == EINVAL || e == ENOSYS) {
+					P_INFO("splice() is not supported for client sockets; disabling request body splicing");
+					spliceRequestBodies = false;
+					client->clientInput->start();
+				} else {
+					onClientInputError(client, "Cannot splice from socket", e);
+				}
+				return;
+			}
+
+			RH_TRACE(client, 3, "Spliced " << ret << " bytes from the client");
+			bytesReceivedMetric->add(ret);
+			client->clientBodyAlreadyRead += ret;
+			size_t pending = ret;
+			while (pending > 0) {
+				do {
+					ret = splice(splicePipe.first, NULL, client->session->fd(), NULL,
+						pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				} while (ret == -1 && errno == EINTR);
+
+				if (ret == -1) {
+					int e = errno;
+					if (e == EAGAIN) {
+						onSplicingAppBlocked(client, pending);
+					} else if (e == EPIPE || e == ECONNRESET) {
+						// Client will be disconnected after response forwarding is done.
+						discardSplicePipeData(pending);
+						stopSplicingRequestBody(client);
+						syscalls::shutdown(client->fd, SHUT_RD);
+					} else {
+						discardSplicePipeData(pending);
+						disconnectWithAppSocketWriteError(client, e);
+					}
+					return;
+				} else {
+					pending -= ret;
+				}
+			}
+
+			if (client->contentLength >= 0
+			 && client->clientBodyAlreadyRead == (unsigned long long) client->contentLength)
+			{
+				stopSplicingRequestBody(client);
+				state_forwardingBodyToApp_onClientEof(client);
+			}
+		#endif
+	}
+
+	/**
+	 * The application socket isn't writable right now. Move the data that's
+	 * left in the splice pipe into appOutputBuffer, and wait until the
+	 * application socket is writable again.
+	 */
+	void onSplicingAppBlocked(const ClientPtr &client, size_t pending) {
+		RH_TRACE(client, 3, "Application is not keeping up; buffering the spliced request body data");
+		char buf[SPLICE_BLOCK_SIZE];
+		ssize_t ret = syscalls::read(splicePipe.first, buf, std::min(pending, sizeof(buf)));
+		stopSplicingRequestBody(client);
+		if (ret > 0) {
+			client->appOutputBuffer.assign(buf, ret);
 		}
+		client->appOutputWatcher.start();
 	}
 
 
 	/*****************************************************
-	 * COMPONENT: clientOutputPipe -> client fd plumbing
+	 * COMPONENT: upgraded connection tunnels
 	 *
-	 * The following code handles forwarding data from
-	 * clientOutputPipe to the client socket.
+	 * Once the application has switched protocols, e.g.
+	 * for a WebSocket, and everything buffered has been
+	 * forwarded, the client and application sockets are
+	 * handed over to a Tunnel and the Client is
+	 * disconnected. The Tunnel forwards the data without
+	 * the Client's buffers and state machine.
 	 *****************************************************/
 
-	void onClientOutputPipeData(const ClientPtr &client, const char *data,
-		size_t size, const FileBackedPipe::ConsumeCallback &consumed)
-	{
-		RH_LOG_EVENT(client, "onClientOutputPipeData");
-		if (!client->connected()) {
+	bool canStartTunnel(const ClientPtr &client) const {
+		return tunnelUpgrades
+			&& client->connected()
+			&& client->upgraded
+			&& client->state == Client::FORWARDING_BODY_TO_APP
+			&& !client->requestBodyIsBuffered
+			&& !client->requestBodySent
+			&& client->session != NULL
+			&& client->session->initiated()
+			&& client->backgroundOperations == 0
+			&& !client->chunkedResponse
+			&& client->compressor == NULL
+			&& !client->cachingResponse
+			&& client->sendfileFile == -1
+			&& client->appOutputBuffer.empty()
+			&& !client->appOutputWatcher.is_active()
+			&& client->clientInput->getBufferSize() == 0
+			&& client->appInput->getBufferSize() == 0
+			&& client->clientOutputPipe->getBufferSize() == 0
+			&& !client->clientOutputWatcher.is_active();
+	}
+
+	/**
+	 * Called whenever an upgraded client may have nothing buffered anymore.
+	 * We may be inside a clientInput, appInput or clientOutputPipe callback
+	 * whose data only counts as consumed once it returns, so the check and
+	 * the hand-over happen later.
+	 */
+	void maybeStartTunnel(const ClientPtr &client) {
+		if (tunnelUpgrades && client->upgraded) {
+			libev->runLater(boost::bind(&RequestHandler::startTunnel, this, client));
+		}
+	}
+
+	void startTunnel(ClientPtr client) {
+		if (!canStartTunnel(client)) {
 			return;
 		}
 
-		RH_TRACE(client, 3, "Forwarding " << size << " bytes of application data to client.");
-		ssize_t ret = syscalls::write(client->fd, data, size);
-		if (ret == -1) {
-			int e = errno;
-			RH_TRACE(client, 3, "Could not write to client socket: " << strerror(e) << " (errno=" << e << ")");
-			if (e == EAGAIN) {
-				RH_TRACE(client, 3, "Waiting until the client socket is writable again.");
-				client->clientOutputWatcher.start();
-				consumed(0, true);
-			} else if (e == EPIPE || e == ECONNRESET) {
-				// If the client closed the connection then disconnect quietly.
-				RH_TRACE(client, 3, "Client stopped reading prematurely");
-				if (client->useUnionStation()) {
-					client->logMessage("Disconnecting: client stopped reading prematurely");
-				}
-				disconnect(client);
-			} else {
-				disconnectWithClientSocketWriteError(client, e);
+		FileDescriptor appFd;
+		SessionPtr session;
+		if (client->session->getSocket()->concurrency == 0) {
+			// The process handles any number of connections at once, so
+			// there's no point in keeping its session slot occupied.
+			appFd = FileDescriptor(dup(client->session->fd()));
+			if (appFd == -1) {
+				int e = errno;
+				RH_WARN(client, "Cannot duplicate the application socket, not tunneling: " <<
+					strerror(e) << " (errno=" << e << ")");
+				tunnelUpgrades = false;
+				return;
 			}
+			client->session->close(false);
+			client->session.reset();
 		} else {
-			RH_TRACE(client, 3, "Managed to forward " << ret << " bytes.");
-			consumed(ret, false);
+			appFd = client->session->fd();
+			session = client->session;
 		}
-	}
 
-	void onClientOutputPipeEnd(const ClientPtr &client) {
-		RH_LOG_EVENT(client, "onClientOutputPipeEnd");
-		if (!client->connected()) {
-			return;
+		RH_DEBUG(client, "Application switched protocols; handing the connection over to a tunnel");
+		if (client->splicingResponse) {
+			stopSplicingResponse(client);
 		}
+		client->clientInput->stop();
+		client->appInput->stop();
+		createSplicePipe();
+
+		TunnelPtr tunnel = boost::make_shared<Tunnel>(libev->getLoop(), client->fd,
+			appFd, spliceAvailable ? &splicePipe : NULL);
+		tunnel->onClose = onTunnelClosed;
+		tunnel->userData = this;
+		tunnel->session = session;
+		tunnel->bytesSentMetric = bytesSentMetric;
+		tunnel->bytesReceivedMetric = bytesReceivedMetric;
+		tunnel->loopTimeStats = loopTimeStats.get();
+		tunnels[client->fd] = tunnel;
+		tunnelsMetric->increment();
+		tunnel->start();
 
-		RH_TRACE(client, 2, "Client output pipe ended; disconnecting client");
+		client->endScopeLog(&client->scopeLogs.requestProxying);
 		client->endScopeLog(&client->scopeLogs.requestProcessing);
 		disconnect(client);
 	}
 
-	void onClientOutputPipeError(const ClientPtr &client, int errorCode) {
-		RH_LOG_EVENT(client, "onClientOutputPipeError");
-		if (!client->connected()) {
-			return;
-		}
-
-		stringstream message;
-		message << "client output pipe error: ";
-		message << strerror(errorCode);
-		message << " (errno=" << errorCode << ")";
-		disconnectWithError(client, message.str());
-	}
-
-	void onClientOutputWritable(const ClientPtr &client) {
-		RH_LOG_EVENT(client, "onClientOutputWritable");
-		if (!client->connected()) {
-			return;
+	static void onTunnelClosed(Tunnel *tunnel) {
+		RequestHandler *self = (RequestHandler *) tunnel->userData;
+		P_DEBUG("Tunnel for client fd " << tunnel->getClientFd() << " closed; " <<
+			tunnel->getBytesSentToApp() << " bytes sent to the application, " <<
+			tunnel->getBytesSentToClient() << " bytes sent to the client");
+		// Destroys the tunnel, closing both sockets.
+		self->tunnels.erase(tunnel->getClientFd());
+		self->tunnelsMetric->decrement();
+		if (self->clientList.empty() && self->tunnels.empty()) {
+			self->becomeIdle();
 		}
-
-		// Continue forwarding output data to the client.
-		RH_TRACE(client, 3, "Client socket became writable again.");
-		client->clientOutputWatcher.stop();
-		assert(!client->clientOutputPipe->isStarted());
-		client->clientOutputPipe->start();
 	}
 
 
@@ -1291,7 +3604,13 @@ private:
 	 * depending on the client state.
 	 *****************************************************/
 
-	FileDescriptor acceptNonBlockingSocket(int sock) {
+	/**
+	 * Returns the accepted file descriptor, which the caller must close,
+	 * or -1 with errno set. It's only wrapped in a FileDescriptor once a
+	 * client is associated with it, so that connections that are rejected
+	 * right away don't cost an allocation.
+	 */
+	int acceptNonBlockingSocket(int sock) {
 		union {
 			struct sockaddr_in inaddr;
 			struct sockaddr_un unaddr;
@@ -1299,8 +3618,8 @@ private:
 		socklen_t addrlen = sizeof(u);
 
 		if (accept4Available) {
-			FileDescriptor fd(callAccept4(requestSocket,
-				(struct sockaddr *) &u, &addrlen, O_NONBLOCK));
+			int fd = callAccept4(sock,
+				(struct sockaddr *) &u, &addrlen, O_NONBLOCK);
 			// FreeBSD returns EINVAL if accept4() is called with invalid flags.
 			if (fd == -1 && (errno == ENOSYS || errno == EINVAL)) {
 				accept4Available = false;
@@ -1309,32 +3628,128 @@ private:
 				return fd;
 			}
 		} else {
-			FileDescriptor fd(syscalls::accept(requestSocket,
+			UniqueFileDescriptor fd(syscalls::accept(sock,
 				(struct sockaddr *) &u, &addrlen));
 			if (fd != -1) {
 				int e = errno;
 				setNonBlocking(fd);
 				errno = e;
 			}
-			return fd;
+			return fd.release();
+		}
+	}
+
+
+	void onResumeSocketWatcher(ev::timer &timer, int revents) {
+		ScopedLoopTimer loopTimer(loopTimeStats.get(), LPC_CLIENT_INPUT);
+		P_INFO("Resuming listening on server socket.");
+		resumeSocketWatcherTimer.stop();
+		requestSocketWatcher.start();
+		if (httpSocket != -1) {
+			httpSocketWatcher.start();
+		}
+	}
+
+	static void appendCgiVariable(string &env, const StaticString &name, const StaticString &value) {
+		env.append(name.data(), name.size());
+		env.append(1, '\0');
+		env.append(value.data(), value.size());
+		env.append(1, '\0');
+	}
+
+	/**
+	 * Appends the address and port variables (e.g. REMOTE_ADDR and
+	 * REMOTE_PORT) for the given socket address. Returns the address.
+	 */
+	static string appendAddressVariables(string &env, const struct sockaddr *addr,
+		const char *addrName, const char *portName)
+	{
+		char host[INET6_ADDRSTRLEN];
+		unsigned short port;
+
+		if (addr->sa_family == AF_INET) {
+			const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+			inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+			port = ntohs(in->sin_port);
+		} else if (addr->sa_family == AF_INET6) {
+			const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+			inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+			port = ntohs(in6->sin6_port);
+		} else {
+			return string();
+		}
+		appendCgiVariable(env, addrName, host);
+		appendCgiVariable(env, portName, toString(port));
+		return host;
+	}
+
+	/**
+	 * Sets the CGI variables that describe a newly accepted HTTP client's
+	 * connection. Clients on a Unix domain socket only get a SERVER_PORT,
+	 * which Rack requires.
+	 */
+	static void setHttpConnectionEnv(const ClientPtr &client) {
+		struct sockaddr_storage addr;
+		socklen_t len;
+		string &env = client->httpConnectionEnv;
+		string serverAddr;
+
+		env.clear();
+		len = sizeof(addr);
+		if (getpeername(client->fd, (struct sockaddr *) &addr, &len) == 0) {
+			appendAddressVariables(env, (struct sockaddr *) &addr, "REMOTE_ADDR", "REMOTE_PORT");
+		}
+		len = sizeof(addr);
+		if (getsockname(client->fd, (struct sockaddr *) &addr, &len) == 0) {
+			serverAddr = appendAddressVariables(env, (struct sockaddr *) &addr,
+				"SERVER_ADDR", "SERVER_PORT");
+		}
+		if (serverAddr.empty()) {
+			appendCgiVariable(env, "SERVER_PORT", "80");
+			client->httpParser.defaultServerName = "localhost";
+		} else {
+			client->httpParser.defaultServerName = serverAddr;
 		}
 	}
 
-
-	void onResumeSocketWatcher(ev::timer &timer, int revents) {
-		P_INFO("Resuming listening on server socket.");
-		resumeSocketWatcherTimer.stop();
-		requestSocketWatcher.start();
+	/**
+	 * Checks whether a request socket client may connect, based on the user
+	 * ID of the connecting process. Root and our own user could read the
+	 * connect password anyway.
+	 */
+	bool checkPeerCredentials(int fd) const {
+		uid_t uid;
+		if (!getPeerUid(fd, uid)) {
+			int e = errno;
+			P_WARN("Refusing a request socket connection: cannot determine "
+				"the credentials of the connecting process: " << strerror(e) <<
+				" (errno=" << e << ")");
+			return false;
+		} else if (uid == 0 || uid == geteuid() || uid == options.webServerWorkerUid) {
+			return true;
+		} else {
+			P_WARN("Refusing a request socket connection from unauthorized user ID " << uid);
+			return false;
+		}
 	}
 
 	void onAcceptable(ev::io &io, int revents) {
+		ScopedLoopTimer timer(loopTimeStats.get(), LPC_CLIENT_INPUT);
 		bool endReached = false;
 		unsigned int count = 0;
-		unsigned int maxAcceptTries = clamp<unsigned int>(clients.size(), 1, 10);
-		ClientPtr acceptedClients[10];
+		unsigned int maxAcceptTries;
+		bool http = &io == &httpSocketWatcher;
+		int sock = http ? httpSocket : requestSocket;
+
+		if ((http ? httpAcceptEpoll : acceptEpoll) != -1) {
+			// The kernel already spreads new connections over the event loops.
+			maxAcceptTries = acceptBatchSize;
+		} else {
+			maxAcceptTries = clamp<unsigned int>(clientList.size(), 1, acceptBatchSize);
+		}
 
 		while (!endReached && count < maxAcceptTries) {
-			FileDescriptor fd = acceptNonBlockingSocket(requestSocket);
+			UniqueFileDescriptor fd(acceptNonBlockingSocket(sock));
 			if (fd == -1) {
 				if (errno == EAGAIN || errno == EWOULDBLOCK) {
 					endReached = true;
@@ -1343,8 +3758,8 @@ private:
 					P_ERROR("Cannot accept client: " << strerror(e) <<
 						" (errno=" << e << "). " <<
 						"Pausing listening on server socket for 3 seconds. " <<
-						"Current client count: " << clients.size());
-					requestSocketWatcher.stop();
+						"Current client count: " << clientList.size());
+					io.stop();
 					resumeSocketWatcherTimer.start();
 					endReached = true;
 				}
@@ -1356,22 +3771,42 @@ private:
 					"Connection: close\r\n"
 					"\r\n"
 					"Benchmark point: after_accept\n");
+			} else if (!http && options.requestSocketPeerAuth && !checkPeerCredentials(fd)) {
+				// The connection is closed when fd goes out of scope.
+				continue;
 			} else {
-				ClientPtr client = boost::make_shared<Client>();
-				client->associate(this, fd);
-				clients.insert(make_pair((int) fd, client));
-				acceptedClients[count] = client;
+				ClientPtr client = checkoutClient();
+				client->associate(this, fd.share(), http, !http && options.requestSocketPeerAuth);
+				if (http) {
+					setHttpConnectionEnv(client);
+				}
+				addClient(client);
+				acceptedClients.push_back(client);
 				count++;
-				RH_DEBUG(client, "New client accepted; new client count = " << clients.size());
+				PASSENGER_PROBE2(client_accepted, client->fdnum, (int) http);
+				RH_DEBUG(client, "New client accepted; new client count = " << clientList.size());
+			}
+		}
+
+		if (!endReached && maxAcceptTries == acceptBatchSize) {
+			acceptBatchesFilled++;
+			if (acceptBatchSize < MAX_ACCEPT_BATCH_SIZE) {
+				acceptBatchSize *= 2;
 			}
+		} else if (endReached && count < acceptBatchSize / 4
+			&& acceptBatchSize > MIN_ACCEPT_BATCH_SIZE)
+		{
+			acceptBatchSize /= 2;
 		}
 
+		acceptsMetric->add(count);
 		for (unsigned int i = 0; i < count; i++) {
 			acceptedClients[i]->clientInput->readNow();
 		}
+		acceptedClients.clear();
 
-		if (OXT_LIKELY(!clients.empty())) {
-			inactivityTimer.stop();
+		if (OXT_LIKELY(!clientList.empty())) {
+			becomeActive();
 		}
 	}
 
@@ -1431,7 +3866,14 @@ private:
 		RH_LOG_EVENT(client, "onClientEof; client sent EOF");
 		switch (client->state) {
 		case Client::BUFFERING_REQUEST_BODY:
-			state_bufferingRequestBody_onClientEof(client);
+			if (client->httpFrontend && !requestBodyComplete(client)) {
+				// Unlike web servers, HTTP clients may not end the
+				// request body with EOF.
+				disconnectWithWarning(client, "client closed the connection before "
+					"sending the entire request body");
+			} else {
+				state_bufferingRequestBody_onClientEof(client);
+			}
 			break;
 		case Client::FORWARDING_BODY_TO_APP:
 			state_forwardingBodyToApp_onClientEof(client);
@@ -1540,6 +3982,32 @@ private:
 	}
 
 
+	unsigned long long clientTimeoutsNow() const {
+		return libev->getNowUsec() / 1000;
+	}
+
+	void scheduleClientTimeout(Client *client, unsigned int timeout) {
+		clientTimeouts.schedule(&client->timeoutEntry, clientTimeoutsNow(), timeout);
+		if (!clientTimeoutsTimer.is_active()) {
+			ev_tstamp interval = clientTimeouts.getResolution() / 1000.0;
+			clientTimeoutsTimer.start(interval, interval);
+		}
+	}
+
+	void onClientTimeoutsTick(ev::timer &timer, int revents) {
+		ScopedLoopTimer loopTimer(loopTimeStats.get(), LPC_HOUSEKEEPING);
+		clientTimeouts.expire(clientTimeoutsNow(),
+			boost::bind(&RequestHandler::onClientTimeoutExpired, this, _1));
+		if (clientTimeouts.empty()) {
+			clientTimeoutsTimer.stop();
+		}
+	}
+
+	void onClientTimeoutExpired(TimerWheel::Entry *entry) {
+		Client *client = (Client *) entry->userData;
+		onTimeout(client->shared_from_this());
+	}
+
 	void onTimeout(const ClientPtr &client) {
 		RH_LOG_EVENT(client, "onTimeout");
 		if (!client->connected()) {
@@ -1551,12 +4019,115 @@ private:
 		case Client::STILL_READING_CONNECT_PASSWORD:
 			disconnectWithError(client, "no connect password received within timeout");
 			break;
+		case Client::CHECKING_OUT_SESSION:
+			// Not a timeout but a periodic check; see asyncGetSession().
+			if (clientHungUp(client)) {
+				disconnectWithWarning(client, "client hung up while waiting for a process");
+			} else {
+				scheduleClientTimeout(client.get(), CHECKOUT_HANGUP_CHECK_INTERVAL);
+			}
+			break;
+		case Client::SENDING_HEADER_TO_APP:
+		case Client::FORWARDING_BODY_TO_APP:
+			// Scheduled when the session was checked out. If the session
+			// is gone, the application has responded and we're only
+			// waiting for the client to receive the response.
+			if (client->session != NULL) {
+				onMaxRequestTimeExceeded(client);
+			}
+			break;
+		case Client::WRITING_SIMPLE_RESPONSE:
+			break;
+		case Client::READING_HEADER:
+			if (client->httpFrontend) {
+				// Most likely an idle keep-alive connection.
+				RH_DEBUG(client, "Disconnecting: no HTTP request received within timeout");
+				disconnect(client);
+				break;
+			}
+			// Fallthrough
 		default:
 			disconnectWithError(client, "timeout");
 			break;
 		}
 	}
 
+	/**
+	 * Called when the application has been working on the request for
+	 * longer than Options::maxRequestTime. The process is most likely stuck,
+	 * e.g. in an infinite loop or on a hung database call, and would
+	 * otherwise keep the session, and with it part of the group's capacity,
+	 * forever. The client gets a 504 if no part of the response has been sent
+	 * yet, and is disconnected otherwise.
+	 *
+	 * Ruby processes are sent SIGQUIT first, upon which they log the
+	 * backtraces of all threads. The process is then detached: it gets no new
+	 * requests, is replaced if the group needs the capacity, and is shut down
+	 * once its other requests are done, or killed when it doesn't shut down
+	 * within the shutdown timeout. That timeout is the grace period for
+	 * other requests on the same process.
+	 */
+	void onMaxRequestTimeExceeded(const ClientPtr &client) {
+		SessionPtr session = client->session;
+		ProcessPtr process = session->getProcess();
+		RH_WARN(client, "Process " << session->getPid() << " of " <<
+			client->options.getAppGroupName() << " didn't respond within the " <<
+			"maximum request time of " << client->options.maxRequestTime <<
+			" seconds. Aborting the request and detaching the process.");
+		stuckRequestsMetric->increment();
+		if (client->options.appType == "classic-rails" || client->options.appType == "rack") {
+			session->kill(SIGQUIT);
+		}
+		// Detaching may call back into us, e.g. to hand waiting requests
+		// to other processes, so do it outside this timeout callback.
+		libev->runLater(boost::bind(&RequestHandler::detachStuckProcess, this, process));
+
+		if (client->responseHeaderSeen) {
+			disconnectWithError(client, "maximum request time exceeded");
+			return;
+		}
+
+		client->clientInput->stop();
+		client->clientSpliceWatcher.stop();
+		client->appInput->stop();
+		client->appOutputWatcher.stop();
+		client->appSpliceWatcher.stop();
+		client->session->close(false);
+		client->session.reset();
+		client->endScopeLog(&client->scopeLogs.requestProxying, false);
+		if (client->cachingResponse) {
+			client->stopCachingResponse();
+			releaseCollapsedRequests(client);
+		}
+		client->state = Client::WRITING_SIMPLE_RESPONSE;
+		writeSimpleResponse(client, gatewayTimeoutPage(), 504);
+	}
+
+	void detachStuckProcess(ProcessPtr process) {
+		pool->detachProcess(process);
+	}
+
+	/**
+	 * Checks whether the client has closed its connection, without reading
+	 * from it. The request body may still be waiting to be read, so an EOF
+	 * can only be seen with POLLRDHUP (Linux). A web server that doesn't
+	 * want to keep the connection alive may shut down its writing side
+	 * after sending the request, so that only counts as a hangup if it
+	 * asked for keep-alive.
+	 */
+	bool clientHungUp(const ClientPtr &client) const {
+		struct pollfd pfd;
+		pfd.fd = client->fdnum;
+		pfd.events = 0;
+		pfd.revents = 0;
+		#ifdef POLLRDHUP
+			if (client->frontendKeepAlive) {
+				pfd.events = POLLRDHUP;
+			}
+		#endif
+		return syscalls::poll(&pfd, 1, 0) == 1 && pfd.revents != 0;
+	}
+
 
 	/*****************************************************
 	 * COMPONENT: client -> application plumbing
@@ -1575,7 +4146,7 @@ private:
 			RH_TRACE(client, 3, "Connect password is correct; reading header");
 			client->state = Client::READING_HEADER;
 			client->freeBufferedConnectPassword();
-			client->timeoutTimer.stop();
+			client->timeoutEntry.cancel();
 
 			if (benchmarkPoint == BP_AFTER_CHECK_CONNECT_PASSWORD) {
 				writeSimpleResponse(client, "Benchmark point: after_check_connect_password\n");
@@ -1620,31 +4191,27 @@ private:
 
 	bool modifyClientHeaders(const ClientPtr &client) {
 		ScgiRequestParser &parser = client->scgiParser;
-		ScgiRequestParser::HeaderMap &map = parser.getMap();
-		ScgiRequestParser::iterator it, end = map.end();
 		bool modified = false;
 
 		/* The Rack spec specifies that HTTP_CONTENT_LENGTH and HTTP_CONTENT_TYPE must
 		 * not exist and that their respective non-HTTP_ versions should exist instead.
 		 */
 
-		if ((it = map.find("HTTP_CONTENT_LENGTH")) != end) {
-			if (map.find("CONTENT_LENGTH") == end) {
-				map["CONTENT_LENGTH"] = it->second;
-				map.erase("HTTP_CONTENT_LENGTH");
-			} else {
-				map.erase(it);
+		if (parser.hasHeader(ScgiRequestParser::KH_HTTP_CONTENT_LENGTH)) {
+			if (!parser.hasHeader(ScgiRequestParser::KH_CONTENT_LENGTH)) {
+				parser.setHeader("CONTENT_LENGTH",
+					parser.getHeader(ScgiRequestParser::KH_HTTP_CONTENT_LENGTH));
 			}
+			parser.removeHeader("HTTP_CONTENT_LENGTH");
 			modified = true;
 		}
 
-		if ((it = map.find("HTTP_CONTENT_TYPE")) != end) {
-			if (map.find("CONTENT_TYPE") == end) {
-				map["CONTENT_TYPE"] = it->second;
-				map.erase("HTTP_CONTENT_TYPE");
-			} else {
-				map.erase(it);
+		if (parser.hasHeader(ScgiRequestParser::KH_HTTP_CONTENT_TYPE)) {
+			if (!parser.hasHeader(ScgiRequestParser::KH_CONTENT_TYPE)) {
+				parser.setHeader("CONTENT_TYPE",
+					parser.getHeader(ScgiRequestParser::KH_HTTP_CONTENT_TYPE));
 			}
+			parser.removeHeader("HTTP_CONTENT_TYPE");
 			modified = true;
 		}
 
@@ -1693,31 +4260,103 @@ private:
 		}
 	}
 
+	/**
+	 * Collects the headers that fillPoolOptionsFromHeaders() depends on into
+	 * 'key', in the order in which they appear in the header data.
+	 */
+	static void buildOptionsCacheKey(const ScgiRequestParser &parser, string &key) {
+		StaticString data = parser.getHeaderData();
+		const char *pos = data.data();
+		const char *end = data.data() + data.size();
+
+		key.clear();
+		while (pos < end) {
+			const char *nameEnd = (const char *) memchr(pos, '\0', end - pos);
+			if (nameEnd == NULL) {
+				break;
+			}
+			const char *valueEnd = (const char *) memchr(nameEnd + 1, '\0', end - nameEnd - 1);
+			if (valueEnd == NULL) {
+				valueEnd = end;
+			}
+
+			StaticString name(pos, nameEnd - pos);
+			if (startsWith(name, "PASSENGER_")
+			 || name == "SCRIPT_NAME"
+			 || name == "DOCUMENT_ROOT")
+			{
+				key.append(pos, valueEnd - pos);
+				key.append(1, '\0');
+			}
+			pos = valueEnd + 1;
+		}
+	}
+
 	void fillPoolOptions(const ClientPtr &client) {
 		Options &options = client->options;
-		ScgiRequestParser &parser = client->scgiParser;
 		ScgiRequestParser::const_iterator it, end = client->scgiParser.end();
 
+		buildOptionsCacheKey(client->scgiParser, optionsCacheKey);
+		size_t hash = StaticString::Hash()(optionsCacheKey);
+		OptionsCache::iterator cit = optionsCache.find(hash);
+		if (cit != optionsCache.end() && cit->second.key == optionsCacheKey) {
+			options = cit->second.options;
+			options.logLevel = getLogLevel();
+		} else {
+			fillPoolOptionsFromHeaders(client);
+			if (!client->connected()) {
+				return;
+			}
+			if (cit == optionsCache.end() && optionsCache.size() >= OPTIONS_CACHE_SIZE) {
+				optionsCache.clear();
+			}
+			OptionsCacheEntry &entry = optionsCache[hash];
+			entry.key = optionsCacheKey;
+			entry.options = options.copyAndPersist();
+		}
+
+		setStickySessionId(client);
+
+		for (it = client->scgiParser.begin(); it != end; it++) {
+			if (!startsWith(it->first, "PASSENGER_")
+			 && !startsWith(it->first, "HTTP_")
+			 && it->first != "PATH_INFO"
+			 && it->first != "SCRIPT_NAME"
+			 && it->first != "CONTENT_LENGTH"
+			 && it->first != "CONTENT_TYPE")
+			{
+				options.environmentVariables.push_back(*it);
+			}
+		}
+	}
+
+	/**
+	 * Fills in the Options fields that only depend on the headers collected
+	 * by buildOptionsCacheKey(), so that the result can be cached.
+	 */
+	void fillPoolOptionsFromHeaders(const ClientPtr &client) {
+		Options &options = client->options;
+		ScgiRequestParser &parser = client->scgiParser;
+
 		options = Options();
 
-		StaticString scriptName = parser.getHeader("SCRIPT_NAME");
-		StaticString appRoot = parser.getHeader("PASSENGER_APP_ROOT");
+		StaticString scriptName = parser.getHeader(ScgiRequestParser::KH_SCRIPT_NAME);
+		StaticString appRoot = parser.getHeader(ScgiRequestParser::KH_PASSENGER_APP_ROOT);
 		if (scriptName.empty()) {
 			if (appRoot.empty()) {
-				StaticString documentRoot = parser.getHeader("DOCUMENT_ROOT");
+				StaticString documentRoot = parser.getHeader(ScgiRequestParser::KH_DOCUMENT_ROOT);
 				if (documentRoot.empty()) {
 					disconnectWithError(client, "no PASSENGER_APP_ROOT or DOCUMENT_ROOT headers set.");
 					return;
 				}
-				client->appRoot = extractDirName(documentRoot);
-				options.appRoot = client->appRoot;
+				options.appRoot = extractDirNameStatic(documentRoot);
 			} else {
 				options.appRoot = appRoot;
 			}
 		} else {
 			if (appRoot.empty()) {
-				client->appRoot = extractDirName(resolveSymlink(parser.getHeader("DOCUMENT_ROOT")));
-				options.appRoot = client->appRoot;
+				options.appRoot = client->arena.copy(extractDirName(resolveSymlink(
+					parser.getHeader(ScgiRequestParser::KH_DOCUMENT_ROOT))));
 			} else {
 				options.appRoot = appRoot;
 			}
@@ -1747,26 +4386,36 @@ private:
 		fillPoolOptionSecToMsec(client, options.startTimeout, "PASSENGER_START_TIMEOUT");
 		fillPoolOption(client, options.maxPreloaderIdleTime, "PASSENGER_MAX_PRELOADER_IDLE_TIME");
 		fillPoolOption(client, options.maxRequestQueueSize, "PASSENGER_MAX_REQUEST_QUEUE_SIZE");
+		fillPoolOption(client, options.maxRequestQueueTime, "PASSENGER_MAX_REQUEST_QUEUE_TIME");
+		fillPoolOption(client, options.maxRequestTime, "PASSENGER_MAX_REQUEST_TIME");
+		fillPoolOption(client, options.latencyAwareRouting, "PASSENGER_LATENCY_AWARE_ROUTING");
+		fillPoolOption(client, options.spawnAheadUtilization, "PASSENGER_SPAWN_AHEAD_UTILIZATION");
+		fillPoolOption(client, options.maxTunedConcurrency, "PASSENGER_MAX_TUNED_CONCURRENCY");
+		fillPoolOption(client, options.maxOutOfBandWorkPercentage, "PASSENGER_MAX_OUT_OF_BAND_WORK_PERCENTAGE");
+		fillPoolOption(client, options.outOfBandWorkInterval, "PASSENGER_OUT_OF_BAND_WORK_INTERVAL");
+		fillPoolOption(client, options.maxConcurrentSpawns, "PASSENGER_MAX_CONCURRENT_SPAWNS");
+		fillPoolOption(client, options.standbyProcesses, "PASSENGER_STANDBY_PROCESSES");
+		fillPoolOption(client, options.rollingRestart, "PASSENGER_ROLLING_RESTARTS");
+		fillPoolOption(client, options.maxSurge, "PASSENGER_MAX_SURGE");
+		fillPoolOption(client, options.maxUnavailable, "PASSENGER_MAX_UNAVAILABLE");
+		fillPoolOption(client, options.memoryLimit, "PASSENGER_MEMORY_LIMIT");
+		fillPoolOption(client, options.memoryLimitOobw, "PASSENGER_MEMORY_LIMIT_OOBW");
+		fillPoolOption(client, options.capacityWeight, "PASSENGER_CAPACITY_WEIGHT");
+		fillPoolOption(client, options.guaranteedCapacity, "PASSENGER_GUARANTEED_CAPACITY");
+		fillPoolOption(client, options.maxCapacityShare, "PASSENGER_MAX_CAPACITY_SHARE");
+		fillPoolOption(client, options.warmupUrls, "PASSENGER_WARMUP_URLS");
+		fillPoolOption(client, options.cpuAffinity, "PASSENGER_CPU_AFFINITY");
+		fillPoolOption(client, options.remoteAgents, "PASSENGER_REMOTE_AGENTS");
+		fillPoolOption(client, options.maxLocalProcesses, "PASSENGER_MAX_LOCAL_PROCESSES");
+		fillPoolOption(client, options.requestPriority, "PASSENGER_REQUEST_PRIORITY");
 		fillPoolOption(client, options.statThrottleRate, "PASSENGER_STAT_THROTTLE_RATE");
 		fillPoolOption(client, options.restartDir, "PASSENGER_RESTART_DIR");
 		fillPoolOption(client, options.startupFile, "PASSENGER_STARTUP_FILE");
 		fillPoolOption(client, options.loadShellEnvvars, "PASSENGER_LOAD_SHELL_ENVVARS");
+		fillPoolOption(client, options.loadPathCache, "PASSENGER_LOAD_PATH_CACHE");
 		fillPoolOption(client, options.debugger, "PASSENGER_DEBUGGER");
 		fillPoolOption(client, options.raiseInternalError, "PASSENGER_RAISE_INTERNAL_ERROR");
-		setStickySessionId(client);
 		/******************/
-		
-		for (it = client->scgiParser.begin(); it != end; it++) {
-			if (!startsWith(it->first, "PASSENGER_")
-			 && !startsWith(it->first, "HTTP_")
-			 && it->first != "PATH_INFO"
-			 && it->first != "SCRIPT_NAME"
-			 && it->first != "CONTENT_LENGTH"
-			 && it->first != "CONTENT_TYPE")
-			{
-				options.environmentVariables.push_back(*it);
-			}
-		}
 	}
 
 	void initializeUnionStation(const ClientPtr &client) {
@@ -1774,13 +4423,19 @@ private:
 			Options &options = client->options;
 			ScgiRequestParser &parser = client->scgiParser;
 
-			StaticString key = parser.getHeader("UNION_STATION_KEY");
-			StaticString filters = parser.getHeader("UNION_STATION_FILTERS");
+			StaticString key = parser.getHeader(ScgiRequestParser::KH_UNION_STATION_KEY);
+			StaticString filters = parser.getHeader(ScgiRequestParser::KH_UNION_STATION_FILTERS);
 			if (key.empty()) {
 				disconnectWithError(client, "header UNION_STATION_KEY must be set.");
 				return;
 			}
 
+			if (!sampleUnionStationRequest(client)) {
+				RH_TRACE(client, 3, "Request not sampled for Union Station");
+				client->unionStationDeferred = true;
+				return;
+			}
+
 			client->options.logger = loggerFactory->newTransaction(
 				options.getAppGroupName(), "requests", key, filters);
 			if (!client->options.logger->isNull()) {
@@ -1789,74 +4444,386 @@ private:
 			}
 			
 			client->beginScopeLog(&client->scopeLogs.requestProcessing, "request processing");
+			logRequestInfo(client);
+		}
+	}
+
+	/**
+	 * Decides whether this request is logged to Union Station from the start,
+	 * which is 1 in UNION_STATION_SAMPLE_RATE requests. Unsampled requests
+	 * don't create a transaction at all; finishUnionStationRequest() still
+	 * logs them if they're slow or fail.
+	 */
+	bool sampleUnionStationRequest(const ClientPtr &client) {
+		ScgiRequestParser &parser = client->scgiParser;
+		unsigned int rate = unionStationSampleRate;
+		StaticString value;
 
-			StaticString staticRequestMethod = parser.getHeader("REQUEST_METHOD");
-			client->logMessage("Request method: " + staticRequestMethod);
+		value = parser.getHeader(ScgiRequestParser::KH_UNION_STATION_SAMPLE_RATE);
+		if (!value.empty()) {
+			rate = stringToUint(value);
+		}
+		if (rate <= 1) {
+			return true;
+		}
 
-			StaticString staticRequestURI = parser.getHeader("REQUEST_URI");
-			if (!staticRequestURI.empty()) {
-				client->logMessage("URI: " + staticRequestURI);
-			} else {
-				string requestURI = parser.getHeader("SCRIPT_NAME");
-				requestURI.append(parser.getHeader("PATH_INFO"));
-				StaticString queryString = parser.getHeader("QUERY_STRING");
-				if (!queryString.empty()) {
-					requestURI.append("?");
-					requestURI.append(queryString);
+		value = parser.getHeader(ScgiRequestParser::KH_UNION_STATION_SLOW_REQUEST_THRESHOLD);
+		if (!value.empty()) {
+			client->unionStationSlowThreshold = stringToULL(value) * 1000;
+		} else {
+			client->unionStationSlowThreshold = unionStationSlowRequestThreshold;
+		}
+		return rand_r(&unionStationSampleSeed) % rate == 0;
+	}
+
+	void logRequestInfo(const ClientPtr &client) {
+		ScgiRequestParser &parser = client->scgiParser;
+
+		StaticString staticRequestMethod = parser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD);
+		client->logMessage("Request method: " + staticRequestMethod);
+
+		StaticString staticRequestURI = parser.getHeader(ScgiRequestParser::KH_REQUEST_URI);
+		if (!staticRequestURI.empty()) {
+			client->logMessage("URI: " + staticRequestURI);
+		} else {
+			string requestURI = parser.getHeader(ScgiRequestParser::KH_SCRIPT_NAME);
+			requestURI.append(parser.getHeader(ScgiRequestParser::KH_PATH_INFO));
+			StaticString queryString = parser.getHeader(ScgiRequestParser::KH_QUERY_STRING);
+			if (!queryString.empty()) {
+				requestURI.append("?");
+				requestURI.append(queryString);
+			}
+			client->logMessage("URI: " + requestURI);
+		}
+	}
+
+	/**
+	 * Called when a request ends. If it wasn't sampled for Union Station
+	 * but turned out to be slow or to have failed, then only now a
+	 * transaction is created for it, with what we still know about the
+	 * request.
+	 */
+	void finishUnionStationRequest(const ClientPtr &client) {
+		if (!client->unionStationDeferred) {
+			return;
+		}
+		client->unionStationDeferred = false;
+
+		unsigned long long duration = monotonicTimeUsec() - client->phaseTimes.accepted;
+		bool slow = client->unionStationSlowThreshold > 0
+			&& duration >= client->unionStationSlowThreshold;
+		bool failed = !client->unionStationError.empty()
+			|| client->responseStatusCode >= 500;
+		if (!slow && !failed) {
+			return;
+		}
+
+		ScgiRequestParser &parser = client->scgiParser;
+		LoggerPtr logger = loggerFactory->newTransaction(
+			client->options.getAppGroupName(), "requests",
+			parser.getHeader(ScgiRequestParser::KH_UNION_STATION_KEY),
+			parser.getHeader(ScgiRequestParser::KH_UNION_STATION_FILTERS));
+		if (logger->isNull()) {
+			return;
+		}
+		RH_DEBUG(client, "Logging unsampled request to Union Station because it " <<
+			(failed ? "failed" : "was slow"));
+
+		unsigned long long end = SystemTime::getUsec();
+		client->options.logger = logger;
+		UnionStation::ScopeLog::logBeginAt(logger, "request processing", end - duration);
+		logRequestInfo(client);
+		if (client->responseStatusCode != 0) {
+			client->logMessage("Status: " + toString(client->responseStatusCode));
+		}
+		if (!client->unionStationError.empty()) {
+			client->logMessage("Disconnecting with error: " + client->unionStationError);
+		}
+		UnionStation::ScopeLog::logEndAt(logger, "request processing", end, !failed);
+		// Closes the transaction.
+		client->options.logger.reset();
+	}
+
+	/**
+	 * Whether to add an X-Passenger-Timing header to the response; see
+	 * appendTimingHeader(). That's the case for all requests to applications
+	 * with the PASSENGER_TIMING_HEADER option, and for requests that carry a
+	 * valid X-Passenger-Timing request header. The latter allows a frontend
+	 * to ask for timings of single requests. Its value must look like
+	 * "<timestamp>:<signature>", in which the timestamp is the Unix time at
+	 * which the request was signed and the signature is the MD5 of
+	 * "<timingHeaderSecret>:<timestamp>" in hex. A signature is valid for
+	 * TIMING_SIGNATURE_MAX_AGE seconds around its timestamp, so that one
+	 * that leaks to an application can't be used for long.
+	 */
+	bool wantsTimingHeader(const ClientPtr &client) {
+		if (getBoolOption(client, "PASSENGER_TIMING_HEADER")) {
+			return true;
+		} else if (timingHeaderSecret.empty()) {
+			return false;
+		}
+
+		StaticString value = client->scgiParser.getHeader("HTTP_X_PASSENGER_TIMING");
+		string::size_type sep = value.find(':');
+		if (sep == string::npos || sep == 0 || sep > 20
+		 || value.size() - sep - 1 != MD5_HEX_SIZE)
+		{
+			return false;
+		}
+		StaticString timestamp = value.substr(0, sep);
+		for (string::size_type i = 0; i < timestamp.size(); i++) {
+			if (timestamp[i] < '0' || timestamp[i] > '9') {
+				return false;
+			}
+		}
+		long long age = (long long) time(NULL) - stringToLL(timestamp);
+		if (age > TIMING_SIGNATURE_MAX_AGE || age < -TIMING_SIGNATURE_MAX_AGE) {
+			RH_DEBUG(client, "X-Passenger-Timing request header has expired");
+			return false;
+		}
+
+		string expected = md5_hex(timingHeaderSecret + ":" + timestamp);
+		if (constantTimeCompare(value.substr(sep + 1), expected)) {
+			return true;
+		} else {
+			RH_DEBUG(client, "X-Passenger-Timing request header has an invalid signature");
+			return false;
+		}
+	}
+
+	void setStickySessionId(const ClientPtr &client) {
+		ScgiRequestParser &parser = client->scgiParser;
+		if (parser.getHeader(ScgiRequestParser::KH_PASSENGER_STICKY_SESSION) == "true") {
+			// TODO: This is not entirely correct. Clients MAY send multiple Cookie
+			// headers, although this is in practice extremely rare.
+			// http://stackoverflow.com/questions/16305814/are-multiple-cookie-headers-allowed-in-an-http-request
+			StaticString cookie = parser.getHeader(ScgiRequestParser::KH_HTTP_COOKIE);
+			StaticString cookieName = getStickySessionCookieName(client);
+			vector<StaticString> parts;
+
+			client->stickySession = true;
+			split(cookie, ';', parts);
+			foreach (StaticString part, parts) {
+				const char *begin = part.data();
+				const char *end = part.data() + part.size();
+				const char *sep;
+
+				// Skip leading whitespace in the name.
+				while (begin < end && *begin == ' ') {
+					begin++;
+				}
+				part = StaticString(begin, end - begin);
+
+				// Find the separator ('=').
+				sep = (const char *) memchr(begin, '=', end - begin);
+				if (sep != NULL) {
+					StaticString name(begin, sep - begin);
+					if (name == cookieName) {
+						// This cookie matches the one we're looking for.
+						StaticString value(sep + 1, end - (sep + 1));
+						client->options.stickySessionId = stringToUint(value);
+						return;
+					}
 				}
-				client->logMessage("URI: " + requestURI);
 			}
 		}
-	}
-
-	void setStickySessionId(const ClientPtr &client) {
-		ScgiRequestParser &parser = client->scgiParser;
-		if (parser.getHeader("PASSENGER_STICKY_SESSION") == "true") {
-			// TODO: This is not entirely correct. Clients MAY send multiple Cookie
-			// headers, although this is in practice extremely rare.
-			// http://stackoverflow.com/questions/16305814/are-multiple-cookie-headers-allowed-in-an-http-request
-			StaticString cookie = parser.getHeader("HTTP_COOKIE");
-			StaticString cookieName = getStickySessionCookieName(client);
-			vector<StaticString> parts;
+	}
+
+	StaticString getStickySessionCookieName(const ClientPtr &client) const {
+		StaticString value = client->scgiParser.getHeader(ScgiRequestParser::KH_PASSENGER_STICKY_SESSION_COOKIE_NAME);
+		if (value.empty()) {
+			return StaticString("_passenger_route", sizeof("_passenger_route") - 1);
+		} else {
+			return value;
+		}
+	}
+
+	/**
+	 * Sets the response cache primary key for this request if the response
+	 * to it may be cached: (app group, method, host, URI). The status line
+	 * setting is part of the key because it changes the stored header.
+	 */
+	void setResponseCachePrimaryKey(const ClientPtr &client) {
+		ScgiRequestParser &parser = client->scgiParser;
+		StaticString method = parser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD);
+		StaticString host = parser.getHeader(ScgiRequestParser::KH_HTTP_HOST);
+		StaticString uri = parser.getHeader(ScgiRequestParser::KH_REQUEST_URI);
+		StaticString appGroupName = client->options.getAppGroupName();
+		string &key = client->cachePrimaryKey;
+
+		if (method != "GET"
+		 || client->contentLength > 0
+		 || client->stickySession
+		 || uri.empty()
+		 || !parser.getHeader(ScgiRequestParser::KH_HTTP_AUTHORIZATION).empty())
+		{
+			return;
+		}
+
+		key.reserve(appGroupName.size() + host.size() + uri.size() + 10);
+		key.append(appGroupName.data(), appGroupName.size());
+		key.append(1, '\0');
+		key.append(getBoolOption(client, "PASSENGER_STATUS_LINE", true) ? "1" : "0");
+		key.append(1, '\0');
+		key.append(method.data(), method.size());
+		key.append(1, '\0');
+		key.append(host.data(), host.size());
+		key.append(1, '\0');
+		key.append(uri.data(), uri.size());
+	}
+
+	static bool requestForbidsCachedResponse(const ScgiRequestParser &parser) {
+		return parser.getHeader(ScgiRequestParser::KH_HTTP_CACHE_CONTROL).find("no-cache") != string::npos
+			|| parser.getHeader(ScgiRequestParser::KH_HTTP_PRAGMA).find("no-cache") != string::npos;
+	}
+
+	/**
+	 * Writes a fresh response from the response cache, if there is one.
+	 * Returns whether it did; if so then the request is done.
+	 */
+	bool serveFromResponseCache(const ClientPtr &client) {
+		ScgiRequestParser &parser = client->scgiParser;
+		if (requestForbidsCachedResponse(parser)) {
+			return false;
+		}
+
+		const vector<string> *varyHeaders = responseCache->getVaryHeaders(client->cachePrimaryKey);
+		if (varyHeaders == NULL) {
+			return false;
+		}
+		vector<StaticString> varyValues;
+		foreach (const string &name, *varyHeaders) {
+			varyValues.push_back(parser.getHeader(name));
+		}
+		ResponseCache::buildKey(responseCacheKey, client->cachePrimaryKey, varyValues);
+
+		unsigned long long now = monotonicTimeUsec();
+		ResponseCache::EntryPtr entry = responseCache->lookup(responseCacheKey, now);
+		if (entry == NULL) {
+			return false;
+		}
+
+		RH_DEBUG(client, "Serving response from the response cache");
+		client->state = Client::WRITING_SIMPLE_RESPONSE;
+		client->clientInput->stop();
+		client->requestBodySent = true;
+		client->responseHeaderSeen = true;
+		client->cachePrimaryKey.clear();
+
+		string header;
+		header.reserve(entry->header.size() + 200);
+		header.append(entry->header);
+		if (client->httpFrontend) {
+			client->responseBodyless = responseHasNoBody(client, header);
+			prepareHttpResponseHeader(client, header);
+		}
+		if (client->frontendKeepAlive && !client->responseBodyless) {
+			header.append("Transfer-Encoding: chunked\r\n");
+		}
+		appendPoweredByHeader(client, header);
+		appendDateHeader(header);
+		header.append("Age: ");
+		header.append(toString((now - entry->storedAt) / 1000000));
+		header.append("\r\n\r\n");
+
+		if (client->useUnionStation()) {
+			Header status = lookupHeader(header, "Status", "status");
+			client->logMessage("Status: " + status.value);
+			client->logMessage("Served from the response cache");
+		}
+
+		writeToClientOutputPipe(client, header);
+		writeResponseBodyData(client, entry->body);
+		endClientOutput(client);
+		return true;
+	}
+
+	/**
+	 * If PASSENGER_COLLAPSE_REQUESTS is on and an identical request is
+	 * already being forwarded to the application, parks this request until
+	 * that one's response is in the response cache, so that a burst of
+	 * requests for the same cold resource results in one application
+	 * request instead of many. Returns whether the request was parked.
+	 * Otherwise this request becomes the one that the next identical
+	 * requests wait for.
+	 */
+	bool maybeCollapseRequest(const ClientPtr &client) {
+		if (!getBoolOption(client, "PASSENGER_COLLAPSE_REQUESTS", false)
+		 || client->requestBodyIsChunked
+		 || client->upgraded
+		 || requestForbidsCachedResponse(client->scgiParser)
+		 || !client->scgiParser.getHeader(ScgiRequestParser::KH_HTTP_COOKIE).empty())
+		{
+			return false;
+		}
 
-			client->stickySession = true;
-			split(cookie, ';', parts);
-			foreach (StaticString part, parts) {
-				const char *begin = part.data();
-				const char *end = part.data() + part.size();
-				const char *sep;
+		map< string, vector<ClientPtr> >::iterator it =
+			collapsedRequests.find(client->cachePrimaryKey);
+		if (it == collapsedRequests.end()) {
+			collapsedRequests.insert(make_pair(client->cachePrimaryKey, vector<ClientPtr>()));
+			client->collapsingLeader = true;
+			return false;
+		} else {
+			RH_DEBUG(client, "Identical request in progress; waiting for its response");
+			it->second.push_back(client);
+			client->state = Client::WAITING_FOR_COLLAPSED_RESPONSE;
+			client->clientInput->stop();
+			return true;
+		}
+	}
 
-				// Skip leading whitespace in the name.
-				while (begin < end && *begin == ' ') {
-					begin++;
-				}
-				part = StaticString(begin, end - begin);
+	/**
+	 * Called when a request that others were collapsed into has stored its
+	 * response in the response cache, or has found that it won't. The
+	 * waiting requests are served from the cache if possible, and are
+	 * forwarded to the application themselves otherwise.
+	 */
+	void releaseCollapsedRequests(const ClientPtr &client) {
+		if (!client->collapsingLeader) {
+			return;
+		}
+		client->collapsingLeader = false;
 
-				// Find the separator ('=').
-				sep = (const char *) memchr(begin, '=', end - begin);
-				if (sep != NULL) {
-					StaticString name(begin, sep - begin);
-					if (name == cookieName) {
-						// This cookie matches the one we're looking for.
-						StaticString value(sep + 1, end - (sep + 1));
-						client->options.stickySessionId = stringToUint(value);
-						return;
-					}
-				}
+		map< string, vector<ClientPtr> >::iterator it =
+			collapsedRequests.find(client->cachePrimaryKey);
+		if (it == collapsedRequests.end()) {
+			return;
+		}
+		vector<ClientPtr> waiters;
+		waiters.swap(it->second);
+		collapsedRequests.erase(it);
+
+		vector<ClientPtr>::iterator w_it, w_end = waiters.end();
+		for (w_it = waiters.begin(); w_it != w_end; w_it++) {
+			const ClientPtr &waiter = *w_it;
+			if (waiter->state != Client::WAITING_FOR_COLLAPSED_RESPONSE) {
+				continue;
+			}
+			if (serveFromResponseCache(waiter)) {
+				collapsedRequestsMetric->increment();
+			} else {
+				RH_DEBUG(waiter, "No shareable response; forwarding request itself");
+				beginProcessingRequest(waiter);
 			}
 		}
 	}
 
-	StaticString getStickySessionCookieName(const ClientPtr &client) const {
-		StaticString value = client->scgiParser.getHeader("PASSENGER_STICKY_SESSION_COOKIE_NAME");
-		if (value.empty()) {
-			return StaticString("_passenger_route", sizeof("_passenger_route") - 1);
-		} else {
-			return value;
+	/** Removes a waiting request that is disconnected before being released. */
+	void removeCollapsedRequest(const ClientPtr &client) {
+		map< string, vector<ClientPtr> >::iterator it =
+			collapsedRequests.find(client->cachePrimaryKey);
+		if (it != collapsedRequests.end()) {
+			vector<ClientPtr> &waiters = it->second;
+			waiters.erase(std::remove(waiters.begin(), waiters.end(), client),
+				waiters.end());
 		}
 	}
 
 	size_t state_readingHeader_onClientData(const ClientPtr &client, const char *data, size_t size) {
+		if (client->httpFrontend) {
+			return state_readingHeader_onHttpClientData(client, data, size);
+		}
+
 		ScgiRequestParser &parser = client->scgiParser;
 		size_t consumed = parser.feed(data, size);
 		if (!parser.acceptingInput()) {
@@ -1868,46 +4835,289 @@ private:
 				}
 				return consumed;
 			}
-
-			if (benchmarkPoint == BP_AFTER_PARSING_HEADER) {
-				writeSimpleResponse(client, "Benchmark point: after_parsing_header\n");
-				return consumed;
+			if (!requestLoopHandlers.empty()
+			 && maybeHandOverClient(client, data + consumed, size - consumed))
+			{
+				return size;
 			}
+			state_readingHeader_onHeaderParsed(client);
+		}
+		return consumed;
+	}
 
-			bool modified = modifyClientHeaders(client);
-			/* TODO: in case the headers are not modified, we only need to rebuild the header data
-			 * right now because the scgiParser buffer is invalidated as soon as onClientData exits.
-			 * We should figure out a way to not copy anything if we can do everything before
-			 * onClientData exits.
-			 */
-			parser.rebuildData(modified);
-			client->contentLength = getULongLongOption(client, "CONTENT_LENGTH");
-			fillPoolOptions(client);
-			if (!client->connected()) {
-				return consumed;
-			}
-			initializeUnionStation(client);
-			if (!client->connected()) {
-				return consumed;
+	/**
+	 * Called when a web server's request header has been parsed, if each app
+	 * group is served by one request loop. If the request's app group belongs
+	 * to another loop, hands the connection over to that loop, along with the
+	 * header and the `rest` of the data that has already been read, and
+	 * returns true. The other loop then parses the header again.
+	 *
+	 * This keeps an app that keeps its loop busy, e.g. with many streaming
+	 * responses, from adding latency to the apps of the other loops. It also
+	 * keeps each loop's options cache and session leases filled with its
+	 * own apps. App groups are assigned to loops by a hash of their name, so
+	 * that no state has to be shared between the loops. HTTP clients aren't
+	 * handed over because they all go to the same app.
+	 */
+	bool maybeHandOverClient(const ClientPtr &client, const char *rest, size_t restSize) {
+		ScgiRequestParser &parser = client->scgiParser;
+		StaticString appGroupName = parser.getHeader(ScgiRequestParser::KH_PASSENGER_APP_GROUP_NAME);
+		if (appGroupName.empty()) {
+			appGroupName = parser.getHeader(ScgiRequestParser::KH_PASSENGER_APP_ROOT);
+		}
+		if (appGroupName.empty()) {
+			appGroupName = parser.getHeader(ScgiRequestParser::KH_DOCUMENT_ROOT);
+		}
+		RequestHandler *owner = requestLoopHandlers[
+			StaticString::Hash()(appGroupName) % requestLoopHandlers.size()];
+		if (owner == this) {
+			return false;
+		}
+
+		StaticString header = parser.getHeaderData();
+		string data;
+		data.reserve(header.size() + restSize + 16);
+		data.append(toString(header.size()));
+		data.append(1, ':');
+		data.append(header.data(), header.size());
+		data.append(1, ',');
+		data.append(rest, restSize);
+
+		RH_DEBUG(client, "Handing over to the request loop of app group " << appGroupName);
+		FileDescriptor fd = client->fd;
+		unsigned long long acceptedAt = client->phaseTimes.accepted;
+		handoversMetric->increment();
+		disconnect(client);
+		owner->libev->runLater(boost::bind(&RequestHandler::adoptClient,
+			owner, fd, data, acceptedAt));
+		return true;
+	}
+
+	/**
+	 * Takes over a web server connection from another request loop, see
+	 * maybeHandOverClient(). `data` has already been read from it and
+	 * starts with the request header.
+	 */
+	void adoptClient(const FileDescriptor &fd, const string &data,
+		unsigned long long acceptedAt)
+	{
+		ClientPtr client = checkoutClient();
+		client->associate(this, fd, false, true);
+		client->phaseTimes.accepted = acceptedAt;
+		addClient(client);
+		becomeActive();
+		RH_DEBUG(client, "Client handed over from another request loop; "
+			"new client count = " << clientList.size());
+		client->clientInput->unread(data);
+	}
+
+	size_t state_readingHeader_onHttpClientData(const ClientPtr &client, const char *data, size_t size) {
+		HttpRequestParser &httpParser = client->httpParser;
+		size_t consumed = httpParser.feed(data, size);
+		if (httpParser.acceptingInput()) {
+			return consumed;
+		}
+
+		client->timeoutEntry.cancel();
+		if (httpParser.getState() == HttpRequestParser::ERROR) {
+			RH_DEBUG(client, "Invalid HTTP request: " << httpParser.getErrorMessage());
+			client->state = Client::WRITING_SIMPLE_RESPONSE;
+			client->clientInput->stop();
+			writeSimpleResponse(client,
+				string("<h1>Bad request</h1>\n<p>") + httpParser.getErrorMessage() + "</p>\n",
+				httpParser.getErrorStatusCode());
+			return consumed;
+		}
+
+		feedHttpHeaderToScgiParser(client);
+		client->requestBodyIsChunked = httpParser.isChunked();
+		if (httpParser.expectsContinue()
+		 && (client->requestBodyIsChunked || getULongLongOption(client, "CONTENT_LENGTH", 0) > 0))
+		{
+			// The client waits for this before sending the body.
+			writeToClientOutputPipe(client, "HTTP/1.1 100 Continue\r\n\r\n");
+		}
+		state_readingHeader_onHeaderParsed(client);
+		return consumed;
+	}
+
+	/**
+	 * Turns the CGI variables that httpParser produced into the SCGI header
+	 * that a web server would have sent, and feeds it to scgiParser. The
+	 * variables that the web server would have added come from
+	 * httpEnvironment and httpConnectionEnv.
+	 */
+	void feedHttpHeaderToScgiParser(const ClientPtr &client) {
+		static const StaticString keepAlive("PASSENGER_FRONTEND_KEEPALIVE\0true\0",
+			sizeof("PASSENGER_FRONTEND_KEEPALIVE\0true\0") - 1);
+		StaticString cgiHeaders = client->httpParser.getHeaderData();
+		size_t size = httpEnvironment.size() + client->httpConnectionEnv.size()
+			+ cgiHeaders.size();
+		if (client->httpParser.keepAlive()) {
+			size += keepAlive.size();
+		}
+
+		string &header = httpScgiHeader;
+		header.clear();
+		header.append(toString(size));
+		header.append(1, ':');
+		header.append(httpEnvironment);
+		header.append(client->httpConnectionEnv);
+		header.append(cgiHeaders.data(), cgiHeaders.size());
+		if (client->httpParser.keepAlive()) {
+			header.append(keepAlive.data(), keepAlive.size());
+		}
+		header.append(1, ',');
+
+		ScgiRequestParser &parser = client->scgiParser;
+		parser.feed(header.data(), header.size());
+		// The parser refers to httpScgiHeader until
+		// state_readingHeader_onHeaderParsed() calls rebuildData().
+		assert(parser.getState() == ScgiRequestParser::DONE);
+	}
+
+	void state_readingHeader_onHeaderParsed(const ClientPtr &client) {
+		ScgiRequestParser &parser = client->scgiParser;
+
+		if (benchmarkPoint == BP_AFTER_PARSING_HEADER) {
+			writeSimpleResponse(client, "Benchmark point: after_parsing_header\n");
+			return;
+		}
+
+		client->phaseTimes.headerRead = monotonicTimeUsec();
+		requestsMetric->increment();
+		bool modified = modifyClientHeaders(client);
+		/* TODO: in case the headers are not modified, we only need to rebuild the header data
+		 * right now because the scgiParser buffer is invalidated as soon as onClientData exits.
+		 * We should figure out a way to not copy anything if we can do everything before
+		 * onClientData exits.
+		 */
+		parser.rebuildData(modified);
+		client->contentLength = getULongLongOption(client, "CONTENT_LENGTH");
+		client->frontendKeepAlive = canKeepAliveFrontend(client);
+		if (client->contentLength == -1 && !client->requestBodyIsChunked
+		 && (client->frontendKeepAlive
+		  || (client->httpFrontend && !parser.hasHeader(ScgiRequestParser::KH_HTTP_UPGRADE))))
+		{
+			// The next request follows right after this one, so a
+			// request without a content length can't have a body.
+			// Neither can one from an HTTP client, unless it's a
+			// protocol upgrade, whose data lasts until EOF.
+			client->contentLength = 0;
+		}
+		if (client->contentLength > 0) {
+			client->clientBodyBuffer->setSizeHint(client->contentLength);
+		}
+		if (options.compressBufferFiles && parser.hasHeader(ScgiRequestParser::KH_CONTENT_TYPE)) {
+			client->clientBodyBuffer->setCompression(isCompressibleContentType(
+				parser.getHeader(ScgiRequestParser::KH_CONTENT_TYPE)));
+		}
+		fillPoolOptions(client);
+		if (!client->connected()) {
+			return;
+		}
+		initializeUnionStation(client);
+		if (!client->connected()) {
+			return;
+		}
+		PASSENGER_PROBE3(request_header_parsed, client->fdnum,
+			client->options.getAppGroupName().data(),
+			client->options.getAppGroupName().size());
+		client->timingHeader = wantsTimingHeader(client);
+		if (staticFileCache != NULL && maybeServeStaticFile(client)) {
+			return;
+		}
+		if (responseCache != NULL) {
+			setResponseCachePrimaryKey(client);
+			if (!client->cachePrimaryKey.empty()
+			 && (serveFromResponseCache(client) || maybeCollapseRequest(client)))
+			{
+				return;
 			}
+		}
 
-			if (getBoolOption(client, "PASSENGER_BUFFERING")) {
-				RH_TRACE(client, 3, "Valid SCGI header; buffering request body");
-				client->state = Client::BUFFERING_REQUEST_BODY;
-				client->requestBodyIsBuffered = true;
-				client->beginScopeLog(&client->scopeLogs.bufferingRequestBody, "buffering request body");
-				if (client->contentLength == 0) {
-					client->clientInput->stop();
-					state_bufferingRequestBody_onClientEof(client);
-					return 0;
-				}
-			} else {
-				RH_TRACE(client, 3, "Valid SCGI header; not buffering request body; checking out session");
+		beginProcessingRequest(client);
+	}
+
+	/**
+	 * Continues with a request whose header has been parsed and that
+	 * couldn't be answered without the application.
+	 */
+	void beginProcessingRequest(const ClientPtr &client) {
+		if (!checkRateLimit(client)) {
+			return;
+		}
+		if (getBoolOption(client, "PASSENGER_BUFFERING") || client->requestBodyIsChunked) {
+			// Chunked request bodies are always buffered, so that the
+			// application gets them with a content length.
+			RH_TRACE(client, 3, "Valid request header; buffering request body");
+			client->state = Client::BUFFERING_REQUEST_BODY;
+			client->requestBodyIsBuffered = true;
+			client->beginScopeLog(&client->scopeLogs.bufferingRequestBody, "buffering request body");
+			if (client->contentLength == 0) {
 				client->clientInput->stop();
-				checkoutSession(client);
+				state_bufferingRequestBody_onClientEof(client);
 			}
+		} else {
+			RH_TRACE(client, 3, "Valid request header; not buffering request body; checking out session");
+			client->clientInput->stop();
+			checkoutSession(client);
+		}
+	}
+
+
+	/**
+	 * Applies the request rate limit (PASSENGER_RATE_LIMIT requests per second,
+	 * with bursts of PASSENGER_RATE_LIMIT_BURST) and the concurrency limit
+	 * (PASSENGER_MAX_CONCURRENT_REQUESTS_PER_KEY) that the request's app group
+	 * is configured with, if any. Requests are grouped by the value of the
+	 * request header named by PASSENGER_RATE_LIMIT_KEY, which is REMOTE_ADDR
+	 * by default. Responds with "429 Too Many Requests" and returns false if
+	 * the request exceeds a limit.
+	 */
+	bool checkRateLimit(const ClientPtr &client) {
+		double rate = getDoubleOption(client, "PASSENGER_RATE_LIMIT", 0);
+		long long maxConcurrency = getULongLongOption(client,
+			"PASSENGER_MAX_CONCURRENT_REQUESTS_PER_KEY", 0);
+		if (rate <= 0 && maxConcurrency <= 0) {
+			return true;
+		}
+
+		StaticString keyName = client->scgiParser.getHeader("PASSENGER_RATE_LIMIT_KEY");
+		if (keyName.empty()) {
+			keyName = "REMOTE_ADDR";
+		}
+		boost::uint64_t key = rateLimiter->hash(client->options.getAppGroupName(),
+			client->scgiParser.getHeader(keyName));
+		RateLimiter::Result result = rateLimiter->admit(key, rate,
+			getDoubleOption(client, "PASSENGER_RATE_LIMIT_BURST", rate),
+			(unsigned int) std::min<long long>(maxConcurrency, UINT_MAX),
+			monotonicTimeUsec());
+
+		if (result == RateLimiter::ALLOWED) {
+			if (maxConcurrency > 0) {
+				client->rateLimitHeld = true;
+				client->rateLimitKey = key;
+			}
+			return true;
+		} else {
+			RH_DEBUG(client, ((result == RateLimiter::RATE_LIMITED)
+				? "Request rate limit exceeded"
+				: "Concurrent request limit exceeded")
+				<< " for " << keyName << "=" << client->scgiParser.getHeader(keyName));
+			rateLimitedMetric->increment();
+			client->state = Client::WRITING_SIMPLE_RESPONSE;
+			client->clientInput->stop();
+			writePreparedResponse(client, rateLimitedResponses, 429);
+			return false;
+		}
+	}
+
+	void releaseRateLimit(const ClientPtr &client) {
+		if (client->rateLimitHeld) {
+			rateLimiter->release(client->rateLimitKey);
+			client->rateLimitHeld = false;
 		}
-		return consumed;
 	}
 
 
@@ -1922,6 +5132,10 @@ private:
 		state_bufferingRequestBody_verifyInvariants(client);
 		assert(!client->clientBodyBuffer->isCommittingToDisk());
 
+		if (client->requestBodyIsChunked) {
+			return state_bufferingRequestBody_onChunkedClientData(client, data, size);
+		}
+
 		if (client->contentLength >= 0) {
 			size = std::min<unsigned long long>(
 				size,
@@ -1954,10 +5168,68 @@ private:
 		return size;
 	}
 
+	/**
+	 * Decodes a chunked request body into clientBodyBuffer, through
+	 * onClientBodyChunk(). Once the last chunk has been received the request
+	 * gets a CONTENT_LENGTH, so that to the application it looks like any
+	 * other buffered request. Trailers are not supported.
+	 */
+	size_t state_bufferingRequestBody_onChunkedClientData(const ClientPtr &client,
+		const char *data, size_t size)
+	{
+		Dechunker &dechunker = client->requestDechunker;
+		size_t consumed = dechunker.feed(data, size);
+		if (dechunker.acceptingInput()) {
+			return consumed;
+		} else if (dechunker.hasError()) {
+			disconnectWithError(client, string("invalid chunked request body: ") +
+				dechunker.getErrorMessage());
+			return consumed;
+		}
+
+		RH_TRACE(client, 3, "Done decoding chunked request body; size=" <<
+			client->clientBodyAlreadyRead);
+		client->contentLength = client->clientBodyAlreadyRead;
+		string contentLength = toString(client->contentLength);
+		client->scgiParser.setHeader("CONTENT_LENGTH", contentLength);
+		client->scgiParser.rebuildData(true);
+
+		if (client->clientBodyBuffer->isCommittingToDisk()) {
+			RH_TRACE(client, 3, "Done buffering request body, but clientBodyBuffer not yet done committing data to disk; waiting until it's done");
+			client->checkoutSessionAfterCommit = true;
+		} else {
+			client->clientInput->stop();
+			state_bufferingRequestBody_onClientEof(client);
+		}
+		return consumed;
+	}
+
+	void onClientBodyChunk(const ClientPtr &client, const StaticString &data) {
+		if (!client->clientBodyBuffer->write(data.data(), data.size())
+		 && client->clientInput->isStarted())
+		{
+			// See state_bufferingRequestBody_onClientData().
+			client->backgroundOperations++;
+			client->clientInput->stop();
+		}
+		client->clientBodyAlreadyRead += data.size();
+	}
+
+	/** Whether an HTTP client has sent the entire request body. */
+	bool requestBodyComplete(const ClientPtr &client) const {
+		if (client->requestBodyIsChunked) {
+			return !client->requestDechunker.acceptingInput();
+		} else {
+			return client->contentLength < 0
+				|| client->clientBodyAlreadyRead == (unsigned long long) client->contentLength;
+		}
+	}
+
 	void state_bufferingRequestBody_onClientEof(const ClientPtr &client) {
 		state_bufferingRequestBody_verifyInvariants(client);
 
 		RH_TRACE(client, 3, "Done buffering request body; checking out session");
+		client->phaseTimes.bodyBuffered = monotonicTimeUsec();
 		client->clientBodyBuffer->end();
 		client->endScopeLog(&client->scopeLogs.bufferingRequestBody);
 		checkoutSession(client);
@@ -1990,16 +5262,49 @@ private:
 			RH_TRACE(client, 2, "Checking out session: appRoot=" << client->options.appRoot);
 			client->state = Client::CHECKING_OUT_SESSION;
 			client->beginScopeLog(&client->scopeLogs.getFromPool, "get from pool");
-			pool->asyncGet(client->options, boost::bind(&RequestHandler::sessionCheckedOut,
-				this, client, _1, _2));
-			if (!client->sessionCheckedOut) {
-				client->backgroundOperations++;
+			if (client->timingHeader && client->checkoutStartedAt == 0) {
+				client->checkoutStartedAt = SystemTime::getUsec();
 			}
+			PASSENGER_PROBE3(session_checkout_begin, client->fdnum,
+				client->options.getAppGroupName().data(),
+				client->options.getAppGroupName().size());
+			asyncGetSession(client);
 		} else {
 			writeSimpleResponse(client, "Benchmark point: before_checkout_session\n");
 		}
 	}
 
+	/**
+	 * Asks the pool for a session for the client's request. Client input is
+	 * stopped meanwhile, so if the request has to wait in the pool's queue,
+	 * the client socket is checked for a hangup every
+	 * CHECKOUT_HANGUP_CHECK_INTERVAL msec instead. A hangup cancels the
+	 * queued request (see disconnect()), so that no process ends up
+	 * handling a request whose response nobody will read.
+	 */
+	void asyncGetSession(const ClientPtr &client) {
+		client->options.cancellation.reset();
+		if (client->checkoutCancellation == NULL || !client->checkoutCancellation.unique()) {
+			client->checkoutCancellation = boost::make_shared<GetCancellation>();
+		} else {
+			client->checkoutCancellation->reset();
+		}
+		client->options.cancellation = client->checkoutCancellation;
+
+		// Counted before calling asyncGet() because the callback may be
+		// called immediately.
+		client->backgroundOperations++;
+		sessionLeases->asyncGet(client->options,
+			boost::bind(&RequestHandler::sessionCheckedOut, this, client, _1, _2),
+			sessionLeasesPerGroup);
+		if (client->connected()
+		 && client->state == Client::CHECKING_OUT_SESSION
+		 && !client->sessionCheckedOut)
+		{
+			scheduleClientTimeout(client.get(), CHECKOUT_HANGUP_CHECK_INTERVAL);
+		}
+	}
+
 	void sessionCheckedOut(ClientPtr client, const SessionPtr &session, const ExceptionPtr &e) {
 		if (!pthread_equal(pthread_self(), libev->getCurrentThread())) {
 			libev->runLater(boost::bind(&RequestHandler::sessionCheckedOut_real, this,
@@ -2010,6 +5315,7 @@ private:
 	}
 
 	void sessionCheckedOut_real(ClientPtr client, const SessionPtr &session, const ExceptionPtr &e) {
+		ScopedLoopTimer timer(loopTimeStats.get(), LPC_SESSIONS);
 		if (!client->connected()) {
 			return;
 		}
@@ -2017,6 +5323,14 @@ private:
 		state_checkingOutSession_verifyInvariants(client);
 		client->backgroundOperations--;
 		client->sessionCheckedOut = true;
+		client->timeoutEntry.cancel();
+		client->phaseTimes.sessionCheckedOut = monotonicTimeUsec();
+
+		PASSENGER_PROBE5(session_checkout_end, client->fdnum,
+			client->options.getAppGroupName().data(),
+			client->options.getAppGroupName().size(),
+			(session != NULL) ? (int) session->getPid() : 0,
+			(session != NULL) ? session->getGupid().c_str() : "");
 
 		if (e != NULL) {
 			client->endScopeLog(&client->scopeLogs.getFromPool, false);
@@ -2039,21 +5353,24 @@ private:
 			RH_DEBUG(client, "Session checked out: pid=" << session->getPid() <<
 				", gupid=" << session->getGupid());
 			client->session = session;
+			if (client->options.maxRequestTime > 0) {
+				scheduleClientTimeout(client.get(), client->options.maxRequestTime * 1000);
+			}
 			initiateSession(client);
 		}
 	}
 
 	void writeRequestQueueFullExceptionErrorResponse(const ClientPtr &client) {
-		StaticString value = client->scgiParser.getHeader("PASSENGER_REQUEST_QUEUE_OVERFLOW_STATUS_CODE");
+		StaticString value = client->scgiParser.getHeader(ScgiRequestParser::KH_PASSENGER_REQUEST_QUEUE_OVERFLOW_STATUS_CODE);
 		int requestQueueOverflowStatusCode = 503;
 		if (!value.empty()) {
 			requestQueueOverflowStatusCode = atoi(value.data());
 		}
-		writeSimpleResponse(client,
-			"<h1>This website is under heavy load</h1>"
-			"<p>We're sorry, too many people are accessing this website at the same "
-			"time. We're working on this problem. Please try again later.</p>",
-			requestQueueOverflowStatusCode);
+		if (requestQueueOverflowStatusCode == 503) {
+			writePreparedResponse(client, overloadResponses, 503);
+		} else {
+			writeSimpleResponse(client, overloadPage(), requestQueueOverflowStatusCode);
+		}
 	}
 
 	void writeSpawnExceptionErrorResponse(const ClientPtr &client, const boost::shared_ptr<SpawnException> &e) {
@@ -2109,12 +5426,7 @@ private:
 				RH_DEBUG(client, "Error checking out session (" << e2.what() <<
 					"); retrying (attempt " << client->sessionCheckoutTry << ")");
 				client->sessionCheckedOut = false;
-				pool->asyncGet(client->options,
-					boost::bind(&RequestHandler::sessionCheckedOut,
-						this, client, _1, _2));
-				if (!client->sessionCheckedOut) {
-					client->backgroundOperations++;
-				}
+				asyncGetSession(client);
 			} else {
 				string message = "could not initiate a session (";
 				message.append(e2.what());
@@ -2133,6 +5445,12 @@ private:
 		}
 		
 		RH_DEBUG(client, "Session initiated: fd=" << client->session->fd());
+		client->keepAliveSession = canKeepAliveSession(client);
+		if (client->keepAliveSession && client->contentLength == -1) {
+			// The application relies on CONTENT_LENGTH to find the end of
+			// the request body, so don't forward anything beyond the header.
+			client->contentLength = 0;
+		}
 		setNonBlocking(client->session->fd());
 		client->appInput->reset(libev.get(), client->session->fd());
 		client->appInput->start();
@@ -2142,6 +5460,50 @@ private:
 	}
 
 
+	/**
+	 * Whether the connection with the web server may be kept open after
+	 * this request. Web servers opt in per request by setting the
+	 * PASSENGER_FRONTEND_KEEPALIVE header. Every response on such a
+	 * connection then carries "Transfer-Encoding: chunked" and a chunked
+	 * body, terminated by a zero-sized chunk, after which the next request
+	 * may be sent without a connect password. Responses without that header
+	 * are followed by EOF instead, in which case the web server must not
+	 * reuse the connection.
+	 *
+	 * The request body must be delimited by CONTENT_LENGTH, so requests
+	 * whose body is only delimited by EOF fall back to a one-shot connection.
+	 */
+	bool canKeepAliveFrontend(const ClientPtr &client) const {
+		if (!getBoolOption(client, "PASSENGER_FRONTEND_KEEPALIVE")) {
+			return false;
+		} else if (client->contentLength >= 0) {
+			return true;
+		} else {
+			return client->scgiParser.getHeader(ScgiRequestParser::KH_HTTP_TRANSFER_ENCODING).empty()
+				&& client->scgiParser.getHeader(ScgiRequestParser::KH_HTTP_UPGRADE).empty();
+		}
+	}
+
+	bool canKeepAliveSession(const ClientPtr &client) const {
+		// A keep-alive session can only be used if the application can
+		// find the end of the request body without relying on EOF. Requests
+		// without a content length are assumed to have no body, unless they
+		// use chunked transfer encoding, are protocol upgrades (e.g. WebSocket)
+		// or had their body buffered until EOF.
+		if (!client->session->getSocket()->keepAlive
+		 || client->session->getProtocol() != "session")
+		{
+			return false;
+		} else if (client->contentLength >= 0) {
+			return true;
+		} else {
+			return !client->requestBodyIsBuffered
+				&& client->scgiParser.getHeader(ScgiRequestParser::KH_HTTP_TRANSFER_ENCODING).empty()
+				&& client->scgiParser.getHeader(ScgiRequestParser::KH_HTTP_UPGRADE).empty();
+		}
+	}
+
+
 	/******* State: SENDING_HEADER_TO_APP *******/
 
 	void state_sendingHeaderToApp_verifyInvariants(const ClientPtr &client) {
@@ -2149,6 +5511,27 @@ private:
 		assert(!client->clientBodyBuffer->isStarted());
 	}
 
+	/**
+	 * Formats the request's deadline into `buf`: the wall clock time at which
+	 * the request arrived plus its queue time budget
+	 * (Options::maxRequestQueueTime), in seconds since the epoch with
+	 * millisecond precision. Sent to the app as PASSENGER_REQUEST_DEADLINE,
+	 * so that it can abort work for requests that are already late. Returns
+	 * the empty string if the request has no queue time budget.
+	 */
+	static StaticString formatRequestDeadline(const ClientPtr &client, char *buf, size_t size) {
+		if (client->options.maxRequestQueueTime == 0) {
+			return StaticString();
+		}
+		unsigned long long now = monotonicTimeUsec();
+		unsigned long long age = now - std::min(now, client->phaseTimes.headerRead);
+		unsigned long long deadline = SystemTime::getUsec() - age
+			+ client->options.maxRequestQueueTime * 1000ull;
+		int len = snprintf(buf, size, "%llu.%03llu",
+			deadline / 1000000, deadline / 1000 % 1000);
+		return StaticString(buf, len);
+	}
+
 	void sendHeaderToApp(const ClientPtr &client) {
 		assert(!client->clientInput->isStarted());
 		assert(!client->clientBodyBuffer->isStarted());
@@ -2160,7 +5543,9 @@ private:
 				"Application sent EOF before we were able to send headers to it");
 		} else if (client->session->getProtocol() == "session") {
 			char sizeField[sizeof(uint32_t)];
-			SmallVector<StaticString, 10> data;
+			char deadlineBuf[32];
+			StaticString deadline = formatRequestDeadline(client, deadlineBuf, sizeof(deadlineBuf));
+			SmallVector<StaticString, 12> data;
 
 			data.push_back(StaticString(sizeField, sizeof(uint32_t)));
 			data.push_back(client->scgiParser.getHeaderData());
@@ -2173,6 +5558,23 @@ private:
 				data.push_back(makeStaticStringWithNull(client->options.logger->getTxnId()));
 			}
 
+			if (!deadline.empty()) {
+				data.push_back(makeStaticStringWithNull("PASSENGER_REQUEST_DEADLINE"));
+				data.push_back(StaticString(deadline.data(), deadline.size() + 1));
+			}
+
+			if (client->keepAliveSession) {
+				data.push_back(makeStaticStringWithNull("PASSENGER_KEEPALIVE"));
+				data.push_back(makeStaticStringWithNull("true"));
+			}
+
+			if (client->requestBodyIsBuffered) {
+				// Tells the app that the entire body follows right away, so
+				// that it can read the body in one go.
+				data.push_back(makeStaticStringWithNull("PASSENGER_REQUEST_BODY_BUFFERED"));
+				data.push_back(makeStaticStringWithNull("true"));
+			}
+
 			uint32_t dataSize = 0;
 			for (unsigned int i = 1; i < data.size(); i++) {
 				dataSize += (uint32_t) data[i].size();
@@ -2193,59 +5595,75 @@ private:
 			assert(client->session->getProtocol() == "http_session");
 			const ScgiRequestParser &parser = client->scgiParser;
 			ScgiRequestParser::const_iterator it, end = parser.end();
-			string data;
+			SmallVector<StaticString, 64> data;
+			/* Header values are written straight out of the parser's buffer;
+			 * only the converted header names are copied, into 'names'.
+			 * "HTTP_FOO\0" is never shorter than "Foo: " so 'names' never needs
+			 * to grow beyond this, and the StaticStrings pointing into it stay
+			 * valid.
+			 */
+			string names;
+			names.reserve(parser.getHeaderData().size());
 
-			data.reserve(parser.getHeaderData().size() + 128);
-			data.append(parser.getHeader("REQUEST_METHOD"));
-			data.append(" ");
-			data.append(parser.getHeader("REQUEST_URI"));
-			data.append(" HTTP/1.1\r\n");
-			data.append("Connection: close\r\n");
+			data.push_back(parser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD));
+			data.push_back(" ");
+			data.push_back(parser.getHeader(ScgiRequestParser::KH_REQUEST_URI));
+			data.push_back(" HTTP/1.1\r\nConnection: close\r\n");
 
 			for (it = parser.begin(); it != end; it++) {
 				if (startsWith(it->first, "HTTP_")) {
-					string subheader = it->first.substr(sizeof("HTTP_") - 1);
-					string::size_type i;
+					StaticString subheader = it->first.substr(sizeof("HTTP_") - 1);
+					string::size_type i, begin = names.size();
 					for (i = 0; i < subheader.size(); i++) {
 						if (subheader[i] == '_') {
-							subheader[i] = '-';
-						} else if (i > 0 && subheader[i - 1] != '-') {
-							subheader[i] = tolower(subheader[i]);
+							names.append(1, '-');
+						} else if (i > 0 && subheader[i - 1] != '_') {
+							names.append(1, (char) tolower(subheader[i]));
+						} else {
+							names.append(1, subheader[i]);
 						}
 					}
+					names.append(": ");
+					assert(names.capacity() >= parser.getHeaderData().size());
 
-					data.append(subheader);
-					data.append(": ");
-					data.append(it->second);
-					data.append("\r\n");
+					data.push_back(StaticString(names.data() + begin, names.size() - begin));
+					data.push_back(it->second);
+					data.push_back("\r\n");
 				}
 			}
 
-			StaticString header = parser.getHeader("CONTENT_LENGTH");
+			StaticString header = parser.getHeader(ScgiRequestParser::KH_CONTENT_LENGTH);
 			if (!header.empty()) {
-				data.append("Content-Length: ");
-				data.append(header);
-				data.append("\r\n");
+				data.push_back("Content-Length: ");
+				data.push_back(header);
+				data.push_back("\r\n");
 			}
 
-			header = parser.getHeader("CONTENT_TYPE");
+			header = parser.getHeader(ScgiRequestParser::KH_CONTENT_TYPE);
 			if (!header.empty()) {
-				data.append("Content-Type: ");
-				data.append(header);
-				data.append("\r\n");
+				data.push_back("Content-Type: ");
+				data.push_back(header);
+				data.push_back("\r\n");
 			}
 
 			if (client->options.analytics) {
-				data.append("Passenger-Txn-Id: ");
-				data.append(client->options.logger->getTxnId());
-				data.append("\r\n");
+				data.push_back("Passenger-Txn-Id: ");
+				data.push_back(client->options.logger->getTxnId());
+				data.push_back("\r\n");
+			}
+
+			char deadlineBuf[32];
+			StaticString deadline = formatRequestDeadline(client, deadlineBuf, sizeof(deadlineBuf));
+			if (!deadline.empty()) {
+				data.push_back("Passenger-Request-Deadline: ");
+				data.push_back(deadline);
+				data.push_back("\r\n");
 			}
 
-			data.append("\r\n");
+			data.push_back("\r\n");
 
-			StaticString datas[] = { data };
-			ssize_t ret = gatheredWrite(client->session->fd(), datas,
-				1, client->appOutputBuffer);
+			ssize_t ret = gatheredWrite(client->session->fd(), &data[0],
+				data.size(), client->appOutputBuffer);
 			if (ret == -1 && errno != EAGAIN) {
 				disconnectWithAppSocketWriteError(client, errno);
 				// TODO: what about other errors?
@@ -2292,6 +5710,7 @@ private:
 		assert(!client->appOutputWatcher.is_active());
 
 		RH_TRACE(client, 2, "Begin sending body to application");
+		client->phaseTimes.headerSent = monotonicTimeUsec();
 
 		client->state = Client::FORWARDING_BODY_TO_APP;
 		if (client->requestBodyIsBuffered) {
@@ -2300,6 +5719,7 @@ private:
 			state_forwardingBodyToApp_onClientEof(client);
 		} else {
 			client->clientInput->start();
+			maybeStartSplicingRequestBody(client);
 		}
 	}
 
@@ -2351,6 +5771,10 @@ private:
 			if (client->contentLength >= 0 && client->clientBodyAlreadyRead == (unsigned long long) client->contentLength) {
 				client->clientInput->stop();
 				state_forwardingBodyToApp_onClientEof(client);
+			} else if (client->upgraded) {
+				maybeStartTunnel(client);
+			} else if ((size_t) ret == size) {
+				maybeStartSplicingRequestBody(client, true);
 			}
 
 			return ret;
@@ -2363,6 +5787,7 @@ private:
 
 		RH_TRACE(client, 2, "End of (unbuffered) client body reached; done sending data to application");
 		client->clientInput->stop();
+		client->requestBodySent = true;
 		if (client->session != NULL && client->shouldHalfCloseWrite()) {
 			syscalls::shutdown(client->session->fd(), SHUT_WR);
 		}
@@ -2373,12 +5798,45 @@ private:
 
 		RH_TRACE(client, 3, "Application socket became writable again.");
 		client->appOutputWatcher.stop();
+		if (!client->appOutputBuffer.empty()) {
+			// Left over from splicing the request body.
+			ssize_t ret = syscalls::write(client->session->fd(),
+				client->appOutputBuffer.data(), client->appOutputBuffer.size());
+			if (ret == -1) {
+				int e = errno;
+				if (e == EAGAIN) {
+					client->appOutputWatcher.start();
+				} else if (e == EPIPE || e == ECONNRESET) {
+					// Client will be disconnected after response forwarding is done.
+					client->appOutputBuffer.resize(0);
+					syscalls::shutdown(client->fd, SHUT_RD);
+				} else {
+					disconnectWithAppSocketWriteError(client, e);
+				}
+				return;
+			} else if ((size_t) ret < client->appOutputBuffer.size()) {
+				client->appOutputBuffer.erase(0, ret);
+				client->appOutputWatcher.start();
+				return;
+			}
+			client->appOutputBuffer.resize(0);
+			if (client->contentLength >= 0
+			 && client->clientBodyAlreadyRead == (unsigned long long) client->contentLength)
+			{
+				state_forwardingBodyToApp_onClientEof(client);
+				return;
+			}
+		}
+		if (client->upgraded) {
+			maybeStartTunnel(client);
+		}
 		if (client->requestBodyIsBuffered) {
 			assert(!client->clientBodyBuffer->isStarted());
 			client->clientBodyBuffer->start();
 		} else {
 			assert(!client->clientInput->isStarted());
 			client->clientInput->start();
+			maybeStartSplicingRequestBody(client);
 		}
 	}
 
@@ -2424,6 +5882,7 @@ private:
 		assert(client->requestBodyIsBuffered);
 
 		RH_TRACE(client, 2, "End of (buffered) client body reached; done sending data to application");
+		client->requestBodySent = true;
 		if (client->session != NULL && client->shouldHalfCloseWrite()) {
 			syscalls::shutdown(client->session->fd(), SHUT_WR);
 		}
@@ -2433,9 +5892,75 @@ private:
 public:
 	// For unit testing purposes.
 	unsigned int connectPasswordTimeout; // milliseconds
+	/** Per-client timeouts, expired by a single coarse timer instead of a
+	 * libev timer per client. Its resolution may be changed before the event
+	 * loop is started. */
+	TimerWheel clientTimeouts;
 
 	BenchmarkPoint benchmarkPoint;
 
+	/** Whether to forward response bodies with splice() when possible. */
+	bool spliceResponses;
+	/** Whether to forward unbuffered request bodies with splice() when possible. */
+	bool spliceRequestBodies;
+	/** Whether to hand connections over to a Tunnel once the application
+	 * has switched protocols. */
+	bool tunnelUpgrades;
+	/** Whether to apply the sessions that are closed during an event loop
+	 * iteration to the pool in a single batch, see Pool::SessionCloseBatch.
+	 * Must be set before the event loop is started. */
+	bool batchSessionCloses;
+	/** The maximum number of sessions per application group that this
+	 * event loop checks out ahead of time, so that it can hand them out
+	 * without locking the pool. See Pool::SessionLeases. 0 disables this. */
+	unsigned int sessionLeasesPerGroup;
+	/** Canonical paths of the directories from which files may be sent on
+	 * behalf of applications through an X-Sendfile response header. Empty
+	 * (the default, unless set by AgentOptions) disables X-Sendfile
+	 * handling, and the header is passed on to the web server instead. */
+	vector<string> sendfileRoots;
+	/** Maximum number of disconnected Client objects to keep around for reuse. */
+	unsigned int clientFreelistLimit;
+	/** After how many seconds without clients to release the memory that
+	 * is only kept for reuse, see releaseIdleMemory(). 0 disables this. */
+	unsigned int idleMemoryReleaseDelay;
+	/** Caches publicly cacheable responses so that they can be served without
+	 * checking out a session. NULL (the default) disables response caching.
+	 * Must be set before the event loop is started. */
+	ResponseCachePtr responseCache;
+	/** Caches the files in applications' public directories, which are
+	 * served without checking out a session to HTTP clients, and to the
+	 * web server if it sets PASSENGER_SERVE_STATIC_FILES. NULL (the default)
+	 * disables static file serving. Must be set before the event loop is
+	 * started. */
+	StaticFileCachePtr staticFileCache;
+	/** Compresses responses for clients that accept gzip or deflate. May be
+	 * shared between RequestHandlers. NULL (the default) disables response
+	 * compression. Must be set before the event loop is started. */
+	CompressionPoolPtr compressionPool;
+	/** Takes over writing fully generated responses to slow clients. May be
+	 * shared between RequestHandlers. NULL (the default) keeps slow clients in
+	 * this event loop. Must be set before the event loop is started. */
+	ResponseDrainerPtr responseDrainer;
+	/** Bounds the memory of all client body buffers and client output pipes.
+	 * May be shared between RequestHandlers. NULL (the default) means no
+	 * budget. Must be set before the event loop is started. */
+	FileBackedPipe::MemoryBudgetPtr bufferMemoryBudget;
+	/** Secret with which requests may be signed to get an X-Passenger-Timing
+	 * response header. Empty (the default, unless set by AgentOptions)
+	 * means that only applications with PASSENGER_TIMING_HEADER get one.
+	 * See wantsTimingHeader(). */
+	string timingHeaderSecret;
+	/** Where per-phase request latencies are recorded. May be shared between
+	 * RequestHandlers, or NULL to disable latency recording. Must be set before
+	 * the event loop is started. */
+	RequestLatencyStatsPtr latencyStats;
+	/** The RequestHandlers of all request loops, this one included, if each
+	 * app group is to be served by one of them (see maybeHandOverClient()).
+	 * Empty (the default) lets every RequestHandler serve every app group.
+	 * Must be set before the event loops are started. */
+	vector<RequestHandler *> requestLoopHandlers;
+
 	RequestHandler(const SafeLibevPtr &_libev,
 		const FileDescriptor &_requestSocket,
 		const PoolPtr &_pool,
@@ -2445,28 +5970,188 @@ public:
 		  pool(_pool),
 		  options(_options),
 		  resourceLocator(_options.passengerRoot),
+		  sessionCloses(_pool),
 		  benchmarkPoint(getDefaultBenchmarkPoint())
 	{
 		accept4Available = true;
+		#ifdef RH_SPLICE_AVAILABLE
+			spliceAvailable = true;
+		#else
+			spliceAvailable = false;
+		#endif
+		spliceResponses = true;
+		spliceRequestBodies = true;
+		tunnelUpgrades = true;
+		batchSessionCloses = true;
+		sessionLeasesPerGroup = 2;
+		clientFreelistLimit = 1024;
+		idleMemoryReleaseDelay = 30;
+		idleMemoryReleases = 0;
+		rssBeforeIdleMemoryRelease = 0;
+		rssAfterIdleMemoryRelease = 0;
+		dateHeaderSize = 0;
+		dateHeaderTime = 0;
+		for (unsigned int i = 0; i < _options.sendfileRoots.size(); i++) {
+			try {
+				sendfileRoots.push_back(canonicalizePath(_options.sendfileRoots[i]));
+			} catch (const FileSystemException &e) {
+				P_WARN("Ignoring X-Sendfile directory " << _options.sendfileRoots[i] <<
+					": " << e.what());
+			}
+		}
+		timingHeaderSecret = _options.timingHeaderSecret;
+		loadErrorTemplates();
+		latencyStats = boost::make_shared<RequestLatencyStats>();
+		pipeBufferPool = boost::make_shared<FileBackedPipe::BufferPool>();
+		spillFilePool = boost::make_shared<FileBackedPipe::SpillFilePool>();
+		rateLimiter = boost::make_shared<RateLimiter>(4096,
+			(boost::uint64_t) SystemTime::getUsec() ^ (boost::uint64_t) (uintptr_t) this);
+		inputBufferPool = boost::make_shared<EventedBufferedInputBufferPool>();
 		connectPasswordTimeout = 15000;
 		loggerFactory = pool->loggerFactory;
+		unionStationSampleRate = _options.unionStationSampleRate;
+		unionStationSlowRequestThreshold = _options.unionStationSlowRequestThreshold * 1000;
+		unionStationSampleSeed = (unsigned int) SystemTime::getUsec() ^ (unsigned int) (uintptr_t) this;
+		for (unsigned int i = 0; i < _options.httpEnvironment.size(); i++) {
+			const string &entry = _options.httpEnvironment[i];
+			string::size_type pos = entry.find('=');
+			if (pos == string::npos || pos == 0) {
+				P_WARN("Ignoring HTTP environment variable " << entry <<
+					": expected NAME=VALUE");
+			} else {
+				appendCgiVariable(httpEnvironment, entry.substr(0, pos), entry.substr(pos + 1));
+			}
+		}
 
-		requestSocketWatcher.set(_requestSocket, ev::READ);
+		acceptBatchSize = MIN_ACCEPT_BATCH_SIZE;
+		acceptBatchesFilled = 0;
+		acceptEpoll = createExclusiveAcceptEpoll(_requestSocket);
+		if (acceptEpoll != -1) {
+			requestSocketWatcher.set(acceptEpoll, ev::READ);
+		} else {
+			requestSocketWatcher.set(_requestSocket, ev::READ);
+		}
 		requestSocketWatcher.set(_libev->getLoop());
 		requestSocketWatcher.set<RequestHandler, &RequestHandler::onAcceptable>(this);
+		setLoopPriority(requestSocketWatcher, LPC_CLIENT_INPUT);
 		requestSocketWatcher.start();
 
 		resumeSocketWatcherTimer.set<RequestHandler, &RequestHandler::onResumeSocketWatcher>(this);
 		resumeSocketWatcherTimer.set(_libev->getLoop());
 		resumeSocketWatcherTimer.set(3, 3);
+		setLoopPriority(resumeSocketWatcherTimer, LPC_CLIENT_INPUT);
+
+		clientTimeoutsTimer.set<RequestHandler, &RequestHandler::onClientTimeoutsTick>(this);
+		clientTimeoutsTimer.set(_libev->getLoop());
+		setLoopPriority(clientTimeoutsTimer, LPC_HOUSEKEEPING);
+		idleMemoryTimer.set<RequestHandler, &RequestHandler::releaseIdleMemory>(this);
+		idleMemoryTimer.set(_libev->getLoop());
+		setLoopPriority(idleMemoryTimer, LPC_HOUSEKEEPING);
+
+		recycleWatcher.set<RequestHandler, &RequestHandler::recycleClients>(this);
+		recycleWatcher.set(_libev->getLoop());
+		setLoopPriority(recycleWatcher, LPC_HOUSEKEEPING);
+
+		sessionClosesWatcher.set<RequestHandler, &RequestHandler::flushSessionCloses>(this);
+		sessionClosesWatcher.set(_libev->getLoop());
+		setLoopPriority(sessionClosesWatcher, LPC_SESSIONS);
+		sessionClosesWatcher.start();
+
+		sessionLeases = boost::make_shared<Pool::SessionLeases>(_pool, _libev);
+
+		metricsRegistry = _pool->metrics;
+		acceptsMetric = metricsRegistry->add(this, "passenger_accepts_total",
+			Metric::COUNTER, "Client connections accepted.");
+		clientsMetric = metricsRegistry->add(this, "passenger_clients",
+			Metric::GAUGE, "Connected clients.");
+		requestsMetric = metricsRegistry->add(this, "passenger_requests_total",
+			Metric::COUNTER, "Requests whose header has been read.");
+		bytesReceivedMetric = metricsRegistry->add(this, "passenger_client_bytes_received_total",
+			Metric::COUNTER, "Bytes received from clients.");
+		bytesSentMetric = metricsRegistry->add(this, "passenger_client_bytes_sent_total",
+			Metric::COUNTER, "Bytes sent to clients.");
+		bufferSpillsMetric = metricsRegistry->add(this, "passenger_buffer_spills_total",
+			Metric::COUNTER, "Request or response bodies that were buffered to disk.");
+		tunnelsMetric = metricsRegistry->add(this, "passenger_tunnels",
+			Metric::GAUGE, "Upgraded connections, e.g. WebSockets, that are being tunneled.");
+		collapsedRequestsMetric = metricsRegistry->add(this, "passenger_collapsed_requests_total",
+			Metric::COUNTER, "Requests that were answered with the response to an identical concurrent request.");
+		staticFilesMetric = metricsRegistry->add(this, "passenger_static_files_total",
+			Metric::COUNTER, "Requests that were answered with a file from an application's public directory.");
+		rateLimitedMetric = metricsRegistry->add(this, "passenger_rate_limited_requests_total",
+			Metric::COUNTER, "Requests that were rejected because of a rate or concurrency limit.");
+		handoversMetric = metricsRegistry->add(this, "passenger_request_loop_handovers_total",
+			Metric::COUNTER, "Connections that were handed over to the request loop that owns their app group.");
+		stuckRequestsMetric = metricsRegistry->add(this, "passenger_stuck_requests_total",
+			Metric::COUNTER, "Requests that were aborted because they exceeded the maximum request time.");
+		loopTimeStats = boost::make_shared<LoopTimeStats>(metricsRegistry);
+	}
+
+	~RequestHandler() {
+		idleMemoryTimer.stop();
+		metricsRegistry->removeAll(this);
+	}
+
+	/**
+	 * Also accepts HTTP/1.1 clients on the given socket, which must be
+	 * non-blocking. Those are parsed into the same request variables that a
+	 * web server would have sent over the request socket, plus the variables
+	 * in AgentOptions::httpEnvironment. Must be called before the event loop
+	 * is started.
+	 */
+	void listenForHttp(const FileDescriptor &socket) {
+		httpSocket = socket;
+		httpAcceptEpoll = createExclusiveAcceptEpoll(socket);
+		if (httpAcceptEpoll != -1) {
+			httpSocketWatcher.set(httpAcceptEpoll, ev::READ);
+		} else {
+			httpSocketWatcher.set(socket, ev::READ);
+		}
+		httpSocketWatcher.set(libev->getLoop());
+		httpSocketWatcher.set<RequestHandler, &RequestHandler::onAcceptable>(this);
+		setLoopPriority(httpSocketWatcher, LPC_CLIENT_INPUT);
+		httpSocketWatcher.start();
 	}
 
 	template<typename Stream>
 	void inspect(Stream &stream) const {
-		stream << clients.size() << " clients:\n";
-		HashMap<int, ClientPtr>::const_iterator it;
-		for (it = clients.begin(); it != clients.end(); it++) {
-			const ClientPtr &client = it->second;
+		pipeBufferPool->inspect(stream);
+		spillFilePool->inspect(stream);
+		inputBufferPool->inspect(stream);
+		if (bufferMemoryBudget != NULL) {
+			bufferMemoryBudget->inspect(stream);
+		}
+		stream << "Client freelist: " << freeClients.size() << "\n";
+		stream << "Idle memory releases: " << idleMemoryReleases;
+		if (idleMemoryReleases > 0) {
+			stream << " (last: RSS " << rssBeforeIdleMemoryRelease / 1024 <<
+				" KB -> " << rssAfterIdleMemoryRelease / 1024 << " KB)";
+		}
+		stream << "\n";
+		stream << "Tunnels: " << tunnels.size() << "\n";
+		stream << "Collapsed requests: " << collapsedRequests.size() << " in flight\n";
+		stream << "Client timeouts: " << clientTimeouts.size() << " scheduled\n";
+		loopTimeStats->inspect(stream);
+		if (responseCache != NULL) {
+			responseCache->inspect(stream);
+		}
+		if (staticFileCache != NULL) {
+			staticFileCache->inspect(stream);
+		}
+		if (responseDrainer != NULL) {
+			responseDrainer->inspect(stream);
+		}
+		stream << "Accept batch size: " << acceptBatchSize <<
+			" (backlog exceeded it " << acceptBatchesFilled << " times" <<
+			(acceptEpoll != -1 ? ", exclusive wakeups" : "") << ")\n";
+		unsigned int queued, backlog;
+		if (getUnixServerQueueInfo(requestSocket, queued, backlog)) {
+			stream << "Accept queue: " << queued << " of " << backlog << " connections waiting\n";
+		}
+		stream << clientList.size() << " clients:\n";
+		vector<Client *>::const_iterator it, end = clientList.end();
+		for (it = clientList.begin(); it != end; it++) {
+			const Client *client = *it;
 			stream << "  Client " << client->fd << ":\n";
 			client->inspect(stream);
 		}
@@ -2476,6 +6161,15 @@ public:
 		libev->run(boost::bind(&RequestHandler::doResetInactivityTime, this));
 	}
 
+	/**
+	 * Stops accepting new clients, e.g. because another HelperAgent has taken
+	 * over the request socket. Clients that are already connected are still
+	 * served.
+	 */
+	void stopAccepting() {
+		libev->run(boost::bind(&RequestHandler::doStopAccepting, this));
+	}
+
 	unsigned long long inactivityTime() const {
 		unsigned long long result;
 		libev->run(boost::bind(&RequestHandler::getInactivityTime, this, &result));
@@ -2483,6 +6177,8 @@ public:
 	}
 };
 
+typedef boost::shared_ptr<RequestHandler> RequestHandlerPtr;
+
 
 } // namespace Passenger
 
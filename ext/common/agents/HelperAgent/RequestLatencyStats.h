@@ -0,0 +1,241 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_REQUEST_LATENCY_STATS_H_
+#define _PASSENGER_REQUEST_LATENCY_STATS_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <time.h>
+#include <StaticString.h>
+#include <Utils/StringMap.h>
+#include <Utils/SystemTime.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+
+/**
+ * Returns a monotonic timestamp in microseconds, for measuring durations.
+ */
+inline unsigned long long
+monotonicTimeUsec() {
+	#if defined(CLOCK_MONOTONIC)
+		struct timespec ts;
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+			return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+	#endif
+	return SystemTime::getUsec();
+}
+
+
+/**
+ * A histogram of durations with logarithmic buckets: bucket 0 counts durations
+ * below 2 microseconds and bucket i > 0 counts durations in [2^i, 2^(i+1))
+ * microseconds. Recording is lock-free, so multiple event loops may record
+ * into the same histogram while another thread reads it.
+ */
+class LatencyHistogram {
+public:
+	static const unsigned int BUCKETS = 32;
+
+private:
+	boost::atomic<unsigned int> buckets[BUCKETS];
+	boost::atomic<unsigned int> count;
+
+	static unsigned int bucketFor(unsigned long long usec) {
+		unsigned int i = 0;
+		while (usec > 1 && i < BUCKETS - 1) {
+			usec >>= 1;
+			i++;
+		}
+		return i;
+	}
+
+public:
+	LatencyHistogram() {
+		for (unsigned int i = 0; i < BUCKETS; i++) {
+			buckets[i].store(0, boost::memory_order_relaxed);
+		}
+		count.store(0, boost::memory_order_relaxed);
+	}
+
+	void record(unsigned long long usec) {
+		buckets[bucketFor(usec)].fetch_add(1, boost::memory_order_relaxed);
+		count.fetch_add(1, boost::memory_order_relaxed);
+	}
+
+	unsigned int getCount() const {
+		return count.load(boost::memory_order_relaxed);
+	}
+
+	/**
+	 * Returns an upper bound, in microseconds, for the given percentile
+	 * (between 0 and 100) of the recorded durations. Returns 0 if nothing
+	 * has been recorded yet.
+	 */
+	unsigned long long percentile(double p) const {
+		unsigned int counts[BUCKETS];
+		unsigned long long total = 0;
+		unsigned long long seen = 0;
+		unsigned int i;
+
+		for (i = 0; i < BUCKETS; i++) {
+			counts[i] = buckets[i].load(boost::memory_order_relaxed);
+			total += counts[i];
+		}
+		if (total == 0) {
+			return 0;
+		}
+
+		unsigned long long threshold = (unsigned long long) (total * p / 100.0 + 0.5);
+		if (threshold == 0) {
+			threshold = 1;
+		}
+		for (i = 0; i < BUCKETS; i++) {
+			seen += counts[i];
+			if (seen >= threshold) {
+				break;
+			}
+		}
+		return 2ull << std::min(i, BUCKETS - 1);
+	}
+};
+
+
+/**
+ * Per-application group latency histograms for each phase of a request, as
+ * recorded by RequestHandler. Shared by all RequestHandlers in the HelperAgent.
+ * The registry is protected by a lock but the histograms themselves are not:
+ * RequestHandlers are expected to cache the GroupLatencies objects they use.
+ */
+class RequestLatencyStats {
+public:
+	enum Phase {
+		/** Accepting the connection until the request header has been read. */
+		READING_HEADER,
+		/** Until the entire request body has been buffered, if buffering is on. */
+		BUFFERING_BODY,
+		/** Until the pool has handed out a session: pool queueing and spawning. */
+		CHECKING_OUT_SESSION,
+		/** Until the request header has been sent to the application. */
+		SENDING_HEADER,
+		/** Until the application sent the first byte of its response. */
+		WAITING_FOR_APP,
+		/** Until the response has been sent to the client. */
+		SENDING_RESPONSE,
+		/** The whole request. */
+		TOTAL,
+
+		PHASE_COUNT
+	};
+
+	struct GroupLatencies {
+		LatencyHistogram phases[PHASE_COUNT];
+	};
+
+	typedef boost::shared_ptr<GroupLatencies> GroupLatenciesPtr;
+
+private:
+	mutable boost::mutex syncher;
+	StringMap<GroupLatenciesPtr> groups;
+
+	static void formatDuration(stringstream &stream, unsigned long long usec) {
+		stream << std::setw(10);
+		if (usec < 1000) {
+			stream << (toString(usec) + "us");
+		} else if (usec < 1000000) {
+			stream << (toString(usec / 1000) + "ms");
+		} else {
+			stream << (toString(usec / 1000000) + "s");
+		}
+	}
+
+public:
+	static const char *phaseName(Phase phase) {
+		static const char *names[] = {
+			"reading header",
+			"buffering body",
+			"checking out session",
+			"sending header",
+			"waiting for app",
+			"sending response",
+			"total"
+		};
+		return names[phase];
+	}
+
+	GroupLatenciesPtr get(const StaticString &groupName) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		GroupLatenciesPtr result = groups.get(groupName);
+		if (result == NULL) {
+			result = boost::make_shared<GroupLatencies>();
+			groups.set(groupName, result);
+		}
+		return result;
+	}
+
+	string inspect() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		stringstream stream;
+		StringMap<GroupLatenciesPtr>::const_iterator it, end = groups.end();
+
+		for (it = groups.begin(); it != end; it++) {
+			const GroupLatenciesPtr &group = it->second;
+			stream << it->first << ":\n";
+			stream << "  " << std::left << std::setw(22) << "Phase" << std::right <<
+				std::setw(10) << "Count" <<
+				std::setw(10) << "p50" <<
+				std::setw(10) << "p99" << "\n";
+			for (unsigned int i = 0; i < PHASE_COUNT; i++) {
+				const LatencyHistogram &histogram = group->phases[i];
+				if (histogram.getCount() == 0) {
+					continue;
+				}
+				stream << "  " << std::left << std::setw(22) << phaseName((Phase) i) <<
+					std::right << std::setw(10) << histogram.getCount();
+				formatDuration(stream, histogram.percentile(50));
+				formatDuration(stream, histogram.percentile(99));
+				stream << "\n";
+			}
+		}
+		return stream.str();
+	}
+};
+
+typedef boost::shared_ptr<RequestLatencyStats> RequestLatencyStatsPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_REQUEST_LATENCY_STATS_H_ */
@@ -0,0 +1,302 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_RESPONSE_CACHE_H_
+#define _PASSENGER_RESPONSE_CACHE_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <string>
+#include <vector>
+#include <list>
+#include <StaticString.h>
+#include <Utils/StringMap.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+
+
+/**
+ * An in-memory cache of complete application responses, used by
+ * RequestHandler to answer requests for publicly cacheable resources without
+ * checking out a session.
+ *
+ * Responses are looked up in two steps. The primary key identifies the
+ * resource (e.g. application group, method, host and URI). For each primary
+ * key the cache remembers which request headers the response varies on, as
+ * announced by the application's Vary header. The full key is the primary key
+ * followed by the values of those request headers; see buildKey().
+ *
+ * The total size of the stored keys, headers and bodies is bounded by a
+ * memory budget. The least recently used entries are evicted when the budget
+ * is exceeded. Stale entries are removed when they're looked up or evicted.
+ * All times are monotonic timestamps in microseconds.
+ *
+ * Not thread-safe: every RequestHandler owns its own cache.
+ */
+class ResponseCache {
+public:
+	struct Entry {
+		string key;
+		string primaryKey;
+		/** The response header, without the terminating empty line. */
+		string header;
+		string body;
+		unsigned long long storedAt;
+		unsigned long long expiresAt;
+
+		size_t size() const {
+			return sizeof(Entry) + key.size() + primaryKey.size() +
+				header.size() + body.size();
+		}
+	};
+
+	typedef boost::shared_ptr<Entry> EntryPtr;
+
+private:
+	typedef list<EntryPtr> EntryList;
+
+	struct VaryInfo {
+		/** Request header names in SCGI form, e.g. "HTTP_ACCEPT_ENCODING". */
+		vector<string> headers;
+		unsigned int entries;
+
+		VaryInfo() {
+			entries = 0;
+		}
+	};
+
+	/** Most recently used entries first. */
+	EntryList lru;
+	StringMap<EntryList::iterator> index;
+	StringMap<VaryInfo> varyInfos;
+	size_t maxSize;
+	size_t maxEntrySize;
+	size_t totalSize;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+
+	void removeEntry(EntryList::iterator it) {
+		EntryPtr entry = *it;
+		VaryInfo *info = lookupVaryInfo(entry->primaryKey);
+		if (info != NULL) {
+			info->entries--;
+			if (info->entries == 0) {
+				varyInfos.remove(entry->primaryKey);
+			}
+		}
+		totalSize -= entry->size();
+		index.remove(entry->key);
+		lru.erase(it);
+	}
+
+	VaryInfo *lookupVaryInfo(const StaticString &primaryKey) {
+		StringMap<VaryInfo>::iterator it = varyInfos.find(primaryKey);
+		if (it == varyInfos.end()) {
+			return NULL;
+		} else {
+			return &it->second;
+		}
+	}
+
+public:
+	/**
+	 * @param maxSize The memory budget in bytes.
+	 * @param maxEntrySize Responses larger than this are not cached. Defaults
+	 *                     to 1/16th of the budget, so that a few large
+	 *                     responses can't push out everything else.
+	 */
+	ResponseCache(size_t maxSize, size_t maxEntrySize = 0) {
+		this->maxSize = maxSize;
+		if (maxEntrySize == 0) {
+			this->maxEntrySize = maxSize / 16;
+		} else {
+			this->maxEntrySize = maxEntrySize;
+		}
+		totalSize = 0;
+		hits = 0;
+		misses = 0;
+		evictions = 0;
+	}
+
+	size_t getMaxEntrySize() const {
+		return maxEntrySize;
+	}
+
+	/**
+	 * Returns the names of the request headers that responses for the given
+	 * primary key vary on, or NULL if nothing is cached for it. The latter
+	 * counts as a miss.
+	 */
+	const vector<string> *getVaryHeaders(const StaticString &primaryKey) {
+		VaryInfo *info = lookupVaryInfo(primaryKey);
+		if (info == NULL) {
+			misses++;
+			return NULL;
+		} else {
+			return &info->headers;
+		}
+	}
+
+	/**
+	 * Builds a full key from a primary key and the values of the request
+	 * headers that the response varies on.
+	 */
+	static void buildKey(string &key, const StaticString &primaryKey,
+		const vector<StaticString> &varyValues)
+	{
+		key.assign(primaryKey.data(), primaryKey.size());
+		vector<StaticString>::const_iterator it, end = varyValues.end();
+		for (it = varyValues.begin(); it != end; it++) {
+			key.append(1, '\0');
+			key.append(it->data(), it->size());
+		}
+	}
+
+	/**
+	 * Returns the fresh entry stored under the given full key, or NULL.
+	 * A stale entry is removed.
+	 */
+	EntryPtr lookup(const StaticString &key, unsigned long long now) {
+		StringMap<EntryList::iterator>::iterator it = index.find(key);
+		if (it == index.end()) {
+			misses++;
+			return EntryPtr();
+		}
+
+		EntryList::iterator lit = it->second;
+		EntryPtr entry = *lit;
+		if (entry->expiresAt <= now) {
+			removeEntry(lit);
+			misses++;
+			return EntryPtr();
+		} else {
+			lru.splice(lru.begin(), lru, lit);
+			hits++;
+			return entry;
+		}
+	}
+
+	/**
+	 * Stores a response, replacing any entry under the same full key, and
+	 * evicts least recently used entries until the cache fits its budget.
+	 * If the Vary headers for the primary key changed, then the entries that
+	 * were stored with the old Vary headers are removed.
+	 *
+	 * @return Whether the response was stored. It isn't if it's too large.
+	 */
+	bool store(const StaticString &primaryKey, const vector<string> &varyHeaders,
+		const StaticString &key, const StaticString &header, const StaticString &body,
+		unsigned long long now, unsigned long long expiresAt)
+	{
+		EntryPtr entry = boost::make_shared<Entry>();
+		entry->key = key;
+		entry->primaryKey = primaryKey;
+		entry->header = header;
+		entry->body = body;
+		entry->storedAt = now;
+		entry->expiresAt = expiresAt;
+		if (entry->size() > maxEntrySize || entry->size() > maxSize) {
+			return false;
+		}
+
+		StringMap<EntryList::iterator>::iterator it = index.find(key);
+		if (it != index.end()) {
+			removeEntry(it->second);
+		}
+
+		VaryInfo *info = lookupVaryInfo(primaryKey);
+		if (info != NULL && info->headers != varyHeaders) {
+			EntryList::iterator lit = lru.begin();
+			while (lit != lru.end()) {
+				EntryList::iterator next = lit;
+				next++;
+				if ((*lit)->primaryKey == primaryKey) {
+					removeEntry(lit);
+				}
+				lit = next;
+			}
+			info = NULL;
+		}
+		if (info == NULL) {
+			VaryInfo newInfo;
+			newInfo.headers = varyHeaders;
+			varyInfos.set(primaryKey, newInfo);
+			info = lookupVaryInfo(primaryKey);
+		}
+		info->entries++;
+
+		lru.push_front(entry);
+		index.set(entry->key, lru.begin());
+		totalSize += entry->size();
+		while (totalSize > maxSize) {
+			EntryList::iterator last = lru.end();
+			last--;
+			removeEntry(last);
+			evictions++;
+		}
+		return true;
+	}
+
+	/** Removes the entry stored under the given full key, if any. */
+	void remove(const StaticString &key) {
+		StringMap<EntryList::iterator>::iterator it = index.find(key);
+		if (it != index.end()) {
+			removeEntry(it->second);
+		}
+	}
+
+	void clear() {
+		lru.clear();
+		index.clear();
+		varyInfos.clear();
+		totalSize = 0;
+	}
+
+	unsigned int count() const {
+		return lru.size();
+	}
+
+	size_t size() const {
+		return totalSize;
+	}
+
+	template<typename Stream>
+	void inspect(Stream &stream) const {
+		stream << "Response cache: " << lru.size() << " entries, " <<
+			totalSize << " of " << maxSize << " bytes, " <<
+			hits << " hits, " << misses << " misses, " <<
+			evictions << " evictions\n";
+	}
+};
+
+typedef boost::shared_ptr<ResponseCache> ResponseCachePtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_RESPONSE_CACHE_H_ */
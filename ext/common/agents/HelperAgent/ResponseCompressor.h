@@ -0,0 +1,221 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_RESPONSE_COMPRESSOR_H_
+#define _PASSENGER_RESPONSE_COMPRESSOR_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <oxt/backtrace.hpp>
+#include <oxt/thread.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <zlib.h>
+#include <StaticString.h>
+#include <Logging.h>
+#include <Utils/BlockingQueue.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+
+/**
+ * Compresses a single response body with gzip or deflate, in steps. Every
+ * step compresses everything in `input` and appends the result to `output`,
+ * flushed so that the client can decompress the data received so far, which
+ * keeps streaming responses streaming.
+ *
+ * A step may run in any thread, but the caller must make sure that only one
+ * thread touches the object at a time. RequestHandler runs steps in a
+ * CompressionPool while the event loop collects the input for the next step.
+ */
+class ResponseCompressor: public boost::noncopyable {
+public:
+	enum Encoding {
+		GZIP,
+		DEFLATE
+	};
+
+private:
+	z_stream stream;
+	bool initialized;
+	bool finished;
+
+public:
+	/** Data to compress in the next step. */
+	string input;
+	/** Compressed data produced so far. */
+	string output;
+	/** Whether the next step is the last one. */
+	bool finishing;
+	/** Set if a step failed. */
+	string errorMessage;
+
+	ResponseCompressor(Encoding encoding, int level = Z_DEFAULT_COMPRESSION) {
+		memset(&stream, 0, sizeof(stream));
+		stream.zalloc = Z_NULL;
+		stream.zfree  = Z_NULL;
+		stream.opaque = Z_NULL;
+		// 15 window bits plus 16 selects the gzip wrapper.
+		int windowBits = (encoding == GZIP) ? 15 + 16 : 15;
+		initialized = deflateInit2(&stream, level, Z_DEFLATED, windowBits,
+			8, Z_DEFAULT_STRATEGY) == Z_OK;
+		if (!initialized) {
+			errorMessage = "cannot initialize zlib";
+		}
+		finished = false;
+		finishing = false;
+	}
+
+	~ResponseCompressor() {
+		if (initialized) {
+			deflateEnd(&stream);
+		}
+	}
+
+	static const char *encodingName(Encoding encoding) {
+		if (encoding == GZIP) {
+			return "gzip";
+		} else {
+			return "deflate";
+		}
+	}
+
+	/** Whether the last step has been run. */
+	bool isFinished() const {
+		return finished;
+	}
+
+	/** Compresses `input` into `output`. Check `errorMessage` afterwards. */
+	void step() {
+		char buf[1024 * 16];
+		int flush = finishing ? Z_FINISH : Z_SYNC_FLUSH;
+		int ret;
+
+		if (!initialized || finished) {
+			input.clear();
+			return;
+		}
+
+		stream.next_in  = (Bytef *) input.data();
+		stream.avail_in = input.size();
+		do {
+			stream.next_out  = (Bytef *) buf;
+			stream.avail_out = sizeof(buf);
+			ret = deflate(&stream, flush);
+			if (ret == Z_STREAM_ERROR) {
+				errorMessage = "zlib stream error";
+				break;
+			}
+			output.append(buf, sizeof(buf) - stream.avail_out);
+		} while (stream.avail_out == 0);
+		input.clear();
+		if (finishing) {
+			finished = true;
+		}
+	}
+};
+
+typedef boost::shared_ptr<ResponseCompressor> ResponseCompressorPtr;
+
+
+/**
+ * A small pool of threads that run response compression steps, so that the
+ * RequestHandler event loops never block on compression. Jobs are plain
+ * callbacks, run in FIFO order. Thread-safe.
+ */
+class CompressionPool: public boost::noncopyable {
+public:
+	typedef boost::function<void ()> Job;
+
+private:
+	/** An empty job tells a thread to exit. */
+	BlockingQueue<Job> queue;
+	vector<oxt::thread *> threads;
+
+	void threadMain() {
+		TRACE_POINT();
+		while (true) {
+			UPDATE_TRACE_POINT();
+			Job job = queue.get();
+			if (job.empty()) {
+				break;
+			}
+			try {
+				job();
+			} catch (const std::exception &e) {
+				P_WARN("Error in response compression job: " << e.what());
+			}
+		}
+	}
+
+public:
+	CompressionPool(unsigned int threadCount) {
+		for (unsigned int i = 0; i < threadCount; i++) {
+			threads.push_back(new oxt::thread(
+				boost::bind(&CompressionPool::threadMain, this),
+				"Response compressor " + toString(i + 1),
+				1024 * 128
+			));
+		}
+	}
+
+	~CompressionPool() {
+		unsigned int i;
+		for (i = 0; i < threads.size(); i++) {
+			queue.add(Job());
+		}
+		for (i = 0; i < threads.size(); i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+	}
+
+	void submit(const Job &job) {
+		queue.add(job);
+	}
+
+	unsigned int getThreadCount() const {
+		return threads.size();
+	}
+
+	/** The number of jobs waiting for a thread. */
+	unsigned int backlog() const {
+		return queue.size();
+	}
+};
+
+typedef boost::shared_ptr<CompressionPool> CompressionPoolPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_RESPONSE_COMPRESSOR_H_ */
@@ -0,0 +1,302 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_RESPONSE_DRAINER_H_
+#define _PASSENGER_RESPONSE_DRAINER_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <ev++.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <map>
+#include <string>
+#include <ostream>
+#include <BackgroundEventLoop.h>
+#include <SafeLibev.h>
+#include <FileDescriptor.h>
+#include <Logging.h>
+#include <Utils/MetricsRegistry.h>
+#include <agents/HelperAgent/RequestLatencyStats.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+
+/**
+ * Writes the remainder of fully generated responses to slow clients, in its
+ * own event loop thread. RequestHandler hands a client over once the
+ * application is done and everything that is left is buffered, so that the
+ * request loop doesn't have to keep on servicing a client that reads slowly;
+ * the client is then disconnected from the RequestHandler's point of view.
+ *
+ * A handed over response consists of some in-memory data followed by a
+ * range of a buffer file, as detached from a FileBackedPipe. Responses that
+ * make no progress for `timeout` seconds are dropped. Thread-safe.
+ */
+class ResponseDrainer: public boost::noncopyable {
+private:
+	static const size_t FILE_READ_SIZE = 1024 * 16;
+
+	struct Job {
+		ResponseDrainer *drainer;
+		FileDescriptor fd;
+		string memoryData;
+		size_t memoryOffset;
+		FileDescriptor file;
+		off_t fileOffset;
+		off_t fileEnd;
+		ev::io watcher;
+		unsigned long long lastActivity;
+
+		void onWritable(ev::io &io, int revents) {
+			drainer->onWritable(this);
+		}
+	};
+
+	typedef boost::shared_ptr<Job> JobPtr;
+
+	// Must be declared before 'jobs' so that it's stopped before the jobs
+	// are destroyed.
+	BackgroundEventLoop loop;
+	ev::timer timeoutTimer;
+	/** Only accessed from the event loop thread. */
+	map<int, JobPtr> jobs;
+	unsigned int timeout;
+
+	mutable boost::mutex syncher;
+	unsigned int activeJobs;
+	unsigned long long jobsHandedOff;
+	unsigned long long jobsTimedOut;
+	unsigned long long bytesDrained;
+	MetricsRegistryPtr metricsRegistry;
+	Metric *bytesSentMetric;
+
+	void addJob(const JobPtr &job) {
+		job->drainer = this;
+		job->lastActivity = monotonicTimeUsec();
+		job->watcher.set<Job, &Job::onWritable>(job.get());
+		job->watcher.set(loop.loop);
+		job->watcher.set(job->fd, ev::WRITE);
+		job->watcher.start();
+		jobs[job->fd] = job;
+		if (!timeoutTimer.is_active()) {
+			timeoutTimer.start();
+		}
+	}
+
+	void removeJob(Job *job) {
+		job->watcher.stop();
+		// Destroys the job and thereby closes the client connection.
+		jobs.erase(job->fd);
+		if (jobs.empty()) {
+			timeoutTimer.stop();
+		}
+		boost::lock_guard<boost::mutex> l(syncher);
+		activeJobs--;
+	}
+
+	/**
+	 * Writes as much as possible. Returns the number of bytes written, or
+	 * -1 with errno set.
+	 */
+	ssize_t writeSome(Job *job, bool &done) {
+		char buf[FILE_READ_SIZE];
+		size_t total = 0;
+		ssize_t ret;
+
+		done = false;
+		while (job->memoryOffset < job->memoryData.size()) {
+			ret = syscalls::write(job->fd,
+				job->memoryData.data() + job->memoryOffset,
+				job->memoryData.size() - job->memoryOffset);
+			if (ret == -1) {
+				return (errno == EAGAIN && total > 0) ? (ssize_t) total : -1;
+			}
+			job->memoryOffset += ret;
+			total += ret;
+		}
+		if (!job->memoryData.empty()) {
+			string().swap(job->memoryData);
+			job->memoryOffset = 0;
+		}
+
+		while (job->fileOffset < job->fileEnd) {
+			size_t size = (size_t) std::min<off_t>(sizeof(buf),
+				job->fileEnd - job->fileOffset);
+			ret = ::pread(job->file, buf, size, job->fileOffset);
+			if (ret <= 0) {
+				if (ret == 0) {
+					errno = EIO;
+				}
+				return -1;
+			}
+			ret = syscalls::write(job->fd, buf, ret);
+			if (ret == -1) {
+				return (errno == EAGAIN && total > 0) ? (ssize_t) total : -1;
+			}
+			job->fileOffset += ret;
+			total += ret;
+		}
+
+		done = true;
+		return total;
+	}
+
+	void onWritable(Job *job) {
+		bool done;
+		ssize_t ret = writeSome(job, done);
+		if (ret == -1) {
+			int e = errno;
+			if (e == EAGAIN) {
+				return;
+			}
+			if (e != EPIPE && e != ECONNRESET) {
+				P_DEBUG("Cannot drain response to client fd " << job->fd << ": " <<
+					strerror(e) << " (errno=" << e << ")");
+			}
+			removeJob(job);
+			return;
+		}
+
+		job->lastActivity = monotonicTimeUsec();
+		{
+			boost::lock_guard<boost::mutex> l(syncher);
+			bytesDrained += ret;
+		}
+		if (bytesSentMetric != NULL) {
+			bytesSentMetric->add(ret);
+		}
+		if (done) {
+			removeJob(job);
+		}
+	}
+
+	void onTimeout(ev::timer &timer, int revents) {
+		unsigned long long deadline = monotonicTimeUsec()
+			- (unsigned long long) timeout * 1000000;
+		map<int, JobPtr>::iterator it = jobs.begin();
+		while (it != jobs.end()) {
+			Job *job = (it++)->second.get();
+			if (job->lastActivity < deadline) {
+				P_DEBUG("Client fd " << job->fd << " stopped reading its response; dropping it");
+				{
+					boost::lock_guard<boost::mutex> l(syncher);
+					jobsTimedOut++;
+				}
+				removeJob(job);
+			}
+		}
+	}
+
+public:
+	/**
+	 * If `metrics` is given, then the drained bytes are also counted in its
+	 * 'passenger_client_bytes_sent_total' counter.
+	 */
+	ResponseDrainer(unsigned int timeout = 60,
+		const MetricsRegistryPtr &metrics = MetricsRegistryPtr())
+		: timeout(timeout),
+		  activeJobs(0),
+		  jobsHandedOff(0),
+		  jobsTimedOut(0),
+		  bytesDrained(0),
+		  metricsRegistry(metrics),
+		  bytesSentMetric(NULL)
+	{
+		if (metrics != NULL) {
+			bytesSentMetric = metrics->add(this, "passenger_client_bytes_sent_total",
+				Metric::COUNTER, "Bytes sent to clients.");
+		}
+		timeoutTimer.set<ResponseDrainer, &ResponseDrainer::onTimeout>(this);
+		timeoutTimer.set(loop.loop);
+		timeoutTimer.set(1, 1);
+		loop.start("Slow client response drainer", 1024 * 128);
+	}
+
+	~ResponseDrainer() {
+		loop.stop();
+		if (metricsRegistry != NULL) {
+			metricsRegistry->removeAll(this);
+		}
+		timeoutTimer.stop();
+		map<int, JobPtr>::iterator it, end = jobs.end();
+		for (it = jobs.begin(); it != end; it++) {
+			it->second->watcher.stop();
+		}
+	}
+
+	/**
+	 * Takes over writing the rest of a response to the given non-blocking
+	 * client socket: first `memoryData`, then [fileOffset, fileEnd) of
+	 * `file`, if any. The connection is closed afterwards. The contents of
+	 * `memoryData` are taken over, leaving it empty.
+	 */
+	void drain(const FileDescriptor &fd, string &memoryData,
+		const FileDescriptor &file, off_t fileOffset, off_t fileEnd)
+	{
+		JobPtr job = boost::make_shared<Job>();
+		job->fd = fd;
+		job->memoryData.swap(memoryData);
+		job->memoryOffset = 0;
+		job->file = file;
+		job->fileOffset = fileOffset;
+		job->fileEnd = fileEnd;
+		{
+			boost::lock_guard<boost::mutex> l(syncher);
+			activeJobs++;
+			jobsHandedOff++;
+		}
+		loop.safe->runLater(boost::bind(&ResponseDrainer::addJob, this, job));
+	}
+
+	/** The number of responses that are still being drained. */
+	unsigned int getActiveCount() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return activeJobs;
+	}
+
+	void inspect(ostream &stream) const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		stream << "Slow client drainer: " << activeJobs << " active, " <<
+			jobsHandedOff << " handed off, " <<
+			jobsTimedOut << " timed out, " <<
+			bytesDrained << " bytes drained\n";
+	}
+};
+
+typedef boost::shared_ptr<ResponseDrainer> ResponseDrainerPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_RESPONSE_DRAINER_H_ */
@@ -26,14 +26,16 @@
 #define _PASSENGER_SCGI_REQUEST_PARSER_H_
 
 #include <string>
+#include <utility>
 #include <algorithm>
 #include <cstdlib>
 #include <cstddef>
+#include <cstring>
 
 #include <oxt/macros.hpp>
 
 #include <StaticString.h>
-#include <Utils/HashMap.h>
+#include <Utils/SmallVector.h>
 
 namespace Passenger {
 
@@ -101,12 +103,90 @@ using namespace std;
  * headers, will be buffered into an internal string. getHeaderData() and the
  * internal header map will then refer to this internal string. In this case
  * you don't need to ensure that the original data is kept around.
+ *
+ * <h2>Header storage</h2>
+ * Headers are stored in a flat list, in the order in which they appear. The
+ * headers that Phusion Passenger itself looks at (see KnownHeader) are
+ * assigned a fixed slot while parsing, through a precomputed perfect hash
+ * table, so looking them up is a hash of a few characters plus an array
+ * lookup, or just an array lookup if you pass the KnownHeader constant.
+ * Other headers are looked up with a linear scan. If a header occurs more
+ * than once then lookups return the last value.
  */
 class ScgiRequestParser {
 public:
-	typedef HashMap< StaticString, StaticString, StaticString::Hash, equal_to<StaticString> > HeaderMap;
-	typedef HeaderMap::const_iterator const_iterator;
-	typedef HeaderMap::iterator iterator;
+	typedef pair<StaticString, StaticString> Header;
+	typedef SmallVector<Header, 48> HeaderList;
+	typedef HeaderList::const_iterator const_iterator;
+	typedef HeaderList::iterator iterator;
+
+	/**
+	 * Headers that get their own slot. Keep in sync with the tables in
+	 * lookupKnownHeader().
+	 */
+	enum KnownHeader {
+		KH_CONTENT_LENGTH,
+		KH_CONTENT_TYPE,
+		KH_DOCUMENT_ROOT,
+		KH_HTTP_ACCEPT_ENCODING,
+		KH_HTTP_AUTHORIZATION,
+		KH_HTTP_CACHE_CONTROL,
+		KH_HTTP_CONTENT_LENGTH,
+		KH_HTTP_CONTENT_TYPE,
+		KH_HTTP_COOKIE,
+		KH_HTTP_HOST,
+		KH_HTTP_PRAGMA,
+		KH_HTTP_TRANSFER_ENCODING,
+		KH_HTTP_UPGRADE,
+		KH_PASSENGER_APP_ENV,
+		KH_PASSENGER_APP_GROUP_NAME,
+		KH_PASSENGER_APP_ROOT,
+		KH_PASSENGER_APP_TYPE,
+		KH_PASSENGER_BUFFERING,
+		KH_PASSENGER_CONNECT_PASSWORD,
+		KH_PASSENGER_DEBUGGER,
+		KH_PASSENGER_FRIENDLY_ERROR_PAGES,
+		KH_PASSENGER_FRONTEND_KEEPALIVE,
+		KH_PASSENGER_GROUP,
+		KH_PASSENGER_KEEPALIVE,
+		KH_PASSENGER_LOAD_SHELL_ENVVARS,
+		KH_PASSENGER_MAX_PRELOADER_IDLE_TIME,
+		KH_PASSENGER_MAX_PROCESSES,
+		KH_PASSENGER_MAX_REQUESTS,
+		KH_PASSENGER_MAX_REQUEST_QUEUE_SIZE,
+		KH_PASSENGER_MIN_PROCESSES,
+		KH_PASSENGER_NODEJS,
+		KH_PASSENGER_PYTHON,
+		KH_PASSENGER_RAISE_INTERNAL_ERROR,
+		KH_PASSENGER_REQUEST_HANDLER_BENCHMARK_POINT,
+		KH_PASSENGER_REQUEST_QUEUE_OVERFLOW_STATUS_CODE,
+		KH_PASSENGER_RESTART_DIR,
+		KH_PASSENGER_RUBY,
+		KH_PASSENGER_SHOW_VERSION_IN_HEADER,
+		KH_PASSENGER_SPAWN_METHOD,
+		KH_PASSENGER_STARTUP_FILE,
+		KH_PASSENGER_START_COMMAND,
+		KH_PASSENGER_START_TIMEOUT,
+		KH_PASSENGER_STATUS_LINE,
+		KH_PASSENGER_STAT_THROTTLE_RATE,
+		KH_PASSENGER_STICKY_SESSION,
+		KH_PASSENGER_STICKY_SESSION_COOKIE_NAME,
+		KH_PASSENGER_TXN_ID,
+		KH_PASSENGER_USER,
+		KH_PATH_INFO,
+		KH_QUERY_STRING,
+		KH_REQUEST_METHOD,
+		KH_REQUEST_URI,
+		KH_SCRIPT_NAME,
+		KH_UNION_STATION_FILTERS,
+		KH_UNION_STATION_KEY,
+		KH_UNION_STATION_SAMPLE_RATE,
+		KH_UNION_STATION_SLOW_REQUEST_THRESHOLD,
+		KH_UNION_STATION_SUPPORT,
+
+		KH_COUNT,
+		KH_UNKNOWN = -1
+	};
 
 	enum State {
 		READING_LENGTH_STRING,
@@ -148,20 +228,68 @@ private:
 	
 	StaticString headerData;
 	string headerBuffer;
-	HeaderMap headers;
+	/** The buffer that rebuildData(true) builds the new header data in. It's
+	 * swapped with headerBuffer afterwards, so that both keep their memory
+	 * for the next request. */
+	string rebuildBuffer;
+	HeaderList headers;
+	/** Index into 'headers' for every KnownHeader, or -1 if it isn't present. */
+	int knownHeaderIndex[KH_COUNT];
 	char lengthStringBuffer[sizeof("4294967296")];
 	
 	static inline bool isDigit(char byte) {
 		return byte >= '0' && byte <= '9';
 	}
 	
+	void clearHeaders() {
+		headers.clear();
+		memset(knownHeaderIndex, -1, sizeof(knownHeaderIndex));
+	}
+	
+	void addHeader(const StaticString &key, const StaticString &value) {
+		int kh = lookupKnownHeader(key);
+		if (kh != KH_UNKNOWN && knownHeaderIndex[kh] != -1) {
+			headers[knownHeaderIndex[kh]].second = value;
+		} else {
+			if (kh != KH_UNKNOWN) {
+				knownHeaderIndex[kh] = headers.size();
+			}
+			headers.push_back(Header(key, value));
+		}
+	}
+	
+	const Header *findHeader(const StaticString &name) const {
+		int kh = lookupKnownHeader(name);
+		if (kh != KH_UNKNOWN) {
+			return findHeader((KnownHeader) kh);
+		} else {
+			const_iterator it = headers.end();
+			while (it != headers.begin()) {
+				it--;
+				if (it->first == name) {
+					return it;
+				}
+			}
+			return NULL;
+		}
+	}
+	
+	const Header *findHeader(KnownHeader kh) const {
+		if (knownHeaderIndex[kh] == -1) {
+			return NULL;
+		} else {
+			return &headers[knownHeaderIndex[kh]];
+		}
+	}
+	
 	/**
 	 * Parse the given header data into key-value pairs, returns whether parsing succeeded.
 	 */
-	bool parseHeaderData(const StaticString &data, HeaderMap &output) {
+	bool parseHeaderData(const StaticString &data) {
 		const char *current = data.data();
 		const char *end     = data.data() + data.size();
 		
+		clearHeaders();
 		while (current < end) {
 			const char *keyEnd = (const char *) memchr(current, '\0', end - current);
 			if (OXT_UNLIKELY(
@@ -182,7 +310,7 @@ private:
 				return false;
 			}
 			
-			output[key] = StaticString(current, valueEnd - current);
+			addHeader(key, StaticString(current, valueEnd - current));
 			current = valueEnd + 1;
 		}
 		return true;
@@ -206,10 +334,118 @@ public:
 		lengthStringBufferSize = 0;
 		headerSize = 0;
 		headerBuffer.clear();
-		headers.clear();
+		clearHeaders();
 		headerData = StaticString();
 	}
 
+	/**
+	 * Returns the KnownHeader for the given header name, or KH_UNKNOWN.
+	 * Lookup is case-sensitive.
+	 */
+	static int lookupKnownHeader(const StaticString &name) {
+		/* A perfect hash over the known header names: every name maps
+		 * to a different slot. The hash function and table were found
+		 * with a brute-force search over the multipliers.
+		 */
+		static const signed char slots[256] = {
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 32, -1, 2, -1,
+			-1, -1, -1, 34, 9, -1, 15, -1, -1, -1, -1, 16, -1, 12, 56, -1,
+			-1, 25, -1, 36, 18, 24, 31, 45, 44, -1, -1, -1, -1, -1, -1, -1,
+			-1, 11, -1, -1, -1, 23, -1, 17, -1, -1, -1, 55, -1, -1, -1, 43,
+			-1, -1, 33, -1, -1, -1, -1, -1, -1, -1, -1, -1, 38, -1, -1, -1,
+			-1, -1, -1, 29, 6, -1, 0, -1, -1, 14, -1, -1, 35, -1, -1, -1,
+			-1, -1, -1, 26, 46, -1, -1, 30, -1, -1, -1, -1, -1, -1, -1, -1,
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			-1, -1, 5, 53, -1, -1, -1, -1, -1, -1, -1, 48, -1, -1, -1, -1,
+			-1, -1, -1, -1, 57, -1, -1, -1, -1, -1, -1, -1, -1, 27, -1, -1,
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, 8, -1, -1, 13, -1, -1, -1,
+			-1, 42, -1, -1, -1, -1, -1, 52, 47, -1, -1, 28, -1, 54, -1, -1,
+			-1, 49, 40, -1, -1, 1, -1, -1, -1, 39, -1, 20, 19, -1, -1, 7,
+			4, -1, -1, -1, -1, -1, -1, -1, 22, -1, -1, -1, 37, -1, -1, -1,
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 41, 3,
+			-1, 51, -1, -1, -1, -1, -1, -1, -1, -1, -1, 10, -1, 21, 50, -1,
+		};
+		static const char * const names[KH_COUNT] = {
+			"CONTENT_LENGTH",
+			"CONTENT_TYPE",
+			"DOCUMENT_ROOT",
+			"HTTP_ACCEPT_ENCODING",
+			"HTTP_AUTHORIZATION",
+			"HTTP_CACHE_CONTROL",
+			"HTTP_CONTENT_LENGTH",
+			"HTTP_CONTENT_TYPE",
+			"HTTP_COOKIE",
+			"HTTP_HOST",
+			"HTTP_PRAGMA",
+			"HTTP_TRANSFER_ENCODING",
+			"HTTP_UPGRADE",
+			"PASSENGER_APP_ENV",
+			"PASSENGER_APP_GROUP_NAME",
+			"PASSENGER_APP_ROOT",
+			"PASSENGER_APP_TYPE",
+			"PASSENGER_BUFFERING",
+			"PASSENGER_CONNECT_PASSWORD",
+			"PASSENGER_DEBUGGER",
+			"PASSENGER_FRIENDLY_ERROR_PAGES",
+			"PASSENGER_FRONTEND_KEEPALIVE",
+			"PASSENGER_GROUP",
+			"PASSENGER_KEEPALIVE",
+			"PASSENGER_LOAD_SHELL_ENVVARS",
+			"PASSENGER_MAX_PRELOADER_IDLE_TIME",
+			"PASSENGER_MAX_PROCESSES",
+			"PASSENGER_MAX_REQUESTS",
+			"PASSENGER_MAX_REQUEST_QUEUE_SIZE",
+			"PASSENGER_MIN_PROCESSES",
+			"PASSENGER_NODEJS",
+			"PASSENGER_PYTHON",
+			"PASSENGER_RAISE_INTERNAL_ERROR",
+			"PASSENGER_REQUEST_HANDLER_BENCHMARK_POINT",
+			"PASSENGER_REQUEST_QUEUE_OVERFLOW_STATUS_CODE",
+			"PASSENGER_RESTART_DIR",
+			"PASSENGER_RUBY",
+			"PASSENGER_SHOW_VERSION_IN_HEADER",
+			"PASSENGER_SPAWN_METHOD",
+			"PASSENGER_STARTUP_FILE",
+			"PASSENGER_START_COMMAND",
+			"PASSENGER_START_TIMEOUT",
+			"PASSENGER_STATUS_LINE",
+			"PASSENGER_STAT_THROTTLE_RATE",
+			"PASSENGER_STICKY_SESSION",
+			"PASSENGER_STICKY_SESSION_COOKIE_NAME",
+			"PASSENGER_TXN_ID",
+			"PASSENGER_USER",
+			"PATH_INFO",
+			"QUERY_STRING",
+			"REQUEST_METHOD",
+			"REQUEST_URI",
+			"SCRIPT_NAME",
+			"UNION_STATION_FILTERS",
+			"UNION_STATION_KEY",
+			"UNION_STATION_SAMPLE_RATE",
+			"UNION_STATION_SLOW_REQUEST_THRESHOLD",
+			"UNION_STATION_SUPPORT",
+		};
+		
+		size_t len = name.size();
+		if (len < 2) {
+			return KH_UNKNOWN;
+		}
+		const unsigned char *str = (const unsigned char *) name.data();
+		unsigned int hash = (len * 2 + str[len - 1] * 17 + str[len - 2] * 4
+			+ str[len / 2] * 30) & 255;
+		int kh = slots[hash];
+		// strncmp() stops at the end of the known name, so it never reads
+		// past it when `name` is longer. Names never contain NUL bytes.
+		if (kh != KH_UNKNOWN
+		 && strncmp(names[kh], (const char *) str, len) == 0
+		 && names[kh][len] == '\0')
+		{
+			return kh;
+		} else {
+			return KH_UNKNOWN;
+		}
+	}
+
 	/**
 	 * Feed SCGI request data to the parser.
 	 *
@@ -286,7 +522,7 @@ public:
 			
 			case EXPECTING_COMMA:
 				if (data[consumed] == ',') {
-					if (parseHeaderData(headerData, headers)) {
+					if (parseHeaderData(headerData)) {
 						state = DONE;
 					} else {
 						state = ERROR;
@@ -327,8 +563,13 @@ public:
 		return headerData;
 	}
 
+	/**
+	 * Returns an iterator to the header with the given name, or end()
+	 * if there is no such header.
+	 */
 	const_iterator getHeaderIterator(const StaticString &name) const {
-		return headers.find(name);
+		const Header *header = findHeader(name);
+		return (header == NULL) ? headers.end() : header;
 	}
 	
 	/**
@@ -343,11 +584,20 @@ public:
 	 * @pre getState() == DONE
 	 */
 	StaticString getHeader(const StaticString &name) const {
-		HeaderMap::const_iterator it(headers.find(name));
-		if (it == headers.end()) {
+		const Header *header = findHeader(name);
+		if (header == NULL) {
+			return "";
+		} else {
+			return header->second;
+		}
+	}
+	
+	StaticString getHeader(KnownHeader name) const {
+		const Header *header = findHeader(name);
+		if (header == NULL) {
 			return "";
 		} else {
-			return it->second;
+			return header->second;
 		}
 	}
 	
@@ -358,11 +608,42 @@ public:
 	 * @pre getState() == DONE
 	 */
 	bool hasHeader(const StaticString &name) const {
-		return headers.find(name) != headers.end();
+		return findHeader(name) != NULL;
 	}
-
-	HeaderMap &getMap() {
-		return headers;
+	
+	bool hasHeader(KnownHeader name) const {
+		return findHeader(name) != NULL;
+	}
+	
+	/**
+	 * Sets the value of the given header, adding it if it doesn't exist.
+	 * The key and value must stay valid until the next rebuildData(true)
+	 * call, which you must call to make getHeaderData() reflect the change.
+	 */
+	void setHeader(const StaticString &name, const StaticString &value) {
+		addHeader(name, value);
+	}
+	
+	/**
+	 * Removes all headers with the given name. Returns whether there
+	 * were any. Call rebuildData(true) afterwards.
+	 */
+	bool removeHeader(const StaticString &name) {
+		HeaderList::iterator it = headers.begin();
+		bool found = false;
+		
+		while (it != headers.end()) {
+			if (it->first == name) {
+				it = headers.erase(it);
+				found = true;
+			} else {
+				it++;
+			}
+		}
+		if (found) {
+			reindexKnownHeaders();
+		}
+		return found;
 	}
 	
 	unsigned int size() const {
@@ -411,37 +692,36 @@ public:
 	 */
 	void rebuildData(bool modified) {
 		if (modified) {
-			string *newHeaderBuffer;
 			const_iterator it, end = headers.end();
 
-			if (headerData.data() == headerBuffer.data()) {
-				// headerBuffer already used; allocate new temporary storage.
-				newHeaderBuffer = new string();
-			} else {
-				// headerBuffer unused; use it directly.
-				newHeaderBuffer = &headerBuffer;
-			}
-			newHeaderBuffer->reserve(headerSize);
+			rebuildBuffer.clear();
+			rebuildBuffer.reserve(headerSize);
 			for (it = headers.begin(); it != end; it++) {
-				newHeaderBuffer->append(it->first);
-				newHeaderBuffer->append(1, '\0');
-				newHeaderBuffer->append(it->second);
-				newHeaderBuffer->append(1, '\0');
+				rebuildBuffer.append(it->first);
+				rebuildBuffer.append(1, '\0');
+				rebuildBuffer.append(it->second);
+				rebuildBuffer.append(1, '\0');
 			}
 
-			if (headerData.data() == headerBuffer.data()) {
-				headerBuffer = *newHeaderBuffer;
-				delete newHeaderBuffer;
-			}
+			headerBuffer.swap(rebuildBuffer);
 			headerData = headerBuffer;
-			headers.clear();
-			parseHeaderData(headerData, headers);
+			parseHeaderData(headerData);
 
 		} else if (headerData.data() != headerBuffer.data()) {
 			headerBuffer.assign(headerData.data(), headerData.size());
 			headerData = headerBuffer;
-			headers.clear();
-			parseHeaderData(headerData, headers);
+			parseHeaderData(headerData);
+		}
+	}
+
+private:
+	void reindexKnownHeaders() {
+		memset(knownHeaderIndex, -1, sizeof(knownHeaderIndex));
+		for (unsigned int i = 0; i < headers.size(); i++) {
+			int kh = lookupKnownHeader(headers[i].first);
+			if (kh != KH_UNKNOWN) {
+				knownHeaderIndex[kh] = i;
+			}
 		}
 	}
 };
@@ -0,0 +1,249 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_STATIC_FILE_CACHE_H_
+#define _PASSENGER_STATIC_FILE_CACHE_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <oxt/system_calls.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <list>
+#include <StaticString.h>
+#include <FileDescriptor.h>
+#include <Utils/StringMap.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+
+
+/**
+ * Caches open file descriptors and stat() information of the files that
+ * RequestHandler serves straight from applications' public directories, so
+ * that a request for an asset costs neither an open() nor a stat() most of
+ * the time. Files that don't exist are remembered too, because every request
+ * that ends up at the application first checks whether it maps to a file.
+ *
+ * An entry is trusted for `ttl` microseconds, after which the file is opened
+ * again, so changes to the public directory are picked up after at most that
+ * long. The number of entries, and thus the number of file descriptors kept
+ * open, is bounded; the least recently used entries are evicted first. Since
+ * files are sent with sendfile() or pread() at an explicit offset, one file
+ * descriptor can be shared by any number of clients.
+ *
+ * Not thread-safe: every RequestHandler owns its own cache.
+ */
+class StaticFileCache {
+public:
+	struct Entry {
+		string path;
+		/** -1 if the path doesn't refer to a regular file that we can read. */
+		FileDescriptor fd;
+		struct stat info;
+		/** Validators for conditional requests, derived from the file's
+		 * modification time and size. Empty if there's no file. */
+		string etag;
+		string lastModified;
+		unsigned long long openedAt;
+
+		bool exists() const {
+			return fd != -1;
+		}
+	};
+
+	typedef boost::shared_ptr<Entry> EntryPtr;
+
+private:
+	typedef list<EntryPtr> EntryList;
+
+	/** Most recently used entries first. */
+	EntryList lru;
+	StringMap<EntryList::iterator> index;
+	unsigned int maxEntries;
+	unsigned long long ttl;
+	unsigned long long hits;
+	unsigned long long misses;
+
+	static EntryPtr openEntry(const StaticString &path, unsigned long long now) {
+		EntryPtr entry = boost::make_shared<Entry>();
+		entry->path = path;
+		entry->openedAt = now;
+		memset(&entry->info, 0, sizeof(entry->info));
+
+		// O_NONBLOCK so that a FIFO in the public directory can't
+		// block us; we only serve regular files anyway.
+		FileDescriptor fd(syscalls::open(entry->path.c_str(), O_RDONLY | O_NONBLOCK));
+		if (fd != -1 && fstat(fd, &entry->info) == 0 && S_ISREG(entry->info.st_mode)) {
+			entry->fd = fd;
+			buildValidators(*entry);
+		}
+		return entry;
+	}
+
+	static void buildValidators(Entry &entry) {
+		char buf[64];
+		struct tm tm;
+
+		snprintf(buf, sizeof(buf), "\"%lx-%llx\"",
+			(unsigned long) entry.info.st_mtime,
+			(unsigned long long) entry.info.st_size);
+		entry.etag = buf;
+
+		gmtime_r(&entry.info.st_mtime, &tm);
+		entry.lastModified.assign(buf,
+			strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm));
+	}
+
+	void removeEntry(EntryList::iterator it) {
+		index.remove((*it)->path);
+		lru.erase(it);
+	}
+
+public:
+	/**
+	 * @param maxEntries The maximum number of files (and thus file
+	 *                   descriptors) to remember.
+	 * @param ttl For how long an entry is trusted, in microseconds.
+	 */
+	StaticFileCache(unsigned int maxEntries, unsigned long long ttl = 1000000) {
+		this->maxEntries = maxEntries;
+		this->ttl = ttl;
+		hits = 0;
+		misses = 0;
+	}
+
+	/**
+	 * Returns the entry for the given absolute path, opening the file if
+	 * it isn't cached or if its entry is older than the TTL. Never returns
+	 * NULL; check Entry::exists().
+	 */
+	EntryPtr lookup(const StaticString &path, unsigned long long now) {
+		StringMap<EntryList::iterator>::iterator it = index.find(path);
+		if (it != index.end()) {
+			EntryList::iterator lit = it->second;
+			if ((*lit)->openedAt + ttl > now) {
+				lru.splice(lru.begin(), lru, lit);
+				hits++;
+				return *lit;
+			}
+			removeEntry(lit);
+		}
+
+		misses++;
+		EntryPtr entry = openEntry(path, now);
+		if (maxEntries > 0) {
+			lru.push_front(entry);
+			index.set(entry->path, lru.begin());
+			while (lru.size() > maxEntries) {
+				EntryList::iterator last = lru.end();
+				last--;
+				removeEntry(last);
+			}
+		}
+		return entry;
+	}
+
+	void clear() {
+		lru.clear();
+		index.clear();
+	}
+
+	unsigned int count() const {
+		return lru.size();
+	}
+
+	/**
+	 * Returns the Content-Type for a file, based on its extension.
+	 */
+	static StaticString getContentType(const StaticString &filename) {
+		static const char *types[] = {
+			"html",  "text/html; charset=utf-8",
+			"htm",   "text/html; charset=utf-8",
+			"css",   "text/css",
+			"js",    "application/javascript",
+			"json",  "application/json",
+			"map",   "application/json",
+			"txt",   "text/plain",
+			"xml",   "application/xml",
+			"rss",   "application/rss+xml",
+			"atom",  "application/atom+xml",
+			"png",   "image/png",
+			"jpg",   "image/jpeg",
+			"jpeg",  "image/jpeg",
+			"gif",   "image/gif",
+			"svg",   "image/svg+xml",
+			"ico",   "image/x-icon",
+			"webp",  "image/webp",
+			"woff",  "application/font-woff",
+			"woff2", "font/woff2",
+			"ttf",   "application/x-font-ttf",
+			"otf",   "application/x-font-opentype",
+			"eot",   "application/vnd.ms-fontobject",
+			"pdf",   "application/pdf",
+			"zip",   "application/zip",
+			"mp3",   "audio/mpeg",
+			"ogg",   "audio/ogg",
+			"mp4",   "video/mp4",
+			"webm",  "video/webm",
+			NULL
+		};
+
+		string::size_type pos = filename.size();
+		while (pos > 0 && filename[pos - 1] != '.' && filename[pos - 1] != '/') {
+			pos--;
+		}
+		if (pos > 0 && filename[pos - 1] == '.') {
+			StaticString ext = filename.substr(pos);
+			for (unsigned int i = 0; types[i] != NULL; i += 2) {
+				if (ext.size() == strlen(types[i])
+				 && strncasecmp(ext.data(), types[i], ext.size()) == 0)
+				{
+					return types[i + 1];
+				}
+			}
+		}
+		return "application/octet-stream";
+	}
+
+	template<typename Stream>
+	void inspect(Stream &stream) const {
+		stream << "Static file cache: " << lru.size() << " of " << maxEntries <<
+			" entries, " << hits << " hits, " << misses << " misses\n";
+	}
+};
+
+typedef boost::shared_ptr<StaticFileCache> StaticFileCachePtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_STATIC_FILE_CACHE_H_ */
@@ -0,0 +1,415 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_TUNNEL_H_
+#define _PASSENGER_TUNNEL_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <oxt/system_calls.hpp>
+#include <ev++.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <FileDescriptor.h>
+#include <Logging.h>
+#include <Utils/MetricsRegistry.h>
+#include <ApplicationPool2/Session.h>
+#include <agents/HelperAgent/LoopPriorities.h>
+
+#if defined(__linux__) && defined(SPLICE_F_MOVE) && defined(SPLICE_F_NONBLOCK)
+	#define TUNNEL_SPLICE_AVAILABLE
+#endif
+
+namespace Passenger {
+
+using namespace std;
+using namespace oxt;
+
+
+/**
+ * Forwards data in both directions between a client and an application
+ * process that has switched protocols, e.g. for a WebSocket. RequestHandler
+ * hands a connection over to a Tunnel once the response header has been
+ * sent, so that long-lived connections don't keep a Client with all its
+ * buffers and parsers around.
+ *
+ * On Linux the data is moved with splice() through a kernel pipe that is
+ * shared by all Tunnels in the same event loop, and that is always drained
+ * before control returns to the event loop. Only data that the receiving
+ * side can't take right away is copied, into a small per-direction buffer,
+ * and reading from the sending side pauses until it has been written.
+ *
+ * An EOF in one direction is passed on as a half close. The tunnel closes
+ * once both directions have ended, or on the first error, after which
+ * `onClose` is called. Not thread-safe; must be used from the event loop
+ * thread only.
+ */
+class Tunnel: public boost::noncopyable {
+public:
+	typedef void (*Callback)(Tunnel *tunnel);
+
+private:
+	static const size_t BLOCK_SIZE = 64 * 1024;
+	/** The maximum number of blocks to forward per event, so that busy
+	 * tunnels don't starve the rest of the event loop. */
+	static const unsigned int MAX_BLOCKS_PER_EVENT = 4;
+
+	struct Direction {
+		int from;
+		int to;
+		/** Data that `to` couldn't take yet. */
+		string pending;
+		bool ended;
+		unsigned long long bytes;
+
+		Direction(int _from, int _to)
+			: from(_from),
+			  to(_to),
+			  ended(false),
+			  bytes(0)
+			{ }
+	};
+
+	FileDescriptor clientFd;
+	FileDescriptor appFd;
+	const Pipe *splicePipe;
+	Direction toApp;
+	Direction toClient;
+	ev::io clientWatcher;
+	ev::io appWatcher;
+	bool closed;
+
+	void onClientEvent(ev::io &io, int revents) {
+		ScopedLoopTimer timer(loopTimeStats, LPC_CLIENT_OUTPUT);
+		if (revents & ev::WRITE) {
+			flushPending(toClient);
+		}
+		if (!closed && (revents & ev::READ)) {
+			forward(toApp);
+		}
+		finishEvent();
+	}
+
+	void onAppEvent(ev::io &io, int revents) {
+		ScopedLoopTimer timer(loopTimeStats, LPC_CLIENT_OUTPUT);
+		if (revents & ev::WRITE) {
+			flushPending(toApp);
+		}
+		if (!closed && (revents & ev::READ)) {
+			forward(toClient);
+		}
+		finishEvent();
+	}
+
+	/**
+	 * Must be the last thing that an event handler does, because `onClose`
+	 * may destroy this object.
+	 */
+	void finishEvent() {
+		if (!closed && toApp.ended && toClient.ended) {
+			closed = true;
+		}
+		if (closed) {
+			clientWatcher.stop();
+			appWatcher.stop();
+			if (onClose != NULL) {
+				onClose(this);
+			}
+		} else {
+			updateWatcher(clientWatcher, clientFd, toApp, toClient);
+			updateWatcher(appWatcher, appFd, toClient, toApp);
+		}
+	}
+
+	/**
+	 * Watches `fd` for readability as long as the data read from it can be
+	 * written onward, and for writability as long as data for it is pending.
+	 */
+	static void updateWatcher(ev::io &watcher, int fd, const Direction &out,
+		const Direction &in)
+	{
+		int events = 0;
+		if (!out.ended && out.pending.empty()) {
+			events |= ev::READ;
+		}
+		if (!in.pending.empty()) {
+			events |= ev::WRITE;
+		}
+		if (events != (watcher.events & (ev::READ | ev::WRITE)) || !watcher.is_active()) {
+			watcher.stop();
+			if (events != 0) {
+				watcher.set(fd, events);
+				watcher.start();
+			}
+		}
+	}
+
+	void forward(Direction &dir) {
+		for (unsigned int i = 0; i < MAX_BLOCKS_PER_EVENT && !closed && !dir.ended
+			&& dir.pending.empty(); i++)
+		{
+			ssize_t ret;
+			#ifdef TUNNEL_SPLICE_AVAILABLE
+				if (splicePipe != NULL) {
+					ret = spliceBlock(dir);
+				} else {
+					ret = copyBlock(dir);
+				}
+			#else
+				ret = copyBlock(dir);
+			#endif
+			if (ret <= 0) {
+				break;
+			}
+		}
+	}
+
+	#ifdef TUNNEL_SPLICE_AVAILABLE
+		/**
+		 * Moves a block from `dir.from` to `dir.to` through the splice pipe.
+		 * Whatever `dir.to` doesn't take is moved from the pipe into
+		 * `dir.pending`. Returns the number of bytes moved, 0 if there's
+		 * nothing to do right now, or -1 if the tunnel is done with `dir`.
+		 */
+		ssize_t spliceBlock(Direction &dir) {
+			ssize_t ret;
+			do {
+				ret = splice(dir.from, NULL, splicePipe->second, NULL,
+					BLOCK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			} while (ret == -1 && errno == EINTR);
+
+			if (ret == 0) {
+				onEnd(dir);
+				return -1;
+			} else if (ret == -1) {
+				int e = errno;
+				if (e == EAGAIN) {
+					return 0;
+				} else if (e == EINVAL || e == ENOSYS) {
+					P_DEBUG("splice() is not supported for tunnel fd " << dir.from <<
+						"; copying the data instead");
+					splicePipe = NULL;
+					return copyBlock(dir);
+				} else {
+					onError(dir.from, "read", e);
+					return -1;
+				}
+			}
+
+			size_t size = ret;
+			size_t pending = size;
+			while (pending > 0) {
+				do {
+					ret = splice(splicePipe->first, NULL, dir.to, NULL,
+						pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				} while (ret == -1 && errno == EINTR);
+
+				if (ret == -1) {
+					int e = errno;
+					if (e == EAGAIN) {
+						// Keep the shared pipe empty.
+						drainSplicePipe(dir.pending, pending);
+						break;
+					} else {
+						drainSplicePipe(dir.pending, pending);
+						onError(dir.to, "write", e);
+						return -1;
+					}
+				} else {
+					pending -= ret;
+				}
+			}
+			countBytes(dir, size);
+			return size;
+		}
+
+		void drainSplicePipe(string &buffer, size_t size) {
+			char buf[1024 * 16];
+			while (size > 0) {
+				ssize_t ret = syscalls::read(splicePipe->first, buf,
+					std::min(size, sizeof(buf)));
+				if (ret <= 0) {
+					break;
+				}
+				buffer.append(buf, ret);
+				size -= ret;
+			}
+		}
+	#endif
+
+	/** Like spliceBlock(), but with read() and write(). */
+	ssize_t copyBlock(Direction &dir) {
+		char buf[1024 * 16];
+		ssize_t ret = syscalls::read(dir.from, buf, sizeof(buf));
+		if (ret == 0) {
+			onEnd(dir);
+			return -1;
+		} else if (ret == -1) {
+			int e = errno;
+			if (e == EAGAIN) {
+				return 0;
+			} else {
+				onError(dir.from, "read", e);
+				return -1;
+			}
+		}
+
+		size_t size = ret;
+		ret = syscalls::write(dir.to, buf, size);
+		if (ret == -1) {
+			int e = errno;
+			if (e == EAGAIN) {
+				ret = 0;
+			} else {
+				onError(dir.to, "write", e);
+				return -1;
+			}
+		}
+		if ((size_t) ret < size) {
+			dir.pending.append(buf + ret, size - ret);
+		}
+		countBytes(dir, size);
+		return size;
+	}
+
+	void countBytes(Direction &dir, size_t size) {
+		Metric *metric = (&dir == &toClient) ? bytesSentMetric : bytesReceivedMetric;
+		dir.bytes += size;
+		if (metric != NULL) {
+			metric->add(size);
+		}
+	}
+
+	void flushPending(Direction &dir) {
+		while (!dir.pending.empty()) {
+			ssize_t ret = syscalls::write(dir.to, dir.pending.data(), dir.pending.size());
+			if (ret == -1) {
+				int e = errno;
+				if (e != EAGAIN) {
+					onError(dir.to, "write", e);
+				}
+				return;
+			}
+			dir.pending.erase(0, ret);
+		}
+		// Don't hold on to the memory of a burst.
+		string().swap(dir.pending);
+		if (dir.ended) {
+			syscalls::shutdown(dir.to, SHUT_WR);
+		}
+	}
+
+	void onEnd(Direction &dir) {
+		dir.ended = true;
+		if (dir.pending.empty()) {
+			syscalls::shutdown(dir.to, SHUT_WR);
+		}
+	}
+
+	void onError(int fd, const char *operation, int e) {
+		if (e != EPIPE && e != ECONNRESET) {
+			P_DEBUG("Cannot " << operation << " tunnel fd " << fd << ": " <<
+				strerror(e) << " (errno=" << e << ")");
+		}
+		closed = true;
+	}
+
+public:
+	/** Called once the tunnel has closed. The callback may destroy the Tunnel. */
+	Callback onClose;
+	void *userData;
+	/** If set, the application session that this tunnel occupies. It's
+	 * closed along with the Tunnel. */
+	ApplicationPool2::SessionPtr session;
+	/** If set, count the bytes sent to and received from the client. */
+	Metric *bytesSentMetric;
+	Metric *bytesReceivedMetric;
+	/** If set, the time spent on this tunnel's events is accounted here. */
+	LoopTimeStats *loopTimeStats;
+
+	/**
+	 * Both file descriptors must be non-blocking sockets. If `splicePipe` is
+	 * NULL, the data is copied with read() and write() instead.
+	 */
+	Tunnel(struct ev_loop *loop, const FileDescriptor &_clientFd,
+		const FileDescriptor &_appFd, const Pipe *_splicePipe)
+		: clientFd(_clientFd),
+		  appFd(_appFd),
+		  splicePipe(_splicePipe),
+		  toApp(_clientFd, _appFd),
+		  toClient(_appFd, _clientFd),
+		  closed(false),
+		  onClose(NULL),
+		  userData(NULL),
+		  bytesSentMetric(NULL),
+		  bytesReceivedMetric(NULL),
+		  loopTimeStats(NULL)
+	{
+		clientWatcher.set<Tunnel, &Tunnel::onClientEvent>(this);
+		clientWatcher.set(loop);
+		appWatcher.set<Tunnel, &Tunnel::onAppEvent>(this);
+		appWatcher.set(loop);
+		// Tunneled traffic is bulk transfer, whichever direction it goes.
+		setLoopPriority(clientWatcher, LPC_CLIENT_OUTPUT);
+		setLoopPriority(appWatcher, LPC_CLIENT_OUTPUT);
+	}
+
+	~Tunnel() {
+		clientWatcher.stop();
+		appWatcher.stop();
+		if (session != NULL) {
+			session->close(false);
+		}
+	}
+
+	/** Starts forwarding. */
+	void start() {
+		updateWatcher(clientWatcher, clientFd, toApp, toClient);
+		updateWatcher(appWatcher, appFd, toClient, toApp);
+	}
+
+	int getClientFd() const {
+		return clientFd;
+	}
+
+	unsigned long long getBytesSentToApp() const {
+		return toApp.bytes;
+	}
+
+	unsigned long long getBytesSentToClient() const {
+		return toClient.bytes;
+	}
+};
+
+typedef boost::shared_ptr<Tunnel> TunnelPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_TUNNEL_H_ */
@@ -61,6 +61,64 @@ private:
 		writeScalarMessage(commonContext.fd, stream.str());
 	}
 	
+	void processMetrics(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.passSecurity();
+		writeScalarMessage(commonContext.fd, server->getMetrics()->toPrometheusText());
+	}
+	
+	/**
+	 * Queries the request store. Options: "filter" (a filter expression),
+	 * "since" and "until" (in seconds ago; default: everything), "group_by"
+	 * (app, uri, controller or status) and "limit". Replies with "ok"
+	 * followed by the result as a scalar message, or with "error" and a
+	 * message. See RequestStore::query() for the result format.
+	 */
+	void processQuery(CommonClientContext &commonContext, SpecificContext *specificContext,
+		const vector<string> &args)
+	{
+		TRACE_POINT();
+		commonContext.passSecurity();
+		const boost::shared_ptr<RequestStore> &store = server->getRequestStore();
+		if (store == NULL) {
+			writeArrayMessage(commonContext.fd, "error",
+				"The request store is disabled; set analytics_store_dir to enable it",
+				NULL);
+			return;
+		}
+
+		string result;
+		try {
+			VariantMap options = argsToOptions(args, 1);
+			unsigned long long now = SystemTime::getUsec();
+			RequestStore::Query query;
+			query.filter = options.get("filter", false);
+			query.groupBy = options.get("group_by", false);
+			query.limit = options.getInt("limit", false, 10);
+			if (options.has("since")) {
+				query.since = now - options.getULL("since") * 1000000;
+			}
+			if (options.has("until")) {
+				query.until = now - options.getULL("until") * 1000000;
+			}
+			result = store->query(query);
+		} catch (const SyntaxError &e) {
+			writeArrayMessage(commonContext.fd, "error",
+				("Invalid filter: " + string(e.what())).c_str(), NULL);
+			return;
+		} catch (const ArgumentException &e) {
+			writeArrayMessage(commonContext.fd, "error", e.what(), NULL);
+			return;
+		} catch (const SystemException &e) {
+			writeArrayMessage(commonContext.fd, "error", e.what(), NULL);
+			return;
+		}
+		writeArrayMessage(commonContext.fd, "ok", NULL);
+		writeScalarMessage(commonContext.fd, result);
+	}
+	
 public:
 	AdminController(const LoggingServerPtr &server) {
 		this->server = server;
@@ -78,6 +136,10 @@ public:
 		try {
 			if (isCommand(args, "status", 0)) {
 				processStatus(commonContext, specificContext, args);
+			} else if (isCommand(args, "metrics", 0)) {
+				processMetrics(commonContext, specificContext, args);
+			} else if (args.size() % 2 == 1 && args[0] == "query") {
+				processQuery(commonContext, specificContext, args);
 			} else {
 				return false;
 			}
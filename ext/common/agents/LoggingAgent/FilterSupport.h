@@ -33,6 +33,7 @@
 
 #include <string>
 #include <set>
+#include <vector>
 // Checking for _PCREPOSIX_H avoids conflicts with headers provided by Apache.
 // https://code.google.com/p/phusion-passenger/issues/detail?id=651
 #ifndef _PCREPOSIX_H
@@ -485,9 +486,23 @@ public:
 		RESPONSE_TIME_WITHOUT_GC,
 		STATUS,
 		STATUS_CODE,
-		GC_TIME
+		GC_TIME,
+		CPU_TIME,
+		ALLOCATIONS
 	};
 	
+	/** A bit mask with all fields set. See `fieldMask()`. */
+	static const unsigned int ALL_FIELDS = (1 << (ALLOCATIONS + 1)) - 1;
+	
+	/**
+	 * Returns the bit that represents the given field in a field mask. Field
+	 * masks tell a Context which fields a filter is going to query, so that
+	 * it doesn't have to extract anything else.
+	 */
+	static unsigned int fieldMask(FieldIdentifier id) {
+		return 1 << id;
+	}
+	
 	virtual ~Context() { }
 	
 	virtual string getURI() const = 0;
@@ -496,6 +511,10 @@ public:
 	virtual string getStatus() const = 0;
 	virtual int getStatusCode() const = 0;
 	virtual int getGcTime() const = 0;
+	/** The CPU time, in microseconds, and the number of allocated objects
+	 * that the application reported for the request. 0 if not reported. */
+	virtual int getCpuTime() const = 0;
+	virtual int getAllocations() const = 0;
 	virtual bool hasHint(const string &name) const = 0;
 	
 	int getResponseTimeWithoutGc() const {
@@ -518,6 +537,10 @@ public:
 			return toString(getStatusCode());
 		case GC_TIME:
 			return toString(getGcTime());
+		case CPU_TIME:
+			return toString(getCpuTime());
+		case ALLOCATIONS:
+			return toString(getAllocations());
 		default:
 			return "";
 		}
@@ -533,6 +556,10 @@ public:
 			return getStatusCode();
 		case GC_TIME:
 			return getGcTime();
+		case CPU_TIME:
+			return getCpuTime();
+		case ALLOCATIONS:
+			return getAllocations();
 		default:
 			return 0;
 		}
@@ -554,6 +581,10 @@ public:
 			return getStatusCode() > 0;
 		case GC_TIME:
 			return getGcTime() > 0;
+		case CPU_TIME:
+			return getCpuTime() > 0;
+		case ALLOCATIONS:
+			return getAllocations() > 0;
 		default:
 			return false;
 		}
@@ -569,6 +600,8 @@ public:
 		case RESPONSE_TIME_WITHOUT_GC:
 		case STATUS_CODE:
 		case GC_TIME:
+		case CPU_TIME:
+		case ALLOCATIONS:
 			return INTEGER_TYPE;
 		default:
 			return UNKNOWN_TYPE;
@@ -580,16 +613,21 @@ class SimpleContext: public Context {
 public:
 	string uri;
 	string controller;
+	string action;
 	string status;
 	int responseTime;
 	int statusCode;
 	int gcTime;
+	int cpuTime;
+	int allocations;
 	set<string> hints;
 	
 	SimpleContext() {
 		responseTime = 0;
 		statusCode = 0;
 		gcTime = 0;
+		cpuTime = 0;
+		allocations = 0;
 	}
 	
 	virtual string getURI() const {
@@ -616,6 +654,14 @@ public:
 		return gcTime;
 	}
 	
+	virtual int getCpuTime() const {
+		return cpuTime;
+	}
+	
+	virtual int getAllocations() const {
+		return allocations;
+	}
+	
 	virtual bool hasHint(const string &name) const {
 		return hints.find(name) != hints.end();
 	}
@@ -624,9 +670,15 @@ public:
 class ContextFromLog: public Context {
 private:
 	StaticString logData;
+	unsigned int fields;
 	mutable SimpleContext *parsedData;
+	mutable unsigned int parsedFields;
 	
 	struct ParseState {
+		bool wantRequestTimes;
+		bool wantGcTimes;
+		bool wantStatus;
+		bool wantResourceUsage;
 		unsigned long long requestProcessingStart;
 		unsigned long long requestProcessingEnd;
 		unsigned long long smallestTimestamp;
@@ -636,47 +688,89 @@ private:
 	};
 	
 	static void parseLine(const StaticString &txnId, unsigned long long timestamp,
-		const StaticString &data, SimpleContext &ctx, ParseState &state)
+		const StaticString &data, unsigned int fields, SimpleContext &ctx,
+		ParseState &state)
 	{
-		if (startsWith(data, "BEGIN: request processing")) {
+		if (state.wantRequestTimes && startsWith(data, "BEGIN: request processing")) {
 			state.requestProcessingStart = extractEventTimestamp(data);
-		} else if (startsWith(data, "END: request processing")
-		        || startsWith(data, "FAIL: request processing")) {
+		} else if (state.wantRequestTimes
+		        && (startsWith(data, "END: request processing")
+		         || startsWith(data, "FAIL: request processing")))
+		{
 			state.requestProcessingEnd = extractEventTimestamp(data);
-		} else if (startsWith(data, "URI: ")) {
+		} else if ((fields & fieldMask(URI)) && startsWith(data, "URI: ")) {
 			ctx.uri = data.substr(data.find(':') + 2);
-		} else if (startsWith(data, "Controller action: ")) {
+		} else if ((fields & fieldMask(CONTROLLER)) && startsWith(data, "Controller action: ")) {
 			StaticString value = data.substr(data.find(':') + 2);
 			size_t pos = value.find('#');
 			if (pos != string::npos) {
 				ctx.controller = value.substr(0, pos);
+				ctx.action = value.substr(pos + 1);
 			}
-		} else if (startsWith(data, "Status: ")) {
+		} else if (state.wantStatus && startsWith(data, "Status: ")) {
 			StaticString value = data.substr(data.find(':') + 2);
 			ctx.status = value;
 			ctx.statusCode = stringToInt(value);
-		} else if (startsWith(data, "Initial GC time: ")) {
+		} else if (state.wantGcTimes && startsWith(data, "Initial GC time: ")) {
 			StaticString value = data.substr(data.find(':') + 2);
 			state.gcTimeStart = stringToULL(value);
-		} else if (startsWith(data, "Final GC time: ")) {
+		} else if (state.wantGcTimes && startsWith(data, "Final GC time: ")) {
 			StaticString value = data.substr(data.find(':') + 2);
 			state.gcTimeEnd = stringToULL(value);
+		} else if (state.wantResourceUsage && startsWith(data, "Resource usage: ")) {
+			// "Resource usage: cpu=<usec> allocations=<count>", as logged
+			// by the HelperAgent.
+			vector<StaticString> values;
+			split(data.substr(data.find(':') + 2), ' ', values);
+			for (unsigned int i = 0; i < values.size(); i++) {
+				if (startsWith(values[i], "cpu=")) {
+					ctx.cpuTime = stringToInt(values[i].substr(sizeof("cpu=") - 1));
+				} else if (startsWith(values[i], "allocations=")) {
+					ctx.allocations = stringToInt(values[i].substr(sizeof("allocations=") - 1));
+				}
+			}
 		}
 		
-		if (state.smallestTimestamp == 0 || timestamp < state.smallestTimestamp) {
-			state.smallestTimestamp = timestamp;
+		if (state.wantRequestTimes) {
+			if (state.smallestTimestamp == 0 || timestamp < state.smallestTimestamp) {
+				state.smallestTimestamp = timestamp;
+			}
+			if (timestamp > state.largestTimestamp) {
+				state.largestTimestamp = timestamp;
+			}
 		}
-		if (timestamp > state.largestTimestamp) {
-			state.largestTimestamp = timestamp;
+	}
+	
+	/**
+	 * Adds the fields that `fields` can only be derived from, and the
+	 * fields that are extracted from the same log lines anyway.
+	 */
+	static unsigned int expandFields(unsigned int fields) {
+		if (fields & fieldMask(RESPONSE_TIME_WITHOUT_GC)) {
+			fields |= fieldMask(RESPONSE_TIME) | fieldMask(GC_TIME);
+		}
+		if (fields & (fieldMask(STATUS) | fieldMask(STATUS_CODE))) {
+			fields |= fieldMask(STATUS) | fieldMask(STATUS_CODE);
 		}
+		if (fields & (fieldMask(CPU_TIME) | fieldMask(ALLOCATIONS))) {
+			fields |= fieldMask(CPU_TIME) | fieldMask(ALLOCATIONS);
+		}
+		return fields;
 	}
 	
-	static void reallyParse(const StaticString &data, SimpleContext &ctx) {
+	static void reallyParse(const StaticString &data, unsigned int fields, SimpleContext &ctx) {
 		const char *current = data.data();
 		const char *end     = data.data() + data.size();
 		
 		ParseState state;
 		memset(&state, 0, sizeof(state));
+		state.wantRequestTimes = fields & fieldMask(RESPONSE_TIME);
+		state.wantGcTimes = fields & fieldMask(GC_TIME);
+		state.wantStatus = fields & fieldMask(STATUS);
+		state.wantResourceUsage = fields & fieldMask(CPU_TIME);
+		if (fields == 0) {
+			return;
+		}
 		
 		while (current < end) {
 			current = skipNewlines(current, end);
@@ -693,8 +787,8 @@ private:
 					// the lines but for the purposes of ContextFromLog
 					// analyzing the data without sorting is good enough.
 					if (splitLine(line, txnId, timestamp, writeCount, lineData)) {
-						parseLine(txnId, timestamp, lineData, ctx,
-						state);
+						parseLine(txnId, timestamp, lineData, fields,
+							ctx, state);
 					}
 				}
 				current = endOfLine;
@@ -780,19 +874,34 @@ private:
 		return current;
 	}
 	
-	SimpleContext *parse() const {
-		if (parsedData == NULL) {
+	/**
+	 * Parses the log data, extracting the fields that were announced in the
+	 * constructor. Asking for a field that wasn't announced causes another
+	 * pass over the data, so the result is always correct.
+	 */
+	SimpleContext *parse(unsigned int needed) const {
+		if (parsedData == NULL || (parsedFields & needed) != needed) {
+			unsigned int toParse = expandFields(fields | parsedFields | needed);
 			auto_ptr<SimpleContext> ctx(new SimpleContext());
-			reallyParse(logData, *ctx.get());
+			reallyParse(logData, toParse, *ctx.get());
+			delete parsedData;
 			parsedData = ctx.release();
+			parsedFields = toParse;
 		}
 		return parsedData;
 	}
 	
 public:
-	ContextFromLog(const StaticString &logData) {
+	/**
+	 * @param fields A mask of the fields that are going to be queried, e.g.
+	 *               `Filter::getReferencedFields()`. Only those are extracted
+	 *               from the log data.
+	 */
+	ContextFromLog(const StaticString &logData, unsigned int fields = ALL_FIELDS) {
 		this->logData = logData;
+		this->fields = fields;
 		parsedData = NULL;
+		parsedFields = 0;
 	}
 	
 	~ContextFromLog() {
@@ -800,31 +909,53 @@ public:
 	}
 	
 	virtual string getURI() const {
-		return parse()->uri;
+		return parse(fieldMask(URI))->uri;
 	}
 	
 	virtual string getController() const {
-		return parse()->getController();
+		return parse(fieldMask(CONTROLLER))->getController();
+	}
+	
+	/**
+	 * Returns the controller and action in "Controller#action" form, or
+	 * the empty string if the log data doesn't mention them.
+	 */
+	string getControllerAction() const {
+		const SimpleContext *ctx = parse(fieldMask(CONTROLLER));
+		if (ctx->controller.empty()) {
+			return string();
+		} else {
+			return ctx->controller + "#" + ctx->action;
+		}
 	}
 	
 	virtual int getResponseTime() const {
-		return parse()->getResponseTime();
+		return parse(fieldMask(RESPONSE_TIME))->getResponseTime();
 	}
 	
 	virtual string getStatus() const {
-		return parse()->getStatus();
+		return parse(fieldMask(STATUS))->getStatus();
 	}
 	
 	virtual int getStatusCode() const {
-		return parse()->getStatusCode();
+		return parse(fieldMask(STATUS_CODE))->getStatusCode();
 	}
 	
 	virtual int getGcTime() const {
-		return parse()->getGcTime();
+		return parse(fieldMask(GC_TIME))->getGcTime();
+	}
+	
+	virtual int getCpuTime() const {
+		return parse(fieldMask(CPU_TIME))->getCpuTime();
+	}
+	
+	virtual int getAllocations() const {
+		return parse(fieldMask(ALLOCATIONS))->getAllocations();
 	}
 	
 	virtual bool hasHint(const string &name) const {
-		return parse()->hasHint(name);
+		// Hints are not extracted from the log data.
+		return parse(0)->hasHint(name);
 	}
 };
 
@@ -846,6 +977,8 @@ private:
 	struct BooleanComponent {
 		virtual ~BooleanComponent() { }
 		virtual bool evaluate(const Context &ctx) = 0;
+		/** Whether the result doesn't depend on the context. */
+		virtual bool isConstant() const = 0;
 	};
 	
 	enum LogicalOperator {
@@ -893,6 +1026,18 @@ private:
 			
 			return result;
 		}
+		
+		virtual bool isConstant() const {
+			if (!firstExpression->isConstant()) {
+				return false;
+			}
+			for (unsigned int i = 0; i < rest.size(); i++) {
+				if (!rest[i].expression->isConstant()) {
+					return false;
+				}
+			}
+			return true;
+		}
 	};
 	
 	struct Negation: public BooleanComponent {
@@ -905,6 +1050,10 @@ private:
 		virtual bool evaluate(const Context &ctx) {
 			return !expr->evaluate(ctx);
 		}
+		
+		virtual bool isConstant() const {
+			return expr->isConstant();
+		}
 	};
 	
 	struct Value {
@@ -987,6 +1136,10 @@ private:
 			return *this;
 		}
 		
+		bool isLiteral() const {
+			return source != CONTEXT_FIELD_IDENTIFIER;
+		}
+		
 		regex_t *getRegexpValue(const Context &ctx) const {
 			if (source == REGEXP_LITERAL) {
 				return &storedRegexp();
@@ -1127,6 +1280,10 @@ private:
 		virtual bool evaluate(const Context &ctx) {
 			return val.getBooleanValue(ctx);
 		}
+		
+		virtual bool isConstant() const {
+			return val.isLiteral();
+		}
 	};
 	
 	struct Comparison: public BooleanComponent {
@@ -1147,6 +1304,10 @@ private:
 				return false;
 			}
 		}
+		
+		virtual bool isConstant() const {
+			return subject.isLiteral() && object.isLiteral();
+		}
 	
 	private:
 		bool compareStringOrRegexp(const string &str, const Context &ctx) {
@@ -1204,6 +1365,15 @@ private:
 		vector<Value> arguments;
 		
 		virtual void checkArguments() const = 0;
+		
+		virtual bool isConstant() const {
+			for (unsigned int i = 0; i < arguments.size(); i++) {
+				if (!arguments[i].isLiteral()) {
+					return false;
+				}
+			}
+			return true;
+		}
 	};
 	
 	struct StartsWithFunctionCall: public FunctionCall {
@@ -1225,6 +1395,10 @@ private:
 			return ctx.hasHint(arguments[0].getStringValue(ctx));
 		}
 		
+		virtual bool isConstant() const {
+			return false;
+		}
+		
 		virtual void checkArguments() const {
 			if (arguments.size() != 1) {
 				throw SyntaxError("you passed " + toString(arguments.size()) + 
@@ -1233,10 +1407,37 @@ private:
 		}
 	};
 	
+	/**
+	 * After parsing, the syntax tree is compiled into a flat program that
+	 * operates on a single boolean accumulator. Only the leaves of the tree
+	 * (comparisons, function calls) are evaluated through virtual calls;
+	 * logical operators become jumps, which implement short-circuiting.
+	 */
+	enum Opcode {
+		/** acc = operand */
+		LOAD_CONSTANT,
+		/** acc = components[operand]->evaluate(ctx) */
+		EVALUATE,
+		/** acc = !acc */
+		NEGATE,
+		/** if (!acc) goto operand */
+		JUMP_IF_FALSE,
+		/** if (acc) goto operand */
+		JUMP_IF_TRUE
+	};
+	
+	struct Instruction {
+		Opcode opcode;
+		unsigned int operand;
+	};
+	
 	Tokenizer tokenizer;
 	BooleanComponentPtr root;
 	Token lookahead;
 	bool debug;
+	unsigned int referencedFields;
+	vector<Instruction> program;
+	vector<BooleanComponentPtr> components;
 	
 	static bool isLiteralToken(const Token &token) {
 		return token.type == Tokenizer::REGEXP
@@ -1556,6 +1757,12 @@ private:
 	
 	Value matchContextFieldIdentifier(int level, const Token &token) {
 		logMatch(level, "matchContextFieldIdentifier()");
+		Value result = contextFieldIdentifierFor(token);
+		referencedFields |= Context::fieldMask(result.u.contextFieldIdentifier);
+		return result;
+	}
+	
+	Value contextFieldIdentifierFor(const Token &token) {
 		if (token.rawValue == "uri") {
 			return Value(Context::URI);
 		} else if (token.rawValue == "controller") {
@@ -1570,25 +1777,161 @@ private:
 			return Value(Context::STATUS_CODE);
 		} else if (token.rawValue == "gc_time") {
 			return Value(Context::GC_TIME);
+		} else if (token.rawValue == "cpu_time") {
+			return Value(Context::CPU_TIME);
+		} else if (token.rawValue == "allocations") {
+			return Value(Context::ALLOCATIONS);
 		} else {
 			raiseSyntaxError("unknown field '" + token.rawValue + "'", token);
 			return Value(); // Shut up compiler warning.
 		}
 	}
 	
+	static bool evaluateConstant(const BooleanComponentPtr &component) {
+		SimpleContext ctx;
+		return component->evaluate(ctx);
+	}
+	
+	unsigned int emit(Opcode opcode, unsigned int operand = 0) {
+		Instruction instruction;
+		instruction.opcode = opcode;
+		instruction.operand = operand;
+		program.push_back(instruction);
+		return program.size() - 1;
+	}
+	
+	void compile(const BooleanComponentPtr &component) {
+		if (component->isConstant()) {
+			emit(LOAD_CONSTANT, evaluateConstant(component));
+			return;
+		}
+		
+		const MultiExpression *multiExpression =
+			dynamic_cast<const MultiExpression *>(component.get());
+		const Negation *negation = dynamic_cast<const Negation *>(component.get());
+		if (multiExpression != NULL) {
+			compileMultiExpression(*multiExpression);
+		} else if (negation != NULL) {
+			compile(negation->expr);
+			emit(NEGATE);
+		} else {
+			emit(EVALUATE, components.size());
+			components.push_back(component);
+		}
+	}
+	
+	/**
+	 * Operators are applied from left to right, and the entire expression
+	 * yields false as soon as an AND yields false; see
+	 * MultiExpression::evaluate(). As long as the result so far is known at
+	 * compile time no code is emitted for it.
+	 */
+	void compileMultiExpression(const MultiExpression &expr) {
+		vector<unsigned int> exitJumps;
+		bool known = expr.firstExpression->isConstant();
+		bool value = known && evaluateConstant(expr.firstExpression);
+		unsigned int i;
+		
+		if (!known) {
+			compile(expr.firstExpression);
+		}
+		for (i = 0; i < expr.rest.size(); i++) {
+			const MultiExpression::Part &part = expr.rest[i];
+			bool isAnd = part.theOperator == AND;
+			
+			if (known) {
+				if (isAnd && !value) {
+					break;
+				} else if (!isAnd && value) {
+					continue;
+				} else if (part.expression->isConstant()) {
+					value = evaluateConstant(part.expression);
+					if (isAnd && !value) {
+						break;
+					}
+					continue;
+				}
+				// The result is now whatever this part yields.
+				compile(part.expression);
+				known = false;
+			} else if (isAnd) {
+				exitJumps.push_back(emit(JUMP_IF_FALSE));
+				compile(part.expression);
+			} else {
+				unsigned int skip = emit(JUMP_IF_TRUE);
+				compile(part.expression);
+				program[skip].operand = program.size();
+			}
+			
+			if (isAnd && i + 1 < expr.rest.size() && expr.rest[i + 1].theOperator == OR) {
+				exitJumps.push_back(emit(JUMP_IF_FALSE));
+			}
+		}
+		
+		if (known) {
+			emit(LOAD_CONSTANT, value);
+		}
+		for (i = 0; i < exitJumps.size(); i++) {
+			program[exitJumps[i]].operand = program.size();
+		}
+	}
+	
 public:
 	Filter(const StaticString &source, bool debug = false)
 		: tokenizer(source, debug)
 	{
 		this->debug = debug;
+		referencedFields = 0;
 		lookahead = tokenizer.getNext();
 		root = matchMultiExpression(0);
 		logMatch(0, "end of data");
 		match(Tokenizer::END_OF_DATA);
+		compile(root);
+	}
+	
+	/**
+	 * Returns a mask of the context fields that this filter refers to.
+	 * Pass it to ContextFromLog so that it only extracts those.
+	 */
+	unsigned int getReferencedFields() const {
+		return referencedFields;
 	}
 	
-	bool run(const Context &ctx) {
-		return root->evaluate(ctx);
+	/** The number of instructions that the filter was compiled to. */
+	unsigned int getProgramSize() const {
+		return program.size();
+	}
+	
+	bool run(const Context &ctx) const {
+		const Instruction *instructions = &program[0];
+		unsigned int size = program.size();
+		unsigned int pc = 0;
+		bool acc = false;
+		
+		while (pc < size) {
+			const Instruction &instruction = instructions[pc];
+			switch (instruction.opcode) {
+			case LOAD_CONSTANT:
+				acc = instruction.operand;
+				pc++;
+				break;
+			case EVALUATE:
+				acc = components[instruction.operand]->evaluate(ctx);
+				pc++;
+				break;
+			case NEGATE:
+				acc = !acc;
+				pc++;
+				break;
+			case JUMP_IF_FALSE:
+				pc = acc ? pc + 1 : instruction.operand;
+				break;
+			case JUMP_IF_TRUE:
+				pc = acc ? instruction.operand : pc + 1;
+				break;
+			}
+		}
+		return acc;
 	}
 };
 
@@ -28,11 +28,17 @@
 #include <oxt/system_calls.hpp>
 #include <oxt/macros.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <string>
 #include <ostream>
 #include <sstream>
 #include <map>
+#include <list>
+#include <vector>
+#include <algorithm>
 #include <ev++.h>
+#include <zlib.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -45,6 +51,8 @@
 #include <agents/LoggingAgent/DataStoreId.h>
 #include <agents/LoggingAgent/RemoteSender.h>
 #include <agents/LoggingAgent/FilterSupport.h>
+#include <agents/LoggingAgent/MetricsAggregator.h>
+#include <agents/LoggingAgent/RequestStore.h>
 
 #include <EventedMessageServer.h>
 #include <MessageReadersWriters.h>
@@ -52,13 +60,17 @@
 #include <StaticString.h>
 #include <Exceptions.h>
 #include <Constants.h>
+#include <DTraceSupport.h>
+#include <UnionStationLogBatch.h>
 #include <Utils.h>
 #include <Utils/MD5.h>
 #include <Utils/IOUtils.h>
 #include <Utils/MessageIO.h>
 #include <Utils/VariantMap.h>
 #include <Utils/StrIntUtils.h>
-#include <Utils/StringMap.h>
+#include <Utils/FlatStringMap.h>
+#include <Utils/HeapTrim.h>
+#include <Utils/MetricsRegistry.h>
 
 
 namespace Passenger {
@@ -71,20 +83,32 @@ using namespace oxt;
 class LoggingServer: public EventedMessageServer {
 private:
 	static const int MAX_LOG_SINK_CACHE_SIZE = 512;
+	static const unsigned int MAX_FILTER_CACHE_SIZE = 256;
 	static const int GARBAGE_COLLECTION_TIMEOUT = 4500;  // 1 hour 15 minutes
+	static const unsigned int TRANSACTION_SHARD_COUNT = 16;
+	/** Larger than the largest transaction that a buffered Logger sends. */
+	static const unsigned int MAX_DATAGRAM_SIZE = 192 * 1024;
+	static const unsigned int MAX_DATAGRAMS_PER_ITERATION = 64;
+	static const unsigned long long DEFAULT_CLIENT_MEMORY_LIMIT = 32 * 1024 * 1024;
+	static const unsigned long long DEFAULT_MEMORY_LIMIT = 256 * 1024 * 1024;
 	
+	struct SharedState;
 	struct LogSink;
 	typedef boost::shared_ptr<LogSink> LogSinkPtr;
 	typedef map<string, LogSinkPtr> LogSinkCache;
 	
+	/**
+	 * A LogSink and its fields may only be accessed while holding
+	 * SharedState.sinksSyncher.
+	 */
 	struct LogSink {
-		LoggingServer *server;
+		SharedState *shared;
 		
 		/**
 		 * Marks how many times this LogSink is currently opened, i.e. the
 		 * number of Transaction objects currently referencing this LogSink.
 		 * @invariant
-		 *    (opened == 0) == (this LogSink is in LoggingServer.inactiveLogSinks)
+		 *    (opened == 0) == (this LogSink is in SharedState.inactiveLogSinks)
 		 */
 		int opened;
 		
@@ -98,20 +122,20 @@ private:
 		unsigned int writtenTo;
 		
 		/**
-		 * This LogSink's iterator inside LoggingServer.logSinkCache.
+		 * This LogSink's iterator inside SharedState.logSinkCache.
 		 */
 		LogSinkCache::iterator cacheIterator;
 		
 		/**
-		 * This LogSink's iterator inside LoggingServer.inactiveLogSinks.
+		 * This LogSink's iterator inside SharedState.inactiveLogSinks.
 		 * Only valid when opened == 0.
 		 */
 		list<LogSinkPtr>::iterator inactiveLogSinksIterator;
 		
-		LogSink(LoggingServer *_server) {
-			server = _server;
+		LogSink(SharedState *_shared) {
+			shared = _shared;
 			opened = 0;
-			lastUsed = ev_now(server->getLoop());
+			lastUsed = ev_time();
 			lastFlushed = lastUsed;
 			writtenTo = 0;
 		}
@@ -137,19 +161,63 @@ private:
 		}
 		
 		virtual bool flush() {
-			lastFlushed = ev_now(server->getLoop());
+			lastFlushed = ev_time();
 			return true;
 		}
 		
 		virtual void dump(ostream &stream) const { }
 	};
 	
+	/**
+	 * Appends data to a file. Data is buffered, and written out with a
+	 * single writev() call when the buffer is full, when the sink is
+	 * flushed, or at the end of the current event loop iteration. So under
+	 * load, all data appended during an event loop iteration is written at
+	 * once, while an idle server writes data out right away.
+	 *
+	 * If a sync interval is configured, then flushing also calls
+	 * fdatasync() at most once per that interval, so that all data written
+	 * in the mean time is committed to disk at once.
+	 */
 	struct LogFileSink: public LogSink {
+		static const unsigned int BUFFER_CAPACITY = 64 * 1024;
+		
 		string filename;
 		FileDescriptor fd;
+		string buffer;
+		/** Whether this sink is in SharedState.dirtyFileSinks. */
+		bool dirty;
+		/** Last time fdatasync() was called. */
+		ev_tstamp lastSynced;
+		
+		void write(const StaticString data[], unsigned int count) {
+			try {
+				gatheredWrite(fd, data, count);
+			} catch (const SystemException &e) {
+				P_ERROR("Cannot write to " << filename << ": " << e.what());
+			}
+		}
+		
+		void sync() {
+			int ret;
+			do {
+				#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+					ret = fsync(fd);
+				#else
+					ret = fdatasync(fd);
+				#endif
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1 && errno != EINVAL) {
+				// EINVAL means that the file, e.g. /dev/null, doesn't support syncing.
+				int e = errno;
+				P_ERROR("Cannot sync " << filename << ": " << strerror(e) <<
+					" (errno=" << e << ")");
+			}
+			lastSynced = ev_time();
+		}
 		
-		LogFileSink(LoggingServer *server, const string &filename)
-			: LogSink(server)
+		LogFileSink(SharedState *shared, const string &filename)
+			: LogSink(shared)
 		{
 			if (filename.empty()) {
 				this->filename = "/dev/null";
@@ -163,15 +231,51 @@ private:
 				int e = errno;
 				throw FileSystemException("Cannnot open file", e, filename);
 			}
+			buffer.reserve(BUFFER_CAPACITY);
+			dirty = false;
+			lastSynced = ev_time();
 		}
 		
 		virtual ~LogFileSink() {
 			flush();
+			if (dirty) {
+				shared->removeDirtyFileSink(this);
+			}
 		}
 		
 		virtual void append(const DataStoreId &dataStoreId, const StaticString &data) {
 			LogSink::append(dataStoreId, data);
-			syscalls::write(fd, data.data(), data.size());
+			if (buffer.size() + data.size() > BUFFER_CAPACITY) {
+				StaticString data2[2];
+				data2[0] = buffer;
+				data2[1] = data;
+				write(data2, 2);
+				buffer.clear();
+			} else {
+				buffer.append(data.data(), data.size());
+				if (!dirty) {
+					dirty = true;
+					shared->addDirtyFileSink(this);
+				}
+			}
+		}
+		
+		void writeBuffer() {
+			if (!buffer.empty()) {
+				StaticString data(buffer);
+				write(&data, 1);
+				buffer.clear();
+			}
+		}
+		
+		virtual bool flush() {
+			writeBuffer();
+			if (shared->dumpFileSyncInterval > 0
+			 && ev_time() - lastSynced >= shared->dumpFileSyncInterval)
+			{
+				sync();
+			}
+			return LogSink::flush();
 		}
 
 		virtual void dump(ostream &stream) const {
@@ -180,24 +284,23 @@ private:
 			stream << "     LastUsed   : " << distanceOfTimeInWords((time_t) lastUsed) << " ago\n";
 			stream << "     LastFlushed: " << distanceOfTimeInWords((time_t) lastFlushed) << " ago\n";
 			stream << "     WrittenTo  : " << writtenTo << "\n";
+			stream << "     BufferSize : " << buffer.size() << "\n";
 		}
 	};
 	
 	typedef boost::shared_ptr<LogFileSink> LogFileSinkPtr;
 	
 	struct RemoteSink: public LogSink {
-		/* RemoteSender compresses the data with zlib before sending it
-		 * to the server. Even including Base64 and URL encoding overhead,
-		 * this compresses the data to about 25% of its original size.
-		 * Therefore we set a buffer capacity of a little less than 4 times
-		 * the TCP maximum segment size so that we can send as much
-		 * data as possible to the server in a single TCP segment.
-		 * With the "little less" we take into account:
+		/* Data is compressed with zlib as it comes in. Even including
+		 * Base64 and URL encoding overhead, this compresses the data to
+		 * about 25% of its original size, so the buffer holds about 4 times
+		 * its capacity in log data. We set a buffer capacity of a little
+		 * less than 4 times the TCP maximum segment size. With the "little
+		 * less" we take into account:
 		 * - HTTPS overhead. This can be as high as 2 KB.
-		 * - The fact that RemoteSink.append() might try to flush the
-		 *   current buffer the current data. Empirical evidence has
-		 *   shown that the data for a request transaction is usually
-		 *   less than 5 KB.
+		 * - The fact that zlib holds some data internally until the stream
+		 *   is finished. Empirical evidence has shown that the data for
+		 *   a request transaction is usually less than 5 KB.
 		 */
 		static const unsigned int BUFFER_CAPACITY =
 			4 * 64 * 1024 -
@@ -206,21 +309,83 @@ private:
 		string unionStationKey;
 		string nodeName;
 		string category;
-		char buffer[BUFFER_CAPACITY];
+		/** Compressed data, or raw data if compression is unavailable. */
+		string buffer;
+		/** The amount of uncompressed data in the buffer and in `strm`. */
 		unsigned int bufferSize;
+		z_stream strm;
+		bool compressing;
+		/** Number of packets that RemoteSender dropped because its queue was full. */
+		unsigned int droppedPackets;
 		
-		RemoteSink(LoggingServer *server, const string &unionStationKey,
+		void deflateInto(int flush) {
+			unsigned char out[16 * 1024];
+			int ret;
+			
+			do {
+				strm.avail_out = sizeof(out);
+				strm.next_out  = out;
+				ret = deflate(&strm, flush);
+				assert(ret != Z_STREAM_ERROR);
+				buffer.append((const char *) out, sizeof(out) - strm.avail_out);
+			} while (strm.avail_out == 0);
+			(void) ret;
+		}
+		
+		bool sendBuffer() {
+			if (bufferSize > 0) {
+				if (compressing) {
+					deflateInto(Z_FINISH);
+				}
+				lastFlushed = ev_time();
+				PASSENGER_PROBE3(union_station_flush, category.c_str(),
+					(unsigned long long) bufferSize,
+					(unsigned long long) buffer.size());
+				StaticString data(buffer);
+				if (!shared->remoteSender.schedule(unionStationKey, nodeName,
+					category, &data, 1, compressing))
+				{
+					droppedPackets++;
+				}
+				P_DEBUG("Flushed remote sink " << inspect() << ": " << bufferSize <<
+					" bytes (" << buffer.size() << " bytes compressed)");
+				buffer.clear();
+				bufferSize = 0;
+				if (compressing) {
+					deflateReset(&strm);
+				}
+				return true;
+			} else {
+				P_DEBUG("Flushed remote sink " << inspect() << ": 0 bytes");
+				return false;
+			}
+		}
+		
+		RemoteSink(SharedState *shared, const string &unionStationKey,
 			const string &nodeName, const string &category)
-			: LogSink(server)
+			: LogSink(shared)
 		{
 			this->unionStationKey = unionStationKey;
 			this->nodeName = nodeName;
 			this->category = category;
 			this->bufferSize = 0;
+			this->droppedPackets = 0;
+			buffer.reserve(BUFFER_CAPACITY);
+			
+			strm.zalloc = Z_NULL;
+			strm.zfree  = Z_NULL;
+			strm.opaque = Z_NULL;
+			compressing = deflateInit(&strm, Z_DEFAULT_COMPRESSION) == Z_OK;
+			if (!compressing) {
+				P_WARN("Cannot initialize zlib; sending Union Station data uncompressed");
+			}
 		}
 		
 		virtual ~RemoteSink() {
-			flush();
+			sendBuffer();
+			if (compressing) {
+				deflateEnd(&strm);
+			}
 		}
 		
 		virtual bool isRemote() const {
@@ -233,33 +398,30 @@ private:
 		
 		virtual void append(const DataStoreId &dataStoreId, const StaticString &data) {
 			LogSink::append(dataStoreId, data);
-			if (bufferSize + data.size() > BUFFER_CAPACITY) {
-				StaticString data2[2];
-				data2[0] = StaticString(buffer, bufferSize);
-				data2[1] = data;
-				
-				server->remoteSender.schedule(unionStationKey, nodeName,
-					category, data2, 2);
-				lastFlushed = ev_now(server->getLoop());
-				bufferSize = 0;
+			if (compressing) {
+				strm.avail_in = data.size();
+				strm.next_in  = (unsigned char *) data.data();
+				deflateInto(Z_NO_FLUSH);
+				assert(strm.avail_in == 0);
 			} else {
-				memcpy(buffer + bufferSize, data.data(), data.size());
-				bufferSize += data.size();
+				buffer.append(data.data(), data.size());
+			}
+			bufferSize += data.size();
+			if (buffer.size() >= BUFFER_CAPACITY) {
+				sendBuffer();
 			}
 		}
 		
 		virtual bool flush() {
-			if (bufferSize > 0) {
-				lastFlushed = ev_now(server->getLoop());
-				StaticString data(buffer, bufferSize);
-				server->remoteSender.schedule(unionStationKey, nodeName,
-					category, &data, 1);
-				bufferSize = 0;
-				P_DEBUG("Flushed remote sink " << inspect() << ": " << bufferSize << " bytes");
-				return true;
-			} else {
-				P_DEBUG("Flushed remote sink " << inspect() << ": 0 bytes");
+			if (bufferSize > 0 && shared->remoteSender.congested()) {
+				// Keep buffering while RemoteSender catches up, so that it
+				// gets fewer, larger packets. The buffer is still sent
+				// out as soon as it's full.
+				P_DEBUG("Postponing flush of remote sink " << inspect() <<
+					": the Union Station gateway isn't keeping up");
 				return false;
+			} else {
+				return sendBuffer();
 			}
 		}
 
@@ -276,12 +438,17 @@ private:
 			stream << "     LastUsed   : " << distanceOfTimeInWords((time_t) lastUsed) << " ago\n";
 			stream << "     LastFlushed: " << distanceOfTimeInWords((time_t) lastFlushed) << " ago\n";
 			stream << "     WrittenTo  : " << writtenTo << "\n";
-			stream << "     BufferSize : " << bufferSize << "\n";
+			stream << "     BufferSize : " << bufferSize << " (" << buffer.size() << " compressed)\n";
+			stream << "     Dropped    : " << droppedPackets << " packets\n";
 		}
 	};
 	
+	/**
+	 * A Transaction's fields may only be modified while holding the lock
+	 * of the TransactionShard that it belongs to.
+	 */
 	struct Transaction {
-		LoggingServer *server;
+		SharedState *shared;
 		LogSinkPtr logSink;
 		ev_tstamp createdAt;
 		string txnId;
@@ -289,22 +456,79 @@ private:
 		unsigned int writeCount;
 		int refcount;
 		bool crashProtect, discarded;
+		/**
+		 * Whether the data was dropped because a memory limit was hit.
+		 * Only a "DISCARDED: memory" entry is written to the log sink.
+		 */
+		bool evicted;
 		string data;
 		string filters;
+		/** Only set if this transaction is sent to Union Station. */
+		string unionStationKey;
 		
-		Transaction(LoggingServer *server, ev_tstamp createdAt) {
-			this->server = server;
+		Transaction(SharedState *shared, ev_tstamp createdAt) {
+			this->shared = shared;
 			this->createdAt = createdAt;
+			evicted = false;
 			data.reserve(8 * 1024);
+			shared->transactionMemory += data.capacity();
 		}
 		
 		~Transaction() {
 			if (logSink != NULL) {
-				if (!discarded && passesFilter()) {
+				bool passes = !discarded && (evicted || passesFilter());
+				if (passes && !evicted && getCategory() == "requests") {
+					if (shared->requestStore != NULL) {
+						store();
+					}
+					if (shared->aggregatesMetrics() && !unionStationKey.empty()) {
+						passes = aggregate();
+					}
+				}
+				boost::lock_guard<boost::mutex> l(shared->sinksSyncher);
+				if (passes) {
 					logSink->append(dataStoreId, data);
 				}
-				server->closeLogSink(logSink);
+				shared->closeLogSink(logSink);
 			}
+			shared->transactionMemory -= data.capacity();
+		}
+		
+		/**
+		 * Returns by how many bytes the memory used by this transaction
+		 * grew.
+		 */
+		size_t appendEntry(const StaticString &timestamp, const StaticString &entry) {
+			if (discarded || evicted) {
+				return 0;
+			}
+			
+			size_t oldCapacity = data.capacity();
+			char writeCountStr[sizeof(unsigned int) * 2 + 1];
+			integerToHexatri(writeCount, writeCountStr);
+			writeCount++;
+			data.append(txnId);
+			data.append(" ");
+			data.append(timestamp);
+			data.append(" ");
+			data.append(writeCountStr);
+			data.append(" ");
+			data.append(entry);
+			data.append("\n");
+			if (data.capacity() > oldCapacity) {
+				shared->transactionMemory += data.capacity() - oldCapacity;
+				return data.capacity() - oldCapacity;
+			} else {
+				return 0;
+			}
+		}
+		
+		void appendDetachEntry() {
+			char timestamp[2 * sizeof(unsigned long long) + 1];
+			// Must use System::getUsec() here instead of ev_now() because the
+			// precision of the time is very important.
+			integerToHexatri<unsigned long long>(SystemTime::getUsec(), timestamp);
+			appendEntry(timestamp, "DETACH");
 		}
 		
 		StaticString getGroupName() const {
@@ -324,6 +548,20 @@ private:
 			discarded = true;
 		}
 		
+		/**
+		 * Frees the data logged so far because a memory limit was hit,
+		 * and ignores everything that is logged from now on.
+		 */
+		void evict() {
+			char timestamp[2 * sizeof(unsigned long long) + 1];
+			integerToHexatri<unsigned long long>(SystemTime::getUsec(), timestamp);
+			shared->transactionMemory -= data.capacity();
+			string().swap(data);
+			appendEntry(timestamp, "DISCARDED: memory");
+			evicted = true;
+			shared->transactionsEvicted++;
+		}
+		
 		void dump(ostream &stream) const {
 			stream << "   * Transaction " << txnId << "\n";
 			stream << "     Created at: " << distanceOfTimeInWords((time_t) createdAt) << " ago\n";
@@ -331,9 +569,48 @@ private:
 			stream << "     Node      : " << getNodeName() << "\n";
 			stream << "     Category  : " << getCategory() << "\n";
 			stream << "     Refcount  : " << refcount << "\n";
+			stream << "     Memory    : " << data.capacity() << " bytes" <<
+				(evicted ? " (evicted)" : "") << "\n";
 		}
 	
 	private:
+		/** Adds this request to the local request store. */
+		void store() {
+			FilterSupport::ContextFromLog ctx(data);
+			RequestStore::Request request;
+			request.timestamp = (unsigned long long) (createdAt * 1000000);
+			request.app = getGroupName();
+			request.uri = ctx.getURI();
+			request.controllerAction = ctx.getControllerAction();
+			request.status = ctx.getStatus();
+			request.statusCode = ctx.getStatusCode();
+			request.responseTime = ctx.getResponseTime();
+			request.gcTime = ctx.getGcTime();
+			request.cpuTime = ctx.getCpuTime();
+			request.allocations = ctx.getAllocations();
+			shared->requestStore->add(request);
+		}
+		
+		/**
+		 * Records this request in the metrics aggregator. Returns whether
+		 * the raw transaction log should be sent as well: failed requests
+		 * are always sent, other requests are sampled.
+		 */
+		bool aggregate() {
+			FilterSupport::ContextFromLog ctx(data,
+				FilterSupport::Context::fieldMask(FilterSupport::Context::CONTROLLER)
+				| FilterSupport::Context::fieldMask(FilterSupport::Context::RESPONSE_TIME)
+				| FilterSupport::Context::fieldMask(FilterSupport::Context::STATUS_CODE)
+				| FilterSupport::Context::fieldMask(FilterSupport::Context::CPU_TIME));
+			string controllerAction = ctx.getControllerAction();
+			int statusCode = ctx.getStatusCode();
+			
+			shared->metricsAggregator.record(unionStationKey, getNodeName(),
+				getGroupName(), controllerAction, ctx.getResponseTime(),
+				statusCode, ctx.getCpuTime(), ctx.getAllocations());
+			return statusCode >= 500 || shared->sampleRawLog();
+		}
+		
 		bool passesFilter() {
 			if (filters.empty()) {
 				return true;
@@ -341,12 +618,14 @@ private:
 			
 			const char *current = filters.data();
 			const char *end     = filters.data() + filters.size();
-			bool result         = true;
-			FilterSupport::ContextFromLog ctx(data);
+			vector<FilterPtr> compiledFilters;
+			unsigned int fields = 0;
+			ev_tstamp now = ev_time();
 			
 			// 'filters' may contain multiple filter sources, separated
-			// by '\1' characters. Process each.
-			while (current < end && result) {
+			// by '\1' characters. Compile each, so that we know which
+			// fields have to be extracted from the data.
+			while (current < end) {
 				StaticString tmp(current, end - current);
 				size_t pos = tmp.find('\1');
 				if (pos == string::npos) {
@@ -354,16 +633,441 @@ private:
 				}
 				
 				StaticString source(current, pos);
-				FilterSupport::Filter &filter = server->compileFilter(source);
-				result = filter.run(ctx);
+				FilterPtr filter = shared->compileFilter(source, now);
+				fields |= filter->getReferencedFields();
+				compiledFilters.push_back(filter);
 				
 				current = tmp.data() + pos + 1;
 			}
-			return result;
+			
+			FilterSupport::ContextFromLog ctx(data, fields);
+			vector<FilterPtr>::const_iterator it;
+			for (it = compiledFilters.begin(); it != compiledFilters.end(); it++) {
+				if (!(*it)->run(ctx)) {
+					return false;
+				}
+			}
+			return true;
 		}
 	};
 	
 	typedef boost::shared_ptr<Transaction> TransactionPtr;
+	typedef map<string, TransactionPtr> TransactionMap;
+	typedef boost::shared_ptr<FilterSupport::Filter> FilterPtr;
+	
+	struct CachedFilter {
+		FilterPtr filter;
+		ev_tstamp lastUsed;
+		
+		CachedFilter() {
+			lastUsed = 0;
+		}
+	};
+	
+	struct TransactionShard {
+		boost::mutex syncher;
+		TransactionMap transactions;
+	};
+	
+	/**
+	 * The state that all LoggingServers serving the same socket share, each
+	 * on its own event loop. Clients on different event loops may open the
+	 * same transaction, so transactions are kept here, sharded by
+	 * transaction ID so that event loops rarely contend for the same lock.
+	 *
+	 * Lock order: a TransactionShard lock, then `sinksSyncher`, then
+	 * `filtersSyncher`.
+	 */
+	struct SharedState {
+		RemoteSender remoteSender;
+		TransactionShard shards[TRANSACTION_SHARD_COUNT];
+		
+		/** Protects the fields that follow, and all LogSinks. */
+		boost::mutex sinksSyncher;
+		LogSinkCache logSinkCache;
+		/**
+		 * @invariant
+		 *    inactiveLogSinks is sorted from oldest to youngest (by lastTime member).
+		 *    for all s in inactiveLogSinks:
+		 *       s.opened == 0
+		 *    inactiveLogSinks.size() == inactiveLogSinksCount
+		 */
+		list<LogSinkPtr> inactiveLogSinks;
+		int inactiveLogSinksCount;
+		
+		/** Protects `filters`. */
+		boost::mutex filtersSyncher;
+		FlatStringMap<CachedFilter> filters;
+		
+		const int sinkFlushInterval;
+		const string dumpFile;
+		/** How often LogFileSinks call fdatasync(), in seconds. 0 means never. */
+		const int dumpFileSyncInterval;
+		/**
+		 * LogFileSinks with data that must be written out at the end of the
+		 * current event loop iteration. Protected by `sinksSyncher`.
+		 */
+		vector<LogFileSink *> dirtyFileSinks;
+		boost::atomic<bool> hasDirtyFileSinks;
+		
+		/** The number of clients of all LoggingServers together. */
+		boost::atomic<unsigned int> clientCount;
+		boost::atomic<bool> refuseNewConnections;
+		boost::atomic<bool> exitRequested;
+		
+		boost::mutex serversSyncher;
+		vector<LoggingServer *> servers;
+		
+		MetricsAggregator metricsAggregator;
+		/**
+		 * How often request metrics are sent to Union Station, in seconds.
+		 * 0 means that metrics are not aggregated.
+		 */
+		const int metricsInterval;
+		/**
+		 * When aggregating metrics, only 1 out of this many successful
+		 * request transactions is sent to Union Station in full.
+		 */
+		const unsigned int rawLogSampleRate;
+		boost::atomic<unsigned int> rawLogSampleCounter;
+		
+		/**
+		 * The memory used by the data of all open transactions, and the
+		 * limits on it. A client that is accountable for more than
+		 * `clientMemoryLimit` bytes of transaction data gets its oldest
+		 * transactions evicted. When all clients together hit `memoryLimit`,
+		 * LoggingServers stop reading from their clients until the usage
+		 * drops, evicting the oldest transactions if it doesn't. 0 means
+		 * unlimited.
+		 */
+		boost::atomic<unsigned long long> transactionMemory;
+		const unsigned long long clientMemoryLimit;
+		const unsigned long long memoryLimit;
+		boost::atomic<unsigned int> transactionsEvicted;
+		
+		/** Where each LoggingServer registers its metrics. */
+		MetricsRegistryPtr metrics;
+		
+		/** Only set if the analytics_store_dir option is set. */
+		boost::shared_ptr<RequestStore> requestStore;
+		
+		SharedState(const VariantMap &options)
+			: remoteSender(
+			      options.get("union_station_gateway_address", false, DEFAULT_UNION_STATION_GATEWAY_ADDRESS),
+			      options.getInt("union_station_gateway_port", false, DEFAULT_UNION_STATION_GATEWAY_PORT),
+			      options.get("union_station_gateway_cert", false, ""),
+			      options.get("union_station_proxy_address", false),
+			      options.getInt("union_station_sender_threads", false,
+			          RemoteSender::DEFAULT_THREADS),
+			      options.get("union_station_spool_file", false),
+			      options.getULL("union_station_spool_max_size", false,
+			          RemoteSender::DEFAULT_SPOOL_MAX_SIZE)),
+			  sinkFlushInterval(options.getInt("analytics_sink_flush_interval", false, 0)),
+			  dumpFile(options.get("analytics_dump_file", false, "/dev/null")),
+			  dumpFileSyncInterval(options.getInt("analytics_dump_file_sync_interval", false, 0)),
+			  metricsAggregator(SystemTime::get()),
+			  metricsInterval(options.getInt("union_station_metrics_interval", false, 0)),
+			  rawLogSampleRate(std::max(1, options.getInt("union_station_raw_log_sample_rate", false, 1))),
+			  clientMemoryLimit(options.getULL("analytics_client_memory_limit", false,
+			      DEFAULT_CLIENT_MEMORY_LIMIT)),
+			  memoryLimit(options.getULL("analytics_memory_limit", false,
+			      DEFAULT_MEMORY_LIMIT))
+		{
+			inactiveLogSinksCount = 0;
+			hasDirtyFileSinks = false;
+			clientCount = 0;
+			refuseNewConnections = false;
+			exitRequested = false;
+			rawLogSampleCounter = 0;
+			transactionMemory = 0;
+			transactionsEvicted = 0;
+			metrics = boost::make_shared<MetricsRegistry>();
+			if (!options.get("analytics_store_dir", false).empty()) {
+				requestStore = boost::make_shared<RequestStore>(
+					options.get("analytics_store_dir"),
+					options.getInt("analytics_store_partition_duration", false, 3600),
+					options.getInt("analytics_store_retention", false, 7 * 24 * 3600),
+					options.getULL("analytics_store_max_size", false,
+						1024ull * 1024 * 1024));
+			}
+		}
+		
+		~SharedState() {
+			for (unsigned int i = 0; i < TRANSACTION_SHARD_COUNT; i++) {
+				TransactionMap::iterator it, end = shards[i].transactions.end();
+				for (it = shards[i].transactions.begin(); it != end; it++) {
+					TransactionPtr &transaction = it->second;
+					if (transaction->crashProtect) {
+						transaction->appendDetachEntry();
+					} else {
+						transaction->discard();
+					}
+				}
+			}
+			
+			// Invoke destructors, causing all transactions and log sinks to
+			// be flushed before RemoteSender is being destroyed.
+			for (unsigned int i = 0; i < TRANSACTION_SHARD_COUNT; i++) {
+				shards[i].transactions.clear();
+			}
+			logSinkCache.clear();
+			inactiveLogSinks.clear();
+			if (aggregatesMetrics()) {
+				sendMetrics();
+			}
+		}
+		
+		bool aggregatesMetrics() const {
+			return metricsInterval > 0;
+		}
+		
+		bool sampleRawLog() {
+			return rawLogSampleCounter.fetch_add(1) % rawLogSampleRate == 0;
+		}
+		
+		void sendMetrics() {
+			vector<MetricsAggregator::Summary> summaries;
+			vector<MetricsAggregator::Summary>::const_iterator it;
+			
+			metricsAggregator.takeSummaries(summaries, SystemTime::get());
+			for (it = summaries.begin(); it != summaries.end(); it++) {
+				StaticString data(it->data);
+				P_DEBUG("Sending metrics summary for Union Station key " <<
+					it->unionStationKey << ", node " << it->nodeName <<
+					": " << data.size() << " bytes");
+				remoteSender.schedule(it->unionStationKey, it->nodeName,
+					"metrics", &data, 1);
+			}
+		}
+		
+		TransactionShard &getShard(const StaticString &txnId) {
+			// FNV-1a
+			unsigned int hash = 2166136261u;
+			const char *current = txnId.data();
+			const char *end = txnId.data() + txnId.size();
+			while (current < end) {
+				hash = (hash ^ (unsigned char) *current) * 16777619u;
+				current++;
+			}
+			return shards[hash % TRANSACTION_SHARD_COUNT];
+		}
+		
+		/** Must be called while holding `sinksSyncher`. */
+		void addDirtyFileSink(LogFileSink *sink) {
+			dirtyFileSinks.push_back(sink);
+			hasDirtyFileSinks = true;
+		}
+		
+		/** Must be called while holding `sinksSyncher`. */
+		void removeDirtyFileSink(LogFileSink *sink) {
+			dirtyFileSinks.erase(std::remove(dirtyFileSinks.begin(),
+				dirtyFileSinks.end(), sink), dirtyFileSinks.end());
+		}
+		
+		void writeDirtyFileSinks() {
+			if (!hasDirtyFileSinks) {
+				return;
+			}
+			boost::lock_guard<boost::mutex> l(sinksSyncher);
+			vector<LogFileSink *>::iterator it, end = dirtyFileSinks.end();
+			for (it = dirtyFileSinks.begin(); it != end; it++) {
+				(*it)->writeBuffer();
+				(*it)->dirty = false;
+			}
+			dirtyFileSinks.clear();
+			hasDirtyFileSinks = false;
+		}
+		
+		/** Must be called while holding `sinksSyncher`. */
+		LogSinkPtr openLogFile() {
+			string cacheKey = "file:" + dumpFile;
+			LogSinkPtr result;
+			LogSinkCache::iterator it = logSinkCache.find(cacheKey);
+			if (it == logSinkCache.end()) {
+				trimLogSinkCache(MAX_LOG_SINK_CACHE_SIZE - 1);
+				result = boost::make_shared<LogFileSink>(this, dumpFile);
+				pair<LogSinkCache::iterator, bool> p =
+					logSinkCache.insert(make_pair(cacheKey, result));
+				result->cacheIterator = p.first;
+				result->opened = 1;
+			} else {
+				result = it->second;
+				result->opened++;
+				if (result->opened == 1) {
+					inactiveLogSinks.erase(result->inactiveLogSinksIterator);
+					inactiveLogSinksCount--;
+				}
+			}
+			return result;
+		}
+		
+		/** Must be called while holding `sinksSyncher`. */
+		LogSinkPtr openRemoteSink(const StaticString &unionStationKey, const string &nodeName,
+			const string &category)
+		{
+			string cacheKey = "remote:";
+			cacheKey.append(unionStationKey.c_str(), unionStationKey.size());
+			cacheKey.append(1, '\0');
+			cacheKey.append(nodeName);
+			cacheKey.append(1, '\0');
+			cacheKey.append(category);
+			
+			LogSinkPtr result;
+			LogSinkCache::iterator it = logSinkCache.find(cacheKey);
+			if (it == logSinkCache.end()) {
+				trimLogSinkCache(MAX_LOG_SINK_CACHE_SIZE - 1);
+				result = boost::make_shared<RemoteSink>(this, unionStationKey,
+					nodeName, category);
+				pair<LogSinkCache::iterator, bool> p =
+					logSinkCache.insert(make_pair(cacheKey, result));
+				result->cacheIterator = p.first;
+				result->opened = 1;
+			} else {
+				result = it->second;
+				result->opened++;
+				if (result->opened == 1) {
+					inactiveLogSinks.erase(result->inactiveLogSinksIterator);
+					inactiveLogSinksCount--;
+				}
+			}
+			return result;
+		}
+		
+		/**
+		 * 'Closes' the given log sink. It's not actually deleted from memory;
+		 * instead it's marked as inactive and cached for later use. May be
+		 * deleted later when resources are low.
+		 *
+		 * No need to call this manually. Automatically called by Transaction's
+		 * destructor. Must be called while holding `sinksSyncher`.
+		 */
+		void closeLogSink(const LogSinkPtr &logSink) {
+			logSink->opened--;
+			assert(logSink->opened >= 0);
+			logSink->lastUsed = ev_time();
+			if (logSink->opened == 0) {
+				inactiveLogSinks.push_back(logSink);
+				logSink->inactiveLogSinksIterator = inactiveLogSinks.end();
+				logSink->inactiveLogSinksIterator--;
+				inactiveLogSinksCount++;
+				trimLogSinkCache(MAX_LOG_SINK_CACHE_SIZE);
+			}
+		}
+		
+		/** Try to reduce the log sink cache size to the given size.
+		 * Must be called while holding `sinksSyncher`. */
+		void trimLogSinkCache(unsigned int size) {
+			while (!inactiveLogSinks.empty() && logSinkCache.size() > size) {
+				const LogSinkPtr logSink = inactiveLogSinks.front();
+				inactiveLogSinks.pop_front();
+				inactiveLogSinksCount--;
+				logSinkCache.erase(logSink->cacheIterator);
+			}
+		}
+		
+		/* Release all inactive log sinks that have been inactive for more than
+		 * GARBAGE_COLLECTION_TIMEOUT seconds. Must be called while holding
+		 * `sinksSyncher`.
+		 */
+		void releaseInactiveLogSinks(ev_tstamp now) {
+			bool done = false;
+			
+			while (!done && !inactiveLogSinks.empty()) {
+				const LogSinkPtr logSink = inactiveLogSinks.front();
+				if (now - logSink->lastUsed >= GARBAGE_COLLECTION_TIMEOUT) {
+					inactiveLogSinks.pop_front();
+					inactiveLogSinksCount--;
+					logSinkCache.erase(logSink->cacheIterator);
+				} else {
+					done = true;
+				}
+			}
+		}
+		
+		ev_tstamp getFlushInterval(const LogSink *sink) const {
+			if (sinkFlushInterval == 0) {
+				return sink->defaultFlushInterval();
+			} else {
+				return sinkFlushInterval;
+			}
+		}
+		
+		/** Flushes all sinks, or only those whose flush interval has passed. */
+		void flushSinks(bool all) {
+			boost::lock_guard<boost::mutex> l(sinksSyncher);
+			LogSinkCache::iterator it;
+			LogSinkCache::iterator end = logSinkCache.end();
+			ev_tstamp now = ev_time();
+			
+			for (it = logSinkCache.begin(); it != end; it++) {
+				LogSink *sink = it->second.get();
+				if (all || now - sink->lastFlushed >= getFlushInterval(sink)) {
+					sink->flush();
+				}
+			}
+			if (requestStore != NULL) {
+				requestStore->flush();
+			}
+		}
+		
+		/**
+		 * Returns the compiled version of the given filter source. Compiled
+		 * filters are cached; if the cache is full then the least recently
+		 * used filter is evicted.
+		 */
+		FilterPtr compileFilter(const StaticString &source, ev_tstamp now) {
+			boost::lock_guard<boost::mutex> l(filtersSyncher);
+			FlatStringMap<CachedFilter>::iterator it = filters.find(source);
+			if (it != filters.end()) {
+				it->second.lastUsed = now;
+				return it->second.filter;
+			}
+			
+			CachedFilter cachedFilter;
+			cachedFilter.filter = boost::make_shared<FilterSupport::Filter>(source);
+			cachedFilter.lastUsed = now;
+			if (filters.size() >= MAX_FILTER_CACHE_SIZE) {
+				FlatStringMap<CachedFilter>::iterator end = filters.end();
+				FlatStringMap<CachedFilter>::iterator oldest = filters.begin();
+				for (it = filters.begin(); it != end; it++) {
+					if (it->second.lastUsed < oldest->second.lastUsed) {
+						oldest = it;
+					}
+				}
+				filters.remove(oldest->first.toString());
+			}
+			filters.set(source, cachedFilter);
+			return cachedFilter.filter;
+		}
+		
+		/**
+		 * Removes compiled filters that haven't been used for
+		 * GARBAGE_COLLECTION_TIMEOUT seconds.
+		 */
+		void releaseUnusedFilters(ev_tstamp now) {
+			boost::lock_guard<boost::mutex> l(filtersSyncher);
+			FlatStringMap<CachedFilter>::iterator it;
+			FlatStringMap<CachedFilter>::iterator end = filters.end();
+			vector<string> sources;
+			
+			for (it = filters.begin(); it != end; it++) {
+				if (now - it->second.lastUsed >= GARBAGE_COLLECTION_TIMEOUT) {
+					sources.push_back(it->first.toString());
+				}
+			}
+			for (unsigned int i = 0; i < sources.size(); i++) {
+				filters.remove(sources[i]);
+			}
+		}
+		
+		/** Removes all compiled filters. */
+		void releaseAllFilters() {
+			boost::lock_guard<boost::mutex> l(filtersSyncher);
+			filters.clear();
+		}
+	};
+	
+	typedef boost::shared_ptr<SharedState> SharedStatePtr;
 	
 	enum ClientType {
 		UNINITIALIZED,
@@ -375,11 +1079,20 @@ private:
 		ClientType type;
 		char nodeId[MD5_HEX_SIZE];
 		/**
-		 * Set of transaction IDs opened by this client.
-		 * @invariant This is a subset of the transaction IDs in the 'transactions' member.
+		 * Transaction IDs opened by this client, mapped to the number of
+		 * bytes of transaction data that this client is accountable for.
+		 * @invariant The keys are a subset of the transaction IDs in the 'transactions' member.
 		 */
-		set<string> openTransactions;
+		map<string, size_t> openTransactions;
+		/** The sum of the values in `openTransactions`. */
+		unsigned long long transactionMemory;
+		/** Whether reading was stopped because the global memory limit was hit. */
+		bool paused;
+		/** Whether the client sends log entries in the binary format. */
+		bool binaryLogs;
 		ScalarMessage dataReader;
+		/** Whether dataReader is reading a "logBatch" or a "log" message. */
+		bool readingLogBatch;
 		TransactionPtr currentTransaction;
 		string currentTimestamp;
 		
@@ -387,7 +1100,12 @@ private:
 			: EventedMessageClient(loop, fd)
 		{
 			type = UNINITIALIZED;
-			dataReader.setMaxSize(1024 * 128);
+			transactionMemory = 0;
+			paused = false;
+			binaryLogs = false;
+			readingLogBatch = false;
+			// Leave room for the framing overhead of a full Logger buffer.
+			dataReader.setMaxSize(1024 * 132);
 		}
 
 		template<typename Stream>
@@ -395,45 +1113,49 @@ private:
 			stream << "   * Client " << (int) fd << "\n";
 			stream << "     Initialized      : " << bool(type == LOGGER) << "\n";
 			stream << "     Node name        : " << nodeName << "\n";
+			stream << "     Binary logs      : " << binaryLogs << "\n";
 			stream << "     Open transactions: (" << openTransactions.size() << ")";
-			set<string>::const_iterator it, end = openTransactions.end();
+			map<string, size_t>::const_iterator it, end = openTransactions.end();
 			for (it = openTransactions.begin(); it != end; it++) {
-				stream << " " << *it;
+				stream << " " << it->first;
 			}
 			stream << "\n";
+			stream << "     Memory           : " << transactionMemory << " bytes" <<
+				(paused ? " (paused)" : "") << "\n";
 			stream << "     Connection state : " << getStateName() << "\n";
 			stream << "     Message state    : " << messageServer.getStateName() << "\n";
-			stream << "     Outbox           : " << outbox.size() << " bytes\n";
+			stream << "     Outbox           : " << pendingWrites() << " bytes\n";
 		}
 	};
 	
 	typedef boost::shared_ptr<Client> ClientPtr;
-	typedef map<string, TransactionPtr> TransactionMap;
-	
-	typedef boost::shared_ptr<FilterSupport::Filter> FilterPtr;
 	
-	RemoteSender remoteSender;
+	const SharedStatePtr shared;
 	ev::timer garbageCollectionTimer;
 	ev::timer sinkFlushingTimer;
 	ev::timer exitTimer;
-	TransactionMap transactions;
-	LogSinkCache logSinkCache;
-	/**
-	 * @invariant
-	 *    inactiveLogSinks is sorted from oldest to youngest (by lastTime member).
-	 *    for all s in inactiveLogSinks:
-	 *       s.opened == 0
-	 *    inactiveLogSinks.size() == inactiveLogSinksCount
-	 */
-	list<LogSinkPtr> inactiveLogSinks;
-	int inactiveLogSinksCount;
-	StringMap<FilterPtr> filters;
+	ev::prepare dirtySinksWatcher;
+	ev::timer metricsTimer;
+	ev::timer memoryPressureTimer;
+	/** Clients on this server that we stopped reading from. */
+	vector<Client *> pausedClients;
 	RandomGenerator randomGenerator;
-	bool refuseNewConnections;
-	bool exitRequested;
 	unsigned long long exitBeginTime;
-	int sinkFlushInterval;
-	string dumpFile;
+	
+	/** This server's own metrics. Only our event loop thread updates them. */
+	Metric *acceptsMetric;
+	Metric *clientsMetric;
+	Metric *transactionsOpenedMetric;
+	Metric *transactionsClosedMetric;
+	Metric *entriesMetric;
+	Metric *entryBytesMetric;
+	Metric *datagramsMetric;
+	Metric *rejectedDatagramsMetric;
+
+	/** See listenForDatagrams(). */
+	FileDescriptor datagramFd;
+	ev::io datagramWatcher;
+	string datagramBuffer;
 	
 	void sendErrorToClient(Client *client, const string &message) {
 		client->writeArrayMessage("error", message.c_str(), NULL);
@@ -460,6 +1182,16 @@ private:
 		}
 	}
 	
+	bool expectingMaxArgumentsCount(Client *client, const vector<StaticString> &args, unsigned int size) {
+		if (args.size() <= size) {
+			return true;
+		} else {
+			sendErrorToClient(client, "Invalid number of arguments");
+			client->disconnect();
+			return false;
+		}
+	}
+	
 	bool expectingLoggerType(Client *client) {
 		if (client->type == LOGGER) {
 			return true;
@@ -471,7 +1203,7 @@ private:
 	}
 	
 	bool checkWhetherConnectionAreAcceptable(Client *client) {
-		if (refuseNewConnections) {
+		if (shared->refuseNewConnections) {
 			client->writeArrayMessage("server shutting down", NULL);
 			client->disconnect();
 			return false;
@@ -537,147 +1269,340 @@ private:
 		return category == "requests" || category == "processes" || category == "exceptions";
 	}
 	
-	LogSinkPtr openLogFile() {
-		string cacheKey = "file:" + dumpFile;
-		LogSinkPtr result;
-		LogSinkCache::iterator it = logSinkCache.find(cacheKey);
-		if (it == logSinkCache.end()) {
-			trimLogSinkCache(MAX_LOG_SINK_CACHE_SIZE - 1);
-			result = boost::make_shared<LogFileSink>(this, dumpFile);
-			pair<LogSinkCache::iterator, bool> p =
-				logSinkCache.insert(make_pair(cacheKey, result));
-			result->cacheIterator = p.first;
-			result->opened = 1;
+	/**
+	 * Checks whether the given log entry may be written. If not, sends an
+	 * error to the client and disconnects it. Must not be called while
+	 * holding any locks, because disconnecting calls onClientDisconnected().
+	 */
+	bool checkLogEntry(Client *client, const StaticString &timestamp,
+		const StaticString &data)
+	{
+		if (OXT_UNLIKELY( !validLogContent(data) )) {
+			sendErrorToClient(client, "Log entry data contains an invalid character.");
+			client->disconnect();
+			return false;
+		}
+		if (OXT_UNLIKELY( !validTimestamp(timestamp) )) {
+			sendErrorToClient(client, "Log entry timestamp is invalid.");
+			client->disconnect();
+			return false;
+		}
+		return true;
+	}
+	
+	/**
+	 * Appends the entries in a batch in the binary format (see
+	 * UnionStationLogBatch.h) to their transaction.
+	 */
+	void processLogBatch(Client *client, const StaticString &data) {
+		UnionStation::LogBatchReader reader(data);
+		string txnId = reader.getTxnId();
+		const char *error = NULL;
+		
+		if (OXT_UNLIKELY( !reader.isValid() )) {
+			error = "Log batch is malformed or has an unsupported format";
 		} else {
-			result = it->second;
-			result->opened++;
-			if (result->opened == 1) {
-				inactiveLogSinks.erase(result->inactiveLogSinksIterator);
-				inactiveLogSinksCount--;
+			TransactionShard &shard = shared->getShard(txnId);
+			boost::lock_guard<boost::mutex> l(shard.syncher);
+			TransactionMap::iterator it = shard.transactions.find(txnId);
+			if (OXT_UNLIKELY( it == shard.transactions.end() )) {
+				error = "Cannot log data: transaction does not exist";
+			} else if (OXT_UNLIKELY( client->openTransactions.find(txnId)
+			           == client->openTransactions.end() ))
+			{
+				error = "Cannot log data: transaction not opened in this connection";
+			} else {
+				Transaction *transaction = it->second.get();
+				unsigned long long timestamp;
+				StaticString entry;
+				char timestampStr[2 * sizeof(unsigned long long) + 1];
+				
+				size_t memory = 0;
+				
+				while (reader.next(timestamp, entry)) {
+					if (OXT_UNLIKELY( !validLogContent(entry) )) {
+						error = "Log entry data contains an invalid character.";
+						break;
+					}
+					integerToHexatri<unsigned long long>(timestamp, timestampStr);
+					memory += transaction->appendEntry(timestampStr, entry);
+					entriesMetric->increment();
+					entryBytesMetric->add(entry.size());
+				}
+				accountTransactionMemory(client, txnId, memory);
+				if (error == NULL && OXT_UNLIKELY( !reader.isValid() )) {
+					error = "Log batch is malformed";
+				}
 			}
 		}
-		return result;
+		
+		if (OXT_UNLIKELY( error != NULL )) {
+			sendErrorToClient(client, error);
+			client->disconnect();
+		} else {
+			enforceMemoryLimits(client);
+		}
 	}
 	
-	LogSinkPtr openRemoteSink(const StaticString &unionStationKey, const string &nodeName,
-		const string &category)
+	/**
+	 * Creates a transaction and opens its log sink. `nodeId` is the MD5 of
+	 * `nodeName` in hex, or NULL if it hasn't been computed yet.
+	 */
+	TransactionPtr createTransaction(const string &txnId, const StaticString &groupName,
+		const StaticString &nodeName, const char *nodeId, const StaticString &category,
+		const StaticString &unionStationKey, const StaticString &senderNodeName,
+		bool crashProtect, const StaticString &filters)
 	{
-		string cacheKey = "remote:";
-		cacheKey.append(unionStationKey.c_str(), unionStationKey.size());
-		cacheKey.append(1, '\0');
-		cacheKey.append(nodeName);
-		cacheKey.append(1, '\0');
-		cacheKey.append(category);
-		
-		LogSinkPtr result;
-		LogSinkCache::iterator it = logSinkCache.find(cacheKey);
-		if (it == logSinkCache.end()) {
-			trimLogSinkCache(MAX_LOG_SINK_CACHE_SIZE - 1);
-			result = boost::make_shared<RemoteSink>(this, unionStationKey,
-				nodeName, category);
-			pair<LogSinkCache::iterator, bool> p =
-				logSinkCache.insert(make_pair(cacheKey, result));
-			result->cacheIterator = p.first;
-			result->opened = 1;
-		} else {
-			result = it->second;
-			result->opened++;
-			if (result->opened == 1) {
-				inactiveLogSinks.erase(result->inactiveLogSinksIterator);
-				inactiveLogSinksCount--;
+		TransactionPtr transaction = boost::make_shared<Transaction>(shared.get(),
+			ev_now(getLoop()));
+		if (unionStationKey.empty() || unionStationKey == "-") {
+			char tempNodeId[MD5_HEX_SIZE];
+			
+			if (nodeId == NULL) {
+				md5_state_t state;
+				md5_byte_t  digest[MD5_SIZE];
+				
+				md5_init(&state);
+				md5_append(&state,
+					(const md5_byte_t *) nodeName.data(),
+					nodeName.size());
+				md5_finish(&state, digest);
+				toHex(StaticString((const char *) digest, MD5_SIZE),
+					tempNodeId);
+				nodeId = tempNodeId;
 			}
+			
+			boost::lock_guard<boost::mutex> l(shared->sinksSyncher);
+			transaction->logSink = shared->openLogFile();
+		} else {
+			boost::lock_guard<boost::mutex> l(shared->sinksSyncher);
+			transaction->logSink = shared->openRemoteSink(unionStationKey,
+				senderNodeName, category);
+			transaction->unionStationKey = unionStationKey;
 		}
-		return result;
+		transaction->txnId        = txnId;
+		transaction->dataStoreId  = DataStoreId(groupName,
+			nodeName, category);
+		transaction->writeCount   = 0;
+		transaction->refcount     = 0;
+		transaction->crashProtect = crashProtect;
+		if (!filters.empty()) {
+			transaction->filters = filters;
+		}
+		transaction->discarded    = false;
+		transactionsOpenedMetric->increment();
+		return transaction;
 	}
-	
+
 	/**
-	 * 'Closes' the given log sink. It's not actually deleted from memory;
-	 * instead it's marked as inactive and cached for later use. May be
-	 * deleted later when resources are low.
-	 *
-	 * No need to call this manually. Automatically called by Transaction's
-	 * destructor.
+	 * Writes a whole transaction that was sent to the datagram socket (see
+	 * UnionStation::TransactionDatagram). There's nobody to report errors
+	 * to, so invalid datagrams are only counted. Datagram transactions are
+	 * never merged with transactions of the same ID that are open on
+	 * connections.
 	 */
-	void closeLogSink(const LogSinkPtr &logSink) {
-		logSink->opened--;
-		assert(logSink->opened >= 0);
-		logSink->lastUsed = ev_now(getLoop());
-		if (logSink->opened == 0) {
-			inactiveLogSinks.push_back(logSink);
-			logSink->inactiveLogSinksIterator = inactiveLogSinks.end();
-			logSink->inactiveLogSinksIterator--;
-			inactiveLogSinksCount++;
-			trimLogSinkCache(MAX_LOG_SINK_CACHE_SIZE);
+	void processDatagram(const StaticString &data) {
+		UnionStation::TransactionDatagram datagram;
+		const char *error = NULL;
+
+		if (OXT_UNLIKELY( !datagram.parse(data) )) {
+			error = "it is malformed";
+		} else if (OXT_UNLIKELY( accountsDatabase->authenticate(datagram.username,
+			datagram.password) == NULL ))
+		{
+			error = "invalid username or password";
+		} else if (OXT_UNLIKELY( datagram.nodeName.empty()
+		        || !supportedCategory(datagram.category)
+		        || !validUnionStationKey(datagram.unionStationKey) ))
+		{
+			error = "invalid transaction parameters";
+		}
+
+		UnionStation::LogBatchReader reader(datagram.batch);
+		if (error == NULL && OXT_UNLIKELY( !reader.isValid()
+		 || !validTxnId(reader.getTxnId()) ))
+		{
+			error = "the log batch is malformed";
+		}
+
+		if (error == NULL) {
+			TransactionPtr transaction = createTransaction(reader.getTxnId(),
+				datagram.groupName, datagram.nodeName, NULL,
+				datagram.category, datagram.unionStationKey,
+				datagram.nodeName, false, datagram.filters);
+			unsigned long long timestamp;
+			StaticString entry;
+			char timestampStr[2 * sizeof(unsigned long long) + 1];
+			bool validEntries = true;
+
+			integerToHexatri<unsigned long long>(datagram.openedAt, timestampStr);
+			transaction->appendEntry(timestampStr, "ATTACH");
+			while (validEntries && reader.next(timestamp, entry)) {
+				validEntries = validLogContent(entry);
+				if (validEntries) {
+					integerToHexatri<unsigned long long>(timestamp, timestampStr);
+					transaction->appendEntry(timestampStr, entry);
+					entriesMetric->increment();
+					entryBytesMetric->add(entry.size());
+				}
+			}
+			if (OXT_UNLIKELY( !validEntries || !reader.isValid() )) {
+				error = "a log entry is malformed or contains an invalid character";
+				transaction->discard();
+			} else {
+				integerToHexatri<unsigned long long>(datagram.closedAt, timestampStr);
+				transaction->appendEntry(timestampStr, "DETACH");
+			}
+			// Writes the transaction to its log sink.
+			transaction.reset();
+			transactionsClosedMetric->increment();
+		}
+
+		if (error == NULL) {
+			datagramsMetric->increment();
+		} else {
+			P_DEBUG("Rejected a transaction datagram because " << error);
+			rejectedDatagramsMetric->increment();
 		}
 	}
-	
-	/** Try to reduce the log sink cache size to the given size. */
-	void trimLogSinkCache(unsigned int size) {
-		while (!inactiveLogSinks.empty() && logSinkCache.size() > size) {
-			const LogSinkPtr logSink = inactiveLogSinks.front();
-			inactiveLogSinks.pop_front();
-			inactiveLogSinksCount--;
-			logSinkCache.erase(logSink->cacheIterator);
+
+	void onDatagramReadable(ev::io &io, int revents) {
+		// Don't starve the connections if the socket is flooded.
+		for (unsigned int i = 0; i < MAX_DATAGRAMS_PER_ITERATION; i++) {
+			ssize_t ret;
+			do {
+				ret = recv(datagramFd, &datagramBuffer[0], datagramBuffer.size(),
+					MSG_DONTWAIT);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				int e = errno;
+				if (e != EAGAIN && e != EWOULDBLOCK) {
+					P_WARN("Cannot receive from the datagram socket: " <<
+						strerror(e) << " (errno=" << e << ")");
+				}
+				return;
+			}
+			processDatagram(StaticString(datagramBuffer.data(), ret));
 		}
 	}
-	
-	FilterSupport::Filter &compileFilter(const StaticString &source) {
-		// TODO: garbage collect filters based on time
-		FilterPtr filter = filters.get(source);
-		if (filter == NULL) {
-			filter = boost::make_shared<FilterSupport::Filter>(source);
-			filters.set(source, filter);
-		}
-		return *filter;
+
+	void accountTransactionMemory(Client *client, const string &txnId, size_t bytes) {
+		if (bytes > 0) {
+			client->openTransactions[txnId] += bytes;
+			client->transactionMemory += bytes;
+		}
 	}
 	
-	bool writeLogEntry(Client *client, const TransactionPtr &transaction,
-		const StaticString &timestamp, const StaticString &data)
-	{
-		if (transaction->discarded) {
-			return true;
-		}
-		if (OXT_UNLIKELY( !validLogContent(data) )) {
-			if (client != NULL) {
-				sendErrorToClient(client, "Log entry data contains an invalid character.");
-				client->disconnect();
+	/**
+	 * Evicts the oldest open transactions until the memory
+	 * used by transactions drops to `target` bytes. If `client` is given,
+	 * only that client's transactions are considered, and the target
+	 * applies to the memory that the client is accountable for.
+	 */
+	void evictOldestTransactions(Client *client, unsigned long long target) {
+		typedef pair<ev_tstamp, string> Candidate;
+		vector<Candidate> candidates;
+		
+		if (client != NULL) {
+			map<string, size_t>::iterator it, end = client->openTransactions.end();
+			client->transactionMemory = 0;
+			for (it = client->openTransactions.begin(); it != end; it++) {
+				TransactionShard &shard = shared->getShard(it->first);
+				boost::lock_guard<boost::mutex> l(shard.syncher);
+				const Transaction *transaction = shard.transactions.find(it->first)->second.get();
+				if (transaction->evicted || transaction->discarded) {
+					// Evicted because of another client, so it
+					// doesn't count against this client anymore.
+					it->second = 0;
+				} else {
+					candidates.push_back(make_pair(transaction->createdAt, it->first));
+				}
+				client->transactionMemory += it->second;
+			}
+		} else {
+			for (unsigned int i = 0; i < TRANSACTION_SHARD_COUNT; i++) {
+				TransactionShard &shard = shared->shards[i];
+				boost::lock_guard<boost::mutex> l(shard.syncher);
+				TransactionMap::const_iterator it, end = shard.transactions.end();
+				for (it = shard.transactions.begin(); it != end; it++) {
+					const Transaction *transaction = it->second.get();
+					if (!transaction->evicted && !transaction->discarded) {
+						candidates.push_back(make_pair(transaction->createdAt, it->first));
+					}
+				}
 			}
-			return false;
 		}
-		if (OXT_UNLIKELY( !validTimestamp(timestamp) )) {
+		
+		sort(candidates.begin(), candidates.end());
+		vector<Candidate>::const_iterator it, end = candidates.end();
+		for (it = candidates.begin(); it != end; it++) {
+			if (client != NULL && client->transactionMemory <= target) {
+				break;
+			} else if (client == NULL && shared->transactionMemory <= target) {
+				break;
+			}
+			
+			const string &txnId = it->second;
+			TransactionShard &shard = shared->getShard(txnId);
+			boost::lock_guard<boost::mutex> l(shard.syncher);
+			TransactionMap::iterator tit = shard.transactions.find(txnId);
+			if (tit != shard.transactions.end() && !tit->second->evicted) {
+				P_WARN("Transaction " << txnId << " uses too much memory; "
+					"discarding its data");
+				tit->second->evict();
+			}
 			if (client != NULL) {
-				sendErrorToClient(client, "Log entry timestamp is invalid.");
-				client->disconnect();
+				size_t &memory = client->openTransactions[txnId];
+				client->transactionMemory -= memory;
+				memory = 0;
 			}
-			return false;
 		}
-		
-		char writeCountStr[sizeof(unsigned int) * 2 + 1];
-		integerToHexatri(transaction->writeCount, writeCountStr);
-		transaction->writeCount++;
-		transaction->data.append(transaction->txnId);
-		transaction->data.append(" ");
-		transaction->data.append(timestamp);
-		transaction->data.append(" ");
-		transaction->data.append(writeCountStr);
-		transaction->data.append(" ");
-		transaction->data.append(data);
-		transaction->data.append("\n");
-		return true;
 	}
 	
-	void writeDetachEntry(Client *client, const TransactionPtr &transaction) {
-		char timestamp[2 * sizeof(unsigned long long) + 1];
-		// Must use System::getUsec() here instead of ev_now() because the
-		// precision of the time is very important.
-		integerToHexatri<unsigned long long>(SystemTime::getUsec(), timestamp);
-		writeDetachEntry(client, transaction, timestamp);
+	/**
+	 * Called after `client` logged something. Evicts its oldest
+	 * transactions if it hit the per-client memory limit, and stops
+	 * reading from it if all clients together hit the global limit.
+	 * Must be called without holding any shard locks.
+	 */
+	void enforceMemoryLimits(Client *client) {
+		if (shared->clientMemoryLimit > 0
+		 && OXT_UNLIKELY( client->transactionMemory > shared->clientMemoryLimit ))
+		{
+			evictOldestTransactions(client, shared->clientMemoryLimit);
+		}
+		if (shared->memoryLimit > 0
+		 && OXT_UNLIKELY( shared->transactionMemory > shared->memoryLimit )
+		 && !client->paused)
+		{
+			P_DEBUG("Transactions use too much memory; no longer reading from client " <<
+				(int) client->fd);
+			client->paused = true;
+			client->notifyReads(false);
+			pausedClients.push_back(client);
+			if (!memoryPressureTimer.is_active()) {
+				memoryPressureTimer.start();
+			}
+		}
 	}
 	
-	void writeDetachEntry(Client *client, const TransactionPtr &transaction,
-		const StaticString &timestamp)
-	{
-		writeLogEntry(client, transaction, timestamp, "DETACH");
+	void memoryPressureTimeout(ev::timer &timer, int revents) {
+		// Give clients that are allowed to continue reading some time to
+		// close their transactions. If that doesn't free enough memory,
+		// evict the oldest transactions so that nobody is blocked forever.
+		unsigned long long lowWatermark = shared->memoryLimit / 4 * 3;
+		if (shared->transactionMemory > lowWatermark) {
+			evictOldestTransactions(NULL, lowWatermark);
+		}
+		
+		vector<Client *>::const_iterator it, end = pausedClients.end();
+		for (it = pausedClients.begin(); it != end; it++) {
+			Client *client = *it;
+			client->paused = false;
+			client->notifyReads(true);
+		}
+		pausedClients.clear();
+		timer.stop();
 	}
 	
 	bool requireRights(Client *client, Account::Rights rights) {
@@ -716,67 +1641,58 @@ private:
 		return true;
 	}
 	
-	/* Release all inactive log sinks that have been inactive for more than
-	 * GARBAGE_COLLECTION_TIMEOUT seconds.
-	 */
-	void releaseInactiveLogSinks(ev_tstamp now) {
-		bool done = false;
-		
-		while (!done && !inactiveLogSinks.empty()) {
-			const LogSinkPtr logSink = inactiveLogSinks.front();
-			if (now - logSink->lastUsed >= GARBAGE_COLLECTION_TIMEOUT) {
-				inactiveLogSinks.pop_front();
-				inactiveLogSinksCount--;
-				logSinkCache.erase(logSink->cacheIterator);
-			} else {
-				done = true;
-			}
+	void garbageCollect(ev::timer &timer, int revents) {
+		P_DEBUG("Garbage collection time");
+		{
+			boost::lock_guard<boost::mutex> l(shared->sinksSyncher);
+			shared->releaseInactiveLogSinks(ev_now(getLoop()));
+		}
+		shared->releaseUnusedFilters(ev_now(getLoop()));
+		if (shared->transactionMemory == 0) {
+			releaseIdleMemory();
 		}
 	}
 	
-	void garbageCollect(ev::timer &timer, int revents) {
-		P_DEBUG("Garbage collection time");
-		releaseInactiveLogSinks(ev_now(getLoop()));
+	/**
+	 * Called by the garbage collector when there are no open transactions.
+	 * The memory of the transactions of a traffic peak is kept by the
+	 * allocator and not returned to the OS otherwise, so our RSS would stay
+	 * at the peak's level forever.
+	 */
+	void releaseIdleMemory() {
+		size_t rssBefore = getCurrentRss();
+		shared->releaseAllFilters();
+		releaseFreeHeapMemory();
+		P_DEBUG("No open transactions; released memory. RSS: " <<
+			rssBefore / 1024 << " KB -> " << getCurrentRss() / 1024 << " KB");
 	}
-
-	ev_tstamp getFlushInterval(const LogSink *sink) const {
-		if (sinkFlushInterval == 0) {
-			return sink->defaultFlushInterval();
-		} else {
-			return sinkFlushInterval;
-		}
+	
+	void metricsTimeout(ev::timer &timer, int revents) {
+		shared->sendMetrics();
 	}
 	
 	void sinkFlushTimeout(ev::timer &timer, int revents) {
 		P_DEBUG("Flushing all sinks");
-		LogSinkCache::iterator it;
-		LogSinkCache::iterator end = logSinkCache.end();
-		ev_tstamp now = ev_now(getLoop());
-		
-		for (it = logSinkCache.begin(); it != end; it++) {
-			LogSink *sink = it->second.get();
-			if (now - sink->lastFlushed >= getFlushInterval(sink)) {
-				sink->flush();
-			}
-		}
+		shared->flushSinks(false);
+	}
+	
+	void writeDirtySinks(ev::prepare &watcher, int revents) {
+		shared->writeDirtyFileSinks();
 	}
 	
 	void flushAllSinks() {
 		P_TRACE(2, "Flushing all sinks");
-		LogSinkCache::iterator it;
-		LogSinkCache::iterator end = logSinkCache.end();
-		
-		for (it = logSinkCache.begin(); it != end; it++) {
-			LogSink *sink = it->second.get();
-			sink->flush();
-		}
+		shared->flushSinks(true);
 	}
 	
 	void exitTimerTimeout(ev::timer &timer, int revents) {
-		if (SystemTime::getMsec() >= exitBeginTime + 5000) {
+		if (shared->clientCount > 0) {
+			// A client connected to another LoggingServer in the mean time.
 			exitTimer.stop();
-			exitRequested = false;
-			refuseNewConnections = false;
+		} else if (SystemTime::getMsec() >= exitBeginTime + 5000) {
+			exitTimer.stop();
+			shared->exitRequested = false;
+			shared->refuseNewConnections = false;
 			ev_break(getLoop(), EVBREAK_ONE);
 		}
 	}
@@ -789,7 +1705,16 @@ protected:
 	virtual bool onMessageReceived(EventedMessageClient *_client, const vector<StaticString> &args) {
 		Client *client = (Client *) _client;
 		
-		if (args[0] == "log") {
+		if (args[0] == "logBatch") {
+			if (OXT_UNLIKELY( !expectingArgumentsCount(client, args, 1)
+			               || !expectingLoggerType(client) )) {
+				return true;
+			}
+			// Expecting the batch in a scalar message.
+			client->readingLogBatch = true;
+			return false;
+			
+		} else if (args[0] == "log") {
 			if (OXT_UNLIKELY( !expectingArgumentsCount(client, args, 3)
 			               || !expectingLoggerType(client) )) {
 				return true;
@@ -797,22 +1722,31 @@ protected:
 			
 			string txnId     = args[1];
 			string timestamp = args[2];
+			const char *error = NULL;
+			
+			{
+				TransactionShard &shard = shared->getShard(txnId);
+				boost::lock_guard<boost::mutex> l(shard.syncher);
+				TransactionMap::iterator it = shard.transactions.find(txnId);
+				if (OXT_UNLIKELY( it == shard.transactions.end() )) {
+					error = "Cannot log data: transaction does not exist";
+				} else if (OXT_UNLIKELY( client->openTransactions.find(txnId)
+				           == client->openTransactions.end() ))
+				{
+					error = "Cannot log data: transaction not opened in this connection";
+				} else {
+					client->currentTransaction = it->second;
+				}
+			}
 			
-			TransactionMap::iterator it = transactions.find(txnId);
-			if (OXT_UNLIKELY( it == transactions.end() )) {
-				sendErrorToClient(client, "Cannot log data: transaction does not exist");
+			if (OXT_UNLIKELY( error != NULL )) {
+				sendErrorToClient(client, error);
 				client->disconnect();
+				return true;
 			} else {
-				set<string>::iterator sit = client->openTransactions.find(txnId);
-				if (OXT_UNLIKELY( sit == client->openTransactions.end() )) {
-					sendErrorToClient(client,
-						"Cannot log data: transaction not opened in this connection");
-					client->disconnect();
-					return true;
-				}
 				// Expecting the log data in a scalar message.
-				client->currentTransaction = it->second;
 				client->currentTimestamp = timestamp;
+				client->readingLogBatch = false;
 				return false;
 			}
 			
@@ -850,6 +1784,9 @@ protected:
 				client->disconnect();
 				return true;
 			}
+			if (OXT_UNLIKELY( !checkLogEntry(client, timestamp, "ATTACH") )) {
+				return true;
+			}
 			
 			const char *nodeId;
 			
@@ -860,77 +1797,51 @@ protected:
 				nodeId = NULL;
 			}
 			
-			TransactionMap::iterator it = transactions.find(txnId);
-			TransactionPtr transaction;
-			if (it == transactions.end()) {
-				if (OXT_UNLIKELY( !supportedCategory(category) )) {
-					sendErrorToClient(client, "Unsupported category");
-					client->disconnect();
-					return true;
-				}
-				
-				transaction = boost::make_shared<Transaction>(this, ev_now(getLoop()));
-				if (unionStationKey.empty() || unionStationKey == "-") {
-					char tempNodeId[MD5_HEX_SIZE];
-					
-					if (nodeId == NULL) {
-						md5_state_t state;
-						md5_byte_t  digest[MD5_SIZE];
-
-						md5_init(&state);
-						md5_append(&state,
-							(const md5_byte_t *) nodeName.data(),
-							nodeName.size());
-						md5_finish(&state, digest);
-						toHex(StaticString((const char *) digest, MD5_SIZE),
-							tempNodeId);
-						nodeId = tempNodeId;
+			string error;
+			{
+				TransactionShard &shard = shared->getShard(txnId);
+				boost::lock_guard<boost::mutex> l(shard.syncher);
+				TransactionMap::iterator it = shard.transactions.find(txnId);
+				TransactionPtr transaction;
+				if (it == shard.transactions.end()) {
+					if (OXT_UNLIKELY( !supportedCategory(category) )) {
+						error = "Unsupported category";
+					} else {
+						transaction = createTransaction(txnId, groupName, nodeName,
+							nodeId, category, unionStationKey, client->nodeName,
+							crashProtect, filters);
+						shard.transactions.insert(make_pair(txnId, transaction));
 					}
-					
-					transaction->logSink = openLogFile();
 				} else {
-					transaction->logSink = openRemoteSink(unionStationKey,
-						client->nodeName, category);
-				}
-				transaction->txnId        = txnId;
-				transaction->dataStoreId  = DataStoreId(groupName,
-					nodeName, category);
-				transaction->writeCount   = 0;
-				transaction->refcount     = 0;
-				transaction->crashProtect = crashProtect;
-				if (!filters.empty()) {
-					transaction->filters = filters;
-				}
-				transaction->discarded    = false;
-				transactions.insert(make_pair(txnId, transaction));
-			} else {
-				transaction = it->second;
-				if (OXT_UNLIKELY( transaction->getGroupName() != groupName )) {
-					sendErrorToClient(client,
-						"Cannot open transaction: transaction already opened with a "
-						"different group name ('" + transaction->getGroupName() +
-						"' vs '" + groupName + "')");
-					client->disconnect();
-					return true;
-				}
-				if (OXT_UNLIKELY( transaction->getNodeName() != nodeName )) {
-					sendErrorToClient(client,
-						"Cannot open transaction: transaction already opened with a different node name");
-					client->disconnect();
-					return true;
+					transaction = it->second;
+					if (OXT_UNLIKELY( transaction->getGroupName() != groupName )) {
+						error = "Cannot open transaction: transaction already opened with a "
+							"different group name ('" + transaction->getGroupName() +
+							"' vs '" + groupName + "')";
+					} else if (OXT_UNLIKELY( transaction->getNodeName() != nodeName )) {
+						error = "Cannot open transaction: transaction already opened with a different node name";
+					} else if (OXT_UNLIKELY( transaction->getCategory() != category )) {
+						error = "Cannot open transaction: transaction already opened with a different category name";
+					}
 				}
-				if (OXT_UNLIKELY( transaction->getCategory() != category )) {
-					sendErrorToClient(client,
-						"Cannot open transaction: transaction already opened with a different category name");
-					client->disconnect();
-					return true;
+				
+				if (error.empty()) {
+					size_t memory = transaction->appendEntry(timestamp, "ATTACH");
+					if (transaction->refcount == 0) {
+						memory += transaction->data.capacity();
+					}
+					client->openTransactions.insert(make_pair(txnId, memory));
+					client->transactionMemory += memory;
+					transaction->refcount++;
 				}
 			}
 			
-			client->openTransactions.insert(txnId);
-			transaction->refcount++;
-			writeLogEntry(client, transaction, timestamp, "ATTACH");
-			
+			if (OXT_UNLIKELY( !error.empty() )) {
+				sendErrorToClient(client, error);
+				client->disconnect();
+				return true;
+			}
+			enforceMemoryLimits(client);
 			if (ack) {
 				client->writeArrayMessage("ok", NULL);
 			}
@@ -945,34 +1856,48 @@ protected:
 			StaticString timestamp = args[2];
 			bool         ack       = getBool(args, 3, false);
 			
-			TransactionMap::iterator it = transactions.find(txnId);
-			if (OXT_UNLIKELY( it == transactions.end() )) {
-				sendErrorToClient(client,
-					"Cannot close transaction " + txnId +
-					": transaction does not exist");
-				client->disconnect();
-			} else {
-				TransactionPtr &transaction = it->second;
-				
-				set<string>::const_iterator sit = client->openTransactions.find(txnId);
-				if (OXT_UNLIKELY( sit == client->openTransactions.end() )) {
-					sendErrorToClient(client,
-						"Cannot close transaction " + txnId +
-						": transaction not opened in this connection");
-					client->disconnect();
-					return true;
+			if (OXT_UNLIKELY( !checkLogEntry(client, timestamp, "DETACH") )) {
+				return true;
+			}
+			
+			string error;
+			TransactionPtr closedTransaction;
+			{
+				TransactionShard &shard = shared->getShard(txnId);
+				boost::lock_guard<boost::mutex> l(shard.syncher);
+				TransactionMap::iterator it = shard.transactions.find(txnId);
+				if (OXT_UNLIKELY( it == shard.transactions.end() )) {
+					error = "Cannot close transaction " + txnId +
+						": transaction does not exist";
 				} else {
-					client->openTransactions.erase(sit);
-				}
-				
-				writeDetachEntry(client, transaction, timestamp);
-				transaction->refcount--;
-				assert(transaction->refcount >= 0);
-				if (transaction->refcount == 0) {
-					transactions.erase(it);
+					TransactionPtr &transaction = it->second;
+					map<string, size_t>::iterator sit = client->openTransactions.find(txnId);
+					if (OXT_UNLIKELY( sit == client->openTransactions.end() )) {
+						error = "Cannot close transaction " + txnId +
+							": transaction not opened in this connection";
+					} else {
+						client->transactionMemory -= sit->second;
+						client->openTransactions.erase(sit);
+						transaction->appendEntry(timestamp, "DETACH");
+						transaction->refcount--;
+						assert(transaction->refcount >= 0);
+						if (transaction->refcount == 0) {
+							// Destroy the transaction, which writes it to its
+							// log sink, after releasing the shard lock.
+							closedTransaction = transaction;
+							shard.transactions.erase(it);
+							transactionsClosedMetric->increment();
+						}
+					}
 				}
 			}
+			closedTransaction.reset();
 			
+			if (OXT_UNLIKELY( !error.empty() )) {
+				sendErrorToClient(client, error);
+				client->disconnect();
+				return true;
+			}
 			if (ack) {
 				client->writeArrayMessage("ok", NULL);
 			}
@@ -983,7 +1908,8 @@ protected:
 				client->disconnect();
 				return true;
 			}
-			if (OXT_UNLIKELY( !expectingArgumentsCount(client, args, 2) )) {
+			if (OXT_UNLIKELY( !expectingMinArgumentsCount(client, args, 2)
+			               || !expectingMaxArgumentsCount(client, args, 3) )) {
 				return true;
 			}
 			if (OXT_UNLIKELY( !checkWhetherConnectionAreAcceptable(client) )) {
@@ -1001,6 +1927,7 @@ protected:
 			toHex(StaticString((const char *) digest, MD5_SIZE), client->nodeId);
 			
 			client->type = LOGGER;
+			client->binaryLogs = args.size() == 3 && args[2] == "binary-logs";
 			client->writeArrayMessage("ok", NULL);
 			
 		} else if (args[0] == "flush") {
@@ -1026,14 +1953,14 @@ protected:
 			} else if (args.size() == 2 && args[1] == "semi-gracefully") {
 				// Semi-graceful exit: refuse new connections, shut down
 				// a few seconds after the last client has disconnected.
-				refuseNewConnections = true;
-				exitRequested = true;
+				shared->refuseNewConnections = true;
+				shared->exitRequested = true;
 			} else {
 				// Graceful exit: shut down a few seconds after the
 				// last client has disconnected.
 				client->writeArrayMessage("Passed security", NULL);
 				client->writeArrayMessage("exit command received", NULL);
-				exitRequested = true;
+				shared->exitRequested = true;
 			}
 			client->disconnect();
 			
@@ -1053,10 +1980,22 @@ protected:
 		Client *client = (Client *) _client;
 		size_t consumed = client->dataReader.feed(data, size);
 		if (client->dataReader.done()) {
-			writeLogEntry(client,
-				client->currentTransaction,
-				client->currentTimestamp,
-				client->dataReader.value());
+			StaticString value = client->dataReader.value();
+			if (client->readingLogBatch) {
+				processLogBatch(client, value);
+			} else if (checkLogEntry(client, client->currentTimestamp, value)) {
+				TransactionPtr &transaction = client->currentTransaction;
+				TransactionShard &shard = shared->getShard(transaction->txnId);
+				size_t memory;
+				{
+					boost::lock_guard<boost::mutex> l(shard.syncher);
+					memory = transaction->appendEntry(client->currentTimestamp, value);
+				}
+				entriesMetric->increment();
+				entryBytesMetric->add(value.size());
+				accountTransactionMemory(client, transaction->txnId, memory);
+				enforceMemoryLimits(client);
+			}
 			client->currentTransaction.reset();
 			client->dataReader.reset();
 			return make_pair(consumed, true);
@@ -1066,7 +2005,10 @@ protected:
 	}
 	
 	virtual void onNewClient(EventedClient *client) {
-		if (exitRequested && exitTimer.is_active()) {
+		shared->clientCount++;
+		acceptsMetric->increment();
+		clientsMetric->increment();
+		if (shared->exitRequested && exitTimer.is_active()) {
 			exitTimer.stop();
 		}
 		EventedMessageServer::onNewClient(client);
@@ -1075,34 +2017,49 @@ protected:
 	virtual void onClientDisconnected(EventedClient *_client) {
 		EventedMessageServer::onClientDisconnected(_client);
 		Client *client = (Client *) _client;
-		set<string>::const_iterator sit;
-		set<string>::const_iterator send = client->openTransactions.end();
+		map<string, size_t>::const_iterator sit;
+		map<string, size_t>::const_iterator send = client->openTransactions.end();
+		
+		if (client->paused) {
+			pausedClients.erase(find(pausedClients.begin(),
+				pausedClients.end(), client));
+			client->paused = false;
+		}
 		
 		// Close any transactions that this client had opened.
 		for (sit = client->openTransactions.begin(); sit != send; sit++) {
-			const string &txnId = *sit;
-			TransactionMap::iterator it = transactions.find(txnId);
-			if (OXT_UNLIKELY( it == transactions.end() )) {
-				P_ERROR("Bug: client->openTransactions is not a subset of this->transactions!");
+			const string &txnId = sit->first;
+			TransactionPtr closedTransaction;
+			TransactionShard &shard = shared->getShard(txnId);
+			boost::unique_lock<boost::mutex> l(shard.syncher);
+			TransactionMap::iterator it = shard.transactions.find(txnId);
+			if (OXT_UNLIKELY( it == shard.transactions.end() )) {
+				P_ERROR("Bug: client->openTransactions is not a subset of the transactions!");
 				abort();
 			}
 			
 			TransactionPtr &transaction = it->second;
 			if (transaction->crashProtect) {
-				writeDetachEntry(client, transaction);
+				transaction->appendDetachEntry();
 			} else {
 				transaction->discard();
 			}
 			transaction->refcount--;
 			assert(transaction->refcount >= 0);
 			if (transaction->refcount == 0) {
-				transactions.erase(it);
+				closedTransaction = transaction;
+				shard.transactions.erase(it);
+				transactionsClosedMetric->increment();
 			}
+			l.unlock();
 		}
 		client->openTransactions.clear();
+		client->transactionMemory = 0;
+		client->currentTransaction.reset();
+		clientsMetric->decrement();
 		
 		// Possibly start exit timer.
-		if (exitRequested && getClients().empty()) {
+		if (--shared->clientCount == 0 && shared->exitRequested) {
 			exitTimer.start();
 			/* Using SystemTime here instead of setting a correct
 			 * timeout directly on the timer, so that we can
@@ -1113,86 +2070,213 @@ protected:
 	}
 
 public:
+	/**
+	 * Creates a LoggingServer with its own, new shared state.
+	 */
 	LoggingServer(struct ev_loop *loop,
 		FileDescriptor fd,
 		const AccountsDatabasePtr &accountsDatabase,
 		const VariantMap &options = VariantMap())
 		: EventedMessageServer(loop, fd, accountsDatabase),
-		  remoteSender(
-		      options.get("union_station_gateway_address", false, DEFAULT_UNION_STATION_GATEWAY_ADDRESS),
-		      options.getInt("union_station_gateway_port", false, DEFAULT_UNION_STATION_GATEWAY_PORT),
-		      options.get("union_station_gateway_cert", false, ""),
-		      options.get("union_station_proxy_address", false)),
+		  shared(boost::make_shared<SharedState>(options)),
 		  garbageCollectionTimer(loop),
 		  sinkFlushingTimer(loop),
 		  exitTimer(loop),
-		  dumpFile(options.get("analytics_dump_file", false, "/dev/null"))
+		  dirtySinksWatcher(loop),
+		  metricsTimer(loop),
+		  memoryPressureTimer(loop),
+		  datagramWatcher(loop)
 	{
 		int sinkFlushTimerInterval = options.getInt("analytics_sink_flush_timer_interval", false, 15);
-		sinkFlushInterval = options.getInt("analytics_sink_flush_interval", false, 0);
 		garbageCollectionTimer.set<LoggingServer, &LoggingServer::garbageCollect>(this);
 		garbageCollectionTimer.start(GARBAGE_COLLECTION_TIMEOUT, GARBAGE_COLLECTION_TIMEOUT);
 		sinkFlushingTimer.set<LoggingServer, &LoggingServer::sinkFlushTimeout>(this);
 		sinkFlushingTimer.start(sinkFlushTimerInterval, sinkFlushTimerInterval);
-		exitTimer.set<LoggingServer, &LoggingServer::exitTimerTimeout>(this);
-		exitTimer.set(0.05, 0.05);
-		refuseNewConnections = false;
-		exitRequested = false;
-		inactiveLogSinksCount = 0;
+		if (shared->aggregatesMetrics()) {
+			metricsTimer.set<LoggingServer, &LoggingServer::metricsTimeout>(this);
+			metricsTimer.start(shared->metricsInterval, shared->metricsInterval);
+		}
+		initialize();
+	}
+	
+	/**
+	 * Creates a LoggingServer that runs on a different event loop than
+	 * `primary`, but shares its transactions and log sinks. Both servers
+	 * accept clients on the same socket, so that clients are spread over
+	 * the event loops. Only the primary server runs the garbage collection
+	 * and sink flushing timers. The secondary server must be destroyed
+	 * before the primary one.
+	 */
+	LoggingServer(struct ev_loop *loop,
+		FileDescriptor fd,
+		const AccountsDatabasePtr &accountsDatabase,
+		LoggingServer &primary)
+		: EventedMessageServer(loop, fd, accountsDatabase),
+		  shared(primary.shared),
+		  garbageCollectionTimer(loop),
+		  sinkFlushingTimer(loop),
+		  exitTimer(loop),
+		  dirtySinksWatcher(loop),
+		  metricsTimer(loop),
+		  memoryPressureTimer(loop),
+		  datagramWatcher(loop)
+	{
+		initialize();
+	}
+	
+	/**
+	 * Also accepts whole transactions as datagrams on the given Unix
+	 * datagram socket, from UnionStation::LoggerFactories that have a
+	 * datagram address set. The socket must be non-blocking.
+	 */
+	void listenForDatagrams(const FileDescriptor &fd) {
+		datagramFd = fd;
+		datagramBuffer.resize(MAX_DATAGRAM_SIZE);
+		datagramWatcher.set<LoggingServer, &LoggingServer::onDatagramReadable>(this);
+		datagramWatcher.start(fd, ev::READ);
 	}
 	
 	~LoggingServer() {
-		TransactionMap::iterator it, end = transactions.end();
-		for (it = transactions.begin(); it != end; it++) {
-			TransactionPtr &transaction = it->second;
-			if (transaction->crashProtect) {
-				writeDetachEntry(NULL, transaction);
-			} else {
-				transaction->discard();
-			}
+		// Clients are freed by our base class, after the shared state
+		// may already have been destroyed.
+		ClientSet::const_iterator it, end = getClients().end();
+		for (it = getClients().begin(); it != end; it++) {
+			static_cast<Client *>(*it)->currentTransaction.reset();
 		}
 		
-		// Invoke destructors, causing all transactions and log sinks to
-		// be flushed before RemoteSender is being destroyed.
-		transactions.clear();
-		logSinkCache.clear();
-		inactiveLogSinks.clear();
+		shared->metrics->removeAll(this);
+		boost::lock_guard<boost::mutex> l(shared->serversSyncher);
+		shared->servers.erase(find(shared->servers.begin(),
+			shared->servers.end(), this));
 	}
 	
-	void dump(ostream &stream) const {
-		TransactionMap::const_iterator it;
-		TransactionMap::const_iterator end = transactions.end();
-		
-		ClientSet::const_iterator cit, cend = getClients().end();
-		stream << "Clients:\n";
-		stream << "  Count: " << getClients().size() << "\n";
-		for (cit = getClients().begin(); cit != cend; cit++) {
-			const Client *client = static_cast<Client *>(*cit);
-			client->inspect(stream);
+	/**
+	 * The registry with the metrics of all LoggingServers that share this
+	 * one's state.
+	 */
+	const MetricsRegistryPtr &getMetrics() const {
+		return shared->metrics;
+	}
+	
+	/**
+	 * The local store of request transactions, or NULL if the
+	 * analytics_store_dir option isn't set.
+	 */
+	const boost::shared_ptr<RequestStore> &getRequestStore() const {
+		return shared->requestStore;
+	}
+	
+	void dump(ostream &stream) {
+		{
+			boost::lock_guard<boost::mutex> l(shared->serversSyncher);
+			vector<LoggingServer *>::const_iterator it;
+			unsigned int i = 0;
+			for (it = shared->servers.begin(); it != shared->servers.end(); it++, i++) {
+				// Other servers' client lists are owned by their own event
+				// loops, so only their client counts are shown.
+				LoggingServer *server = *it;
+				if (shared->servers.size() > 1) {
+					stream << "Event loop " << i << " clients:\n";
+				} else {
+					stream << "Clients:\n";
+				}
+				if (server == this) {
+					ClientSet::const_iterator cit, cend = getClients().end();
+					stream << "  Count: " << getClients().size() << "\n";
+					for (cit = getClients().begin(); cit != cend; cit++) {
+						const Client *client = static_cast<Client *>(*cit);
+						client->inspect(stream);
+					}
+				} else {
+					stream << "  Count: " << server->getClients().size() << "\n";
+				}
+				stream << "\n";
+			}
 		}
-		stream << "\n";
 
+		stream << "Transaction memory:\n";
+		stream << "   Used   : " << shared->transactionMemory << " bytes\n";
+		stream << "   Limits : " << shared->memoryLimit << " bytes, " <<
+			shared->clientMemoryLimit << " bytes per client\n";
+		stream << "   Evicted: " << shared->transactionsEvicted << " transactions\n";
+		stream << "\n";
+		
 		stream << "RemoteSender:\n";
-		remoteSender.inspect(stream);
+		shared->remoteSender.inspect(stream);
 		stream << "\n";
+		
+		if (shared->aggregatesMetrics()) {
+			stream << "Metrics aggregator:\n";
+			shared->metricsAggregator.inspect(stream);
+			stream << "\n";
+		}
+		
+		if (shared->requestStore != NULL) {
+			stream << "Request store:\n";
+			shared->requestStore->inspect(stream);
+			stream << "\n";
+		}
 
-		LogSinkCache::const_iterator sit;
-		LogSinkCache::const_iterator send = logSinkCache.end();
-		stream << "Open log sinks:\n";
-		stream << "   Count: " << logSinkCache.size() <<
-			" (of which " << inactiveLogSinksCount << " inactive)\n";
-		for (sit = logSinkCache.begin(); sit != send; sit++) {
-			const LogSinkPtr &logSink = sit->second;
-			logSink->dump(stream);
+		{
+			boost::lock_guard<boost::mutex> l(shared->sinksSyncher);
+			LogSinkCache::const_iterator sit;
+			LogSinkCache::const_iterator send = shared->logSinkCache.end();
+			stream << "Open log sinks:\n";
+			stream << "   Count: " << shared->logSinkCache.size() <<
+				" (of which " << shared->inactiveLogSinksCount << " inactive)\n";
+			for (sit = shared->logSinkCache.begin(); sit != send; sit++) {
+				const LogSinkPtr &logSink = sit->second;
+				logSink->dump(stream);
+			}
+			stream << "\n";
 		}
-		stream << "\n";
 
-		stream << "Open transactions:\n";
-		stream << "   Count: " << transactions.size() << "\n";
-		for (it = transactions.begin(); it != end; it++) {
-			const TransactionPtr &transaction = it->second;
-			transaction->dump(stream);
+		unsigned int count = 0;
+		stringstream transactionsStream;
+		for (unsigned int i = 0; i < TRANSACTION_SHARD_COUNT; i++) {
+			TransactionShard &shard = shared->shards[i];
+			boost::lock_guard<boost::mutex> l(shard.syncher);
+			TransactionMap::const_iterator it, end = shard.transactions.end();
+			for (it = shard.transactions.begin(); it != end; it++) {
+				const TransactionPtr &transaction = it->second;
+				transaction->dump(transactionsStream);
+				count++;
+			}
 		}
+		stream << "Open transactions:\n";
+		stream << "   Count: " << count << "\n";
+		stream << transactionsStream.str();
+	}
+	
+private:
+	void initialize() {
+		exitTimer.set<LoggingServer, &LoggingServer::exitTimerTimeout>(this);
+		exitTimer.set(0.05, 0.05);
+		dirtySinksWatcher.set<LoggingServer, &LoggingServer::writeDirtySinks>(this);
+		dirtySinksWatcher.start();
+		memoryPressureTimer.set<LoggingServer, &LoggingServer::memoryPressureTimeout>(this);
+		memoryPressureTimer.set(0.1, 0.1);
+		
+		const MetricsRegistryPtr &metrics = shared->metrics;
+		acceptsMetric = metrics->add(this, "passenger_logging_accepts_total",
+			Metric::COUNTER, "Client connections accepted by the logging agent.");
+		clientsMetric = metrics->add(this, "passenger_logging_clients",
+			Metric::GAUGE, "Clients connected to the logging agent.");
+		transactionsOpenedMetric = metrics->add(this, "passenger_logging_transactions_opened_total",
+			Metric::COUNTER, "Transactions opened.");
+		transactionsClosedMetric = metrics->add(this, "passenger_logging_transactions_closed_total",
+			Metric::COUNTER, "Transactions closed by all the clients that had opened them.");
+		entriesMetric = metrics->add(this, "passenger_logging_entries_total",
+			Metric::COUNTER, "Log entries received.");
+		entryBytesMetric = metrics->add(this, "passenger_logging_entry_bytes_total",
+			Metric::COUNTER, "Bytes of log entry data received.");
+		datagramsMetric = metrics->add(this, "passenger_logging_datagrams_total",
+			Metric::COUNTER, "Transactions received on the datagram socket.");
+		rejectedDatagramsMetric = metrics->add(this, "passenger_logging_rejected_datagrams_total",
+			Metric::COUNTER, "Datagrams that were rejected because they were invalid.");
+		
+		boost::lock_guard<boost::mutex> l(shared->serversSyncher);
+		shared->servers.push_back(this);
 	}
 };
 
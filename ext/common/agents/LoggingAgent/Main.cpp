@@ -61,6 +61,7 @@ static VariantMap agentsOptions;
 static string passengerRoot;
 static string socketAddress;
 static string adminSocketAddress;
+static string datagramSocketAddress;
 static string password;
 static string username;
 static string groupname;
@@ -69,15 +70,78 @@ static string adminToolStatusPassword;
 /***** Constants and working objects *****/
 
 static const int MESSAGE_SERVER_THREAD_STACK_SIZE = 128 * 1024;
+static const int WORKER_THREAD_STACK_SIZE = 256 * 1024;
+
+static struct ev_loop *eventLoop = NULL;
+static ev::async *workerExitWatcher = NULL;
+
+/**
+ * An additional event loop, running in its own thread, with a LoggingServer
+ * that accepts clients on the same socket as the main LoggingServer and
+ * that shares its transactions and log sinks.
+ */
+struct Worker {
+	struct ev_loop *loop;
+	ev::async stopWatcher;
+	LoggingServerPtr loggingServer;
+	boost::shared_ptr<oxt::thread> thread;
+
+	Worker(unsigned int number, const FileDescriptor &serverSocketFd,
+		const AccountsDatabasePtr &accountsDatabase, LoggingServer &primary)
+		: loop(ev_loop_new(EVBACKEND_EPOLL | EVBACKEND_KQUEUE)),
+		  stopWatcher(loop)
+	{
+		if (loop == NULL) {
+			loop = ev_loop_new(0);
+		}
+		if (loop == NULL) {
+			throw RuntimeException("Cannot create an event loop");
+		}
+		stopWatcher.set(loop);
+		stopWatcher.set<Worker, &Worker::stopRequested>(this);
+		stopWatcher.start();
+		loggingServer = boost::make_shared<LoggingServer>(loop, serverSocketFd,
+			accountsDatabase, primary);
+		thread = boost::make_shared<oxt::thread>(
+			boost::bind(&Worker::mainLoop, this),
+			"Logging worker thread " + toString(number),
+			WORKER_THREAD_STACK_SIZE);
+	}
+
+	~Worker() {
+		stopWatcher.send();
+		thread->join();
+		thread.reset();
+		loggingServer.reset();
+		stopWatcher.stop();
+		ev_loop_destroy(loop);
+	}
+
+	void mainLoop() {
+		ev_run(loop, 0);
+		// The loop may also have been broken by an 'exit' command received
+		// by this worker's LoggingServer. Let the main loop exit as well.
+		workerExitWatcher->send();
+	}
+
+	void stopRequested(ev::async &watcher, int revents) {
+		ev_break(loop, EVBREAK_ALL);
+	}
+};
+
+typedef boost::shared_ptr<Worker> WorkerPtr;
 
 struct WorkingObjects {
 	ResourceLocatorPtr resourceLocator;
 	FileDescriptor serverSocketFd;
+	FileDescriptor datagramSocketFd;
 	AccountsDatabasePtr adminAccountsDatabase;
 	MessageServerPtr adminServer;
 	boost::shared_ptr<oxt::thread> adminServerThread;
 	AccountsDatabasePtr accountsDatabase;
 	LoggingServerPtr loggingServer;
+	// Destroyed before loggingServer, whose state the workers share.
+	vector<WorkerPtr> workers;
 
 	~WorkingObjects() {
 		// Stop thread before destroying anything else.
@@ -87,7 +151,6 @@ struct WorkingObjects {
 	}
 };
 
-static struct ev_loop *eventLoop = NULL;
 static LoggingServer *loggingServer = NULL;
 static int exitCode = 0;
 
@@ -150,6 +213,7 @@ initializeOptions(WorkingObjects &wo) {
 	passengerRoot      = agentsOptions.get("passenger_root");
 	socketAddress      = agentsOptions.get("logging_agent_address");
 	adminSocketAddress = agentsOptions.get("logging_agent_admin_address");
+	datagramSocketAddress = agentsOptions.get("logging_agent_datagram_address", false);
 	password           = agentsOptions.get("logging_agent_password");
 	username           = agentsOptions.get("analytics_log_user", false, myself());
 	groupname          = agentsOptions.get("analytics_log_group", false);
@@ -174,6 +238,20 @@ initializePrivilegedWorkingObjects(WorkingObjects &wo) {
 				S_IROTH | S_IWOTH | S_IXOTH);
 		} while (ret == -1 && errno == EINTR);
 	}
+	if (!datagramSocketAddress.empty()) {
+		// Like the stream socket, this is protected by the password
+		// that every datagram carries.
+		string filename = parseUnixSocketAddress(datagramSocketAddress);
+		int ret;
+
+		wo.datagramSocketFd = createUnixDatagramServer(filename);
+		do {
+			ret = chmod(filename.c_str(),
+				S_IRUSR | S_IWUSR |
+				S_IRGRP | S_IWGRP |
+				S_IROTH | S_IWOTH);
+		} while (ret == -1 && errno == EINTR);
+	}
 
 	wo.adminAccountsDatabase = boost::make_shared<AccountsDatabase>();	
 	wo.adminAccountsDatabase->add("_passenger-status", adminToolStatusPassword, false);
@@ -266,12 +344,24 @@ createEventLoop() {
 static void
 initializeUnprivilegedWorkingObjects(WorkingObjects &wo) {
 	eventLoop = createEventLoop();
+	workerExitWatcher = new ev::async(eventLoop);
 	wo.accountsDatabase = boost::make_shared<AccountsDatabase>();
 	wo.accountsDatabase->add("logging", password, false);
 
 	wo.loggingServer = boost::make_shared<LoggingServer>(eventLoop, wo.serverSocketFd,
 		wo.accountsDatabase, agentsOptions);
 	loggingServer = wo.loggingServer.get();
+	if (wo.datagramSocketFd != -1) {
+		setNonBlocking(wo.datagramSocketFd);
+		wo.loggingServer->listenForDatagrams(wo.datagramSocketFd);
+	}
+
+	unsigned int threads = (unsigned int) std::max(1,
+		agentsOptions.getInt("logging_agent_threads", false, 1));
+	for (unsigned int i = 1; i < threads; i++) {
+		wo.workers.push_back(boost::make_shared<Worker>(i, wo.serverSocketFd,
+			wo.accountsDatabase, *wo.loggingServer));
+	}
 
 	wo.adminServer->addHandler(boost::make_shared<AdminController>(wo.loggingServer));
 	boost::function<void ()> adminServerFunc = boost::bind(&MessageServer::mainLoop, wo.adminServer.get());
@@ -293,6 +383,11 @@ caughtExitSignal(ev::sig &watcher, int revents) {
 	exitCode = 1;
 }
 
+static void
+workerExited(ev::async &watcher, int revents) {
+	ev_break(eventLoop, EVBREAK_ONE);
+}
+
 void
 printInfo(ev::sig &watcher, int revents) {
 	cerr << "---------- Begin LoggingAgent status ----------\n";
@@ -308,6 +403,8 @@ runMainLoop(WorkingObjects &wo) {
 	ev::sig sigtermWatcher(eventLoop);
 	ev::sig sigquitWatcher(eventLoop);
 	
+	workerExitWatcher->set<&workerExited>();
+	workerExitWatcher->start();
 	sigintWatcher.set<&caughtExitSignal>();
 	sigintWatcher.start(SIGINT);
 	sigtermWatcher.set<&caughtExitSignal>();
@@ -316,12 +413,18 @@ runMainLoop(WorkingObjects &wo) {
 	sigquitWatcher.start(SIGQUIT);
 	
 	P_WARN("PassengerLoggingAgent online, listening at " << socketAddress);
+	if (!datagramSocketAddress.empty()) {
+		P_INFO("Accepting transaction datagrams at " << datagramSocketAddress);
+	}
 	if (feedbackFdAvailable()) {
 		feedbackFdWatcher.set<&feedbackFdBecameReadable>();
 		feedbackFdWatcher.start(FEEDBACK_FD, ev::READ);
 		writeArrayMessage(FEEDBACK_FD, "initialized", NULL);
 	}
 	ev_run(eventLoop, 0);
+	workerExitWatcher->stop();
+	// Stop the workers before anything else is destroyed.
+	wo.workers.clear();
 }
 
 int
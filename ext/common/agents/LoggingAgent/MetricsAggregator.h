@@ -0,0 +1,366 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_METRICS_AGGREGATOR_H_
+#define _PASSENGER_METRICS_AGGREGATOR_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <cstring>
+
+#include <boost/thread.hpp>
+
+#include <StaticString.h>
+#include <Utils/StrIntUtils.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * A histogram of latencies, in microseconds, with logarithmic buckets like
+ * those of HDR histograms. Every power of two is divided into 16 buckets,
+ * so a recorded value is off by at most 1/16th. Histograms are merged by
+ * adding up their buckets, so histograms from different nodes or periods
+ * can be combined without losing precision.
+ */
+class ResponseTimeHistogram {
+public:
+	static const unsigned int LINEAR_BUCKETS = 32;
+	static const unsigned int SUB_BUCKETS = 16;
+	static const unsigned int BUCKET_COUNT = LINEAR_BUCKETS + 27 * SUB_BUCKETS;
+
+private:
+	unsigned int counts[BUCKET_COUNT];
+	unsigned long long totalCount;
+
+	static unsigned int highestBit(unsigned int value) {
+		unsigned int result = 0;
+		while (value >>= 1) {
+			result++;
+		}
+		return result;
+	}
+
+public:
+	ResponseTimeHistogram() {
+		clear();
+	}
+
+	static unsigned int indexFor(unsigned int value) {
+		if (value < LINEAR_BUCKETS) {
+			return value;
+		} else {
+			unsigned int shift = highestBit(value) - 4;
+			return LINEAR_BUCKETS + (shift - 1) * SUB_BUCKETS
+				+ (value >> shift) - SUB_BUCKETS;
+		}
+	}
+
+	static unsigned int lowestValueAt(unsigned int index) {
+		if (index < LINEAR_BUCKETS) {
+			return index;
+		} else {
+			unsigned int shift = (index - LINEAR_BUCKETS) / SUB_BUCKETS + 1;
+			unsigned int sub = (index - LINEAR_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+			return sub << shift;
+		}
+	}
+
+	static unsigned int highestValueAt(unsigned int index) {
+		if (index < LINEAR_BUCKETS) {
+			return index;
+		} else {
+			unsigned int shift = (index - LINEAR_BUCKETS) / SUB_BUCKETS + 1;
+			return lowestValueAt(index) + (1u << shift) - 1;
+		}
+	}
+
+	void record(unsigned int value, unsigned int count = 1) {
+		counts[indexFor(value)] += count;
+		totalCount += count;
+	}
+
+	void merge(const ResponseTimeHistogram &other) {
+		for (unsigned int i = 0; i < BUCKET_COUNT; i++) {
+			counts[i] += other.counts[i];
+		}
+		totalCount += other.totalCount;
+	}
+
+	void clear() {
+		memset(counts, 0, sizeof(counts));
+		totalCount = 0;
+	}
+
+	unsigned long long getTotalCount() const {
+		return totalCount;
+	}
+
+	/**
+	 * Returns the highest value that is equivalent to the value at the
+	 * given percentile (0-100), or 0 if the histogram is empty.
+	 */
+	unsigned int percentile(double p) const {
+		unsigned long long rank = (unsigned long long) (p / 100 * totalCount + 0.5);
+		unsigned long long seen = 0;
+
+		if (rank == 0) {
+			rank = 1;
+		}
+		for (unsigned int i = 0; i < BUCKET_COUNT; i++) {
+			seen += counts[i];
+			if (seen >= rank) {
+				return highestValueAt(i);
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * Appends the non-empty buckets as comma-separated "index:count"
+	 * pairs, so that the receiver can merge histograms.
+	 */
+	void serialize(string &output) const {
+		bool first = true;
+		for (unsigned int i = 0; i < BUCKET_COUNT; i++) {
+			if (counts[i] != 0) {
+				if (!first) {
+					output.append(1, ',');
+				}
+				output.append(toString(i));
+				output.append(1, ':');
+				output.append(toString(counts[i]));
+				first = false;
+			}
+		}
+	}
+};
+
+
+/**
+ * Aggregates Union Station request transactions into per (application,
+ * controller action) request counts and latency histograms, so that
+ * summaries can be sent to Union Station instead of every transaction.
+ * Summaries are kept separately per Union Station key and node, because
+ * that's where they're sent to.
+ *
+ * This class is thread-safe.
+ */
+class MetricsAggregator {
+public:
+	struct Metrics {
+		unsigned long long count;
+		/** The number of requests that responded with a 5xx status. */
+		unsigned long long errors;
+		unsigned long long totalTime;
+		unsigned int minTime;
+		unsigned int maxTime;
+		ResponseTimeHistogram histogram;
+		/** The CPU time, in microseconds, and the number of allocated
+		 * objects that the application reported for the requests. */
+		unsigned long long totalCpuTime;
+		unsigned long long totalAllocations;
+
+		Metrics() {
+			count = 0;
+			errors = 0;
+			totalTime = 0;
+			minTime = 0;
+			maxTime = 0;
+			totalCpuTime = 0;
+			totalAllocations = 0;
+		}
+	};
+
+	/** The summary of one period for one Union Station key and node. */
+	struct Summary {
+		string unionStationKey;
+		string nodeName;
+		string data;
+	};
+
+private:
+	struct Destination {
+		string unionStationKey;
+		string nodeName;
+		/** Keyed by group name + "\t" + controller action. */
+		map<string, Metrics> metrics;
+	};
+
+	mutable boost::mutex syncher;
+	map<string, Destination> destinations;
+	unsigned long long periodStart;
+	unsigned long long requestsRecorded;
+	unsigned long long summariesCreated;
+
+	static void appendSummaryLine(string &output, const string &key, const Metrics &metrics) {
+		output.append(key);
+		output.append("\tcount=");
+		output.append(toString(metrics.count));
+		output.append("\terrors=");
+		output.append(toString(metrics.errors));
+		output.append("\ttotal=");
+		output.append(toString(metrics.totalTime));
+		output.append("\tmin=");
+		output.append(toString(metrics.minTime));
+		output.append("\tmax=");
+		output.append(toString(metrics.maxTime));
+		output.append("\tp50=");
+		output.append(toString(min(metrics.histogram.percentile(50), metrics.maxTime)));
+		output.append("\tp90=");
+		output.append(toString(min(metrics.histogram.percentile(90), metrics.maxTime)));
+		output.append("\tp99=");
+		output.append(toString(min(metrics.histogram.percentile(99), metrics.maxTime)));
+		output.append("\tcpu=");
+		output.append(toString(metrics.totalCpuTime));
+		output.append("\tallocations=");
+		output.append(toString(metrics.totalAllocations));
+		output.append("\thistogram=");
+		metrics.histogram.serialize(output);
+		output.append("\n");
+	}
+
+public:
+	MetricsAggregator(unsigned long long now = 0) {
+		periodStart = now;
+		requestsRecorded = 0;
+		summariesCreated = 0;
+	}
+
+	/**
+	 * Records a request.
+	 *
+	 * @param responseTime The response time in microseconds.
+	 * @param cpuTime The CPU time that the application reported, in microseconds.
+	 * @param allocations The number of objects that the application reported
+	 *                    to have allocated.
+	 */
+	void record(const StaticString &unionStationKey, const StaticString &nodeName,
+		const StaticString &groupName, const StaticString &controllerAction,
+		int responseTime, int statusCode, int cpuTime = 0, int allocations = 0)
+	{
+		string destinationKey, metricsKey;
+		unsigned int time = responseTime < 0 ? 0 : responseTime;
+
+		destinationKey.reserve(unionStationKey.size() + nodeName.size() + 1);
+		destinationKey.append(unionStationKey.data(), unionStationKey.size());
+		destinationKey.append(1, '\0');
+		destinationKey.append(nodeName.data(), nodeName.size());
+		metricsKey.reserve(groupName.size() + controllerAction.size() + 1);
+		metricsKey.append(groupName.data(), groupName.size());
+		metricsKey.append(1, '\t');
+		if (controllerAction.empty()) {
+			metricsKey.append(1, '-');
+		} else {
+			metricsKey.append(controllerAction.data(), controllerAction.size());
+		}
+
+		boost::lock_guard<boost::mutex> l(syncher);
+		map<string, Destination>::iterator it = destinations.find(destinationKey);
+		if (it == destinations.end()) {
+			it = destinations.insert(make_pair(destinationKey, Destination())).first;
+			it->second.unionStationKey = unionStationKey;
+			it->second.nodeName = nodeName;
+		}
+
+		Metrics &metrics = it->second.metrics[metricsKey];
+		if (metrics.count == 0 || time < metrics.minTime) {
+			metrics.minTime = time;
+		}
+		if (time > metrics.maxTime) {
+			metrics.maxTime = time;
+		}
+		metrics.count++;
+		metrics.totalTime += time;
+		if (statusCode >= 500) {
+			metrics.errors++;
+		}
+		metrics.histogram.record(time);
+		metrics.totalCpuTime += std::max(cpuTime, 0);
+		metrics.totalAllocations += std::max(allocations, 0);
+		requestsRecorded++;
+	}
+
+	/**
+	 * Summarizes everything that was recorded since the previous call, and
+	 * starts a new period. The summary consists of a "period <start> <end>"
+	 * line, followed by one line per application and controller action,
+	 * containing tab-separated fields.
+	 *
+	 * @param now The current time, in seconds since the epoch.
+	 */
+	void takeSummaries(vector<Summary> &summaries, unsigned long long now) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		map<string, Destination>::const_iterator it, end = destinations.end();
+
+		for (it = destinations.begin(); it != end; it++) {
+			const Destination &destination = it->second;
+			map<string, Metrics>::const_iterator mit, mend = destination.metrics.end();
+			Summary summary;
+
+			summary.unionStationKey = destination.unionStationKey;
+			summary.nodeName = destination.nodeName;
+			summary.data.append("period ");
+			summary.data.append(toString(periodStart));
+			summary.data.append(" ");
+			summary.data.append(toString(now));
+			summary.data.append("\n");
+			for (mit = destination.metrics.begin(); mit != mend; mit++) {
+				appendSummaryLine(summary.data, mit->first, mit->second);
+			}
+			summaries.push_back(summary);
+		}
+		summariesCreated += destinations.size();
+		destinations.clear();
+		periodStart = now;
+	}
+
+	bool empty() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return destinations.empty();
+	}
+
+	void inspect(ostream &stream) const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		map<string, Destination>::const_iterator it, end = destinations.end();
+		unsigned int count = 0;
+
+		for (it = destinations.begin(); it != end; it++) {
+			count += it->second.metrics.size();
+		}
+		stream << "   Requests recorded : " << requestsRecorded << "\n";
+		stream << "   Summaries created : " << summariesCreated << "\n";
+		stream << "   Current period    : " << count << " controller actions on " <<
+			destinations.size() << " nodes\n";
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_METRICS_AGGREGATOR_H_ */
@@ -0,0 +1,325 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_PACKET_SPOOL_H_
+#define _PASSENGER_PACKET_SPOOL_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <oxt/system_calls.hpp>
+
+#include <FileDescriptor.h>
+#include <StaticString.h>
+#include <Exceptions.h>
+
+namespace Passenger {
+
+using namespace std;
+
+
+/**
+ * A bounded, append-only queue of records, stored in a file. RemoteSender
+ * uses this to keep Union Station packets on disk while the gateway is
+ * unreachable, so that the logging agent's memory usage stays flat.
+ *
+ * The file starts with a header containing a magic string and the offset
+ * of the first record that hasn't been consumed yet. Each record consists
+ * of a 4-byte big endian size followed by the data. Records are consumed
+ * in the order in which they were appended; once all records have been
+ * consumed, the file is truncated. Because the read offset is stored in
+ * the file, unconsumed records survive a restart.
+ *
+ * This class is thread-safe.
+ */
+class PacketSpool {
+private:
+	static const unsigned int MAGIC_SIZE = 8;
+	static const unsigned int HEADER_SIZE = MAGIC_SIZE + 8;
+
+	const string path;
+	const unsigned long long maxSize;
+
+	mutable boost::mutex syncher;
+	FileDescriptor fd;
+	unsigned long long readOffset;
+	unsigned long long writeOffset;
+	unsigned int count;
+
+	static const char *magic() {
+		return "PSPOOL01";
+	}
+
+	static void encodeUint32(unsigned int value, unsigned char *buf) {
+		buf[0] = (value >> 24) & 0xFF;
+		buf[1] = (value >> 16) & 0xFF;
+		buf[2] = (value >> 8) & 0xFF;
+		buf[3] = value & 0xFF;
+	}
+
+	static unsigned int decodeUint32(const unsigned char *buf) {
+		return ((unsigned int) buf[0] << 24)
+			| ((unsigned int) buf[1] << 16)
+			| ((unsigned int) buf[2] << 8)
+			| (unsigned int) buf[3];
+	}
+
+	void writeAt(const void *data, size_t size, unsigned long long offset) {
+		const char *current = (const char *) data;
+		while (size > 0) {
+			ssize_t ret;
+			do {
+				ret = ::pwrite(fd, current, size, offset);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				int e = errno;
+				throw FileSystemException("Cannot write to spool file " + path, e, path);
+			}
+			current += ret;
+			size -= ret;
+			offset += ret;
+		}
+	}
+
+	/** Returns whether `size` bytes could be read. */
+	bool readAt(void *data, size_t size, unsigned long long offset) {
+		char *current = (char *) data;
+		while (size > 0) {
+			ssize_t ret;
+			do {
+				ret = ::pread(fd, current, size, offset);
+			} while (ret == -1 && errno == EINTR);
+			if (ret == -1) {
+				int e = errno;
+				throw FileSystemException("Cannot read from spool file " + path, e, path);
+			} else if (ret == 0) {
+				return false;
+			}
+			current += ret;
+			size -= ret;
+			offset += ret;
+		}
+		return true;
+	}
+
+	void writeHeader() {
+		unsigned char header[HEADER_SIZE];
+		memcpy(header, magic(), MAGIC_SIZE);
+		encodeUint32((unsigned int) (readOffset >> 32), header + MAGIC_SIZE);
+		encodeUint32((unsigned int) (readOffset & 0xFFFFFFFF), header + MAGIC_SIZE + 4);
+		writeAt(header, HEADER_SIZE, 0);
+	}
+
+	void truncate(unsigned long long size) {
+		int ret;
+		do {
+			ret = ::ftruncate(fd, size);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot truncate spool file " + path, e, path);
+		}
+	}
+
+	/** Discards all records. */
+	void reset() {
+		readOffset = writeOffset = HEADER_SIZE;
+		count = 0;
+		truncate(HEADER_SIZE);
+		writeHeader();
+	}
+
+	/**
+	 * Counts the records in an existing file. A partially written record at
+	 * the end, e.g. because we crashed while appending, is discarded.
+	 */
+	void load() {
+		unsigned char header[HEADER_SIZE];
+		struct stat buf;
+
+		if (fstat(fd, &buf) == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot stat spool file " + path, e, path);
+		}
+		writeOffset = buf.st_size;
+		if (!readAt(header, HEADER_SIZE, 0) || memcmp(header, magic(), MAGIC_SIZE) != 0) {
+			reset();
+			return;
+		}
+		readOffset = ((unsigned long long) decodeUint32(header + MAGIC_SIZE) << 32)
+			| decodeUint32(header + MAGIC_SIZE + 4);
+		if (readOffset < HEADER_SIZE || readOffset > writeOffset) {
+			reset();
+			return;
+		}
+
+		unsigned long long offset = readOffset;
+		count = 0;
+		while (offset < writeOffset) {
+			unsigned char sizeBuf[4];
+			unsigned long long end;
+			if (!readAt(sizeBuf, 4, offset)) {
+				break;
+			}
+			end = offset + 4 + decodeUint32(sizeBuf);
+			if (end > writeOffset) {
+				break;
+			}
+			offset = end;
+			count++;
+		}
+		if (offset != writeOffset) {
+			writeOffset = offset;
+			truncate(writeOffset);
+		}
+		if (count == 0) {
+			reset();
+		}
+	}
+
+public:
+	/**
+	 * Opens the spool file at the given path, creating it if it doesn't
+	 * exist. The file will not grow beyond `maxSize` bytes.
+	 *
+	 * @throws FileSystemException
+	 */
+	PacketSpool(const string &_path, unsigned long long _maxSize)
+		: path(_path),
+		  maxSize(_maxSize)
+	{
+		int ret = oxt::syscalls::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+		if (ret == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot open spool file " + path, e, path);
+		}
+		fd = ret;
+		load();
+	}
+
+	const string &getPath() const {
+		return path;
+	}
+
+	/**
+	 * Appends a record. Returns false if there's no room for it.
+	 *
+	 * @throws FileSystemException
+	 */
+	bool append(const StaticString &data) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		if (writeOffset + 4 + data.size() > maxSize) {
+			return false;
+		}
+
+		unsigned char sizeBuf[4];
+		encodeUint32(data.size(), sizeBuf);
+		try {
+			writeAt(sizeBuf, 4, writeOffset);
+			writeAt(data.data(), data.size(), writeOffset + 4);
+		} catch (...) {
+			// Don't leave a partial record behind.
+			truncate(writeOffset);
+			throw;
+		}
+		writeOffset += 4 + data.size();
+		count++;
+		return true;
+	}
+
+	/**
+	 * Reads the oldest record into `output` without consuming it.
+	 * Returns false if the spool is empty.
+	 *
+	 * @throws FileSystemException
+	 */
+	bool peek(string &output) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		if (count == 0) {
+			return false;
+		}
+
+		unsigned char sizeBuf[4];
+		if (!readAt(sizeBuf, 4, readOffset)) {
+			throw IOException("Spool file " + path + " was truncated unexpectedly");
+		}
+		output.resize(decodeUint32(sizeBuf));
+		if (!output.empty() && !readAt(&output[0], output.size(), readOffset + 4)) {
+			throw IOException("Spool file " + path + " was truncated unexpectedly");
+		}
+		return true;
+	}
+
+	/**
+	 * Consumes the oldest record.
+	 *
+	 * @throws FileSystemException
+	 */
+	void pop() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		if (count == 0) {
+			return;
+		}
+
+		unsigned char sizeBuf[4];
+		if (!readAt(sizeBuf, 4, readOffset)) {
+			throw IOException("Spool file " + path + " was truncated unexpectedly");
+		}
+		count--;
+		if (count == 0) {
+			reset();
+		} else {
+			readOffset += 4 + decodeUint32(sizeBuf);
+			writeHeader();
+		}
+	}
+
+	bool empty() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return count == 0;
+	}
+
+	/** The number of records in the spool. */
+	unsigned int size() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return count;
+	}
+
+	/** The number of bytes used by unconsumed records. */
+	unsigned long long usedBytes() const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		return writeOffset - readOffset;
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_PACKET_SPOOL_H_ */
@@ -34,9 +34,11 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 #include <oxt/thread.hpp>
 #include <string>
 #include <list>
+#include <vector>
 
 #include <Logging.h>
 #include <StaticString.h>
@@ -46,6 +48,7 @@
 #include <Utils/ScopeGuard.h>
 #include <Utils/Base64.h>
 #include <Utils/Curl.h>
+#include <agents/LoggingAgent/PacketSpool.h>
 
 namespace Passenger {
 
@@ -54,8 +57,31 @@ using namespace boost;
 using namespace oxt;
 
 
+/**
+ * Sends Union Station data to the Union Station gateway servers in the
+ * background. Scheduled packets are put in a queue which is processed by
+ * a pool of sender threads. Every gateway server keeps its connections
+ * open between requests, one for every sender thread that is currently
+ * using it. Uncompressed packets for the same key, node and category that
+ * are waiting in the queue are coalesced into a single request.
+ *
+ * If a spool file is configured, then packets that don't fit in the queue,
+ * or that cannot be sent because all gateway servers are down, are
+ * compressed and written to the spool instead of being dropped. Spooled
+ * packets are sent in order once the gateway servers are reachable again.
+ */
 class RemoteSender {
+public:
+	static const unsigned int DEFAULT_THREADS = 2;
+	static const unsigned long long DEFAULT_SPOOL_MAX_SIZE = 64 * 1024 * 1024;
+	
 private:
+	static const unsigned int QUEUE_CAPACITY = 1024;
+	/** Above this many queued packets the sender is considered congested. */
+	static const unsigned int CONGESTION_THRESHOLD = QUEUE_CAPACITY / 2;
+	/** Maximum amount of uncompressed data in a single coalesced request. */
+	static const unsigned int MAX_COALESCED_SIZE = 1024 * 1024;
+	
 	struct Item {
 		bool exit;
 		bool compressed;
@@ -68,6 +94,33 @@ private:
 			exit = false;
 			compressed = false;
 		}
+		
+		bool sameDestination(const Item &other) const {
+			return unionStationKey == other.unionStationKey
+				&& nodeName == other.nodeName
+				&& category == other.category;
+		}
+	};
+	
+	/**
+	 * A CURL handle and its per-request state. Reusing the handle allows
+	 * libcurl to keep the connection to the gateway server alive.
+	 */
+	struct Connection {
+		CURL *curl;
+		char lastErrorMessage[CURL_ERROR_SIZE];
+		string responseBody;
+		
+		Connection() {
+			curl = NULL;
+			lastErrorMessage[0] = '\0';
+		}
+		
+		~Connection() {
+			if (curl != NULL) {
+				curl_easy_cleanup(curl);
+			}
+		}
 	};
 	
 	class Server {
@@ -77,36 +130,38 @@ private:
 		string certificate;
 		const CurlProxyInfo *proxyInfo;
 		
-		CURL *curl;
 		struct curl_slist *headers;
-		char lastErrorMessage[CURL_ERROR_SIZE];
 		string hostHeader;
-		string responseBody;
 		
 		string pingURL;
 		string sinkURL;
 		
-		void resetConnection() {
+		/** Protects idleConnections. */
+		boost::mutex syncher;
+		vector<Connection *> idleConnections;
+		
+		void resetConnection(Connection *conn) {
+			CURL *curl = conn->curl;
 			if (curl != NULL) {
 				#ifdef HAS_CURL_EASY_RESET
 					curl_easy_reset(curl);
 				#else
 					curl_easy_cleanup(curl);
-					curl = NULL;
+					curl = conn->curl = NULL;
 				#endif
 			}
 			if (curl == NULL) {
-				curl = curl_easy_init();
+				curl = conn->curl = curl_easy_init();
 				if (curl == NULL) {
 					throw IOException("Unable to create a CURL handle");
 				}
 			}
 			curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 			curl_easy_setopt(curl, CURLOPT_TIMEOUT, 180);
-			curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, lastErrorMessage);
+			curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, conn->lastErrorMessage);
 			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlDataReceived);
-			curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, conn);
 			if (certificate.empty()) {
 				curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
 			} else {
@@ -119,17 +174,58 @@ private:
 			 */
 			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
 			setCurlProxy(curl, *proxyInfo);
-			responseBody.clear();
+			conn->responseBody.clear();
+		}
+		
+		/**
+		 * Returns an idle connection, or a new one if there are none.
+		 * Must be given back with checkinConnection().
+		 */
+		Connection *checkoutConnection() {
+			{
+				boost::lock_guard<boost::mutex> l(syncher);
+				if (!idleConnections.empty()) {
+					Connection *conn = idleConnections.back();
+					idleConnections.pop_back();
+					return conn;
+				}
+			}
+			
+			Connection *conn = new Connection();
+			try {
+				resetConnection(conn);
+			} catch (...) {
+				delete conn;
+				throw;
+			}
+			return conn;
+		}
+		
+		/**
+		 * Gives back a connection. If the last request on it failed,
+		 * then it is reset first, which closes the underlying socket.
+		 */
+		void checkinConnection(Connection *conn, bool failed) {
+			if (failed) {
+				try {
+					resetConnection(conn);
+				} catch (const IOException &) {
+					delete conn;
+					return;
+				}
+			}
+			boost::lock_guard<boost::mutex> l(syncher);
+			idleConnections.push_back(conn);
 		}
 		
-		void prepareRequest(const string &url) {
-			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-			responseBody.clear();
+		void prepareRequest(Connection *conn, const string &url) {
+			curl_easy_setopt(conn->curl, CURLOPT_URL, url.c_str());
+			conn->responseBody.clear();
 		}
 		
 		static size_t curlDataReceived(void *buffer, size_t size, size_t nmemb, void *userData) {
-			Server *self = (Server *) userData;
-			self->responseBody.append((const char *) buffer, size * nmemb);
+			Connection *conn = (Connection *) userData;
+			conn->responseBody.append((const char *) buffer, size * nmemb);
 			return size * nmemb;
 		}
 		
@@ -155,14 +251,11 @@ private:
 				"/ping";
 			sinkURL = string("https://") + ip + ":" + toString(port) +
 				"/sink";
-			
-			curl = NULL;
-			resetConnection();
 		}
 		
 		~Server() {
-			if (curl != NULL) {
-				curl_easy_cleanup(curl);
+			foreach (Connection *conn, idleConnections) {
+				delete conn;
 			}
 			curl_slist_free_all(headers);
 		}
@@ -173,29 +266,33 @@ private:
 		
 		bool ping() {
 			P_DEBUG("Pinging Union Station gateway " << ip << ":" << port);
-			ScopeGuard guard(boost::bind(&Server::resetConnection, this));
-			prepareRequest(pingURL);
+			Connection *conn = checkoutConnection();
+			ScopeGuard guard(boost::bind(&Server::checkinConnection, this, conn, true));
+			prepareRequest(conn, pingURL);
 			
-			curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
-			if (curl_easy_perform(curl) != 0) {
+			curl_easy_setopt(conn->curl, CURLOPT_HTTPGET, 1);
+			if (curl_easy_perform(conn->curl) != 0) {
 				P_DEBUG("Could not ping Union Station gateway server " << ip
-					<< ": " << lastErrorMessage);
+					<< ": " << conn->lastErrorMessage);
 				return false;
 			}
-			if (responseBody == "pong") {
+			if (conn->responseBody == "pong") {
 				guard.clear();
+				checkinConnection(conn, false);
 				return true;
 			} else {
 				P_DEBUG("Union Station gateway server " << ip <<
 					" returned an unexpected ping message: " <<
-					responseBody);
+					conn->responseBody);
 				return false;
 			}
 		}
 		
 		bool send(const Item &item) {
-			ScopeGuard guard(boost::bind(&Server::resetConnection, this));
-			prepareRequest(sinkURL);
+			Connection *conn = checkoutConnection();
+			ScopeGuard guard(boost::bind(&Server::checkinConnection, this, conn, true));
+			CURL *curl = conn->curl;
+			prepareRequest(conn, sinkURL);
 			
 			struct curl_httppost *post = NULL;
 			struct curl_httppost *last = NULL;
@@ -245,11 +342,12 @@ private:
 			
 			if (code == CURLE_OK) {
 				guard.clear();
+				checkinConnection(conn, false);
 				// TODO: check response
 				return true;
 			} else {
 				P_DEBUG("Could not send data to Union Station gateway server " << ip
-					<< ": " << lastErrorMessage);
+					<< ": " << conn->lastErrorMessage);
 				return false;
 			}
 		}
@@ -262,21 +360,37 @@ private:
 	string certificate;
 	CurlProxyInfo proxyInfo;
 	BlockingQueue<Item> queue;
-	oxt::thread *thr;
+	vector<oxt::thread *> threads;
 	
 	mutable boost::mutex syncher;
+	boost::condition_variable checkupFinished;
 	list<ServerPtr> servers;
 	time_t nextCheckupTime;
-	unsigned int packetsSent, packetsDropped;
+	bool checkingServers;
+	unsigned int runningThreads;
+	unsigned int packetsSent, packetsDropped, packetsCoalesced;
+	
+	/** NULL if spooling is disabled. */
+	boost::shared_ptr<PacketSpool> spool;
+	bool replayingSpool;
+	unsigned int packetsSpooled, packetsReplayed;
 	
 	void threadMain() {
 		ScopeGuard guard(boost::bind(&RemoteSender::freeThreadData, this));
+		// An item that was taken from the queue while coalescing, but
+		// that could not be coalesced.
+		Item pending;
+		bool hasPending = false;
 		
 		while (true) {
 			Item item;
 			bool hasItem;
 			
-			if (firstStarted()) {
+			if (hasPending) {
+				item = pending;
+				hasItem = true;
+				hasPending = false;
+			} else if (firstStarted()) {
 				item = queue.get();
 				hasItem = true;
 			} else {
@@ -287,15 +401,50 @@ private:
 				if (item.exit) {
 					return;
 				} else {
+					hasPending = coalesce(item, pending);
 					if (timeForCheckup()) {
-						recheckServers();
+						recheckServersOrWait();
 					}
 					sendOut(item);
 				}
 			} else if (timeForCheckup()) {
-				recheckServers();
+				recheckServersOrWait();
+				replaySpool();
+			}
+		}
+	}
+	
+	/**
+	 * Appends the data of queued items with the same destination as `item`
+	 * to `item`, until an item with a different destination is
+	 * encountered. That item is stored in `next`, in which case true
+	 * is returned.
+	 */
+	bool coalesce(Item &item, Item &next) {
+		unsigned int coalesced = 0;
+		bool result = false;
+		
+		while (item.data.size() < MAX_COALESCED_SIZE && queue.tryGet(next)) {
+			// Compressed streams cannot be concatenated.
+			if (!next.exit && !item.compressed && !next.compressed
+			 && next.sameDestination(item)
+			 && item.data.size() + next.data.size() <= MAX_COALESCED_SIZE)
+			{
+				item.data.append(next.data);
+				coalesced++;
+			} else {
+				result = true;
+				break;
 			}
 		}
+		if (coalesced > 0) {
+			P_DEBUG("Coalesced " << coalesced << " Union Station packets into one: key=" <<
+				item.unionStationKey << ", node=" << item.nodeName <<
+				", category=" << item.category);
+			boost::lock_guard<boost::mutex> l(syncher);
+			packetsCoalesced += coalesced;
+		}
+		return result;
 	}
 	
 	bool firstStarted() const {
@@ -303,6 +452,35 @@ private:
 		return nextCheckupTime == 0;
 	}
 	
+	/**
+	 * Rechecks the servers, unless another thread is already doing that,
+	 * in which case this method waits until it's done.
+	 */
+	void recheckServersOrWait() {
+		boost::unique_lock<boost::mutex> l(syncher);
+		if (checkingServers) {
+			while (checkingServers) {
+				checkupFinished.wait(l);
+			}
+			return;
+		}
+		checkingServers = true;
+		l.unlock();
+		
+		try {
+			recheckServers();
+		} catch (...) {
+			l.lock();
+			checkingServers = false;
+			checkupFinished.notify_all();
+			throw;
+		}
+		
+		l.lock();
+		checkingServers = false;
+		checkupFinished.notify_all();
+	}
+	
 	void recheckServers() {
 		P_INFO("Rechecking Union Station gateway servers (" << gatewayAddress << ")...");
 		
@@ -326,6 +504,7 @@ private:
 		}
 		P_INFO(servers.size() << " Union Station gateway servers are up");
 		
+		boost::lock_guard<boost::mutex> l(syncher);
 		if (servers.empty()) {
 			scheduleNextCheckup(5 * 60);
 		} else if (someServersAreDown) {
@@ -333,20 +512,21 @@ private:
 		} else {
 			scheduleNextCheckup(3 * 60 * 60);
 		}
-
-		boost::lock_guard<boost::mutex> l(syncher);
 		this->servers = servers;
 	}
 	
 	void freeThreadData() {
 		boost::lock_guard<boost::mutex> l(syncher);
-		servers.clear(); // Invoke destructors inside this thread.
+		runningThreads--;
+		if (runningThreads == 0) {
+			servers.clear(); // Invoke destructors inside this thread.
+		}
 	}
 	
 	/**
 	 * Schedules the next checkup to be run after the given number
 	 * of seconds, unless there's already a checkup scheduled for
-	 * earlier.
+	 * earlier. Must be called while holding `syncher`.
 	 */
 	void scheduleNextCheckup(unsigned int seconds) {
 		time_t now = SystemTime::get();
@@ -371,25 +551,46 @@ private:
 		return SystemTime::get() >= nextCheckupTime;
 	}
 	
-	void sendOut(const Item &item) {
+	void sendOut(Item &item) {
+		if (!item.compressed) {
+			compress(item);
+		}
+		if (trySend(item)) {
+			replaySpool();
+		} else if (!spoolItem(item)) {
+			/* If all servers went down then all items in the queue will be
+			 * effectively dropped until after the next checkup has detected
+			 * servers that are up.
+			 */
+			P_WARN("Dropping Union Station packet because no servers are available: "
+				"key=" << item.unionStationKey <<
+				", node=" << item.nodeName <<
+				", category=" << item.category <<
+				", compressedDataSize=" << item.data.size());
+		}
+	}
+	
+	/** Sends the item to the first available server. */
+	bool trySend(const Item &item) {
 		boost::unique_lock<boost::mutex> l(syncher);
 		bool sent = false;
 		bool someServersWentDown = false;
 		
 		while (!sent && !servers.empty()) {
 			// Pick first available server and put it on the back of the list
-			// for round-robin load balancing.
+			// for round-robin load balancing. Other threads may pick the
+			// next server while we're sending.
 			ServerPtr server = servers.front();
+			servers.pop_front();
+			servers.push_back(server);
 			l.unlock();
 			if (server->send(item)) {
 				l.lock();
-				servers.pop_front();
-				servers.push_back(server);
 				sent = true;
 				packetsSent++;
 			} else {
 				l.lock();
-				servers.pop_front();
+				servers.remove(server);
 				someServersWentDown = true;
 				packetsDropped++;
 			}
@@ -402,17 +603,128 @@ private:
 				scheduleNextCheckup(60 * 60);
 			}
 		}
+		return sent;
+	}
+	
+	static string serialize(const Item &item) {
+		string result;
+		result.reserve(item.unionStationKey.size() + item.nodeName.size() +
+			item.category.size() + item.data.size() + 4);
+		result.append(item.unionStationKey);
+		result.append(1, '\0');
+		result.append(item.nodeName);
+		result.append(1, '\0');
+		result.append(item.category);
+		result.append(1, '\0');
+		result.append(1, item.compressed ? '1' : '0');
+		result.append(item.data);
+		return result;
+	}
+	
+	static bool unserialize(const string &data, Item &item) {
+		string::size_type keyEnd, nodeEnd, categoryEnd;
 		
-		/* If all servers went down then all items in the queue will be
-		 * effectively dropped until after the next checkup has detected
-		 * servers that are up.
-		 */
-		if (!sent) {
-			P_WARN("Dropping Union Station packet because no servers are available: "
-				"key=" << item.unionStationKey <<
-				", node=" << item.nodeName <<
-				", category=" << item.category <<
+		keyEnd = data.find('\0');
+		if (keyEnd == string::npos) {
+			return false;
+		}
+		nodeEnd = data.find('\0', keyEnd + 1);
+		if (nodeEnd == string::npos) {
+			return false;
+		}
+		categoryEnd = data.find('\0', nodeEnd + 1);
+		if (categoryEnd == string::npos || categoryEnd + 1 >= data.size()) {
+			return false;
+		}
+		item.unionStationKey = data.substr(0, keyEnd);
+		item.nodeName = data.substr(keyEnd + 1, nodeEnd - keyEnd - 1);
+		item.category = data.substr(nodeEnd + 1, categoryEnd - nodeEnd - 1);
+		item.compressed = data[categoryEnd + 1] == '1';
+		item.data = data.substr(categoryEnd + 2);
+		return true;
+	}
+	
+	/**
+	 * Writes the item, compressed, to the spool. Returns false if spooling
+	 * is disabled or if the spool is full.
+	 */
+	bool spoolItem(Item &item) {
+		if (spool == NULL) {
+			return false;
+		}
+		if (!item.compressed) {
+			compress(item);
+		}
+		
+		bool result;
+		try {
+			result = spool->append(serialize(item));
+		} catch (const tracable_exception &e) {
+			P_WARN("Cannot spool Union Station packet: " << e.what());
+			result = false;
+		}
+		if (result) {
+			P_DEBUG("Spooled Union Station packet: key=" << item.unionStationKey <<
+				", node=" << item.nodeName << ", category=" << item.category <<
 				", compressedDataSize=" << item.data.size());
+			boost::lock_guard<boost::mutex> l(syncher);
+			packetsSpooled++;
+		}
+		return result;
+	}
+	
+	/**
+	 * Sends spooled packets, oldest first, until the spool is empty, a send
+	 * fails, or new packets are waiting in the queue. Only one thread
+	 * replays the spool at a time.
+	 */
+	void replaySpool() {
+		if (spool == NULL || spool->empty()) {
+			return;
+		}
+		{
+			boost::lock_guard<boost::mutex> l(syncher);
+			if (replayingSpool || servers.empty()) {
+				return;
+			}
+			replayingSpool = true;
+		}
+		
+		try {
+			string record;
+			Item item;
+			
+			while (queue.size() == 0 && spool->peek(record)) {
+				if (!unserialize(record, item)) {
+					P_WARN("Discarding corrupt record in Union Station spool file " <<
+						spool->getPath());
+					spool->pop();
+				} else if (trySend(item)) {
+					spool->pop();
+					boost::lock_guard<boost::mutex> l(syncher);
+					packetsReplayed++;
+				} else {
+					break;
+				}
+			}
+		} catch (const tracable_exception &e) {
+			P_WARN("Cannot replay Union Station spool: " << e.what());
+		}
+		
+		boost::lock_guard<boost::mutex> l(syncher);
+		replayingSpool = false;
+	}
+	
+	/**
+	 * Compresses the item's data in place, if possible. This happens in
+	 * the sender threads so as not to block the LoggingServer event loops.
+	 */
+	void compress(Item &item) {
+		StaticString data(item.data);
+		string output;
+		if (compress(&data, 1, output)) {
+			item.data.swap(output);
+			item.compressed = true;
 		}
 	}
 	
@@ -458,8 +770,10 @@ private:
 	
 public:
 	RemoteSender(const string &gatewayAddress, unsigned short gatewayPort, const string &certificate,
-		const string &proxyAddress)
-		: queue(1024)
+		const string &proxyAddress, unsigned int threadCount = DEFAULT_THREADS,
+		const string &spoolPath = string(),
+		unsigned long long spoolMaxSize = DEFAULT_SPOOL_MAX_SIZE)
+		: queue(QUEUE_CAPACITY)
 	{
 		TRACE_POINT();
 		this->gatewayAddress = gatewayAddress;
@@ -472,67 +786,108 @@ public:
 				proxyAddress + "\": " + e.what());
 		}
 		nextCheckupTime = 0;
+		checkingServers = false;
 		packetsSent = 0;
 		packetsDropped = 0;
-		thr = new oxt::thread(
-			boost::bind(&RemoteSender::threadMain, this),
-			"RemoteSender thread",
-			1024 * 512
-		);
+		packetsCoalesced = 0;
+		replayingSpool = false;
+		packetsSpooled = 0;
+		packetsReplayed = 0;
+		if (!spoolPath.empty()) {
+			try {
+				spool = boost::make_shared<PacketSpool>(spoolPath, spoolMaxSize);
+				if (!spool->empty()) {
+					P_INFO(spool->size() << " Union Station packets left in spool file " <<
+						spoolPath << "; will send them once a gateway is available");
+				}
+			} catch (const tracable_exception &e) {
+				P_WARN("Cannot open Union Station spool file, spooling disabled: " <<
+					e.what());
+			}
+		}
+		if (threadCount == 0) {
+			threadCount = 1;
+		}
+		runningThreads = threadCount;
+		for (unsigned int i = 0; i < threadCount; i++) {
+			threads.push_back(new oxt::thread(
+				boost::bind(&RemoteSender::threadMain, this),
+				"RemoteSender thread " + toString(i + 1),
+				1024 * 512
+			));
+		}
 	}
 	
 	~RemoteSender() {
 		Item item;
 		item.exit = true;
-		queue.add(item);
-		/* Wait until the thread sends out all queued items.
+		for (unsigned int i = 0; i < threads.size(); i++) {
+			queue.add(item);
+		}
+		/* Wait until the threads send out all queued items.
 		 * If this cannot be done within a short amount of time,
 		 * e.g. because all servers are down, then we'll get killed
 		 * by the watchdog anyway.
 		 */
-		thr->join();
-		delete thr;
+		foreach (oxt::thread *thr, threads) {
+			thr->join();
+			delete thr;
+		}
 	}
 	
-	void schedule(const string &unionStationKey, const StaticString &nodeName,
+	/**
+	 * Schedules the given data to be sent. Unless `compressed` is true, the
+	 * data is compressed by the sender threads. Returns false if the data
+	 * was dropped because the queue is full.
+	 */
+	bool schedule(const string &unionStationKey, const StaticString &nodeName,
 		const StaticString &category, const StaticString data[],
-		unsigned int count)
+		unsigned int count, bool compressed = false)
 	{
 		Item item;
+		size_t size = 0;
+		unsigned int i;
 
 		item.unionStationKey = unionStationKey;
 		item.nodeName = nodeName;
 		item.category = category;
+		item.compressed = compressed;
 		
-		if (compress(data, count, item.data)) {
-			item.compressed = true;
-		} else {
-			size_t size = 0;
-			unsigned int i;
-			
-			for (i = 0; i < count; i++) {
-				size += data[i].size();
-			}
-			item.data.reserve(size);
-			for (i = 0; i < count; i++) {
-				item.data.append(data[i].c_str(), data[i].size());
-			}
+		for (i = 0; i < count; i++) {
+			size += data[i].size();
+		}
+		item.data.reserve(size);
+		for (i = 0; i < count; i++) {
+			item.data.append(data[i].c_str(), data[i].size());
 		}
 		
 		P_DEBUG("Scheduling Union Station packet: key=" << unionStationKey <<
 			", node=" << nodeName << ", category=" << category <<
-			", compressedDataSize=" << item.data.size());
+			", dataSize=" << item.data.size());
 
-		if (!queue.tryAdd(item)) {
+		if (queue.tryAdd(item)) {
+			return true;
+		} else if (spoolItem(item)) {
+			return true;
+		} else {
 			P_WARN("The Union Station gateway isn't responding quickly enough; dropping packet.");
 			boost::lock_guard<boost::mutex> l(syncher);
 			packetsDropped++;
+			return false;
 		}
 	}
 	
 	unsigned int queued() const {
 		return queue.size();
 	}
+	
+	/**
+	 * Whether the queue is filling up because the gateway servers aren't
+	 * keeping up. Senders should then send fewer, larger packets.
+	 */
+	bool congested() const {
+		return queue.size() >= CONGESTION_THRESHOLD;
+	}
 
 	template<typename Stream>
 	void inspect(Stream &stream) const {
@@ -542,9 +897,17 @@ public:
 			stream << server->name() << " ";
 		}
 		stream << "\n";
+		stream << "  Sender threads: " << threads.size() << "\n";
 		stream << "  Items in queue: " << queue.size() << "\n";
 		stream << "  Packets sent out so far: " << packetsSent << "\n";
 		stream << "  Packets dropped out so far: " << packetsDropped << "\n";
+		stream << "  Packets coalesced so far: " << packetsCoalesced << "\n";
+		if (spool != NULL) {
+			stream << "  Spool: " << spool->getPath() << ", " << spool->size() <<
+				" packets (" << spool->usedBytes() << " bytes)\n";
+			stream << "  Packets spooled so far: " << packetsSpooled << "\n";
+			stream << "  Packets replayed so far: " << packetsReplayed << "\n";
+		}
 		stream << "  Next server checkup time: ";
 		if (nextCheckupTime == 0) {
 			stream << "not yet scheduled, waiting for first packet\n";
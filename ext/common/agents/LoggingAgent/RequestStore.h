@@ -0,0 +1,943 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_REQUEST_STORE_H_
+#define _PASSENGER_REQUEST_STORE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <ostream>
+
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <oxt/system_calls.hpp>
+
+#include <agents/LoggingAgent/FilterSupport.h>
+#include <agents/LoggingAgent/MetricsAggregator.h>
+#include <FileDescriptor.h>
+#include <StaticString.h>
+#include <Exceptions.h>
+#include <Logging.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/SystemTime.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace oxt;
+
+
+/**
+ * Stores the metadata of request transactions (application, URI, controller
+ * action, status, response time and timestamp) on local disk, so that they
+ * can be searched and aggregated without grepping the analytics dump file.
+ *
+ * Requests are stored in segment files, one per time partition of
+ * `partitionDuration` seconds, named "requests-<partition start>.seg".
+ * A segment consists of blocks of at most MAX_BLOCK_ROWS requests that are
+ * appended one at a time. Within a block, every field is stored as a
+ * separate column: fixed width integers for the numbers, and offset/length
+ * pairs into a string heap at the end of the block for the strings, so a
+ * scan only reads the columns that it needs. Every block header contains
+ * the block's time range, so blocks outside the queried range are skipped
+ * without reading their columns. Blocks are written in host byte order;
+ * the store is not meant to be copied to other machines.
+ *
+ * New requests are collected in an in-memory block, which is appended to
+ * the current segment when it's full, when a request for a later partition
+ * comes in, or on `flush()`. Queries see both the segments, which they
+ * read through mmap(), and the in-memory block.
+ *
+ * Segments older than `retention` seconds are deleted, and so are the
+ * oldest segments if all segments together are larger than `maxSize` bytes.
+ *
+ * This class is thread-safe.
+ */
+class RequestStore {
+public:
+	static const unsigned int MAX_BLOCK_ROWS = 4096;
+
+	struct Request {
+		/** Time at which the request began, in microseconds since the epoch. */
+		unsigned long long timestamp;
+		string app;
+		string uri;
+		/** In "Controller#action" form. */
+		string controllerAction;
+		string status;
+		int statusCode;
+		/** In microseconds. */
+		int responseTime;
+		int gcTime;
+		/** As reported by the application, see FilterSupport::Context::getCpuTime(). */
+		int cpuTime;
+		int allocations;
+
+		Request() {
+			timestamp = 0;
+			statusCode = 0;
+			responseTime = 0;
+			gcTime = 0;
+			cpuTime = 0;
+			allocations = 0;
+		}
+	};
+
+	struct Query {
+		/** A FilterSupport expression. Empty means all requests. */
+		string filter;
+		/** Time range, in microseconds since the epoch. `until` is exclusive. */
+		unsigned long long since;
+		unsigned long long until;
+		/**
+		 * "app", "uri", "controller" or "status" to aggregate requests per
+		 * value of that field. Empty to list the slowest requests instead.
+		 */
+		string groupBy;
+		/** The maximum number of requests or groups to return. */
+		unsigned int limit;
+
+		Query() {
+			since = 0;
+			until = ~0ull;
+			limit = 10;
+		}
+	};
+
+private:
+	enum StringColumn {
+		APP_COLUMN,
+		URI_COLUMN,
+		CONTROLLER_ACTION_COLUMN,
+		STATUS_COLUMN,
+		STRING_COLUMN_COUNT
+	};
+
+	struct BlockHeader {
+		char magic[4];
+		boost::uint32_t rowCount;
+		boost::uint32_t heapSize;
+		/** Size of the entire block, including this header and padding. */
+		boost::uint32_t size;
+		boost::uint64_t minTimestamp;
+		boost::uint64_t maxTimestamp;
+	};
+
+	/**
+	 * Points to the columns of a block, either inside a mapped segment
+	 * or inside the in-memory block.
+	 */
+	struct BlockView {
+		unsigned int rowCount;
+		unsigned long long minTimestamp;
+		unsigned long long maxTimestamp;
+		const boost::uint64_t *timestamps;
+		const boost::int32_t *responseTimes;
+		const boost::int32_t *gcTimes;
+		const boost::int32_t *cpuTimes;
+		const boost::int32_t *allocations;
+		const boost::int32_t *statusCodes;
+		const boost::uint32_t *offsets[STRING_COLUMN_COUNT];
+		const boost::uint32_t *lengths[STRING_COLUMN_COUNT];
+		const char *heap;
+
+		StaticString getString(StringColumn column, unsigned int row) const {
+			return StaticString(heap + offsets[column][row], lengths[column][row]);
+		}
+	};
+
+	/** The in-memory block that new requests are added to. */
+	struct BlockBuilder {
+		vector<boost::uint64_t> timestamps;
+		vector<boost::int32_t> responseTimes;
+		vector<boost::int32_t> gcTimes;
+		vector<boost::int32_t> cpuTimes;
+		vector<boost::int32_t> allocations;
+		vector<boost::int32_t> statusCodes;
+		vector<boost::uint32_t> offsets[STRING_COLUMN_COUNT];
+		vector<boost::uint32_t> lengths[STRING_COLUMN_COUNT];
+		string heap;
+		/**
+		 * Where previously added values of the low-cardinality columns
+		 * are in the heap, so that they're stored only once per block.
+		 */
+		map<string, boost::uint32_t> internedStrings;
+		unsigned long long minTimestamp;
+		unsigned long long maxTimestamp;
+
+		BlockBuilder() {
+			minTimestamp = 0;
+			maxTimestamp = 0;
+		}
+
+		unsigned int size() const {
+			return timestamps.size();
+		}
+
+		bool empty() const {
+			return timestamps.empty();
+		}
+
+		void addString(StringColumn column, const string &value, bool intern) {
+			boost::uint32_t offset;
+			if (intern) {
+				map<string, boost::uint32_t>::iterator it = internedStrings.find(value);
+				if (it == internedStrings.end()) {
+					offset = heap.size();
+					heap.append(value);
+					internedStrings.insert(make_pair(value, offset));
+				} else {
+					offset = it->second;
+				}
+			} else {
+				offset = heap.size();
+				heap.append(value);
+			}
+			offsets[column].push_back(offset);
+			lengths[column].push_back(value.size());
+		}
+
+		void add(const Request &request) {
+			if (empty() || request.timestamp < minTimestamp) {
+				minTimestamp = request.timestamp;
+			}
+			if (empty() || request.timestamp > maxTimestamp) {
+				maxTimestamp = request.timestamp;
+			}
+			timestamps.push_back(request.timestamp);
+			responseTimes.push_back(request.responseTime);
+			gcTimes.push_back(request.gcTime);
+			cpuTimes.push_back(request.cpuTime);
+			allocations.push_back(request.allocations);
+			statusCodes.push_back(request.statusCode);
+			addString(APP_COLUMN, request.app, true);
+			addString(URI_COLUMN, request.uri, false);
+			addString(CONTROLLER_ACTION_COLUMN, request.controllerAction, true);
+			addString(STATUS_COLUMN, request.status, true);
+		}
+
+		/** @pre !empty() */
+		BlockView view() const {
+			BlockView view;
+			view.rowCount = size();
+			view.minTimestamp = minTimestamp;
+			view.maxTimestamp = maxTimestamp;
+			view.timestamps = &timestamps[0];
+			view.responseTimes = &responseTimes[0];
+			view.gcTimes = &gcTimes[0];
+			view.cpuTimes = &cpuTimes[0];
+			view.allocations = &allocations[0];
+			view.statusCodes = &statusCodes[0];
+			for (unsigned int i = 0; i < STRING_COLUMN_COUNT; i++) {
+				view.offsets[i] = &offsets[i][0];
+				view.lengths[i] = &lengths[i][0];
+			}
+			view.heap = heap.data();
+			return view;
+		}
+
+		template<typename T>
+		static void appendColumn(string &output, const vector<T> &column) {
+			output.append((const char *) &column[0], column.size() * sizeof(T));
+		}
+
+		/** @pre !empty() */
+		void serialize(string &output) const {
+			unsigned int n = size();
+			unsigned int size = sizeof(BlockHeader)
+				+ n * (sizeof(boost::uint64_t) + 5 * sizeof(boost::int32_t)
+					+ STRING_COLUMN_COUNT * 2 * sizeof(boost::uint32_t))
+				+ heap.size();
+			BlockHeader header;
+
+			size = (size + 7) & ~7u;
+			memcpy(header.magic, "PRQ2", 4);
+			header.rowCount = n;
+			header.heapSize = heap.size();
+			header.size = size;
+			header.minTimestamp = minTimestamp;
+			header.maxTimestamp = maxTimestamp;
+
+			output.reserve(size);
+			output.append((const char *) &header, sizeof(header));
+			appendColumn(output, timestamps);
+			appendColumn(output, responseTimes);
+			appendColumn(output, gcTimes);
+			appendColumn(output, cpuTimes);
+			appendColumn(output, allocations);
+			appendColumn(output, statusCodes);
+			for (unsigned int i = 0; i < STRING_COLUMN_COUNT; i++) {
+				appendColumn(output, offsets[i]);
+				appendColumn(output, lengths[i]);
+			}
+			output.append(heap);
+			output.append(size - output.size(), '\0');
+		}
+
+		void clear() {
+			timestamps.clear();
+			responseTimes.clear();
+			gcTimes.clear();
+			cpuTimes.clear();
+			allocations.clear();
+			statusCodes.clear();
+			for (unsigned int i = 0; i < STRING_COLUMN_COUNT; i++) {
+				offsets[i].clear();
+				lengths[i].clear();
+			}
+			heap.clear();
+			internedStrings.clear();
+		}
+	};
+
+	/** Lets FilterSupport filters query a single row of a block. */
+	class RowContext: public FilterSupport::Context {
+	private:
+		const BlockView &block;
+		unsigned int row;
+
+	public:
+		RowContext(const BlockView &_block, unsigned int _row)
+			: block(_block),
+			  row(_row)
+			{ }
+
+		virtual string getURI() const {
+			return block.getString(URI_COLUMN, row);
+		}
+
+		virtual string getController() const {
+			StaticString value = block.getString(CONTROLLER_ACTION_COLUMN, row);
+			return value.substr(0, value.find('#'));
+		}
+
+		virtual int getResponseTime() const {
+			return block.responseTimes[row];
+		}
+
+		virtual string getStatus() const {
+			return block.getString(STATUS_COLUMN, row);
+		}
+
+		virtual int getStatusCode() const {
+			return block.statusCodes[row];
+		}
+
+		virtual int getGcTime() const {
+			return block.gcTimes[row];
+		}
+
+		virtual int getCpuTime() const {
+			return block.cpuTimes[row];
+		}
+
+		virtual int getAllocations() const {
+			return block.allocations[row];
+		}
+
+		virtual bool hasHint(const string &name) const {
+			return false;
+		}
+	};
+
+	struct SlowRequest {
+		int responseTime;
+		Request request;
+
+		bool operator<(const SlowRequest &other) const {
+			// Makes std::priority_queue-style heaps keep the fastest
+			// request at the front, so that it's the one to be replaced.
+			return responseTime > other.responseTime;
+		}
+	};
+
+	struct ScanResult {
+		MetricsAggregator::Metrics total;
+		map<string, MetricsAggregator::Metrics> groups;
+		/** A heap with the slowest requests, if not grouping. */
+		vector<SlowRequest> slowest;
+		unsigned long long blocksScanned;
+		unsigned long long blocksSkipped;
+
+		ScanResult() {
+			blocksScanned = 0;
+			blocksSkipped = 0;
+		}
+	};
+
+	/** A segment file that is mapped into memory during a query. */
+	class MappedSegment {
+	private:
+		void *addr;
+		size_t size;
+
+	public:
+		MappedSegment(const string &path, size_t _size)
+			: addr(NULL),
+			  size(_size)
+		{
+			if (size == 0) {
+				return;
+			}
+			FileDescriptor fd(syscalls::open(path.c_str(), O_RDONLY));
+			if (fd == -1) {
+				int e = errno;
+				if (e == ENOENT) {
+					// Deleted by the retention policy in the mean time.
+					size = 0;
+					return;
+				}
+				throw FileSystemException("Cannot open " + path, e, path);
+			}
+			addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			if (addr == MAP_FAILED) {
+				int e = errno;
+				addr = NULL;
+				throw SystemException("Cannot map " + path, e);
+			}
+		}
+
+		~MappedSegment() {
+			if (addr != NULL) {
+				munmap(addr, size);
+			}
+		}
+
+		const char *data() const {
+			return (const char *) addr;
+		}
+
+		size_t getSize() const {
+			return addr == NULL ? 0 : size;
+		}
+	};
+
+	const string dir;
+	const unsigned int partitionDuration;
+	const unsigned int retention;
+	const unsigned long long maxSize;
+
+	mutable boost::mutex syncher;
+	BlockBuilder current;
+	unsigned long long currentPartition;
+	/** Maps partition start times to the sizes of their segment files. */
+	map<unsigned long long, unsigned long long> segments;
+	unsigned long long totalSize;
+	unsigned long long requestsRecorded;
+	unsigned long long blocksWritten;
+	unsigned long long segmentsDeleted;
+
+	string segmentPath(unsigned long long partition) const {
+		return dir + "/requests-" + toString(partition) + ".seg";
+	}
+
+	static bool parseSegmentName(const char *name, unsigned long long &partition) {
+		StaticString str(name);
+		if (!startsWith(str, "requests-") || str.size() <= sizeof("requests-.seg") - 1
+		 || str.substr(str.size() - 4) != ".seg")
+		{
+			return false;
+		}
+		StaticString digits = str.substr(sizeof("requests-") - 1,
+			str.size() - (sizeof("requests-.seg") - 1));
+		for (unsigned int i = 0; i < digits.size(); i++) {
+			if (digits[i] < '0' || digits[i] > '9') {
+				return false;
+			}
+		}
+		partition = stringToULL(digits);
+		return true;
+	}
+
+	void loadSegments() {
+		DIR *d = opendir(dir.c_str());
+		if (d == NULL) {
+			int e = errno;
+			throw FileSystemException("Cannot open directory " + dir, e, dir);
+		}
+
+		struct dirent *entry;
+		while ((entry = readdir(d)) != NULL) {
+			unsigned long long partition;
+			struct stat buf;
+			if (parseSegmentName(entry->d_name, partition)
+			 && stat(segmentPath(partition).c_str(), &buf) == 0)
+			{
+				segments[partition] = buf.st_size;
+				totalSize += buf.st_size;
+			}
+		}
+		closedir(d);
+	}
+
+	unsigned long long partitionFor(unsigned long long timestamp) const {
+		unsigned long long seconds = timestamp / 1000000;
+		return seconds - seconds % partitionDuration;
+	}
+
+	void appendBlock(const string &data) {
+		string path = segmentPath(currentPartition);
+		FileDescriptor fd(syscalls::open(path.c_str(),
+			O_WRONLY | O_CREAT | O_APPEND, 0600));
+		if (fd == -1) {
+			int e = errno;
+			throw FileSystemException("Cannot open " + path, e, path);
+		}
+
+		unsigned long long &size = segments[currentPartition];
+		try {
+			writeExact(fd, data.data(), data.size());
+		} catch (const SystemException &) {
+			// Don't leave a partial block behind.
+			int ret;
+			do {
+				ret = ftruncate(fd, size);
+			} while (ret == -1 && errno == EINTR);
+			throw;
+		}
+		size += data.size();
+		totalSize += data.size();
+		blocksWritten++;
+	}
+
+	void flushLocked() {
+		if (current.empty()) {
+			return;
+		}
+
+		string data;
+		current.serialize(data);
+		current.clear();
+		try {
+			appendBlock(data);
+		} catch (const SystemException &e) {
+			P_ERROR("Cannot write to the request store: " << e.what());
+		}
+		enforceRetentionLocked(SystemTime::get());
+	}
+
+	void deleteSegmentLocked(map<unsigned long long, unsigned long long>::iterator it) {
+		string path = segmentPath(it->first);
+		if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+			int e = errno;
+			P_ERROR("Cannot delete " << path << ": " << strerror(e) <<
+				" (errno=" << e << ")");
+		}
+		totalSize -= it->second;
+		segments.erase(it);
+		segmentsDeleted++;
+	}
+
+	void enforceRetentionLocked(unsigned long long now) {
+		while (!segments.empty()
+		 && segments.begin()->first + partitionDuration + retention <= now)
+		{
+			deleteSegmentLocked(segments.begin());
+		}
+		// Always keep the newest segment.
+		while (segments.size() > 1 && totalSize > maxSize) {
+			deleteSegmentLocked(segments.begin());
+		}
+	}
+
+	static bool parseBlock(const char *data, size_t available, BlockView &view,
+		size_t &blockSize)
+	{
+		BlockHeader header;
+		if (available < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, data, sizeof(header));
+		if (memcmp(header.magic, "PRQ2", 4) != 0 || header.size > available) {
+			return false;
+		}
+
+		const char *current = data + sizeof(header);
+		unsigned int n = header.rowCount;
+		view.rowCount = n;
+		view.minTimestamp = header.minTimestamp;
+		view.maxTimestamp = header.maxTimestamp;
+		view.timestamps = (const boost::uint64_t *) current;
+		current += n * sizeof(boost::uint64_t);
+		view.responseTimes = (const boost::int32_t *) current;
+		current += n * sizeof(boost::int32_t);
+		view.gcTimes = (const boost::int32_t *) current;
+		current += n * sizeof(boost::int32_t);
+		view.cpuTimes = (const boost::int32_t *) current;
+		current += n * sizeof(boost::int32_t);
+		view.allocations = (const boost::int32_t *) current;
+		current += n * sizeof(boost::int32_t);
+		view.statusCodes = (const boost::int32_t *) current;
+		current += n * sizeof(boost::int32_t);
+		for (unsigned int i = 0; i < STRING_COLUMN_COUNT; i++) {
+			view.offsets[i] = (const boost::uint32_t *) current;
+			current += n * sizeof(boost::uint32_t);
+			view.lengths[i] = (const boost::uint32_t *) current;
+			current += n * sizeof(boost::uint32_t);
+		}
+		view.heap = current;
+		blockSize = header.size;
+		return current + header.heapSize <= data + header.size;
+	}
+
+	static void record(MetricsAggregator::Metrics &metrics, unsigned int time,
+		int statusCode, int cpuTime, int allocations)
+	{
+		if (metrics.count == 0 || time < metrics.minTime) {
+			metrics.minTime = time;
+		}
+		if (time > metrics.maxTime) {
+			metrics.maxTime = time;
+		}
+		metrics.count++;
+		metrics.totalTime += time;
+		if (statusCode >= 500) {
+			metrics.errors++;
+		}
+		metrics.histogram.record(time);
+		metrics.totalCpuTime += std::max(cpuTime, 0);
+		metrics.totalAllocations += std::max(allocations, 0);
+	}
+
+	static Request materialize(const BlockView &block, unsigned int row) {
+		Request request;
+		request.timestamp = block.timestamps[row];
+		request.app = block.getString(APP_COLUMN, row);
+		request.uri = block.getString(URI_COLUMN, row);
+		request.controllerAction = block.getString(CONTROLLER_ACTION_COLUMN, row);
+		request.status = block.getString(STATUS_COLUMN, row);
+		request.statusCode = block.statusCodes[row];
+		request.responseTime = block.responseTimes[row];
+		request.gcTime = block.gcTimes[row];
+		request.cpuTime = block.cpuTimes[row];
+		request.allocations = block.allocations[row];
+		return request;
+	}
+
+	/**
+	 * Scans a block one column at a time: the timestamp column yields the
+	 * rows in the time range, the filter narrows those down, and only then
+	 * are the columns that the result needs read for the remaining rows.
+	 */
+	static void scan(const BlockView &block, const Query &query,
+		FilterSupport::Filter *filter, StringColumn groupColumn,
+		vector<unsigned int> &selection, ScanResult &result)
+	{
+		unsigned int i, n;
+
+		if (block.rowCount == 0 || block.maxTimestamp < query.since
+		 || block.minTimestamp >= query.until)
+		{
+			result.blocksSkipped++;
+			return;
+		}
+		result.blocksScanned++;
+
+		selection.clear();
+		for (i = 0; i < block.rowCount; i++) {
+			if (block.timestamps[i] >= query.since && block.timestamps[i] < query.until) {
+				selection.push_back(i);
+			}
+		}
+
+		if (filter != NULL) {
+			n = 0;
+			for (i = 0; i < selection.size(); i++) {
+				if (filter->run(RowContext(block, selection[i]))) {
+					selection[n] = selection[i];
+					n++;
+				}
+			}
+			selection.resize(n);
+		}
+
+		n = selection.size();
+		for (i = 0; i < n; i++) {
+			unsigned int row = selection[i];
+			int time = block.responseTimes[row];
+			record(result.total, time < 0 ? 0 : time, block.statusCodes[row],
+				block.cpuTimes[row], block.allocations[row]);
+		}
+
+		if (groupColumn != STRING_COLUMN_COUNT) {
+			for (i = 0; i < n; i++) {
+				unsigned int row = selection[i];
+				int time = block.responseTimes[row];
+				record(result.groups[block.getString(groupColumn, row)],
+					time < 0 ? 0 : time, block.statusCodes[row],
+					block.cpuTimes[row], block.allocations[row]);
+			}
+		} else if (query.limit > 0) {
+			for (i = 0; i < n; i++) {
+				unsigned int row = selection[i];
+				int time = block.responseTimes[row];
+				if (result.slowest.size() < query.limit) {
+					SlowRequest slow;
+					slow.responseTime = time;
+					slow.request = materialize(block, row);
+					result.slowest.push_back(slow);
+					push_heap(result.slowest.begin(), result.slowest.end());
+				} else if (time > result.slowest.front().responseTime) {
+					pop_heap(result.slowest.begin(), result.slowest.end());
+					result.slowest.back().responseTime = time;
+					result.slowest.back().request = materialize(block, row);
+					push_heap(result.slowest.begin(), result.slowest.end());
+				}
+			}
+		}
+	}
+
+	static void appendMetrics(string &output, const MetricsAggregator::Metrics &metrics) {
+		output.append("count=");
+		output.append(toString(metrics.count));
+		output.append("\terrors=");
+		output.append(toString(metrics.errors));
+		output.append("\tavg=");
+		output.append(toString(metrics.count == 0 ? 0 : metrics.totalTime / metrics.count));
+		output.append("\tmax=");
+		output.append(toString(metrics.maxTime));
+		output.append("\tp50=");
+		output.append(toString(min(metrics.histogram.percentile(50), metrics.maxTime)));
+		output.append("\tp90=");
+		output.append(toString(min(metrics.histogram.percentile(90), metrics.maxTime)));
+		output.append("\tp99=");
+		output.append(toString(min(metrics.histogram.percentile(99), metrics.maxTime)));
+		output.append("\tcpu_avg=");
+		output.append(toString(metrics.count == 0 ? 0 : metrics.totalCpuTime / metrics.count));
+		output.append("\tallocations_avg=");
+		output.append(toString(metrics.count == 0 ? 0 : metrics.totalAllocations / metrics.count));
+		output.append("\n");
+	}
+
+	static StringColumn groupColumnFor(const string &groupBy) {
+		if (groupBy.empty()) {
+			return STRING_COLUMN_COUNT;
+		} else if (groupBy == "app") {
+			return APP_COLUMN;
+		} else if (groupBy == "uri") {
+			return URI_COLUMN;
+		} else if (groupBy == "controller") {
+			return CONTROLLER_ACTION_COLUMN;
+		} else if (groupBy == "status") {
+			return STATUS_COLUMN;
+		} else {
+			throw ArgumentException("Cannot group by '" + groupBy +
+				"': must be one of app, uri, controller or status");
+		}
+	}
+
+	static bool compareGroupsBySlowness(
+		const pair<const string, MetricsAggregator::Metrics> *a,
+		const pair<const string, MetricsAggregator::Metrics> *b)
+	{
+		return a->second.totalTime > b->second.totalTime;
+	}
+
+	static string formatResult(const Query &query, ScanResult &result) {
+		string output;
+
+		output.append("total\t");
+		appendMetrics(output, result.total);
+		if (query.groupBy.empty()) {
+			sort_heap(result.slowest.begin(), result.slowest.end());
+			vector<SlowRequest>::const_iterator it, end = result.slowest.end();
+			for (it = result.slowest.begin(); it != end; it++) {
+				const Request &request = it->request;
+				output.append(toString(request.timestamp));
+				output.append("\t");
+				output.append(toString(request.responseTime));
+				output.append("\t");
+				output.append(toString(request.statusCode));
+				output.append("\t");
+				output.append(request.app);
+				output.append("\t");
+				output.append(request.controllerAction.empty()
+					? string("-") : request.controllerAction);
+				output.append("\t");
+				output.append(request.uri);
+				output.append("\n");
+			}
+		} else {
+			// The groups that took the most time in total come first.
+			vector<const pair<const string, MetricsAggregator::Metrics> *> groups;
+			map<string, MetricsAggregator::Metrics>::const_iterator it;
+			for (it = result.groups.begin(); it != result.groups.end(); it++) {
+				groups.push_back(&*it);
+			}
+			sort(groups.begin(), groups.end(), compareGroupsBySlowness);
+			for (unsigned int i = 0; i < groups.size() && i < query.limit; i++) {
+				output.append(groups[i]->first.empty() ? string("-") : groups[i]->first);
+				output.append("\t");
+				appendMetrics(output, groups[i]->second);
+			}
+		}
+		return output;
+	}
+
+public:
+	/**
+	 * @param dir The directory to store segments in. Created if it doesn't exist.
+	 * @param partitionDuration The time span of a segment, in seconds.
+	 * @param retention How long segments are kept, in seconds.
+	 * @param maxSize The maximum size of all segments together, in bytes.
+	 * @throws FileSystemException
+	 */
+	RequestStore(const string &_dir, unsigned int _partitionDuration,
+		unsigned int _retention, unsigned long long _maxSize)
+		: dir(_dir),
+		  partitionDuration(std::max(1u, _partitionDuration)),
+		  retention(_retention),
+		  maxSize(_maxSize)
+	{
+		currentPartition = 0;
+		totalSize = 0;
+		requestsRecorded = 0;
+		blocksWritten = 0;
+		segmentsDeleted = 0;
+		if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+			int e = errno;
+			throw FileSystemException("Cannot create directory " + dir, e, dir);
+		}
+		loadSegments();
+		boost::lock_guard<boost::mutex> l(syncher);
+		enforceRetentionLocked(SystemTime::get());
+	}
+
+	~RequestStore() {
+		flush();
+	}
+
+	void add(const Request &request) {
+		boost::lock_guard<boost::mutex> l(syncher);
+		unsigned long long partition = partitionFor(request.timestamp);
+
+		if (current.empty()) {
+			currentPartition = partition;
+		} else if (partition > currentPartition) {
+			flushLocked();
+			currentPartition = partition;
+		}
+		// Requests for earlier partitions, which may arrive late, are
+		// stored in the current one. Block headers record the actual
+		// time ranges.
+		current.add(request);
+		requestsRecorded++;
+		if (current.size() >= MAX_BLOCK_ROWS) {
+			flushLocked();
+		}
+	}
+
+	/** Appends the in-memory block to the current segment. */
+	void flush() {
+		boost::lock_guard<boost::mutex> l(syncher);
+		flushLocked();
+	}
+
+	/**
+	 * Runs the given query and returns the result as text. The first line
+	 * contains "total", followed by tab-separated statistics of all
+	 * matching requests: count, errors (5xx responses) and average,
+	 * maximum and percentile response times in microseconds. If grouping,
+	 * then each following line contains the same for a group, the slowest
+	 * groups in total first. Otherwise, each following line contains the
+	 * timestamp, response time, status code, application, controller
+	 * action and URI of one of the slowest requests, the slowest first.
+	 *
+	 * @throws SyntaxError The filter is invalid.
+	 * @throws ArgumentException The group field is invalid.
+	 * @throws SystemException
+	 */
+	string query(const Query &query) const {
+		StringColumn groupColumn = groupColumnFor(query.groupBy);
+		auto_ptr<FilterSupport::Filter> filter;
+		vector< pair<unsigned long long, unsigned long long> > segmentsToScan;
+		vector<unsigned int> selection;
+		ScanResult result;
+
+		if (!query.filter.empty()) {
+			filter.reset(new FilterSupport::Filter(query.filter));
+		}
+
+		{
+			boost::lock_guard<boost::mutex> l(syncher);
+			map<unsigned long long, unsigned long long>::const_iterator it;
+			for (it = segments.begin(); it != segments.end(); it++) {
+				// A segment only contains requests from before its
+				// partition's end.
+				if (it->first + partitionDuration > query.since / 1000000) {
+					segmentsToScan.push_back(*it);
+				}
+			}
+			if (!current.empty()) {
+				scan(current.view(), query, filter.get(), groupColumn,
+					selection, result);
+			}
+		}
+
+		// Segments are append-only and we only read up to the sizes
+		// recorded above, so they can be scanned without holding the lock.
+		for (unsigned int i = 0; i < segmentsToScan.size(); i++) {
+			MappedSegment segment(segmentPath(segmentsToScan[i].first),
+				segmentsToScan[i].second);
+			const char *current = segment.data();
+			size_t remaining = segment.getSize();
+			BlockView view;
+			size_t blockSize;
+
+			while (remaining > 0 && parseBlock(current, remaining, view, blockSize)) {
+				scan(view, query, filter.get(), groupColumn, selection, result);
+				current += blockSize;
+				remaining -= blockSize;
+			}
+		}
+
+		return formatResult(query, result);
+	}
+
+	void inspect(ostream &stream) const {
+		boost::lock_guard<boost::mutex> l(syncher);
+		stream << "   Directory        : " << dir << "\n";
+		stream << "   Requests recorded: " << requestsRecorded << "\n";
+		stream << "   Unflushed        : " << current.size() << " requests\n";
+		stream << "   Segments         : " << segments.size() << " (" <<
+			totalSize << " bytes, " << segmentsDeleted << " deleted)\n";
+		stream << "   Blocks written   : " << blocksWritten << "\n";
+	}
+};
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_REQUEST_STORE_H_ */
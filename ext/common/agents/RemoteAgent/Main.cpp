@@ -0,0 +1,149 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+/*
+ * PassengerRemoteAgent runs on hosts that serve application processes for
+ * HelperAgents on other hosts. It is started by hand (or by an init script),
+ * not by the Watchdog:
+ *
+ *   PassengerRemoteAgent passenger_root /path/to/passenger \
+ *       remote_agent_address tcp://0.0.0.0:3010 \
+ *       remote_agent_password_file /etc/passenger_remote_agent_password
+ *
+ * HelperAgents use it when PASSENGER_REMOTE_AGENTS lists its address and
+ * their remote_agent_password matches the contents of the password file.
+ */
+#include <oxt/system_calls.hpp>
+#include <oxt/backtrace.hpp>
+#include <oxt/thread.hpp>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <signal.h>
+
+#include <agents/Base.h>
+#include <agents/RemoteAgent/RemoteAgentServer.h>
+#include <ApplicationPool2/DirectSpawner.h>
+
+#include <Exceptions.h>
+#include <ResourceLocator.h>
+#include <ServerInstanceDir.h>
+#include <Utils.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/VariantMap.h>
+
+using namespace oxt;
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+
+
+static VariantMap agentsOptions;
+
+static string
+findDefaultGroup(const string &defaultUser) {
+	struct passwd *entry = getpwnam(defaultUser.c_str());
+	if (entry == NULL) {
+		throw NonExistentUserException("The default user '" + defaultUser +
+			"' does not exist");
+	}
+	return getGroupName(entry->pw_gid);
+}
+
+static void
+waitForExitSignal() {
+	sigset_t signals;
+	int signo;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGQUIT);
+	sigwait(&signals, &signo);
+	P_INFO("Caught signal, exiting...");
+}
+
+int
+main(int argc, char *argv[]) {
+	agentsOptions = initializeAgent(argc, argv, "PassengerRemoteAgent");
+	if (agentsOptions.get("test_binary", false) == "1") {
+		printf("PASS\n");
+		exit(0);
+	}
+	P_DEBUG("Starting PassengerRemoteAgent...");
+
+	try {
+		TRACE_POINT();
+		ResourceLocator resourceLocator(agentsOptions.get("passenger_root"));
+		string address = agentsOptions.get("remote_agent_address");
+		string password = strip(readAll(agentsOptions.get("remote_agent_password_file")));
+		string defaultUser = agentsOptions.get("default_user", false, "nobody");
+		string defaultGroup = agentsOptions.get("default_group", false);
+		if (defaultGroup.empty()) {
+			defaultGroup = findDefaultGroup(defaultUser);
+		}
+
+		/* Block the exit signals in all threads so that the main thread
+		 * can wait for them with sigwait().
+		 */
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGQUIT);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+		UPDATE_TRACE_POINT();
+		ServerInstanceDir serverInstanceDir(string(getSystemTempDir()) +
+			"/passenger-remote-agent." + toString(getpid()));
+		ServerInstanceDir::GenerationPtr generation = serverInstanceDir.newGeneration(
+			geteuid() == 0, defaultUser, defaultGroup, geteuid(), getegid());
+		SpawnerPtr spawner = boost::make_shared<DirectSpawner>(SafeLibevPtr(),
+			resourceLocator, generation);
+
+		UPDATE_TRACE_POINT();
+		RemoteAgentServerPtr server = boost::make_shared<RemoteAgentServer>(
+			FileDescriptor(createServer(address)), password, spawner);
+		oxt::thread serverThread(
+			boost::bind(runAndPrintExceptions,
+				boost::function<void ()>(boost::bind(&RemoteAgentServer::mainLoop, server.get())),
+				true),
+			"RemoteAgent server thread", RemoteAgentServer::THREAD_STACK_SIZE);
+		P_WARN("PassengerRemoteAgent online, listening at " << address);
+
+		waitForExitSignal();
+		serverThread.interrupt_and_join();
+		// Kills the processes that are still running.
+		server.reset();
+		P_DEBUG("Remote agent exiting.");
+		return 0;
+	} catch (const tracable_exception &e) {
+		P_ERROR("*** ERROR: " << e.what() << "\n" << e.backtrace());
+		return 1;
+	}
+}
@@ -0,0 +1,416 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2013 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_REMOTE_AGENT_SERVER_H_
+#define _PASSENGER_REMOTE_AGENT_SERVER_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <oxt/system_calls.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/dynamic_thread_group.hpp>
+#include <oxt/backtrace.hpp>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <cstdlib>
+
+#include <ApplicationPool2/Spawner.h>
+#include <ApplicationPool2/RemoteSpawner.h>
+#include <FileDescriptor.h>
+#include <Exceptions.h>
+#include <Logging.h>
+#include <Utils/IOUtils.h>
+#include <Utils/MessageIO.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/VariantMap.h>
+
+namespace Passenger {
+
+using namespace std;
+using namespace boost;
+using namespace oxt;
+using namespace Passenger::ApplicationPool2;
+
+
+/**
+ * Spawns application processes on behalf of the HelperAgents that use this
+ * host as a RemoteAgent. See RemoteSpawner for the protocol.
+ *
+ * Every control connection is handled by a thread of its own, which spawns
+ * the process, makes the process's sockets available on TCP ports and then
+ * carries out the commands it receives until the process has exited.
+ * Connections to those TCP ports are relayed to the process's sockets,
+ * one thread per connection.
+ */
+class RemoteAgentServer {
+public:
+	static const unsigned int THREAD_STACK_SIZE = 1024 * 128;
+	/** How long a client may take to send its spawn request, in microseconds. */
+	static const unsigned long long REQUEST_TIMEOUT = 15000000;
+
+private:
+	/** Makes one of a process's sockets available on a TCP port. */
+	struct SocketProxy {
+		string target;
+		string address;
+		FileDescriptor serverFd;
+		boost::shared_ptr<oxt::thread> acceptThread;
+		dynamic_thread_group relayThreads;
+
+		~SocketProxy() {
+			if (acceptThread != NULL) {
+				acceptThread->interrupt_and_join();
+			}
+			relayThreads.interrupt_and_join_all();
+		}
+	};
+
+	typedef boost::shared_ptr<SocketProxy> SocketProxyPtr;
+
+	/** SIGKILLs the process if the control connection handler bails out early. */
+	struct ProcessKiller {
+		ProcessPtr process;
+
+		~ProcessKiller() {
+			this_thread::disable_syscall_interruption dsi;
+			if (process != NULL && !process->isDead()) {
+				if (process->osProcessExists()) {
+					syscalls::kill(process->pid, SIGKILL);
+				}
+				process->requiresShutdown = false;
+			}
+		}
+	};
+
+	FileDescriptor serverFd;
+	string password;
+	SpawnerPtr spawner;
+	dynamic_thread_group threads;
+
+	static void proxyMainLoop(SocketProxy *proxy) {
+		TRACE_POINT();
+		while (true) {
+			FileDescriptor client(syscalls::accept(proxy->serverFd, NULL, NULL));
+			if (client == -1) {
+				int e = errno;
+				P_WARN("Cannot accept a connection for " << proxy->target <<
+					": " << strerror(e) << " (errno=" << e << ")");
+				return;
+			}
+
+			this_thread::disable_interruption di;
+			this_thread::disable_syscall_interruption dsi;
+			proxy->relayThreads.create_thread(
+				boost::bind(relay, proxy->target, client),
+				"RemoteAgent relay thread " + toString(client),
+				THREAD_STACK_SIZE);
+		}
+	}
+
+	/** Copies data between the client and the application process until
+	 * both sides have closed their end. */
+	static void relay(const string target, FileDescriptor client) {
+		TRACE_POINT();
+		FileDescriptor app;
+		try {
+			app = FileDescriptor(connectToServer(target));
+		} catch (const tracable_exception &e) {
+			P_WARN("Cannot connect to " << target << ": " << e.what());
+			return;
+		}
+
+		int from[2] = { client, app };
+		int to[2] = { app, client };
+		bool open[2] = { true, true };
+		char buf[1024 * 16];
+
+		try {
+			while (open[0] || open[1]) {
+				struct pollfd fds[2];
+				int directions[2];
+				nfds_t n = 0;
+
+				for (int i = 0; i < 2; i++) {
+					if (open[i]) {
+						fds[n].fd = from[i];
+						fds[n].events = POLLIN;
+						fds[n].revents = 0;
+						directions[n] = i;
+						n++;
+					}
+				}
+				if (syscalls::poll(fds, n, -1) == -1) {
+					int e = errno;
+					throw SystemException("poll() failed", e);
+				}
+
+				for (nfds_t j = 0; j < n; j++) {
+					if (fds[j].revents == 0) {
+						continue;
+					}
+					int i = directions[j];
+					ssize_t ret = syscalls::read(from[i], buf, sizeof(buf));
+					if (ret <= 0) {
+						syscalls::shutdown(to[i], SHUT_WR);
+						open[i] = false;
+					} else {
+						writeExact(to[i], buf, ret);
+					}
+				}
+			}
+		} catch (const SystemException &e) {
+			P_DEBUG("Connection to " << target << " aborted: " << e.what());
+		}
+	}
+
+	/** The IP address on which the HelperAgent reached us, so that it can
+	 * reach the process's sockets too. */
+	static string getLocalAddress(const FileDescriptor &fd) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		char buf[INET_ADDRSTRLEN];
+
+		if (getsockname(fd, (struct sockaddr *) &addr, &len) == 0
+		 && addr.sin_family == AF_INET
+		 && inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)) != NULL)
+		{
+			return buf;
+		} else {
+			return "127.0.0.1";
+		}
+	}
+
+	static SocketProxyPtr startProxy(const string &ip, const string &target) {
+		SocketProxyPtr proxy = boost::make_shared<SocketProxy>();
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+
+		proxy->target = target;
+		proxy->serverFd = FileDescriptor(createTcpServer(ip.c_str(), 0));
+		if (getsockname(proxy->serverFd, (struct sockaddr *) &addr, &len) == -1) {
+			int e = errno;
+			throw SystemException("Cannot query the proxy socket's address", e);
+		}
+		proxy->address = "tcp://" + ip + ":" + toString(ntohs(addr.sin_port));
+		proxy->acceptThread.reset(new oxt::thread(
+			boost::bind(proxyMainLoop, proxy.get()),
+			"RemoteAgent proxy thread for " + target,
+			THREAD_STACK_SIZE));
+		return proxy;
+	}
+
+	static void sendError(const FileDescriptor &fd, const string &message,
+		SpawnException::ErrorKind kind = SpawnException::UNDEFINED_ERROR,
+		const string &errorPage = string(), bool isHTML = false)
+	{
+		vector<string> args;
+		args.push_back("error");
+		args.push_back(message);
+		args.push_back(toString((int) kind));
+		args.push_back(errorPage);
+		args.push_back(isHTML ? "true" : "false");
+		writeArrayMessage(fd, args);
+	}
+
+	/**
+	 * Reads the spawn request and spawns the process. Returns NULL if that
+	 * failed, in which case an error response has been sent.
+	 */
+	ProcessPtr spawnProcess(const FileDescriptor &fd) {
+		TRACE_POINT();
+		VariantMap args;
+		Options options;
+		string storage;
+		unsigned long long timeout = REQUEST_TIMEOUT;
+
+		if (!waitUntilReadable(fd, &timeout)) {
+			P_WARN("RemoteAgent client did not send a spawn request in time");
+			return ProcessPtr();
+		}
+		args.readFrom(fd, "spawn");
+		if (!constantTimeCompare(args.get("password", false), password)) {
+			sendError(fd, "Invalid RemoteAgent password");
+			return ProcessPtr();
+		}
+
+		UPDATE_TRACE_POINT();
+		try {
+			RemoteSpawner::parseOptions(args, options, storage);
+			return spawner->spawn(options);
+		} catch (const SpawnException &e) {
+			sendError(fd, e.what(), e.getErrorKind(), e.getErrorPage(), e.isHTML());
+		} catch (const VariantMap::MissingKeyException &e) {
+			sendError(fd, e.what());
+		}
+		return ProcessPtr();
+	}
+
+	void sendProcessInfo(const FileDescriptor &fd, const ProcessPtr &process,
+		const vector<SocketProxyPtr> &proxies)
+	{
+		vector<string> args;
+		SocketList::const_iterator it;
+		unsigned int i = 0;
+
+		args.push_back("ok");
+		args.push_back(toString(process->pid));
+		args.push_back(process->gupid);
+		args.push_back(process->connectPassword);
+		for (it = process->sockets->begin(); it != process->sockets->end(); it++, i++) {
+			args.push_back(it->name);
+			args.push_back(proxies[i]->address);
+			args.push_back(it->protocol);
+			args.push_back(toString(it->concurrency));
+		}
+		writeArrayMessage(fd, args);
+	}
+
+	/**
+	 * Carries out the commands received over the control connection until
+	 * the process has exited. Closing the control connection counts as a
+	 * shutdown command.
+	 */
+	void superviseProcess(const FileDescriptor &fd, const ProcessPtr &process) {
+		TRACE_POINT();
+		vector<string> args;
+		bool eof = false;
+		bool killed = false;
+
+		while (process->osProcessExists()) {
+			if (!process->canTriggerShutdown() && !killed
+			 && process->shutdownTimeoutExpired())
+			{
+				P_WARN("Process " << process->inspect() << " did not shut down in time; killing it");
+				process->kill(SIGKILL);
+				killed = true;
+			}
+
+			unsigned long long timeout = 100000;
+			if (eof) {
+				syscalls::usleep(timeout);
+				continue;
+			} else if (!waitUntilReadable(fd, &timeout)) {
+				continue;
+			}
+
+			try {
+				eof = !readArrayMessage(fd, args);
+			} catch (const SystemException &) {
+				eof = true;
+			}
+			if (!eof && args.empty()) {
+				continue;
+			} else if ((eof || args[0] == "shutdown") && process->canTriggerShutdown()) {
+				P_DEBUG("Shutting down process " << process->inspect());
+				process->triggerShutdown();
+			} else if (!eof && args[0] == "kill" && args.size() == 2) {
+				process->kill(atoi(args[1]));
+			}
+		}
+
+		if (process->canTriggerShutdown()) {
+			process->triggerShutdown();
+		}
+		process->cleanup();
+	}
+
+	void controlConnectionMain(FileDescriptor fd) {
+		TRACE_POINT();
+		ProcessKiller killer;
+		vector<SocketProxyPtr> proxies;
+
+		try {
+			killer.process = spawnProcess(fd);
+			if (killer.process == NULL) {
+				return;
+			}
+
+			UPDATE_TRACE_POINT();
+			string ip = getLocalAddress(fd);
+			SocketList::const_iterator it, end = killer.process->sockets->end();
+			for (it = killer.process->sockets->begin(); it != end; it++) {
+				proxies.push_back(startProxy(ip, it->address));
+			}
+			sendProcessInfo(fd, killer.process, proxies);
+
+			UPDATE_TRACE_POINT();
+			superviseProcess(fd, killer.process);
+			P_DEBUG("Process " << killer.process->pid << " has exited");
+		} catch (const tracable_exception &e) {
+			P_WARN("Error on a RemoteAgent control connection: " << e.what() <<
+				"\n" << e.backtrace());
+		}
+	}
+
+public:
+	RemoteAgentServer(const FileDescriptor &_serverFd, const string &_password,
+		const SpawnerPtr &_spawner)
+		: serverFd(_serverFd),
+		  password(_password),
+		  spawner(_spawner)
+		{ }
+
+	~RemoteAgentServer() {
+		threads.interrupt_and_join_all();
+	}
+
+	/**
+	 * Accepts control connections until the calling thread is interrupted.
+	 *
+	 * @throws SystemException Unable to accept a new connection.
+	 * @throws boost::thread_interrupted
+	 */
+	void mainLoop() {
+		TRACE_POINT();
+		while (true) {
+			this_thread::interruption_point();
+			FileDescriptor fd(syscalls::accept(serverFd, NULL, NULL));
+			if (fd == -1) {
+				throw SystemException("Unable to accept a new RemoteAgent client", errno);
+			}
+
+			UPDATE_TRACE_POINT();
+			this_thread::disable_interruption di;
+			this_thread::disable_syscall_interruption dsi;
+			threads.create_thread(
+				boost::bind(&RemoteAgentServer::controlConnectionMain, this, fd),
+				"RemoteAgent client thread " + toString(fd),
+				THREAD_STACK_SIZE);
+		}
+	}
+};
+
+typedef boost::shared_ptr<RemoteAgentServer> RemoteAgentServerPtr;
+
+
+} // namespace Passenger
+
+#endif /* _PASSENGER_REMOTE_AGENT_SERVER_H_ */
@@ -27,6 +27,11 @@
  * /tmp cleaners from removing it.
  */
 
+/* For nftw() and utimensat() in TreeToucher.h. */
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -38,6 +43,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include "TreeToucher.h"
 
 #define ERROR_PREFIX "*** TempDirToucher error"
 
@@ -216,48 +222,40 @@ dirExists(const char *dir) {
 	return stat(dir, &buf) == 0 && S_ISDIR(buf.st_mode);
 }
 
+/* Whether SIGINT or SIGTERM has been received. Leaves the byte in the
+ * termination pipe so that doSleep() sees it too.
+ */
+static int
+terminationRequested(void *userData) {
+	fd_set readfds;
+	struct timeval timeout;
+	int ret;
+
+	FD_ZERO(&readfds);
+	FD_SET(terminationPipe[0], &readfds);
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 0;
+	do {
+		ret = select(terminationPipe[0] + 1, &readfds, NULL, NULL, &timeout);
+	} while (ret == -1 && errno == EINTR);
+	return ret > 0;
+}
+
 static void
 touchDir(const char *dir) {
-	pid_t pid;
-	int e, status;
+	TreeToucher toucher;
+	int e;
 
-	pid = fork();
-	if (pid == 0) {
-		close(terminationPipe[0]);
-		close(terminationPipe[1]);
-		if (chdir(dir) == -1) {
-			e = errno;
-			fprintf(stderr, ERROR_PREFIX
-				": cannot change working directory to %s: %s (errno %d)\n",
-				dir, strerror(e), e);
-			_exit(1);
-		}
-		execlp("/bin/sh", "/bin/sh", "-c",
-			"find \"$1\" | xargs touch", "/bin/sh", ".",
-			(const char * const) 0);
+	initTreeToucher(&toucher);
+	/* Entries that were used in the last 15 minutes are fresh enough. */
+	toucher.minAge = 900;
+	toucher.maxPerSecond = 1000;
+	toucher.shouldStop = terminationRequested;
+	if (touchTree(&toucher, dir) == -1) {
 		e = errno;
-		fprintf(stderr, ERROR_PREFIX ": cannot execute /bin/sh: %s (errno %d)\n",
-			strerror(e), e);
-		_exit(1);
-	} else if (pid == -1) {
-		e = errno;
-		fprintf(stderr, ERROR_PREFIX ": cannot fork: %s (errno %d)\n",
-			strerror(e), e);
+		fprintf(stderr, ERROR_PREFIX ": cannot touch %s: %s (errno %d)\n",
+			dir, strerror(e), e);
 		exit(1);
-	} else {
-		if (waitpid(pid, &status, 0) == -1) {
-			if (errno != ESRCH && errno != EPERM) {
-				fprintf(stderr, ERROR_PREFIX
-					": unable to wait for shell command 'find %s | xargs touch'\n",
-					dir);
-				exit(1);
-			}
-		} else if (WEXITSTATUS(status) != 0) {
-			fprintf(stderr, ERROR_PREFIX
-				": shell command 'find %s | xargs touch' failed with exit status %d\n",
-				dir, WEXITSTATUS(status));
-			exit(1);
-		}
 	}
 }
 
@@ -336,6 +334,7 @@ main(int argc, char *argv[]) {
 	installSignalHandlers();
 	maybeDaemonize();
 	maybeWritePidfile();
+	setIdleIoPriority();
 
 	while (1) {
 		if (dirExists(dir)) {
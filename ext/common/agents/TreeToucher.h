@@ -0,0 +1,196 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+#ifndef _PASSENGER_TREE_TOUCHER_H_
+#define _PASSENGER_TREE_TOUCHER_H_
+
+/* Touches everything in a directory tree so that /tmp cleaners leave it
+ * alone, without spawning 'find | xargs touch'. Used by both the Watchdog
+ * and TempDirToucher, so this is plain C.
+ *
+ *   TreeToucher toucher;
+ *   initTreeToucher(&toucher);
+ *   toucher.minAge = 60 * 60;
+ *   toucher.maxPerSecond = 1000;
+ *   touchTree(&toucher, "/tmp/passenger.1.0.1234");
+ *
+ * touchTree() is not reentrant: only one thread in a process may use it
+ * at a time, because nftw() doesn't pass any context to its callback.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+	#include <sys/syscall.h>
+#endif
+
+typedef struct {
+	/** Entries whose access and modification times are both less than
+	 * this many seconds old are skipped. */
+	time_t minAge;
+	/** Touch at most this many entries per second. 0 means no limit. */
+	unsigned int maxPerSecond;
+	/** If not NULL, called before every entry. The walk is aborted
+	 * if it returns nonzero. */
+	int (*shouldStop)(void *userData);
+	void *userData;
+
+	/** Statistics about the last touchTree() call. */
+	unsigned long touched;
+	unsigned long skipped;
+	unsigned long failed;
+
+	/* Private. */
+	time_t threshold;
+	struct timeval windowStart;
+	unsigned int windowCount;
+} TreeToucher;
+
+static TreeToucher *currentTreeToucher = NULL;
+
+static void
+initTreeToucher(TreeToucher *toucher) {
+	memset(toucher, 0, sizeof(TreeToucher));
+}
+
+/* Sleeps until the current one second rate limiting window is over,
+ * checking shouldStop() every 100 msec. Returns whether to stop.
+ */
+static int
+waitForNextTouchWindow(TreeToucher *toucher) {
+	struct timeval now;
+	long long elapsed;
+
+	while (1) {
+		if (toucher->shouldStop != NULL && toucher->shouldStop(toucher->userData)) {
+			return 1;
+		}
+		gettimeofday(&now, NULL);
+		elapsed = (long long) (now.tv_sec - toucher->windowStart.tv_sec) * 1000000
+			+ (now.tv_usec - toucher->windowStart.tv_usec);
+		if (elapsed < 0 || elapsed >= 1000000) {
+			toucher->windowStart = now;
+			toucher->windowCount = 0;
+			return 0;
+		} else if (1000000 - elapsed > 100000) {
+			usleep(100000);
+		} else {
+			usleep((useconds_t) (1000000 - elapsed));
+		}
+	}
+}
+
+static int
+touchTreeEntry(const char *path, const struct stat *buf, int type, struct FTW *ftw) {
+	TreeToucher *toucher = currentTreeToucher;
+	int ret;
+
+	(void) ftw;
+	if (toucher->shouldStop != NULL && toucher->shouldStop(toucher->userData)) {
+		return 1;
+	}
+	if (type != FTW_NS && buf->st_atime >= toucher->threshold
+	 && buf->st_mtime >= toucher->threshold)
+	{
+		toucher->skipped++;
+		return 0;
+	}
+
+	if (toucher->maxPerSecond > 0 && toucher->windowCount >= toucher->maxPerSecond) {
+		if (waitForNextTouchWindow(toucher)) {
+			return 1;
+		}
+	}
+	toucher->windowCount++;
+
+	#ifdef UTIME_NOW
+		do {
+			ret = utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+		} while (ret == -1 && errno == EINTR);
+	#else
+		if (type == FTW_SL) {
+			/* utimes() would touch the symlink's target instead. */
+			return 0;
+		}
+		do {
+			ret = utimes(path, NULL);
+		} while (ret == -1 && errno == EINTR);
+	#endif
+	if (ret == 0) {
+		toucher->touched++;
+	} else {
+		/* The file may have been removed in the mean time. */
+		toucher->failed++;
+	}
+	return 0;
+}
+
+/* Touches everything in `dir`, including `dir` itself, that hasn't been
+ * accessed or modified in the last `minAge` seconds. Symlinks are touched
+ * but not followed. Returns 0 on success, 1 if shouldStop() told us to stop,
+ * or -1 if `dir` could not be walked, with errno set. Failures to touch
+ * individual entries are only counted in `failed`.
+ */
+static int
+touchTree(TreeToucher *toucher, const char *dir) {
+	int ret;
+
+	toucher->touched = 0;
+	toucher->skipped = 0;
+	toucher->failed = 0;
+	toucher->threshold = time(NULL) - toucher->minAge;
+	gettimeofday(&toucher->windowStart, NULL);
+	toucher->windowCount = 0;
+
+	currentTreeToucher = toucher;
+	ret = nftw(dir, touchTreeEntry, 16, FTW_PHYS);
+	currentTreeToucher = NULL;
+	return ret;
+}
+
+/* Puts the calling thread in the idle I/O scheduling class, so that the
+ * disk activity caused by touchTree() doesn't slow down anything else.
+ * Only supported on Linux; a no-op elsewhere.
+ */
+static void
+setIdleIoPriority(void) {
+	#if defined(__linux__) && defined(SYS_ioprio_set)
+		/* IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0); glibc has no header for it. */
+		const int ioprioWhoProcess = 1;
+		const int ioprioClassIdle = 3;
+		const int ioprioClassShift = 13;
+		/* For IOPRIO_WHO_PROCESS, 0 means the calling thread. */
+		syscall(SYS_ioprio_set, ioprioWhoProcess, 0,
+			ioprioClassIdle << ioprioClassShift);
+	#endif
+}
+
+#endif /* _PASSENGER_TREE_TOUCHER_H_ */
@@ -44,21 +44,29 @@ private:
 				
 				// Process can be started before the watcher thread is launched.
 				if (pid == 0) {
-					pid = start();
+					boost::lock_guard<boost::mutex> l(startSyncher);
+					{
+						// It may have been started by a handoff in the mean time.
+						boost::lock_guard<boost::mutex> l2(lock);
+						pid = this->pid;
+					}
+					if (pid == 0) {
+						pid = start();
+					}
 				}
 				ret = syscalls::waitpid(pid, &status, 0);
 				if (ret == -1 && errno == ECHILD) {
 					/* If the agent is attached to gdb then waitpid()
 					 * here can return -1 with errno == ECHILD.
-					 * Fallback to kill() polling for checking
-					 * whether the agent is alive.
+					 * Fall back to waiting for its exit event in
+					 * some other way.
 					 */
 					ret = pid;
 					status = 0;
 					P_WARN("waitpid() on " << name() << " (pid=" << pid <<
 						") returned -1 with " <<
-						"errno = ECHILD, falling back to kill polling");
-					waitpidUsingKillPolling(pid);
+						"errno = ECHILD, falling back to waiting for its exit event");
+					waitUntilExited(pid);
 					e = 0;
 				} else {
 					e = errno;
@@ -66,6 +74,13 @@ private:
 				
 				{
 					boost::lock_guard<boost::mutex> l(lock);
+					if (this->pid != pid) {
+						/* The agent has been replaced while we were waiting,
+						 * see HelperAgentWatcher::handOff(). The process that
+						 * exited is the old one, so watch the new one.
+						 */
+						continue;
+					}
 					this->pid = 0;
 				}
 				
@@ -138,6 +153,19 @@ protected:
 	 */
 	mutable boost::mutex lock;
 
+	/**
+	 * Held while starting the agent process, so that the watcher thread and
+	 * the main thread never both start a new one.
+	 */
+	boost::mutex startSyncher;
+
+	/**
+	 * How long the phases of the last successful start() took, in miliseconds:
+	 * forking, sending the startup arguments, and waiting for the agent to
+	 * report that it has initialized. Protected by `lock`.
+	 */
+	unsigned long long forkTime, argumentsTime, initializationTime;
+
 	WorkingObjectsPtr wo;
 	
 	/**
@@ -193,22 +221,35 @@ protected:
 	 */
 	static int timedWaitPid(pid_t pid, int *status, unsigned long long timeout) {
 		Timer timer;
+		unsigned long long elapsed;
 		int ret;
 		
-		do {
+		while (true) {
 			ret = syscalls::waitpid(pid, status, WNOHANG);
 			if (ret > 0 || ret == -1) {
 				return ret;
-			} else {
+			}
+			elapsed = timer.elapsed();
+			if (elapsed >= timeout) {
+				return 0; // timed out
+			} else if (waitForProcessExit(pid, (int) (timeout - elapsed)) == -1) {
+				// Can't wait for the exit event on this platform, so poll.
 				syscalls::usleep(10000);
 			}
-		} while (timer.elapsed() < timeout);
-		return 0; // timed out
+		}
 	}
 	
-	static void waitpidUsingKillPolling(pid_t pid) {
-		bool done = false;
+	/**
+	 * Waits until the given process has exited, even if it isn't our child
+	 * process anymore (see threadMain()).
+	 */
+	static void waitUntilExited(pid_t pid) {
+		if (waitForProcessExit(pid, -1) != -1) {
+			return;
+		}
 		
+		// Can't wait for the exit event on this platform, so poll.
+		bool done = false;
 		while (!done) {
 			int ret = syscalls::kill(pid, 0);
 			done = ret == -1;
@@ -222,6 +263,9 @@ public:
 	AgentWatcher(const WorkingObjectsPtr &wo) {
 		thr = NULL;
 		pid = 0;
+		forkTime = 0;
+		argumentsTime = 0;
+		initializationTime = 0;
 		this->wo = wo;
 	}
 	
@@ -237,6 +281,21 @@ public:
 	 */
 	virtual void reportAgentsInformation(VariantMap &report) = 0;
 	
+	/**
+	 * Stores how long the phases of starting the agent process took in the
+	 * given report object, as `<prefix>_fork_time`, `<prefix>_arguments_time`
+	 * and `<prefix>_initialization_time` (in miliseconds).
+	 *
+	 * @pre start() has been called and succeeded.
+	 */
+	void reportStartupTimes(VariantMap &report, const string &prefix) const {
+		boost::lock_guard<boost::mutex> l(lock);
+		report
+			.setULL(prefix + "_fork_time", forkTime)
+			.setULL(prefix + "_arguments_time", argumentsTime)
+			.setULL(prefix + "_initialization_time", initializationTime);
+	}
+	
 	/** Returns the name of the agent that this class is watching. */
 	virtual const char *name() const = 0;
 	
@@ -250,6 +309,8 @@ public:
 		SocketPair fds;
 		int e, ret;
 		pid_t pid;
+		Timer timer;
+		unsigned long long forkTime, argumentsTime;
 		
 		/* Create feedback fd for this agent process. We'll send some startup
 		 * arguments to this agent process through this fd, and we'll receive
@@ -326,6 +387,8 @@ public:
 			vector<string> args;
 			
 			fds[1].close();
+			forkTime = timer.elapsed();
+			timer.start();
 			this_thread::restore_interruption ri(di);
 			this_thread::restore_syscall_interruption rsi(dsi);
 			ScopeGuard failGuard(boost::bind(killAndWait, pid));
@@ -343,6 +406,8 @@ public:
 						ex.code());
 				}
 			}
+			argumentsTime = timer.elapsed();
+			timer.start();
 			
 			// Now read its feedback.
 			try {
@@ -421,6 +486,9 @@ public:
 			boost::lock_guard<boost::mutex> l(lock);
 			this->feedbackFd = feedbackFd;
 			this->pid = pid;
+			this->forkTime = forkTime;
+			this->argumentsTime = argumentsTime;
+			this->initializationTime = timer.elapsed();
 			failGuard.clear();
 			return pid;
 		}
@@ -29,6 +29,7 @@ protected:
 	VariantMap params, report;
 	string requestSocketFilename;
 	string messageSocketFilename;
+	ProcessKeeperPtr processKeeper;
 	
 	virtual const char *name() const {
 		return "Phusion Passenger helper agent";
@@ -50,7 +51,7 @@ protected:
 	virtual void sendStartupArguments(pid_t pid, FileDescriptor &fd) {
 		VariantMap options = agentsOptions;
 		params.addTo(options);
-		options.writeToFd(fd);
+		options.writeBinaryToFd(fd);
 	}
 	
 	virtual bool processStartupInfo(pid_t pid, FileDescriptor &fd, const vector<string> &args) {
@@ -63,6 +64,19 @@ protected:
 		}
 	}
 	
+	/**
+	 * With peer credential authentication the web server doesn't send a
+	 * connect password, which is signified by "-".
+	 */
+	static string getRequestSocketPassword(const WorkingObjectsPtr &wo) {
+		if (agentsOptions.getBool("request_socket_peer_auth", false, false)) {
+			return "-";
+		} else {
+			return agentsOptions.get("request_socket_password", false,
+				wo->randomGenerator.generateAsciiString(REQUEST_SOCKET_PASSWORD_SIZE));
+		}
+	}
+	
 public:
 	HelperAgentWatcher(const WorkingObjectsPtr &wo)
 		: AgentWatcher(wo)
@@ -73,9 +87,7 @@ public:
 			.set("request_socket_filename",
 				agentsOptions.get("request_socket_filename", false,
 					wo->generation->getPath() + "/request"))
-			.set("request_socket_password",
-				agentsOptions.get("request_socket_password", false,
-					wo->randomGenerator.generateAsciiString(REQUEST_SOCKET_PASSWORD_SIZE)))
+			.set("request_socket_password", getRequestSocketPassword(wo))
 			.set("helper_agent_admin_socket_address",
 				agentsOptions.get("helper_agent_admin_socket_address", false,
 					"unix:" + wo->generation->getPath() + "/helper_admin"))
@@ -83,13 +95,64 @@ public:
 				agentsOptions.get("helper_agent_exit_password", false,
 					wo->randomGenerator.generateAsciiString(MESSAGE_SERVER_MAX_PASSWORD_SIZE)));
 
+		processKeeper = boost::make_shared<ProcessKeeper>(wo);
+
 		params = report;
 		params
 			.set("logging_agent_address", wo->loggingAgentAddress)
-			.set("logging_agent_password", wo->loggingAgentPassword);
+			.set("logging_agent_password", wo->loggingAgentPassword)
+			.set("process_keeper_address", processKeeper->getAddress())
+			.set("process_keeper_password", processKeeper->getPassword());
+		if (!wo->loggingAgentDatagramAddress.empty()) {
+			params.set("logging_agent_datagram_address", wo->loggingAgentDatagramAddress);
+		}
 	}
 	
 	virtual void reportAgentsInformation(VariantMap &report) {
 		this->report.addTo(report);
+		reportStartupTimes(report, "helper_agent_startup");
+	}
+
+	/**
+	 * Stops the process keeper and closes the file descriptors that it holds.
+	 * Must be called before the watchdog forks its cleanup process: otherwise
+	 * that process inherits the process keeper's sockets without serving them,
+	 * and the helper agent blocks on them while shutting down.
+	 */
+	void stopProcessKeeper() {
+		processKeeper.reset();
+	}
+
+	/**
+	 * Replaces the running helper agent with a new one, e.g. after the
+	 * helper agent binary has been upgraded. The new helper agent takes over
+	 * the request socket and the application processes from the old one,
+	 * so that no requests are refused and no processes have to be respawned.
+	 * The old one exits once its remaining clients have disconnected.
+	 *
+	 * Returns false if there's no helper agent running that can be replaced.
+	 * May throw arbitrary exceptions, in which case the old helper agent
+	 * keeps running.
+	 */
+	bool handOff() {
+		boost::lock_guard<boost::mutex> l(startSyncher);
+		pid_t oldPid;
+		{
+			boost::lock_guard<boost::mutex> l2(lock);
+			oldPid = pid;
+		}
+		if (oldPid == 0) {
+			return false;
+		}
+
+		P_WARN("Replacing the " << name() << " (pid=" << oldPid << ")...");
+		params.set("handoff", "true");
+		ScopeGuard guard(boost::bind(&VariantMap::erase, &params, "handoff"));
+		/* When start() replaces the old agent's feedback fd, the old
+		 * agent takes that as the signal that it may exit.
+		 */
+		pid_t newPid = start();
+		P_WARN("The " << name() << " has been replaced by pid " << newPid);
+		return true;
 	}
 };
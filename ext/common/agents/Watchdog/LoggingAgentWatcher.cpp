@@ -45,7 +45,10 @@ protected:
 		options.set("logging_agent_address", wo->loggingAgentAddress);
 		options.set("logging_agent_password", wo->loggingAgentPassword);
 		options.set("logging_agent_admin_address", wo->loggingAgentAdminAddress);
-		options.writeToFd(fd);
+		if (!wo->loggingAgentDatagramAddress.empty()) {
+			options.set("logging_agent_datagram_address", wo->loggingAgentDatagramAddress);
+		}
+		options.writeBinaryToFd(fd);
 	}
 	
 	virtual bool processStartupInfo(pid_t pid, FileDescriptor &fd, const vector<string> &args) {
@@ -68,5 +71,6 @@ public:
 			.set("logging_socket_address", wo->loggingAgentAddress)
 			.set("logging_socket_password", wo->loggingAgentPassword)
 			.set("logging_socket_admin_address", wo->loggingAgentAdminAddress);
+		reportStartupTimes(report, "logging_agent_startup");
 	}
 };
@@ -32,20 +32,28 @@
 #include <string>
 #include <utility>
 #include <vector>
+#include <map>
+#include <algorithm>
 
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <unistd.h>
+#include <signal.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
 
 #include <agents/Base.h>
+#include <agents/TreeToucher.h>
 #include <Constants.h>
 #include <ServerInstanceDir.h>
+#include <MessageServer.h>
+#include <AccountsDatabase.h>
+#include <Account.h>
 #include <FileDescriptor.h>
 #include <RandomGenerator.h>
 #include <Logging.h>
@@ -105,6 +113,8 @@ struct WorkingObjects {
 	string loggingAgentAddress;
 	string loggingAgentPassword;
 	string loggingAgentAdminAddress;
+	/** Empty unless Union Station datagrams are enabled. */
+	string loggingAgentDatagramAddress;
 	string adminToolStatusPassword;
 	string adminToolManipulationPassword;
 };
@@ -113,8 +123,12 @@ typedef boost::shared_ptr<WorkingObjects> WorkingObjectsPtr;
 
 static string oldOomScore;
 
+/** Written to by onSighup() so that the main thread can select() on it. */
+static int sighupPipe[2] = { -1, -1 };
+
 #include "AgentWatcher.cpp"
 #include "ServerInstanceDirToucher.cpp"
+#include "ProcessKeeper.cpp"
 #include "HelperAgentWatcher.cpp"
 #include "LoggingAgentWatcher.cpp"
 
@@ -220,10 +234,71 @@ setOomScoreNeverKill() {
 	return oldScore;
 }
 
+static void
+onSighup(int signo) {
+	int e = errno;
+	ssize_t ret = write(sighupPipe[1], "x", 1);
+	(void) ret;
+	errno = e;
+}
+
+static void
+installSighupHandler() {
+	struct sigaction action;
+
+	if (syscalls::pipe(sighupPipe) == -1) {
+		int e = errno;
+		throw SystemException("Cannot create a pipe", e);
+	}
+	setNonBlocking(sighupPipe[1]);
+
+	action.sa_handler = onSighup;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGHUP, &action, NULL);
+}
+
+/**
+ * Called when the watchdog receives SIGHUP. Replaces the helper agent with
+ * a new one, e.g. to activate an upgraded helper agent binary, without
+ * refusing requests or respawning application processes.
+ */
+static void
+handOffHelperAgent(vector<AgentWatcherPtr> &watchers) {
+	foreach (AgentWatcherPtr watcher, watchers) {
+		boost::shared_ptr<HelperAgentWatcher> helperAgentWatcher =
+			dynamic_pointer_cast<HelperAgentWatcher>(watcher);
+		if (helperAgentWatcher == NULL) {
+			continue;
+		}
+		try {
+			if (!helperAgentWatcher->handOff()) {
+				P_WARN("Not replacing the " << watcher->name() <<
+					" because it's being restarted already");
+			}
+		} catch (const tracable_exception &e) {
+			P_ERROR("Cannot replace the " << watcher->name() << ": " <<
+				e.what() << "\n" << e.backtrace());
+		}
+	}
+}
+
+static void
+stopProcessKeeper(vector<AgentWatcherPtr> &watchers) {
+	foreach (AgentWatcherPtr watcher, watchers) {
+		boost::shared_ptr<HelperAgentWatcher> helperAgentWatcher =
+			dynamic_pointer_cast<HelperAgentWatcher>(watcher);
+		if (helperAgentWatcher != NULL) {
+			helperAgentWatcher->stopProcessKeeper();
+		}
+	}
+}
+
 /**
  * Wait until the starter process has exited or sent us an exit command,
  * or until one of the watcher threads encounter an error. If a thread
- * encountered an error then the error message will be printed.
+ * encountered an error then the error message will be printed. Replaces
+ * the helper agent whenever we receive SIGHUP in the mean time.
  *
  * Returns whether this watchdog should exit gracefully, which is only the
  * case if the web server sent us an exit command and no thread encountered
@@ -235,21 +310,27 @@ waitForStarterProcessOrWatchers(const WorkingObjectsPtr &wo, vector<AgentWatcher
 	int max, ret;
 	char x;
 	
-	FD_ZERO(&fds);
-	FD_SET(FEEDBACK_FD, &fds);
-	FD_SET(wo->errorEvent.fd(), &fds);
-	
-	if (FEEDBACK_FD > wo->errorEvent.fd()) {
-		max = FEEDBACK_FD;
-	} else {
-		max = wo->errorEvent.fd();
-	}
-	
-	ret = syscalls::select(max + 1, &fds, NULL, NULL, NULL);
-	if (ret == -1) {
-		int e = errno;
-		P_ERROR("select() failed: " << strerror(e));
-		return false;
+	while (true) {
+		FD_ZERO(&fds);
+		FD_SET(FEEDBACK_FD, &fds);
+		FD_SET(wo->errorEvent.fd(), &fds);
+		FD_SET(sighupPipe[0], &fds);
+		max = std::max(std::max(FEEDBACK_FD, wo->errorEvent.fd()), sighupPipe[0]);
+
+		ret = syscalls::select(max + 1, &fds, NULL, NULL, NULL);
+		if (ret == -1) {
+			int e = errno;
+			P_ERROR("select() failed: " << strerror(e));
+			return false;
+		}
+
+		if (FD_ISSET(sighupPipe[0], &fds)) {
+			char buf[32];
+			syscalls::read(sighupPipe[0], buf, sizeof(buf));
+			handOffHelperAgent(watchers);
+		} else {
+			break;
+		}
 	}
 	
 	if (FD_ISSET(wo->errorEvent.fd(), &fds)) {
@@ -316,8 +397,8 @@ cleanupAgentsInBackground(const WorkingObjectsPtr &wo, vector<AgentWatcherPtr> &
 		try {
 			vector<AgentWatcherPtr>::const_iterator it;
 			Timer timer(false);
-			fd_set fds, fds2;
-			int max, agentProcessesDone;
+			vector<struct pollfd> fds;
+			bool error = false;
 			unsigned long long deadline = 30000; // miliseconds
 
 			#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(sun)
@@ -327,43 +408,39 @@ cleanupAgentsInBackground(const WorkingObjectsPtr &wo, vector<AgentWatcherPtr> &
 			
 			// Wait until all agent processes have exited. The starter
 			// process is responsible for telling the individual agents
-			// to exit.
+			// to exit. An agent's feedback fd becomes readable (EOF)
+			// once it has exited.
 			
-			max = 0;
-			FD_ZERO(&fds);
 			for (it = watchers.begin(); it != watchers.end(); it++) {
-				FD_SET((*it)->getFeedbackFd(), &fds);
-				if ((*it)->getFeedbackFd() > max) {
-					max = (*it)->getFeedbackFd();
+				struct pollfd pfd;
+				pfd.fd = (*it)->getFeedbackFd();
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				if (pfd.fd != -1) {
+					fds.push_back(pfd);
 				}
 			}
 
 			timer.start();
-			agentProcessesDone = 0;
-			while (agentProcessesDone != -1
-			    && agentProcessesDone < (int) watchers.size()
-			    && timer.elapsed() < deadline)
-			{
-				struct timeval timeout;
-				
-				#ifdef FD_COPY
-					FD_COPY(&fds, &fds2);
-				#else
-					FD_ZERO(&fds2);
-					for (it = watchers.begin(); it != watchers.end(); it++) {
-						FD_SET((*it)->getFeedbackFd(), &fds2);
+			while (!fds.empty() && !error && timer.elapsed() < deadline) {
+				int ret = syscalls::poll(&fds[0], fds.size(),
+					(int) (deadline - std::min(deadline, timer.elapsed())));
+				if (ret == -1) {
+					error = true;
+				} else if (ret > 0) {
+					unsigned int i = 0;
+					while (i < fds.size()) {
+						if (fds[i].revents != 0) {
+							fds[i] = fds.back();
+							fds.pop_back();
+						} else {
+							i++;
+						}
 					}
-				#endif
-				
-				timeout.tv_sec = 0;
-				timeout.tv_usec = 10000;
-				agentProcessesDone = syscalls::select(max + 1, &fds2, NULL, NULL, &timeout);
-				if (agentProcessesDone > 0 && timer.elapsed() < deadline) {
-					usleep(10000);
 				}
 			}
 
-			if (agentProcessesDone == -1 || timer.elapsed() >= deadline) {
+			if (error || !fds.empty()) {
 				// An error occurred or we've waited long enough. Kill all the
 				// processes.
 				P_WARN("Some Phusion Passenger agent processes did not exit " <<
@@ -587,6 +664,9 @@ initializeWorkingObjects(WorkingObjectsPtr &wo, ServerInstanceDirToucherPtr &ser
 	wo->loggingAgentAddress  = "unix:" + wo->generation->getPath() + "/logging";
 	wo->loggingAgentPassword = wo->randomGenerator.generateAsciiString(64);
 	wo->loggingAgentAdminAddress  = "unix:" + wo->generation->getPath() + "/logging_admin";
+	if (agentsOptions.getBool("union_station_datagrams", false, false)) {
+		wo->loggingAgentDatagramAddress = "unix:" + wo->generation->getPath() + "/logging_datagrams";
+	}
 
 	UPDATE_TRACE_POINT();
 	wo->adminToolStatusPassword = wo->randomGenerator.generateAsciiString(MESSAGE_SERVER_MAX_PASSWORD_SIZE);
@@ -613,21 +693,48 @@ initializeAgentWatchers(const WorkingObjectsPtr &wo, vector<AgentWatcherPtr> &wa
 	watchers.push_back(make_shared<LoggingAgentWatcher>(wo));
 }
 
+static void
+startAgent(AgentWatcherPtr watcher, string *errorMessage) {
+	try {
+		watcher->start();
+	} catch (const std::exception &e) {
+		*errorMessage = e.what();
+	}
+	// Allow other exceptions to propagate and crash the watchdog.
+}
+
+/**
+ * Starts all agents at the same time instead of one after the other: they
+ * don't depend on each other during startup, so the web server only has to
+ * wait for the slowest one.
+ */
 static void
 startAgents(const WorkingObjectsPtr &wo, vector<AgentWatcherPtr> &watchers) {
 	TRACE_POINT();
-	foreach (AgentWatcherPtr watcher, watchers) {
-		try {
-			watcher->start();
-		} catch (const std::exception &e) {
+	vector<oxt::thread *> threads;
+	vector<string> errorMessages(watchers.size());
+	unsigned int i;
+
+	for (i = 0; i < watchers.size(); i++) {
+		threads.push_back(new oxt::thread(
+			boost::bind(startAgent, watchers[i], &errorMessages[i]),
+			string("Starting ") + watchers[i]->name(),
+			256 * 1024));
+	}
+	for (i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+
+	for (i = 0; i < errorMessages.size(); i++) {
+		if (!errorMessages[i].empty()) {
 			writeArrayMessage(FEEDBACK_FD,
 				"Watchdog startup error",
-				e.what(),
+				errorMessages[i].c_str(),
 				NULL);
 			forceAllAgentsShutdown(watchers);
 			exit(1);
 		}
-		// Allow other exceptions to propagate and crash the watchdog.
 	}
 }
 
@@ -649,13 +756,16 @@ beginWatchingAgents(const WorkingObjectsPtr &wo, vector<AgentWatcherPtr> &watche
 }
 
 static void
-reportAgentsInformation(const WorkingObjectsPtr &wo, const vector<AgentWatcherPtr> &watchers) {
+reportAgentsInformation(const WorkingObjectsPtr &wo, const vector<AgentWatcherPtr> &watchers,
+	unsigned long long startupTime)
+{
 	TRACE_POINT();
 	VariantMap report;
 
 	report
 		.set("server_instance_dir", wo->serverInstanceDir->getPath())
-		.setInt("generation", wo->generation->getNumber());
+		.setInt("generation", wo->generation->getNumber())
+		.setULL("agents_startup_time", startupTime);
 
 	foreach (AgentWatcherPtr watcher, watchers) {
 		watcher->reportAgentsInformation(report);
@@ -691,9 +801,11 @@ main(int argc, char *argv[]) {
 
 	try {
 		TRACE_POINT();
+		Timer timer;
 		startAgents(wo, watchers);
 		beginWatchingAgents(wo, watchers);
-		reportAgentsInformation(wo, watchers);
+		reportAgentsInformation(wo, watchers, timer.elapsed());
+		installSighupHandler();
 		P_INFO("All Phusion Passenger agents started!");
 		UPDATE_TRACE_POINT();
 		runHookScriptAndThrowOnError("after_watchdog_initialization");
@@ -715,6 +827,7 @@ main(int argc, char *argv[]) {
 		runHookScriptAndThrowOnError("after_watchdog_shutdown");
 		UPDATE_TRACE_POINT();
 		AgentWatcher::stopWatching(watchers);
+		stopProcessKeeper(watchers);
 		if (exitGracefully) {
 			UPDATE_TRACE_POINT();
 			cleanupAgentsInBackground(wo, watchers, argv);
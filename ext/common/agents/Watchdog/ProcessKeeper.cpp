@@ -0,0 +1,155 @@
+/*
+ *  Phusion Passenger - https://www.phusionpassenger.com/
+ *  Copyright (c) 2014 Phusion
+ *
+ *  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+/**
+ * Holds on to the admin sockets and error pipes of the helper agent's
+ * application processes, so that those processes survive a helper agent
+ * crash: an application process exits once the other end of its admin
+ * socket is closed, which would otherwise happen as soon as the helper agent
+ * dies. The restarted helper agent takes them back and reattaches the
+ * processes, see ProcessJournal in the helper agent.
+ *
+ * The helper agent sends the file descriptors of every process that it
+ * attaches with 'keep', and tells us to 'release' them once it detaches the
+ * process:
+ *
+ *   ["keep", gupid, whether there's an error pipe], followed by the
+ *   admin socket and the error pipe, if any
+ *   ["release", gupid]
+ *   ["recover"]: we reply with ["process", gupid, whether there's an error
+ *   pipe] followed by its file descriptors for every kept process,
+ *   and then ["end"]. We keep holding on to them.
+ */
+class ProcessKeeper {
+private:
+	class Handler: public MessageServer::Handler {
+	private:
+		struct KeptProcess {
+			FileDescriptor adminSocket;
+			FileDescriptor errorPipe;
+		};
+
+		boost::mutex syncher;
+		map<string, KeptProcess> processes;
+
+	public:
+		virtual bool processMessage(MessageServer::CommonClientContext &commonContext,
+		                            MessageServer::ClientContextPtr &handlerSpecificContext,
+		                            const vector<string> &args)
+		{
+			if (args[0] == "keep" && args.size() == 3) {
+				TRACE_POINT();
+				commonContext.requireRights(Account::KEEP_PROCESSES);
+				KeptProcess process;
+				process.adminSocket = FileDescriptor(
+					readFileDescriptorWithNegotiation(commonContext.fd));
+				if (args[2] == "true") {
+					process.errorPipe = FileDescriptor(
+						readFileDescriptorWithNegotiation(commonContext.fd));
+				}
+				boost::lock_guard<boost::mutex> l(syncher);
+				processes[args[1]] = process;
+				return true;
+			} else if (args[0] == "release" && args.size() == 2) {
+				commonContext.requireRights(Account::KEEP_PROCESSES);
+				boost::lock_guard<boost::mutex> l(syncher);
+				processes.erase(args[1]);
+				return true;
+			} else if (args[0] == "recover" && args.size() == 1) {
+				TRACE_POINT();
+				commonContext.requireRights(Account::KEEP_PROCESSES);
+				map<string, KeptProcess> copy;
+				{
+					boost::lock_guard<boost::mutex> l(syncher);
+					copy = processes;
+				}
+
+				map<string, KeptProcess>::const_iterator it, end = copy.end();
+				for (it = copy.begin(); it != end; it++) {
+					const KeptProcess &process = it->second;
+					writeArrayMessage(commonContext.fd,
+						"process",
+						it->first.c_str(),
+						(process.errorPipe != -1) ? "true" : "false",
+						NULL);
+					writeFileDescriptorWithNegotiation(commonContext.fd,
+						process.adminSocket);
+					if (process.errorPipe != -1) {
+						writeFileDescriptorWithNegotiation(commonContext.fd,
+							process.errorPipe);
+					}
+				}
+				writeArrayMessage(commonContext.fd, "end", NULL);
+				P_DEBUG("Handed " << copy.size() << " kept processes back to "
+					"the helper agent");
+				return true;
+			} else {
+				return false;
+			}
+		}
+	};
+
+	string password;
+	boost::shared_ptr<MessageServer> server;
+	oxt::thread *thr;
+
+	void threadMain() {
+		try {
+			server->mainLoop();
+		} catch (const boost::thread_interrupted &) {
+			// Shutting down.
+		} catch (const tracable_exception &e) {
+			P_WARN("The process keeper has stopped: " << e.what() << "\n" <<
+				e.backtrace());
+		}
+	}
+
+public:
+	ProcessKeeper(const WorkingObjectsPtr &wo) {
+		AccountsDatabasePtr accountsDatabase = boost::make_shared<AccountsDatabase>();
+		password = wo->randomGenerator.generateAsciiString(MESSAGE_SERVER_MAX_PASSWORD_SIZE);
+		accountsDatabase->add("_helper_agent", password, false, Account::KEEP_PROCESSES);
+		server = boost::make_shared<MessageServer>(
+			wo->generation->getPath() + "/process_keeper", accountsDatabase);
+		server->addHandler(boost::make_shared<Handler>());
+		thr = new oxt::thread(boost::bind(&ProcessKeeper::threadMain, this),
+			"Process keeper", 256 * 1024);
+	}
+
+	~ProcessKeeper() {
+		thr->interrupt_and_join();
+		delete thr;
+	}
+
+	string getAddress() const {
+		return "unix:" + server->getSocketFilename();
+	}
+
+	const string &getPassword() const {
+		return password;
+	}
+};
+
+typedef boost::shared_ptr<ProcessKeeper> ProcessKeeperPtr;
@@ -27,75 +27,45 @@
  * Touch all files in the server instance dir every 6 hours in order to prevent /tmp
  * cleaners from weaking havoc:
  * http://code.google.com/p/phusion-passenger/issues/detail?id=365
+ *
+ * The touching is done in-process by TreeToucher, at idle I/O priority and
+ * rate limited, so that instance dirs with many buffered upload files don't
+ * cause I/O bursts. Files that have been used in the last 3 hours don't need
+ * touching and are skipped.
  */
 class ServerInstanceDirToucher {
 private:
 	WorkingObjectsPtr wo;
 	oxt::thread *thr;
 	
+	static int
+	shouldStopTouching(void *userData) {
+		return this_thread::interruption_requested();
+	}
+	
 	void
 	threadMain() {
+		setIdleIoPriority();
 		while (!this_thread::interruption_requested()) {
 			syscalls::sleep(60 * 60 * 6);
 			
-			begin_touch:
+			string path = wo->serverInstanceDir->getPath();
+			TreeToucher toucher;
+			initTreeToucher(&toucher);
+			toucher.minAge = 60 * 60 * 3;
+			toucher.maxPerSecond = 1000;
+			toucher.shouldStop = shouldStopTouching;
 			
-			this_thread::disable_interruption di;
-			this_thread::disable_syscall_interruption dsi;
-			// Fork a process which touches everything in the server instance dir.
-			pid_t pid = syscalls::fork();
-			if (pid == 0) {
-				// Child
-				int prio, ret, e;
-				
-				closeAllFileDescriptors(2);
-				
-				// Make process nicer.
-				do {
-					prio = getpriority(PRIO_PROCESS, getpid());
-				} while (prio == -1 && errno == EINTR);
-				if (prio != -1) {
-					prio++;
-					if (prio > 20) {
-						prio = 20;
-					}
-					do {
-						ret = setpriority(PRIO_PROCESS, getpid(), prio);
-					} while (ret == -1 && errno == EINTR);
-				} else {
-					perror("getpriority");
-				}
-				
-				do {
-					ret = chdir(wo->serverInstanceDir->getPath().c_str());
-				} while (ret == -1 && errno == EINTR);
-				if (ret == -1) {
-					e = errno;
-					fprintf(stderr, "chdir(\"%s\") failed: %s (%d)\n",
-						wo->serverInstanceDir->getPath().c_str(),
-						strerror(e), e);
-					fflush(stderr);
-					_exit(1);
-				}
-				
-				setOomScore(oldOomScore);
-				
-				execlp("/bin/sh", "/bin/sh", "-c", "find . | xargs touch", (char *) 0);
-				e = errno;
-				fprintf(stderr, "Cannot execute 'find . | xargs touch': %s (%d)\n",
-					strerror(e), e);
-				fflush(stderr);
-				_exit(1);
-			} else if (pid == -1) {
-				// Error
-				P_WARN("Could not touch the server instance directory because "
-					"fork() failed. Retrying in 2 minutes...");
-				this_thread::restore_interruption si(di);
-				this_thread::restore_syscall_interruption rsi(dsi);
-				syscalls::sleep(60 * 2);
-				goto begin_touch;
-			} else {
-				syscalls::waitpid(pid, NULL, 0);
+			int ret = touchTree(&toucher, path.c_str());
+			if (ret == -1) {
+				int e = errno;
+				P_WARN("Could not touch the server instance directory " << path <<
+					": " << strerror(e) << " (errno=" << e << ")");
+			} else if (ret == 0) {
+				P_DEBUG("Touched the server instance directory: " <<
+					toucher.touched << " entries touched, " <<
+					toucher.skipped << " recently used, " <<
+					toucher.failed << " failed");
 			}
 		}
 	}
@@ -79,6 +79,13 @@ u_char int_buf[32], *end, *buf, *pos;
 	
 
 	
+		if (conf->timing_header != NGX_CONF_UNSET) {
+			len += 24;
+			len += conf->timing_header ? sizeof("true") : sizeof("false");
+		}
+	
+
+	
 		if (conf->min_instances != NGX_CONF_UNSET) {
 			end = ngx_snprintf(int_buf,
 				sizeof(int_buf) - 1,
@@ -317,6 +324,19 @@ buf = pos = ngx_pnalloc(cf->pool, len);
 	
 
 	
+		if (conf->timing_header != NGX_CONF_UNSET) {
+			pos = ngx_copy(pos,
+				"PASSENGER_TIMING_HEADER",
+				24);
+			if (conf->timing_header) {
+				pos = ngx_copy(pos, "true", sizeof("true"));
+			} else {
+				pos = ngx_copy(pos, "false", sizeof("false"));
+			}
+		}
+	
+
+	
 		if (conf->min_instances != NGX_CONF_UNSET) {
 			pos = ngx_copy(pos,
 				"PASSENGER_MIN_PROCESSES",
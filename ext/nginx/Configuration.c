@@ -35,6 +35,8 @@
 #include "ngx_http_passenger_module.h"
 #include "Configuration.h"
 #include "ContentHandler.h"
+#include "UpstreamKeepalive.h"
+#include "StatCache.h"
 #include "common/Constants.h"
 #include "common/agents/LoggingAgent/FilterSupport.h"
 
@@ -79,6 +81,8 @@ passenger_create_main_conf(ngx_conf_t *cf)
     conf->abort_on_startup_error = NGX_CONF_UNSET;
     conf->max_pool_size = (ngx_uint_t) NGX_CONF_UNSET;
     conf->pool_idle_time = (ngx_uint_t) NGX_CONF_UNSET;
+    conf->helper_agent_keepalive = (ngx_uint_t) NGX_CONF_UNSET;
+    conf->stat_cache_ttl = (ngx_uint_t) NGX_CONF_UNSET;
     conf->user_switching = NGX_CONF_UNSET;
     conf->default_user.data = NULL;
     conf->default_user.len  = 0;
@@ -140,6 +144,14 @@ passenger_init_main_conf(ngx_conf_t *cf, void *conf_pointer)
         conf->pool_idle_time = DEFAULT_POOL_IDLE_TIME;
     }
     
+    if (conf->helper_agent_keepalive == (ngx_uint_t) NGX_CONF_UNSET) {
+        conf->helper_agent_keepalive = DEFAULT_HELPER_AGENT_KEEPALIVE;
+    }
+    
+    if (conf->stat_cache_ttl == (ngx_uint_t) NGX_CONF_UNSET) {
+        conf->stat_cache_ttl = DEFAULT_STAT_CACHE_TTL;
+    }
+    
     if (conf->user_switching == NGX_CONF_UNSET) {
         conf->user_switching = 1;
     }
@@ -197,6 +209,10 @@ passenger_init_main_conf(ngx_conf_t *cf, void *conf_pointer)
         conf->union_station_proxy_address.data = (u_char *) "";
     }
     
+    if (passenger_stat_cache_init(cf) != NGX_OK) {
+        return "Cannot create the stat cache shared memory zone.";
+    }
+    
     return NGX_CONF_OK;
 }
 
@@ -307,6 +323,112 @@ cache_loc_conf_options(ngx_conf_t *cf, passenger_loc_conf_t *conf)
     #include "CacheLocationConfig.c"
 }
 
+/**
+ * Whether the CGI variable at the given index in vars_source has the same
+ * value for every request, so that it can be put in options_cache instead
+ * of being evaluated by the script engine. This is not the case if the value
+ * contains variables, or if another entry with the same name contains
+ * variables: the helper agent lets the last value win, and moving only one
+ * of them to options_cache would change their order.
+ */
+static ngx_flag_t
+is_static_var(ngx_array_t *vars_source, ngx_uint_t index)
+{
+    ngx_keyval_t  *src = vars_source->elts;
+    ngx_uint_t     i;
+
+    if (ngx_http_script_variables_count(&src[index].value) != 0) {
+        return 0;
+    }
+    for (i = 0; i < vars_source->nelts; i++) {
+        if (src[i].key.len == src[index].key.len
+         && ngx_strncmp(src[i].key.data, src[index].key.data, src[i].key.len) == 0
+         && ngx_http_script_variables_count(&src[i].value) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Appends everything else that is the same for every request to this
+ * location to options_cache: the Union Station filters and the CGI variables
+ * without variables in their values. create_request() sends options_cache
+ * by reference instead of serializing these on every request.
+ */
+static ngx_int_t
+cache_static_headers(ngx_conf_t *cf, passenger_loc_conf_t *conf)
+{
+    u_char        *buf, *pos;
+    size_t         len;
+    ngx_uint_t     i;
+    ngx_str_t     *union_station_filters = NULL;
+    ngx_keyval_t  *src = NULL;
+
+    len = conf->options_cache.len;
+
+    if (conf->union_station_filters != NGX_CONF_UNSET_PTR
+     && conf->union_station_filters->nelts > 0)
+    {
+        union_station_filters = (ngx_str_t *) conf->union_station_filters->elts;
+        len += sizeof("UNION_STATION_FILTERS");
+        for (i = 0; i < conf->union_station_filters->nelts; i++) {
+            if (i != 0) {
+                len++;
+            }
+            len += union_station_filters[i].len;
+        }
+        len++;
+    }
+
+    if (conf->vars_source != NULL) {
+        src = conf->vars_source->elts;
+        for (i = 0; i < conf->vars_source->nelts; i++) {
+            if (is_static_var(conf->vars_source, i)) {
+                len += src[i].key.len + src[i].value.len;
+            }
+        }
+    }
+
+    if (len == conf->options_cache.len) {
+        return NGX_OK;
+    }
+
+    buf = pos = ngx_pnalloc(cf->pool, len);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    pos = ngx_copy(pos, conf->options_cache.data, conf->options_cache.len);
+
+    if (union_station_filters != NULL) {
+        pos = ngx_copy(pos, "UNION_STATION_FILTERS",
+                       sizeof("UNION_STATION_FILTERS"));
+        for (i = 0; i < conf->union_station_filters->nelts; i++) {
+            if (i != 0) {
+                pos = ngx_copy(pos, "\1", 1);
+            }
+            pos = ngx_copy(pos, union_station_filters[i].data,
+                           union_station_filters[i].len);
+        }
+        pos = ngx_copy(pos, "\0", 1);
+    }
+
+    if (src != NULL) {
+        for (i = 0; i < conf->vars_source->nelts; i++) {
+            if (is_static_var(conf->vars_source, i)) {
+                pos = ngx_copy(pos, src[i].key.data, src[i].key.len);
+                pos = ngx_copy(pos, src[i].value.data, src[i].value.len);
+            }
+        }
+    }
+
+    conf->options_cache.data = buf;
+    conf->options_cache.len = pos - buf;
+    return NGX_OK;
+}
+
 char *
 passenger_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
@@ -613,10 +735,17 @@ passenger_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->vars_source = prev->vars_source;
 
         if (conf->vars_source == NULL) {
+            if (cache_static_headers(cf, conf) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
             return NGX_CONF_OK;
         }
     }
 
+    if (cache_static_headers(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     conf->vars_len = ngx_array_create(cf->pool, 64, 1);
     if (conf->vars_len == NULL) {
         return NGX_CONF_ERROR;
@@ -630,7 +759,11 @@ passenger_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     src = conf->vars_source->elts;
     for (i = 0; i < conf->vars_source->nelts; i++) {
 
-        if (ngx_http_script_variables_count(&src[i].value) == 0) {
+        if (is_static_var(conf->vars_source, i)) {
+            /* Already in options_cache. */
+            continue;
+
+        } else if (ngx_http_script_variables_count(&src[i].value) == 0) {
             copy = ngx_array_push_n(conf->vars_len,
                                     sizeof(ngx_http_script_copy_code_t));
             if (copy == NULL) {
@@ -771,6 +904,11 @@ passenger_enabled(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         if (passenger_conf->upstream_config.upstream == NULL) {
             return NGX_CONF_ERROR;
         }
+        #ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+            /* Reuse connections to the helper agent. */
+            passenger_conf->upstream_config.upstream->peer.init_upstream =
+                passenger_init_helper_agent_upstream;
+        #endif
         
         clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
         clcf->handler = passenger_content_handler;
@@ -974,6 +1112,20 @@ const ngx_command_t passenger_commands[] = {
       offsetof(passenger_main_conf_t, pool_idle_time),
       NULL },
 
+    { ngx_string("passenger_helper_agent_keepalive"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(passenger_main_conf_t, helper_agent_keepalive),
+      NULL },
+
+    { ngx_string("passenger_stat_cache_ttl"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(passenger_main_conf_t, stat_cache_ttl),
+      NULL },
+
     { ngx_string("passenger_user_switching"),
       NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
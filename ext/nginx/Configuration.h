@@ -36,7 +36,8 @@ typedef struct {
     ngx_array_t *flushes;
     ngx_array_t *vars_len;
     ngx_array_t *vars;
-    /** Raw SCGI header data for this location is cached here. */
+    /** Raw SCGI header data that is the same for every request to this
+     * location is cached here. See cache_static_headers(). */
     ngx_str_t    options_cache;
     
     #include "ConfigurationFields.h"
@@ -58,6 +59,8 @@ typedef struct {
     ngx_flag_t   abort_on_startup_error;
     ngx_uint_t   max_pool_size;
     ngx_uint_t   pool_idle_time;
+    ngx_uint_t   helper_agent_keepalive;
+    ngx_uint_t   stat_cache_ttl;
     ngx_flag_t   user_switching;
     ngx_str_t    default_user;
     ngx_str_t    default_group;
@@ -99,6 +99,16 @@
 	NULL
 },
 
+{
+	
+	ngx_string("passenger_timing_header"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(passenger_loc_conf_t, timing_header),
+	NULL
+},
+
 {
 	
 	ngx_string("passenger_min_instances"),
@@ -309,6 +319,16 @@
 	NULL
 },
 
+{
+	
+	ngx_string("passenger_request_buffering"),
+	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_FLAG,
+	ngx_conf_set_flag_slot,
+	NGX_HTTP_LOC_CONF_OFFSET,
+	offsetof(passenger_loc_conf_t, request_buffering),
+	NULL
+},
+
 {
 	
 	ngx_string("passenger_buffer_size"),
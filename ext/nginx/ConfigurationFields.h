@@ -59,12 +59,16 @@
 
 	ngx_int_t min_instances;
 
+	ngx_int_t request_buffering;
+
 	ngx_int_t request_queue_overflow_status_code;
 
 	ngx_int_t show_version_in_header;
 
 	ngx_int_t start_timeout;
 
+	ngx_int_t timing_header;
+
 	ngx_array_t *union_station_filters;
 
 	ngx_int_t union_station_support;
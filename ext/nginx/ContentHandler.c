@@ -28,6 +28,7 @@
 #include <nginx.h>
 #include <ngx_http.h>
 #include "ngx_http_passenger_module.h"
+#include "StatCache.h"
 #include "ContentHandler.h"
 #include "StaticContentHandler.h"
 #include "Configuration.h"
@@ -49,6 +50,12 @@ static ngx_int_t process_status_line(ngx_http_request_t *r);
 static ngx_int_t parse_status_line(ngx_http_request_t *r,
     passenger_context_t *context);
 static ngx_int_t process_header(ngx_http_request_t *r);
+#ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+static ngx_int_t input_filter_init(void *data);
+static ngx_int_t chunked_filter(ngx_event_pipe_t *p, ngx_buf_t *buf);
+static ngx_int_t non_buffered_copy_filter(void *data, ssize_t bytes);
+static ngx_int_t non_buffered_chunked_filter(void *data, ssize_t bytes);
+#endif
 static void abort_request(ngx_http_request_t *r);
 static void finalize_request(ngx_http_request_t *r, ngx_int_t rc);
 
@@ -64,6 +71,14 @@ static FileType
 get_file_type(const u_char *filename, unsigned int throttle_rate) {
     struct stat buf;
     int ret;
+    size_t len;
+    ngx_int_t cached;
+    FileType type;
+    
+    len = ngx_strlen(filename);
+    if (passenger_stat_cache_lookup(PSC_FILE_TYPE, filename, len, &cached) == NGX_OK) {
+        return (FileType) cached;
+    }
     
     ret = pp_cached_file_stat_perform(pp_stat_cache,
                                       (const char *) filename,
@@ -71,15 +86,18 @@ get_file_type(const u_char *filename, unsigned int throttle_rate) {
                                       throttle_rate);
     if (ret == 0) {
         if (S_ISREG(buf.st_mode)) {
-            return FT_FILE;
+            type = FT_FILE;
         } else if (S_ISDIR(buf.st_mode)) {
-            return FT_DIRECTORY;
+            type = FT_DIRECTORY;
         } else {
-            return FT_OTHER;
+            type = FT_OTHER;
         }
     } else {
-        return FT_ERROR;
+        type = FT_ERROR;
     }
+    
+    passenger_stat_cache_store(PSC_FILE_TYPE, filename, len, type, 0);
+    return type;
 }
 
 static int
@@ -87,6 +105,137 @@ file_exists(const u_char *filename, unsigned int throttle_rate) {
     return get_file_type(filename, throttle_rate) == FT_FILE;
 }
 
+/**
+ * Returns the modification time of the tmp/restart.txt of the application
+ * in the given directory, or 0 if it doesn't exist. `relative_path`
+ * is appended to `dir` to form the filename.
+ */
+static time_t
+get_restart_mtime(ngx_http_request_t *r, const ngx_str_t *dir, const char *relative_path)
+{
+    u_char      *path, *end;
+    size_t       len;
+    struct stat  buf;
+    
+    len = dir->len + strlen(relative_path) + 1;
+    path = ngx_pnalloc(r->pool, len);
+    if (path == NULL) {
+        return 0;
+    }
+    end = ngx_copy(path, dir->data, dir->len);
+    end = ngx_copy(end, relative_path, strlen(relative_path) + 1);
+    
+    if (stat((const char *) path, &buf) == 0) {
+        return buf.st_mtime;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Detects the type of the application that serves this request. Results
+ * are cached in the shared stat cache, keyed by the directory that was
+ * checked. Errors are not cached.
+ */
+static PassengerAppType
+detect_app_type(ngx_http_request_t *r, passenger_loc_conf_t *slcf,
+                passenger_context_t *context, PP_Error *error)
+{
+    const ngx_str_t  *dir;
+    u_char           *key, *end;
+    ngx_int_t         cached;
+    PassengerAppType  app_type;
+    
+    if (slcf->app_root.data == NULL) {
+        dir = &context->public_dir;
+    } else {
+        dir = &slcf->app_root;
+    }
+    
+    /* The key is the directory, followed by a NUL and a byte that
+     * indicates how the directory is to be checked.
+     */
+    key = ngx_pnalloc(r->pool, dir->len + 2);
+    if (key == NULL) {
+        return PAT_ERROR;
+    }
+    end = ngx_copy(key, dir->data, dir->len);
+    *end++ = '\0';
+    if (slcf->app_root.data != NULL) {
+        *end++ = 'a';
+    } else if (context->base_uri.len != 0) {
+        *end++ = 'b';
+    } else {
+        *end++ = 'd';
+    }
+    
+    if (passenger_stat_cache_lookup(PSC_APP_TYPE, key, end - key, &cached) == NGX_OK) {
+        return (PassengerAppType) cached;
+    }
+    
+    if (slcf->app_root.data == NULL) {
+        app_type = pp_app_type_detector_check_document_root(
+            pp_app_type_detector,
+            (const char *) context->public_dir.data, context->public_dir.len,
+            context->base_uri.len != 0,
+            error);
+    } else {
+        app_type = pp_app_type_detector_check_app_root(
+            pp_app_type_detector,
+            (const char *) slcf->app_root.data, slcf->app_root.len,
+            error);
+    }
+    
+    if (app_type != PAT_ERROR) {
+        passenger_stat_cache_store(PSC_APP_TYPE, key, end - key, app_type,
+            get_restart_mtime(r, dir, (slcf->app_root.data == NULL)
+                ? "/../tmp/restart.txt"
+                : "/tmp/restart.txt"));
+    }
+    return app_type;
+}
+
+/**
+ * Checks the pool status table for whether the request queue of the
+ * application group that this request belongs to is full. The group name
+ * is determined the same way the HelperAgent does it, except that the
+ * document root's symlink isn't resolved; a mismatch merely means that the
+ * request isn't fast-failed.
+ */
+static int
+request_queue_full(passenger_loc_conf_t *slcf, passenger_context_t *context)
+{
+    const u_char *name, *end;
+    
+    if (pp_pool_status_table == NULL) {
+        return 0;
+    } else if (slcf->app_group_name.data != NULL) {
+        return pp_pool_status_table_queue_full(pp_pool_status_table,
+            (const char *) slcf->app_group_name.data, slcf->app_group_name.len);
+    } else if (slcf->app_root.data != NULL) {
+        return pp_pool_status_table_queue_full(pp_pool_status_table,
+            (const char *) slcf->app_root.data, slcf->app_root.len);
+    }
+    
+    /* The application root is the public directory's parent directory. */
+    name = context->public_dir.data;
+    end  = name + context->public_dir.len;
+    while (end > name && end[-1] == '/') {
+        end--;
+    }
+    while (end > name && end[-1] != '/') {
+        end--;
+    }
+    while (end > name + 1 && end[-1] == '/') {
+        end--;
+    }
+    if (end == name) {
+        return 0;
+    }
+    return pp_pool_status_table_queue_full(pp_pool_status_table,
+        (const char *) name, end - name);
+}
+
 static int
 mapped_filename_equals(const u_char *filename, size_t filename_len, ngx_str_t *str)
 {
@@ -245,12 +394,18 @@ fix_peer_address(ngx_http_request_t *r) {
     const char                       *request_socket_filename;
     unsigned int                      request_socket_filename_len;
 
-    if (r->upstream->peer.get != ngx_http_upstream_get_round_robin_peer) {
-        /* This function only supports the round-robin upstream method. */
-        return;
+    rrp = NULL;
+    #ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+        rrp = passenger_helper_agent_rr_peer_data(&r->upstream->peer);
+    #endif
+    if (rrp == NULL) {
+        if (r->upstream->peer.get != ngx_http_upstream_get_round_robin_peer) {
+            /* This function only supports the round-robin upstream method. */
+            return;
+        }
+        rrp = r->upstream->peer.data;
     }
 
-    rrp        = r->upstream->peer.data;
     peers      = rrp->peers;
     request_socket_filename =
         pp_agents_starter_get_request_socket_filename(pp_agents_starter,
@@ -313,16 +468,16 @@ create_request(ngx_http_request_t *r)
     const char *                   helper_agent_request_socket_password_data;
     unsigned int                   helper_agent_request_socket_password_len;
     u_char                         buf[sizeof("4294967296") + 1];
-    size_t                         len, size, key_len, val_len;
+    size_t                         len, head_len, tail_len, key_len, val_len;
     const u_char                  *app_type_string;
     size_t                         app_type_string_len;
     int                            server_name_len;
     ngx_str_t                      escaped_uri;
-    ngx_str_t                     *union_station_filters = NULL;
     void                          *tmp;
     ngx_uint_t                     i, n;
-    ngx_buf_t                     *b;
-    ngx_chain_t                   *cl, *body;
+    ngx_buf_t                     *b, *head_buf, *tail_buf;
+    ngx_chain_t                   *cl, *head, *body;
+    ngx_flag_t                     keepalive = 0;
     ngx_list_part_t               *part;
     ngx_table_elt_t               *header;
     ngx_http_script_code_pt        code;
@@ -358,6 +513,12 @@ create_request(ngx_http_request_t *r)
 
     /**************************************************
      * Determine the request header length.
+     *
+     * The header consists of three parts: the headers that
+     * depend on the request and precede the static headers, the
+     * static headers in options_cache, which are the same for
+     * every request to this location and are sent by reference,
+     * and the CGI variables and HTTP headers that follow them.
      **************************************************/
     
     len = 0;
@@ -411,29 +572,29 @@ create_request(ngx_http_request_t *r)
         }
     #endif
     
-    /* Lengths of Passenger application pool options. */
-    len += slcf->options_cache.len;
+    #ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+        /* The helper agent can only keep the connection open if it can find
+         * the end of the request body without relying on EOF.
+         */
+        keepalive = passenger_helper_agent_keepalive_enabled()
+            && slcf->upstream_config.pass_request_body
+            && (r->headers_in.content_length_n >= 0
+                || r->headers_in.transfer_encoding == NULL);
+        if (keepalive) {
+            len += sizeof("PASSENGER_FRONTEND_KEEPALIVE") + sizeof("true");
+        }
+    #endif
 
     len += sizeof("PASSENGER_APP_TYPE") + app_type_string_len;
 
-    if (slcf->union_station_filters != NGX_CONF_UNSET_PTR && slcf->union_station_filters->nelts > 0) {
-        len += sizeof("UNION_STATION_FILTERS");
-        
-        union_station_filters = (ngx_str_t *) slcf->union_station_filters->elts;
-        for (i = 0; i < slcf->union_station_filters->nelts; i++) {
-            if (i != 0) {
-                len++;
-            }
-            len += union_station_filters[i].len;
-        }
-        len++;
-    }
+    head_len = len;
+    len = 0;
 
 
     /***********************/
     /***********************/
 
-    /* Lengths of various CGI variables. */
+    /* Lengths of CGI variables that aren't in options_cache. */
     if (slcf->vars_len) {
         ngx_memzero(&le, sizeof(ngx_http_script_engine_t));
 
@@ -488,13 +649,41 @@ create_request(ngx_http_request_t *r)
     helper_agent_request_socket_password_data =
         pp_agents_starter_get_request_socket_password(pp_agents_starter,
             &helper_agent_request_socket_password_len);
-    size = helper_agent_request_socket_password_len +
-        /* netstring length + ":" + trailing "," */
-        /* note: 10 == sizeof("4294967296") - 1 */
-        len + 10 + 1 + 1;
+    /* The connect password lives in its own buffer so that it can be
+     * skipped when reusing a connection. See UpstreamKeepalive.c.
+     */
+    context->password_link = NULL;
+    if (helper_agent_request_socket_password_len > 0) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->memory = 1;
+        b->start = b->pos = (u_char *) helper_agent_request_socket_password_data;
+        b->end = b->last = b->start + helper_agent_request_socket_password_len;
+
+        context->password_link = ngx_alloc_chain_link(r->pool);
+        if (context->password_link == NULL) {
+            return NGX_ERROR;
+        }
 
-    b = ngx_create_temp_buf(r->pool, size);
-    if (b == NULL) {
+        context->password_link->buf = b;
+    }
+
+    tail_len = len;
+    len = head_len + slcf->options_cache.len + tail_len;
+
+    /* netstring length + ":" */
+    /* note: 10 == sizeof("4294967296") - 1 */
+    head_buf = ngx_create_temp_buf(r->pool, head_len + 10 + 1);
+    if (head_buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* trailing "," */
+    tail_buf = ngx_create_temp_buf(r->pool, tail_len + 1);
+    if (tail_buf == NULL) {
         return NGX_ERROR;
     }
 
@@ -503,12 +692,44 @@ create_request(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    cl->buf = b;
+    cl->buf = head_buf;
+    if (context->password_link != NULL) {
+        context->password_link->next = cl;
+        head = context->password_link;
+    } else {
+        head = cl;
+    }
+
+    /* The static headers are shared by all requests to this location. */
+    if (slcf->options_cache.len > 0) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->memory = 1;
+        b->start = b->pos = slcf->options_cache.data;
+        b->end = b->last = b->start + slcf->options_cache.len;
+
+        cl->next = ngx_alloc_chain_link(r->pool);
+        if (cl->next == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl = cl->next;
+        cl->buf = b;
+    }
+
+    cl->next = ngx_alloc_chain_link(r->pool);
+    if (cl->next == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl = cl->next;
+    cl->buf = tail_buf;
     
     /* Build SCGI header netstring length part. */
-    b->last = ngx_copy(b->last, helper_agent_request_socket_password_data,
-                       helper_agent_request_socket_password_len);
-
+    b = head_buf;
     b->last = ngx_snprintf(b->last, 10, "%ui", len);
     *b->last++ = (u_char) ':';
 
@@ -584,27 +805,19 @@ create_request(ngx_http_request_t *r)
     #endif
     
 
-    /* Build Passenger application pool option headers. */
-    b->last = ngx_copy(b->last, slcf->options_cache.data, slcf->options_cache.len);
-
     b->last = ngx_copy(b->last, "PASSENGER_APP_TYPE",
                        sizeof("PASSENGER_APP_TYPE"));
     b->last = ngx_copy(b->last, app_type_string, app_type_string_len);
 
-    if (slcf->union_station_filters != NGX_CONF_UNSET_PTR && slcf->union_station_filters->nelts > 0) {
-        b->last = ngx_copy(b->last, "UNION_STATION_FILTERS",
-                           sizeof("UNION_STATION_FILTERS"));
-        
-        for (i = 0; i < slcf->union_station_filters->nelts; i++) {
-            if (i != 0) {
-                b->last = ngx_copy(b->last, "\1", 1);
-            }
-            b->last = ngx_copy(b->last, union_station_filters[i].data,
-                               union_station_filters[i].len);
-        }
-        b->last = ngx_copy(b->last, "\0", 1);
+    if (keepalive) {
+        b->last = ngx_copy(b->last, "PASSENGER_FRONTEND_KEEPALIVE",
+                           sizeof("PASSENGER_FRONTEND_KEEPALIVE"));
+        b->last = ngx_copy(b->last, "true", sizeof("true"));
     }
 
+    /* Build the CGI variables and HTTP headers that follow options_cache. */
+    b = tail_buf;
+
     /***********************/
     /***********************/
 
@@ -681,10 +894,17 @@ create_request(ngx_http_request_t *r)
     
     *b->last++ = (u_char) ',';
 
+#if (nginx_version >= 1007011)
+    if (r->request_body_no_buffering) {
+        /* The upstream module sends the body as it arrives. */
+        r->upstream->request_bufs = head;
+
+    } else
+#endif
     if (slcf->upstream_config.pass_request_body) {
 
         body = r->upstream->request_bufs;
-        r->upstream->request_bufs = cl;
+        r->upstream->request_bufs = head;
 
         while (body) {
             b = ngx_alloc_buf(r->pool);
@@ -708,7 +928,7 @@ create_request(ngx_http_request_t *r)
         b->flush = 1;
 
     } else {
-        r->upstream->request_bufs = cl;
+        r->upstream->request_bufs = head;
     }
 
 
@@ -733,6 +953,11 @@ reinit_request(ngx_http_request_t *r)
     context->status_count = 0;
     context->status_start = NULL;
     context->status_end = NULL;
+    #ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+        context->chunked.state = 0;
+        r->upstream->pipe->input_filter = ngx_event_pipe_copy_input_filter;
+        r->upstream->input_filter = non_buffered_copy_filter;
+    #endif
 
     r->upstream->process_header = process_status_line;
     r->state = 0;
@@ -1196,6 +1421,293 @@ process_header(ngx_http_request_t *r)
 }
 
 
+#ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+
+/*
+ * The helper agent frames response bodies with chunked transfer encoding
+ * if the request carried PASSENGER_FRONTEND_KEEPALIVE, and then keeps the
+ * connection open after the last chunk. The following filters are modeled
+ * after those in ngx_http_proxy_module. Upon encountering the last chunk
+ * they mark the connection as reusable for UpstreamKeepalive.c. Responses
+ * without chunked framing are read until EOF.
+ */
+
+static ngx_int_t
+input_filter_init(void *data)
+{
+    ngx_http_request_t   *r = data;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    if (u->headers_in.chunked) {
+        u->pipe->input_filter = chunked_filter;
+        u->pipe->length = 3; /* "0" LF LF */
+
+        u->input_filter = non_buffered_chunked_filter;
+        u->length = 1;
+
+    } else {
+        u->pipe->length = -1;
+        u->length = -1;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+chunked_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
+{
+    ngx_int_t             rc;
+    ngx_buf_t            *b, **prev;
+    ngx_chain_t          *cl;
+    ngx_http_request_t   *r;
+    passenger_context_t  *context;
+
+    if (buf->pos == buf->last) {
+        return NGX_OK;
+    }
+
+    r = p->input_ctx;
+    context = ngx_http_get_module_ctx(r, ngx_http_passenger_module);
+
+    b = NULL;
+    prev = &buf->shadow;
+
+    for ( ;; ) {
+
+        rc = ngx_http_parse_chunked(r, buf, &context->chunked);
+
+        if (rc == NGX_OK) {
+
+            /* a chunk has been parsed successfully */
+
+            if (p->free) {
+                cl = p->free;
+                b = cl->buf;
+                p->free = cl->next;
+                ngx_free_chain(p->pool, cl);
+
+            } else {
+                b = ngx_alloc_buf(p->pool);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            ngx_memzero(b, sizeof(ngx_buf_t));
+
+            b->pos = buf->pos;
+            b->start = buf->start;
+            b->end = buf->end;
+            b->tag = p->tag;
+            b->temporary = 1;
+            b->recycled = 1;
+
+            *prev = b;
+            prev = &b->shadow;
+
+            cl = ngx_alloc_chain_link(p->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = b;
+            cl->next = NULL;
+
+            if (p->in) {
+                *p->last_in = cl;
+            } else {
+                p->in = cl;
+            }
+            p->last_in = &cl->next;
+
+            /* STUB */ b->num = buf->num;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                           "input buf #%d %p", b->num, b->pos);
+
+            if (buf->last - buf->pos >= context->chunked.size) {
+                buf->pos += context->chunked.size;
+                b->last = buf->pos;
+                context->chunked.size = 0;
+
+            } else {
+                context->chunked.size -= buf->last - buf->pos;
+                buf->pos = buf->last;
+                b->last = buf->last;
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            /* a whole response has been parsed successfully */
+
+            p->upstream_done = 1;
+            r->upstream->keepalive = 1;
+
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+
+            /* set p->length, minimal amount of data we want to see */
+
+            p->length = context->chunked.length;
+
+            break;
+        }
+
+        /* invalid response */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Phusion Passenger helper agent sent invalid chunked response");
+
+        return NGX_ERROR;
+    }
+
+    if (b) {
+        b->shadow = buf;
+        b->last_shadow = 1;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "input buf %p %z", b->pos, b->last - b->pos);
+
+        return NGX_OK;
+    }
+
+    /* there is no data record in the buf, add it to free chain */
+
+    if (ngx_event_pipe_add_free_buf(p, buf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+non_buffered_copy_filter(void *data, ssize_t bytes)
+{
+    ngx_http_request_t   *r = data;
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    *ll = cl;
+
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+
+    b = &u->buffer;
+
+    cl->buf->pos = b->last;
+    b->last += bytes;
+    cl->buf->last = b->last;
+    cl->buf->tag = u->output.tag;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+non_buffered_chunked_filter(void *data, ssize_t bytes)
+{
+    ngx_http_request_t   *r = data;
+    ngx_int_t             rc;
+    ngx_buf_t            *b, *buf;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_upstream_t  *u;
+    passenger_context_t  *context;
+
+    context = ngx_http_get_module_ctx(r, ngx_http_passenger_module);
+    u = r->upstream;
+    buf = &u->buffer;
+
+    buf->pos = buf->last;
+    buf->last += bytes;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    for ( ;; ) {
+
+        rc = ngx_http_parse_chunked(r, buf, &context->chunked);
+
+        if (rc == NGX_OK) {
+
+            /* a chunk has been parsed successfully */
+
+            cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            *ll = cl;
+            ll = &cl->next;
+
+            b = cl->buf;
+
+            b->flush = 1;
+            b->memory = 1;
+
+            b->pos = buf->pos;
+            b->tag = u->output.tag;
+
+            if (buf->last - buf->pos >= context->chunked.size) {
+                buf->pos += context->chunked.size;
+                b->last = buf->pos;
+                context->chunked.size = 0;
+
+            } else {
+                context->chunked.size -= buf->last - buf->pos;
+                buf->pos = buf->last;
+                b->last = buf->last;
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            /* a whole response has been parsed successfully */
+
+            u->keepalive = 1;
+            u->length = 0;
+
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        /* invalid response */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Phusion Passenger helper agent sent invalid chunked response");
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif /* PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED */
+
+
 static void
 abort_request(ngx_http_request_t *r)
 {
@@ -1314,18 +1826,7 @@ passenger_content_handler(ngx_http_request_t *r)
     
     if (slcf->app_type.data == NULL) {
         pp_error_init(&error);
-        if (slcf->app_root.data == NULL) {
-            context->app_type = pp_app_type_detector_check_document_root(
-                pp_app_type_detector,
-                (const char *) context->public_dir.data, context->public_dir.len,
-                context->base_uri.len != 0,
-                &error);
-        } else {
-            context->app_type = pp_app_type_detector_check_app_root(
-                pp_app_type_detector,
-                (const char *) slcf->app_root.data, slcf->app_root.len,
-                &error);
-        }
+        context->app_type = detect_app_type(r, slcf, context, &error);
         if (context->app_type == PAT_NONE) {
             return NGX_DECLINED;
         } else if (context->app_type == PAT_ERROR) {
@@ -1356,6 +1857,14 @@ passenger_content_handler(ngx_http_request_t *r)
         }
     }
     
+    if (request_queue_full(slcf, context)) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "Phusion Passenger: the request queue of the application "
+                      "that serves \"%V\" is full; rejecting the request",
+                      &r->uri);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+    
     
     /* Setup upstream stuff and prepare sending the request to the backend. */
     
@@ -1389,6 +1898,26 @@ passenger_content_handler(ngx_http_request_t *r)
     u->pipe->input_filter = ngx_event_pipe_copy_input_filter;
     u->pipe->input_ctx = r;
 
+    #ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+        u->input_filter_init = input_filter_init;
+        u->input_filter = non_buffered_copy_filter;
+        u->input_filter_ctx = r;
+    #endif
+
+#if (nginx_version >= 1007011)
+    /* The helper agent buffers the request body itself, so with
+     * passenger_request_buffering off it's streamed to the helper agent
+     * instead of being buffered twice. Chunked bodies are still read in
+     * full, because the helper agent needs their CONTENT_LENGTH.
+     */
+    if (slcf->request_buffering == 0
+     && slcf->upstream_config.pass_request_body
+     && !r->headers_in.chunked)
+    {
+        r->request_body_no_buffering = 1;
+    }
+#endif
+
     rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
 
     fix_peer_address(r);
@@ -30,6 +30,7 @@
 
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include "UpstreamKeepalive.h"
 #include "common/ApplicationPool2/AppTypes.h"
 
 
@@ -48,6 +49,15 @@ typedef struct {
     
     /** The application's type. */
     PassengerAppType app_type;
+    
+    /** The first link of the request chain, containing the helper agent
+     * connect password. Skipped when reusing an authenticated connection. */
+    ngx_chain_t *password_link;
+    
+    #ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+        /** Parser state for chunked response bodies from the helper agent. */
+        ngx_http_chunked_t chunked;
+    #endif
 } passenger_context_t;
 
 
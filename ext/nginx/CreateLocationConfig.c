@@ -68,6 +68,10 @@
 	
 
 	
+		conf->timing_header = NGX_CONF_UNSET;
+	
+
+	
 		conf->min_instances = NGX_CONF_UNSET;
 	
 
@@ -142,6 +146,10 @@
 	
 
 	
+		conf->request_buffering = NGX_CONF_UNSET;
+	
+
+	
 		conf->spawn_method.data = NULL;
 		conf->spawn_method.len  = 0;
 	
@@ -76,6 +76,12 @@
 	
 
 	
+		ngx_conf_merge_value(conf->timing_header,
+			prev->timing_header,
+			NGX_CONF_UNSET);
+	
+
+	
 		ngx_conf_merge_value(conf->min_instances,
 			prev->min_instances,
 			NGX_CONF_UNSET);
@@ -160,6 +166,12 @@
 	
 
 	
+		ngx_conf_merge_value(conf->request_buffering,
+			prev->request_buffering,
+			NGX_CONF_UNSET);
+	
+
+	
 		ngx_conf_merge_str_value(conf->spawn_method,
 			prev->spawn_method,
 			NULL);
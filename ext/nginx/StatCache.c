@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2014 Phusion
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "StatCache.h"
+#include "ngx_http_passenger_module.h"
+#include "Configuration.h"
+
+
+/* Large enough for roughly 5000 cached paths. */
+#define STAT_CACHE_SIZE (1024 * 1024)
+
+/* Keys are prefixed with a byte indicating their kind. */
+#define MAX_KEY_SIZE (NGX_MAX_PATH + 1)
+
+typedef struct {
+    /* Must be first: the node is stored in an ngx_str_node_t rbtree. */
+    ngx_str_node_t  sn;
+    ngx_queue_t     queue;
+    time_t          expires;
+    ngx_uint_t      generation;
+    ngx_int_t       value;
+    time_t          restart_mtime;
+    u_char          data[1];
+} passenger_stat_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    /* Least recently stored nodes are at the tail. */
+    ngx_queue_t        queue;
+    /* Nodes stored under an older generation are stale. */
+    ngx_uint_t         generation;
+} passenger_stat_cache_shctx_t;
+
+typedef struct {
+    passenger_stat_cache_shctx_t  *sh;
+    ngx_slab_pool_t               *shpool;
+} passenger_stat_cache_ctx_t;
+
+
+static ngx_str_t                   zone_name = ngx_string("passenger_stat_cache");
+/* Set by the master process before forking, so it's valid in every worker. */
+static passenger_stat_cache_ctx_t *cache = NULL;
+
+
+static ngx_int_t
+init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    passenger_stat_cache_ctx_t  *old_ctx = data;
+    passenger_stat_cache_ctx_t  *ctx = shm_zone->data;
+
+    if (old_ctx != NULL) {
+        /* Nginx is reloading its configuration. Reuse the zone, but
+         * don't trust results that were obtained under the old
+         * configuration.
+         */
+        ctx->sh = old_ctx->sh;
+        ctx->shpool = old_ctx->shpool;
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ctx->sh->generation++;
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        cache = ctx;
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(passenger_stat_cache_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&ctx->sh->queue);
+    ctx->sh->generation = 0;
+    ctx->shpool->data = ctx->sh;
+
+    cache = ctx;
+    return NGX_OK;
+}
+
+ngx_int_t
+passenger_stat_cache_init(ngx_conf_t *cf)
+{
+    ngx_shm_zone_t              *shm_zone;
+    passenger_stat_cache_ctx_t  *ctx;
+
+    cache = NULL;
+    if (passenger_main_conf.stat_cache_ttl == 0) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(passenger_stat_cache_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &zone_name, STAT_CACHE_SIZE,
+                                     &ngx_http_passenger_module);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm_zone->init = init_zone;
+    shm_zone->data = ctx;
+    return NGX_OK;
+}
+
+static size_t
+make_key(passenger_stat_cache_kind_t kind, const u_char *key, size_t len,
+         u_char *buf)
+{
+    if (len + 1 > MAX_KEY_SIZE) {
+        return 0;
+    }
+    buf[0] = (u_char) ('0' + kind);
+    ngx_memcpy(buf + 1, key, len);
+    return len + 1;
+}
+
+static void
+free_node(passenger_stat_cache_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+/** Frees up to `n` of the least recently stored nodes, as long as they
+ * are stale or `force` is true. Must be called while holding the lock.
+ */
+static void
+expire_nodes(ngx_uint_t n, ngx_flag_t force)
+{
+    ngx_queue_t                  *q;
+    passenger_stat_cache_node_t  *node;
+    time_t                        now = ngx_time();
+    ngx_uint_t                    i;
+
+    for (i = 0; i < n; i++) {
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        node = ngx_queue_data(q, passenger_stat_cache_node_t, queue);
+        if (!force && node->expires > now
+         && node->generation == cache->sh->generation)
+        {
+            return;
+        }
+
+        free_node(node);
+    }
+}
+
+ngx_int_t
+passenger_stat_cache_lookup(passenger_stat_cache_kind_t kind,
+                            const u_char *key, size_t len,
+                            ngx_int_t *value)
+{
+    u_char                        buf[MAX_KEY_SIZE];
+    ngx_str_t                     str;
+    passenger_stat_cache_node_t  *node;
+    ngx_int_t                     rc = NGX_DECLINED;
+
+    if (cache == NULL) {
+        return NGX_DECLINED;
+    }
+
+    str.data = buf;
+    str.len = make_key(kind, key, len, buf);
+    if (str.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (passenger_stat_cache_node_t *) ngx_str_rbtree_lookup(
+        &cache->sh->rbtree, &str, ngx_crc32_short(str.data, str.len));
+    if (node != NULL
+     && node->expires > ngx_time()
+     && node->generation == cache->sh->generation)
+    {
+        *value = node->value;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+void
+passenger_stat_cache_store(passenger_stat_cache_kind_t kind,
+                           const u_char *key, size_t len,
+                           ngx_int_t value, time_t restart_mtime)
+{
+    u_char                        buf[MAX_KEY_SIZE];
+    ngx_str_t                     str;
+    uint32_t                      hash;
+    passenger_stat_cache_node_t  *node;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    str.data = buf;
+    str.len = make_key(kind, key, len, buf);
+    if (str.len == 0) {
+        return;
+    }
+    hash = ngx_crc32_short(str.data, str.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (passenger_stat_cache_node_t *) ngx_str_rbtree_lookup(
+        &cache->sh->rbtree, &str, hash);
+    if (node != NULL) {
+        if (kind == PSC_APP_TYPE && node->restart_mtime != restart_mtime) {
+            /* The application has been restarted. Files may have been
+             * added or removed by a deployment, so forget everything.
+             */
+            cache->sh->generation++;
+        }
+        ngx_queue_remove(&node->queue);
+
+    } else {
+        expire_nodes(2, 0);
+
+        node = ngx_slab_alloc_locked(cache->shpool,
+            offsetof(passenger_stat_cache_node_t, data) + str.len);
+        if (node == NULL) {
+            /* Make room by evicting the least recently stored nodes. */
+            expire_nodes(16, 1);
+            node = ngx_slab_alloc_locked(cache->shpool,
+                offsetof(passenger_stat_cache_node_t, data) + str.len);
+            if (node == NULL) {
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+                return;
+            }
+        }
+
+        ngx_memcpy(node->data, str.data, str.len);
+        node->sn.node.key = hash;
+        node->sn.str.data = node->data;
+        node->sn.str.len = str.len;
+        ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+    }
+
+    node->expires = ngx_time() + passenger_main_conf.stat_cache_ttl;
+    node->generation = cache->sh->generation;
+    node->value = value;
+    node->restart_mtime = restart_mtime;
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014 Phusion
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PASSENGER_NGINX_STAT_CACHE_H_
+#define _PASSENGER_NGINX_STAT_CACHE_H_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * A cache of file existence checks and app type detection results that is
+ * shared by all Nginx workers through a shared memory zone. Each result is
+ * kept for passenger_stat_cache_ttl seconds, so that the number of stat()
+ * calls that the content handler makes no longer grows with the request
+ * rate. Restarting an application by touching its tmp/restart.txt
+ * invalidates the entire cache once the application's app type entry
+ * is refreshed.
+ */
+
+typedef enum {
+    PSC_FILE_TYPE,
+    PSC_APP_TYPE
+} passenger_stat_cache_kind_t;
+
+/**
+ * Registers the shared memory zone, unless passenger_stat_cache_ttl is 0.
+ * Must be called while the 'http' configuration block is being processed.
+ */
+ngx_int_t passenger_stat_cache_init(ngx_conf_t *cf);
+
+/**
+ * Looks up the result stored for the given key. Returns NGX_OK and stores
+ * the result in `value` if the cache contains a result that hasn't expired.
+ * Returns NGX_DECLINED otherwise.
+ */
+ngx_int_t passenger_stat_cache_lookup(passenger_stat_cache_kind_t kind,
+                                      const u_char *key, size_t len,
+                                      ngx_int_t *value);
+
+/**
+ * Stores a result for the given key. For PSC_APP_TYPE results,
+ * `restart_mtime` is the modification time of the application's
+ * tmp/restart.txt, or 0 if it doesn't exist. If it differs from the one
+ * that was stored with the previous result for the same key, then the
+ * application has been restarted and all cached results are invalidated.
+ */
+void passenger_stat_cache_store(passenger_stat_cache_kind_t kind,
+                                const u_char *key, size_t len,
+                                ngx_int_t value, time_t restart_mtime);
+
+#endif /* _PASSENGER_NGINX_STAT_CACHE_H_ */
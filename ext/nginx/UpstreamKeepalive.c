@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) Maxim Dounin
+ * Copyright (C) Nginx, Inc.
+ * Copyright (C) 2014 Phusion
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+
+#include "UpstreamKeepalive.h"
+
+#ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+
+#include "ngx_http_passenger_module.h"
+#include "ContentHandler.h"
+#include "Configuration.h"
+
+
+typedef struct {
+    ngx_queue_t        queue;
+    ngx_connection_t  *connection;
+} passenger_keepalive_cache_t;
+
+typedef struct {
+    ngx_http_request_t      *request;
+    void                    *data;
+    ngx_event_get_peer_pt    original_get_peer;
+    ngx_event_free_peer_pt   original_free_peer;
+} passenger_keepalive_peer_data_t;
+
+
+static ngx_http_upstream_init_peer_pt original_init_peer = NULL;
+
+/* Nginx workers are single-threaded and the cache is allocated lazily, i.e.
+ * after forking, so each worker has its own cache.
+ */
+static ngx_uint_t  cache_initialized = 0;
+static ngx_queue_t cache;
+static ngx_queue_t free_items;
+
+
+static ngx_int_t init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t get_peer(ngx_peer_connection_t *pc, void *data);
+static void free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static void dummy_handler(ngx_event_t *ev);
+static void close_handler(ngx_event_t *ev);
+static void close_connection(ngx_connection_t *c);
+
+
+int
+passenger_helper_agent_keepalive_enabled(void)
+{
+    return passenger_main_conf.helper_agent_keepalive > 0;
+}
+
+void *
+passenger_helper_agent_rr_peer_data(ngx_peer_connection_t *pc)
+{
+    if (pc->get == get_peer) {
+        return ((passenger_keepalive_peer_data_t *) pc->data)->data;
+    } else {
+        return NULL;
+    }
+}
+
+ngx_int_t
+passenger_init_helper_agent_upstream(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    original_init_peer = us->peer.init;
+    us->peer.init = init_peer;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+init_cache(void)
+{
+    passenger_keepalive_cache_t *items;
+    ngx_uint_t                   i;
+
+    items = ngx_pcalloc(ngx_cycle->pool,
+        sizeof(passenger_keepalive_cache_t) * passenger_main_conf.helper_agent_keepalive);
+    if (items == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&cache);
+    ngx_queue_init(&free_items);
+    for (i = 0; i < passenger_main_conf.helper_agent_keepalive; i++) {
+        ngx_queue_insert_head(&free_items, &items[i].queue);
+    }
+
+    cache_initialized = 1;
+    return NGX_OK;
+}
+
+static ngx_int_t
+init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us)
+{
+    passenger_keepalive_peer_data_t *kp;
+
+    if (original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (!passenger_helper_agent_keepalive_enabled()) {
+        return NGX_OK;
+    }
+
+    if (!cache_initialized && init_cache() != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    kp = ngx_palloc(r->pool, sizeof(passenger_keepalive_peer_data_t));
+    if (kp == NULL) {
+        return NGX_ERROR;
+    }
+
+    kp->request = r;
+    kp->data = r->upstream->peer.data;
+    kp->original_get_peer = r->upstream->peer.get;
+    kp->original_free_peer = r->upstream->peer.free;
+
+    r->upstream->peer.data = kp;
+    r->upstream->peer.get = get_peer;
+    r->upstream->peer.free = free_peer;
+
+    return NGX_OK;
+}
+
+/**
+ * Makes the request start with the connect password if we're about to
+ * connect, or skips the password if we're reusing an authenticated connection.
+ * This is called on every (re)connect attempt, so it must work in both
+ * directions.
+ */
+static void
+set_password_sent(ngx_http_request_t *r, int send_password)
+{
+    passenger_context_t *context;
+
+    context = ngx_http_get_module_ctx(r, ngx_http_passenger_module);
+    if (context == NULL || context->password_link == NULL) {
+        return;
+    }
+
+    if (send_password) {
+        r->upstream->request_bufs = context->password_link;
+    } else {
+        r->upstream->request_bufs = context->password_link->next;
+    }
+}
+
+static ngx_int_t
+get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    passenger_keepalive_peer_data_t *kp = data;
+    passenger_keepalive_cache_t     *item;
+    ngx_int_t                        rc;
+    ngx_queue_t                     *q;
+    ngx_connection_t                *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get keepalive Passenger helper agent peer");
+
+    /* Ask the balancer; there's only one helper agent address. */
+
+    rc = kp->original_get_peer(pc, kp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_queue_empty(&cache)) {
+        set_password_sent(kp->request, 1);
+        return NGX_OK;
+    }
+
+    q = ngx_queue_head(&cache);
+    item = ngx_queue_data(q, passenger_keepalive_cache_t, queue);
+    c = item->connection;
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&free_items, q);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get keepalive Passenger helper agent peer: using connection %p", c);
+
+    c->idle = 0;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+    c->pool->log = pc->log;
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    set_password_sent(kp->request, 0);
+
+    return NGX_DONE;
+}
+
+static void
+free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state)
+{
+    passenger_keepalive_peer_data_t *kp = data;
+    passenger_keepalive_cache_t     *item;
+    ngx_queue_t                     *q;
+    ngx_connection_t                *c;
+    ngx_http_upstream_t             *u;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free keepalive Passenger helper agent peer");
+
+    /* Cache valid connections. */
+
+    u = kp->request->upstream;
+    c = pc->connection;
+
+    if (state & NGX_PEER_FAILED
+        || c == NULL
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout)
+    {
+        goto invalid;
+    }
+
+    if (!u->keepalive) {
+        goto invalid;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free keepalive Passenger helper agent peer: saving connection %p", c);
+
+    if (ngx_queue_empty(&free_items)) {
+        q = ngx_queue_last(&cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, passenger_keepalive_cache_t, queue);
+        close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&free_items);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, passenger_keepalive_cache_t, queue);
+    }
+
+    item->connection = c;
+    ngx_queue_insert_head(&cache, q);
+
+    pc->connection = NULL;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = dummy_handler;
+    c->read->handler = close_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool->log = ngx_cycle->log;
+
+    if (c->read->ready) {
+        close_handler(c->read);
+    }
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+static void
+dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive Passenger helper agent dummy handler");
+}
+
+/**
+ * Called when an idle connection becomes readable. The helper agent never
+ * sends anything unsolicited, so this means that it closed the connection,
+ * e.g. because it was restarted.
+ */
+static void
+close_handler(ngx_event_t *ev)
+{
+    passenger_keepalive_cache_t *item;
+    int                          n;
+    char                         buf[1];
+    ngx_connection_t            *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive Passenger helper agent close handler");
+
+    c = ev->data;
+
+    if (c->close) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        /* stale event */
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+
+    close_connection(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&free_items, &item->queue);
+}
+
+static void
+close_connection(ngx_connection_t *c)
+{
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+
+#endif /* PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED */
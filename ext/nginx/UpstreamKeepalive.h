@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) Maxim Dounin
+ * Copyright (C) Nginx, Inc.
+ * Copyright (C) 2014 Phusion
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+
+#ifndef _PASSENGER_NGINX_UPSTREAM_KEEPALIVE_H_
+#define _PASSENGER_NGINX_UPSTREAM_KEEPALIVE_H_
+
+#include <nginx.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * A per-worker cache of idle connections to the helper agent, modeled after
+ * ngx_http_upstream_keepalive_module. The helper agent only keeps
+ * a connection open after a response if the request carried the
+ * PASSENGER_FRONTEND_KEEPALIVE header, and it then sends the response body
+ * with chunked framing. Connections that have been reused have already been
+ * authenticated, so the connect password is not sent again.
+ *
+ * Requires u->keepalive and ngx_http_parse_chunked(), i.e. Nginx >= 1.1.4.
+ */
+#if (nginx_version >= 1001004)
+    #define PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+#endif
+
+#ifdef PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED
+
+/**
+ * Upstream initialization function for the helper agent upstream. Initializes
+ * round-robin balancing and hooks the connection cache into it.
+ */
+ngx_int_t passenger_init_helper_agent_upstream(ngx_conf_t *cf,
+                                               ngx_http_upstream_srv_conf_t *us);
+
+/**
+ * Whether connections to the helper agent should be kept alive, i.e. whether
+ * passenger_helper_agent_keepalive is larger than 0.
+ */
+int passenger_helper_agent_keepalive_enabled(void);
+
+/**
+ * Returns the round-robin peer data that the connection cache wraps, or NULL
+ * if the given peer connection doesn't use the connection cache.
+ */
+void *passenger_helper_agent_rr_peer_data(ngx_peer_connection_t *pc);
+
+#endif /* PASSENGER_HELPER_AGENT_KEEPALIVE_SUPPORTED */
+
+#endif /* _PASSENGER_NGINX_UPSTREAM_KEEPALIVE_H_ */
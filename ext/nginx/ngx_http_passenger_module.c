@@ -55,6 +55,7 @@ ngx_str_t                 pp_placeholder_upstream_address;
 PP_CachedFileStat        *pp_stat_cache;
 PP_AppTypeDetector       *pp_app_type_detector;
 PP_AgentsStarter         *pp_agents_starter = NULL;
+PP_PoolStatusTable       *pp_pool_status_table = NULL;
 ngx_cycle_t              *pp_current_cycle;
 
 
@@ -254,6 +255,7 @@ start_helper_server(ngx_cycle_t *cycle) {
     u_char  filename[NGX_MAX_PATH], *last;
     char   *passenger_root = NULL;
     char   *error_message = NULL;
+    PP_Error error;
     
     core_conf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
     result    = NGX_OK;
@@ -350,6 +352,19 @@ start_helper_server(ngx_cycle_t *cycle) {
         result = NGX_ERROR;
         goto cleanup;
     }
+
+    /* Map the pool status table before forking the workers, so that they
+     * inherit the mapping. Requests are simply not fast-failed if this fails.
+     */
+    pp_error_init(&error);
+    pp_pool_status_table = pp_pool_status_table_open(
+        pp_agents_starter_get_generation_dir(pp_agents_starter), &error);
+    if (pp_pool_status_table == NULL) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+            "Cannot open the Phusion Passenger pool status table: %s",
+            error.message);
+    }
+    pp_error_destroy(&error);
     
 cleanup:
     pp_variant_map_free(params);
@@ -374,6 +389,10 @@ cleanup:
  */
 static void
 shutdown_helper_server() {
+    if (pp_pool_status_table != NULL) {
+        pp_pool_status_table_close(pp_pool_status_table);
+        pp_pool_status_table = NULL;
+    }
     if (pp_agents_starter != NULL) {
         pp_agents_starter_free(pp_agents_starter);
         pp_agents_starter = NULL;
@@ -32,6 +32,7 @@
 #include <ngx_core.h>
 #include "common/AgentsStarter.h"
 #include "common/ApplicationPool2/AppTypes.h"
+#include "common/ApplicationPool2/PoolStatusTable.h"
 #include "common/Utils/CachedFileStat.h"
 
 /**
@@ -59,6 +60,9 @@ extern PP_AppTypeDetector       *pp_app_type_detector;
 
 extern PP_AgentsStarter         *pp_agents_starter;
 
+/** Tells which application groups' request queues are full. May be NULL. */
+extern PP_PoolStatusTable       *pp_pool_status_table;
+
 extern ngx_cycle_t              *pp_current_cycle;
 
 #endif /* _PASSENGER_NGINX_MODULE_H_ */
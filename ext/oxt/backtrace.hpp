@@ -122,6 +122,18 @@
  * <h2>Compilation options</h2>
  * Define OXT_DISABLE_BACKTRACES to disable backtrace support. The backtrace
  * functions as provided by this header will become empty stubs.
+ *
+ * Define OXT_SAMPLED_BACKTRACES to make trace points cheap enough for
+ * production builds. Each thread then records its trace points in a
+ * fixed-size array, and creating or destroying a trace point only writes
+ * to that array: it takes no lock and allocates nothing. In return,
+ * oxt::thread::backtrace() and oxt::thread::all_backtraces() read other
+ * threads' arrays without synchronizing with them, so the backtraces they
+ * return are a best-effort sample which may be slightly out of date.
+ * Trace points nested deeper than OXT_SAMPLED_BACKTRACE_DEPTH (default 64)
+ * are counted but not recorded, and the data of TRACE_POINT_WITH_DATA() is
+ * truncated in sampled backtraces. This option must be defined identically
+ * in all compilation units.
  */
 
 #if defined(NDEBUG) || defined(OXT_DISABLE_BACKTRACES)
@@ -31,6 +31,10 @@
 
 namespace oxt {
 
+#ifdef OXT_SAMPLED_BACKTRACES
+	struct thread_local_context;
+#endif
+
 /**
  * A single point in a backtrace. Creating this object will cause it
  * to push itself to the thread's backtrace list. This backtrace list
@@ -48,6 +52,10 @@ struct trace_point {
 	const char *data;
 	unsigned short line;
 	bool m_detached;
+	#ifdef OXT_SAMPLED_BACKTRACES
+		thread_local_context *m_context;
+		unsigned int m_depth;
+	#endif
 	
 	trace_point(const char *function, const char *source, unsigned short line,
 		const char *data = 0);
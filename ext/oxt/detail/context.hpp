@@ -35,12 +35,37 @@
 	#include <sys/types.h>
 #endif
 #include "../spin_lock.hpp"
+#ifdef OXT_SAMPLED_BACKTRACES
+	#include <boost/atomic.hpp>
+#endif
 
 namespace oxt {
 
 
 struct thread_local_context;
 
+#ifdef OXT_SAMPLED_BACKTRACES
+	#ifndef OXT_SAMPLED_BACKTRACE_DEPTH
+		#define OXT_SAMPLED_BACKTRACE_DEPTH 64
+	#endif
+	#define OXT_SAMPLED_BACKTRACE_DATA_SIZE 48
+
+	struct trace_point;
+
+	/**
+	 * A copy of a trace point's information that other threads can read
+	 * at any time, even after the trace point itself has been destroyed.
+	 */
+	struct backtrace_slot {
+		/** Only valid for the owning thread. */
+		trace_point *point;
+		const char *function;
+		const char *source;
+		unsigned short line;
+		char data[OXT_SAMPLED_BACKTRACE_DATA_SIZE];
+	};
+#endif
+
 typedef boost::shared_ptr<thread_local_context> thread_local_context_ptr;
 
 struct global_context_t {
@@ -71,7 +96,13 @@ struct thread_local_context {
 	 */
 	spin_lock syscall_interruption_lock;
 
-	#ifdef OXT_BACKTRACE_IS_ENABLED
+	#if defined(OXT_BACKTRACE_IS_ENABLED) && defined(OXT_SAMPLED_BACKTRACES)
+		/** The number of live trace points, including those that didn't fit
+		 * in backtrace_slots. Only modified by the owning thread.
+		 */
+		boost::atomic<unsigned int> backtrace_depth;
+		backtrace_slot backtrace_slots[OXT_SAMPLED_BACKTRACE_DEPTH];
+	#elif defined(OXT_BACKTRACE_IS_ENABLED)
 		std::vector<trace_point *> backtrace_list;
 		spin_lock backtrace_lock;
 	#endif
@@ -32,6 +32,7 @@
 #include "thread.hpp"
 #include "spin_lock.hpp"
 #include "detail/context.hpp"
+#include <algorithm>
 #ifdef __linux__
 	#include <sys/syscall.h>
 #endif
@@ -131,6 +132,97 @@ static global_context_t *global_context = NULL;
 
 #ifdef OXT_BACKTRACE_IS_ENABLED
 
+#ifdef OXT_SAMPLED_BACKTRACES
+
+static void
+fill_backtrace_slot(backtrace_slot *slot, trace_point *p) {
+	slot->point = p;
+	slot->function = p->function;
+	slot->source = p->source;
+	slot->line = p->line;
+	if (p->data == NULL) {
+		slot->data[0] = '\0';
+	} else {
+		strncpy(slot->data, p->data, sizeof(slot->data) - 1);
+		slot->data[sizeof(slot->data) - 1] = '\0';
+	}
+}
+
+trace_point::trace_point(const char *_function, const char *_source, unsigned short _line,
+	const char *_data)
+	: function(_function),
+	  source(_source),
+	  data(_data),
+	  line(_line),
+	  m_detached(false)
+{
+	m_context = get_thread_local_context();
+	if (OXT_LIKELY(m_context != NULL)) {
+		// Only this thread modifies the depth, so a plain load suffices.
+		// The release store publishes the slot to threads that sample it.
+		m_depth = m_context->backtrace_depth.load(boost::memory_order_relaxed);
+		if (OXT_LIKELY(m_depth < OXT_SAMPLED_BACKTRACE_DEPTH)) {
+			fill_backtrace_slot(&m_context->backtrace_slots[m_depth], this);
+		}
+		m_context->backtrace_depth.store(m_depth + 1, boost::memory_order_release);
+	} else {
+		m_detached = true;
+	}
+}
+
+trace_point::trace_point(const char *_function, const char *_source, unsigned short _line,
+	const char *_data, const detached &detached_tag)
+	: function(_function),
+	  source(_source),
+	  data(_data),
+	  line(_line),
+	  m_detached(true),
+	  m_context(NULL)
+{ }
+
+trace_point::~trace_point() {
+	if (OXT_LIKELY(!m_detached)) {
+		assert(m_context->backtrace_depth.load(boost::memory_order_relaxed) == m_depth + 1);
+		m_context->backtrace_depth.store(m_depth, boost::memory_order_release);
+	}
+}
+
+void
+trace_point::update(const char *source, unsigned short line) {
+	this->source = source;
+	this->line = line;
+	if (OXT_LIKELY(!m_detached && m_depth < OXT_SAMPLED_BACKTRACE_DEPTH)) {
+		backtrace_slot *slot = &m_context->backtrace_slots[m_depth];
+		slot->source = source;
+		slot->line = line;
+	}
+}
+
+
+tracable_exception::tracable_exception() {
+	thread_local_context *ctx = get_thread_local_context();
+	if (OXT_LIKELY(ctx != NULL)) {
+		unsigned int i, depth = ctx->backtrace_depth.load(boost::memory_order_relaxed);
+		if (depth > OXT_SAMPLED_BACKTRACE_DEPTH) {
+			depth = OXT_SAMPLED_BACKTRACE_DEPTH;
+		}
+		
+		backtrace_copy.reserve(depth);
+		for (i = 0; i < depth; i++) {
+			const trace_point *point = ctx->backtrace_slots[i].point;
+			trace_point *p = new trace_point(
+				point->function,
+				point->source,
+				point->line,
+				point->data,
+				trace_point::detached());
+			backtrace_copy.push_back(p);
+		}
+	}
+}
+
+#else /* OXT_SAMPLED_BACKTRACES */
+
 trace_point::trace_point(const char *_function, const char *_source, unsigned short _line,
 	const char *_data)
 	: function(_function),
@@ -194,6 +286,8 @@ tracable_exception::tracable_exception() {
 	}
 }
 
+#endif /* OXT_SAMPLED_BACKTRACES */
+
 tracable_exception::tracable_exception(const tracable_exception &other)
 	: std::exception()
 {
@@ -255,6 +349,43 @@ format_backtrace(const Collection &backtrace_list) {
 	}
 }
 
+#ifdef OXT_SAMPLED_BACKTRACES
+/**
+ * Formats the backtrace of the given thread without synchronizing with it.
+ * The slots may be overwritten while we copy them, but they only ever
+ * contain string literals and null-terminated data buffers, so the worst
+ * that can happen is that the result is slightly out of date.
+ */
+static string
+format_sampled_backtrace(const thread_local_context *ctx) {
+	unsigned int depth = ctx->backtrace_depth.load(boost::memory_order_acquire);
+	unsigned int i, recorded = std::min<unsigned int>(depth, OXT_SAMPLED_BACKTRACE_DEPTH);
+	vector<backtrace_slot> slots(ctx->backtrace_slots, ctx->backtrace_slots + recorded);
+	vector<trace_point> points;
+	vector<const trace_point *> backtrace_list;
+	
+	points.reserve(recorded);
+	backtrace_list.reserve(recorded);
+	for (i = 0; i < recorded; i++) {
+		backtrace_slot &slot = slots[i];
+		slot.data[sizeof(slot.data) - 1] = '\0';
+		points.push_back(trace_point(slot.function, slot.source, slot.line,
+			(slot.data[0] == '\0') ? NULL : slot.data,
+			trace_point::detached()));
+		backtrace_list.push_back(&points.back());
+	}
+	
+	if (depth > recorded) {
+		stringstream result;
+		result << "     (" << (depth - recorded) << " deeper trace points not recorded)" << endl;
+		result << format_backtrace(backtrace_list);
+		return result.str();
+	} else {
+		return format_backtrace(backtrace_list);
+	}
+}
+#endif
+
 string
 tracable_exception::backtrace() const throw() {
 	return format_backtrace< vector<trace_point *> >(backtrace_copy);
@@ -305,7 +436,9 @@ thread_local_context::thread_local_context()
 		tid = syscall(SYS_gettid);
 	#endif
 	syscall_interruption_lock.lock();
-	#ifdef OXT_BACKTRACE_IS_ENABLED
+	#if defined(OXT_BACKTRACE_IS_ENABLED) && defined(OXT_SAMPLED_BACKTRACES)
+		backtrace_depth.store(0, boost::memory_order_relaxed);
+	#elif defined(OXT_BACKTRACE_IS_ENABLED)
 		backtrace_list.reserve(50);
 	#endif
 }
@@ -372,7 +505,9 @@ thread::name() const throw() {
 
 std::string
 thread::backtrace() const throw() {
-	#ifdef OXT_BACKTRACE_IS_ENABLED
+	#if defined(OXT_BACKTRACE_IS_ENABLED) && defined(OXT_SAMPLED_BACKTRACES)
+		return format_sampled_backtrace(context.get());
+	#elif defined(OXT_BACKTRACE_IS_ENABLED)
 		spin_lock::scoped_lock l(context->backtrace_lock);
 		return format_backtrace(context->backtrace_list);
 	#else
@@ -400,8 +535,12 @@ thread::all_backtraces() throw() {
 				#endif
 				result << "):" << endl;
 				
-				spin_lock::scoped_lock l(ctx->backtrace_lock);
-				std::string bt = format_backtrace(ctx->backtrace_list);
+				#ifdef OXT_SAMPLED_BACKTRACES
+					std::string bt = format_sampled_backtrace(ctx.get());
+				#else
+					spin_lock::scoped_lock l(ctx->backtrace_lock);
+					std::string bt = format_backtrace(ctx->backtrace_list);
+				#endif
 				result << bt;
 				if (bt.empty() || bt[bt.size() - 1] != '\n') {
 					result << endl;
@@ -417,6 +556,47 @@ thread::all_backtraces() throw() {
 	#endif
 }
 
+unsigned int
+thread::sample_current_thread(char *name, unsigned int name_size,
+	const char **functions, unsigned int max_functions) throw()
+{
+	thread_local_context *ctx = get_thread_local_context();
+	unsigned int count = 0;
+
+	if (name_size > 0) {
+		name[0] = '\0';
+	}
+	if (ctx == NULL) {
+		return 0;
+	}
+	if (name_size > 0) {
+		strncpy(name, ctx->thread_name.c_str(), name_size - 1);
+		name[name_size - 1] = '\0';
+	}
+
+	#if defined(OXT_BACKTRACE_IS_ENABLED) && defined(OXT_SAMPLED_BACKTRACES)
+		unsigned int depth = ctx->backtrace_depth.load(boost::memory_order_acquire);
+		if (depth > OXT_SAMPLED_BACKTRACE_DEPTH) {
+			depth = OXT_SAMPLED_BACKTRACE_DEPTH;
+		}
+		while (count < depth && count < max_functions) {
+			functions[count] = ctx->backtrace_slots[count].function;
+			count++;
+		}
+	#elif defined(OXT_BACKTRACE_IS_ENABLED)
+		// The interrupted code may hold this lock, so we must not wait for it.
+		if (ctx->backtrace_lock.try_lock()) {
+			unsigned int depth = ctx->backtrace_list.size();
+			while (count < depth && count < max_functions) {
+				functions[count] = ctx->backtrace_list[count]->function;
+				count++;
+			}
+			ctx->backtrace_lock.unlock();
+		}
+	#endif
+	return count;
+}
+
 void
 thread::interrupt(bool interruptSyscalls) {
 	int ret;
@@ -115,8 +115,34 @@ shouldSimulateFailure() {
  * Passenger::syscalls
  *************************************/
 
+/*
+ * Whether a system call may skip the interruption machinery below. That is
+ * the case when the calling thread has disabled system call interruption
+ * and no failures are being simulated, which is true for the event loop
+ * threads. Such a thread keeps its syscall_interruption_lock locked during
+ * the call, so oxt::thread::interrupt() won't send it signals that it
+ * would ignore anyway.
+ */
+static inline bool
+canSkipInterruptionChecks() {
+	if (nErrorChances > 0) {
+		return false;
+	}
+	#ifdef OXT_THREAD_LOCAL_KEYWORD_SUPPORTED
+		return !this_thread::_syscalls_interruptable;
+	#else
+		return !this_thread::syscalls_interruptable();
+	#endif
+}
+
 #define CHECK_INTERRUPTION(error_expression, allowSimulatingFailure, error_assignment, code) \
 	do { \
+		if (OXT_LIKELY(canSkipInterruptionChecks())) { \
+			do { \
+				code; \
+			} while ((error_expression) && errno == EINTR); \
+			break; \
+		} \
 		if (allowSimulatingFailure && shouldSimulateFailure()) { \
 			error_assignment; \
 			break; \
@@ -139,6 +139,21 @@ public:
 	 * main thread, in a nicely formatted string.
 	 */
 	static std::string all_backtraces() throw();
+
+	/**
+	 * Copies the calling thread's name into <em>name</em>, truncated to
+	 * <em>name_size</em> bytes including the terminating null, and the
+	 * function names of its trace points, outermost first, into
+	 * <em>functions</em>. Returns the number of function names copied.
+	 *
+	 * Unlike the other backtrace functions, this one is async-signal-safe,
+	 * so that a sampling profiler can call it from a signal handler that
+	 * interrupted the thread. If the interrupted code was in the middle of
+	 * modifying its trace points then no function names are copied.
+	 * The function names are string literals, so they stay valid forever.
+	 */
+	static unsigned int sample_current_thread(char *name, unsigned int name_size,
+		const char **functions, unsigned int max_functions) throw();
 	
 	/**
 	 * Interrupt the thread. This method behaves just like
@@ -42,6 +42,9 @@
 #include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -87,6 +90,9 @@
 static VALUE mPassenger;
 static VALUE mNativeSupport;
 static VALUE S_ProcessTimes;
+/* Frozen versions of the strings in well_known_header_names, in the same order. */
+static VALUE well_known_headers;
+static VALUE rack_hijack_key;
 #ifdef HAVE_KQUEUE
 	static VALUE cFileSystemWatcher;
 #endif
@@ -139,6 +145,106 @@ split_by_null_into_hash(VALUE self, VALUE data) {
 	return result;
 }
 
+/* SCGI header names that appear in most requests. Their Rack env keys
+ * are shared between all requests instead of being allocated every time.
+ */
+static const char * const well_known_header_names[] = {
+	"REQUEST_METHOD",
+	"REQUEST_URI",
+	"QUERY_STRING",
+	"SCRIPT_NAME",
+	"PATH_INFO",
+	"SERVER_NAME",
+	"SERVER_PORT",
+	"SERVER_PROTOCOL",
+	"SERVER_SOFTWARE",
+	"REMOTE_ADDR",
+	"REMOTE_PORT",
+	"DOCUMENT_ROOT",
+	"CONTENT_LENGTH",
+	"CONTENT_TYPE",
+	"HTTPS",
+	"HTTP_HOST",
+	"HTTP_USER_AGENT",
+	"HTTP_ACCEPT",
+	"HTTP_ACCEPT_CHARSET",
+	"HTTP_ACCEPT_ENCODING",
+	"HTTP_ACCEPT_LANGUAGE",
+	"HTTP_CACHE_CONTROL",
+	"HTTP_CONNECTION",
+	"HTTP_COOKIE",
+	"HTTP_IF_MODIFIED_SINCE",
+	"HTTP_IF_NONE_MATCH",
+	"HTTP_PRAGMA",
+	"HTTP_REFERER",
+	"HTTP_TRANSFER_ENCODING",
+	"HTTP_VERSION",
+	"HTTP_X_FORWARDED_FOR",
+	"HTTP_X_FORWARDED_PROTO",
+	"HTTP_X_REQUESTED_WITH",
+	"PASSENGER_CONNECT_PASSWORD",
+	"PASSENGER_TXN_ID",
+	"PASSENGER_UNION_STATION_KEY",
+	NULL
+};
+
+static VALUE
+get_header_key(const char *name, long len) {
+	unsigned int i;
+	const char *candidate;
+	VALUE key;
+	
+	for (i = 0; well_known_header_names[i] != NULL; i++) {
+		candidate = well_known_header_names[i];
+		if (candidate[0] == name[0]
+		 && (long) strlen(candidate) == len
+		 && memcmp(candidate, name, len) == 0)
+		{
+			return rb_ary_entry(well_known_headers, i);
+		}
+	}
+	
+	/* Hash#[]= would otherwise make a frozen copy of the key. */
+	key = rb_str_new(name, len);
+	rb_obj_freeze(key);
+	return key;
+}
+
+/*
+ * call-seq: parse_scgi_headers_into_env(data, template)
+ *
+ * Parses the given SCGI header data, which consists of null-terminated keys
+ * and values, into a Rack env. The env starts out as a copy of +template+,
+ * which contains the env entries that are the same for every request.
+ * Well-known header names are turned into shared, frozen key strings.
+ */
+static VALUE
+parse_scgi_headers_into_env(VALUE self, VALUE data, VALUE template) {
+	const char *cdata   = RSTRING_PTR(data);
+	unsigned long len   = RSTRING_LEN(data);
+	const char *current = cdata;
+	const char *end     = cdata + len;
+	const char *key_end, *value_end;
+	VALUE result;
+	
+	result = rb_obj_dup(template);
+	while (current < end) {
+		key_end = memchr(current, '\0', end - current);
+		if (key_end == NULL) {
+			break;
+		}
+		value_end = memchr(key_end + 1, '\0', end - key_end - 1);
+		if (value_end == NULL) {
+			break;
+		}
+		rb_hash_aset(result,
+			get_header_key(current, key_end - current),
+			rb_str_substr(data, key_end + 1 - cdata, value_end - key_end - 1));
+		current = value_end + 1;
+	}
+	return result;
+}
+
 typedef struct {
 	/* The IO vectors in this group. */
 	struct iovec *io_vectors;
@@ -392,6 +498,644 @@ f_writev3(VALUE self, VALUE fd, VALUE components1, VALUE components2, VALUE comp
 	return f_generic_writev(fd, array_of_components, 3);
 }
 
+/* Bodies smaller than this are copied into the response buffer, so that
+ * many small body chunks don't result in many small I/O vectors.
+ */
+#define RACK_RESPONSE_COALESCE_THRESHOLD 4096
+#define RACK_RESPONSE_SENDFILE_CHUNK     (1024 * 1024)
+
+typedef struct {
+	/* If base is NULL then this vector refers to the response buffer,
+	 * starting at offset. We can't store a pointer into the buffer until
+	 * we're done appending to it because appending may reallocate it.
+	 */
+	const char *base;
+	long offset;
+	long len;
+} RackResponseVector;
+
+typedef struct {
+	int fd_num;
+	VALUE buffer;
+	VALUE headers;
+	VALUE body;
+	const char *status_line;
+	long status_len;
+	RackResponseVector *vectors;
+	unsigned int count;
+	unsigned int capacity;
+	/* The file that a body that responds to #to_path refers to, or -1. */
+	int file_fd;
+} RackResponseState;
+
+static void
+rack_response_append(RackResponseState *state, const char *data, long len, int copy) {
+	RackResponseVector *last = (state->count > 0) ? &state->vectors[state->count - 1] : NULL;
+	
+	if (len == 0) {
+		return;
+	}
+	if (copy && last != NULL && last->base == NULL) {
+		/* The last vector refers to the end of the buffer; extend it. */
+		rb_str_cat(state->buffer, data, len);
+		last->len += len;
+		return;
+	}
+	
+	if (state->count == state->capacity) {
+		state->capacity *= 2;
+		REALLOC_N(state->vectors, RackResponseVector, state->capacity);
+	}
+	last = &state->vectors[state->count];
+	state->count++;
+	if (copy) {
+		last->base   = NULL;
+		last->offset = RSTRING_LEN(state->buffer);
+		rb_str_cat(state->buffer, data, len);
+	} else {
+		last->base   = data;
+		last->offset = 0;
+	}
+	last->len = len;
+}
+
+static void
+rack_response_append_header_line(RackResponseState *state, VALUE key,
+	const char *value, long value_len)
+{
+	rack_response_append(state, RSTRING_PTR(key), RSTRING_LEN(key), 1);
+	rack_response_append(state, ": ", 2, 1);
+	rack_response_append(state, value, value_len, 1);
+	rack_response_append(state, "\r\n", 2, 1);
+}
+
+static int
+rack_response_append_header(VALUE key, VALUE values, VALUE arg) {
+	RackResponseState *state = (RackResponseState *) arg;
+	const char *data, *current, *end, *newline;
+	long i;
+	VALUE value;
+	
+	key = rb_obj_as_string(key);
+	if (TYPE(values) == T_STRING) {
+		/* Multiple values are separated by newlines. */
+		data    = RSTRING_PTR(values);
+		current = data;
+		end     = data + RSTRING_LEN(values);
+		while (current < end) {
+			newline = memchr(current, '\n', end - current);
+			if (newline == NULL) {
+				newline = end;
+			}
+			rack_response_append_header_line(state, key, current, newline - current);
+			current = newline + 1;
+		}
+	} else if (rb_str_equal(key, rack_hijack_key) == Qtrue) {
+		/* Not a header. */
+	} else if (TYPE(values) == T_ARRAY) {
+		for (i = 0; i < RARRAY_LEN(values); i++) {
+			value = rb_obj_as_string(rb_ary_entry(values, i));
+			rack_response_append_header_line(state, key,
+				RSTRING_PTR(value), RSTRING_LEN(value));
+		}
+	} else {
+		value = rb_obj_as_string(values);
+		rack_response_append_header_line(state, key,
+			RSTRING_PTR(value), RSTRING_LEN(value));
+	}
+	return ST_CONTINUE;
+}
+
+/* Writes the given vectors, at most IOV_MAX at a time, and waits until all
+ * data has been written.
+ */
+static void
+write_rack_response_vectors(int fd_num, RackResponseState *state) {
+	struct iovec *io_vectors;
+	IOVectorGroup group;
+	unsigned int i, j, count;
+	ssize_t ret;
+	int e;
+	#ifndef TRAP_BEG
+		WritevWrapperData writev_wrapper_data;
+	#endif
+	
+	io_vectors = ALLOCA_N(struct iovec, MIN(state->count, IOV_MAX));
+	for (i = 0; i < state->count; i += count) {
+		count = MIN(state->count - i, IOV_MAX);
+		group.io_vectors = io_vectors;
+		group.count      = count;
+		group.total_size = 0;
+		for (j = 0; j < count; j++) {
+			RackResponseVector *vec = &state->vectors[i + j];
+			if (vec->base == NULL) {
+				io_vectors[j].iov_base = RSTRING_PTR(state->buffer) + vec->offset;
+			} else {
+				io_vectors[j].iov_base = (char *) vec->base;
+			}
+			io_vectors[j].iov_len = vec->len;
+			group.total_size += vec->len;
+		}
+		
+		rb_thread_fd_writable(fd_num);
+		while (group.total_size > 0) {
+			#ifdef TRAP_BEG
+				TRAP_BEG;
+				ret = writev(fd_num, group.io_vectors, group.count);
+				TRAP_END;
+			#else
+				writev_wrapper_data.filedes = fd_num;
+				writev_wrapper_data.iov     = group.io_vectors;
+				writev_wrapper_data.iovcnt  = group.count;
+				#ifdef HAVE_RB_THREAD_IO_BLOCKING_REGION
+					ret = (ssize_t) rb_thread_io_blocking_region(writev_wrapper,
+						&writev_wrapper_data, fd_num);
+				#else
+					ret = (ssize_t) rb_thread_blocking_region(writev_wrapper,
+						&writev_wrapper_data, RUBY_UBF_IO, 0);
+				#endif
+			#endif
+			if (ret == -1) {
+				if (!rb_io_wait_writable(fd_num)) {
+					rb_sys_fail("writev()");
+				}
+			} else if (ret < group.total_size) {
+				e = errno;
+				update_group_written_info(&group, ret);
+				errno = e;
+				rb_io_wait_writable(fd_num);
+			} else {
+				group.total_size = 0;
+			}
+		}
+	}
+}
+
+#ifdef __linux__
+	typedef struct {
+		int out_fd;
+		int in_fd;
+		off_t *offset;
+		size_t count;
+	} SendfileWrapperData;
+	
+	static VALUE
+	sendfile_wrapper(void *ptr) {
+		SendfileWrapperData *data = (SendfileWrapperData *) ptr;
+		return (VALUE) sendfile(data->out_fd, data->in_fd, data->offset, data->count);
+	}
+#endif
+
+/* Writes the given file to fd_num. Stops early if the file is truncated
+ * in the mean time.
+ */
+static void
+write_rack_response_file(int fd_num, int file_fd, off_t size, RackResponseState *state) {
+	off_t offset = 0;
+	ssize_t ret;
+	
+	#ifdef __linux__
+		SendfileWrapperData data;
+		
+		data.out_fd = fd_num;
+		data.in_fd  = file_fd;
+		data.offset = &offset;
+		while (offset < size) {
+			rb_thread_fd_writable(fd_num);
+			data.count = (size_t) MIN(size - offset, RACK_RESPONSE_SENDFILE_CHUNK);
+			#ifdef HAVE_RB_THREAD_IO_BLOCKING_REGION
+				ret = (ssize_t) rb_thread_io_blocking_region(sendfile_wrapper, &data, fd_num);
+			#else
+				ret = (ssize_t) rb_thread_blocking_region(sendfile_wrapper, &data,
+					RUBY_UBF_IO, 0);
+			#endif
+			if (ret == -1) {
+				if (!rb_io_wait_writable(fd_num)) {
+					rb_sys_fail("sendfile()");
+				}
+			} else if (ret == 0) {
+				/* The file has been truncated. */
+				return;
+			}
+		}
+	#else
+		char *buf = ALLOCA_N(char, RACK_RESPONSE_COALESCE_THRESHOLD * 4);
+		
+		while (offset < size) {
+			ret = pread(file_fd, buf, RACK_RESPONSE_COALESCE_THRESHOLD * 4, offset);
+			if (ret == -1) {
+				if (errno != EINTR) {
+					rb_sys_fail("pread()");
+				}
+			} else if (ret == 0) {
+				return;
+			} else {
+				state->count = 0;
+				rb_str_resize(state->buffer, 0);
+				rack_response_append(state, buf, ret, 1);
+				write_rack_response_vectors(fd_num, state);
+				offset += ret;
+			}
+		}
+	#endif
+}
+
+static VALUE
+write_rack_response_body(VALUE arg) {
+	RackResponseState *state = (RackResponseState *) arg;
+	VALUE body = state->body;
+	VALUE chunk, path;
+	struct stat buf;
+	long i;
+	
+	if (TYPE(body) == T_STRING) {
+		rack_response_append(state, RSTRING_PTR(body), RSTRING_LEN(body),
+			RSTRING_LEN(body) < RACK_RESPONSE_COALESCE_THRESHOLD);
+		write_rack_response_vectors(state->fd_num, state);
+		return Qtrue;
+		
+	} else if (TYPE(body) == T_ARRAY) {
+		/* The body may be an ActionController::StringCoercion::UglyBody
+		 * object instead of a real Array, even when #is_a? claims so.
+		 * Call #to_a just to be sure.
+		 */
+		if (rb_obj_class(body) != rb_cArray) {
+			body = rb_funcall(body, rb_intern("to_a"), 0);
+			Check_Type(body, T_ARRAY);
+			state->body = body;
+		}
+		for (i = 0; i < RARRAY_LEN(body); i++) {
+			chunk = rb_ary_entry(body, i);
+			if (TYPE(chunk) == T_STRING) {
+				rack_response_append(state, RSTRING_PTR(chunk), RSTRING_LEN(chunk),
+					RSTRING_LEN(chunk) < RACK_RESPONSE_COALESCE_THRESHOLD);
+			} else {
+				/* Nothing else references the converted string, so copy it. */
+				chunk = rb_obj_as_string(chunk);
+				rack_response_append(state, RSTRING_PTR(chunk), RSTRING_LEN(chunk), 1);
+			}
+		}
+		write_rack_response_vectors(state->fd_num, state);
+		return Qtrue;
+		
+	} else if (rb_respond_to(body, rb_intern("to_path"))) {
+		path = rb_obj_as_string(rb_funcall(body, rb_intern("to_path"), 0));
+		do {
+			state->file_fd = open(StringValueCStr(path), O_RDONLY);
+		} while (state->file_fd == -1 && errno == EINTR);
+		if (state->file_fd != -1
+		 && (fstat(state->file_fd, &buf) == -1 || !S_ISREG(buf.st_mode)))
+		{
+			close(state->file_fd);
+			state->file_fd = -1;
+		}
+		write_rack_response_vectors(state->fd_num, state);
+		if (state->file_fd == -1) {
+			/* Let the caller write the body with #each. */
+			return Qfalse;
+		} else {
+			write_rack_response_file(state->fd_num, state->file_fd, buf.st_size, state);
+			return Qtrue;
+		}
+		
+	} else {
+		write_rack_response_vectors(state->fd_num, state);
+		return Qfalse;
+	}
+}
+
+static VALUE
+write_rack_response_headers_and_body(VALUE arg) {
+	RackResponseState *state = (RackResponseState *) arg;
+	rack_response_append(state, state->status_line, state->status_len, 1);
+	rb_hash_foreach(state->headers, rack_response_append_header, arg);
+	rack_response_append(state, "\r\n", 2, 1);
+	return write_rack_response_body(arg);
+}
+
+static VALUE
+write_rack_response_cleanup(VALUE arg) {
+	RackResponseState *state = (RackResponseState *) arg;
+	xfree(state->vectors);
+	if (state->file_fd != -1) {
+		close(state->file_fd);
+	}
+	return Qnil;
+}
+
+/*
+ * call-seq: write_rack_response(fd, buffer, status, headers, body)
+ *
+ * Writes a Rack response to the given file descriptor in the format that
+ * the HelperAgent expects. The status line and the headers are serialized
+ * into +buffer+, which the caller may reuse between calls. Small String
+ * chunks of an Array body are copied into the same buffer, while large ones
+ * are written directly with +writev()+. A body that responds to +to_path+
+ * is written with +sendfile()+ where possible.
+ *
+ * Returns +true+ if the entire response has been written, or +false+ if
+ * only the status line and the headers have been written and the caller
+ * must still write the body by calling its #each method. Returns +nil+
+ * without writing anything if the response must be handled by the caller,
+ * e.g. because it requests a partial socket hijack.
+ */
+static VALUE
+write_rack_response(VALUE self, VALUE fd, VALUE buffer, VALUE status, VALUE headers, VALUE body) {
+	RackResponseState state;
+	char status_line[sizeof("Status: \r\n") + 32];
+	long status_len;
+	
+	Check_Type(buffer, T_STRING);
+	if (TYPE(headers) != T_HASH || RTEST(rb_hash_lookup(headers, rack_hijack_key))) {
+		return Qnil;
+	}
+	
+	status_len = snprintf(status_line, sizeof(status_line), "Status: %ld\r\n",
+		NUM2LONG(rb_funcall(status, rb_intern("to_i"), 0)));
+	state.fd_num   = NUM2INT(fd);
+	state.buffer   = buffer;
+	state.headers  = headers;
+	state.body     = body;
+	state.status_line = status_line;
+	state.status_len  = status_len;
+	state.count    = 0;
+	state.capacity = 16;
+	state.file_fd  = -1;
+	state.vectors  = ALLOC_N(RackResponseVector, state.capacity);
+	rb_str_resize(buffer, 0);
+	return rb_ensure(write_rack_response_headers_and_body, (VALUE) &state,
+		write_rack_response_cleanup, (VALUE) &state);
+}
+
+#ifdef HAVE_RUBY_IO_H
+/* Native implementations of the MessageChannel reading and writing methods.
+ * See lib/phusion_passenger/message_channel.rb and ext/common/Utils/MessageIO.h
+ * for the wire format. They bypass the IO object's internal buffers, so the
+ * reading functions return false without doing anything if the IO object
+ * has buffered read data, in which case the caller must use the pure Ruby
+ * implementation.
+ */
+
+typedef struct {
+	int filedes;
+	void *buf;
+	size_t count;
+} ReadWrapperData;
+
+static VALUE
+read_wrapper(void *ptr) {
+	ReadWrapperData *data = (ReadWrapperData *) ptr;
+	return (VALUE) read(data->filedes, data->buf, data->count);
+}
+
+/* Reads exactly `size` bytes. Returns 0 if end-of-stream was reached first. */
+static int
+message_channel_read_exact(int fd_num, char *buf, size_t size) {
+	ReadWrapperData data;
+	ssize_t ret;
+	
+	while (size > 0) {
+		rb_thread_wait_fd(fd_num);
+		data.filedes = fd_num;
+		data.buf     = buf;
+		data.count   = size;
+		#ifdef HAVE_RB_THREAD_IO_BLOCKING_REGION
+			ret = (ssize_t) rb_thread_io_blocking_region(read_wrapper, &data, fd_num);
+		#else
+			ret = (ssize_t) rb_thread_blocking_region(read_wrapper, &data, RUBY_UBF_IO, 0);
+		#endif
+		if (ret == -1) {
+			if (errno == ECONNRESET) {
+				return 0;
+			} else if (!rb_io_wait_readable(fd_num)) {
+				rb_sys_fail("read()");
+			}
+		} else if (ret == 0) {
+			return 0;
+		} else {
+			buf  += ret;
+			size -= ret;
+		}
+	}
+	return 1;
+}
+
+static void
+message_channel_write_exact(int fd_num, struct iovec *io_vectors, unsigned int count) {
+	WritevWrapperData data;
+	IOVectorGroup group;
+	unsigned int i;
+	ssize_t ret;
+	
+	group.io_vectors = io_vectors;
+	group.count      = count;
+	group.total_size = 0;
+	for (i = 0; i < count; i++) {
+		group.total_size += io_vectors[i].iov_len;
+	}
+	rb_thread_fd_writable(fd_num);
+	while (group.total_size > 0) {
+		data.filedes = fd_num;
+		data.iov     = group.io_vectors;
+		data.iovcnt  = group.count;
+		#ifdef HAVE_RB_THREAD_IO_BLOCKING_REGION
+			ret = (ssize_t) rb_thread_io_blocking_region(writev_wrapper, &data, fd_num);
+		#else
+			ret = (ssize_t) rb_thread_blocking_region(writev_wrapper, &data, RUBY_UBF_IO, 0);
+		#endif
+		if (ret == -1) {
+			if (!rb_io_wait_writable(fd_num)) {
+				rb_sys_fail("writev()");
+			}
+		} else {
+			update_group_written_info(&group, ret);
+		}
+	}
+}
+
+/* Returns the file descriptor of the given IO object, or -1 if its
+ * internal read buffer contains data.
+ */
+static int
+message_channel_fd(VALUE io, int reading) {
+	rb_io_t *fptr;
+	
+	GetOpenFile(io, fptr);
+	if (reading) {
+		rb_io_check_readable(fptr);
+		if (rb_io_read_pending(fptr)) {
+			return -1;
+		}
+	} else {
+		rb_io_check_writable(fptr);
+		rb_io_flush(io);
+	}
+	return fptr->fd;
+}
+
+/*
+ * call-seq: read_array_message(io)
+ *
+ * Reads an array message from +io+. Returns the message as an array of
+ * strings, nil on end-of-stream, or false if +io+ has buffered read data.
+ */
+static VALUE
+read_array_message(VALUE self, VALUE io) {
+	char header[2];
+	char buf[0xFFFF];
+	unsigned int size;
+	const char *current, *end, *delimiter;
+	VALUE result;
+	int fd_num;
+	
+	fd_num = message_channel_fd(io, 1);
+	if (fd_num == -1) {
+		return Qfalse;
+	}
+	if (!message_channel_read_exact(fd_num, header, 2)) {
+		return Qnil;
+	}
+	size = ((unsigned char) header[0] << 8) | (unsigned char) header[1];
+	if (!message_channel_read_exact(fd_num, buf, size)) {
+		return Qnil;
+	}
+	
+	result  = rb_ary_new();
+	current = buf;
+	end     = buf + size;
+	while (current < end && (delimiter = memchr(current, '\0', end - current)) != NULL) {
+		rb_ary_push(result, rb_str_new(current, delimiter - current));
+		current = delimiter + 1;
+	}
+	return result;
+}
+
+typedef struct {
+	int fd_num;
+	VALUE buffer;
+	size_t size;
+	int ok;
+} ReadScalarState;
+
+static VALUE
+read_scalar_message_body(VALUE arg) {
+	ReadScalarState *state = (ReadScalarState *) arg;
+	state->ok = message_channel_read_exact(state->fd_num,
+		RSTRING_PTR(state->buffer), state->size);
+	return Qnil;
+}
+
+static VALUE
+read_scalar_message_unlock(VALUE buffer) {
+	rb_str_unlocktmp(buffer);
+	return Qnil;
+}
+
+/*
+ * call-seq: read_scalar_message(io, buffer, max_size)
+ *
+ * Reads a scalar message from +io+ into +buffer+, which is also returned.
+ * Returns nil on end-of-stream, or false if +io+ has buffered read data.
+ * Raises SecurityError if the message is larger than +max_size+, unless
+ * +max_size+ is nil.
+ */
+static VALUE
+read_scalar_message(VALUE self, VALUE io, VALUE buffer, VALUE max_size) {
+	unsigned char header[4];
+	ReadScalarState state;
+	
+	Check_Type(buffer, T_STRING);
+	state.fd_num = message_channel_fd(io, 1);
+	if (state.fd_num == -1) {
+		return Qfalse;
+	}
+	if (!message_channel_read_exact(state.fd_num, (char *) header, 4)) {
+		return Qnil;
+	}
+	state.size = ((size_t) header[0] << 24) | ((size_t) header[1] << 16)
+		| ((size_t) header[2] << 8) | (size_t) header[3];
+	if (!NIL_P(max_size) && state.size > NUM2ULONG(max_size)) {
+		rb_raise(rb_eSecurityError, "Scalar message size (%lu) exceeds "
+			"maximum allowed size (%lu).",
+			(unsigned long) state.size, NUM2ULONG(max_size));
+	}
+	
+	rb_str_resize(buffer, state.size);
+	if (state.size > 0) {
+		state.buffer = buffer;
+		rb_str_locktmp(buffer);
+		rb_ensure(read_scalar_message_body, (VALUE) &state,
+			read_scalar_message_unlock, buffer);
+		if (!state.ok) {
+			return Qnil;
+		}
+	}
+	return buffer;
+}
+
+/*
+ * call-seq: write_array_message(io, array)
+ *
+ * Writes the strings in +array+ to +io+ as an array message.
+ * Raises ArgumentError if an element contains a null byte or if the
+ * message is too large.
+ */
+static VALUE
+write_array_message(VALUE self, VALUE io, VALUE array) {
+	char buf[2 + 0xFFFF];
+	struct iovec vec;
+	size_t size = 0;
+	long i, len;
+	VALUE str;
+	
+	Check_Type(array, T_ARRAY);
+	for (i = 0; i < RARRAY_LEN(array); i++) {
+		str = rb_obj_as_string(rb_ary_entry(array, i));
+		len = RSTRING_LEN(str);
+		if (memchr(RSTRING_PTR(str), '\0', len) != NULL) {
+			rb_raise(rb_eArgError, "Message name and arguments may not contain null byte.");
+		}
+		if (size + len + 1 > 0xFFFF) {
+			rb_raise(rb_eArgError, "Message too large.");
+		}
+		memcpy(buf + 2 + size, RSTRING_PTR(str), len);
+		buf[2 + size + len] = '\0';
+		size += len + 1;
+	}
+	buf[0] = (char) (size >> 8);
+	buf[1] = (char) (size & 0xFF);
+	vec.iov_base = buf;
+	vec.iov_len  = size + 2;
+	message_channel_write_exact(message_channel_fd(io, 0), &vec, 1);
+	return Qnil;
+}
+
+/*
+ * call-seq: write_scalar_message(io, data)
+ *
+ * Writes +data+ to +io+ as a scalar message.
+ */
+static VALUE
+write_scalar_message(VALUE self, VALUE io, VALUE data) {
+	unsigned char header[4];
+	struct iovec vecs[2];
+	unsigned long size;
+	
+	Check_Type(data, T_STRING);
+	size = (unsigned long) RSTRING_LEN(data);
+	header[0] = (unsigned char) (size >> 24);
+	header[1] = (unsigned char) (size >> 16);
+	header[2] = (unsigned char) (size >> 8);
+	header[3] = (unsigned char) size;
+	vecs[0].iov_base = header;
+	vecs[0].iov_len  = 4;
+	vecs[1].iov_base = RSTRING_PTR(data);
+	vecs[1].iov_len  = size;
+	message_channel_write_exact(message_channel_fd(io, 0), vecs, 2);
+	return Qnil;
+}
+#endif /* HAVE_RUBY_IO_H */
+
 static VALUE
 process_times(VALUE self) {
 	struct rusage usage;
@@ -862,6 +1606,7 @@ fs_watcher_close(VALUE self) {
 void
 Init_passenger_native_support() {
 	struct sockaddr_un addr;
+	unsigned int i;
 	
 	/* Only defined on Ruby >= 1.9 */
 	#ifdef RUBY_API_VERSION_CODE
@@ -930,11 +1675,28 @@ Init_passenger_native_support() {
 	
 	S_ProcessTimes = rb_struct_define("ProcessTimes", "utime", "stime", NULL);
 	
+	well_known_headers = rb_ary_new();
+	rb_global_variable(&well_known_headers);
+	for (i = 0; well_known_header_names[i] != NULL; i++) {
+		rb_ary_push(well_known_headers, rb_obj_freeze(rb_str_new2(well_known_header_names[i])));
+	}
+	rb_obj_freeze(well_known_headers);
+	rack_hijack_key = rb_obj_freeze(rb_str_new2("rack.hijack"));
+	rb_global_variable(&rack_hijack_key);
+	
 	rb_define_singleton_method(mNativeSupport, "disable_stdio_buffering", disable_stdio_buffering, 0);
 	rb_define_singleton_method(mNativeSupport, "split_by_null_into_hash", split_by_null_into_hash, 1);
+	rb_define_singleton_method(mNativeSupport, "parse_scgi_headers_into_env", parse_scgi_headers_into_env, 2);
 	rb_define_singleton_method(mNativeSupport, "writev", f_writev, 2);
 	rb_define_singleton_method(mNativeSupport, "writev2", f_writev2, 3);
 	rb_define_singleton_method(mNativeSupport, "writev3", f_writev3, 4);
+	rb_define_singleton_method(mNativeSupport, "write_rack_response", write_rack_response, 5);
+	#ifdef HAVE_RUBY_IO_H
+		rb_define_singleton_method(mNativeSupport, "read_array_message", read_array_message, 1);
+		rb_define_singleton_method(mNativeSupport, "read_scalar_message", read_scalar_message, 3);
+		rb_define_singleton_method(mNativeSupport, "write_array_message", write_array_message, 2);
+		rb_define_singleton_method(mNativeSupport, "write_scalar_message", write_scalar_message, 2);
+	#endif
 	rb_define_singleton_method(mNativeSupport, "process_times", process_times, 0);
 	rb_define_singleton_method(mNativeSupport, "detach_process", detach_process, 1);
 	rb_define_singleton_method(mNativeSupport, "freeze_process", freeze_process, 0);
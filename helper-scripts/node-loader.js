@@ -79,6 +79,7 @@ function setupEnvironment(options) {
 	PhusionPassenger.configure = configure;
 	PhusionPassenger._requestHandler = new RequestHandler(loadApplication);
 	PhusionPassenger._appInstalled = false;
+	PhusionPassenger._concurrency = 0;
 	process.title = 'Passenger NodeApp: ' + options.app_root;
 	http.Server.prototype.originalListen = http.Server.prototype.listen;
 	http.Server.prototype.listen = installServer;
@@ -98,10 +99,15 @@ function setupEnvironment(options) {
  *   autoInstall (boolean, default true)
  *     Whether to install the first HttpServer object for which listen() is called,
  *     as the Phusion Passenger request handler.
+ *   concurrency (number, default 0)
+ *     The maximum number of requests that Phusion Passenger may send to this
+ *     process concurrently. 0 means unlimited. Must be set before the
+ *     request handler is installed.
  */
 function configure(_options) {
 	var options = {
-		autoInstall: true
+		autoInstall: true,
+		concurrency: PhusionPassenger._concurrency
 	};
 	for (var key in _options) {
 		options[key] = _options[key];
@@ -110,6 +116,7 @@ function configure(_options) {
     if (!options.autoInstall) {
 		http.Server.prototype.listen = listenAndMaybeInstall;
 	}
+	PhusionPassenger._concurrency = Math.max(parseInt(options.concurrency, 10) || 0, 0);
 }
 
 function loadApplication() {
@@ -180,7 +187,7 @@ function finalizeStartup() {
 	process.stdout.write("!> Ready\n");
 	process.stdout.write("!> socket: main;tcp://127.0.0.1:" +
 		PhusionPassenger._requestHandler.server.address().port +
-		";session;0\n");
+		";session;" + PhusionPassenger._concurrency + "\n");
 	process.stdout.write("!> \n");
 }
 
@@ -22,7 +22,7 @@
 #  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 #  THE SOFTWARE.
 
-import sys, os, re, imp, traceback, socket, select, struct, logging, errno
+import sys, os, re, imp, traceback, socket, select, struct, logging, errno, threading
 
 options = {}
 
@@ -68,10 +68,42 @@ def create_server_socket():
 	s.listen(1000)
 	return (filename, s)
 
-def advertise_sockets(socket_filename):
-	print("!> socket: main;unix:%s;session;1" % socket_filename)
+def advertise_sockets(socket_filename, concurrency = 1):
+	print("!> socket: main;unix:%s;session;%d;keepalive" % (socket_filename, concurrency))
 	print("!> ")
 
+def get_concurrency(app_module):
+	# Apps may set `passenger_concurrency` in passenger_wsgi.py to handle
+	# multiple requests concurrently, each in its own thread.
+	try:
+		return max(int(getattr(app_module, 'passenger_concurrency', 1)), 1)
+	except (TypeError, ValueError):
+		return 1
+
+def start_request_handlers(app_module, owner_pipe):
+	"""
+	Creates the server socket, tells the HelperAgent that we're ready and
+	handles requests until the owner pipe is closed. If the app asks for
+	a concurrency greater than 1, then that many threads handle requests.
+	"""
+	concurrency = get_concurrency(app_module)
+	socket_filename, server_socket = create_server_socket()
+	if concurrency > 1:
+		# All threads select() on the server socket, but only one of them
+		# can accept a given connection.
+		server_socket.setblocking(False)
+	handlers = []
+	for i in range(concurrency):
+		handlers.append(RequestHandler(server_socket, owner_pipe,
+			app_module.application, concurrency > 1))
+	print("!> Ready")
+	advertise_sockets(socket_filename, concurrency)
+	for handler in handlers[1:]:
+		thread = threading.Thread(target = handler.main_loop)
+		thread.daemon = True
+		thread.start()
+	handlers[0].main_loop()
+
 if sys.version_info[0] >= 3:
 	def reraise_exception(exc_info):
 		raise exc_info[0].with_traceback(exc_info[1], exc_info[2])
@@ -92,11 +124,71 @@ else:
 		return s
 
 
+class LimitedInputStream:
+	"""
+	Wraps the input stream of a keep-alive session so that the application
+	cannot read past the end of the request body, since the connection is
+	not closed after the request.
+	"""
+	def __init__(self, stream, length):
+		self.stream = stream
+		self.remaining = length
+
+	def read(self, size = -1):
+		if size is None or size < 0 or size > self.remaining:
+			size = self.remaining
+		if size == 0:
+			return b''
+		data = self.stream.read(size)
+		self.remaining -= len(data)
+		return data
+
+	def readline(self, size = -1):
+		if size is None or size < 0 or size > self.remaining:
+			size = self.remaining
+		if size == 0:
+			return b''
+		data = self.stream.readline(size)
+		self.remaining -= len(data)
+		return data
+
+	def readlines(self, hint = -1):
+		result = []
+		line = self.readline()
+		while line:
+			result.append(line)
+			line = self.readline()
+		return result
+
+	def __iter__(self):
+		return self
+
+	def next(self):
+		line = self.readline()
+		if not line:
+			raise StopIteration
+		return line
+
+	__next__ = next
+
+
 class RequestHandler:
-	def __init__(self, server_socket, owner_pipe, app):
+	# Size of the read buffer of wsgi.input. The SCGI header and the start
+	# of the request body are usually read with a single recv().
+	INPUT_BUFFER_SIZE = 1024 * 64
+	# Response body chunks are coalesced into a single sendall() up to this
+	# size, if the application returned them all at once in a list.
+	OUTPUT_COALESCE_SIZE = 1024 * 16
+
+	def __init__(self, server_socket, owner_pipe, app, multithread = False):
 		self.server = server_socket
 		self.owner_pipe = owner_pipe
 		self.app = app
+		self.multithread = multithread
+		# Connections on which the HelperAgent may send further requests.
+		self.keepalive_clients = []
+		# The buffered input streams of the keep-alive connections.
+		self.input_streams = {}
 	
 	def main_loop(self):
 		done = False
@@ -106,6 +198,7 @@ class RequestHandler:
 				if not client:
 					done = True
 					break
+				keep_alive = False
 				try:
 					try:
 						env, input_stream = self.parse_request(client)
@@ -113,68 +206,97 @@ class RequestHandler:
 							if env['REQUEST_METHOD'] == 'ping':
 								self.process_ping(env, input_stream, client)
 							else:
+								keep_alive = env.get('PASSENGER_KEEPALIVE') == 'true'
 								self.process_request(env, input_stream, client)
 					except KeyboardInterrupt:
+						keep_alive = False
 						done = True
 					except IOError:
+						keep_alive = False
 						e = sys.exc_info()[1]
 						if not getattr(e, 'passenger', False) or e.errno != errno.EPIPE:
 							logging.exception("WSGI application raised an I/O exception!")
 					except Exception:
+						keep_alive = False
 						logging.exception("WSGI application raised an exception!")
 				finally:
-					try:
-						# Shutdown the socket like this just in case the app
-						# spawned a child process that keeps it open.
-						client.shutdown(socket.SHUT_WR)
-					except:
-						pass
-					try:
-						client.close()
-					except:
-						pass
+					if keep_alive:
+						self.keepalive_clients.append(client)
+					else:
+						self.close_connection(client)
 		except KeyboardInterrupt:
 			pass
 
+	def close_connection(self, client):
+		input_stream = self.input_streams.pop(client, None)
+		if input_stream is not None:
+			try:
+				input_stream.close()
+			except:
+				pass
+		try:
+			# Shutdown the socket like this just in case the app
+			# spawned a child process that keeps it open.
+			client.shutdown(socket.SHUT_WR)
+		except:
+			pass
+		try:
+			client.close()
+		except:
+			pass
+
 	def accept_connection(self):
-		result = select.select([self.owner_pipe, self.server.fileno()], [], [])[0]
-		if self.server.fileno() in result:
-			return self.server.accept()
-		else:
-			return (None, None)
+		while True:
+			fds = [self.owner_pipe, self.server.fileno()]
+			fds.extend(self.keepalive_clients)
+			result = select.select(fds, [], [])[0]
+			if self.owner_pipe in result:
+				return (None, None)
+			for client in self.keepalive_clients:
+				if client in result:
+					self.keepalive_clients.remove(client)
+					return (client, None)
+			if self.server.fileno() in result:
+				try:
+					client, address = self.server.accept()
+				except socket.error:
+					e = sys.exc_info()[1]
+					if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+						# Another thread accepted the connection.
+						continue
+					raise
+				client.setblocking(True)
+				return (client, address)
 	
 	def parse_request(self, client):
-		buf = b''
-		while len(buf) < 4:
-			tmp = client.recv(4 - len(buf))
-			if len(tmp) == 0:
-				return (None, None)
-			buf += tmp
+		# The header is read through the same buffered stream that the
+		# application reads the request body from, so that reading it
+		# usually takes a single recv().
+		input_stream = self.input_streams.get(client)
+		if input_stream is None:
+			input_stream = self.wrap_input_socket(client)
+			self.input_streams[client] = input_stream
+
+		buf = input_stream.read(4)
+		if len(buf) < 4:
+			return (None, None)
 		header_size = struct.unpack('>I', buf)[0]
+		buf = input_stream.read(header_size)
+		if len(buf) < header_size:
+			return (None, None)
 		
-		buf = b''
-		while len(buf) < header_size:
-			tmp = client.recv(header_size - len(buf))
-			if len(tmp) == 0:
-				return (None, None)
-			buf += tmp
-		
-		headers = buf.split(b"\0")
+		headers = bytes_to_str(buf).split("\0")
 		headers.pop() # Remove trailing "\0"
-		env = {}
-		i = 0
-		while i < len(headers):
-			env[bytes_to_str(headers[i])] = bytes_to_str(headers[i + 1])
-			i += 2
+		env = dict(zip(headers[0::2], headers[1::2]))
 
-		return (env, client)
+		return (env, input_stream)
 	
 	if hasattr(socket, '_fileobject'):
 		def wrap_input_socket(self, sock):
-			return socket._fileobject(sock, 'rb', 512)
+			return socket._fileobject(sock, 'rb', self.INPUT_BUFFER_SIZE)
 	else:
 		def wrap_input_socket(self, sock):
-			return socket.socket.makefile(sock, 'rb', 512)
+			return socket.socket.makefile(sock, 'rb', self.INPUT_BUFFER_SIZE)
 
 	def process_request(self, env, input_stream, output_stream):
 		# The WSGI speculation says that the input parameter object passed needs to
@@ -184,10 +306,17 @@ class RequestHandler:
 		# Otherwise, the POST data won't be correctly retrieved by Django.
 		#
 		# See: http://www.python.org/dev/peps/pep-0333/#input-and-error-streams
-		env['wsgi.input']        = self.wrap_input_socket(input_stream)
+		keep_alive = env.get('PASSENGER_KEEPALIVE') == 'true'
+		env['wsgi.input']        = input_stream
+		if keep_alive:
+			# The HelperAgent frames keep-alive sessions: the request body
+			# is exactly CONTENT_LENGTH bytes and the response must be
+			# sent with chunked transfer encoding.
+			env['wsgi.input'] = LimitedInputStream(input_stream,
+				int(env.get('CONTENT_LENGTH') or 0))
 		env['wsgi.errors']       = sys.stderr
 		env['wsgi.version']      = (1, 0)
-		env['wsgi.multithread']  = False
+		env['wsgi.multithread']  = self.multithread
 		env['wsgi.multiprocess'] = True
 		env['wsgi.run_once']	 = True
 		if env.get('HTTPS','off') in ('on', '1', 'true', 'yes'):
@@ -197,19 +326,28 @@ class RequestHandler:
 
 		headers_set = []
 		headers_sent = []
+		# Whether we frame the response body ourselves with chunked
+		# transfer encoding. Not necessary if the application already did.
+		chunked = []
 		
 		def write(data):
 			try:
 				if not headers_set:
 					raise AssertionError("write() before start_response()")
 				elif not headers_sent:
-					# Before the first output, send the stored headers.
+					# Before the first output, send the stored headers,
+					# together with the first output.
 					status, response_headers = headers_sent[:] = headers_set
-					output_stream.sendall(str_to_bytes('Status: %s\r\n' % status))
+					out = ['Status: %s\r\n' % status]
 					for header in response_headers:
-						output_stream.sendall(str_to_bytes('%s: %s\r\n' % header))
-					output_stream.sendall(b'\r\n')
-				output_stream.sendall(data)
+						out.append('%s: %s\r\n' % header)
+					if keep_alive and not self.has_chunked_header(response_headers):
+						chunked.append(True)
+						out.append('Transfer-Encoding: chunked\r\n')
+					out.append('\r\n')
+					output_stream.sendall(str_to_bytes(''.join(out)) + frame(data))
+				else:
+					output_stream.sendall(frame(data))
 			except IOError:
 				# Mark this exception as coming from the Phusion Passenger
 				# socket and not some other socket.
@@ -217,6 +355,12 @@ class RequestHandler:
 				setattr(e, 'passenger', True)
 				raise e
 		
+		def frame(data):
+			if chunked and data:
+				return str_to_bytes('%x\r\n' % len(data)) + data + b'\r\n'
+			else:
+				return data
+
 		def start_response(status, response_headers, exc_info = None):
 			if exc_info:
 				try:
@@ -234,17 +378,44 @@ class RequestHandler:
 		
 		result = self.app(env, start_response)
 		try:
-			for data in result:
+			if isinstance(result, (list, tuple)) and len(result) > 1:
+				# The entire body is available right now, so we may send
+				# small chunks together without delaying anything.
+				result_iter = self.coalesce_chunks(result)
+			else:
+				result_iter = result
+			for data in result_iter:
 				# Don't send headers until body appears.
 				if data:
 					write(data)
 			if not headers_sent:
 				# Send headers now if body was empty.
 				write(b'')
+			if chunked:
+				output_stream.sendall(b'0\r\n\r\n')
 		finally:
 			if hasattr(result, 'close'):
 				result.close()
 	
+	def coalesce_chunks(self, chunks):
+		pending = []
+		pending_size = 0
+		for data in chunks:
+			pending.append(data)
+			pending_size += len(data)
+			if pending_size >= self.OUTPUT_COALESCE_SIZE:
+				yield b''.join(pending)
+				pending = []
+				pending_size = 0
+		if pending:
+			yield b''.join(pending)
+
+	def has_chunked_header(self, response_headers):
+		for name, value in response_headers:
+			if name.lower() == 'transfer-encoding' and value.lower() == 'chunked':
+				return True
+		return False
+
 	def process_ping(self, env, input_stream, output_stream):
 		output_stream.sendall(b"pong")
 
@@ -257,8 +428,4 @@ if __name__ == "__main__":
 		logging.captureWarnings(True)
 	handshake_and_read_startup_request()
 	app_module = load_app()
-	socket_filename, server_socket = create_server_socket()
-	handler = RequestHandler(server_socket, sys.stdin, app_module.application)
-	print("!> Ready")
-	advertise_sockets(socket_filename)
-	handler.main_loop()
+	start_request_handlers(app_module, sys.stdin)
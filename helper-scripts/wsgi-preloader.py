@@ -1 +1,147 @@
 #!/usr/bin/env python
+#  Phusion Passenger - https://www.phusionpassenger.com/
+#  Copyright (c) 2014 Phusion
+#
+#  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a copy
+#  of this software and associated documentation files (the "Software"), to deal
+#  in the Software without restriction, including without limitation the rights
+#  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+#  copies of the Software, and to permit persons to whom the Software is
+#  furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+#  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+#  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+#  THE SOFTWARE.
+
+# Loads the WSGI application once and then forks a worker process for every
+# 'spawn' command that the SmartSpawner sends, just like rack-preloader.rb.
+
+import sys, os, imp, socket, select, signal, errno, gc, logging
+
+loader = imp.load_source('passenger_wsgi_loader',
+	os.path.join(os.path.dirname(os.path.abspath(__file__)), 'wsgi-loader.py'))
+
+def reap_children(signum = None, frame = None):
+	try:
+		while True:
+			pid, status = os.waitpid(-1, os.WNOHANG)
+			if pid == 0:
+				break
+	except OSError:
+		pass
+
+def readline_from(f):
+	result = f.readline()
+	if result == "":
+		raise EOFError
+	else:
+		return result
+
+def prepare_heap_for_fork():
+	# Make sure that the children don't modify the memory pages that they
+	# share with us just because the GC touches the objects in them.
+	gc.collect()
+	if hasattr(gc, 'freeze'):
+		gc.freeze()
+
+def accept_and_process_next_client(server_socket):
+	"""
+	Processes a single command from the SmartSpawner. Returns the client
+	socket in the forked child, None in the preloader.
+	"""
+	client, address = server_socket.accept()
+	client_file = client.makefile('r')
+	try:
+		try:
+			command = readline_from(client_file)
+		except EOFError:
+			return None
+		if command != "spawn\n":
+			sys.stderr.write("Unknown command %r\n" % command)
+			return None
+		while readline_from(client_file) != "\n":
+			# Do nothing.
+			pass
+
+		prepare_heap_for_fork()
+		pid = os.fork()
+		if pid == 0:
+			signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+			server_socket.close()
+			client.sendall(loader.str_to_bytes("OK\n%d\n" % os.getpid()))
+			return client
+		else:
+			return None
+	finally:
+		client_file.close()
+		if os.getpid() == preloader_pid:
+			client.close()
+
+def run_main_loop():
+	socket_filename = "%s/backends/preloader.%d" % (loader.options['generation_dir'], os.getpid())
+	server_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	try:
+		os.remove(socket_filename)
+	except OSError:
+		pass
+	server_socket.bind(socket_filename)
+	server_socket.listen(100)
+
+	print("!> Ready")
+	print("!> socket: unix:%s" % socket_filename)
+	print("!> ")
+
+	try:
+		while True:
+			try:
+				ios = select.select([server_socket, sys.stdin], [], [])[0]
+			except select.error:
+				e = sys.exc_info()[1]
+				if e.args[0] == errno.EINTR:
+					continue
+				raise
+			if server_socket in ios:
+				client = accept_and_process_next_client(server_socket)
+				if client is not None:
+					return client
+			if sys.stdin in ios:
+				break
+		return None
+	finally:
+		if os.getpid() == preloader_pid:
+			server_socket.close()
+			try:
+				os.remove(socket_filename)
+			except OSError:
+				pass
+
+def negotiate_spawn_command(client):
+	os.dup2(client.fileno(), 0)
+	os.dup2(client.fileno(), 1)
+	client.close()
+	loader.handshake_and_read_startup_request()
+
+
+if __name__ == "__main__":
+	logging.basicConfig(
+		level = logging.WARNING,
+		format = "[ pid=%(process)d, time=%(asctime)s ]: %(message)s")
+	if hasattr(logging, 'captureWarnings'):
+		logging.captureWarnings(True)
+	preloader_pid = os.getpid()
+	loader.handshake_and_read_startup_request()
+	app_module = loader.load_app()
+	signal.signal(signal.SIGCHLD, reap_children)
+	client = run_main_loop()
+	if client is not None:
+		negotiate_spawn_command(client)
+		loader.start_request_handlers(app_module, sys.stdin)
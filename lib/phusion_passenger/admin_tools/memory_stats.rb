@@ -23,6 +23,7 @@
 
 PhusionPassenger.require_passenger_lib 'platform_info/apache'
 PhusionPassenger.require_passenger_lib 'platform_info/operating_system'
+PhusionPassenger.require_passenger_lib 'admin_tools/server_instance'
 
 module PhusionPassenger
 module AdminTools
@@ -204,6 +205,37 @@ private
 		return PlatformInfo.os_name
 	end
 	
+	# Returns a hash that maps the PIDs of the application processes that
+	# are managed by a running Phusion Passenger instance to their private
+	# dirty RSS in KB. The helper agents measure these periodically anyway, so
+	# asking them is a lot cheaper than parsing /proc/<pid>/smaps ourselves.
+	# Instances that we cannot query, e.g. because we lack the privileges,
+	# are skipped; their processes will be measured by us.
+	def managed_private_dirty_rss
+		@managed_private_dirty_rss ||= begin
+			result = {}
+			ServerInstance.list(:clean_stale_or_corrupted => false).each do |server_instance|
+				begin
+					stats = server_instance.connect(:role => :passenger_status) do |client|
+						client.pool_memory_stats
+					end
+				rescue ServerInstance::RoleDeniedError, SecurityError, EOFError,
+				       IOError, SystemCallError
+					next
+				end
+				next if !stats
+				stats.split("\n").each do |line|
+					pid, ppid, vm_size, private_dirty_rss = line.split("\t", 5)
+					private_dirty_rss = private_dirty_rss.to_i
+					if private_dirty_rss > 0
+						result[pid.to_i] = private_dirty_rss
+					end
+				end
+			end
+			result
+		end
+	end
+	
 	# Returns a list of Process objects that match the given search criteria.
 	#
 	#  # Search by executable path.
@@ -269,7 +301,8 @@ private
 				p.threads = p.threads.to_i if threads_known
 
 				if platform_provides_private_dirty_rss_information?
-					p.private_dirty_rss = determine_private_dirty_rss(p.pid)
+					p.private_dirty_rss = managed_private_dirty_rss[p.pid] ||
+						determine_private_dirty_rss(p.pid)
 				end
 				processes << p
 			end
@@ -71,10 +71,10 @@ class ServerInstance
 	class Process
 		attr_reader :group
 		attr_accessor :pid, :gupid, :sessions, :processed, :uptime, :server_sockets,
-			:has_metrics, :cpu, :rss, :real_memory, :vmsize, :process_group_id, :command,
-			:connect_password
+			:has_metrics, :cpu, :rss, :real_memory, :private_dirty, :shared_memory,
+			:vmsize, :process_group_id, :command, :connect_password
 		INT_PROPERTIES = [:pid, :sessions, :processed, :cpu, :rss, :real_memory,
-				:vmsize, :process_group_id]
+				:private_dirty, :shared_memory, :vmsize, :process_group_id]
 		BOOL_PROPERTIES = [:has_metrics]
 		
 		def initialize(group)
@@ -36,12 +36,23 @@ class AnalyticsLogger
 	include Utils
 	
 	class Log
+		# Buffered messages are sent early once the buffer grows beyond
+		# this many bytes, so that big transactions don't use a lot of memory.
+		MAX_BUFFER_SIZE = 64 * 1024
+		
 		attr_reader :txn_id
 		
-		def initialize(connection = nil, txn_id = nil)
+		# If _buffered_ is true then messages are not sent to the logging agent
+		# right away, but are kept in memory and sent in a single write
+		# together with the 'closeTransaction' command. The logging agent
+		# numbers messages in the order in which they arrive, so this changes
+		# the order of messages from different Log objects for the same
+		# transaction if they have the same timestamp.
+		def initialize(connection = nil, txn_id = nil, buffered = false)
 			if connection
 				@connection = connection
 				@txn_id = txn_id
+				@buffer = new_buffer if buffered
 				connection.ref
 			end
 		end
@@ -56,6 +67,14 @@ class AnalyticsLogger
 				DebugLogging.trace(3, "[Union Station log to null] #{@txn_id} #{timestamp_string} #{text}")
 				return
 			end
+			if @buffer
+				timestamp_string = AnalyticsLogger.timestamp_string
+				DebugLogging.trace(3, "[Union Station log] #{@txn_id} #{timestamp_string} #{text}")
+				append_array_message(@buffer, "log", @txn_id, timestamp_string)
+				append_scalar_message(@buffer, text)
+				flush_buffer if @buffer.bytesize > MAX_BUFFER_SIZE
+				return
+			end
 			@connection.synchronize do
 				return if !@connection.connected?
 				begin
@@ -126,8 +145,14 @@ class AnalyticsLogger
 				return if !@connection.connected?
 				begin
 					# We need an ACK here. See thread_handler.rb finalize_request.
-					@connection.channel.write("closeTransaction", @txn_id,
-						AnalyticsLogger.timestamp_string, true)
+					if @buffer
+						append_array_message(@buffer, "closeTransaction", @txn_id,
+							AnalyticsLogger.timestamp_string, true)
+						write_buffer
+					else
+						@connection.channel.write("closeTransaction", @txn_id,
+							AnalyticsLogger.timestamp_string, true)
+					end
 					result = @connection.channel.read
 					if result != ["ok"]
 						raise "Expected logging agent to respond with 'ok', but got #{result.inspect} instead"
@@ -146,6 +171,7 @@ class AnalyticsLogger
 					@connection.disconnect
 					raise e
 				ensure
+					@buffer = nil
 					@connection.unref
 					@connection = nil
 				end
@@ -167,14 +193,80 @@ class AnalyticsLogger
 			time = AnalyticsLogger.current_time
 			return time.to_i * 1_000_000 + time.usec
 		end
+		
+		# Appends an array message in MessageChannel wire format.
+		def append_array_message(output, *args)
+			message = new_buffer
+			args.each do |arg|
+				message << binary_string(arg.to_s) << MessageChannel::DELIMITER
+			end
+			output << [message.bytesize].pack(MessageChannel::UINT16_PACK_FORMAT) << message
+		end
+		
+		# Appends a scalar message in MessageChannel wire format.
+		def append_scalar_message(output, data)
+			data = binary_string(data)
+			output << [data.bytesize].pack(MessageChannel::UINT32_PACK_FORMAT) << data
+		end
+		
+		if "".respond_to?(:force_encoding)
+			def new_buffer
+				return "".force_encoding(Encoding::BINARY)
+			end
+			
+			def binary_string(str)
+				if str.encoding == Encoding::BINARY
+					return str
+				else
+					return str.dup.force_encoding(Encoding::BINARY)
+				end
+			end
+		else
+			def new_buffer
+				return ""
+			end
+			
+			def binary_string(str)
+				return str
+			end
+		end
+		
+		# Sends the buffered messages in a single write. Must be called
+		# while holding the connection lock.
+		def write_buffer
+			io = @connection.channel.io
+			io.write(@buffer)
+			io.flush
+			@buffer = new_buffer
+		end
+		
+		def flush_buffer
+			@connection.synchronize do
+				if !@connection.connected?
+					@buffer = new_buffer
+					return
+				end
+				begin
+					write_buffer
+				rescue SystemCallError, IOError => e
+					@connection.disconnect
+					DebugLogging.warn("Error communicating with the logging agent: #{e.message}")
+				rescue Exception => e
+					@connection.disconnect
+					raise e
+				end
+			end
+		end
 	end
 	
 	def self.new_from_options(options)
 		if options["analytics"] && options["logging_agent_address"]
-			return new(options["logging_agent_address"],
+			logger = new(options["logging_agent_address"],
 				options["logging_agent_username"],
 				options["logging_agent_password"],
 				options["node_name"])
+			logger.buffered = true
+			return logger
 		else
 			return nil
 		end
@@ -182,6 +274,9 @@ class AnalyticsLogger
 	
 	attr_accessor :max_connect_tries
 	attr_accessor :reconnect_timeout
+	# Whether the Log objects returned by #new_transaction and
+	# #continue_transaction buffer their messages until they're closed.
+	attr_accessor :buffered
 	
 	def initialize(logging_agent_address, username, password, node_name)
 		@server_address = logging_agent_address
@@ -205,6 +300,7 @@ class AnalyticsLogger
 			@max_connect_tries = 1
 		end
 		@reconnect_timeout = 1
+		@buffered = false
 		@next_reconnect_time = Time.utc(1980, 1, 1)
 	end
 	
@@ -271,7 +367,7 @@ class AnalyticsLogger
 					if result != ["ok"]
 						raise "Expected logging server to respond with 'ok', but got #{result.inspect} instead"
 					end
-					return Log.new(@connection, txn_id)
+					return Log.new(@connection, txn_id, @buffered)
 				rescue SystemCallError, IOError
 					@connection.disconnect
 					DebugLogging.warn("The logging agent at #{@server_address}" <<
@@ -322,7 +418,7 @@ class AnalyticsLogger
 						AnalyticsLogger.timestamp_string,
 						union_station_key,
 						true)
-					return Log.new(@connection, txn_id)
+					return Log.new(@connection, txn_id, @buffered)
 				rescue SystemCallError, IOError
 					@connection.disconnect
 					DebugLogging.warn("The logging agent at #{@server_address}" <<
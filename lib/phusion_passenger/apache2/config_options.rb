@@ -157,6 +157,11 @@ APACHE2_DIRECTORY_CONFIGURATION_OPTIONS = [
 		:type => :flag,
 		:desc => "Whether to load environment variables from the shell before running the application."
 	},
+	{
+		:name => "PassengerTimingHeader",
+		:type => :flag,
+		:desc => "Whether to add an X-Passenger-Timing header to responses."
+	},
 	{
 		:name    => "PassengerBufferUpload",
 		:type    => :flag,
@@ -164,6 +169,27 @@ APACHE2_DIRECTORY_CONFIGURATION_OPTIONS = [
 		:desc    => "Whether to buffer file uploads.",
 		:header  => nil
 	},
+	{
+		:name    => "PassengerStreamUpload",
+		:type    => :flag,
+		:context => ["OR_ALL"],
+		:desc    => "Whether to stream file uploads to the helper agent and let it buffer them.",
+		:header  => nil
+	},
+	{
+		:name    => "PassengerHelperAgentKeepalive",
+		:type    => :flag,
+		:context => ["OR_ALL"],
+		:desc    => "Whether to reuse helper agent connections across requests.",
+		:header  => nil
+	},
+	{
+		:name    => "PassengerAsyncResponse",
+		:type    => :flag,
+		:context => ["OR_ALL"],
+		:desc    => "Whether to free the Apache worker thread while waiting for the application to respond.",
+		:header  => nil
+	},
 	{
 		:name    => 'PassengerAppType',
 		:type    => :string,
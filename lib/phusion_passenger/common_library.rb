@@ -344,6 +344,12 @@ COMMON_LIBRARY = CommonLibraryBuilder.new do
 		:deps     => %w(
 			Utils/IOUtils.h
 		)
+	define_component 'Utils/CharScanner.o',
+		:source   => 'Utils/CharScanner.cpp',
+		:category => :base,
+		:deps     => %w(
+			Utils/CharScanner.h
+		)
 	define_component 'Utils.o',
 		:source   => 'Utils.cpp',
 		:category => :base,
@@ -386,11 +392,18 @@ COMMON_LIBRARY = CommonLibraryBuilder.new do
 			ApplicationPool2/Options.h
 			ApplicationPool2/PipeWatcher.h
 			ApplicationPool2/AppTypes.h
+			ApplicationPool2/ForkExec.h
+			ApplicationPool2/UserDatabaseCache.h
 			ApplicationPool2/Spawner.h
 			ApplicationPool2/SpawnerFactory.h
 			ApplicationPool2/SmartSpawner.h
 			ApplicationPool2/DirectSpawner.h
+			ApplicationPool2/RemoteSpawner.h
 			ApplicationPool2/DummySpawner.h
+			ApplicationPool2/ProcessJournal.h
+			ApplicationPool2/SpawnScheduler.h
+			Utils/MetricsRegistry.h
+			Utils/ProcessExitWatcher.h
 		)
 	define_component 'ApplicationPool2/AppTypes.o',
 		:source   => 'ApplicationPool2/AppTypes.cpp',
@@ -400,6 +413,14 @@ COMMON_LIBRARY = CommonLibraryBuilder.new do
 			Utils/StrIntUtils.h
 			Utils/CachedFileStat.h
 		)
+	define_component 'ApplicationPool2/PoolStatusTable.o',
+		:source   => 'ApplicationPool2/PoolStatusTable.cpp',
+		:category => :other,
+		:deps     => %w(
+			ApplicationPool2/PoolStatusTable.h
+			FileDescriptor.h
+			StaticString.h
+		)
 	define_component 'AgentsStarter.o',
 		:source   => 'AgentsStarter.cpp',
 		:category => :other,
@@ -424,6 +445,13 @@ COMMON_LIBRARY = CommonLibraryBuilder.new do
 		:deps     => %w(
 			agents/LoggingAgent/FilterSupport.h
 		)
+	define_component 'Utils/SamplingProfiler.o',
+		:source   => 'Utils/SamplingProfiler.cpp',
+		:category => :other,
+		:deps     => %w(
+			Utils/SamplingProfiler.h
+			Utils/ScopeGuard.h
+		)
 	define_component 'Utils/MD5.o',
 		:source   => 'Utils/MD5.cpp',
 		:category => :other,
@@ -454,4 +482,5 @@ end
 
 # Objects that must be linked into the Nginx binary.
 NGINX_LIBS_SELECTOR = [:base, 'AgentsStarter.o', 'ApplicationPool2/AppTypes.o',
+	'ApplicationPool2/PoolStatusTable.o',
 	'Utils/CachedFileStat.o', 'Utils/Base64.o', 'agents/LoggingAgent/FilterSupport.o']
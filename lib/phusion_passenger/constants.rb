@@ -38,6 +38,8 @@ module PhusionPassenger
 		DEFAULT_NODEJS = "node"
 		DEFAULT_MAX_POOL_SIZE = 6
 		DEFAULT_POOL_IDLE_TIME = 300
+		DEFAULT_HELPER_AGENT_KEEPALIVE = 32
+		DEFAULT_STAT_CACHE_TTL = 1
 		DEFAULT_START_TIMEOUT = 90_000
 		DEFAULT_WEB_APP_USER = "nobody"
 		DEFAULT_CONCURRENCY_MODEL = "process"
@@ -0,0 +1,228 @@
+# encoding: binary
+#  Phusion Passenger - https://www.phusionpassenger.com/
+#  Copyright (c) 2014 Phusion
+#
+#  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a copy
+#  of this software and associated documentation files (the "Software"), to deal
+#  in the Software without restriction, including without limitation the rights
+#  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+#  copies of the Software, and to permit persons to whom the Software is
+#  furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+#  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+#  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+#  THE SOFTWARE.
+
+require 'rbconfig'
+require 'digest/sha1'
+PhusionPassenger.require_passenger_lib 'debug_logging'
+
+module PhusionPassenger
+
+# Speeds up `require` during application startup. Normally, every `require`
+# of a feature that isn't loaded yet checks every directory in $LOAD_PATH
+# with a stat() call per extension, until the feature is found. With
+# hundreds of gems, that's tens of thousands of system calls.
+#
+# LoadPathCache lists the files in each load path directory that belongs to
+# an installed gem or to Ruby itself once, and stores the lists in a file in
+# the server instance directory. Such directories don't change without the
+# Gemfile.lock or the Ruby version changing too, so their contents are looked
+# up in the lists instead of on the filesystem. Other directories, such as
+# the application's own 'lib' directory, are still checked the normal way,
+# in their normal order, so that the result of a `require` never changes.
+class LoadPathCache
+	include DebugLogging
+
+	EXTENSIONS = ['.rb', ".#{RbConfig::CONFIG['DLEXT']}"].freeze
+	EXTENSION_REGEX = /\.(rb|#{Regexp.escape(RbConfig::CONFIG['DLEXT'])})\z/
+	FORMAT_VERSION = 1
+
+	class << self
+		attr_reader :instance
+	end
+
+	# Installs a cache for the application in the current working directory,
+	# stored in the given directory. The cache is only used for `require`
+	# calls that happen after this call.
+	def self.install!(cache_dir)
+		return if @instance
+		@instance = new(cache_dir, Dir.pwd)
+		@instance.load
+		Kernel.module_eval do
+			alias_method :require_without_passenger_load_path_cache, :require
+			private :require_without_passenger_load_path_cache
+
+			def require(feature)
+				cache = PhusionPassenger::LoadPathCache.instance
+				path = cache.resolve(feature) if cache
+				return require_without_passenger_load_path_cache(path || feature)
+			end
+			private :require
+		end
+	end
+
+	attr_reader :filename, :hits, :misses
+
+	def initialize(cache_dir, app_root)
+		@filename = "#{cache_dir}/#{Process.uid}-#{Digest::SHA1.hexdigest(cache_key(app_root))}"
+		@stable_prefixes = stable_prefixes
+		# Load path directory => { feature without extension => path }
+		@entries = {}
+		# Feature => path, for features that have been resolved before. Once
+		# a feature is loaded, Ruby doesn't look for it again either.
+		@resolved = {}
+		@dirty = false
+		@hits = 0
+		@misses = 0
+	end
+
+	def load
+		return if !File.exist?(@filename) || !trustworthy?(@filename)
+		data = File.open(@filename, 'rb') { |f| Marshal.load(f) }
+		if data.is_a?(Hash) && data[:version] == FORMAT_VERSION
+			@entries = data[:entries]
+		end
+	rescue SystemCallError, IOError, TypeError, ArgumentError => e
+		debug("Cannot load the load path cache #{@filename}: #{e} (#{e.class})")
+	end
+
+	# Writes the cache file if any directory was listed since it was loaded.
+	def save
+		return if !@dirty
+		temp_filename = "#{@filename}.#{Process.pid}"
+		File.open(temp_filename, File::WRONLY | File::CREAT | File::EXCL, 0600) do |f|
+			f.binmode
+			Marshal.dump({ :version => FORMAT_VERSION, :entries => @entries }, f)
+		end
+		File.rename(temp_filename, @filename)
+		@dirty = false
+	rescue SystemCallError, IOError => e
+		debug("Cannot save the load path cache #{@filename}: #{e} (#{e.class})")
+		File.unlink(temp_filename) rescue nil
+	end
+
+	# Returns the absolute path of the file that `require(feature)` would load,
+	# or nil if `require` should resolve the feature itself.
+	def resolve(feature)
+		feature = feature.to_path if feature.respond_to?(:to_path)
+		return nil if !feature.is_a?(String) || feature.empty? || feature =~ /\A[\.\/~]/
+		if path = @resolved[feature]
+			return path
+		end
+		if feature =~ EXTENSION_REGEX
+			base = feature.sub(EXTENSION_REGEX, '')
+			extension = ".#{$1}"
+		else
+			return nil if File.extname(feature) != ""
+			base = feature
+		end
+
+		$LOAD_PATH.each do |dir|
+			dir = dir.to_s
+			if stable?(dir)
+				path = lookup(dir, base, extension)
+			else
+				path = search(dir, base, extension)
+			end
+			if path
+				@hits += 1
+				return @resolved[feature] = path
+			end
+		end
+		@misses += 1
+		return nil
+	end
+
+private
+	def cache_key(app_root)
+		key = "#{app_root}\0#{RUBY_VERSION}\0#{RUBY_PLATFORM}\0"
+		key << (defined?(RUBY_ENGINE) ? RUBY_ENGINE : "ruby")
+		key << "\0" << (defined?(RUBY_PATCHLEVEL) ? RUBY_PATCHLEVEL.to_s : "")
+		lockfile = ENV['BUNDLE_GEMFILE'] ? "#{ENV['BUNDLE_GEMFILE']}.lock" : "#{app_root}/Gemfile.lock"
+		if File.exist?(lockfile)
+			key << "\0" << Digest::SHA1.file(lockfile).hexdigest
+		end
+		return key
+	end
+
+	# Directories under which files only change when gems are installed,
+	# which changes the Gemfile.lock, or when Ruby is upgraded.
+	def stable_prefixes
+		result = []
+		if defined?(Gem)
+			result.concat(Gem.path)
+		end
+		if defined?(Bundler) && Bundler.respond_to?(:bundle_path)
+			result << Bundler.bundle_path.to_s rescue nil
+		end
+		%w(rubylibdir archdir sitelibdir sitearchdir vendorlibdir vendorarchdir).each do |name|
+			result << RbConfig::CONFIG[name] if RbConfig::CONFIG[name]
+		end
+		result.map! { |dir| File.expand_path(dir) + "/" }
+		result.uniq!
+		return result
+	end
+
+	def stable?(dir)
+		return @stable_prefixes.any? { |prefix| dir.index(prefix) == 0 }
+	end
+
+	def lookup(dir, base, extension)
+		if !(files = @entries[dir])
+			files = @entries[dir] = list(dir)
+			@dirty = true
+		end
+		if path = files[base]
+			if extension.nil? || path.end_with?(extension)
+				return path
+			else
+				# Both foo.rb and foo.so may exist; the listing only
+				# remembers the one that `require 'foo'` prefers.
+				return search(dir, base, extension)
+			end
+		else
+			return nil
+		end
+	end
+
+	def search(dir, base, extension)
+		(extension ? [extension] : EXTENSIONS).each do |ext|
+			path = "#{dir}/#{base}#{ext}"
+			return File.expand_path(path) if File.file?(path)
+		end
+		return nil
+	end
+
+	def list(dir)
+		result = {}
+		prefix_size = dir.size + 1
+		# Process the extensions in order of preference, so that the first
+		# listed file for a feature is the one that Ruby would pick.
+		EXTENSIONS.each do |ext|
+			Dir.glob("#{dir}/**/*#{ext}").each do |path|
+				base = path[prefix_size .. -(ext.size + 1)]
+				result[base] ||= File.expand_path(path)
+			end
+		end
+		return result
+	end
+
+	# Other users may be able to create files in the cache directory, so we
+	# only use cache files that only we can have written.
+	def trustworthy?(filename)
+		stat = File.lstat(filename)
+		return stat.file? && stat.owned? && (stat.mode & 022) == 0
+	end
+end
+
+end # module PhusionPassenger
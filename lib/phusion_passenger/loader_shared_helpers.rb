@@ -62,6 +62,7 @@ module LoaderSharedHelpers
 		options["log_level"]                 = options["log_level"].to_i if options["log_level"]
 		# TODO: smart spawning is not supported when using ruby-debug. We should raise an error
 		# in this case.
+		options["load_path_cache"]           = to_boolean(options["load_path_cache"])
 		options["debugger"]     = to_boolean(options["debugger"])
 		options["spawn_method"] = "direct" if options["debugger"]
 		
@@ -224,6 +225,15 @@ module LoaderSharedHelpers
 		# !!! NOTE !!!
 		# If the app is using Bundler then any dependencies required past this
 		# point must be specified in the Gemfile. Like ruby-debug if debugging is on...
+
+		# Now that the load path is known, speed up the requires that follow.
+		if options["load_path_cache"] && options["generation_dir"]
+			cache_dir = "#{options["generation_dir"]}/load_path_caches"
+			if File.directory?(cache_dir)
+				PhusionPassenger.require_passenger_lib 'load_path_cache'
+				LoadPathCache.install!(cache_dir)
+			end
+		end
 	end
 	
 	def before_loading_app_code_step2(options)
@@ -233,6 +243,10 @@ module LoaderSharedHelpers
 	# This method is to be called after loading the application code but
 	# before forking a worker process.
 	def after_loading_app_code(options)
+		if defined?(LoadPathCache) && LoadPathCache.instance
+			LoadPathCache.instance.save
+		end
+
 		# Post-install framework extensions. Possibly preceded by a call to
 		# PhusionPassenger.install_framework_extensions!
 		if defined?(::Rails) && !defined?(::Rails::VERSION)
@@ -38,7 +38,7 @@ class MessageChannel
 	end
 	
 	# The wrapped IO object.
-	attr_accessor :io
+	attr_reader :io
 
 	# Create a new MessageChannel by wrapping the given IO object.
 	def initialize(io = nil)
@@ -46,6 +46,11 @@ class MessageChannel
 		# Make it binary just in case.
 		@io.binmode if @io
 	end
+
+	def io=(io)
+		@io = io
+		@native = nil
+	end
 	
 	# Read an array message from the underlying file descriptor.
 	# Returns the array message as an array, or nil when end-of-stream has
@@ -54,6 +59,11 @@ class MessageChannel
 	# Might raise SystemCallError, IOError or SocketError when something
 	# goes wrong.
 	def read
+		if native?
+			result = NativeSupport.read_array_message(@io)
+			return result if result != false
+		end
+
 		buffer = new_buffer
 		if !@io.read(HEADER_SIZE, buffer)
 			return nil
@@ -105,6 +115,16 @@ class MessageChannel
 	# Might raise SystemCallError, IOError or SocketError when something
 	# goes wrong.
 	def read_hash
+		if native?
+			result = NativeSupport.read_array_message(@io)
+			if result
+				raise InvalidHashError if result.size % 2 != 0
+				return Hash[*result]
+			elsif result.nil?
+				return nil
+			end
+		end
+
 		buffer = new_buffer
 		if !@io.read(HEADER_SIZE, buffer)
 			return nil
@@ -174,6 +194,11 @@ class MessageChannel
 	# size for the scalar message. If the received scalar message's size
 	# is larger than +max_size+, then a SecurityError will be raised.
 	def read_scalar(buffer = new_buffer, max_size = nil)
+		if native?
+			result = NativeSupport.read_scalar_message(@io, buffer, max_size)
+			return result if result != false
+		end
+
 		if !@io.read(4, buffer)
 			return nil
 		end
@@ -222,6 +247,10 @@ class MessageChannel
 	# Might raise SystemCallError, IOError or SocketError when something
 	# goes wrong.
 	def write(name, *args)
+		if native?
+			return NativeSupport.write_array_message(@io, [name, *args])
+		end
+
 		check_argument(name)
 		args.each do |arg|
 			check_argument(arg)
@@ -240,6 +269,9 @@ class MessageChannel
 	# Might raise SystemCallError, IOError or SocketError when something
 	# goes wrong.
 	def write_scalar(data)
+		if native? && data.is_a?(String)
+			return NativeSupport.write_scalar_message(@io, data)
+		end
 		@io.write([data.size].pack('N') << data)
 		@io.flush
 	end
@@ -323,6 +355,17 @@ class MessageChannel
 	end
 
 private
+	# Whether the native MessageChannel functions can be used on @io. They
+	# work directly on the file descriptor, so @io must be a real IO object.
+	def native?
+		if @native.nil?
+			@native = !!(defined?(NativeSupport) &&
+				NativeSupport.respond_to?(:read_array_message) &&
+				@io.is_a?(IO))
+		end
+		return @native
+	end
+
 	def check_argument(arg)
 		if arg.to_s.index(DELIMITER)
 			raise ArgumentError, "Message name and arguments may not contain #{DELIMITER_NAME}."
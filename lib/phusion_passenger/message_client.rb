@@ -130,6 +130,26 @@ class MessageClient
 		return read_scalar
 	end
 
+	def helper_agent_latencies
+		write("latencies")
+		check_security_response
+		return read_scalar
+	end
+
+	def helper_agent_metrics
+		write("metrics")
+		check_security_response
+		return read_scalar
+	end
+
+	# Returns the memory usage of the application processes as measured by
+	# the helper agent. See PoolSnapshot::toMemoryStats() for the format.
+	def pool_memory_stats
+		write("stats_snapshot", "memory", false)
+		check_security_response
+		return read_scalar
+	end
+
 	### HelperAgent BacktracesServer methods ###
 	
 	def helper_agent_backtraces
@@ -138,6 +158,23 @@ class MessageClient
 		return read_scalar
 	end
 
+	# Runs the HelperAgent's sampling profiler and returns the profile in the
+	# folded stacks format. Blocks for the duration of the profile.
+	# Recognized options: :duration (seconds), :frequency (Hz) and :stacks
+	# ('native' or 'trace_points').
+	def helper_agent_profile(options = {})
+		write("profile", *options.to_a.flatten.map { |x| x.to_s })
+		check_security_response
+		result = read
+		if result.nil?
+			raise EOFError
+		elsif result.first == "error"
+			raise RuntimeError, result[1]
+		else
+			return read_scalar
+		end
+	end
+
 	### LoggingAgent AdminServer methods ###
 	
 	def logging_agent_status
@@ -145,6 +182,12 @@ class MessageClient
 		check_security_response
 		return read_scalar
 	end
+
+	def logging_agent_metrics
+		write("metrics")
+		check_security_response
+		return read_scalar
+	end
 	
 	### Low level I/O methods ###
 	
@@ -113,6 +113,10 @@ LOCATION_CONFIGURATION_OPTIONS = [
 		:name  => 'passenger_friendly_error_pages',
 		:type  => :flag
 	},
+	{
+		:name  => 'passenger_timing_header',
+		:type  => :flag
+	},
 	{
 		:name   => 'passenger_min_instances',
 		:type   => :integer,
@@ -218,6 +222,11 @@ LOCATION_CONFIGURATION_OPTIONS = [
 		:type  => :flag,
 		:field => 'upstream_config.buffering'
 	},
+	{
+		:name   => 'passenger_request_buffering',
+		:type   => :flag,
+		:header => nil
+	},
 	{
 		:name     => 'passenger_buffer_size',
 		:take     => 'NGX_CONF_TAKE1',
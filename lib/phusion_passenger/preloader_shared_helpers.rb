@@ -60,12 +60,12 @@ module PreloaderSharedHelpers
 				# Do nothing.
 			end
 			
-			# Improve copy-on-write friendliness.
-			GC.start
+			prepare_heap_for_fork
 			
 			pid = fork
 			if pid.nil?
 				$0 = "#{$0} (forking...)"
+				delay_gc_after_fork
 				client.puts "OK"
 				client.puts Process.pid
 				client.flush
@@ -91,6 +91,38 @@ module PreloaderSharedHelpers
 		end
 	end
 	
+	# Improves copy-on-write friendliness by "freezing" the heap before
+	# forking: long-lived objects are compacted together and promoted to
+	# the old generation, so that the children's GC runs don't write to
+	# the pages that they share with the preloader. This is only done
+	# again if the preloader ran the GC since the last time, because
+	# otherwise the heap is still in the same state.
+	def prepare_heap_for_fork
+		if GC.respond_to?(:count) && @heap_prepared_at_gc_count == GC.count
+			return
+		end
+		if ::Process.respond_to?(:warmup)
+			::Process.warmup
+		else
+			# On generational GCs, objects are promoted to the old generation
+			# after surviving a few GC runs.
+			4.times { GC.start }
+			GC.compact if GC.respond_to?(:compact)
+		end
+		@heap_prepared_at_gc_count = GC.count if GC.respond_to?(:count)
+	end
+
+	def delay_gc_after_fork
+		delay = PhusionPassenger.gc_delay_after_fork
+		if delay && delay > 0 && GC.disable == false
+			thread = Thread.new do
+				sleep(delay)
+				GC.enable
+			end
+			thread[:name] = "GC enabler"
+		end
+	end
+	
 	def run_main_loop(options)
 		$0 = "Passenger AppPreloader: #{options['app_root']}"
 		client = nil
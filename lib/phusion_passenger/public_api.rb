@@ -30,6 +30,8 @@ class << self
 	@@event_after_installing_signal_handlers = []
 	@@event_oob_work = []
 	@@advertised_concurrency_level = nil
+	@@fiber_concurrency = nil
+	@@gc_delay_after_fork = nil
 
 	def on_event(name, &block)
 		callback_list_for_event(name) << block
@@ -56,6 +58,31 @@ class << self
 	def advertised_concurrency_level=(value)
 		@@advertised_concurrency_level = value
 	end
+
+	# If set to a number greater than 1, then each process handles up to this
+	# many requests concurrently, each in its own fiber, on a single thread.
+	# Only has effect on Ruby versions that support Fiber.set_scheduler.
+	# The app must not perform blocking calls that bypass the fiber
+	# scheduler, or else all requests in the process are blocked.
+	def fiber_concurrency
+		@@fiber_concurrency
+	end
+
+	def fiber_concurrency=(value)
+		@@fiber_concurrency = value
+	end
+
+	# If set to a number of seconds, then processes that are forked by a
+	# smart spawning preloader do not run the garbage collector during that
+	# many seconds after they have been forked, so that they share more
+	# memory with the preloader. Memory usage may grow freely in the meantime.
+	def gc_delay_after_fork
+		@@gc_delay_after_fork
+	end
+
+	def gc_delay_after_fork=(value)
+		@@gc_delay_after_fork = value
+	end
 	
 	def benchmark(env = nil, title = "Benchmarking")
 		log = lookup_analytics_log(env)
@@ -27,23 +27,79 @@ require 'thread'
 module PhusionPassenger
 module Rack
 
+# Rack middleware for performing garbage collection out-of-band, i.e. after
+# the response has been sent and while the process is not handling any
+# requests. Usage:
+#
+#   # Perform out-of-band GC every 5 requests.
+#   use PhusionPassenger::Rack::OutOfBandGc, 5
+#
+#   # Perform out-of-band GC only when the next request would probably
+#   # trigger a GC, based on how much the previous requests allocated.
+#   use PhusionPassenger::Rack::OutOfBandGc, :adaptive
+#
+# The adaptive strategy requires the GC statistics of Ruby >= 2.1. On
+# older Rubies it falls back to performing out-of-band GC every
+# DEFAULT_FREQUENCY requests.
 class OutOfBandGc
+  DEFAULT_FREQUENCY = 5
+  # A GC is requested when the remaining free slots or malloc budget
+  # is less than the estimated allocation of this many requests.
+  SAFETY_MARGIN = 2
+  # How much weight the most recent request gets in the moving
+  # per-request allocation estimates.
+  ESTIMATE_WEIGHT = 0.2
+
   def initialize(app, frequency, logger = nil)
     @app = app
-    @frequency = frequency
     @request_count = 0
     @mutex = Mutex.new
+    if frequency == :adaptive
+      @adaptive = GC.respond_to?(:stat) && GC.stat.has_key?(:heap_free_slots)
+      @frequency = DEFAULT_FREQUENCY
+    else
+      @adaptive = false
+      @frequency = frequency
+    end
+    @oob_work_requested = false
+    @allocated_objects_estimate = 0.0
+    @malloc_increase_estimate = 0.0
+    if @adaptive
+      # The number of objects that may be allocated before Ruby runs the
+      # GC, relative to the number of free heap slots after the last GC.
+      # Learned from GCs that happened during requests.
+      @gc_interval_ratio = nil
+      record_gc(GC.stat)
+    end
     
     ::PhusionPassenger.on_event(:oob_work) do
       t0 = Time.now
-      disabled = GC.enable
-      GC.start
-      GC.disable if disabled
+      if @adaptive
+        full = @mutex.synchronize { full_gc_needed?(GC.stat) }
+        GC.start(:full_mark => full, :immediate_sweep => true)
+        @mutex.synchronize do
+          @oob_work_requested = false
+          record_gc(GC.stat)
+        end
+      else
+        disabled = GC.enable
+        GC.start
+        GC.disable if disabled
+      end
       logger.info "Out Of Band GC finished in #{Time.now - t0} sec" if logger
     end
   end
 
   def call(env)
+    if @adaptive
+      call_adaptive(env)
+    else
+      call_with_frequency(env)
+    end
+  end
+
+private
+  def call_with_frequency(env)
     status, headers, body = @app.call(env)
 
     @mutex.synchronize do
@@ -56,6 +112,81 @@ class OutOfBandGc
     
     [status, headers, body]
   end
+
+  def call_adaptive(env)
+    before = GC.stat
+    status, headers, body = @app.call(env)
+    after = GC.stat
+
+    @mutex.synchronize do
+      if before[:count] != @last_gc_count
+        # Another thread caused a GC between requests.
+        record_gc(before)
+      end
+      update_estimate(:@allocated_objects_estimate,
+        after[:total_allocated_objects] - before[:total_allocated_objects])
+      if after[:count] == before[:count]
+        update_estimate(:@malloc_increase_estimate,
+          after[:malloc_increase_bytes] - before[:malloc_increase_bytes])
+      else
+        # The GC ran sometime during this request, so at least the objects
+        # allocated before this request fit in the heap. The malloc counter
+        # has been reset, so its delta is meaningless.
+        interval = [before[:total_allocated_objects] -
+          @allocated_objects_at_last_gc, @allocated_objects_estimate].max
+        @gc_interval_ratio = interval / [@free_slots_at_last_gc, 1].max.to_f
+        record_gc(after)
+      end
+      if !@oob_work_requested && gc_needed_soon?(after)
+        @oob_work_requested = true
+        headers['X-Passenger-Request-OOB-Work'] = 'true'
+      end
+    end
+
+    [status, headers, body]
+  end
+
+  def update_estimate(name, value)
+    estimate = instance_variable_get(name)
+    if value > estimate
+      # Adapt to allocation-heavy requests immediately.
+      estimate = value.to_f
+    else
+      estimate += (value - estimate) * ESTIMATE_WEIGHT
+    end
+    instance_variable_set(name, estimate)
+  end
+
+  def record_gc(stat)
+    @last_gc_count = stat[:count]
+    @allocated_objects_at_last_gc = stat[:total_allocated_objects]
+    @free_slots_at_last_gc = stat[:heap_free_slots]
+  end
+
+  # Returns whether the next few requests would probably trigger a GC.
+  def gc_needed_soon?(stat)
+    objects = @allocated_objects_estimate * SAFETY_MARGIN
+    malloc  = @malloc_increase_estimate * SAFETY_MARGIN
+    allocated = stat[:total_allocated_objects] - @allocated_objects_at_last_gc
+    return stat[:heap_free_slots] <= objects ||
+      (@gc_interval_ratio &&
+        allocated + objects >= @gc_interval_ratio * @free_slots_at_last_gc) ||
+      stat[:malloc_increase_bytes] + malloc >= stat[:malloc_increase_bytes_limit] ||
+      (stat.has_key?(:oldmalloc_increase_bytes) &&
+        stat[:oldmalloc_increase_bytes] + malloc >= stat[:oldmalloc_increase_bytes_limit])
+  end
+
+  # Returns whether the next GC would probably be a major one anyway.
+  def full_gc_needed?(stat)
+    if stat.has_key?(:old_objects_limit)
+      return stat[:old_objects] >= stat[:old_objects_limit] * 0.9 ||
+        (stat.has_key?(:oldmalloc_increase_bytes) &&
+          stat[:oldmalloc_increase_bytes] + @malloc_increase_estimate * SAFETY_MARGIN >=
+          stat[:oldmalloc_increase_bytes_limit])
+    else
+      return false
+    end
+  end
 end
 
 end # module Rack
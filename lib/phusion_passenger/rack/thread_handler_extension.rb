@@ -50,22 +50,47 @@ module ThreadHandlerExtension
 	NEWLINE        = "\n"     # :nodoc:
 	STATUS         = "Status: "       # :nodoc:
 	NAME_VALUE_SEPARATOR = ": "       # :nodoc:
+	X_PASSENGER_RESOURCE_USAGE = "X-Passenger-Resource-Usage"  # :nodoc:
+
+	# The CPU time of the current thread is only available on Ruby >= 2.1.
+	# Otherwise the CPU time of the whole process is used, which includes
+	# that of other threads that are handling requests concurrently.
+	if defined?(Process::CLOCK_THREAD_CPUTIME_ID)
+		def self.cpu_time
+			(Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) * 1_000_000).to_i
+		end
+	else
+		def self.cpu_time
+			times = Process.times
+			((times.utime + times.stime) * 1_000_000).to_i
+		end
+	end
+
+	if GC.respond_to?(:stat) && GC.stat.has_key?(:total_allocated_objects)
+		def self.allocated_objects
+			GC.stat[:total_allocated_objects]
+		end
+	elsif GC.respond_to?(:stat) && GC.stat.has_key?(:total_allocated_object)
+		# Ruby 2.1.
+		def self.allocated_objects
+			GC.stat[:total_allocated_object]
+		end
+	else
+		def self.allocated_objects
+			nil
+		end
+	end
 
 	def process_request(env, connection, socket_wrapper, full_http_response)
 		rewindable_input = PhusionPassenger::Utils::TeeInput.new(connection, env)
 		begin
-			env[RACK_VERSION]      = RACK_VERSION_VALUE
+			# The other constant Rack entries come from #create_env_template.
 			env[RACK_INPUT]        = rewindable_input
-			env[RACK_ERRORS]       = STDERR
-			env[RACK_MULTITHREAD]  = @request_handler.concurrency > 1
-			env[RACK_MULTIPROCESS] = true
-			env[RACK_RUN_ONCE]     = false
 			if env[HTTPS] == YES || env[HTTPS] == ON || env[HTTPS] == ONE
 				env[RACK_URL_SCHEME] = HTTPS_DOWNCASE
 			else
 				env[RACK_URL_SCHEME] = HTTP
 			end
-			env[RACK_HIJACK_P] = true
 			env[RACK_HIJACK] = lambda do
 				env[RACK_HIJACK_IO] ||= begin
 					connection.stop_simulating_eof!
@@ -73,6 +98,8 @@ module ThreadHandlerExtension
 				end
 			end
 			
+			cpu_time_start = ThreadHandlerExtension.cpu_time
+			allocations_start = ThreadHandlerExtension.allocated_objects
 			begin
 				status, headers, body = @app.call(env)
 			rescue => e
@@ -90,11 +117,27 @@ module ThreadHandlerExtension
 			# Application requested a full socket hijack.
 			return true if env[RACK_HIJACK_IO]
 
+			add_resource_usage_header(headers, cpu_time_start, allocations_start)
+
 			begin
 				if full_http_response
 					connection.write("HTTP/1.1 #{status.to_i.to_s} Whatever#{CRLF}")
 					connection.write("Connection: close#{CRLF}")
 				end
+				if connection.respond_to?(:write_rack_response)
+					if !@response_buffer
+						@response_buffer = ''
+						@response_buffer.force_encoding('binary') if @response_buffer.respond_to?(:force_encoding)
+					end
+					case connection.write_rack_response(@response_buffer, status, headers, body)
+					when true
+						return false
+					when false
+						write_body_with_each(body, socket_wrapper, connection)
+						return false
+					end
+					# nil means that we must write the response ourselves.
+				end
 				headers_output = [
 					STATUS, status.to_i.to_s, CRLF
 				]
@@ -135,21 +178,7 @@ module ThreadHandlerExtension
 					return false
 				else
 					connection.writev(headers_output)
-					if body
-						begin
-							body.each do |s|
-								connection.write(s)
-							end
-						rescue => e
-							if should_reraise_app_error?(e, socket_wrapper)
-								raise e
-							elsif !should_swallow_app_error?(e, socket_wrapper)
-								# Body objects can raise exceptions in #each.
-								print_exception("Rack body object #each method", e)
-							end
-							return false
-						end
-					end
+					write_body_with_each(body, socket_wrapper, connection)
 					return false
 				end
 			ensure
@@ -161,6 +190,43 @@ module ThreadHandlerExtension
 	end
 
 private
+	# Tells the HelperAgent how much CPU time, in microseconds, and how many
+	# objects the application used for generating the response. Streaming the
+	# body afterwards is not included.
+	def add_resource_usage_header(headers, cpu_time_start, allocations_start)
+		return if headers.frozen?
+		value = "cpu=#{ThreadHandlerExtension.cpu_time - cpu_time_start}"
+		if allocations_start
+			value << ";allocations=#{ThreadHandlerExtension.allocated_objects - allocations_start}"
+		end
+		headers[X_PASSENGER_RESOURCE_USAGE] = value
+	end
+
+	def write_body_with_each(body, socket_wrapper, connection)
+		if body
+			body.each do |s|
+				connection.write(s)
+			end
+		end
+	rescue => e
+		if should_reraise_app_error?(e, socket_wrapper)
+			raise e
+		elsif !should_swallow_app_error?(e, socket_wrapper)
+			# Body objects can raise exceptions in #each.
+			print_exception("Rack body object #each method", e)
+		end
+	end
+	
+	def create_env_template
+		return {
+			RACK_VERSION      => RACK_VERSION_VALUE,
+			RACK_ERRORS       => STDERR,
+			RACK_MULTITHREAD  => @request_handler.concurrency > 1,
+			RACK_MULTIPROCESS => true,
+			RACK_RUN_ONCE     => false,
+			RACK_HIJACK_P     => true
+		}
+	end
 end
 
 end # module Rack
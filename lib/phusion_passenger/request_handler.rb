@@ -96,6 +96,16 @@ class RequestHandler
 		)
 		@thread_handler = options["thread_handler"] || ThreadHandler
 		@concurrency = 1
+		if PhusionPassenger.fiber_concurrency.to_i > 1
+			if Fiber.respond_to?(:set_scheduler)
+				PhusionPassenger.require_passenger_lib 'request_handler/fiber_scheduler'
+				@concurrency = PhusionPassenger.fiber_concurrency.to_i
+				@use_fibers = true
+			else
+				warn("*** Passenger RequestHandler warning: this Ruby version does " <<
+					"not support fiber schedulers; ignoring fiber_concurrency")
+			end
+		end
 		if options["pool_account_password_base64"]
 			@pool_account_password = options["pool_account_password_base64"].unpack('m').first
 		end
@@ -132,6 +142,8 @@ class RequestHandler
 		@main_loop_thread_lock = Mutex.new
 		@main_loop_thread_cond = ConditionVariable.new
 		@threads = []
+		# The ThreadHandlers that run in fibers in the fiber reactor thread.
+		@fiber_handlers = []
 		@threads_mutex = Mutex.new
 		@soft_termination_linger_time = 3
 		@main_loop_running  = false
@@ -430,7 +442,17 @@ private
 		expected_nthreads = 0
 
 		@threads_mutex.synchronize do
-			@concurrency.times do |i|
+			if @use_fibers
+				thread = start_fiber_reactor_thread(thread_handler, main_socket_options,
+					set_initialization_state_to_true, set_initialization_state)
+				@threads << thread
+				expected_nthreads += 1
+			end
+
+			# Each server socket is accepted on by a single thread. Fibers
+			# share the main socket, but the FiberScheduler only wakes one
+			# of them per incoming connection.
+			(@use_fibers ? 0 : @concurrency).times do |i|
 				thread = Thread.new(i) do |number|
 					Thread.current.abort_on_exception = true
 					begin
@@ -471,6 +493,46 @@ private
 		end
 	end
 
+	# Starts a thread that runs @concurrency ThreadHandlers, each in its
+	# own fiber, on a FiberScheduler.
+	def start_fiber_reactor_thread(thread_handler, options, finish_callback, set_initialization_state)
+		return Thread.new do
+			Thread.current.abort_on_exception = true
+			begin
+				Thread.current[:name] = "Fiber reactor"
+				@fiber_scheduler = FiberScheduler.new
+				Fiber.set_scheduler(@fiber_scheduler)
+				# Only report this thread as initialized after all fibers are.
+				nstarted = 0
+				fiber_finish_callback = lambda do
+					nstarted += 1
+					finish_callback.call if nstarted == @concurrency
+				end
+				@concurrency.times do
+					Fiber.schedule do
+						handler = thread_handler.new(self, options)
+						handler.install
+						@threads_mutex.synchronize do
+							@fiber_handlers << handler
+						end
+						begin
+							handler.main_loop(fiber_finish_callback)
+						ensure
+							@threads_mutex.synchronize do
+								@fiber_handlers.delete(handler)
+							end
+						end
+					end
+				end
+			ensure
+				# Runs the fibers until all of them have exited.
+				Fiber.set_scheduler(nil)
+				set_initialization_state.call(false)
+				unregister_current_thread
+			end
+		end
+	end
+
 	def unregister_current_thread
 		@threads_mutex.synchronize do
 			@threads.delete(Thread.current)
@@ -563,7 +625,11 @@ private
 			@threads.dup
 		end
 		threads.each do |thr|
-			thr.raise(ThreadHandler::Interrupted.new)
+			if thr[:name] == "Fiber reactor"
+				@fiber_scheduler.interrupt(ThreadHandler::Interrupted)
+			else
+				thr.raise(ThreadHandler::Interrupted.new)
+			end
 		end
 		threads.each do |thr|
 			thr.join
@@ -580,11 +646,7 @@ private
 		done = false
 
 		while !done
-			handlers = @threads_mutex.synchronize do
-				@threads.map do |thr|
-					thr[:passenger_thread_handler]
-				end
-			end
+			handlers = current_handlers
 			debug("There are currently #{handlers.size} threads")
 			if handlers.empty?
 				# There are no threads, so we're done.
@@ -601,7 +663,7 @@ private
 			sleep 0.01
 			
 			while true
-				if handlers.size != @threads_mutex.synchronize { @threads.size }
+				if handlers.size != current_handlers.size
 					debug("The number of threads changed. Restarting waiting algorithm")
 					break
 				end
@@ -632,6 +694,17 @@ private
 
 		debug("All threads are now idle")
 	end
+
+	def current_handlers
+		@threads_mutex.synchronize do
+			handlers = []
+			@threads.each do |thr|
+				handler = thr[:passenger_thread_handler]
+				handlers << handler if handler
+			end
+			return handlers.concat(@fiber_handlers)
+		end
+	end
 end
 
 end # module PhusionPassenger
@@ -0,0 +1,215 @@
+#  Phusion Passenger - https://www.phusionpassenger.com/
+#  Copyright (c) 2014 Phusion
+#
+#  "Phusion Passenger" is a trademark of Hongli Lai & Ninh Bui.
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a copy
+#  of this software and associated documentation files (the "Software"), to deal
+#  in the Software without restriction, including without limitation the rights
+#  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+#  copies of the Software, and to permit persons to whom the Software is
+#  furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+#
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+#  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+#  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+#  THE SOFTWARE.
+
+
+module PhusionPassenger
+class RequestHandler
+
+
+# A minimal Fiber scheduler, as defined by Ruby 3's Fiber::SchedulerInterface,
+# on top of IO.select. It allows a single thread to multiplex many
+# ThreadHandlers, each running in its own non-blocking fiber: whenever a
+# fiber would block on I/O, a Mutex or sleep, the scheduler runs other
+# fibers instead.
+#
+# Blocking calls that don't go through the scheduler, e.g. in C extensions
+# that don't support it, block all fibers in the thread.
+class FiberScheduler
+	def initialize
+		# IO => fibers waiting for it, in the order in which they started waiting.
+		@readable = {}
+		@writable = {}
+		# Fiber => time at which its wait times out.
+		@timeouts = {}
+		# The number of fibers that are blocked without a timeout.
+		@blocked  = 0
+		@fibers   = []
+
+		# Other threads may unblock fibers, or interrupt all fibers.
+		@lock = Mutex.new
+		@ready = []
+		@interrupt = nil
+		@wakeup_reader, @wakeup_writer = IO.pipe
+	end
+
+	# Raises an instance of +exception_class+ in all fibers created by this
+	# scheduler. May be called from any thread.
+	def interrupt(exception_class)
+		@lock.synchronize do
+			@interrupt = exception_class
+		end
+		wakeup
+	end
+
+	def io_wait(io, events, timeout)
+		fiber = Fiber.current
+		add_waiter(@readable, io, fiber) if (events & IO::READABLE) != 0
+		add_waiter(@writable, io, fiber) if (events & IO::WRITABLE) != 0
+		@timeouts[fiber] = current_time + timeout if timeout
+		return Fiber.yield
+	ensure
+		remove_waiter(@readable, io, fiber)
+		remove_waiter(@writable, io, fiber)
+		@timeouts.delete(fiber)
+	end
+
+	def kernel_sleep(duration = nil)
+		block(:sleep, duration)
+		return true
+	end
+
+	def block(blocker, timeout = nil)
+		fiber = Fiber.current
+		if timeout
+			@timeouts[fiber] = current_time + timeout
+			begin
+				Fiber.yield
+			ensure
+				@timeouts.delete(fiber)
+			end
+		else
+			@blocked += 1
+			begin
+				Fiber.yield
+			ensure
+				@blocked -= 1
+			end
+		end
+	end
+
+	def unblock(blocker, fiber)
+		@lock.synchronize do
+			@ready << fiber
+		end
+		wakeup
+	end
+
+	def fiber(&block)
+		fiber = Fiber.new(:blocking => false, &block)
+		@fibers << fiber
+		fiber.resume
+		return fiber
+	end
+
+	# Called by Fiber.set_scheduler when this scheduler is replaced, and when
+	# the thread exits. Runs the fibers until all of them have finished.
+	def close
+		run
+	ensure
+		@wakeup_reader.close
+		@wakeup_writer.close
+	end
+
+	def run
+		while !@readable.empty? || !@writable.empty? || !@timeouts.empty? || @blocked > 0
+			readable, writable = IO.select(@readable.keys + [@wakeup_reader],
+				@writable.keys, nil, next_timeout)
+			# Only the first fiber that waits for an IO is resumed. All
+			# ThreadHandler fibers wait on the same server socket, and waking
+			# all of them for every connection would make all but one of
+			# them fail to accept and wait again.
+			resumable = {}
+			if readable
+				readable.each do |io|
+					if io.equal?(@wakeup_reader)
+						drain_wakeup_pipe
+					elsif fiber = @readable[io].first
+						resumable[fiber] = (resumable[fiber] || 0) | IO::READABLE
+					end
+				end
+			end
+			if writable
+				writable.each do |io|
+					fiber = @writable[io].first
+					resumable[fiber] = (resumable[fiber] || 0) | IO::WRITABLE
+				end
+			end
+			resumable.each_pair do |fiber, events|
+				fiber.resume(events) if fiber.alive?
+			end
+
+			now = current_time
+			timed_out = @timeouts.keys.select { |fiber| @timeouts[fiber] <= now }
+			timed_out.each do |fiber|
+				# The fiber may have been resumed by another event already.
+				fiber.resume(false) if @timeouts.has_key?(fiber) && fiber.alive?
+			end
+
+			ready, interrupt = @lock.synchronize do
+				result = [@ready, @interrupt]
+				@ready = []
+				@interrupt = nil
+				result
+			end
+			ready.each do |fiber|
+				fiber.resume if fiber.alive?
+			end
+			if interrupt
+				@fibers.each do |fiber|
+					fiber.raise(interrupt) if fiber.alive?
+				end
+			end
+			@fibers.delete_if { |fiber| !fiber.alive? }
+		end
+	end
+
+private
+	def current_time
+		return Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	end
+
+	def next_timeout
+		if @timeouts.empty?
+			return nil
+		else
+			timeout = @timeouts.values.min - current_time
+			return (timeout < 0) ? 0 : timeout
+		end
+	end
+
+	def add_waiter(waiters, io, fiber)
+		(waiters[io] ||= []) << fiber
+	end
+
+	def remove_waiter(waiters, io, fiber)
+		if list = waiters[io]
+			list.delete(fiber)
+			waiters.delete(io) if list.empty?
+		end
+	end
+
+	def wakeup
+		@wakeup_writer.write_nonblock('x')
+	rescue Errno::EAGAIN, IOError
+		# The reactor will wake up anyway, or has already exited.
+	end
+
+	def drain_wakeup_pipe
+		@wakeup_reader.read_nonblock(1024)
+	rescue Errno::EAGAIN
+	end
+end
+
+
+end # class RequestHandler
+end # module PhusionPassenger
@@ -45,6 +45,7 @@ class ThreadHandler
 	OOBW           = 'OOBW'.freeze
 	PASSENGER_CONNECT_PASSWORD  = 'PASSENGER_CONNECT_PASSWORD'.freeze
 	CONTENT_LENGTH = 'CONTENT_LENGTH'.freeze
+	EMPTY_ENV_TEMPLATE = {}.freeze
 	HTTP_TRANSFER_ENCODING = 'HTTP_TRANSFER_ENCODING'.freeze
 
 	MAX_HEADER_SIZE = 128 * 1024
@@ -75,6 +76,13 @@ class ThreadHandler
 		@stats_mutex   = Mutex.new
 		@interruptable = false
 		@iteration     = 0
+		# Extensions may define #create_env_template, which returns the env
+		# entries that are the same for every request.
+		if respond_to?(:create_env_template, true)
+			@env_template = create_env_template.freeze
+		else
+			@env_template = EMPTY_ENV_TEMPLATE
+		end
 
 		if @protocol == :session
 			metaclass = class << self; self; end
@@ -192,7 +200,7 @@ private
 		if headers_data.nil?
 			return
 		end
-		headers = Utils.split_by_null_into_hash(headers_data)
+		headers = Utils.parse_scgi_headers_into_env(headers_data, @env_template)
 		if @connect_password && headers[PASSENGER_CONNECT_PASSWORD] != @connect_password
 			warn "*** Passenger RequestHandler warning: " <<
 				"someone tried to connect with an invalid connect password."
@@ -210,7 +218,7 @@ private
 	# HTTP parser and is not intended to be complete, fast or secure, since the HTTP server
 	# socket is intended to be used for debugging purposes only.
 	def parse_http_request(connection, channel, buffer)
-		headers = {}
+		headers = @env_template.dup
 		
 		data = ""
 		while data !~ /\r\n\r\n/ && data.size < MAX_HEADER_SIZE
@@ -94,6 +94,18 @@ class IO
 			return PhusionPassenger::NativeSupport.writev3(fileno,
 				components, components2, components3)
 		end
+		
+		if PhusionPassenger::NativeSupport.respond_to?(:write_rack_response)
+			# Writes a Rack response in the format that the HelperAgent expects,
+			# serializing the headers into +buffer+. Returns true if the entire
+			# response has been written, false if the caller must still write
+			# the body, or nil if nothing has been written because the caller
+			# must handle the response itself.
+			def write_rack_response(buffer, status, headers, body)
+				return PhusionPassenger::NativeSupport.write_rack_response(fileno,
+					buffer, status, headers, body)
+			end
+		end
 	else
 		def writev(components)
 			return write(components.join(''))
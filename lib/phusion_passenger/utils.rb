@@ -187,6 +187,12 @@ module Utils
 		def split_by_null_into_hash(data)
 			return PhusionPassenger::NativeSupport.split_by_null_into_hash(data)
 		end
+		
+		# Parses the given SCGI header data into a new Rack env, which starts out
+		# as a copy of +template+.
+		def parse_scgi_headers_into_env(data, template)
+			return PhusionPassenger::NativeSupport.parse_scgi_headers_into_env(data, template)
+		end
 	else
 		NULL = "\0".freeze
 		
@@ -195,6 +201,10 @@ module Utils
 			args.pop
 			return Hash[*args]
 		end
+		
+		def parse_scgi_headers_into_env(data, template)
+			return template.dup.update(split_by_null_into_hash(data))
+		end
 	end
 	
 	####################################
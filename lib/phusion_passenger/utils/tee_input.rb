@@ -70,8 +70,15 @@ module Utils
 #
 # When processing uploads, Unicorn exposes a TeeInput object under
 # "rack.input" of the Rack environment.
+#
+# Bodies are kept in memory until they grow larger than
+# client_body_buffer_size, and only then spilled to a temporary file. If
+# the HelperAgent has already buffered the entire body and it is small
+# enough, then it is read in one go and nothing has to be tee'd at all.
 class TeeInput
   CONTENT_LENGTH = "CONTENT_LENGTH".freeze
+  PASSENGER_REQUEST_BODY_BUFFERED = "PASSENGER_REQUEST_BODY_BUFFERED".freeze
+  TRUE_STR = "true".freeze
 
   # The maximum size (in +bytes+) to buffer in memory before
   # resorting to a temporary file.  Default is 112 kilobytes.
@@ -95,8 +102,16 @@ class TeeInput
     @len = env[CONTENT_LENGTH]
     @len = @len.to_i if @len
     @socket = socket
-    @tmp = @len && @len <= @@client_body_buffer_size ?
-           StringIO.new("") : TmpIO.new("PassengerTeeInput")
+    if @len && @len <= @@client_body_buffer_size &&
+       env[PASSENGER_REQUEST_BODY_BUFFERED] == TRUE_STR
+      # The entire body is already waiting in the socket buffer.
+      @tmp = StringIO.new(@len > 0 ? (socket.read(@len) || "") : "")
+      @socket = nil
+    elsif @len && @len > @@client_body_buffer_size
+      @tmp = TmpIO.new("PassengerTeeInput")
+    else
+      @tmp = StringIO.new("")
+    end
   end
 
   def close
@@ -164,10 +179,21 @@ private
 
   def tee(buffer)
     if buffer && buffer.size > 0
+      if @tmp.is_a?(StringIO) && @tmp.size + buffer.size > @@client_body_buffer_size
+        spill!
+      end
       @tmp.write(buffer)
     end
     buffer
   end
+
+  # Moves the data buffered so far from memory to a temporary file.
+  def spill!
+    tmp = TmpIO.new("PassengerTeeInput")
+    tmp.write(@tmp.string)
+    tmp.pos = @tmp.pos
+    @tmp = tmp
+  end
 end
 
 end # module Utils
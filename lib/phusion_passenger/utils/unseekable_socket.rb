@@ -140,6 +140,12 @@ class UnseekableSocket
 		raise annotate(e)
 	end if IO.method_defined?(:writev3)
 	
+	def write_rack_response(buffer, status, headers, body)
+		@socket.write_rack_response(buffer, status, headers, body)
+	rescue => e
+		raise annotate(e)
+	end if IO.method_defined?(:write_rack_response)
+	
 	def send(*args)
 		@socket.send(*args)
 	rescue => e
@@ -0,0 +1,107 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/CgroupManager.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_CgroupManagerTest {
+		TempDir tmpDir;
+		CgroupManager manager;
+		Options options;
+
+		ApplicationPool2_CgroupManagerTest()
+			: tmpDir("tmp.cgroup"),
+			  manager("tmp.cgroup/passenger")
+		{
+			options.appRoot = "/apps/foo";
+		}
+
+		string cgroupDir() const {
+			return "tmp.cgroup/passenger/" +
+				CgroupManager::cgroupNameFor(options.getAppGroupName());
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_CgroupManagerTest);
+
+	TEST_METHOD(1) {
+		// cgroupNameFor() returns file names that keep different app
+		// group names apart.
+		string name = CgroupManager::cgroupNameFor("/apps/foo (production)");
+		ensure(startsWith(name, "app-_apps_foo__production_-"));
+		ensure_equals(name.find('/'), string::npos);
+		ensure(CgroupManager::cgroupNameFor("/apps/foo (production)")
+			== name);
+		ensure(CgroupManager::cgroupNameFor("/apps_foo (production)")
+			!= name);
+		ensure(CgroupManager::cgroupNameFor(string(1000, 'x')).size() < 100);
+	}
+
+	TEST_METHOD(2) {
+		// The CPU weight follows capacityWeight, within the kernel's limits.
+		// memory.high follows memoryLimit and maxProcesses.
+		options.capacityWeight = 0;
+		ensure_equals(CgroupManager::cpuWeightFor(options), 100u);
+		options.capacityWeight = 3;
+		ensure_equals(CgroupManager::cpuWeightFor(options), 300u);
+		options.capacityWeight = 1000;
+		ensure_equals(CgroupManager::cpuWeightFor(options), 10000u);
+
+		ensure_equals(CgroupManager::memoryHighFor(options), 0ull);
+		options.memoryLimit = 512;
+		ensure_equals(CgroupManager::memoryHighFor(options), 0ull);
+		options.maxProcesses = 4;
+		ensure_equals(CgroupManager::memoryHighFor(options), 2048ull * 1024 * 1024);
+	}
+
+	TEST_METHOD(3) {
+		// parseCpuPressure() returns the "some avg10" value.
+		ensure_equals(CgroupManager::parseCpuPressure(
+			"some avg10=12.50 avg60=3.00 avg300=1.00 total=123456\n"
+			"full avg10=1.00 avg60=0.00 avg300=0.00 total=0\n"), 12.5);
+		ensure_equals(CgroupManager::parseCpuPressure(
+			"full avg10=1.00 avg60=0.00 avg300=0.00 total=0\n"), -1.0);
+		ensure_equals(CgroupManager::parseCpuPressure(""), -1.0);
+	}
+
+	TEST_METHOD(4) {
+		// prepare() creates the cgroup, sets its limits and returns the
+		// path of its cgroup.procs file.
+		options.capacityWeight = 2;
+		options.memoryLimit = 100;
+		options.maxProcesses = 2;
+		ensure_equals(manager.prepare(options), cgroupDir() + "/cgroup.procs");
+		ensure_equals(readAll("tmp.cgroup/passenger/cgroup.subtree_control"),
+			"+cpu +memory");
+		ensure_equals(readAll(cgroupDir() + "/cpu.weight"), "200");
+		ensure_equals(readAll(cgroupDir() + "/memory.high"), "209715200");
+
+		options.memoryLimit = 0;
+		manager.prepare(options);
+		ensure_equals(readAll(cgroupDir() + "/memory.high"), "max");
+
+		ensure(CgroupManager::addProcess(cgroupDir() + "/cgroup.procs", 1234));
+		ensure_equals(readAll(cgroupDir() + "/cgroup.procs"), "1234");
+	}
+
+	TEST_METHOD(5) {
+		// getCpuPressure() reads the pressure of prepared cgroups only,
+		// and returns -1 when cgroups are disabled.
+		ensure_equals(manager.getCpuPressure(options.getAppGroupName()), -1.0);
+		manager.prepare(options);
+		ensure_equals(manager.getCpuPressure(options.getAppGroupName()), -1.0);
+
+		CgroupManager manager2("tmp.cgroup/passenger");
+		manager2.prepare(options);
+		createFile(cgroupDir() + "/cpu.pressure",
+			"some avg10=55.00 avg60=0.00 avg300=0.00 total=0\n");
+		ensure_equals(manager2.getCpuPressure(options.getAppGroupName()), 55.0);
+
+		CgroupManager disabled("");
+		ensure(!disabled.enabled());
+		ensure_equals(disabled.prepare(options), "");
+		ensure_equals(disabled.getCpuPressure(options.getAppGroupName()), -1.0);
+	}
+}
@@ -0,0 +1,68 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/ConcurrencyTuner.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_ConcurrencyTunerTest {
+		ConcurrencyTuner tuner;
+
+		/** Records windows of sessions that all took `duration`, with
+		 * `concurrentSessions` sessions open at the same time. */
+		void recordWindows(unsigned int count, unsigned long long duration,
+			unsigned int concurrentSessions)
+		{
+			for (unsigned int i = 0; i < count * ConcurrencyTuner::WINDOW_SIZE; i++) {
+				tuner.recordSession(duration, concurrentSessions);
+			}
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_ConcurrencyTunerTest);
+
+	TEST_METHOD(1) {
+		// It does nothing unless enabled.
+		ensure(!tuner.isEnabled());
+		recordWindows(10, 1000, 1);
+		ensure_equals(tuner.getLimit(), 1u);
+
+		tuner.enable(4, 16);
+		ensure(tuner.isEnabled());
+		ensure_equals(tuner.getLimit(), 4u);
+		tuner.enable(4, 0);
+		ensure(!tuner.isEnabled());
+	}
+
+	TEST_METHOD(2) {
+		// The limit grows up to the maximum while the process uses it and
+		// its response times don't rise.
+		tuner.enable(4, 16);
+		for (unsigned int i = 0; i < 100; i++) {
+			recordWindows(1, 1000, tuner.getLimit());
+		}
+		ensure_equals(tuner.getLimit(), 16u);
+	}
+
+	TEST_METHOD(3) {
+		// The limit doesn't grow if the process doesn't use it.
+		tuner.enable(8, 16);
+		recordWindows(100, 1000, 2);
+		ensure(tuner.getLimit() <= 8u);
+	}
+
+	TEST_METHOD(4) {
+		// The limit shrinks when the response times rise with load,
+		// i.e. when the process is saturated.
+		tuner.enable(16, 16);
+		recordWindows(1, 1000, 16);
+		for (unsigned int i = 0; i < 100; i++) {
+			// Saturated beyond 4 concurrent sessions.
+			unsigned int limit = tuner.getLimit();
+			recordWindows(1, 1000 * std::max(1u, limit / 4), limit);
+		}
+		ensure(tuner.getLimit() < 12u);
+		ensure(tuner.getLimit() >= 4u);
+	}
+}
@@ -0,0 +1,62 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/CpuAffinity.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_CpuAffinityTest {
+		CpuTopology topology;
+
+		ApplicationPool2_CpuAffinityTest() {
+			// Two nodes with two CPUs each.
+			topology.nodes.push_back(parseCpuList("0-1"));
+			topology.nodes.push_back(parseCpuList("2,3"));
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_CpuAffinityTest);
+
+	TEST_METHOD(1) {
+		// parseCpuList() and cpuListToString() convert between CPU lists
+		// and CPU numbers.
+		vector<unsigned int> cpus = parseCpuList("0-3,8,10-11\n");
+		ensure_equals(cpus.size(), 7u);
+		ensure_equals(cpus[0], 0u);
+		ensure_equals(cpus[3], 3u);
+		ensure_equals(cpus[4], 8u);
+		ensure_equals(cpus[6], 11u);
+		ensure_equals(cpuListToString(cpus), "0-3,8,10-11");
+		ensure_equals(cpuListToString(parseCpuList("")), "");
+		ensure_equals(cpuListToString(parseCpuList("5")), "5");
+	}
+
+	TEST_METHOD(2) {
+		// The round-robin policy pins every process to the next CPU.
+		CpuAffinityAllocator allocator(topology);
+		if (allocator.allocate("round-robin", "foo").empty()) {
+			// Not supported on this platform.
+			return;
+		}
+		ensure_equals(cpuListToString(allocator.allocate("round-robin", "foo")), "1");
+		ensure_equals(cpuListToString(allocator.allocate("round-robin", "bar")), "2");
+		ensure_equals(cpuListToString(allocator.allocate("round-robin", "foo")), "3");
+		ensure_equals(cpuListToString(allocator.allocate("round-robin", "foo")), "0");
+		ensure("No pinning by default", allocator.allocate("", "foo").empty());
+	}
+
+	TEST_METHOD(3) {
+		// The numa-node policy keeps every group on one node, and spreads
+		// the groups over the nodes.
+		CpuAffinityAllocator allocator(topology);
+		if (allocator.allocate("numa-node", "foo").empty()) {
+			// Not supported on this platform.
+			return;
+		}
+		ensure_equals(cpuListToString(allocator.allocate("numa-node", "foo")), "0-1");
+		ensure_equals(cpuListToString(allocator.allocate("numa-node", "bar")), "2-3");
+		ensure_equals(cpuListToString(allocator.allocate("numa-node", "foo")), "0-1");
+		ensure_equals(cpuListToString(allocator.allocate("numa-node", "baz")), "0-1");
+	}
+}
@@ -0,0 +1,93 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/DemandTracker.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_DemandTrackerTest {
+		DemandTracker tracker;
+
+		static unsigned long long sec(double value) {
+			return (unsigned long long) (value * 1000000);
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_DemandTrackerTest);
+
+	TEST_METHOD(1) {
+		// Arrivals are counted per second, and expire once they
+		// fall out of the window.
+		for (int i = 0; i < 3; i++) {
+			tracker.recordArrival(sec(100));
+		}
+		tracker.recordArrival(sec(101.5));
+		tracker.recordArrival(sec(101.6));
+		ensure_equals(tracker.getArrivals(sec(101.7), 0, 5), 5u);
+		ensure_equals(tracker.getArrivals(sec(101.7), 0, 1), 2u);
+		ensure_equals(tracker.getArrivals(sec(106.9), 0, 5), 0u);
+		ensure_equals(tracker.getArrivals(sec(106.9), 5, 5), 5u);
+		ensure_equals(tracker.getArrivals(sec(110.5), 5, 5), 2u);
+
+		// A bucket that is reused for a later second starts over.
+		tracker.recordArrival(sec(110.5));
+		ensure_equals(tracker.getArrivals(sec(110.5), 0, 1), 1u);
+		ensure_equals(tracker.getArrivals(sec(110.5), 0, 10), 3u);
+	}
+
+	TEST_METHOD(2) {
+		// projectDemand() takes the larger of the peak concurrency and the
+		// concurrency implied by the arrival rate, and extrapolates the
+		// growth of the arrival rate.
+		tracker.sessionOpened(sec(200));
+		tracker.sessionOpened(sec(200));
+		tracker.sessionOpened(sec(200));
+		tracker.sessionClosed();
+		tracker.sessionClosed();
+		ensure_equals(tracker.getActiveSessions(), 1u);
+		ensure_equals(tracker.getPeakSessions(sec(200.5), 5), 3u);
+		ensure_equals(tracker.projectDemand(sec(200.5), 0), 3.0);
+
+		// 15 arrivals in 5 seconds that each take 2 seconds imply 6
+		// concurrent requests. Without older arrivals, the growth
+		// factor is capped at 2.
+		for (int i = 0; i < 15; i++) {
+			tracker.recordArrival(sec(200));
+		}
+		ensure_equals(tracker.projectDemand(sec(200.5), sec(2)), 12.0);
+
+		// Compared to 10 older arrivals, the growth factor is 1.5.
+		for (int i = 0; i < 10; i++) {
+			tracker.recordArrival(sec(195));
+		}
+		ensure_equals(tracker.projectDemand(sec(200.5), sec(2)), 9.0);
+		ensure_equals(tracker.projectDemand(sec(200.5), sec(0.1)), 4.5);
+
+		// Once everything has expired, only the open session remains.
+		ensure_equals(tracker.getPeakSessions(sec(210), 5), 1u);
+		ensure_equals(tracker.projectDemand(sec(210), sec(2)), 1.0);
+	}
+
+	TEST_METHOD(3) {
+		// The sustained peak only drops after concurrency has stayed lower
+		// for a full window.
+		tracker.sessionOpened(sec(300));
+		tracker.sessionOpened(sec(300));
+		tracker.sessionOpened(sec(300));
+		tracker.sessionClosed();
+		tracker.sessionClosed();
+		ensure_equals(tracker.getSustainedPeakSessions(sec(301), sec(60)), 3u);
+		ensure_equals(tracker.getSustainedPeakWindowEnd(sec(60)), sec(361));
+
+		ensure_equals(tracker.getSustainedPeakSessions(sec(360), sec(60)), 3u);
+		ensure_equals(tracker.getSustainedPeakSessions(sec(362), sec(60)), 1u);
+
+		// A peak in the current window is remembered during the next one.
+		tracker.sessionOpened(sec(400));
+		tracker.sessionClosed();
+		ensure_equals(tracker.getSustainedPeakSessions(sec(421), sec(60)), 2u);
+		ensure_equals(tracker.getSustainedPeakSessions(sec(423), sec(60)), 2u);
+		ensure_equals(tracker.getSustainedPeakSessions(sec(484), sec(60)), 1u);
+	}
+}
@@ -0,0 +1,92 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/ForkExec.h>
+#include <Utils/IOUtils.h>
+#include <sys/wait.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_ForkExecTest {
+		ExecPlan plan;
+		int status;
+
+		ApplicationPool2_ForkExecTest() {
+			status = -1;
+		}
+
+		void setCommand(const char *program, const char *arg1 = NULL,
+			const char *arg2 = NULL, const char *arg3 = NULL)
+		{
+			plan.program = program;
+			plan.args.push_back(program);
+			if (arg1 != NULL) plan.args.push_back(arg1);
+			if (arg2 != NULL) plan.args.push_back(arg2);
+			if (arg3 != NULL) plan.args.push_back(arg3);
+		}
+
+		/** Runs the plan and returns everything the child wrote to stdout and stderr. */
+		string run() {
+			Pipe p = createPipe();
+			plan.stdinFd = p.second;
+			plan.stdoutFd = p.second;
+			plan.stderrFd = p.second;
+			pid_t pid = forkAndExec(plan);
+			p.second.close();
+			string output = readAll(p.first);
+			waitpid(pid, &status, 0);
+			return output;
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_ForkExecTest);
+
+	TEST_METHOD(1) {
+		// It executes the command with the given arguments, environment
+		// and working directory.
+		setCommand("/bin/sh", "-c", "echo \"$0 $FOO\"; pwd", "hello");
+		plan.setenv("FOO", "bar");
+		plan.workingDirectoryPaths.push_back("/tmp");
+		plan.workingDirectoryPathsOutsideChroot.push_back("/tmp");
+		ensure_equals(run(), "hello bar\n/tmp\n");
+		ensure(WIFEXITED(status));
+		ensure_equals(WEXITSTATUS(status), 0);
+	}
+
+	TEST_METHOD(2) {
+		// It searches for the program in $PATH.
+		setCommand("sh", "-c", "echo ok");
+		plan.setenv("PATH", "/nonexistent:/usr/bin:/bin");
+		ensure_equals(run(), "ok\n");
+	}
+
+	TEST_METHOD(3) {
+		// Exec failures are reported in the spawn protocol's error format.
+		setCommand("/nonexistent/program");
+		string output = run();
+		ensure(containsSubstring(output, "!> Error\n!> \n"));
+		ensure(containsSubstring(output, "Cannot execute \"/nonexistent/program\": "));
+		ensure_equals(WEXITSTATUS(status), 1);
+	}
+
+	TEST_METHOD(4) {
+		// Working directory problems are reported.
+		setCommand("/bin/true");
+		plan.workingDirectoryPaths.push_back("/nonexistent");
+		plan.workingDirectoryPathsOutsideChroot.push_back("/nonexistent");
+		string output = run();
+		ensure(containsSubstring(output, "Unable to stat() directory '/nonexistent'"));
+		ensure_equals(WEXITSTATUS(status), 1);
+	}
+
+	TEST_METHOD(5) {
+		// Only stdin, stdout and stderr are inherited, and signal
+		// handlers are reset.
+		FileDescriptor fd(open("/dev/null", O_RDONLY));
+		ensure(fd != -1);
+		setCommand("/bin/sh", "-c", ("if [ -e /dev/fd/" + toString(fd) + " ]; "
+			"then echo leaked; else echo closed; fi").c_str());
+		ensure_equals(run(), "closed\n");
+	}
+}
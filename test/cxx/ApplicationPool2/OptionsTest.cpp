@@ -41,4 +41,41 @@ namespace tut {
 		ensure_equals(options2.environmentVariables[1].first, "PASSENGER_BAR");
 		ensure_equals(options2.environmentVariables[1].second, "bar");
 	}
+	
+	TEST_METHOD(2) {
+		// persist() shares the data of the fields that are not per-request
+		// between Options with the same values.
+		char uri[] = "/foo";
+		Options options;
+		options.appRoot = "appRoot";
+		options.environment = "production";
+		options.environmentVariables.push_back(make_pair("PASSENGER_FOO", "foo"));
+		options.uri = uri;
+		
+		Options options2 = options.copyAndPersist();
+		options.uri = "/bar";
+		Options options3 = options.copyAndPersist();
+		ensure_equals(options2.appRoot, "appRoot");
+		ensure_equals(options2.uri, "/foo");
+		ensure_equals(options3.uri, "/bar");
+		ensure_equals(options2.appRoot.data(), options3.appRoot.data());
+		ensure_equals(options2.environmentVariables[0].second.data(),
+			options3.environmentVariables[0].second.data());
+		uri[1] = 'x';
+		ensure_equals(options2.uri, "/foo");
+		
+		// Persisting a persisted Options object shares its data too.
+		Options options4 = options2.copyAndPersist();
+		ensure_equals(options4.environment.data(), options2.environment.data());
+		ensure_equals(options4.uri, "/foo");
+		
+		// Changed values are not shared.
+		Options options5 = options2;
+		options5.environment = "development";
+		options5.persist(options5);
+		ensure_equals(options5.environment, "development");
+		ensure_equals(options5.appRoot, "appRoot");
+		ensure_equals(options2.environment, "production");
+		ensure(options5.appRoot.data() != options2.appRoot.data());
+	}
 }
@@ -5,6 +5,7 @@
 #include <Utils/json.h>
 #include <MessageReadersWriters.h>
 #include <map>
+#include <set>
 #include <vector>
 #include <cerrno>
 #include <signal.h>
@@ -79,6 +80,13 @@ namespace tut {
 			mySessions.clear();
 		}
 
+		void getAndCloseSessions(Options options, unsigned int count) {
+			Ticket ticket;
+			for (unsigned int i = 0; i < count; i++) {
+				pool->get(options, &ticket).reset();
+			}
+		}
+
 		Options createOptions() {
 			Options options;
 			options.spawnMethod = "dummy";
@@ -187,7 +195,7 @@ namespace tut {
 		}
 	};
 	
-	DEFINE_TEST_GROUP_WITH_LIMIT(ApplicationPool2_PoolTest, 100);
+	DEFINE_TEST_GROUP_WITH_LIMIT(ApplicationPool2_PoolTest, 200);
 	
 	TEST_METHOD(1) {
 		// Test initial state.
@@ -204,7 +212,7 @@ namespace tut {
 		// as the new process is done spawning.
 		Options options = createOptions();
 		
-		ScopedLock l(pool->syncher);
+		PoolLock l(pool->syncher);
 		pool->asyncGet(options, callback, false);
 		ensure_equals(number, 0);
 		ensure(pool->getWaitlist.empty());
@@ -237,7 +245,7 @@ namespace tut {
 		ensure(!process->isTotallyBusy());
 		
 		// Verify test assertion.
-		ScopedLock l(pool->syncher);
+		PoolLock l(pool->syncher);
 		pool->asyncGet(options, callback, false);
 		ensure_equals("callback is immediately called", number, 2);
 	}
@@ -358,7 +366,7 @@ namespace tut {
 		
 		// Now open another session. It should complete immediately
 		// and should not use the first process.
-		ScopedLock l(pool->syncher);
+		PoolLock l(pool->syncher);
 		pool->asyncGet(options, callback, false);
 		ensure_equals("asyncGet() completed immediately", number, 2);
 		SessionPtr session2 = currentSession;
@@ -391,7 +399,7 @@ namespace tut {
 		GroupPtr group = pool->findOrCreateGroup(options);
 		spawnerConfig->concurrency = 2;
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			group->spawn();
 		}
 		EVENTUALLY(5,
@@ -510,7 +518,7 @@ namespace tut {
 		);
 		
 		// The next asyncGet() should spawn a new process and the action should be queued.
-		ScopedLock l(pool->syncher);
+		PoolLock l(pool->syncher);
 		spawnerConfig->spawnTime = 5000000;
 		pool->asyncGet(options, callback, false);
 		ensure(group->spawning());
@@ -814,7 +822,7 @@ namespace tut {
 		SystemTime::force(2);
 		GroupPtr barGroup = pool->get(options2, &ticket)->getGroup();
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals("(1)", barGroup->spawn(), SR_OK);
 		}
 		debug->debugger->recv("Begin spawn loop iteration 1");
@@ -837,7 +845,7 @@ namespace tut {
 		debug->messages->send("Proceed with spawn loop iteration 2");
 		debug->debugger->recv("Spawn loop done");
 		EVENTUALLY(5,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			vector<ProcessPtr> processes = pool->getProcesses(false);
 			if (processes.size() == 1) {
 				GroupPtr group = processes[0]->getGroup();
@@ -899,7 +907,7 @@ namespace tut {
 		debug->messages->send("Proceed with spawn loop iteration 2");
 		debug->debugger->recv("Spawn loop done");
 		EVENTUALLY(5,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			vector<ProcessPtr> processes = pool->getProcesses(false);
 			if (processes.size() == 1) {
 				GroupPtr group = processes[0]->getGroup();
@@ -934,7 +942,7 @@ namespace tut {
 		ProcessPtr process = currentSession->getProcess();
 		pool->detachProcess(currentSession->getProcess());
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure(process->enabled == Process::DETACHED);
 		}
 		EVENTUALLY(5,
@@ -965,13 +973,13 @@ namespace tut {
 		pool->asyncGet(options, callback);
 		
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(pool->superGroups.get("test")->defaultGroup->getWaitlist.size(), 1u);
 		}
 
 		pool->detachProcess(session1->getProcess());
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure(pool->superGroups.get("test")->defaultGroup->spawning());
 			ensure_equals(pool->superGroups.get("test")->defaultGroup->enabledCount, 0);
 			ensure_equals(pool->superGroups.get("test")->defaultGroup->getWaitlist.size(), 1u);
@@ -1003,7 +1011,7 @@ namespace tut {
 		spawnerConfig->spawnTime = 90000;
 		pool->asyncGet(options2, callback);
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(pool->getWaitlist.size(), 1u);
 		}
 
@@ -1016,7 +1024,7 @@ namespace tut {
 		currentSession.reset();
 		pool->detachProcess(session1->getProcess());
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure(pool->superGroups.get("test2") != NULL);
 			ensure_equals(pool->getWaitlist.size(), 0u);
 		}
@@ -1037,7 +1045,7 @@ namespace tut {
 		currentSession.reset();
 		SuperGroupPtr superGroup = process->getSuperGroup();
 		pool->detachProcess(process);
-		LockGuard l(pool->syncher);
+		PoolLockGuard l(pool->syncher);
 		ensure_equals(pool->superGroups.size(), 1u);
 		ensure(superGroup->isAlive());
 		ensure(!superGroup->garbageCollectable());
@@ -1054,18 +1062,18 @@ namespace tut {
 
 		ensure(pool->detachProcess(process));
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(process->enabled, Process::DETACHED);
 		}
 		SHOULD_NEVER_HAPPEN(100,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = !process->isAlive()
 				|| !process->osProcessExists();
 		);
 
 		session.reset();
 		EVENTUALLY(1,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = process->enabled == Process::DETACHED
 				&& !process->osProcessExists()
 				&& process->isDead();
@@ -1085,7 +1093,7 @@ namespace tut {
 
 		ensure(pool->detachProcess(process));
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(process->enabled, Process::DETACHED);
 		}
 		EVENTUALLY(1,
@@ -1093,7 +1101,7 @@ namespace tut {
 		);
 
 		SHOULD_NEVER_HAPPEN(100,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = process->isDead()
 				|| !process->osProcessExists();
 		);
@@ -1102,7 +1110,7 @@ namespace tut {
 		g.clear();
 
 		EVENTUALLY(1,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = process->enabled == Process::DETACHED
 				&& !process->osProcessExists()
 				&& process->isDead();
@@ -1119,7 +1127,7 @@ namespace tut {
 		ensure_equals("Disabling succeeds",
 			pool->disableProcess(processes[0]->gupid), DR_SUCCESS);
 		
-		LockGuard l(pool->syncher);
+		PoolLockGuard l(pool->syncher);
 		ensure(processes[0]->isAlive());
 		ensure_equals("Process is disabled",
 			processes[0]->enabled,
@@ -1190,7 +1198,7 @@ namespace tut {
 		TempThread thr2(boost::bind(&ApplicationPool2_PoolTest::disableProcess,
 			this, session2->getProcess(), &code2));
 		EVENTUALLY(2,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = group->enabledCount == 0
 				&& group->disablingCount == 2
 				&& group->disabledCount == 0;
@@ -1209,7 +1217,7 @@ namespace tut {
 			result = code2 == DR_SUCCESS;
 		);
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(group->enabledCount, 1);
 			ensure_equals(group->disablingCount, 0);
 			ensure_equals(group->disabledCount, 2);
@@ -1237,7 +1245,7 @@ namespace tut {
 			this, session2->getProcess(), &code2));
 		EVENTUALLY(2,
 			GroupPtr group = session1->getGroup();
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = group->enabledCount == 0
 				&& group->disablingCount == 2
 				&& group->disabledCount == 0;
@@ -1256,7 +1264,7 @@ namespace tut {
 		);
 		{
 			GroupPtr group = session1->getGroup();
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(group->enabledCount, 2);
 			ensure_equals(group->disablingCount, 0);
 			ensure_equals(group->disabledCount, 0);
@@ -1314,7 +1322,7 @@ namespace tut {
 		ensure_equals(result, DR_SUCCESS);
 
 		{
-			ScopedLock l(pool->syncher);
+			PoolLock l(pool->syncher);
 			GroupPtr group = processes[0]->getGroup();
 			ensure_equals(group->enabledCount, 1);
 			ensure_equals(group->disablingCount, 0);
@@ -1850,7 +1858,7 @@ namespace tut {
 		}
 		ensure_equals(number, 0);
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(group->getWaitlist.size(),
 				3u);
 		}
@@ -1946,6 +1954,1042 @@ namespace tut {
 	//       when the session's connection has been released by the app.
 
 	
+	/*********** Test locking ***********/
+
+	TEST_METHOD(80) {
+		// Sessions for different groups can be checked out and closed
+		// concurrently without mixing up the session bookkeeping.
+		Options options1 = createOptions();
+		options1.appGroupName = "test1";
+		Options options2 = createOptions();
+		options2.appGroupName = "test2";
+		pool->get(options1, &ticket).reset();
+		pool->get(options2, &ticket).reset();
+
+		boost::thread thread(boost::bind(&ApplicationPool2_PoolTest::getAndCloseSessions,
+			this, options1, 1000));
+		getAndCloseSessions(options2, 1000);
+		thread.join();
+
+		PoolLockGuard l(pool->syncher);
+		vector<ProcessPtr> processes = pool->getProcesses(false);
+		ensure_equals(processes.size(), 2u);
+		for (unsigned int i = 0; i < processes.size(); i++) {
+			ensure_equals(processes[i]->sessions, 0);
+			ensure_equals(processes[i]->processed, 1001u);
+			ensure_equals(processes[i]->getGroup()->pqueue.top(), processes[i].get());
+		}
+	}
+
+	TEST_METHOD(81) {
+		// A restart that is noticed while checking out a session without the
+		// exclusive pool lock is still performed.
+		TempDirCopy dir("stub/wsgi", "tmp.wsgi");
+		Options options = createOptions();
+		options.appRoot = "tmp.wsgi";
+		options.appType = "wsgi";
+		options.spawnMethod = "direct";
+		options.statThrottleRate = 0;
+
+		SessionPtr session = pool->get(options, &ticket);
+		pid_t origPid = session->getPid();
+		session.reset();
+		touchFile("tmp.wsgi/tmp/restart.txt", 1);
+		session = pool->get(options, &ticket);
+		ensure(session->getPid() != origPid);
+	}
+
+	TEST_METHOD(82) {
+		// In latency-aware routing mode, asyncGet() prefers a process that
+		// has been responding quickly over an idle process that has been
+		// responding slowly.
+		Options options = createOptions();
+		options.minProcesses = 2;
+		options.latencyAwareRouting = true;
+		pool->setMax(2);
+		GroupPtr group = pool->findOrCreateGroup(options);
+		spawnerConfig->concurrency = 2;
+		{
+			PoolLockGuard l(pool->syncher);
+			group->spawn();
+		}
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 2;
+		);
+
+		SessionPtr session1 = pool->get(options, &ticket);
+		SessionPtr session2 = pool->get(options, &ticket);
+		ProcessPtr slowProcess = session1->getProcess();
+		ProcessPtr fastProcess = session2->getProcess();
+		ensure("Processes that haven't responded yet are routed to first",
+			slowProcess != fastProcess);
+		session2.reset();
+		usleep(50000);
+		session1.reset();
+
+		session1 = pool->get(options, &ticket);
+		session2 = pool->get(options, &ticket);
+		ensure(session1->getProcess() == fastProcess);
+		ensure(session2->getProcess() == fastProcess);
+	}
+
+	TEST_METHOD(83) {
+		// With spawnAheadUtilization set, a process is spawned ahead of
+		// demand even though the existing process isn't busy right now.
+		Options options = createOptions();
+		options.spawnAheadUtilization = 50;
+		pool->setMax(2);
+		spawnerConfig->concurrency = 1;
+		pool->get(options, &ticket).reset();
+		ensure_equals(pool->getProcessCount(), 1u);
+
+		pool->get(options, &ticket).reset();
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 2;
+		);
+	}
+
+	TEST_METHOD(84) {
+		// Without it, an idle process is enough.
+		Options options = createOptions();
+		pool->setMax(2);
+		spawnerConfig->concurrency = 1;
+		pool->get(options, &ticket).reset();
+		pool->get(options, &ticket).reset();
+		SHOULD_NEVER_HAPPEN(100,
+			result = pool->getProcessCount() > 1;
+		);
+	}
+
+	TEST_METHOD(86) {
+		// With maxConcurrentSpawns set, a group spawns multiple processes
+		// at the same time.
+		Options options = createOptions();
+		options.minProcesses = 4;
+		options.maxConcurrentSpawns = 3;
+		pool->setMax(4);
+		spawnerConfig->spawnTime = 300000;
+		GroupPtr group = pool->findOrCreateGroup(options);
+		{
+			PoolLockGuard l(pool->syncher);
+			group->spawn();
+			ensure_equals(group->capacityUsed() - group->getProcessCount(), 3u);
+		}
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 4;
+		);
+		PoolLockGuard l(pool->syncher);
+		ensure(!group->spawning());
+		ensure_equals(group->capacityUsed() - group->getProcessCount(), 0u);
+	}
+
+	TEST_METHOD(87) {
+		// The pool-wide spawn concurrency limit caps the number of additional
+		// concurrent spawns, but every group may always spawn one process.
+		Options options1 = createOptions();
+		options1.appGroupName = "test1";
+		options1.minProcesses = 3;
+		options1.maxConcurrentSpawns = 3;
+		Options options2 = options1;
+		options2.appGroupName = "test2";
+		pool->setMax(6);
+		pool->setMaxConcurrentSpawns(2);
+		spawnerConfig->spawnTime = 300000;
+		GroupPtr group1 = pool->findOrCreateGroup(options1);
+		GroupPtr group2 = pool->findOrCreateGroup(options2);
+		{
+			PoolLockGuard l(pool->syncher);
+			group1->spawn();
+			ensure_equals(group1->capacityUsed() - group1->getProcessCount(), 2u);
+			group2->spawn();
+			ensure_equals(group2->capacityUsed() - group2->getProcessCount(), 1u);
+		}
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 6;
+		);
+	}
+
+	TEST_METHOD(88) {
+		// With standbyProcesses set, a standby process is spawned once the
+		// group serves traffic. It is attached instantly when the group
+		// needs more capacity.
+		Options options = createOptions();
+		options.standbyProcesses = 1;
+		pool->setMax(3);
+		spawnerConfig->concurrency = 1;
+		SessionPtr session1 = pool->get(options, &ticket);
+		GroupPtr group = session1->getGroup();
+		EVENTUALLY(5,
+			PoolLockGuard l(pool->syncher);
+			result = group->standbyProcesses.size() == 1;
+		);
+		ensure_equals(pool->getProcessCount(), 1u);
+		ensure_equals(pool->capacityUsed(), 2u);
+
+		spawnerConfig->spawnTime = 5000000;
+		pool->asyncGet(options, callback);
+		ensure_equals("The standby process handles the request without waiting for a spawn",
+			number, 1);
+		ensure(currentSession->getProcess() != session1->getProcess());
+		ensure_equals(pool->getProcessCount(), 2u);
+		PoolLockGuard l(pool->syncher);
+		ensure(group->standbyProcesses.empty());
+	}
+
+	TEST_METHOD(89) {
+		// The warmup requests in warmupUrls are sent to a new process
+		// before it handles any real requests.
+		TempDirCopy dir("stub/wsgi", "tmp.wsgi");
+		Options options = createOptions();
+		options.appRoot = "tmp.wsgi";
+		options.appType = "wsgi";
+		options.spawnMethod = "direct";
+		options.warmupUrls = "/cacheable /cacheable?foo=bar";
+
+		ensure_equals(sendRequest(options, "/cacheable"), "Response 3");
+	}
+
+	TEST_METHOD(90) {
+		// A process that uses more memory than memoryLimit is detached
+		// after the next metrics collection.
+		TempDirCopy dir("stub/wsgi", "tmp.wsgi");
+		Options options = createOptions();
+		options.appRoot = "tmp.wsgi";
+		options.appType = "wsgi";
+		options.spawnMethod = "direct";
+		options.memoryLimit = 1;
+
+		SessionPtr session = pool->get(options, &ticket);
+		ProcessPtr process = session->getProcess();
+		session.reset();
+		EVENTUALLY(15,
+			PoolLockGuard l(pool->syncher);
+			result = process->enabled == Process::DETACHED;
+		);
+		ensure(!process->memoryLimitOobwPerformed);
+	}
+
+	TEST_METHOD(91) {
+		// The process and SuperGroup indexes follow attaches and detaches.
+		Options options = createOptions();
+		SessionPtr session = pool->get(options, &ticket);
+		ProcessPtr process = session->getProcess();
+		SuperGroupPtr superGroup = process->getSuperGroup();
+		session.reset();
+
+		ensure_equals(pool->findProcessByPid(process->pid), process);
+		ensure_equals(pool->findProcessByGupid(process->gupid), process);
+		ensure_equals(pool->findSuperGroupBySecret(superGroup->secret), superGroup);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(process->getGroup()->enabledProcessesByStickySessionId[
+				process->stickySessionId], process.get());
+		}
+
+		ensure(pool->detachProcess(process->gupid));
+		ensure(pool->findProcessByPid(process->pid) == NULL);
+		ensure(pool->findProcessByGupid(process->gupid) == NULL);
+
+		ensure(pool->detachSuperGroupByName(superGroup->name));
+		ensure(pool->findSuperGroupBySecret(superGroup->secret) == NULL);
+	}
+
+	TEST_METHOD(92) {
+		// Get waiters are served by priority, and when the request queue
+		// is full, the lowest priority waiters are rejected first.
+		Options options = createOptions();
+		options.appGroupName = "test1";
+		options.maxRequestQueueSize = 3;
+		GroupPtr group = pool->findOrCreateGroup(options);
+		spawnerConfig->concurrency = 3;
+		initPoolDebugging();
+		pool->setMax(1);
+
+		pool->asyncGet(options, callback);
+		pool->asyncGet(options, callback);
+		options.requestPriority = 5;
+		pool->asyncGet(options, callback);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(group->getWaitlist.size(), 3u);
+			ensure_equals(group->getWaitlist[0].options.requestPriority, 5u);
+			ensure_equals(group->getWaitlist[1].options.requestPriority, 0u);
+			ensure_equals(group->getWaitlist[2].options.requestPriority, 0u);
+		}
+
+		options.requestPriority = 3;
+		pool->asyncGet(options, callback);
+		ensure_equals("A priority 0 waiter is rejected", number, 1);
+		ensure(currentException != NULL);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(group->getWaitlist.size(), 3u);
+			ensure_equals(group->getWaitlist[0].options.requestPriority, 5u);
+			ensure_equals(group->getWaitlist[1].options.requestPriority, 3u);
+			ensure_equals(group->getWaitlist[2].options.requestPriority, 0u);
+		}
+
+		options.requestPriority = 0;
+		try {
+			pool->get(options, &ticket);
+			fail("Expected RequestQueueFullException");
+		} catch (const RequestQueueFullException &e) {
+			// OK
+		}
+
+		debug->messages->send("Proceed with spawn loop iteration 1");
+		debug->messages->send("Spawn loop done");
+		EVENTUALLY(5,
+			result = number == 4;
+		);
+	}
+
+	TEST_METHOD(93) {
+		// A waiter cannot be overtaken by higher priority waiters
+		// more than GetWaiter::MAX_OVERTAKES times.
+		Options options = createOptions();
+		deque<GetWaiter> waitlist;
+		waitlist.push_back(GetWaiter(options, callback));
+		options.requestPriority = 1;
+		for (unsigned int i = 0; i < GetWaiter::MAX_OVERTAKES + 1; i++) {
+			pushGetWaiterByPriority(waitlist, GetWaiter(options, callback));
+		}
+		ensure_equals(waitlist.size(), GetWaiter::MAX_OVERTAKES + 2);
+		ensure_equals(waitlist[GetWaiter::MAX_OVERTAKES].options.requestPriority, 0u);
+		ensure_equals(waitlist.back().options.requestPriority, 1u);
+	}
+
+	TEST_METHOD(94) {
+		// New requests are rejected when queued requests have been waiting
+		// longer than maxRequestQueueTime, and the queue wait is reported.
+		Options options = createOptions();
+		options.appGroupName = "test1";
+		options.maxRequestQueueTime = 50;
+		GroupPtr group = pool->findOrCreateGroup(options);
+		spawnerConfig->concurrency = 2;
+		initPoolDebugging();
+		pool->setMax(1);
+
+		pool->asyncGet(options, callback);
+		pool->asyncGet(options, callback);
+		ensure_equals(number, 0);
+		usleep(200000);
+		try {
+			pool->get(options, &ticket);
+			fail("Expected RequestQueueFullException");
+		} catch (const RequestQueueFullException &e) {
+			// OK
+		}
+
+		debug->messages->send("Proceed with spawn loop iteration 1");
+		debug->messages->send("Spawn loop done");
+		EVENTUALLY(5,
+			result = number == 2;
+		);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(group->queueWaits.getSampleCount(), 2u);
+			ensure(group->queueWaits.getPercentile(50) >= 200000);
+		}
+		ensure(pool->inspect().find("Queue wait: p50=") != string::npos);
+		ensure(pool->toXml().find("<queue_wait>") != string::npos);
+	}
+
+	TEST_METHOD(95) {
+		// getStatsSnapshot() reuses the last snapshot until it is too old or
+		// processes have been added or removed, and serializes to XML and JSON.
+		Options options = createOptions();
+		SessionPtr session = pool->get(options, &ticket);
+		string gupid = session->getProcess()->gupid;
+
+		PoolSnapshotPtr snapshot = pool->getStatsSnapshot();
+		ensure_equals(snapshot->processCount, 1u);
+		ensure_equals(snapshot->superGroups.size(), 1u);
+		ensure_equals(snapshot->superGroups[0].groups.size(), 1u);
+		ensure_equals(snapshot->superGroups[0].groups[0].processes.size(), 1u);
+		ensure_equals(snapshot->superGroups[0].groups[0].processes[0].sessions, 1);
+		ensure(snapshot->toXml().find("<process_count>1</process_count>") != string::npos);
+		ensure(snapshot->toXml().find("<sessions>1</sessions>") != string::npos);
+		ensure(snapshot->toXml(false).find("<secret>") == string::npos);
+		ensure(snapshot->toJson().find("\"process_count\":1") != string::npos);
+		ensure(snapshot->toJson(false).find("\"secret\"") == string::npos);
+		Json::Reader reader;
+		Json::Value doc;
+		ensure(reader.parse(snapshot->toJson(), doc));
+		ensure_equals(doc["supergroups"][0u]["groups"][0u]["processes"][0u]["sessions"].asInt(), 1);
+
+		session.reset();
+		ensure("The snapshot is reused", pool->getStatsSnapshot() == snapshot);
+		usleep(1000);
+		PoolSnapshotPtr snapshot2 = pool->getStatsSnapshot(0);
+		ensure("A new snapshot is created once the last one is too old",
+			snapshot2 != snapshot);
+		ensure_equals(snapshot2->superGroups[0].groups[0].processes[0].sessions, 0);
+
+		ensure(pool->detachProcess(gupid));
+		snapshot = pool->getStatsSnapshot();
+		ensure("A new snapshot is created after a process is detached",
+			snapshot != snapshot2);
+		ensure_equals(snapshot->processCount, 0u);
+	}
+
+	TEST_METHOD(96) {
+		// The idle process list contains the enabled processes without
+		// sessions, least recently used first.
+		Options options = createOptions();
+		SessionPtr session1 = pool->get(options, &ticket);
+		SessionPtr session2 = pool->get(options, &ticket);
+		ensure_equals(pool->getProcessCount(), 2u);
+		Process *process1 = session1->getProcess().get();
+		Process *process2 = session2->getProcess().get();
+		string gupid = process2->gupid;
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure(pool->idleProcesses.empty());
+		}
+
+		session2.reset();
+		session1.reset();
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(pool->idleProcesses.size(), 2u);
+			ensure_equals(pool->idleProcesses.front(), process2);
+			ensure_equals(IdleProcessList::next(process2), process1);
+			ensure(pool->inspect(Pool::InspectOptions(), false).find("Idle processes     : 2") != string::npos);
+		}
+
+		// A process that is given a session is no longer idle.
+		session1 = pool->get(options, &ticket);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(pool->idleProcesses.size(), 1u);
+			ensure(pool->idleProcesses.front() != session1->getProcess().get());
+		}
+		session1.reset();
+
+		ensure(pool->detachProcess(gupid));
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(pool->idleProcesses.size(), 1u);
+			ensure(pool->idleProcesses.front() != process2);
+		}
+	}
+
+
+	TEST_METHOD(97) {
+		// setProcessConcurrency() changes the concurrency of a process at
+		// runtime, and hands new capacity to queued requests.
+		Options options = createOptions();
+		options.maxTunedConcurrency = 8;
+		pool->setMax(1);
+		SessionPtr session = pool->get(options, &ticket);
+		ProcessPtr process = session->getProcess();
+		ensure_equals(process->concurrency, 1);
+		ensure("Single-threaded processes are not tuned",
+			!process->concurrencyTuner.isEnabled());
+
+		pool->asyncGet(options, callback);
+		usleep(20000);
+		ensure_equals(number, 0);
+
+		ensure(pool->setProcessConcurrency(process->pid, 2));
+		EVENTUALLY(5,
+			result = number == 1;
+		);
+		ensure_equals(process->concurrency, 2);
+		ensure(currentSession->getProcess() == process);
+		ensure(!pool->setProcessConcurrency((pid_t) -1, 2));
+	}
+
+	TEST_METHOD(98) {
+		// No more than maxOutOfBandWorkPercentage percent of the processes
+		// will be performing out-of-band work at the same time.
+		TempDirCopy dir("stub/wsgi", "tmp.wsgi");
+		Options options = createOptions();
+		options.appRoot = "tmp.wsgi";
+		options.appType = "wsgi";
+		options.spawnMethod = "direct";
+		options.maxOutOfBandWorkInstances = 3;
+		options.maxOutOfBandWorkPercentage = 50;
+		initPoolDebugging();
+		debug->restarting = false;
+		debug->spawning = false;
+		debug->oobw = true;
+
+		SessionPtr session1 = pool->get(options, &ticket);
+		SessionPtr session2 = pool->get(options, &ticket);
+		SessionPtr session3 = pool->get(options, &ticket);
+		session1->requestOOBW();
+		session1.reset();
+		session2->requestOOBW();
+		session2.reset();
+		session3.reset();
+
+		// Only 1 of the 3 processes may perform out-of-band work.
+		debug->debugger->recv("OOBW request about to start");
+		SHOULD_NEVER_HAPPEN(100,
+			result = debug->debugger->peek("OOBW request about to start") != NULL;
+		);
+
+		debug->messages->send("Proceed with OOBW request");
+		debug->debugger->recv("OOBW request finished");
+		debug->debugger->recv("OOBW request about to start");
+		debug->messages->send("Proceed with OOBW request");
+		debug->debugger->recv("OOBW request finished");
+	}
+
+	TEST_METHOD(99) {
+		// Out-of-band work is started no sooner than outOfBandWorkInterval
+		// after the previous one, even if the process receives no more
+		// requests in the meantime.
+		TempDirCopy dir("stub/wsgi", "tmp.wsgi");
+		Options options = createOptions();
+		options.appRoot = "tmp.wsgi";
+		options.appType = "wsgi";
+		options.spawnMethod = "direct";
+		options.maxOutOfBandWorkInstances = 2;
+		options.outOfBandWorkInterval = 300;
+		initPoolDebugging();
+		debug->restarting = false;
+		debug->spawning = false;
+		debug->oobw = true;
+
+		SessionPtr session1 = pool->get(options, &ticket);
+		SessionPtr session2 = pool->get(options, &ticket);
+		session1->requestOOBW();
+		session1.reset();
+		debug->debugger->recv("OOBW request about to start");
+		session2->requestOOBW();
+		session2.reset();
+		SHOULD_NEVER_HAPPEN(100,
+			result = debug->debugger->peek("OOBW request about to start") != NULL;
+		);
+
+		EVENTUALLY(3,
+			result = debug->debugger->peek("OOBW request about to start") != NULL;
+		);
+		debug->debugger->recv("OOBW request about to start");
+		debug->messages->send("Proceed with OOBW request");
+		debug->messages->send("Proceed with OOBW request");
+		debug->debugger->recv("OOBW request finished");
+		debug->debugger->recv("OOBW request finished");
+	}
+
+	TEST_METHOD(100) {
+		// Initializing a new SuperGroup, including the creation of its
+		// spawner, happens outside the pool lock so that it doesn't block
+		// get() requests for other applications.
+		Options options = createOptions();
+		SessionPtr session = pool->get(options, &ticket);
+		session.reset();
+
+		spawnerConfig->spawnerCreationSleepTime = 1000000;
+		Options options2 = createOptions();
+		options2.appGroupName = "test2";
+		pool->asyncGet(options2, callback);
+		usleep(50000);
+
+		unsigned long long startTime = SystemTime::getUsec();
+		session = pool->get(options, &ticket);
+		ensure("get() was not blocked by the other SuperGroup's initialization",
+			SystemTime::getUsec() - startTime < 500000);
+		session.reset();
+		EVENTUALLY(5,
+			result = number == 1;
+		);
+	}
+
+	TEST_METHOD(101) {
+		// If neither an app type nor a start command is given, the
+		// SuperGroup initializer detects the app type.
+		Options options = createOptions();
+		options.startCommand = "";
+		options.startupFile = "";
+		GroupPtr group = pool->findOrCreateGroup(options);
+		ensure_equals(string(group->options.appType), "rack");
+	}
+
+	TEST_METHOD(102) {
+		// If stat throttling is enabled, changes to restart.txt are
+		// noticed through the file change watcher instead of being
+		// delayed by the throttle.
+		TempDirCopy dir("stub/wsgi", "tmp.wsgi");
+		Options options = createOptions();
+		options.appRoot = "tmp.wsgi";
+		options.statThrottleRate = 100;
+		SessionPtr session = pool->get(options, &ticket);
+		pid_t pid = session->getPid();
+		session.reset();
+
+		touchFile("tmp.wsgi/tmp/restart.txt");
+		EVENTUALLY2(500, 10,
+			session = pool->get(options, &ticket);
+			result = session->getPid() != pid;
+			session.reset();
+		);
+	}
+
+	TEST_METHOD(103) {
+		// A rolling restart replaces all processes while the old ones keep
+		// serving requests, and may temporarily spawn processes on top of
+		// the pool limit.
+		Options options = createOptions();
+		options.minProcesses = 3;
+		options.maxSurge = 2;
+		pool->setMax(3);
+		SessionPtr session = pool->get(options, &ticket);
+		string groupName = session->getProcess()->getGroup()->name;
+		session.reset();
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 3;
+		);
+
+		set<pid_t> oldPids;
+		foreach (const ProcessPtr &process, pool->getProcesses()) {
+			oldPids.insert(process->pid);
+		}
+		ensure(pool->restartGroupByName(groupName, RM_ROLLING));
+
+		bool done = false;
+		unsigned long long deadline = SystemTime::getMsec() + 5000;
+		while (!done && SystemTime::getMsec() < deadline) {
+			vector<ProcessPtr> processes = pool->getProcesses();
+			ensure("Processes keep serving requests", processes.size() >= 3);
+			done = processes.size() == 3;
+			foreach (const ProcessPtr &process, processes) {
+				done = done && oldPids.find(process->pid) == oldPids.end();
+			}
+			usleep(10000);
+		}
+		ensure("All processes have been replaced", done);
+	}
+
+	TEST_METHOD(104) {
+		// If the pool is full, capacity for a new SuperGroup is reclaimed
+		// from the SuperGroup that is furthest above its fair share, even
+		// if another SuperGroup has an older idle process.
+		Options options = createOptions();
+		pool->setMax(3);
+
+		options.appRoot = "/foo";
+		pool->get(options, &ticket).reset();
+		SuperGroupPtr superGroup1 = pool->superGroups.get("/foo");
+
+		options.appRoot = "/bar";
+		options.minProcesses = 2;
+		pool->get(options, &ticket).reset();
+		SuperGroupPtr superGroup2 = pool->superGroups.get("/bar");
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 3;
+		);
+
+		options.appRoot = "/baz";
+		options.minProcesses = 1;
+		pool->get(options, &ticket).reset();
+		ensure_equals(pool->getProcessCount(), 3u);
+		ensure_equals(superGroup1->getProcessCount(), 1u);
+		ensure_equals(superGroup2->getProcessCount(), 1u);
+	}
+
+	TEST_METHOD(105) {
+		// Capacity is not reclaimed from SuperGroups that don't use more
+		// than their guaranteedCapacity, and the capacity weight counts
+		// towards a SuperGroup's fair share.
+		Options options = createOptions();
+		pool->setMax(3);
+
+		options.appRoot = "/foo";
+		pool->get(options, &ticket).reset();
+		SuperGroupPtr superGroup1 = pool->superGroups.get("/foo");
+
+		options.appRoot = "/bar";
+		options.minProcesses = 2;
+		options.guaranteedCapacity = 2;
+		pool->get(options, &ticket).reset();
+		SuperGroupPtr superGroup2 = pool->superGroups.get("/bar");
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 3;
+		);
+
+		options.appRoot = "/baz";
+		options.minProcesses = 1;
+		options.guaranteedCapacity = 0;
+		pool->get(options, &ticket).reset();
+		ensure_equals(superGroup1->getProcessCount(), 0u);
+		ensure_equals(superGroup2->getProcessCount(), 2u);
+
+		// /baz now has 1 process, /bar 2 processes at weight 3.
+		options.appRoot = "/bar";
+		options.minProcesses = 2;
+		options.guaranteedCapacity = 0;
+		options.capacityWeight = 3;
+		pool->get(options, &ticket).reset();
+		options.appRoot = "/qux";
+		options.minProcesses = 1;
+		options.capacityWeight = 1;
+		pool->get(options, &ticket).reset();
+		ensure_equals(pool->superGroups.get("/baz")->getProcessCount(), 0u);
+		ensure_equals(superGroup2->getProcessCount(), 2u);
+	}
+
+	TEST_METHOD(106) {
+		// A SuperGroup doesn't spawn more processes than its
+		// maxCapacityShare of the pool allows.
+		Options options = createOptions();
+		options.minProcesses = 4;
+		options.maxCapacityShare = 50;
+		pool->setMax(4);
+		pool->get(options, &ticket).reset();
+		EVENTUALLY(5,
+			result = pool->getProcessCount() == 2;
+		);
+		SHOULD_NEVER_HAPPEN(100,
+			result = pool->getProcessCount() > 2;
+		);
+	}
+
+	TEST_METHOD(107) {
+		// Waiters on the pool's wait list that have the same priority are
+		// served in weighted fair order.
+		Options options = createOptions();
+		options.appRoot = "/foo";
+		pool->getWaitlist.push_back(GetWaiter(options.copyAndPersist(), callback));
+		pool->getWaitlist.push_back(GetWaiter(options.copyAndPersist(), callback));
+		options.appRoot = "/bar";
+		options.capacityWeight = 2;
+		pool->getWaitlist.push_back(GetWaiter(options.copyAndPersist(), callback));
+		pool->getWaitlist.push_back(GetWaiter(options.copyAndPersist(), callback));
+		options.appRoot = "/baz";
+		options.requestPriority = 1;
+		pool->getWaitlist.insert(pool->getWaitlist.begin(),
+			GetWaiter(options.copyAndPersist(), callback));
+
+		pool->sortGetWaitlistByWeight();
+		vector<string> order;
+		foreach (const GetWaiter &waiter, pool->getWaitlist) {
+			order.push_back(waiter.options.getAppGroupName());
+		}
+		pool->getWaitlist.clear();
+		ensure_equals(order.size(), 5u);
+		ensure_equals(order[0], "/baz");
+		ensure_equals(order[1], "/bar");
+		ensure_equals(order[2], "/foo");
+		ensure_equals(order[3], "/bar");
+		ensure_equals(order[4], "/foo");
+	}
+
+	TEST_METHOD(108) {
+		// A detached process that won't shut down by itself is cleaned
+		// up as soon as its OS process exits, instead of on the next poll.
+		Options options = createOptions();
+		options.spawnMethod = "direct";
+		options.minProcesses = 0;
+		ProcessPtr process = pool->get(options, &ticket)->getProcess();
+
+		ScopeGuard g(boost::bind(::kill, process->pid, SIGCONT));
+		kill(process->pid, SIGSTOP);
+
+		ensure(pool->detachProcess(process));
+		EVENTUALLY(1,
+			result = process->getLifeStatus() == Process::SHUTDOWN_TRIGGERED;
+		);
+		SHOULD_NEVER_HAPPEN(200,
+			PoolLockGuard l(pool->syncher);
+			result = process->isDead();
+		);
+
+		kill(process->pid, SIGKILL);
+		g.clear();
+		EVENTUALLY2(50, 1,
+			PoolLockGuard l(pool->syncher);
+			result = process->isDead();
+		);
+	}
+
+	TEST_METHOD(109) {
+		// While a SessionCloseBatch is active, closing a session is only
+		// applied to the pool upon flushing the batch, and the flush
+		// assigns sessions to get waiters.
+		Options options = createOptions();
+		options.maxProcesses = 1;
+		SessionPtr session1 = pool->get(options, &ticket);
+		ProcessPtr process = session1->getProcess();
+		pool->asyncGet(options, callback);
+		ensure_equals(number, 0);
+
+		Pool::SessionCloseBatch batch(pool);
+		batch.activate();
+		session1.reset();
+		ensure(!batch.empty());
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(process->sessions, 1);
+		}
+		batch.flush();
+		batch.deactivate();
+		ensure(batch.empty());
+		ensure_equals(number, 1);
+		ensure_equals(currentSession->getProcess(), process);
+		currentSession.reset();
+		PoolLockGuard l(pool->syncher);
+		ensure_equals(process->sessions, 0);
+		ensure_equals(process->processed, 2u);
+	}
+
+	TEST_METHOD(110) {
+		// asyncGet() first flushes the calling thread's SessionCloseBatch,
+		// so that it sees the process as available.
+		Options options = createOptions();
+		SessionPtr session = pool->get(options, &ticket);
+		ProcessPtr process = session->getProcess();
+
+		Pool::SessionCloseBatch batch(pool);
+		batch.activate();
+		session.reset();
+		session = pool->get(options, &ticket);
+		batch.deactivate();
+		ensure(batch.empty());
+		ensure_equals(session->getProcess(), process);
+		ensure_equals(pool->getProcessCount(), 1u);
+	}
+
+	TEST_METHOD(111) {
+		// SessionLeases leases sessions along with a fast path checkout,
+		// but only as long as that doesn't make the process totally busy.
+		// Leased sessions are handed out without going through the pool,
+		// and are given back once they're recalled.
+		Options options = createOptions();
+		spawnerConfig->concurrency = 4;
+		pool->get(options, &ticket).reset();
+		SafeLibevPtr libev = boost::make_shared<SafeLibev>(ev_loop_new(EVFLAG_AUTO));
+		Pool::SessionLeasesPtr leases = boost::make_shared<Pool::SessionLeases>(pool, libev);
+		retainSessions = true;
+
+		leases->asyncGet(options, callback, 3);
+		ensure_equals(number, 1);
+		ensure_equals(leases->size(), 2u);
+		ProcessPtr process = currentSession->getProcess();
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(process->sessions, 3);
+		}
+
+		leases->asyncGet(options, callback, 3);
+		ensure_equals(number, 2);
+		ensure_equals(leases->size(), 1u);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(process->sessions, 3);
+		}
+
+		pool->recallSessionLeases();
+		ensure(leases->checkout(options) == NULL);
+		ensure_equals(leases->size(), 0u);
+		PoolLockGuard l(pool->syncher);
+		ensure_equals(process->sessions, 2);
+		ensure_equals(process->processed, 1u);
+	}
+
+	TEST_METHOD(112) {
+		// Nothing is leased if a process would become totally busy.
+		Options options = createOptions();
+		spawnerConfig->concurrency = 2;
+		pool->get(options, &ticket).reset();
+		SafeLibevPtr libev = boost::make_shared<SafeLibev>(ev_loop_new(EVFLAG_AUTO));
+		Pool::SessionLeasesPtr leases = boost::make_shared<Pool::SessionLeases>(pool, libev);
+
+		leases->asyncGet(options, callback, 3);
+		ensure_equals(number, 1);
+		ensure_equals(leases->size(), 0u);
+		ensure(leases->checkout(options) == NULL);
+	}
+
+	TEST_METHOD(113) {
+		// After SPAWN_FAILURE_THRESHOLD spawns in a row have failed, requests
+		// fail immediately with the last spawn error until the backoff period
+		// is over. Then a spawn is attempted again.
+		unsigned int threshold = Group::SPAWN_FAILURE_THRESHOLD;
+		initPoolDebugging();
+		Options options = createOptions();
+		setLogLevel(-2);
+		SystemTime::forceAll(1000000);
+		for (unsigned int i = 1; i <= threshold; i++) {
+			debug->messages->send("Fail spawn loop iteration " + toString(i));
+			pool->asyncGet(options, callback);
+			EVENTUALLY(5,
+				result = number == (int) i;
+			);
+			ensure(currentException != NULL);
+		}
+		ExceptionPtr lastException = currentException;
+
+		pool->asyncGet(options, callback);
+		ensure_equals(number, (int) threshold + 1);
+		ensure("The last spawn error is reused", currentException == lastException);
+		{
+			LockGuard l(debug->syncher);
+			ensure_equals("Nothing was spawned", debug->spawnLoopIteration, threshold);
+		}
+
+		SystemTime::forceAll(1000000 + Group::MAX_SPAWN_BACKOFF);
+		debug->messages->send("Proceed with spawn loop iteration " +
+			toString(threshold + 1));
+		pool->asyncGet(options, callback);
+		EVENTUALLY(5,
+			result = number == (int) threshold + 2;
+		);
+		ensure(currentException == NULL);
+		ensure(currentSession != NULL);
+	}
+
+	TEST_METHOD(114) {
+		// A cancelled get request doesn't take up a slot in the request
+		// queue, and is completed with an error instead of a session.
+		Options options = createOptions();
+		options.appGroupName = "test1";
+		options.maxRequestQueueSize = 2;
+		GroupPtr group = pool->findOrCreateGroup(options);
+		spawnerConfig->concurrency = 3;
+		initPoolDebugging();
+		pool->setMax(1);
+
+		GetCancellationPtr cancellation = boost::make_shared<GetCancellation>();
+		Options cancellable = options;
+		cancellable.cancellation = cancellation;
+		pool->asyncGet(cancellable, callback);
+		pool->asyncGet(options, callback);
+		cancellation->cancel();
+		pool->asyncGet(options, callback);
+		ensure_equals(number, 1);
+		ensure(dynamic_cast<GetAbortedException *>(currentException.get()) != NULL);
+		cancellable.cancellation.reset();
+		ensure("The pool no longer refers to the cancellation", cancellation.unique());
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(group->getWaitlist.size(), 2u);
+		}
+
+		debug->messages->send("Proceed with spawn loop iteration 1");
+		debug->messages->send("Spawn loop done");
+		EVENTUALLY(5,
+			result = number == 3;
+		);
+		ensure(currentException == NULL);
+	}
+
+	TEST_METHOD(115) {
+		// A SuperGroup that has had no processes and no requests for
+		// maxDormancyIdleTime is made dormant, and is recreated by the
+		// next request for it.
+		Options options = createOptions();
+		options.appGroupName = "test1";
+		options.minProcesses = 0;
+		pool->setMaxIdleTime(50000);
+		pool->setMaxDormancyIdleTime(50000);
+		pool->get(options, &ticket).reset();
+		ensure_equals(pool->getProcessCount(), 1u);
+
+		EVENTUALLY(5,
+			result = pool->getSuperGroup("test1") == NULL;
+		);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals(pool->dormantSuperGroups.size(), 1u);
+			ensure(pool->dormantSuperGroups.find("test1") != pool->dormantSuperGroups.end());
+		}
+
+		SessionPtr session = pool->get(options, &ticket);
+		ensure(pool->getSuperGroup("test1") != NULL);
+		ensure_equals(pool->getProcessCount(), 1u);
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure(pool->dormantSuperGroups.empty());
+		}
+	}
+
+	TEST_METHOD(116) {
+		// detachSuperGroupsByName() detaches multiple SuperGroups at once
+		// and skips the names that don't exist.
+		Options options = createOptions();
+		options.appGroupName = "test1";
+		Options options2 = createOptions();
+		options2.appGroupName = "test2";
+		pool->get(options, &ticket).reset();
+		pool->get(options2, &ticket).reset();
+		ensure_equals(pool->getProcessCount(), 2u);
+
+		vector<string> names;
+		names.push_back("test1");
+		names.push_back("test2");
+		names.push_back("test3");
+		bool succeeded = false;
+		ensure_equals(pool->detachSuperGroupsByName(names, 5000000, &succeeded), 2u);
+		ensure(succeeded);
+		ensure_equals(pool->getSuperGroupCount(), 0u);
+		ensure_equals(pool->getProcessCount(), 0u);
+		ensure(!pool->detachSuperGroupByName("test1"));
+	}
+
+	TEST_METHOD(117) {
+		// Idle processes are detached one at a time, at most once per
+		// scale-down interval, instead of all at once.
+		Options options = createOptions();
+		pool->setMaxIdleTime(50000);
+		pool->setScaleDownInterval(500000);
+		for (int i = 0; i < 4; i++) {
+			sessions.push_back(pool->get(options, &ticket));
+		}
+		ensure_equals(pool->getProcessCount(), 4u);
+		sessions.clear();
+
+		EVENTUALLY(2,
+			result = pool->getProcessCount() == 3;
+		);
+		SHOULD_NEVER_HAPPEN(300,
+			result = pool->getProcessCount() < 3;
+		);
+		EVENTUALLY(2,
+			result = pool->getProcessCount() == 2;
+		);
+		SHOULD_NEVER_HAPPEN(300,
+			result = pool->getProcessCount() < 2;
+		);
+
+		// It doesn't go below minProcesses.
+		EVENTUALLY(2,
+			result = pool->getProcessCount() == 1;
+		);
+		SHOULD_NEVER_HAPPEN(700,
+			result = pool->getProcessCount() == 0;
+		);
+	}
+
+	TEST_METHOD(118) {
+		// A rolling restart prepares the new spawner before it replaces
+		// any processes. A regular restart leaves that to the first spawn.
+		Options options = createOptions();
+		SessionPtr session = pool->get(options, &ticket);
+		GroupPtr group = session->getProcess()->getGroup();
+		DummySpawnerPtr spawner = static_pointer_cast<DummySpawner>(group->spawner);
+		session.reset();
+
+		ensure(pool->restartGroupByName(group->name, RM_ROLLING));
+		EVENTUALLY(5,
+			result = spawner->prepareCount == 1;
+		);
+		EVENTUALLY(5,
+			PoolLock l(pool->syncher);
+			result = !group->rollingRestarting() && pool->getProcessCount(false) == 1;
+		);
+
+		ensure(pool->restartGroupByName(group->name, RM_BLOCKING));
+		EVENTUALLY(5,
+			PoolLock l(pool->syncher);
+			result = !group->restarting() && pool->getProcessCount(false) == 1;
+		);
+		ensure_equals(spawner->prepareCount, 1u);
+	}
+
 	/*********** Test previously discovered bugs ***********/
 	
 	TEST_METHOD(85) {
@@ -42,6 +42,10 @@ namespace tut {
 			adminSocket = createUnixSocketPair();
 			errorPipe = createPipe();
 		}
+		
+		~ApplicationPool2_ProcessTest() {
+			SystemTime::releaseAll();
+		}
 	};
 	
 	DEFINE_TEST_GROUP(ApplicationPool2_ProcessTest);
@@ -136,4 +140,65 @@ namespace tut {
 		ensure(process->isTotallyBusy());
 		ensure(process->newSession() == NULL);
 	}
+	
+	TEST_METHOD(5) {
+		// sessionClosed() maintains a moving average of the session durations,
+		// which expectedLatency() multiplies by the number of sessions.
+		ProcessPtr process = boost::make_shared<Process>(bg.safe,
+			123, "", "", adminSocket[0],
+			errorPipe[0], sockets, 0, 0);
+		process->dummy = true;
+		process->requiresShutdown = false;
+		
+		SystemTime::forceUsec(1000000);
+		SessionPtr session1 = process->newSession();
+		SessionPtr session2 = process->newSession();
+		ensure_equals(process->expectedLatency(), 3);
+		
+		SystemTime::forceUsec(1008000);
+		process->sessionClosed(session1.get());
+		ensure_equals(process->responseTimeEwma, 8000ull);
+		ensure_equals(process->expectedLatency(), 16000);
+		
+		SystemTime::forceUsec(1016000);
+		process->sessionClosed(session2.get());
+		ensure_equals(process->responseTimeEwma, 9000ull);
+		ensure_equals(process->expectedLatency(), 9000);
+	}
+
+	TEST_METHOD(6) {
+		// setConcurrency() distributes the concurrency over the session
+		// sockets, with at least 1 per socket, and may be lowered while
+		// sessions are open.
+		ProcessPtr process = boost::make_shared<Process>(bg.safe,
+			123, "", "", adminSocket[0],
+			errorPipe[0], sockets, 0, 0);
+		process->dummy = true;
+		process->requiresShutdown = false;
+		ensure_equals(process->concurrency, 9);
+
+		process->setConcurrency(4);
+		ensure_equals(process->concurrency, 4);
+		ensure_equals(sockets->front().concurrency, 2);
+		vector<SessionPtr> sessions;
+		for (int i = 0; i < 4; i++) {
+			SessionPtr session = process->newSession();
+			ensure(session != NULL);
+			sessions.push_back(session);
+		}
+		ensure(process->isTotallyBusy());
+		ensure(process->newSession() == NULL);
+
+		process->setConcurrency(1);
+		ensure_equals(process->concurrency, 3);
+		process->sessionClosed(sessions[0].get());
+		ensure(process->isTotallyBusy());
+		ensure(process->newSession() == NULL);
+		process->sessionClosed(sessions[1].get());
+		ensure(!process->isTotallyBusy());
+
+		process->setConcurrency(0);
+		ensure_equals(process->concurrency, 0);
+		ensure(process->newSession() != NULL);
+	}
 }
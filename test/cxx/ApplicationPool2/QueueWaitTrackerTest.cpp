@@ -0,0 +1,65 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/QueueWaitTracker.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_QueueWaitTrackerTest {
+		QueueWaitTracker tracker;
+
+		static unsigned long long msec(double value) {
+			return (unsigned long long) (value * 1000);
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_QueueWaitTrackerTest);
+
+	TEST_METHOD(1) {
+		// Percentiles are computed over the most recent samples.
+		ensure_equals(tracker.getSampleCount(), 0u);
+		ensure_equals(tracker.getPercentile(50), 0ull);
+		for (unsigned int i = 1; i <= 100; i++) {
+			tracker.recordWait(msec(1000), i, 0);
+		}
+		ensure_equals(tracker.getSampleCount(), 100u);
+		ensure_equals(tracker.getPercentile(50), 51ull);
+		ensure_equals(tracker.getPercentile(99), 100ull);
+		ensure_equals(tracker.getPercentile(100), 100ull);
+
+		for (unsigned int i = 0; i < QueueWaitTracker::SAMPLES; i++) {
+			tracker.recordWait(msec(1000), 7, 0);
+		}
+		ensure_equals(tracker.getSampleCount(), (unsigned int) QueueWaitTracker::SAMPLES);
+		ensure_equals(tracker.getPercentile(99), 7ull);
+	}
+
+	TEST_METHOD(2) {
+		// The queue is overloaded once the wait has been above the target
+		// for an interval, and no longer once a wait is below it or the
+		// queue has emptied.
+		unsigned long long target = msec(50);
+		tracker.recordWait(msec(1000), msec(60), target);
+		ensure(!tracker.overloaded(msec(1050), target, 0));
+		tracker.recordWait(msec(1080), msec(70), target);
+		ensure(tracker.overloaded(msec(1100), target, 0));
+		ensure("Disabled without a target", !tracker.overloaded(msec(1100), 0, 0));
+
+		tracker.recordWait(msec(1110), msec(10), target);
+		ensure(!tracker.overloaded(msec(1300), target, 0));
+
+		tracker.recordWait(msec(2000), msec(60), target);
+		tracker.queueEmptied();
+		ensure(!tracker.overloaded(msec(2200), target, 0));
+	}
+
+	TEST_METHOD(3) {
+		// A queued request that has waited for longer than the target plus
+		// the interval overloads the queue, even before any request has
+		// been taken off it.
+		unsigned long long target = msec(50);
+		ensure(!tracker.overloaded(msec(1000), target, msec(149)));
+		ensure(tracker.overloaded(msec(1000), target, msec(150)));
+	}
+}
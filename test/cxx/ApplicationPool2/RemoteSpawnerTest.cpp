@@ -0,0 +1,211 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/DirectSpawner.h>
+#include <ApplicationPool2/RemoteSpawner.h>
+#include <agents/RemoteAgent/RemoteAgentServer.h>
+#include <netinet/in.h>
+#include <signal.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+
+namespace tut {
+	struct ApplicationPool2_RemoteSpawnerTest {
+		ServerInstanceDirPtr serverInstanceDir;
+		ServerInstanceDir::GenerationPtr generation;
+		BackgroundEventLoop bg;
+		SpawnerConfigPtr config;
+		string agentAddress;
+		RemoteAgentServerPtr server;
+		boost::shared_ptr<oxt::thread> serverThread;
+		ProcessPtr process;
+
+		ApplicationPool2_RemoteSpawnerTest() {
+			createServerInstanceDirAndGeneration(serverInstanceDir, generation);
+			bg.start();
+			setLogLevel(LVL_ERROR);
+			setPrintAppOutputAsDebuggingMessages(true);
+
+			FileDescriptor serverFd(createTcpServer("127.0.0.1", 0));
+			agentAddress = "tcp://127.0.0.1:" + toString(getPort(serverFd));
+			server = boost::make_shared<RemoteAgentServer>(serverFd, "1234",
+				boost::make_shared<DirectSpawner>(bg.safe, *resourceLocator, generation));
+			serverThread.reset(new oxt::thread(
+				boost::bind(&RemoteAgentServer::mainLoop, server.get()),
+				"RemoteAgent server thread",
+				RemoteAgentServer::THREAD_STACK_SIZE));
+
+			config = boost::make_shared<SpawnerConfig>();
+			config->remoteAgentPassword = "1234";
+		}
+
+		~ApplicationPool2_RemoteSpawnerTest() {
+			if (process != NULL) {
+				process->requiresShutdown = false;
+				process.reset();
+			}
+			serverThread->interrupt_and_join();
+			server.reset();
+			setLogLevel(DEFAULT_LOG_LEVEL);
+			setPrintAppOutputAsDebuggingMessages(false);
+		}
+
+		static unsigned short getPort(int fd) {
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+			getsockname(fd, (struct sockaddr *) &addr, &len);
+			return ntohs(addr.sin_port);
+		}
+
+		Options createOptions() {
+			Options options;
+			options.spawnMethod = "direct";
+			options.loadShellEnvvars = false;
+			options.appRoot = "stub/rack";
+			options.startCommand = "ruby\t" "start.rb";
+			options.startupFile = "start.rb";
+			options.remoteAgents = agentAddress;
+			return options;
+		}
+
+		SpawnerPtr createSpawner(const Options &options, const SpawnerPtr &localSpawner = SpawnerPtr()) {
+			return boost::make_shared<RemoteSpawner>(*resourceLocator,
+				localSpawner, options, config);
+		}
+	};
+
+	static void checkin(ProcessPtr process, Connection *conn) {
+		process->sockets->front().checkinConnection(*conn);
+	}
+
+	DEFINE_TEST_GROUP(ApplicationPool2_RemoteSpawnerTest);
+
+	TEST_METHOD(1) {
+		// It spawns the process on the RemoteAgent and makes its
+		// socket reachable over TCP.
+		Options options = createOptions();
+		SpawnerPtr spawner = createSpawner(options);
+		process = spawner->spawn(options);
+		ensure(process->isRemote());
+		ensure_equals(process->remoteAgent, agentAddress);
+		ensure_equals(process->sockets->size(), 1u);
+		ensure(startsWith(process->sockets->front().address, "tcp://127.0.0.1:"));
+		ensure(process->osProcessExists());
+
+		Connection conn = process->sockets->front().checkoutConnection();
+		ScopeGuard guard(boost::bind(checkin, process, &conn));
+		writeExact(conn.fd, "ping\n");
+		ensure_equals(readAll(conn.fd), "pong\n");
+	}
+
+	TEST_METHOD(2) {
+		// Shutting down a remote process makes the RemoteAgent shut it
+		// down, after which the control connection is closed.
+		Options options = createOptions();
+		SpawnerPtr spawner = createSpawner(options);
+		process = spawner->spawn(options);
+		process->triggerShutdown();
+		EVENTUALLY(5,
+			result = !process->osProcessExists();
+		);
+		process->cleanup();
+		ensure(process->isDead());
+	}
+
+	TEST_METHOD(3) {
+		// Killing a remote process makes the RemoteAgent kill it.
+		Options options = createOptions();
+		SpawnerPtr spawner = createSpawner(options);
+		process = spawner->spawn(options);
+		ensure_equals(process->kill(SIGKILL), 0);
+		EVENTUALLY(5,
+			result = !process->osProcessExists();
+		);
+	}
+
+	TEST_METHOD(4) {
+		// The RemoteAgent rejects clients with the wrong password.
+		Options options = createOptions();
+		config->remoteAgentPassword = "wrong";
+		SpawnerPtr spawner = createSpawner(options);
+		try {
+			process = spawner->spawn(options);
+			fail("SpawnException expected");
+		} catch (const SpawnException &e) {
+			ensure(containsSubstring(e.what(), "Invalid RemoteAgent password"));
+		}
+	}
+
+	TEST_METHOD(5) {
+		// Spawn errors on the RemoteAgent are passed on, error page included.
+		Options options = createOptions();
+		options.appRoot      = "stub";
+		options.startCommand = "perl\t" "start_error.pl";
+		options.startupFile  = "start_error.pl";
+		SpawnerPtr spawner = createSpawner(options);
+		try {
+			process = spawner->spawn(options);
+			fail("SpawnException expected");
+		} catch (const SpawnException &e) {
+			ensure_equals(e.getErrorKind(),
+				SpawnException::APP_STARTUP_EXPLAINABLE_ERROR);
+			ensure_equals(e.getErrorPage(),
+				"He's dead, Jim!\n"
+				"Relax, I'm a doctor.\n");
+		}
+	}
+
+	TEST_METHOD(6) {
+		// Unreachable RemoteAgents are skipped.
+		string unreachable;
+		{
+			FileDescriptor fd(createTcpServer("127.0.0.1", 0));
+			unreachable = "tcp://127.0.0.1:" + toString(getPort(fd));
+		}
+		Options options = createOptions();
+		string agents = unreachable + " " + agentAddress;
+		options.remoteAgents = agents;
+		SpawnerPtr spawner = createSpawner(options);
+		process = spawner->spawn(options);
+		ensure_equals(process->remoteAgent, agentAddress);
+	}
+
+	TEST_METHOD(7) {
+		// The first maxLocalProcesses processes are spawned locally.
+		Options options = createOptions();
+		options.maxLocalProcesses = 1;
+		SpawnerPtr spawner = createSpawner(options,
+			boost::make_shared<DirectSpawner>(bg.safe, *resourceLocator, generation));
+
+		ProcessPtr local = spawner->spawn(options);
+		local->requiresShutdown = false;
+		ensure(!local->isRemote());
+
+		process = spawner->spawn(options);
+		ensure(process->isRemote());
+	}
+
+	TEST_METHOD(8) {
+		// Environment variables survive serialization.
+		Options options = createOptions();
+		options.environmentVariables.push_back(make_pair("FOO", "bar"));
+		options.environmentVariables.push_back(make_pair("EMPTY", ""));
+
+		vector<string> args;
+		RemoteSpawner::serializeOptions(options, args);
+		VariantMap map;
+		for (unsigned int i = 0; i < args.size(); i += 2) {
+			map.set(args[i], args[i + 1]);
+		}
+
+		Options parsed;
+		string storage;
+		RemoteSpawner::parseOptions(map, parsed, storage);
+		ensure_equals(parsed.appRoot, "stub/rack");
+		ensure_equals(parsed.startCommand, "ruby\tstart.rb");
+		ensure_equals(parsed.environmentVariables.size(), 2u);
+		ensure_equals(parsed.environmentVariables[0].first, "FOO");
+		ensure_equals(parsed.environmentVariables[0].second, "bar");
+		ensure_equals(parsed.environmentVariables[1].first, "EMPTY");
+		ensure_equals(parsed.environmentVariables[1].second, "");
+	}
+}
@@ -241,4 +241,21 @@ namespace tut {
 			result = gatheredOutput.find("hello world!\n") != string::npos;
 		);
 	}
+
+	TEST_METHOD(86) {
+		// prepare() starts the preloader, which subsequent spawns then use.
+		Options options = createOptions();
+		options.appRoot      = "stub/rack";
+		options.startCommand = "ruby\t" "start.rb";
+		options.startupFile  = "start.rb";
+		boost::shared_ptr<SmartSpawner> spawner = createSpawner(options);
+		ensure_equals(spawner->getPreloaderPid(), (pid_t) -1);
+		spawner->prepare();
+		pid_t preloaderPid = spawner->getPreloaderPid();
+		ensure(preloaderPid != -1);
+
+		process = spawner->spawn(options);
+		process->requiresShutdown = false;
+		ensure_equals(spawner->getPreloaderPid(), preloaderPid);
+	}
 }
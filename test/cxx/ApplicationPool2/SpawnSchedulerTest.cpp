@@ -0,0 +1,140 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/SpawnScheduler.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_SpawnSchedulerTest {
+		SpawnScheduler scheduler;
+		boost::atomic<bool> urgent, notUrgent;
+		boost::mutex syncher;
+		vector<string> order;
+		boost::thread *thr1, *thr2;
+
+		ApplicationPool2_SpawnSchedulerTest() {
+			urgent.store(true);
+			notUrgent.store(false);
+			thr1 = NULL;
+			thr2 = NULL;
+		}
+
+		~ApplicationPool2_SpawnSchedulerTest() {
+			if (thr1 != NULL) {
+				thr1->interrupt();
+				thr1->join();
+				delete thr1;
+			}
+			if (thr2 != NULL) {
+				thr2->interrupt();
+				thr2->join();
+				delete thr2;
+			}
+		}
+
+		void spawn(string name, const boost::atomic<bool> *isUrgent) {
+			try {
+				SpawnScheduler::Ticket ticket(scheduler, name, *isUrgent);
+				boost::lock_guard<boost::mutex> l(syncher);
+				order.push_back(name);
+			} catch (const boost::thread_interrupted &) {
+				// Return.
+			}
+		}
+
+		boost::thread *startSpawn(const string &name, const boost::atomic<bool> *isUrgent) {
+			return new boost::thread(boost::bind(
+				&ApplicationPool2_SpawnSchedulerTest::spawn, this, name, isUrgent));
+		}
+
+		unsigned int queueSize() {
+			return scheduler.getQueue().size();
+		}
+
+		vector<string> getOrder() {
+			boost::lock_guard<boost::mutex> l(syncher);
+			return order;
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_SpawnSchedulerTest);
+
+	TEST_METHOD(1) {
+		// Without a limit, tickets are granted right away.
+		string name = "foo";
+		{
+			SpawnScheduler::Ticket ticket1(scheduler, name, notUrgent);
+			SpawnScheduler::Ticket ticket2(scheduler, name, notUrgent);
+			ensure_equals(scheduler.getActive(), 2u);
+			ensure_equals(queueSize(), 0u);
+		}
+		ensure_equals(scheduler.getActive(), 0u);
+	}
+
+	TEST_METHOD(2) {
+		// Once the limit is reached, spawns wait for a slot. Spawns of
+		// groups with queued requests go first.
+		string name = "main";
+		scheduler.setLimit(1);
+		{
+			SpawnScheduler::Ticket ticket(scheduler, name, notUrgent);
+			thr1 = startSpawn("prestart", &notUrgent);
+			EVENTUALLY(5,
+				result = queueSize() == 1;
+			);
+			thr2 = startSpawn("requested", &urgent);
+			EVENTUALLY(5,
+				result = queueSize() == 2;
+			);
+
+			vector<SpawnScheduler::QueuedSpawn> queue = scheduler.getQueue();
+			ensure_equals(queue[0].groupName, "prestart");
+			ensure(!queue[0].urgent);
+			ensure_equals(queue[1].groupName, "requested");
+			ensure(queue[1].urgent);
+			ensure_equals(scheduler.getActive(), 1u);
+			ensure(getOrder().empty());
+		}
+
+		thr1->join();
+		thr2->join();
+		vector<string> order = getOrder();
+		ensure_equals(order.size(), 2u);
+		ensure_equals(order[0], "requested");
+		ensure_equals(order[1], "prestart");
+		ensure_equals(scheduler.getActive(), 0u);
+	}
+
+	TEST_METHOD(3) {
+		// A spawn thread that is interrupted while waiting leaves the queue.
+		string name = "main";
+		scheduler.setLimit(1);
+		SpawnScheduler::Ticket ticket(scheduler, name, notUrgent);
+		thr1 = startSpawn("foo", &notUrgent);
+		EVENTUALLY(5,
+			result = queueSize() == 1;
+		);
+		thr1->interrupt();
+		thr1->join();
+		ensure_equals(queueSize(), 0u);
+		ensure_equals(scheduler.getActive(), 1u);
+		ensure(getOrder().empty());
+	}
+
+	TEST_METHOD(4) {
+		// Raising the limit lets waiting spawns proceed.
+		string name = "main";
+		scheduler.setLimit(1);
+		SpawnScheduler::Ticket ticket(scheduler, name, notUrgent);
+		thr1 = startSpawn("foo", &notUrgent);
+		EVENTUALLY(5,
+			result = queueSize() == 1;
+		);
+		scheduler.setLimit(2);
+		thr1->join();
+		ensure_equals(getOrder().size(), 1u);
+		ensure_equals(queueSize(), 0u);
+		ensure_equals(scheduler.getActive(), 1u);
+	}
+}
@@ -317,7 +317,47 @@
 				&& gatheredOutput.find("hello stderr!\n") != string::npos;
 		);
 	}
-	
+
+	TEST_METHOD(11) {
+		// It records how long the phases of spawning took.
+		Options options = createOptions();
+		options.appRoot      = "stub/rack";
+		options.startCommand = "ruby\t" "start.rb";
+		options.startupFile  = "start.rb";
+		SpawnerPtr spawner = createSpawner(options);
+		unsigned long long before = SystemTime::getUsec();
+		process = spawner->spawn(options);
+		process->requiresShutdown = false;
+		unsigned long long after = SystemTime::getUsec();
+
+		const SpawnTimings &timings = process->spawnTimings;
+		ensure("The loader takes time to start", timings.preparationUsec > 0);
+		ensure(timings.total() <= after - before);
+
+		stringstream xml;
+		process->inspectXml(xml, false);
+		ensure(xml.str().find("<preparation_usec>" + toString(timings.preparationUsec) +
+			"</preparation_usec>") != string::npos);
+	}
+
+	TEST_METHOD(12) {
+		// It pins the process to the CPUs chosen by the cpuAffinity policy.
+		Options options = createOptions();
+		options.appRoot      = "stub/rack";
+		options.startCommand = "ruby\t" "start.rb";
+		options.startupFile  = "start.rb";
+		options.cpuAffinity  = "numa-node";
+		SpawnerPtr spawner = createSpawner(options);
+		process = spawner->spawn(options);
+		process->requiresShutdown = false;
+		#ifdef __linux__
+			ensure(!process->cpuAffinity.empty());
+			string status = readAll("/proc/" + toString(process->pid) + "/status");
+			ensure(status.find("Cpus_allowed_list:\t" + process->cpuAffinity + "\n")
+				!= string::npos);
+		#endif
+	}
+
 	// It raises an exception if getStartupCommand() is empty.
 
 	/******* User switching tests *******/
@@ -0,0 +1,66 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/UserDatabaseCache.h>
+#include <algorithm>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct ApplicationPool2_UserDatabaseCacheTest {
+		UserDatabaseCache cache;
+
+		~ApplicationPool2_UserDatabaseCacheTest() {
+			SystemTime::releaseAll();
+		}
+	};
+
+	DEFINE_TEST_GROUP(ApplicationPool2_UserDatabaseCacheTest);
+
+	TEST_METHOD(1) {
+		// It looks up users by name and by ID.
+		UserDatabaseCache::User user = cache.lookupUser(string("root"));
+		ensure(user.found);
+		ensure_equals(user.name, "root");
+		ensure_equals(user.uid, (uid_t) 0);
+		ensure(!user.home.empty());
+
+		user = cache.lookupUser((uid_t) 0);
+		ensure(user.found);
+		ensure_equals(user.name, "root");
+	}
+
+	TEST_METHOD(2) {
+		// It looks up groups by name and by ID.
+		UserDatabaseCache::Group group = cache.lookupGroup((gid_t) 0);
+		ensure(group.found);
+		ensure_equals(group.gid, (gid_t) 0);
+		ensure_equals(cache.lookupGroup(group.name).gid, (gid_t) 0);
+		ensure_equals(cache.getGroupName(0), group.name);
+	}
+
+	TEST_METHOD(3) {
+		// Entries that don't exist are reported as such.
+		ensure(!cache.lookupUser(string("passenger_nonexistent_user")).found);
+		ensure(!cache.lookupGroup(string("passenger_nonexistent_group")).found);
+		ensure_equals(cache.getGroupName(123456), "123456");
+	}
+
+	TEST_METHOD(4) {
+		// Results are cached until the TTL expires.
+		SystemTime::forceAll(1000000);
+		ensure(!cache.lookupUser(string("passenger_nonexistent_user")).found);
+		ensure(cache.lookupUser(string("root")).found);
+		SystemTime::forceAll(1000000 + 61 * 1000000ull);
+		ensure(cache.lookupUser(string("root")).found);
+	}
+
+	#ifdef HAVE_GETGROUPLIST
+		TEST_METHOD(5) {
+			// getGroupList() includes the given group.
+			vector<gid_t> groups = cache.getGroupList("root", 0);
+			ensure(find(groups.begin(), groups.end(), (gid_t) 0) != groups.end());
+			ensure(groups == cache.getGroupList("root", 0));
+		}
+	#endif
+}
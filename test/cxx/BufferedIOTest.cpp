@@ -361,4 +361,37 @@ namespace tut {
 			ensure_equals(io.getBuffer(), "");
 		}
 	}
+	
+	TEST_METHOD(32) {
+		// The StaticString variant of readLine() returns lines in
+		// the same way as the string variant.
+		StaticString line;
+		io.unread("hel");
+		write("lo\nworld\n.");
+		writer.close();
+		io.readLine(line);
+		ensure_equals(line, "hello\n");
+		ensure_equals(io.getBuffer(), "world\n.");
+		io.readLine(line);
+		ensure_equals(line, "world\n");
+		ensure_equals(io.readLine(), ".");
+		io.readLine(line);
+		ensure_equals(line, "");
+		ensure_equals(io.getBuffer(), "");
+	}
+	
+	TEST_METHOD(33) {
+		// The StaticString variant of readLine() throws a
+		// SecurityException if the line is too long.
+		StaticString line;
+		write("ab\nabcd");
+		io.readLine(line, 3);
+		ensure_equals(line, "ab\n");
+		try {
+			io.readLine(line, 3);
+			fail("SecurityException expected");
+		} catch (const SecurityException &) {
+			// Pass.
+		}
+	}
 }
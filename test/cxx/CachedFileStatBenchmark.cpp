@@ -0,0 +1,100 @@
+/*
+ * Compares CachedFileStat with ShardedCachedFileStat when many threads
+ * stat the same set of files at the same time, like the Apache worker
+ * threads do on every request.
+ *
+ *   rake benchmark:cached_file_stat ARGS="64"
+ *
+ * The optional argument is the number of threads. Default: 64.
+ */
+#include <oxt/initialize.hpp>
+#include <oxt/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <Utils/CachedFileStat.hpp>
+#include <Utils/ShardedCachedFileStat.hpp>
+#include <Utils/StrIntUtils.h>
+
+using namespace std;
+using namespace Passenger;
+
+
+static const unsigned int ITERATIONS = 20000;
+static const unsigned int CACHE_SIZE = 1024;
+
+static vector<string> filenames;
+
+
+static unsigned long long
+getUsec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+template<typename Cache>
+static void
+runThread(Cache *cache, unsigned int seed, unsigned int workingSet) {
+	struct stat buf;
+	for (unsigned int i = 0; i < ITERATIONS; i++) {
+		seed = seed * 1103515245 + 12345;
+		cache->stat(filenames[(seed >> 8) % workingSet], &buf, 3600);
+	}
+}
+
+template<typename Cache>
+static void
+benchmark(const char *name, unsigned int threadCount, unsigned int workingSet) {
+	Cache cache(CACHE_SIZE);
+	vector< boost::shared_ptr<oxt::thread> > threads;
+	unsigned long long start = getUsec();
+
+	for (unsigned int i = 0; i < threadCount; i++) {
+		threads.push_back(boost::make_shared<oxt::thread>(
+			boost::bind(runThread<Cache>, &cache, i, workingSet),
+			"Thread " + toString(i)));
+	}
+	for (unsigned int i = 0; i < threadCount; i++) {
+		threads[i]->join();
+	}
+
+	unsigned long long time = getUsec() - start;
+	printf("  %-22s: %8.0f stats/sec\n", name,
+		(double) threadCount * ITERATIONS / (time / 1000000.0));
+}
+
+static void
+benchmarkWorkingSet(const char *description, unsigned int threadCount,
+	unsigned int workingSet)
+{
+	printf("%s (%u files, cache size %u, %u threads):\n", description,
+		workingSet, CACHE_SIZE, threadCount);
+	benchmark<CachedFileStat>("CachedFileStat", threadCount, workingSet);
+	benchmark<ShardedCachedFileStat>("ShardedCachedFileStat", threadCount, workingSet);
+}
+
+int
+main(int argc, char *argv[]) {
+	oxt::initialize();
+	unsigned int threadCount = (argc > 1) ? atoi(argv[1]) : 64;
+
+	// Most of these files don't exist, which the caches remember
+	// just like they remember successful stats.
+	for (unsigned int i = 0; i < 4 * CACHE_SIZE; i++) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/var/www/customer%u/current/public", i);
+		filenames.push_back(buf);
+	}
+
+	benchmarkWorkingSet("Everything cached", threadCount, CACHE_SIZE / 2);
+	benchmarkWorkingSet("Working set larger than the cache", threadCount, 4 * CACHE_SIZE);
+	return 0;
+}
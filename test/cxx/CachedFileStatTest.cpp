@@ -1,5 +1,6 @@
 #include "TestSupport.h"
 #include "Utils/CachedFileStat.hpp"
+#include "Utils/ShardedCachedFileStat.hpp"
 #include "Utils/SystemTime.h"
 #include <sys/types.h>
 #include <utime.h>
@@ -399,4 +400,64 @@ namespace tut {
 		ensure("(4)", stat.knows("test4.txt"));
 		ensure("(5)", stat.knows("test5.txt"));
 	}
+	
+	/************ ShardedCachedFileStat ************/
+	
+	TEST_METHOD(17) {
+		// ShardedCachedFileStat does not re-stat a file until the
+		// cache has expired, just like CachedFileStat.
+		ShardedCachedFileStat stat(0, 4);
+		
+		SystemTime::force(5);
+		touch("test.txt", 1);
+		ensure_equals(stat.stat("test.txt", &buf, 1), 0);
+		ensure_equals(buf.st_mtime, (time_t) 1);
+		
+		touch("test.txt", 1000);
+		ensure_equals(stat.stat("test.txt", &buf, 1), 0);
+		ensure_equals("The cached information is used", buf.st_mtime, (time_t) 1);
+		
+		SystemTime::force(6);
+		ensure_equals(stat.stat("test.txt", &buf, 1), 0);
+		ensure_equals("The file has been re-statted", buf.st_mtime, (time_t) 1000);
+		
+		ensure_equals(stat.stat("test2.txt", &buf, 1), -1);
+		ensure_equals(errno, ENOENT);
+		touch("test2.txt");
+		ensure_equals(stat.stat("test2.txt", &buf, 1), -1);
+		ensure_equals("The cached errno is returned", errno, ENOENT);
+	}
+	
+	TEST_METHOD(18) {
+		// A full shard evicts entries whose reference bit is not set
+		// before entries that have been used since they were cached.
+		ShardedCachedFileStat stat(2, 1);
+		stat.stat("test.txt", &buf, 1);
+		stat.stat("test2.txt", &buf, 1);
+		stat.stat("test.txt", &buf, 1);
+		stat.stat("test3.txt", &buf, 1);
+		ensure("(1)", stat.knows("test.txt"));
+		ensure("(2)", !stat.knows("test2.txt"));
+		ensure("(3)", stat.knows("test3.txt"));
+		ensure_equals(stat.size(), 2u);
+	}
+	
+	TEST_METHOD(19) {
+		// The maximum size is divided over the shards, and decreasing it
+		// evicts entries from every shard.
+		ShardedCachedFileStat stat(0, 4);
+		for (unsigned int i = 0; i < 100; i++) {
+			stat.stat("test" + toString(i) + ".txt", &buf, 1);
+		}
+		ensure_equals(stat.size(), 100u);
+		stat.setMaxSize(8);
+		ensure("Every shard holds at most 2 entries", stat.size() <= 8);
+		
+		stat.setMaxSize(40);
+		for (unsigned int i = 0; i < 100; i++) {
+			stat.stat("test" + toString(i) + ".txt", &buf, 1);
+		}
+		ensure("The cache doesn't grow past its maximum size", stat.size() <= 40);
+		ensure("The cache is used", stat.size() >= 30);
+	}
 }
@@ -0,0 +1,109 @@
+#include "TestSupport.h"
+#include <Utils/CharScanner.h>
+#include <Utils/SystemTime.h>
+#include <cstdlib>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct CharScannerTest {
+		vector<CharScannerKernel> kernels;
+
+		CharScannerTest() {
+			for (int i = 0; i < CSK_KERNEL_COUNT; i++) {
+				if (charScannerKernelSupported((CharScannerKernel) i)) {
+					kernels.push_back((CharScannerKernel) i);
+				}
+			}
+		}
+
+		void checkAllKernels(const string &data, size_t begin, size_t end) {
+			const char *expected = findCrOrLfWithKernel(CSK_SCALAR,
+				data.data() + begin, data.data() + end);
+			for (unsigned int i = 0; i < kernels.size(); i++) {
+				const char *result = findCrOrLfWithKernel(kernels[i],
+					data.data() + begin, data.data() + end);
+				if (result != expected) {
+					fail((string("Kernel ") + getCharScannerKernelName(kernels[i]) +
+						" gives a different result for range " + toString(begin) +
+						"-" + toString(end)).c_str());
+				}
+			}
+		}
+	};
+
+	DEFINE_TEST_GROUP(CharScannerTest);
+
+	TEST_METHOD(1) {
+		// The scalar kernel is always supported, and findCrOrLf()
+		// works with the kernel selected for this machine.
+		ensure(charScannerKernelSupported(CSK_SCALAR));
+		ensure(charScannerKernelSupported(getCharScannerKernel()));
+
+		const char *str = "hello\r\nworld";
+		ensure_equals(findCrOrLf(str, str + strlen(str)), str + 5);
+		ensure_equals(findCrOrLf(str, str + 5), str + 5);
+		ensure_equals(findCrOrLf(str + 6, str + strlen(str)), str + 6);
+		ensure_equals(findCrOrLf(str + 7, str + strlen(str)), str + strlen(str));
+		ensure_equals(findCrOrLf(str, str), str);
+	}
+
+	TEST_METHOD(2) {
+		// All kernels agree with the scalar kernel for every match position,
+		// alignment and length, including the vector tails.
+		string data(100, 'x');
+		for (size_t matchPos = 0; matchPos <= data.size(); matchPos++) {
+			string str = data;
+			if (matchPos < str.size()) {
+				str[matchPos] = (matchPos % 2 == 0) ? '\r' : '\n';
+			}
+			for (size_t begin = 0; begin < 8; begin++) {
+				for (size_t end = begin; end <= str.size(); end++) {
+					checkAllKernels(str, begin, end);
+				}
+			}
+		}
+	}
+
+	TEST_METHOD(3) {
+		// They don't confuse CR and LF with characters that differ in one
+		// bit, or with bytes that have the high bit set.
+		string data;
+		for (int i = 0; i < 256; i++) {
+			if (i != '\r' && i != '\n') {
+				data.append(1, (char) i);
+			}
+		}
+		data.append("\n");
+		for (size_t begin = 0; begin < 40; begin++) {
+			checkAllKernels(data, begin, data.size());
+			ensure_equals(findCrOrLf(data.data() + begin, data.data() + data.size()),
+				data.data() + data.size() - 1);
+		}
+	}
+
+	TEST_METHOD(4) {
+		// Microbenchmark. Only runs if PASSENGER_BENCHMARK is set.
+		if (getenv("PASSENGER_BENCHMARK") == NULL) {
+			return;
+		}
+
+		string data(1024 * 1024, 'x');
+		unsigned int iterations = 200;
+		for (unsigned int i = 0; i < kernels.size(); i++) {
+			unsigned long long start = SystemTime::getUsec();
+			size_t total = 0;
+			for (unsigned int j = 0; j < iterations; j++) {
+				total += findCrOrLfWithKernel(kernels[i], data.data(),
+					data.data() + data.size()) - data.data();
+			}
+			unsigned long long elapsed = SystemTime::getUsec() - start;
+			if (elapsed == 0) {
+				elapsed = 1;
+			}
+			printf("CharScanner %-6s: %llu MB/sec\n", getCharScannerKernelName(kernels[i]),
+				(unsigned long long) total / elapsed);
+		}
+	}
+}
@@ -247,4 +247,26 @@ namespace tut {
 		ensure_equals(chunks[1], "world");
 		ensure(!ended);
 	}
+
+	TEST_METHOD(28) {
+		// skip() tracks the chunk boundaries without emitting events,
+		// regardless of how the stream is split up.
+		addChunk("hello");
+		addChunk("world");
+		addChunk("");
+		string::size_type end = input.size();
+		input.append("garbage");
+		for (string::size_type i = 0; i < end; i++) {
+			dechunker.reset();
+			size_t first = dechunker.skip(input.data(), i);
+			ensure_equals(first, i);
+			ensure(!dechunker.isDone());
+			size_t second = dechunker.skip(input.data() + i, input.size() - i);
+			ensure_equals(first + second, end);
+			ensure(dechunker.isDone());
+			ensure(!dechunker.hasError());
+		}
+		ensure(chunks.empty());
+		ensure(!ended);
+	}
 }
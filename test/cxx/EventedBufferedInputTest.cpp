@@ -113,6 +113,11 @@ namespace tut {
 			ebi->start();
 		}
 
+		void unreadAndStart(const StaticString &data) {
+			ebi->unread(data);
+			ebi->start();
+		}
+
 		bool ebiIsStarted() {
 			bool result;
 			bg.safe->run(boost::bind(&EventedBufferedInputTest::realEbiIsStarted, this, &result));
@@ -755,4 +760,67 @@ namespace tut {
 			"previously unemitted data events after resume");
 		// TODO
 	}
+
+	/***** Buffer pool *****/
+
+	TEST_METHOD(40) {
+		set_test_name("With a buffer pool, it borrows a buffer only while it holds unconsumed data");
+		EventedBufferedInputBufferPoolPtr pool = boost::make_shared<EventedBufferedInputBufferPool>(16);
+		ebi->setBufferPool(pool);
+		toConsume = 3;
+		startEbi();
+		writeExact(p.second, "aaabbb");
+		EVENTUALLY(5,
+			LOCK();
+			result = log == "Data: aaabbb\nData: bbb\n";
+		);
+		EVENTUALLY(5,
+			result = pool->freeCount() == 1;
+		);
+		ensure_equals(pool->missCount(), 1u);
+
+		writeExact(p.second, "ccc");
+		EVENTUALLY(5,
+			LOCK();
+			result = log == "Data: aaabbb\nData: bbb\nData: ccc\n";
+		);
+		EVENTUALLY(5,
+			result = pool->hitCount() == 1 && pool->freeCount() == 1;
+		);
+	}
+
+	TEST_METHOD(41) {
+		set_test_name("With a buffer pool, it uses larger buffers when the socket delivers a lot of data");
+		EventedBufferedInputBufferPoolPtr pool = boost::make_shared<EventedBufferedInputBufferPool>(4);
+		ebi->setBufferPool(pool);
+		writeExact(p.second, "aaaabbbbbbbbbbbbbbbbcccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc");
+		startEbi();
+		EVENTUALLY(5,
+			LOCK();
+			result = log.find("cccc") != string::npos;
+		);
+		LOCK();
+		ensure_equals(log,
+			"Data: aaaa\n"
+			"Data: bbbbbbbbbbbbbbbb\n"
+			"Data: cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc\n");
+	}
+
+	TEST_METHOD(42) {
+		set_test_name("Unread data is emitted before the data from the socket");
+		writeExact(p.second, "socket");
+		toConsume = 3;
+		bg.safe->run(boost::bind(&EventedBufferedInputTest::unreadAndStart, this,
+			StaticString("unread")));
+		EVENTUALLY(5,
+			LOCK();
+			result = log.find("Data: ket") != string::npos;
+		);
+		LOCK();
+		ensure_equals(log,
+			"Data: unread\n"
+			"Data: ead\n"
+			"Data: socket\n"
+			"Data: ket\n");
+	}
 }
@@ -520,4 +520,53 @@ namespace tut {
 		ensure("(2)", client.fd != -1);
 		ensure_equals("(3)", data, "world");
 	}
+	
+	TEST_METHOD(22) {
+		// Many small writes that cannot be written out immediately
+		// are sent in the order in which they were written.
+		EventedClient client(eventLoop, fd2);
+		string filler(1024 * 1024, 'x');
+		string expected;
+		
+		client.write(filler);
+		ensure("(1)", client.pendingWrites() > 0);
+		for (int i = 0; i < 10000; i++) {
+			string str = toString(i) + ",";
+			client.write(str);
+			expected.append(str);
+		}
+		ensure("(2)", client.pendingWrites() > expected.size());
+		
+		startEventLoop();
+		EVENT_LOOP_GUARD;
+		
+		string buf(filler.size() + expected.size(), '\0');
+		ensure("(3)", readExact(fd1, &buf[0], buf.size()));
+		ensure("(4)", buf == filler + expected);
+	}
+	
+	TEST_METHOD(23) {
+		// If a shared buffer cannot be written out immediately then
+		// EventedClient keeps a reference to it instead of copying it.
+		EventedClient client(eventLoop, fd2);
+		boost::shared_ptr<const string> str =
+			boost::make_shared<const string>(1024 * 1024, 'x');
+		
+		client.write(str);
+		ensure("(1)", client.pendingWrites() > 0);
+		ensure("(2)", client.pendingWrites() < str->size());
+		ensure("(3)", str.use_count() > 1);
+		
+		client.write("hello world");
+		
+		startEventLoop();
+		EVENT_LOOP_GUARD;
+		
+		string buf(str->size() + strlen("hello world"), '\0');
+		ensure("(4)", readExact(fd1, &buf[0], buf.size()));
+		ensure("(5)", buf == *str + "hello world");
+		EVENTUALLY(5,
+			result = str.use_count() == 1;
+		);
+	}
 }
@@ -128,6 +128,12 @@ namespace tut {
 			*result = pipe->getDataState();
 		}
 
+		void real_detachBufferedData(FileDescriptor *fd, off_t *fileEnd, bool *result) {
+			string memoryData;
+			off_t fileOffset;
+			*result = pipe->detachBufferedData(memoryData, *fd, fileOffset, *fileEnd);
+		}
+
 		static void onData(const FileBackedPipePtr &source, const char *data,
 			size_t size, const FileBackedPipe::ConsumeCallback &consumed)
 		{
@@ -623,4 +629,245 @@ namespace tut {
 		ensure("(3)", !isStarted());
 		ensure_equals("(4)", getBufferSize(), 0u);
 	}
+
+	TEST_METHOD(29) {
+		// It borrows its memory buffer from the buffer pool, if one is set, and
+		// returns it once the buffer has been drained.
+		FileBackedPipe::BufferPoolPtr pool = boost::make_shared<FileBackedPipe::BufferPool>();
+		pipe->setBufferPool(pool);
+		consumeImmediately = false;
+		init();
+		startPipe();
+		write("hello");
+		ensure_equals("(1)", getBufferSize(), 5u);
+		ensure_equals("(2)", pool->missCount(), 1u);
+		ensure_equals("(3)", pool->freeCount(), 0u);
+
+		callConsumedCallback(5, false);
+		ensure_equals("(4)", getBufferSize(), 0u);
+		ensure_equals("(5)", pool->freeCount(), 1u);
+
+		write("world");
+		ensure_equals("(6)", receivedData, "hello\nworld");
+		ensure_equals("(7)", getBufferSize(), 5u);
+		ensure_equals("(8)", pool->hitCount(), 1u);
+		ensure_equals("(9)", pool->missCount(), 1u);
+
+		bg.safe->run(boost::bind(&FileBackedPipe::reset, pipe.get(), SafeLibevPtr()));
+		ensure_equals("(10)", pool->freeCount(), 1u);
+	}
+
+	TEST_METHOD(30) {
+		// Pipes whose threshold differs from the pool's block size
+		// don't use the pool.
+		FileBackedPipe::BufferPoolPtr pool = boost::make_shared<FileBackedPipe::BufferPool>(1024);
+		pipe->setBufferPool(pool);
+		pipe->setThreshold(16);
+		consumeImmediately = false;
+		init();
+		startPipe();
+		write("hello");
+		ensure_equals(getBufferSize(), 5u);
+		ensure_equals(pool->missCount(), 0u);
+		ensure_equals(pool->hitCount(), 0u);
+	}
+
+	TEST_METHOD(31) {
+		// Test reading a large amount of data back from the buffer file.
+		string data;
+		for (unsigned int i = 0; i < 1024 * 1024; i++) {
+			data.append(1, 'a' + i % 26);
+		}
+		toConsume = data.size();
+		pipe->setThreshold(1);
+		init();
+		write(data);
+		endPipe();
+		EVENTUALLY(5,
+			result = getDataState() == FileBackedPipe::IN_FILE && !isCommittingToDisk();
+		);
+
+		startPipe();
+		EVENTUALLY(5,
+			result = ended;
+		);
+		receivedData.erase(std::remove(receivedData.begin(), receivedData.end(), '\n'),
+			receivedData.end());
+		ensure_equals(receivedData.size(), data.size());
+		ensure(receivedData == data);
+		ensure("data is read in blocks of at least 16 KB",
+			consumeCallbackCount <= 64);
+	}
+
+	TEST_METHOD(32) {
+		// MemoryBudget grants buffers in full up to half of its limit,
+		// shrinks them beyond that, and refuses them once exhausted.
+		FileBackedPipe::MemoryBudget budget(1000);
+		ensure_equals(budget.reserve(100), 100u);
+		ensure_equals(budget.reserve(400), 400u);
+		ensure_equals(budget.reserve(100), 100u);
+		ensure_equals("Shrunk under pressure", budget.reserve(100), 80u);
+		ensure_equals(budget.getUsage(), 680u);
+		ensure_equals(budget.reserve(1000), 320u);
+		ensure_equals(budget.getUsage(), 1000u);
+		ensure_equals("Exhausted", budget.reserve(1), 0u);
+
+		budget.release(1000);
+		ensure_equals(budget.getUsage(), 0u);
+		ensure_equals(budget.getHighWatermark(), 1000u);
+
+		FileBackedPipe::MemoryBudget unlimited;
+		ensure_equals(unlimited.reserve(1024 * 1024), 1024u * 1024);
+	}
+
+	TEST_METHOD(33) {
+		// Pipes account their in-memory buffer against the memory budget
+		// and go to disk once the budget is exhausted.
+		FileBackedPipe::MemoryBudgetPtr budget = boost::make_shared<FileBackedPipe::MemoryBudget>(64);
+		pipe->setMemoryBudget(budget);
+		pipe->setThreshold(16);
+		consumeImmediately = false;
+		init();
+		startPipe();
+		write("hello");
+		ensure_equals(getDataState(), FileBackedPipe::IN_MEMORY);
+		ensure_equals(budget->getUsage(), 16u);
+
+		bg.safe->run(boost::bind(&FileBackedPipe::reset, pipe.get(), bg.safe));
+		ensure_equals("Buffer is given back on reset", budget->getUsage(), 0u);
+
+		ensure_equals(budget->reserve(64), 64u);
+		startPipe();
+		write("hello");
+		ensure("Data goes to disk", getDataState() != FileBackedPipe::IN_MEMORY);
+		ensure_equals(budget->getUsage(), 64u);
+	}
+
+	TEST_METHOD(34) {
+		// It takes its buffer file from the spill file pool, if one is set,
+		// and gives it back, empty, on reset.
+		FileBackedPipe::SpillFilePoolPtr pool = boost::make_shared<FileBackedPipe::SpillFilePool>();
+		pipe->setSpillFilePool(pool);
+		pipe->setThreshold(3);
+		consumeImmediately = false;
+		init();
+		write("hello");
+		EVENTUALLY(5,
+			result = getDataState() == FileBackedPipe::IN_FILE && !isCommittingToDisk();
+		);
+		ensure_equals("(1)", pool->missCount(), 1u);
+
+		bg.safe->run(boost::bind(&FileBackedPipe::reset, pipe.get(), bg.safe));
+		EVENTUALLY(5,
+			result = pool->freeCount() == 1;
+		);
+
+		pipe->setSizeHint(1024 * 1024);
+		write("world");
+		EVENTUALLY(5,
+			result = getDataState() == FileBackedPipe::IN_FILE && !isCommittingToDisk();
+		);
+		ensure_equals("(2)", pool->hitCount(), 1u);
+		ensure_equals("(3)", pool->freeCount(), 0u);
+		startPipe();
+		EVENTUALLY(5,
+			result = consumeCallbackCount == 1;
+		);
+		ensure_equals("(4)", receivedData, "world");
+	}
+
+	TEST_METHOD(35) {
+		// A buffer file that has been detached is not given back to the pool.
+		FileBackedPipe::SpillFilePoolPtr pool = boost::make_shared<FileBackedPipe::SpillFilePool>();
+		pipe->setSpillFilePool(pool);
+		pipe->setThreshold(3);
+		init();
+		write("hello");
+		endPipe();
+		EVENTUALLY(5,
+			result = getDataState() == FileBackedPipe::IN_FILE && !isCommittingToDisk();
+		);
+
+		FileDescriptor fd;
+		off_t fileEnd;
+		bool detached;
+		bg.safe->run(boost::bind(&FileBackedPipeTest::real_detachBufferedData, this,
+			&fd, &fileEnd, &detached));
+		ensure("(1)", detached);
+		ensure_equals("(2)", fileEnd, (off_t) 5);
+		usleep(20000);
+		ensure_equals("(3)", pool->freeCount(), 0u);
+
+		char buf[5];
+		ensure_equals("(4)", pread(fd, buf, sizeof(buf), 0), (ssize_t) 5);
+		ensure_equals("(5)", string(buf, 5), "hello");
+	}
+
+	TEST_METHOD(36) {
+		// Test compressing the buffer file, and reading it back in pieces
+		// that don't line up with the compressed blocks.
+		string data;
+		for (unsigned int i = 0; i < 1024 * 1024; i++) {
+			data.append(1, 'a' + i % 26);
+		}
+		toConsume = 1000;
+		pipe->setThreshold(1);
+		init();
+		bg.safe->run(boost::bind(&FileBackedPipe::setCompression, pipe.get(), true));
+		write(data);
+		endPipe();
+		EVENTUALLY(5,
+			result = getDataState() == FileBackedPipe::IN_FILE && !isCommittingToDisk();
+		);
+		ensure("The buffer file is compressed", pipe->getBufferFileSize() < (off_t) data.size() / 10);
+
+		startPipe();
+		EVENTUALLY(10,
+			result = ended;
+		);
+		string received;
+		unsigned int pos = 0;
+		while (pos < receivedData.size()) {
+			string::size_type end = receivedData.find('\n', pos);
+			if (end == string::npos) {
+				end = receivedData.size();
+			}
+			// Every onData call consumes at most 1000 bytes, so the rest
+			// is passed again in the next call.
+			received.append(receivedData, pos, std::min<size_t>(1000, end - pos));
+			pos = end + 1;
+		}
+		ensure_equals(received.size(), data.size());
+		ensure(received == data);
+	}
+
+	TEST_METHOD(37) {
+		// Data that doesn't compress is stored as is.
+		string data;
+		unsigned int seed = 1;
+		for (unsigned int i = 0; i < 256 * 1024; i++) {
+			seed = seed * 1103515245 + 12345;
+			data.append(1, 'a' + (seed >> 16) % 26);
+			data.append(1, (char) (seed >> 8));
+		}
+		data.erase(std::remove(data.begin(), data.end(), '\n'), data.end());
+		toConsume = data.size();
+		pipe->setThreshold(1);
+		init();
+		bg.safe->run(boost::bind(&FileBackedPipe::setCompression, pipe.get(), true));
+		write(data);
+		endPipe();
+		EVENTUALLY(5,
+			result = getDataState() == FileBackedPipe::IN_FILE && !isCommittingToDisk();
+		);
+
+		startPipe();
+		EVENTUALLY(5,
+			result = ended;
+		);
+		receivedData.erase(std::remove(receivedData.begin(), receivedData.end(), '\n'),
+			receivedData.end());
+		ensure_equals(receivedData.size(), data.size());
+		ensure(receivedData == data);
+	}
 }
@@ -0,0 +1,104 @@
+#include "TestSupport.h"
+#include "Utils/FileChangeWatcher.h"
+#include <oxt/thread.hpp>
+#include <boost/bind.hpp>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct FileChangeWatcherTest {
+		TempDir tmpDir;
+		FileChangeWatcher watcher;
+		oxt::thread *thr;
+		vector<string> names;
+
+		FileChangeWatcherTest()
+			: tmpDir("tmp.watcher")
+		{
+			names.push_back("restart.txt");
+			thr = NULL;
+		}
+
+		~FileChangeWatcherTest() {
+			if (thr != NULL) {
+				thr->interrupt_and_join();
+				delete thr;
+			}
+		}
+
+		void startWatcher() {
+			thr = new oxt::thread(boost::bind(&FileChangeWatcher::run, &watcher),
+				"File change watcher", 1024 * 128);
+		}
+	};
+
+	DEFINE_TEST_GROUP(FileChangeWatcherTest);
+
+	TEST_METHOD(1) {
+		// The first consumeChange() call returns true, subsequent
+		// calls only after one of the files has changed.
+		if (!watcher.isSupported()) {
+			return;
+		}
+		FileChangeWatcher::WatchPtr watch = watcher.watch("tmp.watcher", names);
+		ensure(watch != NULL);
+		ensure(watch->isActive());
+		startWatcher();
+		ensure(watch->consumeChange());
+		ensure(!watch->consumeChange());
+
+		touchFile("tmp.watcher/restart.txt");
+		EVENTUALLY(2,
+			result = watch->consumeChange();
+		);
+		ensure(!watch->consumeChange());
+	}
+
+	TEST_METHOD(2) {
+		// Changes to other files in the directory are ignored.
+		if (!watcher.isSupported()) {
+			return;
+		}
+		FileChangeWatcher::WatchPtr watch = watcher.watch("tmp.watcher", names);
+		startWatcher();
+		ensure(watch->consumeChange());
+		touchFile("tmp.watcher/foo.txt");
+		SHOULD_NEVER_HAPPEN(200,
+			result = watch->consumeChange();
+		);
+	}
+
+	TEST_METHOD(3) {
+		// Watching a nonexistant directory fails. The watch becomes
+		// inactive when the watched directory is removed.
+		if (!watcher.isSupported()) {
+			return;
+		}
+		ensure(watcher.watch("tmp.watcher/nonexistant", names) == NULL);
+
+		mkdir("tmp.watcher/tmp", 0700);
+		FileChangeWatcher::WatchPtr watch = watcher.watch("tmp.watcher/tmp", names);
+		ensure(watch != NULL);
+		startWatcher();
+		rmdir("tmp.watcher/tmp");
+		EVENTUALLY(2,
+			result = !watch->isActive();
+		);
+	}
+
+	TEST_METHOD(4) {
+		// All watches become inactive when the watcher stops.
+		if (!watcher.isSupported()) {
+			return;
+		}
+		FileChangeWatcher::WatchPtr watch = watcher.watch("tmp.watcher", names);
+		startWatcher();
+		thr->interrupt_and_join();
+		delete thr;
+		thr = NULL;
+		ensure(!watch->isActive());
+		ensure(watcher.watch("tmp.watcher", names) == NULL);
+	}
+}
@@ -66,4 +66,40 @@ namespace tut {
 		ensure_equals(f2, -1);
 		ensure(write(pipes[1], "x", 1) == -1);
 	}
+
+	TEST_METHOD(4) {
+		// UniqueFileDescriptor closes the file descriptor when destroyed,
+		// unless ownership has been given up with release().
+		int reader = pipes[0];
+		pipes[0] = -1;
+		{
+			UniqueFileDescriptor f(reader);
+			ensure_equals((int) f, reader);
+			ensure_equals(f.release(), reader);
+			ensure_equals((int) f, -1);
+		}
+		ensure("File descriptor is not closed after release()",
+			write(pipes[1], "x", 1) != -1);
+		{
+			UniqueFileDescriptor f(reader);
+		}
+		ensure("File descriptor is closed when destroyed",
+			write(pipes[1], "x", 1) == -1);
+	}
+
+	TEST_METHOD(5) {
+		// UniqueFileDescriptor::share() moves ownership into a FileDescriptor.
+		int reader = pipes[0];
+		pipes[0] = -1;
+		FileDescriptor shared;
+		{
+			UniqueFileDescriptor f(reader);
+			shared = f.share();
+			ensure_equals((int) f, -1);
+		}
+		ensure_equals(shared, reader);
+		ensure(write(pipes[1], "x", 1) != -1);
+		shared = FileDescriptor();
+		ensure(write(pipes[1], "x", 1) == -1);
+	}
 }
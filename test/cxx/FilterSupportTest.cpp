@@ -344,6 +344,50 @@ namespace tut {
 		ensure("(21)", eval("(uri == 'foo' && response_time == 1) || response_time == 10"));
 	}
 	
+	TEST_METHOD(33) {
+		// Expressions that are partially known at compile time yield the
+		// same results as when they're entirely known at compile time.
+		const char *templates[] = {
+			"A && B || C",
+			"A || B && C",
+			"A && B && C || D",
+			"A || B || C && D",
+			"A && (B || C) || D",
+			"(A || B) && C || D",
+			"(A && B || C) && D"
+		};
+		ctx.uri = "yes";
+		for (unsigned int t = 0; t < sizeof(templates) / sizeof(const char *); t++) {
+			for (unsigned int bits = 0; bits < 16; bits++) {
+				for (unsigned int dynamic = 0; dynamic < 16; dynamic++) {
+					string constant = templates[t];
+					string mixed = templates[t];
+					for (int i = 3; i >= 0; i--) {
+						bool value = bits & (1 << i);
+						string name(1, 'A' + i);
+						string literal = value ? "true" : "false";
+						string field = value ? "uri == 'yes'" : "uri == 'no'";
+						string::size_type pos = constant.find(name);
+						if (pos != string::npos) {
+							constant.replace(pos, 1, literal);
+							mixed.replace(mixed.find(name), 1,
+								(dynamic & (1 << i)) ? field : literal);
+						}
+					}
+					ensure_equals(mixed.c_str(), Filter(mixed).run(ctx), Filter(constant).run(ctx));
+				}
+			}
+		}
+	}
+	
+	TEST_METHOD(34) {
+		// Constant expressions are folded at compile time.
+		ensure_equals(Filter("1 == 1 && (false || 'a' != 'b')").getProgramSize(), 1u);
+		ensure_equals(Filter("false && uri == 'foo'").getProgramSize(), 1u);
+		ensure_equals(Filter("true && uri == 'foo'").getProgramSize(), 1u);
+		ensure(Filter("uri == 'foo' && 1 == 2").getProgramSize() > 1);
+	}
+	
 	
 	/******** Error tests *******/
 	
@@ -430,4 +474,38 @@ namespace tut {
 		);
 		ensure_equals(ctx.getResponseTime(), 2);
 	}
+	
+	TEST_METHOD(53) {
+		// It only extracts the requested fields, but still returns
+		// the right value for fields that weren't requested.
+		string log =
+			"1234-abcd 1234 0 BEGIN: request processing (1235, 10, 10)\n"
+			"1234-abcd 1240 1 URI: /foo\n"
+			"1234-abcd 1242 3 Status: 200 OK\n"
+			"1234-abcd 2234 10 END: request processing (2234, 10, 10)\n";
+		Filter filter("uri == '/foo' && status_code == 200");
+		ensure_equals(filter.getReferencedFields(),
+			Context::fieldMask(Context::URI) | Context::fieldMask(Context::STATUS_CODE));
+		ContextFromLog ctx(log, filter.getReferencedFields());
+		ensure(filter.run(ctx));
+		ensure_equals(ctx.getStatus(), "200 OK");
+		ensure_equals(ctx.getResponseTime(), 46655);
+		ensure_equals(ctx.getURI(), "/foo");
+	}
+	
+	TEST_METHOD(54) {
+		// It extracts the resource usage that the application reported,
+		// which filters can query as cpu_time and allocations.
+		string log =
+			"1234-abcd 1234 0 BEGIN: request processing (1235, 10, 10)\n"
+			"1234-abcd 1242 1 Resource usage: cpu=1500 allocations=320\n"
+			"1234-abcd 2234 2 END: request processing (2234, 10, 10)\n";
+		ContextFromLog ctx(log);
+		ensure_equals(ctx.getCpuTime(), 1500);
+		ensure_equals(ctx.getAllocations(), 320);
+
+		Filter filter("cpu_time > 1000 && allocations < 1000");
+		ensure(filter.run(ContextFromLog(log, filter.getReferencedFields())));
+		ensure(!Filter("cpu_time > 2000").run(ContextFromLog(log)));
+	}
 }
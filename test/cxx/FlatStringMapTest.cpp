@@ -0,0 +1,138 @@
+#include "TestSupport.h"
+#include "Utils/FlatStringMap.h"
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdlib>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct FlatStringMapTest {
+	};
+	
+	DEFINE_TEST_GROUP(FlatStringMapTest);
+	
+	TEST_METHOD(1) {
+		// get()ing a nonexistant key returns the default value.
+		FlatStringMap<string> m;
+		ensure_equals(m.get("hello"), "");
+		ensure_equals(m.get("hello", "default"), "default");
+		ensure(!m.has("hello"));
+		ensure(m.find("hello") == m.end());
+		ensure(m.begin() == m.end());
+	}
+	
+	TEST_METHOD(2) {
+		// set() inserts new keys and overwrites the values of existing ones.
+		FlatStringMap<string> m;
+		ensure(m.set("hello", "world"));
+		ensure(m.set("foo", "bar"));
+		ensure(!m.set("hello", "new world"));
+		ensure_equals(m.size(), 2u);
+		ensure_equals(m.get("hello"), "new world");
+		ensure_equals(m.get("foo"), "bar");
+		ensure_equals(m.get("something"), "");
+	}
+	
+	TEST_METHOD(3) {
+		// Short and long keys are interned, so changing the original has
+		// no effect.
+		FlatStringMap<string> m;
+		char key1[] = "hello";
+		string key2(100, 'x');
+		
+		m.set(key1, "xxx");
+		m.set(key2, "yyy");
+		key1[4] = 'p';
+		key2[99] = 'y';
+		
+		ensure_equals(m.get("hello"), "xxx");
+		ensure_equals(m.get("hellp"), "");
+		ensure_equals(m.get(string(100, 'x')), "yyy");
+		ensure_equals(m.get(key2), "");
+	}
+	
+	TEST_METHOD(4) {
+		// Iterators visit every entry once, and values can be modified
+		// through them.
+		FlatStringMap<int> m;
+		m.set("a", 1);
+		m.set("b", 2);
+		m.set(string(50, 'c'), 3);
+		
+		map<string, int> m2;
+		FlatStringMap<int>::iterator it, end = m.end();
+		for (it = m.begin(); it != end; it++) {
+			m2[it->first] = it->second;
+			it->second *= 10;
+		}
+		ensure_equals(m2.size(), 3u);
+		ensure_equals(m2["a"], 1);
+		ensure_equals(m2["b"], 2);
+		ensure_equals(m2[string(50, 'c')], 3);
+		
+		const FlatStringMap<int> &cm = m;
+		FlatStringMap<int>::const_iterator cit, cend = cm.end();
+		int sum = 0;
+		for (cit = cm.begin(); cit != cend; cit++) {
+			sum += cit->second;
+		}
+		ensure_equals(sum, 60);
+	}
+	
+	TEST_METHOD(5) {
+		// Many inserts and removals, of keys that are longer and shorter
+		// than INLINE_KEY_SIZE, behave like a std::map while the table
+		// grows and reuses deleted slots.
+		FlatStringMap<int> m;
+		map<string, int> reference;
+		srand(1234);
+		for (int i = 0; i < 20000; i++) {
+			string key = toString(rand() % 2000);
+			if (rand() % 3 == 0) {
+				key.append(30, 'x');
+			}
+			if (rand() % 3 == 0) {
+				ensure_equals(m.remove(key), reference.erase(key) > 0);
+			} else {
+				ensure_equals(m.set(key, i), reference.find(key) == reference.end());
+				reference[key] = i;
+			}
+		}
+		
+		ensure_equals(m.size(), (unsigned int) reference.size());
+		map<string, int>::const_iterator it;
+		for (it = reference.begin(); it != reference.end(); it++) {
+			ensure_equals(m.get(it->first, -1), it->second);
+		}
+		unsigned int count = 0;
+		FlatStringMap<int>::const_iterator mit, mend = m.end();
+		for (mit = m.begin(); mit != mend; mit++) {
+			ensure(reference.find(mit->first) != reference.end());
+			count++;
+		}
+		ensure_equals(count, m.size());
+	}
+	
+	TEST_METHOD(6) {
+		// Copies are independent of the original, and clear() empties
+		// the map.
+		FlatStringMap<string> m;
+		m.set("short", "1");
+		m.set(string(40, 'l'), "2");
+		
+		FlatStringMap<string> copy(m);
+		m.set("short", "changed");
+		m.clear();
+		ensure(m.empty());
+		ensure_equals(m.get("short"), "");
+		ensure_equals(copy.size(), 2u);
+		ensure_equals(copy.get("short"), "1");
+		ensure_equals(copy.get(string(40, 'l')), "2");
+		
+		m = copy;
+		ensure_equals(m.get(string(40, 'l')), "2");
+	}
+}
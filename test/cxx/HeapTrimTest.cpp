@@ -0,0 +1,46 @@
+#include "TestSupport.h"
+#include <Utils/HeapTrim.h>
+#include <vector>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct HeapTrimTest {
+	};
+
+	DEFINE_TEST_GROUP(HeapTrimTest);
+
+	TEST_METHOD(1) {
+		// getCurrentRss() returns the resident set size on Linux.
+		#ifdef __linux__
+			size_t rss = getCurrentRss();
+			ensure(rss > 0);
+
+			vector<char> memory(1024 * 1024 * 32, 'x');
+			ensure(getCurrentRss() >= rss + memory.size() / 2);
+		#endif
+	}
+
+	TEST_METHOD(2) {
+		// releaseFreeHeapMemory() returns freed heap memory to the OS.
+		#if defined(__linux__) && defined(__GLIBC__)
+			// Small enough to be allocated on the heap instead of with mmap().
+			vector<char *> blocks;
+			for (int i = 0; i < 1024; i++) {
+				char *block = (char *) malloc(1024 * 32);
+				memset(block, 'x', 1024 * 32);
+				blocks.push_back(block);
+			}
+			// Keep the last block, so that the free memory isn't at the
+			// top of the heap, which glibc would return by itself.
+			for (int i = 0; i < 1023; i++) {
+				free(blocks[i]);
+			}
+			size_t rss = getCurrentRss();
+			ensure(releaseFreeHeapMemory());
+			ensure(getCurrentRss() + 1024 * 1024 * 16 <= rss);
+			free(blocks[1023]);
+		#endif
+	}
+}
@@ -0,0 +1,103 @@
+#include "TestSupport.h"
+#include "HookScriptExecutor.h"
+#include <oxt/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct HookScriptExecutorTest {
+		TempDir tmpDir;
+		boost::shared_ptr<HookScriptExecutor> executor;
+		oxt::thread *thr;
+
+		HookScriptExecutorTest()
+			: tmpDir("tmp.hooks")
+		{
+			thr = NULL;
+		}
+
+		~HookScriptExecutorTest() {
+			if (thr != NULL) {
+				thr->interrupt_and_join();
+				delete thr;
+			}
+		}
+
+		void startExecutor(unsigned int batchTime = 0) {
+			executor = boost::make_shared<HookScriptExecutor>(batchTime);
+			thr = new oxt::thread(boost::bind(&HookScriptExecutor::run, executor.get()),
+				"Hook script executor", 1024 * 128);
+		}
+
+		void createScript(const string &filename, const string &contents) {
+			writeFile(filename, "#!/bin/sh\n" + contents);
+			chmod(filename.c_str(), 0700);
+		}
+
+		HookScriptOptions createOptions(const string &pid) {
+			HookScriptOptions options;
+			options.name = "test";
+			options.spec = "tmp.hooks/hook.sh";
+			options.environment.push_back(make_pair("PASSENGER_PROCESS_PID", pid));
+			options.environment.push_back(make_pair("PASSENGER_APP_ROOT", "/foo"));
+			return options;
+		}
+	};
+
+	DEFINE_TEST_GROUP(HookScriptExecutorTest);
+
+	TEST_METHOD(1) {
+		// schedule() doesn't wait for the hook script to finish.
+		createScript("tmp.hooks/hook.sh",
+			"sleep 1\n"
+			"echo $PASSENGER_PROCESS_PID > tmp.hooks/output\n");
+		startExecutor();
+		unsigned long long startTime = SystemTime::getMsec(true);
+		executor->schedule(createOptions("123"));
+		ensure(SystemTime::getMsec(true) - startTime < 500);
+		EVENTUALLY(5,
+			result = fileExists("tmp.hooks/output");
+		);
+		EVENTUALLY(1,
+			result = readAll("tmp.hooks/output") == "123\n";
+		);
+	}
+
+	TEST_METHOD(2) {
+		// Hook scripts with the same batch key are merged into one invocation.
+		createScript("tmp.hooks/hook.sh",
+			"echo $PASSENGER_PROCESS_PID $PASSENGER_APP_ROOT >> tmp.hooks/output\n");
+		startExecutor(300);
+		executor->schedule(createOptions("1"), "key");
+		executor->schedule(createOptions("2"), "key");
+		executor->schedule(createOptions("3"), "key");
+		executor->drain();
+		ensure_equals(readAll("tmp.hooks/output"), "1,2,3 /foo\n");
+	}
+
+	TEST_METHOD(3) {
+		// Hook scripts without a batch key are not merged.
+		createScript("tmp.hooks/hook.sh",
+			"echo $PASSENGER_PROCESS_PID >> tmp.hooks/output\n");
+		startExecutor(300);
+		executor->schedule(createOptions("1"));
+		executor->schedule(createOptions("2"));
+		executor->drain();
+		ensure_equals(readAll("tmp.hooks/output"), "1\n2\n");
+	}
+
+	TEST_METHOD(4) {
+		// Hook scripts that run longer than their timeout are killed.
+		createScript("tmp.hooks/hook.sh", "sleep 5\n");
+		HookScriptOptions options = createOptions("1");
+		options.timeout = 100;
+		unsigned long long startTime = SystemTime::getMsec(true);
+		ensure(!runHookScripts(options));
+		ensure(SystemTime::getMsec(true) - startTime < 2000);
+	}
+}
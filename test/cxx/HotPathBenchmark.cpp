@@ -0,0 +1,552 @@
+/*
+ * Micro-benchmarks for the components on the request hot path, meant for
+ * catching performance regressions between releases.
+ *
+ *   rake benchmark:hot_path ARGS="--filter Dechunker --json results.json"
+ *
+ * Every benchmark is first calibrated: the number of iterations per sample
+ * is doubled until a sample takes at least min_sample_time. Then the given
+ * number of samples is taken, and the time per iteration is reported as
+ * the minimum, the 50th, 90th and 99th percentile and the maximum over
+ * all samples.
+ *
+ * Options, given as "--name value" pairs:
+ *
+ *   filter           Only run benchmarks whose name contains this string.
+ *   samples          Number of samples per benchmark. Default: 30.
+ *   min_sample_time  Minimum duration of a sample, in microseconds.
+ *                    Default: 10000.
+ *   json             Also write the results as JSON to this file, or to
+ *                    stdout if the value is "-".
+ *
+ * Must be run from the 'test' directory, like CxxTestMain.
+ */
+#include <oxt/initialize.hpp>
+#include <oxt/system_calls.hpp>
+#include <oxt/backtrace.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <BackgroundEventLoop.cpp>
+#include <MultiLibeio.cpp>
+#include <Logging.h>
+#include <ResourceLocator.h>
+#include <ServerInstanceDir.h>
+#include <ApplicationPool2/Pool.h>
+#include <agents/HelperAgent/ScgiRequestParser.h>
+#include <agents/HelperAgent/FileBackedPipe.h>
+#include <Utils/CachedFileStat.hpp>
+#include <Utils/Dechunker.h>
+#include <Utils/HttpHeaderBufferer.h>
+#include <Utils/MessageIO.h>
+#include <Utils/IOUtils.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/StringMap.h>
+#include <Utils/SystemTime.h>
+#include <Utils/VariantMap.h>
+#include <Utils/json.h>
+#include <Utils.h>
+
+using namespace std;
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+
+
+/** Results are added to this, so that the compiler can't optimize the work away. */
+static volatile size_t sink;
+
+static VariantMap options;
+
+static const char *HEADER_NAMES[] = {
+	"CONTENT_LENGTH", "CONTENT_TYPE", "DOCUMENT_ROOT", "HTTP_ACCEPT",
+	"HTTP_ACCEPT_ENCODING", "HTTP_ACCEPT_LANGUAGE", "HTTP_CONNECTION",
+	"HTTP_COOKIE", "HTTP_HOST", "HTTP_REFERER", "HTTP_USER_AGENT",
+	"PASSENGER_APP_ROOT", "PASSENGER_CONNECT_PASSWORD", "PATH_INFO",
+	"QUERY_STRING", "REMOTE_ADDR", "REMOTE_PORT", "REQUEST_METHOD",
+	"REQUEST_URI", "SCRIPT_NAME", "SERVER_NAME", "SERVER_PORT",
+	"SERVER_PROTOCOL", "SERVER_SOFTWARE"
+};
+static const unsigned int HEADER_COUNT = sizeof(HEADER_NAMES) / sizeof(const char *);
+
+
+class Benchmark {
+public:
+	virtual ~Benchmark() { }
+	virtual const char *getName() const = 0;
+	virtual void run(unsigned int iterations) = 0;
+};
+
+typedef boost::shared_ptr<Benchmark> BenchmarkPtr;
+
+
+class ScgiRequestParserBenchmark: public Benchmark {
+private:
+	ScgiRequestParser parser;
+	string request;
+
+public:
+	ScgiRequestParserBenchmark() {
+		string headers;
+		for (unsigned int i = 0; i < HEADER_COUNT; i++) {
+			headers.append(HEADER_NAMES[i]);
+			headers.append(1, '\0');
+			headers.append("some typical header value");
+			headers.append(1, '\0');
+		}
+		request = toString(headers.size()) + ":" + headers + ",";
+	}
+
+	virtual const char *getName() const {
+		return "ScgiRequestParser::feed";
+	}
+
+	virtual void run(unsigned int iterations) {
+		for (unsigned int i = 0; i < iterations; i++) {
+			parser.reset();
+			parser.feed(request.data(), request.size());
+			sink += parser.getHeader("HTTP_HOST").size();
+		}
+	}
+};
+
+class HttpHeaderBuffererBenchmark: public Benchmark {
+private:
+	HttpHeaderBufferer bufferer;
+	string response;
+	size_t fragmentSize;
+	string name;
+
+public:
+	HttpHeaderBuffererBenchmark(size_t _fragmentSize)
+		: fragmentSize(_fragmentSize)
+	{
+		response = "HTTP/1.1 200 OK\r\n"
+			"Status: 200 OK\r\n"
+			"Content-Type: text/html; charset=utf-8\r\n"
+			"Cache-Control: max-age=0, private, must-revalidate\r\n"
+			"Set-Cookie: _session_id=BAh7B0kiD3Nlc3Npb25faWQGOgZFRkkiJTk5YjY1; path=/; HttpOnly\r\n"
+			"X-Request-Id: 4f4b1a7c-8d1e-4b7f-9f0a-1c2d3e4f5a6b\r\n"
+			"X-Runtime: 0.012345\r\n"
+			"X-Frame-Options: SAMEORIGIN\r\n"
+			"X-Content-Type-Options: nosniff\r\n"
+			"ETag: \"d41d8cd98f00b204e9800998ecf8427e\"\r\n"
+			"\r\n"
+			"<html><body>Hello world</body></html>";
+		if (fragmentSize == 0) {
+			name = "HttpHeaderBufferer::feed";
+		} else {
+			name = "HttpHeaderBufferer::feed (" + toString(fragmentSize) + " byte fragments)";
+		}
+	}
+
+	virtual const char *getName() const {
+		return name.c_str();
+	}
+
+	virtual void run(unsigned int iterations) {
+		size_t step = (fragmentSize == 0) ? response.size() : fragmentSize;
+		for (unsigned int i = 0; i < iterations; i++) {
+			size_t pos = 0;
+			bufferer.reset();
+			while (bufferer.acceptingInput() && pos < response.size()) {
+				size_t size = std::min(step, response.size() - pos);
+				pos += bufferer.feed(response.data() + pos, size);
+			}
+			sink += bufferer.getData().size();
+		}
+	}
+};
+
+class DechunkerBenchmark: public Benchmark {
+private:
+	Dechunker dechunker;
+	string body;
+
+	static void onData(const char *data, size_t size, void *userData) {
+		sink += size;
+	}
+
+public:
+	DechunkerBenchmark() {
+		string chunk(4096, 'x');
+		for (unsigned int i = 0; i < 16; i++) {
+			body.append("1000\r\n");
+			body.append(chunk);
+			body.append("\r\n");
+		}
+		body.append("0\r\n\r\n");
+		dechunker.onData = onData;
+	}
+
+	virtual const char *getName() const {
+		return "Dechunker::feed (64 KB in 4 KB chunks)";
+	}
+
+	virtual void run(unsigned int iterations) {
+		for (unsigned int i = 0; i < iterations; i++) {
+			dechunker.reset();
+			dechunker.feed(body.data(), body.size());
+		}
+	}
+};
+
+class StringMapBenchmark: public Benchmark {
+public:
+	virtual const char *getName() const {
+		return "StringMap set and get (24 headers)";
+	}
+
+	virtual void run(unsigned int iterations) {
+		for (unsigned int i = 0; i < iterations; i++) {
+			StringMap<unsigned int> map;
+			for (unsigned int j = 0; j < HEADER_COUNT; j++) {
+				map.set(HEADER_NAMES[j], j);
+			}
+			for (unsigned int j = 0; j < HEADER_COUNT; j++) {
+				sink += map.get(HEADER_NAMES[j]);
+			}
+		}
+	}
+};
+
+class FileBackedPipeBenchmark: public Benchmark {
+private:
+	SafeLibevPtr libev;
+	FileBackedPipePtr pipe;
+	string data;
+
+	static void onData(const FileBackedPipePtr &source, const char *data,
+		size_t size, const FileBackedPipe::ConsumeCallback &consumed)
+	{
+		sink += size;
+		consumed(size, false);
+	}
+
+public:
+	FileBackedPipeBenchmark()
+		: data(4096, 'x')
+	{
+		// The pipe never touches the disk in this benchmark, so the
+		// event loop doesn't need to run; we only need its thread ID.
+		libev = boost::make_shared<SafeLibev>(ev_loop_new(EVFLAG_AUTO));
+		pipe = boost::make_shared<FileBackedPipe>("/tmp");
+		pipe->onData = onData;
+	}
+
+	virtual const char *getName() const {
+		return "FileBackedPipe write and consume (4 KB, in memory)";
+	}
+
+	virtual void run(unsigned int iterations) {
+		for (unsigned int i = 0; i < iterations; i++) {
+			pipe->reset(libev);
+			// Buffered while stopped, delivered by start().
+			pipe->write(data.data(), data.size());
+			pipe->start();
+			// Delivered immediately.
+			pipe->write(data.data(), data.size());
+			pipe->end();
+		}
+	}
+};
+
+class MessageIOBenchmark: public Benchmark {
+private:
+	SocketPair sockets;
+	vector<string> received;
+
+public:
+	MessageIOBenchmark() {
+		sockets = createUnixSocketPair();
+	}
+
+	virtual const char *getName() const {
+		return "MessageIO array message round trip";
+	}
+
+	virtual void run(unsigned int iterations) {
+		StaticString args[] = { "log", "1234-abcdefghijk", "hn7yhrsvw1" };
+		for (unsigned int i = 0; i < iterations; i++) {
+			writeArrayMessage(sockets.first, args, 3);
+			readArrayMessage(sockets.second, received);
+			sink += received.size();
+		}
+	}
+};
+
+class CachedFileStatBenchmark: public Benchmark {
+private:
+	CachedFileStat cache;
+	vector<string> filenames;
+
+public:
+	CachedFileStatBenchmark()
+		: cache(1024)
+	{
+		for (unsigned int i = 0; i < 64; i++) {
+			filenames.push_back("/var/www/customer" + toString(i) + "/current/public");
+		}
+	}
+
+	virtual const char *getName() const {
+		return "CachedFileStat::stat (cached)";
+	}
+
+	virtual void run(unsigned int iterations) {
+		struct stat buf;
+		for (unsigned int i = 0; i < iterations; i++) {
+			sink += cache.stat(filenames[i % filenames.size()], &buf, 3600);
+		}
+	}
+};
+
+class PoolAsyncGetBenchmark: public Benchmark {
+private:
+	ServerInstanceDirPtr serverInstanceDir;
+	ServerInstanceDir::GenerationPtr generation;
+	ResourceLocator resourceLocator;
+	BackgroundEventLoop bg;
+	SpawnerConfigPtr spawnerConfig;
+	SpawnerFactoryPtr spawnerFactory;
+	PoolPtr pool;
+	Options options;
+	Ticket ticket;
+
+	static void callback(Ticket *ticket, const SessionPtr &session, ExceptionPtr e) {
+		boost::lock_guard<boost::mutex> l(ticket->syncher);
+		ticket->session = session;
+		ticket->exception = e;
+		ticket->cond.notify_one();
+	}
+
+	SessionPtr get() {
+		ticket.session.reset();
+		ticket.exception.reset();
+		pool->asyncGet(options, boost::bind(callback, &ticket, _1, _2));
+
+		boost::unique_lock<boost::mutex> l(ticket.syncher);
+		while (ticket.session == NULL && ticket.exception == NULL) {
+			ticket.cond.wait(l);
+		}
+		if (ticket.exception != NULL) {
+			rethrowException(ticket.exception);
+		}
+		SessionPtr session = ticket.session;
+		ticket.session.reset();
+		return session;
+	}
+
+	static string getPassengerRoot() {
+		char path[PATH_MAX + 1];
+		if (getcwd(path, PATH_MAX) == NULL) {
+			int e = errno;
+			throw SystemException("Cannot get the current working directory", e);
+		}
+		return extractDirName(path);
+	}
+
+public:
+	PoolAsyncGetBenchmark()
+		: resourceLocator(getPassengerRoot())
+	{
+		serverInstanceDir = boost::make_shared<ServerInstanceDir>(
+			"/tmp/passenger-benchmark." + toString(getpid()));
+		generation = serverInstanceDir->newGeneration(false,
+			"nobody", getGroupName(getegid()),
+			geteuid(), getegid());
+		spawnerConfig = boost::make_shared<SpawnerConfig>();
+		spawnerFactory = boost::make_shared<SpawnerFactory>(bg.safe, resourceLocator,
+			generation, spawnerConfig);
+		pool = boost::make_shared<Pool>(spawnerFactory);
+		pool->initialize();
+		bg.start();
+
+		options.spawnMethod = "dummy";
+		options.appRoot = "stub/rack";
+		options.startCommand = "ruby\t" "start.rb";
+		options.startupFile  = "start.rb";
+		options.loadShellEnvvars = false;
+
+		// Spawn the process outside the measurements.
+		get()->close(true);
+	}
+
+	~PoolAsyncGetBenchmark() {
+		pool->destroy();
+		pool.reset();
+		bg.stop();
+	}
+
+	virtual const char *getName() const {
+		return "Pool::asyncGet and Session::close (DummySpawner)";
+	}
+
+	virtual void run(unsigned int iterations) {
+		for (unsigned int i = 0; i < iterations; i++) {
+			SessionPtr session = get();
+			sink += session->getPid();
+			session->close(true);
+		}
+	}
+};
+
+
+struct Result {
+	string name;
+	unsigned int iterations;
+	/** Nanoseconds per iteration, for each sample, sorted. */
+	vector<double> samples;
+
+	double percentile(double p) const {
+		// Nearest-rank method.
+		size_t rank = (size_t) ceil(p / 100 * samples.size());
+		return samples[std::max<size_t>(rank, 1) - 1];
+	}
+
+	double mean() const {
+		double total = 0;
+		for (unsigned int i = 0; i < samples.size(); i++) {
+			total += samples[i];
+		}
+		return total / samples.size();
+	}
+
+	Json::Value inspectAsJson() const {
+		Json::Value doc;
+		doc["name"] = name;
+		doc["iterations_per_sample"] = iterations;
+		doc["samples"] = (Json::UInt) samples.size();
+		doc["min_ns"] = samples.front();
+		doc["p50_ns"] = percentile(50);
+		doc["p90_ns"] = percentile(90);
+		doc["p99_ns"] = percentile(99);
+		doc["max_ns"] = samples.back();
+		doc["mean_ns"] = mean();
+		return doc;
+	}
+};
+
+
+static void
+parseOptions(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i += 2) {
+		string name = argv[i];
+		if (!startsWith(name, "--") || i + 1 >= argc) {
+			fprintf(stderr, "Usage: %s [--name value ...]\n", argv[0]);
+			exit(1);
+		}
+		name = name.substr(2);
+		for (string::size_type j = 0; j < name.size(); j++) {
+			if (name[j] == '-') {
+				name[j] = '_';
+			}
+		}
+		options.set(name, argv[i + 1]);
+	}
+}
+
+static unsigned long long
+timeRun(Benchmark &benchmark, unsigned int iterations) {
+	unsigned long long start = SystemTime::getMonotonicUsec();
+	benchmark.run(iterations);
+	return SystemTime::getMonotonicUsec() - start;
+}
+
+static Result
+measure(Benchmark &benchmark) {
+	unsigned int samples = std::max(1, options.getInt("samples", false, 30));
+	unsigned long long minSampleTime = options.getULL("min_sample_time", false, 10000);
+	Result result;
+
+	result.name = benchmark.getName();
+	result.iterations = 1;
+	while (timeRun(benchmark, result.iterations) < minSampleTime
+	    && result.iterations < UINT_MAX / 2)
+	{
+		result.iterations *= 2;
+	}
+
+	for (unsigned int i = 0; i < samples; i++) {
+		unsigned long long time = timeRun(benchmark, result.iterations);
+		result.samples.push_back(time * 1000.0 / result.iterations);
+	}
+	std::sort(result.samples.begin(), result.samples.end());
+	return result;
+}
+
+static void
+writeJson(const vector<Result> &results) {
+	Json::Value doc;
+	doc["benchmarks"] = Json::Value(Json::arrayValue);
+	for (unsigned int i = 0; i < results.size(); i++) {
+		doc["benchmarks"].append(results[i].inspectAsJson());
+	}
+
+	string filename = options.get("json");
+	if (filename == "-") {
+		printf("%s", doc.toStyledString().c_str());
+	} else {
+		createFile(filename, doc.toStyledString());
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	signal(SIGPIPE, SIG_IGN);
+	oxt::initialize();
+	oxt::setup_syscall_interruption_support();
+	setLogLevel(LVL_ERROR);
+	parseOptions(argc, argv);
+	Passenger::MultiLibeio::init();
+
+	vector<BenchmarkPtr> benchmarks;
+	benchmarks.push_back(boost::make_shared<ScgiRequestParserBenchmark>());
+	benchmarks.push_back(boost::make_shared<HttpHeaderBuffererBenchmark>(0));
+	benchmarks.push_back(boost::make_shared<HttpHeaderBuffererBenchmark>(64));
+	benchmarks.push_back(boost::make_shared<DechunkerBenchmark>());
+	benchmarks.push_back(boost::make_shared<StringMapBenchmark>());
+	benchmarks.push_back(boost::make_shared<FileBackedPipeBenchmark>());
+	benchmarks.push_back(boost::make_shared<MessageIOBenchmark>());
+	benchmarks.push_back(boost::make_shared<CachedFileStatBenchmark>());
+	benchmarks.push_back(boost::make_shared<PoolAsyncGetBenchmark>());
+
+	string filter = options.get("filter", false);
+	bool jsonToStdout = options.get("json", false) == "-";
+	FILE *out = jsonToStdout ? stderr : stdout;
+	vector<Result> results;
+
+	fprintf(out, "%-52s %10s %10s %10s %10s %10s\n", "Benchmark (ns/iteration)",
+		"min", "p50", "p90", "p99", "max");
+	for (unsigned int i = 0; i < benchmarks.size(); i++) {
+		if (!filter.empty() && strstr(benchmarks[i]->getName(), filter.c_str()) == NULL) {
+			continue;
+		}
+		Result result = measure(*benchmarks[i]);
+		fprintf(out, "%-52s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			result.name.c_str(), result.samples.front(), result.percentile(50),
+			result.percentile(90), result.percentile(99), result.samples.back());
+		fflush(out);
+		results.push_back(result);
+	}
+	benchmarks.clear();
+
+	if (options.has("json")) {
+		writeJson(results);
+	}
+	Passenger::MultiLibeio::shutdown();
+	return 0;
+}
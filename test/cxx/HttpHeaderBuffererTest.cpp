@@ -200,4 +200,24 @@ namespace tut {
 		ensure(bufferer.acceptingInput());
 		ensure(!bufferer.hasError());
 	}
+	
+	TEST_METHOD(25) {
+		// A partial terminator followed by a mismatch doesn't hide a
+		// terminator that starts inside it, also across feeds.
+		string input2 = "GET / HTTP/1.1\r\nX: \r\r\n\r\r\n\r\nbody";
+		size_t headerSize = input2.size() - 4;
+		
+		ensure_equals(bufferer.feed(input2.data(), input2.size()), headerSize);
+		ensure(!bufferer.acceptingInput());
+		ensure_equals(bufferer.getData(), input2.substr(0, headerSize));
+		
+		bufferer.reset();
+		for (size_t i = 0; i < headerSize; i++) {
+			ensure(bufferer.acceptingInput());
+			ensure_equals(bufferer.feed(input2.data() + i, 1), 1u);
+		}
+		ensure(!bufferer.acceptingInput());
+		ensure(!bufferer.hasError());
+		ensure_equals(bufferer.getData(), input2.substr(0, headerSize));
+	}
 }
@@ -0,0 +1,253 @@
+#include "TestSupport.h"
+#include "agents/HelperAgent/HttpRequestParser.h"
+#include "agents/HelperAgent/ScgiRequestParser.h"
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct HttpRequestParserTest {
+		HttpRequestParser parser;
+		ScgiRequestParser scgi;
+
+		size_t feed(const StaticString &data) {
+			return parser.feed(data.data(), data.size());
+		}
+
+		/** Parses the parser's output so that the CGI variables can be looked up. */
+		void parseOutput() {
+			StaticString data = parser.getHeaderData();
+			string netstring = toString(data.size()) + ":" + data + ",";
+			ensure_equals(scgi.feed(netstring.data(), netstring.size()), netstring.size());
+			ensure_equals(scgi.getState(), ScgiRequestParser::DONE);
+		}
+	};
+
+	DEFINE_TEST_GROUP(HttpRequestParserTest);
+
+	/***** Request line and headers *****/
+
+	TEST_METHOD(1) {
+		// It parses a simple request and maps it to CGI variables.
+		StaticString data = "GET /foo/bar?a=1&b=2 HTTP/1.1\r\n"
+			"Host: www.example.com:8080\r\n"
+			"Accept-Language: en\r\n"
+			"Content-Type: text/plain\r\n"
+			"\r\n";
+		ensure_equals(feed(data), data.size());
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure_equals(scgi.getHeader("REQUEST_METHOD"), "GET");
+		ensure_equals(scgi.getHeader("REQUEST_URI"), "/foo/bar?a=1&b=2");
+		ensure_equals(scgi.getHeader("PATH_INFO"), "/foo/bar");
+		ensure_equals(scgi.getHeader("QUERY_STRING"), "a=1&b=2");
+		ensure(scgi.hasHeader("SCRIPT_NAME"));
+		ensure_equals(scgi.getHeader("SERVER_PROTOCOL"), "HTTP/1.1");
+		ensure_equals(scgi.getHeader("SERVER_NAME"), "www.example.com");
+		ensure_equals(scgi.getHeader("HTTP_HOST"), "www.example.com:8080");
+		ensure_equals(scgi.getHeader("HTTP_ACCEPT_LANGUAGE"), "en");
+		ensure_equals(scgi.getHeader("CONTENT_TYPE"), "text/plain");
+		ensure(!scgi.hasHeader("HTTP_CONTENT_TYPE"));
+		ensure("HTTP/1.1 is kept alive", parser.keepAlive());
+	}
+
+	TEST_METHOD(2) {
+		// It accepts the header in pieces, including a terminator
+		// that is split over multiple feed() calls.
+		StaticString data = "GET / HTTP/1.1\r\nHost: foo\r\n\r\n";
+		for (string::size_type i = 0; i < data.size(); i++) {
+			ensure(parser.acceptingInput());
+			ensure_equals(parser.feed(data.data() + i, 1), 1u);
+		}
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure_equals(scgi.getHeader("HTTP_HOST"), "foo");
+	}
+
+	TEST_METHOD(3) {
+		// It doesn't consume the data that follows the header.
+		StaticString data = "POST / HTTP/1.1\r\nHost: foo\r\nContent-Length: 5\r\n\r\nhello";
+		ensure_equals(feed(data), data.size() - 5);
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure_equals(scgi.getHeader("CONTENT_LENGTH"), "5");
+	}
+
+	TEST_METHOD(4) {
+		// It accepts bare LF line endings and skips empty lines
+		// before the request line.
+		StaticString data = "\r\n\r\nGET /x HTTP/1.0\nUser-Agent: test\n\n";
+		ensure_equals(feed(data), data.size());
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure_equals(scgi.getHeader("REQUEST_URI"), "/x");
+		ensure_equals(scgi.getHeader("HTTP_USER_AGENT"), "test");
+	}
+
+	TEST_METHOD(5) {
+		// It joins repeated headers and continuation lines.
+		StaticString data = "GET / HTTP/1.1\r\n"
+			"Host: foo\r\n"
+			"Accept: text/html\r\n"
+			"Cookie: a=1\r\n"
+			"X-Folded: one\r\n"
+			"   two\r\n"
+			"Accept: text/plain\r\n"
+			"Cookie: b=2\r\n"
+			"\r\n";
+		feed(data);
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure_equals(scgi.getHeader("HTTP_ACCEPT"), "text/html, text/plain");
+		ensure_equals(scgi.getHeader("HTTP_COOKIE"), "a=1; b=2");
+		ensure_equals(scgi.getHeader("HTTP_X_FOLDED"), "one two");
+	}
+
+	TEST_METHOD(6) {
+		// It drops headers with underscores in their names.
+		StaticString data = "GET / HTTP/1.1\r\n"
+			"Host: foo\r\n"
+			"X_Forwarded-For: 1.2.3.4\r\n"
+			"\r\n";
+		feed(data);
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure(!scgi.hasHeader("HTTP_X_FORWARDED_FOR"));
+	}
+
+	TEST_METHOD(7) {
+		// It reduces absolute URIs to a path, and takes the host from them.
+		StaticString data = "GET http://example.org?q HTTP/1.1\r\nHost: other\r\n\r\n";
+		feed(data);
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		parseOutput();
+		ensure_equals(scgi.getHeader("REQUEST_URI"), "/?q");
+		ensure_equals(scgi.getHeader("PATH_INFO"), "/");
+		ensure_equals(scgi.getHeader("HTTP_HOST"), "example.org");
+	}
+
+	TEST_METHOD(8) {
+		// Requests without a Host header get the default server name,
+		// and IPv6 hosts keep their brackets.
+		parser.defaultServerName = "10.0.0.1";
+		feed("GET / HTTP/1.0\r\n\r\n");
+		parseOutput();
+		ensure_equals(scgi.getHeader("SERVER_NAME"), "10.0.0.1");
+		ensure("HTTP/1.0 is not kept alive", !parser.keepAlive());
+
+		parser.reset();
+		scgi.reset();
+		feed("GET / HTTP/1.1\r\nHost: [::1]:3000\r\n\r\n");
+		parseOutput();
+		ensure_equals(scgi.getHeader("SERVER_NAME"), "[::1]");
+	}
+
+	/***** Connection management and body framing *****/
+
+	TEST_METHOD(10) {
+		// "Connection: close" disables keep-alive.
+		feed("GET / HTTP/1.1\r\nHost: foo\r\nConnection: TE, close\r\n\r\n");
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		ensure(!parser.keepAlive());
+	}
+
+	TEST_METHOD(11) {
+		// It recognizes chunked request bodies and 100-continue, and
+		// doesn't pass those headers on.
+		feed("POST / HTTP/1.1\r\nHost: foo\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"Expect: 100-continue\r\n\r\n");
+		ensure_equals(parser.getState(), HttpRequestParser::DONE);
+		ensure(parser.isChunked());
+		ensure(parser.expectsContinue());
+		parseOutput();
+		ensure(!scgi.hasHeader("HTTP_TRANSFER_ENCODING"));
+		ensure(!scgi.hasHeader("HTTP_EXPECT"));
+		ensure(!scgi.hasHeader("CONTENT_LENGTH"));
+	}
+
+	TEST_METHOD(12) {
+		// It rejects other transfer encodings with 501.
+		feed("POST / HTTP/1.1\r\nHost: foo\r\nTransfer-Encoding: gzip, chunked\r\n\r\n");
+		ensure_equals(parser.getState(), HttpRequestParser::ERROR);
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::UNSUPPORTED_TRANSFER_ENCODING);
+		ensure_equals(parser.getErrorStatusCode(), 501);
+	}
+
+	TEST_METHOD(13) {
+		// It rejects ambiguous body lengths.
+		feed("POST / HTTP/1.1\r\nHost: foo\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::INVALID_CONTENT_LENGTH);
+
+		parser.reset();
+		feed("POST / HTTP/1.1\r\nHost: foo\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::INVALID_CONTENT_LENGTH);
+
+		parser.reset();
+		feed("POST / HTTP/1.1\r\nHost: foo\r\nContent-Length: -1\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::INVALID_CONTENT_LENGTH);
+
+		parser.reset();
+		feed("POST / HTTP/1.1\r\nHost: foo\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\n");
+		ensure_equals("Identical duplicates are allowed",
+			parser.getState(), HttpRequestParser::DONE);
+	}
+
+	/***** Errors *****/
+
+	TEST_METHOD(20) {
+		// It rejects malformed request lines.
+		const char *lines[] = {
+			"GET\r\n\r\n",
+			"GET /\r\n\r\n",
+			"GET / HTTP/1.1 extra\r\n\r\n",
+			"G(T / HTTP/1.1\r\n\r\n",
+			"GET foo HTTP/1.1\r\n\r\n",
+			"GET / HTTX/1.1\r\n\r\n",
+			NULL
+		};
+		for (unsigned int i = 0; lines[i] != NULL; i++) {
+			parser.reset();
+			feed(lines[i]);
+			ensure_equals(lines[i], parser.getErrorReason(), HttpRequestParser::INVALID_REQUEST_LINE);
+			ensure_equals(parser.getErrorStatusCode(), 400);
+		}
+	}
+
+	TEST_METHOD(21) {
+		// It rejects other HTTP versions with 505.
+		feed("GET / HTTP/2.0\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::UNSUPPORTED_HTTP_VERSION);
+		ensure_equals(parser.getErrorStatusCode(), 505);
+	}
+
+	TEST_METHOD(22) {
+		// It rejects malformed headers, including ones containing NUL bytes.
+		feed("GET / HTTP/1.1\r\nHost foo\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::INVALID_HEADER);
+
+		parser.reset();
+		feed("GET / HTTP/1.1\r\n continued\r\nHost: foo\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::INVALID_HEADER);
+
+		parser.reset();
+		feed(StaticString("GET / HTTP/1.1\r\nHost: f\0o\r\n\r\n", 29));
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::INVALID_HEADER);
+	}
+
+	TEST_METHOD(23) {
+		// HTTP/1.1 requests must have a Host header.
+		feed("GET / HTTP/1.1\r\n\r\n");
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::MISSING_HOST_HEADER);
+	}
+
+	TEST_METHOD(24) {
+		// It enforces the size limit.
+		HttpRequestParser parser(32);
+		StaticString data = "GET / HTTP/1.1\r\nHost: foo\r\nX-Foo: barbarbarbar\r\n\r\n";
+		ensure_equals(parser.feed(data.data(), data.size()), 32u);
+		ensure_equals(parser.getState(), HttpRequestParser::ERROR);
+		ensure_equals(parser.getErrorReason(), HttpRequestParser::LIMIT_REACHED);
+		ensure_equals(parser.getErrorStatusCode(), 431);
+	}
+}
@@ -810,6 +810,36 @@ namespace tut {
 		}
 	}
 	
+	/***** Test getUnixServerQueueInfo() *****/
+	
+	TEST_METHOD(75) {
+		// It reports the number of connections waiting to be accepted.
+		#ifdef __linux__
+			string filename = "/tmp/passenger-test-" + toString(getpid()) + ".sock";
+			FileDescriptor server(createUnixServer(filename, 16));
+			FileDescriptor client1(connectToUnixServer(filename));
+			FileDescriptor client2(connectToUnixServer(filename));
+			unsigned int queued, backlog;
+			unlink(filename.c_str());
+			
+			ensure(getUnixServerQueueInfo(server, queued, backlog));
+			ensure_equals(queued, 2u);
+			ensure_equals(backlog, 16u);
+		#endif
+	}
+	
+	/***** Test getPeerUid() *****/
+	
+	TEST_METHOD(76) {
+		// It returns the user ID of the process on the other end.
+		#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+			SocketPair sockets = createUnixSocketPair();
+			uid_t uid = (uid_t) -1;
+			ensure(getPeerUid(sockets[0], uid));
+			ensure_equals(uid, geteuid());
+		#endif
+	}
+	
 	/***** Test readFileDescriptor() and writeFileDescriptor() *****/
 	
 	TEST_METHOD(80) {
@@ -0,0 +1,134 @@
+#include "TestSupport.h"
+#include <Utils/InlineFunction.h>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct InlineFunctionTest {
+		static int instances;
+
+		struct Counter {
+			int *calls;
+			char padding[16];
+
+			Counter(int *c)
+				: calls(c)
+			{
+				instances++;
+			}
+
+			Counter(const Counter &other)
+				: calls(other.calls)
+			{
+				instances++;
+			}
+
+			~Counter() {
+				instances--;
+			}
+
+			int operator()(int x) const {
+				(*calls)++;
+				return x * 2;
+			}
+		};
+
+		struct BigCounter: public Counter {
+			char morePadding[128];
+
+			BigCounter(int *c)
+				: Counter(c)
+				{ }
+		};
+
+		InlineFunctionTest() {
+			instances = 0;
+		}
+
+		static int add(int a, int b) {
+			return a + b;
+		}
+
+		void concat(const boost::shared_ptr<string> &str, const string &a, const string &b) {
+			str->append(a);
+			str->append(b);
+		}
+	};
+
+	int InlineFunctionTest::instances;
+
+	DEFINE_TEST_GROUP(InlineFunctionTest);
+
+	TEST_METHOD(1) {
+		// A default constructed InlineFunction is empty.
+		InlineFunction<void ()> f;
+		ensure(f.empty());
+		ensure(!f);
+	}
+
+	TEST_METHOD(2) {
+		// It calls function pointers, and treats NULL pointers
+		// and empty boost::functions as empty.
+		InlineFunction<int (int, int)> f = add;
+		ensure(!f.empty());
+		ensure_equals(f(1, 2), 3);
+
+		f = (int (*)(int, int)) NULL;
+		ensure(f.empty());
+		f = boost::function<int (int, int)>();
+		ensure(f.empty());
+		f = boost::function<int (int, int)>(add);
+		ensure_equals(f(2, 3), 5);
+	}
+
+	TEST_METHOD(3) {
+		// It calls boost::bind() results that bind a member function,
+		// an object and a shared_ptr.
+		boost::shared_ptr<string> str = boost::make_shared<string>();
+		InlineFunction<void (const string &, const string &)> f =
+			boost::bind(&InlineFunctionTest::concat, this, str, _1, _2);
+		ensure_equals("The bound shared_ptr is retained", str.use_count(), 2l);
+		f("a", "b");
+		ensure_equals(*str, "ab");
+		f.clear();
+		ensure(f.empty());
+		ensure_equals("The bound shared_ptr is released", str.use_count(), 1l);
+	}
+
+	TEST_METHOD(4) {
+		// Function objects that fit in the buffer and those that don't
+		// are copied and destroyed properly.
+		int calls = 0;
+		{
+			InlineFunction<int (int)> small = Counter(&calls);
+			InlineFunction<int (int)> big = BigCounter(&calls);
+			ensure_equals(instances, 2);
+			InlineFunction<int (int)> small2 = small;
+			InlineFunction<int (int)> big2 = big;
+			ensure_equals(instances, 4);
+			ensure_equals(small2(1), 2);
+			ensure_equals(big2(2), 4);
+			ensure_equals(calls, 2);
+
+			small = big;
+			ensure_equals(instances, 4);
+			big = big;
+			ensure_equals(instances, 4);
+			ensure_equals(big(3), 6);
+			small2.clear();
+			ensure_equals(instances, 3);
+		}
+		ensure_equals(instances, 0);
+	}
+
+	TEST_METHOD(5) {
+		// It can be bound itself, because it defines result_type.
+		InlineFunction<int (int, int)> f = add;
+		InlineFunction<int ()> g = boost::bind(f, 4, 5);
+		ensure_equals(g(), 9);
+	}
+}
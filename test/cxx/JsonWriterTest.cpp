@@ -0,0 +1,87 @@
+#include "TestSupport.h"
+#include <Utils/JsonWriter.h>
+#include <Utils/json.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct JsonWriterTest {
+		string buffer;
+		JsonWriter writer;
+
+		JsonWriterTest()
+			: writer(buffer)
+			{ }
+	};
+
+	DEFINE_TEST_GROUP(JsonWriterTest);
+
+	TEST_METHOD(1) {
+		// It writes nested objects and arrays with commas in between values.
+		writer.beginObject();
+		writer.field("a", 1);
+		writer.key("b");
+		writer.beginArray();
+		writer.value(true);
+		writer.value("x");
+		writer.beginObject();
+		writer.endObject();
+		writer.beginArray();
+		writer.endArray();
+		writer.null();
+		writer.endArray();
+		writer.field("c", string("y"));
+		writer.endObject();
+		ensure(writer.isComplete());
+		ensure_equals(buffer, "{\"a\":1,\"b\":[true,\"x\",{},[],null],\"c\":\"y\"}");
+	}
+
+	TEST_METHOD(2) {
+		// It writes integers of all sizes and doubles.
+		writer.beginArray();
+		writer.value(-1);
+		writer.value(4294967295u);
+		writer.value(-9223372036854775807ll);
+		writer.value(18446744073709551615ull);
+		writer.value(0.5);
+		writer.value(false);
+		writer.endArray();
+		ensure_equals(buffer,
+			"[-1,4294967295,-9223372036854775807,18446744073709551615,0.5,false]");
+	}
+
+	TEST_METHOD(3) {
+		// It escapes the characters in strings that must be escaped.
+		string str("quote\" backslash\\ newline\n tab\t nul", 35);
+		str.append(1, '\0');
+		str.append("\x01\x1f \xc3\xa9");
+		writer.beginObject();
+		writer.field("key\"", str);
+		writer.endObject();
+		ensure_equals(buffer,
+			"{\"key\\\"\":\"quote\\\" backslash\\\\ newline\\n tab\\t nul"
+			"\\u0000\\u0001\\u001f \xc3\xa9\"}");
+	}
+
+	TEST_METHOD(4) {
+		// A JSON parser reads escaped strings back unchanged.
+		string str = "quote\" backslash\\ newline\n \x01 \xc3\xa9";
+		writer.beginArray();
+		writer.value(str);
+		writer.endArray();
+
+		Json::Reader reader;
+		Json::Value doc;
+		ensure(reader.parse(buffer, doc));
+		ensure_equals(doc[0u].asString(), str);
+	}
+
+	TEST_METHOD(5) {
+		// It appends to the buffer, so that the buffer can be reused.
+		buffer = "x";
+		writer.beginArray();
+		writer.endArray();
+		ensure_equals(buffer, "x[]");
+	}
+}
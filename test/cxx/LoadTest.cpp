@@ -0,0 +1,624 @@
+/*
+ * End-to-end load test. Starts the watchdog, HelperAgent and LoggingAgent
+ * through AgentsStarter, like the web server modules do, and sends requests
+ * for one of the stub applications to the HelperAgent's request socket.
+ * Alternatively, it sends plain HTTP requests to a web server, e.g. an Nginx
+ * that has been started with test/stub/nginx/nginx.conf.erb.
+ *
+ *   rake test:load ARGS="--scenario large_uploads --rate 50 --duration 30"
+ *
+ * The load is open-loop: request i is scheduled at start + i / rate,
+ * regardless of whether earlier requests have finished, and its latency is
+ * measured from its scheduled time. So when the server falls behind, the
+ * time that requests spend waiting for a free connection shows up in the
+ * latencies instead of silently lowering the request rate.
+ *
+ * Options, given as "--name value" pairs:
+ *
+ *   scenario         One of:
+ *                      plain            GET requests for 'uri'.
+ *                      slow_clients     Like 'large_downloads', but the
+ *                                       headers are sent in two parts and the
+ *                                       response is read at 'slow_client_speed'.
+ *                      large_uploads    POSTs of 'upload_size' bytes.
+ *                      large_downloads  Responses of 'download_size' bytes.
+ *                      restarts         Like 'plain', while the application is
+ *                                       restarted every 'restart_interval'
+ *                                       seconds through tmp/restart.txt.
+ *                    Default: plain.
+ *   rate             Requests per second. Default: 100.
+ *   duration         Duration of the test, in seconds. Default: 10.
+ *   connections      Maximum number of concurrent requests. Default: 64.
+ *   app_root         Default: test/stub/rack.
+ *   app_type         Default: rack.
+ *   uri              Default: /.
+ *   upload_size      Default: 1048576.
+ *   download_size    Default: 1048576.
+ *   slow_client_speed
+ *                    In bytes per second. Default: 65536.
+ *   restart_interval Default: 2.
+ *   http_address     Send HTTP requests to this address, e.g.
+ *                    "tcp://127.0.0.1:8000", instead of starting the agents.
+ *   helper_agent_pid The PID of the HelperAgent to measure when http_address
+ *                    is given.
+ *   json             Also write the results as JSON to this file.
+ *
+ * All other options, e.g. max_pool_size or user_switching, are passed to
+ * the watchdog. The HelperAgent's CPU usage and RSS are only measured on
+ * systems with /proc.
+ *
+ * Must be run from the 'test' directory, like CxxTestMain.
+ */
+#include <oxt/initialize.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/atomic.hpp>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <limits.h>
+#include <signal.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <AgentsStarter.h>
+#include <FileDescriptor.h>
+#include <Logging.h>
+#include <Utils.h>
+#include <Utils/IOUtils.h>
+#include <Utils/ProcessMetricsCollector.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/SystemTime.h>
+#include <Utils/VariantMap.h>
+#include <Utils/json.h>
+
+using namespace std;
+using namespace oxt;
+using namespace Passenger;
+
+
+static const char *HARNESS_OPTIONS[] = {
+	"scenario", "rate", "duration", "connections", "app_root", "app_type",
+	"uri", "upload_size", "download_size", "slow_client_speed",
+	"restart_interval", "http_address", "helper_agent_pid", "json"
+};
+
+struct WorkerResult {
+	/** Latency of every successful request, in microseconds. */
+	vector<unsigned int> latencies;
+	unsigned long long errors;
+	unsigned long long bytesSent;
+	unsigned long long bytesReceived;
+
+	WorkerResult() {
+		errors = 0;
+		bytesSent = 0;
+		bytesReceived = 0;
+	}
+};
+
+struct ResourceUsage {
+	unsigned long long cpuTime;
+	ssize_t rss;
+	ssize_t peakRss;
+
+	ResourceUsage() {
+		cpuTime = 0;
+		rss = -1;
+		peakRss = -1;
+	}
+};
+
+static VariantMap options;
+static string scenario;
+static string serverAddress;
+static string connectPassword;
+static string root;
+static boost::atomic<unsigned long long> nextRequest(0);
+static unsigned long long startTime, endTime;
+static boost::mutex usageSyncher;
+static ResourceUsage usage;
+static boost::atomic<bool> finished(false);
+
+
+static void
+parseOptions(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i += 2) {
+		string name = argv[i];
+		if (!startsWith(name, "--") || i + 1 >= argc) {
+			fprintf(stderr, "Usage: %s [--name value ...]\n", argv[0]);
+			exit(1);
+		}
+		name = name.substr(2);
+		for (string::size_type j = 0; j < name.size(); j++) {
+			if (name[j] == '-') {
+				name[j] = '_';
+			}
+		}
+		options.set(name, argv[i + 1]);
+	}
+
+	scenario = options.get("scenario", false, "plain");
+	if (scenario != "plain" && scenario != "slow_clients"
+	 && scenario != "large_uploads" && scenario != "large_downloads"
+	 && scenario != "restarts")
+	{
+		fprintf(stderr, "Unknown scenario '%s'\n", scenario.c_str());
+		exit(1);
+	}
+	if (!options.has("app_root")) {
+		options.set("app_root", root + "/test/stub/rack");
+	}
+}
+
+static VariantMap
+getAgentOptions() {
+	VariantMap result;
+	VariantMap::ConstIterator it, end = options.end();
+	const char **harnessOptionsEnd = HARNESS_OPTIONS +
+		sizeof(HARNESS_OPTIONS) / sizeof(const char *);
+
+	for (it = options.begin(); it != end; it++) {
+		if (std::find(HARNESS_OPTIONS, harnessOptionsEnd, it->first) == harnessOptionsEnd) {
+			result.set(it->first, it->second);
+		}
+	}
+	return result;
+}
+
+
+/***** Talking to the server *****/
+
+static void
+addHeader(string &headers, const StaticString &name, const StaticString &value) {
+	headers.append(name.data(), name.size());
+	headers.append(1, '\0');
+	headers.append(value.data(), value.size());
+	headers.append(1, '\0');
+}
+
+/**
+ * Builds the request that the web server module would send to the
+ * HelperAgent: the connect password followed by an SCGI header.
+ */
+static string
+buildScgiRequest(const string &method, const string &uri, unsigned long long contentLength) {
+	string headers;
+	addHeader(headers, "REQUEST_METHOD", method);
+	addHeader(headers, "REQUEST_URI", uri);
+	addHeader(headers, "PATH_INFO", uri);
+	addHeader(headers, "QUERY_STRING", "");
+	addHeader(headers, "SCRIPT_NAME", "");
+	addHeader(headers, "SERVER_NAME", "localhost");
+	addHeader(headers, "SERVER_PORT", "80");
+	addHeader(headers, "SERVER_PROTOCOL", "HTTP/1.1");
+	addHeader(headers, "REMOTE_ADDR", "127.0.0.1");
+	addHeader(headers, "HTTP_HOST", "localhost");
+	addHeader(headers, "PASSENGER_APP_ROOT", options.get("app_root"));
+	addHeader(headers, "PASSENGER_APP_TYPE", options.get("app_type", false, "rack"));
+	addHeader(headers, "PASSENGER_LOAD_SHELL_ENVVARS", "false");
+	if (contentLength > 0) {
+		addHeader(headers, "CONTENT_LENGTH", toString(contentLength));
+		addHeader(headers, "HTTP_X_OUTPUT", "/dev/null");
+	}
+	if (scenario == "large_downloads" || scenario == "slow_clients") {
+		addHeader(headers, "HTTP_X_SIZE", options.get("download_size", false, "1048576"));
+	}
+	return connectPassword + toString(headers.size()) + ":" + headers + ",";
+}
+
+static string
+buildHttpRequest(const string &method, const string &uri, unsigned long long contentLength) {
+	string request = method + " " + uri + " HTTP/1.0\r\n"
+		"Host: localhost\r\n"
+		"Connection: close\r\n";
+	if (contentLength > 0) {
+		request.append("Content-Length: " + toString(contentLength) + "\r\n");
+		request.append("X-Output: /dev/null\r\n");
+	}
+	if (scenario == "large_downloads" || scenario == "slow_clients") {
+		request.append("X-Size: " + options.get("download_size", false, "1048576") + "\r\n");
+	}
+	request.append("\r\n");
+	return request;
+}
+
+static void
+sleepUsec(unsigned long long usec) {
+	if (usec > 0) {
+		syscalls::usleep(usec);
+	}
+}
+
+/** Sends one request and reads the response. Returns whether it succeeded. */
+static bool
+performRequest(WorkerResult &result, const string &uploadData) {
+	string method = "GET";
+	string uri = options.get("uri", false, "/");
+	if (scenario == "large_uploads") {
+		method = "POST";
+		uri = "/raw_upload_to_file";
+	} else if (scenario == "large_downloads" || scenario == "slow_clients") {
+		uri = "/blob";
+	}
+
+	string request;
+	if (options.has("http_address")) {
+		request = buildHttpRequest(method, uri, uploadData.size());
+	} else {
+		request = buildScgiRequest(method, uri, uploadData.size());
+	}
+
+	FileDescriptor fd(connectToServer(serverAddress));
+	if (scenario == "slow_clients") {
+		writeExact(fd, StaticString(request.data(), request.size() / 2));
+		sleepUsec(10000);
+		writeExact(fd, StaticString(request.data() + request.size() / 2,
+			request.size() - request.size() / 2));
+	} else {
+		writeExact(fd, request);
+	}
+	if (!uploadData.empty()) {
+		writeExact(fd, uploadData);
+	}
+	result.bytesSent += request.size() + uploadData.size();
+
+	unsigned long long slowClientSpeed = options.getULL("slow_client_speed", false, 65536);
+	char buf[1024 * 16];
+	size_t readSize = (scenario == "slow_clients") ? 4096 : sizeof(buf);
+	string head;
+	ssize_t ret;
+
+	while ((ret = syscalls::read(fd, buf, readSize)) > 0) {
+		if (head.size() < 16) {
+			head.append(buf, std::min<size_t>(ret, 16 - head.size()));
+		}
+		result.bytesReceived += ret;
+		if (scenario == "slow_clients") {
+			sleepUsec(ret * 1000000ull / std::max(1ull, slowClientSpeed));
+		}
+	}
+	if (ret == -1) {
+		int e = errno;
+		throw SystemException("Cannot read the response", e);
+	}
+
+	// "HTTP/1.1 200 OK"
+	string::size_type pos = head.find(' ');
+	if (pos == string::npos) {
+		return false;
+	}
+	unsigned int status = atoi(head.c_str() + pos + 1);
+	return status >= 200 && status < 400;
+}
+
+static void
+runWorker(WorkerResult *result) {
+	double rate = atof(options.get("rate", false, "100").c_str());
+	string uploadData;
+
+	if (scenario == "large_uploads") {
+		// The stub applications read uploads line by line.
+		string line(63, 'x');
+		line.append("\n");
+		unsigned long long size = options.getULL("upload_size", false, 1048576);
+		while (uploadData.size() + line.size() <= size) {
+			uploadData.append(line);
+		}
+		uploadData.append(size - uploadData.size(), '\n');
+	}
+
+	while (true) {
+		unsigned long long i = nextRequest.fetch_add(1);
+		unsigned long long scheduledTime = startTime + (unsigned long long) (i * 1000000 / rate);
+		if (scheduledTime >= endTime) {
+			break;
+		}
+
+		unsigned long long now = SystemTime::getMonotonicUsec();
+		if (now < scheduledTime) {
+			sleepUsec(scheduledTime - now);
+		}
+
+		bool success;
+		try {
+			success = performRequest(*result, uploadData);
+		} catch (const std::exception &e) {
+			P_DEBUG("Request failed: " << e.what());
+			success = false;
+		}
+		if (success) {
+			result->latencies.push_back((unsigned int)
+				(SystemTime::getMonotonicUsec() - scheduledTime));
+		} else {
+			result->errors++;
+		}
+	}
+}
+
+
+/***** Scenario helpers *****/
+
+static void
+touchRestartFile() {
+	string filename = options.get("app_root") + "/tmp/restart.txt";
+	if (!fileExists(filename)) {
+		createFile(filename, "");
+	}
+	// Restarts are triggered by modification time changes.
+	if (utime(filename.c_str(), NULL) == -1) {
+		int e = errno;
+		P_WARN("Cannot touch " << filename << ": " << strerror(e));
+	}
+}
+
+static void
+runRestarter() {
+	unsigned long long interval = options.getULL("restart_interval", false, 2) * 1000000;
+	while (!finished.load()) {
+		try {
+			syscalls::usleep(interval);
+		} catch (const thread_interrupted &) {
+			break;
+		}
+		touchRestartFile();
+	}
+}
+
+
+/***** Measuring the HelperAgent *****/
+
+/** Finds the HelperAgent among the watchdog's child processes. */
+static pid_t
+findHelperAgent(pid_t watchdogPid) {
+	DIR *dir = opendir("/proc");
+	struct dirent *entry;
+	pid_t result = 0;
+
+	if (dir == NULL) {
+		return 0;
+	}
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		pid_t pid = atoi(entry->d_name);
+		if (pid <= 0) {
+			continue;
+		}
+		string stat;
+		try {
+			stat = readAll("/proc/" + string(entry->d_name) + "/stat");
+		} catch (const SystemException &) {
+			continue;
+		}
+		// "pid (comm) state ppid ..."
+		string::size_type commEnd = stat.rfind(')');
+		if (commEnd == string::npos
+		 || stat.find("(PassengerHelpe") == string::npos)
+		{
+			continue;
+		}
+		vector<string> fields;
+		split(stat.substr(commEnd + 2), ' ', fields);
+		if (fields.size() > 1 && atoi(fields[1].c_str()) == watchdogPid) {
+			result = pid;
+		}
+	}
+	closedir(dir);
+	return result;
+}
+
+/** Returns the user and system CPU time of the given process, in microseconds. */
+static unsigned long long
+getCpuTime(pid_t pid) {
+	string stat;
+	try {
+		stat = readAll("/proc/" + toString(pid) + "/stat");
+	} catch (const SystemException &) {
+		return 0;
+	}
+	string::size_type commEnd = stat.rfind(')');
+	if (commEnd == string::npos) {
+		return 0;
+	}
+	vector<string> fields;
+	split(stat.substr(commEnd + 2), ' ', fields);
+	if (fields.size() < 13) {
+		return 0;
+	}
+	// utime and stime are fields 14 and 15 of the whole line.
+	unsigned long long ticks = atoll(fields[11].c_str()) + atoll(fields[12].c_str());
+	return ticks * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static ssize_t
+getRss(pid_t pid) {
+	ProcessMetricsCollector collector;
+	vector<pid_t> pids;
+	pids.push_back(pid);
+	try {
+		ProcessMetricMap metrics = collector.collect(pids);
+		ProcessMetricMap::const_iterator it = metrics.find(pid);
+		if (it != metrics.end()) {
+			return it->second.rss;
+		}
+	} catch (const std::exception &) {
+		// Fall through.
+	}
+	return -1;
+}
+
+static void
+runMonitor(pid_t helperAgentPid) {
+	unsigned long long startCpuTime = getCpuTime(helperAgentPid);
+	while (!finished.load()) {
+		ssize_t rss = getRss(helperAgentPid);
+		unsigned long long cpuTime = getCpuTime(helperAgentPid);
+		{
+			boost::lock_guard<boost::mutex> l(usageSyncher);
+			usage.cpuTime = cpuTime - startCpuTime;
+			usage.rss = rss;
+			usage.peakRss = std::max(usage.peakRss, rss);
+		}
+		try {
+			syscalls::usleep(250000);
+		} catch (const thread_interrupted &) {
+			break;
+		}
+	}
+}
+
+
+/***** Reporting *****/
+
+static unsigned int
+percentile(const vector<unsigned int> &sortedValues, double p) {
+	if (sortedValues.empty()) {
+		return 0;
+	}
+	// Nearest-rank method.
+	size_t rank = (size_t) ceil(p / 100 * sortedValues.size());
+	return sortedValues[std::max<size_t>(rank, 1) - 1];
+}
+
+static void
+report(const vector<WorkerResult> &results, unsigned long long wallTime,
+	pid_t helperAgentPid)
+{
+	vector<unsigned int> latencies;
+	unsigned long long errors = 0, bytesSent = 0, bytesReceived = 0;
+	for (unsigned int i = 0; i < results.size(); i++) {
+		latencies.insert(latencies.end(), results[i].latencies.begin(),
+			results[i].latencies.end());
+		errors += results[i].errors;
+		bytesSent += results[i].bytesSent;
+		bytesReceived += results[i].bytesReceived;
+	}
+	std::sort(latencies.begin(), latencies.end());
+	double seconds = wallTime / 1000000.0;
+
+	printf("Scenario          : %s\n", scenario.c_str());
+	printf("Requests          : %llu successful, %llu failed in %.3f sec\n",
+		(unsigned long long) latencies.size(), errors, seconds);
+	printf("Throughput        : %.1f requests/sec, %.1f MB/sec sent, %.1f MB/sec received\n",
+		latencies.size() / seconds, bytesSent / seconds / 1024 / 1024,
+		bytesReceived / seconds / 1024 / 1024);
+	printf("Latency           : p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+		percentile(latencies, 50) / 1000.0, percentile(latencies, 90) / 1000.0,
+		percentile(latencies, 99) / 1000.0, percentile(latencies, 100) / 1000.0);
+	if (helperAgentPid != 0) {
+		printf("HelperAgent CPU   : %.3f sec (%.1f%% of one core)\n",
+			usage.cpuTime / 1000000.0, 100.0 * usage.cpuTime / wallTime);
+		printf("HelperAgent RSS   : %.1f MB at the end, %.1f MB peak\n",
+			usage.rss / 1024.0, usage.peakRss / 1024.0);
+	}
+
+	if (options.has("json")) {
+		Json::Value doc;
+		doc["scenario"] = scenario;
+		doc["rate"] = atof(options.get("rate", false, "100").c_str());
+		doc["duration_sec"] = seconds;
+		doc["successful_requests"] = (Json::UInt64) latencies.size();
+		doc["failed_requests"] = (Json::UInt64) errors;
+		doc["requests_per_sec"] = latencies.size() / seconds;
+		doc["bytes_sent"] = (Json::UInt64) bytesSent;
+		doc["bytes_received"] = (Json::UInt64) bytesReceived;
+		doc["latency_ms"]["p50"] = percentile(latencies, 50) / 1000.0;
+		doc["latency_ms"]["p90"] = percentile(latencies, 90) / 1000.0;
+		doc["latency_ms"]["p99"] = percentile(latencies, 99) / 1000.0;
+		doc["latency_ms"]["max"] = percentile(latencies, 100) / 1000.0;
+		if (helperAgentPid != 0) {
+			doc["helper_agent"]["cpu_sec"] = usage.cpuTime / 1000000.0;
+			doc["helper_agent"]["rss_kb"] = (Json::Int64) usage.rss;
+			doc["helper_agent"]["peak_rss_kb"] = (Json::Int64) usage.peakRss;
+		}
+		createFile(options.get("json"), doc.toStyledString());
+	}
+}
+
+
+int
+main(int argc, char *argv[]) {
+	signal(SIGPIPE, SIG_IGN);
+	oxt::initialize();
+	oxt::setup_syscall_interruption_support();
+	setLogLevel(LVL_WARN);
+
+	char path[PATH_MAX + 1];
+	getcwd(path, PATH_MAX);
+	root = extractDirName(path);
+	parseOptions(argc, argv);
+
+	AgentsStarter starter(AS_NGINX);
+	pid_t helperAgentPid = 0;
+	if (options.has("http_address")) {
+		serverAddress = options.get("http_address");
+		helperAgentPid = options.getPid("helper_agent_pid", false, 0);
+	} else {
+		starter.start(root, getAgentOptions());
+		serverAddress = "unix:" + starter.getRequestSocketFilename();
+		connectPassword = starter.getRequestSocketPassword();
+		helperAgentPid = findHelperAgent(starter.getPid());
+	}
+
+	// Spawn the application outside the measurements.
+	{
+		WorkerResult warmup;
+		string savedScenario = scenario;
+		scenario = "plain";
+		try {
+			performRequest(warmup, "");
+		} catch (const std::exception &e) {
+			fprintf(stderr, "Warmup request failed: %s\n", e.what());
+		}
+		scenario = savedScenario;
+	}
+
+	unsigned int connections = std::max(1, options.getInt("connections", false, 64));
+	unsigned long long duration = options.getULL("duration", false, 10) * 1000000;
+	vector<WorkerResult> results(connections);
+	vector< boost::shared_ptr<oxt::thread> > workers;
+	boost::shared_ptr<oxt::thread> monitor, restarter;
+
+	if (helperAgentPid != 0) {
+		monitor = boost::make_shared<oxt::thread>(
+			boost::bind(runMonitor, helperAgentPid), "Monitor");
+	}
+	if (scenario == "restarts") {
+		restarter = boost::make_shared<oxt::thread>(runRestarter, "Restarter");
+	}
+
+	startTime = SystemTime::getMonotonicUsec();
+	endTime = startTime + duration;
+	for (unsigned int i = 0; i < connections; i++) {
+		workers.push_back(boost::make_shared<oxt::thread>(
+			boost::bind(runWorker, &results[i]),
+			"Worker " + toString(i), 1024 * 128));
+	}
+	for (unsigned int i = 0; i < connections; i++) {
+		workers[i]->join();
+	}
+	unsigned long long wallTime = SystemTime::getMonotonicUsec() - startTime;
+
+	finished.store(true);
+	if (restarter != NULL) {
+		restarter->interrupt_and_join();
+		unlink((options.get("app_root") + "/tmp/restart.txt").c_str());
+	}
+	if (monitor != NULL) {
+		monitor->interrupt_and_join();
+	}
+
+	report(results, wallTime, helperAgentPid);
+	return 0;
+}
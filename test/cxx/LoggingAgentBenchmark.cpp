@@ -0,0 +1,244 @@
+/*
+ * Measures how many transactions per second an in-process LoggingServer can
+ * handle, driven by client threads that log through UnionStation::LoggerFactory.
+ *
+ *   rake benchmark:logging_agent ARGS="--clients 8 --message_size 512"
+ *
+ * Options, given as "--name value" pairs:
+ *
+ *   clients          Number of client threads. Default: 4.
+ *   transactions     Number of transactions per client thread. Default: 10000.
+ *   messages         Number of messages per transaction. Default: 10.
+ *   message_size     Size of each message, in bytes. Default: 100.
+ *   event_loops      Number of LoggingServer event loops. Default: 1.
+ *   filter           A filter source that is attached to every transaction.
+ *   union_station_key
+ *                    Send transactions to a remote sink with this key instead
+ *                    of writing them to the dump file.
+ *   buffer_messages  Whether loggers buffer messages. Default: false.
+ *
+ * All other options, e.g. analytics_dump_file or union_station_gateway_address,
+ * are passed to the LoggingServer. Transactions are written to /dev/null
+ * unless analytics_dump_file is given.
+ */
+#include <oxt/initialize.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <oxt/backtrace.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <ev++.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <Utils/IOUtils.h>
+#include <Utils/SystemTime.h>
+#include <Utils/VariantMap.h>
+#include <AccountsDatabase.h>
+#include <Logging.h>
+#include <UnionStation.h>
+#include <agents/LoggingAgent/LoggingServer.h>
+#include <agents/LoggingAgent/MetricsAggregator.h>
+
+using namespace std;
+using namespace oxt;
+using namespace Passenger;
+using namespace Passenger::UnionStation;
+
+
+struct ClientResult {
+	ResponseTimeHistogram writeLatencies;
+	unsigned long long cpuTime;
+
+	ClientResult() {
+		cpuTime = 0;
+	}
+};
+
+static VariantMap options;
+static string socketAddress;
+
+
+static unsigned long long
+timevalToUsec(const struct timeval &tv) {
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static unsigned long long
+getCpuTime(int who) {
+	struct rusage usage;
+	if (getrusage(who, &usage) == -1) {
+		return 0;
+	} else {
+		return timevalToUsec(usage.ru_utime) + timevalToUsec(usage.ru_stime);
+	}
+}
+
+static void
+parseOptions(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i += 2) {
+		string name = argv[i];
+		if (!startsWith(name, "--") || i + 1 >= argc) {
+			fprintf(stderr, "Usage: %s [--name value ...]\n", argv[0]);
+			exit(1);
+		}
+		name = name.substr(2);
+		for (string::size_type j = 0; j < name.size(); j++) {
+			if (name[j] == '-') {
+				name[j] = '_';
+			}
+		}
+		options.set(name, argv[i + 1]);
+	}
+	if (!options.has("analytics_dump_file")) {
+		options.set("analytics_dump_file", "/dev/null");
+	}
+}
+
+static void
+recordLatency(ClientResult &result, unsigned long long startTime) {
+	result.writeLatencies.record((unsigned int) (SystemTime::getMonotonicUsec() - startTime));
+}
+
+static void
+runClient(ClientResult *result) {
+	unsigned int transactions = options.getInt("transactions", false, 10000);
+	unsigned int messages = options.getInt("messages", false, 10);
+	string message(options.getInt("message_size", false, 100), 'x');
+	string unionStationKey = options.get("union_station_key", false, "-");
+	string filter = options.get("filter", false, "");
+	LoggerFactoryPtr factory = boost::make_shared<LoggerFactory>(socketAddress,
+		"benchmark", "1234", "localhost");
+
+	factory->setBufferMessages(options.getBool("buffer_messages", false, false));
+	for (unsigned int i = 0; i < transactions; i++) {
+		unsigned long long startTime = SystemTime::getMonotonicUsec();
+		LoggerPtr log = factory->newTransaction("benchmark", "requests",
+			unionStationKey, filter);
+		recordLatency(*result, startTime);
+
+		for (unsigned int j = 0; j < messages; j++) {
+			startTime = SystemTime::getMonotonicUsec();
+			log->message(message);
+			recordLatency(*result, startTime);
+		}
+
+		startTime = SystemTime::getMonotonicUsec();
+		log.reset();
+		recordLatency(*result, startTime);
+	}
+
+	// Wait until the server has processed everything that this thread
+	// sent: the connection is reused, and the server acknowledges the
+	// flush only after processing the preceding messages.
+	LoggerPtr log = factory->newTransaction("benchmark");
+	log->flushToDiskAfterClose(true);
+	log.reset();
+
+	#ifdef RUSAGE_THREAD
+		result->cpuTime = getCpuTime(RUSAGE_THREAD);
+	#endif
+}
+
+static void
+breakLoop(ev::async &watcher, int revents) {
+	watcher.loop.break_loop(ev::ONE);
+}
+
+int
+main(int argc, char *argv[]) {
+	signal(SIGPIPE, SIG_IGN);
+	oxt::initialize();
+	oxt::setup_syscall_interruption_support();
+	setLogLevel(-1);
+	parseOptions(argc, argv);
+
+	unsigned int clients = options.getInt("clients", false, 4);
+	unsigned int eventLoops = std::max(1, options.getInt("event_loops", false, 1));
+	unsigned int transactions = options.getInt("transactions", false, 10000);
+	string socketFilename = "/tmp/passenger-logging-benchmark." + toString(getpid());
+	socketAddress = "unix:" + socketFilename;
+
+	AccountsDatabasePtr accountsDatabase = boost::make_shared<AccountsDatabase>();
+	accountsDatabase->add("benchmark", "1234", false);
+	FileDescriptor serverFd(createUnixServer(socketFilename.c_str()));
+
+	vector< boost::shared_ptr<ev::dynamic_loop> > loops;
+	vector<LoggingServerPtr> servers;
+	vector< boost::shared_ptr<ev::async> > exitWatchers;
+	vector< boost::shared_ptr<oxt::thread> > serverThreads;
+	for (unsigned int i = 0; i < eventLoops; i++) {
+		loops.push_back(boost::make_shared<ev::dynamic_loop>());
+		exitWatchers.push_back(boost::make_shared<ev::async>(*loops[i]));
+		exitWatchers[i]->set<breakLoop>();
+		exitWatchers[i]->start();
+		if (i == 0) {
+			servers.push_back(boost::make_shared<LoggingServer>(*loops[i],
+				serverFd, accountsDatabase, options));
+		} else {
+			servers.push_back(boost::make_shared<LoggingServer>(*loops[i],
+				serverFd, accountsDatabase, *servers[0]));
+		}
+	}
+	for (unsigned int i = 0; i < eventLoops; i++) {
+		serverThreads.push_back(boost::make_shared<oxt::thread>(
+			boost::bind(&ev::dynamic_loop::loop, loops[i].get(), 0),
+			"Logging server " + toString(i)));
+	}
+
+	vector<ClientResult> results(clients);
+	vector< boost::shared_ptr<oxt::thread> > clientThreads;
+	unsigned long long startTime = SystemTime::getMonotonicUsec();
+	unsigned long long startCpuTime = getCpuTime(RUSAGE_SELF);
+	for (unsigned int i = 0; i < clients; i++) {
+		clientThreads.push_back(boost::make_shared<oxt::thread>(
+			boost::bind(runClient, &results[i]),
+			"Client " + toString(i)));
+	}
+	for (unsigned int i = 0; i < clients; i++) {
+		clientThreads[i]->join();
+	}
+	unsigned long long wallTime = SystemTime::getMonotonicUsec() - startTime;
+	unsigned long long cpuTime = getCpuTime(RUSAGE_SELF) - startCpuTime;
+
+	for (unsigned int i = 0; i < eventLoops; i++) {
+		exitWatchers[i]->send();
+		serverThreads[i]->join();
+		exitWatchers[i]->stop();
+	}
+	// Secondary servers must be destroyed before the primary one.
+	while (!servers.empty()) {
+		servers.pop_back();
+	}
+	unlink(socketFilename.c_str());
+
+	ResponseTimeHistogram writeLatencies;
+	unsigned long long clientCpuTime = 0;
+	for (unsigned int i = 0; i < clients; i++) {
+		writeLatencies.merge(results[i].writeLatencies);
+		clientCpuTime += results[i].cpuTime;
+	}
+
+	unsigned long long totalTransactions = (unsigned long long) clients * transactions;
+	printf("Transactions      : %llu in %.3f sec\n", totalTransactions, wallTime / 1000000.0);
+	printf("Throughput        : %.0f transactions/sec\n",
+		totalTransactions / (wallTime / 1000000.0));
+	printf("Write latency     : p50 %u usec, p99 %u usec\n",
+		writeLatencies.percentile(50), writeLatencies.percentile(99));
+	#ifdef RUSAGE_THREAD
+		printf("LoggingAgent CPU  : %.3f sec (%.1f%% of one core)\n",
+			(cpuTime - clientCpuTime) / 1000000.0,
+			100.0 * (cpuTime - clientCpuTime) / wallTime);
+	#else
+		printf("Process CPU       : %.3f sec (clients included)\n",
+			cpuTime / 1000000.0);
+	#endif
+	return 0;
+}
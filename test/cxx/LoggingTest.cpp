@@ -0,0 +1,89 @@
+#include "TestSupport.h"
+#include <Logging.h>
+#include <Utils/IOUtils.h>
+#include <oxt/thread.hpp>
+#include <boost/bind.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct LoggingTest {
+		TempDir tmpDir;
+		string logFile;
+		int oldLogOutput;
+		int oldLogLevel;
+
+		LoggingTest()
+			: tmpDir("tmp.logging")
+		{
+			logFile = "tmp.logging/log.txt";
+			oldLogOutput = _logOutput;
+			oldLogLevel = getLogLevel();
+			setLogLevel(0);
+			setDebugFile(logFile.c_str());
+		}
+
+		~LoggingTest() {
+			stopAsyncLogging();
+			close(_logOutput);
+			_logOutput = oldLogOutput;
+			setLogLevel(oldLogLevel);
+		}
+
+		static void logMessages(unsigned int thread, unsigned int count) {
+			for (unsigned int i = 0; i < count; i++) {
+				P_WARN("thread " << thread << " message " << i);
+			}
+		}
+	};
+
+	DEFINE_TEST_GROUP(LoggingTest);
+
+	TEST_METHOD(1) {
+		// Log entries of all threads are written by the async logging
+		// thread, completely and in order per thread.
+		startAsyncLogging();
+		vector< boost::shared_ptr<oxt::thread> > threads;
+		for (unsigned int i = 0; i < 4; i++) {
+			threads.push_back(boost::make_shared<oxt::thread>(
+				boost::bind(logMessages, i, 100)));
+		}
+		for (unsigned int i = 0; i < 4; i++) {
+			threads[i]->join();
+		}
+		stopAsyncLogging();
+
+		string data = readAll(logFile);
+		for (unsigned int i = 0; i < 4; i++) {
+			string::size_type pos = 0;
+			for (unsigned int j = 0; j < 100; j++) {
+				pos = data.find("thread " + toString(i) + " message " + toString(j) + "\n", pos);
+				ensure("Message " + toString(j) + " of thread " + toString(i) +
+					" is logged in order", pos != string::npos);
+			}
+		}
+	}
+
+	TEST_METHOD(2) {
+		// Entries that don't fit in the thread's buffer are dropped and
+		// counted, but entries that are larger than the whole buffer and
+		// errors are written synchronously.
+		unsigned long long dropped = getDroppedLogEntries();
+		startAsyncLogging(256);
+		logMessages(0, 1000);
+		P_WARN(string(300, 'x'));
+		P_ERROR("an error");
+		ensure("Large entries are written synchronously",
+			readAll(logFile).find(string(300, 'x')) != string::npos);
+		ensure("Errors are written synchronously",
+			readAll(logFile).find("an error\n") != string::npos);
+		stopAsyncLogging();
+
+		ensure("Entries are dropped", getDroppedLogEntries() > dropped);
+		ensure("Dropped entries are reported",
+			readAll(logFile).find(" log entries were dropped") != string::npos);
+	}
+}
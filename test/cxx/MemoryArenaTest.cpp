@@ -0,0 +1,82 @@
+#include "TestSupport.h"
+#include <Utils/MemoryArena.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct MemoryArenaTest {
+		MemoryArena arena;
+
+		MemoryArenaTest()
+			: arena(1024, 8192)
+			{ }
+	};
+
+	DEFINE_TEST_GROUP(MemoryArenaTest);
+
+	TEST_METHOD(1) {
+		// Allocations are bumped from a single block and are aligned.
+		char *a = (char *) arena.allocate(3, 1);
+		char *b = (char *) arena.allocate(8, 8);
+		char *c = (char *) arena.allocate(1, 1);
+		ensure_equals(arena.getBlockSize(), 1024u);
+		ensure_equals((size_t) b % 8, 0u);
+		ensure(b >= a + 3);
+		ensure_equals(c, b + 8);
+		ensure(!arena.overflowed());
+		ensure_equals(arena.getUsed(), 12u);
+	}
+
+	TEST_METHOD(2) {
+		// copy() and concat() return NULL-terminated copies.
+		string str = "hello";
+		StaticString copy = arena.copy(str);
+		str = "world";
+		ensure_equals(copy, StaticString("hello"));
+		ensure_equals(copy.data()[copy.size()], '\0');
+
+		StaticString both = arena.concat("Status: ", "200 OK");
+		ensure_equals(both, StaticString("Status: 200 OK"));
+		ensure_equals(both.data()[both.size()], '\0');
+	}
+
+	TEST_METHOD(3) {
+		// Allocations that don't fit in the block go to overflow blocks,
+		// and the next reset() grows the block to fit all of them.
+		for (int i = 0; i < 10; i++) {
+			memset(arena.allocate(300), 'x', 300);
+		}
+		ensure(arena.overflowed());
+		arena.reset();
+		ensure(!arena.overflowed());
+		ensure_equals(arena.getUsed(), 0u);
+		ensure(arena.getBlockSize() >= 3000);
+
+		for (int i = 0; i < 10; i++) {
+			arena.allocate(300);
+		}
+		ensure(!arena.overflowed());
+	}
+
+	TEST_METHOD(4) {
+		// The block doesn't grow beyond the maximum size; larger
+		// allocations still succeed.
+		memset(arena.allocate(100000), 'x', 100000);
+		ensure(arena.overflowed());
+		arena.reset();
+		ensure_equals(arena.getBlockSize(), 8192u);
+	}
+
+	TEST_METHOD(5) {
+		// The block shrinks after having been too large for a while.
+		arena.allocate(6000);
+		arena.reset();
+		ensure(arena.getBlockSize() >= 6000);
+		for (unsigned int i = 0; i < 2 * MemoryArena::SHRINK_INTERVAL; i++) {
+			arena.allocate(100);
+			arena.reset();
+		}
+		ensure_equals(arena.getBlockSize(), 1024u);
+	}
+}
@@ -1,6 +1,7 @@
 #include <TestSupport.h>
 #include <Utils/IOUtils.h>
 #include <Utils/MessageIO.h>
+#include <Utils/SmallVector.h>
 #include <Utils/SystemTime.h>
 
 using namespace Passenger;
@@ -278,6 +279,30 @@ namespace tut {
 		}
 	}
 	
+	TEST_METHOD(24) {
+		// readArrayMessage() can read into a reusable buffer and
+		// return StaticStrings that point into it.
+		writeArrayMessage(pipes[1], "ab", "", "cde", NULL);
+		writeArrayMessage(pipes[1], "f", NULL);
+		pipes[1].close();
+		
+		SmallVector<StaticString, 4> args;
+		string buffer;
+		ensure(readArrayMessage(pipes[0], args, buffer));
+		ensure_equals(args.size(), 3u);
+		ensure_equals(args[0], "ab");
+		ensure_equals(args[1], "");
+		ensure_equals(args[2], "cde");
+		ensure(args[0].data() >= buffer.data());
+		ensure(args[2].data() < buffer.data() + buffer.size());
+		
+		ensure(readArrayMessage(pipes[0], args, buffer));
+		ensure_equals(args.size(), 1u);
+		ensure_equals(args[0], "f");
+		
+		ensure("EOF", !readArrayMessage(pipes[0], args, buffer));
+	}
+	
 	/***** Test readScalarMessage() and writeScalarMessage() *****/
 	
 	TEST_METHOD(30) {
@@ -357,4 +382,23 @@ namespace tut {
 			ensure(timeout <= 2000);
 		}
 	}
+	
+	TEST_METHOD(34) {
+		// readScalarMessage() can read into a reusable buffer.
+		writeScalarMessage(pipes[1], "hello world");
+		writeScalarMessage(pipes[1], "");
+		writeScalarMessage(pipes[1], "abcdef");
+		
+		StaticString output;
+		string buffer;
+		ensure(readScalarMessage(pipes[0], output, buffer));
+		ensure_equals(output, "hello world");
+		ensure(readScalarMessage(pipes[0], output, buffer));
+		ensure_equals(output, "");
+		try {
+			readScalarMessage(pipes[0], output, buffer, 5);
+			fail("SecurityException expected");
+		} catch (const SecurityException &) {
+		}
+	}
 }
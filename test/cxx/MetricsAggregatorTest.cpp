@@ -0,0 +1,90 @@
+#include "TestSupport.h"
+#include "agents/LoggingAgent/MetricsAggregator.h"
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct MetricsAggregatorTest {
+		MetricsAggregator aggregator;
+
+		MetricsAggregatorTest()
+			: aggregator(1000)
+			{ }
+	};
+
+	DEFINE_TEST_GROUP(MetricsAggregatorTest);
+
+	TEST_METHOD(1) {
+		// Histogram buckets cover every value, and a value is off by
+		// at most 1/16th.
+		unsigned int values[] = { 0, 1, 31, 32, 33, 63, 64, 1000, 123456, 4294967295u };
+		for (unsigned int i = 0; i < sizeof(values) / sizeof(unsigned int); i++) {
+			unsigned int value = values[i];
+			unsigned int index = ResponseTimeHistogram::indexFor(value);
+			ensure("index is in range", index < ResponseTimeHistogram::BUCKET_COUNT);
+			ensure("lowest value", ResponseTimeHistogram::lowestValueAt(index) <= value);
+			ensure("highest value", ResponseTimeHistogram::highestValueAt(index) >= value);
+			ensure("precision", ResponseTimeHistogram::highestValueAt(index)
+				- ResponseTimeHistogram::lowestValueAt(index) <= value / 16);
+		}
+		ensure_equals(ResponseTimeHistogram::indexFor(4294967295u),
+			ResponseTimeHistogram::BUCKET_COUNT - 1);
+	}
+
+	TEST_METHOD(2) {
+		// Percentiles are computed from the buckets, and merging
+		// histograms adds up their buckets.
+		ResponseTimeHistogram histogram, other;
+		for (unsigned int i = 1; i <= 90; i++) {
+			histogram.record(10);
+		}
+		for (unsigned int i = 1; i <= 10; i++) {
+			other.record(100000);
+		}
+		histogram.merge(other);
+		ensure_equals(histogram.getTotalCount(), 100ull);
+		ensure_equals(histogram.percentile(50), 10u);
+		ensure_equals(histogram.percentile(90), 10u);
+		unsigned int p99 = histogram.percentile(99);
+		ensure(p99 >= 100000 && p99 <= 100000 + 100000 / 16);
+
+		string serialized;
+		histogram.serialize(serialized);
+		ensure_equals(serialized, "10:90," +
+			toString(ResponseTimeHistogram::indexFor(100000)) + ":10");
+	}
+
+	TEST_METHOD(3) {
+		// Requests are aggregated per application and controller action,
+		// separately for every Union Station key and node.
+		aggregator.record("key", "node", "app", "HomeController#index", 100, 200, 40, 1000);
+		aggregator.record("key", "node", "app", "HomeController#index", 300, 500, 60, 500);
+		aggregator.record("key", "node", "app", "", 50, 200);
+		aggregator.record("key2", "node", "app", "HomeController#index", 10, 200);
+
+		vector<MetricsAggregator::Summary> summaries;
+		aggregator.takeSummaries(summaries, 1010);
+		ensure_equals(summaries.size(), 2u);
+		ensure_equals(summaries[0].unionStationKey, "key");
+		ensure_equals(summaries[0].nodeName, "node");
+		ensure_equals(summaries[0].data,
+			"period 1000 1010\n"
+			"app\t-\tcount=1\terrors=0\ttotal=50\tmin=50\tmax=50\t"
+				"p50=50\tp90=50\tp99=50\tcpu=0\tallocations=0\thistogram=" +
+				toString(ResponseTimeHistogram::indexFor(50)) + ":1\n"
+			"app\tHomeController#index\tcount=2\terrors=1\ttotal=400\tmin=100\tmax=300\t"
+				"p50=" + toString(ResponseTimeHistogram::highestValueAt(ResponseTimeHistogram::indexFor(100))) +
+				"\tp90=300\tp99=300\tcpu=100\tallocations=1500\thistogram=" +
+				toString(ResponseTimeHistogram::indexFor(100)) + ":1," +
+				toString(ResponseTimeHistogram::indexFor(300)) + ":1\n");
+		ensure_equals(summaries[1].unionStationKey, "key2");
+		ensure(aggregator.empty());
+
+		summaries.clear();
+		aggregator.record("key", "node", "app", "", 50, 200);
+		aggregator.takeSummaries(summaries, 1020);
+		ensure_equals(summaries.size(), 1u);
+		ensure(startsWith(summaries[0].data, "period 1010 1020\n"));
+	}
+}
@@ -0,0 +1,103 @@
+#include "TestSupport.h"
+#include <Utils/MetricsRegistry.h>
+#include <oxt/thread.hpp>
+#include <boost/bind.hpp>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct MetricsRegistryTest {
+		MetricsRegistry registry;
+		int owner1, owner2;
+
+		static void incrementMany(Metric *metric) {
+			for (int i = 0; i < 100000; i++) {
+				metric->increment();
+			}
+		}
+	};
+
+	DEFINE_TEST_GROUP(MetricsRegistryTest);
+
+	TEST_METHOD(1) {
+		// Metrics are rendered in the Prometheus text format, sorted by name.
+		Metric *requests = registry.add(&owner1, "requests_total", Metric::COUNTER, "Requests.");
+		Metric *clients = registry.add(&owner1, "clients", Metric::GAUGE, "Clients.");
+		requests->add(3);
+		clients->increment();
+		clients->increment();
+		clients->decrement();
+		ensure_equals(registry.toPrometheusText(),
+			"# HELP clients Clients.\n"
+			"# TYPE clients gauge\n"
+			"clients 1\n"
+			"# HELP requests_total Requests.\n"
+			"# TYPE requests_total counter\n"
+			"requests_total 3\n");
+	}
+
+	TEST_METHOD(2) {
+		// Metrics with the same name and labels are summed. Different
+		// labels are rendered separately under the same name.
+		Metric *a = registry.add(&owner1, "sessions", Metric::GAUGE, "Sessions.",
+			MetricsRegistry::label("app", "/foo"));
+		Metric *b = registry.add(&owner2, "sessions", Metric::GAUGE, "Sessions.",
+			MetricsRegistry::label("app", "/foo"));
+		Metric *c = registry.add(&owner2, "sessions", Metric::GAUGE, "Sessions.",
+			MetricsRegistry::label("app", "/bar"));
+		a->set(2);
+		b->set(3);
+		c->set(4);
+		ensure_equals(registry.toPrometheusText(),
+			"# HELP sessions Sessions.\n"
+			"# TYPE sessions gauge\n"
+			"sessions{app=\"/bar\"} 4\n"
+			"sessions{app=\"/foo\"} 5\n");
+	}
+
+	TEST_METHOD(3) {
+		// removeAll() only removes the given owner's metrics.
+		registry.add(&owner1, "requests_total", Metric::COUNTER, "Requests.")->add(1);
+		registry.add(&owner2, "requests_total", Metric::COUNTER, "Requests.")->add(2);
+		registry.removeAll(&owner1);
+		ensure(containsSubstring(registry.toPrometheusText(), "requests_total 2\n"));
+		registry.removeAll(&owner2);
+		ensure_equals(registry.toPrometheusText(), "");
+	}
+
+	TEST_METHOD(4) {
+		// Registering an existing name with a different type is an error.
+		registry.add(&owner1, "requests_total", Metric::COUNTER, "Requests.");
+		try {
+			registry.add(&owner1, "requests_total", Metric::GAUGE, "Requests.");
+			fail("ArgumentException expected");
+		} catch (const ArgumentException &) {
+			// Pass.
+		}
+	}
+
+	TEST_METHOD(5) {
+		// Label values are escaped.
+		ensure_equals(MetricsRegistry::label("app", "a\"b\\c\nd"),
+			"app=\"a\\\"b\\\\c\\nd\"");
+	}
+
+	TEST_METHOD(6) {
+		// Metrics live on cache lines of their own and can be updated by
+		// different threads while they're being rendered.
+		Metric *a = registry.add(&owner1, "requests_total", Metric::COUNTER, "Requests.");
+		Metric *b = registry.add(&owner2, "requests_total", Metric::COUNTER, "Requests.");
+		ensure_equals((size_t) a % Metric::CACHE_LINE_SIZE, (size_t) 0);
+		ensure_equals((size_t) b % Metric::CACHE_LINE_SIZE, (size_t) 0);
+
+		oxt::thread thr1(boost::bind(incrementMany, a));
+		oxt::thread thr2(boost::bind(incrementMany, b));
+		for (int i = 0; i < 100; i++) {
+			registry.toPrometheusText();
+		}
+		thr1.join();
+		thr2.join();
+		ensure(containsSubstring(registry.toPrometheusText(), "requests_total 200000\n"));
+	}
+}
@@ -0,0 +1,147 @@
+#include <TestSupport.h>
+#include <BackgroundEventLoop.h>
+#include <MultiLibeio.h>
+#include <Utils/IOUtils.h>
+#include <boost/bind.hpp>
+#include <fcntl.h>
+#include <pthread.h>
+
+using namespace Passenger;
+using namespace std;
+using namespace boost;
+
+namespace tut {
+	struct MultiLibeioTest {
+		BackgroundEventLoop bg;
+		MultiLibeio libeio;
+		bool ioUringWasUsed;
+
+		boost::mutex syncher;
+		int callbackCount;
+		eio_req lastReq;
+		pthread_t callbackThread;
+
+		MultiLibeioTest()
+			: libeio(bg.safe)
+		{
+			ioUringWasUsed = MultiLibeio::usingIoUring();
+			callbackCount = 0;
+			unlink("tmp.libeio");
+			bg.start();
+		}
+
+		~MultiLibeioTest() {
+			bg.stop();
+			MultiLibeio::setIoUringEnabled(ioUringWasUsed);
+			unlink("tmp.libeio");
+		}
+
+		void callback(eio_req req) {
+			boost::lock_guard<boost::mutex> l(syncher);
+			lastReq = req;
+			callbackThread = pthread_self();
+			callbackCount++;
+		}
+
+		eio_req waitForCallback(int count) {
+			EVENTUALLY(5,
+				boost::lock_guard<boost::mutex> l(syncher);
+				result = callbackCount >= count;
+			);
+			boost::lock_guard<boost::mutex> l(syncher);
+			ensure("callback called from event loop thread",
+				pthread_equal(callbackThread, bg.safe->getCurrentThread()));
+			return lastReq;
+		}
+
+		void real_open(const char *path, int flags) {
+			eio_req *req = libeio.open(path, flags, 0600, 0,
+				boost::bind(&MultiLibeioTest::callback, this, _1));
+			ensure(req != NULL);
+		}
+
+		void real_read(int fd, char *buf, size_t size, off_t offset) {
+			eio_req *req = libeio.read(fd, buf, size, offset, 0,
+				boost::bind(&MultiLibeioTest::callback, this, _1));
+			ensure(req != NULL);
+		}
+
+		void real_write(int fd, const char *data, size_t size, off_t offset) {
+			eio_req *req = libeio.write(fd, (void *) data, size, offset, 0,
+				boost::bind(&MultiLibeioTest::callback, this, _1));
+			ensure(req != NULL);
+		}
+
+		void testRoundTrip() {
+			const char *path = "tmp.libeio";
+			char buf[6];
+			eio_req req;
+
+			bg.safe->run(boost::bind(&MultiLibeioTest::real_open, this,
+				path, O_CREAT | O_RDWR | O_TRUNC));
+			req = waitForCallback(1);
+			ensure("(1)", req.result >= 0);
+			FileDescriptor fd(req.result);
+
+			bg.safe->run(boost::bind(&MultiLibeioTest::real_write, this,
+				(int) fd, "hello world", 11, (off_t) 0));
+			req = waitForCallback(2);
+			ensure_equals("(2)", req.result, (eio_ssize_t) 11);
+
+			memset(buf, 0, sizeof(buf));
+			bg.safe->run(boost::bind(&MultiLibeioTest::real_read, this,
+				(int) fd, buf, 5, (off_t) 6));
+			req = waitForCallback(3);
+			ensure_equals("(3)", req.result, (eio_ssize_t) 5);
+			ensure_equals("(4)", string(buf), "world");
+		}
+
+		void testError() {
+			bg.safe->run(boost::bind(&MultiLibeioTest::real_open, this,
+				"tmp.libeio/nonexistant", O_RDONLY));
+			eio_req req = waitForCallback(1);
+			ensure_equals(req.result, (eio_ssize_t) -1);
+			ensure_equals(req.errorno, ENOENT);
+		}
+	};
+
+	DEFINE_TEST_GROUP(MultiLibeioTest);
+
+	TEST_METHOD(1) {
+		// open(), write() and read() work, and call the callback
+		// in the event loop thread.
+		testRoundTrip();
+	}
+
+	TEST_METHOD(2) {
+		// Errors are reported through the request's result and errorno.
+		testError();
+	}
+
+	TEST_METHOD(3) {
+		// Test 1 with io_uring disabled.
+		MultiLibeio::setIoUringEnabled(false);
+		ensure(!MultiLibeio::usingIoUring());
+		testRoundTrip();
+	}
+
+	TEST_METHOD(4) {
+		// Test 2 with io_uring disabled.
+		MultiLibeio::setIoUringEnabled(false);
+		testError();
+	}
+
+	TEST_METHOD(5) {
+		// Many concurrent operations all complete.
+		const char *path = "tmp.libeio";
+		FileDescriptor fd(open(path, O_CREAT | O_RDWR | O_TRUNC, 0600));
+		string data(1024 * 64, 'x');
+
+		for (unsigned int i = 0; i < 200; i++) {
+			bg.safe->runLater(boost::bind(&MultiLibeioTest::real_write, this,
+				(int) fd, data.data(), data.size(), (off_t) (i * data.size())));
+		}
+		waitForCallback(200);
+		ensure_equals(lseek(fd, 0, SEEK_END), (off_t) (200 * data.size()));
+	}
+}
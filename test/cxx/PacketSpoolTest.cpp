@@ -0,0 +1,110 @@
+#include "TestSupport.h"
+#include "agents/LoggingAgent/PacketSpool.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct PacketSpoolTest {
+		TempDir tmpDir;
+		string path;
+
+		PacketSpoolTest()
+			: tmpDir("tmp.spool")
+		{
+			path = "tmp.spool/spool";
+		}
+	};
+
+	DEFINE_TEST_GROUP(PacketSpoolTest);
+
+	TEST_METHOD(1) {
+		// Records are consumed in the order in which they were appended.
+		PacketSpool spool(path, 1024 * 1024);
+		string record;
+		ensure(spool.empty());
+		ensure(!spool.peek(record));
+
+		ensure(spool.append("hello"));
+		ensure(spool.append(string("wor\0ld", 6)));
+		ensure(spool.append(""));
+		ensure_equals(spool.size(), 3u);
+
+		ensure(spool.peek(record));
+		ensure_equals(record, "hello");
+		ensure(spool.peek(record));
+		ensure_equals("peek() doesn't consume the record", record, "hello");
+		spool.pop();
+		ensure(spool.peek(record));
+		ensure_equals(record, string("wor\0ld", 6));
+		spool.pop();
+		ensure(spool.peek(record));
+		ensure_equals(record, "");
+		spool.pop();
+		ensure(spool.empty());
+	}
+
+	TEST_METHOD(2) {
+		// Unconsumed records survive reopening the spool.
+		{
+			PacketSpool spool(path, 1024 * 1024);
+			spool.append("one");
+			spool.append("two");
+			spool.append("three");
+			spool.pop();
+		}
+
+		PacketSpool spool(path, 1024 * 1024);
+		string record;
+		ensure_equals(spool.size(), 2u);
+		ensure(spool.peek(record));
+		ensure_equals(record, "two");
+		spool.pop();
+		ensure(spool.peek(record));
+		ensure_equals(record, "three");
+	}
+
+	TEST_METHOD(3) {
+		// The spool doesn't grow beyond its maximum size, and is
+		// truncated once all records have been consumed.
+		PacketSpool spool(path, 110);
+		string data(40, 'x');
+		ensure(spool.append(data));
+		ensure(!spool.append(data + data));
+		ensure(spool.append(data));
+		ensure(!spool.append(data));
+		ensure_equals(spool.size(), 2u);
+
+		spool.pop();
+		spool.pop();
+		ensure(spool.empty());
+		ensure_equals(spool.usedBytes(), 0ull);
+		ensure(spool.append(data));
+		ensure(spool.append(data));
+	}
+
+	TEST_METHOD(4) {
+		// A partially written record at the end of the file is discarded
+		// when the spool is reopened.
+		{
+			PacketSpool spool(path, 1024 * 1024);
+			spool.append("complete");
+			spool.append("incomplete");
+		}
+		struct stat buf;
+		ensure_equals(stat(path.c_str(), &buf), 0);
+		ensure_equals(truncate(path.c_str(), buf.st_size - 3), 0);
+
+		PacketSpool spool(path, 1024 * 1024);
+		string record;
+		ensure_equals(spool.size(), 1u);
+		ensure(spool.peek(record));
+		ensure_equals(record, "complete");
+		ensure(spool.append("new"));
+		spool.pop();
+		ensure(spool.peek(record));
+		ensure_equals(record, "new");
+	}
+}
@@ -0,0 +1,633 @@
+/*
+ * Replays a request trace against a real ApplicationPool2::Pool whose
+ * processes are simulated, in order to see how pool settings behave under
+ * a given workload before trying them in production. Processes are created
+ * by a DummySpawner that takes `spawn_time` of virtual time to spawn one,
+ * and every request holds a session for its service time. The clock is
+ * virtual (see SystemTime::forceAll()), so an hour of traffic is simulated
+ * as fast as the Pool can route it.
+ *
+ *   rake test:pool_simulator ARGS="--trace requests.txt --max 20 --max_idle_time 120"
+ *   rake test:pool_simulator ARGS="--apps 4 --rate 200 --duration 600"
+ *
+ * Options, given as "--name value" pairs:
+ *
+ *   trace            A file with one request per line: the arrival time in
+ *                    microseconds since the start of the trace, the
+ *                    application name and the service time in microseconds,
+ *                    separated by whitespace. Lines must be ordered by
+ *                    arrival time; empty lines and lines starting with '#'
+ *                    are ignored. If not given, a synthetic trace is
+ *                    generated from the following four options.
+ *   apps             Number of applications, which receive equal shares of
+ *                    the traffic. Default: 1.
+ *   rate             Average number of requests per second, with Poisson
+ *                    distributed arrivals. Default: 100.
+ *   service_time     Average service time in microseconds, exponentially
+ *                    distributed. Default: 100000.
+ *   duration         Length of the trace in seconds. Default: 60.
+ *   seed             Random seed for the synthetic trace. Default: 1.
+ *
+ * Candidate pool settings:
+ *
+ *   max              Pool::setMax(). Default: 6.
+ *   max_idle_time    Pool::setMaxIdleTime(), in seconds. Default: 300.
+ *   min_instances    Options::minProcesses. Default: 1.
+ *   max_instances_per_app
+ *                    Options::maxProcesses. Default: 0 (unlimited).
+ *   max_request_queue_size
+ *                    Options::maxRequestQueueSize. Default: 100.
+ *   concurrency      Sessions that a process can handle at the same time,
+ *                    0 meaning unlimited. Default: 1.
+ *   spawn_time       Time it takes to spawn a process, in microseconds.
+ *                    Default: 1000000.
+ *   max_concurrent_spawns
+ *                    Pool::setMaxConcurrentSpawns(). Default: 0.
+ *   spawn_concurrency
+ *                    Pool::setSpawnConcurrency(). Default: 0.
+ *   latency_aware_routing
+ *                    Options::latencyAwareRouting. Default: false.
+ *   spawn_ahead_utilization
+ *                    Options::spawnAheadUtilization. Default: 0.
+ *   standby_processes
+ *                    Options::standbyProcesses. Default: 0.
+ *
+ * The garbage collector runs whenever Pool::realGarbageCollect() asks to run
+ * again, so processes may outlive max_idle_time by a bit, like they do in
+ * the HelperAgent.
+ */
+#include <oxt/initialize.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <oxt/backtrace.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
+#include <signal.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+
+#include <BackgroundEventLoop.cpp>
+#include <ApplicationPool2/Pool.h>
+#include <ApplicationPool2/DummySpawner.h>
+#include <agents/LoggingAgent/MetricsAggregator.h>
+#include <Logging.h>
+#include <ResourceLocator.h>
+#include <Utils/StrIntUtils.h>
+#include <Utils/SystemTime.h>
+#include <Utils/VariantMap.h>
+
+using namespace std;
+using namespace oxt;
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+
+
+struct App {
+	string name;
+	Options options;
+
+	unsigned long long requests;
+	unsigned long long rejected;
+	unsigned long long totalWaitTime;
+	ResponseTimeHistogram waitTimes;
+	unsigned int spawns;
+	unsigned int idleKills;
+
+	App(const string &_name)
+		: name(_name),
+		  requests(0),
+		  rejected(0),
+		  totalWaitTime(0),
+		  spawns(0),
+		  idleKills(0)
+		{ }
+};
+
+typedef boost::shared_ptr<App> AppPtr;
+
+struct Arrival {
+	unsigned long long time;
+	App *app;
+	unsigned int serviceTime;
+};
+
+/**
+ * A spawn that is waiting for the virtual clock to reach `time`.
+ */
+struct SpawnWaiter {
+	unsigned long long time;
+	bool released;
+};
+
+/**
+ * Something that happens at a point in virtual time: either a session
+ * that has been served and must be closed, or a spawn that finishes.
+ */
+struct Event {
+	unsigned long long time;
+	unsigned long long seq;
+	SessionPtr session;
+	unsigned int serviceTime;
+	SpawnWaiter *waiter;
+
+	bool operator<(const Event &other) const {
+		// Reversed, so that the priority_queue pops the earliest event first.
+		if (time != other.time) {
+			return time > other.time;
+		} else {
+			return seq > other.seq;
+		}
+	}
+};
+
+static VariantMap options;
+
+
+class Simulator {
+private:
+	boost::mutex syncher;
+	boost::condition_variable cond;
+	/** The virtual time, in microseconds since the Epoch. */
+	unsigned long long now;
+	unsigned long long startTime;
+	unsigned long long seq;
+	priority_queue<Event> events;
+	/** The number of spawner threads that are waiting in waitForSpawn(). */
+	unsigned int blockedSpawns;
+	/** Incremented whenever a spawner thread starts waiting, so that
+	 * waitUntilSettled() can tell whether that happened while it was
+	 * counting threads. */
+	unsigned long long blockGeneration;
+
+	FILE *traceFile;
+	unsigned short randomState[3];
+	double rate;
+	double meanServiceTime;
+	unsigned long long duration;
+	unsigned long long lastArrival;
+	/** Protects `appsByName` and `apps`, which the spawner threads look
+	 * up while the trace may add applications. */
+	boost::mutex appsSyncher;
+	map<string, AppPtr> appsByName;
+
+	unsigned long long busyTime;
+	unsigned long long processTime;
+	unsigned int peakProcesses;
+
+	double randomExponential(double mean) {
+		return -log(1 - erand48(randomState)) * mean;
+	}
+
+	App *getApp(const string &name) {
+		boost::lock_guard<boost::mutex> l(appsSyncher);
+		map<string, AppPtr>::iterator it = appsByName.find(name);
+		if (it != appsByName.end()) {
+			return it->second.get();
+		}
+
+		AppPtr app = boost::make_shared<App>(name);
+		Options &o = app->options;
+		o.spawnMethod = "dummy";
+		o.appRoot = app->name;
+		o.startCommand = "ruby\t" "start.rb";
+		o.startupFile = "start.rb";
+		o.loadShellEnvvars = false;
+		o.minProcesses = options.getInt("min_instances", false, 1);
+		o.maxProcesses = options.getInt("max_instances_per_app", false, 0);
+		o.maxRequestQueueSize = options.getInt("max_request_queue_size", false, 100);
+		o.latencyAwareRouting = options.getBool("latency_aware_routing", false, false);
+		o.spawnAheadUtilization = options.getInt("spawn_ahead_utilization", false, 0);
+		o.standbyProcesses = options.getInt("standby_processes", false, 0);
+		appsByName.insert(make_pair(name, app));
+		apps.push_back(app);
+		return app.get();
+	}
+
+	bool nextTraceArrival(Arrival &arrival) {
+		char line[1024];
+		char name[1024];
+		unsigned long long time, serviceTime;
+
+		while (fgets(line, sizeof(line), traceFile) != NULL) {
+			if (line[0] == '#' || line[0] == '\n') {
+				continue;
+			}
+			if (sscanf(line, "%llu %1023s %llu", &time, name, &serviceTime) != 3) {
+				fprintf(stderr, "Invalid trace line: %s", line);
+				exit(1);
+			}
+			if (time < lastArrival) {
+				fprintf(stderr, "Trace is not ordered by arrival time: %s", line);
+				exit(1);
+			}
+			lastArrival = time;
+			arrival.time = startTime + time;
+			arrival.app = getApp(name);
+			arrival.serviceTime = (unsigned int) serviceTime;
+			return true;
+		}
+		return false;
+	}
+
+	bool nextSyntheticArrival(Arrival &arrival) {
+		lastArrival += (unsigned long long) randomExponential(1000000 / rate);
+		if (lastArrival >= duration) {
+			return false;
+		}
+		arrival.time = startTime + lastArrival;
+		arrival.app = apps[(unsigned int) (erand48(randomState) * apps.size())
+			% apps.size()].get();
+		arrival.serviceTime = (unsigned int) randomExponential(meanServiceTime);
+		return true;
+	}
+
+	bool nextArrival(Arrival &arrival) {
+		if (traceFile != NULL) {
+			return nextTraceArrival(arrival);
+		} else {
+			return nextSyntheticArrival(arrival);
+		}
+	}
+
+	void pushEvent(Event &event) {
+		event.seq = seq++;
+		events.push(event);
+	}
+
+	void onSessionCheckedOut(App *app, unsigned long long arrivalTime,
+		unsigned int serviceTime, const SessionPtr &session, const ExceptionPtr &e)
+	{
+		boost::lock_guard<boost::mutex> l(syncher);
+		if (e != NULL) {
+			app->rejected++;
+			return;
+		}
+
+		unsigned long long waitTime = now - arrivalTime;
+		app->totalWaitTime += waitTime;
+		app->waitTimes.record((unsigned int) std::min<unsigned long long>(waitTime, 0xFFFFFFFF));
+
+		Event event;
+		event.time = now + serviceTime;
+		event.session = session;
+		event.serviceTime = serviceTime;
+		event.waiter = NULL;
+		pushEvent(event);
+	}
+
+	unsigned int countPoolThreads() {
+		unsigned int result = pool->interruptableThreads.num_threads();
+		PoolLockGuard l(pool->syncher);
+		SuperGroupMap::const_iterator it, end = pool->superGroups.end();
+		for (it = pool->superGroups.begin(); it != end; it++) {
+			foreach (const GroupPtr &group, it->second->groups) {
+				result += group->getThreadCount();
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Waits until every pool thread is blocked on the virtual clock, i.e.
+	 * until nothing can happen anymore until the clock is advanced.
+	 */
+	void waitUntilSettled() {
+		while (true) {
+			unsigned long long generation;
+			{
+				boost::lock_guard<boost::mutex> l(syncher);
+				generation = blockGeneration;
+			}
+			unsigned int threads = countPoolThreads();
+			unsigned int queuedSpawns = 0;
+			if (threads > 0) {
+				queuedSpawns = pool->spawnScheduler.getQueue().size();
+			}
+			{
+				boost::lock_guard<boost::mutex> l(syncher);
+				if (generation == blockGeneration && threads == blockedSpawns + queuedSpawns) {
+					return;
+				}
+			}
+			syscalls::usleep(50);
+		}
+	}
+
+	void countProcesses(map<string, unsigned int> &result) {
+		PoolLockGuard l(pool->syncher);
+		SuperGroupMap::const_iterator it, end = pool->superGroups.end();
+		for (it = pool->superGroups.begin(); it != end; it++) {
+			result[it->second->name] = it->second->getProcessCount();
+		}
+	}
+
+	unsigned long long garbageCollect() {
+		map<string, unsigned int> before, after;
+		countProcesses(before);
+		unsigned long long sleepTime = pool->realGarbageCollect();
+		countProcesses(after);
+
+		map<string, unsigned int>::const_iterator it;
+		for (it = before.begin(); it != before.end(); it++) {
+			unsigned int remaining = after[it->first];
+			if (remaining < it->second) {
+				getApp(it->first)->idleKills += it->second - remaining;
+			}
+		}
+		return sleepTime;
+	}
+
+	void setTime(unsigned long long time) {
+		unsigned int processes = pool->getProcessCount();
+		boost::lock_guard<boost::mutex> l(syncher);
+		processTime += (time - now) * processes;
+		peakProcesses = std::max(peakProcesses, processes);
+		now = time;
+		SystemTime::forceAll(time);
+	}
+
+public:
+	PoolPtr pool;
+	vector<AppPtr> apps;
+
+	Simulator() {
+		now = startTime = SystemTime::getUsec();
+		SystemTime::forceAll(now);
+		seq = 0;
+		blockedSpawns = 0;
+		blockGeneration = 0;
+		lastArrival = 0;
+		busyTime = 0;
+		processTime = 0;
+		peakProcesses = 0;
+
+		traceFile = NULL;
+		if (options.has("trace")) {
+			traceFile = fopen(options.get("trace").c_str(), "r");
+			if (traceFile == NULL) {
+				int e = errno;
+				fprintf(stderr, "Cannot open %s: %s\n", options.get("trace").c_str(),
+					strerror(e));
+				exit(1);
+			}
+		} else {
+			unsigned int seed = options.getInt("seed", false, 1);
+			randomState[0] = 0x330E;
+			randomState[1] = (unsigned short) seed;
+			randomState[2] = (unsigned short) (seed >> 16);
+			rate = atof(options.get("rate", false, "100").c_str());
+			meanServiceTime = atof(options.get("service_time", false, "100000").c_str());
+			duration = options.getULL("duration", false, 60) * 1000000;
+			unsigned int appCount = std::max(1, options.getInt("apps", false, 1));
+			for (unsigned int i = 0; i < appCount; i++) {
+				getApp("app" + toString(i + 1));
+			}
+		}
+	}
+
+	~Simulator() {
+		if (traceFile != NULL) {
+			fclose(traceFile);
+		}
+	}
+
+	/**
+	 * Called by SimulatedSpawner from the spawner threads. Blocks until the
+	 * virtual clock has advanced by `spawnTime`.
+	 */
+	void waitForSpawn(const Options &options, unsigned int spawnTime) {
+		boost::unique_lock<boost::mutex> l(syncher);
+		SpawnWaiter waiter;
+		Event event;
+
+		getApp(options.appRoot)->spawns++;
+		waiter.time = now + spawnTime;
+		waiter.released = false;
+		event.time = waiter.time;
+		event.serviceTime = 0;
+		event.waiter = &waiter;
+		pushEvent(event);
+		blockedSpawns++;
+		blockGeneration++;
+		while (!waiter.released) {
+			cond.wait(l);
+		}
+	}
+
+	void run() {
+		Arrival arrival;
+		bool haveArrival = nextArrival(arrival);
+		// Like Pool::garbageCollect(), which waits 5 seconds before its first run.
+		unsigned long long nextGcTime = startTime + 5000000;
+
+		while (true) {
+			waitUntilSettled();
+
+			boost::unique_lock<boost::mutex> l(syncher);
+			if (!haveArrival && events.empty()) {
+				break;
+			}
+			unsigned long long time = haveArrival ? arrival.time : (unsigned long long) -1;
+			if (!events.empty()) {
+				time = std::min(time, events.top().time);
+			}
+			l.unlock();
+
+			if (nextGcTime <= time) {
+				setTime(nextGcTime);
+				nextGcTime += std::max<unsigned long long>(garbageCollect(), 1);
+				continue;
+			}
+			setTime(time);
+
+			l.lock();
+			if (!events.empty() && events.top().time == time) {
+				Event event = events.top();
+				events.pop();
+				if (event.waiter != NULL) {
+					event.waiter->released = true;
+					blockedSpawns--;
+					cond.notify_all();
+				} else {
+					busyTime += event.serviceTime;
+					l.unlock();
+					// Closing the session may hand its process to a
+					// waiting request, which schedules another event.
+					event.session->close(true);
+					event.session.reset();
+				}
+			} else {
+				App *app = arrival.app;
+				app->requests++;
+				l.unlock();
+				pool->asyncGet(app->options, boost::bind(&Simulator::onSessionCheckedOut,
+					this, app, time, arrival.serviceTime, _1, _2));
+				haveArrival = nextArrival(arrival);
+			}
+		}
+	}
+
+	void report(unsigned long long wallTime) {
+		unsigned long long simulatedTime = now - startTime;
+		unsigned long long requests = 0, rejected = 0, totalWaitTime = 0;
+		unsigned int spawns = 0, idleKills = 0;
+		ResponseTimeHistogram waitTimes;
+		map<string, unsigned int> remaining;
+
+		countProcesses(remaining);
+		printf("Simulated time    : %.3f sec in %.3f sec wall clock time\n",
+			simulatedTime / 1000000.0, wallTime / 1000000.0);
+
+		foreach (const AppPtr &app, apps) {
+			unsigned long long served = app->waitTimes.getTotalCount();
+			unsigned int detached = app->spawns - remaining[app->name];
+			printf("\n%s\n", app->name.c_str());
+			printf("  Requests        : %llu (%llu rejected)\n", app->requests, app->rejected);
+			printf("  Queue wait      : avg %.0f usec, p50 %u usec, p99 %u usec\n",
+				served == 0 ? 0.0 : (double) app->totalWaitTime / served,
+				app->waitTimes.percentile(50), app->waitTimes.percentile(99));
+			printf("  Spawns          : %u\n", app->spawns);
+			printf("  Idle kills      : %u (%u other detaches)\n", app->idleKills,
+				detached > app->idleKills ? detached - app->idleKills : 0);
+
+			requests += app->requests;
+			rejected += app->rejected;
+			totalWaitTime += app->totalWaitTime;
+			waitTimes.merge(app->waitTimes);
+			spawns += app->spawns;
+			idleKills += app->idleKills;
+		}
+
+		printf("\nTotal\n");
+		printf("  Requests        : %llu (%llu rejected), %.0f per wall clock second\n",
+			requests, rejected, requests / (wallTime / 1000000.0));
+		printf("  Queue wait      : avg %.0f usec, p50 %u usec, p99 %u usec, p99.9 %u usec\n",
+			waitTimes.getTotalCount() == 0 ? 0.0 : (double) totalWaitTime / waitTimes.getTotalCount(),
+			waitTimes.percentile(50), waitTimes.percentile(99), waitTimes.percentile(99.9));
+		printf("  Spawns          : %u\n", spawns);
+		printf("  Idle kills      : %u\n", idleKills);
+		printf("  Processes       : avg %.2f, peak %u\n",
+			simulatedTime == 0 ? 0.0 : (double) processTime / simulatedTime,
+			peakProcesses);
+		unsigned int concurrency = options.getInt("concurrency", false, 1);
+		if (concurrency > 0 && processTime > 0) {
+			printf("  Utilization     : %.1f%% of process capacity\n",
+				100.0 * busyTime / ((double) processTime * concurrency));
+		}
+	}
+};
+
+
+/**
+ * A DummySpawner whose spawns take virtual instead of real time.
+ */
+class SimulatedSpawner: public DummySpawner {
+private:
+	Simulator *simulator;
+	unsigned int spawnTime;
+
+public:
+	SimulatedSpawner(const ResourceLocator &resourceLocator,
+		const SpawnerConfigPtr &config, Simulator *_simulator,
+		unsigned int _spawnTime)
+		: DummySpawner(resourceLocator, config),
+		  simulator(_simulator),
+		  spawnTime(_spawnTime)
+		{ }
+
+	virtual ProcessPtr spawn(const Options &options) {
+		simulator->waitForSpawn(options, spawnTime);
+		return DummySpawner::spawn(options);
+	}
+};
+
+class SimulatedSpawnerFactory: public SpawnerFactory {
+private:
+	ResourceLocator resourceLocator;
+	SpawnerConfigPtr config;
+	Simulator *simulator;
+	unsigned int spawnTime;
+
+public:
+	SimulatedSpawnerFactory(const ResourceLocator &_resourceLocator,
+		const SpawnerConfigPtr &_config, Simulator *_simulator,
+		unsigned int _spawnTime)
+		: SpawnerFactory(SafeLibevPtr(), _resourceLocator,
+			ServerInstanceDir::GenerationPtr(), _config),
+		  resourceLocator(_resourceLocator),
+		  config(_config),
+		  simulator(_simulator),
+		  spawnTime(_spawnTime)
+		{ }
+
+	virtual SpawnerPtr create(const Options &options) {
+		return boost::make_shared<SimulatedSpawner>(resourceLocator, config,
+			simulator, spawnTime);
+	}
+};
+
+
+static void
+parseOptions(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i += 2) {
+		string name = argv[i];
+		if (!startsWith(name, "--") || i + 1 >= argc) {
+			fprintf(stderr, "Usage: %s [--name value ...]\n", argv[0]);
+			exit(1);
+		}
+		name = name.substr(2);
+		for (string::size_type j = 0; j < name.size(); j++) {
+			if (name[j] == '-') {
+				name[j] = '_';
+			}
+		}
+		options.set(name, argv[i + 1]);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	signal(SIGPIPE, SIG_IGN);
+	oxt::initialize();
+	oxt::setup_syscall_interruption_support();
+	setLogLevel(LVL_ERROR);
+	parseOptions(argc, argv);
+
+	unsigned long long wallStartTime = SystemTime::getMonotonicUsec();
+	Simulator simulator;
+	SpawnerConfigPtr config = boost::make_shared<SpawnerConfig>();
+	config->concurrency = options.getInt("concurrency", false, 1);
+	ResourceLocator resourceLocator(".");
+	SpawnerFactoryPtr spawnerFactory = boost::make_shared<SimulatedSpawnerFactory>(
+		resourceLocator, config, &simulator,
+		options.getInt("spawn_time", false, 1000000));
+
+	// Pool::initialize() isn't called: the simulator runs the garbage
+	// collector itself, and the other background threads aren't needed.
+	PoolPtr pool = boost::make_shared<Pool>(spawnerFactory);
+	pool->detachedProcessesLoop.start("Pool detached processes watcher",
+		POOL_HELPER_THREAD_STACK_SIZE);
+	pool->setMax(options.getInt("max", false, 6));
+	pool->setMaxIdleTime(options.getULL("max_idle_time", false, 300) * 1000000);
+	pool->setMaxConcurrentSpawns(options.getInt("max_concurrent_spawns", false, 0));
+	pool->setSpawnConcurrency(options.getInt("spawn_concurrency", false, 0));
+	simulator.pool = pool;
+
+	simulator.run();
+	SystemTime::releaseAll();
+	simulator.report(SystemTime::getMonotonicUsec() - wallStartTime);
+
+	pool->destroy();
+	simulator.pool.reset();
+	pool.reset();
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include <TestSupport.h>
+#include <ApplicationPool2/PoolStatusTable.h>
+
+using namespace Passenger;
+using namespace Passenger::ApplicationPool2;
+using namespace std;
+
+namespace tut {
+	struct PoolStatusTableTest {
+		string filename;
+		vector<PoolStatusTable::GroupState> states;
+
+		PoolStatusTableTest() {
+			filename = "tmp.pool_status";
+			unlink(filename.c_str());
+		}
+
+		~PoolStatusTableTest() {
+			unlink(filename.c_str());
+		}
+	};
+
+	DEFINE_TEST_GROUP(PoolStatusTableTest);
+
+	TEST_METHOD(1) {
+		// A reader sees the queue states that the writer has published.
+		PoolStatusTable writer(filename, true);
+		PoolStatusTable reader(filename, false);
+		time_t now = time(NULL);
+
+		states.push_back(PoolStatusTable::GroupState("/apps/full", 10, 10));
+		states.push_back(PoolStatusTable::GroupState("/apps/not_full", 9, 10));
+		states.push_back(PoolStatusTable::GroupState("/apps/unlimited", 1000, 0));
+		writer.update(states, now);
+		ensure("(1)", reader.isQueueFull("/apps/full", now));
+		ensure("(2)", !reader.isQueueFull("/apps/not_full", now));
+		ensure("(3)", !reader.isQueueFull("/apps/unlimited", now));
+		ensure("(4)", !reader.isQueueFull("/apps/unknown", now));
+
+		states.clear();
+		states.push_back(PoolStatusTable::GroupState("/apps/not_full", 10, 10));
+		writer.update(states, now);
+		ensure("(5)", !reader.isQueueFull("/apps/full", now));
+		ensure("(6)", reader.isQueueFull("/apps/not_full", now));
+	}
+
+	TEST_METHOD(2) {
+		// Readers ignore the table if it hasn't been updated recently.
+		PoolStatusTable writer(filename, true);
+		PoolStatusTable reader(filename, false);
+		time_t now = time(NULL);
+
+		states.push_back(PoolStatusTable::GroupState("/apps/full", 10, 10));
+		writer.update(states, now - 60);
+		ensure(!reader.isQueueFull("/apps/full", now));
+	}
+
+	TEST_METHOD(3) {
+		// A restarted writer reuses the existing file, so that existing
+		// readers keep seeing its updates.
+		time_t now = time(NULL);
+		boost::shared_ptr<PoolStatusTable> oldWriter =
+			boost::make_shared<PoolStatusTable>(filename, true);
+		PoolStatusTable reader(filename, false);
+		states.push_back(PoolStatusTable::GroupState("/apps/foo", 10, 10));
+		oldWriter->update(states, now);
+		oldWriter.reset();
+
+		PoolStatusTable writer(filename, true);
+		ensure("(1)", reader.isQueueFull("/apps/foo", now));
+		states.clear();
+		writer.update(states, now);
+		ensure("(2)", !reader.isQueueFull("/apps/foo", now));
+	}
+}
@@ -0,0 +1,203 @@
+#include "TestSupport.h"
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "BackgroundEventLoop.h"
+#include "PooledMessageServer.h"
+#include "MessageClient.h"
+#include "Utils.h"
+#include <string>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace boost;
+using namespace std;
+
+namespace tut {
+	struct PooledMessageServerTest {
+		ServerInstanceDirPtr serverInstanceDir;
+		ServerInstanceDir::GenerationPtr generation;
+		string socketFilename;
+		string socketAddress;
+		AccountsDatabasePtr accountsDatabase;
+		BackgroundEventLoop bg;
+		PooledMessageServerPtr server;
+		
+		PooledMessageServerTest() {
+			createServerInstanceDirAndGeneration(serverInstanceDir, generation);
+			socketFilename = generation->getPath() + "/socket";
+			socketAddress = "unix:" + socketFilename;
+			accountsDatabase = boost::make_shared<AccountsDatabase>();
+			accountsDatabase->add("test", "12345", false);
+			server = boost::make_shared<PooledMessageServer>(bg.safe, socketFilename,
+				accountsDatabase, 2);
+		}
+		
+		~PooledMessageServerTest() {
+			bg.stop();
+			server.reset();
+		}
+		
+		class EchoHandler: public MessageServer::Handler {
+		public:
+			struct SpecificContext: public MessageServer::ClientContext {
+				int count;
+				
+				SpecificContext() {
+					count = 0;
+				}
+			};
+			
+			boost::mutex mutex;
+			int clientsAccepted;
+			int clientsDisconnected;
+			
+			EchoHandler() {
+				clientsAccepted = 0;
+				clientsDisconnected = 0;
+			}
+			
+			virtual MessageServer::ClientContextPtr newClient(MessageServer::CommonClientContext &context) {
+				boost::lock_guard<boost::mutex> l(mutex);
+				clientsAccepted++;
+				return boost::make_shared<SpecificContext>();
+			}
+			
+			virtual void clientDisconnected(MessageServer::CommonClientContext &context,
+			                                MessageServer::ClientContextPtr &handlerSpecificContext)
+			{
+				boost::lock_guard<boost::mutex> l(mutex);
+				clientsDisconnected++;
+			}
+			
+			virtual bool processMessage(MessageServer::CommonClientContext &commonContext,
+			                            MessageServer::ClientContextPtr &handlerSpecificContext,
+			                            const vector<string> &args)
+			{
+				SpecificContext *context = (SpecificContext *) handlerSpecificContext.get();
+				if (args[0] == "echo") {
+					context->count++;
+					writeArrayMessage(commonContext.fd, args[1].c_str(),
+						toString(context->count).c_str(), NULL);
+					return true;
+				} else if (args[0] == "sleep") {
+					syscalls::usleep(atoi(args[1]) * 1000);
+					writeArrayMessage(commonContext.fd, "slept", NULL);
+					return true;
+				} else {
+					return false;
+				}
+			}
+			
+			int getClientsDisconnected() {
+				boost::lock_guard<boost::mutex> l(mutex);
+				return clientsDisconnected;
+			}
+		};
+		
+		typedef boost::shared_ptr<EchoHandler> EchoHandlerPtr;
+	};
+
+	DEFINE_TEST_GROUP(PooledMessageServerTest);
+	
+	TEST_METHOD(1) {
+		// It rejects clients with an invalid password.
+		bg.start();
+		try {
+			MessageClient().connect(socketAddress, "test", "123456");
+			fail("SecurityException expected");
+		} catch (const SecurityException &) {
+			// Pass.
+		}
+	}
+	
+	TEST_METHOD(2) {
+		// It passes messages to the handlers in a worker thread, which
+		// can reply on the client socket. The handler-specific context
+		// is kept for the duration of the connection.
+		EchoHandlerPtr handler = boost::make_shared<EchoHandler>();
+		server->addHandler(handler);
+		bg.start();
+		
+		MessageClient client;
+		vector<string> args;
+		client.connect(socketAddress, "test", "12345");
+		client.write("echo", "hello", NULL);
+		ensure(client.read(args));
+		ensure_equals(args.size(), 2u);
+		ensure_equals(args[0], "hello");
+		ensure_equals(args[1], "1");
+		
+		client.write("echo", "world", NULL);
+		ensure(client.read(args));
+		ensure_equals(args[0], "world");
+		ensure_equals(args[1], "2");
+	}
+	
+	TEST_METHOD(3) {
+		// Messages that a client sends before it has read the reply
+		// to the previous one are processed in order.
+		EchoHandlerPtr handler = boost::make_shared<EchoHandler>();
+		server->addHandler(handler);
+		bg.start();
+		
+		MessageClient client;
+		vector<string> args;
+		client.connect(socketAddress, "test", "12345");
+		client.write("sleep", "20", NULL);
+		client.write("echo", "a", NULL);
+		client.write("echo", "b", NULL);
+		ensure(client.read(args));
+		ensure_equals(args[0], "slept");
+		ensure(client.read(args));
+		ensure_equals(args[0], "a");
+		ensure(client.read(args));
+		ensure_equals(args[0], "b");
+		ensure_equals(args[1], "2");
+	}
+	
+	TEST_METHOD(4) {
+		// A handler that blocks doesn't block other clients.
+		EchoHandlerPtr handler = boost::make_shared<EchoHandler>();
+		server->addHandler(handler);
+		bg.start();
+		
+		MessageClient slowClient, client;
+		vector<string> args;
+		slowClient.connect(socketAddress, "test", "12345");
+		slowClient.write("sleep", "2000", NULL);
+		usleep(20000);
+		
+		unsigned long long timeout = 1000000;
+		client.connect(socketAddress, "test", "12345");
+		client.write("echo", "hello", NULL);
+		ensure(client.read(args, &timeout));
+		ensure_equals(args[0], "hello");
+	}
+	
+	TEST_METHOD(5) {
+		// It closes the connection if no handler recognizes the message,
+		// and notifies the handlers when a client disconnects.
+		EchoHandlerPtr handler = boost::make_shared<EchoHandler>();
+		server->addHandler(handler);
+		bg.start();
+		
+		MessageClient client;
+		vector<string> args;
+		client.connect(socketAddress, "test", "12345");
+		client.write("foo", NULL);
+		ensure("Connection closed", !client.read(args));
+		EVENTUALLY(5,
+			result = handler->getClientsDisconnected() == 1;
+		);
+		
+		{
+			MessageClient client2;
+			client2.connect(socketAddress, "test", "12345");
+		}
+		EVENTUALLY(5,
+			result = handler->getClientsDisconnected() == 2;
+		);
+	}
+}
@@ -0,0 +1,191 @@
+/*
+ * Compares PriorityQueue, an indexed 4-ary heap, with the Fibonacci heap
+ * that it replaced, on the operations that the session open/close path
+ * performs: a Group picks its least busy Process, the Process picks its
+ * least busy session Socket, and both queues are updated when the session
+ * is opened and again when it's closed.
+ *
+ *   rake benchmark:priority_queue
+ */
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <Utils/PriorityQueue.h>
+#include <Utils/fib.h>
+
+using namespace std;
+using namespace Passenger;
+
+
+static const unsigned int SESSIONS = 2000000;
+
+static unsigned long long
+getUsec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/** The Fibonacci heap based implementation that PriorityQueue used to have. */
+template<typename T>
+class FibonacciPriorityQueue {
+private:
+	struct fibheap heap;
+
+public:
+	typedef struct fibheap_el * Handle;
+
+	FibonacciPriorityQueue() {
+		fh_initheap(&heap);
+		heap.fh_keys = 1;
+	}
+
+	~FibonacciPriorityQueue() {
+		fh_destroyheap(&heap);
+	}
+
+	Handle push(T *item, int priority) {
+		return fh_insertkey(&heap, priority, item);
+	}
+
+	T *pop() {
+		return (T *) fh_extractmin(&heap);
+	}
+
+	T *top() const {
+		return (T *) fh_min(const_cast<struct fibheap *>(&heap));
+	}
+
+	void decrease(Handle handle, int priority) {
+		fh_replacekeydata(&heap, handle, priority, handle->fhe_data);
+	}
+
+	Handle update(Handle handle, int priority) {
+		if (priority <= handle->fhe_key) {
+			decrease(handle, priority);
+			return handle;
+		} else {
+			T *item = (T *) handle->fhe_data;
+			fh_delete(&heap, handle);
+			return push(item, priority);
+		}
+	}
+};
+
+template<template<typename> class Queue>
+struct Simulation {
+	struct Socket {
+		int sessions;
+		unsigned int pqIndex;
+		typename Queue<Socket>::Handle pqHandle;
+	};
+
+	struct Process {
+		int sessions;
+		vector<Socket> sockets;
+		Queue<Socket> sessionSockets;
+		unsigned int pqIndex;
+		typename Queue<Process>::Handle pqHandle;
+	};
+
+	struct Session {
+		Process *process;
+		Socket *socket;
+	};
+
+	vector<Process *> processes;
+	Queue<Process> pqueue;
+
+	Simulation(unsigned int processCount, unsigned int socketCount) {
+		for (unsigned int i = 0; i < processCount; i++) {
+			Process *process = new Process();
+			process->sessions = 0;
+			process->sockets.resize(socketCount);
+			for (unsigned int j = 0; j < socketCount; j++) {
+				Socket *socket = &process->sockets[j];
+				socket->sessions = 0;
+				socket->pqHandle = process->sessionSockets.push(socket, 0);
+			}
+			process->pqHandle = pqueue.push(process, 0);
+			processes.push_back(process);
+		}
+	}
+
+	~Simulation() {
+		for (unsigned int i = 0; i < processes.size(); i++) {
+			delete processes[i];
+		}
+	}
+
+	Session open() {
+		Session session;
+		Process *process = pqueue.top();
+		Socket *socket = process->sessionSockets.pop();
+		socket->sessions++;
+		socket->pqHandle = process->sessionSockets.push(socket, socket->sessions);
+		process->sessions++;
+		process->pqHandle = pqueue.update(process->pqHandle, process->sessions);
+		session.process = process;
+		session.socket = socket;
+		return session;
+	}
+
+	void close(const Session &session) {
+		Process *process = session.process;
+		Socket *socket = session.socket;
+		socket->sessions--;
+		process->sessionSockets.decrease(socket->pqHandle, socket->sessions);
+		process->sessions--;
+		process->pqHandle = pqueue.update(process->pqHandle, process->sessions);
+	}
+
+	/**
+	 * Keeps a number of sessions open at all times, and closes a random
+	 * one of them whenever a new one is opened.
+	 */
+	unsigned long long run(unsigned int concurrency) {
+		vector<Session> open;
+		unsigned long long start = getUsec();
+
+		for (unsigned int i = 0; i < concurrency; i++) {
+			open.push_back(this->open());
+		}
+		for (unsigned int i = 0; i < SESSIONS; i++) {
+			unsigned int victim = rand() % concurrency;
+			close(open[victim]);
+			open[victim] = this->open();
+		}
+		for (unsigned int i = 0; i < concurrency; i++) {
+			close(open[i]);
+		}
+		return getUsec() - start;
+	}
+};
+
+template<template<typename> class Queue>
+static void
+benchmark(const char *name, unsigned int processCount, unsigned int socketCount) {
+	Simulation<Queue> simulation(processCount, socketCount);
+	srand(1234);
+	unsigned long long time = simulation.run(processCount * socketCount);
+	printf("  %-14s: %6.1f ns per session\n", name, time * 1000.0 / SESSIONS);
+}
+
+static void
+benchmarkSize(unsigned int processCount, unsigned int socketCount) {
+	printf("%u processes with %u session sockets each:\n", processCount, socketCount);
+	benchmark<FibonacciPriorityQueue>("Fibonacci heap", processCount, socketCount);
+	benchmark<PriorityQueue>("4-ary heap", processCount, socketCount);
+}
+
+int
+main() {
+	benchmarkSize(4, 1);
+	benchmarkSize(16, 1);
+	benchmarkSize(64, 1);
+	benchmarkSize(16, 8);
+	benchmarkSize(256, 4);
+	return 0;
+}
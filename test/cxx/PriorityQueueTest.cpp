@@ -0,0 +1,102 @@
+#include <TestSupport.h>
+#include <Utils/PriorityQueue.h>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct PriorityQueueTest {
+		struct Item {
+			int value;
+			unsigned int pqIndex;
+			PriorityQueue<Item>::Handle pqHandle;
+		};
+
+		PriorityQueue<Item> queue;
+		Item items[100];
+
+		PriorityQueueTest() {
+			for (int i = 0; i < 100; i++) {
+				items[i].value = i;
+			}
+		}
+
+		vector<int> popAll() {
+			vector<int> result;
+			Item *item;
+			while ((item = queue.pop()) != NULL) {
+				result.push_back(item->value);
+			}
+			return result;
+		}
+	};
+
+	DEFINE_TEST_GROUP(PriorityQueueTest);
+
+	TEST_METHOD(1) {
+		// An empty queue has no top.
+		ensure(queue.empty());
+		ensure(queue.top() == NULL);
+		ensure(queue.pop() == NULL);
+	}
+
+	TEST_METHOD(2) {
+		// Items are popped in order of priority.
+		vector<int> order;
+		for (int i = 0; i < 100; i++) {
+			order.push_back(i);
+		}
+		srand(1234);
+		random_shuffle(order.begin(), order.end());
+		for (int i = 0; i < 100; i++) {
+			queue.push(&items[order[i]], order[i]);
+		}
+		ensure_equals(queue.size(), 100u);
+		ensure_equals(queue.top(), &items[0]);
+
+		vector<int> result = popAll();
+		ensure_equals(result.size(), 100u);
+		for (int i = 0; i < 100; i++) {
+			ensure_equals(result[i], i);
+		}
+	}
+
+	TEST_METHOD(3) {
+		// Handles stay valid while other items are moved around,
+		// and decrease(), update() and erase() work through them.
+		for (int i = 0; i < 100; i++) {
+			items[i].pqHandle = queue.push(&items[i], 1000 + i);
+		}
+		queue.decrease(items[50].pqHandle, 0);
+		ensure_equals("(1)", queue.top(), &items[50]);
+
+		items[50].pqHandle = queue.update(items[50].pqHandle, 5000);
+		items[70].pqHandle = queue.update(items[70].pqHandle, -1);
+		ensure_equals("(2)", queue.top(), &items[70]);
+
+		queue.erase(items[0].pqHandle);
+		queue.erase(items[99].pqHandle);
+		queue.erase(items[70].pqHandle);
+		ensure_equals("(3)", queue.size(), 97u);
+		ensure_equals("(4)", queue.top(), &items[1]);
+
+		vector<int> result = popAll();
+		ensure_equals("(5)", result.size(), 97u);
+		ensure_equals("(6)", result.back(), 50);
+		for (unsigned int i = 1; i < result.size() - 1; i++) {
+			ensure("(7)", result[i - 1] < result[i]);
+		}
+	}
+
+	TEST_METHOD(4) {
+		// clear() removes all items.
+		for (int i = 0; i < 10; i++) {
+			queue.push(&items[i], i);
+		}
+		queue.clear();
+		ensure(queue.empty());
+		ensure(queue.top() == NULL);
+	}
+}
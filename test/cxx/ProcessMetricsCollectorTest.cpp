@@ -120,4 +120,30 @@ namespace tut {
 			ensure(swap < 10000 || swap == -1);
 		#endif
 	}
+	
+	TEST_METHOD(4) {
+		// On Linux, it collects the metrics from /proc, with the same
+		// results as 'ps'.
+		#ifdef __linux__
+			child = spawnChild(50);
+			usleep(500000);
+			vector<pid_t> pids;
+			pids.push_back(child);
+			pids.push_back(getpid());
+			ProcessMetricMap result = collector.collect(pids);
+			ProcessMetricMap psResult = collector.collectFromPs<vector<pid_t>,
+				vector<pid_t>::const_iterator>(pids);
+
+			ensure_equals(result.size(), 2u);
+			ensure_equals(result[child].pid, child);
+			ensure_equals(result[child].ppid, getpid());
+			ensure_equals(result[child].processGroupId, getpgrp());
+			ensure_equals(result[child].uid, geteuid());
+			ensure_equals(result[child].command, "support/allocate_memory 50");
+			ensure(result[child].rss > 50000);
+			ensure_equals(result[getpid()].ppid, psResult[getpid()].ppid);
+			ensure_equals(result[getpid()].command, psResult[getpid()].command);
+			ensure(result[getpid()].vmsize > 0);
+		#endif
+	}
 }
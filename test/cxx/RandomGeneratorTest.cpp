@@ -0,0 +1,78 @@
+#include "TestSupport.h"
+#include "RandomGenerator.h"
+#include "Utils/StrIntUtils.h"
+#include <sys/wait.h>
+#include <set>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct RandomGeneratorTest {
+		RandomGenerator generator;
+	};
+
+	DEFINE_TEST_GROUP(RandomGeneratorTest);
+
+	TEST_METHOD(1) {
+		// The ChaCha20 block function matches the RFC 7539 test vector (2.3.2).
+		boost::uint32_t input[16] = {
+			0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+			0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+			0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+			0x00000001, 0x09000000, 0x4a000000, 0x00000000
+		};
+		unsigned char output[ChaCha20Rng::BLOCK_SIZE];
+		ChaCha20Rng::block(input, output);
+		ensure_equals(toHex(StaticString((const char *) output, sizeof(output))),
+			"10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+			"d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e");
+	}
+
+	TEST_METHOD(2) {
+		// It doesn't repeat itself, including across buffer refills.
+		set<string> seen;
+		for (int i = 0; i < 1000; i++) {
+			string id = generator.generateHexString(16);
+			ensure_equals(id.size(), 32u);
+			ensure("Not seen before", seen.insert(id).second);
+		}
+		string big = generator.generateByteString(5000);
+		ensure("Large outputs are not all zeroes", big != string(5000, '\0'));
+	}
+
+	TEST_METHOD(3) {
+		// Multiple generators on the same thread, and generators on other
+		// threads, produce different output.
+		RandomGenerator other;
+		ensure(generator.generateByteString(32) != other.generateByteString(32));
+	}
+
+	TEST_METHOD(4) {
+		// A forked child doesn't produce the same output as its parent.
+		generator.generateByteString(16);
+		int fds[2];
+		ensure_equals(pipe(fds), 0);
+		pid_t pid = fork();
+		if (pid == 0) {
+			string data = generator.generateByteString(16);
+			write(fds[1], data.data(), data.size());
+			_exit(0);
+		}
+		close(fds[1]);
+		string parentData = generator.generateByteString(16);
+		char buf[16];
+		ensure_equals(read(fds[0], buf, sizeof(buf)), (ssize_t) sizeof(buf));
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		ensure(parentData != string(buf, sizeof(buf)));
+	}
+
+	TEST_METHOD(5) {
+		// generateAsciiString() only produces alphanumeric characters.
+		string str = generator.generateAsciiString(500);
+		for (string::size_type i = 0; i < str.size(); i++) {
+			ensure(isalnum((unsigned char) str[i]));
+		}
+	}
+}
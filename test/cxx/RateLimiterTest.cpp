@@ -0,0 +1,81 @@
+#include "TestSupport.h"
+#include <agents/HelperAgent/RateLimiter.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct RateLimiterTest {
+		RateLimiter limiter;
+		boost::uint64_t client1, client2;
+
+		RateLimiterTest()
+			: limiter(1024, 1234)
+		{
+			client1 = limiter.hash("app", "10.0.0.1");
+			client2 = limiter.hash("app", "10.0.0.2");
+		}
+	};
+
+	DEFINE_TEST_GROUP(RateLimiterTest);
+
+	TEST_METHOD(1) {
+		// A key may make `burst` requests at once, after which it's limited.
+		for (int i = 0; i < 5; i++) {
+			ensure_equals(limiter.admit(client1, 1, 5, 0, 1000000), RateLimiter::ALLOWED);
+		}
+		ensure_equals(limiter.admit(client1, 1, 5, 0, 1000000), RateLimiter::RATE_LIMITED);
+		// Other keys are not affected.
+		ensure_equals(limiter.admit(client2, 1, 5, 0, 1000000), RateLimiter::ALLOWED);
+	}
+
+	TEST_METHOD(2) {
+		// Tokens are refilled at the given rate.
+		ensure_equals(limiter.admit(client1, 2, 1, 0, 1000000), RateLimiter::ALLOWED);
+		ensure_equals(limiter.admit(client1, 2, 1, 0, 1100000), RateLimiter::RATE_LIMITED);
+		ensure_equals(limiter.admit(client1, 2, 1, 0, 1500000), RateLimiter::ALLOWED);
+		ensure_equals(limiter.admit(client1, 2, 1, 0, 1600000), RateLimiter::RATE_LIMITED);
+		// But not beyond the burst size.
+		ensure_equals(limiter.admit(client1, 2, 1, 0, 10000000), RateLimiter::ALLOWED);
+		ensure_equals(limiter.admit(client1, 2, 1, 0, 10000000), RateLimiter::RATE_LIMITED);
+	}
+
+	TEST_METHOD(3) {
+		// The concurrency limit counts admitted requests until they're released.
+		ensure_equals(limiter.admit(client1, 0, 0, 2, 1000000), RateLimiter::ALLOWED);
+		ensure_equals(limiter.admit(client1, 0, 0, 2, 1000000), RateLimiter::ALLOWED);
+		ensure_equals(limiter.getConcurrency(client1), 2u);
+		ensure_equals(limiter.admit(client1, 0, 0, 2, 1000000), RateLimiter::CONCURRENCY_LIMITED);
+		ensure_equals(limiter.admit(client2, 0, 0, 2, 1000000), RateLimiter::ALLOWED);
+		limiter.release(client1);
+		ensure_equals(limiter.getConcurrency(client1), 1u);
+		ensure_equals(limiter.admit(client1, 0, 0, 2, 1000000), RateLimiter::ALLOWED);
+	}
+
+	TEST_METHOD(4) {
+		// With about as many keys as cells per row, keys that stay within
+		// their limit are only rarely limited because of abusive keys.
+		RateLimiter small(1024, 99);
+		for (int i = 0; i < 20; i++) {
+			boost::uint64_t key = small.hash("app", "abuser" + toString(i));
+			for (int j = 0; j < 20; j++) {
+				small.admit(key, 10, 10, 0, 1000000);
+			}
+		}
+		unsigned int limited = 0;
+		for (int i = 0; i < 1000; i++) {
+			boost::uint64_t key = small.hash("app", "client" + toString(i));
+			if (small.admit(key, 10, 10, 0, 1000000) != RateLimiter::ALLOWED) {
+				limited++;
+			}
+		}
+		ensure("limited: " + toString(limited), limited < 10);
+	}
+
+	TEST_METHOD(5) {
+		// The app group is part of the key.
+		ensure(limiter.hash("app1", "10.0.0.1") != limiter.hash("app2", "10.0.0.1"));
+		ensure(limiter.hash("ab", "c") != limiter.hash("a", "bc"));
+		ensure(RateLimiter(1024, 1).hash("app", "x") != RateLimiter(1024, 2).hash("app", "x"));
+	}
+}
@@ -26,6 +26,8 @@ namespace tut {
 		ServerInstanceDir::GenerationPtr generation;
 		string serverFilename;
 		FileDescriptor requestSocket;
+		string httpServerFilename;
+		FileDescriptor httpSocket;
 		AgentOptions agentOptions;
 
 		BackgroundEventLoop bg;
@@ -33,6 +35,8 @@ namespace tut {
 		PoolPtr pool;
 		Pool::DebugSupportPtr debug;
 		boost::shared_ptr<RequestHandler> handler;
+		BackgroundEventLoop bg2;
+		boost::shared_ptr<RequestHandler> handler2;
 		FileDescriptor connection;
 		map<string, string> defaultHeaders;
 
@@ -65,12 +69,18 @@ namespace tut {
 		~RequestHandlerTest() {
 			setLogLevel(DEFAULT_LOG_LEVEL);
 			setPrintAppOutputAsDebuggingMessages(false);
+			if (bg2.isStarted()) {
+				bg2.safe->runSync(boost::bind(&RequestHandlerTest::destroySecondHandler, this));
+			}
 			if (bg.isStarted()) {
 				bg.safe->runSync(boost::bind(&RequestHandlerTest::destroy, this));
 			} else {
 				destroy();
 			}
 			unlink(serverFilename.c_str());
+			if (!httpServerFilename.empty()) {
+				unlink(httpServerFilename.c_str());
+			}
 		}
 
 		void init() {
@@ -78,6 +88,25 @@ namespace tut {
 			bg.start();
 		}
 
+		void initHttp() {
+			httpServerFilename = generation->getPath() + "/http";
+			httpSocket = createUnixServer(httpServerFilename);
+			setNonBlocking(httpSocket);
+			handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+			handler->listenForHttp(httpSocket);
+			bg.start();
+		}
+
+		void initSecondHandler() {
+			handler2 = boost::make_shared<RequestHandler>(bg2.safe, requestSocket, pool, agentOptions);
+			bg2.start();
+		}
+
+		void destroySecondHandler() {
+			handler2.reset();
+			ev_break(bg2.loop, EVBREAK_ALL);
+		}
+
 		void destroy() {
 			handler.reset();
 			pool->destroy();
@@ -95,6 +124,11 @@ namespace tut {
 			return connection;
 		}
 
+		FileDescriptor &connectHttp() {
+			connection = connectToUnixServer(httpServerFilename);
+			return connection;
+		}
+
 		void sendHeaders(const map<string, string> &headers, ...) {
 			va_list ap;
 			const char *arg;
@@ -137,6 +171,24 @@ namespace tut {
 			}
 		}
 
+		/**
+		 * Reads a response on a persistent frontend connection, i.e. up to
+		 * and including the terminating zero-sized chunk.
+		 */
+		string readFramedResponse() {
+			string result;
+			char buf[1024];
+			unsigned long long timeout = 5000000;
+			while (result.size() < 7 || result.compare(result.size() - 7, 7, "\r\n0\r\n\r\n") != 0) {
+				unsigned int size = readExact(connection, buf, 1, &timeout);
+				if (size == 0) {
+					break;
+				}
+				result.append(buf, size);
+			}
+			return result;
+		}
+
 		string inspect() {
 			string result;
 			bg.safe->runSync(boost::bind(&RequestHandlerTest::real_inspect, this, &result));
@@ -162,7 +214,7 @@ namespace tut {
 		}
 	};
 
-	DEFINE_TEST_GROUP_WITH_LIMIT(RequestHandlerTest, 80);
+	DEFINE_TEST_GROUP_WITH_LIMIT(RequestHandlerTest, 90);
 
 	TEST_METHOD(1) {
 		// Test one normal request.
@@ -274,6 +326,7 @@ namespace tut {
 		setLogLevel(-1);
 		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
 		handler->connectPasswordTimeout = 40;
+		handler->clientTimeouts.setResolution(10);
 		bg.start();
 
 		connect();
@@ -313,7 +366,7 @@ namespace tut {
 		ensure_equals(io.readLine(), "HTTP/1.1 200 OK\r\n");
 		ProcessPtr process;
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals(pool->getProcessCount(false), 1u);
 			SuperGroupPtr superGroup = pool->superGroups.get(wsgiAppPath);
 			process = superGroup->defaultGroup->enabledProcesses.front();
@@ -321,7 +374,7 @@ namespace tut {
 		}
 		connection.close();
 		EVENTUALLY(5,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = process->sessions == 0;
 		);
 	}
@@ -625,7 +678,12 @@ namespace tut {
 			"HTTP_X_SIZE", "10485760",
 			NULL);
 		EVENTUALLY(10,
-			result = containsSubstring(inspect(), "appInput reachedEnd         = true");
+			string state = inspect();
+			// The application is done once it has sent EOF, or once it
+			// has finished the response on a keep-alive session.
+			result = containsSubstring(state, "appInput reachedEnd         = true")
+				|| (containsSubstring(state, "responseHeaderSeen          = true")
+					&& containsSubstring(state, "session                     = NULL"));
 		);
 		string result = stripHeaders(readAll(connection));
 		ensure_equals(result.size(), 10485760u);
@@ -814,7 +872,7 @@ namespace tut {
 		// Get a reference to the orignal process and verify oobw has been requested.
 		ProcessPtr origProcess;
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			origProcess = pool->superGroups.get(wsgiAppPath)->defaultGroup->disablingProcesses.front();
 			ensure("OOBW requested", origProcess->oobwStatus == Process::OOBW_IN_PROGRESS);
 		}
@@ -836,13 +894,13 @@ namespace tut {
 		
 		// Wait for the original process to finish oobw request.
 		EVENTUALLY(2,
-			boost::unique_lock<boost::mutex> lock(pool->syncher);
+			PoolLock lock(pool->syncher);
 			result = origProcess->oobwStatus == Process::OOBW_NOT_ACTIVE;
 		);
 		
 		// Final asserts.
 		{
-			boost::unique_lock<boost::mutex> lock(pool->syncher);
+			PoolLock lock(pool->syncher);
 			ensure_equals("2 enabled processes", pool->superGroups.get(wsgiAppPath)->defaultGroup->enabledProcesses.size(), 2u);
 			ensure_equals("oobw is reset", origProcess->oobwStatus, Process::OOBW_NOT_ACTIVE);
 			ensure_equals("process is enabled", origProcess->enabled, Process::ENABLED);
@@ -935,11 +993,11 @@ namespace tut {
 			result = processes.size() == 1;
 		);
 		EVENTUALLY(5,
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			result = processes[0]->processed == 1;
 		);
 		{
-			LockGuard l(pool->syncher);
+			PoolLockGuard l(pool->syncher);
 			ensure_equals("The session is closed before the client is done reading",
 				processes[0]->sessions, 0);
 		}
@@ -972,6 +1030,1000 @@ namespace tut {
 		ensure(containsSubstring(response, "Counter: 2\n"));
 	}
 
+	TEST_METHOD(53) {
+		set_test_name("Multiple request handlers on different event loops can share "
+			"the same request socket and pool");
+
+		init();
+		initSecondHandler();
+		for (int i = 0; i < 10; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PATH_INFO", "/",
+				NULL);
+			string response = readAll(connection);
+			ensure("Status line is correct", containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+			ensure_equals(stripHeaders(response), "front page");
+		}
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals("Both handlers share one pool", pool->getProcessCount(false), 1u);
+		}
+	}
+
+	TEST_METHOD(54) {
+		set_test_name("It reuses application connections on keep-alive sessions");
+
+		init();
+		for (int i = 0; i < 3; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PATH_INFO", "/",
+				NULL);
+			string response = readAll(connection);
+			ensure("Status line is correct", containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+			ensure_equals(stripHeaders(response), "front page");
+		}
+
+		vector<ProcessPtr> processes = pool->getProcesses();
+		ensure_equals(processes.size(), 1u);
+		Socket *socket = &processes[0]->sockets->front();
+		ensure("The application socket supports keep-alive", socket->keepAlive);
+		EVENTUALLY(5,
+			result = socket->idleConnectionCount() == 1;
+		);
+	}
+
+	TEST_METHOD(55) {
+		set_test_name("Keep-alive sessions work with request bodies");
+
+		DeleteFileEventually d("/tmp/output.txt");
+		map<string, string> headers = defaultHeaders;
+		headers["REQUEST_METHOD"] = "POST";
+		init();
+		for (int i = 0; i < 2; i++) {
+			string requestBody = "hello " + toString(i) + "\n";
+			connect();
+			sendHeaders(headers,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PATH_INFO", "/raw_upload_to_file",
+				"CONTENT_LENGTH", toString(requestBody.size()).c_str(),
+				"HTTP_X_OUTPUT", "/tmp/output.txt",
+				NULL);
+			writeExact(connection, requestBody);
+			string response = readAll(connection);
+			ensure_equals(stripHeaders(response), "ok");
+			ensure_equals(readAll("/tmp/output.txt"), requestBody);
+		}
+	}
+
+	TEST_METHOD(56) {
+		set_test_name("Unframed response bodies are forwarded correctly to fast clients "
+			"(possibly through splice())");
+
+		init();
+		connect();
+		// Buffered request bodies without a content length are delimited by
+		// EOF, so this session can't be kept alive and the response is unframed.
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/blob",
+			"PASSENGER_BUFFERING", "true",
+			"HTTP_X_SIZE", "5242880",
+			NULL);
+		shutdown(connection, SHUT_WR);
+		string result = stripHeaders(readAll(connection));
+		ensure_equals(result.size(), 5242880u);
+		ensure_equals(result.find_first_not_of('x'), string::npos);
+	}
+
+	TEST_METHOD(57) {
+		set_test_name("Unframed response bodies are forwarded correctly to slow clients "
+			"(falling back from splice() to response buffering)");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/blob",
+			"PASSENGER_BUFFERING", "true",
+			"HTTP_X_SIZE", "5242880",
+			NULL);
+		shutdown(connection, SHUT_WR);
+		EVENTUALLY(10,
+			string state = inspect();
+			result = containsSubstring(state, "appInput reachedEnd         = true")
+				&& containsSubstring(state, "splicingResponse            = false");
+		);
+		string result = stripHeaders(readAll(connection));
+		ensure_equals(result.size(), 5242880u);
+		ensure_equals(result.find_first_not_of('x'), string::npos);
+	}
+
 	// Test small response buffering.
 	// Test large response buffering.
+
+	TEST_METHOD(58) {
+		set_test_name("Client objects of disconnected clients are reused for new connections");
+
+		init();
+		for (int i = 0; i < 3; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PATH_INFO", "/",
+				NULL);
+			string response = readAll(connection);
+			ensure("Status line is correct", containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+			ensure_equals(stripHeaders(response), "front page");
+			EVENTUALLY(5,
+				result = containsSubstring(inspect(), "Client freelist: 1\n");
+			);
+		}
+		ensure(containsSubstring(inspect(), "0 clients:"));
+	}
+
+	TEST_METHOD(59) {
+		set_test_name("It keeps track of clients that disconnect out of order");
+
+		init();
+		FileDescriptor connections[3];
+		for (int i = 0; i < 3; i++) {
+			connections[i] = connectToUnixServer(serverFilename);
+		}
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "3 clients:");
+		);
+
+		connections[1].close();
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "2 clients:");
+		);
+
+		connections[0].close();
+		connections[2].close();
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "0 clients:");
+		);
+	}
+
+	TEST_METHOD(60) {
+		set_test_name("Requests whose pool option headers differ get different pool options");
+
+		const char *groupNames[] = { "group1", "group2", "group1", "group2" };
+		init();
+		for (int i = 0; i < 4; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PASSENGER_APP_GROUP_NAME", groupNames[i],
+				"PATH_INFO", "/",
+				NULL);
+			string response = readAll(connection);
+			ensure("Status line is correct", containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+		}
+		{
+			PoolLockGuard l(pool->syncher);
+			ensure_equals("One process per group", pool->getProcessCount(false), 2u);
+		}
+	}
+
+	TEST_METHOD(61) {
+		set_test_name("It records per-phase latencies for each application group");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			NULL);
+		string response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+
+		EVENTUALLY(5,
+			RequestLatencyStats::GroupLatenciesPtr latencies =
+				handler->latencyStats->get(wsgiAppPath);
+			result = latencies->phases[RequestLatencyStats::TOTAL].getCount() == 1;
+		);
+		RequestLatencyStats::GroupLatenciesPtr latencies = handler->latencyStats->get(wsgiAppPath);
+		ensure_equals(latencies->phases[RequestLatencyStats::CHECKING_OUT_SESSION].getCount(), 1u);
+		ensure_equals(latencies->phases[RequestLatencyStats::WAITING_FOR_APP].getCount(), 1u);
+		ensure_equals("No body buffering took place",
+			latencies->phases[RequestLatencyStats::BUFFERING_BODY].getCount(), 0u);
+		ensure(containsSubstring(handler->latencyStats->inspect(), "waiting for app"));
+	}
+
+	TEST_METHOD(62) {
+		set_test_name("It serves multiple requests over a persistent frontend connection");
+
+		agentOptions.requestSocketPassword = "hello world";
+		init();
+		connect();
+		writeExact(connection, "hello world");
+		for (int i = 0; i < 3; i++) {
+			// The connect password is only sent once.
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PASSENGER_FRONTEND_KEEPALIVE", "true",
+				"PATH_INFO", "/",
+				NULL);
+			string response = readFramedResponse();
+			ensure("Status line is correct", containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+			ensure("Response is chunked", containsSubstring(response, "Transfer-Encoding: chunked\r\n"));
+			ensure("Body is framed", containsSubstring(stripHeaders(response), "\r\nfront page\r\n"));
+		}
+		EVENTUALLY(5,
+			RequestLatencyStats::GroupLatenciesPtr latencies =
+				handler->latencyStats->get(wsgiAppPath);
+			result = latencies->phases[RequestLatencyStats::TOTAL].getCount() == 3;
+		);
+		ensure(containsSubstring(inspect(), "state                       = READING_HEADER"));
+	}
+
+	TEST_METHOD(63) {
+		set_test_name("Error responses on a persistent frontend connection are followed by EOF");
+
+		setLogLevel(-2);
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PASSENGER_FRONTEND_KEEPALIVE", "true",
+			"PASSENGER_RAISE_INTERNAL_ERROR", "true",
+			"PATH_INFO", "/",
+			NULL);
+		string response = readAll(connection);
+		ensure(containsSubstring(response, "Status: 500 Internal Server Error\r\n"));
+		ensure("Response is not chunked", !containsSubstring(response, "Transfer-Encoding: chunked\r\n"));
+	}
+
+	TEST_METHOD(64) {
+		set_test_name("It accepts bursts of connections in growing batches");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		vector<FileDescriptor> connections;
+		for (int i = 0; i < 100; i++) {
+			connections.push_back(FileDescriptor(connectToUnixServer(serverFilename)));
+		}
+		bg.start();
+
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "\n100 clients:\n");
+		);
+		string info = inspect();
+		if (containsSubstring(info, "exclusive wakeups")) {
+			ensure("The batch size grew", !containsSubstring(info, "Accept batch size: 10 "));
+			ensure(!containsSubstring(info, "backlog exceeded it 0 times"));
+		}
+		#ifdef __linux__
+			ensure(containsSubstring(info, "Accept queue: 0 of 1024 connections waiting\n"));
+		#endif
+	}
+
+	TEST_METHOD(65) {
+		set_test_name("It serves publicly cacheable responses from the response cache");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->responseCache = boost::make_shared<ResponseCache>(1024 * 1024);
+		bg.start();
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/cacheable",
+			"REQUEST_URI", "/cacheable",
+			NULL);
+		string response = readAll(connection);
+		ensure(containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+		string body = stripHeaders(response);
+
+		// This one is served from the cache.
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/cacheable",
+			"REQUEST_URI", "/cacheable",
+			NULL);
+		response = readAll(connection);
+		ensure(containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+		ensure(containsSubstring(response, "Age: "));
+		ensure(containsSubstring(response, "Date: "));
+		ensure_equals(stripHeaders(response), body);
+
+		// The response varies on Accept-Encoding.
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/cacheable",
+			"REQUEST_URI", "/cacheable",
+			"HTTP_ACCEPT_ENCODING", "gzip",
+			NULL);
+		response = readAll(connection);
+		ensure(!containsSubstring(response, "Age: "));
+		ensure(stripHeaders(response) != body);
+
+		// Cached bodies are framed on persistent frontend connections.
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PASSENGER_FRONTEND_KEEPALIVE", "true",
+			"PATH_INFO", "/cacheable",
+			"REQUEST_URI", "/cacheable",
+			NULL);
+		response = readFramedResponse();
+		ensure(containsSubstring(response, "Age: "));
+		ensure(containsSubstring(response, "Transfer-Encoding: chunked\r\n"));
+		ensure(containsSubstring(stripHeaders(response), "\r\n" + body + "\r\n"));
+
+		ensure(containsSubstring(inspect(), "Response cache: 2 entries"));
+	}
+
+	TEST_METHOD(66) {
+		set_test_name("It doesn't cache private responses");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->responseCache = boost::make_shared<ResponseCache>(1024 * 1024);
+		bg.start();
+
+		for (int i = 0; i < 2; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PATH_INFO", "/cacheable",
+				"REQUEST_URI", "/cacheable",
+				"HTTP_X_CACHE_CONTROL", "private, max-age=60",
+				NULL);
+			string response = readAll(connection);
+			ensure(containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+			ensure(!containsSubstring(response, "Age: "));
+		}
+		ensure(containsSubstring(inspect(), "Response cache: 0 entries"));
+	}
+
+	TEST_METHOD(67) {
+		set_test_name("It compresses responses for clients that accept gzip");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->compressionPool = boost::make_shared<CompressionPool>(2);
+		bg.start();
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/blob",
+			"HTTP_X_SIZE", "300000",
+			"HTTP_ACCEPT_ENCODING", "deflate, gzip",
+			NULL);
+		string response = readAll(connection);
+		ensure(containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+		ensure(containsSubstring(response, "Content-Encoding: gzip\r\n"));
+		ensure(containsSubstring(response, "Vary: Accept-Encoding\r\n"));
+		string body = stripHeaders(response);
+		ensure("The body is compressed", body.size() < 300000 / 10);
+
+		z_stream stream;
+		char buf[1024 * 64];
+		string decompressed;
+		int ret;
+		memset(&stream, 0, sizeof(stream));
+		ensure_equals(inflateInit2(&stream, 15 + 16), Z_OK);
+		stream.next_in  = (Bytef *) body.data();
+		stream.avail_in = body.size();
+		do {
+			stream.next_out  = (Bytef *) buf;
+			stream.avail_out = sizeof(buf);
+			ret = inflate(&stream, Z_NO_FLUSH);
+			decompressed.append(buf, sizeof(buf) - stream.avail_out);
+		} while (ret == Z_OK);
+		inflateEnd(&stream);
+		ensure_equals(ret, Z_STREAM_END);
+		ensure_equals(decompressed, string(300000, 'x'));
+
+		// Small responses and clients that don't accept gzip get the
+		// response as-is.
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			"HTTP_ACCEPT_ENCODING", "gzip",
+			NULL);
+		response = readAll(connection);
+		ensure(!containsSubstring(response, "Content-Encoding:"));
+		ensure_equals(stripHeaders(response), "front page");
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/blob",
+			"HTTP_X_SIZE", "1000",
+			"HTTP_ACCEPT_ENCODING", "gzip;q=0, identity",
+			NULL);
+		response = readAll(connection);
+		ensure(!containsSubstring(response, "Content-Encoding:"));
+		ensure_equals(stripHeaders(response), string(1000, 'x'));
+	}
+
+	TEST_METHOD(68) {
+		set_test_name("The rest of a response for a slow client is handed over to the "
+			"slow client drainer");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->responseDrainer = boost::make_shared<ResponseDrainer>();
+		bg.start();
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/blob",
+			"PASSENGER_BUFFERING", "true",
+			"HTTP_X_SIZE", "5242880",
+			NULL);
+		shutdown(connection, SHUT_WR);
+		EVENTUALLY(10,
+			string state = inspect();
+			result = containsSubstring(state, "0 clients:")
+				&& containsSubstring(state, "Slow client drainer: 1 active, 1 handed off");
+		);
+		string result = stripHeaders(readAll(connection));
+		ensure_equals(result.size(), 5242880u);
+		ensure_equals(result.find_first_not_of('x'), string::npos);
+		EVENTUALLY(5,
+			result = handler->responseDrainer->getActiveCount() == 0;
+		);
+	}
+
+	TEST_METHOD(69) {
+		set_test_name("It sends the file in an X-Sendfile header if it's in one of the sendfile roots");
+
+		TempDir tempDir("tmp.sendfile");
+		createFile("tmp.sendfile/file.txt", string(100000, 'x'));
+		createFile("tmp.sendfile.txt", "secret");
+		agentOptions.sendfileRoots.push_back("tmp.sendfile");
+		init();
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/sendfile",
+			"HTTP_X_SENDFILE", (root + "/test/tmp.sendfile/file.txt").c_str(),
+			NULL);
+		string response = readAll(connection);
+		ensure(containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+		ensure(containsSubstring(response, "Content-Length: 100000\r\n"));
+		ensure(!containsSubstring(response, "X-Sendfile"));
+		ensure_equals(stripHeaders(response), string(100000, 'x'));
+
+		// Files outside the sendfile roots are not sent.
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/sendfile",
+			"HTTP_X_SENDFILE", (root + "/test/tmp.sendfile/../tmp.sendfile.txt").c_str(),
+			NULL);
+		response = readAll(connection);
+		unlink("tmp.sendfile.txt");
+		ensure(!containsSubstring(response, "secret"));
+	}
+
+	TEST_METHOD(70) {
+		set_test_name("It adds an X-Passenger-Timing header if PASSENGER_TIMING_HEADER is true");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			"PASSENGER_TIMING_HEADER", "true",
+			NULL);
+		string response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+		ensure(response, containsSubstring(response, "X-Passenger-Timing: queue="));
+		ensure(response, containsSubstring(response, "ms;spawn="));
+		ensure(response, containsSubstring(response, "ms;app="));
+		ensure(response, containsSubstring(response, "ms;buffer="));
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			NULL);
+		response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+		ensure(response, !containsSubstring(response, "X-Passenger-Timing"));
+	}
+
+	TEST_METHOD(71) {
+		set_test_name("It adds an X-Passenger-Timing header to requests with a valid signature");
+
+		agentOptions.timingHeaderSecret = "s3cr3t";
+		init();
+
+		string timestamp = toString(time(NULL));
+		string valid = timestamp + ":" + md5_hex("s3cr3t:" + timestamp);
+		string oldTimestamp = toString(time(NULL) - 3600);
+		string expired = oldTimestamp + ":" + md5_hex("s3cr3t:" + oldTimestamp);
+		string forged = timestamp + ":" + md5_hex("wrong:" + timestamp);
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			"HTTP_X_PASSENGER_TIMING", valid.c_str(),
+			NULL);
+		string response = readAll(connection);
+		ensure(response, containsSubstring(response, "X-Passenger-Timing: queue="));
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			"HTTP_X_PASSENGER_TIMING", expired.c_str(),
+			NULL);
+		response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+		ensure(response, !containsSubstring(response, "X-Passenger-Timing: queue="));
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			"HTTP_X_PASSENGER_TIMING", forged.c_str(),
+			NULL);
+		response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+		ensure(response, !containsSubstring(response, "X-Passenger-Timing: queue="));
+	}
+
+	TEST_METHOD(72) {
+		set_test_name("HTTP clients get an error response to a malformed request");
+
+		initHttp();
+		connectHttp();
+		writeExact(connection, "GET / HTTP/1.1\r\n\r\n");
+		string response = readAll(connection);
+		ensure(response, startsWith(response, "HTTP/1.1 400 Bad Request\r\n"));
+		ensure(response, containsSubstring(response, "Connection: close\r\n"));
+
+		connectHttp();
+		writeExact(connection, "GET / HTTP/1.1\r\nHost: foo\r\n"
+			"Transfer-Encoding: gzip\r\n\r\n");
+		response = readAll(connection);
+		ensure(response, startsWith(response, "HTTP/1.1 501 Not Implemented\r\n"));
+	}
+
+	TEST_METHOD(73) {
+		set_test_name("It serves pipelined requests on persistent HTTP connections");
+
+		agentOptions.httpEnvironment.push_back("PASSENGER_LOAD_SHELL_ENVVARS=false");
+		agentOptions.httpEnvironment.push_back("PASSENGER_APP_TYPE=wsgi");
+		agentOptions.httpEnvironment.push_back("PASSENGER_SPAWN_METHOD=direct");
+		agentOptions.httpEnvironment.push_back("PASSENGER_APP_ROOT=" + wsgiAppPath);
+		initHttp();
+		connectHttp();
+		writeExact(connection,
+			"GET / HTTP/1.1\r\nHost: foo\r\n\r\n"
+			"GET / HTTP/1.1\r\nHost: foo\r\n\r\n");
+		string response = readFramedResponse();
+		ensure(response, startsWith(response, "HTTP/1.1 200 OK\r\n"));
+		ensure(response, containsSubstring(response, "Transfer-Encoding: chunked\r\n"));
+		ensure(response, containsSubstring(response, "\r\na\r\nfront page\r\n"));
+		response = readFramedResponse();
+		ensure(response, startsWith(response, "HTTP/1.1 200 OK\r\n"));
+
+		writeExact(connection, "GET / HTTP/1.1\r\nHost: foo\r\nConnection: close\r\n\r\n");
+		response = readAll(connection);
+		ensure(response, containsSubstring(response, "Connection: close\r\n"));
+		ensure_equals(stripHeaders(response), "front page");
+	}
+
+	TEST_METHOD(74) {
+		set_test_name("It passes chunked HTTP request bodies to the application with a content length");
+
+		agentOptions.httpEnvironment.push_back("PASSENGER_LOAD_SHELL_ENVVARS=false");
+		agentOptions.httpEnvironment.push_back("PASSENGER_APP_TYPE=wsgi");
+		agentOptions.httpEnvironment.push_back("PASSENGER_SPAWN_METHOD=direct");
+		agentOptions.httpEnvironment.push_back("PASSENGER_APP_ROOT=" + wsgiAppPath);
+		initHttp();
+		connectHttp();
+		writeExact(connection,
+			"POST /parameters HTTP/1.1\r\n"
+			"Host: foo\r\n"
+			"Content-Type: application/x-www-form-urlencoded\r\n"
+			"Transfer-Encoding: chunked\r\n"
+			"Expect: 100-continue\r\n"
+			"Connection: close\r\n\r\n");
+		char buf[25];
+		unsigned long long timeout = 5000000;
+		ensure_equals(readExact(connection, buf, 25, &timeout), 25u);
+		ensure_equals(string(buf, 25), "HTTP/1.1 100 Continue\r\n\r\n");
+		writeExact(connection, "6\r\nfirst=\r\n3\r\nfoo\r\nb\r\n&second=bar\r\n0\r\n\r\n");
+		string response = readAll(connection);
+		ensure_equals(stripHeaders(response),
+			"Method: POST\n"
+			"First: foo\n"
+			"Second: bar\n");
+	}
+
+	TEST_METHOD(75) {
+		set_test_name("Connections are handed over to a tunnel once the application switches protocols");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/upgrade",
+			"HTTP_CONNECTION", "Upgrade",
+			"HTTP_UPGRADE", "echo",
+			NULL);
+		string response;
+		char buf[1024];
+		unsigned long long timeout = 5000000;
+		while (!containsSubstring(response, "ready\n")) {
+			ssize_t ret = syscalls::read(connection, buf, sizeof(buf));
+			ensure(ret > 0);
+			response.append(buf, ret);
+		}
+		ensure(response, startsWith(response, "HTTP/1.1 101 Switching Protocols\r\n"));
+		EVENTUALLY(5,
+			string state = inspect();
+			result = containsSubstring(state, "Tunnels: 1\n")
+				&& containsSubstring(state, "0 clients:");
+		);
+
+		writeExact(connection, "hello\n");
+		ensure_equals(readExact(connection, buf, 6, &timeout), 6u);
+		ensure_equals(string(buf, 6), "hello\n");
+
+		shutdown(connection, SHUT_WR);
+		ensure_equals(readAll(connection), "");
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "Tunnels: 0\n");
+		);
+	}
+
+	TEST_METHOD(76) {
+		set_test_name("Large unbuffered request bodies are forwarded correctly to applications "
+			"that don't keep up (falling back from splice() to regular forwarding)");
+
+		DeleteFileEventually d1("/tmp/wait.txt");
+		DeleteFileEventually d2("/tmp/output.txt");
+
+		// 2 MB of request body. Guaranteed not to fit in any socket buffer.
+		string requestBody;
+		for (int i = 0; i < 102400; i++) {
+			char buf[100];
+			snprintf(buf, sizeof(buf), "%06d: hello world!\n", i);
+			requestBody.append(buf);
+		}
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/raw_upload_to_file",
+			"CONTENT_LENGTH", toString(requestBody.size()).c_str(),
+			"HTTP_X_WAIT_FOR_FILE", "/tmp/wait.txt",
+			"HTTP_X_OUTPUT", "/tmp/output.txt",
+			NULL);
+
+		TempThread thr(boost::bind(RequestHandlerTest::writeBody, connection, requestBody));
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "session initiated           = true");
+		);
+		usleep(100000);
+		touchFile("/tmp/wait.txt");
+
+		string result = stripHeaders(readAll(connection));
+		ensure_equals(result, "ok");
+		ensure("The request body arrives intact", readAll("/tmp/output.txt") == requestBody);
+	}
+
+	TEST_METHOD(77) {
+		set_test_name("With peer credential authentication, request socket clients "
+			"of an authorized user don't send a connect password");
+
+		agentOptions.requestSocketPassword = "hello world";
+		agentOptions.requestSocketPeerAuth = true;
+		agentOptions.webServerWorkerUid = geteuid();
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			NULL
+		);
+		ensure(containsSubstring(readAll(connection), "front page"));
+	}
+
+	TEST_METHOD(78) {
+		set_test_name("Identical concurrent requests are collapsed into a single "
+			"application request if PASSENGER_COLLAPSE_REQUESTS is on");
+
+		DeleteFileEventually d("/tmp/wait.txt");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->responseCache = boost::make_shared<ResponseCache>(1024 * 1024);
+		bg.start();
+
+		FileDescriptor connections[2];
+		for (int i = 0; i < 2; i++) {
+			connections[i] = connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PASSENGER_COLLAPSE_REQUESTS", "true",
+				"PATH_INFO", "/cacheable",
+				"REQUEST_URI", "/cacheable",
+				"HTTP_X_WAIT_FOR_FILE", "/tmp/wait.txt",
+				NULL);
+			if (i == 0) {
+				EVENTUALLY(5,
+					result = containsSubstring(inspect(), "session initiated           = true");
+				);
+			}
+		}
+		EVENTUALLY(5,
+			result = containsSubstring(inspect(), "WAITING_FOR_COLLAPSED_RESPONSE");
+		);
+		touchFile("/tmp/wait.txt");
+
+		string response1 = readAll(connections[0]);
+		string response2 = readAll(connections[1]);
+		ensure(containsSubstring(response1, "HTTP/1.1 200 OK\r\n"));
+		ensure(containsSubstring(response2, "HTTP/1.1 200 OK\r\n"));
+		ensure(containsSubstring(response2, "Age: "));
+		ensure_equals(stripHeaders(response2), stripHeaders(response1));
+		ensure(containsSubstring(inspect(), "Collapsed requests: 0 in flight"));
+	}
+
+	TEST_METHOD(79) {
+		set_test_name("HTTP clients get files in the public directory without "
+			"involving the application");
+
+		string publicDir = wsgiAppPath + "/public";
+		DeleteFileEventually d1(publicDir + "/static.css");
+		DeleteFileEventually d2(publicDir + "/static.css.gz");
+		DeleteFileEventually d3(publicDir + "/page.html");
+		createFile(publicDir + "/static.css", "body {}");
+		createFile(publicDir + "/static.css.gz", "gzipped");
+		createFile(publicDir + "/page.html", "page cache");
+
+		agentOptions.httpEnvironment.push_back("PASSENGER_APP_ROOT=" + wsgiAppPath);
+		httpServerFilename = generation->getPath() + "/http";
+		httpSocket = createUnixServer(httpServerFilename);
+		setNonBlocking(httpSocket);
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->staticFileCache = boost::make_shared<StaticFileCache>(10);
+		handler->listenForHttp(httpSocket);
+		bg.start();
+
+		// Static files are delimited by their Content-Length, so the
+		// connection can be reused.
+		connectHttp();
+		writeExact(connection,
+			"GET /static.css HTTP/1.1\r\nHost: foo\r\n\r\n"
+			"GET /page HTTP/1.1\r\nHost: foo\r\nConnection: close\r\n\r\n");
+		string response = readAll(connection);
+		ensure(response, startsWith(response, "HTTP/1.1 200 OK\r\n"));
+		ensure(response, containsSubstring(response, "Content-Type: text/css\r\n"));
+		ensure(response, containsSubstring(response, "Content-Length: 7\r\n"));
+		ensure(response, containsSubstring(response, "ETag: \""));
+		ensure(response, containsSubstring(response, "\r\n\r\nbody {}HTTP/1.1 200 OK\r\n"));
+		ensure(response, containsSubstring(response, "Content-Type: text/html; charset=utf-8\r\n"));
+		ensure_equals(response.substr(response.size() - 14), "\r\n\r\npage cache");
+
+		string etag = response.substr(response.find("ETag: ") + 6);
+		etag.erase(etag.find("\r\n"));
+		connectHttp();
+		writeExact(connection, "GET /static.css HTTP/1.1\r\nHost: foo\r\n"
+			"If-None-Match: " + etag + "\r\nConnection: close\r\n\r\n");
+		response = readAll(connection);
+		ensure(response, startsWith(response, "HTTP/1.1 304 Not Modified\r\n"));
+		ensure_equals(stripHeaders(response), "");
+
+		connectHttp();
+		writeExact(connection, "GET /static.css HTTP/1.1\r\nHost: foo\r\n"
+			"Accept-Encoding: gzip\r\nConnection: close\r\n\r\n");
+		response = readAll(connection);
+		ensure(response, containsSubstring(response, "Content-Encoding: gzip\r\n"));
+		ensure(response, containsSubstring(response, "Content-Type: text/css\r\n"));
+		ensure_equals(stripHeaders(response), "gzipped");
+		ensure(containsSubstring(inspect(), "Static file cache: 4 of 10 entries"));
+	}
+
+	TEST_METHOD(80) {
+		set_test_name("Chunked responses are passed on as-is on persistent "
+			"frontend connections");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PASSENGER_FRONTEND_KEEPALIVE", "true",
+			"PATH_INFO", "/chunked",
+			NULL);
+		string response = readFramedResponse();
+		ensure(response, containsSubstring(response, "Transfer-Encoding: chunked\r\n"));
+		ensure_equals(stripHeaders(response),
+			"7\r\nchunk1\n\r\n"
+			"7\r\nchunk2\n\r\n"
+			"7\r\nchunk3\n\r\n"
+			"0\r\n\r\n");
+
+		// The connection can be reused afterwards.
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PASSENGER_FRONTEND_KEEPALIVE", "true",
+			"PATH_INFO", "/chunked",
+			NULL);
+		response = readFramedResponse();
+		ensure(response, containsSubstring(response, "7\r\nchunk3\n\r\n0\r\n\r\n"));
+	}
+
+	TEST_METHOD(81) {
+		set_test_name("Requests over the rate limit of their key get a 429 response");
+
+		const char *clients[] = { "a", "a", "a", "b" };
+		const char *statuses[] = { "200 OK", "200 OK", "429 Too Many Requests", "200 OK" };
+		init();
+		for (int i = 0; i < 4; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"PASSENGER_RATE_LIMIT", "0.01",
+				"PASSENGER_RATE_LIMIT_BURST", "2",
+				"PASSENGER_RATE_LIMIT_KEY", "HTTP_X_CLIENT",
+				"HTTP_X_CLIENT", clients[i],
+				"PATH_INFO", "/",
+				NULL);
+			string response = readAll(connection);
+			ensure(response, containsSubstring(response, statuses[i]));
+		}
+	}
+
+	TEST_METHOD(82) {
+		set_test_name("The app is told the request deadline if there is a queue time budget");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/env",
+			NULL);
+		string response = readAll(connection);
+		ensure(response, !containsSubstring(response, "PASSENGER_REQUEST_DEADLINE"));
+
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PASSENGER_MAX_REQUEST_QUEUE_TIME", "30000",
+			"PATH_INFO", "/env",
+			NULL);
+		response = readAll(connection);
+		string::size_type pos = response.find("PASSENGER_REQUEST_DEADLINE = ");
+		ensure(response, pos != string::npos);
+		double deadline = atof(response.c_str() + pos + sizeof("PASSENGER_REQUEST_DEADLINE = ") - 1);
+		double now = SystemTime::getUsec() / 1000000.0;
+		ensure(toString(deadline), deadline > now + 20 && deadline <= now + 30);
+	}
+
+	TEST_METHOD(83) {
+		set_test_name("With request loop affinity, connections are handed over "
+			"to the request loop that owns their app group");
+
+		// The second handler doesn't accept connections itself, so it can
+		// only serve the requests if they are handed over to it.
+		string otherServerFilename = generation->getPath() + "/other";
+		FileDescriptor otherSocket(createUnixServer(otherServerFilename));
+		setNonBlocking(otherSocket);
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler2 = boost::make_shared<RequestHandler>(bg2.safe, otherSocket, pool, agentOptions);
+		handler->requestLoopHandlers.push_back(handler2.get());
+		bg.start();
+		bg2.start();
+
+		for (int i = 0; i < 3; i++) {
+			connect();
+			sendHeaders(defaultHeaders,
+				"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+				"REQUEST_METHOD", "POST",
+				"PATH_INFO", "/parameters",
+				"CONTENT_TYPE", "application/x-www-form-urlencoded",
+				"CONTENT_LENGTH", "20",
+				NULL);
+			writeExact(connection, "first=foo&second=bar");
+			string response = readAll(connection);
+			ensure(response, containsSubstring(response, "HTTP/1.1 200 OK\r\n"));
+			ensure_equals(stripHeaders(response),
+				"Method: POST\n"
+				"First: foo\n"
+				"Second: bar\n");
+		}
+		unlink(otherServerFilename.c_str());
+	}
+
+	TEST_METHOD(84) {
+		set_test_name("A request that exceeds the maximum request time is answered with a 504 "
+			"and its process is detached");
+
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PASSENGER_MAX_REQUEST_TIME", "1",
+			"PATH_INFO", "/sleep",
+			"HTTP_X_SLEEP", "10",
+			NULL);
+		Timer timer;
+		string response = readAll(connection);
+		ensure(response, containsSubstring(response, "Status: 504 Gateway Timeout\r\n"));
+		ensure(response, containsSubstring(response, "took too long to respond"));
+		ensure("answered before the application finished", timer.elapsed() < 5000);
+
+		EVENTUALLY(5,
+			PoolLockGuard l(pool->syncher);
+			result = !pool->superGroups.get(wsgiAppPath)->defaultGroup->detachedProcesses.empty();
+		);
+	}
+
+	TEST_METHOD(85) {
+		set_test_name("Memory that is kept for reuse is released once there have been "
+			"no clients for a while");
+
+		handler = boost::make_shared<RequestHandler>(bg.safe, requestSocket, pool, agentOptions);
+		handler->idleMemoryReleaseDelay = 1;
+		bg.start();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			NULL);
+		string response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+		EVENTUALLY(5,
+			string state = inspect();
+			result = containsSubstring(state, "Idle memory releases: 1 ")
+				&& containsSubstring(state, "Client freelist: 0\n");
+		);
+	}
+
+	TEST_METHOD(86) {
+		// The resource usage that the application reports in the
+		// X-Passenger-Resource-Usage header is added to the totals of the
+		// process, and the header is not passed on to the client.
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/resource_usage",
+			NULL);
+		string response = readAll(connection);
+		ensure(containsSubstring(response, "Status: 200 OK\r\n"));
+		ensure(!containsSubstring(response, "X-Passenger-Resource-Usage"));
+
+		PoolLockGuard l(pool->syncher);
+		ProcessPtr process = pool->superGroups.get(wsgiAppPath)->defaultGroup->
+			enabledProcesses.front();
+		ensure_equals(process->cpuTime, 1500ull);
+		ensure_equals(process->allocations, 320ull);
+		ensure_equals(process->resourceUsageReports, 1u);
+	}
+
+	TEST_METHOD(87) {
+		// The time spent in event loop callbacks is accounted per priority class.
+		init();
+		connect();
+		sendHeaders(defaultHeaders,
+			"PASSENGER_APP_ROOT", wsgiAppPath.c_str(),
+			"PATH_INFO", "/",
+			NULL);
+		string response = readAll(connection);
+		ensure_equals(stripHeaders(response), "front page");
+
+		string state = inspect();
+		ensure(state, containsSubstring(state, "Loop time: sessions="));
+		ensure(state, !containsSubstring(state, "client_input=0ms/0 "));
+		ensure(state, !containsSubstring(state, "app_io=0ms/0 "));
+	}
 }
@@ -0,0 +1,57 @@
+#include "TestSupport.h"
+#include <agents/HelperAgent/RequestLatencyStats.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct RequestLatencyStatsTest {
+		LatencyHistogram histogram;
+		RequestLatencyStats stats;
+	};
+
+	DEFINE_TEST_GROUP(RequestLatencyStatsTest);
+
+	TEST_METHOD(1) {
+		// An empty histogram reports zero for all percentiles.
+		ensure_equals(histogram.getCount(), 0u);
+		ensure_equals(histogram.percentile(50), 0ull);
+		ensure_equals(histogram.percentile(99), 0ull);
+	}
+
+	TEST_METHOD(2) {
+		// Percentiles are reported as the upper bound of the bucket they fall in.
+		for (int i = 0; i < 98; i++) {
+			histogram.record(100);
+		}
+		histogram.record(5000);
+		histogram.record(5000);
+		ensure_equals(histogram.getCount(), 100u);
+		ensure_equals("p50", histogram.percentile(50), 128ull);
+		ensure_equals("p98", histogram.percentile(98), 128ull);
+		ensure_equals("p99", histogram.percentile(99), 8192ull);
+		ensure_equals("p100", histogram.percentile(100), 8192ull);
+	}
+
+	TEST_METHOD(3) {
+		// Very large durations end up in the last bucket.
+		histogram.record(0);
+		histogram.record(~0ull);
+		ensure_equals(histogram.percentile(1), 2ull);
+		ensure_equals(histogram.percentile(100), 2ull << (LatencyHistogram::BUCKETS - 1));
+	}
+
+	TEST_METHOD(4) {
+		// get() returns the same object for the same group.
+		RequestLatencyStats::GroupLatenciesPtr group = stats.get("/foo");
+		ensure(group == stats.get("/foo"));
+		ensure(group != stats.get("/bar"));
+
+		group->phases[RequestLatencyStats::TOTAL].record(1500);
+		string result = stats.inspect();
+		ensure(containsSubstring(result, "/foo:\n"));
+		ensure(containsSubstring(result, "total"));
+		ensure(containsSubstring(result, "2ms"));
+		ensure("Empty phases are not shown", !containsSubstring(result, "buffering body"));
+	}
+}
@@ -0,0 +1,198 @@
+#include "TestSupport.h"
+#include "agents/LoggingAgent/RequestStore.h"
+#include <Utils/SystemTime.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct RequestStoreTest {
+		static const unsigned long long HOUR = 3600ull * 1000000;
+
+		TempDir tmpDir;
+		string dir;
+		unsigned long long start;
+
+		RequestStoreTest()
+			: tmpDir("tmp.store")
+		{
+			dir = "tmp.store/store";
+			// A time at the start of a partition.
+			start = 1400000400ull * 1000000;
+			SystemTime::forceAll(start);
+		}
+
+		~RequestStoreTest() {
+			SystemTime::releaseAll();
+		}
+
+		static RequestStore::Request request(unsigned long long timestamp,
+			const string &app, const string &uri, int statusCode, int responseTime)
+		{
+			RequestStore::Request request;
+			request.timestamp = timestamp;
+			request.app = app;
+			request.uri = uri;
+			request.controllerAction = "Foo#" + uri.substr(1);
+			request.status = toString(statusCode) + " Whatever";
+			request.statusCode = statusCode;
+			request.responseTime = responseTime;
+			return request;
+		}
+
+		static vector<string> lines(const string &result) {
+			vector<string> lines;
+			split(result, '\n', lines);
+			if (!lines.empty() && lines.back().empty()) {
+				lines.pop_back();
+			}
+			return lines;
+		}
+
+		static bool fileExists(const string &path) {
+			struct stat buf;
+			return stat(path.c_str(), &buf) == 0;
+		}
+	};
+
+	DEFINE_TEST_GROUP(RequestStoreTest);
+
+	TEST_METHOD(1) {
+		// Without grouping, it returns totals and the slowest matching
+		// requests, both before and after flushing them to disk.
+		RequestStore store(dir, 3600, 7 * 24 * 3600, 1024 * 1024);
+		store.add(request(start + 1, "app1", "/checkout", 200, 100));
+		store.add(request(start + 2, "app1", "/checkout", 500, 300));
+		store.add(request(start + 3, "app1", "/home", 200, 1000));
+		store.add(request(start + 4, "app2", "/checkout", 200, 200));
+
+		RequestStore::Query query;
+		query.filter = "uri == \"/checkout\"";
+		query.limit = 2;
+		for (int i = 0; i < 2; i++) {
+			vector<string> result = lines(store.query(query));
+			ensure_equals(result.size(), 3u);
+			ensure(startsWith(result[0], "total\tcount=3\terrors=1\tavg=200\tmax=300\t"));
+			ensure_equals(result[1], toString(start + 2) +
+				"\t300\t500\tapp1\tFoo#checkout\t/checkout");
+			ensure_equals(result[2], toString(start + 4) +
+				"\t200\t200\tapp2\tFoo#checkout\t/checkout");
+			store.flush();
+		}
+		ensure(fileExists(dir + "/requests-1400000400.seg"));
+	}
+
+	TEST_METHOD(2) {
+		// Requests can be aggregated per field, the slowest groups first.
+		RequestStore store(dir, 3600, 7 * 24 * 3600, 1024 * 1024);
+		store.add(request(start + 1, "app1", "/a", 200, 100));
+		store.add(request(start + 2, "app2", "/b", 200, 200));
+		store.flush();
+		store.add(request(start + 3, "app2", "/c", 503, 400));
+
+		RequestStore::Query query;
+		query.groupBy = "app";
+		vector<string> result = lines(store.query(query));
+		ensure_equals(result.size(), 3u);
+		ensure(startsWith(result[0], "total\tcount=3\terrors=1\t"));
+		ensure(startsWith(result[1], "app2\tcount=2\terrors=1\tavg=300\tmax=400\t"));
+		ensure(startsWith(result[2], "app1\tcount=1\terrors=0\tavg=100\tmax=100\t"));
+
+		query.groupBy = "foo";
+		try {
+			store.query(query);
+			fail("ArgumentException expected");
+		} catch (const ArgumentException &) {
+			// Pass.
+		}
+	}
+
+	TEST_METHOD(3) {
+		// Queries only return requests in the given time range, and
+		// segments survive reopening the store.
+		{
+			RequestStore store(dir, 3600, 7 * 24 * 3600, 1024 * 1024);
+			store.add(request(start, "app", "/a", 200, 1));
+			store.add(request(start + HOUR, "app", "/b", 200, 2));
+			store.add(request(start + 2 * HOUR, "app", "/c", 200, 3));
+		}
+		ensure(fileExists(dir + "/requests-1400000400.seg"));
+		ensure(fileExists(dir + "/requests-1400004000.seg"));
+		ensure(fileExists(dir + "/requests-1400007600.seg"));
+
+		RequestStore store(dir, 3600, 7 * 24 * 3600, 1024 * 1024);
+		RequestStore::Query query;
+		query.since = start + HOUR;
+		query.until = start + 2 * HOUR;
+		vector<string> result = lines(store.query(query));
+		ensure_equals(result.size(), 2u);
+		ensure(startsWith(result[0], "total\tcount=1\t"));
+		ensure(result[1].find("/b") != string::npos);
+	}
+
+	TEST_METHOD(4) {
+		// Segments older than the retention period are deleted, and so
+		// are the oldest segments when the store is too large.
+		{
+			RequestStore store(dir, 3600, 2 * 3600, 1024 * 1024);
+			store.add(request(start, "app", "/a", 200, 1));
+			store.add(request(start + HOUR, "app", "/b", 200, 2));
+			store.flush();
+			SystemTime::forceAll(start + 3 * HOUR);
+			store.add(request(start + 3 * HOUR, "app", "/c", 200, 3));
+			store.flush();
+		}
+		ensure(!fileExists(dir + "/requests-1400000400.seg"));
+		ensure(fileExists(dir + "/requests-1400004000.seg"));
+		ensure(fileExists(dir + "/requests-1400011200.seg"));
+
+		RequestStore store(dir, 3600, 7 * 24 * 3600, 1);
+		ensure(!fileExists(dir + "/requests-1400004000.seg"));
+		ensure("The newest segment is kept", fileExists(dir + "/requests-1400011200.seg"));
+	}
+
+	TEST_METHOD(5) {
+		// An invalid filter results in a SyntaxError.
+		RequestStore store(dir, 3600, 7 * 24 * 3600, 1024 * 1024);
+		RequestStore::Query query;
+		query.filter = "uri ==";
+		try {
+			store.query(query);
+			fail("SyntaxError expected");
+		} catch (const SyntaxError &) {
+			// Pass.
+		}
+	}
+
+	TEST_METHOD(6) {
+		// It stores the resource usage that the application reported, which
+		// can be filtered on and is averaged per group.
+		RequestStore store(dir, 3600, 7 * 24 * 3600, 1024 * 1024);
+		RequestStore::Request cpuBound = request(start + 1, "app1", "/report", 200, 900);
+		cpuBound.cpuTime = 800;
+		cpuBound.allocations = 5000;
+		RequestStore::Request ioBound = request(start + 2, "app1", "/upload", 200, 900);
+		ioBound.cpuTime = 100;
+		ioBound.allocations = 1000;
+		store.add(cpuBound);
+		store.add(ioBound);
+
+		RequestStore::Query query;
+		query.groupBy = "app";
+		for (int i = 0; i < 2; i++) {
+			vector<string> result = lines(store.query(query));
+			ensure_equals(result.size(), 2u);
+			ensure(result[1].find("\tcpu_avg=450\tallocations_avg=3000") != string::npos);
+			store.flush();
+		}
+
+		query.groupBy.clear();
+		query.filter = "cpu_time > 500";
+		query.limit = 10;
+		vector<string> result = lines(store.query(query));
+		ensure_equals(result.size(), 2u);
+		ensure(result[1].find("/report") != string::npos);
+	}
+}
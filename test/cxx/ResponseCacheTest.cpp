@@ -0,0 +1,114 @@
+#include "TestSupport.h"
+#include <agents/HelperAgent/ResponseCache.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct ResponseCacheTest {
+		vector<string> noVary;
+
+		string key(const StaticString &primaryKey, const StaticString &varyValue) {
+			vector<StaticString> values;
+			string result;
+			values.push_back(varyValue);
+			ResponseCache::buildKey(result, primaryKey, values);
+			return result;
+		}
+	};
+
+	DEFINE_TEST_GROUP(ResponseCacheTest);
+
+	TEST_METHOD(1) {
+		// A stored response can be looked up until it expires.
+		ResponseCache cache(1024 * 1024);
+		ensure(cache.getVaryHeaders("foo") == NULL);
+		ensure(cache.store("foo", noVary, "foo", "Status: 200 OK\r\n", "hello", 100, 200));
+		ensure(cache.getVaryHeaders("foo") != NULL);
+		ensure_equals(cache.getVaryHeaders("foo")->size(), 0u);
+
+		ResponseCache::EntryPtr entry = cache.lookup("foo", 150);
+		ensure(entry != NULL);
+		ensure_equals(entry->header, "Status: 200 OK\r\n");
+		ensure_equals(entry->body, "hello");
+		ensure_equals(entry->storedAt, 100ull);
+
+		ensure(cache.lookup("foo", 200) == NULL);
+		ensure_equals(cache.count(), 0u);
+		ensure_equals(cache.size(), 0u);
+		ensure(cache.getVaryHeaders("foo") == NULL);
+	}
+
+	TEST_METHOD(2) {
+		// Responses that vary on request headers are stored per header value.
+		ResponseCache cache(1024 * 1024);
+		vector<string> vary;
+		vary.push_back("HTTP_ACCEPT_ENCODING");
+
+		ensure(cache.store("foo", vary, key("foo", "gzip"), "", "compressed", 0, 100));
+		ensure(cache.store("foo", vary, key("foo", ""), "", "plain", 0, 100));
+		ensure_equals(cache.count(), 2u);
+		ensure_equals(cache.getVaryHeaders("foo")->size(), 1u);
+		ensure_equals(cache.getVaryHeaders("foo")->front(), "HTTP_ACCEPT_ENCODING");
+		ensure_equals(cache.lookup(key("foo", "gzip"), 50)->body, "compressed");
+		ensure_equals(cache.lookup(key("foo", ""), 50)->body, "plain");
+		ensure(cache.lookup(key("foo", "br"), 50) == NULL);
+	}
+
+	TEST_METHOD(3) {
+		// Storing a response with different Vary headers removes the
+		// responses stored with the old ones.
+		ResponseCache cache(1024 * 1024);
+		vector<string> vary;
+		vary.push_back("HTTP_ACCEPT_ENCODING");
+
+		ensure(cache.store("foo", vary, key("foo", "gzip"), "", "1", 0, 100));
+		ensure(cache.store("foo", vary, key("foo", ""), "", "2", 0, 100));
+		ensure(cache.store("bar", noVary, "bar", "", "3", 0, 100));
+		ensure(cache.store("foo", noVary, "foo", "", "4", 0, 100));
+		ensure_equals(cache.count(), 2u);
+		ensure_equals(cache.getVaryHeaders("foo")->size(), 0u);
+		ensure(cache.lookup(key("foo", "gzip"), 50) == NULL);
+		ensure_equals(cache.lookup("foo", 50)->body, "4");
+		ensure_equals(cache.lookup("bar", 50)->body, "3");
+	}
+
+	TEST_METHOD(4) {
+		// The least recently used entries are evicted when the budget is exceeded.
+		string body(100, 'x');
+		size_t entrySize = sizeof(ResponseCache::Entry) + 2 + body.size();
+		ResponseCache cache(entrySize * 3, entrySize);
+
+		ensure(cache.store("a", noVary, "a", "", body, 0, 100));
+		ensure(cache.store("b", noVary, "b", "", body, 0, 100));
+		ensure(cache.store("c", noVary, "c", "", body, 0, 100));
+		ensure_equals(cache.size(), entrySize * 3);
+		ensure(cache.lookup("a", 50) != NULL);
+		ensure(cache.store("d", noVary, "d", "", body, 0, 100));
+
+		ensure_equals(cache.count(), 3u);
+		ensure(cache.lookup("b", 50) == NULL);
+		ensure(cache.getVaryHeaders("b") == NULL);
+		ensure(cache.lookup("a", 50) != NULL);
+		ensure(cache.lookup("c", 50) != NULL);
+		ensure(cache.lookup("d", 50) != NULL);
+	}
+
+	TEST_METHOD(5) {
+		// Responses larger than the maximum entry size are not stored, and
+		// storing under an existing key replaces the old entry.
+		ResponseCache cache(1024 * 1024, 1024);
+		ensure(!cache.store("foo", noVary, "foo", "", string(2048, 'x'), 0, 100));
+		ensure_equals(cache.count(), 0u);
+
+		ensure(cache.store("foo", noVary, "foo", "", "old", 0, 100));
+		ensure(cache.store("foo", noVary, "foo", "", "new", 10, 200));
+		ensure_equals(cache.count(), 1u);
+		ensure_equals(cache.lookup("foo", 150)->body, "new");
+
+		cache.remove("foo");
+		ensure_equals(cache.count(), 0u);
+		ensure_equals(cache.size(), 0u);
+		ensure(cache.getVaryHeaders("foo") == NULL);
+	}
+}
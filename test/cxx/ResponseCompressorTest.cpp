@@ -0,0 +1,88 @@
+#include "TestSupport.h"
+#include <agents/HelperAgent/ResponseCompressor.h>
+#include <boost/thread.hpp>
+#include <zlib.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct ResponseCompressorTest {
+		boost::mutex syncher;
+		vector<int> jobsRun;
+
+		static string decompress(const string &data, int windowBits) {
+			z_stream stream;
+			char buf[1024 * 4];
+			string result;
+			int ret;
+
+			memset(&stream, 0, sizeof(stream));
+			ensure_equals(inflateInit2(&stream, windowBits), Z_OK);
+			stream.next_in  = (Bytef *) data.data();
+			stream.avail_in = data.size();
+			do {
+				stream.next_out  = (Bytef *) buf;
+				stream.avail_out = sizeof(buf);
+				ret = inflate(&stream, Z_NO_FLUSH);
+				result.append(buf, sizeof(buf) - stream.avail_out);
+			} while (ret == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+			inflateEnd(&stream);
+			return result;
+		}
+
+		void runJob(int i) {
+			boost::lock_guard<boost::mutex> l(syncher);
+			jobsRun.push_back(i);
+		}
+	};
+
+	DEFINE_TEST_GROUP(ResponseCompressorTest);
+
+	TEST_METHOD(1) {
+		// It compresses a body in multiple steps into a valid gzip stream.
+		ResponseCompressor compressor(ResponseCompressor::GZIP);
+		string part1(1024 * 64, 'a');
+		string part2 = "hello world";
+
+		compressor.input = part1;
+		compressor.step();
+		ensure(compressor.errorMessage.empty());
+		ensure(compressor.input.empty());
+		ensure(!compressor.isFinished());
+		ensure("The data so far is flushed", !compressor.output.empty());
+		ensure_equals(decompress(compressor.output, 15 + 16), part1);
+
+		compressor.input = part2;
+		compressor.finishing = true;
+		compressor.step();
+		ensure(compressor.isFinished());
+		ensure(compressor.output.size() < part1.size() / 10);
+		ensure_equals(decompress(compressor.output, 15 + 16), part1 + part2);
+	}
+
+	TEST_METHOD(2) {
+		// It supports deflate, and finishing without any more input.
+		ResponseCompressor compressor(ResponseCompressor::DEFLATE);
+		ensure_equals(ResponseCompressor::encodingName(ResponseCompressor::DEFLATE), string("deflate"));
+		compressor.input = "hello hello hello";
+		compressor.step();
+		compressor.finishing = true;
+		compressor.step();
+		ensure(compressor.isFinished());
+		ensure_equals(decompress(compressor.output, 15), "hello hello hello");
+	}
+
+	TEST_METHOD(3) {
+		// CompressionPool runs all submitted jobs, and its destructor
+		// waits for them.
+		{
+			CompressionPool pool(2);
+			ensure_equals(pool.getThreadCount(), 2u);
+			for (int i = 0; i < 10; i++) {
+				pool.submit(boost::bind(&ResponseCompressorTest::runJob, this, i));
+			}
+		}
+		ensure_equals(jobsRun.size(), 10u);
+	}
+}
@@ -0,0 +1,120 @@
+#include <TestSupport.h>
+#include <BackgroundEventLoop.h>
+#include <SafeLibev.h>
+#include <oxt/thread.hpp>
+#include <vector>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct SafeLibevTest {
+		BackgroundEventLoop bg;
+		boost::mutex syncher;
+		vector<int> log;
+
+		SafeLibevTest() {
+			bg.start();
+		}
+
+		~SafeLibevTest() {
+			bg.stop();
+		}
+
+		void append(int value) {
+			boost::lock_guard<boost::mutex> l(syncher);
+			log.push_back(value);
+		}
+
+		unsigned int logSize() {
+			boost::lock_guard<boost::mutex> l(syncher);
+			return log.size();
+		}
+
+		void produce(int thread, int count) {
+			for (int i = 0; i < count; i++) {
+				bg.safe->runLater(boost::bind(&SafeLibevTest::append, this,
+					thread * count + i));
+			}
+		}
+
+		void scheduleAndCancel(bool *cancelled, bool *cancelledTwice) {
+			bg.safe->runLater(boost::bind(&SafeLibevTest::append, this, 1));
+			unsigned int id = bg.safe->runLater(boost::bind(&SafeLibevTest::append, this, 2));
+			bg.safe->runLater(boost::bind(&SafeLibevTest::append, this, 3));
+			*cancelled = bg.safe->cancelCommand(id);
+			*cancelledTwice = bg.safe->cancelCommand(id);
+		}
+	};
+
+	DEFINE_TEST_GROUP(SafeLibevTest);
+
+	TEST_METHOD(1) {
+		// runLater() runs callbacks from multiple threads in the order in
+		// which each thread scheduled them.
+		vector< boost::shared_ptr<oxt::thread> > threads;
+		for (int i = 0; i < 4; i++) {
+			threads.push_back(boost::make_shared<oxt::thread>(
+				boost::bind(&SafeLibevTest::produce, this, i, 1000)));
+		}
+		for (int i = 0; i < 4; i++) {
+			threads[i]->join();
+		}
+		EVENTUALLY(5,
+			result = logSize() == 4000;
+		);
+
+		vector<int> last(4, -1);
+		for (unsigned int i = 0; i < log.size(); i++) {
+			int thread = log[i] / 1000;
+			ensure("Callbacks of a thread run in order", log[i] > last[thread]);
+			last[thread] = log[i];
+		}
+	}
+
+	TEST_METHOD(2) {
+		// runSync() only returns after the callback has run, and after the
+		// callbacks that were scheduled before it have run.
+		for (int i = 0; i < 100; i++) {
+			bg.safe->runLater(boost::bind(&SafeLibevTest::append, this, i));
+		}
+		bg.safe->runSync(boost::bind(&SafeLibevTest::append, this, 100));
+		ensure_equals(logSize(), 101u);
+		ensure_equals(log.back(), 100);
+	}
+
+	TEST_METHOD(3) {
+		// cancelCommand() cancels callbacks that haven't run yet.
+		bool cancelled, cancelledTwice;
+		bg.safe->runSync(boost::bind(&SafeLibevTest::scheduleAndCancel, this,
+			&cancelled, &cancelledTwice));
+		bg.safe->runSync(boost::bind(&SafeLibevTest::append, this, 4));
+		ensure("The command is cancelled", cancelled);
+		ensure("A command can only be cancelled once", !cancelledTwice);
+		ensure_equals(logSize(), 3u);
+		ensure_equals(log[0], 1);
+		ensure_equals(log[1], 3);
+		ensure_equals(log[2], 4);
+	}
+
+	TEST_METHOD(4) {
+		// When called from another thread, cancelCommand() returns false
+		// for callbacks that were scheduled before it, because the event
+		// loop thread has run them by the time that it looks at them.
+		unsigned int id = bg.safe->runLater(boost::bind(&SafeLibevTest::append, this, 1));
+		ensure(!bg.safe->cancelCommand(id));
+		ensure_equals(logSize(), 1u);
+	}
+
+	static void getNowUsec(SafeLibev *safe, unsigned long long *result) {
+		safe->updateNow();
+		*result = safe->getNowUsec();
+	}
+
+	TEST_METHOD(5) {
+		// getNowUsec() returns the time cached by the event loop.
+		unsigned long long now, real = SystemTime::getUsec();
+		bg.safe->run(boost::bind(getNowUsec, bg.safe.get(), &now));
+		ensure(now + 1000000 >= real && now <= real + 1000000);
+	}
+}
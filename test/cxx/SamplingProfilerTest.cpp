@@ -0,0 +1,95 @@
+#include "TestSupport.h"
+#include <Utils/SamplingProfiler.h>
+#include <oxt/thread.hpp>
+#include <oxt/backtrace.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/foreach.hpp>
+#include <Utils/StrIntUtils.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct SamplingProfilerTest {
+		boost::atomic<bool> stop;
+		boost::atomic<unsigned long long> counter;
+		oxt::thread *thread;
+
+		SamplingProfilerTest() {
+			stop.store(false);
+			counter.store(0);
+			thread = new oxt::thread(boost::bind(&SamplingProfilerTest::burnCpu, this),
+				"CPU burner");
+		}
+
+		~SamplingProfilerTest() {
+			stop.store(true);
+			thread->join();
+			delete thread;
+		}
+
+		void burnCpu() {
+			TRACE_POINT();
+			while (!stop.load(boost::memory_order_relaxed)) {
+				counter.fetch_add(1, boost::memory_order_relaxed);
+			}
+		}
+
+		static void profileInBackground(string *result) {
+			*result = runSamplingProfiler(500, 100);
+		}
+
+		static unsigned int countSamples(const string &profile, const string &substring) {
+			vector<string> lines;
+			unsigned int result = 0;
+			split(profile, '\n', lines);
+			foreach (const string &line, lines) {
+				if (line.find(substring) != string::npos) {
+					result += atoi(line.substr(line.rfind(' ') + 1).c_str());
+				}
+			}
+			return result;
+		}
+	};
+
+	DEFINE_TEST_GROUP(SamplingProfilerTest);
+
+	TEST_METHOD(1) {
+		// It samples the trace points of the threads that use CPU.
+		string profile = runSamplingProfiler(300, 200, TRACE_POINT_STACKS);
+		ensure(profile, countSamples(profile, "CPU burner;") > 10);
+		ensure(profile, countSamples(profile, "CPU burner;") ==
+			countSamples(profile, "burnCpu"));
+	}
+
+	TEST_METHOD(2) {
+		// It samples native stacks in the folded format.
+		string profile = runSamplingProfiler(300, 200, NATIVE_STACKS);
+		vector<string> lines;
+		split(profile, '\n', lines);
+		ensure_equals("The output ends with a newline", lines.back(), "");
+		lines.pop_back();
+		foreach (const string &line, lines) {
+			string::size_type pos = line.rfind(' ');
+			ensure(line, pos != string::npos);
+			ensure(line, atoi(line.substr(pos + 1).c_str()) > 0);
+		}
+		ensure(profile, countSamples(profile, "CPU burner;") > 10);
+	}
+
+	TEST_METHOD(3) {
+		// Only one profile can run at a time.
+		string result;
+		oxt::thread other(boost::bind(profileInBackground, &result));
+		usleep(100000);
+		try {
+			runSamplingProfiler(10, 100);
+			fail("RuntimeException expected");
+		} catch (const RuntimeException &) {
+			// Pass.
+		}
+		other.join();
+		ensure(countSamples(result, "CPU burner;") > 0);
+	}
+}
@@ -406,4 +406,62 @@ namespace tut {
 		ensure_equals("It accepted the data (10)",
 			parser.getState(), ScgiRequestParser::READING_HEADER_DATA);
 	}
+	
+	/***** Header storage *****/
+	
+	TEST_METHOD(50) {
+		// Known headers can be looked up by name and by slot, and
+		// unknown headers by name. The last value of a duplicate wins.
+		static const char data[] = "83:REQUEST_METHOD\0GET\0X_FOO\0foo\0"
+			"PASSENGER_APP_ROOT\0/a\0PASSENGER_APP_ROOT\0/b\0X_FOO\0bar\0,";
+		ensure_equals(parser.feed(data, sizeof(data) - 1), sizeof(data) - 1);
+		ensure_equals(parser.getState(), ScgiRequestParser::DONE);
+		ensure_equals(parser.size(), 4u);
+		ensure_equals(parser.getHeader("REQUEST_METHOD"), "GET");
+		ensure_equals(parser.getHeader(ScgiRequestParser::KH_REQUEST_METHOD), "GET");
+		ensure_equals(parser.getHeader(ScgiRequestParser::KH_PASSENGER_APP_ROOT), "/b");
+		ensure_equals(parser.getHeader("X_FOO"), "bar");
+		ensure(parser.hasHeader("X_FOO"));
+		ensure(!parser.hasHeader("X_BAR"));
+		ensure(!parser.hasHeader(ScgiRequestParser::KH_REQUEST_URI));
+		ensure(parser.getHeaderIterator("REQUEST_URI") == parser.end());
+		ensure_equals(parser.getHeaderIterator("REQUEST_METHOD")->second, "GET");
+		ensure_equals(parser.begin()->first, "REQUEST_METHOD");
+	}
+	
+	TEST_METHOD(51) {
+		// lookupKnownHeader() only recognizes exact names.
+		ensure_equals(ScgiRequestParser::lookupKnownHeader("DOCUMENT_ROOT"),
+			(int) ScgiRequestParser::KH_DOCUMENT_ROOT);
+		ensure_equals(ScgiRequestParser::lookupKnownHeader("UNION_STATION_KEY"),
+			(int) ScgiRequestParser::KH_UNION_STATION_KEY);
+		ensure_equals(ScgiRequestParser::lookupKnownHeader("PASSENGER_STICKY_SESSION_COOKIE_NAME"),
+			(int) ScgiRequestParser::KH_PASSENGER_STICKY_SESSION_COOKIE_NAME);
+		ensure_equals(ScgiRequestParser::lookupKnownHeader("DOCUMENT_ROO"),
+			(int) ScgiRequestParser::KH_UNKNOWN);
+		ensure_equals(ScgiRequestParser::lookupKnownHeader("document_root"),
+			(int) ScgiRequestParser::KH_UNKNOWN);
+		ensure_equals(ScgiRequestParser::lookupKnownHeader("X"),
+			(int) ScgiRequestParser::KH_UNKNOWN);
+		ensure_equals(ScgiRequestParser::lookupKnownHeader(""),
+			(int) ScgiRequestParser::KH_UNKNOWN);
+	}
+	
+	TEST_METHOD(52) {
+		// Headers can be modified, after which rebuildData() updates the
+		// header data.
+		static const char data[] = "39:HTTP_CONTENT_TYPE\0text/plain\0X_FOO\0foo\0,";
+		ensure_equals(parser.feed(data, sizeof(data) - 1), sizeof(data) - 1);
+		parser.setHeader("CONTENT_TYPE", parser.getHeader("HTTP_CONTENT_TYPE"));
+		ensure(parser.removeHeader("HTTP_CONTENT_TYPE"));
+		ensure(!parser.removeHeader("HTTP_CONTENT_TYPE"));
+		parser.rebuildData(true);
+		
+		ensure_equals(parser.getHeaderData(),
+			string("X_FOO\0foo\0CONTENT_TYPE\0text/plain\0", 34));
+		ensure_equals(parser.size(), 2u);
+		ensure(!parser.hasHeader("HTTP_CONTENT_TYPE"));
+		ensure_equals(parser.getHeader(ScgiRequestParser::KH_CONTENT_TYPE), "text/plain");
+		ensure_equals(parser.getHeader("X_FOO"), "foo");
+	}
 }
@@ -0,0 +1,149 @@
+#include "TestSupport.h"
+#include "ShmRing.h"
+#include "Utils/IOUtils.h"
+#include "Utils/StrIntUtils.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct ShmRingTest {
+		vector<char> memory;
+		PP_ShmRing *ring;
+
+		ShmRingTest() {
+			memory.resize(pp_shm_ring_size(16));
+			ring = pp_shm_ring_init(&memory[0], 16);
+		}
+
+		size_t write(const StaticString &data, int *wake = NULL) {
+			int dummy;
+			return pp_shm_ring_write(ring, data.data(), data.size(),
+				wake == NULL ? &dummy : wake);
+		}
+
+		string read(size_t size, int *wake = NULL) {
+			int dummy;
+			char buf[64];
+			size_t ret = pp_shm_ring_read(ring, buf, std::min(size, sizeof(buf)),
+				wake == NULL ? &dummy : wake);
+			return string(buf, ret);
+		}
+	};
+
+	DEFINE_TEST_GROUP(ShmRingTest);
+
+	TEST_METHOD(1) {
+		// The capacity must be a power of 2, and attaching checks the header.
+		vector<char> other(pp_shm_ring_size(16));
+		ensure(pp_shm_ring_init(&other[0], 12) == NULL);
+		ensure(pp_shm_ring_attach(&other[0], other.size()) == NULL);
+
+		ensure(ring != NULL);
+		ensure(pp_shm_ring_attach(&memory[0], memory.size()) == ring);
+		ensure("Too small", pp_shm_ring_attach(&memory[0], memory.size() - 1) == NULL);
+	}
+
+	TEST_METHOD(2) {
+		// Data comes out in the order it went in, also around the end
+		// of the data area, and writes are cut off when the ring is full.
+		ensure_equals(write("hello world"), 11u);
+		ensure_equals(read(6), "hello ");
+		ensure_equals(pp_shm_ring_writable(ring), 11u);
+		ensure_equals(write("0123456789abcdef"), 11u);
+		ensure_equals(pp_shm_ring_readable(ring), 16u);
+		ensure_equals(write("x"), 0u);
+		ensure_equals(read(100), "world0123456789a");
+		ensure_equals(read(100), "");
+	}
+
+	TEST_METHOD(3) {
+		// The other side only needs to be woken up when it's waiting.
+		int wake;
+		write("a", &wake);
+		ensure(!wake);
+
+		ensure("Data is available", pp_shm_ring_prepare_wait_readable(ring));
+		read(1);
+		ensure("Ring is empty", !pp_shm_ring_prepare_wait_readable(ring));
+		write("b", &wake);
+		ensure(wake);
+		pp_shm_ring_end_wait_readable(ring);
+		write("c", &wake);
+		ensure(!wake);
+
+		write("0123456789abcd");
+		ensure("Ring is full", !pp_shm_ring_prepare_wait_writable(ring));
+		read(1, &wake);
+		ensure(wake);
+		pp_shm_ring_end_wait_writable(ring);
+	}
+
+	static void waitOnDoorbell(int fd) {
+		char c;
+		ensure_equals(::read(fd, &c, 1), (ssize_t) 1);
+	}
+
+	static void ringDoorbell(int fd) {
+		ensure_equals(::write(fd, "x", 1), (ssize_t) 1);
+	}
+
+	TEST_METHOD(4) {
+		// It transfers data between processes.
+		unsigned int capacity = 4096;
+		size_t size = pp_shm_ring_size(capacity);
+		void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANON, -1, 0);
+		ensure(shared != MAP_FAILED);
+		PP_ShmRing *ring = pp_shm_ring_init(shared, capacity);
+		Pipe consumerDoorbell = createPipe();
+		Pipe producerDoorbell = createPipe();
+
+		string data;
+		for (int i = 0; i < 100000; i++) {
+			data.append(toString(i));
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			size_t written = 0;
+			int wake;
+			while (written < data.size()) {
+				size_t ret = pp_shm_ring_write(ring, data.data() + written,
+					std::min<size_t>(data.size() - written, 1000), &wake);
+				written += ret;
+				if (wake) {
+					ringDoorbell(consumerDoorbell[1]);
+				}
+				if (ret == 0 && !pp_shm_ring_prepare_wait_writable(ring)) {
+					waitOnDoorbell(producerDoorbell[0]);
+					pp_shm_ring_end_wait_writable(ring);
+				}
+			}
+			_exit(0);
+		}
+
+		string received;
+		char buf[1500];
+		int wake;
+		while (received.size() < data.size()) {
+			size_t ret = pp_shm_ring_read(ring, buf, sizeof(buf), &wake);
+			received.append(buf, ret);
+			if (wake) {
+				ringDoorbell(producerDoorbell[1]);
+			}
+			if (ret == 0 && !pp_shm_ring_prepare_wait_readable(ring)) {
+				waitOnDoorbell(consumerDoorbell[0]);
+				pp_shm_ring_end_wait_readable(ring);
+			}
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		munmap(shared, size);
+		ensure("The data arrives intact", received == data);
+	}
+}
@@ -0,0 +1,77 @@
+#include "TestSupport.h"
+#include <agents/HelperAgent/StaticFileCache.h>
+#include <Utils/IOUtils.h>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct StaticFileCacheTest {
+		string dir;
+
+		StaticFileCacheTest() {
+			dir = "tmp.static_file_cache";
+			removeDirTree(dir);
+			makeDirTree(dir);
+		}
+
+		~StaticFileCacheTest() {
+			removeDirTree(dir);
+		}
+	};
+
+	DEFINE_TEST_GROUP(StaticFileCacheTest);
+
+	TEST_METHOD(1) {
+		// It opens regular files and caches their file descriptors.
+		createFile(dir + "/foo.css", "hello");
+		StaticFileCache cache(10);
+		StaticFileCache::EntryPtr entry = cache.lookup(dir + "/foo.css", 0);
+		ensure(entry->exists());
+		ensure_equals(entry->info.st_size, (off_t) 5);
+		ensure(!entry->etag.empty());
+		ensure(!entry->lastModified.empty());
+		ensure_equals(readAll(entry->fd), "hello");
+		ensure("It is cached", cache.lookup(dir + "/foo.css", 10) == entry);
+		ensure_equals(cache.count(), 1u);
+	}
+
+	TEST_METHOD(2) {
+		// Files that don't exist and things that aren't regular files
+		// are cached as nonexistent.
+		StaticFileCache cache(10);
+		StaticFileCache::EntryPtr entry = cache.lookup(dir + "/foo", 0);
+		ensure(!entry->exists());
+		ensure("It is cached", cache.lookup(dir + "/foo", 10) == entry);
+		ensure(!cache.lookup(dir, 0)->exists());
+		ensure_equals(cache.count(), 2u);
+	}
+
+	TEST_METHOD(3) {
+		// Entries are opened again after the TTL.
+		StaticFileCache cache(10, 100);
+		ensure(!cache.lookup(dir + "/foo", 0)->exists());
+		createFile(dir + "/foo", "hello");
+		ensure(!cache.lookup(dir + "/foo", 99)->exists());
+		ensure(cache.lookup(dir + "/foo", 100)->exists());
+	}
+
+	TEST_METHOD(4) {
+		// The least recently used entries are evicted.
+		StaticFileCache cache(2);
+		StaticFileCache::EntryPtr a = cache.lookup(dir + "/a", 0);
+		cache.lookup(dir + "/b", 0);
+		cache.lookup(dir + "/a", 0);
+		cache.lookup(dir + "/c", 0);
+		ensure_equals(cache.count(), 2u);
+		ensure(cache.lookup(dir + "/a", 0) == a);
+	}
+
+	TEST_METHOD(5) {
+		// getContentType() looks at the extension.
+		ensure_equals(StaticFileCache::getContentType("/a/b.CSS"), "text/css");
+		ensure_equals(StaticFileCache::getContentType("/a/index.html"), "text/html; charset=utf-8");
+		ensure_equals(StaticFileCache::getContentType("/a.js/b"), "application/octet-stream");
+		ensure_equals(StaticFileCache::getContentType("/a/b."), "application/octet-stream");
+	}
+}
@@ -0,0 +1,133 @@
+/*
+ * Compares StaticString::Hash with the times-33 hash that it replaced, on
+ * the kinds of keys that are looked up on the request path: CGI header
+ * names, application roots and options cache keys.
+ *
+ *   rake benchmark:static_string_hash
+ */
+#include <sys/time.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <StaticString.h>
+#include <Utils/HashMap.h>
+
+using namespace std;
+using namespace Passenger;
+
+
+/** The hash that StaticString::Hash used before. */
+struct Times33Hash {
+	size_t operator()(const StaticString &str) const {
+		const char *data = str.data();
+		const char *end  = str.data() + str.size();
+		size_t result    = 0;
+
+		#if defined(__i386__) || defined(__x86_64__)
+			const char *last_long = str.data() +
+				str.size() / sizeof(unsigned long) *
+				sizeof(unsigned long);
+			while (data < last_long) {
+				result = result * 33 + *((unsigned long *) data);
+				data += sizeof(unsigned long);
+			}
+		#endif
+
+		while (data < end) {
+			result = result * 33 + *data;
+			data++;
+		}
+		return result;
+	}
+};
+
+static const unsigned int ITERATIONS = 2000;
+
+static unsigned long long
+getUsec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+template<typename HashFunction>
+static void
+benchmark(const char *name, const vector<string> &keys) {
+	HashFunction hash;
+	HashMap<StaticString, unsigned int, HashFunction> map;
+	size_t result = 0;
+	unsigned long long start;
+	unsigned int found = 0;
+
+	for (unsigned int i = 0; i < keys.size(); i++) {
+		map[keys[i]] = i;
+	}
+
+	start = getUsec();
+	for (unsigned int i = 0; i < ITERATIONS; i++) {
+		for (unsigned int j = 0; j < keys.size(); j++) {
+			result += hash(keys[j]);
+		}
+	}
+	double hashTime = (getUsec() - start) * 1000.0 / ITERATIONS / keys.size();
+
+	start = getUsec();
+	for (unsigned int i = 0; i < ITERATIONS; i++) {
+		for (unsigned int j = 0; j < keys.size(); j++) {
+			found += map.find(keys[j]) != map.end();
+		}
+	}
+	double lookupTime = (getUsec() - start) * 1000.0 / ITERATIONS / keys.size();
+
+	printf("  %-9s: %6.2f ns/hash, %6.2f ns/lookup (checksum %u)\n",
+		name, hashTime, lookupTime, (unsigned int) (result + found));
+}
+
+static void
+benchmarkKeys(const char *description, const vector<string> &keys) {
+	printf("%s (%u keys):\n", description, (unsigned int) keys.size());
+	benchmark<Times33Hash>("times 33", keys);
+	benchmark<StaticString::Hash>("current", keys);
+}
+
+int
+main() {
+	const char *headerNames[] = {
+		"HTTP_HOST", "HTTP_USER_AGENT", "HTTP_ACCEPT", "HTTP_ACCEPT_LANGUAGE",
+		"HTTP_ACCEPT_ENCODING", "HTTP_COOKIE", "HTTP_CONNECTION", "HTTP_REFERER",
+		"HTTP_CACHE_CONTROL", "HTTP_X_FORWARDED_FOR", "HTTP_X_REQUESTED_WITH",
+		"REQUEST_METHOD", "REQUEST_URI", "QUERY_STRING", "SCRIPT_NAME",
+		"SERVER_NAME", "SERVER_PORT", "SERVER_PROTOCOL", "REMOTE_ADDR",
+		"REMOTE_PORT", "CONTENT_TYPE", "CONTENT_LENGTH", "DOCUMENT_ROOT",
+		"PASSENGER_APP_ROOT", "PASSENGER_APP_TYPE", "PASSENGER_ENV",
+		"PASSENGER_SPAWN_METHOD", "PASSENGER_USER", "PASSENGER_GROUP",
+		"PASSENGER_MIN_INSTANCES", "PASSENGER_FRIENDLY_ERROR_PAGES",
+		"PASSENGER_CONNECT_PASSWORD", "UNION_STATION_SUPPORT", "HTTPS"
+	};
+	vector<string> keys;
+
+	for (unsigned int i = 0; i < sizeof(headerNames) / sizeof(const char *); i++) {
+		keys.push_back(headerNames[i]);
+	}
+	benchmarkKeys("Header names", keys);
+
+	keys.clear();
+	for (unsigned int i = 0; i < 100; i++) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/var/www/customer%u/current/public", i);
+		keys.push_back(buf);
+	}
+	benchmarkKeys("Application roots", keys);
+
+	keys.clear();
+	for (unsigned int i = 0; i < 100; i++) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "/var/www/customer%u/current\1rack\1production"
+			"\1smart\1nobody\1nogroup\1%u\1false\1true\1http://localhost/%u",
+			i, i % 4, i);
+		keys.push_back(buf);
+	}
+	benchmarkKeys("Options cache keys", keys);
+	return 0;
+}
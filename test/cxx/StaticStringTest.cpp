@@ -1,5 +1,6 @@
 #include "TestSupport.h"
 #include "StaticString.h"
+#include <set>
 
 using namespace Passenger;
 using namespace std;
@@ -217,4 +218,72 @@ namespace tut {
 			StaticString("hello world").substr(6, 10),
 			"world");
 	}
+	
+	static unsigned int countBits(size_t value) {
+		unsigned int result = 0;
+		while (value != 0) {
+			result += value & 1;
+			value >>= 1;
+		}
+		return result;
+	}
+	
+	TEST_METHOD(7) {
+		// Hash: equal strings have equal hashes, regardless of where
+		// they're stored, and all bytes of every key size contribute.
+		StaticString::Hash hash;
+		string buf = "xHTTP_ACCEPT_ENCODING";
+		ensure_equals(hash(StaticString(buf.data() + 1, buf.size() - 1)),
+			hash("HTTP_ACCEPT_ENCODING"));
+		
+		for (unsigned int len = 1; len <= 40; len++) {
+			string key(len, 'a');
+			size_t original = hash(key);
+			for (unsigned int i = 0; i < len; i++) {
+				key[i] = 'b';
+				ensure("Byte " + toString(i) + " of a key of size " +
+					toString(len) + " is hashed", hash(key) != original);
+				key[i] = 'a';
+			}
+			ensure("Keys that only differ in size have different hashes",
+				hash(StaticString(key.data(), len - 1)) != original);
+		}
+	}
+	
+	TEST_METHOD(8) {
+		// Hash: realistic keys don't collide, are spread evenly over the
+		// buckets of a hash table, and flipping a bit changes about half
+		// of the hash's bits.
+		StaticString::Hash hash;
+		vector<string> keys;
+		const char *prefixes[] = { "HTTP_X_CUSTOM_HEADER_", "/var/www/app", "PASSENGER_", "h" };
+		for (unsigned int i = 0; i < sizeof(prefixes) / sizeof(const char *); i++) {
+			for (unsigned int j = 0; j < 1000; j++) {
+				keys.push_back(prefixes[i] + toString(j));
+			}
+		}
+		
+		set<size_t> hashes, buckets;
+		unsigned long long flippedBits = 0, flips = 0;
+		vector<string>::iterator it;
+		for (it = keys.begin(); it != keys.end(); it++) {
+			string &key = *it;
+			size_t value = hash(key);
+			hashes.insert(value);
+			buckets.insert(value % 4096);
+			for (unsigned int i = 0; i < key.size() * 8; i++) {
+				key[i / 8] ^= 1 << (i % 8);
+				flippedBits += countBits(value ^ hash(key));
+				flips++;
+				key[i / 8] ^= 1 << (i % 8);
+			}
+		}
+		ensure_equals("No collisions", hashes.size(), keys.size());
+		// 4000 random values occupy about 2536 of 4096 buckets.
+		ensure("Buckets are used evenly (" + toString(buckets.size()) + ")",
+			buckets.size() > 2400);
+		double averageFlipped = (double) flippedBits / flips / (sizeof(size_t) * 8);
+		ensure("Avalanche (" + toString(averageFlipped) + ")",
+			averageFlipped > 0.45 && averageFlipped < 0.55);
+	}
 }
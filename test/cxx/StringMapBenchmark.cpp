@@ -0,0 +1,84 @@
+/*
+ * Compares FlatStringMap with StringMap on short keys (header names) and
+ * long keys (filter sources, application roots).
+ *
+ *   rake benchmark:string_map
+ */
+#include <sys/time.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <Utils/StringMap.h>
+#include <Utils/FlatStringMap.h>
+
+using namespace std;
+using namespace Passenger;
+
+
+static const unsigned int ITERATIONS = 200;
+
+static unsigned long long
+getUsec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+template<typename Map>
+static void
+benchmark(const char *name, const vector<string> &keys, const vector<string> &missingKeys) {
+	unsigned long long insertTime = 0, hitTime = 0, missTime = 0, start;
+	unsigned int found = 0;
+
+	for (unsigned int i = 0; i < ITERATIONS; i++) {
+		Map map;
+
+		start = getUsec();
+		for (unsigned int j = 0; j < keys.size(); j++) {
+			map.set(keys[j], j);
+		}
+		insertTime += getUsec() - start;
+
+		start = getUsec();
+		for (unsigned int j = 0; j < keys.size(); j++) {
+			found += map.has(keys[j]);
+		}
+		hitTime += getUsec() - start;
+
+		start = getUsec();
+		for (unsigned int j = 0; j < missingKeys.size(); j++) {
+			found += map.has(missingKeys[j]);
+		}
+		missTime += getUsec() - start;
+	}
+
+	double operations = (double) ITERATIONS * keys.size() / 1000;
+	printf("  %-13s: insert %6.1f ns, hit %6.1f ns, miss %6.1f ns (found %u)\n",
+		name, insertTime / operations, hitTime / operations,
+		missTime / operations, found / ITERATIONS);
+}
+
+static void
+benchmarkKeys(const char *description, const string &prefix, unsigned int count) {
+	vector<string> keys, missingKeys;
+	for (unsigned int i = 0; i < count; i++) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%u", i);
+		keys.push_back(prefix + buf);
+		missingKeys.push_back(prefix + "missing" + buf);
+	}
+
+	printf("%s (%u keys):\n", description, count);
+	benchmark< StringMap<int> >("StringMap", keys, missingKeys);
+	benchmark< FlatStringMap<int> >("FlatStringMap", keys, missingKeys);
+}
+
+int
+main() {
+	benchmarkKeys("Short keys", "HTTP_X_", 50);
+	benchmarkKeys("Short keys", "HTTP_X_", 5000);
+	benchmarkKeys("Long keys", "/var/www/customer/current/public/", 50);
+	benchmarkKeys("Long keys", "status_code == 200 and uri =~ /^\\/customer/ and ", 5000);
+	return 0;
+}
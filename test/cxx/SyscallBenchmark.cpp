@@ -0,0 +1,91 @@
+/*
+ * Measures the overhead of the oxt::syscalls wrappers over raw system calls,
+ * with system call interruption enabled and disabled. Each iteration reads
+ * from an empty non-blocking pipe, which is about the cheapest system call
+ * that the event loops make.
+ *
+ *   rake benchmark:syscalls ARGS="1000000"
+ *
+ * The optional argument is the number of iterations. Default: 1000000.
+ */
+#include <oxt/initialize.hpp>
+#include <oxt/thread.hpp>
+#include <oxt/system_calls.hpp>
+#include <boost/bind.hpp>
+
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace oxt;
+
+
+static unsigned int iterations = 1000000;
+static int fds[2];
+
+
+static unsigned long long
+getUsec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+report(const char *name, unsigned long long start) {
+	unsigned long long time = getUsec() - start;
+	printf("  %-36s: %6.1f ns/call\n", name,
+		time * 1000.0 / iterations);
+}
+
+static void
+benchmarkRaw() {
+	char buf[1];
+	unsigned long long start = getUsec();
+	for (unsigned int i = 0; i < iterations; i++) {
+		::read(fds[0], buf, sizeof(buf));
+	}
+	report("raw read()", start);
+}
+
+static void
+benchmarkWrapper(const char *name) {
+	char buf[1];
+	unsigned long long start = getUsec();
+	for (unsigned int i = 0; i < iterations; i++) {
+		syscalls::read(fds[0], buf, sizeof(buf));
+	}
+	report(name, start);
+}
+
+static void
+runThread() {
+	benchmarkRaw();
+	benchmarkWrapper("syscalls::read(), interruptable");
+	{
+		boost::this_thread::disable_syscall_interruption dsi;
+		benchmarkWrapper("syscalls::read(), not interruptable");
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+	}
+	oxt::initialize();
+	setup_syscall_interruption_support();
+
+	if (pipe(fds) == -1) {
+		perror("pipe()");
+		return 1;
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	printf("%u iterations in an oxt::thread:\n", iterations);
+	oxt::thread thr(runThread, "Benchmark");
+	thr.join();
+	return 0;
+}
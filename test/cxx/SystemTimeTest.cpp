@@ -34,4 +34,16 @@ namespace tut {
 		time_t now = SystemTime::get();
 		ensure(now >= begin && now <= begin + 2);
 	}
+
+	TEST_METHOD(3) {
+		// getCoarseUsec() is close to getUsec() and can be forced.
+		unsigned long long coarse = SystemTime::getCoarseUsec();
+		unsigned long long real = SystemTime::getUsec();
+		ensure(coarse <= real + 1000000 && real <= coarse + 1000000);
+		
+		SystemTime::forceUsec(1);
+		ensure_equals(SystemTime::getCoarseUsec(), 1ull);
+		SystemTime::releaseUsec();
+		ensure(SystemTime::getCoarseUsec() >= coarse);
+	}
 }
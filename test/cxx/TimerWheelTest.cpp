@@ -0,0 +1,113 @@
+#include "TestSupport.h"
+#include <Utils/TimerWheel.h>
+#include <vector>
+
+using namespace Passenger;
+using namespace std;
+
+namespace tut {
+	struct TimerWheelTest {
+		TimerWheel wheel;
+		TimerWheel::Entry entries[3];
+		vector<int> expired;
+
+		TimerWheelTest()
+			: wheel(10, 8)
+		{
+			for (int i = 0; i < 3; i++) {
+				entries[i].userData = (void *) (long) i;
+			}
+		}
+
+		struct Collector {
+			TimerWheelTest *test;
+
+			Collector(TimerWheelTest *t)
+				: test(t)
+				{ }
+
+			void operator()(TimerWheel::Entry *entry) const {
+				test->expired.push_back((int) (long) entry->userData);
+			}
+		};
+
+		unsigned int expire(unsigned long long now) {
+			return wheel.expire(now, Collector(this));
+		}
+	};
+
+	DEFINE_TEST_GROUP(TimerWheelTest);
+
+	TEST_METHOD(1) {
+		// Entries expire once their timeout has passed, never earlier,
+		// and at most one resolution interval later.
+		wheel.schedule(&entries[0], 1000, 25);
+		wheel.schedule(&entries[1], 1000, 40);
+		ensure_equals(wheel.size(), 2u);
+
+		ensure_equals(expire(1020), 0u);
+		ensure_equals(expire(1024), 0u);
+		ensure_equals(expire(1030), 1u);
+		ensure_equals(expired.size(), 1u);
+		ensure_equals(expired[0], 0);
+		ensure(!entries[0].scheduled());
+
+		ensure_equals(expire(1039), 0u);
+		ensure_equals(expire(1040), 1u);
+		ensure_equals(expired[1], 1);
+		ensure(wheel.empty());
+	}
+
+	TEST_METHOD(2) {
+		// Cancelled entries don't expire.
+		wheel.schedule(&entries[0], 1000, 20);
+		wheel.schedule(&entries[1], 1000, 20);
+		entries[0].cancel();
+		ensure_equals(wheel.size(), 1u);
+		ensure_equals(expire(1100), 1u);
+		ensure_equals(expired.size(), 1u);
+		ensure_equals(expired[0], 1);
+	}
+
+	TEST_METHOD(3) {
+		// Timeouts longer than one wheel rotation survive the rotations
+		// that come before their expiry.
+		wheel.schedule(&entries[0], 1000, 200);
+		for (unsigned long long now = 1010; now < 1200; now += 10) {
+			ensure_equals(expire(now), 0u);
+		}
+		ensure_equals(expire(1200), 1u);
+	}
+
+	TEST_METHOD(4) {
+		// Rescheduling an entry replaces its previous timeout.
+		wheel.schedule(&entries[0], 1000, 20);
+		wheel.schedule(&entries[0], 1000, 50);
+		ensure_equals(wheel.size(), 1u);
+		ensure_equals(expire(1040), 0u);
+		ensure_equals(expire(1050), 1u);
+	}
+
+	TEST_METHOD(5) {
+		// If the clock jumps ahead by more than a rotation then everything
+		// that is due expires at once.
+		wheel.schedule(&entries[0], 1000, 10);
+		wheel.schedule(&entries[1], 1000, 70);
+		wheel.schedule(&entries[2], 1000, 5000);
+		ensure_equals(expire(2000), 2u);
+		ensure_equals(wheel.size(), 1u);
+		ensure(entries[2].scheduled());
+	}
+
+	TEST_METHOD(6) {
+		// Destroying the wheel unschedules its entries.
+		TimerWheel::Entry entry;
+		{
+			TimerWheel otherWheel;
+			otherWheel.schedule(&entry, 0, 1000);
+			ensure(entry.scheduled());
+		}
+		ensure(!entry.scheduled());
+		entry.cancel();
+	}
+}
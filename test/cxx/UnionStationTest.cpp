@@ -27,6 +27,7 @@ namespace tut {
 		string socketFilename;
 		string socketAddress;
 		string dumpFile;
+		VariantMap serverOptions;
 		AccountsDatabasePtr accountsDatabase;
 		ev::dynamic_loop eventLoop;
 		FileDescriptor serverFd;
@@ -39,6 +40,7 @@ namespace tut {
 			socketFilename = generation->getPath() + "/logging.socket";
 			socketAddress = "unix:" + socketFilename;
 			dumpFile = generation->getPath() + "/log.txt";
+			serverOptions.set("analytics_dump_file", dumpFile);
 			accountsDatabase = ptr(new AccountsDatabase());
 			accountsDatabase->add("test", "1234", false);
 			setLogLevel(-1);
@@ -61,11 +63,9 @@ namespace tut {
 		}
 		
 		void startLoggingServer(const boost::function<void ()> &initFunc = boost::function<void ()>()) {
-			VariantMap options;
-			options.set("analytics_dump_file", dumpFile);
 			serverFd = createUnixServer(socketFilename.c_str());
 			server = ptr(new LoggingServer(eventLoop,
-				serverFd, accountsDatabase, options));
+				serverFd, accountsDatabase, serverOptions));
 			if (initFunc) {
 				initFunc();
 			}
@@ -117,6 +117,12 @@ namespace tut {
 		string readDumpFile() {
 			return readAll(dumpFile);
 		}
+
+		void listenForDatagrams(const string &filename) {
+			FileDescriptor fd(createUnixDatagramServer(filename));
+			setNonBlocking(fd);
+			server->listenForDatagrams(fd);
+		}
 	};
 	
 	DEFINE_TEST_GROUP(UnionStationTest);
@@ -271,11 +277,9 @@ namespace tut {
 	}
 	
 	TEST_METHOD(12) {
-		// If the logging server crashed and was restarted then
-		// newTransaction() and continueTransaction() print a warning and return
-		// a null log object. One of the next newTransaction()/continueTransaction()
-		// calls will reestablish the connection when the connection timeout
-		// has passed.
+		// If the logging server crashed and was restarted then the pooled
+		// connections are noticed to be dead, and newTransaction() and
+		// continueTransaction() reestablish the connection right away.
 		SystemTime::forceAll(TODAY);
 		LoggerPtr log, log2;
 		
@@ -286,15 +290,11 @@ namespace tut {
 		startLoggingServer();
 
 		log = factory->newTransaction("foobar");
-		ensure("(1)", log->isNull());
-		log2 = factory2->continueTransaction("some-id", "foobar");
-		ensure("(2)", log2->isNull());
-		
-		SystemTime::forceAll(TODAY + 60000000);
-		log = factory->newTransaction("foobar");
-		ensure("(3)", !log->isNull());
+		ensure("(1)", !log->isNull());
 		log2 = factory2->continueTransaction(log->getTxnId(), "foobar");
-		ensure("(4)", !log2->isNull());
+		ensure("(2)", !log2->isNull());
+		ensure("(3)", factory->inspectConnectionPool().find("1 unusable ones closed")
+			!= string::npos);
 		log2->message("hello");
 		log2->flushToDiskAfterClose(true);
 		log.reset();
@@ -741,5 +741,302 @@ namespace tut {
 		ensure("(2)", data.find("transaction 2\n") == string::npos);
 	}
 	
+	TEST_METHOD(31) {
+		// ScopeLog can log a scope that has already ended, with the given timestamps.
+		SystemTime::forceAll(TODAY);
+		
+		LoggerPtr log = factory->newTransaction("foobar");
+		ScopeLog::logBeginAt(log, "request processing", YESTERDAY);
+		ScopeLog::logEndAt(log, "request processing", TODAY, false);
+		log->flushToDiskAfterClose(true);
+		log.reset();
+		
+		string data = readDumpFile();
+		ensure("(1)", data.find("BEGIN: request processing (" +
+			timestampString(YESTERDAY) + ",0,0) \n") != string::npos);
+		ensure("(2)", data.find("FAIL: request processing (" +
+			timestampString(TODAY) + ",0,0)\n") != string::npos);
+	}
+	
+	TEST_METHOD(32) {
+		// Buffered messages are sent in batches, in order, even if
+		// the buffer fills up multiple times.
+		factory->setBufferMessages(true);
+		LoggerPtr log = factory->newTransaction("foobar");
+		string padding(100, 'x');
+		for (int i = 0; i < 500; i++) {
+			log->message("message " + toString(i) + " " + padding);
+		}
+		log->flushToDiskAfterClose(true);
+		log.reset();
+
+		string data = readDumpFile();
+		string::size_type pos = 0;
+		for (int i = 0; i < 500; i++) {
+			pos = data.find("message " + toString(i) + " " + padding + "\n", pos);
+			ensure("Message " + toString(i) + " is logged in order", pos != string::npos);
+		}
+	}
+	
+	TEST_METHOD(33) {
+		// Connections are reused, preferably by the thread that used them last.
+		factory->newTransaction("foobar").reset();
+		factory->newTransaction("foobar").reset();
+		ensure_equals(factory->inspectConnectionPool(),
+			"1/10 idle, 1 created, 1 reused (1 by the same thread), 0 unusable ones closed");
+
+		factory->setConnectionPoolMaxSize(0);
+		factory->newTransaction("foobar").reset();
+		ensure_equals(factory->inspectConnectionPool(),
+			"0/0 idle, 2 created, 1 reused (1 by the same thread), 0 unusable ones closed");
+	}
+	
+	TEST_METHOD(34) {
+		// A LoggingServer on another event loop shares the transactions of
+		// the LoggingServer that it was created from.
+		string socketFilename2 = generation->getPath() + "/logging2.socket";
+		string socketAddress2 = "unix:" + socketFilename2;
+		ev::dynamic_loop eventLoop2;
+		FileDescriptor serverFd2(createUnixServer(socketFilename2.c_str()));
+		LoggingServerPtr server2 = ptr(new LoggingServer(eventLoop2,
+			serverFd2, accountsDatabase, *server));
+		boost::shared_ptr<oxt::thread> serverThread2 = ptr(new oxt::thread(
+			boost::bind(&ev::dynamic_loop::loop, &eventLoop2, 0)
+		));
+		LoggerFactoryPtr factory5 = ptr(new LoggerFactory(socketAddress2,
+			"test", "1234", "localhost"));
+		
+		LoggerPtr log = factory->newTransaction("foobar");
+		log->message("message 1");
+		log->flushToDiskAfterClose(true);
+		
+		LoggerPtr log2 = factory5->continueTransaction(log->getTxnId(),
+			log->getGroupName(), log->getCategory());
+		log2->message("message 2");
+		log2->flushToDiskAfterClose(true);
+		
+		log.reset();
+		log2.reset();
+		
+		MessageClient client;
+		client.connect(socketAddress2, "test", "1234");
+		client.write("exit", "immediately", NULL);
+		serverThread2->join();
+		server2.reset();
+		unlink(socketFilename2.c_str());
+		
+		string data = readDumpFile();
+		ensure("(1)", data.find("message 1\n") != string::npos);
+		ensure("(2)", data.find("message 2\n") != string::npos);
+		ensure("(3)", data.find("message 1\n") < data.find("message 2\n"));
+	}
+	
+	TEST_METHOD(35) {
+		// Loggers send log entries in the binary format, which the
+		// logging server stores with the same timestamps as text entries.
+		factory->setBufferMessages(true);
+		SystemTime::forceAll(YESTERDAY);
+		LoggerPtr log = factory->newTransaction("foobar");
+		log->message("message 1");
+		SystemTime::forceAll(TODAY);
+		log->message("message 2");
+		SystemTime::forceAll(YESTERDAY);
+		log->message("message 3");
+		log->flushToDiskAfterClose(true);
+		string txnId = log->getTxnId();
+		log.reset();
+		
+		string data = readDumpFile();
+		ensure("(1)", data.find(txnId + " " + timestampString(YESTERDAY) + " 1 message 1\n") != string::npos);
+		ensure("(2)", data.find(txnId + " " + timestampString(TODAY) + " 2 message 2\n") != string::npos);
+		ensure("(3)", data.find(txnId + " " + timestampString(YESTERDAY) + " 3 message 3\n") != string::npos);
+	}
+	
+	TEST_METHOD(36) {
+		// The logging server rejects malformed log batches.
+		MessageClient client = createConnection();
+		vector<string> args;
+		
+		SystemTime::forceAll(TODAY);
+		client.write("openTransaction",
+			TODAY_TXN_ID, "foobar", "", "requests", TODAY_TIMESTAMP_STR,
+			"-", "true", "true", NULL);
+		client.read(args);
+		
+		LogBatchWriter batch;
+		batch.append(TODAY_TXN_ID, TODAY, "hello world");
+		string data = batch.getData();
+		data.resize(data.size() - 3);
+		client.write("logBatch", NULL);
+		client.writeScalar(data);
+		ensure(client.read(args));
+		ensure_equals(args.size(), 2u);
+		ensure_equals(args[0], "error");
+		ensure_equals(args[1], "Log batch is malformed");
+	}
+	
+	TEST_METHOD(37) {
+		// Lightweight scope logs have the same format as normal ones.
+		factory->setLightweightScopeLogs(true);
+		LoggerPtr log = factory->newTransaction("foobar");
+		SystemTime::forceAll(YESTERDAY);
+		{
+			ScopeLog scope(log, "lightweight scope");
+			SystemTime::forceAll(TODAY);
+			scope.success();
+		}
+		{
+			ScopeLog scope(log, "failed scope");
+		}
+		log->flushToDiskAfterClose(true);
+		log.reset();
+
+		string data = readDumpFile();
+		ensure("(1)", data.find("BEGIN: lightweight scope (" + timestampString(YESTERDAY) + ",") != string::npos);
+		ensure("(2)", data.find("END: lightweight scope (" + timestampString(TODAY) + ",") != string::npos);
+		ensure("(3)", data.find("BEGIN: failed scope (" + timestampString(TODAY) + ",") != string::npos);
+		ensure("(4)", data.find("FAIL: failed scope (" + timestampString(TODAY) + ",") != string::npos);
+	}
+	
+	TEST_METHOD(38) {
+		// A client that exceeds its memory limit gets its oldest
+		// transactions evicted, which are then logged as discarded.
+		stopLoggingServer();
+		serverOptions.set("analytics_client_memory_limit", "16384");
+		startLoggingServer();
+		MessageClient client = createConnection();
+		vector<string> args;
+		
+		SystemTime::forceAll(TODAY);
+		client.write("openTransaction",
+			TODAY_TXN_ID, "foobar", "", "requests", TODAY_TIMESTAMP_STR,
+			"-", "true", "true", NULL);
+		client.read(args);
+		client.write("log", TODAY_TXN_ID, TODAY_TIMESTAMP_STR, NULL);
+		client.writeScalar(string(32 * 1024, 'x'));
+		client.write("log", TODAY_TXN_ID, TODAY_TIMESTAMP_STR, NULL);
+		client.writeScalar("after eviction");
+		client.write("closeTransaction", TODAY_TXN_ID, TODAY_TIMESTAMP_STR,
+			"true", NULL);
+		ensure(client.read(args));
+		ensure_equals(args[0], "ok");
+		
+		client.write("info", NULL);
+		ensure(client.read(args));
+		ensure(args[1].find("Evicted: 1 transactions") != string::npos);
+		client.write("flush", NULL);
+		client.read(args);
+		
+		string data = readDumpFile();
+		ensure("(1)", data.find(TODAY_TXN_ID " " TODAY_TIMESTAMP_STR " 2 DISCARDED: memory\n")
+			!= string::npos);
+		ensure("(2)", data.find("xxxx") == string::npos);
+		ensure("(3)", data.find("after eviction") == string::npos);
+	}
+	
 	/************************************/
+	
+	TEST_METHOD(39) {
+		// Transactions can be sent as datagrams, which carry the password.
+		string datagramFilename = generation->getPath() + "/logging_datagrams";
+		stopLoggingServer();
+		startLoggingServer(boost::bind(&UnionStationTest::listenForDatagrams,
+			this, datagramFilename));
+		LoggerFactoryPtr badFactory = boost::make_shared<LoggerFactory>(
+			socketAddress, "test", "wrong", "localhost");
+		badFactory->setDatagramAddress("unix:" + datagramFilename);
+		factory->setDatagramAddress("unix:" + datagramFilename);
+		
+		SystemTime::forceAll(YESTERDAY);
+		LoggerPtr log = badFactory->newTransaction("foobar");
+		log->message("from an impostor");
+		log.reset();
+		log = factory->newTransaction("foobar");
+		ensure(!log->isNull());
+		log->message("hello");
+		SystemTime::forceAll(TODAY);
+		log->message("world");
+		string txnId = log->getTxnId();
+		log.reset();
+		
+		MessageClient client = createConnection();
+		vector<string> args;
+		string data;
+		EVENTUALLY(5,
+			client.write("flush", NULL);
+			client.read(args);
+			data = readDumpFile();
+			result = data.find(" DETACH\n") != string::npos;
+		);
+		ensure("(1)", data.find(txnId + " " + timestampString(YESTERDAY) + " 0 ATTACH\n") != string::npos);
+		ensure("(2)", data.find(txnId + " " + timestampString(YESTERDAY) + " 1 hello\n") != string::npos);
+		ensure("(3)", data.find(txnId + " " + timestampString(TODAY) + " 2 world\n") != string::npos);
+		ensure("(4)", data.find(txnId + " " + timestampString(TODAY) + " 3 DETACH\n") != string::npos);
+		ensure("(5)", data.find("impostor") == string::npos);
+	}
+	
+	TEST_METHOD(40) {
+		// Request transactions are added to the request store, if enabled.
+		string storeDir = generation->getPath() + "/store";
+		stopLoggingServer();
+		serverOptions.set("analytics_store_dir", storeDir);
+		startLoggingServer();
+		
+		LoggerPtr log = factory->newTransaction("foobar");
+		log->message("URI: /checkout");
+		log->message("Controller action: OrdersController#create");
+		log->message("Status: 503 Service Unavailable");
+		log.reset();
+		log = factory->newTransaction("foobar", "processes");
+		log->message("URI: /not-a-request");
+		log.reset();
+		
+		RequestStore::Query query;
+		query.filter = "status_code == 503";
+		string output;
+		EVENTUALLY(5,
+			output = server->getRequestStore()->query(query);
+			result = !startsWith(output, "total\tcount=0\t");
+		);
+		ensure(output, startsWith(output, "total\tcount=1\terrors=1\t"));
+		ensure(output, output.find("\t503\tfoobar\tOrdersController#create\t/checkout\n")
+			!= string::npos);
+		ensure(output, output.find("/not-a-request") == string::npos);
+	}
+	
+	TEST_METHOD(41) {
+		// Datagram transactions that don't pass their filters aren't sent at all.
+		string datagramFilename = generation->getPath() + "/logging_datagrams";
+		stopLoggingServer();
+		startLoggingServer(boost::bind(&UnionStationTest::listenForDatagrams,
+			this, datagramFilename));
+		factory->setDatagramAddress("unix:" + datagramFilename);
+		
+		LoggerPtr log = factory->newTransaction("foobar", "requests", "-",
+			"uri == \"/foo\""
+			"\1"
+			"status_code == 500");
+		log->message("URI: /foo");
+		log->message("Status: 200 OK");
+		log->message("transaction 1");
+		log.reset();
+		log = factory->newTransaction("foobar", "requests", "-",
+			"uri == \"/foo\"");
+		log->message("URI: /foo");
+		log->message("transaction 2");
+		log.reset();
+		ensure(factory->inspectConnectionPool(),
+			containsSubstring(factory->inspectConnectionPool(), "1 sent, 0 dropped, 1 filtered"));
+		
+		MessageClient client = createConnection();
+		vector<string> args;
+		string data;
+		EVENTUALLY(5,
+			client.write("flush", NULL);
+			client.read(args);
+			data = readDumpFile();
+			result = data.find("transaction 2\n") != string::npos;
+		);
+		ensure(data.find("transaction 1") == string::npos);
+	}
 }
@@ -131,6 +131,29 @@ namespace tut {
 		ensure_equals(output[2], ":");
 		ensure_equals(output[3], "def");
 	}
+
+	TEST_METHOD(8) {
+		// splitLines() excludes the newlines and doesn't
+		// produce an empty line for a trailing newline.
+		vector<StaticString> lines;
+		splitLines("", lines);
+		ensure_equals(lines.size(), 0u);
+
+		splitLines("\n", lines);
+		ensure_equals(lines.size(), 1u);
+		ensure_equals(lines[0], "");
+
+		splitLines("hello\n\nworld\n", lines);
+		ensure_equals(lines.size(), 3u);
+		ensure_equals(lines[0], "hello");
+		ensure_equals(lines[1], "");
+		ensure_equals(lines[2], "world");
+
+		splitLines("hello\nworld", lines);
+		ensure_equals(lines.size(), 2u);
+		ensure_equals(lines[0], "hello");
+		ensure_equals(lines[1], "world");
+	}
 	
 	
 	/***** Test getSystemTempDir() *****/
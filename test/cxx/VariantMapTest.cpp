@@ -1,5 +1,6 @@
 #include "TestSupport.h"
 #include "Utils/VariantMap.h"
+#include "Utils/IOUtils.h"
 
 using namespace Passenger;
 
@@ -188,4 +189,60 @@ namespace tut {
 		ensure(!map.has("foo"));
 		ensure_equals(map.size(), 1u);
 	}
+
+	TEST_METHOD(8) {
+		// serialize() and unserialize() round-trip arbitrary keys and values.
+		map.set("b", string("x\0y", 3));
+		map.set("", "empty key");
+		map.setInt("a", 1234);
+		VariantMap map2;
+		map2.set("c", "kept");
+		map2.set("a", "overwritten");
+		map2.unserialize(map.serialize());
+		ensure_equals(map2.size(), 4u);
+		ensure_equals(map2.get("b"), string("x\0y", 3));
+		ensure_equals(map2.get(""), "empty key");
+		ensure_equals(map2.getInt("a"), 1234);
+		ensure_equals(map2.get("c"), "kept");
+	}
+
+	TEST_METHOD(9) {
+		// unserialize() rejects truncated data and unsorted keys.
+		map.set("a", "1");
+		map.set("b", "2");
+		string data = map.serialize();
+		VariantMap map2;
+		try {
+			map2.unserialize(StaticString(data.data(), data.size() - 1));
+			fail("ArgumentException expected");
+		} catch (const ArgumentException &) {
+			// Pass.
+		}
+
+		// Swap the keys of the two entries.
+		string::size_type pos = data.find("a");
+		data[pos] = 'b';
+		data[data.find("b", pos + 1)] = 'a';
+		try {
+			map2.unserialize(data);
+			fail("ArgumentException expected");
+		} catch (const ArgumentException &) {
+			// Pass.
+		}
+	}
+
+	TEST_METHOD(10) {
+		// readFrom(fd) accepts both writeToFd() and writeBinaryToFd() output.
+		SocketPair sockets = createUnixSocketPair();
+		map.set("foo", "bar");
+		map.setBool("baz", true);
+		map.writeToFd(sockets.first, "options");
+		map.writeBinaryToFd(sockets.first, "options");
+
+		VariantMap map2, map3;
+		map2.readFrom(sockets.second, "options");
+		map3.readFrom(sockets.second, "options");
+		ensure_equals(map2.inspect(), map.inspect());
+		ensure_equals(map3.inspect(), map.inspect());
+	}
 }
@@ -3,6 +3,7 @@
 #include <oxt/backtrace.hpp>
 #include <oxt/tracable_exception.hpp>
 #include <oxt/thread.hpp>
+#include <vector>
 
 using namespace oxt;
 using namespace std;
@@ -84,5 +85,28 @@ namespace tut {
 		foo_thread.join();
 		bar_thread.join();
 	}
+	
+	static void sample(string *name, vector<string> *functions) {
+		TRACE_POINT();
+		char name_buf[8];
+		const char *function_buf[1];
+		unsigned int count = oxt::thread::sample_current_thread(name_buf, sizeof(name_buf),
+			function_buf, 1);
+		*name = name_buf;
+		functions->assign(function_buf, function_buf + count);
+	}
+	
+	TEST_METHOD(3) {
+		// Test oxt::thread::sample_current_thread().
+		string name;
+		vector<string> functions;
+		oxt::thread thread(boost::bind(sample, &name, &functions), "Sampled thread");
+		thread.join();
+		
+		ensure_equals("The thread name is truncated", name, "Sampled");
+		ensure_equals("The number of functions is limited", functions.size(), 1u);
+		ensure("The outermost trace point comes first",
+			functions[0].find("sample") != string::npos);
+	}
 }
 
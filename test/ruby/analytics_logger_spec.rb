@@ -68,6 +68,23 @@ describe AnalyticsLogger do
 		File.read(@dump_file).should =~ /world/
 	end
 	
+	specify "logging with #new_transaction works if the logger is buffered" do
+		mock_time(TODAY)
+		@logger.buffered = true
+		
+		log = @logger.new_transaction("foobar")
+		log.should_not be_null
+		begin
+			log.message("hello")
+			log.message("world")
+		ensure
+			log.close(true)
+		end
+		
+		File.read(@dump_file).should =~ /hello/
+		File.read(@dump_file).should =~ /world/
+	end
+	
 	specify "#new_transaction reestablishes the connection if disconnected" do
 		mock_time(TODAY)
 		
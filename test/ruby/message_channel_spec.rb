@@ -91,6 +91,17 @@ describe MessageChannel do
 			@writer.write_scalar(" " * 100)
 			lambda { @reader.read_scalar('', 99) }.should raise_error(SecurityError)
 		end
+		
+		it "reads messages correctly if the IO object has buffered data" do
+			@writer.write("hello")
+			@writer.write_scalar("world")
+			@writer.write("foo", "bar")
+			@reader_pipe.getc.should == "\0"
+			@reader_pipe.ungetc("\0")
+			@reader.read.should == ["hello"]
+			@reader.read_scalar.should == "world"
+			@reader.read_hash.should == { "foo" => "bar" }
+		end
 	end
 	
 	describe "scenarios with 2 channels and 2 concurrent processes" do
@@ -33,6 +33,15 @@ describe Utils do
 		split_by_null_into_hash("\0\0").should == { "" => "" }
 	end
 	
+	specify "#parse_scgi_headers_into_env works" do
+		template = { "rack.run_once" => false }.freeze
+		env = parse_scgi_headers_into_env("REQUEST_METHOD\0GET\0X_FOO\0\0", template)
+		env.should == { "rack.run_once" => false, "REQUEST_METHOD" => "GET", "X_FOO" => "" }
+		env.should_not be_frozen
+		template.should == { "rack.run_once" => false }
+		parse_scgi_headers_into_env("", template).should == template
+	end
+	
 	describe "#passenger_tmpdir" do
 		before :each do
 			@old_passenger_tmpdir = Utils.passenger_tmpdir
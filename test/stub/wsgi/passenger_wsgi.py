@@ -7,6 +7,8 @@ def file_exist(filename):
 	except OSError:
 		return False
 
+cacheable_responses = [0]
+
 def application(env, start_response):
 	status = '200 OK'
 	body   = None
@@ -57,6 +59,13 @@ def application(env, start_response):
 		return ["ok"]
 	elif path == '/cached':
 		body = "This is the uncached version of /cached"
+	elif path == '/cacheable':
+		cacheable_responses[0] += 1
+		body = "Response %d" % cacheable_responses[0]
+		start_response(status, [('Content-Type', 'text/plain'), ('Content-Length', str(len(body))),
+			('Cache-Control', env.get('HTTP_X_CACHE_CONTROL', 'public, max-age=60')),
+			('Vary', 'Accept-Encoding')])
+		return [body]
 	elif path == '/upload_with_params':
 		params = cgi.FieldStorage(fp = env['wsgi.input'], environ = env)
 		name1 = params["name1"].value
@@ -128,9 +137,25 @@ def application(env, start_response):
 				written += len(data)
 		start_response(status, [('Content-Type', 'text/plain')])
 		return body()
+	elif path == '/sendfile':
+		start_response(status, [('Content-Type', 'text/plain'), ('X-Sendfile', env['HTTP_X_SENDFILE'])])
+		return [str('app body')]
+	elif path == '/upgrade':
+		# Switches protocols and echoes every line.
+		def body():
+			yield b'ready\n'
+			line = env['wsgi.input'].readline()
+			while line:
+				yield line
+				line = env['wsgi.input'].readline()
+		start_response('101 Switching Protocols', [('Upgrade', 'echo'), ('Connection', 'Upgrade')])
+		return body()
 	elif path == '/oobw':
 		start_response(status, [('Content-Type', 'text/plain'), ('X-Passenger-Request-OOB-Work', 'true')])
 		return [str(os.getpid())]
+	elif path == '/resource_usage':
+		start_response(status, [('Content-Type', 'text/plain'), ('X-Passenger-Resource-Usage', 'cpu=1500;allocations=320')])
+		return ['ok']
 	else:
 		status = "404 Not Found"
 		body = "Unknown URI"